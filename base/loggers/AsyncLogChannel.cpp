@@ -0,0 +1,71 @@
+#include "AsyncLogChannel.h"
+
+#include <Common/setThreadName.h>
+
+
+namespace RK
+{
+
+AsyncLogChannel::AsyncLogChannel(Poco::AutoPtr<Poco::Channel> channel_, size_t queue_size)
+    : channel(std::move(channel_)), queue(queue_size)
+{
+}
+
+void AsyncLogChannel::open()
+{
+    channel->open();
+    if (!thread.joinable())
+    {
+        thread = std::thread([this] { run(); });
+        running.store(true, std::memory_order_release);
+    }
+}
+
+void AsyncLogChannel::close()
+{
+    running.store(false, std::memory_order_release);
+    queue.finish();
+    if (thread.joinable())
+        thread.join();
+    channel->close();
+}
+
+void AsyncLogChannel::log(const Poco::Message & msg)
+{
+    if (msg.getPriority() <= Poco::Message::PRIO_CRITICAL || !running.load(std::memory_order_acquire))
+    {
+        channel->log(msg);
+        return;
+    }
+
+    if (!queue.tryPush(msg))
+        dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AsyncLogChannel::run()
+{
+    setThreadName("AsyncLog");
+
+    Poco::Message msg;
+    while (queue.pop(msg))
+    {
+        channel->log(msg);
+
+        UInt64 current_dropped = dropped.load(std::memory_order_relaxed);
+        if (current_dropped != reported_dropped && queue.empty())
+        {
+            channel->log(Poco::Message(
+                msg.getSource(),
+                "Dropped " + std::to_string(current_dropped - reported_dropped) + " log messages, the log queue was full",
+                Poco::Message::PRIO_WARNING));
+            reported_dropped = current_dropped;
+        }
+    }
+}
+
+AsyncLogChannel::~AsyncLogChannel()
+{
+    close();
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <Poco/AutoPtr.h>
+#include <Poco/Channel.h>
+#include <Poco/Message.h>
+#include <Common/MPMCBoundedQueue.h>
+
+
+namespace RK
+{
+/** Channel writing messages to another channel in a background thread, so that threads logging on hot paths
+  * only copy the formatted message into a lock-free ring instead of writing the file themselves.
+  *
+  * It sits after OwnFormattingChannel, the time and thread of a message are taken by the logging thread.
+  * A message is dropped if the ring is full, the drops are counted and reported by the background thread.
+  * Fatal and critical messages are written right away, they are logged before the process dies.
+  */
+class AsyncLogChannel : public Poco::Channel
+{
+public:
+    AsyncLogChannel(Poco::AutoPtr<Poco::Channel> channel_, size_t queue_size);
+
+    void open() override;
+    /// Write the queued messages and stop the background thread
+    void close() override;
+
+    void log(const Poco::Message & msg) override;
+
+    UInt64 droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+protected:
+    ~AsyncLogChannel() override;
+
+private:
+    void run();
+
+    Poco::AutoPtr<Poco::Channel> channel;
+    MPMCBoundedQueue<Poco::Message> queue;
+    std::thread thread;
+    /// Messages are written by the caller before open and after close
+    std::atomic<bool> running{false};
+
+    std::atomic<UInt64> dropped{0};
+    /// Drops already reported by the background thread
+    UInt64 reported_dropped = 0;
+};
+
+}
@@ -1,6 +1,7 @@
 #include "Loggers.h"
 
 #include <iostream>
+#include "AsyncLogChannel.h"
 #include <Poco/Util/AbstractConfiguration.h>
 #include "OwnFormattingChannel.h"
 #include "OwnPatternFormatter.h"
@@ -41,6 +42,16 @@ void Loggers::buildLoggers(Poco::Util::AbstractConfiguration & config, Poco::Log
     split = new Poco::SplitterChannel();
 
     auto log_level = config.getString("logger.level", "trace");
+
+    /// Write through a background thread, see AsyncLogChannel
+    bool async = config.getBool("logger.async", false);
+    size_t async_queue_size = config.getUInt64("logger.async_queue_size", 65536);
+    auto make_output = [&](Poco::AutoPtr<Poco::Channel> channel) -> Poco::AutoPtr<Poco::Channel>
+    {
+        if (!async)
+            return channel;
+        return new RK::AsyncLogChannel(channel, async_queue_size);
+    };
     const auto log_path = config.getString("logger.path", "");
     if (!log_path.empty())
     {
@@ -60,7 +71,7 @@ void Loggers::buildLoggers(Poco::Util::AbstractConfiguration & config, Poco::Log
 
         Poco::AutoPtr<OwnPatternFormatter> pf = new OwnPatternFormatter(this);
 
-        Poco::AutoPtr<RK::OwnFormattingChannel> log = new RK::OwnFormattingChannel(pf, log_file);
+        Poco::AutoPtr<RK::OwnFormattingChannel> log = new RK::OwnFormattingChannel(pf, make_output(log_file));
         split->addChannel(log);
     }
 
@@ -81,7 +92,7 @@ void Loggers::buildLoggers(Poco::Util::AbstractConfiguration & config, Poco::Log
 
         Poco::AutoPtr<OwnPatternFormatter> pf = new OwnPatternFormatter(this);
 
-        Poco::AutoPtr<RK::OwnFormattingChannel> error_log = new RK::OwnFormattingChannel(pf, error_log_file);
+        Poco::AutoPtr<RK::OwnFormattingChannel> error_log = new RK::OwnFormattingChannel(pf, make_output(error_log_file));
         error_log->setLevel(Poco::Message::PRIO_NOTICE);
         error_log->open();
         split->addChannel(error_log);
@@ -96,7 +107,7 @@ void Loggers::buildLoggers(Poco::Util::AbstractConfiguration & config, Poco::Log
         bool color_enabled = config.getBool("logger.color_terminal", color_logs_by_default);
 
         Poco::AutoPtr<OwnPatternFormatter> pf = new OwnPatternFormatter(this, OwnPatternFormatter::ADD_NOTHING, color_enabled);
-        Poco::AutoPtr<RK::OwnFormattingChannel> log = new RK::OwnFormattingChannel(pf, new Poco::ConsoleChannel);
+        Poco::AutoPtr<RK::OwnFormattingChannel> log = new RK::OwnFormattingChannel(pf, make_output(new Poco::ConsoleChannel));
         logger.warning("Logging " + log_level + " to console");
         split->addChannel(log);
     }
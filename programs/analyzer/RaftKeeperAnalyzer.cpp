@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <boost/program_options.hpp>
+
+#include <Service/NuRaftLogSnapshot.h>
+#include <Poco/ConsoleChannel.h>
+#include <Poco/AutoPtr.h>
+#include <Poco/Logger.h>
+#include <Common/Stopwatch.h>
+#include <Common/TerminalSize.h>
+#include <Common/formatReadable.h>
+#include <common/logger_useful.h>
+
+namespace RK::ErrorCodes
+{
+    extern const int BAD_ARGUMENTS;
+    extern const int LOGICAL_ERROR;
+}
+
+namespace
+{
+using namespace RK;
+
+/// Values of at least 2^(VALUE_BUCKETS - 2) bytes are in the last bucket
+constexpr size_t VALUE_BUCKETS = 22;
+
+struct SubtreeStats
+{
+    UInt64 nodes = 0;
+    UInt64 bytes = 0;
+    UInt64 ephemerals = 0;
+};
+
+/// Of the nodes scanned by one thread, merged at last
+struct TreeStats
+{
+    std::unordered_map<String, SubtreeStats> subtrees;
+    std::array<UInt64, VALUE_BUCKETS> value_counts{};
+    std::array<UInt64, VALUE_BUCKETS> value_bytes{};
+    std::unordered_map<uint64_t, UInt64> acl_nodes;
+    UInt64 nodes = 0;
+    UInt64 bytes = 0;
+    UInt64 value_total = 0;
+    UInt64 max_value = 0;
+    String max_value_path;
+    /// The widest node
+    UInt64 max_children = 0;
+    String max_children_path;
+
+    void add(const String & path, const KeeperNode & node, size_t max_depth)
+    {
+        UInt64 value_size = node.data.size();
+        /// The path, the value and the node, as held in memory
+        UInt64 node_bytes = path.size() + value_size + sizeof(KeeperNode);
+        ++nodes;
+        bytes += node_bytes;
+        value_total += value_size;
+        size_t bucket = value_size ? std::min<size_t>(64 - __builtin_clzll(value_size), VALUE_BUCKETS - 1) : 0;
+        ++value_counts[bucket];
+        value_bytes[bucket] += value_size;
+        ++acl_nodes[node.acl_id];
+        if (value_size > max_value)
+        {
+            max_value = value_size;
+            max_value_path = path;
+        }
+        if (node.children.size() > max_children)
+        {
+            max_children = node.children.size();
+            max_children_path = path;
+        }
+
+        /// Every ancestor of at most max_depth, and the node itself, contains the node
+        size_t depth = 0;
+        for (size_t pos = path.find('/', 1); depth < max_depth; pos = path.find('/', pos + 1))
+        {
+            ++depth;
+            auto & subtree = subtrees[pos == String::npos ? path : path.substr(0, pos)];
+            ++subtree.nodes;
+            subtree.bytes += node_bytes;
+            subtree.ephemerals += node.is_ephemeral;
+            if (pos == String::npos)
+                break;
+        }
+    }
+
+    void merge(TreeStats && other)
+    {
+        for (auto & [path, stats] : other.subtrees)
+        {
+            auto & subtree = subtrees[path];
+            subtree.nodes += stats.nodes;
+            subtree.bytes += stats.bytes;
+            subtree.ephemerals += stats.ephemerals;
+        }
+        std::unordered_map<String, SubtreeStats>().swap(other.subtrees);
+        for (size_t i = 0; i < VALUE_BUCKETS; ++i)
+        {
+            value_counts[i] += other.value_counts[i];
+            value_bytes[i] += other.value_bytes[i];
+        }
+        for (const auto & [acl_id, count] : other.acl_nodes)
+            acl_nodes[acl_id] += count;
+        nodes += other.nodes;
+        bytes += other.bytes;
+        value_total += other.value_total;
+        if (other.max_value > max_value)
+        {
+            max_value = other.max_value;
+            max_value_path = std::move(other.max_value_path);
+        }
+        if (other.max_children > max_children)
+        {
+            max_children = other.max_children;
+            max_children_path = std::move(other.max_children_path);
+        }
+    }
+};
+
+/// Scan the blocks of the container by threads, a radix tree is scanned by one thread
+TreeStats scanTree(KeeperStore & store, size_t threads, size_t max_depth)
+{
+    UInt32 blocks = store.container.getBlockNum();
+    if (!blocks)
+    {
+        TreeStats stats;
+        store.container.forEach([&](const String & path, const auto & node) { stats.add(path, *node, max_depth); });
+        return stats;
+    }
+
+    threads = std::clamp<size_t>(threads, 1, blocks);
+    std::vector<TreeStats> thread_stats(threads);
+    std::atomic<UInt32> next_block{0};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i)
+        workers.emplace_back(
+            [&, i]
+            {
+                for (UInt32 block = next_block++; block < blocks; block = next_block++)
+                    store.container.getMap(block).forEach(
+                        [&](const String & path, const auto & node) { thread_stats[i].add(path, *node, max_depth); });
+            });
+    for (auto & worker : workers)
+        worker.join();
+
+    TreeStats stats = std::move(thread_stats[0]);
+    for (size_t i = 1; i < threads; ++i)
+        stats.merge(std::move(thread_stats[i]));
+    return stats;
+}
+
+String formatBytes(UInt64 bytes)
+{
+    return formatReadableSizeWithBinarySuffix(static_cast<double>(bytes));
+}
+
+String bucketName(size_t bucket)
+{
+    if (bucket == 0)
+        return "0";
+    String from = formatReadableSizeWithBinarySuffix(static_cast<double>(1ULL << (bucket - 1)), 0);
+    if (bucket == VALUE_BUCKETS - 1)
+        return ">= " + from;
+    return from + " - " + formatReadableSizeWithBinarySuffix(static_cast<double>((1ULL << bucket) - 1), 0);
+}
+
+String aclToString(const Coordination::ACLs & acls)
+{
+    String ret;
+    for (const auto & acl : acls)
+    {
+        if (!ret.empty())
+            ret += ',';
+        ret += acl.scheme + ':' + acl.id + ':';
+        ret += (acl.permissions & Coordination::ACL::Create) ? "c" : "";
+        ret += (acl.permissions & Coordination::ACL::Delete) ? "d" : "";
+        ret += (acl.permissions & Coordination::ACL::Read) ? "r" : "";
+        ret += (acl.permissions & Coordination::ACL::Write) ? "w" : "";
+        ret += (acl.permissions & Coordination::ACL::Admin) ? "a" : "";
+    }
+    return ret;
+}
+
+/// The top entries of items by key, largest first
+template <typename T, typename Key>
+std::vector<T> top(std::vector<T> items, size_t count, Key && key)
+{
+    count = std::min(count, items.size());
+    std::partial_sort(items.begin(), items.begin() + count, items.end(), [&](const T & l, const T & r) { return key(l) > key(r); });
+    items.resize(count);
+    return items;
+}
+
+void printReport(KeeperStore & store, TreeStats & stats, size_t top_count, size_t max_depth)
+{
+    std::cout << "nodes: " << stats.nodes << "\nbytes: " << stats.bytes << " (" << formatBytes(stats.bytes)
+              << ", paths, values and nodes)\nvalue_bytes: " << stats.value_total << "\nmax_value_bytes: " << stats.max_value << " "
+              << stats.max_value_path << "\nmax_children: " << stats.max_children << " " << stats.max_children_path
+              << "\nsessions: " << store.session_table.size() << "\nsessions_with_ephemerals: " << store.ephemerals.size()
+              << "\nephemerals: " << store.ephemerals.nodeCount() << "\nzxid: " << store.zxid.load() << std::endl;
+
+    using Subtree = std::pair<String, SubtreeStats>;
+    std::vector<Subtree> subtrees(stats.subtrees.begin(), stats.subtrees.end());
+    std::unordered_map<String, SubtreeStats>().swap(stats.subtrees);
+    auto print_subtrees = [&](const char * title, auto && key)
+    {
+        std::cout << "\n" << title << ", subtrees of depth at most " << max_depth << ":\n";
+        for (const auto & [path, subtree] : top(subtrees, top_count, key))
+            std::cout << "  " << subtree.nodes << " nodes\t" << formatBytes(subtree.bytes) << "\t"
+                      << subtree.ephemerals << " ephemerals\t" << path << "\n";
+    };
+    print_subtrees("Largest subtrees by nodes", [](const Subtree & subtree) { return subtree.second.nodes; });
+    print_subtrees("Largest subtrees by bytes", [](const Subtree & subtree) { return subtree.second.bytes; });
+
+    std::cout << "\nValue sizes:\n";
+    for (size_t i = 0; i < VALUE_BUCKETS; ++i)
+    {
+        if (!stats.value_counts[i])
+            continue;
+        std::cout << "  " << bucketName(i) << "\t" << stats.value_counts[i] << " nodes\t"
+                  << formatBytes(stats.value_bytes[i]) << "\n";
+    }
+
+    using SessionEphemerals = std::pair<int64_t, size_t>;
+    std::vector<SessionEphemerals> sessions;
+    sessions.reserve(store.ephemerals.size());
+    store.ephemerals.forEach([&sessions](int64_t session_id, const auto & paths) { sessions.emplace_back(session_id, paths.size()); });
+    std::cout << "\nSessions by ephemerals:\n";
+    for (const auto & [session_id, count] : top(sessions, top_count, [](const SessionEphemerals & session) { return session.second; }))
+        std::cout << "  0x" << std::hex << session_id << std::dec << "\t" << count << " ephemerals\n";
+
+    using ACLUsage = std::pair<uint64_t, UInt64>;
+    std::vector<ACLUsage> acls(stats.acl_nodes.begin(), stats.acl_nodes.end());
+    std::cout << "\nACLs by nodes, " << store.acl_map.getMapping().size() << " distinct ACLs:\n";
+    for (const auto & [acl_id, count] : top(acls, top_count, [](const ACLUsage & acl) { return acl.second; }))
+        std::cout << "  " << count << " nodes\t" << (acl_id ? aclToString(store.acl_map.convertNumber(acl_id)) : "none, open to all")
+                  << "\n";
+    std::cout << std::flush;
+}
+
+}
+
+int mainEntryRaftKeeperAnalyzer(int argc, char ** argv)
+{
+    using namespace RK;
+    namespace po = boost::program_options;
+
+    po::options_description desc = createOptionsDescription("Allowed options", getTerminalWidth());
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("snapshot-dir", po::value<std::string>(), "Directory of RaftKeeper snapshots, as snapshot_dir of the server")
+        ("log-index", po::value<UInt64>()->default_value(0), "Last log index of the snapshot to analyze, 0 means the latest one")
+        ("top", po::value<size_t>()->default_value(20), "Entries of every ranking")
+        ("depth", po::value<size_t>()->default_value(4), "Depth of the subtrees ranked, /a/b is of depth 2")
+        ("threads", po::value<size_t>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Threads scanning the tree")
+    ;
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+    if (vm.count("help") || !vm.count("snapshot-dir"))
+    {
+        std::cout << "Usage: " << argv[0] << " --snapshot-dir /var/lib/raftkeeper/data/snapshot --top 20 --depth 3" << std::endl;
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+
+    Poco::AutoPtr<Poco::ConsoleChannel> console_channel(new Poco::ConsoleChannel);
+    Poco::Logger * log = &Poco::Logger::get("RaftKeeperAnalyzer");
+    log->setChannel(console_channel);
+
+    try
+    {
+        String snapshot_dir = vm["snapshot-dir"].as<std::string>();
+        size_t max_depth = vm["depth"].as<size_t>();
+        if (!max_depth)
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "Depth must be at least 1");
+
+        auto snap_mgr = nuraft::cs_new<KeeperSnapshotManager>(snapshot_dir, 3600, KeeperSnapshotStore::MAX_OBJECT_NODE_SIZE);
+        if (!snap_mgr->loadSnapshotMetas())
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "No snapshot in {}", snapshot_dir);
+
+        nuraft::ptr<nuraft::snapshot> meta;
+        if (UInt64 log_index = vm["log-index"].as<UInt64>())
+        {
+            auto snapshot_store = snap_mgr->getSnapshotStore(nuraft::snapshot(log_index, 0, std::make_shared<nuraft::cluster_config>()));
+            if (!snapshot_store)
+                throw Exception(ErrorCodes::BAD_ARGUMENTS, "No snapshot of last log index {} in {}", log_index, snapshot_dir);
+            meta = snapshot_store->getSnapshot();
+        }
+        else
+            meta = snap_mgr->lastSnapshot();
+
+        /// Objects are decoded by the threads of parseObject, as on startup of the server
+        KeeperStore store(500);
+        Stopwatch watch;
+        if (!snap_mgr->parseSnapshot(*meta, store))
+            throw Exception(ErrorCodes::LOGICAL_ERROR, "Cannot load snapshot of last log index {}", meta->get_last_log_idx());
+        LOG_INFO(
+            log,
+            "Loaded {} nodes of snapshot {} in {:.3f} s",
+            store.container.size(),
+            meta->get_last_log_idx(),
+            watch.elapsedSeconds());
+
+        watch.restart();
+        TreeStats stats = scanTree(store, vm["threads"].as<size_t>(), max_depth);
+        LOG_INFO(log, "Scanned the tree in {:.3f} s", watch.elapsedSeconds());
+
+        std::cout << "snapshot_last_log_index: " << meta->get_last_log_idx() << "\n";
+        printReport(store, stats, vm["top"].as<size_t>(), max_depth);
+    }
+    catch (...)
+    {
+        std::cerr << getCurrentExceptionMessage(true) << '\n';
+        return getCurrentExceptionCode();
+    }
+    return 0;
+}
@@ -0,0 +1,2 @@
+int mainEntryRaftKeeperAnalyzer(int argc, char ** argv);
+int main(int argc_, char ** argv_) { return mainEntryRaftKeeperAnalyzer(argc_, argv_); }
@@ -0,0 +1,709 @@
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <boost/program_options.hpp>
+
+#include <IO/ReadBufferFromMemory.h>
+#include <Service/LatencyHistogram.h>
+#include <Service/RequestCapture.h>
+#include <Poco/ConsoleChannel.h>
+#include <Poco/AutoPtr.h>
+#include <Poco/Logger.h>
+#include <Common/Stopwatch.h>
+#include <Common/TerminalSize.h>
+#include <Common/ZooKeeper/ZooKeeperIO.h>
+#include <Common/ZooKeeper/ZooKeeperImpl.h>
+#include <common/logger_useful.h>
+
+namespace RK::ErrorCodes
+{
+    extern const int BAD_ARGUMENTS;
+    extern const int LOGICAL_ERROR;
+}
+
+namespace
+{
+using namespace RK;
+
+enum Operation : uint8_t
+{
+    GET = 0,
+    EXISTS,
+    LIST,
+    SET,
+    CREATE,
+    CREATE_SEQUENTIAL,
+    REMOVE,
+    MULTI,
+    /// Set of a node watched by the watch sessions
+    WATCH_SET,
+    OPERATIONS,
+};
+
+const char * const OPERATION_NAMES[OPERATIONS]
+    = {"get", "exists", "list", "set", "create", "create_sequential", "remove", "multi", "watch_set"};
+
+struct BenchmarkOptions
+{
+    Coordination::ZooKeeper::Nodes nodes;
+    size_t sessions;
+    size_t depth;
+    size_t duration_seconds;
+    /// Requests per second of all sessions, 0 sends as fast as responses come back
+    size_t rate;
+    std::array<size_t, OPERATIONS> weights{};
+    size_t keys;
+    size_t data_size;
+    String root;
+    size_t multi_size;
+    size_t watch_sessions;
+    size_t watch_paths;
+    size_t report_interval_seconds;
+    bool print_histogram;
+};
+
+struct BenchmarkStats
+{
+    std::array<LatencyHistogram, OPERATIONS> latency;
+    std::array<std::atomic<UInt64>, OPERATIONS> errors{};
+    std::atomic<UInt64> completed{0};
+    /// From the set of a watched node to the notification of a watch session
+    LatencyHistogram notify_latency;
+};
+
+UInt64 nowMicroseconds()
+{
+    return clock_gettime_ns() / 1000;
+}
+
+std::shared_ptr<Coordination::ZooKeeper> connect(const BenchmarkOptions & options)
+{
+    return std::make_shared<Coordination::ZooKeeper>(
+        options.nodes, "", "", "", Poco::Timespan(30, 0), Poco::Timespan(10, 0), Poco::Timespan(10, 0));
+}
+
+String keyPath(const BenchmarkOptions & options, size_t key)
+{
+    return options.root + "/keys/" + std::to_string(key);
+}
+
+String watchPath(const BenchmarkOptions & options, size_t path)
+{
+    return options.root + "/watch/" + std::to_string(path);
+}
+
+/// Limits outstanding requests of a session
+class InFlight
+{
+public:
+    explicit InFlight(size_t limit_) : limit(limit_) { }
+
+    void acquire()
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] { return count < limit; });
+        ++count;
+    }
+
+    void release()
+    {
+        {
+            std::lock_guard lock(mutex);
+            --count;
+        }
+        cv.notify_all();
+    }
+
+    bool waitAll(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock lock(mutex);
+        return cv.wait_for(lock, timeout, [&] { return count == 0; });
+    }
+
+private:
+    const size_t limit;
+    size_t count{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+/// Create the nodes the load works on, pipelined, the ones which exist are kept
+void prepare(const BenchmarkOptions & options, Poco::Logger * log)
+{
+    auto zk = connect(options);
+    InFlight in_flight(options.depth);
+    std::atomic<UInt64> failures{0};
+    String data(options.data_size, 'x');
+
+    auto create = [&](const String & path, const String & node_data)
+    {
+        in_flight.acquire();
+        zk->create(path, node_data, false, false, {}, [&](const Coordination::CreateResponse & response)
+        {
+            if (response.error != Coordination::Error::ZOK && response.error != Coordination::Error::ZNODEEXISTS)
+                ++failures;
+            in_flight.release();
+        });
+    };
+
+    /// Parents before children
+    for (const auto & parent : {options.root, options.root + "/keys", options.root + "/watch"})
+    {
+        create(parent, "");
+        in_flight.waitAll(std::chrono::seconds(30));
+    }
+    for (size_t key = 0; key < options.keys; ++key)
+        create(keyPath(options, key), data);
+    for (size_t path = 0; path < options.watch_paths; ++path)
+        create(watchPath(options, path), data);
+
+    if (!in_flight.waitAll(std::chrono::seconds(60)) || failures)
+        throw Exception(ErrorCodes::LOGICAL_ERROR, "Failed to create {} of the nodes under {}", failures.load(), options.root);
+    LOG_INFO(log, "Prepared {} keys and {} watched paths under {}", options.keys, options.watch_paths, options.root);
+}
+
+/// A session keeping a data watch on every watched path, it is set again once fired
+class Watcher
+{
+public:
+    Watcher(const BenchmarkOptions & options_, BenchmarkStats & stats_, std::vector<std::atomic<UInt64>> & last_set_us_)
+        : options(options_), stats(stats_), last_set_us(last_set_us_), zk(connect(options_))
+    {
+        for (size_t path = 0; path < options.watch_paths; ++path)
+            arm(path);
+    }
+
+private:
+    void arm(size_t path)
+    {
+        if (zk->isExpired())
+            return;
+        auto on_exists = [](const Coordination::ExistsResponse &) { };
+        zk->exists(watchPath(options, path), on_exists, [this, path](const Coordination::WatchResponse &)
+        {
+            UInt64 set_us = last_set_us[path].load(std::memory_order_relaxed);
+            UInt64 now_us = nowMicroseconds();
+            if (set_us && now_us >= set_us)
+                stats.notify_latency.record(now_us - set_us);
+            arm(path);
+        });
+    }
+
+    const BenchmarkOptions & options;
+    BenchmarkStats & stats;
+    std::vector<std::atomic<UInt64>> & last_set_us;
+    std::shared_ptr<Coordination::ZooKeeper> zk;
+};
+
+/** A session sending requests with at most depth of them outstanding.
+ *
+ * In open loop every request has an intended send time on a fixed schedule and its latency is measured from
+ * that time, so a stalled server is charged for the requests which could not be sent meanwhile.
+ */
+class LoadSession
+{
+public:
+    LoadSession(
+        const BenchmarkOptions & options_, BenchmarkStats & stats_, std::vector<std::atomic<UInt64>> & last_set_us_, size_t id_)
+        : options(options_)
+        , stats(stats_)
+        , last_set_us(last_set_us_)
+        , id(id_)
+        , zk(connect(options_))
+        , in_flight(options_.depth)
+        , rng(id_)
+        , data(options_.data_size, 'x')
+    {
+        size_t total = 0;
+        for (size_t weight : options.weights)
+            total += weight;
+        for (size_t op = 0, cumulative = 0; op < OPERATIONS; ++op)
+        {
+            cumulative += options.weights[op];
+            thresholds[op] = cumulative;
+        }
+        total_weight = total;
+    }
+
+    void run(UInt64 start_us, UInt64 end_us)
+    {
+        /// Sessions are staggered within the interval, so that all of them do not send at once
+        double interval_us = options.rate ? static_cast<double>(options.sessions) * 1000000 / options.rate : 0;
+        double intended_us = start_us + interval_us * id / options.sessions;
+
+        while (true)
+        {
+            UInt64 now_us = nowMicroseconds();
+            if (now_us >= end_us)
+                break;
+
+            if (interval_us)
+            {
+                if (intended_us > now_us)
+                    std::this_thread::sleep_for(std::chrono::microseconds(static_cast<UInt64>(intended_us) - now_us));
+                in_flight.acquire();
+                issue(pickOperation(), static_cast<UInt64>(intended_us));
+                intended_us += interval_us;
+            }
+            else
+            {
+                in_flight.acquire();
+                issue(pickOperation(), nowMicroseconds());
+            }
+        }
+    }
+
+    bool drain() { return in_flight.waitAll(std::chrono::seconds(30)); }
+
+private:
+    Operation pickOperation()
+    {
+        size_t value = rng() % total_weight;
+        for (size_t op = 0; op < OPERATIONS; ++op)
+            if (value < thresholds[op])
+                return static_cast<Operation>(op);
+        return GET;
+    }
+
+    void finish(Operation op, UInt64 intended_us, Coordination::Error error)
+    {
+        UInt64 now_us = nowMicroseconds();
+        stats.latency[op].record(now_us > intended_us ? now_us - intended_us : 0);
+        if (error != Coordination::Error::ZOK)
+            stats.errors[op].fetch_add(1, std::memory_order_relaxed);
+        stats.completed.fetch_add(1, std::memory_order_relaxed);
+        in_flight.release();
+    }
+
+    /// Created nodes are ephemeral, so nothing is left once the session is closed
+    void issue(Operation op, UInt64 intended_us)
+    {
+        String key = keyPath(options, rng() % std::max<size_t>(options.keys, 1));
+        auto done = [this, op, intended_us](const Coordination::Response & response) { finish(op, intended_us, response.error); };
+
+        try
+        {
+            switch (op)
+            {
+                case GET:
+                    zk->get(key, done, {});
+                    break;
+                case EXISTS:
+                    zk->exists(key, done, {});
+                    break;
+                case LIST:
+                    zk->list(options.root + "/keys", done, {});
+                    break;
+                case SET:
+                    zk->set(key, data, -1, done);
+                    break;
+                case CREATE:
+                case CREATE_SEQUENTIAL: {
+                    bool sequential = op == CREATE_SEQUENTIAL;
+                    String path = options.root + "/keys/s" + std::to_string(id) + "-" + (sequential ? "" : std::to_string(create_count++));
+                    zk->create(path, data, true, sequential, {}, [this, done](const Coordination::CreateResponse & response)
+                    {
+                        if (response.error == Coordination::Error::ZOK)
+                        {
+                            std::lock_guard lock(created_mutex);
+                            created.push_back(response.path_created);
+                        }
+                        done(response);
+                    });
+                    break;
+                }
+                case REMOVE: {
+                    std::optional<String> path;
+                    {
+                        std::lock_guard lock(created_mutex);
+                        if (!created.empty())
+                        {
+                            path = std::move(created.front());
+                            created.pop_front();
+                        }
+                    }
+                    /// Nothing created by the session yet, count it as a miss of the remove
+                    if (!path)
+                        zk->remove(key + "/missing", -1, done);
+                    else
+                        zk->remove(*path, -1, done);
+                    break;
+                }
+                case MULTI: {
+                    Coordination::Requests requests;
+                    auto create = std::make_shared<Coordination::CreateRequest>();
+                    create->path = options.root + "/keys/m" + std::to_string(id) + "-";
+                    create->data = data;
+                    create->is_ephemeral = true;
+                    create->is_sequential = true;
+                    requests.push_back(create);
+                    for (size_t i = 1; i < options.multi_size; ++i)
+                    {
+                        auto set = std::make_shared<Coordination::SetRequest>();
+                        set->path = keyPath(options, rng() % std::max<size_t>(options.keys, 1));
+                        set->data = data;
+                        set->version = -1;
+                        requests.push_back(set);
+                    }
+                    zk->multi(requests, done);
+                    break;
+                }
+                case WATCH_SET: {
+                    size_t path = rng() % std::max<size_t>(options.watch_paths, 1);
+                    last_set_us[path].store(nowMicroseconds(), std::memory_order_relaxed);
+                    zk->set(watchPath(options, path), data, -1, done);
+                    break;
+                }
+                case OPERATIONS:
+                    break;
+            }
+        }
+        catch (...)
+        {
+            /// The request was not queued, its callback is never called
+            finish(op, intended_us, Coordination::Error::ZCONNECTIONLOSS);
+        }
+    }
+
+    const BenchmarkOptions & options;
+    BenchmarkStats & stats;
+    std::vector<std::atomic<UInt64>> & last_set_us;
+    const size_t id;
+    std::shared_ptr<Coordination::ZooKeeper> zk;
+    InFlight in_flight;
+    std::mt19937_64 rng;
+    const String data;
+    std::array<size_t, OPERATIONS> thresholds{};
+    size_t total_weight{0};
+    UInt64 create_count{0};
+
+    std::mutex created_mutex;
+    std::deque<String> created;
+};
+
+void parseMix(const String & mix, BenchmarkOptions & options)
+{
+    std::istringstream in(mix);
+    String item;
+    while (std::getline(in, item, ','))
+    {
+        auto colon = item.find(':');
+        if (colon == String::npos)
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "Operation mix item '{}' is not <operation>:<weight>", item);
+        String name = item.substr(0, colon);
+        auto it = std::find(std::begin(OPERATION_NAMES), std::end(OPERATION_NAMES), name);
+        if (it == std::end(OPERATION_NAMES))
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "Unknown operation '{}' in the operation mix", name);
+        options.weights[it - std::begin(OPERATION_NAMES)] = std::stoull(item.substr(colon + 1));
+    }
+    if (std::all_of(options.weights.begin(), options.weights.end(), [](size_t weight) { return weight == 0; }))
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "Operation mix '{}' has no operation", mix);
+}
+
+void printPercentilesHeader()
+{
+    std::cout << std::left << std::setw(20) << "operation" << std::right << std::setw(12) << "count" << std::setw(10) << "errors"
+              << std::setw(10) << "p50_us" << std::setw(10) << "p90_us" << std::setw(10) << "p99_us" << std::setw(10) << "p999_us"
+              << std::setw(12) << "max_us" << '\n';
+}
+
+void printPercentiles(const String & name, const LatencyPercentiles & percentiles, UInt64 errors)
+{
+    std::cout << std::left << std::setw(20) << name << std::right << std::setw(12) << percentiles.count << std::setw(10) << errors
+              << std::setw(10) << percentiles.p50 << std::setw(10) << percentiles.p90 << std::setw(10) << percentiles.p99
+              << std::setw(10) << percentiles.p999 << std::setw(12) << percentiles.max << '\n';
+}
+
+void printHistogram(const String & name, const LatencyHistogram & histogram)
+{
+    auto counts = histogram.getCounts();
+    for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket)
+        if (counts[bucket])
+            std::cout << name << "\tle_us " << LatencyHistogram::bucketUpperBound(bucket) << '\t' << counts[bucket] << '\n';
+}
+
+struct ReplayStats
+{
+    LatencyHistogram latency;
+    std::atomic<UInt64> errors{0};
+};
+
+/** Send the requests of a capture of RequestCapture again, each captured session by a session of its own, at the
+ * captured times divided by speed. Requests are sent from one thread in the captured order and a session answers
+ * its requests in order, so the order within every session is kept. Latency is measured from the captured time.
+ *
+ * Captured close requests are not sent, the sessions are closed when the replay ends.
+ */
+void replay(BenchmarkOptions options, const String & path, double speed, Poco::Logger * log)
+{
+    std::unordered_map<int64_t, std::shared_ptr<Coordination::ZooKeeper>> sessions;
+    std::map<Coordination::OpNum, std::unique_ptr<ReplayStats>> stats;
+    size_t total = 0;
+
+    /// Sessions are connected before replaying, so that connecting does not delay the requests
+    {
+        RequestCaptureReader reader(path);
+        CapturedRequest request;
+        while (reader.next(request))
+        {
+            ++total;
+            ReadBufferFromMemory in(request.frame.data(), request.frame.size());
+            Coordination::XID xid;
+            Coordination::OpNum opnum;
+            Coordination::read(xid, in);
+            Coordination::read(opnum, in);
+            if (!stats.count(opnum))
+                stats.emplace(opnum, std::make_unique<ReplayStats>());
+            if (!sessions.count(request.session_id))
+            {
+                std::rotate(options.nodes.begin(), options.nodes.begin() + 1, options.nodes.end());
+                sessions.emplace(request.session_id, connect(options));
+            }
+        }
+    }
+    LOG_INFO(log, "Replaying {} requests of {} sessions from {} at {}x speed", total, sessions.size(), path, speed);
+
+    std::atomic<UInt64> outstanding{0};
+    size_t sent = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+    UInt64 start_us = nowMicroseconds();
+    UInt64 next_report_us = start_us + options.report_interval_seconds * 1000000;
+
+    RequestCaptureReader reader(path);
+    CapturedRequest request;
+    while (reader.next(request))
+    {
+        UInt64 intended_us = start_us + static_cast<UInt64>(request.offset_us / speed);
+        UInt64 now_us = nowMicroseconds();
+        if (intended_us > now_us)
+            std::this_thread::sleep_for(std::chrono::microseconds(intended_us - now_us));
+        else if (now_us >= next_report_us)
+        {
+            /// Only reported when behind, the log would delay requests on time
+            LOG_INFO(log, "Sent {} of {} requests, {} ms behind the capture", sent, total, (now_us - intended_us) / 1000);
+            next_report_us = now_us + options.report_interval_seconds * 1000000;
+        }
+
+        ReadBufferFromMemory in(request.frame.data(), request.frame.size());
+        Coordination::XID xid;
+        Coordination::OpNum opnum;
+        Coordination::read(xid, in);
+        Coordination::read(opnum, in);
+
+        /// Requests of the session life cycle are made by the replaying sessions themselves
+        if (opnum == Coordination::OpNum::Close || opnum == Coordination::OpNum::SetWatches)
+        {
+            ++skipped;
+            continue;
+        }
+
+        auto & op_stats = *stats.at(opnum);
+        try
+        {
+            auto zk_request = Coordination::ZooKeeperRequestFactory::instance().get(opnum);
+            zk_request->readImpl(in);
+
+            outstanding.fetch_add(1, std::memory_order_relaxed);
+            sessions.at(request.session_id)->execute(
+                zk_request,
+                [&op_stats, &outstanding, intended_us](const Coordination::Response & response)
+                {
+                    UInt64 done_us = nowMicroseconds();
+                    op_stats.latency.record(done_us > intended_us ? done_us - intended_us : 0);
+                    if (response.error != Coordination::Error::ZOK)
+                        op_stats.errors.fetch_add(1, std::memory_order_relaxed);
+                    outstanding.fetch_sub(1, std::memory_order_relaxed);
+                },
+                {});
+            ++sent;
+        }
+        catch (...)
+        {
+            /// Not queued, so the callback is not called
+            if (!failed++)
+                tryLogCurrentException(log, "Failed to replay a request, the later failures are only counted");
+            op_stats.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    for (size_t i = 0; i < 300 && outstanding.load(); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (outstanding.load())
+        LOG_WARNING(log, "{} responses did not come back in 30 seconds", outstanding.load());
+    double seconds = static_cast<double>(nowMicroseconds() - start_us) / 1000000;
+
+    std::cout << "\nreplayed " << sent << " requests, skipped " << skipped << " session requests, "
+              << static_cast<UInt64>(sent / seconds) << " requests per second\n\n";
+    printPercentilesHeader();
+    for (const auto & [opnum, op_stats] : stats)
+        if (opnum != Coordination::OpNum::Close && opnum != Coordination::OpNum::SetWatches)
+            printPercentiles(Coordination::toString(opnum), op_stats->latency.getPercentiles(), op_stats->errors.load());
+
+    if (options.print_histogram)
+    {
+        std::cout << '\n';
+        for (const auto & [opnum, op_stats] : stats)
+            printHistogram(Coordination::toString(opnum), op_stats->latency);
+    }
+}
+
+}
+
+int mainEntryRaftKeeperBenchmark(int argc, char ** argv)
+{
+    using namespace RK;
+    namespace po = boost::program_options;
+
+    po::options_description desc = createOptionsDescription("Allowed options", getTerminalWidth());
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("hosts", po::value<std::vector<std::string>>()->multitoken()->default_value({"localhost:8101"}, "localhost:8101"),
+            "Servers to connect to, sessions are spread over them")
+        ("sessions", po::value<size_t>()->default_value(64), "Client sessions sending requests")
+        ("depth", po::value<size_t>()->default_value(32), "Outstanding requests of a session")
+        ("duration", po::value<size_t>()->default_value(60), "Seconds to send requests for")
+        ("rate", po::value<size_t>()->default_value(0),
+            "Requests per second of all sessions on a fixed schedule, latency is measured from the scheduled send time. "
+            "0 sends a request as soon as a response comes back")
+        ("mix", po::value<std::string>()->default_value("get:70,set:20,create:5,remove:5"),
+            "Weights of operations: get, exists, list, set, create, create_sequential, remove, multi and watch_set")
+        ("keys", po::value<size_t>()->default_value(10000), "Nodes read and written by the operations")
+        ("data-size", po::value<size_t>()->default_value(256), "Bytes of data written")
+        ("root", po::value<std::string>()->default_value("/raftkeeper_benchmark"), "Node under which the benchmark works")
+        ("multi-size", po::value<size_t>()->default_value(4), "Requests in a multi, one ephemeral sequential create and sets")
+        ("watch-sessions", po::value<size_t>()->default_value(0), "Sessions watching every watched path, the fan out of a watch_set")
+        ("watch-paths", po::value<size_t>()->default_value(16), "Paths changed by watch_set")
+        ("report-interval", po::value<size_t>()->default_value(1), "Seconds between throughput reports")
+        ("histogram", "Also print the latency histograms")
+        ("replay", po::value<std::string>(),
+            "Replay a capture of the requests of a server made by the capb command instead of generating load, the nodes the "
+            "requests work on are expected to be there as when capturing, e.g. by a snapshot of that time")
+        ("speed", po::value<double>()->default_value(1), "Speed of the replay relative to the capture")
+    ;
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << "Usage: " << argv[0] << " --hosts host1:8101 host2:8101 --sessions 256 --rate 500000 --mix get:80,set:15,multi:5"
+                  << std::endl;
+        std::cout << "       " << argv[0] << " --hosts host1:8101 --replay requests_1700000000.rkcap --speed 2" << std::endl;
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    Poco::AutoPtr<Poco::ConsoleChannel> console_channel(new Poco::ConsoleChannel);
+    Poco::Logger * log = &Poco::Logger::get("RaftKeeperBenchmark");
+    log->setChannel(console_channel);
+
+    try
+    {
+        BenchmarkOptions options;
+        for (const auto & host : vm["hosts"].as<std::vector<std::string>>())
+            options.nodes.push_back({Poco::Net::SocketAddress(host), false});
+        options.sessions = std::max<size_t>(1, vm["sessions"].as<size_t>());
+        options.depth = std::max<size_t>(1, vm["depth"].as<size_t>());
+        options.duration_seconds = vm["duration"].as<size_t>();
+        options.rate = vm["rate"].as<size_t>();
+        parseMix(vm["mix"].as<std::string>(), options);
+        options.keys = vm["keys"].as<size_t>();
+        options.data_size = vm["data-size"].as<size_t>();
+        options.root = vm["root"].as<std::string>();
+        options.multi_size = std::max<size_t>(1, vm["multi-size"].as<size_t>());
+        options.watch_sessions = vm["watch-sessions"].as<size_t>();
+        options.watch_paths = std::max<size_t>(1, vm["watch-paths"].as<size_t>());
+        options.report_interval_seconds = std::max<size_t>(1, vm["report-interval"].as<size_t>());
+        options.print_histogram = vm.count("histogram");
+
+        if (vm.count("replay"))
+        {
+            double speed = vm["speed"].as<double>();
+            if (speed <= 0)
+                throw Exception(ErrorCodes::BAD_ARGUMENTS, "Replay speed must be positive");
+            replay(options, vm["replay"].as<std::string>(), speed, log);
+            return 0;
+        }
+
+        prepare(options, log);
+
+        BenchmarkStats stats;
+        std::vector<std::atomic<UInt64>> last_set_us(options.watch_paths);
+        std::vector<std::unique_ptr<Watcher>> watchers;
+        for (size_t i = 0; i < options.watch_sessions; ++i)
+        {
+            /// A connection connects to the first server, shuffle so that sessions are spread
+            std::rotate(options.nodes.begin(), options.nodes.begin() + 1, options.nodes.end());
+            watchers.push_back(std::make_unique<Watcher>(options, stats, last_set_us));
+        }
+
+        std::vector<std::unique_ptr<LoadSession>> sessions;
+        for (size_t i = 0; i < options.sessions; ++i)
+        {
+            std::rotate(options.nodes.begin(), options.nodes.begin() + 1, options.nodes.end());
+            sessions.push_back(std::make_unique<LoadSession>(options, stats, last_set_us, i));
+        }
+
+        LOG_INFO(
+            log,
+            "Sending requests of {} sessions, {} outstanding each, for {} seconds, {}",
+            options.sessions,
+            options.depth,
+            options.duration_seconds,
+            options.rate ? "at " + std::to_string(options.rate) + " requests per second" : "as fast as possible");
+
+        UInt64 start_us = nowMicroseconds();
+        UInt64 end_us = start_us + options.duration_seconds * 1000000;
+        std::vector<std::thread> threads;
+        for (auto & session : sessions)
+            threads.emplace_back([&session, start_us, end_us] { session->run(start_us, end_us); });
+
+        UInt64 last_completed = 0;
+        while (nowMicroseconds() < end_us)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(options.report_interval_seconds));
+            UInt64 completed = stats.completed.load(std::memory_order_relaxed);
+            UInt64 errors = 0;
+            for (const auto & op_errors : stats.errors)
+                errors += op_errors.load(std::memory_order_relaxed);
+            LOG_INFO(
+                log, "{} requests per second, {} errors in total", (completed - last_completed) / options.report_interval_seconds, errors);
+            last_completed = completed;
+        }
+
+        for (auto & thread : threads)
+            thread.join();
+        for (auto & session : sessions)
+            if (!session->drain())
+                LOG_WARNING(log, "Responses of a session did not come back in 30 seconds");
+        double seconds = static_cast<double>(nowMicroseconds() - start_us) / 1000000;
+
+        std::cout << "\nthroughput: " << static_cast<UInt64>(stats.completed.load() / seconds) << " requests per second\n\n";
+        printPercentilesHeader();
+        for (size_t op = 0; op < OPERATIONS; ++op)
+            if (options.weights[op])
+                printPercentiles(OPERATION_NAMES[op], stats.latency[op].getPercentiles(), stats.errors[op].load());
+        if (options.watch_sessions)
+            printPercentiles("watch_notify", stats.notify_latency.getPercentiles(), 0);
+
+        if (options.print_histogram)
+        {
+            std::cout << '\n';
+            for (size_t op = 0; op < OPERATIONS; ++op)
+                if (options.weights[op])
+                    printHistogram(OPERATION_NAMES[op], stats.latency[op]);
+            printHistogram("watch_notify", stats.notify_latency);
+        }
+    }
+    catch (...)
+    {
+        std::cerr << getCurrentExceptionMessage(true) << '\n';
+        return getCurrentExceptionCode();
+    }
+    return 0;
+}
@@ -0,0 +1,2 @@
+int mainEntryRaftKeeperBenchmark(int argc, char ** argv);
+int main(int argc_, char ** argv_) { return mainEntryRaftKeeperBenchmark(argc_, argv_); }
@@ -1,10 +1,13 @@
+#include <chrono>
 #include <iostream>
 #include <optional>
+#include <thread>
 #include <boost/program_options.hpp>
 
 #include <Service/NuRaftLogSnapshot.h>
 #include <Service/ZooKeeperDataReader.h>
 #include <Common/TerminalSize.h>
+#include <Common/getNumberOfPhysicalCPUCores.h>
 #include <Poco/ConsoleChannel.h>
 #include <Poco/AutoPtr.h>
 #include <Poco/Logger.h>
@@ -22,6 +25,11 @@ int mainEntryRaftKeeperConverter(int argc, char ** argv)
         ("zookeeper-logs-dir", po::value<std::string>(), "Path to directory with ZooKeeper logs")
         ("zookeeper-snapshots-dir", po::value<std::string>(), "Path to directory with ZooKeeper snapshots")
         ("output-dir", po::value<std::string>(), "Directory to place output raftkeeper snapshot")
+        ("threads", po::value<size_t>()->default_value(getNumberOfPhysicalCPUCores()), "Threads decoding ZooKeeper logs ahead of applying them")
+        ("follow-idle-seconds", po::value<size_t>()->default_value(0),
+            "Follow the logs of a running ZooKeeper server until no transaction is written for so many seconds, then write the snapshot. "
+            "0 means convert the logs as they are")
+        ("follow-poll-ms", po::value<size_t>()->default_value(100), "Interval of checking the followed logs for new transactions")
     ;
     po::variables_map options;
     po::store(po::command_line_parser(argc, argv).options(desc).run(), options);
@@ -42,7 +50,24 @@ int mainEntryRaftKeeperConverter(int argc, char ** argv)
         RK::KeeperStore store(500);
 
         RK::deserializeKeeperStoreFromSnapshotsDir(store, options["zookeeper-snapshots-dir"].as<std::string>(), logger);
-        RK::deserializeLogsAndApplyToStore(store, options["zookeeper-logs-dir"].as<std::string>(), logger);
+        size_t follow_idle_seconds = options["follow-idle-seconds"].as<size_t>();
+        if (follow_idle_seconds)
+        {
+            /// Stop writes to ZooKeeper to cut over, the snapshot is written once the last transactions are applied
+            RK::ZooKeeperLogFollower follower(store, options["zookeeper-logs-dir"].as<std::string>(), logger);
+            auto poll_interval = std::chrono::milliseconds(options["follow-poll-ms"].as<size_t>());
+            auto last_applied = std::chrono::steady_clock::now();
+            while (std::chrono::steady_clock::now() - last_applied < std::chrono::seconds(follow_idle_seconds))
+            {
+                if (follower.poll())
+                    last_applied = std::chrono::steady_clock::now();
+                else
+                    std::this_thread::sleep_for(poll_interval);
+            }
+            LOG_INFO(logger, "No transaction in {} seconds, stop following at zxid {}", follow_idle_seconds, store.zxid);
+        }
+        else
+            RK::deserializeLogsAndApplyToStore(store, options["zookeeper-logs-dir"].as<std::string>(), logger, options["threads"].as<size_t>());
         std::cout << "storage.container.size():" << store.container.size() << std::endl;
         nuraft::ptr<snapshot> new_snapshot
             ( nuraft::cs_new<snapshot>(store.zxid, 1, std::make_shared<nuraft::cluster_config>()) ); // TODO 1 ?
@@ -0,0 +1,456 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <boost/program_options.hpp>
+
+#include <Service/NuRaftLogSnapshot.h>
+#include <Poco/ConsoleChannel.h>
+#include <Poco/AutoPtr.h>
+#include <Poco/Logger.h>
+#include <Common/MemoryStatisticsOS.h>
+#include <Common/Stopwatch.h>
+#include <Common/TerminalSize.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <common/logger_useful.h>
+
+namespace RK::ErrorCodes
+{
+    extern const int BAD_ARGUMENTS;
+    extern const int LOGICAL_ERROR;
+}
+
+namespace
+{
+using namespace RK;
+
+enum class ValueDistribution
+{
+    FIXED,
+    UNIFORM,
+    EXPONENTIAL,
+};
+
+struct GeneratorOptions
+{
+    String root;
+    /// Children of every node of a level, the last level are leaves
+    std::vector<size_t> fan_out;
+    ValueDistribution value_distribution;
+    size_t value_size;
+    size_t value_size_max;
+    /// Part of the leaves which are ephemeral, owned by the sessions round robin
+    double ephemeral_ratio;
+    size_t sessions;
+    int64_t session_timeout_ms;
+    /// Part of the nodes with one of acl_count digest ACLs, the rest are world:anyone
+    double acl_ratio;
+    size_t acl_count;
+    size_t threads;
+    UInt64 seed;
+};
+
+std::vector<size_t> parseFanOut(const String & fan_out, size_t depth)
+{
+    std::vector<size_t> levels;
+    std::istringstream in(fan_out);
+    String level;
+    while (std::getline(in, level, ','))
+        levels.push_back(std::stoull(level));
+    if (levels.empty() || std::find(levels.begin(), levels.end(), 0) != levels.end())
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "Fan out '{}' must be positive counts separated by commas", fan_out);
+    /// A single count is the fan out of every level
+    if (levels.size() == 1)
+        levels.resize(std::max<size_t>(depth, 1), levels.front());
+    return levels;
+}
+
+ValueDistribution parseValueDistribution(const String & name)
+{
+    if (name == "fixed")
+        return ValueDistribution::FIXED;
+    if (name == "uniform")
+        return ValueDistribution::UNIFORM;
+    if (name == "exponential")
+        return ValueDistribution::EXPONENTIAL;
+    throw Exception(ErrorCodes::BAD_ARGUMENTS, "Unknown value distribution '{}', expected fixed, uniform or exponential", name);
+}
+
+size_t nodeCount(const std::vector<size_t> & fan_out)
+{
+    size_t count = 0;
+    size_t level_count = 1;
+    for (size_t children : fan_out)
+    {
+        level_count *= children;
+        count += level_count;
+    }
+    return count;
+}
+
+UInt64 residentBytes()
+{
+    return MemoryStatisticsOS().get().resident;
+}
+
+String formatBytes(UInt64 bytes)
+{
+    return std::to_string(bytes / (1024 * 1024)) + " MiB";
+}
+
+/** Builds a synthetic tree in a KeeperStore directly, as the converter does with ZooKeeper snapshots, without
+  * requests: root/n<i>/n<j>/... with fan_out[level] children at every level. Subtrees of the first level are built
+  * by threads in parallel, the children are linked by buildPathChildren at last.
+  */
+class TreeGenerator
+{
+public:
+    TreeGenerator(const GeneratorOptions & options_, KeeperStore & store_) : options(options_), store(store_)
+    {
+        for (size_t i = 0; i < options.acl_count; ++i)
+        {
+            Coordination::ACLs acls;
+            acls.push_back({Coordination::ACL::Read | Coordination::ACL::Write, "world", "anyone"});
+            acls.push_back({Coordination::ACL::All, "digest", "generator" + std::to_string(i) + ":" + String(28, 'a' + i % 26)});
+            acl_ids.push_back(store.acl_map.convertACLs(acls));
+        }
+    }
+
+    void generate()
+    {
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        for (size_t session = 0; session < options.sessions; ++session)
+            store.addSessionID(static_cast<int64_t>(session + 1), options.session_timeout_ms);
+        store.session_id_counter = static_cast<int64_t>(options.sessions + 1);
+
+        /// Parents of root
+        String path;
+        for (std::string_view part : splitPath(options.root))
+        {
+            path += '/';
+            path += part;
+            if (!store.container.get(path))
+                store.container.emplace(path, makeNode(now, {}, 0));
+        }
+
+        std::vector<std::thread> threads;
+        std::vector<std::vector<UInt64>> acl_usages(options.threads, std::vector<UInt64>(acl_ids.size()));
+        for (size_t thread = 0; thread < options.threads; ++thread)
+        {
+            threads.emplace_back([this, thread, now, &acl_usages]
+            {
+                std::mt19937_64 rng(options.seed + thread);
+                for (size_t child = thread; child < options.fan_out.front(); child += options.threads)
+                    generateSubtree(options.root + "/n" + std::to_string(child), 0, now, rng, acl_usages[thread]);
+            });
+        }
+        for (auto & thread : threads)
+            thread.join();
+
+        for (const auto & usages : acl_usages)
+            for (size_t i = 0; i < acl_ids.size(); ++i)
+                if (usages[i])
+                    store.acl_map.addUsage(acl_ids[i], usages[i]);
+
+        store.zxid = next_zxid.load();
+        store.buildPathChildren(true);
+    }
+
+    /// A path of the last level, picked at random
+    template <typename Rng>
+    String randomLeafPath(Rng & rng) const
+    {
+        String path = options.root;
+        for (size_t children : options.fan_out)
+            path += "/n" + std::to_string(rng() % children);
+        return path;
+    }
+
+    UInt64 ephemeralCount() const { return ephemeral_count.load(); }
+    UInt64 valueBytes() const { return value_bytes.load(); }
+
+private:
+    static std::vector<std::string_view> splitPath(std::string_view path)
+    {
+        std::vector<std::string_view> parts;
+        while (!path.empty())
+        {
+            size_t begin = path.find_first_not_of('/');
+            if (begin == std::string_view::npos)
+                break;
+            size_t end = path.find('/', begin);
+            parts.push_back(path.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin));
+            path = end == std::string_view::npos ? std::string_view{} : path.substr(end);
+        }
+        return parts;
+    }
+
+    template <typename Rng>
+    size_t valueSize(Rng & rng) const
+    {
+        switch (options.value_distribution)
+        {
+            case ValueDistribution::FIXED:
+                return options.value_size;
+            case ValueDistribution::UNIFORM:
+                return std::min(rng() % (2 * options.value_size + 1), options.value_size_max);
+            case ValueDistribution::EXPONENTIAL:
+                return std::min(
+                    static_cast<size_t>(std::exponential_distribution<double>(1.0 / std::max<size_t>(options.value_size, 1))(rng)),
+                    options.value_size_max);
+        }
+        return options.value_size;
+    }
+
+    std::shared_ptr<KeeperNode> makeNode(int64_t now, String value, uint64_t acl_id)
+    {
+        auto node = KeeperNode::create();
+        int64_t zxid = next_zxid.fetch_add(1);
+        value_bytes.fetch_add(value.size(), std::memory_order_relaxed);
+        node->data = std::move(value);
+        node->acl_id = acl_id;
+        node->stat.czxid = zxid;
+        node->stat.mzxid = zxid;
+        node->stat.pzxid = zxid;
+        node->stat.ctime = now;
+        node->stat.mtime = now;
+        node->stat.dataLength = static_cast<int32_t>(node->data.size());
+        return node;
+    }
+
+    template <typename Rng>
+    void generateSubtree(const String & path, size_t level, int64_t now, Rng & rng, std::vector<UInt64> & acl_usages)
+    {
+        uint64_t acl_id = 0;
+        if (!acl_ids.empty() && std::uniform_real_distribution<double>()(rng) < options.acl_ratio)
+        {
+            size_t acl = rng() % acl_ids.size();
+            acl_id = acl_ids[acl];
+            ++acl_usages[acl];
+        }
+
+        auto node = makeNode(now, String(valueSize(rng), 'v'), acl_id);
+        bool leaf = level + 1 == options.fan_out.size();
+        if (leaf && options.sessions && std::uniform_real_distribution<double>()(rng) < options.ephemeral_ratio)
+        {
+            int64_t session_id = static_cast<int64_t>(ephemeral_count.fetch_add(1) % options.sessions + 1);
+            node->is_ephemeral = true;
+            node->stat.ephemeralOwner = session_id;
+            store.ephemerals.add(session_id, path);
+        }
+        store.container.emplace(path, std::move(node));
+
+        if (leaf)
+            return;
+        for (size_t child = 0; child < options.fan_out[level + 1]; ++child)
+            generateSubtree(path + "/n" + std::to_string(child), level + 1, now, rng, acl_usages);
+    }
+
+    const GeneratorOptions & options;
+    KeeperStore & store;
+    std::vector<uint64_t> acl_ids;
+
+    std::atomic<int64_t> next_zxid{1};
+    std::atomic<UInt64> ephemeral_count{0};
+    std::atomic<UInt64> value_bytes{0};
+};
+
+/** Reads by read_threads and sets by one thread, as a server applies writes serially, of random leaves of the tree
+  * for duration_seconds, through KeeperStore::processRequest. Returns the reads and the writes done.
+  */
+std::pair<UInt64, UInt64> measureThroughput(
+    KeeperStore & store, const TreeGenerator & generator, size_t read_threads, size_t duration_seconds, size_t value_size, UInt64 seed)
+{
+    std::atomic<bool> stop{false};
+    std::atomic<UInt64> reads{0};
+    std::atomic<UInt64> writes{0};
+
+    auto run = [&](bool write, UInt64 thread_seed)
+    {
+        std::mt19937_64 rng(thread_seed);
+        KeeperStore::KeeperResponsesQueue responses(1);
+        UInt64 done = 0;
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            Coordination::ZooKeeperRequestPtr request;
+            if (write)
+            {
+                auto set = std::make_shared<Coordination::ZooKeeperSetRequest>();
+                set->path = generator.randomLeafPath(rng);
+                set->data = String(value_size, 'w');
+                request = set;
+            }
+            else
+            {
+                auto get = std::make_shared<Coordination::ZooKeeperGetRequest>();
+                get->path = generator.randomLeafPath(rng);
+                request = get;
+            }
+            store.processRequest(responses, request, 1, 0, {}, true, /* ignore_response = */ true);
+            ++done;
+        }
+        (write ? writes : reads).fetch_add(done);
+    };
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(run, true, seed);
+    for (size_t i = 0; i < read_threads; ++i)
+        threads.emplace_back(run, false, seed + i + 1);
+    std::this_thread::sleep_for(std::chrono::seconds(duration_seconds));
+    stop = true;
+    for (auto & thread : threads)
+        thread.join();
+    return {reads.load(), writes.load()};
+}
+
+}
+
+int mainEntryRaftKeeperGenerator(int argc, char ** argv)
+{
+    using namespace RK;
+    namespace po = boost::program_options;
+
+    po::options_description desc = createOptionsDescription("Allowed options", getTerminalWidth());
+    desc.add_options()
+        ("help,h", "produce help message")
+        ("output-dir", po::value<std::string>(), "Directory to place the generated snapshot")
+        ("root", po::value<std::string>()->default_value("/generated"), "Node under which the tree is generated")
+        ("fan-out", po::value<std::string>()->default_value("100"),
+            "Children of every node of each level separated by commas, e.g. 1000,100,500 for 50M nodes, or one count for all levels")
+        ("depth", po::value<size_t>()->default_value(3), "Levels of the tree if fan-out is one count")
+        ("value-distribution", po::value<std::string>()->default_value("exponential"),
+            "Sizes of node values: fixed at value-size, uniform up to twice value-size, or exponential of mean value-size")
+        ("value-size", po::value<size_t>()->default_value(100), "Bytes of node values, see value-distribution")
+        ("value-size-max", po::value<size_t>()->default_value(1024 * 1024), "Bytes of node values at most")
+        ("sessions", po::value<size_t>()->default_value(0), "Sessions in the snapshot, they own the ephemeral nodes")
+        ("session-timeout-ms", po::value<int64_t>()->default_value(30000), "Timeout of the sessions")
+        ("ephemeral-ratio", po::value<double>()->default_value(0), "Part of the leaves which are ephemeral, needs sessions")
+        ("acl-ratio", po::value<double>()->default_value(0), "Part of the nodes with a digest ACL instead of world:anyone")
+        ("acl-count", po::value<size_t>()->default_value(16), "Distinct digest ACLs")
+        ("threads", po::value<size_t>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Threads generating the tree")
+        ("seed", po::value<UInt64>()->default_value(0), "Seed of the random generator")
+        ("scale-test", "After writing the snapshot, load it into a new store and measure the load time, the resident memory, "
+            "the time of creating a snapshot again and the read and write throughput of the store")
+        ("watches", po::value<size_t>()->default_value(0), "Data watches of the sessions on random leaves, added by the scale test")
+        ("test-duration", po::value<size_t>()->default_value(10), "Seconds of the throughput measurement of the scale test")
+        ("read-threads", po::value<size_t>()->default_value(4), "Threads reading in the throughput measurement, one thread writes")
+    ;
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+    if (vm.count("help") || !vm.count("output-dir"))
+    {
+        std::cout << "Usage: " << argv[0] << " --output-dir ./data/snapshot --fan-out 1000,100,500 --sessions 300000 --ephemeral-ratio 0.01"
+                  << " --scale-test --watches 2000000" << std::endl;
+        std::cout << desc << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+
+    Poco::AutoPtr<Poco::ConsoleChannel> console_channel(new Poco::ConsoleChannel);
+    Poco::Logger * log = &Poco::Logger::get("RaftKeeperGenerator");
+    log->setChannel(console_channel);
+
+    try
+    {
+        GeneratorOptions options;
+        options.root = vm["root"].as<std::string>();
+        if (options.root.empty() || options.root.front() != '/' || options.root == "/" || options.root.back() == '/')
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "Root '{}' must be an absolute path of a node other than /", options.root);
+        options.fan_out = parseFanOut(vm["fan-out"].as<std::string>(), vm["depth"].as<size_t>());
+        options.value_distribution = parseValueDistribution(vm["value-distribution"].as<std::string>());
+        options.value_size = vm["value-size"].as<size_t>();
+        options.value_size_max = vm["value-size-max"].as<size_t>();
+        options.sessions = vm["sessions"].as<size_t>();
+        options.session_timeout_ms = vm["session-timeout-ms"].as<int64_t>();
+        options.ephemeral_ratio = vm["ephemeral-ratio"].as<double>();
+        options.acl_ratio = vm["acl-ratio"].as<double>();
+        options.acl_count = vm["acl-count"].as<size_t>();
+        options.threads = std::max<size_t>(1, vm["threads"].as<size_t>());
+        options.seed = vm["seed"].as<UInt64>();
+        if (options.ephemeral_ratio > 0 && !options.sessions)
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "Ephemeral nodes need sessions");
+
+        String output_dir = vm["output-dir"].as<std::string>();
+        std::filesystem::create_directories(output_dir);
+
+        UInt64 base_rss = residentBytes();
+        auto store = std::make_unique<KeeperStore>(500);
+        TreeGenerator generator(options, *store);
+        LOG_INFO(log, "Generating {} nodes under {}", nodeCount(options.fan_out), options.root);
+
+        Stopwatch watch;
+        generator.generate();
+        LOG_INFO(
+            log,
+            "Generated {} nodes, {} ephemeral, {} of values in {:.3f} s, resident memory grew by {}",
+            store->container.size(),
+            generator.ephemeralCount(),
+            formatBytes(generator.valueBytes()),
+            watch.elapsedSeconds(),
+            formatBytes(residentBytes() - base_rss));
+
+        auto snap_mgr = nuraft::cs_new<KeeperSnapshotManager>(output_dir, 3600, KeeperSnapshotStore::MAX_OBJECT_NODE_SIZE);
+        nuraft::snapshot meta(store->zxid, 1, std::make_shared<nuraft::cluster_config>());
+        watch.restart();
+        size_t objects = snap_mgr->createSnapshot(meta, *store, store->zxid, store->session_id_counter);
+        double create_seconds = watch.elapsedSeconds();
+        LOG_INFO(log, "Snapshot of {} objects written to {} in {:.3f} s", objects, output_dir, create_seconds);
+
+        if (!vm.count("scale-test"))
+            return 0;
+
+        /// The generated store is gone before loading, so that the resident memory is of the loaded one
+        store.reset();
+        base_rss = residentBytes();
+
+        KeeperStore loaded(500);
+        watch.restart();
+        if (!snap_mgr->parseSnapshot(meta, loaded))
+            throw Exception(ErrorCodes::LOGICAL_ERROR, "Cannot load the generated snapshot");
+        double load_seconds = watch.elapsedSeconds();
+        UInt64 loaded_rss = residentBytes() - base_rss;
+        LOG_INFO(log, "Loaded {} nodes in {:.3f} s, resident memory {}", loaded.container.size(), load_seconds, formatBytes(loaded_rss));
+
+        size_t watches = vm["watches"].as<size_t>();
+        UInt64 watches_rss = 0;
+        if (watches)
+        {
+            std::mt19937_64 rng(options.seed);
+            UInt64 rss = residentBytes();
+            watch.restart();
+            size_t watch_sessions = std::max<size_t>(options.sessions, 1);
+            for (size_t i = 0; i < watches; ++i)
+            {
+                String path = generator.randomLeafPath(rng);
+                loaded.watch_manager.addWatch(path, static_cast<int64_t>(i % watch_sessions + 1), WatchManager::DATA);
+            }
+            watches_rss = residentBytes() - rss;
+            LOG_INFO(log, "Added {} watches in {:.3f} s, resident memory {}", watches, watch.elapsedSeconds(), formatBytes(watches_rss));
+        }
+
+        watch.restart();
+        nuraft::snapshot again_meta(loaded.zxid + 1, 1, std::make_shared<nuraft::cluster_config>());
+        snap_mgr->createSnapshot(again_meta, loaded, loaded.zxid, loaded.session_id_counter);
+        double again_seconds = watch.elapsedSeconds();
+
+        size_t duration = std::max<size_t>(1, vm["test-duration"].as<size_t>());
+        auto [reads, writes] = measureThroughput(
+            loaded, generator, vm["read-threads"].as<size_t>(), duration, options.value_size, options.seed);
+
+        std::cout << "\nnodes: " << loaded.container.size() << "\nephemerals: " << loaded.ephemerals.nodeCount()
+                  << "\nsessions: " << options.sessions << "\nwatches: " << watches
+                  << "\nsnapshot_create_seconds: " << create_seconds << "\nsnapshot_load_seconds: " << load_seconds
+                  << "\nsnapshot_create_loaded_seconds: " << again_seconds << "\nresident_bytes: " << loaded_rss
+                  << "\nwatches_resident_bytes: " << watches_rss << "\nreads_per_second: " << reads / duration
+                  << "\nwrites_per_second: " << writes / duration << std::endl;
+    }
+    catch (...)
+    {
+        std::cerr << getCurrentExceptionMessage(true) << '\n';
+        return getCurrentExceptionCode();
+    }
+    return 0;
+}
@@ -0,0 +1,2 @@
+int mainEntryRaftKeeperGenerator(int argc, char ** argv);
+int main(int argc_, char ** argv_) { return mainEntryRaftKeeperGenerator(argc_, argv_); }
@@ -19,6 +19,9 @@
 
 int mainEntryRaftKeeperServer(int argc, char ** argv);
 int mainEntryRaftKeeperConverter(int argc, char ** argv);
+int mainEntryRaftKeeperBenchmark(int argc, char ** argv);
+int mainEntryRaftKeeperGenerator(int argc, char ** argv);
+int mainEntryRaftKeeperAnalyzer(int argc, char ** argv);
 
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
@@ -34,6 +37,9 @@ std::pair<const char *, MainFunc> raftkeeper_applications[] =
 {
     {"server", mainEntryRaftKeeperServer},
     {"converter", mainEntryRaftKeeperConverter},
+    {"benchmark", mainEntryRaftKeeperBenchmark},
+    {"generator", mainEntryRaftKeeperGenerator},
+    {"analyzer", mainEntryRaftKeeperAnalyzer},
 };
 
 
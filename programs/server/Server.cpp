@@ -1,18 +1,28 @@
 #include "Server.h"
+#include <algorithm>
 #include <memory>
 #include <Core/Context.h>
 #include <IO/UseSSL.h>
 #include <Service/ConnectionHandler.h>
+#include <Service/ConnectionHandoff.h>
 #include <Service/ForwardingConnectionHandler.h>
 #include <Service/FourLetterCommand.h>
+#include <Service/KernelTLS.h>
+#include <Service/MetricsHTTPHandler.h>
+#include <Service/MultiplexConnectionHandler.h>
+#include <Service/Settings.h>
+#include <Service/StartupReadServer.h>
 #include <Service/SvsSocketAcceptor.h>
 #include <Service/SvsSocketReactor.h>
+#include <Poco/Environment.h>
 #include <Poco/Net/HTTPServer.h>
 #include <Poco/Net/NetException.h>
+#include <Poco/Net/StreamSocketImpl.h>
 #include <Poco/Util/HelpFormatter.h>
 #include <Common/Config/ConfigReloader.h>
 #include <Common/CurrentMetrics.h>
 #include <Common/SensitiveDataMasker.h>
+#include <Common/StringUtils/StringUtils.h>
 #include <Common/ThreadFuzzer.h>
 #include <Common/ThreadProfileEvents.h>
 #include <Common/ThreadStatus.h>
@@ -149,7 +159,8 @@ int Server::main(const std::vector<std::string> & /*args*/)
     auto & global_context = Context::get();
     
     std::shared_ptr<SvsSocketReactor<SocketReactor>> nio_server;
-    std::shared_ptr<SvsSocketAcceptor<ConnectionHandler, SocketReactor>> nio_server_acceptor;
+    /// One acceptor, or one for every reactor if reuse_port
+    std::vector<std::shared_ptr<SvsSocketAcceptor<ConnectionHandler, SocketReactor>>> nio_server_acceptors;
 
     //get port from config
     std::string listen_host = config().getString("keeper.host", "0.0.0.0");
@@ -158,26 +169,125 @@ int Server::main(const std::vector<std::string> & /*args*/)
     //Init global thread pool
     GlobalThreadPool::initialize(config().getUInt("max_thread_pool_size", 10000));
 
+    /// The settings are loaded again by the dispatcher
+    auto startup_settings = Settings::loadFromConfig(config(), true);
+    /// Before the client port is bound or the data is opened, the server handing off holds them until it exits
+    std::optional<HandoffState> handoff_state;
+    if (!startup_settings->handoff_socket.empty())
+        handoff_state = ConnectionHandoff::receive(startup_settings->handoff_socket, startup_settings->handoff_timeout_ms);
+
+    std::unique_ptr<StartupReadServer> startup_read_server;
+    /// Clients of the inherited sockets wait for the server to start
+    if (startup_settings->startup_read_only && !startup_settings->tls_client_port && !handoff_state)
+    {
+        createServer(listen_host, startup_settings->port, listen_try, [&](UInt16 listen_port) {
+            startup_read_server = std::make_unique<StartupReadServer>(
+                Poco::Net::ServerSocket(listen_port),
+                startup_settings->startup_read_max_connections,
+                startup_settings->raft_settings->session_timeout_ms);
+            LOG_INFO(log, "Serving read only sessions on port {} while starting", listen_port);
+        });
+    }
+
     global_context.initializeDispatcher();
+    /// Closes the port for the server below
+    startup_read_server.reset();
     FourLetterCommandFactory::registerCommands(*global_context.getDispatcher());
 
+    const auto & keeper_settings = global_context.getDispatcher()->getKeeperConfigurationAndSettings();
+
+    /// Before any reactor is created
+    PollSet::setEdgeTriggered(keeper_settings->edge_triggered_io);
+
+    /// Listening sockets of the server handed off, used if they are as many as this one listens on
+    std::vector<int> inherited_listen_fds;
+    if (handoff_state)
+        inherited_listen_fds = handoff_state->listen_fds;
+    size_t listen_socket_count = keeper_settings->reuse_port ? keeper_settings->io_thread_count : 1;
+    if (!inherited_listen_fds.empty() && inherited_listen_fds.size() != listen_socket_count)
+    {
+        LOG_WARNING(log, "Inherited {} listening sockets instead of {}, listen again", inherited_listen_fds.size(), listen_socket_count);
+        for (int fd : inherited_listen_fds)
+            ::close(fd);
+        inherited_listen_fds.clear();
+    }
+    /// Handed off in turn
+    std::vector<int> client_listen_fds;
+
     /// start server
     int32_t port = config().getInt("keeper.port", 8101);
     createServer(listen_host, port, listen_try, [&](UInt16 listen_port) {
-        Poco::Net::ServerSocket socket(listen_port);
-        socket.setBlocking(false);
-
         Poco::Timespan timeout(
             global_context.getConfigRef().getUInt(
                 "keeper.raft_settings.operation_timeout_ms", Coordination::DEFAULT_OPERATION_TIMEOUT_MS * 1000)
             * 1000);
+
+        if (keeper_settings->reuse_port)
+        {
+            int processor_count = static_cast<int>(Poco::Environment::processorCount());
+            for (int i = 0; i < keeper_settings->io_thread_count; ++i)
+            {
+                int cpu = i % processor_count;
+                Poco::Net::ServerSocket socket;
+                if (inherited_listen_fds.empty())
+                {
+                    socket.bind(Poco::Net::SocketAddress(listen_port), true, true);
+#if defined(SO_INCOMING_CPU)
+                    /// The kernel prefers the listening socket of the CPU which received the connection
+                    socket.impl()->setOption(SOL_SOCKET, SO_INCOMING_CPU, cpu);
+#endif
+                    socket.listen();
+                }
+                else
+                    socket = ConnectionHandoff::adoptServerSocket(inherited_listen_fds[i]);
+                socket.setBlocking(false);
+                client_listen_fds.push_back(socket.impl()->sockfd());
+
+                nio_server_acceptors.push_back(std::make_shared<SvsSocketAcceptor<ConnectionHandler, SocketReactor>>(
+                    "NIO-HANDLER#" + std::to_string(i), global_context, socket, timeout, cpu));
+                if (keeper_settings->tls_client_port)
+                    nio_server_acceptors.back()->setTLS(KernelTLS::get(*keeper_settings));
+            }
+            LOG_INFO(
+                log,
+                "Listening for user connections on port {} by {} reactors with SO_REUSEPORT",
+                listen_port,
+                keeper_settings->io_thread_count);
+            return;
+        }
+
+        Poco::Net::ServerSocket socket = inherited_listen_fds.empty()
+            ? Poco::Net::ServerSocket(listen_port)
+            : ConnectionHandoff::adoptServerSocket(inherited_listen_fds.front());
+        socket.setBlocking(false);
+        client_listen_fds.push_back(socket.impl()->sockfd());
+
         nio_server = std::make_shared<SvsSocketReactor<SocketReactor>>(timeout, "NIO-ACCEPTOR");
-        /// TODO add io thread count to config
-        nio_server_acceptor = std::make_shared<SvsSocketAcceptor<ConnectionHandler, SocketReactor>>(
-            "NIO-HANDLER", global_context, socket, *nio_server, timeout);
-        LOG_INFO(log, "Listening for user connections on {}", socket.address().toString());
+        nio_server_acceptors.push_back(std::make_shared<SvsSocketAcceptor<ConnectionHandler, SocketReactor>>(
+            "NIO-HANDLER", global_context, socket, *nio_server, timeout, keeper_settings->io_thread_count));
+        if (keeper_settings->tls_client_port)
+            nio_server_acceptors.back()->setTLS(KernelTLS::get(*keeper_settings));
+        LOG_INFO(
+            log, "Listening for user connections on {}{}", socket.address().toString(), keeper_settings->tls_client_port ? " by TLS" : "");
     });
 
+    if (handoff_state)
+    {
+        size_t adopted = 0;
+        for (const auto & connection : handoff_state->connections)
+        {
+            /// Expired meanwhile, its client finds out when it reconnects
+            if (nio_server_acceptors.empty() || !global_context.getDispatcher()->getStore().containsSession(connection.session_id))
+            {
+                ::close(connection.fd);
+                continue;
+            }
+            StreamSocket socket(new Poco::Net::StreamSocketImpl(connection.fd));
+            nio_server_acceptors[adopted++ % nio_server_acceptors.size()]->adoptConnection(socket, connection);
+        }
+        LOG_INFO(log, "Took over {} of {} connections", adopted, handoff_state->connections.size());
+    }
+
     std::shared_ptr<SvsSocketReactor<SocketReactor>> nio_forwarding_server;
     std::shared_ptr<SvsSocketAcceptor<ForwardingConnectionHandler, SocketReactor>> nio_forwarding_server_acceptor;
 
@@ -192,13 +302,63 @@ int Server::main(const std::vector<std::string> & /*args*/)
             global_context.getConfigRef().getUInt(
                 "keeper.raft_settings.operation_timeout_ms", Coordination::DEFAULT_OPERATION_TIMEOUT_MS * 1000)
             * 1000);
-        nio_forwarding_server = std::make_shared<SvsSocketReactor<SocketReactor>>(timeout, "NIO-ACCEPTOR");
-        /// TODO add io thread count to config
+        nio_forwarding_server = std::make_shared<SvsSocketReactor<SocketReactor>>(timeout, "NIO-FWD-ACCEPT");
         nio_forwarding_server_acceptor = std::make_shared<SvsSocketAcceptor<ForwardingConnectionHandler, SocketReactor>>(
-            "NIO-HANDLER", global_context, socket, *nio_forwarding_server, timeout);
-        LOG_INFO(log, "Listening for forwarding connections on {}", socket.address().toString());
+            "NIO-FWD", global_context, socket, *nio_forwarding_server, timeout, keeper_settings->forwarding_io_thread_count);
+        if (keeper_settings->tls_forwarding_port)
+            nio_forwarding_server_acceptor->setTLS(KernelTLS::get(*keeper_settings));
+        LOG_INFO(
+            log,
+            "Listening for forwarding connections on {}{}",
+            socket.address().toString(),
+            keeper_settings->tls_forwarding_port ? " by TLS" : "");
     });
 
+    std::shared_ptr<SvsSocketReactor<SocketReactor>> nio_multiplex_server;
+    std::shared_ptr<SvsSocketAcceptor<MultiplexConnectionHandler, SocketReactor>> nio_multiplex_server_acceptor;
+
+    /// start multiplexed client server, disabled by default
+    int32_t multiplex_port = config().getInt("keeper.multiplex_port", 0);
+    if (multiplex_port)
+    {
+        createServer(listen_host, multiplex_port, listen_try, [&](UInt16 listen_port) {
+            Poco::Net::ServerSocket socket(listen_port);
+            socket.setBlocking(false);
+
+            Poco::Timespan timeout(
+                global_context.getConfigRef().getUInt(
+                    "keeper.raft_settings.operation_timeout_ms", Coordination::DEFAULT_OPERATION_TIMEOUT_MS * 1000)
+                * 1000);
+            nio_multiplex_server = std::make_shared<SvsSocketReactor<SocketReactor>>(timeout, "NIO-MUX-ACCEPT");
+            nio_multiplex_server_acceptor = std::make_shared<SvsSocketAcceptor<MultiplexConnectionHandler, SocketReactor>>(
+                "NIO-MUX", global_context, socket, *nio_multiplex_server, timeout, keeper_settings->io_thread_count);
+            LOG_INFO(log, "Listening for multiplexed user connections on {}", socket.address().toString());
+        });
+    }
+
+    /// start metrics server, disabled by default
+    std::unique_ptr<Poco::Net::HTTPServer> metrics_server;
+    int32_t metrics_port = config().getInt("keeper.metrics_port", 0);
+    if (metrics_port)
+    {
+        createServer(listen_host, metrics_port, listen_try, [&](UInt16 listen_port) {
+            Poco::Net::ServerSocket socket(listen_port);
+            auto params = new Poco::Net::HTTPServerParams;
+            /// A scraper or two, and a long poll of every server which may replicate from this one, see RelayReplicator
+            Poco::Util::AbstractConfiguration::Keys server_keys;
+            config().keys("keeper.cluster", server_keys);
+            int relayed = static_cast<int>(std::count_if(server_keys.begin(), server_keys.end(), [&](const String & key)
+            {
+                return startsWith(key, "server") && config().has("keeper.cluster." + key + ".upstream");
+            }));
+            params->setMaxThreads(2 + relayed);
+            metrics_server = std::make_unique<Poco::Net::HTTPServer>(
+                new MetricsHTTPRequestHandlerFactory(*global_context.getDispatcher()), socket, params);
+            metrics_server->start();
+            LOG_INFO(log, "Listening for metrics scrapes on http://{}/metrics", socket.address().toString());
+        });
+    }
+
     zkutil::EventPtr unused_event = std::make_shared<Poco::Event>();
     zkutil::ZooKeeperNodeCache unused_cache([] { return nullptr; });
 
@@ -216,14 +376,43 @@ int Server::main(const std::vector<std::string> & /*args*/)
 
     buildLoggers(config(), logger());
     main_config_reloader->start();
+
+    std::unique_ptr<ConnectionHandoff> connection_handoff;
+    if (!keeper_settings->handoff_socket.empty())
+    {
+        auto set_accepting = [&nio_server_acceptors](bool accepting)
+        {
+            for (auto & acceptor : nio_server_acceptors)
+            {
+                if (accepting)
+                    acceptor->resumeAccepting();
+                else
+                    acceptor->unregisterAcceptor();
+            }
+        };
+        connection_handoff = std::make_unique<ConnectionHandoff>(
+            keeper_settings->handoff_socket,
+            *global_context.getDispatcher(),
+            client_listen_fds,
+            !keeper_settings->tls_client_port,
+            keeper_settings->handoff_timeout_ms,
+            std::move(set_accepting),
+            [] { terminate(); });
+        connection_handoff->start();
+    }
     LOG_INFO(log, "RaftKeeper started!");
 
     SCOPE_EXIT({
         LOG_INFO(log, "Main thread received termination signal.");
 
         main_config_reloader.reset();
+        connection_handoff.reset();
         is_cancelled = true;
 
+        /// Metrics are rendered from the dispatcher
+        if (metrics_server)
+            metrics_server->stop();
+
         /// shutdown dispatcher
         global_context.shutdownDispatcher();
 
@@ -233,6 +422,8 @@ int Server::main(const std::vector<std::string> & /*args*/)
             nio_server->stop();
         if (nio_forwarding_server)
             nio_forwarding_server->stop();
+        if (nio_multiplex_server)
+            nio_multiplex_server->stop();
 
         LOG_INFO(log, "RaftKeeper shutdown gracefully.");
         _exit(Application::EXIT_OK);
@@ -31,6 +31,7 @@
 #include <Common/CurrentMemoryTracker.h>
 #include <Common/Exception.h>
 #include <Common/formatReadable.h>
+#include <Common/hugePages.h>
 
 #include <Common/Allocator_fwd.h>
 
@@ -207,6 +208,9 @@ private:
             if (MAP_FAILED == buf)
                 RK::throwFromErrno(fmt::format("Allocator: Cannot mmap {}.", ReadableSize(size)), RK::ErrorCodes::CANNOT_ALLOCATE_MEMORY);
 
+            /// Large arena chunks of the data tree are mapped here, mremap keeps the advice
+            RK::adviseHugePages(buf, size);
+
             /// No need for zero-fill, because mmap guarantees it.
         }
         else
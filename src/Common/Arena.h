@@ -191,6 +191,17 @@ public:
         return head->pos;
     }
 
+    /// Free all the MemoryChunks but the last one, which is the largest, and allocate from its beginning again.
+    /// Everything allocated before is invalidated.
+    void clear()
+    {
+        delete head->prev;
+        head->prev = nullptr;
+        head->pos = head->begin;
+        ASAN_POISON_MEMORY_REGION(head->begin, head->size());
+        size_in_bytes = head->size();
+    }
+
     /** Begin or expand a contiguous range of memory.
       * 'range_start' is the start of range. If nullptr, a new range is
       * allocated.
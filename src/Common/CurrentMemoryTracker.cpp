@@ -6,8 +6,14 @@
 namespace
 {
 
+/// Set by CurrentMemoryTracker::Scope
+thread_local MemoryTracker * scope_memory_tracker = nullptr;
+
 MemoryTracker * getMemoryTracker()
 {
+    if (scope_memory_tracker)
+        return scope_memory_tracker;
+
     if (auto * thread_memory_tracker = RK::CurrentThread::getMemoryTracker())
         return thread_memory_tracker;
 
@@ -78,4 +84,30 @@ void free(Int64 size)
     }
 }
 
+MemoryTracker * setScopeMemoryTracker(MemoryTracker * memory_tracker)
+{
+    MemoryTracker * previous = scope_memory_tracker;
+    if (memory_tracker == previous)
+        return previous;
+
+    /// Untracked memory was allocated or freed in the previous scope
+    if (current_thread && current_thread->untracked_memory)
+    {
+        if (auto * previous_memory_tracker = getMemoryTracker())
+        {
+            /// Called from destructors, must not throw for the limit
+            MemoryTracker::LockExceptionInThread lock_memory_tracker(VariableContext::Global);
+            Int64 untracked = current_thread->untracked_memory;
+            current_thread->untracked_memory = 0;
+            if (untracked > 0)
+                previous_memory_tracker->alloc(untracked);
+            else
+                previous_memory_tracker->free(-untracked);
+        }
+    }
+
+    scope_memory_tracker = memory_tracker;
+    return previous;
+}
+
 }
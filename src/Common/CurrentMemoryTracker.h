@@ -2,10 +2,33 @@
 
 #include <common/types.h>
 
+class MemoryTracker;
+
 /// Convenience methods, that use current thread's memory_tracker if it is available.
 namespace CurrentMemoryTracker
 {
     void alloc(Int64 size);
     void realloc(Int64 old_size, Int64 new_size);
     void free(Int64 size);
+
+    /// Allocations of the current thread go to memory_tracker instead of the one of the thread, nullptr restores it.
+    /// Memory not tracked yet is accounted to the previous tracker first. Returns the previous tracker.
+    MemoryTracker * setScopeMemoryTracker(MemoryTracker * memory_tracker);
+
+    /** Accounts the allocations and frees of the current thread to memory_tracker while it lives, e.g. to tell
+      * the memory of a subsystem. Scopes can be nested. Memory allocated in a scope and freed outside of it,
+      * or the other way round, makes the tracker drift, so it suits work which frees what it allocates.
+      */
+    class Scope
+    {
+    public:
+        explicit Scope(MemoryTracker * memory_tracker) : previous(setScopeMemoryTracker(memory_tracker)) {}
+        ~Scope() { setScopeMemoryTracker(previous); }
+
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+
+    private:
+        MemoryTracker * previous;
+    };
 }
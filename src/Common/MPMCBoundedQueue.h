@@ -0,0 +1,295 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <common/types.h>
+
+
+/** Bounded multi-producer multi-consumer queue on a lock-free ring, every cell has a sequence number
+  * telling whether it is ready to be written or read in the current lap (D. Vyukov's algorithm).
+  *
+  * Push and pop never take a lock on the fast path. A thread which has to wait spins for a short
+  * while and then parks on a condition variable, producers and consumers only touch the mutex when
+  * there is a parked thread on the other side, so a busy pipeline hops without syscalls.
+  *
+  * The interface is the same as ConcurrentBoundedQueue, plus tryPopMany which pops a batch at once.
+  * Capacity is rounded up to a power of 2. size() is approximate under concurrent access.
+  */
+template <typename T>
+class MPMCBoundedQueue
+{
+public:
+    explicit MPMCBoundedQueue(size_t max_fill_) : capacity(roundUpToPowerOfTwo(max_fill_)), mask(capacity - 1)
+    {
+        cells = std::make_unique<Cell[]>(capacity);
+        for (size_t i = 0; i < capacity; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /// Returns false if queue is finished
+    bool push(const T & x) { return pushImpl(T(x), std::nullopt); }
+    bool push(T && x) { return pushImpl(std::move(x), std::nullopt); }
+
+    /// Returns false if queue is finished
+    template <typename... Args>
+    bool emplace(Args &&... args) { return pushImpl(T(std::forward<Args>(args)...), std::nullopt); }
+
+    /// Returns false if queue is finished or object was not pushed during timeout
+    bool tryPush(const T & x, UInt64 milliseconds = 0) { return pushImpl(T(x), std::chrono::milliseconds(milliseconds)); }
+    bool tryPush(T && x, UInt64 milliseconds = 0) { return pushImpl(std::move(x), std::chrono::milliseconds(milliseconds)); }
+
+    /// Returns false if queue is finished and empty
+    bool pop(T & x) { return popImpl(x, std::nullopt); }
+
+    void pop()
+    {
+        T x;
+        popImpl(x, std::nullopt);
+    }
+
+    /// Returns false if queue is (finished and empty) or (object was not popped during timeout)
+    bool tryPop(T & x, UInt64 milliseconds = 0) { return popImpl(x, std::chrono::milliseconds(milliseconds)); }
+
+    /// Returns false if queue is (finished and empty) or (object was not popped during timeout microseconds)
+    bool tryPopMicro(T & x, UInt64 microseconds = 0) { return popImpl(x, std::chrono::microseconds(microseconds)); }
+
+    /// Pop at most max_count objects into out without waiting, returns the number popped.
+    size_t tryPopMany(std::vector<T> & out, size_t max_count)
+    {
+        size_t popped = 0;
+        T x;
+        while (popped < max_count && tryPopOnce(x))
+        {
+            out.push_back(std::move(x));
+            ++popped;
+        }
+        if (popped)
+            notifyPushers();
+        return popped;
+    }
+
+    /// Copy the head to x without popping it. Only valid when there is a single consumer.
+    bool peek(T & x) const
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        const Cell & cell = cells[pos & mask];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        x = cell.data;
+        return true;
+    }
+
+    /// Returns size of queue
+    size_t size() const
+    {
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    /// Returns if queue is empty
+    bool empty() const { return size() == 0; }
+
+    /** Finish queue, after that push operation will return false,
+      * pop operations will return values until queue become empty.
+      * Returns true if queue was already finished
+      */
+    bool finish()
+    {
+        bool was_finished_before = is_finished.exchange(true);
+        wakeAll();
+        return was_finished_before;
+    }
+
+    bool isFinished() const { return is_finished.load(std::memory_order_acquire); }
+
+    bool isFinishedAndEmpty() const { return isFinished() && empty(); }
+
+    /// Clear queue
+    void clear()
+    {
+        T x;
+        while (tryPopOnce(x))
+            ;
+        notifyPushers();
+    }
+
+    /// Clear and finish queue
+    void clearAndFinish()
+    {
+        is_finished.store(true);
+        clear();
+        wakeAll();
+    }
+
+private:
+    /// Spins before parking, long enough to cover a hop between two running threads.
+    static constexpr size_t SPIN_COUNT = 512;
+
+    struct alignas(64) Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    static size_t roundUpToPowerOfTwo(size_t n)
+    {
+        size_t result = 2;
+        while (result < n)
+            result <<= 1;
+        return result;
+    }
+
+    bool tryPushOnce(T & x)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell & cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<Int64>(sequence) - static_cast<Int64>(pos);
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.data = std::move(x);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            /// Full
+            else if (diff < 0)
+                return false;
+            else
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool tryPopOnce(T & x)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell & cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<Int64>(sequence) - static_cast<Int64>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    x = std::move(cell.data);
+                    /// Do not keep what the object owns alive in the ring
+                    cell.data = T();
+                    cell.sequence.store(pos + capacity, std::memory_order_release);
+                    return true;
+                }
+            }
+            /// Empty
+            else if (diff < 0)
+                return false;
+            else
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    using Timeout = std::optional<std::chrono::microseconds>;
+
+    bool pushImpl(T && x, Timeout timeout)
+    {
+        bool pushed = false;
+        waitFor([&] { return isFinished() || (pushed = tryPushOnce(x)); }, push_waiters, push_condition, timeout);
+        if (pushed)
+            notifyPoppers();
+        return pushed;
+    }
+
+    bool popImpl(T & x, Timeout timeout)
+    {
+        bool popped = false;
+        waitFor([&] { return (popped = tryPopOnce(x)) || isFinished(); }, pop_waiters, pop_condition, timeout);
+        /// A finished queue is still drained
+        if (!popped)
+            popped = tryPopOnce(x);
+        if (popped)
+            notifyPushers();
+        return popped;
+    }
+
+    /// Spin on ready and then park until it is true or timeout, returns the last result of ready.
+    template <typename Ready>
+    bool waitFor(Ready && ready, std::atomic<size_t> & waiters, std::condition_variable & condition, Timeout timeout)
+    {
+        if (ready())
+            return true;
+        if (timeout && timeout->count() == 0)
+            return false;
+
+        for (size_t i = 0; i < SPIN_COUNT; ++i)
+        {
+            if (ready())
+                return true;
+            if (i % 64 == 63)
+                std::this_thread::yield();
+        }
+
+        std::unique_lock lock(mutex);
+        /// Checked under the mutex after registering, the other side notifies under the mutex, so no wakeup is lost
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool result;
+        if (timeout)
+            result = condition.wait_for(lock, *timeout, ready);
+        else
+        {
+            condition.wait(lock, ready);
+            result = true;
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    void notifyPoppers() { notify(pop_waiters, pop_condition); }
+    void notifyPushers() { notify(push_waiters, push_condition); }
+
+    void notify(std::atomic<size_t> & waiters, std::condition_variable & condition)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        {
+            std::lock_guard lock(mutex);
+        }
+        condition.notify_one();
+    }
+
+    void wakeAll()
+    {
+        {
+            std::lock_guard lock(mutex);
+        }
+        pop_condition.notify_all();
+        push_condition.notify_all();
+    }
+
+    const size_t capacity;
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+    std::atomic<bool> is_finished{false};
+
+    std::mutex mutex;
+    std::condition_variable push_condition;
+    std::condition_variable pop_condition;
+    std::atomic<size_t> push_waiters{0};
+    std::atomic<size_t> pop_waiters{0};
+};
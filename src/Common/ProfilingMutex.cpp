@@ -0,0 +1,78 @@
+#include <Common/ProfilingMutex.h>
+
+
+namespace LockProfiler
+{
+
+LockStats stats[END] {};
+
+std::atomic<bool> enabled{false};
+
+const char * getName(Lock lock)
+{
+    static const char * strings[] =
+    {
+    #define M(NAME, DOCUMENTATION) #NAME,
+        APPLY_FOR_PROFILED_LOCKS(M)
+    #undef M
+    };
+
+    return strings[lock];
+}
+
+const char * getDocumentation(Lock lock)
+{
+    static const char * strings[] =
+    {
+    #define M(NAME, DOCUMENTATION) DOCUMENTATION,
+        APPLY_FOR_PROFILED_LOCKS(M)
+    #undef M
+    };
+
+    return strings[lock];
+}
+
+Lock end() { return END; }
+
+namespace
+{
+    void updateMax(std::atomic<RK::UInt64> & max, RK::UInt64 value)
+    {
+        RK::UInt64 current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+}
+
+void LockStats::recordWait(RK::UInt64 ns, bool contended)
+{
+    acquisitions.fetch_add(1, std::memory_order_relaxed);
+    if (!contended)
+        return;
+    contentions.fetch_add(1, std::memory_order_relaxed);
+    wait_ns.fetch_add(ns, std::memory_order_relaxed);
+    updateMax(max_wait_ns, ns);
+}
+
+void LockStats::recordHold(RK::UInt64 ns)
+{
+    hold_ns.fetch_add(ns, std::memory_order_relaxed);
+    updateMax(max_hold_ns, ns);
+}
+
+void reset()
+{
+    for (Lock lock = 0; lock < end(); ++lock)
+    {
+        auto & lock_stats = stats[lock];
+        lock_stats.acquisitions.store(0, std::memory_order_relaxed);
+        lock_stats.contentions.store(0, std::memory_order_relaxed);
+        lock_stats.wait_ns.store(0, std::memory_order_relaxed);
+        lock_stats.max_wait_ns.store(0, std::memory_order_relaxed);
+        lock_stats.hold_ns.store(0, std::memory_order_relaxed);
+        lock_stats.max_hold_ns.store(0, std::memory_order_relaxed);
+    }
+}
+
+}
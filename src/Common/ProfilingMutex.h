@@ -0,0 +1,183 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <Common/Stopwatch.h>
+#include <common/defines.h>
+#include <common/types.h>
+
+/// Profiled locks. Add something here and declare the mutex as ProfilingMutex<Mutex, LockProfiler::NAME>.
+#define APPLY_FOR_PROFILED_LOCKS(M) \
+    M(StoreSession, "KeeperStore::session_mutex, serializes creating and closing sessions") \
+    M(EphemeralShard, "Mutexes of the shards of EphemeralIndex, the ephemeral nodes of sessions") \
+    M(StoreAuth, "KeeperStore::auth_mutex, guards the auth of sessions") \
+    M(StoreACL, "ACLMap::acl_mutex, guards the ACLs of nodes, recursive") \
+    M(StoreBlock, "Write mutexes of the blocks of ConcurrentMap, e.g. of the nodes of the store") \
+    M(WatchPathShard, "Mutexes of the path shards of WatchManager") \
+    M(WatchRecursive, "Mutex of the recursive watches of WatchManager") \
+    M(WatchSessionShard, "Mutexes of the session shards of WatchManager") \
+    M(SessionTableShard, "Mutexes of the shards of SessionTable") \
+    M(SessionCallbacks, "Mutexes of the shards of the response callbacks of sessions in KeeperDispatcher") \
+    M(ConnectionShard, "Mutexes of the shards of the registry of client connections in ConnectionHandler") \
+    M(IdempotencyShard, "Mutexes of the shards of IdempotencyCache") \
+
+
+/** Wait and hold times of the hot mutexes of the server, to find the ones limiting scaling.
+  *
+  * See also ProfilingScopedRWLock.h, which adds the wait time of a lock to a ProfileEvent.
+  */
+namespace LockProfiler
+{
+    /// Lock identifier (index in array).
+    using Lock = size_t;
+
+    enum : Lock
+    {
+    #define M(NAME, DOCUMENTATION) NAME,
+        APPLY_FOR_PROFILED_LOCKS(M)
+    #undef M
+        END
+    };
+
+    struct LockStats
+    {
+        std::atomic<RK::UInt64> acquisitions{0};
+        /// Acquisitions which had to wait
+        std::atomic<RK::UInt64> contentions{0};
+        std::atomic<RK::UInt64> wait_ns{0};
+        std::atomic<RK::UInt64> max_wait_ns{0};
+        /// Not recorded for shared acquisitions
+        std::atomic<RK::UInt64> hold_ns{0};
+        std::atomic<RK::UInt64> max_hold_ns{0};
+
+        void recordWait(RK::UInt64 ns, bool contended);
+        void recordHold(RK::UInt64 ns);
+    };
+
+    /// Get name of lock by identifier. Returns statically allocated string.
+    const char * getName(Lock lock);
+    /// Get text description of lock by identifier. Returns statically allocated string.
+    const char * getDocumentation(Lock lock);
+
+    /// Lock identifier -> statistics.
+    extern LockStats stats[];
+
+    /// Get index just after last lock identifier.
+    Lock end();
+
+    /// Disabled, a profiled mutex costs a relaxed load more than the mutex it wraps
+    extern std::atomic<bool> enabled;
+
+    inline bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    void reset();
+}
+
+namespace RK
+{
+
+/** A mutex recording its acquisitions, wait and hold times into LockProfiler::stats[lock] if profiling is enabled.
+  * Mutex is std::mutex, std::recursive_mutex or std::shared_mutex, it is used with std::lock_guard, std::unique_lock
+  * and std::shared_lock as the mutex itself.
+  *
+  * An uncontended acquisition costs two clock reads more. For a recursive mutex only the outermost acquisition is
+  * recorded, and shared acquisitions record their waits only.
+  */
+template <typename Mutex, LockProfiler::Lock lock_id>
+class ProfilingMutex
+{
+public:
+    static constexpr bool is_recursive = std::is_same_v<Mutex, std::recursive_mutex>;
+
+    void lock()
+    {
+        if (likely(!LockProfiler::isEnabled()))
+        {
+            mutex.lock();
+            enter(0);
+            return;
+        }
+
+        UInt64 start_ns = clock_gettime_ns();
+        bool contended = !mutex.try_lock();
+        if (contended)
+            mutex.lock();
+        UInt64 acquired_ns = contended ? clock_gettime_ns() : start_ns;
+        if (enter(acquired_ns))
+            LockProfiler::stats[lock_id].recordWait(acquired_ns - start_ns, contended);
+    }
+
+    bool try_lock()
+    {
+        if (!mutex.try_lock())
+            return false;
+        UInt64 acquired_ns = LockProfiler::isEnabled() ? clock_gettime_ns() : 0;
+        if (enter(acquired_ns) && acquired_ns)
+            LockProfiler::stats[lock_id].recordWait(0, false);
+        return true;
+    }
+
+    void unlock()
+    {
+        UInt64 held_since = held_since_ns;
+        bool outermost = true;
+        if constexpr (is_recursive)
+            outermost = --depth == 0;
+        if (outermost)
+            held_since_ns = 0;
+        mutex.unlock();
+
+        /// Recorded after unlocking, so that waiters do not wait for the recording too
+        if (outermost && held_since)
+            LockProfiler::stats[lock_id].recordHold(clock_gettime_ns() - held_since);
+    }
+
+    void lock_shared()
+    {
+        if (likely(!LockProfiler::isEnabled()))
+        {
+            mutex.lock_shared();
+            return;
+        }
+
+        UInt64 start_ns = clock_gettime_ns();
+        bool contended = !mutex.try_lock_shared();
+        if (contended)
+            mutex.lock_shared();
+        LockProfiler::stats[lock_id].recordWait(contended ? clock_gettime_ns() - start_ns : 0, contended);
+    }
+
+    bool try_lock_shared()
+    {
+        if (!mutex.try_lock_shared())
+            return false;
+        if (LockProfiler::isEnabled())
+            LockProfiler::stats[lock_id].recordWait(0, false);
+        return true;
+    }
+
+    void unlock_shared() { mutex.unlock_shared(); }
+
+private:
+    /// Called by the owner once acquired, return whether it is the outermost acquisition
+    bool enter(UInt64 acquired_ns)
+    {
+        if constexpr (is_recursive)
+        {
+            if (depth++)
+                return false;
+        }
+        held_since_ns = acquired_ns;
+        return true;
+    }
+
+    Mutex mutex;
+    /// Monotonic time the owner acquired the mutex, 0 if not profiled. Only touched by the owner.
+    UInt64 held_since_ns{0};
+    /// Acquisitions of the owner of a recursive mutex
+    size_t depth{0};
+};
+
+}
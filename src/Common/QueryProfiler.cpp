@@ -2,6 +2,7 @@
 
 #include <IO/WriteHelpers.h>
 #include <Common/Exception.h>
+#include <Common/SamplingProfiler.h>
 #include <Common/StackTrace.h>
 #include <Common/thread_local_rng.h>
 #include <common/logger_useful.h>
@@ -57,6 +58,7 @@ namespace
 
         const auto signal_context = *reinterpret_cast<ucontext_t *>(context);
         const StackTrace stack_trace(signal_context);
+        SamplingProfiler::collect(stack_trace);
 
         errno = saved_errno;
     }
@@ -98,8 +100,9 @@ QueryProfilerBase<ProfilerImpl>::QueryProfilerBase(const UInt64 thread_id, const
     if (sigaddset(&sa.sa_mask, pause_signal))
         throwFromErrno("Failed to add signal to mask for query profiler", ErrorCodes::CANNOT_MANIPULATE_SIGSET);
 
-    if (sigaction(pause_signal, &sa, previous_handler))
+    if (sigaction(pause_signal, &sa, &previous_handler))
         throwFromErrno("Failed to setup signal handler for query profiler", ErrorCodes::CANNOT_SET_SIGNAL_HANDLER);
+    handler_installed = true;
 
     try
     {
@@ -164,7 +167,7 @@ void QueryProfilerBase<ProfilerImpl>::tryCleanup()
     if (timer_id != nullptr && timer_delete(timer_id))
         LOG_ERROR(log, "Failed to delete query profiler timer {}", errnoToString(ErrorCodes::CANNOT_DELETE_TIMER));
 
-    if (previous_handler != nullptr && sigaction(pause_signal, previous_handler, nullptr))
+    if (handler_installed && sigaction(pause_signal, &previous_handler, nullptr))
         LOG_ERROR(log, "Failed to restore signal handler after query profiler {}", errnoToString(ErrorCodes::CANNOT_SET_SIGNAL_HANDLER));
 #endif
 }
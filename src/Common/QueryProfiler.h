@@ -23,7 +23,7 @@ namespace RK
   * This class installs timer and signal handler on creation to:
   *  1. periodically pause given thread
   *  2. collect thread's current stack trace
-  *  3. write collected stack trace to trace_pipe for TraceCollector
+  *  3. pass collected stack trace to SamplingProfiler
   *
   * Destructor tries to unset timer and restore previous signal handler.
   * Note that signal handler implementation is defined by template parameter. See QueryProfilerReal and QueryProfilerCpu.
@@ -49,7 +49,8 @@ private:
     int pause_signal;
 
     /// Previous signal handler to restore after query profiler exits
-    struct sigaction * previous_handler = nullptr;
+    struct sigaction previous_handler{};
+    bool handler_installed = false;
 };
 
 /// Query profiler with timer based on real clock
@@ -0,0 +1,225 @@
+#include <Common/SamplingProfiler.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <thread>
+#include <Common/Exception.h>
+#include <Common/SymbolIndex.h>
+#include <common/demangle.h>
+#include <common/getThreadId.h>
+#include <common/logger_useful.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int BAD_ARGUMENTS;
+    extern const int NOT_IMPLEMENTED;
+}
+
+SamplingProfiler & SamplingProfiler::instance()
+{
+    static SamplingProfiler profiler;
+    return profiler;
+}
+
+SamplingProfiler::~SamplingProfiler()
+{
+    try
+    {
+        stop();
+    }
+    catch (...)
+    {
+        tryLogCurrentException(&Poco::Logger::get("SamplingProfiler"), "Failed to stop the profile");
+    }
+}
+
+void SamplingProfiler::start(Clock clock, UInt64 frequency, UInt64 duration_ms)
+{
+    std::unique_lock lock(mutex);
+    if (running)
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "A profile is already running");
+
+    /// The stop thread of the last profile may be exiting
+    if (stop_thread.joinable())
+    {
+        auto thread = std::move(stop_thread);
+        lock.unlock();
+        thread.join();
+        lock.lock();
+        if (running)
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "A profile is already running");
+    }
+
+    /// QueryProfiler samples at most 1000 times a second
+    frequency = std::clamp<UInt64>(frequency, 1, 1000);
+    UInt32 period_ns = static_cast<UInt32>(1000000000 / frequency);
+
+    thread_names.clear();
+    for (const auto & task : std::filesystem::directory_iterator("/proc/self/task"))
+    {
+        String name;
+        std::ifstream comm(task.path() / "comm");
+        std::getline(comm, name);
+        thread_names.emplace(std::stoull(task.path().filename().string()), name.empty() ? "?" : name);
+    }
+
+    samples_capacity = std::min<size_t>(MAX_SAMPLES, thread_names.size() * (frequency * duration_ms / 1000 + 1));
+    samples = std::make_unique<Sample[]>(samples_capacity);
+    next_sample.store(0);
+    dropped_samples.store(0);
+    active.store(true);
+
+    String last_error;
+    for (const auto & [thread_id, name] : thread_names)
+    {
+        /// The thread may have exited meanwhile
+        try
+        {
+            if (clock == Clock::CPU)
+                cpu_profilers.push_back(std::make_unique<QueryProfilerCpu>(thread_id, period_ns));
+            else
+                real_profilers.push_back(std::make_unique<QueryProfilerReal>(thread_id, period_ns));
+        }
+        catch (...)
+        {
+            last_error = getCurrentExceptionMessage(false);
+        }
+    }
+
+    if (cpu_profilers.empty() && real_profilers.empty())
+    {
+        active.store(false);
+        samples.reset();
+        throw Exception(ErrorCodes::NOT_IMPLEMENTED, "Cannot profile any thread: {}", last_error);
+    }
+
+    running = true;
+    stop_thread = ThreadFromGlobalPool([this, duration_ms]
+    {
+        std::unique_lock thread_lock(mutex);
+        cv.wait_for(thread_lock, std::chrono::milliseconds(duration_ms), [this] { return !running; });
+        if (running)
+            stopSampling(thread_lock);
+    });
+
+    LOG_INFO(
+        &Poco::Logger::get("SamplingProfiler"),
+        "Profiling {} threads by {} time {} times a second for {} ms",
+        cpu_profilers.size() + real_profilers.size(),
+        clock == Clock::CPU ? "CPU" : "real",
+        frequency,
+        duration_ms);
+}
+
+String SamplingProfiler::stop()
+{
+    std::unique_lock lock(mutex);
+    if (running)
+        stopSampling(lock);
+    cv.notify_all();
+    String collapsed = samples ? collapse() : String{};
+
+    auto thread = std::move(stop_thread);
+    lock.unlock();
+    if (thread.joinable())
+        thread.join();
+    return collapsed;
+}
+
+void SamplingProfiler::stopSampling(std::unique_lock<std::mutex> & /* lock */)
+{
+    running = false;
+    active.store(false);
+
+    while (!cpu_profilers.empty())
+        cpu_profilers.pop_back();
+    while (!real_profilers.empty())
+        real_profilers.pop_back();
+
+    /// A handler may still be writing a sample taken before the timers were deleted
+    while (running_handlers.load())
+        std::this_thread::yield();
+
+    LOG_INFO(
+        &Poco::Logger::get("SamplingProfiler"),
+        "Profile stopped, {} samples taken, {} dropped",
+        std::min(next_sample.load(), samples_capacity),
+        dropped_samples.load());
+}
+
+void SamplingProfiler::collect(const StackTrace & stack_trace)
+{
+    auto & profiler = instance();
+    profiler.running_handlers.fetch_add(1);
+    if (profiler.active.load())
+    {
+        size_t index = profiler.next_sample.fetch_add(1, std::memory_order_relaxed);
+        if (index < profiler.samples_capacity)
+        {
+            Sample & sample = profiler.samples[index];
+            sample.thread_id = getThreadId();
+            size_t offset = stack_trace.getOffset();
+            sample.size = stack_trace.getSize() - offset;
+            const auto & frame_pointers = stack_trace.getFramePointers();
+            for (size_t i = 0; i < sample.size; ++i)
+                sample.frames[i] = frame_pointers[offset + i];
+            sample.ready.store(true, std::memory_order_release);
+        }
+        else
+            profiler.dropped_samples.fetch_add(1, std::memory_order_relaxed);
+    }
+    profiler.running_handlers.fetch_sub(1);
+}
+
+String SamplingProfiler::collapse() const
+{
+#if defined(__ELF__) && !defined(__FreeBSD__)
+    auto symbol_index_ptr = SymbolIndex::instance();
+    const SymbolIndex & symbol_index = *symbol_index_ptr;
+#endif
+
+    std::unordered_map<const void *, String> symbols;
+    auto symbolize = [&](const void * address) -> const String &
+    {
+        auto [it, inserted] = symbols.try_emplace(address);
+        if (!inserted)
+            return it->second;
+#if defined(__ELF__) && !defined(__FreeBSD__)
+        if (const auto * symbol = symbol_index.findSymbol(address))
+            it->second = demangle(symbol->name);
+#endif
+        if (it->second.empty())
+            it->second = "?";
+        return it->second;
+    };
+
+    std::map<String, UInt64> stacks;
+    size_t taken = std::min(next_sample.load(), samples_capacity);
+    for (size_t index = 0; index < taken; ++index)
+    {
+        const Sample & sample = samples[index];
+        if (!sample.ready.load(std::memory_order_acquire))
+            continue;
+
+        auto name = thread_names.find(sample.thread_id);
+        String stack = name == thread_names.end() ? "?" : name->second;
+        /// Innermost frame is the first
+        for (size_t i = sample.size; i > 0; --i)
+        {
+            stack += ';';
+            stack += symbolize(sample.frames[i - 1]);
+        }
+        ++stacks[stack];
+    }
+
+    String collapsed;
+    for (const auto & [stack, count] : stacks)
+        collapsed += stack + ' ' + std::to_string(count) + '\n';
+    return collapsed;
+}
+
+}
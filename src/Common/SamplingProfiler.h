@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <Common/QueryProfiler.h>
+#include <Common/StackTrace.h>
+#include <Common/ThreadPool.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Samples the stacks of all threads of the server for a while, to profile it where perf cannot be attached.
+  *
+  * Every thread running when the profile starts gets a QueryProfiler timer, by CPU time or by real time. Its signal
+  * handler puts the stack into a buffer allocated in advance, so sampling takes no locks and no allocations. The
+  * stacks are symbolized by SymbolIndex when the profile is taken and returned as collapsed stacks, one line
+  * "thread;outermost;...;innermost count" per distinct stack, which flamegraph.pl and speedscope read.
+  *
+  * The real time profiler takes over SIGUSR1 while it runs, which otherwise reopens the logs.
+  */
+class SamplingProfiler : private boost::noncopyable
+{
+public:
+    enum class Clock
+    {
+        CPU,
+        REAL,
+    };
+
+    /// Samples kept at most, more are dropped
+    static constexpr size_t MAX_SAMPLES = 65536;
+
+    static SamplingProfiler & instance();
+
+    ~SamplingProfiler();
+
+    /// Sample every thread frequency times a second for duration_ms, throws if a profile is running
+    void start(Clock clock, UInt64 frequency, UInt64 duration_ms);
+
+    /// Stop the profile if it is running, return the collapsed stacks of the last one, empty if there is none
+    String stop();
+
+    /// Called by the signal handler of QueryProfiler, signal safe
+    static void collect(const StackTrace & stack_trace);
+
+private:
+    SamplingProfiler() = default;
+
+    struct Sample
+    {
+        std::atomic<bool> ready{false};
+        UInt64 thread_id;
+        size_t size;
+        void * frames[StackTrace::capacity];
+    };
+
+    /// Delete the timers and wait for the signal handlers running
+    void stopSampling(std::unique_lock<std::mutex> & lock);
+    String collapse() const;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    bool running = false;
+    ThreadFromGlobalPool stop_thread;
+
+    /// Destroyed in reverse, every profiler restores the signal handler of the one before
+    std::vector<std::unique_ptr<QueryProfilerCpu>> cpu_profilers;
+    std::vector<std::unique_ptr<QueryProfilerReal>> real_profilers;
+
+    std::unique_ptr<Sample[]> samples;
+    size_t samples_capacity = 0;
+    std::unordered_map<UInt64, String> thread_names;
+
+    /// Read by the signal handlers
+    std::atomic<bool> active{false};
+    std::atomic<size_t> running_handlers{0};
+    std::atomic<size_t> next_sample{0};
+    std::atomic<UInt64> dropped_samples{0};
+};
+
+}
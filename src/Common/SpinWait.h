@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <common/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#endif
+
+
+namespace RK
+{
+
+/// Tell the CPU that the thread is spinning, so that it saves power and leaves the core to its sibling.
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/** Spin until ready returns true, at most spin_us microseconds, and return its last result.
+  *
+  * Called before a pipeline thread parks on a condition variable, so that a request arriving soon
+  * does not pay for a futex wakeup. It burns a core while waiting, only for dedicated hosts. Does
+  * nothing if spin_us is 0.
+  */
+template <typename Ready>
+bool spinUntil(Ready && ready, UInt64 spin_us)
+{
+    if (!spin_us)
+        return false;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+    for (size_t i = 1;; ++i)
+    {
+        if (ready())
+            return true;
+        cpuRelax();
+        /// Reading the clock costs more than a pause
+        if (i % 64 == 0 && std::chrono::steady_clock::now() >= deadline)
+            return false;
+    }
+}
+
+}
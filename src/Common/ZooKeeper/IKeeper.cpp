@@ -110,6 +110,10 @@ const char * errorMessage(Error code)
         case Error::ZCLOSING:                 return "ZooKeeper is closing";
         case Error::ZNOTHING:                 return "(not error) no server responses to process";
         case Error::ZSESSIONMOVED:            return "Session moved to another server, so operation is ignored";
+        case Error::ZNOTREADONLY:             return "State-changing request is passed to read-only server";
+        case Error::ZNOWATCHER:               return "No such watcher";
+        case Error::ZQUOTAEXCEEDED:           return "Quota exceeded";
+        case Error::ZTHROTTLEDOP:             return "Operation was throttled";
     }
 
     __builtin_unreachable();
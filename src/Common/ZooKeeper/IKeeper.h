@@ -130,7 +130,11 @@ enum class Error : int32_t
     ZAUTHFAILED = -115,                 /// Client authentication failed
     ZCLOSING = -116,                    /// ZooKeeper is closing
     ZNOTHING = -117,                    /// (not error) no server responses to process
-    ZSESSIONMOVED = -118                /// Session moved to another server, so operation is ignored
+    ZSESSIONMOVED = -118,               /// Session moved to another server, so operation is ignored
+    ZNOTREADONLY = -119,                /// State-changing request is passed to read-only server
+    ZNOWATCHER = -121,                  /// The watcher could not be found
+    ZQUOTAEXCEEDED = -125,              /// Exceeded the hard quota set on the path
+    ZTHROTTLEDOP = -127                 /// Operation was throttled and not executed, it can be retried
 };
 
 /// Network errors and similar. You should reinitialize ZooKeeper session in case of these errors
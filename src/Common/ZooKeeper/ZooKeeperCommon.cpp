@@ -1,6 +1,7 @@
 #include <Common/ZooKeeper/ZooKeeperCommon.h>
 #include <Common/ZooKeeper/ZooKeeperIO.h>
 #include <IO/WriteHelpers.h>
+#include <IO/NullWriteBuffer.h>
 #include <IO/WriteBufferFromString.h>
 #include <IO/Operators.h>
 #include <IO/ReadHelpers.h>
@@ -15,6 +16,24 @@ using namespace RK;
 
 void ZooKeeperResponse::write(WriteBuffer & out) const
 {
+    if (!frame.empty())
+    {
+        out.write(frame.data(), frame.size());
+        out.next();
+        return;
+    }
+
+    if (body && error == Error::ZOK)
+    {
+        Coordination::write(static_cast<int32_t>(sizeof(xid) + sizeof(zxid) + sizeof(int32_t) + body->size()), out);
+        Coordination::write(xid, out);
+        Coordination::write(zxid, out);
+        Coordination::write(error, out);
+        out.write(body->data(), body->size());
+        out.next();
+        return;
+    }
+
     /// Excessive copy to calculate length.
     WriteBufferFromOwnString buf;
     Coordination::write(xid, buf);
@@ -26,17 +45,76 @@ void ZooKeeperResponse::write(WriteBuffer & out) const
     out.next();
 }
 
-void ZooKeeperRequest::write(WriteBuffer & out) const
+void ZooKeeperResponse::writeBody(WriteBuffer & out) const
 {
-    /// Excessive copy to calculate length.
+    if (body)
+        out.write(body->data(), body->size());
+    else
+        writeImpl(out);
+}
+
+void ZooKeeperResponse::prepareFrame()
+{
+    frame.clear();
     WriteBufferFromOwnString buf;
-    Coordination::write(xid, buf);
-    Coordination::write(getOpNum(), buf);
-    writeImpl(buf);
-    Coordination::write(buf.str(), out);
+    write(buf);
+    frame = std::move(buf.str());
+}
+
+void ZooKeeperRequest::write(WriteBuffer & out) const
+{
+    /// Length does not count itself
+    Coordination::write(static_cast<int32_t>(bytesSize() - sizeof(int32_t)), out);
+    Coordination::write(xid, out);
+    Coordination::write(getOpNum(), out);
+    writeImpl(out);
     out.next();
 }
 
+size_t ZooKeeperRequest::sizeImpl() const
+{
+    /// Large values are written over the scratch memory and only counted
+    char scratch[256];
+    NullWriteBuffer out(sizeof(scratch), scratch);
+    writeImpl(out);
+    return out.count();
+}
+
+void ZooKeeperAddWatchRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(mode, out);
+}
+
+void ZooKeeperAddWatchRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(mode, in);
+}
+
+void ZooKeeperAddWatchResponse::readImpl(ReadBuffer & in)
+{
+    int32_t body_error;
+    Coordination::read(body_error, in);
+}
+
+void ZooKeeperAddWatchResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(static_cast<int32_t>(error), out);
+}
+
+void ZooKeeperRemoveWatchesRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(type, out);
+}
+
+void ZooKeeperRemoveWatchesRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(type, in);
+}
+
 void ZooKeeperSyncRequest::writeImpl(WriteBuffer & out) const
 {
     Coordination::write(path, out);
@@ -57,6 +135,176 @@ void ZooKeeperSyncResponse::writeImpl(WriteBuffer & out) const
     Coordination::write(path, out);
 }
 
+void ZooKeeperSubtreeStatRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+}
+
+void ZooKeeperSubtreeStatRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+}
+
+void ZooKeeperSubtreeStatResponse::readImpl(ReadBuffer & in)
+{
+    Coordination::read(node_count, in);
+    Coordination::read(data_bytes, in);
+}
+
+void ZooKeeperSubtreeStatResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(node_count, out);
+    Coordination::write(data_bytes, out);
+}
+
+void ZooKeeperGetEphemeralsRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+}
+
+void ZooKeeperGetEphemeralsRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+}
+
+void ZooKeeperGetEphemeralsResponse::readImpl(ReadBuffer & in)
+{
+    Coordination::read(ephemerals, in);
+}
+
+void ZooKeeperGetEphemeralsResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(ephemerals, out);
+}
+
+void ZooKeeperGetAllChildrenNumberRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+}
+
+void ZooKeeperGetAllChildrenNumberRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+}
+
+void ZooKeeperGetAllChildrenNumberResponse::readImpl(ReadBuffer & in)
+{
+    Coordination::read(total_number, in);
+}
+
+void ZooKeeperGetAllChildrenNumberResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(total_number, out);
+}
+
+void ZooKeeperListPageRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(start_after, out);
+    Coordination::write(prefix, out);
+    Coordination::write(limit, out);
+}
+
+void ZooKeeperListPageRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(start_after, in);
+    Coordination::read(prefix, in);
+    Coordination::read(limit, in);
+}
+
+void ZooKeeperListPageResponse::readImpl(ReadBuffer & in)
+{
+    Coordination::read(names, in);
+    Coordination::read(stat, in);
+    Coordination::read(has_more, in);
+}
+
+void ZooKeeperListPageResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(names, out);
+    Coordination::write(stat, out);
+    Coordination::write(has_more, out);
+}
+
+void ZooKeeperListWithDataRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(start_after, out);
+    Coordination::write(prefix, out);
+    Coordination::write(limit, out);
+    Coordination::write(with_data, out);
+    Coordination::write(max_data_bytes, out);
+}
+
+void ZooKeeperListWithDataRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(start_after, in);
+    Coordination::read(prefix, in);
+    Coordination::read(limit, in);
+    Coordination::read(with_data, in);
+    Coordination::read(max_data_bytes, in);
+}
+
+void ZooKeeperListWithDataResponse::readImpl(ReadBuffer & in)
+{
+    int32_t count;
+    Coordination::read(count, in);
+    if (count < 0)
+        throw Exception("Negative number of children", Error::ZMARSHALLINGERROR);
+    children.resize(count);
+    for (auto & child : children)
+    {
+        Coordination::read(child.name, in);
+        Coordination::read(child.stat, in);
+        Coordination::read(child.has_data, in);
+        if (child.has_data)
+            Coordination::read(child.data, in);
+    }
+    Coordination::read(stat, in);
+    Coordination::read(has_more, in);
+}
+
+void ZooKeeperListWithDataResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(static_cast<int32_t>(children.size()), out);
+    for (const auto & child : children)
+    {
+        Coordination::write(child.name, out);
+        Coordination::write(child.stat, out);
+        Coordination::write(child.has_data, out);
+        if (child.has_data)
+            Coordination::write(child.data, out);
+    }
+    Coordination::write(stat, out);
+    Coordination::write(has_more, out);
+}
+
+void ZooKeeperRemoveRecursiveRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(limit, out);
+}
+
+void ZooKeeperRemoveRecursiveRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(limit, in);
+}
+
+void ZooKeeperRemoveRecursiveResponse::readImpl(ReadBuffer & in)
+{
+    Coordination::read(removed, in);
+    Coordination::read(has_more, in);
+}
+
+void ZooKeeperRemoveRecursiveResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(removed, out);
+    Coordination::write(has_more, out);
+}
+
 void ZooKeeperWatchResponse::readImpl(ReadBuffer & in)
 {
     Coordination::read(type, in);
@@ -73,9 +321,11 @@ void ZooKeeperWatchResponse::writeImpl(WriteBuffer & out) const
 
 void ZooKeeperWatchResponse::write(WriteBuffer & out) const
 {
-    if (error == Error::ZOK)
-        ZooKeeperResponse::write(out);
     /// skip bad responses for watches
+    if (error != Error::ZOK)
+        return;
+
+    ZooKeeperResponse::write(out);
 }
 
 void ZooKeeperAuthRequest::writeImpl(WriteBuffer & out) const
@@ -108,6 +358,12 @@ void ZooKeeperCreateRequest::writeImpl(WriteBuffer & out) const
     Coordination::write(flags, out);
 }
 
+size_t ZooKeeperCreateRequest::sizeImpl() const
+{
+    /// Flags of Create, mode of CreateContainer
+    return wireSize(path) + wireSize(data) + wireSize(acls) + sizeof(int32_t);
+}
+
 void ZooKeeperCreateRequest::readImpl(ReadBuffer & in)
 {
     Coordination::read(path, in);
@@ -123,6 +379,60 @@ void ZooKeeperCreateRequest::readImpl(ReadBuffer & in)
         is_sequential = true;
 }
 
+/// CreateMode of ZooKeeper
+static constexpr int32_t CREATE_MODE_CONTAINER = 4;
+static constexpr int32_t CREATE_MODE_PERSISTENT_WITH_TTL = 5;
+static constexpr int32_t CREATE_MODE_PERSISTENT_SEQUENTIAL_WITH_TTL = 6;
+
+void ZooKeeperCreateContainerRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(data, out);
+    Coordination::write(acls, out);
+    Coordination::write(CREATE_MODE_CONTAINER, out);
+}
+
+void ZooKeeperCreateContainerRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(data, in);
+    Coordination::read(acls, in);
+
+    int32_t mode = 0;
+    Coordination::read(mode, in);
+    if (mode != CREATE_MODE_CONTAINER)
+        throw Exception("Create mode " + std::to_string(mode) + " is not a container", Error::ZBADARGUMENTS);
+}
+
+void ZooKeeperCreateTTLRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path, out);
+    Coordination::write(data, out);
+    Coordination::write(acls, out);
+    Coordination::write(is_sequential ? CREATE_MODE_PERSISTENT_SEQUENTIAL_WITH_TTL : CREATE_MODE_PERSISTENT_WITH_TTL, out);
+    Coordination::write(ttl, out);
+}
+
+size_t ZooKeeperCreateTTLRequest::sizeImpl() const
+{
+    return ZooKeeperCreateRequest::sizeImpl() + sizeof(ttl);
+}
+
+void ZooKeeperCreateTTLRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path, in);
+    Coordination::read(data, in);
+    Coordination::read(acls, in);
+
+    int32_t mode = 0;
+    Coordination::read(mode, in);
+    if (mode != CREATE_MODE_PERSISTENT_WITH_TTL && mode != CREATE_MODE_PERSISTENT_SEQUENTIAL_WITH_TTL)
+        throw Exception("Create mode " + std::to_string(mode) + " has no TTL", Error::ZBADARGUMENTS);
+    is_sequential = mode == CREATE_MODE_PERSISTENT_SEQUENTIAL_WITH_TTL;
+
+    Coordination::read(ttl, in);
+}
+
 void ZooKeeperCreateResponse::readImpl(ReadBuffer & in)
 {
     Coordination::read(path_created, in);
@@ -133,12 +443,29 @@ void ZooKeeperCreateResponse::writeImpl(WriteBuffer & out) const
     Coordination::write(path_created, out);
 }
 
+void ZooKeeperCreateWithStatResponse::readImpl(ReadBuffer & in)
+{
+    Coordination::read(path_created, in);
+    Coordination::read(stat, in);
+}
+
+void ZooKeeperCreateWithStatResponse::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(path_created, out);
+    Coordination::write(stat, out);
+}
+
 void ZooKeeperRemoveRequest::writeImpl(WriteBuffer & out) const
 {
     Coordination::write(path, out);
     Coordination::write(version, out);
 }
 
+size_t ZooKeeperRemoveRequest::sizeImpl() const
+{
+    return wireSize(path) + sizeof(version);
+}
+
 void ZooKeeperRemoveRequest::readImpl(ReadBuffer & in)
 {
     Coordination::read(path, in);
@@ -187,7 +514,7 @@ void ZooKeeperGetResponse::readImpl(ReadBuffer & in)
 
 void ZooKeeperGetResponse::writeImpl(WriteBuffer & out) const
 {
-    Coordination::write(data, out);
+    Coordination::write(shared_data ? *shared_data : data, out);
     Coordination::write(stat, out);
 }
 
@@ -198,6 +525,11 @@ void ZooKeeperSetRequest::writeImpl(WriteBuffer & out) const
     Coordination::write(version, out);
 }
 
+size_t ZooKeeperSetRequest::sizeImpl() const
+{
+    return wireSize(path) + wireSize(data) + sizeof(version);
+}
+
 void ZooKeeperSetRequest::readImpl(ReadBuffer & in)
 {
     Coordination::read(path, in);
@@ -291,6 +623,11 @@ void ZooKeeperCheckRequest::writeImpl(WriteBuffer & out) const
     Coordination::write(version, out);
 }
 
+size_t ZooKeeperCheckRequest::sizeImpl() const
+{
+    return wireSize(path) + sizeof(version);
+}
+
 void ZooKeeperCheckRequest::readImpl(ReadBuffer & in)
 {
     Coordination::read(path, in);
@@ -369,6 +706,16 @@ void ZooKeeperMultiRequest::writeImpl(WriteBuffer & out) const
     Coordination::write(error, out);
 }
 
+size_t ZooKeeperMultiRequest::sizeImpl() const
+{
+    /// op_num, done and error before every request and the end
+    static constexpr size_t header_size = sizeof(int32_t) + sizeof(bool) + sizeof(int32_t);
+    size_t size = header_size;
+    for (const auto & request : requests)
+        size += header_size + dynamic_cast<const ZooKeeperRequest &>(*request).sizeImpl();
+    return size;
+}
+
 void ZooKeeperMultiRequest::readImpl(ReadBuffer & in)
 {
 
@@ -473,7 +820,7 @@ void ZooKeeperMultiResponse::writeImpl(WriteBuffer & out) const
         Coordination::write(done, out);
         Coordination::write(op_error, out);
         if (op_error == Error::ZOK || op_num == OpNum::Error)
-            zk_response.writeImpl(out);
+            zk_response.writeBody(out);
     }
 
     /// Footer.
@@ -522,8 +869,30 @@ void ZooKeeperSetWatchesRequest::readImpl(ReadBuffer & in)
 ZooKeeperResponsePtr ZooKeeperHeartbeatRequest::makeResponse() const { return std::make_shared<ZooKeeperHeartbeatResponse>(); }
 ZooKeeperResponsePtr ZooKeeperSetWatchesRequest::makeResponse() const { return std::make_shared<ZooKeeperSetWatchesResponse>(); }
 ZooKeeperResponsePtr ZooKeeperSyncRequest::makeResponse() const { return std::make_shared<ZooKeeperSyncResponse>(); }
+ZooKeeperResponsePtr ZooKeeperAddWatchRequest::makeResponse() const { return std::make_shared<ZooKeeperAddWatchResponse>(); }
+ZooKeeperResponsePtr ZooKeeperRemoveWatchesRequest::makeResponse() const { return std::make_shared<ZooKeeperRemoveWatchesResponse>(); }
+ZooKeeperResponsePtr ZooKeeperSubtreeStatRequest::makeResponse() const { return std::make_shared<ZooKeeperSubtreeStatResponse>(); }
+ZooKeeperResponsePtr ZooKeeperListPageRequest::makeResponse() const { return std::make_shared<ZooKeeperListPageResponse>(); }
+ZooKeeperResponsePtr ZooKeeperListWithDataRequest::makeResponse() const { return std::make_shared<ZooKeeperListWithDataResponse>(); }
+ZooKeeperResponsePtr ZooKeeperGetEphemeralsRequest::makeResponse() const { return std::make_shared<ZooKeeperGetEphemeralsResponse>(); }
+ZooKeeperResponsePtr ZooKeeperGetAllChildrenNumberRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperGetAllChildrenNumberResponse>();
+}
+ZooKeeperResponsePtr ZooKeeperRemoveRecursiveRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperRemoveRecursiveResponse>();
+}
 ZooKeeperResponsePtr ZooKeeperAuthRequest::makeResponse() const { return std::make_shared<ZooKeeperAuthResponse>(); }
 ZooKeeperResponsePtr ZooKeeperCreateRequest::makeResponse() const { return std::make_shared<ZooKeeperCreateResponse>(); }
+ZooKeeperResponsePtr ZooKeeperCreateContainerRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperCreateWithStatResponse>(OpNum::CreateContainer);
+}
+ZooKeeperResponsePtr ZooKeeperCreateTTLRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperCreateWithStatResponse>(OpNum::CreateTTL);
+}
 ZooKeeperResponsePtr ZooKeeperRemoveRequest::makeResponse() const { return std::make_shared<ZooKeeperRemoveResponse>(); }
 ZooKeeperResponsePtr ZooKeeperExistsRequest::makeResponse() const { return std::make_shared<ZooKeeperExistsResponse>(); }
 ZooKeeperResponsePtr ZooKeeperGetRequest::makeResponse() const { return std::make_shared<ZooKeeperGetResponse>(); }
@@ -531,6 +900,8 @@ ZooKeeperResponsePtr ZooKeeperSetRequest::makeResponse() const { return std::mak
 ZooKeeperResponsePtr ZooKeeperListRequest::makeResponse() const { return std::make_shared<ZooKeeperListResponse>(); }
 ZooKeeperResponsePtr ZooKeeperCheckRequest::makeResponse() const { return std::make_shared<ZooKeeperCheckResponse>(); }
 ZooKeeperResponsePtr ZooKeeperMultiRequest::makeResponse() const { return std::make_shared<ZooKeeperMultiResponse>(requests); }
+ZooKeeperResponsePtr ZooKeeperMultiReadRequest::makeResponse() const { return std::make_shared<ZooKeeperMultiReadResponse>(requests); }
+ZooKeeperResponsePtr ZooKeeperBatchWriteRequest::makeResponse() const { return std::make_shared<ZooKeeperBatchWriteResponse>(requests); }
 ZooKeeperResponsePtr ZooKeeperCloseRequest::makeResponse() const { return std::make_shared<ZooKeeperCloseResponse>(); }
 ZooKeeperResponsePtr ZooKeeperSetSeqNumRequest::makeResponse() const { return std::make_shared<ZooKeeperSetSeqNumResponse>(); }
 ZooKeeperResponsePtr ZooKeeperSetACLRequest::makeResponse() const { return std::make_shared<ZooKeeperSetACLResponse>(); }
@@ -569,6 +940,51 @@ void ZooKeeperSessionIDResponse::writeImpl(WriteBuffer & out) const
     Coordination::write(server_id, out);
 }
 
+void ZooKeeperExpireSessionsRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(session_ids, out);
+}
+
+void ZooKeeperExpireSessionsRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(session_ids, in);
+}
+
+Coordination::ZooKeeperResponsePtr ZooKeeperExpireSessionsRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperExpireSessionsResponse>();
+}
+
+void ZooKeeperRemoveExpiredNodesRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(paths, out);
+}
+
+void ZooKeeperRemoveExpiredNodesRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(paths, in);
+}
+
+Coordination::ZooKeeperResponsePtr ZooKeeperRemoveExpiredNodesRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperRemoveExpiredNodesResponse>();
+}
+
+void ZooKeeperRegisterSessionRequest::writeImpl(WriteBuffer & out) const
+{
+    Coordination::write(session_timeout_ms, out);
+}
+
+void ZooKeeperRegisterSessionRequest::readImpl(ReadBuffer & in)
+{
+    Coordination::read(session_timeout_ms, in);
+}
+
+Coordination::ZooKeeperResponsePtr ZooKeeperRegisterSessionRequest::makeResponse() const
+{
+    return std::make_shared<ZooKeeperRegisterSessionResponse>();
+}
+
 void ZooKeeperRequestFactory::registerRequest(OpNum op_num, Creator creator)
 {
     if (!op_num_to_request.try_emplace(op_num, creator).second)
@@ -617,6 +1033,8 @@ ZooKeeperRequestFactory::ZooKeeperRequestFactory()
     registerZooKeeperRequest<OpNum::Auth, ZooKeeperAuthRequest>(*this);
     registerZooKeeperRequest<OpNum::Close, ZooKeeperCloseRequest>(*this);
     registerZooKeeperRequest<OpNum::Create, ZooKeeperCreateRequest>(*this);
+    registerZooKeeperRequest<OpNum::CreateContainer, ZooKeeperCreateContainerRequest>(*this);
+    registerZooKeeperRequest<OpNum::CreateTTL, ZooKeeperCreateTTLRequest>(*this);
     registerZooKeeperRequest<OpNum::Remove, ZooKeeperRemoveRequest>(*this);
     registerZooKeeperRequest<OpNum::Exists, ZooKeeperExistsRequest>(*this);
     registerZooKeeperRequest<OpNum::Get, ZooKeeperGetRequest>(*this);
@@ -625,8 +1043,21 @@ ZooKeeperRequestFactory::ZooKeeperRequestFactory()
     registerZooKeeperRequest<OpNum::List, ZooKeeperListRequest>(*this);
     registerZooKeeperRequest<OpNum::Check, ZooKeeperCheckRequest>(*this);
     registerZooKeeperRequest<OpNum::Multi, ZooKeeperMultiRequest>(*this);
+    registerZooKeeperRequest<OpNum::MultiRead, ZooKeeperMultiReadRequest>(*this);
+    registerZooKeeperRequest<OpNum::BatchWrite, ZooKeeperBatchWriteRequest>(*this);
     registerZooKeeperRequest<OpNum::SetSeqNum, ZooKeeperSetSeqNumRequest>(*this);
+    registerZooKeeperRequest<OpNum::SubtreeStat, ZooKeeperSubtreeStatRequest>(*this);
+    registerZooKeeperRequest<OpNum::AddWatch, ZooKeeperAddWatchRequest>(*this);
+    registerZooKeeperRequest<OpNum::RemoveWatches, ZooKeeperRemoveWatchesRequest>(*this);
+    registerZooKeeperRequest<OpNum::ListPage, ZooKeeperListPageRequest>(*this);
+    registerZooKeeperRequest<OpNum::ListWithData, ZooKeeperListWithDataRequest>(*this);
+    registerZooKeeperRequest<OpNum::GetEphemerals, ZooKeeperGetEphemeralsRequest>(*this);
+    registerZooKeeperRequest<OpNum::GetAllChildrenNumber, ZooKeeperGetAllChildrenNumberRequest>(*this);
+    registerZooKeeperRequest<OpNum::RemoveRecursive, ZooKeeperRemoveRecursiveRequest>(*this);
     registerZooKeeperRequest<OpNum::SessionID, ZooKeeperSessionIDRequest>(*this);
+    registerZooKeeperRequest<OpNum::ExpireSessions, ZooKeeperExpireSessionsRequest>(*this);
+    registerZooKeeperRequest<OpNum::RemoveExpiredNodes, ZooKeeperRemoveExpiredNodesRequest>(*this);
+    registerZooKeeperRequest<OpNum::RegisterSession, ZooKeeperRegisterSessionRequest>(*this);
     registerZooKeeperRequest<OpNum::SetWatches, ZooKeeperSetWatchesRequest>(*this);
     registerZooKeeperRequest<OpNum::GetACL, ZooKeeperGetACLRequest>(*this);
     registerZooKeeperRequest<OpNum::SetACL, ZooKeeperSetACLRequest>(*this);
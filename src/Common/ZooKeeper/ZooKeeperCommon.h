@@ -30,10 +30,20 @@ struct ZooKeeperResponse : virtual Response
     /// used to calculate request latency
     UInt64 request_created_time_ms = 0;
 
+    /// Serialized response if prepared, written as it is. A watch event sent to many sessions is serialized once.
+    String frame;
+    /// Serialized writeImpl if shared with other responses, e.g. by the response cache of KeeperStore, written after the header
+    std::shared_ptr<const String> body;
+
     virtual ~ZooKeeperResponse() override = default;
     virtual void readImpl(ReadBuffer &) = 0;
     virtual void writeImpl(WriteBuffer &) const = 0;
     virtual void write(WriteBuffer & out) const;
+    /// writeImpl or the shared body
+    void writeBody(WriteBuffer & out) const;
+
+    /// Serialize into frame, must be called after xid, zxid and error are set and before the response is shared.
+    void prepareFrame();
     virtual OpNum getOpNum() const = 0;
 
     virtual bool operator== (const ZooKeeperResponse & response) const
@@ -57,6 +67,7 @@ struct ZooKeeperResponse : virtual Response
 };
 
 using ZooKeeperResponsePtr = std::shared_ptr<ZooKeeperResponse>;
+using ZooKeeperResponses = std::vector<ZooKeeperResponsePtr>;
 
 struct ZooKeeperRequest : virtual Request
 {
@@ -68,6 +79,9 @@ struct ZooKeeperRequest : virtual Request
 
     bool restored_from_zookeeper_log = false;
 
+    /// Hash of the path, computed by the server at the first lookup of the request and reused by the next ones, 0 if not yet.
+    mutable size_t path_hash = 0;
+
     ZooKeeperRequest() = default;
     ZooKeeperRequest(const ZooKeeperRequest &) = default;
     virtual ~ZooKeeperRequest() override = default;
@@ -76,8 +90,12 @@ struct ZooKeeperRequest : virtual Request
 
     /// Writes length, xid, op_num, then the rest.
     void write(WriteBuffer & out) const;
+    /// Bytes written by write, so that a buffer of the exact size can be allocated before writing
+    size_t bytesSize() const { return sizeof(int32_t) + sizeof(XID) + sizeof(int32_t) + sizeImpl(); }
 
     virtual void writeImpl(WriteBuffer &) const = 0;
+    /// Bytes written by writeImpl. Computed from the fields by the write requests, counted by writing to a null buffer otherwise.
+    virtual size_t sizeImpl() const;
     virtual void readImpl(ReadBuffer &) = 0;
 
     static std::shared_ptr<ZooKeeperRequest> read(ReadBuffer & in);
@@ -139,15 +157,84 @@ struct ZooKeeperSetWatchesResponse final : ZooKeeperResponse
     OpNum getOpNum() const override { return OpNum::SetWatches; }
 };
 
+/// Register a watch of mode on path which is not removed when fired, as addWatch of ZooKeeper 3.6.
+struct ZooKeeperAddWatchRequest final : ZooKeeperRequest
+{
+    enum Mode : int32_t
+    {
+        PERSISTENT = 0,
+        PERSISTENT_RECURSIVE = 1,
+    };
+
+    String path;
+    int32_t mode = PERSISTENT;
+
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::AddWatch; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path + ", mode " + std::to_string(mode);
+    }
+};
+
+/// The body is the error code again, same as ZooKeeper.
+struct ZooKeeperAddWatchResponse final : ZooKeeperResponse
+{
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::AddWatch; }
+};
+
+/// Unregister the watches of type on path of the session, ZNOWATCHER if there is none.
+struct ZooKeeperRemoveWatchesRequest final : ZooKeeperRequest
+{
+    /// Watcher types of ZooKeeper
+    enum Type : int32_t
+    {
+        CHILDREN = 1,
+        DATA = 2,
+        ANY = 3,
+        PERSISTENT = 4,
+        PERSISTENT_RECURSIVE = 5,
+    };
+
+    String path;
+    int32_t type = ANY;
+
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::RemoveWatches; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path + ", type " + std::to_string(type);
+    }
+};
+
+struct ZooKeeperRemoveWatchesResponse final : ZooKeeperResponse
+{
+    void readImpl(ReadBuffer &) override {}
+    void writeImpl(WriteBuffer &) const override {}
+    OpNum getOpNum() const override { return OpNum::RemoveWatches; }
+};
+
 struct ZooKeeperSyncRequest final : ZooKeeperRequest
 {
     String path;
+    /// Served as a read waiting for the commit index of the leader rather than as a log entry, not serialized
+    bool barrier = false;
     String getPath() const override { return path; }
     OpNum getOpNum() const override { return OpNum::Sync; }
     void writeImpl(WriteBuffer & out) const override;
     void readImpl(ReadBuffer & in) override;
     ZooKeeperResponsePtr makeResponse() const override;
-    bool isReadRequest() const override { return false; }
+    bool isReadRequest() const override { return barrier; }
     String toString() const override
     {
         return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path;
@@ -162,6 +249,201 @@ struct ZooKeeperSyncResponse final : ZooKeeperResponse
     OpNum getOpNum() const override { return OpNum::Sync; }
 };
 
+/// Number of descendants and their total data bytes of path, answered from KeeperStore subtree stats.
+struct ZooKeeperSubtreeStatRequest final : ZooKeeperRequest
+{
+    String path;
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::SubtreeStat; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path;
+    }
+};
+
+struct ZooKeeperSubtreeStatResponse final : ZooKeeperResponse
+{
+    int64_t node_count = 0;
+    int64_t data_bytes = 0;
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::SubtreeStat; }
+};
+
+/// Ephemeral nodes of the session beginning with path, as ZooKeeper 3.6 getEphemerals. Answered from KeeperStore::ephemerals.
+struct ZooKeeperGetEphemeralsRequest final : ZooKeeperRequest
+{
+    String path;
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::GetEphemerals; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path;
+    }
+};
+
+struct ZooKeeperGetEphemeralsResponse final : ZooKeeperResponse
+{
+    /// Sorted
+    std::vector<String> ephemerals;
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::GetEphemerals; }
+};
+
+/// Number of descendants of path, as ZooKeeper 3.6 getAllChildrenNumber. Answered from KeeperStore subtree stats.
+struct ZooKeeperGetAllChildrenNumberRequest final : ZooKeeperRequest
+{
+    String path;
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::GetAllChildrenNumber; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path;
+    }
+};
+
+struct ZooKeeperGetAllChildrenNumberResponse final : ZooKeeperResponse
+{
+    int32_t total_number = 0;
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::GetAllChildrenNumber; }
+};
+
+/** Page of children of path in sorted order, for znodes with too many children to list at once.
+ *
+ * Children greater than start_after and beginning with prefix are listed, limit of them at most.
+ * Empty start_after begins from the first child, empty prefix matches all. The last name of a page
+ * is the start_after of the next one, has_more tells whether there is a next page.
+ */
+struct ZooKeeperListPageRequest final : ZooKeeperRequest
+{
+    String path;
+    String start_after;
+    String prefix;
+    int32_t limit = 0;
+
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::ListPage; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path + ", start_after " + start_after
+            + ", prefix " + prefix + ", limit " + std::to_string(limit);
+    }
+};
+
+struct ZooKeeperListPageResponse final : ZooKeeperResponse
+{
+    std::vector<String> names;
+    Stat stat;
+    bool has_more = false;
+
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::ListPage; }
+};
+
+/** Page of children of path as ListPage, with the stat and optionally the data of every child, so that a consumer of
+ * a queue node polls it by one request instead of a List and a Get of every child.
+ *
+ * Data is listed if with_data. A page ends early once the data of its children would exceed max_data_bytes, 0 for
+ * no cap, it has at least one child though. A child the session may not read is listed without its data.
+ */
+struct ZooKeeperListWithDataRequest final : ZooKeeperRequest
+{
+    String path;
+    String start_after;
+    String prefix;
+    int32_t limit = 0;
+    bool with_data = true;
+    int32_t max_data_bytes = 0;
+
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::ListWithData; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path + ", start_after " + start_after
+            + ", prefix " + prefix + ", limit " + std::to_string(limit) + ", with_data " + std::to_string(with_data)
+            + ", max_data_bytes " + std::to_string(max_data_bytes);
+    }
+};
+
+struct ZooKeeperListWithDataResponse final : ZooKeeperResponse
+{
+    struct Child
+    {
+        String name;
+        Stat stat;
+        /// Whether data is listed
+        bool has_data = false;
+        String data;
+    };
+
+    std::vector<Child> children;
+    /// Of path
+    Stat stat;
+    bool has_more = false;
+
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::ListWithData; }
+};
+
+/** Remove path and all its descendants by one request, descendants before their parents.
+ *
+ * limit 0 removes the whole subtree atomically. A positive limit removes at most limit nodes, so that a
+ * huge subtree is removed by a few requests of bounded apply time, has_more tells whether nodes are left.
+ */
+struct ZooKeeperRemoveRecursiveRequest final : ZooKeeperRequest
+{
+    String path;
+    int32_t limit = 0;
+
+    String getPath() const override { return path; }
+    OpNum getOpNum() const override { return OpNum::RemoveRecursive; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return false; }
+    String toString() const override
+    {
+        return Coordination::toString(getOpNum()) + ", xid " + std::to_string(xid) + ", path " + path + ", limit " + std::to_string(limit);
+    }
+};
+
+struct ZooKeeperRemoveRecursiveResponse final : ZooKeeperResponse
+{
+    int64_t removed = 0;
+    bool has_more = false;
+    /// Removed paths in the order of removal, to fire their watches. Not serialized.
+    std::vector<String> removed_paths;
+
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return OpNum::RemoveRecursive; }
+};
+
 struct ZooKeeperWatchResponse final : WatchResponse, ZooKeeperResponse
 {
     void readImpl(ReadBuffer & in) override;
@@ -230,16 +512,21 @@ struct ZooKeeperCloseResponse final : ZooKeeperResponse
     OpNum getOpNum() const override { return OpNum::Close; }
 };
 
-struct ZooKeeperCreateRequest final : public CreateRequest, ZooKeeperRequest
+struct ZooKeeperCreateRequest : public CreateRequest, ZooKeeperRequest
 {
     /// used only during restore from zookeeper log
     int32_t parent_cversion = -1;
 
+    /// Set by CreateContainer and CreateTTL
+    bool is_container = false;
+    int64_t ttl = 0;
+
     ZooKeeperCreateRequest() = default;
     explicit ZooKeeperCreateRequest(const CreateRequest & base) : CreateRequest(base) {}
 
     OpNum getOpNum() const override { return OpNum::Create; }
     void writeImpl(WriteBuffer & out) const override;
+    size_t sizeImpl() const override;
     void readImpl(ReadBuffer & in) override;
 
     ZooKeeperResponsePtr makeResponse() const override;
@@ -255,7 +542,33 @@ struct ZooKeeperCreateRequest final : public CreateRequest, ZooKeeperRequest
     }
 };
 
-struct ZooKeeperCreateResponse final : CreateResponse, ZooKeeperResponse
+/** Create a container node, which is removed by the leader once it had children and has none left.
+ * Flags are the CreateMode of ZooKeeper instead of bits, only CONTAINER (4) is allowed.
+ */
+struct ZooKeeperCreateContainerRequest final : ZooKeeperCreateRequest
+{
+    ZooKeeperCreateContainerRequest() { is_container = true; }
+
+    OpNum getOpNum() const override { return OpNum::CreateContainer; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+};
+
+/** Create a persistent node which is removed by the leader when it is not modified for ttl ms and has no children.
+ * Flags are PERSISTENT_WITH_TTL (5) or PERSISTENT_SEQUENTIAL_WITH_TTL (6), ttl follows them.
+ */
+struct ZooKeeperCreateTTLRequest final : ZooKeeperCreateRequest
+{
+    OpNum getOpNum() const override { return OpNum::CreateTTL; }
+    void writeImpl(WriteBuffer & out) const override;
+    size_t sizeImpl() const override;
+    void readImpl(ReadBuffer & in) override;
+    ZooKeeperResponsePtr makeResponse() const override;
+    String toString() const override { return ZooKeeperCreateRequest::toString() + ", ttl " + std::to_string(ttl); }
+};
+
+struct ZooKeeperCreateResponse : CreateResponse, ZooKeeperResponse
 {
     void readImpl(ReadBuffer & in) override;
 
@@ -278,6 +591,19 @@ struct ZooKeeperCreateResponse final : CreateResponse, ZooKeeperResponse
     }
 };
 
+/// Response of CreateContainer and CreateTTL, the created path and its stat as Create2 of ZooKeeper
+struct ZooKeeperCreateWithStatResponse final : ZooKeeperCreateResponse
+{
+    explicit ZooKeeperCreateWithStatResponse(OpNum op_num_) : op_num(op_num_) { }
+
+    OpNum op_num;
+    Stat stat{};
+
+    void readImpl(ReadBuffer & in) override;
+    void writeImpl(WriteBuffer & out) const override;
+    OpNum getOpNum() const override { return op_num; }
+};
+
 struct ZooKeeperRemoveRequest final : RemoveRequest, ZooKeeperRequest
 {
     ZooKeeperRemoveRequest() = default;
@@ -285,6 +611,7 @@ struct ZooKeeperRemoveRequest final : RemoveRequest, ZooKeeperRequest
 
     OpNum getOpNum() const override { return OpNum::Remove; }
     void writeImpl(WriteBuffer & out) const override;
+    size_t sizeImpl() const override;
     void readImpl(ReadBuffer & in) override;
 
     ZooKeeperResponsePtr makeResponse() const override;
@@ -360,6 +687,9 @@ struct ZooKeeperGetRequest final : GetRequest, ZooKeeperRequest
 
 struct ZooKeeperGetResponse final : GetResponse, ZooKeeperResponse
 {
+    /// Large value shared with the node, written instead of data if set
+    std::shared_ptr<const String> shared_data;
+
     void readImpl(ReadBuffer & in) override;
     void writeImpl(WriteBuffer & out) const override;
     OpNum getOpNum() const override { return OpNum::Get; }
@@ -387,6 +717,7 @@ struct ZooKeeperSetRequest final : SetRequest, ZooKeeperRequest
 
     OpNum getOpNum() const override { return OpNum::Set; }
     void writeImpl(WriteBuffer & out) const override;
+    size_t sizeImpl() const override;
     void readImpl(ReadBuffer & in) override;
     ZooKeeperResponsePtr makeResponse() const override;
     bool isReadRequest() const override { return false; }
@@ -484,6 +815,7 @@ struct ZooKeeperCheckRequest final : CheckRequest, ZooKeeperRequest
 
     OpNum getOpNum() const override { return OpNum::Check; }
     void writeImpl(WriteBuffer & out) const override;
+    size_t sizeImpl() const override;
     void readImpl(ReadBuffer & in) override;
 
     ZooKeeperResponsePtr makeResponse() const override;
@@ -546,7 +878,7 @@ struct ZooKeeperGetACLResponse final : GetACLResponse, ZooKeeperResponse
     OpNum getOpNum() const override { return OpNum::GetACL; }
 };
 
-struct ZooKeeperMultiRequest final : MultiRequest, ZooKeeperRequest
+struct ZooKeeperMultiRequest : MultiRequest, ZooKeeperRequest
 {
     OpNum getOpNum() const override { return OpNum::Multi; }
     ZooKeeperMultiRequest() = default;
@@ -554,6 +886,7 @@ struct ZooKeeperMultiRequest final : MultiRequest, ZooKeeperRequest
     ZooKeeperMultiRequest(const Requests & generic_requests, const ACLs & default_acls);
 
     void writeImpl(WriteBuffer & out) const override;
+    size_t sizeImpl() const override;
     void readImpl(ReadBuffer & in) override;
 
     ZooKeeperResponsePtr makeResponse() const override;
@@ -567,7 +900,7 @@ struct ZooKeeperMultiRequest final : MultiRequest, ZooKeeperRequest
     }
 };
 
-struct ZooKeeperMultiResponse final : MultiResponse, ZooKeeperResponse
+struct ZooKeeperMultiResponse : MultiResponse, ZooKeeperResponse
 {
     OpNum getOpNum() const override { return OpNum::Multi; }
 
@@ -619,6 +952,41 @@ struct ZooKeeperMultiResponse final : MultiResponse, ZooKeeperResponse
     }
 };
 
+/** Batch of Get, List and SimpleList requests in one round trip, same as multiRead of ZooKeeper 3.6.
+ *
+ * It is a read request, every sub request has its own result and a failed one does not fail the others.
+ * Failed sub requests are written as error results.
+ */
+struct ZooKeeperMultiReadRequest final : ZooKeeperMultiRequest
+{
+    OpNum getOpNum() const override { return OpNum::MultiRead; }
+    ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return true; }
+};
+
+struct ZooKeeperMultiReadResponse final : ZooKeeperMultiResponse
+{
+    using ZooKeeperMultiResponse::ZooKeeperMultiResponse;
+    OpNum getOpNum() const override { return OpNum::MultiRead; }
+};
+
+/** Batch of Create, Set and Remove requests applied in one log entry, for bulk loads.
+ *
+ * Unlike multi it is not atomic: the sub requests are applied in order, every one has its own result and a failed
+ * one does not fail or undo the others. Failed sub requests are written as error results as in MultiRead.
+ */
+struct ZooKeeperBatchWriteRequest final : ZooKeeperMultiRequest
+{
+    OpNum getOpNum() const override { return OpNum::BatchWrite; }
+    ZooKeeperResponsePtr makeResponse() const override;
+};
+
+struct ZooKeeperBatchWriteResponse final : ZooKeeperMultiResponse
+{
+    using ZooKeeperMultiResponse::ZooKeeperMultiResponse;
+    OpNum getOpNum() const override { return OpNum::BatchWrite; }
+};
+
 /// Fake internal coordination (keeper) response. Never received from client
 /// and never send to client.
 struct ZooKeeperSessionIDRequest final : ZooKeeperRequest
@@ -653,6 +1021,84 @@ struct ZooKeeperSessionIDResponse final : ZooKeeperResponse
     Coordination::OpNum getOpNum() const override { return OpNum::SessionID; }
 };
 
+/// Fake internal coordination (keeper) request, close expired sessions in one log entry.
+/// Never received from client and never send to client.
+struct ZooKeeperExpireSessionsRequest final : ZooKeeperRequest
+{
+    std::vector<int64_t> session_ids;
+
+    Coordination::OpNum getOpNum() const override { return OpNum::ExpireSessions; }
+    String getPath() const override { return {}; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+
+    Coordination::ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return false; }
+    String toString() const override
+    {
+        return "ExpireSessionsRequest, sessions " + std::to_string(session_ids.size());
+    }
+};
+
+/// Fake internal coordination (keeper) response. Every expired session gets a close response instead.
+struct ZooKeeperExpireSessionsResponse final : ZooKeeperResponse
+{
+    void readImpl(ReadBuffer &) override {}
+    void writeImpl(WriteBuffer &) const override {}
+    Coordination::OpNum getOpNum() const override { return OpNum::ExpireSessions; }
+};
+
+/// Fake internal coordination (keeper) request, remove expired TTL and container nodes in one log entry.
+/// Every path is checked again when applied. Never received from client and never send to client.
+struct ZooKeeperRemoveExpiredNodesRequest final : ZooKeeperRequest
+{
+    std::vector<String> paths;
+
+    Coordination::OpNum getOpNum() const override { return OpNum::RemoveExpiredNodes; }
+    String getPath() const override { return {}; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+
+    Coordination::ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return false; }
+    String toString() const override { return "RemoveExpiredNodesRequest, paths " + std::to_string(paths.size()); }
+};
+
+/// Fake internal coordination (keeper) response, there is no client to answer.
+struct ZooKeeperRemoveExpiredNodesResponse final : ZooKeeperResponse
+{
+    void readImpl(ReadBuffer &) override {}
+    void writeImpl(WriteBuffer &) const override {}
+    Coordination::OpNum getOpNum() const override { return OpNum::RemoveExpiredNodes; }
+};
+
+/// Fake internal coordination (keeper) request, create a session whose id is granted locally
+/// from a reserved block. Never received from client and never send to client.
+struct ZooKeeperRegisterSessionRequest final : ZooKeeperRequest
+{
+    int64_t session_timeout_ms;
+
+    Coordination::OpNum getOpNum() const override { return OpNum::RegisterSession; }
+    String getPath() const override { return {}; }
+    void writeImpl(WriteBuffer & out) const override;
+    void readImpl(ReadBuffer & in) override;
+
+    Coordination::ZooKeeperResponsePtr makeResponse() const override;
+    bool isReadRequest() const override { return false; }
+    String toString() const override
+    {
+        return "RegisterSessionRequest, timeout " + std::to_string(session_timeout_ms);
+    }
+};
+
+/// Fake internal coordination (keeper) response, never send to client.
+struct ZooKeeperRegisterSessionResponse final : ZooKeeperResponse
+{
+    void readImpl(ReadBuffer &) override {}
+    void writeImpl(WriteBuffer &) const override {}
+    Coordination::OpNum getOpNum() const override { return OpNum::RegisterSession; }
+};
+
 struct ZooKeeperSetSeqNumRequest final : SetSeqNumRequest, ZooKeeperRequest
 {
     OpNum getOpNum() const override { return OpNum::SetSeqNum; }
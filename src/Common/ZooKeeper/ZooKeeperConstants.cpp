@@ -20,10 +20,25 @@ static const std::unordered_set<int32_t> VALID_OPERATIONS =
     static_cast<int32_t>(OpNum::List),
     static_cast<int32_t>(OpNum::Check),
     static_cast<int32_t>(OpNum::Multi),
+    static_cast<int32_t>(OpNum::MultiRead),
+    static_cast<int32_t>(OpNum::CreateContainer),
+    static_cast<int32_t>(OpNum::CreateTTL),
     static_cast<int32_t>(OpNum::Auth),
     static_cast<int32_t>(OpNum::SetSeqNum),
+    static_cast<int32_t>(OpNum::SubtreeStat),
+    static_cast<int32_t>(OpNum::ExpireSessions),
+    static_cast<int32_t>(OpNum::RegisterSession),
+    static_cast<int32_t>(OpNum::ListPage),
+    static_cast<int32_t>(OpNum::RemoveRecursive),
+    static_cast<int32_t>(OpNum::RemoveExpiredNodes),
+    static_cast<int32_t>(OpNum::BatchWrite),
+    static_cast<int32_t>(OpNum::ListWithData),
     static_cast<int32_t>(OpNum::SessionID),
     static_cast<int32_t>(OpNum::SetWatches),
+    static_cast<int32_t>(OpNum::GetEphemerals),
+    static_cast<int32_t>(OpNum::GetAllChildrenNumber),
+    static_cast<int32_t>(OpNum::AddWatch),
+    static_cast<int32_t>(OpNum::RemoveWatches),
     static_cast<int32_t>(OpNum::SetACL),
     static_cast<int32_t>(OpNum::GetACL),
 };
@@ -56,16 +71,46 @@ std::string toString(OpNum op_num)
             return "Check";
         case OpNum::Multi:
             return "Multi";
+        case OpNum::MultiRead:
+            return "MultiRead";
+        case OpNum::CreateContainer:
+            return "CreateContainer";
+        case OpNum::CreateTTL:
+            return "CreateTTL";
         case OpNum::Heartbeat:
             return "Heartbeat";
         case OpNum::Auth:
             return "Auth";
         case OpNum::SetSeqNum:
             return "SetSeqNum";
+        case OpNum::SubtreeStat:
+            return "SubtreeStat";
+        case OpNum::ExpireSessions:
+            return "ExpireSessions";
+        case OpNum::RegisterSession:
+            return "RegisterSession";
+        case OpNum::ListPage:
+            return "ListPage";
+        case OpNum::RemoveRecursive:
+            return "RemoveRecursive";
+        case OpNum::RemoveExpiredNodes:
+            return "RemoveExpiredNodes";
+        case OpNum::BatchWrite:
+            return "BatchWrite";
+        case OpNum::ListWithData:
+            return "ListWithData";
         case OpNum::SessionID:
             return "SessionID";
         case OpNum::SetWatches:
             return "SetWatches";
+        case OpNum::GetEphemerals:
+            return "GetEphemerals";
+        case OpNum::GetAllChildrenNumber:
+            return "GetAllChildrenNumber";
+        case OpNum::AddWatch:
+            return "AddWatch";
+        case OpNum::RemoveWatches:
+            return "RemoveWatches";
         case OpNum::SetACL:
             return "SetACL";
         case OpNum::GetACL:
@@ -12,7 +12,14 @@ using XID = int32_t;
 static constexpr XID WATCH_XID = -1;
 static constexpr XID PING_XID  = -2;
 static constexpr XID AUTH_XID  = -4;
+static constexpr XID REGISTER_SESSION_XID = -5;
 static constexpr XID CLOSE_XID = 0x7FFFFFFF;
+/// Marks a compressed frame, see EXTENSION_COMPRESSION
+static constexpr XID COMPRESSED_XID = -100;
+/// Responses never sent to the client of a connection handed off to another process, see ConnectionHandoff:
+/// the barrier after the responses of the old process and the requests registering the watches in the new one.
+static constexpr XID HANDOFF_BARRIER_XID = -101;
+static constexpr XID HANDOFF_RESTORE_XID = -102;
 
 enum class OpNum : int32_t
 {
@@ -31,9 +38,24 @@ enum class OpNum : int32_t
     List = 12,
     Check = 13,
     Multi = 14,
+    RemoveWatches = 18,
+    CreateContainer = 19,
+    CreateTTL = 21,
+    MultiRead = 22,
     Auth = 100,
     SetWatches = 101,
+    GetEphemerals = 103,
+    GetAllChildrenNumber = 104,
+    AddWatch = 106,
     SetSeqNum = 200, /// Special internal request
+    SubtreeStat = 201, /// Extension, node count and data bytes of a subtree
+    ExpireSessions = 202, /// Special internal request, close a batch of expired sessions
+    RegisterSession = 203, /// Special internal request, create a session granted from a reserved session id block
+    ListPage = 204, /// Extension, a page of sorted children after a cursor
+    RemoveRecursive = 205, /// Extension, remove a node with its descendants
+    RemoveExpiredNodes = 206, /// Special internal request, remove a batch of expired TTL and container nodes
+    BatchWrite = 207, /// Extension, Create, Set and Remove requests applied one by one in one log entry
+    ListWithData = 208, /// Extension, a page of sorted children after a cursor with their stats and data
     SessionID = 997, /// Special internal request
 };
 
@@ -45,6 +67,15 @@ static constexpr int32_t ZOOKEEPER_PROTOCOL_VERSION = 0;
 static constexpr int32_t CLIENT_HANDSHAKE_LENGTH = 44;
 static constexpr int32_t CLIENT_HANDSHAKE_LENGTH_WITH_READONLY = 45;
 static constexpr int32_t SERVER_HANDSHAKE_LENGTH = 36;
+/// A client supporting the protocol extensions of RaftKeeper appends PROTOCOL_EXTENSIONS_MAGIC and the Int32 flags of
+/// the extensions it asks for to the handshake with readonly. Only then the server appends the magic and the flags it
+/// accepts to its handshake, plain ZooKeeper clients get the plain protocol.
+static constexpr int32_t CLIENT_HANDSHAKE_LENGTH_WITH_EXTENSIONS = 53;
+static constexpr int32_t SERVER_HANDSHAKE_LENGTH_WITH_EXTENSIONS = 44;
+static constexpr int32_t PROTOCOL_EXTENSIONS_MAGIC = 0x524B4558;
+/// Frames may be sent compressed in both directions: COMPRESSED_XID, the Int32 size of the frame after its length,
+/// and the frame after its length compressed by zlib. The server compresses frames of at least client_compression_min_bytes.
+static constexpr int32_t EXTENSION_COMPRESSION = 1;
 static constexpr int32_t PASSWORD_LENGTH = 16;
 
 /// ZooKeeper has 1 MB node size and serialization limit by default,
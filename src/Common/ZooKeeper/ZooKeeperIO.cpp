@@ -154,6 +154,14 @@ void read(std::string & s, ReadBuffer & in)
     if (size > MAX_STRING_OR_ARRAY_SIZE)
         throw Exception("Too large string size while reading from ZooKeeper", Error::ZMARSHALLINGERROR);
 
+    /// A request is parsed from the bytes received, copy them at once without filling the string first
+    if (in.available() >= static_cast<size_t>(size))
+    {
+        s.assign(in.position(), size);
+        in.position() += size;
+        return;
+    }
+
     s.resize(size);
     in.read(s.data(), size);
 }
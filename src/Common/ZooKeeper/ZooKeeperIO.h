@@ -45,6 +45,19 @@ void write(const std::vector<T> & arr, WriteBuffer & out)
         write(elem, out);
 }
 
+/// Bytes written by write of the value
+inline size_t wireSize(const std::string & s) { return sizeof(int32_t) + s.size(); }
+inline size_t wireSize(const ACL & acl) { return sizeof(acl.permissions) + wireSize(acl.scheme) + wireSize(acl.id); }
+
+template <typename T>
+size_t wireSize(const std::vector<T> & arr)
+{
+    size_t size = sizeof(int32_t);
+    for (const auto & elem : arr)
+        size += wireSize(elem);
+    return size;
+}
+
 void read(size_t & x, ReadBuffer & in);
 #ifdef __APPLE__
 void read(uint64_t & x, ReadBuffer & in);
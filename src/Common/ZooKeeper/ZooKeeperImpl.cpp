@@ -1206,6 +1206,19 @@ void ZooKeeper::setSeqNum(const String & path, int32_t seq_num, SetSeqNumCallbac
 }
 
 
+void ZooKeeper::execute(const ZooKeeperRequestPtr & request, ResponseCallback callback, WatchCallback watch)
+{
+    request->xid = 0;
+
+    RequestInfo request_info;
+    request_info.request = request;
+    request_info.callback = std::move(callback);
+    request_info.watch = std::move(watch);
+
+    pushRequest(std::move(request_info));
+}
+
+
 void ZooKeeper::close()
 {
     ZooKeeperCloseRequest request;
@@ -169,6 +169,9 @@ public:
 
     void setSeqNum(const String & path, int32_t seq_num, SetSeqNumCallback callback) override;
 
+    /// Send a request as it is, such as one replayed from a capture of the requests of a server. Its xid is assigned again.
+    void execute(const ZooKeeperRequestPtr & request, ResponseCallback callback, WatchCallback watch);
+
     /// Without forcefully invalidating (finalizing) ZooKeeper session before
     /// establishing a new one, there was a possibility that server is using
     /// two ZooKeeper sessions simultaneously in different parts of code.
@@ -0,0 +1,211 @@
+#include <Common/heapProfile.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <Poco/TemporaryFile.h>
+#include <Common/Exception.h>
+#include <Common/SymbolIndex.h>
+#include <common/demangle.h>
+
+#if USE_JEMALLOC
+#    include <jemalloc/jemalloc.h>
+#endif
+
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int SUPPORT_IS_DISABLED;
+    extern const int SYSTEM_ERROR;
+}
+
+#if USE_JEMALLOC && JEMALLOC_VERSION_MAJOR >= 5
+
+namespace
+{
+    template <typename T>
+    T readMallctl(const String & name)
+    {
+        T value{};
+        size_t size = sizeof(value);
+        if (int err = mallctl(name.c_str(), &value, &size, nullptr, 0))
+            throw Exception(ErrorCodes::SYSTEM_ERROR, "Cannot read {} of the allocator, error {}", name, err);
+        return value;
+    }
+
+    /// Profiling is compiled in and was enabled at start, it cannot be enabled later
+    void checkHeapProfile()
+    {
+        bool prof = false;
+        size_t size = sizeof(prof);
+        if (mallctl("opt.prof", &prof, &size, nullptr, 0) || !prof)
+            throw Exception(
+                ErrorCodes::SUPPORT_IS_DISABLED,
+                "The allocator has no heap profiling, it needs jemalloc built with profiling and started with prof:true");
+    }
+
+    String symbolize(const void * address, std::unordered_map<const void *, String> & symbols)
+    {
+        auto [it, inserted] = symbols.try_emplace(address);
+        if (!inserted)
+            return it->second;
+#    if defined(__ELF__) && !defined(__FreeBSD__)
+        if (const auto * symbol = SymbolIndex::instance()->findSymbol(address))
+            it->second = demangle(symbol->name);
+#    endif
+        if (it->second.empty())
+            it->second = "?";
+        return it->second;
+    }
+}
+
+void setHeapProfileActive(bool active)
+{
+    checkHeapProfile();
+    if (int err = mallctl("prof.active", nullptr, nullptr, &active, sizeof(active)))
+        throw Exception(ErrorCodes::SYSTEM_ERROR, "Cannot set prof.active of the allocator, error {}", err);
+}
+
+bool isHeapProfileActive()
+{
+    checkHeapProfile();
+    return readMallctl<bool>("prof.active");
+}
+
+String dumpHeapProfile()
+{
+    checkHeapProfile();
+
+    Poco::TemporaryFile file;
+    String path = file.path();
+    const char * path_ptr = path.c_str();
+    if (int err = mallctl("prof.dump", nullptr, nullptr, &path_ptr, sizeof(path_ptr)))
+        throw Exception(ErrorCodes::SYSTEM_ERROR, "Cannot dump the heap profile into {}, error {}", path, err);
+
+    /** heap_v2/<sample period>
+      *   t*: <objects>: <bytes> [<accumulated>]    totals, then of each thread
+      * @ <return address> ...                      a stack, innermost first
+      *   t*: <objects>: <bytes> [...]              its totals, then of each thread
+      * MAPPED_LIBRARIES:
+      */
+    std::ifstream in(path);
+    String line;
+    double sample_period = 0;
+    if (std::getline(in, line) && line.starts_with("heap_v2/"))
+        sample_period = std::strtod(line.c_str() + strlen("heap_v2/"), nullptr);
+
+    std::unordered_map<const void *, String> symbols;
+    std::map<String, double> stacks;
+    String stack;
+    bool expect_totals = false;
+    while (std::getline(in, line) && !line.starts_with("MAPPED_LIBRARIES:"))
+    {
+        if (line.starts_with("@ "))
+        {
+            std::vector<const void *> frames;
+            std::istringstream addresses(line.substr(2));
+            String address;
+            while (addresses >> address)
+                frames.push_back(reinterpret_cast<const void *>(std::strtoull(address.c_str(), nullptr, 16)));
+
+            stack.clear();
+            for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame)
+            {
+                if (!stack.empty())
+                    stack += ';';
+                stack += symbolize(*frame, symbols);
+            }
+            expect_totals = true;
+        }
+        else if (expect_totals && line.starts_with("  t*: "))
+        {
+            expect_totals = false;
+            char * end = nullptr;
+            double objects = std::strtod(line.c_str() + strlen("  t*: "), &end);
+            double bytes = *end == ':' ? std::strtod(end + 1, nullptr) : 0;
+            if (objects <= 0 || bytes <= 0)
+                continue;
+            /// An allocation of size s is sampled with probability 1 - exp(-s / period)
+            double scale = sample_period > 0 ? 1 / (1 - std::exp(-bytes / objects / sample_period)) : 1;
+            stacks[stack] += bytes * scale;
+        }
+    }
+
+    std::vector<std::pair<double, const String *>> sorted;
+    sorted.reserve(stacks.size());
+    for (const auto & [name, bytes] : stacks)
+        sorted.emplace_back(bytes, &name);
+    std::sort(sorted.begin(), sorted.end(), [](const auto & lhs, const auto & rhs) { return lhs.first > rhs.first; });
+
+    String collapsed;
+    for (const auto & [bytes, name] : sorted)
+        collapsed += *name + ' ' + std::to_string(static_cast<UInt64>(bytes)) + '\n';
+    return collapsed;
+}
+
+String getAllocatorStats()
+{
+    /// Statistics are cached by the allocator and refreshed by advancing the epoch
+    UInt64 epoch = 1;
+    mallctl("epoch", nullptr, nullptr, &epoch, sizeof(epoch));
+
+    String ret;
+    auto allocated = readMallctl<size_t>("stats.allocated");
+    auto active = readMallctl<size_t>("stats.active");
+    for (const auto * name : {"allocated", "active", "metadata", "resident", "mapped", "retained"})
+        ret += fmt::format("{}\t{}\n", name, readMallctl<size_t>(String("stats.") + name));
+    ret += fmt::format("fragmentation\t{:.3f}\n", active ? static_cast<double>(active - allocated) / active : 0);
+
+    auto page = readMallctl<size_t>("arenas.page");
+    auto narenas = readMallctl<unsigned>("arenas.narenas");
+    ret += fmt::format("arenas\t{}\n", narenas);
+    ret += "arena\tthreads\tactive\tdirty\tmuzzy\n";
+    for (unsigned i = 0; i < narenas; ++i)
+    {
+        if (!readMallctl<bool>("arena." + std::to_string(i) + ".initialized"))
+            continue;
+        String stats = "stats.arenas." + std::to_string(i);
+        ret += fmt::format(
+            "{}\t{}\t{}\t{}\t{}\n",
+            i,
+            readMallctl<unsigned>(stats + ".nthreads"),
+            readMallctl<size_t>(stats + ".pactive") * page,
+            readMallctl<size_t>(stats + ".pdirty") * page,
+            readMallctl<size_t>(stats + ".pmuzzy") * page);
+    }
+    return ret;
+}
+
+#else
+
+void setHeapProfileActive(bool)
+{
+    throw Exception(ErrorCodes::SUPPORT_IS_DISABLED, "Heap profiling needs jemalloc");
+}
+
+bool isHeapProfileActive()
+{
+    return false;
+}
+
+String dumpHeapProfile()
+{
+    throw Exception(ErrorCodes::SUPPORT_IS_DISABLED, "Heap profiling needs jemalloc");
+}
+
+String getAllocatorStats()
+{
+    throw Exception(ErrorCodes::SUPPORT_IS_DISABLED, "Allocator statistics need jemalloc");
+}
+
+#endif
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <common/types.h>
+
+
+namespace RK
+{
+
+/** Heap profiling and statistics of jemalloc, for memory growing on a long running server.
+  *
+  * jemalloc is built with profiling and started with prof:true,prof_active:false, so that sampling costs nothing
+  * until it is activated. While active, about one allocation in every 2^lg_prof_sample bytes records its stack,
+  * which is kept until the allocation is freed. A dump therefore covers the memory allocated while sampling was on
+  * and still in use. All of them throw SUPPORT_IS_DISABLED if the allocator has no profiling.
+  */
+
+/// Start or stop sampling allocations, the samples taken are kept until their allocations are freed
+void setHeapProfileActive(bool active);
+bool isHeapProfileActive();
+
+/** Stacks of the sampled allocations in use, symbolized by SymbolIndex, as collapsed stacks for flamegraph.pl,
+  * largest first. The bytes are estimates of all the allocations of the stack, scaled from the samples as jeprof does.
+  *     RK::KeeperStore::processRequest(...);...;operator new(unsigned long) 1048576
+  */
+String dumpHeapProfile();
+
+/** Statistics of the allocator in bytes, then the memory of each arena in use:
+  *     allocated    1073741824
+  *     fragmentation    0.043
+  *     arena    threads    active    dirty    muzzy
+  *     0    4    268435456    1048576    0
+  * fragmentation is the part of the active pages not allocated, retained is the virtual memory kept unmapped.
+  */
+String getAllocatorStats();
+
+}
@@ -0,0 +1,146 @@
+#include <Common/hugePages.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <string_view>
+#include <common/logger_useful.h>
+
+#if defined(OS_LINUX)
+#    include <sys/mman.h>
+#endif
+
+#if USE_JEMALLOC
+#    include <jemalloc/jemalloc.h>
+#endif
+
+
+namespace RK
+{
+
+static std::atomic<bool> huge_pages_enabled{false};
+
+#if defined(OS_LINUX) && USE_JEMALLOC && JEMALLOC_VERSION_MAJOR >= 5
+
+static extent_hooks_t * default_extent_hooks = nullptr;
+static extent_hooks_t huge_page_extent_hooks;
+
+/// Extents are allocated by the default hook and advised to be backed by huge pages
+static void * hugePageExtentAlloc(
+    extent_hooks_t *, void * new_addr, size_t size, size_t alignment, bool * zero, bool * commit, unsigned arena_ind)
+{
+    void * addr = default_extent_hooks->alloc(default_extent_hooks, new_addr, size, alignment, zero, commit, arena_ind);
+    if (addr)
+        adviseHugePages(addr, size);
+    return addr;
+}
+
+static bool installExtentHooks()
+{
+    size_t hooks_size = sizeof(extent_hooks_t *);
+    if (mallctl("arena.0.extent_hooks", &default_extent_hooks, &hooks_size, nullptr, 0) || !default_extent_hooks)
+        return false;
+
+    huge_page_extent_hooks = *default_extent_hooks;
+    huge_page_extent_hooks.alloc = hugePageExtentAlloc;
+
+    unsigned narenas = 0;
+    size_t narenas_size = sizeof(narenas);
+    if (mallctl("arenas.narenas", &narenas, &narenas_size, nullptr, 0))
+        return false;
+
+    /// Arenas not used yet are initialized with the hooks
+    extent_hooks_t * new_hooks = &huge_page_extent_hooks;
+    for (unsigned i = 0; i < narenas; ++i)
+    {
+        String name = "arena." + std::to_string(i) + ".extent_hooks";
+        if (mallctl(name.c_str(), nullptr, nullptr, &new_hooks, sizeof(new_hooks)))
+            return false;
+    }
+    return true;
+}
+
+#else
+
+static bool installExtentHooks()
+{
+    return false;
+}
+
+#endif
+
+bool enableHugePages()
+{
+    auto * log = &Poco::Logger::get("HugePages");
+    String mode = getTransparentHugePagesMode();
+    if (mode.empty() || mode == "never")
+    {
+        LOG_WARNING(log, "Transparent huge pages are not available (mode '{}'), memory is backed by normal pages", mode);
+        return false;
+    }
+
+    huge_pages_enabled.store(true, std::memory_order_relaxed);
+    if (!installExtentHooks())
+        LOG_WARNING(log, "Cannot install huge page extent hooks of the allocator, only large mapped regions use huge pages");
+
+    LOG_INFO(log, "Huge pages enabled, transparent huge pages mode is {}", mode);
+    return true;
+}
+
+bool hugePagesEnabled()
+{
+    return huge_pages_enabled.load(std::memory_order_relaxed);
+}
+
+void adviseHugePages(void * addr, size_t size)
+{
+#if defined(OS_LINUX)
+    if (!huge_pages_enabled.load(std::memory_order_relaxed))
+        return;
+
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(addr) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + size) & ~(HUGE_PAGE_SIZE - 1);
+    /// Not worth it, or the advice failed, then the memory just stays on normal pages
+    if (begin < end)
+        ::madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+#else
+    (void)addr;
+    (void)size;
+#endif
+}
+
+String getTransparentHugePagesMode()
+{
+#if defined(OS_LINUX)
+    /// e.g. "always [madvise] never", the mode in use is in brackets
+    std::ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+    String line;
+    if (!std::getline(in, line))
+        return {};
+    auto begin = line.find('[');
+    auto end = line.find(']', begin);
+    if (begin == String::npos || end == String::npos)
+        return {};
+    return line.substr(begin + 1, end - begin - 1);
+#else
+    return {};
+#endif
+}
+
+UInt64 getHugePagesBytes()
+{
+#if defined(OS_LINUX)
+    /// Lines such as "AnonHugePages:    10240 kB" after the header line of the rollup
+    static constexpr std::string_view key = "AnonHugePages:";
+    std::ifstream in("/proc/self/smaps_rollup");
+    String line;
+    while (std::getline(in, line))
+    {
+        if (line.starts_with(key))
+            return std::strtoull(line.c_str() + key.size(), nullptr, 10) * 1024;
+    }
+#endif
+    return 0;
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <common/types.h>
+
+
+namespace RK
+{
+
+/** Backing long-lived memory by 2 MB transparent huge pages, so that walking a large data tree misses
+  * the TLB less.
+  *
+  * enableHugePages installs extent hooks which advise MADV_HUGEPAGE for every jemalloc arena, that covers
+  * nodes, values and the Raft log entry cache, and Allocator advises the large regions it maps itself.
+  * Nothing is changed if transparent huge pages are not available.
+  */
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/// Back memory allocated from now on by huge pages, false if the system has none
+bool enableHugePages();
+bool hugePagesEnabled();
+
+/// Advise the huge page aligned part of the region to be backed by huge pages, if they are enabled
+void adviseHugePages(void * addr, size_t size);
+
+/// Transparent huge pages mode of the system, always, madvise or never, empty if not supported
+String getTransparentHugePagesMode();
+
+/// Anonymous memory of the process backed by huge pages
+UInt64 getHugePagesBytes();
+
+}
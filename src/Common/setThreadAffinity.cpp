@@ -0,0 +1,24 @@
+#include <Common/setThreadAffinity.h>
+
+#if defined(OS_LINUX)
+#    include <pthread.h>
+#    include <sched.h>
+#endif
+
+
+bool setThreadAffinity(const std::vector<int> & cpus)
+{
+    if (cpus.empty())
+        return true;
+
+#if defined(OS_LINUX)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : cpus)
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpu_set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <vector>
+
+/** Pins the current thread to the given CPUs, does nothing if cpus is empty.
+  * Only supported on Linux, returns false if the affinity is not set.
+  */
+bool setThreadAffinity(const std::vector<int> & cpus);
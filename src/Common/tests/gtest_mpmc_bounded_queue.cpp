@@ -0,0 +1,57 @@
+#include <Common/MPMCBoundedQueue.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+
+using namespace RK;
+
+TEST(MPMCBoundedQueue, concurrentPushPop)
+{
+    MPMCBoundedQueue<int64_t> queue(64);
+
+    int64_t head;
+    ASSERT_FALSE(queue.peek(head));
+    ASSERT_TRUE(queue.push(1));
+    ASSERT_TRUE(queue.push(2));
+    ASSERT_TRUE(queue.peek(head));
+    ASSERT_EQ(head, 1);
+    std::vector<int64_t> batch;
+    ASSERT_EQ(queue.tryPopMany(batch, 10), 2);
+    ASSERT_EQ(batch, std::vector<int64_t>({1, 2}));
+    ASSERT_FALSE(queue.tryPopMicro(head, 100));
+
+    /// The ring is much smaller than what is pushed, producers and consumers have to wait for each other
+    static constexpr int64_t PER_PRODUCER = 20000;
+    std::atomic<int64_t> sum{0};
+    std::atomic<int64_t> popped{0};
+    std::vector<std::thread> threads;
+    for (int64_t producer = 0; producer < 4; ++producer)
+        threads.emplace_back([&queue, producer]
+        {
+            for (int64_t i = 1; i <= PER_PRODUCER; ++i)
+                queue.push(producer * PER_PRODUCER + i);
+        });
+    for (int consumer = 0; consumer < 4; ++consumer)
+        threads.emplace_back([&]
+        {
+            int64_t value;
+            while (queue.pop(value))
+            {
+                sum += value;
+                popped++;
+            }
+        });
+
+    for (size_t i = 0; i < 4; ++i)
+        threads[i].join();
+    while (!queue.empty())
+        std::this_thread::yield();
+    queue.finish();
+    for (size_t i = 4; i < threads.size(); ++i)
+        threads[i].join();
+
+    int64_t count = 4 * PER_PRODUCER;
+    ASSERT_EQ(popped, count);
+    ASSERT_EQ(sum, count * (count + 1) / 2);
+    ASSERT_FALSE(queue.push(1));
+}
@@ -106,6 +106,14 @@ void ACLMap::addUsage(uint64_t acl_id, uint64_t count)
     usage_counter[acl_id] += count;
 }
 
+uint64_t ACLMap::convertACLsAndAddUsage(const Coordination::ACLs & acls)
+{
+    std::lock_guard lock(acl_mutex);
+    uint64_t acl_id = convertACLs(acls);
+    addUsage(acl_id);
+    return acl_id;
+}
+
 void ACLMap::removeUsage(uint64_t acl_id)
 {
     std::lock_guard lock(acl_mutex);
@@ -122,6 +130,20 @@ void ACLMap::removeUsage(uint64_t acl_id)
         usage_counter.erase(acl_id);
     }
 }
+uint64_t ACLMap::sizeInBytes() const
+{
+    std::lock_guard lock(acl_mutex);
+    uint64_t bytes = 0;
+    for (const auto & [acl_id, acls] : num_to_acl)
+    {
+        uint64_t acls_bytes = sizeof(Coordination::ACLs) + sizeof(uint64_t);
+        for (const auto & acl : acls)
+            acls_bytes += sizeof(Coordination::ACL) + acl.scheme.size() + acl.id.size();
+        bytes += 2 * acls_bytes;
+    }
+    return bytes + usage_counter.size() * 2 * sizeof(uint64_t);
+}
+
 bool ACLMap::operator==(const ACLMap & rhs) const
 {
 
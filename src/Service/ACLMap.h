@@ -1,4 +1,5 @@
 #pragma once
+#include <Common/ProfilingMutex.h>
 #include <Common/ZooKeeper/ZooKeeperCommon.h>
 #include <Common/ZooKeeper/IKeeper.h>
 #include <unordered_map>
@@ -31,7 +32,7 @@ private:
     ACLToNumMap acl_to_num;
     NumToACLMap num_to_acl;
     UsageCounter usage_counter;
-    mutable std::recursive_mutex acl_mutex;
+    mutable ProfilingMutex<std::recursive_mutex, LockProfiler::StoreACL> acl_mutex;
     uint64_t max_acl_id{1};
 public:
 
@@ -62,6 +63,13 @@ public:
     void addUsage(uint64_t acl_id, uint64_t count = 1);
     void removeUsage(uint64_t acl_id);
 
+    /// convertACLs and addUsage atomically, so that a concurrent removeUsage
+    /// can not drop the mapping between them.
+    uint64_t convertACLsAndAddUsage(const Coordination::ACLs & acls);
+
+    /// Memory of all ACLs, id mapping is counted twice for it is kept in both directions.
+    uint64_t sizeInBytes() const;
+
     bool operator==(const ACLMap & rhs) const;
     bool operator!=(const ACLMap & rhs) const;
 };
@@ -0,0 +1,98 @@
+#include <Service/ACLPermissionCache.h>
+
+namespace RK
+{
+
+ACLPermissionCache::ACLPermissionCache() : buckets(new std::atomic<Entry *>[BUCKETS])
+{
+    for (size_t i = 0; i < BUCKETS; ++i)
+        buckets[i].store(nullptr, std::memory_order_relaxed);
+}
+
+ACLPermissionCache::~ACLPermissionCache()
+{
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        Entry * entry = buckets[i].load(std::memory_order_relaxed);
+        while (entry)
+        {
+            Entry * next = entry->next.load(std::memory_order_relaxed);
+            delete entry;
+            entry = next;
+        }
+    }
+}
+
+const ACLPermissionCache::Entry * ACLPermissionCache::find(int64_t session_id) const
+{
+    const Entry * entry = buckets[bucketIndex(session_id)].load(std::memory_order_acquire);
+    while (entry && entry->session_id != session_id)
+        entry = entry->next.load(std::memory_order_acquire);
+    return entry;
+}
+
+bool ACLPermissionCache::get(int64_t session_id, uint64_t acl_id, int32_t & permissions) const
+{
+    EpochGuard guard;
+    const Entry * entry = find(session_id);
+    if (!entry)
+        return false;
+
+    UInt64 slot = entry->slots[acl_id % SLOTS].load(std::memory_order_relaxed);
+    if (!slot || slot >> PERMISSION_BITS != acl_id)
+        return false;
+    permissions = static_cast<int32_t>(slot & ((1 << PERMISSION_BITS) - 1));
+    return true;
+}
+
+void ACLPermissionCache::put(int64_t session_id, uint64_t acl_id, int32_t permissions)
+{
+    if (acl_id == 0)
+        return;
+
+    std::lock_guard lock(write_mutex);
+    auto & head = buckets[bucketIndex(session_id)];
+    Entry * entry = const_cast<Entry *>(find(session_id));
+    if (!entry)
+    {
+        entry = new Entry(session_id, head.load(std::memory_order_relaxed));
+        head.store(entry, std::memory_order_release);
+        session_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    entry->slots[acl_id % SLOTS].store(acl_id << PERMISSION_BITS | static_cast<UInt64>(permissions), std::memory_order_relaxed);
+}
+
+void ACLPermissionCache::erase(int64_t session_id)
+{
+    std::lock_guard lock(write_mutex);
+    auto & head = buckets[bucketIndex(session_id)];
+    for (std::atomic<Entry *> * link = &head; Entry * entry = link->load(std::memory_order_relaxed); link = &entry->next)
+    {
+        if (entry->session_id == session_id)
+        {
+            /// Readers standing on entry can still walk to its successors until it is reclaimed
+            link->store(entry->next.load(std::memory_order_relaxed), std::memory_order_release);
+            EpochReclaimer::instance().retire(entry);
+            session_count.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+void ACLPermissionCache::clear()
+{
+    std::lock_guard lock(write_mutex);
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        Entry * entry = buckets[i].exchange(nullptr, std::memory_order_acq_rel);
+        while (entry)
+        {
+            Entry * next = entry->next.load(std::memory_order_relaxed);
+            EpochReclaimer::instance().retire(entry);
+            entry = next;
+        }
+    }
+    session_count.store(0, std::memory_order_relaxed);
+}
+
+}
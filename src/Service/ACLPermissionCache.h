@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <Service/EpochReclaimer.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Permissions of sessions on the ACL ids of nodes, so that checking the ACL of a request takes no lock and
+ * no allocation once the session has checked the same ACL id before.
+ *
+ * The ACLs of an id never change, SetACL gives the node another id, so the permission mask of a session on an
+ * id stays valid until the auth of the session changes. A session has an entry with a few direct mapped slots,
+ * each of them an atomic word packing an ACL id and its mask. Readers find the entry of a session in a chained
+ * hash table of atomic pointers inside an EpochGuard, as ConcurrentMap.
+ *
+ * Masks are computed and put by the caller with the auth of the session read under KeeperStore::auth_mutex
+ * shared, and writers of the auth erase the entry of the session under it exclusive, so that a put never
+ * publishes a mask of stale auth.
+ */
+class ACLPermissionCache
+{
+public:
+    /// ACL ids cached per session, one cache line
+    static constexpr size_t SLOTS = 8;
+    static constexpr size_t BUCKETS = 4096;
+
+    ACLPermissionCache();
+    ~ACLPermissionCache();
+
+    ACLPermissionCache(const ACLPermissionCache &) = delete;
+    ACLPermissionCache & operator=(const ACLPermissionCache &) = delete;
+
+    /// Permission mask of session on acl_id, false if it is not cached. acl_id 0 is never cached.
+    bool get(int64_t session_id, uint64_t acl_id, int32_t & permissions) const;
+
+    /// Cache the mask of session on acl_id, evicting the id in its slot
+    void put(int64_t session_id, uint64_t acl_id, int32_t permissions);
+
+    /// The auth of session changed or the session is closed
+    void erase(int64_t session_id);
+
+    /// ACL ids may have been remapped, e.g. by loading a snapshot
+    void clear();
+
+    /// Sessions with an entry
+    size_t size() const { return session_count.load(std::memory_order_relaxed); }
+
+private:
+    /// ACL permissions fit in the low bits, see Coordination::ACL::All
+    static constexpr UInt64 PERMISSION_BITS = 5;
+
+    struct Entry
+    {
+        explicit Entry(int64_t session_id_, Entry * next_) : session_id(session_id_), next(next_) { }
+
+        const int64_t session_id;
+        /// Not owned, an unlinked entry is freed alone and its successors are untouched
+        std::atomic<Entry *> next;
+        /// acl_id << PERMISSION_BITS | permissions, 0 if empty
+        std::atomic<UInt64> slots[SLOTS]{};
+    };
+
+    static size_t bucketIndex(int64_t session_id) { return std::hash<int64_t>{}(session_id) & (BUCKETS - 1); }
+
+    const Entry * find(int64_t session_id) const;
+
+    std::unique_ptr<std::atomic<Entry *>[]> buckets;
+    std::atomic<size_t> session_count{0};
+    /// Serializes writers, readers take no lock
+    std::mutex write_mutex;
+};
+
+}
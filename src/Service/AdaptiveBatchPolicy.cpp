@@ -0,0 +1,104 @@
+#include <Service/AdaptiveBatchPolicy.h>
+#include <algorithm>
+
+namespace RK
+{
+
+AdaptiveBatchPolicy::AdaptiveBatchPolicy(UInt64 max_batch_size_, UInt64 max_batch_bytes_, UInt64 latency_target_us_)
+    : max_batch_size(std::max<UInt64>(1, max_batch_size_))
+    , max_batch_bytes(max_batch_bytes_)
+    , latency_target_us(latency_target_us_)
+    , batch_size(latency_target_us ? std::min<UInt64>(MIN_BATCH_SIZE, max_batch_size) : max_batch_size)
+    , stat_batch_size(batch_size)
+{
+    latencies.reserve(LATENCY_WINDOW);
+}
+
+void AdaptiveBatchPolicy::setLimits(UInt64 max_batch_size_, UInt64 max_batch_bytes_, UInt64 latency_target_us_)
+{
+    max_batch_size = std::max<UInt64>(1, max_batch_size_);
+    max_batch_bytes = max_batch_bytes_;
+    latency_target_us = latency_target_us_;
+    /// Adapting goes on from the current size, a fixed size is max_batch_size
+    batch_size = latency_target_us ? std::min<UInt64>(batch_size, max_batch_size) : max_batch_size;
+    stat_batch_size.store(batch_size, std::memory_order_relaxed);
+}
+
+UInt64 AdaptiveBatchPolicy::lingerMicroseconds() const
+{
+    if (!latency_target_us || interarrival_us <= 0)
+        return 0;
+
+    /// Spend at most a quarter of the headroom under the target on waiting
+    UInt64 headroom = latency_target_us > p99_latency_us ? (latency_target_us - p99_latency_us) / 4 : 0;
+    auto expected = static_cast<UInt64>(interarrival_us * 2);
+    return expected <= headroom ? expected : 0;
+}
+
+void AdaptiveBatchPolicy::onArrival(size_t count, UInt64 now_us)
+{
+    if (!count)
+        return;
+
+    if (last_arrival_us && now_us > last_arrival_us)
+    {
+        double sample = static_cast<double>(now_us - last_arrival_us) / count;
+        interarrival_us = interarrival_us > 0 ? interarrival_us * 0.875 + sample * 0.125 : sample;
+    }
+    last_arrival_us = now_us;
+}
+
+void AdaptiveBatchPolicy::onFlush(size_t count, FlushReason reason)
+{
+    if (reason == SIZE)
+        ++full_flushes;
+    stat_last_batch_size.store(count, std::memory_order_relaxed);
+    stat_flushes[reason].fetch_add(1, std::memory_order_relaxed);
+}
+
+void AdaptiveBatchPolicy::onCommitted(UInt64 latency_us)
+{
+    if (!latency_target_us)
+        return;
+
+    if (latencies.size() < LATENCY_WINDOW)
+        latencies.push_back(latency_us);
+    else
+        latencies[next_latency] = latency_us;
+    next_latency = (next_latency + 1) % LATENCY_WINDOW;
+
+    /// Adapt once for every few batches, so that one slow batch does not decide
+    if (++committed_since_adapt >= 8)
+        adapt();
+}
+
+void AdaptiveBatchPolicy::adapt()
+{
+    std::vector<UInt64> sorted = latencies;
+    auto p99 = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), p99, sorted.end());
+    p99_latency_us = *p99;
+
+    if (p99_latency_us > latency_target_us)
+        batch_size = std::max<size_t>(std::min<UInt64>(MIN_BATCH_SIZE, max_batch_size), batch_size * 3 / 4);
+    else if (p99_latency_us < latency_target_us / 2 && full_flushes > 0)
+        batch_size = std::min<size_t>(max_batch_size, batch_size + batch_size / 4 + 1);
+
+    committed_since_adapt = 0;
+    full_flushes = 0;
+    stat_batch_size.store(batch_size, std::memory_order_relaxed);
+    stat_p99_latency_us.store(p99_latency_us, std::memory_order_relaxed);
+}
+
+AdaptiveBatchPolicy::Stats AdaptiveBatchPolicy::getStats() const
+{
+    Stats stats;
+    stats.batch_size = stat_batch_size.load(std::memory_order_relaxed);
+    stats.last_batch_size = stat_last_batch_size.load(std::memory_order_relaxed);
+    stats.p99_commit_latency_us = stat_p99_latency_us.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < 3; ++i)
+        stats.flushes[i] = stat_flushes[i].load(std::memory_order_relaxed);
+    return stats;
+}
+
+}
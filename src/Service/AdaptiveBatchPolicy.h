@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Size of write batches of RequestAccumulator, chosen from observed commit latency and arrival rate.
+ *
+ * Without a latency target batches are max_batch_size requests at most and flushed as soon as the
+ * queue is drained, same as before. With a target, the batch size grows while the p99 commit latency
+ * of recent batches is well under the target and batches are filled up, and shrinks once the p99
+ * goes over the target. When the queue is drained the accumulator lingers for the next request only
+ * if requests arrive faster than the latency headroom, so light load never waits.
+ *
+ * Not thread safe except getStats, every accumulator runner has its own policy.
+ */
+class AdaptiveBatchPolicy
+{
+public:
+    enum FlushReason : uint8_t
+    {
+        /// Batch reached its size or byte limit
+        SIZE = 0,
+        /// Linger time passed
+        TIME = 1,
+        /// Queue was drained
+        IDLE = 2,
+    };
+
+    struct Stats
+    {
+        UInt64 batch_size;
+        UInt64 last_batch_size;
+        UInt64 p99_commit_latency_us;
+        UInt64 flushes[3];
+    };
+
+    static constexpr size_t MIN_BATCH_SIZE = 16;
+    /// Commit latencies kept for p99
+    static constexpr size_t LATENCY_WINDOW = 128;
+
+    /// latency_target_us 0 disables adapting, max_batch_bytes 0 means no byte limit.
+    AdaptiveBatchPolicy(UInt64 max_batch_size_, UInt64 max_batch_bytes_, UInt64 latency_target_us_);
+
+    size_t batchSize() const { return batch_size; }
+    bool isFull(size_t count, UInt64 bytes) const { return count >= batch_size || (max_batch_bytes && bytes >= max_batch_bytes); }
+
+    /// How long to wait for more requests when the queue is drained, 0 means flush at once.
+    UInt64 lingerMicroseconds() const;
+
+    /// count requests arrived at now_us.
+    void onArrival(size_t count, UInt64 now_us);
+    void onFlush(size_t count, FlushReason reason);
+    /// A batch is committed latency_us after submitted.
+    void onCommitted(UInt64 latency_us);
+
+    Stats getStats() const;
+
+    /// Change the limits, takes effect from the next batch
+    void setLimits(UInt64 max_batch_size_, UInt64 max_batch_bytes_, UInt64 latency_target_us_);
+
+private:
+    void adapt();
+
+    UInt64 max_batch_size;
+    UInt64 max_batch_bytes;
+    UInt64 latency_target_us;
+
+    size_t batch_size;
+
+    /// Exponentially weighted average of time between requests
+    double interarrival_us = 0;
+    UInt64 last_arrival_us = 0;
+
+    std::vector<UInt64> latencies;
+    size_t next_latency = 0;
+    size_t committed_since_adapt = 0;
+    UInt64 p99_latency_us = 0;
+    /// Batches flushed by SIZE since the last adapt
+    size_t full_flushes = 0;
+
+    std::atomic<UInt64> stat_batch_size;
+    std::atomic<UInt64> stat_last_batch_size{0};
+    std::atomic<UInt64> stat_p99_latency_us{0};
+    std::atomic<UInt64> stat_flushes[3]{};
+};
+
+}
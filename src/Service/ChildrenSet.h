@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <string_view>
+#include <vector>
+#include <common/types.h>
+
+namespace RK
+{
+
+/// Heap memory held by a string, 0 if it fits in the small string buffer.
+inline size_t getStringHeapBytes(const String & str)
+{
+    const char * begin = reinterpret_cast<const char *>(&str);
+    if (str.data() >= begin && str.data() < begin + sizeof(String))
+        return 0;
+    return str.capacity() + 1;
+}
+
+/** Children base names of a znode, always in sorted order.
+ *
+ * Most znodes are leaves, so an empty set holds no container at all. A small fan-out is kept
+ * in a sorted vector which is much more compact than a tree, the vector is converted to an
+ * ordered set when it grows beyond MAX_VECTOR_SIZE and converted back when it shrinks below
+ * half of it. Being ordered, a page of a huge directory costs O(page + log n) and listing
+ * all children needs no sorting.
+ */
+class ChildrenSet
+{
+public:
+    using Vector = std::vector<String>;
+    using SortedSet = std::set<String, std::less<>>;
+
+    static constexpr size_t MAX_VECTOR_SIZE = 32;
+
+    ChildrenSet() = default;
+    ChildrenSet(const ChildrenSet & other) { copyFrom(other); }
+    ChildrenSet(ChildrenSet && other) noexcept = default;
+
+    ChildrenSet & operator=(const ChildrenSet & other)
+    {
+        if (this != &other)
+            copyFrom(other);
+        return *this;
+    }
+    ChildrenSet & operator=(ChildrenSet && other) noexcept = default;
+
+    bool insert(const String & child)
+    {
+        if (sorted_set)
+            return sorted_set->insert(child).second;
+
+        if (!vector)
+            vector = std::make_unique<Vector>();
+
+        auto it = std::lower_bound(vector->begin(), vector->end(), child);
+        if (it != vector->end() && *it == child)
+            return false;
+
+        if (vector->size() >= MAX_VECTOR_SIZE)
+        {
+            sorted_set = std::make_unique<SortedSet>(vector->begin(), vector->end());
+            vector.reset();
+            return sorted_set->insert(child).second;
+        }
+
+        vector->insert(it, child);
+        return true;
+    }
+
+    bool erase(const String & child)
+    {
+        if (sorted_set)
+        {
+            if (!sorted_set->erase(child))
+                return false;
+            if (sorted_set->size() <= MAX_VECTOR_SIZE / 2)
+            {
+                vector = std::make_unique<Vector>(sorted_set->begin(), sorted_set->end());
+                sorted_set.reset();
+            }
+            return true;
+        }
+
+        if (!vector)
+            return false;
+
+        auto it = std::lower_bound(vector->begin(), vector->end(), child);
+        if (it == vector->end() || *it != child)
+            return false;
+
+        vector->erase(it);
+        if (vector->empty())
+            vector.reset();
+        return true;
+    }
+
+    bool contains(const String & child) const
+    {
+        if (sorted_set)
+            return sorted_set->contains(child);
+        if (vector)
+            return std::binary_search(vector->begin(), vector->end(), child);
+        return false;
+    }
+
+    size_t size() const
+    {
+        if (sorted_set)
+            return sorted_set->size();
+        return vector ? vector->size() : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    /// Call f for every child in sorted order.
+    template <typename F>
+    void forEach(F && f) const
+    {
+        if (sorted_set)
+        {
+            for (const auto & child : *sorted_set)
+                f(child);
+        }
+        else if (vector)
+        {
+            for (const auto & child : *vector)
+                f(child);
+        }
+    }
+
+    /** Call f for children greater than start_after and beginning with prefix in sorted order, limit of them at most.
+     * Return whether there are more such children after the last one.
+     */
+    template <typename F>
+    bool forEachPage(std::string_view start_after, std::string_view prefix, size_t limit, F && f) const
+    {
+        if (sorted_set)
+            return forEachPageImpl(*sorted_set, start_after, prefix, limit, f);
+        if (vector)
+            return forEachPageImpl(*vector, start_after, prefix, limit, f);
+        return false;
+    }
+
+    bool operator==(const ChildrenSet & rhs) const
+    {
+        if (size() != rhs.size())
+            return false;
+        bool equal = true;
+        forEach([&](const String & child) { equal = equal && rhs.contains(child); });
+        return equal;
+    }
+    bool operator!=(const ChildrenSet & rhs) const { return !(*this == rhs); }
+
+    /// Heap memory held by the set, not include sizeof(ChildrenSet).
+    uint64_t sizeInBytes() const
+    {
+        uint64_t bytes = 0;
+        if (sorted_set)
+        {
+            /// one tree node per element (three pointers, color, value)
+            bytes += sizeof(SortedSet) + sorted_set->size() * (sizeof(String) + 4 * sizeof(void *));
+        }
+        else if (vector)
+        {
+            bytes += sizeof(Vector) + vector->capacity() * sizeof(String);
+        }
+        forEach([&bytes](const String & child) { bytes += getStringHeapBytes(child); });
+        return bytes;
+    }
+
+private:
+    static auto lowerBound(const Vector & children, std::string_view key) { return std::lower_bound(children.begin(), children.end(), key); }
+    static auto upperBound(const Vector & children, std::string_view key) { return std::upper_bound(children.begin(), children.end(), key); }
+    static auto lowerBound(const SortedSet & children, std::string_view key) { return children.lower_bound(key); }
+    static auto upperBound(const SortedSet & children, std::string_view key) { return children.upper_bound(key); }
+
+    template <typename Children, typename F>
+    static bool forEachPageImpl(const Children & children, std::string_view start_after, std::string_view prefix, size_t limit, F & f)
+    {
+        /// Skip to the first child after start_after which may begin with prefix
+        auto it = prefix > start_after ? lowerBound(children, prefix) : upperBound(children, start_after);
+        for (size_t count = 0; it != children.end(); ++it, ++count)
+        {
+            if (std::string_view(*it).substr(0, prefix.size()) != prefix)
+                return false;
+            if (count == limit)
+                return true;
+            f(*it);
+        }
+        return false;
+    }
+
+    void copyFrom(const ChildrenSet & other)
+    {
+        vector = other.vector ? std::make_unique<Vector>(*other.vector) : nullptr;
+        sorted_set = other.sorted_set ? std::make_unique<SortedSet>(*other.sorted_set) : nullptr;
+    }
+
+    /// At most one of them is not null
+    std::unique_ptr<Vector> vector;
+    std::unique_ptr<SortedSet> sorted_set;
+};
+
+}
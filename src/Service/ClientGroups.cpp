@@ -0,0 +1,102 @@
+#include <Service/ClientGroups.h>
+#include <algorithm>
+#include <Common/Exception.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int UNKNOWN_SETTING;
+}
+
+ClientGroups::ClientGroups()
+{
+    groups.push_back({"default", 1, {}, {}, {}});
+}
+
+void ClientGroups::configure(const std::vector<ClientGroupSettings> & settings, UInt64 default_weight)
+{
+    if (settings.size() + 1 > MAX_GROUPS)
+        throw Exception(ErrorCodes::UNKNOWN_SETTING, "Too many client groups {}, at most {}", settings.size(), MAX_GROUPS - 1);
+
+    groups.resize(1);
+    groups[DEFAULT].weight = std::max(default_weight, static_cast<UInt64>(1));
+    for (const auto & setting : settings)
+    {
+        Group group{setting.name, std::max(setting.weight, static_cast<UInt64>(1)), {}, setting.auths, setting.path_prefixes};
+        for (const auto & network : setting.networks)
+        {
+            auto slash = network.find('/');
+            Poco::Net::IPAddress address;
+            if (!Poco::Net::IPAddress::tryParse(network.substr(0, slash), address))
+                throw Exception(ErrorCodes::UNKNOWN_SETTING, "Invalid network {} of client group {}", network, setting.name);
+            unsigned prefix_length = slash == String::npos ? address.length() * 8 : std::stoul(network.substr(slash + 1));
+            group.networks.emplace_back(address, Poco::Net::IPAddress(prefix_length, address.family()));
+        }
+        groups.push_back(std::move(group));
+    }
+}
+
+std::vector<UInt64> ClientGroups::weights() const
+{
+    std::vector<UInt64> ret;
+    for (const auto & group : groups)
+        ret.push_back(group.weight);
+    return ret;
+}
+
+size_t ClientGroups::ofAddress(const Poco::Net::IPAddress & address) const
+{
+    for (size_t i = 1; i < groups.size(); ++i)
+        for (const auto & [network, mask] : groups[i].networks)
+            if (address.family() == network.family() && (address & mask) == (network & mask))
+                return i;
+    return DEFAULT;
+}
+
+size_t ClientGroups::ofAuth(const String & scheme, const String & data) const
+{
+    /// The data of digest is user:password
+    String id = scheme + ':' + (scheme == "digest" ? data.substr(0, data.find(':')) : data);
+    for (size_t i = 1; i < groups.size(); ++i)
+        if (std::find(groups[i].auths.begin(), groups[i].auths.end(), id) != groups[i].auths.end())
+            return i;
+    return DEFAULT;
+}
+
+size_t ClientGroups::ofPath(const String & path) const
+{
+    for (size_t i = 1; i < groups.size(); ++i)
+    {
+        for (const auto & prefix : groups[i].path_prefixes)
+        {
+            /// /a matches /a and /a/b but not /ab
+            if (path.starts_with(prefix) && (path.size() == prefix.size() || path[prefix.size()] == '/' || prefix.ends_with('/')))
+                return i;
+        }
+    }
+    return DEFAULT;
+}
+
+size_t ClientGroups::ofRequest(size_t group, const Coordination::ZooKeeperRequest & request, bool & path_checked) const
+{
+    if (groups.size() == 1)
+        return DEFAULT;
+
+    if (request.getOpNum() == Coordination::OpNum::Auth)
+    {
+        const auto & auth = static_cast<const Coordination::ZooKeeperAuthRequest &>(request);
+        return merge(group, ofAuth(auth.scheme, auth.data));
+    }
+    if (path_checked)
+        return group;
+
+    String path = request.getPath();
+    if (path.empty())
+        return group;
+    path_checked = true;
+    return merge(group, ofPath(path));
+}
+
+}
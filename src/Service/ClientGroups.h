@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <Poco/Net/IPAddress.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/// Clients of a group of Settings::client_groups, see ClientGroups
+struct ClientGroupSettings
+{
+    String name;
+    UInt64 weight;
+    /// Client networks, such as 10.0.0.0/8
+    std::vector<String> networks;
+    /// scheme:id of auth requests, such as digest:discovery, the id of digest is the user name
+    std::vector<String> auths;
+    /// Path prefixes, such as the chroot of the clients
+    std::vector<String> path_prefixes;
+};
+
+/** Groups of clients sharing the request threads by weight, see PriorityRequestsQueue.
+ *
+ * A connection belongs to the first configured group matching its client address, an identity it sent an auth
+ * request for, or the path of its first request with a path, a client with a chroot prefixes all its paths by it.
+ * Groups are numbered from 1 in the order of configuration, DEFAULT is of the clients matching none.
+ */
+class ClientGroups
+{
+public:
+    static constexpr size_t DEFAULT = 0;
+    /// Groups popped by a request thread are tracked in a bit mask
+    static constexpr size_t MAX_GROUPS = 64;
+
+    ClientGroups();
+
+    /// Throw UNKNOWN_SETTING if a network is invalid or there are too many groups
+    void configure(const std::vector<ClientGroupSettings> & settings, UInt64 default_weight);
+
+    size_t size() const { return groups.size(); }
+    const String & name(size_t group) const { return groups[group].name; }
+    UInt64 weight(size_t group) const { return groups[group].weight; }
+    std::vector<UInt64> weights() const;
+
+    /// DEFAULT if none matches
+    size_t ofAddress(const Poco::Net::IPAddress & address) const;
+    size_t ofAuth(const String & scheme, const String & data) const;
+    size_t ofPath(const String & path) const;
+
+    /// Group of a connection in group once it sent request, path_checked is set by its first request with a path
+    size_t ofRequest(size_t group, const Coordination::ZooKeeperRequest & request, bool & path_checked) const;
+
+    /// Group of a connection in current which also matches candidate, the first configured one wins
+    static size_t merge(size_t current, size_t candidate)
+    {
+        if (current == DEFAULT || candidate == DEFAULT)
+            return current == DEFAULT ? candidate : current;
+        return std::min(current, candidate);
+    }
+
+private:
+    struct Group
+    {
+        String name;
+        UInt64 weight;
+        /// <network, mask>
+        std::vector<std::pair<Poco::Net::IPAddress, Poco::Net::IPAddress>> networks;
+        std::vector<String> auths;
+        std::vector<String> path_prefixes;
+    };
+
+    std::vector<Group> groups;
+};
+
+}
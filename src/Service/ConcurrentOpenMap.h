@@ -0,0 +1,417 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <Service/EpochReclaimer.h>
+#include <Service/HashedPath.h>
+#include <Common/ProfilingMutex.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Hash map sharded into blocks, with the interface of ConcurrentMap, on open addressing tables.
+ *
+ * A block is a linear probing table of cells, a cell keeps the hash and a pointer to the entry holding the key
+ * and the value. Lookups compare the hashes in the cells and touch an entry only when its hash matches, instead of
+ * walking a chain of entries, and a pair of cell and entry is smaller than an entry of a chain and its bucket.
+ *
+ * Reads are lock free: readers probe inside an EpochGuard and validate against the version of the block, as a
+ * seqlock, retrying if a writer moved cells meanwhile. Entries are never changed once published, a writer
+ * replaces the pointer and retires the old entry to EpochReclaimer. Writers of a block are serialized by its mutex.
+ *
+ * Erase shifts the following cells of the cluster back instead of leaving a tombstone, so the table does not
+ * degrade under erases. Growing is incremental: a full table is replaced by one twice as large, and every write
+ * moves a few cells of the old table until it is empty, so no write pays for the rehash of the whole block.
+ * Lookups meanwhile probe the new table and then the old one, cells moved out of the old table become tombstones
+ * there, the old table is retired when it is empty.
+ */
+template <typename Element>
+class ConcurrentOpenMap
+{
+public:
+    using SharedElement = std::shared_ptr<Element>;
+    using Action = std::function<void(const String &, const SharedElement &)>;
+
+    static constexpr UInt32 DEFAULT_BLOCK_NUM = 16;
+
+    class alignas(64) InnerMap
+    {
+    private:
+        struct Entry
+        {
+            Entry(std::string_view key_, const SharedElement & value_) : key(key_), value(value_) { }
+
+            const String key;
+            const SharedElement value;
+        };
+
+        /// Hash of a free cell
+        static constexpr size_t EMPTY = 0;
+        /// Hash of a cell moved out of or erased from the old table, probing goes on past it
+        static constexpr size_t TOMBSTONE = 1;
+
+        struct Cell
+        {
+            std::atomic<size_t> hash{EMPTY};
+            std::atomic<Entry *> entry{nullptr};
+        };
+
+        /// Does not own the entries, they are moved between tables
+        struct Table
+        {
+            explicit Table(size_t capacity_) : capacity(capacity_), mask(capacity_ - 1), cells(new Cell[capacity_]) { }
+
+            size_t home(size_t hash) const { return hash & mask; }
+
+            const size_t capacity;
+            const size_t mask;
+            std::unique_ptr<Cell[]> cells;
+        };
+
+        static constexpr size_t INITIAL_CAPACITY = 64;
+        /// Cells of the old table a write moves, enough to empty it before the new table is full
+        static constexpr size_t MIGRATE_STEP = 16;
+
+        static size_t bucketHash(std::string_view key) { return HashedPath::hashOf(key); }
+
+        /// Hash kept in a cell, out of the reserved values
+        static size_t cellHash(size_t hash) { return hash > TOMBSTONE ? hash : hash + 2; }
+
+        static bool isFull(const Table & t, size_t count) { return count + 1 > t.capacity / 4 * 3; }
+
+        static const Entry * probe(const Table & t, std::string_view key, size_t hash)
+        {
+            for (size_t i = t.home(hash);; i = (i + 1) & t.mask)
+            {
+                size_t cell_hash = t.cells[i].hash.load(std::memory_order_acquire);
+                if (cell_hash == EMPTY)
+                    return nullptr;
+                if (cell_hash == hash)
+                {
+                    const Entry * entry = t.cells[i].entry.load(std::memory_order_acquire);
+                    if (entry && entry->key == key)
+                        return entry;
+                }
+            }
+        }
+
+        /// Probe until no writer moved cells meanwhile, the entry is guarded by the EpochGuard of the caller.
+        const Entry * find(std::string_view key, size_t hash) const
+        {
+            hash = cellHash(hash);
+            for (size_t attempt = 0;; ++attempt)
+            {
+                size_t begin_version = version.load(std::memory_order_acquire);
+                if (begin_version & 1)
+                {
+                    if (attempt % 64 == 63)
+                        std::this_thread::yield();
+                    continue;
+                }
+
+                const Entry * entry = probe(*table.load(std::memory_order_acquire), key, hash);
+                if (!entry)
+                {
+                    if (const Table * old = old_table.load(std::memory_order_acquire))
+                        entry = probe(*old, key, hash);
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == begin_version)
+                    return entry;
+            }
+        }
+
+        /// Writer side, the index of the cell of key in t or t.capacity
+        static size_t findCell(const Table & t, std::string_view key, size_t hash)
+        {
+            for (size_t i = t.home(hash);; i = (i + 1) & t.mask)
+            {
+                size_t cell_hash = t.cells[i].hash.load(std::memory_order_relaxed);
+                if (cell_hash == EMPTY)
+                    return t.capacity;
+                if (cell_hash == hash && t.cells[i].entry.load(std::memory_order_relaxed)->key == key)
+                    return i;
+            }
+        }
+
+        /// Publish an entry in a free cell, readers see it or not and need no version change
+        static void insertCell(Table & t, Entry * entry, size_t hash)
+        {
+            size_t i = t.home(hash);
+            while (t.cells[i].hash.load(std::memory_order_relaxed) != EMPTY)
+                i = (i + 1) & t.mask;
+            t.cells[i].entry.store(entry, std::memory_order_relaxed);
+            t.cells[i].hash.store(hash, std::memory_order_release);
+        }
+
+        /// Erase cell i of the current table, moving back the cells of the cluster whose home is not after it.
+        /// Called between beginWrite and endWrite.
+        static void eraseCell(Table & t, size_t i)
+        {
+            for (size_t j = (i + 1) & t.mask;; j = (j + 1) & t.mask)
+            {
+                size_t cell_hash = t.cells[j].hash.load(std::memory_order_relaxed);
+                if (cell_hash == EMPTY)
+                    break;
+                /// Distance of i and of j from the home of j, the cell moves if i is on its probe path
+                size_t home = t.home(cell_hash);
+                if (((i - home) & t.mask) < ((j - home) & t.mask))
+                {
+                    t.cells[i].entry.store(t.cells[j].entry.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    t.cells[i].hash.store(cell_hash, std::memory_order_relaxed);
+                    i = j;
+                }
+            }
+            t.cells[i].hash.store(EMPTY, std::memory_order_relaxed);
+            t.cells[i].entry.store(nullptr, std::memory_order_relaxed);
+        }
+
+        /// Readers probing meanwhile retry
+        void beginWrite()
+        {
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        void endWrite() { version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+        /// Move up to MIGRATE_STEP cells of the old table to the current one, writers hold write_mutex.
+        void migrate(size_t step)
+        {
+            Table * old = old_table.load(std::memory_order_relaxed);
+            if (!old)
+                return;
+
+            Table * current = table.load(std::memory_order_relaxed);
+            beginWrite();
+            for (size_t end = std::min(old->capacity, migrate_pos + step); migrate_pos < end; ++migrate_pos)
+            {
+                Cell & cell = old->cells[migrate_pos];
+                size_t cell_hash = cell.hash.load(std::memory_order_relaxed);
+                if (cell_hash > TOMBSTONE)
+                {
+                    insertCell(*current, cell.entry.load(std::memory_order_relaxed), cell_hash);
+                    cell.hash.store(TOMBSTONE, std::memory_order_relaxed);
+                    cell.entry.store(nullptr, std::memory_order_relaxed);
+                    ++current_count;
+                }
+            }
+
+            if (migrate_pos == old->capacity)
+            {
+                old_table.store(nullptr, std::memory_order_relaxed);
+                EpochReclaimer::instance().retire(old);
+            }
+            endWrite();
+        }
+
+        void grow()
+        {
+            /// Emptied long before the current table is full, see MIGRATE_STEP
+            while (old_table.load(std::memory_order_relaxed))
+                migrate(MIGRATE_STEP);
+
+            Table * current = table.load(std::memory_order_relaxed);
+            beginWrite();
+            old_table.store(current, std::memory_order_relaxed);
+            table.store(new Table(current->capacity * 2), std::memory_order_relaxed);
+            migrate_pos = 0;
+            current_count = 0;
+            endWrite();
+        }
+
+        /// Insert or assign, writers hold write_mutex.
+        bool emplaceImpl(std::string_view key, size_t hash, const SharedElement & value)
+        {
+            hash = cellHash(hash);
+            std::lock_guard lock(write_mutex);
+            migrate(MIGRATE_STEP);
+
+            for (Table * t : {table.load(std::memory_order_relaxed), old_table.load(std::memory_order_relaxed)})
+            {
+                if (!t)
+                    continue;
+                size_t i = findCell(*t, key, hash);
+                if (i != t->capacity)
+                {
+                    Entry * replaced = t->cells[i].entry.load(std::memory_order_relaxed);
+                    t->cells[i].entry.store(new Entry(key, value), std::memory_order_release);
+                    EpochReclaimer::instance().retire(replaced);
+                    return false;
+                }
+            }
+
+            if (isFull(*table.load(std::memory_order_relaxed), current_count))
+                grow();
+            insertCell(*table.load(std::memory_order_relaxed), new Entry(key, value), hash);
+            ++current_count;
+            element_count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+    public:
+        InnerMap() : table(new Table(INITIAL_CAPACITY)) { }
+        ~InnerMap()
+        {
+            for (Table * t : {table.load(std::memory_order_relaxed), old_table.load(std::memory_order_relaxed)})
+            {
+                if (!t)
+                    continue;
+                for (size_t i = 0; i < t->capacity; ++i)
+                    delete t->cells[i].entry.load(std::memory_order_relaxed);
+                delete t;
+            }
+        }
+
+        InnerMap(const InnerMap &) = delete;
+        InnerMap & operator=(const InnerMap &) = delete;
+
+        SharedElement get(std::string_view key) { return get(key, bucketHash(key)); }
+        SharedElement get(std::string_view key, size_t hash)
+        {
+            EpochGuard guard;
+            const Entry * entry = find(key, hash);
+            return entry ? entry->value : nullptr;
+        }
+
+        /// Call f with the element without copying the shared_ptr, return false if key not exists.
+        template <typename F>
+        bool read(std::string_view key, size_t hash, F && f)
+        {
+            EpochGuard guard;
+            const Entry * entry = find(key, hash);
+            if (!entry || !entry->value)
+                return false;
+            f(static_cast<const Element &>(*entry->value));
+            return true;
+        }
+
+        bool emplace(std::string_view key, SharedElement && value) { return emplaceImpl(key, bucketHash(key), value); }
+        bool emplace(std::string_view key, const SharedElement & value) { return emplaceImpl(key, bucketHash(key), value); }
+        bool emplace(std::string_view key, size_t hash, const SharedElement & value) { return emplaceImpl(key, hash, value); }
+
+        bool erase(std::string_view key) { return erase(key, bucketHash(key)); }
+        bool erase(std::string_view key, size_t hash)
+        {
+            hash = cellHash(hash);
+            std::lock_guard lock(write_mutex);
+            migrate(MIGRATE_STEP);
+
+            Table * current = table.load(std::memory_order_relaxed);
+            Table * old = old_table.load(std::memory_order_relaxed);
+            Entry * erased = nullptr;
+
+            if (size_t i = findCell(*current, key, hash); i != current->capacity)
+            {
+                erased = current->cells[i].entry.load(std::memory_order_relaxed);
+                beginWrite();
+                eraseCell(*current, i);
+                endWrite();
+                --current_count;
+            }
+            else if (size_t j = old ? findCell(*old, key, hash) : 0; old && j != old->capacity)
+            {
+                erased = old->cells[j].entry.load(std::memory_order_relaxed);
+                beginWrite();
+                old->cells[j].hash.store(TOMBSTONE, std::memory_order_relaxed);
+                old->cells[j].entry.store(nullptr, std::memory_order_relaxed);
+                endWrite();
+            }
+
+            if (!erased)
+                return false;
+            EpochReclaimer::instance().retire(erased);
+            element_count.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        size_t size() const { return element_count.load(std::memory_order_relaxed); }
+
+        /// Writers of the block wait until it finishes.
+        void forEach(const Action & fn)
+        {
+            std::lock_guard lock(write_mutex);
+            for (Table * t : {table.load(std::memory_order_relaxed), old_table.load(std::memory_order_relaxed)})
+            {
+                if (!t)
+                    continue;
+                for (size_t i = 0; i < t->capacity; ++i)
+                {
+                    if (t->cells[i].hash.load(std::memory_order_relaxed) > TOMBSTONE)
+                    {
+                        const Entry * entry = t->cells[i].entry.load(std::memory_order_relaxed);
+                        fn(entry->key, entry->value);
+                    }
+                }
+            }
+        }
+
+    private:
+        /// Odd while a writer moves cells
+        alignas(64) std::atomic<size_t> version{0};
+        std::atomic<Table *> table;
+        /// The table being emptied into table after growing, nullptr if none
+        std::atomic<Table *> old_table{nullptr};
+        alignas(64) ProfilingMutex<std::mutex, LockProfiler::StoreBlock> write_mutex;
+        /// Next cell of old_table to move, and the cells used in table, only touched by writers
+        size_t migrate_pos = 0;
+        size_t current_count = 0;
+        std::atomic<size_t> element_count{0};
+    };
+
+private:
+    static UInt32 blockBits(UInt32 block_num_)
+    {
+        UInt32 bits = 0;
+        while ((1U << bits) < block_num_)
+            ++bits;
+        return bits;
+    }
+
+    const UInt32 block_num;
+    const UInt32 block_bits;
+    std::unique_ptr<InnerMap[]> maps_;
+
+    /// Blocks by the high bits of the hash, cells by the low bits
+    InnerMap & mapFor(size_t hash) { return maps_[block_bits ? hash >> (64 - block_bits) : 0]; }
+
+public:
+    /// block_num_ is rounded up to a power of two
+    explicit ConcurrentOpenMap(UInt32 block_num_ = DEFAULT_BLOCK_NUM)
+        : block_num(1U << blockBits(block_num_)), block_bits(blockBits(block_num_)), maps_(new InnerMap[block_num])
+    {
+    }
+
+    SharedElement get(const HashedPath & key) { return mapFor(key.hash).get(key.path, key.hash); }
+    SharedElement at(const HashedPath & key) { return get(key); }
+
+    /// Call f with the element under an EpochGuard, return false if key not exists.
+    template <typename F>
+    bool read(const HashedPath & key, F && f)
+    {
+        return mapFor(key.hash).read(key.path, key.hash, std::forward<F>(f));
+    }
+
+    bool emplace(const HashedPath & key, const SharedElement & value) { return mapFor(key.hash).emplace(key.path, key.hash, value); }
+    size_t count(const HashedPath & key) { return get(key) != nullptr ? 1 : 0; }
+    bool erase(const HashedPath & key) { return mapFor(key.hash).erase(key.path, key.hash); }
+
+    InnerMap & mapFor(const HashedPath & key) { return mapFor(key.hash); }
+    UInt32 getBlockNum() const { return block_num; }
+    InnerMap & getMap(const UInt32 & index) { return maps_[index]; }
+
+    size_t size() const
+    {
+        size_t s(0);
+        for (UInt32 i = 0; i < block_num; ++i)
+            s += maps_[i].size();
+        return s;
+    }
+};
+
+}
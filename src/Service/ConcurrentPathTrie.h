@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Path-compressed (radix) tree keyed by absolute znode path.
+ *
+ * Every edge holds a compressed label, so a common prefix like "/clickhouse/tables/" is
+ * stored once for the whole subtree instead of once per key as in ConcurrentMap.
+ * Lookups walk the labels and never hash the path.
+ *
+ * The contract is the same as ConcurrentMap: get / emplace (insert or assign) / erase / forEach.
+ * Writes are serialized by one shared_mutex, it is fine because all writes come from the apply thread.
+ */
+template <typename Element>
+class ConcurrentPathTrie
+{
+public:
+    using SharedElement = std::shared_ptr<Element>;
+    using Action = std::function<void(const String &, const SharedElement &)>;
+
+private:
+    struct TrieNode
+    {
+        /// Compressed edge label from parent to this node
+        String label;
+        /// Null if no key ends at this node
+        SharedElement value;
+        /// Sorted by the first char of label, first chars are unique
+        std::vector<std::unique_ptr<TrieNode>> children;
+
+        size_t findChild(char c) const
+        {
+            auto it = std::lower_bound(
+                children.begin(), children.end(), c, [](const std::unique_ptr<TrieNode> & child, char ch) { return child->label[0] < ch; });
+            if (it != children.end() && (*it)->label[0] == c)
+                return it - children.begin();
+            return NOT_FOUND;
+        }
+
+        void addChild(std::unique_ptr<TrieNode> && child)
+        {
+            auto it = std::lower_bound(
+                children.begin(),
+                children.end(),
+                child->label[0],
+                [](const std::unique_ptr<TrieNode> & node, char ch) { return node->label[0] < ch; });
+            children.insert(it, std::move(child));
+        }
+    };
+
+    static constexpr size_t NOT_FOUND = std::numeric_limits<size_t>::max();
+
+    /// Merge node with its only child if node holds no value, keeps the tree path-compressed.
+    static void tryMerge(TrieNode & node)
+    {
+        if (node.value || node.children.size() != 1)
+            return;
+        auto child = std::move(node.children[0]);
+        node.label += child->label;
+        node.value = std::move(child->value);
+        node.children = std::move(child->children);
+    }
+
+    static size_t commonPrefix(std::string_view key, size_t pos, const String & label)
+    {
+        size_t len = std::min(key.size() - pos, label.size());
+        size_t i = 0;
+        while (i < len && key[pos + i] == label[i])
+            ++i;
+        return i;
+    }
+
+    static void forEachImpl(const TrieNode & node, String & key, const Action & fn)
+    {
+        size_t key_size = key.size();
+        key += node.label;
+        if (node.value)
+            fn(key, node.value);
+        for (const auto & child : node.children)
+            forEachImpl(*child, key, fn);
+        key.resize(key_size);
+    }
+
+    const TrieNode * find(std::string_view key) const
+    {
+        const TrieNode * node = &root;
+        size_t pos = 0;
+        while (pos < key.size())
+        {
+            size_t idx = node->findChild(key[pos]);
+            if (idx == NOT_FOUND)
+                return nullptr;
+            const TrieNode * child = node->children[idx].get();
+            if (key.compare(pos, child->label.size(), child->label) != 0)
+                return nullptr;
+            pos += child->label.size();
+            node = child;
+        }
+        return node;
+    }
+
+    template <typename Value>
+    bool emplaceImpl(std::string_view key, Value && value)
+    {
+        std::unique_lock write_lock(mut_);
+        TrieNode * node = &root;
+        size_t pos = 0;
+        while (pos < key.size())
+        {
+            size_t idx = node->findChild(key[pos]);
+            if (idx == NOT_FOUND)
+            {
+                auto leaf = std::make_unique<TrieNode>();
+                leaf->label = key.substr(pos);
+                leaf->value = std::forward<Value>(value);
+                node->addChild(std::move(leaf));
+                ++element_count;
+                return true;
+            }
+
+            auto & child = node->children[idx];
+            size_t common = commonPrefix(key, pos, child->label);
+            if (common == child->label.size())
+            {
+                pos += common;
+                node = child.get();
+                continue;
+            }
+
+            /// Split the edge at the first mismatched char
+            auto mid = std::make_unique<TrieNode>();
+            mid->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            mid->children.push_back(std::move(child));
+
+            if (pos + common == key.size())
+            {
+                mid->value = std::forward<Value>(value);
+            }
+            else
+            {
+                auto leaf = std::make_unique<TrieNode>();
+                leaf->label = key.substr(pos + common);
+                leaf->value = std::forward<Value>(value);
+                mid->addChild(std::move(leaf));
+            }
+            node->children[idx] = std::move(mid);
+            ++element_count;
+            return true;
+        }
+
+        bool created = !node->value;
+        node->value = std::forward<Value>(value);
+        if (created)
+            ++element_count;
+        return created;
+    }
+
+public:
+    SharedElement get(std::string_view key)
+    {
+        std::shared_lock read_lock(mut_);
+        const TrieNode * node = find(key);
+        return node ? node->value : nullptr;
+    }
+
+    SharedElement at(std::string_view key) { return get(key); }
+
+    bool emplace(std::string_view key, SharedElement && value) { return emplaceImpl(key, std::move(value)); }
+    bool emplace(std::string_view key, const SharedElement & value) { return emplaceImpl(key, value); }
+
+    size_t count(std::string_view key) { return get(key) != nullptr ? 1 : 0; }
+
+    bool erase(std::string_view key)
+    {
+        std::unique_lock write_lock(mut_);
+
+        /// parent and child index of every edge walked
+        std::vector<std::pair<TrieNode *, size_t>> trail;
+        TrieNode * node = &root;
+        size_t pos = 0;
+        while (pos < key.size())
+        {
+            size_t idx = node->findChild(key[pos]);
+            if (idx == NOT_FOUND)
+                return false;
+            TrieNode * child = node->children[idx].get();
+            if (key.compare(pos, child->label.size(), child->label) != 0)
+                return false;
+            trail.emplace_back(node, idx);
+            pos += child->label.size();
+            node = child;
+        }
+
+        if (!node->value)
+            return false;
+
+        node->value.reset();
+        --element_count;
+
+        if (!trail.empty())
+        {
+            auto [parent, idx] = trail.back();
+            if (node->children.empty())
+            {
+                parent->children.erase(parent->children.begin() + idx);
+                if (parent != &root)
+                    tryMerge(*parent);
+            }
+            else
+            {
+                tryMerge(*node);
+            }
+        }
+        return true;
+    }
+
+    size_t size() const { return element_count.load(std::memory_order_relaxed); }
+
+    void forEach(const Action & fn)
+    {
+        std::shared_lock read_lock(mut_);
+        String key;
+        forEachImpl(root, key, fn);
+    }
+
+    std::shared_mutex & getMutex() { return mut_; }
+
+private:
+    std::shared_mutex mut_;
+    TrieNode root;
+    std::atomic<size_t> element_count{0};
+};
+
+}
@@ -0,0 +1,130 @@
+#include <Service/ConnCommon.h>
+
+#include <sys/uio.h>
+#include <IO/ReadBufferFromMemory.h>
+#include <Service/LogEntry.h>
+#include <Common/Exception.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int NETWORK_ERROR;
+    extern const int UNEXPECTED_PACKET_FROM_CLIENT;
+}
+
+GatheredSendResult sendResponsesGathered(
+    Poco::Net::StreamSocket & socket, ThreadSafeResponseQueue & responses, size_t & head_sent, size_t max_iov_count, size_t max_bytes)
+{
+    GatheredSendResult result;
+
+    /// Only the reactor thread of the connection takes from responses, so they stay valid while sending.
+    /// Buffers are never drained, so begin() does not move their data.
+    std::vector<iovec> iov;
+    size_t bytes = 0;
+    responses.forEach([&](const std::shared_ptr<FIFOBuffer> & resp) -> bool {
+        if (!resp)
+            return false;
+        size_t offset = iov.empty() ? head_sent : 0;
+        iov.push_back({resp->begin() + offset, resp->used() - offset});
+        bytes += resp->used() - offset;
+        return iov.size() < max_iov_count && bytes < max_bytes;
+    });
+
+    if (iov.empty())
+        return result;
+
+    ssize_t sent;
+    do
+        sent = ::writev(socket.impl()->sockfd(), iov.data(), iov.size());
+    while (sent < 0 && errno == EINTR);
+
+    if (sent < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            result.would_block = true;
+            return result;
+        }
+        throwFromErrno("Cannot send responses to " + socket.peerAddress().toString(), ErrorCodes::NETWORK_ERROR);
+    }
+
+    result.bytes = sent;
+    result.would_block = result.bytes < bytes;
+
+    size_t left = sent;
+    std::shared_ptr<FIFOBuffer> resp;
+    while (left > 0 && responses.peek(resp) && resp)
+    {
+        size_t rest = resp->used() - head_sent;
+        if (left >= rest)
+        {
+            left -= rest;
+            head_sent = 0;
+            responses.remove();
+            ++result.responses;
+        }
+        else
+        {
+            head_sent += left;
+            left = 0;
+        }
+    }
+    return result;
+}
+
+std::shared_ptr<FIFOBuffer> makeFrameBuffer(const Coordination::ZooKeeperResponsePtr & response)
+{
+    struct FrameBuffer
+    {
+        explicit FrameBuffer(const Coordination::ZooKeeperResponsePtr & response_)
+            : response(response_), buffer(response->frame.data(), response->frame.size())
+        {
+            buffer.advance(response->frame.size());
+        }
+
+        Coordination::ZooKeeperResponsePtr response;
+        FIFOBuffer buffer;
+    };
+
+    auto frame_buffer = std::make_shared<FrameBuffer>(response);
+    return std::shared_ptr<FIFOBuffer>(frame_buffer, &frame_buffer->buffer);
+}
+
+std::shared_ptr<FIFOBuffer> compressFrame(FIFOBuffer & frame, size_t min_bytes)
+{
+    if (frame.used() < min_bytes || frame.used() <= sizeof(int32_t))
+        return nullptr;
+
+    const char * data = frame.begin() + sizeof(int32_t);
+    size_t size = frame.used() - sizeof(int32_t);
+    String compressed;
+    if (!LogEntry::compress(data, size, compressed))
+        return nullptr;
+
+    WriteBufferFromFiFoBuffer out(3 * sizeof(int32_t) + compressed.size());
+    Coordination::write(static_cast<int32_t>(2 * sizeof(int32_t) + compressed.size()), out);
+    Coordination::write(Coordination::COMPRESSED_XID, out);
+    Coordination::write(static_cast<int32_t>(size), out);
+    out.write(compressed.data(), compressed.size());
+    return out.getBuffer();
+}
+
+void decompressFrame(const char * data, size_t size, String & out)
+{
+    Coordination::XID xid;
+    int32_t decompressed_size;
+    ReadBufferFromMemory in(data, size);
+    Coordination::read(xid, in);
+    Coordination::read(decompressed_size, in);
+    if (xid != Coordination::COMPRESSED_XID || decompressed_size < 0 || decompressed_size > Coordination::MAX_STRING_OR_ARRAY_SIZE)
+        throw Exception(ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Bad compressed frame of decompressed size {}", decompressed_size);
+
+    out.resize(decompressed_size);
+    size_t header_size = 2 * sizeof(int32_t);
+    if (!LogEntry::decompress(data + header_size, size - header_size, out.data(), out.size()))
+        throw Exception(ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Compressed frame is corrupted");
+}
+
+}
@@ -51,6 +51,31 @@ using ThreadSafeResponseQueue = ThreadSafeQueue<std::shared_ptr<FIFOBuffer>>;
 
 using ThreadSafeResponseQueuePtr = std::unique_ptr<ThreadSafeResponseQueue>;
 
+struct GatheredSendResult
+{
+    /// Responses sent completely and removed
+    size_t responses = 0;
+    size_t bytes = 0;
+    /// The socket took less than it was offered
+    bool would_block = false;
+};
+
+/** Send responses at the head of the queue by one writev, at most max_iov_count of them and not much
+  * more than max_bytes. Sent responses are removed, head_sent is the bytes of the head response sent
+  * before. Responses are never modified, so that one buffer can be queued to many connections. Stops
+  * before a nullptr response, which marks closing.
+  */
+GatheredSendResult sendResponsesGathered(
+    Poco::Net::StreamSocket & socket, ThreadSafeResponseQueue & responses, size_t & head_sent, size_t max_iov_count, size_t max_bytes);
+
+/// Response buffer over the prepared frame of response, which is kept alive by the buffer
+std::shared_ptr<FIFOBuffer> makeFrameBuffer(const Coordination::ZooKeeperResponsePtr & response);
+
+/// Frame compressed as of EXTENSION_COMPRESSION, nullptr if it is shorter than min_bytes or does not get smaller
+std::shared_ptr<FIFOBuffer> compressFrame(FIFOBuffer & frame, size_t min_bytes);
+/// Frame after its length of a compressed frame after its length, throws if it is corrupted
+void decompressFrame(const char * data, size_t size, String & out);
+
 struct LastOp;
 using LastOpMultiVersion = MultiVersion<LastOp>;
 using LastOpPtr = LastOpMultiVersion::Version;
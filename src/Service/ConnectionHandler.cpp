@@ -1,12 +1,14 @@
 #    include "ConnectionHandler.h"
 
 #    include <Service/FourLetterCommand.h>
+#    include <IO/WriteBufferFromPocoSocket.h>
 #    include <Service/formatHex.h>
 #    include <Poco/Net/NetException.h>
 #    include <Common/Stopwatch.h>
 #    include <Common/ZooKeeper/ZooKeeperCommon.h>
 #    include <Common/ZooKeeper/ZooKeeperIO.h>
 #    include <Common/setThreadName.h>
+#    include <fcntl.h>
 
 namespace RK
 {
@@ -23,41 +25,102 @@ namespace ErrorCodes
 
 using Poco::NObserver;
 
-std::mutex ConnectionHandler::conns_mutex;
-std::unordered_set<ConnectionHandler *> ConnectionHandler::connections;
+ConnectionHandler::ConnectionShard ConnectionHandler::connection_shards[CONNECTION_SHARDS];
+std::atomic<size_t> ConnectionHandler::trimmed_connections{0};
+std::atomic<ConnectionHandler::HandoffPhase> ConnectionHandler::handoff_phase{HandoffPhase::NONE};
+std::mutex ConnectionHandler::handed_off_mutex;
+std::vector<HandoffConnection> ConnectionHandler::handed_off;
+std::atomic<Int64> ConnectionHandler::trim_interval_us{0};
+
+namespace
+{
+    UInt64 nowMilliseconds()
+    {
+        return clock_gettime_ns(CLOCK_MONOTONIC_COARSE) / 1000000;
+    }
+}
 
 
 void ConnectionHandler::registerConnection(ConnectionHandler * conn)
 {
-    std::lock_guard lock(conns_mutex);
-    connections.insert(conn);
+    auto & shard = connectionShardFor(conn);
+    std::lock_guard lock(shard.mutex);
+    shard.connections.insert(conn);
 }
 
 void ConnectionHandler::unregisterConnection(ConnectionHandler * conn)
 {
-    std::lock_guard lock(conns_mutex);
-    connections.erase(conn);
+    auto & shard = connectionShardFor(conn);
+    std::lock_guard lock(shard.mutex);
+    shard.connections.erase(conn);
 }
 
-void ConnectionHandler::dumpConnections(WriteBufferFromOwnString & buf, bool brief)
+void ConnectionHandler::dumpConnections(WriteBuffer & buf, bool brief)
 {
-    std::lock_guard lock(conns_mutex);
-    for (auto * conn : connections)
+    /// A connection may be gone once the lock is released, so stats are formatted under it and written after
+    WriteBufferFromOwnString stats;
+    for (auto & shard : connection_shards)
     {
-        conn->dumpStats(buf, brief);
+        std::lock_guard lock(shard.mutex);
+        for (auto * conn : shard.connections)
+            conn->dumpStats(stats, brief);
     }
+    writeString(stats.str(), buf);
+}
+
+UInt64 ConnectionHandler::getQueuedResponseBytes()
+{
+    UInt64 bytes = 0;
+    for (auto & shard : connection_shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (auto * conn : shard.connections)
+            bytes += conn->queued_response_bytes.load(std::memory_order_relaxed);
+    }
+    return bytes;
+}
+
+std::vector<ConnectionHandler::SessionOutstanding> ConnectionHandler::getSessionsOutstanding()
+{
+    std::vector<SessionOutstanding> result;
+    for (auto & shard : connection_shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (auto * conn : shard.connections)
+        {
+            if (conn->session_id == -1)
+                continue;
+            size_t response_bytes = conn->queued_response_bytes.load(std::memory_order_relaxed);
+            std::lock_guard heartbeat_lock(conn->heartbeat_mutex);
+            result.push_back(SessionOutstanding{conn->session_id, conn->outstanding_requests, response_bytes});
+        }
+    }
+    return result;
 }
 
 void ConnectionHandler::resetConnsStats()
 {
-    std::lock_guard lock(conns_mutex);
-    for (auto * conn : connections)
+    for (auto & shard : connection_shards)
     {
-        conn->resetStats();
+        std::lock_guard lock(shard.mutex);
+        for (auto * conn : shard.connections)
+            conn->resetStats();
     }
 }
 
 ConnectionHandler::ConnectionHandler(Context & global_context_, StreamSocket & socket, SocketReactor & reactor)
+    : ConnectionHandler(global_context_, socket, reactor, nullptr)
+{
+}
+
+ConnectionHandler::ConnectionHandler(
+    Context & global_context_, StreamSocket & socket, SocketReactor & reactor, const HandoffConnection & handoff)
+    : ConnectionHandler(global_context_, socket, reactor, &handoff)
+{
+}
+
+ConnectionHandler::ConnectionHandler(
+    Context & global_context_, StreamSocket & socket, SocketReactor & reactor, const HandoffConnection * handoff)
     : log(&Logger::get("ConnectionHandler"))
     , socket_(socket)
     , reactor_(reactor)
@@ -74,10 +137,29 @@ ConnectionHandler::ConnectionHandler(Context & global_context_, StreamSocket & s
               "keeper.raft_settings.session_timeout_ms", Coordination::DEFAULT_SESSION_TIMEOUT_MS)
               * 1000)
     , responses(std::make_unique<ThreadSafeResponseQueue>())
+    , max_send_iov_count(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_send_iov_count)
+    , max_send_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_send_bytes)
     , last_op(std::make_unique<LastOp>(EMPTY_LAST_OP))
+    , max_outstanding_requests(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_connection_outstanding_requests)
+    , max_queued_response_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_connection_queued_response_bytes)
+    , session_rate_bucket(keeper_dispatcher->getRateLimiter().sessionBucket())
+    , ip_rate_bucket(keeper_dispatcher->getRateLimiter().ipBucket(socket_.peerAddress().host().toString()))
+    , relaxed_read_order(keeper_dispatcher->isRelaxedReadOrderClient(socket_.peerAddress().host()))
+    , client_group(keeper_dispatcher->getClientGroups().ofAddress(socket_.peerAddress().host()))
+    , idle_trim_ms(keeper_dispatcher->getKeeperConfigurationAndSettings()->idle_connection_trim_ms)
+    , idle_socket_buffer_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->idle_socket_buffer_bytes)
+    , compression_min_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->client_compression_min_bytes)
+    , last_active_ms(nowMilliseconds())
 {
     LOG_DEBUG(log, "New connection from {}", socket_.peerAddress().toString());
     registerConnection(this);
+    if (idle_trim_ms)
+    {
+        trim_interval_us = std::max<UInt64>(idle_trim_ms / 4, 1000) * 1000;
+        reactor_.setPeriodicTask(Poco::Timespan(0, static_cast<long>(trim_interval_us.load())), &ConnectionHandler::trimIdleConnections);
+    }
+    if (handoff)
+        restoreHandoff(*handoff);
 
     reactor_.addEventHandler(
         socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
@@ -92,9 +174,21 @@ ConnectionHandler::~ConnectionHandler()
     {
         /// 4lw cmd connection will not init session_id
         if (session_id != -1)
+        {
             LOG_INFO(log, "Disconnecting session {}", toHexString(session_id));
+            keeper_dispatcher->getHotKeyStats().unregisterClient(session_id);
+        }
 
         unregisterConnection(this);
+        if (trimmed)
+            trimmed_connections.fetch_sub(1, std::memory_order_relaxed);
+
+        /// The session request of a parked handshake may be done any time, it finds the connection gone
+        if (parked_handshake)
+        {
+            std::lock_guard lock(parked_handshake->mutex);
+            parked_handshake->conn = nullptr;
+        }
 
         reactor_.removeEventHandler(
             socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
@@ -114,16 +208,34 @@ void ConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotification> & /
 {
     try
     {
+        last_active_ms = nowMilliseconds();
+        if (unlikely(trimmed))
+            untrim();
         LOG_TRACE(log, "session {} socket readable", toHexString(session_id));
         if (!socket_.available())
         {
+            /// An edge triggered reactor may report data which was already drained when handling the last event
+            if (reactor_.isEdgeTriggered()
+                && !socket_.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_ERROR))
+                return;
             LOG_INFO(log, "Client of session {} close connection! errno {}", toHexString(session_id), errno);
             destroyMe();
             return;
         }
 
-        while (socket_.available())
+        while (!reading_paused && socket_.available())
         {
+            /// Between requests after handshake, read as much as available and handle the requests in it at once
+            if (handshake_done && !next_req_header_read_done && !req_header_buf.used())
+            {
+                if (!receivePipelinedRequests())
+                {
+                    destroyMe();
+                    return;
+                }
+                continue;
+            }
+
             /// 1. Request header
             if (!next_req_header_read_done)
             {
@@ -163,11 +275,7 @@ void ConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotification> & /
             /// 2. Read body
 
             if (previous_req_body_read_done)
-            {
-                /// create a buffer
-                req_body_buf = std::make_shared<FIFOBuffer>(body_len);
-                previous_req_body_read_done = false;
-            }
+                prepareBodyBuffer();
 
             socket_.receiveBytes(*req_body_buf);
 
@@ -199,6 +307,9 @@ void ConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotification> & /
                     connect_req = receiveHandshake(handshake_req_len);
 
                     handshake_result = handleHandshake(connect_req);
+                    /// Answered once the session request is done, see finishSessionRequest
+                    if (handshake_result.parked)
+                        return;
                     sendHandshake(handshake_result);
                 }
                 catch (...)
@@ -211,52 +322,17 @@ void ConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotification> & /
                     return;
                 }
 
-                if (!handshake_result.connect_success)
+                if (!finishHandshake(handshake_result))
                 {
                     destroyMe();
                     return;
                 }
-
-                /// register session response callback
-                auto response_callback = [this](const Coordination::ZooKeeperResponsePtr & response) { sendResponse(response); };
-                keeper_dispatcher->registerSession(session_id, response_callback, handshake_result.is_reconnected);
-
-                /// start session timeout timer
-                session_stopwatch.start();
-                handshake_done = true;
             }
             /// 4. handle request
-            else
+            else if (!handleRequest(req_body_buf->begin(), body_len, std::move(req_log_entry)))
             {
-                session_stopwatch.start();
-
-                try
-                {
-                    auto [received_op, received_xid] = receiveRequest(body_len);
-
-                    if (received_op == Coordination::OpNum::Close)
-                    {
-                        LOG_DEBUG(log, "Received close event with xid {} for session {}", received_xid, toHexString(session_id));
-                        close_xid = received_xid;
-                    }
-                    else if (received_op == Coordination::OpNum::Heartbeat)
-                    {
-                        LOG_TRACE(log, "Received heartbeat for session {}", toHexString(session_id));
-                    }
-
-                    /// Each request restarts session stopwatch
-                    session_stopwatch.restart();
-                }
-                catch (const Exception & e)
-                {
-                    tryLogCurrentException(log, fmt::format("Error processing session {} request.", toHexString(session_id)));
-
-                    if (e.code() == ErrorCodes::TIMEOUT_EXCEEDED)
-                    {
-                        destroyMe();
-                        return;
-                    }
-                }
+                destroyMe();
+                return;
             }
         }
     }
@@ -274,76 +350,520 @@ void ConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotification> & /
     }
 }
 
-void ConnectionHandler::onSocketWritable(const AutoPtr<WritableNotification> &)
+bool ConnectionHandler::receivePipelinedRequests()
+{
+    /// Reactor threads serve one connection at a time, so one buffer for each of them
+    thread_local std::unique_ptr<char[]> receive_buffer;
+    if (!receive_buffer)
+        receive_buffer = std::make_unique<char[]>(RECEIVE_BUFFER_SIZE);
+
+    char * data = receive_buffer.get();
+    int received = socket_.receiveBytes(data, RECEIVE_BUFFER_SIZE);
+    if (received <= 0)
+        return true;
+
+    size_t size = received;
+    size_t pos = 0;
+    while (size - pos >= sizeof(int32_t))
+    {
+        int32_t length{};
+        ReadBufferFromMemory header(data + pos, sizeof(int32_t));
+        Coordination::read(length, header);
+        if (length < 0)
+            throw Exception(
+                ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Session {} sent request of length {}", toHexString(session_id), length);
+
+        if (size - pos - sizeof(int32_t) < static_cast<size_t>(length))
+            break;
+
+        pos += sizeof(int32_t);
+        packageReceived();
+        LOG_TRACE(log, "session {} read request done, body length : {}", toHexString(session_id), length);
+
+        if (!handleRequest(data + pos, length, nullptr))
+            return false;
+        pos += length;
+    }
+
+    /// The last request is incomplete, go on with it in the buffers of the connection
+    if (size - pos < sizeof(int32_t))
+    {
+        req_header_buf.write(data + pos, size - pos);
+        return true;
+    }
+
+    ReadBufferFromMemory header(data + pos, sizeof(int32_t));
+    Coordination::read(body_len, header);
+    pos += sizeof(int32_t);
+    next_req_header_read_done = true;
+
+    prepareBodyBuffer();
+    req_body_buf->write(data + pos, size - pos);
+    return true;
+}
+
+void ConnectionHandler::trimIdleConnections(SocketReactor & reactor)
+{
+    UInt64 now_ms = nowMilliseconds();
+    auto & shard = connection_shards[std::hash<const SocketReactor *>()(&reactor) % CONNECTION_SHARDS];
+    std::lock_guard lock(shard.mutex);
+    /// Connections of the reactor are only changed by its thread, which runs this
+    for (auto * conn : shard.connections)
+    {
+        if (&conn->reactor_ == &reactor)
+            conn->trimIfIdle(now_ms);
+    }
+}
+
+void ConnectionHandler::trimIfIdle(UInt64 now_ms)
+{
+    /// Not in the middle of the handshake or of a request
+    if (trimmed || !handshake_done || parked_handshake || next_req_header_read_done || req_header_buf.used()
+        || now_ms < last_active_ms + idle_trim_ms)
+        return;
+    {
+        std::lock_guard lock(heartbeat_mutex);
+        if (outstanding_requests)
+            return;
+        outstanding_receive_us.shrink_to_fit();
+    }
+    if (!responses->shrinkIfEmpty())
+        return;
+
+    req_body_buf.reset();
+    req_log_entry.reset();
+    if (idle_socket_buffer_bytes)
+    {
+        try
+        {
+            saved_receive_buffer_bytes = socket_.getReceiveBufferSize();
+            saved_send_buffer_bytes = socket_.getSendBufferSize();
+            socket_.setReceiveBufferSize(idle_socket_buffer_bytes);
+            socket_.setSendBufferSize(idle_socket_buffer_bytes);
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Cannot shrink socket buffers of idle session " + toHexString(session_id));
+        }
+    }
+    trimmed = true;
+    trimmed_connections.fetch_add(1, std::memory_order_relaxed);
+    LOG_TRACE(log, "Trimmed idle session {}", toHexString(session_id));
+}
+
+void ConnectionHandler::untrim()
 {
+    trimmed = false;
+    trimmed_connections.fetch_sub(1, std::memory_order_relaxed);
+    if (!saved_receive_buffer_bytes)
+        return;
+
+    /// Linux reports twice the size set, for its bookkeeping
+#if defined(OS_LINUX)
+    constexpr int reported_factor = 2;
+#else
+    constexpr int reported_factor = 1;
+#endif
     try
     {
-        LOG_TRACE(log, "session {} socket writable", toHexString(session_id));
+        socket_.setReceiveBufferSize(saved_receive_buffer_bytes / reported_factor);
+        socket_.setSendBufferSize(saved_send_buffer_bytes / reported_factor);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Cannot restore socket buffers of session " + toHexString(session_id));
+    }
+    saved_receive_buffer_bytes = 0;
+    saved_send_buffer_bytes = 0;
+}
+
+void ConnectionHandler::startHandoff()
+{
+    {
+        std::lock_guard lock(handed_off_mutex);
+        handed_off.clear();
+    }
+    handoff_phase = HandoffPhase::FREEZE;
+    installHandoffTasks();
+}
 
-        if (responses->size() == 0 && send_buf.used() == 0)
+bool ConnectionHandler::handoffFrozen()
+{
+    /// Again for the connections accepted meanwhile
+    installHandoffTasks();
+    bool frozen = true;
+    forEachConnection([&](ConnectionHandler & conn)
+    {
+        auto stage = conn.handoff_stage.load();
+        if (stage == HandoffStage::NONE)
+            frozen = false;
+        else if (stage == HandoffStage::FROZEN)
+        {
+            std::lock_guard lock(conn.heartbeat_mutex);
+            if (conn.outstanding_requests)
+                frozen = false;
+        }
+    });
+    return frozen;
+}
+
+std::vector<int64_t> ConnectionHandler::getHandoffSessions()
+{
+    std::vector<int64_t> sessions;
+    forEachConnection([&](ConnectionHandler & conn)
+    {
+        if (conn.handoff_stage != HandoffStage::FROZEN)
+            return;
+        std::lock_guard lock(conn.heartbeat_mutex);
+        /// Its responses may come after the barrier
+        if (conn.outstanding_requests)
             return;
+        conn.handoff_barrier_queued = true;
+        sessions.push_back(conn.session_id);
+    });
+    return sessions;
+}
 
-        /// TODO use zero copy buffer
-        size_t size_to_sent = 0;
+void ConnectionHandler::drainHandoff()
+{
+    handoff_phase = HandoffPhase::DRAIN;
+    installHandoffTasks();
+}
 
-        /// 1. accumulate data into tmp_buf
-        responses->forEach([&size_to_sent, this](const auto & resp) -> bool {
-            if (resp == is_close)
-                return false;
+bool ConnectionHandler::handoffDrained()
+{
+    installHandoffTasks();
+    bool drained = true;
+    forEachConnection([&](ConnectionHandler & conn)
+    {
+        if (conn.handoff_stage == HandoffStage::FROZEN && conn.handoff_barrier_queued)
+            drained = false;
+    });
+    return drained;
+}
 
-            if (size_to_sent + resp->used() < SENT_BUFFER_SIZE)
-            {
-                /// add whole resp to send_buf
-                send_buf.write(resp->begin(), resp->used());
-                size_to_sent += resp->used();
-            }
-            else if (size_to_sent + resp->used() == SENT_BUFFER_SIZE)
-            {
-                /// add whole resp to send_buf
-                send_buf.write(resp->begin(), resp->used());
-                size_to_sent += resp->used();
-            }
-            else
-            {
-                /// add part of resp to send_buf
-                send_buf.write(resp->begin(), SENT_BUFFER_SIZE - size_to_sent);
-            }
-            return size_to_sent < SENT_BUFFER_SIZE;
-        });
+std::vector<HandoffConnection> ConnectionHandler::takeHandedOff()
+{
+    /// Connections are detached by the reactors in DRAIN only
+    handoff_phase = HandoffPhase::FREEZE;
+    std::lock_guard lock(handed_off_mutex);
+    return std::move(handed_off);
+}
 
-        /// 2. send data
-        size_t sent = socket_.sendBytes(send_buf);
+void ConnectionHandler::endHandoff(bool handed_off_)
+{
+    handoff_phase = handed_off_ ? HandoffPhase::DONE : HandoffPhase::ABORT;
+    if (!handed_off_)
+        installHandoffTasks();
+}
 
-        /// 3. remove sent responses
+void ConnectionHandler::installHandoffTasks()
+{
+    std::unordered_set<SocketReactor *> reactors;
+    forEachConnection([&](ConnectionHandler & conn) { reactors.insert(&conn.reactor_); });
+    for (auto * reactor : reactors)
+    {
+        reactor->setPeriodicTask(Poco::Timespan(0, HANDOFF_TASK_INTERVAL_US), &ConnectionHandler::runHandoff);
+        reactor->wakeUp();
+    }
+}
 
-        ptr<FIFOBuffer> resp;
-        while (responses->peek(resp) && sent > 0)
+void ConnectionHandler::runHandoff(SocketReactor & reactor)
+{
+    auto phase = handoff_phase.load();
+    std::vector<ConnectionHandler *> connections;
+    {
+        auto & shard = connection_shards[std::hash<const SocketReactor *>()(&reactor) % CONNECTION_SHARDS];
+        std::lock_guard lock(shard.mutex);
+        for (auto * conn : shard.connections)
+            if (&conn->reactor_ == &reactor)
+                connections.push_back(conn);
+    }
+
+    /// Connections of the reactor are only destroyed by its thread, which runs this
+    for (auto * conn : connections)
+    {
+        if (phase == HandoffPhase::ABORT)
+            conn->resumeAfterHandoff();
+        else if (phase == HandoffPhase::FREEZE || phase == HandoffPhase::DRAIN)
         {
-            if (sent >= resp->used())
+            if (conn->handoff_stage == HandoffStage::NONE)
+                conn->freezeForHandoff();
+            if (phase == HandoffPhase::DRAIN && conn->handoff_stage == HandoffStage::FROZEN && conn->handoff_barrier_queued)
+                conn->detachForHandoff();
+        }
+    }
+
+    if (phase == HandoffPhase::ABORT)
+    {
+        if (Int64 interval_us = trim_interval_us.load())
+            reactor.setPeriodicTask(Poco::Timespan(0, static_cast<long>(interval_us)), &ConnectionHandler::trimIdleConnections);
+        else
+            reactor.setPeriodicTask(Poco::Timespan(), {});
+    }
+}
+
+void ConnectionHandler::freezeForHandoff()
+{
+    handoff_barrier_queued = false;
+    handoff_barrier_passed = false;
+    /// Connections of four letter words have no session
+    if (!handshake_done || parked_handshake || session_id == -1)
+    {
+        handoff_stage = HandoffStage::SKIPPED;
+        return;
+    }
+
+    /// The socket buffers go to the new process as they are
+    if (trimmed)
+        untrim();
+    std::lock_guard lock(heartbeat_mutex);
+    handoff_frozen = true;
+    if (!reading_paused)
+    {
+        reading_paused = true;
+        reactor_.removeEventHandler(
+            socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
+    }
+    handoff_stage = HandoffStage::FROZEN;
+}
+
+void ConnectionHandler::detachForHandoff()
+{
+    if (!handoff_barrier_passed || responses->size() != 0)
+        return;
+
+    /// Nothing is sent any more, responses queued after the barrier are events fired again by the new process
+    handoff_stage = HandoffStage::DETACHED;
+    reactor_.removeEventHandler(socket_, NObserver<ConnectionHandler, WritableNotification>(*this, &ConnectionHandler::onSocketWritable));
+    keeper_dispatcher->finishSession(session_id);
+
+    HandoffConnection connection;
+    connection.fd = ::fcntl(socket_.impl()->sockfd(), F_DUPFD_CLOEXEC, 0);
+    if (connection.fd < 0)
+    {
+        LOG_WARNING(log, "Cannot duplicate socket of session {}, errno {}, it is closed", toHexString(session_id), errno);
+        destroyMe();
+        return;
+    }
+    connection.session_id = session_id;
+    connection.session_timeout_ms = session_timeout.totalMilliseconds();
+    {
+        std::lock_guard lock(heartbeat_mutex);
+        connection.last_zxid = last_zxid;
+    }
+    connection.client_extensions = client_extensions;
+    connection.compress_frames = compress_frames;
+    connection.header_done = next_req_header_read_done;
+    if (next_req_header_read_done)
+    {
+        connection.body_len = body_len;
+        connection.pending_input.assign(req_body_buf->begin(), req_body_buf->used());
+    }
+    else
+        connection.pending_input.assign(req_header_buf.begin(), req_header_buf.used());
+
+    LOG_DEBUG(log, "Detached session {} for handoff", toHexString(session_id));
+    std::lock_guard lock(handed_off_mutex);
+    handed_off.push_back(std::move(connection));
+}
+
+void ConnectionHandler::resumeAfterHandoff()
+{
+    auto stage = handoff_stage.exchange(HandoffStage::NONE);
+    if (stage == HandoffStage::DETACHED)
+    {
+        LOG_INFO(log, "Handoff of session {} failed, close its connection", toHexString(session_id));
+        destroyMe();
+        return;
+    }
+    if (stage != HandoffStage::FROZEN)
+        return;
+    {
+        std::lock_guard lock(heartbeat_mutex);
+        handoff_frozen = false;
+    }
+    updateReadInterest();
+}
+
+void ConnectionHandler::restoreHandoff(const HandoffConnection & handoff)
+{
+    session_id = handoff.session_id;
+    session_timeout = Poco::Timespan(0, handoff.session_timeout_ms * 1000);
+    last_zxid = handoff.last_zxid;
+    client_extensions = handoff.client_extensions;
+    compress_frames = handoff.compress_frames;
+    handshake_done = true;
+    if (handoff.header_done)
+    {
+        body_len = handoff.body_len;
+        next_req_header_read_done = true;
+        prepareBodyBuffer();
+        req_body_buf->write(handoff.pending_input.data(), handoff.pending_input.size());
+    }
+    else
+        req_header_buf.write(handoff.pending_input.data(), handoff.pending_input.size());
+
+    HandShakeResult result;
+    result.connect_success = true;
+    result.is_reconnected = true;
+    finishHandshake(result);
+    LOG_INFO(log, "Took over session {} from the old server", toHexString(session_id));
+
+    /// Before any request of the client, as requests of a session are served in order
+    const auto & watches = handoff.watches;
+    std::vector<Coordination::ZooKeeperRequestPtr> requests;
+    if (!watches.data_watches.empty() || !watches.exist_watches.empty() || !watches.list_watches.empty())
+    {
+        auto request = std::make_shared<Coordination::ZooKeeperSetWatchesRequest>();
+        request->relative_zxid = handoff.watches_zxid;
+        request->data_watches = watches.data_watches;
+        request->exist_watches = watches.exist_watches;
+        request->list_watches = watches.list_watches;
+        requests.push_back(std::move(request));
+    }
+    auto add_watches = [&](const std::vector<String> & paths, int32_t mode)
+    {
+        for (const auto & path : paths)
+        {
+            auto request = std::make_shared<Coordination::ZooKeeperAddWatchRequest>();
+            request->path = path;
+            request->mode = mode;
+            requests.push_back(std::move(request));
+        }
+    };
+    add_watches(watches.persistent_watches, Coordination::ZooKeeperAddWatchRequest::PERSISTENT);
+    add_watches(watches.persistent_recursive_watches, Coordination::ZooKeeperAddWatchRequest::PERSISTENT_RECURSIVE);
+
+    for (auto & request : requests)
+    {
+        request->xid = Coordination::HANDOFF_RESTORE_XID;
+        if (!keeper_dispatcher->putRequest(request, session_id))
+            LOG_WARNING(log, "Cannot register watches of session {} again", toHexString(session_id));
+    }
+}
+
+void ConnectionHandler::prepareBodyBuffer()
+{
+    if (handshake_done)
+    {
+        /// Receive the request right into a log entry, so that a write is appended without serializing it again
+        req_log_entry = nuraft::buffer::alloc(
+            NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE + body_len + NuRaftStateMachine::LOG_ENTRY_TAIL_SIZE);
+        req_body_buf = std::make_shared<FIFOBuffer>(
+            reinterpret_cast<char *>(req_log_entry->data_begin()) + NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE, body_len);
+    }
+    else
+        req_body_buf = std::make_shared<FIFOBuffer>(body_len);
+    previous_req_body_read_done = false;
+}
+
+bool ConnectionHandler::handleRequest(const char * data, int32_t length, nuraft::ptr<nuraft::buffer> log_entry)
+{
+    session_stopwatch.start();
+
+    try
+    {
+        int32_t first_int{};
+        if (compress_frames && length >= static_cast<int32_t>(2 * sizeof(int32_t)))
+        {
+            ReadBufferFromMemory header(data, sizeof(int32_t));
+            Coordination::read(first_int, header);
+        }
+
+        /// Requests are parsed out of the frame, so one buffer for each reactor thread
+        thread_local String decompressed;
+        if (first_int == Coordination::COMPRESSED_XID)
+        {
+            decompressFrame(data, length, decompressed);
+            data = decompressed.data();
+            length = static_cast<int32_t>(decompressed.size());
+            log_entry = nullptr;
+        }
+
+        auto [received_op, received_xid] = receiveRequest(data, length, std::move(log_entry));
+
+        if (received_op == Coordination::OpNum::Close)
+        {
+            LOG_DEBUG(log, "Received close event with xid {} for session {}", received_xid, toHexString(session_id));
+            close_xid = received_xid;
+        }
+        else if (received_op == Coordination::OpNum::Heartbeat)
+        {
+            LOG_TRACE(log, "Received heartbeat for session {}", toHexString(session_id));
+        }
+
+        /// Each request restarts session stopwatch
+        session_stopwatch.restart();
+        updateReadInterest();
+    }
+    catch (const Exception & e)
+    {
+        tryLogCurrentException(log, fmt::format("Error processing session {} request.", toHexString(session_id)));
+
+        if (e.code() == ErrorCodes::TIMEOUT_EXCEEDED)
+            return false;
+    }
+    return true;
+}
+
+void ConnectionHandler::onSocketWritable(const AutoPtr<WritableNotification> &)
+{
+    try
+    {
+        last_active_ms = nowMilliseconds();
+        if (unlikely(trimmed))
+            untrim();
+        LOG_TRACE(log, "session {} socket writable", toHexString(session_id));
+
+        if (unlikely(handoff_stage.load(std::memory_order_relaxed) == HandoffStage::DETACHED))
+        {
+            reactor_.removeEventHandler(
+                socket_, NObserver<ConnectionHandler, WritableNotification>(*this, &ConnectionHandler::onSocketWritable));
+            return;
+        }
+
+        if (unlikely(parked_handshake))
+        {
+            if (!finishSessionRequest())
             {
-                sent -= resp->used();
-                responses->remove();
-                /// package sent
-                packageSent();
-                LOG_TRACE(log, "sent response to {}", toHexString(session_id));
+                destroyMe();
+                return;
             }
-            else
+            if (responses->size() == 0)
             {
-                resp->drain(sent);
-                /// move data to begin
-                resp->begin();
-                sent = 0;
+                reactor_.removeEventHandler(
+                    socket_, NObserver<ConnectionHandler, WritableNotification>(*this, &ConnectionHandler::onSocketWritable));
+                return;
             }
         }
 
-        if (responses->peek(resp) && resp == is_close)
-        {
-            destroyMe();
+        if (responses->size() == 0)
             return;
-        }
+
+        /// An edge triggered reactor does not report the socket again while it stays writable, so send until it would block
+        bool edge_triggered = reactor_.isEdgeTriggered();
+        GatheredSendResult result;
+        do
+        {
+            result = sendResponsesGathered(socket_, *responses, head_response_sent, max_send_iov_count, max_send_bytes);
+            for (size_t i = 0; i < result.responses; ++i)
+                packageSent();
+            LOG_TRACE(log, "sent {} responses to {}", result.responses, toHexString(session_id));
+
+            queued_response_bytes.fetch_sub(result.bytes, std::memory_order_relaxed);
+            updateReadInterest();
+
+            ptr<FIFOBuffer> resp;
+            if (responses->peek(resp) && resp == is_close)
+            {
+                destroyMe();
+                return;
+            }
+        } while (edge_triggered && !result.would_block && responses->size() != 0);
 
         /// If all sent unregister writable event.
-        if (responses->size() == 0 && send_buf.used() == 0)
+        if (responses->size() == 0)
         {
             LOG_DEBUG(log, "Remove socket writable event handler - session {}", socket_.peerAddress().toString());
             reactor_.removeEventHandler(
@@ -371,7 +891,6 @@ void ConnectionHandler::onSocketError(const AutoPtr<ErrorNotification> & /*pNf*/
 
 ConnectionStats ConnectionHandler::getConnectionStats() const
 {
-    std::lock_guard lock(conn_stats_mutex);
     return conn_stats;
 }
 
@@ -426,10 +945,7 @@ void ConnectionHandler::dumpStats(WriteBufferFromOwnString & buf, bool brief)
 
 void ConnectionHandler::resetStats()
 {
-    {
-        std::lock_guard lock(conn_stats_mutex);
-        conn_stats.reset();
-    }
+    conn_stats.reset();
     last_op.set(std::make_unique<LastOp>(EMPTY_LAST_OP));
 }
 
@@ -453,7 +969,13 @@ ConnectRequest ConnectionHandler::receiveHandshake(int32_t handshake_req_len)
     Coordination::read(timeout_ms, in);
 
     int64_t last_zxid = keeper_dispatcher->getStateMachine().getLastProcessedZxid();
-    if (last_zxid_seen > last_zxid)
+    if (last_zxid_seen > last_zxid && keeper_dispatcher->getKeeperConfigurationAndSettings()->raft_settings->zxid_fence_wait_ms)
+    {
+        LOG_DEBUG(
+            log, "Client has seen zxid {}, our last zxid is {}, fence its reads", toHexString(last_zxid_seen), toHexString(last_zxid));
+        read_fence_zxid = last_zxid_seen;
+    }
+    else if (last_zxid_seen > last_zxid)
     {
         String msg = "Refusing session request  as it has seen zxid " + toHexString(last_zxid_seen) + " our last zxid is "
             + toHexString(last_zxid) + " client must try another server";
@@ -466,9 +988,23 @@ ConnectRequest ConnectionHandler::receiveHandshake(int32_t handshake_req_len)
 
     bool readonly{false};
 
-    if (handshake_req_len == Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_READONLY)
+    if (handshake_req_len != Coordination::CLIENT_HANDSHAKE_LENGTH)
         Coordination::read(readonly, in);
 
+    if (handshake_req_len == Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_EXTENSIONS)
+    {
+        int32_t magic;
+        int32_t extensions;
+        Coordination::read(magic, in);
+        Coordination::read(extensions, in);
+        if (magic != Coordination::PROTOCOL_EXTENSIONS_MAGIC)
+            throw Exception("Unexpected protocol extensions magic: " + toString(magic), ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT);
+
+        client_extensions = true;
+        compress_frames = (extensions & Coordination::EXTENSION_COMPRESSION) && compression_min_bytes;
+        LOG_DEBUG(log, "Client asks for protocol extensions {}, compression {}", extensions, compress_frames ? "accepted" : "refused");
+    }
+
     return {protocol_version, last_zxid_seen, timeout_ms, previous_session_id, passwd, readonly};
 }
 
@@ -489,6 +1025,12 @@ ConnectionHandler::HandShakeResult ConnectionHandler::handleHandshake(ConnectReq
         return {connect_success, true, is_reconnected};
     }
 
+    if (keeper_dispatcher->isWitness())
+    {
+        LOG_WARNING(log, "Witness serves no clients");
+        return {false, true, is_reconnected};
+    }
+
     try
     {
         if (connect_req.previous_session_id != 0)
@@ -506,28 +1048,21 @@ ConnectionHandler::HandShakeResult ConnectionHandler::handleHandshake(ConnectReq
             }
             else
             {
-                /// update session timeout
-                if (!keeper_dispatcher->updateSessionTimeout(session_id, session_timeout.totalMilliseconds()))
-                {
-                    /// update failed
-                    /// session was expired when updating
-                    /// session expired, set timeout <=0
-                    LOG_WARNING(log, "Session {} was expired when updating", toHexString(connect_req.previous_session_id));
-                    session_expired = true;
-                    connect_success = false;
-                }
-                else
-                {
-                    is_reconnected = true;
-                    LOG_INFO(log, "Client reconnected with session {}", toHexString(connect_req.previous_session_id));
-                }
+                /// update session timeout, the handshake is finished by finishSessionRequest
+                connect_success = parkHandshake(session_id);
+                return {connect_success, session_expired, is_reconnected, connect_success};
             }
         }
+        else if (!keeper_dispatcher->admitNewSession())
+        {
+            LOG_WARNING(log, "Memory is over the soft limit, new session rejected");
+            connect_success = false;
+        }
         else
         {
-            /// new session
-            session_id = keeper_dispatcher->getSessionID(session_timeout.totalMilliseconds());
-            LOG_INFO(log, "New session with ID {}", toHexString(session_id));
+            /// new session, the handshake is finished by finishSessionRequest
+            connect_success = parkHandshake(0);
+            return {connect_success, session_expired, is_reconnected, connect_success};
         }
     }
     catch (const Exception & e)
@@ -539,10 +1074,105 @@ ConnectionHandler::HandShakeResult ConnectionHandler::handleHandshake(ConnectReq
     return {connect_success, session_expired, is_reconnected};
 }
 
+bool ConnectionHandler::parkHandshake(int64_t previous_session_id)
+{
+    auto parked = std::make_shared<ParkedHandshake>();
+    parked->conn = this;
+    parked->previous_session_id = previous_session_id;
+    auto callback = [parked](int64_t new_session_id, bool expired) { onSessionRequestDone(parked, new_session_id, expired); };
+    if (!keeper_dispatcher->putSessionRequest(previous_session_id, session_timeout.totalMilliseconds(), std::move(callback)))
+    {
+        LOG_WARNING(log, "Too many handshakes waiting for their sessions");
+        return false;
+    }
+
+    /// Nothing is read until the handshake is answered, the client does not send requests before it
+    parked_handshake = std::move(parked);
+    reactor_.removeEventHandler(socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
+    return true;
+}
+
+void ConnectionHandler::onSessionRequestDone(const std::shared_ptr<ParkedHandshake> & parked, int64_t session_id, bool expired)
+{
+    std::lock_guard lock(parked->mutex);
+    if (!parked->conn)
+        return;
+
+    parked->session_id = session_id;
+    parked->expired = expired;
+    parked->done = true;
+    /// The handshake is finished on the reactor thread when the socket is writable
+    auto & conn = *parked->conn;
+    conn.reactor_.addEventHandler(
+        conn.socket_, NObserver<ConnectionHandler, WritableNotification>(conn, &ConnectionHandler::onSocketWritable));
+    conn.reactor_.wakeUp();
+}
+
+bool ConnectionHandler::finishSessionRequest()
+{
+    HandShakeResult result;
+    {
+        std::lock_guard lock(parked_handshake->mutex);
+        if (!parked_handshake->done)
+            return true;
+
+        int64_t previous_session_id = parked_handshake->previous_session_id;
+        if (parked_handshake->session_id)
+        {
+            session_id = parked_handshake->session_id;
+            result.connect_success = true;
+            result.is_reconnected = previous_session_id != 0;
+            if (result.is_reconnected)
+                LOG_INFO(log, "Client reconnected with session {}", toHexString(session_id));
+            else
+                LOG_INFO(log, "New session with ID {}", toHexString(session_id));
+        }
+        else if (parked_handshake->expired)
+        {
+            /// session was expired when updating, set timeout <=0
+            LOG_WARNING(log, "Session {} was expired when updating", toHexString(previous_session_id));
+            result.session_expired = true;
+        }
+        else
+            LOG_WARNING(log, "Cannot receive session for handshake");
+        parked_handshake->conn = nullptr;
+    }
+    parked_handshake.reset();
+
+    sendHandshake(result);
+    if (!finishHandshake(result))
+        return false;
+
+    reactor_.addEventHandler(socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
+    reactor_.wakeUp();
+    return true;
+}
+
+bool ConnectionHandler::finishHandshake(const HandShakeResult & handshake_result)
+{
+    if (!handshake_result.connect_success)
+        return false;
+
+    /// register session response callback
+    auto response_callback = [this](const Coordination::ZooKeeperResponses & batch) { sendResponses(batch); };
+    keeper_dispatcher->registerSession(session_id, response_callback, handshake_result.is_reconnected);
+    keeper_dispatcher->getHotKeyStats().registerClient(session_id, socket_.peerAddress().host().toString());
+    if (!handshake_result.is_reconnected)
+        keeper_dispatcher->putRegisterSessionRequest(session_id, session_timeout.totalMilliseconds());
+
+    /// start session timeout timer
+    session_stopwatch.start();
+    handshake_done = true;
+    return true;
+}
+
 void ConnectionHandler::sendHandshake(HandShakeResult & result)
 {
     WriteBufferFromFiFoBuffer out;
-    Coordination::write(Coordination::SERVER_HANDSHAKE_LENGTH, out);
+    if (client_extensions)
+        Coordination::write(Coordination::SERVER_HANDSHAKE_LENGTH_WITH_EXTENSIONS, out);
+    else
+        Coordination::write(Coordination::SERVER_HANDSHAKE_LENGTH, out);
     if (result.connect_success)
         Coordination::write(Coordination::ZOOKEEPER_PROTOCOL_VERSION, out);
     else
@@ -556,6 +1186,12 @@ void ConnectionHandler::sendHandshake(HandShakeResult & result)
     std::array<char, Coordination::PASSWORD_LENGTH> passwd{};
     Coordination::write(passwd, out);
 
+    if (client_extensions)
+    {
+        Coordination::write(Coordination::PROTOCOL_EXTENSIONS_MAGIC, out);
+        Coordination::write(compress_frames ? Coordination::EXTENSION_COMPRESSION : 0, out);
+    }
+
     /// Set socket to blocking mode to simplify sending.
     socket_.setBlocking(true);
     socket_.sendBytes(*out.getBuffer());
@@ -565,7 +1201,8 @@ void ConnectionHandler::sendHandshake(HandShakeResult & result)
 bool ConnectionHandler::isHandShake(Int32 & handshake_length)
 {
     return handshake_length == Coordination::CLIENT_HANDSHAKE_LENGTH
-        || handshake_length == Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_READONLY;
+        || handshake_length == Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_READONLY
+        || handshake_length == Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_EXTENSIONS;
 }
 
 bool ConnectionHandler::tryExecuteFourLetterWordCmd(int32_t command)
@@ -585,27 +1222,35 @@ bool ConnectionHandler::tryExecuteFourLetterWordCmd(int32_t command)
         auto command_ptr = FourLetterCommandFactory::instance().get(command);
         LOG_DEBUG(log, "Receive four letter command {}", command_ptr->name());
 
-        try
+        /// The command runs off the reactor thread and writes its output as it goes. The socket stays open
+        /// until the job is done, the handler is deleted right after.
+        auto job = [command_ptr, socket = socket_, send_timeout = operation_timeout, log = log]() mutable
         {
-            String res = command_ptr->run();
-            WriteBufferFromFiFoBuffer buf(res.size());
-            buf.write(res.data(), res.size());
+            try
+            {
+                /// Set socket to blocking mode to simplify sending, a client not reading is given up on by the timeout.
+                socket.setBlocking(true);
+                socket.setSendTimeout(send_timeout);
+                WriteBufferFromPocoSocket out(socket, FOUR_LETTER_WORD_CHUNK_BYTES);
+                command_ptr->runStreamed(out);
+                out.next();
+            }
+            catch (...)
+            {
+                tryLogCurrentException(log, "Error when executing four letter command " + command_ptr->name());
+            }
+        };
 
-            /// Set socket to blocking mode to simplify sending.
-            socket_.setBlocking(true);
-            socket_.sendBytes(*buf.getBuffer());
-        }
-        catch (...)
-        {
-            tryLogCurrentException(log, "Error when executing four letter command " + command_ptr->name());
-        }
+        if (!keeper_dispatcher->scheduleFourLetterWordCommand(std::move(job)))
+            LOG_WARNING(log, "Too many four letter commands running, drop {}", command_ptr->name());
         return true;
     }
 }
 
-std::pair<Coordination::OpNum, Coordination::XID> ConnectionHandler::receiveRequest(int32_t length)
+std::pair<Coordination::OpNum, Coordination::XID>
+ConnectionHandler::receiveRequest(const char * data, int32_t length, nuraft::ptr<nuraft::buffer> log_entry)
 {
-    ReadBufferFromMemory body(req_body_buf->begin(), req_body_buf->used());
+    ReadBufferFromMemory body(data, length);
     int32_t xid;
     Coordination::read(xid, body);
 
@@ -621,35 +1266,229 @@ std::pair<Coordination::OpNum, Coordination::XID> ConnectionHandler::receiveRequ
             length,
             Coordination::toString(opnum));
 
+    /// Internal requests are only made by servers
+    if (opnum == Coordination::OpNum::ExpireSessions || opnum == Coordination::OpNum::RegisterSession
+        || opnum == Coordination::OpNum::RemoveExpiredNodes)
+        throw Exception(ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Session {} sent internal request {}", toHexString(session_id), Coordination::toString(opnum));
+
+    /// Auth requests are not captured for their credentials
+    auto & request_capture = keeper_dispatcher->getRequestCapture();
+    if (unlikely(request_capture.isActive()) && opnum != Coordination::OpNum::Heartbeat && opnum != Coordination::OpNum::Auth)
+        request_capture.record(session_id, data, length);
+
     Coordination::ZooKeeperRequestPtr request = Coordination::ZooKeeperRequestFactory::instance().get(opnum);
     request->xid = xid;
     request->readImpl(body);
+    if (opnum == Coordination::OpNum::Sync && keeper_dispatcher->getKeeperConfigurationAndSettings()->raft_settings->lightweight_sync)
+        static_cast<Coordination::ZooKeeperSyncRequest &>(*request).barrier = true;
 
-    if (!keeper_dispatcher->putRequest(request, session_id))
-        throw Exception(ErrorCodes::TIMEOUT_EXCEEDED, "Session {} already disconnected", toHexString(session_id));
+    if (opnum == Coordination::OpNum::Heartbeat && answerHeartbeat(xid))
+        return std::make_pair(opnum, xid);
+
+    {
+        std::lock_guard lock(heartbeat_mutex);
+        ++outstanding_requests;
+        outstanding_receive_us.emplace_back(xid, clock_gettime_ns() / 1000);
+    }
+
+    try
+    {
+        putRequest(request, data, length, body.eof(), std::move(log_entry));
+    }
+    catch (...)
+    {
+        /// The request is never answered, the connection may be kept for the requests after it
+        forgetOutstandingRequest();
+        throw;
+    }
     return std::make_pair(opnum, xid);
 }
 
-void ConnectionHandler::sendResponse(const Coordination::ZooKeeperResponsePtr & response)
+void ConnectionHandler::putRequest(
+    const Coordination::ZooKeeperRequestPtr & request,
+    const char * data,
+    int32_t length,
+    bool whole_body,
+    nuraft::ptr<nuraft::buffer> log_entry)
 {
-    LOG_TRACE(log, "Dispatch response to conn handler session {}", toHexString(session_id));
+    /// Only when the request is exactly the bytes received, otherwise it is serialized when appended
+    if (request->isReadRequest() || !whole_body)
+        log_entry.reset();
+    else if (!log_entry)
+    {
+        /// Received in the buffer of the reactor
+        log_entry = nuraft::buffer::alloc(
+            NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE + length + NuRaftStateMachine::LOG_ENTRY_TAIL_SIZE);
+        memcpy(log_entry->data_begin() + NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE, data, length);
+    }
+
+    /// Control requests, e.g. heartbeats and close, are never limited
+    bool rate_limited = PriorityRequestsQueue::laneOf(*request) != PriorityRequestsQueue::CONTROL && !acquireRateLimits(*request);
 
-    /// TODO should invoked after response sent to client.
-    updateStats(response);
+    /// Once the fence is applied every later read sees it, writes are applied here before they are answered
+    if (read_fence_zxid && keeper_dispatcher->getStateMachine().getLastProcessedZxid() >= read_fence_zxid)
+        read_fence_zxid = 0;
+    int64_t min_zxid = request->isReadRequest() ? read_fence_zxid : 0;
+    client_group = keeper_dispatcher->getClientGroups().ofRequest(client_group, *request, client_group_path_checked);
 
-    if (response->xid != Coordination::WATCH_XID && response->getOpNum() == Coordination::OpNum::Close)
+    if (!keeper_dispatcher->putRequest(request, session_id, log_entry, rate_limited, min_zxid, relaxed_read_order, client_group))
+        throw Exception(ErrorCodes::TIMEOUT_EXCEEDED, "Session {} already disconnected", toHexString(session_id));
+}
+
+void ConnectionHandler::forgetOutstandingRequest()
+{
+    std::optional<Coordination::XID> heartbeat_to_answer;
     {
-        responses->push(ptr<FIFOBuffer>());
+        std::lock_guard lock(heartbeat_mutex);
+        if (outstanding_requests)
+            --outstanding_requests;
+        /// It is the last one received
+        if (!outstanding_receive_us.empty())
+            outstanding_receive_us.pop_back();
+        if (!outstanding_requests && deferred_heartbeat)
+        {
+            heartbeat_to_answer = deferred_heartbeat;
+            deferred_heartbeat.reset();
+        }
     }
-    else
+    if (heartbeat_to_answer)
+        sendResponses({makeHeartbeatResponse(*heartbeat_to_answer)});
+}
+
+bool ConnectionHandler::acquireRateLimits(const Coordination::ZooKeeperRequest & request)
+{
+    auto & rate_limiter = keeper_dispatcher->getRateLimiter();
+    if (!session_rate_bucket && !ip_rate_bucket && !rate_limiter.hasPathLimits())
+        return true;
+
+    UInt64 now_ns = clock_gettime_ns();
+    bool acquired = (!session_rate_bucket || session_rate_bucket->tryAcquire(now_ns))
+        && (!ip_rate_bucket || ip_rate_bucket->tryAcquire(now_ns))
+        && (!rate_limiter.hasPathLimits() || rate_limiter.tryAcquirePath(request.getPath(), now_ns));
+    if (!acquired)
     {
-        WriteBufferFromFiFoBuffer buf;
-        response->write(buf);
+        rate_limiter.onRejected();
+        LOG_TRACE(log, "Session {} over request rate limits, reject xid {}", toHexString(session_id), request.xid);
+    }
+    return acquired;
+}
 
-        /// TODO handle timeout
-        responses->push(buf.getBuffer());
+bool ConnectionHandler::answerHeartbeat(Coordination::XID xid)
+{
+    keeper_dispatcher->pingSession(session_id);
+    {
+        std::lock_guard lock(heartbeat_mutex);
+        if (outstanding_requests)
+        {
+            if (deferred_heartbeat)
+                return false;
+            deferred_heartbeat = xid;
+            return true;
+        }
     }
 
+    /// Requests are received in this thread, so no response can be queued before it from now on
+    sendResponses({makeHeartbeatResponse(xid)});
+    return true;
+}
+
+Coordination::ZooKeeperResponsePtr ConnectionHandler::makeHeartbeatResponse(Coordination::XID xid) const
+{
+    auto response = std::make_shared<Coordination::ZooKeeperHeartbeatResponse>();
+    response->xid = xid;
+    std::lock_guard lock(heartbeat_mutex);
+    response->zxid = last_zxid;
+    return response;
+}
+
+void ConnectionHandler::sendResponses(const Coordination::ZooKeeperResponses & batch)
+{
+    LOG_TRACE(log, "Dispatch {} responses to conn handler session {}", batch.size(), toHexString(session_id));
+
+    std::optional<Coordination::XID> heartbeat_to_answer;
+    std::vector<UInt64> receive_us(batch.size());
+    {
+        std::lock_guard lock(heartbeat_mutex);
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            const auto & response = batch[i];
+            if (response->xid == Coordination::WATCH_XID || response->xid == Coordination::HANDOFF_BARRIER_XID
+                || response->xid == Coordination::HANDOFF_RESTORE_XID)
+                continue;
+            last_zxid = std::max(last_zxid, response->zxid);
+            if (outstanding_requests)
+                --outstanding_requests;
+            if (!outstanding_receive_us.empty())
+            {
+                if (outstanding_receive_us.front().first == response->xid)
+                    receive_us[i] = outstanding_receive_us.front().second;
+                outstanding_receive_us.pop_front();
+            }
+        }
+        if (!outstanding_requests && deferred_heartbeat)
+        {
+            heartbeat_to_answer = deferred_heartbeat;
+            deferred_heartbeat.reset();
+        }
+    }
+
+    std::vector<ptr<FIFOBuffer>> buffers;
+    buffers.reserve(batch.size() + 1);
+
+    auto append = [&](const Coordination::ZooKeeperResponsePtr & response, UInt64 response_receive_us)
+    {
+        /// TODO should invoked after response sent to client.
+        updateStats(response, response_receive_us);
+
+        if (response->xid != Coordination::WATCH_XID && response->getOpNum() == Coordination::OpNum::Close)
+        {
+            buffers.push_back(ptr<FIFOBuffer>());
+        }
+        else
+        {
+            std::shared_ptr<FIFOBuffer> buffer;
+            /// Serialized in advance, sent right from the frame
+            if (!response->frame.empty())
+                buffer = makeFrameBuffer(response);
+            else
+            {
+                WriteBufferFromFiFoBuffer buf;
+                response->write(buf);
+                buffer = buf.getBuffer();
+            }
+
+            /// Compressed here rather than by the reactor thread, which only sends it
+            if (compress_frames)
+                if (auto compressed = compressFrame(*buffer, compression_min_bytes))
+                    buffer = std::move(compressed);
+            buffers.push_back(std::move(buffer));
+        }
+    };
+
+    bool barrier = false;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (unlikely(batch[i]->xid == Coordination::HANDOFF_BARRIER_XID))
+            barrier = true;
+        else if (likely(batch[i]->xid != Coordination::HANDOFF_RESTORE_XID))
+            append(batch[i], receive_us[i]);
+    }
+    if (heartbeat_to_answer)
+        append(makeHeartbeatResponse(*heartbeat_to_answer), 0);
+
+    size_t bytes = 0;
+    for (const auto & buffer : buffers)
+        if (buffer)
+            bytes += buffer->used();
+
+    /// TODO handle timeout
+    responses->push(buffers);
+    queued_response_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    /// The reactor detaches the connection once the responses before it are sent
+    if (unlikely(barrier))
+        handoff_barrier_passed = true;
+    updateReadInterest();
+
     LOG_TRACE(log, "Add socket writable event handler - session {}", toHexString(session_id));
     /// Trigger socket writable event
     reactor_.addEventHandler(
@@ -664,44 +1503,71 @@ void ConnectionHandler::sendResponse(const Coordination::ZooKeeperResponsePtr &
     reactor_.wakeUp();
 }
 
-void ConnectionHandler::packageSent()
+void ConnectionHandler::updateReadInterest()
 {
+    auto over = [](size_t value, size_t limit) { return limit && value >= limit; };
+    /// Resume at half of the limits, so that reading is not switched for every response
+    auto under = [](size_t value, size_t limit) { return !limit || value <= limit / 2; };
+
+    std::lock_guard lock(heartbeat_mutex);
+    size_t bytes = queued_response_bytes.load(std::memory_order_relaxed);
+
+    if (!reading_paused)
+    {
+        if (over(outstanding_requests, max_outstanding_requests) || over(bytes, max_queued_response_bytes))
+        {
+            LOG_DEBUG(
+                log,
+                "Pause reading session {}, {} requests outstanding, {} response bytes queued",
+                toHexString(session_id),
+                outstanding_requests,
+                bytes);
+            reading_paused = true;
+            reactor_.removeEventHandler(
+                socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
+        }
+    }
+    else if (!handoff_frozen && under(outstanding_requests, max_outstanding_requests) && under(bytes, max_queued_response_bytes))
     {
-        std::lock_guard lock(conn_stats_mutex);
-        conn_stats.incrementPacketsSent();
+        LOG_DEBUG(log, "Resume reading session {}", toHexString(session_id));
+        reading_paused = false;
+        reactor_.addEventHandler(
+            socket_, NObserver<ConnectionHandler, ReadableNotification>(*this, &ConnectionHandler::onSocketReadable));
+        reactor_.wakeUp();
     }
+}
+
+void ConnectionHandler::packageSent()
+{
+    conn_stats.incrementPacketsSent();
     keeper_dispatcher->incrementPacketsSent();
 }
 
 void ConnectionHandler::packageReceived()
 {
-    {
-        std::lock_guard lock(conn_stats_mutex);
-        conn_stats.incrementPacketsReceived();
-    }
+    conn_stats.incrementPacketsReceived();
     keeper_dispatcher->incrementPacketsReceived();
 }
 
-void ConnectionHandler::updateStats(const Coordination::ZooKeeperResponsePtr & response)
+void ConnectionHandler::updateStats(const Coordination::ZooKeeperResponsePtr & response, UInt64 receive_us)
 {
     /// update statistics ignoring watch, close and heartbeat response.
     if (response->xid != Coordination::WATCH_XID && response->getOpNum() != Coordination::OpNum::Heartbeat
         && response->getOpNum() != Coordination::OpNum::SetWatches && response->getOpNum() != Coordination::OpNum::Close)
     {
         Int64 elapsed = Poco::Timestamp().epochMicroseconds() / 1000 - response->request_created_time_ms;
-        {
-            std::lock_guard lock(conn_stats_mutex);
-            conn_stats.updateLatency(elapsed);
-            if (elapsed > 1000)
-                LOG_WARNING(
-                    log,
-                    "Request process time {}ms, session {} xid {} req type {}",
-                    elapsed,
-                    toHexString(session_id),
-                    response->xid,
-                    Coordination::toString(response->getOpNum()));
-        }
-        keeper_dispatcher->updateKeeperStatLatency(elapsed);
+        conn_stats.updateLatency(elapsed);
+        if (elapsed > 1000)
+            LOG_WARNING(
+                log,
+                "Request process time {}ms, session {} xid {} req type {}",
+                elapsed,
+                toHexString(session_id),
+                response->xid,
+                Coordination::toString(response->getOpNum()));
+        /// Falls back to the create time in milliseconds for a response not matched with its request
+        UInt64 elapsed_us = receive_us ? clock_gettime_ns() / 1000 - receive_us : elapsed * 1000;
+        keeper_dispatcher->updateKeeperStatLatency(elapsed, response->getOpNum(), elapsed_us);
 
         last_op.set(std::make_unique<LastOp>(LastOp{
             .name = Coordination::toString(response->getOpNum()),
@@ -14,13 +14,19 @@
 #include <Poco/Util/OptionSet.h>
 #include <Poco/Util/ServerApplication.h>
 
+#include <deque>
+#include <optional>
 #include <unordered_set>
 #include <Service/ConnCommon.h>
+#include <Service/ConnectionHandoff.h>
+#include <Service/NuRaftStateMachine.h>
+#include <Service/RequestRateLimiter.h>
 #include <Service/SvsSocketAcceptor.h>
 #include <Service/SvsSocketReactor.h>
 #include <Service/WriteBufferFromFiFoBuffer.h>
 #include "ConnectionStats.h"
 #include "IO/WriteBufferFromString.h"
+#include <Common/ProfilingMutex.h>
 
 
 namespace RK
@@ -38,15 +44,101 @@ public:
     static void registerConnection(ConnectionHandler * conn);
     static void unregisterConnection(ConnectionHandler * conn);
     /// dump all connections statistics
-    static void dumpConnections(WriteBufferFromOwnString & buf, bool brief);
+    static void dumpConnections(WriteBuffer & buf, bool brief);
+    /// Bytes of responses queued in all connections and not sent yet
+    static UInt64 getQueuedResponseBytes();
+
+    /// Requests outstanding and bytes of responses queued of the connection of a session
+    struct SessionOutstanding
+    {
+        int64_t session_id;
+        size_t requests;
+        size_t response_bytes;
+    };
+    /// Of every connection with a session
+    static std::vector<SessionOutstanding> getSessionsOutstanding();
+    /// Connections whose buffers are released for being idle, see trimIfIdle
+    static size_t getTrimmedConnections() { return trimmed_connections.load(std::memory_order_relaxed); }
     static void resetConnsStats();
+
+    /** Hand off the connections to another process, see ConnectionHandoff. After startHandoff the reactors pause
+      * reading every connection, handoffFrozen is true once all of them are paused and have no request outstanding.
+      * The barriers of getHandoffSessions are queued then, and after drainHandoff a connection whose responses are
+      * sent up to its barrier is detached, handoffDrained is true once all of them are. endHandoff(false) resumes
+      * the connections not detached and closes the detached ones, endHandoff(true) leaves all of them to the exit.
+      */
+    static void startHandoff();
+    static bool handoffFrozen();
+    static std::vector<int64_t> getHandoffSessions();
+    static void drainHandoff();
+    static bool handoffDrained();
+    /// Detached connections, their fds are duplicates the caller closes
+    static std::vector<HandoffConnection> takeHandedOff();
+    static void endHandoff(bool handed_off);
+
 private:
-    static std::mutex conns_mutex;
-    /// all connections
-    static std::unordered_set<ConnectionHandler *> connections;
+    /// All connections, sharded by reactor so that connecting and disconnecting on one reactor does not contend
+    /// with the others
+    struct ConnectionShard
+    {
+        ProfilingMutex<std::mutex, LockProfiler::ConnectionShard> mutex;
+        std::unordered_set<ConnectionHandler *> connections;
+    };
+    static constexpr size_t CONNECTION_SHARDS = 32;
+    static ConnectionShard connection_shards[CONNECTION_SHARDS];
+    static std::atomic<size_t> trimmed_connections;
+
+    static ConnectionShard & connectionShardFor(const ConnectionHandler * conn)
+    {
+        return connection_shards[std::hash<const SocketReactor *>()(&conn->reactor_) % CONNECTION_SHARDS];
+    }
+
+    enum class HandoffPhase : uint8_t
+    {
+        NONE,
+        FREEZE,
+        DRAIN,
+        ABORT,
+        DONE,
+    };
+    enum class HandoffStage : uint8_t
+    {
+        NONE,
+        /// Not handed off, e.g. in the middle of the handshake
+        SKIPPED,
+        /// Reading paused
+        FROZEN,
+        /// Session finished, the socket is only closed at exit
+        DETACHED,
+    };
+    /// The reactors run runHandoff this often during a handoff
+    static constexpr Int64 HANDOFF_TASK_INTERVAL_US = 1000;
+    static std::atomic<HandoffPhase> handoff_phase;
+    static std::mutex handed_off_mutex;
+    static std::vector<HandoffConnection> handed_off;
+    /// Of the periodic task trimming idle connections, 0 if they are not trimmed
+    static std::atomic<Int64> trim_interval_us;
+
+    /// Call f for every connection under the lock of its shard
+    template <typename F>
+    static void forEachConnection(F && f)
+    {
+        for (auto & shard : connection_shards)
+        {
+            std::lock_guard lock(shard.mutex);
+            for (auto * conn : shard.connections)
+                f(*conn);
+        }
+    }
+    /// Make the reactors of all connections run runHandoff
+    static void installHandoffTasks();
+    /// Periodic task of a reactor during a handoff, moves its connections along handoff_phase
+    static void runHandoff(SocketReactor & reactor);
 
 public:
     ConnectionHandler(Context & global_context_, StreamSocket & socket, SocketReactor & reactor);
+    /// Serve a connection handed off by another process as if its handshake was done
+    ConnectionHandler(Context & global_context_, StreamSocket & socket, SocketReactor & reactor, const HandoffConnection & handoff);
     ~ConnectionHandler();
 
     void onSocketReadable(const AutoPtr<ReadableNotification> & pNf);
@@ -59,34 +151,118 @@ public:
     void resetStats();
 
 private:
+    ConnectionHandler(Context & global_context_, StreamSocket & socket, SocketReactor & reactor, const HandoffConnection * handoff);
+
+    /// Pause reading for a handoff, or skip the connection if it cannot be handed off
+    void freezeForHandoff();
+    /// Detach the connection if its responses are sent up to the barrier
+    void detachForHandoff();
+    /// After an aborted handoff, destroys the connection if it is detached
+    void resumeAfterHandoff();
+    /// Session, partly received request and watches of a connection handed off
+    void restoreHandoff(const HandoffConnection & handoff);
+
     struct HandShakeResult
     {
         bool connect_success{};
         bool session_expired{};
         bool is_reconnected{};
+        /// Waiting for the session request, answered by finishSessionRequest
+        bool parked{};
+    };
+
+    /// Handshake waiting for its session request, shared with the callback of the request
+    struct ParkedHandshake
+    {
+        std::mutex mutex;
+        /// nullptr once the connection is destroyed or the handshake is finished
+        ConnectionHandler * conn = nullptr;
+        /// 0 for a new session
+        int64_t previous_session_id = 0;
+        bool done = false;
+        /// Result of the session request, 0 if it failed
+        int64_t session_id = 0;
+        bool expired = false;
     };
 
     ConnectRequest receiveHandshake(int32_t handshake_length);
     HandShakeResult handleHandshake(ConnectRequest & connect_req);
+    /** Put the session request of the handshake, a new session if previous_session_id is 0, and stop reading
+      * until it is done, so that the reactor does not wait for Raft. False if it cannot be put.
+      */
+    bool parkHandshake(int64_t previous_session_id);
+    /// Callback of the session request, called on the session request thread of the dispatcher
+    static void onSessionRequestDone(const std::shared_ptr<ParkedHandshake> & parked, int64_t session_id, bool expired);
+    /// Answer the parked handshake if its session request is done, return false if the connection should be closed
+    bool finishSessionRequest();
+    /// Register the session of an answered handshake, return false if the connection should be closed
+    bool finishHandshake(const HandShakeResult & handshake_result);
     void sendHandshake(HandShakeResult & result);
 
     static bool isHandShake(Int32 & handshake_length) ;
+    /// Output of four letter word commands is sent in chunks of this size
+    static constexpr size_t FOUR_LETTER_WORD_CHUNK_BYTES = 64 * 1024;
     bool tryExecuteFourLetterWordCmd(int32_t four_letter_cmd);
 
-    std::pair<Coordination::OpNum, Coordination::XID> receiveRequest(int32_t length);
+    /** Read all available bytes into the receive buffer of the reactor thread and handle the complete
+      * requests in it without copying them, the incomplete one at the end is kept in req_header_buf or
+      * req_body_buf. Return false if the connection should be closed.
+      */
+    bool receivePipelinedRequests();
+    /// Allocate req_body_buf for a body of body_len
+    void prepareBodyBuffer();
+    /// Return false if the connection should be closed
+    bool handleRequest(const char * data, int32_t length, nuraft::ptr<nuraft::buffer> log_entry);
+
+    /// log_entry is the log entry data is in, or nullptr
+    std::pair<Coordination::OpNum, Coordination::XID>
+    receiveRequest(const char * data, int32_t length, nuraft::ptr<nuraft::buffer> log_entry);
+    /// Put the request received from data into the dispatcher, whole_body tells whether it is all the bytes of data
+    void putRequest(
+        const Coordination::ZooKeeperRequestPtr & request,
+        const char * data,
+        int32_t length,
+        bool whole_body,
+        nuraft::ptr<nuraft::buffer> log_entry);
+    /// The last outstanding request is not put into the dispatcher, so it is never answered
+    void forgetOutstandingRequest();
+
+    /** Answer heartbeat without sending it to the dispatcher. If the session has requests not answered
+      * yet, it is answered right after them to keep the response order. Return false if it should go
+      * through the dispatcher, that is when another heartbeat is already waiting.
+      */
+    bool answerHeartbeat(Coordination::XID xid);
+    Coordination::ZooKeeperResponsePtr makeHeartbeatResponse(Coordination::XID xid) const;
+
+    /// Queue responses and wake up reactor once for all of them.
+    void sendResponses(const Coordination::ZooKeeperResponses & batch);
 
-    void sendResponse(const Coordination::ZooKeeperResponsePtr& resp);
+    /// Stop reading the socket when the session has too many requests outstanding or response bytes queued,
+    /// so that a client pipelining too much or reading too slowly is held back by TCP instead of buffered.
+    void updateReadInterest();
+    /// Take the tokens of request from the rate limits, false if it is over any of them
+    bool acquireRateLimits(const Coordination::ZooKeeperRequest & request);
 
     void packageSent();
     void packageReceived();
 
-    void updateStats(const Coordination::ZooKeeperResponsePtr & response);
+    /// receive_us is the monotonic receive time of the request in microseconds, 0 if unknown
+    void updateStats(const Coordination::ZooKeeperResponsePtr & response, UInt64 receive_us);
+
+    /// Periodic task of the reactor, trims the idle connections of the reactor
+    static void trimIdleConnections(SocketReactor & reactor);
+    /** Release the request buffer and the blocks of the response and outstanding queues of a connection with
+      * nothing in flight after idle_trim_ms, and shrink its kernel socket buffers to idle_socket_buffer_bytes.
+      * Called by the reactor thread, untrim restores the socket buffers on the next event, the other buffers
+      * are allocated again as requests come.
+      */
+    void trimIfIdle(UInt64 now_ms);
+    void untrim();
 
     /// destroy connection
     void destroyMe();
 
-    static constexpr size_t SENT_BUFFER_SIZE = 1024;
-    FIFOBuffer send_buf = FIFOBuffer(SENT_BUFFER_SIZE);
+    static constexpr size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
 
     std::shared_ptr<FIFOBuffer> is_close = nullptr;
 
@@ -96,6 +272,8 @@ private:
     SocketReactor & reactor_;
 
     std::shared_ptr<FIFOBuffer> req_body_buf;
+    /// Log entry req_body_buf is in, nullptr before handshake
+    nuraft::ptr<nuraft::buffer> req_log_entry;
     FIFOBuffer req_header_buf = FIFOBuffer(4);
 
     /// request body length
@@ -104,6 +282,8 @@ private:
     bool next_req_header_read_done = false;
     bool previous_req_body_read_done = true;
     bool handshake_done = false;
+    /// Not nullptr while the handshake waits for its session request
+    std::shared_ptr<ParkedHandshake> parked_handshake;
 
     Context & global_context;
     std::shared_ptr<KeeperDispatcher> keeper_dispatcher;
@@ -114,14 +294,74 @@ private:
 
     Stopwatch session_stopwatch;
     ThreadSafeResponseQueuePtr responses;
+    /// Bytes of the head of responses sent
+    size_t head_response_sent = 0;
+    /// Limits of a writev sending responses
+    size_t max_send_iov_count;
+    size_t max_send_bytes;
 
     Coordination::XID close_xid = Coordination::CLOSE_XID;
     Poco::Timestamp established;
 
     LastOpMultiVersion last_op;
 
-    mutable std::mutex conn_stats_mutex;
+    /// Protects outstanding_requests, deferred_heartbeat, last_zxid and changing reading_paused,
+    /// responses are sent from the dispatcher threads.
+    mutable std::mutex heartbeat_mutex;
+    /// Requests put into the dispatcher and not answered yet
+    size_t outstanding_requests = 0;
+    /// Xid and monotonic receive time in microseconds of outstanding requests, they are answered in order
+    std::deque<std::pair<Coordination::XID, UInt64>> outstanding_receive_us;
+    /// Bytes in responses not sent yet
+    std::atomic<size_t> queued_response_bytes{0};
+    /// Readable event handler is removed for the limits below, 0 means no limit
+    std::atomic<bool> reading_paused{false};
+    size_t max_outstanding_requests;
+    size_t max_queued_response_bytes;
+
+    /// Last zxid seen by the client at the handshake while this server had not applied it, reads are fenced by it
+    /// until it is applied, 0 if not fenced. See RaftSettings::zxid_fence_wait_ms.
+    int64_t read_fence_zxid = 0;
+
+    /// The client sent the flags of protocol extensions at the handshake, it is answered with the ones accepted
+    bool client_extensions = false;
+    /// Compression is negotiated, compressed requests are accepted and responses of at least compression_min_bytes
+    /// are compressed by the dispatcher threads sending them. Set before the session is registered.
+    bool compress_frames = false;
+    /// 0 means compression is refused, see Settings::client_compression_min_bytes
+    const size_t compression_min_bytes;
+
+    /// Request rate limits of the session and of the client address, nullptr if not limited
+    TokenBucketPtr session_rate_bucket;
+    TokenBucketPtr ip_rate_bucket;
+    /// Reads of the session may pass its pending writes on other paths, see Settings::relaxed_read_order_networks
+    const bool relaxed_read_order;
+    /// Client group of the connection, by its address and then its requests, see ClientGroups
+    size_t client_group;
+    bool client_group_path_checked = false;
+    /// Heartbeat to answer when outstanding_requests drops to 0
+    std::optional<Coordination::XID> deferred_heartbeat;
+    /// Max zxid of responses sent to the session, used as the zxid of heartbeat responses
+    int64_t last_zxid = 0;
+
     ConnectionStats conn_stats;
+
+    /// 0 means connections are not trimmed
+    const UInt64 idle_trim_ms;
+    const int idle_socket_buffer_bytes;
+    /// Monotonic time of the last event of the socket in milliseconds, of the reactor thread
+    UInt64 last_active_ms;
+    bool trimmed = false;
+    /// Kernel socket buffer sizes before trimming, 0 if they are not shrunk
+    int saved_receive_buffer_bytes = 0;
+    int saved_send_buffer_bytes = 0;
+
+    std::atomic<HandoffStage> handoff_stage{HandoffStage::NONE};
+    /// A barrier is queued after the responses of the session, set when they are queued to the connection
+    std::atomic<bool> handoff_barrier_queued{false};
+    std::atomic<bool> handoff_barrier_passed{false};
+    /// Reading is not resumed by updateReadInterest, protected by heartbeat_mutex
+    bool handoff_frozen = false;
 };
 
 }
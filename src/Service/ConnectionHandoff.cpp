@@ -0,0 +1,498 @@
+#include <Service/ConnectionHandoff.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unordered_map>
+#include <IO/ReadBufferFromString.h>
+#include <IO/ReadHelpers.h>
+#include <IO/WriteBufferFromString.h>
+#include <IO/WriteHelpers.h>
+#include <Service/ConnectionHandler.h>
+#include <Service/KeeperDispatcher.h>
+#include <Poco/Net/ServerSocketImpl.h>
+#include <Common/Exception.h>
+#include <Common/Stopwatch.h>
+#include <Common/setThreadName.h>
+#include <ext/scope_guard.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int SYSTEM_ERROR;
+    extern const int NETWORK_ERROR;
+    extern const int BAD_ARGUMENTS;
+}
+
+namespace
+{
+    enum Status : UInt8
+    {
+        OK = 0,
+        REFUSED = 1,
+    };
+
+    /// Below SCM_MAX_FD of Linux
+    constexpr size_t MAX_FDS_PER_MESSAGE = 250;
+    /// The state is received within the drain timeout and this
+    constexpr UInt64 RECEIVE_TIMEOUT_MARGIN_MS = 5000;
+
+    class InheritedServerSocketImpl : public Poco::Net::ServerSocketImpl
+    {
+    public:
+        explicit InheritedServerSocketImpl(poco_socket_t fd) { reset(fd); }
+    };
+
+    class InheritedServerSocket : public Poco::Net::ServerSocket
+    {
+    public:
+        explicit InheritedServerSocket(poco_socket_t fd) : Poco::Net::ServerSocket(new InheritedServerSocketImpl(fd), true) { }
+    };
+
+    sockaddr_un makeAddress(const String & path)
+    {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path))
+            throw Exception(ErrorCodes::BAD_ARGUMENTS, "Handoff socket path {} is too long", path);
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.data(), path.size());
+        return addr;
+    }
+
+    void writeAll(int fd, const char * data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                throwFromErrno("Cannot write to handoff socket", ErrorCodes::NETWORK_ERROR);
+            data += written;
+            size -= written;
+        }
+    }
+
+    void readAll(int fd, char * data, size_t size)
+    {
+        while (size)
+        {
+            ssize_t received = ::recv(fd, data, size, 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received < 0)
+                throwFromErrno("Cannot read from handoff socket", ErrorCodes::NETWORK_ERROR);
+            if (received == 0)
+                throw Exception(ErrorCodes::NETWORK_ERROR, "Handoff socket closed by the other server");
+            data += received;
+            size -= received;
+        }
+    }
+
+    template <typename T>
+    void writePOD(int fd, T value)
+    {
+        writeAll(fd, reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    T readPOD(int fd)
+    {
+        T value;
+        readAll(fd, reinterpret_cast<char *>(&value), sizeof(value));
+        return value;
+    }
+
+    /// fds are sent in messages of a byte each, as a message without data carries no fds
+    void sendFds(int fd, const std::vector<int> & fds)
+    {
+        for (size_t pos = 0; pos < fds.size(); pos += MAX_FDS_PER_MESSAGE)
+        {
+            size_t count = std::min(MAX_FDS_PER_MESSAGE, fds.size() - pos);
+            char byte = 0;
+            iovec iov{&byte, 1};
+            std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds.data() + pos, count * sizeof(int));
+
+            ssize_t sent;
+            while ((sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+                ;
+            if (sent != 1)
+                throwFromErrno("Cannot send sockets to the new server", ErrorCodes::NETWORK_ERROR);
+        }
+    }
+
+    std::vector<int> receiveFds(int fd, size_t count)
+    {
+        std::vector<int> fds;
+        fds.reserve(count);
+        while (fds.size() < count)
+        {
+            size_t expected = std::min(MAX_FDS_PER_MESSAGE, count - fds.size());
+            char byte;
+            iovec iov{&byte, 1};
+            std::vector<char> control(CMSG_SPACE(expected * sizeof(int)));
+
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+
+            ssize_t received;
+            while ((received = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+                ;
+            if (received != 1)
+                throwFromErrno("Cannot receive sockets from the old server", ErrorCodes::NETWORK_ERROR);
+
+            cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+            if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC))
+                throw Exception(
+                    ErrorCodes::NETWORK_ERROR, "Sockets from the old server are truncated, is the limit of open files too low?");
+            size_t received_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const auto * data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), data, data + received_count);
+        }
+        return fds;
+    }
+
+    void setReceiveTimeout(int fd, UInt64 timeout_ms)
+    {
+        timeval timeout{static_cast<time_t>(timeout_ms / 1000), static_cast<suseconds_t>(timeout_ms % 1000 * 1000)};
+        if (::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
+            throwFromErrno("Cannot set timeout of handoff socket", ErrorCodes::SYSTEM_ERROR);
+    }
+
+    void writePaths(const std::vector<String> & paths, WriteBuffer & out)
+    {
+        writeVarUInt(paths.size(), out);
+        for (const auto & path : paths)
+            writeStringBinary(path, out);
+    }
+
+    void readPaths(std::vector<String> & paths, ReadBuffer & in)
+    {
+        size_t size;
+        readVarUInt(size, in);
+        paths.resize(size);
+        for (auto & path : paths)
+            readStringBinary(path, in);
+    }
+
+    /// fds are not in the state, they are sent after it in the same order
+    String serialize(const HandoffState & state)
+    {
+        WriteBufferFromOwnString out;
+        writeVarUInt(state.listen_fds.size(), out);
+        writeVarUInt(state.connections.size(), out);
+        for (const auto & connection : state.connections)
+        {
+            writeBinary(connection.session_id, out);
+            writeBinary(connection.session_timeout_ms, out);
+            writeBinary(connection.last_zxid, out);
+            writeBinary(connection.client_extensions, out);
+            writeBinary(connection.compress_frames, out);
+            writeBinary(connection.header_done, out);
+            writeBinary(connection.body_len, out);
+            writeStringBinary(connection.pending_input, out);
+            writePaths(connection.watches.data_watches, out);
+            writePaths(connection.watches.exist_watches, out);
+            writePaths(connection.watches.list_watches, out);
+            writePaths(connection.watches.persistent_watches, out);
+            writePaths(connection.watches.persistent_recursive_watches, out);
+            writeBinary(connection.watches_zxid, out);
+        }
+        return out.str();
+    }
+
+    /// Return the number of listening sockets
+    size_t deserialize(const String & data, HandoffState & state)
+    {
+        ReadBufferFromString in(data);
+        size_t listen_count;
+        size_t connection_count;
+        readVarUInt(listen_count, in);
+        readVarUInt(connection_count, in);
+        state.connections.resize(connection_count);
+        for (auto & connection : state.connections)
+        {
+            readBinary(connection.session_id, in);
+            readBinary(connection.session_timeout_ms, in);
+            readBinary(connection.last_zxid, in);
+            readBinary(connection.client_extensions, in);
+            readBinary(connection.compress_frames, in);
+            readBinary(connection.header_done, in);
+            readBinary(connection.body_len, in);
+            readStringBinary(connection.pending_input, in);
+            readPaths(connection.watches.data_watches, in);
+            readPaths(connection.watches.exist_watches, in);
+            readPaths(connection.watches.list_watches, in);
+            readPaths(connection.watches.persistent_watches, in);
+            readPaths(connection.watches.persistent_recursive_watches, in);
+            readBinary(connection.watches_zxid, in);
+        }
+        return listen_count;
+    }
+
+    /// Poll until done returns true, for at most timeout_ms
+    template <typename F>
+    bool waitFor(F && done, UInt64 timeout_ms, UInt64 interval_ms)
+    {
+        Stopwatch watch;
+        while (!done())
+        {
+            if (watch.elapsedMilliseconds() >= timeout_ms)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        }
+        return true;
+    }
+}
+
+std::optional<HandoffState> ConnectionHandoff::receive(const String & path, UInt64 timeout_ms)
+{
+    auto * log = &Poco::Logger::get("ConnectionHandoff");
+    sockaddr_un addr = makeAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throwFromErrno("Cannot create handoff socket", ErrorCodes::SYSTEM_ERROR);
+    SCOPE_EXIT({ ::close(fd); });
+
+    if (::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        if (errno == ENOENT || errno == ECONNREFUSED)
+        {
+            LOG_INFO(log, "No server to take over at {}", path);
+            return {};
+        }
+        throwFromErrno("Cannot connect to handoff socket " + path, ErrorCodes::NETWORK_ERROR);
+    }
+
+    LOG_INFO(log, "Take over the connections of the server at {}", path);
+    setReceiveTimeout(fd, timeout_ms + RECEIVE_TIMEOUT_MARGIN_MS);
+    writePOD(fd, MAGIC);
+    writePOD(fd, VERSION);
+    if (readPOD<UInt8>(fd) != OK)
+        throw Exception(ErrorCodes::NETWORK_ERROR, "The server at {} refused the handoff and goes on serving", path);
+
+    String data(readPOD<UInt64>(fd), '\0');
+    readAll(fd, data.data(), data.size());
+    HandoffState state;
+    size_t listen_count = deserialize(data, state);
+    auto fds = receiveFds(fd, listen_count + state.connections.size());
+    state.listen_fds.assign(fds.begin(), fds.begin() + listen_count);
+    for (size_t i = 0; i < state.connections.size(); ++i)
+        state.connections[i].fd = fds[listen_count + i];
+
+    LOG_INFO(
+        log,
+        "Received {} listening sockets and {} connections, wait for the server at {} to exit",
+        state.listen_fds.size(),
+        state.connections.size(),
+        path);
+    /// The old server closes the socket when it exits, then its files are closed and the data can be loaded
+    setReceiveTimeout(fd, 0);
+    char byte;
+    ssize_t received;
+    while ((received = ::recv(fd, &byte, 1, 0)) < 0 && errno == EINTR)
+        ;
+    if (received < 0)
+        LOG_WARNING(log, "Handoff socket failed while waiting for the old server to exit, errno {}", errno);
+    return state;
+}
+
+Poco::Net::ServerSocket ConnectionHandoff::adoptServerSocket(int fd)
+{
+    return InheritedServerSocket(fd);
+}
+
+ConnectionHandoff::ConnectionHandoff(
+    const String & path_,
+    KeeperDispatcher & dispatcher_,
+    std::vector<int> listen_fds_,
+    bool handoff_connections_,
+    UInt64 timeout_ms_,
+    std::function<void(bool)> set_accepting_,
+    std::function<void()> terminate_)
+    : path(path_)
+    , dispatcher(dispatcher_)
+    , listen_fds(std::move(listen_fds_))
+    , handoff_connections(handoff_connections_)
+    , timeout_ms(timeout_ms_)
+    , set_accepting(std::move(set_accepting_))
+    , terminate(std::move(terminate_))
+    , log(&Poco::Logger::get("ConnectionHandoff"))
+{
+}
+
+ConnectionHandoff::~ConnectionHandoff()
+{
+    shutdown();
+}
+
+void ConnectionHandoff::start()
+{
+    sockaddr_un addr = makeAddress(path);
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        throwFromErrno("Cannot create handoff socket", ErrorCodes::SYSTEM_ERROR);
+
+    /// Left by a server which did not exit by a handoff, the file of a running one would have been connected to
+    ::unlink(path.c_str());
+    if (::bind(listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 || ::chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0
+        || ::listen(listen_fd, 1) != 0)
+        throwFromErrno("Cannot listen on handoff socket " + path, ErrorCodes::NETWORK_ERROR);
+
+    LOG_INFO(log, "Listening for a new server to hand off to on {}", path);
+    thread = ThreadFromGlobalPool([this] { run(); });
+}
+
+void ConnectionHandoff::shutdown()
+{
+    if (shutdown_called.exchange(true))
+        return;
+    if (thread.joinable())
+        thread.join();
+    if (listen_fd >= 0)
+    {
+        ::close(listen_fd);
+        /// After a handoff the new server binds it once this one exits
+        if (peer_fd < 0)
+            ::unlink(path.c_str());
+    }
+}
+
+void ConnectionHandoff::run()
+{
+    setThreadName("Handoff");
+    while (!shutdown_called)
+    {
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (::poll(&pfd, 1, 1000) <= 0)
+            continue;
+        int peer = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (peer < 0)
+            continue;
+
+        try
+        {
+#if defined(OS_LINUX)
+            ucred credentials{};
+            socklen_t length = sizeof(credentials);
+            if (::getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0 || credentials.uid != ::geteuid())
+                throw Exception(ErrorCodes::NETWORK_ERROR, "Handoff socket connected by another user {}", credentials.uid);
+#endif
+            if (handOff(peer))
+            {
+                peer_fd = peer;
+                return;
+            }
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Cannot hand off to the new server");
+        }
+        ::close(peer);
+    }
+}
+
+bool ConnectionHandoff::handOff(int peer)
+{
+    setReceiveTimeout(peer, 1000);
+    auto magic = readPOD<UInt32>(peer);
+    auto version = readPOD<UInt32>(peer);
+    if (magic != MAGIC || version != VERSION)
+        throw Exception(
+            ErrorCodes::NETWORK_ERROR, "Handoff socket connected with magic {} version {}, expected version {}", magic, version, VERSION);
+
+    LOG_INFO(log, "Hand off to a new server, connections are {}", handoff_connections ? "drained" : "closed");
+    Stopwatch watch;
+    auto remaining_ms = [&] { return timeout_ms - std::min(timeout_ms, watch.elapsedMilliseconds()); };
+    set_accepting(false);
+
+    HandoffState state;
+    state.listen_fds = listen_fds;
+    if (handoff_connections)
+    {
+        ConnectionHandler::startHandoff();
+        if (!waitFor([] { return ConnectionHandler::handoffFrozen(); }, remaining_ms(), POLL_INTERVAL_MS))
+            LOG_WARNING(log, "Some connections are still waiting for responses, they are closed");
+
+        /// Watch events of the changes up to it are queued to the connections before the barriers
+        int64_t watches_zxid = dispatcher.getStateMachine().getLastProcessedZxid();
+        if (!dispatcher.waitCommittedApplied(remaining_ms()))
+        {
+            LOG_WARNING(log, "Committed requests are not applied in {}ms, refuse the handoff", timeout_ms);
+            ConnectionHandler::endHandoff(false);
+            set_accepting(true);
+            writePOD(peer, static_cast<UInt8>(REFUSED));
+            return false;
+        }
+
+        /// Before the barriers, a watch fired after it is in the responses sent by this server
+        std::unordered_map<int64_t, KeeperStore::SessionWatches> watches;
+        for (int64_t session_id : ConnectionHandler::getHandoffSessions())
+        {
+            watches[session_id] = dispatcher.getStore().getSessionWatches(session_id);
+            dispatcher.pushHandoffBarrier(session_id);
+        }
+        ConnectionHandler::drainHandoff();
+        if (!waitFor([] { return ConnectionHandler::handoffDrained(); }, remaining_ms(), POLL_INTERVAL_MS))
+            LOG_WARNING(log, "Responses of some connections are not sent in {}ms, they are closed", timeout_ms);
+
+        state.connections = ConnectionHandler::takeHandedOff();
+        for (auto & connection : state.connections)
+        {
+            connection.watches = std::move(watches[connection.session_id]);
+            connection.watches_zxid = watches_zxid;
+        }
+    }
+
+    std::vector<int> fds = state.listen_fds;
+    for (const auto & connection : state.connections)
+        fds.push_back(connection.fd);
+    /// The new server has its own copies once they are sent
+    SCOPE_EXIT({
+        for (const auto & connection : state.connections)
+            ::close(connection.fd);
+    });
+
+    try
+    {
+        String data = serialize(state);
+        writePOD(peer, static_cast<UInt8>(OK));
+        writePOD(peer, static_cast<UInt64>(data.size()));
+        writeAll(peer, data.data(), data.size());
+        sendFds(peer, fds);
+    }
+    catch (...)
+    {
+        /// The connections handed off have no session here any more, their clients reconnect
+        if (handoff_connections)
+            ConnectionHandler::endHandoff(false);
+        set_accepting(true);
+        throw;
+    }
+
+    if (handoff_connections)
+        ConnectionHandler::endHandoff(true);
+    LOG_INFO(log, "Handed off {} connections in {}ms, exit", state.connections.size(), watch.elapsedMilliseconds());
+    terminate();
+    return true;
+}
+
+}
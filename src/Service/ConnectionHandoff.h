@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <vector>
+#include <Poco/Net/ServerSocket.h>
+#include <Service/KeeperStore.h>
+#include <Common/ThreadPool.h>
+#include <common/logger_useful.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+class KeeperDispatcher;
+
+/// Client connection of a session handed off by another process, see ConnectionHandoff
+struct HandoffConnection
+{
+    int fd = -1;
+    int64_t session_id = 0;
+    int64_t session_timeout_ms = 0;
+    /// Max zxid the client was sent, of its heartbeat responses
+    int64_t last_zxid = 0;
+    /// Protocol extensions negotiated at the handshake
+    bool client_extensions = false;
+    bool compress_frames = false;
+    /// Bytes of the request received but not handled yet, the length of the request and a part of its body of
+    /// body_len if header_done, a part of the length otherwise
+    bool header_done = false;
+    int32_t body_len = 0;
+    String pending_input;
+    /// Watches of the session, registered again relative to watches_zxid, the old process sent the events before it
+    KeeperStore::SessionWatches watches;
+    int64_t watches_zxid = 0;
+};
+
+/// What a new process takes over from the old one
+struct HandoffState
+{
+    /// Of the client port, one for every reactor if reuse_port
+    std::vector<int> listen_fds;
+    std::vector<HandoffConnection> connections;
+};
+
+/** Hand the listening sockets of the client port and the client connections to a new server binary started on the
+  * same host, so that clients stay connected through an upgrade. The running server listens on the UNIX socket of
+  * Settings::handoff_socket, a new one connects to it before it loads any data.
+  *
+  * The old server stops accepting and pauses reading every connection. Once their requests are answered and the
+  * committed requests are applied, it takes the watches of their sessions and queues a barrier after their responses,
+  * see ConnectionHandler::startHandoff. A connection whose responses are sent up to the barrier is detached from its
+  * session without its socket being closed. The sockets are then passed by SCM_RIGHTS with the sessions, the bytes of
+  * partly received requests and the watches, and the old server exits. The new one waits for it to exit, loads the
+  * data, listens on the inherited sockets, serves the connections as if their handshakes were done and registers
+  * their watches again relative to the last zxid the old server applied before taking them. So watch events are
+  * delivered at least once, an event of a change after that zxid may be sent by both servers.
+  *
+  * Connections still waiting for responses after Settings::handoff_timeout_ms, in the middle of a handshake, of four
+  * letter words or by TLS are closed, their clients reconnect to the new server. The tree is loaded from the snapshot
+  * and the log as on any restart, it is not handed over.
+  */
+class ConnectionHandoff
+{
+public:
+    /// Called by a new server before it loads its data. The state of the server listening on path once it exited, or
+    /// nullopt if there is none. Throw if it refused the handoff, then the new server should exit and be started again.
+    static std::optional<HandoffState> receive(const String & path, UInt64 timeout_ms);
+
+    /// Listening socket of an inherited fd
+    static Poco::Net::ServerSocket adoptServerSocket(int fd);
+
+    /// set_accepting pauses and resumes accepting on listen_fds, terminate makes the server exit. TLS connections
+    /// are not handed off, only listen_fds are if not handoff_connections.
+    ConnectionHandoff(
+        const String & path_,
+        KeeperDispatcher & dispatcher_,
+        std::vector<int> listen_fds_,
+        bool handoff_connections_,
+        UInt64 timeout_ms_,
+        std::function<void(bool)> set_accepting_,
+        std::function<void()> terminate_);
+
+    ~ConnectionHandoff();
+
+    void start();
+    void shutdown();
+
+private:
+    static constexpr UInt32 MAGIC = 0x524b484f;
+    static constexpr UInt32 VERSION = 1;
+    /// Progress of the connections is polled this often
+    static constexpr UInt64 POLL_INTERVAL_MS = 10;
+
+    void run();
+    /// Hand off to the server connected by peer, false if it is refused
+    bool handOff(int peer);
+
+    const String path;
+    KeeperDispatcher & dispatcher;
+    const std::vector<int> listen_fds;
+    const bool handoff_connections;
+    const UInt64 timeout_ms;
+    std::function<void(bool)> set_accepting;
+    std::function<void()> terminate;
+    Poco::Logger * log;
+
+    int listen_fd = -1;
+    /// The new server after a handoff, left open until this process exits, that tells it to load the data
+    int peer_fd = -1;
+    std::atomic<bool> shutdown_called{false};
+    ThreadFromGlobalPool thread;
+};
+
+}
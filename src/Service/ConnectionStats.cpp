@@ -3,63 +3,74 @@
 namespace RK
 {
 
+ConnectionStats & ConnectionStats::operator=(const ConnectionStats & other)
+{
+    packets_sent.store(other.packets_sent.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    packets_received.store(other.packets_received.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    total_latency.store(other.total_latency.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    max_latency.store(other.max_latency.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    min_latency.store(other.min_latency.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    last_latency.store(other.last_latency.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    count.store(other.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+}
+
 uint64_t ConnectionStats::getMinLatency() const
 {
-    return min_latency;
+    return min_latency.load(std::memory_order_relaxed);
 }
 
 uint64_t ConnectionStats::getMaxLatency() const
 {
-    return max_latency;
+    return max_latency.load(std::memory_order_relaxed);
 }
 
 uint64_t ConnectionStats::getAvgLatency() const
 {
-    if (count != 0)
-        return total_latency / count;
+    uint64_t current_count = count.load(std::memory_order_relaxed);
+    if (current_count != 0)
+        return total_latency.load(std::memory_order_relaxed) / current_count;
     return 0;
 }
 
 uint64_t ConnectionStats::getLastLatency() const
 {
-    return last_latency;
+    return last_latency.load(std::memory_order_relaxed);
 }
 
 uint64_t ConnectionStats::getPacketsReceived() const
 {
-    return packets_received;
+    return packets_received.load(std::memory_order_relaxed);
 }
 
 uint64_t ConnectionStats::getPacketsSent() const
 {
-    return packets_sent;
+    return packets_sent.load(std::memory_order_relaxed);
 }
 
 void ConnectionStats::incrementPacketsReceived()
 {
-    packets_received++;
+    packets_received.fetch_add(1, std::memory_order_relaxed);
 }
 
 void ConnectionStats::incrementPacketsSent()
 {
-    packets_sent++;
+    packets_sent.fetch_add(1, std::memory_order_relaxed);
 }
 
 void ConnectionStats::updateLatency(uint64_t latency_ms)
 {
-    last_latency = latency_ms;
-    total_latency += (latency_ms);
-    count++;
-
-    if (latency_ms < min_latency)
-    {
-        min_latency = latency_ms;
-    }
-
-    if (latency_ms > max_latency)
-    {
-        max_latency = latency_ms;
-    }
+    last_latency.store(latency_ms, std::memory_order_relaxed);
+    total_latency.fetch_add(latency_ms, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t current_min = min_latency.load(std::memory_order_relaxed);
+    while (latency_ms < current_min && !min_latency.compare_exchange_weak(current_min, latency_ms, std::memory_order_relaxed))
+        ;
+
+    uint64_t current_max = max_latency.load(std::memory_order_relaxed);
+    while (latency_ms > current_max && !max_latency.compare_exchange_weak(current_max, latency_ms, std::memory_order_relaxed))
+        ;
 }
 
 void ConnectionStats::reset()
@@ -70,17 +81,17 @@ void ConnectionStats::reset()
 
 void ConnectionStats::resetLatency()
 {
-    total_latency = 0;
-    count = 0;
-    max_latency = 0;
-    min_latency = 0;
-    last_latency = 0;
+    total_latency.store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    max_latency.store(0, std::memory_order_relaxed);
+    min_latency.store(0, std::memory_order_relaxed);
+    last_latency.store(0, std::memory_order_relaxed);
 }
 
 void ConnectionStats::resetRequestCounters()
 {
-    packets_received = 0;
-    packets_sent = 0;
+    packets_received.store(0, std::memory_order_relaxed);
+    packets_sent.store(0, std::memory_order_relaxed);
 }
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <common/types.h>
+#include <atomic>
 #include <memory>
 #include <cstdint>
 #include <limits>
@@ -8,11 +9,17 @@
 namespace RK
 {
 
-/// Request statistics for connection or dispatcher
+/** Request statistics for connection or dispatcher.
+ *
+ * Counters are relaxed atomics updated without a lock for every request and response, a copy is a snapshot
+ * aggregated only when cons or stat asks for it. Fields of a snapshot may be a request apart.
+ */
 class ConnectionStats
 {
 public:
     ConnectionStats() = default;
+    ConnectionStats(const ConnectionStats & other) { *this = other; }
+    ConnectionStats & operator=(const ConnectionStats & other);
 
     uint64_t getMinLatency() const;
     uint64_t getMaxLatency() const;
@@ -34,20 +41,20 @@ private:
     void resetRequestCounters();
 
     /// all response with watch response included
-    uint64_t packets_sent = 0;
+    std::atomic<uint64_t> packets_sent{0};
     /// All user requests
-    uint64_t packets_received = 0;
+    std::atomic<uint64_t> packets_received{0};
 
     /// For consistent with zookeeper measured by millisecond,
     /// otherwise maybe microsecond is better
-    uint64_t total_latency = 0;
-    uint64_t max_latency = 0;
-    uint64_t min_latency = std::numeric_limits<uint64_t>::max();
+    std::atomic<uint64_t> total_latency{0};
+    std::atomic<uint64_t> max_latency{0};
+    std::atomic<uint64_t> min_latency{std::numeric_limits<uint64_t>::max()};
 
     /// last operation latency
-    uint64_t last_latency = 0;
+    std::atomic<uint64_t> last_latency{0};
 
-    uint64_t count = 0;
+    std::atomic<uint64_t> count{0};
 };
 
 }
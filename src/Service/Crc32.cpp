@@ -1,5 +1,15 @@
 #include <Service/Crc32.h>
 #include <common/types.h>
+#include <common/unaligned.h>
+#include <Common/CpuId.h>
+
+#if defined(__x86_64__)
+#    include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#    include <arm_acle.h>
+#endif
 
 namespace RK
 {
@@ -53,4 +63,153 @@ bool verifyCRC32(const char * data, size_t len, uint32_t value)
     return (value == getCRC32(data, len));
 }
 
+UInt32 extendCRC32(UInt32 crc, const char * data, size_t length)
+{
+    crc = crc ^ 0xffffffff;
+    for (size_t i = 0; i != length; ++i)
+    {
+        crc = CRC_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+}
+
+namespace
+{
+    /// Reversed Castagnoli polynomial
+    constexpr UInt32 CRC32C_POLY = 0x82f63b78;
+
+    struct CRC32CTable
+    {
+        UInt32 data[256];
+
+        constexpr CRC32CTable() : data()
+        {
+            for (UInt32 i = 0; i < 256; ++i)
+            {
+                UInt32 crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+                data[i] = crc;
+            }
+        }
+    };
+
+    constexpr CRC32CTable CRC32C_TABLE;
+
+    UInt32 softwareCRC32C(UInt32 crc, const char * data, size_t length)
+    {
+        for (size_t i = 0; i != length; ++i)
+            crc = CRC32C_TABLE.data[(crc ^ static_cast<UInt8>(data[i])) & 0xff] ^ (crc >> 8);
+        return crc;
+    }
+
+    /// a * b modulo the polynomial, in the reflected representation where the highest bit is x^0
+    UInt32 multiplyModP(UInt32 a, UInt32 b)
+    {
+        UInt32 product = 0;
+        for (UInt32 mask = 1u << 31; mask; mask >>= 1)
+        {
+            if (a & mask)
+                product ^= b;
+            b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+        }
+        return product;
+    }
+
+    /// x^(8 * bytes) modulo the polynomial, it shifts a CRC over that many zero bytes
+    UInt32 shiftOfBytes(size_t bytes)
+    {
+        UInt32 result = 1u << 31;
+        UInt32 power = 1u << 23; /// x^8
+        for (; bytes; bytes >>= 1)
+        {
+            if (bytes & 1)
+                result = multiplyModP(power, result);
+            power = multiplyModP(power, power);
+        }
+        return result;
+    }
+
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    /** Long buffers are split into three lanes computed in one loop, so that the latency of the crc32 instruction
+      * (3 cycles for a throughput of 1) is hidden. The CRCs of the lanes are shifted over the lanes after them and combined.
+      */
+    constexpr size_t LANE_SIZE = 4096;
+
+#    if defined(__x86_64__)
+#        define CRC32C_TARGET __attribute__((target("sse4.2")))
+    CRC32C_TARGET inline UInt64 crc32cU64(UInt64 crc, UInt64 value) { return _mm_crc32_u64(crc, value); }
+    CRC32C_TARGET inline UInt32 crc32cU8(UInt32 crc, UInt8 value) { return _mm_crc32_u8(crc, value); }
+#    else
+#        define CRC32C_TARGET
+    inline UInt64 crc32cU64(UInt64 crc, UInt64 value) { return __crc32cd(static_cast<UInt32>(crc), value); }
+    inline UInt32 crc32cU8(UInt32 crc, UInt8 value) { return __crc32cb(crc, value); }
+#    endif
+
+    CRC32C_TARGET UInt32 hardwareCRC32C(UInt32 crc, const char * data, size_t length)
+    {
+        static const UInt32 shift_one_lane = shiftOfBytes(LANE_SIZE);
+        static const UInt32 shift_two_lanes = shiftOfBytes(2 * LANE_SIZE);
+
+        while (length >= 3 * LANE_SIZE)
+        {
+            UInt64 crc0 = crc;
+            UInt64 crc1 = 0;
+            UInt64 crc2 = 0;
+            for (size_t i = 0; i < LANE_SIZE; i += sizeof(UInt64))
+            {
+                crc0 = crc32cU64(crc0, unalignedLoad<UInt64>(data + i));
+                crc1 = crc32cU64(crc1, unalignedLoad<UInt64>(data + LANE_SIZE + i));
+                crc2 = crc32cU64(crc2, unalignedLoad<UInt64>(data + 2 * LANE_SIZE + i));
+            }
+            crc = multiplyModP(shift_two_lanes, static_cast<UInt32>(crc0)) ^ multiplyModP(shift_one_lane, static_cast<UInt32>(crc1))
+                ^ static_cast<UInt32>(crc2);
+            data += 3 * LANE_SIZE;
+            length -= 3 * LANE_SIZE;
+        }
+
+        UInt64 crc64 = crc;
+        for (; length >= sizeof(UInt64); data += sizeof(UInt64), length -= sizeof(UInt64))
+            crc64 = crc32cU64(crc64, unalignedLoad<UInt64>(data));
+        crc = static_cast<UInt32>(crc64);
+        for (; length; ++data, --length)
+            crc = crc32cU8(crc, static_cast<UInt8>(*data));
+        return crc;
+    }
+#    undef CRC32C_TARGET
+#endif
+
+    using CRC32CImpl = UInt32 (*)(UInt32, const char *, size_t);
+
+    CRC32CImpl chooseCRC32C()
+    {
+#if defined(__x86_64__)
+        if (Cpu::haveSSE42())
+            return hardwareCRC32C;
+        return softwareCRC32C;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+        return hardwareCRC32C;
+#else
+        return softwareCRC32C;
+#endif
+    }
+}
+
+UInt32 getCRC32C(const char * data, size_t length)
+{
+    static const CRC32CImpl impl = chooseCRC32C();
+    return ~impl(~0u, data, length);
+}
+
+bool verifyCRC32C(const char * data, size_t len, uint32_t value)
+{
+    return value == getCRC32C(data, len);
+}
+
+UInt32 extendCRC32C(UInt32 crc, const char * data, size_t length)
+{
+    static const CRC32CImpl impl = chooseCRC32C();
+    return ~impl(~crc, data, length);
+}
+
 }
@@ -8,4 +8,38 @@ UInt32 getCRC32(const char * data, size_t length);
 
 bool verifyCRC32(const char * data, size_t len, uint32_t value);
 
+/// CRC32 of the bytes of crc followed by data, crc is the CRC32 of non-empty bytes
+UInt32 extendCRC32(UInt32 crc, const char * data, size_t length);
+
+/// CRC32C (Castagnoli), computed by the crc32 instruction of SSE 4.2 or ARMv8 if the CPU has it
+UInt32 getCRC32C(const char * data, size_t length);
+
+bool verifyCRC32C(const char * data, size_t len, uint32_t value);
+
+/// CRC32C of the bytes of crc followed by data
+UInt32 extendCRC32C(UInt32 crc, const char * data, size_t length);
+
+/// Checksum of log entries and snapshot batches, recorded by the version of the file
+enum class ChecksumType : uint8_t
+{
+    CRC32 = 0,
+    CRC32C = 1,
+};
+
+inline UInt32 getChecksum(ChecksumType type, const char * data, size_t length)
+{
+    return type == ChecksumType::CRC32C ? getCRC32C(data, length) : getCRC32(data, length);
+}
+
+/// Checksum of the bytes of checksum followed by data, so that an entry is checksummed in pieces without copying it
+inline UInt32 extendChecksum(ChecksumType type, UInt32 checksum, const char * data, size_t length)
+{
+    return type == ChecksumType::CRC32C ? extendCRC32C(checksum, data, length) : extendCRC32(checksum, data, length);
+}
+
+inline bool verifyChecksum(ChecksumType type, const char * data, size_t len, uint32_t value)
+{
+    return value == getChecksum(type, data, len);
+}
+
 }
@@ -0,0 +1,119 @@
+#include <Service/EphemeralIndex.h>
+#include <algorithm>
+
+namespace RK
+{
+
+void EphemeralIndex::add(int64_t session_id, const String & path)
+{
+    auto & shard = shardFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto [it, inserted] = shard.sessions.try_emplace(session_id);
+    if (inserted)
+        session_count.fetch_add(1, std::memory_order_relaxed);
+    if (it->second.insert(path).second)
+        node_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void EphemeralIndex::remove(int64_t session_id, const String & path)
+{
+    auto & shard = shardFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it == shard.sessions.end() || !it->second.erase(path))
+        return;
+
+    node_count.fetch_sub(1, std::memory_order_relaxed);
+    if (it->second.empty())
+    {
+        shard.sessions.erase(it);
+        session_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+EphemeralIndex::Paths EphemeralIndex::take(int64_t session_id)
+{
+    Paths paths;
+    {
+        auto & shard = shardFor(session_id);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.sessions.find(session_id);
+        if (it == shard.sessions.end())
+            return paths;
+        paths.swap(it->second);
+        shard.sessions.erase(it);
+    }
+    session_count.fetch_sub(1, std::memory_order_relaxed);
+    node_count.fetch_sub(paths.size(), std::memory_order_relaxed);
+    return paths;
+}
+
+bool EphemeralIndex::contains(int64_t session_id) const
+{
+    const auto & shard = shardFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    return shard.sessions.contains(session_id);
+}
+
+size_t EphemeralIndex::count(int64_t session_id) const
+{
+    const auto & shard = shardFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    return it == shard.sessions.end() ? 0 : it->second.size();
+}
+
+std::vector<String> EphemeralIndex::getPaths(int64_t session_id, const String & prefix) const
+{
+    std::vector<String> paths;
+    {
+        const auto & shard = shardFor(session_id);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.sessions.find(session_id);
+        if (it == shard.sessions.end())
+            return paths;
+        for (const auto & path : it->second)
+            if (path.starts_with(prefix))
+                paths.push_back(path);
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+EphemeralIndex::Sessions EphemeralIndex::getSessions() const
+{
+    Sessions result;
+    for (const auto & shard : shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        result.insert(shard.sessions.begin(), shard.sessions.end());
+    }
+    return result;
+}
+
+void EphemeralIndex::forEach(const std::function<void(int64_t, const Paths &)> & f) const
+{
+    Sessions shard_sessions;
+    for (const auto & shard : shards)
+    {
+        {
+            std::lock_guard lock(shard.mutex);
+            shard_sessions = shard.sessions;
+        }
+        for (const auto & [session_id, paths] : shard_sessions)
+            f(session_id, paths);
+    }
+}
+
+void EphemeralIndex::clear()
+{
+    for (auto & shard : shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        shard.sessions.clear();
+    }
+    session_count.store(0, std::memory_order_relaxed);
+    node_count.store(0, std::memory_order_relaxed);
+}
+
+}
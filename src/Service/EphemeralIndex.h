@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Common/ProfilingMutex.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Ephemeral nodes of sessions, sharded by session id.
+ *
+ * Creating and removing an ephemeral node locks the shard of its owner only. Closing a session takes its
+ * paths out of the index at once and removes the nodes without holding any lock of the index, so that a
+ * session with many ephemeral nodes does not block ephemeral nodes of other sessions.
+ *
+ * Paths are kept rather than nodes, a node is replaced in the container by a copy while a snapshot is pinned,
+ * and the path is needed to unlink it from its parent anyway.
+ */
+class EphemeralIndex
+{
+public:
+    using Paths = std::unordered_set<String>;
+    using Sessions = std::unordered_map<int64_t, Paths>;
+
+    static constexpr size_t SHARDS = 32;
+
+    void add(int64_t session_id, const String & path);
+    /// Remove path of session, the session is removed with its last path
+    void remove(int64_t session_id, const String & path);
+    /// Take the paths of session out of the index, empty if it has none
+    Paths take(int64_t session_id);
+
+    bool contains(int64_t session_id) const;
+    /// Ephemeral nodes of session
+    size_t count(int64_t session_id) const;
+    /// Paths of session beginning with prefix, sorted
+    std::vector<String> getPaths(int64_t session_id, const String & prefix) const;
+
+    /// Sessions with ephemeral nodes
+    size_t size() const { return session_count.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+    /// Ephemeral nodes of all the sessions
+    size_t nodeCount() const { return node_count.load(std::memory_order_relaxed); }
+
+    /// Copy of session -> paths
+    Sessions getSessions() const;
+    /// Call f for every session, a shard is copied under its lock and f is called without any lock held
+    void forEach(const std::function<void(int64_t, const Paths &)> & f) const;
+
+    void clear();
+
+private:
+    struct Shard
+    {
+        mutable ProfilingMutex<std::mutex, LockProfiler::EphemeralShard> mutex;
+        Sessions sessions;
+    };
+
+    Shard & shardFor(int64_t session_id) { return shards[static_cast<uint64_t>(session_id) % SHARDS]; }
+    const Shard & shardFor(int64_t session_id) const { return shards[static_cast<uint64_t>(session_id) % SHARDS]; }
+
+    Shard shards[SHARDS];
+    std::atomic<size_t> session_count{0};
+    std::atomic<size_t> node_count{0};
+};
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <limits>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Kind of a node encoded in Stat::ephemeralOwner as ZooKeeper does, so that snapshots and clients see the same stat.
+ *
+ * 0 is a persistent node and a session id an ephemeral node. Container nodes are INT64_MIN, the high byte 0xFF with
+ * the next two bytes 0 marks a TTL node whose TTL in ms is in the low 40 bits. Session ids never reach these values.
+ */
+struct EphemeralType
+{
+    static constexpr int64_t CONTAINER = std::numeric_limits<int64_t>::min();
+    static constexpr int64_t MAX_TTL = (1LL << 40) - 1;
+
+    static bool isContainer(int64_t owner) { return owner == CONTAINER; }
+    static bool isTTL(int64_t owner) { return (static_cast<UInt64>(owner) & EXTENDED_MASK) == TTL_PREFIX; }
+    static int64_t ttlOf(int64_t owner) { return owner & MAX_TTL; }
+    static int64_t ownerOfTTL(int64_t ttl) { return static_cast<int64_t>(TTL_PREFIX | static_cast<UInt64>(ttl)); }
+
+    /// Whether the node is an ephemeral node of session owner
+    static bool isSession(int64_t owner) { return owner != 0 && !isContainer(owner) && !isTTL(owner); }
+
+private:
+    static constexpr UInt64 EXTENDED_MASK = 0xFFFFFF0000000000ULL;
+    static constexpr UInt64 TTL_PREFIX = 0xFF00000000000000ULL;
+};
+
+}
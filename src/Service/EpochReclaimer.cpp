@@ -0,0 +1,127 @@
+#include <Service/EpochReclaimer.h>
+#include <algorithm>
+
+namespace RK
+{
+
+struct EpochReclaimer::ThreadState
+{
+    Slot * slot = nullptr;
+    /// Nested guards only publish the epoch in the outermost one
+    size_t depth = 0;
+
+    ~ThreadState()
+    {
+        if (slot)
+            EpochReclaimer::releaseSlot(slot);
+    }
+};
+
+thread_local EpochReclaimer::ThreadState EpochReclaimer::thread_state;
+
+EpochReclaimer & EpochReclaimer::instance()
+{
+    static auto * reclaimer = new EpochReclaimer();
+    return *reclaimer;
+}
+
+EpochReclaimer::Slot * EpochReclaimer::acquireSlot()
+{
+    for (auto * block = &first_block;;)
+    {
+        for (auto & slot : block->slots)
+        {
+            bool expected = false;
+            if (!slot.in_use.load(std::memory_order_relaxed)
+                && slot.in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return &slot;
+        }
+
+        auto * next = block->next.load(std::memory_order_acquire);
+        if (!next)
+        {
+            auto * fresh = new SlotBlock;
+            fresh->slots[0].in_use.store(true, std::memory_order_relaxed);
+            if (block->next.compare_exchange_strong(next, fresh, std::memory_order_acq_rel))
+                return &fresh->slots[0];
+            /// Another thread linked a block, next is it
+            delete fresh;
+        }
+        block = next;
+    }
+}
+
+void EpochReclaimer::enter()
+{
+    if (thread_state.depth++ != 0)
+        return;
+
+    if (!thread_state.slot)
+        thread_state.slot = acquireSlot();
+
+    thread_state.slot->epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    /// Pairs with the fence in reclaim: either reclaim sees the epoch, or the reader sees the unlinking made before it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void EpochReclaimer::leave()
+{
+    if (--thread_state.depth != 0)
+        return;
+    thread_state.slot->epoch.store(0, std::memory_order_release);
+}
+
+void EpochReclaimer::retireImpl(void * ptr, Deleter deleter)
+{
+    bool need_reclaim;
+    {
+        std::lock_guard lock(retired_mutex);
+        retired.push_back({global_epoch.load(std::memory_order_acquire), ptr, deleter});
+        need_reclaim = retired.size() % RECLAIM_BATCH == 0;
+    }
+    if (need_reclaim)
+        reclaim();
+}
+
+size_t EpochReclaimer::reclaim()
+{
+    std::vector<Retired> reclaimable;
+    {
+        std::lock_guard lock(retired_mutex);
+        if (retired.empty())
+            return 0;
+
+        /// Readers enter after it will never see objects retired before it
+        uint64_t min_active = global_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        for (const auto * block = &first_block; block; block = block->next.load(std::memory_order_acquire))
+        {
+            for (const auto & slot : block->slots)
+            {
+                uint64_t epoch = slot.epoch.load(std::memory_order_acquire);
+                if (epoch != 0 && epoch < min_active)
+                    min_active = epoch;
+            }
+        }
+
+        /// Two epochs after the retire epoch, readers in the epoch after it may have loaded it before it advanced
+        auto it = std::partition(
+            retired.begin(), retired.end(), [min_active](const Retired & r) { return r.epoch + 2 > min_active; });
+        reclaimable.assign(it, retired.end());
+        retired.erase(it, retired.end());
+    }
+
+    /// Free out of lock, deleters may retire other objects
+    for (const auto & r : reclaimable)
+        r.deleter(r.ptr);
+    return reclaimable.size();
+}
+
+size_t EpochReclaimer::pendingCount() const
+{
+    std::lock_guard lock(retired_mutex);
+    return retired.size();
+}
+
+}
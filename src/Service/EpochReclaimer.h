@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Epoch based reclamation for structures which are read without locks.
+ *
+ * A reader wraps its accesses in an EpochGuard, which publishes the global epoch in a slot
+ * owned by the thread. Entering and leaving only store to that slot, there is no atomic
+ * read-modify-write on a cache line shared with other readers.
+ *
+ * A writer unlinks an object so that new readers can not reach it and then retires it. Every reclaim
+ * advances the global epoch, a retired object is freed once the epoch advanced twice since it was
+ * retired and no active reader is in an epoch before that, so a reader which loaded the epoch just
+ * before the retire and published it late still holds the object back.
+ *
+ * Slots are in blocks of SLOTS_PER_BLOCK, a new block is linked when all of them are taken, so
+ * any number of threads may read.
+ */
+class EpochReclaimer
+{
+public:
+    static constexpr size_t SLOTS_PER_BLOCK = 512;
+    /// Try to free retired objects every RECLAIM_BATCH retires
+    static constexpr size_t RECLAIM_BATCH = 1024;
+
+    using Deleter = void (*)(void *);
+
+    /// Process wide reclaimer, never destroyed for objects may be retired during static destruction.
+    static EpochReclaimer & instance();
+
+    template <typename T>
+    void retire(T * ptr)
+    {
+        retireImpl(ptr, [](void * p) { delete static_cast<T *>(p); });
+    }
+
+    /// Free retired objects which are not reachable by any reader, return the number of freed objects.
+    /// Objects retired before a reclaim are freed by the next one at the earliest.
+    size_t reclaim();
+
+    /// Retired objects not freed yet
+    size_t pendingCount() const;
+
+    uint64_t currentEpoch() const { return global_epoch.load(std::memory_order_relaxed); }
+
+private:
+    friend class EpochGuard;
+
+    /// Epoch of a thread, 0 means not in a guard. Aligned to avoid false sharing between threads.
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<bool> in_use{false};
+    };
+
+    /// Never freed, threads keep pointers to their slots
+    struct SlotBlock
+    {
+        Slot slots[SLOTS_PER_BLOCK];
+        std::atomic<SlotBlock *> next{nullptr};
+    };
+
+    struct Retired
+    {
+        uint64_t epoch;
+        void * ptr;
+        Deleter deleter;
+    };
+
+    EpochReclaimer() = default;
+
+    struct ThreadState;
+    static thread_local ThreadState thread_state;
+
+    void retireImpl(void * ptr, Deleter deleter);
+
+    void enter();
+    void leave();
+
+    /// Slot of current thread, acquired on first use and released when the thread exits.
+    Slot * acquireSlot();
+    static void releaseSlot(Slot * slot) { slot->in_use.store(false, std::memory_order_release); }
+
+    std::atomic<uint64_t> global_epoch{1};
+    SlotBlock first_block;
+
+    mutable std::mutex retired_mutex;
+    std::vector<Retired> retired;
+};
+
+/// Readers may access objects reachable from lock free structures while the guard is alive. Guards can be nested.
+class EpochGuard
+{
+public:
+    EpochGuard() { EpochReclaimer::instance().enter(); }
+    ~EpochGuard() { EpochReclaimer::instance().leave(); }
+
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard & operator=(const EpochGuard &) = delete;
+};
+
+}
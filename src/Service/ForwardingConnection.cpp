@@ -34,6 +34,9 @@ void ForwardingConnection::connect(Poco::Timespan connection_timeout)
             socket.setSendTimeout(operation_timeout);
             socket.setNoDelay(true);
 
+            if (tls)
+                tls->connect(socket, endpoint);
+
             in.emplace(socket);
             out.emplace(socket);
 
@@ -65,29 +68,48 @@ void ForwardingConnection::disconnect()
     }
 }
 
-void ForwardingConnection::send(KeeperStore::RequestForSession request_for_session)
+bool ForwardingConnection::tryConnect()
 {
+    if (connected)
+        return true;
+
+    std::lock_guard lock(connect_mutex);
     if (!connected)
-    {
         connect(operation_timeout.totalMicroseconds() / 3);
-    }
+    return connected;
+}
 
-    if (!connected)
-    {
+void ForwardingConnection::connectIfNeeded()
+{
+    if (!tryConnect())
         throw Exception("ForwardingConnection connect failed", ErrorCodes::ALL_CONNECTION_TRIES_FAILED);
-    }
+}
 
+void ForwardingConnection::writeRequest(const KeeperStore::RequestForSession & request_for_session)
+{
     LOG_TRACE(log, "Forwarding session {}, xid {} to endpoint {}", toHexString(request_for_session.session_id), request_for_session.request->xid, endpoint);
 
+    Coordination::write(PkgType::Data, *out);
+    WriteBufferFromOwnString buf;
+    writeRequestPayload(request_for_session, buf);
+    Coordination::write(buf.str(), *out);
+}
+
+void ForwardingConnection::writeRequestPayload(const KeeperStore::RequestForSession & request_for_session, WriteBuffer & buf)
+{
+    Coordination::write(request_for_session.session_id, buf);
+    Coordination::write(request_for_session.request->xid, buf);
+    Coordination::write(request_for_session.request->getOpNum(), buf);
+    request_for_session.request->writeImpl(buf);
+}
+
+void ForwardingConnection::send(KeeperStore::RequestForSession request_for_session)
+{
+    connectIfNeeded();
+
     try
     {
-        Coordination::write(PkgType::Data, *out);
-        WriteBufferFromOwnString buf;
-        Coordination::write(request_for_session.session_id, buf);
-        Coordination::write(request_for_session.request->xid, buf);
-        Coordination::write(request_for_session.request->getOpNum(), buf);
-        request_for_session.request->writeImpl(buf);
-        Coordination::write(buf.str(), *out);
+        writeRequest(request_for_session);
         out->next();
     }
     catch(...)
@@ -99,6 +121,44 @@ void ForwardingConnection::send(KeeperStore::RequestForSession request_for_sessi
 
 }
 
+void ForwardingConnection::send(const KeeperStore::RequestsForSessions & requests, bool as_one_frame)
+{
+    connectIfNeeded();
+
+    try
+    {
+        if (as_one_frame && requests.size() > 1)
+        {
+            /// Count, then the payload of every request prefixed by its length, so that the leader skips a bad one
+            WriteBufferFromOwnString frame;
+            WriteBufferFromOwnString payload;
+            Coordination::write(static_cast<int32_t>(requests.size()), frame);
+            for (const auto & request_for_session : requests)
+            {
+                payload.restart();
+                writeRequestPayload(request_for_session, payload);
+                Coordination::write(payload.str(), frame);
+            }
+            LOG_TRACE(log, "Forwarding {} requests in one frame to endpoint {}", requests.size(), endpoint);
+            Coordination::write(PkgType::DataBatch, *out);
+            Coordination::write(frame.str(), *out);
+        }
+        else
+        {
+            /// The socket buffer is flushed only when it is full and at last
+            for (const auto & request_for_session : requests)
+                writeRequest(request_for_session);
+        }
+        out->next();
+    }
+    catch(...)
+    {
+        LOG_ERROR(log, "Got exception while forwarding {} requests to {}, {}", requests.size(), endpoint, getCurrentExceptionMessage(true));
+        disconnect();
+        throw Exception("ForwardingConnection send failed", ErrorCodes::NETWORK_ERROR);
+    }
+}
+
 bool ForwardingConnection::poll(UInt64 max_wait)
 {
     if (!connected)
@@ -130,6 +190,9 @@ bool ForwardingConnection::receive(ForwardResponse & response)
         Coordination::read(response.xid, *in);
         Coordination::read(response.opnum, *in);
 
+        if (response.protocol == ReadIndex)
+            Coordination::read(response.read_index, *in);
+
         return true;
     }
     catch(...)
@@ -143,15 +206,7 @@ bool ForwardingConnection::receive(ForwardResponse & response)
 
 void ForwardingConnection::sendSession(const std::unordered_map<int64_t, int64_t> & session_to_expiration_time)
 {
-    if (!connected)
-    {
-        connect(operation_timeout.totalMicroseconds() / 3);
-    }
-
-    if (!connected)
-    {
-        throw Exception("ForwardingConnection connect failed", ErrorCodes::ALL_CONNECTION_TRIES_FAILED);
-    }
+    connectIfNeeded();
 
     LOG_TRACE(log, "Send ping to endpoint {}", endpoint);
 
@@ -176,6 +231,48 @@ void ForwardingConnection::sendSession(const std::unordered_map<int64_t, int64_t
     }
 }
 
+void ForwardingConnection::sendReadIndex(int64_t round)
+{
+    connectIfNeeded();
+
+    LOG_TRACE(log, "Send read index round {} to endpoint {}", round, endpoint);
+
+    try
+    {
+        Coordination::write(PkgType::ReadIndex, *out);
+        Coordination::write(round, *out);
+        out->next();
+    }
+    catch(...)
+    {
+        LOG_ERROR(log, "Got exception while send read index to {}, {}", endpoint, getCurrentExceptionMessage(true));
+        disconnect();
+        throw Exception("ForwardingConnection send failed", ErrorCodes::NETWORK_ERROR);
+    }
+}
+
+void ForwardingConnection::sendSessionDelta(const SessionDelta & delta)
+{
+    connectIfNeeded();
+
+    LOG_TRACE(log, "Send {} changed sessions of round {} to endpoint {}", delta.sessions.size(), delta.round, endpoint);
+
+    try
+    {
+        WriteBufferFromOwnString buf;
+        writeSessionDelta(delta, buf);
+        Coordination::write(PkgType::SessionDelta, *out);
+        Coordination::write(buf.str(), *out);
+        out->next();
+    }
+    catch(...)
+    {
+        LOG_ERROR(log, "Got exception while send session delta to {}, {}", endpoint, getCurrentExceptionMessage(true));
+        disconnect();
+        throw Exception("ForwardingConnection send failed", ErrorCodes::NETWORK_ERROR);
+    }
+}
+
 void ForwardingConnection::sendHandshake()
 {
     Coordination::write(PkgType::Handshake, *out);
@@ -3,7 +3,10 @@
 #include <IO/ReadBufferFromPocoSocket.h>
 #include <IO/WriteBufferFromPocoSocket.h>
 #include <Service/KeeperStore.h>
+#include <Service/KernelTLS.h>
+#include <Service/SessionSync.h>
 #include <Service/WriteBufferFromFiFoBuffer.h>
+#include <mutex>
 #include <libnuraft/async.hxx>
 #include <Poco/Net/StreamSocket.h>
 #include <Common/ZooKeeper/ZooKeeperCommon.h>
@@ -20,7 +23,13 @@ enum PkgType : int8_t
     Session = 2,
     Data = 3,
     /// TODO remove Result
-    Result = 4
+    Result = 4,
+    /// Ask the leader for its commit index, see ReadIndexTracker
+    ReadIndex = 5,
+    /// Sessions changed since the last acknowledged sync round, see SessionSyncTracker
+    SessionDelta = 6,
+    /// Data packages in one frame, each prefixed by its length, answered by a Result for every request
+    DataBatch = 7
 };
 
 struct ForwardResponse
@@ -39,6 +48,9 @@ struct ForwardResponse
     int64_t xid{non_xid};
     Coordination::OpNum opnum{Coordination::OpNum::Error};
 
+    /// Commit index of the leader, only for ReadIndex whose xid is the round
+    int64_t read_index{0};
+
     void write(WriteBufferFromFiFoBuffer & buf) const
     {
         Coordination::write(protocol, buf);
@@ -47,6 +59,8 @@ struct ForwardResponse
         Coordination::write(session_id, buf);
         Coordination::write(xid, buf);
         Coordination::write(opnum, buf);
+        if (protocol == ReadIndex)
+            Coordination::write(read_index, buf);
     }
 
     String toString() const
@@ -67,6 +81,15 @@ struct ForwardResponse
             case Result:
                 res += "Result";
                 break;
+            case ReadIndex:
+                res += "ReadIndex";
+                break;
+            case SessionDelta:
+                res += "SessionDelta";
+                break;
+            case DataBatch:
+                res += "DataBatch";
+                break;
             default:
                 res += "Unknown";
                 break;
@@ -76,6 +99,8 @@ struct ForwardResponse
         res += ", session_id: " + std::to_string(session_id);
         res += ", xid: " + std::to_string(xid);
         res += ", opnum: " + Coordination::toString(opnum);
+        if (protocol == ReadIndex)
+            res += ", read_index: " + std::to_string(read_index);
         return res;
     }
 };
@@ -83,17 +108,24 @@ struct ForwardResponse
 class ForwardingConnection
 {
 public:
-    ForwardingConnection(int32_t server_id_, int32_t thread_id_, String endpoint_, Poco::Timespan operation_timeout_ms)
+    /// The connection is by TLS if tls_ is not nullptr
+    ForwardingConnection(
+        int32_t server_id_, int32_t thread_id_, String endpoint_, Poco::Timespan operation_timeout_ms, KernelTLSPtr tls_ = nullptr)
         : my_server_id(server_id_)
         , thread_id(thread_id_)
         , endpoint(endpoint_)
         , operation_timeout(operation_timeout_ms)
+        , tls(std::move(tls_))
         , log(&Poco::Logger::get("ForwardingConnection"))
     {
     }
 
     void connect(Poco::Timespan connection_timeout);
+    /// Connect if not connected, safe to call from another thread than the sending one. Returns whether connected.
+    bool tryConnect();
     void send(KeeperStore::RequestForSession request_for_session);
+    /// Send requests by one write, as one DataBatch frame if as_one_frame, as Data packages back to back otherwise
+    void send(const KeeperStore::RequestsForSessions & requests, bool as_one_frame = false);
     bool receive(ForwardResponse & response);
     void disconnect();
 
@@ -103,6 +135,11 @@ public:
 
     void sendSession(const std::unordered_map<int64_t, int64_t> & session_to_expiration_time);
 
+    void sendReadIndex(int64_t round);
+
+    /// Acknowledged by a SessionDelta response whose xid is the round
+    void sendSessionDelta(const SessionDelta & delta);
+
     bool poll(UInt64 max_wait);
 
     bool isConnected() const { return connected; }
@@ -121,11 +158,19 @@ public:
     }
 
 private:
+    void connectIfNeeded();
+    void writeRequest(const KeeperStore::RequestForSession & request_for_session);
+    /// Session id, xid, opnum and body of the request, the payload of Data
+    static void writeRequestPayload(const KeeperStore::RequestForSession & request_for_session, WriteBuffer & buf);
+
     int32_t my_server_id;
     int32_t thread_id;
-    bool connected{false};
+    std::atomic<bool> connected{false};
+    /// Connecting by the sending thread and the background connector of RequestForwarder
+    std::mutex connect_mutex;
     String endpoint;
     Poco::Timespan operation_timeout;
+    KernelTLSPtr tls;
     Poco::Net::StreamSocket socket;
     std::optional<ReadBufferFromPocoSocket> in;
     std::optional<WriteBufferFromPocoSocket> out;
@@ -32,6 +32,8 @@ ForwardingConnectionHandler::ForwardingConnectionHandler(Context & global_contex
     , global_context(global_context_)
     , keeper_dispatcher(global_context.getDispatcher())
     , responses(std::make_unique<ThreadSafeResponseQueue>())
+    , max_send_iov_count(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_send_iov_count)
+    , max_send_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_send_bytes)
 {
     LOG_DEBUG(log, "New connection from {}", socket_.peerAddress().toString());
 
@@ -68,6 +70,10 @@ void ForwardingConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotific
         LOG_TRACE(log, "Forwarding handler socket readable");
         if (!socket_.available())
         {
+            /// An edge triggered reactor may report data which was already drained when handling the last event
+            if (reactor_.isEdgeTriggered()
+                && !socket_.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_ERROR))
+                return;
             LOG_INFO(log, "Client close connection! errno {}", errno);
             destroyMe();
             return;
@@ -103,6 +109,9 @@ void ForwardingConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotific
                     case PkgType::Handshake:
                     case PkgType::Session:
                     case PkgType::Data:
+                    case PkgType::DataBatch:
+                    case PkgType::ReadIndex:
+                    case PkgType::SessionDelta:
                         current_package.is_done = false;
                         break;
                     default:
@@ -129,7 +138,7 @@ void ForwardingConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotific
                     Coordination::read(client_id, body);
 
                     /// register session response callback
-                    auto response_callback = [this](const ForwardResponse & response) { sendResponse(response); };
+                    auto response_callback = [this](const ForwardResponse * responses_, size_t count) { sendResponses(responses_, count); };
 
                     keeper_dispatcher->registerForward({server_id, client_id}, response_callback);
 
@@ -196,6 +205,34 @@ void ForwardingConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotific
                         tryLogCurrentException(log, "Error processing request.");
                     }
                 }
+                else if (current_package.protocol == PkgType::DataBatch)
+                {
+                    if (!req_body_buf)
+                    {
+                        if (!req_body_len_buf.isFull())
+                        {
+                            socket_.receiveBytes(req_body_len_buf);
+                            if (!req_body_len_buf.isFull())
+                                continue;
+                        }
+
+                        int32_t body_len{};
+                        ReadBufferFromMemory read_buf(req_body_len_buf.begin(), req_body_len_buf.used());
+                        Coordination::read(body_len, read_buf);
+                        req_body_len_buf.drain(req_body_len_buf.used());
+
+                        req_body_buf = std::make_shared<FIFOBuffer>(body_len);
+                    }
+
+                    socket_.receiveBytes(*req_body_buf);
+                    if (!req_body_buf->isFull())
+                        continue;
+
+                    receiveRequests();
+
+                    req_body_buf.reset();
+                    current_package.is_done = true;
+                }
                 else if (current_package.protocol == PkgType::Session)
                 {
                     try
@@ -264,6 +301,86 @@ void ForwardingConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotific
                         tryLogCurrentException(log, "Error processing ping request.");
                     }
                 }
+                else if (current_package.protocol == PkgType::SessionDelta)
+                {
+                    if (!req_body_buf)
+                    {
+                        if (!req_body_len_buf.isFull())
+                        {
+                            socket_.receiveBytes(req_body_len_buf);
+                            if (!req_body_len_buf.isFull())
+                                continue;
+                        }
+
+                        int32_t body_len{};
+                        ReadBufferFromMemory read_buf(req_body_len_buf.begin(), req_body_len_buf.used());
+                        Coordination::read(body_len, read_buf);
+                        req_body_len_buf.drain(req_body_len_buf.used());
+
+                        req_body_buf = std::make_shared<FIFOBuffer>(body_len);
+                    }
+
+                    socket_.receiveBytes(*req_body_buf);
+                    if (!req_body_buf->isFull())
+                        continue;
+
+                    SessionDelta delta;
+                    bool accepted = true;
+                    try
+                    {
+                        ReadBufferFromMemory body(req_body_buf->begin(), req_body_buf->used());
+                        readSessionDelta(delta, body);
+                        LOG_TRACE(log, "Receive {} changed sessions of round {} from server {}", delta.sessions.size(), delta.round, server_id);
+                        keeper_dispatcher->handleRemoteSessions(delta.sessions);
+                    }
+                    catch (...)
+                    {
+                        accepted = false;
+                        tryLogCurrentException(log, "Error processing session delta.");
+                    }
+
+                    req_body_buf.reset();
+                    current_package.is_done = true;
+
+                    ForwardResponse response{
+                        PkgType::SessionDelta,
+                        accepted,
+                        nuraft::cmd_result_code::OK,
+                        ForwardResponse::non_session_id,
+                        static_cast<int64_t>(delta.round),
+                        Coordination::OpNum::Error};
+                    keeper_dispatcher->sendAppendEntryResponse(server_id, client_id, response);
+                }
+                else if (current_package.protocol == PkgType::ReadIndex)
+                {
+                    if (!req_body_buf)
+                        req_body_buf = std::make_shared<FIFOBuffer>(8);
+
+                    socket_.receiveBytes(*req_body_buf);
+                    if (!req_body_buf->isFull())
+                        continue;
+
+                    ReadBufferFromMemory body(req_body_buf->begin(), req_body_buf->used());
+                    int64_t round;
+                    Coordination::read(round, body);
+
+                    /// Not accepted if I am not the leader any more
+                    auto read_index = keeper_dispatcher->getReadIndex();
+                    LOG_TRACE(log, "Receive read index round {} from server {}, read index {}", round, server_id, read_index.value_or(0));
+
+                    ForwardResponse response{
+                        PkgType::ReadIndex,
+                        read_index.has_value(),
+                        nuraft::cmd_result_code::OK,
+                        ForwardResponse::non_session_id,
+                        round,
+                        Coordination::OpNum::Error};
+                    response.read_index = static_cast<int64_t>(read_index.value_or(0));
+                    keeper_dispatcher->sendAppendEntryResponse(server_id, client_id, response);
+
+                    req_body_buf.reset();
+                    current_package.is_done = true;
+                }
             }
         }
     }
@@ -283,58 +400,19 @@ void ForwardingConnectionHandler::onSocketWritable(const AutoPtr<WritableNotific
 {
     try
     {
-        if (responses->empty() && send_buf.used() == 0)
+        if (responses->empty())
             return;
 
-        /// TODO use zero copy buffer
-        size_t size_to_sent = 0;
-
-        /// 1. accumulate data into tmp_buf
-        responses->forEach([&size_to_sent, this](const auto & resp) -> bool {
-            if (size_to_sent + resp->used() < SENT_BUFFER_SIZE)
-            {
-                /// add whole resp to send_buf
-                send_buf.write(resp->begin(), resp->used());
-                size_to_sent += resp->used();
-            }
-            else if (size_to_sent + resp->used() == SENT_BUFFER_SIZE)
-            {
-                /// add whole resp to send_buf
-                send_buf.write(resp->begin(), resp->used());
-                size_to_sent += resp->used();
-            }
-            else
-            {
-                /// add part of resp to send_buf
-                send_buf.write(resp->begin(), SENT_BUFFER_SIZE - size_to_sent);
-            }
-            return size_to_sent < SENT_BUFFER_SIZE;
-        });
-
-        /// 2. send data
-        size_t sent = socket_.sendBytes(send_buf);
-
-        /// 3. remove sent responses
-
-        ptr<FIFOBuffer> resp;
-        while (responses->peek(resp) && sent > 0)
+        /// An edge triggered reactor does not report the socket again while it stays writable, so send until it would block
+        bool edge_triggered = reactor_.isEdgeTriggered();
+        GatheredSendResult result;
+        do
         {
-            if (sent >= resp->used())
-            {
-                sent -= resp->used();
-                responses->remove();
-            }
-            else
-            {
-                resp->drain(sent);
-                /// move data to begin
-                resp->begin();
-                sent = 0;
-            }
-        }
+            result = sendResponsesGathered(socket_, *responses, head_response_sent, max_send_iov_count, max_send_bytes);
+        } while (edge_triggered && !result.would_block && !responses->empty());
 
         /// If all sent unregister writable event.
-        if (responses->empty() && send_buf.used() == 0)
+        if (responses->empty())
         {
             LOG_TRACE(log, "Remove socket writable event handler - session {}", socket_.peerAddress().toString());
             reactor_.removeEventHandler(
@@ -387,11 +465,63 @@ std::tuple<int64_t, int64_t, Coordination::OpNum> ForwardingConnectionHandler::r
     return {session_id, xid, opnum};
 }
 
-void ForwardingConnectionHandler::sendResponse(const ForwardResponse & response)
+void ForwardingConnectionHandler::receiveRequests()
+{
+    ReadBufferFromMemory body(req_body_buf->begin(), req_body_buf->used());
+    int32_t count;
+    Coordination::read(count, body);
+
+    KeeperStore::RequestsForSessions requests;
+    requests.reserve(count);
+    std::vector<ForwardResponse> failed;
+    for (int32_t i = 0; i < count; ++i)
+    {
+        int32_t length;
+        Coordination::read(length, body);
+        if (length < 0 || static_cast<size_t>(length) > body.available())
+            throw Exception(ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Bad length {} of request {} of a forwarded batch", length, i);
+
+        /// Parsed in place, a request failing to parse is answered alone
+        ReadBufferFromMemory payload(body.position(), length);
+        body.ignore(length);
+
+        KeeperStore::RequestForSession request_info;
+        request_info.session_id = ForwardResponse::non_session_id;
+        int32_t xid = static_cast<int32_t>(ForwardResponse::non_xid);
+        Coordination::OpNum opnum = Coordination::OpNum::Error;
+        try
+        {
+            Coordination::read(request_info.session_id, payload);
+            Coordination::read(xid, payload);
+            Coordination::read(opnum, payload);
+            request_info.request = Coordination::ZooKeeperRequestFactory::instance().get(opnum);
+            request_info.request->xid = xid;
+            request_info.request->readImpl(payload);
+            requests.push_back(std::move(request_info));
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Error parsing a request of a forwarded batch.");
+            failed.push_back({PkgType::Result, false, nuraft::cmd_result_code::CANCELLED, request_info.session_id, xid, opnum});
+        }
+    }
+
+    LOG_TRACE(log, "Receive {} forwarding requests in one frame from server {}", count, server_id);
+
+    keeper_dispatcher->putForwardingRequests(server_id, client_id, requests, failed);
+    if (!failed.empty())
+        keeper_dispatcher->sendAppendEntryResponses(server_id, client_id, failed.data(), failed.size());
+}
+
+void ForwardingConnectionHandler::sendResponses(const ForwardResponse * responses_, size_t count)
 {
-    LOG_TRACE(log, "Send response {}", response.toString());
+    /// One buffer and one wake up for responses of a batch
     WriteBufferFromFiFoBuffer buf;
-    response.write(buf);
+    for (size_t i = 0; i < count; ++i)
+    {
+        LOG_TRACE(log, "Send response {}", responses_[i].toString());
+        responses_[i].write(buf);
+    }
 
     /// TODO handle timeout
     responses->push(buf.getBuffer());
@@ -45,15 +45,14 @@ public:
 
 private:
     std::tuple<int64_t, int64_t, Coordination::OpNum> receiveRequest(int32_t length);
+    /// Requests of a DataBatch frame, appended to the Raft batch of the accumulator at once
+    void receiveRequests();
 
-    void sendResponse(const ForwardResponse & response);
+    void sendResponses(const ForwardResponse * responses_, size_t count);
 
     /// destroy connection
     void destroyMe();
 
-    static constexpr size_t SENT_BUFFER_SIZE = 1024;
-    FIFOBuffer send_buf = FIFOBuffer(SENT_BUFFER_SIZE);
-
     Logger * log;
 
     StreamSocket socket_;
@@ -77,6 +76,11 @@ private:
 
     Stopwatch session_stopwatch;
     ThreadSafeResponseQueuePtr responses;
+    /// Bytes of the head of responses sent
+    size_t head_response_sent = 0;
+    /// Limits of a writev sending responses
+    size_t max_send_iov_count;
+    size_t max_send_bytes;
 
     int32_t server_id;
     int32_t client_id;
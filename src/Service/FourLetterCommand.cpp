@@ -6,9 +6,15 @@
 #include <Common/config_version.h>
 #include <Service/Keeper4LWInfo.h>
 #include <Service/KeeperDispatcher.h>
+#include <Service/PipelineStageThreads.h>
+#include <Service/SlabAllocator.h>
+#include <Service/StallWatchdog.h>
 #include <Poco/Environment.h>
 #include <Poco/Path.h>
 #include <Poco/String.h>
+#include <Common/SamplingProfiler.h>
+#include <Common/Stopwatch.h>
+#include <Common/heapProfile.h>
 #include <Common/StringUtils/StringUtils.h>
 #include <Common/getCurrentProcessFDCount.h>
 #include <Common/getMaxFileDescriptorCount.h>
@@ -49,6 +55,11 @@ int32_t IFourLetterCommand::toCode(const String & name)
 
 IFourLetterCommand::~IFourLetterCommand() = default;
 
+void IFourLetterCommand::runStreamed(WriteBuffer & out)
+{
+    writeString(run(), out);
+}
+
 FourLetterCommandFactory & FourLetterCommandFactory::instance()
 {
     static FourLetterCommandFactory factory;
@@ -107,6 +118,9 @@ void FourLetterCommandFactory::registerCommands(KeeperDispatcher & keeper_dispat
         FourLetterCommandPtr data_size_command = std::make_shared<DataSizeCommand>(keeper_dispatcher);
         factory.registerCommand(data_size_command);
 
+        FourLetterCommandPtr subtree_stat_command = std::make_shared<SubtreeStatCommand>(keeper_dispatcher);
+        factory.registerCommand(subtree_stat_command);
+
         FourLetterCommandPtr dump_command = std::make_shared<DumpCommand>(keeper_dispatcher);
         factory.registerCommand(dump_command);
 
@@ -143,6 +157,51 @@ void FourLetterCommandFactory::registerCommands(KeeperDispatcher & keeper_dispat
         FourLetterCommandPtr request_leader_command = std::make_shared<RequestLeaderCommand>(keeper_dispatcher);
         factory.registerCommand(request_leader_command);
 
+        FourLetterCommandPtr latency_command = std::make_shared<LatencyCommand>(keeper_dispatcher);
+        factory.registerCommand(latency_command);
+
+        FourLetterCommandPtr trace_command = std::make_shared<TraceCommand>(keeper_dispatcher);
+        factory.registerCommand(trace_command);
+
+        FourLetterCommandPtr lock_stats_command = std::make_shared<LockStatsCommand>(keeper_dispatcher);
+        factory.registerCommand(lock_stats_command);
+
+        FourLetterCommandPtr hot_keys_command = std::make_shared<HotKeysCommand>(keeper_dispatcher);
+        factory.registerCommand(hot_keys_command);
+
+        FourLetterCommandPtr memory_command = std::make_shared<MemoryCommand>(keeper_dispatcher);
+        factory.registerCommand(memory_command);
+
+        FourLetterCommandPtr top_sessions_command = std::make_shared<TopSessionsCommand>(keeper_dispatcher);
+        factory.registerCommand(top_sessions_command);
+
+        FourLetterCommandPtr cpu_profile_command = std::make_shared<CpuProfileCommand>(keeper_dispatcher);
+        factory.registerCommand(cpu_profile_command);
+
+        FourLetterCommandPtr wall_profile_command = std::make_shared<WallProfileCommand>(keeper_dispatcher);
+        factory.registerCommand(wall_profile_command);
+
+        FourLetterCommandPtr profile_command = std::make_shared<ProfileCommand>(keeper_dispatcher);
+        factory.registerCommand(profile_command);
+
+        FourLetterCommandPtr heap_profile_on_command = std::make_shared<HeapProfileOnCommand>(keeper_dispatcher);
+        factory.registerCommand(heap_profile_on_command);
+
+        FourLetterCommandPtr heap_profile_off_command = std::make_shared<HeapProfileOffCommand>(keeper_dispatcher);
+        factory.registerCommand(heap_profile_off_command);
+
+        FourLetterCommandPtr heap_profile_command = std::make_shared<HeapProfileCommand>(keeper_dispatcher);
+        factory.registerCommand(heap_profile_command);
+
+        FourLetterCommandPtr allocator_stats_command = std::make_shared<AllocatorStatsCommand>(keeper_dispatcher);
+        factory.registerCommand(allocator_stats_command);
+
+        FourLetterCommandPtr capture_begin_command = std::make_shared<CaptureBeginCommand>(keeper_dispatcher);
+        factory.registerCommand(capture_begin_command);
+
+        FourLetterCommandPtr capture_end_command = std::make_shared<CaptureEndCommand>(keeper_dispatcher);
+        factory.registerCommand(capture_end_command);
+
         factory.initializeWhiteList(keeper_dispatcher);
         factory.setInitialize(true);
     }
@@ -230,22 +289,175 @@ ConnectionStats stats = keeper_dispatcher.getKeeperConnectionStats();
     print(ret, "avg_latency", stats.getAvgLatency());
     print(ret, "max_latency", stats.getMaxLatency());
     print(ret, "min_latency", stats.getMinLatency());
+
+    const auto & latency_stats = keeper_dispatcher.getRequestLatencyStats();
+    auto print_percentiles = [&](const String & prefix, const LatencyPercentiles & percentiles)
+    {
+        print(ret, prefix + "_p50", percentiles.p50);
+        print(ret, prefix + "_p90", percentiles.p90);
+        print(ret, prefix + "_p99", percentiles.p99);
+        print(ret, prefix + "_p999", percentiles.p999);
+    };
+    print_percentiles("latency_us", LatencyHistogram::getPercentiles(latency_stats.getTotalCounts()));
+    for (size_t slot = 0; slot < RequestLatencyStats::OPERATION_SLOTS; ++slot)
+    {
+        auto percentiles = LatencyHistogram::getPercentiles(latency_stats.getOperationCounts(slot));
+        if (percentiles.count)
+            print_percentiles(Poco::toLower(RequestLatencyStats::operationName(slot)) + "_latency_us", percentiles);
+    }
+    const auto & tracer = keeper_dispatcher.getRequestTracer();
+    for (size_t span = 0; span < RequestTracer::SPANS; ++span)
+    {
+        auto percentiles = tracer.get(static_cast<RequestTracer::Span>(span)).getPercentiles();
+        print(ret, String("stage_") + RequestTracer::spanName(static_cast<RequestTracer::Span>(span)) + "_us_p99", percentiles.p99);
+    }
     print(ret, "packets_received", stats.getPacketsReceived());
     print(ret, "packets_sent", stats.getPacketsSent());
 
     print(ret, "num_alive_connections", keeper_info.alive_connections_count);
+    print(ret, "trimmed_connections", ConnectionHandler::getTrimmedConnections());
     print(ret, "outstanding_requests", keeper_info.outstanding_requests_count);
+    print(ret, "throttled_requests", keeper_info.throttled_requests_count);
+    print(ret, "rate_limited_requests", keeper_info.rate_limited_requests_count);
+    print(ret, "expired_requests", keeper_info.expired_requests_count);
+    print(ret, "abandoned_requests", keeper_info.abandoned_requests_count);
+    print(ret, "queued_control_requests", keeper_info.queued_requests_by_lane[PriorityRequestsQueue::CONTROL]);
+    print(ret, "queued_read_requests", keeper_info.queued_requests_by_lane[PriorityRequestsQueue::READ]);
+    print(ret, "queued_write_requests", keeper_info.queued_requests_by_lane[PriorityRequestsQueue::WRITE]);
+    print(ret, "commit_queue_size", keeper_info.commit_queue_size);
+    for (const auto & group : keeper_info.client_groups)
+    {
+        String prefix = "client_group_" + group.name;
+        print(ret, prefix + "_weight", group.weight);
+        print(ret, prefix + "_queued_requests", group.queued);
+        print(ret, prefix + "_popped_requests", group.popped);
+    }
+    for (size_t i = 0; i < keeper_info.request_runners.size(); ++i)
+    {
+        const auto & runner = keeper_info.request_runners[i];
+        String prefix = "request_runner_" + std::to_string(i);
+        print(ret, prefix + "_queue_depth", runner.queue_depth);
+        print(ret, prefix + "_pending_requests", runner.pending_requests);
+        print(ret, prefix + "_steal_count", runner.steal_count);
+    }
+    for (size_t i = 0; i < keeper_info.request_batches.size(); ++i)
+    {
+        const auto & batch = keeper_info.request_batches[i];
+        String prefix = "request_batch_" + std::to_string(i);
+        print(ret, prefix + "_size", batch.batch_size);
+        print(ret, prefix + "_last_size", batch.last_batch_size);
+        print(ret, prefix + "_p99_commit_latency_us", batch.p99_commit_latency_us);
+        print(ret, prefix + "_flush_by_size", batch.flushes[AdaptiveBatchPolicy::SIZE]);
+        print(ret, prefix + "_flush_by_time", batch.flushes[AdaptiveBatchPolicy::TIME]);
+        print(ret, prefix + "_flush_by_idle", batch.flushes[AdaptiveBatchPolicy::IDLE]);
+    }
+
+    const auto & log_cache = keeper_info.log_cache;
+    print(ret, "log_cache_hits", log_cache.hits);
+    print(ret, "log_cache_misses", log_cache.misses);
+    print(ret, "log_cache_read_ahead_hits", log_cache.read_ahead_hits);
+    /// Percent of lookups served from memory, by the cache or by read ahead
+    UInt64 lookups = log_cache.hits + log_cache.misses;
+    print(ret, "log_cache_hit_ratio", lookups ? (log_cache.hits + log_cache.read_ahead_hits) * 100 / lookups : 0);
+    print(ret, "log_cache_entries", log_cache.entries);
+    print(ret, "log_cache_bytes", log_cache.bytes);
+    print(ret, "log_cache_max_bytes", log_cache.max_bytes);
+    print(ret, "batch_entry_raw_bytes", keeper_info.batch_entry_raw_bytes);
+    print(ret, "batch_entry_bytes", keeper_info.batch_entry_bytes);
+
+    auto reactors = SocketReactor::getAllStats();
+    std::sort(reactors.begin(), reactors.end(), [](const auto & lhs, const auto & rhs) { return lhs.name < rhs.name; });
+    for (const auto & reactor : reactors)
+    {
+        /// NIO-HANDLER#0 is reported as reactor_nio_handler_0
+        String prefix = "reactor_" + Poco::toLower(reactor.name);
+        std::replace_if(prefix.begin(), prefix.end(), [](char c) { return !isAlphaNumericASCII(c); }, '_');
+        print(ret, prefix + "_loop_count", reactor.loop_count);
+        print(ret, prefix + "_event_count", reactor.event_count);
+        print(ret, prefix + "_events_per_loop", reactor.loop_count ? reactor.event_count / reactor.loop_count : 0);
+        print(ret, prefix + "_avg_loop_time_us", reactor.loop_count ? reactor.loop_time_us / reactor.loop_count : 0);
+        print(ret, prefix + "_max_loop_time_us", reactor.max_loop_time_us);
+        print(ret, prefix + "_socket_count", reactor.socket_count);
+    }
+
+    print(ret, "stall_count", StallWatchdog::instance().stallCount());
+    print(ret, "stalled_threads", StallWatchdog::instance().stalledThreads());
+
+    for (const auto & stage : PipelineStageThreads::instance().collect())
+    {
+        String prefix = "stage_" + stage.name;
+        print(ret, prefix + "_threads", stage.threads);
+        print(ret, prefix + "_utilization", stage.utilization);
+        print(ret, prefix + "_cpu_us", stage.cpu_us);
+        print(ret, prefix + "_cpu_wait_us", stage.cpu_wait_us);
+        print(ret, prefix + "_io_wait_us", stage.io_wait_us);
+        print(ret, prefix + "_voluntary_switches", stage.voluntary_switches);
+        print(ret, prefix + "_involuntary_switches", stage.involuntary_switches);
+    }
 
     print(ret, "server_state", keeper_info.getRole());
 
     print(ret, "znode_count", state_machine.getNodesCount());
     print(ret, "watch_count", state_machine.getTotalWatchesCount());
     print(ret, "ephemerals_count", state_machine.getTotalEphemeralNodesCount());
-    print(ret, "approximate_data_size", state_machine.getApproximateDataSize());
+    auto memory_stats = state_machine.getMemoryStats();
+    print(ret, "approximate_data_size", memory_stats.total());
+    print(ret, "node_bytes", memory_stats.node_bytes);
+    print(ret, "data_bytes", memory_stats.data_bytes);
+    print(ret, "compression_saved_bytes", memory_stats.compression_saved_bytes);
+    print(ret, "path_bytes", memory_stats.path_bytes);
+    print(ret, "children_bytes", memory_stats.children_bytes);
+    print(ret, "watch_bytes", memory_stats.watch_bytes);
+    print(ret, "acl_bytes", memory_stats.acl_bytes);
+    print(ret, "digest", state_machine.getDigest());
     print(ret, "snap_count", state_machine.getSnapshotCount());
     print(ret, "snap_time_ms", state_machine.getSnapshotTimeMs());
     print(ret, "in_snapshot", state_machine.getSnapshoting());
 
+    auto memory_info = keeper_dispatcher.getKeeperMemoryInfo();
+    print(ret, "memory_resident_bytes", memory_info.resident);
+    print(ret, "memory_huge_pages_enabled", memory_info.huge_pages_enabled);
+    print(ret, "memory_huge_pages_bytes", memory_info.huge_pages);
+    print(ret, "memory_data_tree_bytes", memory_info.data_tree);
+    print(ret, "memory_watches_bytes", memory_info.watches);
+    print(ret, "memory_log_cache_bytes", memory_info.log_cache);
+    print(ret, "memory_connection_buffers_bytes", memory_info.connection_buffers);
+    print(ret, "memory_snapshot_bytes", std::max<Int64>(memory_info.snapshot, 0));
+    print(ret, "memory_other_bytes", memory_info.other());
+    print(ret, "memory_soft_limit", memory_info.soft_limit);
+    print(ret, "memory_pressure", memory_info.memory_pressure);
+    print(ret, "memory_rejected_sessions", memory_info.rejected_sessions);
+
+    /// Occupancy of slab size classes of nodes and hot responses, "free" objects are held by the pool for reuse.
+    /// "used" includes the few free objects cached by every thread.
+    for (const auto & slab : SlabPool::instance().getStats())
+    {
+        String prefix = "slab_class_" + toString(slab.object_size);
+        print(ret, prefix + "_used", slab.used);
+        print(ret, prefix + "_free", slab.free);
+        print(ret, prefix + "_bytes", slab.bytes);
+    }
+
+    /// Lag of every hop of relayed replication, see RelayReplicator
+    if (auto relay = keeper_dispatcher.getRelayStats())
+    {
+        print(ret, "relay_upstream_alive", relay->upstream_alive);
+        print(ret, "relay_upstream_stalled", relay->stalled);
+        print(ret, "relay_upstream_lag", relay->upstream_commit_index - std::min(relay->applied_index, relay->upstream_commit_index));
+        print(ret, "relay_source_lag", relay->source_commit_index - std::min(relay->applied_index, relay->source_commit_index));
+    }
+    auto downstreams = keeper_dispatcher.getRelayDownstreams();
+    print(ret, "relay_downstream_count", downstreams.size());
+    UInt64 committed_index = keeper_dispatcher.getCommittedIndex();
+    UInt64 now_ms = clock_gettime_ns(CLOCK_MONOTONIC_COARSE) / 1000000;
+    for (const auto & downstream : downstreams)
+    {
+        String prefix = "relay_downstream_" + toString(downstream.server_id);
+        print(ret, prefix + "_applied_index", downstream.applied_index);
+        print(ret, prefix + "_lag", committed_index - std::min(downstream.applied_index, committed_index));
+        print(ret, prefix + "_last_fetch_ms_ago", now_ms - std::min(downstream.last_fetch_ms, now_ms));
+    }
+
 #if defined(__linux__) || defined(__APPLE__)
     print(ret, "open_file_descriptor_count", getCurrentProcessFDCount());
     print(ret, "max_file_descriptor_count", getMaxFileDescriptorCount());
@@ -281,10 +493,15 @@ String ConfCommand::run()
 String ConsCommand::run()
 {
     StringBuffer buf;
-    ConnectionHandler::dumpConnections(buf, false);
+    runStreamed(buf);
     return buf.str();
 }
 
+void ConsCommand::runStreamed(WriteBuffer & out)
+{
+    ConnectionHandler::dumpConnections(out, false);
+}
+
 String RestConnStatsCommand::run()
 {
     ConnectionHandler::resetConnsStats();
@@ -312,6 +529,11 @@ String ServerStatCommand::run()
     latency << stats.getMinLatency() << "/" << stats.getAvgLatency() << "/" << stats.getMaxLatency();
     write("Latency min/avg/max", latency.str());
 
+    auto percentiles = LatencyHistogram::getPercentiles(keeper_dispatcher.getRequestLatencyStats().getTotalCounts());
+    StringBuffer latency_us;
+    latency_us << percentiles.p50 << "/" << percentiles.p99 << "/" << percentiles.p999;
+    write("Latency us p50/p99/p999", latency_us.str());
+
     write("Received", toString(stats.getPacketsReceived()));
     write("Sent ", toString(stats.getPacketsSent()));
     write("Connections", toString(keeper_info.alive_connections_count));
@@ -342,6 +564,11 @@ String StatCommand::run()
     latency << stats.getMinLatency() << "/" << stats.getAvgLatency() << "/" << stats.getMaxLatency();
     write("Latency min/avg/max", latency.str());
 
+    auto percentiles = LatencyHistogram::getPercentiles(keeper_dispatcher.getRequestLatencyStats().getTotalCounts());
+    StringBuffer latency_us;
+    latency_us << percentiles.p50 << "/" << percentiles.p99 << "/" << percentiles.p999;
+    write("Latency us p50/p99/p999", latency_us.str());
+
     write("Received", toString(stats.getPacketsReceived()));
     write("Sent ", toString(stats.getPacketsSent()));
     write("Connections", toString(keeper_info.alive_connections_count));
@@ -366,19 +593,27 @@ String BriefWatchCommand::run()
 String WatchCommand::run()
 {
     StringBuffer buf;
-    const auto & state_machine = keeper_dispatcher.getStateMachine();
-    state_machine.dumpWatches(buf);
+    runStreamed(buf);
     return buf.str();
 }
 
+void WatchCommand::runStreamed(WriteBuffer & out)
+{
+    keeper_dispatcher.getStateMachine().dumpWatches(out);
+}
+
 String WatchByPathCommand::run()
 {
     StringBuffer buf;
-    const auto & state_machine = keeper_dispatcher.getStateMachine();
-    state_machine.dumpWatchesByPath(buf);
+    runStreamed(buf);
     return buf.str();
 }
 
+void WatchByPathCommand::runStreamed(WriteBuffer & out)
+{
+    keeper_dispatcher.getStateMachine().dumpWatchesByPath(out);
+}
+
 String DataSizeCommand::run()
 {
     StringBuffer buf;
@@ -387,14 +622,30 @@ String DataSizeCommand::run()
     return buf.str();
 }
 
+String SubtreeStatCommand::run()
+{
+    const auto & state_machine = keeper_dispatcher.getStateMachine();
+    if (state_machine.getSubtreeStatsDepth() == 0)
+        return "Subtree stats is disabled, set raft_settings.subtree_stats_depth to enable it.\n";
+
+    StringBuffer buf;
+    for (const auto & [path, stats] : state_machine.getIndexedSubtreeStats())
+        buf << path << '\t' << stats.node_count << '\t' << stats.data_bytes << '\n';
+    return buf.str();
+}
+
 String DumpCommand::run()
 {
     StringBuffer buf;
-    const auto & state_machine = keeper_dispatcher.getStateMachine();
-    state_machine.dumpSessionsAndEphemerals(buf);
+    runStreamed(buf);
     return buf.str();
 }
 
+void DumpCommand::runStreamed(WriteBuffer & out)
+{
+    keeper_dispatcher.getStateMachine().dumpSessionsAndEphemerals(out);
+}
+
 String EnviCommand::run()
 {
     using Poco::Environment;
@@ -460,6 +711,26 @@ String LogInfoCommand::run()
     append("leader_committed_log_idx", log_info.leader_committed_log_idx);
     append("target_committed_log_idx", log_info.target_committed_log_idx);
     append("last_snapshot_idx", log_info.last_snapshot_idx);
+
+    const auto & fsync = log_info.fsync_stats;
+    append("fsync_count", fsync.fsync_count);
+    append("fsync_avg_latency_us", fsync.fsync_count ? fsync.total_latency_us / fsync.fsync_count : 0);
+    append("fsync_max_latency_us", fsync.max_latency_us);
+    append("fsync_avg_batch_size", fsync.fsync_count ? fsync.total_batch_size / fsync.fsync_count : 0);
+    append("fsync_last_durability_lag_us", fsync.last_durability_lag_us);
+    append("fsync_max_durability_lag_us", fsync.max_durability_lag_us);
+    append("fsync_batch_entries", fsync.batch_fsync_entries);
+    /// Histograms by the lower bound of buckets, empty buckets are omitted
+    for (size_t i = 0; i < LogFsyncStats::BUCKETS; ++i)
+    {
+        if (fsync.latency_us[i])
+            append("fsync_latency_us_ge_" + std::to_string(LogFsyncStats::bucketLowerBound(i)), fsync.latency_us[i]);
+    }
+    for (size_t i = 0; i < LogFsyncStats::BUCKETS; ++i)
+    {
+        if (fsync.batch_size[i])
+            append("fsync_batch_size_ge_" + std::to_string(LogFsyncStats::bucketLowerBound(i)), fsync.batch_size[i]);
+    }
     return ret.str();
 }
 
@@ -468,4 +739,263 @@ String RequestLeaderCommand::run()
     return keeper_dispatcher.requestLeader() ? "Sent leadership request to leader." : "Failed to send leadership request to leader.";
 }
 
+String LatencyCommand::run()
+{
+    StringBuffer ret;
+    ret << "role\toperation\tcount\tp50\tp90\tp99\tp999\tmax\n";
+
+    const auto & latency_stats = keeper_dispatcher.getRequestLatencyStats();
+    for (size_t role = 0; role < RequestLatencyStats::ROLES; ++role)
+    {
+        for (size_t slot = 0; slot < RequestLatencyStats::OPERATION_SLOTS; ++slot)
+        {
+            auto percentiles = latency_stats.get(static_cast<RequestLatencyStats::Role>(role), slot).getPercentiles();
+            if (!percentiles.count)
+                continue;
+            ret << RequestLatencyStats::roleName(static_cast<RequestLatencyStats::Role>(role)) << '\t'
+                << RequestLatencyStats::operationName(slot) << '\t' << percentiles.count << '\t' << percentiles.p50 << '\t'
+                << percentiles.p90 << '\t' << percentiles.p99 << '\t' << percentiles.p999 << '\t' << percentiles.max << '\n';
+        }
+    }
+    return ret.str();
+}
+
+String TraceCommand::run()
+{
+    StringBuffer ret;
+    ret << "span\tcount\tp50\tp90\tp99\tp999\tmax\n";
+
+    const auto & tracer = keeper_dispatcher.getRequestTracer();
+    for (size_t span = 0; span < RequestTracer::SPANS; ++span)
+    {
+        auto percentiles = tracer.get(static_cast<RequestTracer::Span>(span)).getPercentiles();
+        if (!percentiles.count)
+            continue;
+        ret << RequestTracer::spanName(static_cast<RequestTracer::Span>(span)) << '\t' << percentiles.count << '\t' << percentiles.p50
+            << '\t' << percentiles.p90 << '\t' << percentiles.p99 << '\t' << percentiles.p999 << '\t' << percentiles.max << '\n';
+    }
+
+    ret << "slow requests\n";
+    ret << "session\txid\toperation\tforwarded_from\treceive\tdispatch\tforward\tappend\tpre_commit\tcommit\tapply_begin\tapply_end\n";
+    for (const auto & slow : tracer.getSlowTraces())
+    {
+        UInt64 first = 0;
+        for (UInt64 stage_us : slow.trace.stage_us)
+            if (stage_us && (!first || stage_us < first))
+                first = stage_us;
+
+        ret << toHexString(slow.session_id) << '\t' << slow.xid << '\t' << Coordination::toString(slow.opnum) << '\t' << slow.forwarded_from;
+        for (UInt64 stage_us : slow.trace.stage_us)
+        {
+            ret << '\t';
+            if (stage_us)
+                ret << stage_us - first;
+            else
+                ret << '-';
+        }
+        ret << '\n';
+    }
+    return ret.str();
+}
+String LockStatsCommand::run()
+{
+    if (!LockProfiler::isEnabled())
+        return "Lock profiling is disabled, it is enabled by raft_settings.lock_profiling.\n";
+
+    StringBuffer ret;
+    ret << "lock\tacquisitions\tcontentions\twait_us\tmax_wait_us\thold_us\tmax_hold_us\n";
+    for (LockProfiler::Lock lock = 0; lock < LockProfiler::end(); ++lock)
+    {
+        const auto & stats = LockProfiler::stats[lock];
+        UInt64 acquisitions = stats.acquisitions.load(std::memory_order_relaxed);
+        if (!acquisitions)
+            continue;
+        ret << LockProfiler::getName(lock) << '\t' << acquisitions << '\t' << stats.contentions.load(std::memory_order_relaxed) << '\t'
+            << stats.wait_ns.load(std::memory_order_relaxed) / 1000 << '\t' << stats.max_wait_ns.load(std::memory_order_relaxed) / 1000
+            << '\t' << stats.hold_ns.load(std::memory_order_relaxed) / 1000 << '\t'
+            << stats.max_hold_ns.load(std::memory_order_relaxed) / 1000 << '\n';
+    }
+    return ret.str();
+}
+
+String HotKeysCommand::run()
+{
+    StringBuffer ret;
+    ret << "dimension\tby\tkey\tvalue\terror\n";
+
+    const auto & hot_key_stats = keeper_dispatcher.getHotKeyStats();
+    for (size_t dimension = 0; dimension < HotKeyStats::DIMENSIONS; ++dimension)
+    {
+        for (bool by_bytes : {false, true})
+        {
+            for (const auto & hot_key : hot_key_stats.top(static_cast<HotKeyStats::Dimension>(dimension), by_bytes, 20))
+                ret << HotKeyStats::dimensionName(static_cast<HotKeyStats::Dimension>(dimension)) << '\t'
+                    << (by_bytes ? "bytes" : "requests") << '\t' << hot_key.key << '\t' << hot_key.value << '\t' << hot_key.error << '\n';
+        }
+    }
+    return ret.str();
+}
+
+String MemoryCommand::run()
+{
+    auto memory_info = keeper_dispatcher.getKeeperMemoryInfo();
+
+    StringBuffer ret;
+    auto print_bytes = [&](const char * name, Int64 bytes) { ret << name << '\t' << std::max<Int64>(bytes, 0) << '\n'; };
+    ret << "subsystem\tbytes\n";
+    print_bytes("data_tree", memory_info.data_tree);
+    print_bytes("watches", memory_info.watches);
+    print_bytes("log_cache", memory_info.log_cache);
+    print_bytes("connection_buffers", memory_info.connection_buffers);
+    print_bytes("snapshot", memory_info.snapshot);
+    print_bytes("snapshot_peak", memory_info.snapshot_peak);
+    print_bytes("other", memory_info.other());
+    print_bytes("tracked", memory_info.tracked);
+    print_bytes("resident", memory_info.resident);
+    print_bytes("soft_limit", memory_info.soft_limit);
+    ret << "memory_pressure\t" << (memory_info.memory_pressure ? 1 : 0) << '\n';
+    ret << "rejected_sessions\t" << memory_info.rejected_sessions << '\n';
+    return ret.str();
+}
+
+String TopSessionsCommand::run()
+{
+    static constexpr size_t TOP_SESSIONS = 20;
+
+    StringBuffer ret;
+    ret << "resource\tsession\tcount\tbytes\n";
+
+    const auto & store = keeper_dispatcher.getStore();
+    for (const auto & usage : store.getTopWatchSessions(TOP_SESSIONS))
+        ret << "watches\t" << toHexString(usage.session_id) << '\t' << usage.count << '\t' << usage.bytes << '\n';
+    for (const auto & usage : store.getTopEphemeralSessions(TOP_SESSIONS))
+        ret << "ephemerals\t" << toHexString(usage.session_id) << '\t' << usage.count << '\t' << usage.bytes << '\n';
+
+    auto outstanding = ConnectionHandler::getSessionsOutstanding();
+    auto by_requests = [](const auto & lhs, const auto & rhs) { return lhs.requests > rhs.requests; };
+    if (outstanding.size() > TOP_SESSIONS)
+    {
+        std::nth_element(outstanding.begin(), outstanding.begin() + TOP_SESSIONS, outstanding.end(), by_requests);
+        outstanding.resize(TOP_SESSIONS);
+    }
+    std::sort(outstanding.begin(), outstanding.end(), by_requests);
+    for (const auto & session : outstanding)
+        ret << "outstanding\t" << toHexString(session.session_id) << '\t' << session.requests << '\t' << session.response_bytes << '\n';
+    return ret.str();
+}
+
+String CaptureBeginCommand::run()
+{
+    try
+    {
+        return "capturing into " + keeper_dispatcher.startRequestCapture();
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
+String CaptureEndCommand::run()
+{
+    auto & capture = keeper_dispatcher.getRequestCapture();
+    if (capture.stop().empty())
+        return "not capturing";
+    auto [path, bytes] = capture.getStatus();
+    return "captured " + std::to_string(bytes) + " bytes into " + path;
+}
+
+namespace
+{
+
+String startProfile(KeeperDispatcher & keeper_dispatcher, SamplingProfiler::Clock clock)
+{
+    const auto & settings = keeper_dispatcher.getKeeperConfigurationAndSettings();
+    try
+    {
+        SamplingProfiler::instance().start(clock, settings->profile_frequency, settings->profile_duration_ms);
+        return "profiling for " + std::to_string(settings->profile_duration_ms) + " ms, prof prints the stacks";
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
+}
+
+String CpuProfileCommand::run()
+{
+    return startProfile(keeper_dispatcher, SamplingProfiler::Clock::CPU);
+}
+
+String WallProfileCommand::run()
+{
+    return startProfile(keeper_dispatcher, SamplingProfiler::Clock::REAL);
+}
+
+String ProfileCommand::run()
+{
+    try
+    {
+        String collapsed = SamplingProfiler::instance().stop();
+        return collapsed.empty() ? "no profile, cpup or walp starts one\n" : collapsed;
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
+String HeapProfileOnCommand::run()
+{
+    try
+    {
+        setHeapProfileActive(true);
+        return "heap profiling, heap prints the allocations in use";
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
+String HeapProfileOffCommand::run()
+{
+    try
+    {
+        setHeapProfileActive(false);
+        return "heap profiling stopped";
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
+String HeapProfileCommand::run()
+{
+    try
+    {
+        String collapsed = dumpHeapProfile();
+        return collapsed.empty() ? "no sampled allocations in use, hpon starts sampling\n" : collapsed;
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
+String AllocatorStatsCommand::run()
+{
+    try
+    {
+        return getAllocatorStats();
+    }
+    catch (...)
+    {
+        return getCurrentExceptionMessage(false);
+    }
+}
+
 }
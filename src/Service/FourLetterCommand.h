@@ -25,6 +25,8 @@ public:
 
     virtual String name() = 0;
     virtual String run() = 0;
+    /// Write the output to out, commands with large output override it to write as they go instead of building it at once
+    virtual void runStreamed(WriteBuffer & out);
 
     virtual ~IFourLetterCommand();
     int32_t code();
@@ -94,11 +96,35 @@ struct RuokCommand : public IFourLetterCommand
  * zk_packets_received 70
  * zk_packets_sent 69
  * zk_outstanding_requests 0
+ * zk_rate_limited_requests 0          - of throttled_requests, rejected by session, ip or path request rate limits
+ * zk_expired_requests 0               - reads answered with ZOPERATIONTIMEOUT unserved as their client gave up
+ * zk_abandoned_requests 0             - reads dropped as their connection was gone
+ * zk_queued_write_requests 0          - also control and read, requests in the lanes of the dispatcher queue
+ * zk_commit_queue_size 0              - requests committed but not applied yet
+ * zk_client_group_default_queued_requests 0 - also _weight and _popped_requests, of every client group
  * zk_server_state leader
  * zk_znode_count   4
  * zk_watch_count  0
  * zk_ephemerals_count 0
  * zk_approximate_data_size    27
+ * zk_node_bytes   ...                 - memory breakdown, approximate_data_size is the sum of them
+ * zk_data_bytes   ...
+ * zk_compression_saved_bytes  ...     - not in data_bytes, saved by compressing values of cold nodes
+ * zk_path_bytes   ...
+ * zk_children_bytes   ...
+ * zk_watch_bytes  ...
+ * zk_acl_bytes    ...
+ * zk_digest   ...                     - digest of the data tree, equal on replicas at the same Zxid of srvr
+ * zk_memory_resident_bytes ...        - memory by subsystem, see MemoryCommand
+ * zk_memory_huge_pages_enabled 0      - 1 when enabled by huge_pages, huge_pages_bytes is resident on huge pages
+ * zk_memory_huge_pages_bytes ...
+ * zk_memory_soft_limit ...
+ * zk_memory_pressure   0              - 1 when over the soft limit, new sessions are rejected
+ * zk_log_cache_hits   ...             - Raft log entry cache, hit ratio is in percent and counts read ahead hits
+ * zk_log_cache_misses ...
+ * zk_log_cache_hit_ratio  ...
+ * zk_batch_entry_raw_bytes ...        - batch log entries appended by this server, before and after compression
+ * zk_batch_entry_bytes ...
  * zk_open_file_descriptor_count 23    - only available on Unix platforms
  * zk_max_file_descriptor_count 1024   - only available on Unix platforms
  * zk_followers 2                      - only exposed by the Leader
@@ -166,6 +192,7 @@ struct ConsCommand : public IFourLetterCommand
 
     String name() override { return "cons"; }
     String run() override;
+    void runStreamed(WriteBuffer & out) override;
     ~ConsCommand() override = default;
 };
 
@@ -233,6 +260,7 @@ struct WatchCommand : public IFourLetterCommand
 
     String name() override { return "wchc"; }
     String run() override;
+    void runStreamed(WriteBuffer & out) override;
     ~WatchCommand() override = default;
 };
 
@@ -248,6 +276,7 @@ struct WatchByPathCommand : public IFourLetterCommand
 
     String name() override { return "wchp"; }
     String run() override;
+    void runStreamed(WriteBuffer & out) override;
     ~WatchByPathCommand() override = default;
 };
 
@@ -261,6 +290,7 @@ struct DumpCommand : public IFourLetterCommand
 
     String name() override { return "dump"; }
     String run() override;
+    void runStreamed(WriteBuffer & out) override;
     ~DumpCommand() override = default;
 };
 
@@ -290,6 +320,22 @@ struct DataSizeCommand : public IFourLetterCommand
     ~DataSizeCommand() override = default;
 };
 
+/** Descendant count and data bytes of every path not deeper than subtree_stats_depth, one path per line:
+ *     /clickhouse 1024 4096
+ *     /clickhouse/tables  1000 4000
+ */
+struct SubtreeStatCommand : public IFourLetterCommand
+{
+    explicit SubtreeStatCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "stsz"; }
+    String run() override;
+    ~SubtreeStatCommand() override = default;
+};
+
 /// Tests if server is running in read-only mode.
 /// The server will respond with "ro" if in read-only mode or "rw" if not in read-only mode.
 struct IsReadOnlyCommand : public IFourLetterCommand
@@ -326,6 +372,12 @@ struct CreateSnapshotCommand : public IFourLetterCommand
  *     leader_committed_log_idx 101
  *     target_committed_log_idx 101
  *     last_snapshot_idx    50
+ *     fsync_count  20
+ *     fsync_avg_latency_us 800
+ *     fsync_max_latency_us 2000
+ *     fsync_avg_batch_size 5
+ *     fsync_latency_us_ge_512  18      - fsyncs taking [512, 1024) us
+ *     fsync_batch_size_ge_4    12      - fsyncs making [4, 8) entries durable
  */
 struct LogInfoCommand : public IFourLetterCommand
 {
@@ -339,6 +391,246 @@ struct LogInfoCommand : public IFourLetterCommand
     ~LogInfoCommand() override = default;
 };
 
+/** Latency percentiles in microseconds of client requests by server role and operation, since the last srst,
+ * only the ones with requests:
+ *     role     operation   count   p50 p90 p99 p999    max
+ *     leader   Create  1000    255 511 1023    2047    4095
+ *     leader   Get 5000    63  127 255 511 1023
+ */
+struct LatencyCommand : public IFourLetterCommand
+{
+    explicit LatencyCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "lats"; }
+    String run() override;
+    ~LatencyCommand() override = default;
+};
+
+/** Durations in microseconds between the pipeline stages of requests on this server since the last srst, then the
+ * slowest recent requests with the time of every stage they passed relative to the first one:
+ *     span     count   p50 p90 p99 p999    max
+ *     queue    1000    15  31  63  127 255
+ *     replicate    1000    511 1023    2047    4095    8191
+ *     slow requests
+ *     session  xid operation   forwarded_from  receive dispatch    forward append  pre_commit  commit  apply_begin apply_end
+ *     0x100000001  12  Create  -1  0   10  -   15  80  120300  120350  120400
+ */
+struct TraceCommand : public IFourLetterCommand
+{
+    explicit TraceCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "trcs"; }
+    String run() override;
+    ~TraceCommand() override = default;
+};
+
+/** Contention of the profiled mutexes since the last srst, see LockProfiler, in microseconds. Hold times are of
+ * exclusive acquisitions only:
+ *     lock     acquisitions    contentions wait_us max_wait_us hold_us max_hold_us
+ *     StoreSession 1000    20  150 30  800 5
+ */
+struct LockStatsCommand : public IFourLetterCommand
+{
+    explicit LockStatsCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "lcks"; }
+    String run() override;
+    ~LockStatsCommand() override = default;
+};
+
+/** The top 20 paths, sessions and clients by sampled requests and bytes since the last srst, see HotKeyStats.
+ * Values are estimated from samples, error is the most a value may be overcounted by:
+ *     dimension    by  key value   error
+ *     path requests    /clickhouse/tables/01/t1    120000  64
+ *     client   bytes   10.0.0.12   52428800    0
+ */
+struct HotKeysCommand : public IFourLetterCommand
+{
+    explicit HotKeysCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "hotk"; }
+    String run() override;
+    ~HotKeysCommand() override = default;
+};
+
+/** Memory by subsystem in bytes, see KeeperMemoryInfo. The data tree, watches, log cache and connection buffers are
+ * by their byte counters, snapshots by a memory tracker scope, other is the rest of the resident memory, e.g. NuRaft:
+ *     subsystem    bytes
+ *     data_tree    1073741824
+ *     log_cache    268435456
+ *     other    52428800
+ *     memory_pressure  0
+ */
+struct MemoryCommand : public IFourLetterCommand
+{
+    explicit MemoryCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "mems"; }
+    String run() override;
+    ~MemoryCommand() override = default;
+};
+
+/** The top 20 sessions by count of watches, of ephemeral nodes and of outstanding requests, see KeeperStore::SessionLimits.
+ * Bytes are of the watched and the ephemeral paths, and of the responses queued to the connection:
+ *     resource session count   bytes
+ *     watches  0x0000000100000002  120000  5242880
+ *     ephemerals   0x0000000100000005  3000    96000
+ *     outstanding  0x0000000100000002  512 1048576
+ */
+struct TopSessionsCommand : public IFourLetterCommand
+{
+    explicit TopSessionsCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "tops"; }
+    String run() override;
+    ~TopSessionsCommand() override = default;
+};
+
+/// Start capturing client requests into keeper.request_capture_dir, see RequestCapture. Prints the path of the capture.
+struct CaptureBeginCommand : public IFourLetterCommand
+{
+    explicit CaptureBeginCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "capb"; }
+    String run() override;
+    ~CaptureBeginCommand() override = default;
+};
+
+/// Stop capturing client requests. Prints the path and size of the capture.
+struct CaptureEndCommand : public IFourLetterCommand
+{
+    explicit CaptureEndCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "cape"; }
+    String run() override;
+    ~CaptureEndCommand() override = default;
+};
+
+/// Start a profile of all threads by CPU time, see SamplingProfiler. It stops after keeper.profile_duration_ms.
+struct CpuProfileCommand : public IFourLetterCommand
+{
+    explicit CpuProfileCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "cpup"; }
+    String run() override;
+    ~CpuProfileCommand() override = default;
+};
+
+/// Start a profile of all threads by real time, which also samples threads waiting, e.g. for locks or disks.
+struct WallProfileCommand : public IFourLetterCommand
+{
+    explicit WallProfileCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "walp"; }
+    String run() override;
+    ~WallProfileCommand() override = default;
+};
+
+/** Stop the profile if it is running and print the collapsed stacks of the last one, for flamegraph.pl:
+ *     ReqProcessor;start_thread;RK::RequestProcessor::run();... 1500
+ */
+struct ProfileCommand : public IFourLetterCommand
+{
+    explicit ProfileCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "prof"; }
+    String run() override;
+    ~ProfileCommand() override = default;
+};
+
+/// Start sampling allocations for the heap profile, see setHeapProfileActive. Needs jemalloc with profiling.
+struct HeapProfileOnCommand : public IFourLetterCommand
+{
+    explicit HeapProfileOnCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "hpon"; }
+    String run() override;
+    ~HeapProfileOnCommand() override = default;
+};
+
+/// Stop sampling allocations, the samples of allocations still in use stay in the heap profile.
+struct HeapProfileOffCommand : public IFourLetterCommand
+{
+    explicit HeapProfileOffCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "hpof"; }
+    String run() override;
+    ~HeapProfileOffCommand() override = default;
+};
+
+/** Print the estimated bytes in use by the stacks which allocated them while sampling was on, as collapsed stacks for
+ * flamegraph.pl, largest first:
+ *     start_thread;...;RK::KeeperStore::createNode(...);operator new(unsigned long) 1048576
+ */
+struct HeapProfileCommand : public IFourLetterCommand
+{
+    explicit HeapProfileCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "heap"; }
+    String run() override;
+    ~HeapProfileCommand() override = default;
+};
+
+/** Allocator statistics in bytes and the memory of its arenas, see getAllocatorStats:
+ *     allocated    1073741824
+ *     active    1121976320
+ *     retained    536870912
+ *     fragmentation    0.043
+ */
+struct AllocatorStatsCommand : public IFourLetterCommand
+{
+    explicit AllocatorStatsCommand(KeeperDispatcher & keeper_dispatcher_)
+        : IFourLetterCommand(keeper_dispatcher_)
+    {
+    }
+
+    String name() override { return "allc"; }
+    String run() override;
+    ~AllocatorStatsCommand() override = default;
+};
+
 /// Request to be leader.
 struct RequestLeaderCommand : public IFourLetterCommand
 {
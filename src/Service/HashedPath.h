@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string_view>
+#include <city.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Znode path with its hash, computed once per request and passed to the node container and the watch
+ * tables instead of hashing the path again in every one of them. Comparing hashes is cheaper than comparing
+ * long paths, so lookups compare the hash before the path.
+ *
+ * It refers to the path, it is a temporary for the time of the request and is never kept.
+ */
+struct HashedPath
+{
+    /// Implicit, a String or a string_view is hashed when there is no HashedPath for it yet
+    HashedPath(const String & path_) : HashedPath(std::string_view(path_)) { } // NOLINT(google-explicit-constructor)
+    HashedPath(std::string_view path_) : path(path_), hash(hashOf(path_)) { } // NOLINT(google-explicit-constructor)
+    HashedPath(const char * path_) : HashedPath(std::string_view(path_)) { } // NOLINT(google-explicit-constructor)
+    /// Path with the hash computed before, see hashOf
+    HashedPath(std::string_view path_, size_t hash_) : path(path_), hash(hash_) { }
+
+    static size_t hashOf(std::string_view path_) { return CityHash_v1_0_2::CityHash64(path_.data(), path_.size()); }
+
+    std::string_view path;
+    size_t hash;
+};
+
+/// Hash and equality of String keys which take a HashedPath without hashing it again
+struct HashedPathHash
+{
+    using is_transparent = void;
+    size_t operator()(const String & path) const { return HashedPath::hashOf(path); }
+    size_t operator()(const HashedPath & path) const { return path.hash; }
+};
+
+struct HashedPathEqual
+{
+    using is_transparent = void;
+    bool operator()(const String & lhs, const String & rhs) const { return lhs == rhs; }
+    bool operator()(const HashedPath & lhs, const String & rhs) const { return lhs.path == rhs; }
+    bool operator()(const String & lhs, const HashedPath & rhs) const { return lhs == rhs.path; }
+};
+
+/// Find path in an unordered container of String keys hashed by HashedPathHash, without hashing it again
+template <typename Container>
+auto findPath(Container & container, const HashedPath & path)
+{
+#if __cpp_lib_generic_unordered_lookup >= 201811L
+    return container.find(path);
+#else
+    return container.find(String(path.path));
+#endif
+}
+
+}
@@ -0,0 +1,105 @@
+#include <Service/HotKeyStats.h>
+
+#include <Service/formatHex.h>
+
+namespace RK
+{
+
+const char * HotKeyStats::dimensionName(Dimension dimension)
+{
+    switch (dimension)
+    {
+        case PATH:
+            return "path";
+        case SESSION:
+            return "session";
+        case CLIENT:
+            return "client";
+    }
+    return "unknown";
+}
+
+void HotKeyStats::configure(UInt64 sample_rate_, size_t path_depth_)
+{
+    path_depth.store(path_depth_, std::memory_order_relaxed);
+    sample_rate.store(sample_rate_, std::memory_order_relaxed);
+}
+
+String HotKeyStats::pathPrefix(const String & path) const
+{
+    size_t depth = path_depth.load(std::memory_order_relaxed);
+    size_t pos = 0;
+    for (size_t component = 0; component < depth && pos != String::npos; ++component)
+        pos = path.find('/', pos + 1);
+    return pos == String::npos ? path : path.substr(0, pos);
+}
+
+void HotKeyStats::insert(Dimension dimension, const String & key, UInt64 bytes)
+{
+    UInt64 rate = sample_rate.load(std::memory_order_relaxed);
+    auto & dimension_sketches = sketches[dimension];
+    std::lock_guard lock(dimension_sketches.mutex);
+    dimension_sketches.requests.insert(StringRef(key), rate);
+    dimension_sketches.bytes.insert(StringRef(key), bytes * rate);
+}
+
+void HotKeyStats::record(const Coordination::ZooKeeperRequest & request, int64_t session_id, UInt64 bytes)
+{
+    if (const auto * multi = dynamic_cast<const Coordination::ZooKeeperMultiRequest *>(&request))
+    {
+        /// Every operation counts for its path, the bytes are shared evenly
+        UInt64 operation_bytes = multi->requests.empty() ? 0 : bytes / multi->requests.size();
+        for (const auto & operation : multi->requests)
+            insert(PATH, pathPrefix(operation->getPath()), operation_bytes);
+    }
+    else
+        insert(PATH, pathPrefix(request.getPath()), bytes);
+
+    insert(SESSION, toHexString(session_id), bytes);
+
+    String client;
+    {
+        std::shared_lock lock(clients_mutex);
+        auto it = clients.find(session_id);
+        if (it != clients.end())
+            client = it->second;
+    }
+    insert(CLIENT, client.empty() ? "-" : client, bytes);
+}
+
+void HotKeyStats::registerClient(int64_t session_id, const String & address)
+{
+    std::lock_guard lock(clients_mutex);
+    clients[session_id] = address;
+}
+
+void HotKeyStats::unregisterClient(int64_t session_id)
+{
+    std::lock_guard lock(clients_mutex);
+    clients.erase(session_id);
+}
+
+std::vector<HotKeyStats::HotKey> HotKeyStats::top(Dimension dimension, bool by_bytes, size_t k) const
+{
+    const auto & dimension_sketches = sketches[dimension];
+    std::vector<HotKey> keys;
+    std::lock_guard lock(dimension_sketches.mutex);
+    for (const auto & counter : (by_bytes ? dimension_sketches.bytes : dimension_sketches.requests).topK(k))
+        keys.push_back({counter.key.toString(), counter.count, counter.error});
+    return keys;
+}
+
+void HotKeyStats::reset()
+{
+    for (auto & dimension_sketches : sketches)
+    {
+        std::lock_guard lock(dimension_sketches.mutex);
+        /// clear drops the alpha map too, resize allocates it again
+        dimension_sketches.requests.clear();
+        dimension_sketches.requests.resize(CAPACITY);
+        dimension_sketches.bytes.clear();
+        dimension_sketches.bytes.resize(CAPACITY);
+    }
+}
+
+}
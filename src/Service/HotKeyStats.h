@@ -0,0 +1,91 @@
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include <Common/SpaceSaving.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <common/StringRef.h>
+
+namespace RK
+{
+
+/** The paths, sessions and clients sending the most requests and bytes to this server, to find who overloads it.
+ *
+ * One request in sample_rate is sampled and counts sample_rate times into SpaceSaving sketches, which keep the
+ * heavy hitters of a stream in bounded memory: a key is reported with at most error overcounted. Paths are cut to
+ * their first path_depth components, so that e.g. the queue of a replica is one key. Requests of sessions of
+ * other servers, which are only known here by their writes, have no client.
+ */
+class HotKeyStats
+{
+public:
+    enum Dimension : uint8_t
+    {
+        PATH = 0,
+        SESSION = 1,
+        CLIENT = 2,
+    };
+
+    static constexpr size_t DIMENSIONS = 3;
+    /// Keys a sketch counts, the first ones of them are accurate
+    static constexpr size_t CAPACITY = 512;
+
+    struct HotKey
+    {
+        String key;
+        UInt64 value;
+        /// Upper bound of the overcounting of value
+        UInt64 error;
+    };
+
+    static const char * dimensionName(Dimension dimension);
+
+    /// sample_rate 0 samples no request
+    void configure(UInt64 sample_rate_, size_t path_depth_);
+
+    /// Whether the caller should record its request, cheap enough to call for every request
+    bool sample() const
+    {
+        UInt64 rate = sample_rate.load(std::memory_order_relaxed);
+        if (!rate)
+            return false;
+        thread_local UInt64 counter = 0;
+        return ++counter % rate == 0;
+    }
+
+    /// bytes are the bytes written or read by the request
+    void record(const Coordination::ZooKeeperRequest & request, int64_t session_id, UInt64 bytes);
+
+    /// Address of the client of a local session
+    void registerClient(int64_t session_id, const String & address);
+    void unregisterClient(int64_t session_id);
+
+    /// Top k keys of dimension by requests or by bytes, the most first
+    std::vector<HotKey> top(Dimension dimension, bool by_bytes, size_t k) const;
+
+    void reset();
+
+private:
+    String pathPrefix(const String & path) const;
+    void insert(Dimension dimension, const String & key, UInt64 bytes);
+
+    using Sketch = SpaceSaving<StringRef, StringRefHash>;
+
+    struct Sketches
+    {
+        mutable std::mutex mutex;
+        Sketch requests{CAPACITY};
+        Sketch bytes{CAPACITY};
+    };
+
+    std::atomic<UInt64> sample_rate{0};
+    std::atomic<size_t> path_depth{0};
+    Sketches sketches[DIMENSIONS];
+
+    mutable std::shared_mutex clients_mutex;
+    std::unordered_map<int64_t, String> clients;
+};
+
+}
@@ -0,0 +1,204 @@
+#include <Service/IdempotencyCache.h>
+
+#include <algorithm>
+#include <IO/WriteBufferFromString.h>
+#include <Common/SipHash.h>
+
+namespace RK
+{
+
+bool IdempotencyCache::isCached(const Coordination::ZooKeeperRequest & request)
+{
+    if (request.xid <= 0)
+        return false;
+
+    switch (request.getOpNum())
+    {
+        case Coordination::OpNum::Create:
+        case Coordination::OpNum::CreateContainer:
+        case Coordination::OpNum::CreateTTL:
+        case Coordination::OpNum::Remove:
+        case Coordination::OpNum::RemoveRecursive:
+        case Coordination::OpNum::Set:
+        case Coordination::OpNum::SetACL:
+        case Coordination::OpNum::Check:
+        case Coordination::OpNum::Multi:
+        case Coordination::OpNum::BatchWrite:
+            return true;
+        default:
+            return false;
+    }
+}
+
+UInt64 IdempotencyCache::digestOf(const Coordination::ZooKeeperRequest & request)
+{
+    WriteBufferFromOwnString buf;
+    request.writeImpl(buf);
+    buf.finalize();
+
+    SipHash hash;
+    hash.update(static_cast<Int32>(request.getOpNum()));
+    hash.update(buf.str().data(), buf.str().size());
+    return hash.get64();
+}
+
+Coordination::ZooKeeperResponsePtr
+IdempotencyCache::find(int64_t session_id, const Coordination::ZooKeeperRequest & request, UInt64 digest) const
+{
+    if (!enabled())
+        return nullptr;
+
+    const auto & shard = shardOf(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it == shard.sessions.end())
+        return nullptr;
+
+    /// Retries are mostly of the last writes
+    for (auto entry = it->second.rbegin(); entry != it->second.rend(); ++entry)
+    {
+        if (entry->xid != request.xid)
+            continue;
+        if (entry->request_digest != digest)
+            return nullptr;
+
+        auto response = request.makeResponse();
+        response->xid = request.xid;
+        response->zxid = entry->zxid;
+        response->error = entry->error;
+        response->body = entry->body;
+        return response;
+    }
+    return nullptr;
+}
+
+void IdempotencyCache::add(
+    int64_t session_id, const Coordination::ZooKeeperRequest & request, UInt64 digest, const Coordination::ZooKeeperResponse & response)
+{
+    if (!enabled())
+        return;
+
+    Entry entry;
+    entry.xid = request.xid;
+    entry.request_digest = digest;
+    entry.zxid = response.zxid;
+    entry.error = response.error;
+    if (response.error == Coordination::Error::ZOK)
+    {
+        WriteBufferFromOwnString buf;
+        response.writeBody(buf);
+        buf.finalize();
+        entry.body = std::make_shared<const String>(std::move(buf.str()));
+    }
+
+    auto & shard = shardOf(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto & entries = shard.sessions[session_id];
+    entries.push_back(std::move(entry));
+    entry_count.fetch_add(1, std::memory_order_relaxed);
+    while (entries.size() > max_entries)
+    {
+        dropped(shard, session_id, std::move(entries.front()));
+        entries.pop_front();
+        entry_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void IdempotencyCache::load(int64_t session_id, Entry entry)
+{
+    auto & shard = shardOf(session_id);
+    std::lock_guard lock(shard.mutex);
+    shard.sessions[session_id].push_back(std::move(entry));
+    entry_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IdempotencyCache::erase(int64_t session_id)
+{
+    auto & shard = shardOf(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it == shard.sessions.end())
+        return;
+
+    entry_count.fetch_sub(it->second.size(), std::memory_order_relaxed);
+    for (auto & entry : it->second)
+        dropped(shard, session_id, std::move(entry));
+    shard.sessions.erase(it);
+}
+
+void IdempotencyCache::dropped(Shard & shard, int64_t session_id, Entry && entry)
+{
+    if (pinned.load(std::memory_order_relaxed) && entry.zxid < pinned_zxid.load(std::memory_order_relaxed))
+        shard.pinned_dropped[session_id].push_back(std::move(entry));
+}
+
+void IdempotencyCache::pin(int64_t pinned_zxid_)
+{
+    /// Writes are held off by the caller, no entry is added meanwhile
+    for (auto & shard : shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        shard.pinned_dropped.clear();
+    }
+    pinned_zxid.store(pinned_zxid_, std::memory_order_relaxed);
+    pinned.store(true, std::memory_order_relaxed);
+}
+
+void IdempotencyCache::unpin()
+{
+    pinned.store(false, std::memory_order_relaxed);
+    for (auto & shard : shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        shard.pinned_dropped.clear();
+    }
+}
+
+std::vector<std::pair<int64_t, IdempotencyCache::Entry>> IdempotencyCache::getSnapshotEntries() const
+{
+    bool is_pinned = pinned.load(std::memory_order_relaxed);
+    int64_t max_zxid = pinned_zxid.load(std::memory_order_relaxed);
+
+    std::vector<std::pair<int64_t, Entry>> result;
+    for (const auto & shard : shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        auto append = [&](int64_t session_id, const SessionEntries & entries)
+        {
+            for (const auto & entry : entries)
+                if (!is_pinned || entry.zxid < max_zxid)
+                    result.emplace_back(session_id, entry);
+        };
+
+        /// Entries dropped since pin are older than the entries left of their session
+        for (const auto & [session_id, entries] : shard.pinned_dropped)
+        {
+            append(session_id, entries);
+            auto it = shard.sessions.find(session_id);
+            if (it != shard.sessions.end())
+                append(session_id, it->second);
+        }
+        for (const auto & [session_id, entries] : shard.sessions)
+            if (!shard.pinned_dropped.contains(session_id))
+                append(session_id, entries);
+    }
+    return result;
+}
+
+size_t IdempotencyCache::size() const
+{
+    return entry_count.load(std::memory_order_relaxed);
+}
+
+void IdempotencyCache::clear()
+{
+    for (auto & shard : shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        shard.sessions.clear();
+        shard.pinned_dropped.clear();
+    }
+    entry_count.store(0, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <Common/ProfilingMutex.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Responses of the last writes committed by every session, so that a write retried with the same xid, after it
+  * timed out or its connection was lost, is answered by the response of its first commit instead of being applied
+  * again and failing with ZNODEEXISTS or ZBADVERSION.
+  *
+  * Every replica adds the writes it applies, so replicas which applied the same log have the same entries and the
+  * cache is replicated with the log like the rest of the session state. It is saved with the sessions in snapshots.
+  * A retry is matched by xid and by the digest of the request, so a client reusing xids after a reconnect is not
+  * answered with the response of another request. max_entries must be the same on all the servers.
+  *
+  * The dispatcher answers a retry found in the cache without sending it to Raft. A retry arriving before the first
+  * commit is applied locally goes to Raft, and its apply answers it from the cache without changing the tree.
+  *
+  * While a snapshot is pinned, entries of the pinned point evicted or removed are kept aside, so that the snapshot
+  * saves the cache of the pinned point, as it does with the versions of nodes.
+  */
+class IdempotencyCache
+{
+public:
+    static constexpr size_t SHARDS = 16;
+
+    struct Entry
+    {
+        Coordination::XID xid = 0;
+        UInt64 request_digest = 0;
+        int64_t zxid = 0;
+        Coordination::Error error = Coordination::Error::ZOK;
+        /// Serialized body of the response, nullptr unless error is ZOK
+        std::shared_ptr<const String> body;
+    };
+
+    /// 0 disables the cache
+    explicit IdempotencyCache(size_t max_entries_ = 0) : max_entries(max_entries_) { }
+
+    bool enabled() const { return max_entries != 0; }
+
+    /// Whether the responses of request are cached, client writes with a real xid only
+    static bool isCached(const Coordination::ZooKeeperRequest & request);
+    /// Digest of opnum and body of request
+    static UInt64 digestOf(const Coordination::ZooKeeperRequest & request);
+
+    /// Response of the write committed before with the xid and digest of request, nullptr if none.
+    /// It has the zxid of the first commit and the xid of request.
+    Coordination::ZooKeeperResponsePtr find(int64_t session_id, const Coordination::ZooKeeperRequest & request, UInt64 digest) const;
+
+    /// Add the response of request committed just now, the oldest entry of the session is evicted past max_entries
+    void add(
+        int64_t session_id, const Coordination::ZooKeeperRequest & request, UInt64 digest, const Coordination::ZooKeeperResponse & response);
+
+    /// Add an entry loaded from a snapshot, in the order of the session, whether the cache is enabled or not
+    void load(int64_t session_id, Entry entry);
+
+    /// The session is closed
+    void erase(int64_t session_id);
+
+    /// Entries with zxids before pinned_zxid are kept for the snapshot until unpin
+    void pin(int64_t pinned_zxid);
+    void unpin();
+
+    /// Entries at the pinned point, or all of them if not pinned, every session in its order
+    std::vector<std::pair<int64_t, Entry>> getSnapshotEntries() const;
+
+    size_t size() const;
+
+    void clear();
+
+private:
+    using SessionEntries = std::deque<Entry>;
+
+    struct Shard
+    {
+        mutable ProfilingMutex<std::mutex, LockProfiler::IdempotencyShard> mutex;
+        std::unordered_map<int64_t, SessionEntries> sessions;
+        /// Entries of the pinned point dropped since pin, by session and in its order
+        std::unordered_map<int64_t, SessionEntries> pinned_dropped;
+    };
+
+    Shard & shardOf(int64_t session_id) { return shards[static_cast<UInt64>(session_id) % SHARDS]; }
+    const Shard & shardOf(int64_t session_id) const { return shards[static_cast<UInt64>(session_id) % SHARDS]; }
+
+    /// Keep the entry aside if it is of the pinned point, the shard is locked
+    void dropped(Shard & shard, int64_t session_id, Entry && entry);
+
+    const size_t max_entries;
+    Shard shards[SHARDS];
+
+    std::atomic<bool> pinned{false};
+    std::atomic<int64_t> pinned_zxid{0};
+    std::atomic<size_t> entry_count{0};
+};
+
+}
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <common/types.h>
+#include <Service/AdaptiveBatchPolicy.h>
+#include <Service/LogEntryCache.h>
+#include <Service/LogFsyncStats.h>
 #include <Common/Exception.h>
 
 namespace RK
@@ -12,6 +17,28 @@ namespace ErrorCodes
     extern const int LOGICAL_ERROR;
 }
 
+/// Requests of a client group in the dispatcher queue, see ClientGroups
+struct ClientGroupStats
+{
+    String name;
+    uint64_t weight;
+    /// Requests queued but not taken by a request thread yet
+    uint64_t queued;
+    /// Requests taken by the request threads
+    uint64_t popped;
+};
+
+/// Load of a read runner of RequestProcessor
+struct RequestRunnerStats
+{
+    /// Requests queued for the runner but not taken yet
+    uint64_t queue_depth;
+    /// Requests taken by the runner which wait for their turn
+    uint64_t pending_requests;
+    /// Sessions the runner stole from busier runners
+    uint64_t steal_count;
+};
+
 /// Keeper server related information for different 4lw commands
 struct Keeper4LWInfo
 {
@@ -24,6 +51,17 @@ struct Keeper4LWInfo
 
     uint64_t alive_connections_count;
     uint64_t outstanding_requests_count;
+    uint64_t throttled_requests_count;
+    /// Of throttled_requests_count, rejected by request rate limits
+    uint64_t rate_limited_requests_count;
+    /// Reads answered with ZOPERATIONTIMEOUT without being served as their deadline passed
+    uint64_t expired_requests_count;
+    /// Reads dropped as their connection was gone
+    uint64_t abandoned_requests_count;
+    /// Requests in the control, read and write lanes of the dispatcher queue
+    uint64_t queued_requests_by_lane[3];
+    /// Requests committed but not applied yet
+    uint64_t commit_queue_size;
 
     uint64_t follower_count;
     uint64_t synced_follower_count;
@@ -31,6 +69,17 @@ struct Keeper4LWInfo
     uint64_t total_nodes_count;
     int64_t last_zxid;
 
+    std::vector<ClientGroupStats> client_groups;
+    std::vector<RequestRunnerStats> request_runners;
+    std::vector<AdaptiveBatchPolicy::Stats> request_batches;
+
+    /// In-memory Raft log entry cache
+    LogCacheStats log_cache;
+
+    /// Bytes of batch log entries appended before and after compression
+    uint64_t batch_entry_raw_bytes;
+    uint64_t batch_entry_bytes;
+
     String getRole() const
     {
         if (is_standalone)
@@ -46,6 +95,38 @@ struct Keeper4LWInfo
     }
 };
 
+/// Memory of the server by subsystem in bytes, for the mems and mntr commands
+struct KeeperMemoryInfo
+{
+    /// Nodes with their data, paths, children and ACLs, by the byte counters of the store
+    uint64_t data_tree;
+    uint64_t watches;
+    /// Entries of the in-memory Raft log cache
+    uint64_t log_cache;
+    /// Responses queued in client connections and not sent yet
+    uint64_t connection_buffers;
+    /// Net allocations of snapshots being created or received, tracked by their memory scope
+    int64_t snapshot;
+    int64_t snapshot_peak;
+    /// Allocations of all memory trackers, threads without a ThreadStatus are not tracked
+    int64_t tracked;
+    uint64_t resident;
+    bool huge_pages_enabled;
+    /// Resident memory backed by huge pages
+    uint64_t huge_pages;
+
+    uint64_t soft_limit;
+    bool memory_pressure;
+    uint64_t rejected_sessions;
+
+    /// NuRaft, allocator caches and everything not accounted to a subsystem
+    uint64_t other() const
+    {
+        uint64_t accounted = data_tree + watches + log_cache + connection_buffers + std::max<int64_t>(snapshot, 0);
+        return resident > accounted ? resident - accounted : 0;
+    }
+};
+
 /// Keeper log information for 4lw commands
 struct KeeperLogInfo
 {
@@ -72,6 +153,9 @@ struct KeeperLogInfo
 
     /// The largest committed log index in last snapshot.
     uint64_t last_snapshot_idx;
+
+    /// Fsyncs of the log store, only in FSYNC_PARALLEL mode.
+    LogFsyncStats fsync_stats;
 };
 
 
@@ -1,10 +1,24 @@
 #include <Service/KeeperDispatcher.h>
+#include <fstream>
+#include <sys/resource.h>
+#include <Service/ConnectionHandler.h>
+#include <Service/PipelineStageThreads.h>
+#include <Service/StallWatchdog.h>
 #include <Service/WriteBufferFromFiFoBuffer.h>
 #include <Service/formatHex.h>
 #include <Poco/NumberFormatter.h>
 #include <Common/DNSResolver.h>
+#include <Common/MemoryTracker.h>
+#include <Common/SamplingProfiler.h>
+#include <Common/formatReadable.h>
 #include <Common/checkStackSize.h>
 #include <Common/isLocalAddress.h>
+#include <Common/SpinWait.h>
+#include <Common/Stopwatch.h>
+#include <common/getThreadId.h>
+#include <ext/scope_guard.h>
+#include <Common/hugePages.h>
+#include <Common/setThreadAffinity.h>
 #include <Common/setThreadName.h>
 
 namespace RK
@@ -15,6 +29,7 @@ namespace ErrorCodes
     extern const int TIMEOUT_EXCEEDED;
     extern const int SYSTEM_ERROR;
     extern const int RAFT_ERROR;
+    extern const int UNKNOWN_SETTING;
 }
 
 namespace fs = std::filesystem;
@@ -32,6 +47,9 @@ KeeperDispatcher::KeeperDispatcher()
 void KeeperDispatcher::requestThreadFakeZk(size_t thread_index)
 {
     setThreadName(("K - " + std::to_string(thread_index)).c_str());
+    setThreadAffinity(configuration_and_settings->request_cpus);
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Dispatcher);
+    UInt64 spin_wait_us = configuration_and_settings->spin_wait_us;
 
     /// Result of requests batch from previous iteration
     nuraft::ptr<nuraft::cmd_result<nuraft::ptr<nuraft::buffer>>> prev_result = nullptr;
@@ -45,42 +63,69 @@ void KeeperDispatcher::requestThreadFakeZk(size_t thread_index)
 
         UInt64 max_wait = configuration_and_settings->raft_settings->operation_timeout_ms;
 
-        if (requests_queue->tryPop(thread_index, request_for_session, std::min(static_cast<uint64_t>(1000), max_wait)))
+        if (spinUntil([&] { return requests_queue->tryPop(thread_index, request_for_session); }, spin_wait_us)
+            || requests_queue->tryPop(thread_index, request_for_session, std::min(static_cast<uint64_t>(1000), max_wait)))
         {
             //            LOG_TRACE(log, "1 requests_queue tryPop session {}, xid {}", request_for_session.session_id, request_for_session.request->xid);
 
             if (shutdown_called)
                 break;
 
+            request_for_session.trace.mark(RequestTrace::DISPATCH);
             try
             {
+                /// Writes go to the request processor and to the pipeline, the others to one of them only and are moved
+                bool to_pipeline = !request_for_session.throttled && !request_for_session.request->isReadRequest();
                 if (isLocalSession(request_for_session.session_id))
                 {
+                    /// A retry of a write committed here already does not go to Raft again
+                    const auto & request = *request_for_session.request;
+                    auto & idempotency_cache = server->getKeeperStateMachine()->getStore().idempotency_cache;
+                    if (to_pipeline && idempotency_cache.enabled() && IdempotencyCache::isCached(request))
+                    {
+                        request_for_session.replayed_response
+                            = idempotency_cache.find(request_for_session.session_id, request, IdempotencyCache::digestOf(request));
+                        to_pipeline = !request_for_session.replayed_response;
+                    }
+
                     LOG_TRACE(
                         log,
                         "Put request session {}, xid {}, opnum {} to commit processor",
                         toHexString(request_for_session.session_id),
                         request_for_session.request->xid,
                         request_for_session.request->getOpNum());
-                    request_processor->push(request_for_session);
+                    /// Linearizable reads and lightweight syncs wait for the commit index of the leader after they arrived
+                    if (read_index_tracker && !request_for_session.throttled && request_for_session.request->isReadRequest()
+                        && request_for_session.request->getOpNum() != Coordination::OpNum::Heartbeat
+                        && (request_for_session.request->getOpNum() == Coordination::OpNum::Sync
+                            || (linearizable_reads && !(observer_local_reads && server->isObserver()))))
+                        request_for_session.read_round = read_index_tracker->join();
+                    if (to_pipeline)
+                        request_processor->push(request_for_session);
+                    else
+                        request_processor->push(std::move(request_for_session));
                 }
-                else if (!request_for_session.isForwardRequest())
+                else if (!request_for_session.isForwardRequest() && request_for_session.session_id != INTERNAL_SESSION_ID)
                 {
                     LOG_WARNING(log, "not local session {}", toHexString(request_for_session.session_id));
                 }
 
-                if (!request_for_session.request->isReadRequest() && server->isLeaderAlive())
+                /// Throttled and replayed requests are answered by request processor
+                if (!to_pipeline)
+                    continue;
+
+                if (server->isLeaderAlive())
                 {
                     LOG_TRACE(log, "leader is {}", server->getLeader());
 
                     if (server->isLeader())
-                        request_accumulator.push(request_for_session);
+                        request_accumulator.push(std::move(request_for_session));
                     else
-                        request_forwarder.push(request_for_session);
+                        request_forwarder.push(std::move(request_for_session));
                 }
-                else if (!request_for_session.request->isReadRequest() && !server->isLeaderAlive())
+                else
                 {
-                    request_accumulator.push(request_for_session);
+                    request_accumulator.push(std::move(request_for_session));
                 }
             }
             catch (...)
@@ -94,6 +139,8 @@ void KeeperDispatcher::requestThreadFakeZk(size_t thread_index)
 void KeeperDispatcher::requestThread()
 {
     setThreadName("KeeperReqT");
+    setThreadAffinity(configuration_and_settings->request_cpus);
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Dispatcher);
 
     while (!shutdown_called)
     {
@@ -110,7 +157,16 @@ void KeeperDispatcher::requestThread()
 
             try
             {
-                server->putRequest(request);
+                if (request.throttled)
+                {
+                    auto response = request.request->makeResponse();
+                    response->xid = request.request->xid;
+                    response->request_created_time_ms = request.create_time;
+                    response->error = Coordination::Error::ZTHROTTLEDOP;
+                    setResponse(request.session_id, response);
+                }
+                else
+                    server->putRequest(request);
             }
             catch (...)
             {
@@ -120,23 +176,28 @@ void KeeperDispatcher::requestThread()
     }
 }
 
-void KeeperDispatcher::responseThread()
+void KeeperDispatcher::responseThread(size_t shard)
 {
-    setThreadName("KeeperRspT");
+    setThreadName(("KeeperRspT-" + std::to_string(shard)).c_str());
+    setThreadAffinity(configuration_and_settings->response_cpus);
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Response);
+    UInt64 spin_wait_us = configuration_and_settings->spin_wait_us;
 
-    KeeperStore::ResponseForSession response_for_session;
+    KeeperStore::ResponsesForSessions responses;
     UInt64 max_wait = configuration_and_settings->raft_settings->operation_timeout_ms;
 
     while (!shutdown_called)
     {
-        if (responses_queue.tryPop(response_for_session, std::min(max_wait, static_cast<UInt64>(1000))))
+        /// Take all the pending responses, watch events fired by a commit batch are pushed together.
+        if (spinUntil([&] { return responses_queue.tryPopAll(shard, responses, MAX_RESPONSE_BATCH); }, spin_wait_us)
+            || responses_queue.tryPopAll(shard, responses, MAX_RESPONSE_BATCH, std::min(max_wait, static_cast<UInt64>(1000))))
         {
             if (shutdown_called)
                 break;
 
             try
             {
-                setResponse(response_for_session.session_id, response_for_session.response);
+                setResponses(responses);
             }
             catch (...)
             {
@@ -148,19 +209,52 @@ void KeeperDispatcher::responseThread()
 
 void KeeperDispatcher::setResponse(int64_t session_id, const Coordination::ZooKeeperResponsePtr & response)
 {
-    std::lock_guard lock(session_to_response_callback_mutex);
-    auto session_writer = session_to_response_callback.find(session_id);
-    if (session_writer == session_to_response_callback.end())
-        return;
+    setResponses({KeeperStore::ResponseForSession{session_id, response}});
+}
+
+void KeeperDispatcher::setResponses(const KeeperStore::ResponsesForSessions & responses)
+{
+    /// Keep the order of responses of a session, the order between sessions does not matter.
+    std::unordered_map<int64_t, Coordination::ZooKeeperResponses> session_responses;
+    for (const auto & response_for_session : responses)
+        session_responses[response_for_session.session_id].push_back(response_for_session.response);
 
-    session_writer->second(response);
-    /// Session closed, no more writes
-    if (response->xid != Coordination::WATCH_XID && response->getOpNum() == Coordination::OpNum::Close)
-        session_to_response_callback.erase(session_writer);
+    for (auto & [session_id, session_batch] : session_responses)
+    {
+        auto & shard = sessionCallbacksFor(session_id);
+        std::lock_guard lock(shard.mutex);
+        auto session_writer = shard.callbacks.find(session_id);
+        if (session_writer == shard.callbacks.end())
+            continue;
+
+        /// Session closed, no more writes
+        auto close = std::find_if(session_batch.begin(), session_batch.end(), [](const auto & response)
+        {
+            return response->xid != Coordination::WATCH_XID && response->getOpNum() == Coordination::OpNum::Close;
+        });
+        bool closed = close != session_batch.end();
+        if (closed)
+            session_batch.erase(close + 1, session_batch.end());
+
+        try
+        {
+            session_writer->second(session_batch);
+        }
+        catch (...)
+        {
+            tryLogCurrentException(__PRETTY_FUNCTION__);
+        }
+
+        if (closed)
+            shard.callbacks.erase(session_writer);
+    }
 }
 
-void KeeperDispatcher::sendAppendEntryResponse(int32_t server_id, int32_t client_id, const ForwardResponse & response)
+void KeeperDispatcher::sendAppendEntryResponses(int32_t server_id, int32_t client_id, const ForwardResponse * responses, size_t count)
 {
+    if (count == 0)
+        return;
+
     std::lock_guard lock(forward_to_response_callback_mutex);
     auto forward_response_writer = forward_to_response_callback.find({server_id, client_id});
     if (forward_response_writer == forward_to_response_callback.end())
@@ -168,12 +262,13 @@ void KeeperDispatcher::sendAppendEntryResponse(int32_t server_id, int32_t client
 
     LOG_TRACE(
         log,
-        "[sendAppendEntryResponse]server_id {}, client_id {}, session {}, xid {}",
+        "[sendAppendEntryResponse]server_id {}, client_id {}, {} responses, first session {}, xid {}",
         server_id,
         client_id,
-        toHexString(response.session_id),
-        response.xid);
-    forward_response_writer->second(response);
+        count,
+        toHexString(responses[0].session_id),
+        responses[0].xid);
+    forward_response_writer->second(responses, count);
 }
 
 void KeeperDispatcher::unRegisterForward(int32_t server_id, int32_t client_id)
@@ -186,19 +281,30 @@ void KeeperDispatcher::unRegisterForward(int32_t server_id, int32_t client_id)
     forward_to_response_callback.erase(forward_response_writer);
 }
 
-bool KeeperDispatcher::putRequest(const Coordination::ZooKeeperRequestPtr & request, int64_t session_id)
+bool KeeperDispatcher::putRequest(
+    const Coordination::ZooKeeperRequestPtr & request,
+    int64_t session_id,
+    nuraft::ptr<nuraft::buffer> log_entry,
+    bool rate_limited,
+    int64_t min_zxid,
+    bool relaxed_order,
+    size_t client_group)
 {
-    {
-        std::lock_guard lock(session_to_response_callback_mutex);
-        if (session_to_response_callback.count(session_id) == 0)
-            return false;
-    }
+    if (!isLocalSession(session_id))
+        return false;
 
     KeeperStore::RequestForSession request_info;
     request_info.request = request;
     request_info.session_id = session_id;
+    request_info.log_entry = std::move(log_entry);
+    request_info.min_zxid = min_zxid;
+    request_info.relaxed_order = relaxed_order;
+    request_info.client_group = client_group;
     using namespace std::chrono;
     request_info.create_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    if (UInt64 deadline_ms = configuration_and_settings->raft_settings->request_deadline_ms)
+        request_info.deadline = request_info.create_time + static_cast<int64_t>(deadline_ms);
+    request_info.trace.mark(RequestTrace::RECEIVE);
 
     LOG_TRACE(
         log,
@@ -207,6 +313,27 @@ bool KeeperDispatcher::putRequest(const Coordination::ZooKeeperRequestPtr & requ
         request->xid,
         Coordination::toString(request->getOpNum()));
 
+    /// Rejected like when the queue is full, the connection is closed and the client reconnects, possibly to another
+    /// server. Old clients can not decode ZTHROTTLEDOP, so it is not answered by it.
+    if (shouldThrottle(*request, session_id))
+    {
+        throttled_requests.fetch_add(1, std::memory_order_relaxed);
+        throw Exception(
+            ErrorCodes::TIMEOUT_EXCEEDED,
+            "Throttle request session {} xid {}, requests_queue size {}",
+            toHexString(session_id),
+            request->xid,
+            requests_queue->size());
+    }
+
+    if (rate_limited)
+    {
+        /// Still queued so that it is answered after the requests of the session before it
+        request_info.throttled = true;
+        throttled_requests.fetch_add(1, std::memory_order_relaxed);
+        LOG_TRACE(log, "Rate limited request session {} xid {}", toHexString(session_id), request->xid);
+    }
+
     //    std::lock_guard lock(push_request_mutex);
 
     /// Put close requests without timeouts
@@ -225,6 +352,33 @@ bool KeeperDispatcher::putRequest(const Coordination::ZooKeeperRequestPtr & requ
 }
 
 
+bool KeeperDispatcher::isRelaxedReadOrderClient(const Poco::Net::IPAddress & address) const
+{
+    for (const auto & [network, mask] : relaxed_read_order_networks)
+    {
+        if (address.family() == network.family() && (address & mask) == (network & mask))
+            return true;
+    }
+    return false;
+}
+
+bool KeeperDispatcher::shouldThrottle(const Coordination::ZooKeeperRequest & request, int64_t session_id) const
+{
+    const auto & raft_settings = configuration_and_settings->raft_settings;
+    switch (PriorityRequestsQueue::laneOf(request))
+    {
+        case PriorityRequestsQueue::READ:
+            return raft_settings->max_queued_read_requests
+                && requests_queue->shardSize(session_id, PriorityRequestsQueue::READ) >= raft_settings->max_queued_read_requests;
+        case PriorityRequestsQueue::WRITE:
+            return raft_settings->max_queued_write_requests
+                && requests_queue->shardSize(session_id, PriorityRequestsQueue::WRITE) >= raft_settings->max_queued_write_requests;
+        case PriorityRequestsQueue::CONTROL:
+            return false;
+    }
+    __builtin_unreachable();
+}
+
 bool KeeperDispatcher::putForwardingRequest(
     size_t server_id, size_t client_id, const Coordination::ZooKeeperRequestPtr & request, int64_t session_id)
 {
@@ -233,6 +387,9 @@ bool KeeperDispatcher::putForwardingRequest(
     request_info.session_id = session_id;
     using namespace std::chrono;
     request_info.create_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    if (UInt64 deadline_ms = configuration_and_settings->raft_settings->request_deadline_ms)
+        request_info.deadline = request_info.create_time + static_cast<int64_t>(deadline_ms);
+    request_info.trace.mark(RequestTrace::RECEIVE);
 
     request_info.server_id = server_id;
     request_info.client_id = client_id;
@@ -260,10 +417,77 @@ bool KeeperDispatcher::putForwardingRequest(
     return true;
 }
 
+void KeeperDispatcher::putForwardingRequests(
+    int32_t server_id, int32_t client_id, KeeperStore::RequestsForSessions & requests, std::vector<ForwardResponse> & failed)
+{
+    using namespace std::chrono;
+    int64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    UInt64 deadline_ms = configuration_and_settings->raft_settings->request_deadline_ms;
+    UInt64 operation_timeout_ms = configuration_and_settings->raft_settings->operation_timeout_ms;
+
+    /// The leader skips the request threads, which only hand forwarded writes to the accumulator. Otherwise they go
+    /// there as forwarded one by one, to be forwarded again or failed.
+    bool to_accumulator = server->isLeader();
+    for (auto & request_info : requests)
+    {
+        request_info.create_time = now;
+        if (deadline_ms)
+            request_info.deadline = now + static_cast<int64_t>(deadline_ms);
+        request_info.server_id = server_id;
+        request_info.client_id = client_id;
+        request_info.trace.mark(RequestTrace::RECEIVE);
+
+        /// request_info is moved by the push, the failure response needs a copy of these
+        int64_t session_id = request_info.session_id;
+        auto xid = request_info.request->xid;
+        auto op_num = request_info.request->getOpNum();
+        bool pushed;
+        if (to_accumulator && op_num != Coordination::OpNum::Close && !request_info.request->isReadRequest()
+            && !isLocalSession(session_id))
+        {
+            request_info.trace.mark(RequestTrace::DISPATCH);
+            pushed = request_accumulator.tryPush(std::move(request_info), operation_timeout_ms);
+        }
+        else if (op_num == Coordination::OpNum::Close)
+            pushed = requests_queue->push(std::move(request_info));
+        else
+            pushed = requests_queue->tryPush(std::move(request_info), operation_timeout_ms);
+
+        if (!pushed)
+            failed.push_back({Result, false, nuraft::cmd_result_code::CANCELLED, session_id, xid, op_num});
+    }
+}
+
 void KeeperDispatcher::initialize(const Poco::Util::AbstractConfiguration & config)
 {
     LOG_DEBUG(log, "Initializing dispatcher");
     configuration_and_settings = Settings::loadFromConfig(config, true);
+    /// Before the store and the log are loaded
+    if (configuration_and_settings->huge_pages)
+        enableHugePages();
+    request_tracer.setSlowThreshold(configuration_and_settings->raft_settings->request_trace_slow_us);
+    hot_key_stats.configure(
+        configuration_and_settings->raft_settings->hot_key_sample_rate, configuration_and_settings->raft_settings->hot_key_path_depth);
+    /// Before connections are accepted
+    rate_limiter.configure(
+        configuration_and_settings->session_request_rate,
+        configuration_and_settings->session_request_burst,
+        configuration_and_settings->ip_request_rate,
+        configuration_and_settings->ip_request_burst,
+        configuration_and_settings->path_request_rate_limits);
+    for (const auto & network : configuration_and_settings->relaxed_read_order_networks)
+    {
+        auto slash = network.find('/');
+        Poco::Net::IPAddress address;
+        if (!Poco::Net::IPAddress::tryParse(network.substr(0, slash), address))
+            throw Exception(ErrorCodes::UNKNOWN_SETTING, "Invalid network {} of relaxed_read_order_networks", network);
+        unsigned prefix_length = slash == String::npos ? address.length() * 8 : std::stoul(network.substr(slash + 1));
+        relaxed_read_order_networks.emplace_back(address, Poco::Net::IPAddress(prefix_length, address.family()));
+    }
+    client_groups.configure(configuration_and_settings->client_groups, configuration_and_settings->default_client_group_weight);
+    LockProfiler::enabled.store(configuration_and_settings->raft_settings->lock_profiling, std::memory_order_relaxed);
+    /// Before anything produces responses
+    responses_queue.setShardCount(configuration_and_settings->response_thread_count);
 
     /// TODO remove
     bool session_consistent = configuration_and_settings->raft_settings->session_consistent;
@@ -273,10 +497,15 @@ void KeeperDispatcher::initialize(const Poco::Util::AbstractConfiguration & conf
 
     if (session_consistent)
     {
+        linearizable_reads = configuration_and_settings->raft_settings->linearizable_reads;
+        if (linearizable_reads || configuration_and_settings->raft_settings->lightweight_sync)
+            read_index_tracker = std::make_unique<ReadIndexTracker>();
+        observer_local_reads = configuration_and_settings->raft_settings->observer_local_reads;
         server = std::make_shared<KeeperServer>(configuration_and_settings, config, responses_queue, request_processor);
 
         /// Raft server needs to be able to handle commit when startup.
-        request_processor->initialize(thread_count, server, shared_from_this(), operation_timeout_ms);
+        request_processor->initialize(
+            thread_count, configuration_and_settings->apply_thread_count, server, shared_from_this(), operation_timeout_ms);
     }
     else
         server = std::make_shared<KeeperServer>(configuration_and_settings, config, responses_queue);
@@ -301,17 +530,26 @@ void KeeperDispatcher::initialize(const Poco::Util::AbstractConfiguration & conf
         UInt64 session_sync_period_ms
             = configuration_and_settings->raft_settings->dead_session_check_period_ms / 2;
         request_forwarder.initialize(thread_count, server, shared_from_this(), session_sync_period_ms);
+        const auto & raft_settings = configuration_and_settings->raft_settings;
         request_accumulator.initialize(
-            1, shared_from_this(), server, operation_timeout_ms, configuration_and_settings->raft_settings->max_batch_size);
-        requests_queue = std::make_shared<RequestsQueue>(thread_count, 20000);
+            1,
+            shared_from_this(),
+            server,
+            operation_timeout_ms,
+            raft_settings->max_batch_size,
+            raft_settings->max_batch_bytes,
+            raft_settings->batch_latency_target_ms,
+            raft_settings->max_inflight_batches);
+        requests_queue = std::make_shared<PriorityRequestsQueue>(thread_count, 20000, client_groups.weights());
     }
     else
     {
-        requests_queue = std::make_shared<RequestsQueue>(1, 20000);
+        requests_queue = std::make_shared<PriorityRequestsQueue>(1, 20000, client_groups.weights());
     }
 
     request_thread = std::make_shared<ThreadPool>(thread_count);
-    responses_thread = std::make_shared<ThreadPool>(1);
+    responses_thread = std::make_shared<ThreadPool>(responses_queue.shardCount());
+    four_letter_word_thread = std::make_shared<ThreadPool>(FOUR_LETTER_WORD_THREADS, FOUR_LETTER_WORD_THREADS, FOUR_LETTER_WORD_QUEUE_SIZE);
     for (size_t i = 0; i < thread_count; i++)
     {
         if (session_consistent)
@@ -323,10 +561,19 @@ void KeeperDispatcher::initialize(const Poco::Util::AbstractConfiguration & conf
             request_thread->trySchedule([this] { requestThread(); });
         }
     }
-    responses_thread->trySchedule([this] { responseThread(); });
+    for (size_t i = 0; i < responses_queue.shardCount(); i++)
+        responses_thread->trySchedule([this, i] { responseThread(i); });
 
     session_cleaner_thread = ThreadFromGlobalPool([this] { sessionCleanerTask(); });
+    if (configuration_and_settings->raft_settings->leader_balance_interval_ms)
+        leader_balance_thread = ThreadFromGlobalPool([this] { leaderBalanceThread(); });
+    if (configuration_and_settings->raft_settings->store_shrink_interval_ms)
+        store_shrink_thread = ThreadFromGlobalPool([this] { storeShrinkThread(); });
+    StallWatchdog::instance().setThreshold(configuration_and_settings->stall_threshold_ms);
+    if (configuration_and_settings->stall_threshold_ms)
+        stall_watchdog_thread = ThreadFromGlobalPool([this] { stallWatchdogThread(); });
     update_configuration_thread = ThreadFromGlobalPool([this] { updateConfigurationThread(); });
+    session_request_thread = ThreadFromGlobalPool([this] { sessionRequestThread(); });
     updateConfiguration(config);
 
     LOG_DEBUG(log, "Dispatcher initialized");
@@ -353,6 +600,38 @@ void KeeperDispatcher::shutdown()
             if (session_cleaner_thread.joinable())
                 session_cleaner_thread.join();
 
+            LOG_DEBUG(log, "Shutting down session_request_thread");
+            if (session_request_thread.joinable())
+                session_request_thread.join();
+            session_requests_queue.finish();
+            SessionRequest session_request;
+            while (session_requests_queue.tryPop(session_request))
+                session_request.callback(0, false);
+
+            LOG_DEBUG(log, "Shutting down leader_balance_thread");
+            {
+                std::lock_guard balance_lock(leader_balance_mutex);
+                leader_balance_cv.notify_all();
+            }
+            if (leader_balance_thread.joinable())
+                leader_balance_thread.join();
+
+            LOG_DEBUG(log, "Shutting down store_shrink_thread");
+            {
+                std::lock_guard shrink_lock(store_shrink_mutex);
+                store_shrink_cv.notify_all();
+            }
+            if (store_shrink_thread.joinable())
+                store_shrink_thread.join();
+
+            LOG_DEBUG(log, "Shutting down stall_watchdog_thread");
+            {
+                std::lock_guard watchdog_lock(stall_watchdog_mutex);
+                stall_watchdog_cv.notify_all();
+            }
+            if (stall_watchdog_thread.joinable())
+                stall_watchdog_thread.join();
+
             LOG_DEBUG(log, "Shutting down request_thread");
 
             if (request_thread)
@@ -361,8 +640,12 @@ void KeeperDispatcher::shutdown()
             LOG_DEBUG(log, "Shutting down responses_thread");
             if (responses_thread)
                 responses_thread->wait();
+
+            if (four_letter_word_thread)
+                four_letter_word_thread->wait();
         }
 
+        request_capture.stop();
         request_forwarder.shutdown();
         request_accumulator.shutdown();
         request_processor->shutdown();
@@ -378,7 +661,11 @@ void KeeperDispatcher::shutdown()
             response->error = Coordination::Error::ZSESSIONEXPIRED;
             setResponse(request_for_session.session_id, response);
         }
-        session_to_response_callback.clear();
+        for (auto & shard : session_callbacks)
+        {
+            std::lock_guard lock(shard.mutex);
+            shard.callbacks.clear();
+        }
     }
     catch (...)
     {
@@ -390,11 +677,30 @@ void KeeperDispatcher::shutdown()
 
 void KeeperDispatcher::registerSession(int64_t session_id, ZooKeeperResponseCallback callback, bool is_reconnected)
 {
-    std::lock_guard lock(session_to_response_callback_mutex);
-    if (!session_to_response_callback.try_emplace(session_id, callback).second && !is_reconnected)
+    auto & shard = sessionCallbacksFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    if (!shard.callbacks.try_emplace(session_id, callback).second && !is_reconnected)
         throw Exception(RK::ErrorCodes::LOGICAL_ERROR, "Session with id {} already registered in dispatcher", toHexString(session_id));
 }
 
+void KeeperDispatcher::putRegisterSessionRequest(int64_t session_id, int64_t session_timeout_ms)
+{
+    if (!configuration_and_settings->raft_settings->session_id_block_size)
+        return;
+
+    auto request = std::make_shared<Coordination::ZooKeeperRegisterSessionRequest>();
+    request->xid = Coordination::REGISTER_SESSION_XID;
+    request->session_timeout_ms = session_timeout_ms;
+    putRequest(request, session_id);
+}
+
+bool KeeperDispatcher::putSessionRequest(int64_t session_id, int64_t session_timeout_ms, SessionRequestCallback callback)
+{
+    if (shutdown_called)
+        return false;
+    return session_requests_queue.tryPush(SessionRequest{session_id, session_timeout_ms, std::move(callback)});
+}
+
 void KeeperDispatcher::registerForward(ServerForClient server_client, ForwardResponseCallback callback)
 {
     std::lock_guard lock(forward_to_response_callback_mutex);
@@ -406,6 +712,253 @@ void KeeperDispatcher::registerForward(ServerForClient server_client, ForwardRes
             server_client.second);
 }
 
+static UInt64 getProcessCPUTimeUs()
+{
+    struct rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    auto to_us = [](const timeval & tv) { return static_cast<UInt64>(tv.tv_sec) * 1000000 + tv.tv_usec; };
+    return to_us(usage.ru_utime) + to_us(usage.ru_stime);
+}
+
+String KeeperDispatcher::getLeaderOverload(UInt64 elapsed_us, UInt64 & cpu_us, LogFsyncStats & fsync_stats)
+{
+    const auto & raft_settings = configuration_and_settings->raft_settings;
+    String overload;
+    auto add = [&overload](const String & limit)
+    {
+        if (!overload.empty())
+            overload += ", ";
+        overload += limit;
+    };
+
+    UInt64 current_cpu_us = getProcessCPUTimeUs();
+    UInt64 cores = std::max(std::thread::hardware_concurrency(), 1U);
+    UInt64 cpu_percent = elapsed_us ? (current_cpu_us - std::min(cpu_us, current_cpu_us)) * 100 / (elapsed_us * cores) : 0;
+    cpu_us = current_cpu_us;
+    if (raft_settings->leader_balance_max_cpu_percent && cpu_percent > raft_settings->leader_balance_max_cpu_percent)
+        add(fmt::format("CPU {}%", cpu_percent));
+
+    auto current_fsync_stats = server->getKeeperLogInfo().fsync_stats;
+    /// The counters only grow
+    UInt64 fsyncs = current_fsync_stats.fsync_count - fsync_stats.fsync_count;
+    UInt64 fsync_avg_us = fsyncs ? (current_fsync_stats.total_latency_us - fsync_stats.total_latency_us) / fsyncs : 0;
+    fsync_stats = current_fsync_stats;
+    if (raft_settings->leader_balance_max_fsync_latency_us && fsync_avg_us > raft_settings->leader_balance_max_fsync_latency_us)
+        add(fmt::format("fsync latency {}us", fsync_avg_us));
+
+    size_t connections = 0;
+    for (auto & shard : session_callbacks)
+    {
+        std::lock_guard lock(shard.mutex);
+        connections += shard.callbacks.size();
+    }
+    if (raft_settings->leader_balance_max_connections && connections > raft_settings->leader_balance_max_connections)
+        add(fmt::format("{} connections", connections));
+
+    size_t apply_lag = request_processor->commitQueueSize();
+    if (raft_settings->leader_balance_max_apply_lag && apply_lag > raft_settings->leader_balance_max_apply_lag)
+        add(fmt::format("{} requests to apply", apply_lag));
+
+    return overload;
+}
+
+void KeeperDispatcher::leaderBalanceThread()
+{
+    setThreadName("LeaderBalance");
+
+    const auto & raft_settings = configuration_and_settings->raft_settings;
+    UInt64 cpu_us = getProcessCPUTimeUs();
+    LogFsyncStats fsync_stats = server->getKeeperLogInfo().fsync_stats;
+    auto last_check = std::chrono::steady_clock::now();
+    UInt64 overloaded_checks = 0;
+
+    while (!shutdown_called)
+    {
+        {
+            std::unique_lock lock(leader_balance_mutex);
+            leader_balance_cv.wait_for(
+                lock, std::chrono::milliseconds(raft_settings->leader_balance_interval_ms), [this] { return shutdown_called.load(); });
+        }
+        if (shutdown_called)
+            break;
+
+        try
+        {
+            auto now = std::chrono::steady_clock::now();
+            UInt64 elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(now - last_check).count();
+            last_check = now;
+
+            /// Sample on followers too, so that a new leader compares with the last interval only
+            String overload = getLeaderOverload(elapsed_us, cpu_us, fsync_stats);
+            if (!isLeader() || overload.empty())
+            {
+                overloaded_checks = 0;
+                continue;
+            }
+
+            if (++overloaded_checks < raft_settings->leader_balance_checks)
+                continue;
+            overloaded_checks = 0;
+
+            auto successor = server->getLeadershipSuccessor();
+            if (!successor)
+            {
+                LOG_INFO(log, "Leader is overloaded ({}), but no follower is up to date to take over leadership", overload);
+                continue;
+            }
+
+            LOG_INFO(log, "Leader is overloaded ({}), transferring leadership to server {}", overload, *successor);
+            server->transferLeadership(*successor);
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Failed to balance leadership");
+        }
+    }
+}
+
+void KeeperDispatcher::storeShrinkThread()
+{
+    setThreadName("StoreShrink");
+
+    const auto & raft_settings = configuration_and_settings->raft_settings;
+    while (!shutdown_called)
+    {
+        {
+            std::unique_lock lock(store_shrink_mutex);
+            store_shrink_cv.wait_for(
+                lock, std::chrono::milliseconds(raft_settings->store_shrink_interval_ms), [this] { return shutdown_called.load(); });
+        }
+        if (shutdown_called)
+            break;
+
+        try
+        {
+            Stopwatch watch;
+            size_t shrunk = server->getKeeperStateMachine()->getStore().shrinkContainers();
+            if (shrunk)
+                LOG_INFO(log, "Shrunk {} sparse blocks and tables of the store in {} ms", shrunk, watch.elapsedMilliseconds());
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Failed to shrink the store");
+        }
+    }
+}
+
+void KeeperDispatcher::stallWatchdogThread()
+{
+    setThreadName("StallWatchdog");
+
+    auto & watchdog = StallWatchdog::instance();
+    UInt64 check_interval_ms = std::max<UInt64>(configuration_and_settings->stall_threshold_ms / 4, 10);
+    UInt64 capture_ms = configuration_and_settings->stall_capture_ms;
+    auto wait = [this](UInt64 wait_ms)
+    {
+        std::unique_lock lock(stall_watchdog_mutex);
+        return !stall_watchdog_cv.wait_for(lock, std::chrono::milliseconds(wait_ms), [this] { return shutdown_called.load(); });
+    };
+
+    while (wait(check_interval_ms))
+    {
+        auto stalls = watchdog.check();
+        if (stalls.empty())
+            continue;
+
+        for (const auto & stall : stalls)
+        {
+            String thread_name;
+            std::ifstream comm("/proc/self/task/" + std::to_string(stall.thread_id) + "/comm");
+            std::getline(comm, thread_name);
+            if (stall.log_index)
+                LOG_ERROR(
+                    log,
+                    "Thread {} {} is stalled for {} ms committing log entry {}",
+                    stall.thread_id,
+                    thread_name,
+                    stall.busy_ms,
+                    stall.log_index);
+            else
+                LOG_ERROR(
+                    log,
+                    "Thread {} {} is stalled for {} ms applying request session {} xid {} {}",
+                    stall.thread_id,
+                    thread_name,
+                    stall.busy_ms,
+                    toHexString(stall.session_id),
+                    stall.xid,
+                    Coordination::toString(static_cast<Coordination::OpNum>(stall.opnum)));
+        }
+
+        if (!capture_ms)
+            continue;
+        /// A profile started by cpup or walp is left alone
+        try
+        {
+            auto & profiler = SamplingProfiler::instance();
+            profiler.start(SamplingProfiler::Clock::REAL, 100, capture_ms);
+            bool stopped = !wait(capture_ms);
+            LOG_ERROR(log, "Stacks of all threads during the stall, by real time:\n{}", profiler.stop());
+            if (stopped)
+                break;
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Cannot capture the stacks of the stall");
+        }
+    }
+}
+
+void KeeperDispatcher::putInternalRequest(const Coordination::ZooKeeperRequestPtr & request, int64_t session_id)
+{
+    KeeperStore::RequestForSession request_info;
+    request_info.request = request;
+    request_info.session_id = session_id;
+    using namespace std::chrono;
+    request_info.create_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    request_info.trace.mark(RequestTrace::RECEIVE);
+
+    std::lock_guard lock(push_request_mutex);
+    if (!requests_queue->push(std::move(request_info)))
+        throw Exception("Cannot push request to queue", ErrorCodes::SYSTEM_ERROR);
+}
+
+void KeeperDispatcher::expireSessions(const std::vector<int64_t> & dead_sessions)
+{
+    if (!dead_sessions.empty())
+        LOG_INFO(log, "Found dead sessions {}", dead_sessions.size());
+
+    /// Servers without ExpireSessions can not apply it, they are upgraded before batches are enabled
+    size_t batch_size = configuration_and_settings->raft_settings->max_expire_sessions_batch_size;
+    if (batch_size == 0)
+    {
+        for (auto dead_session : dead_sessions)
+        {
+            auto request = Coordination::ZooKeeperRequestFactory::instance().get(Coordination::OpNum::Close);
+            request->xid = Coordination::CLOSE_XID;
+            putInternalRequest(request, dead_session);
+            finishSession(dead_session);
+        }
+        return;
+    }
+
+    /// Close dead sessions in batches, a batch is one log entry
+    for (size_t begin = 0; begin < dead_sessions.size(); begin += batch_size)
+    {
+        size_t end = std::min(begin + batch_size, dead_sessions.size());
+
+        auto request = std::make_shared<Coordination::ZooKeeperExpireSessionsRequest>();
+        request->xid = Coordination::CLOSE_XID;
+        request->session_ids.assign(dead_sessions.begin() + begin, dead_sessions.begin() + end);
+        putInternalRequest(request);
+
+        for (size_t i = begin; i < end; ++i)
+            finishSession(dead_sessions[i]);
+        LOG_INFO(log, "Expire {} dead sessions request pushed", end - begin);
+    }
+}
+
 void KeeperDispatcher::sessionCleanerTask()
 {
     setThreadName("SessionCleaner");
@@ -418,39 +971,40 @@ void KeeperDispatcher::sessionCleanerTask()
 
         try
         {
+            checkMemorySoftLimit();
+
             if (isLeader())
             {
                 std::this_thread::sleep_for(std::chrono::milliseconds(
                     configuration_and_settings->raft_settings->dead_session_check_period_ms));
 
-                auto dead_sessions = server->getDeadSessions();
-                if (!dead_sessions.empty())
-                    LOG_INFO(log, "Found dead sessions {}", dead_sessions.size());
+                /// Sessions which only sent heartbeats are alive too
+                flushPingedSessions();
+                expireSessions(server->getDeadSessions());
 
-                for (int64_t dead_session : dead_sessions)
+                /// One batch a period, nodes left are found again by the next one
+                if (UInt64 nodes_batch_size = configuration_and_settings->raft_settings->max_expire_nodes_batch_size)
                 {
-                    LOG_INFO(log, "Found dead session {}, will try to close it", dead_session);
-                    Coordination::ZooKeeperRequestPtr request
-                        = Coordination::ZooKeeperRequestFactory::instance().get(Coordination::OpNum::Close);
-                    request->xid = Coordination::CLOSE_XID;
-                    KeeperStore::RequestForSession request_info;
-                    request_info.request = request;
-                    request_info.session_id = dead_session;
-                    using namespace std::chrono;
-                    request_info.create_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+                    auto expired_nodes = server->getExpiredNodes(nodes_batch_size);
+                    if (!expired_nodes.empty())
                     {
-                        std::lock_guard lock(push_request_mutex);
-                        if (!requests_queue->push(std::move(request_info)))
-                            throw Exception("Cannot push request to queue", ErrorCodes::SYSTEM_ERROR);
+                        auto request = std::make_shared<Coordination::ZooKeeperRemoveExpiredNodesRequest>();
+                        request->paths = std::move(expired_nodes);
+                        size_t count = request->paths.size();
+                        putInternalRequest(request);
+                        LOG_DEBUG(log, "Remove {} expired nodes request pushed", count);
                     }
-                    finishSession(dead_session);
-                    LOG_INFO(log, "Dead session close request pushed");
                 }
             }
             else
             {
                 std::this_thread::sleep_for(std::chrono::milliseconds(
                     configuration_and_settings->raft_settings->dead_session_check_period_ms));
+                flushPingedSessions();
+
+                /// The sessions connected here are expired here, the leader holds only their leases
+                if (configuration_and_settings->raft_settings->session_lease_ms && hasLeader() && !isWitness())
+                    expireSessions(server->getKeeperStateMachine()->getStore().getDeadSessionsOf(getLocalSessions()));
             }
         }
         catch (...)
@@ -462,6 +1016,134 @@ void KeeperDispatcher::sessionCleanerTask()
     LOG_INFO(log, "end session clear task!");
 }
 
+UInt64 KeeperDispatcher::getResidentMemory() const
+{
+#if defined(OS_LINUX)
+    return memory_statistics.get().resident;
+#else
+    return std::max<Int64>(total_memory_tracker.get(), 0);
+#endif
+}
+
+void KeeperDispatcher::checkMemorySoftLimit()
+{
+    const auto & raft_settings = configuration_and_settings->raft_settings;
+    UInt64 soft_limit = raft_settings->memory_soft_limit;
+    bool was_under_pressure = memory_pressure.load(std::memory_order_relaxed);
+    if (!soft_limit && !was_under_pressure)
+        return;
+
+    /// Left well below the limit only, so that it does not flap around it
+    UInt64 resident = getResidentMemory();
+    bool under_pressure = soft_limit && resident > (was_under_pressure ? soft_limit / 10 * 9 : soft_limit);
+    if (under_pressure == was_under_pressure)
+        return;
+
+    memory_pressure.store(under_pressure, std::memory_order_relaxed);
+    if (under_pressure)
+    {
+        UInt64 log_cache_bytes = std::min(raft_settings->memory_soft_limit_log_cache_bytes, raft_settings->log_cache_max_bytes);
+        LOG_WARNING(
+            log,
+            "Resident memory {} is over the soft limit {}, new sessions are rejected and the log cache shrinks to {}",
+            formatReadableSizeWithBinarySuffix(resident),
+            formatReadableSizeWithBinarySuffix(soft_limit),
+            formatReadableSizeWithBinarySuffix(log_cache_bytes));
+        server->setLogCacheMaxBytes(log_cache_bytes);
+    }
+    else
+    {
+        LOG_INFO(
+            log,
+            "Resident memory {} is back under the soft limit {}",
+            formatReadableSizeWithBinarySuffix(resident),
+            formatReadableSizeWithBinarySuffix(soft_limit));
+        server->setLogCacheMaxBytes(raft_settings->log_cache_max_bytes);
+    }
+}
+
+KeeperMemoryInfo KeeperDispatcher::getKeeperMemoryInfo() const
+{
+    KeeperMemoryInfo result{};
+    const auto & state_machine = *server->getKeeperStateMachine();
+    auto memory_stats = state_machine.getMemoryStats();
+    result.data_tree = memory_stats.total() - memory_stats.watch_bytes;
+    result.watches = memory_stats.watch_bytes;
+    result.log_cache = server->getLogCacheStats().bytes;
+    result.connection_buffers = ConnectionHandler::getQueuedResponseBytes();
+    result.snapshot = state_machine.getSnapshotMemoryTracker().get();
+    result.snapshot_peak = state_machine.getSnapshotMemoryTracker().getPeak();
+    result.tracked = total_memory_tracker.get();
+    result.resident = getResidentMemory();
+    result.huge_pages_enabled = hugePagesEnabled();
+    result.huge_pages = getHugePagesBytes();
+    result.soft_limit = configuration_and_settings->raft_settings->memory_soft_limit;
+    result.memory_pressure = memory_pressure.load(std::memory_order_relaxed);
+    result.rejected_sessions = rejected_sessions.load(std::memory_order_relaxed);
+    return result;
+}
+
+void KeeperDispatcher::sessionRequestThread()
+{
+    setThreadName("SessionRequest");
+
+    std::vector<SessionRequest> batch;
+    std::vector<ptr<nuraft::cmd_result<ptr<buffer>>>> results;
+    while (!shutdown_called)
+    {
+        SessionRequest session_request;
+        if (!session_requests_queue.tryPop(session_request, 100))
+            continue;
+
+        batch.clear();
+        batch.push_back(std::move(session_request));
+        while (batch.size() < MAX_SESSION_REQUEST_BATCH && session_requests_queue.tryPop(session_request))
+            batch.push_back(std::move(session_request));
+
+        /// Ids granted from the local block take no Raft round, the others are appended together
+        bool local_ids = server->grantsSessionIDsLocally();
+        results.assign(batch.size(), nullptr);
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            try
+            {
+                if (batch[i].session_id)
+                    results[i] = server->appendSessionTimeoutUpdate(batch[i].session_id, batch[i].session_timeout_ms);
+                else if (!local_ids)
+                    results[i] = server->appendCreateSession(batch[i].session_timeout_ms);
+            }
+            catch (...)
+            {
+                tryLogCurrentException(log, "Cannot append session request");
+            }
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            int64_t session_id = 0;
+            bool expired = false;
+            try
+            {
+                if (batch[i].session_id)
+                {
+                    if (results[i] && server->waitSessionTimeoutUpdate(results[i], batch[i].session_id, batch[i].session_timeout_ms))
+                        session_id = batch[i].session_id;
+                    else if (results[i])
+                        expired = true;
+                }
+                else if (local_ids)
+                    session_id = server->getSessionID(batch[i].session_timeout_ms);
+                else if (results[i])
+                    session_id = server->waitCreateSession(results[i], batch[i].session_timeout_ms);
+            }
+            catch (...)
+            {
+                tryLogCurrentException(log, "Cannot serve session request");
+            }
+            batch[i].callback(session_id, expired);
+        }
+    }
+}
 
 void KeeperDispatcher::updateConfigurationThread()
 {
@@ -519,26 +1201,45 @@ void KeeperDispatcher::updateConfigurationThread()
 void KeeperDispatcher::finishSession(int64_t session_id)
 {
     LOG_TRACE(log, "finish session {}", toHexString(session_id));
-    std::lock_guard lock(session_to_response_callback_mutex);
-    auto session_it = session_to_response_callback.find(session_id);
-    if (session_it != session_to_response_callback.end())
-        session_to_response_callback.erase(session_it);
+    auto & shard = sessionCallbacksFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    auto session_it = shard.callbacks.find(session_id);
+    if (session_it != shard.callbacks.end())
+        shard.callbacks.erase(session_it);
+}
+
+void KeeperDispatcher::pushHandoffBarrier(int64_t session_id)
+{
+    auto response = std::make_shared<Coordination::ZooKeeperHeartbeatResponse>();
+    response->xid = Coordination::HANDOFF_BARRIER_XID;
+    responses_queue.push(KeeperStore::ResponseForSession{session_id, response});
+}
+
+std::vector<int64_t> KeeperDispatcher::getLocalSessions()
+{
+    std::vector<int64_t> result;
+    for (auto & shard : session_callbacks)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (const auto & session : shard.callbacks)
+            result.push_back(session.first);
+    }
+    return result;
 }
 
 bool KeeperDispatcher::isLocalSession(int64_t session_id)
 {
     LOG_TRACE(log, "contains session {}", toHexString(session_id));
-    std::lock_guard lock(session_to_response_callback_mutex);
-    auto session_it = session_to_response_callback.find(session_id);
-    return session_it != session_to_response_callback.end();
+    auto & shard = sessionCallbacksFor(session_id);
+    std::lock_guard lock(shard.mutex);
+    return shard.callbacks.contains(session_id);
 }
 
 void KeeperDispatcher::filterLocalSessions(std::unordered_map<int64_t, int64_t> & session_to_expiration_time)
 {
-    std::lock_guard lock(session_to_response_callback_mutex);
     for (auto it = session_to_expiration_time.begin(); it != session_to_expiration_time.end();)
     {
-        if (!session_to_response_callback.contains(it->first))
+        if (!isLocalSession(it->first))
         {
             LOG_TRACE(log, "Not local session {}", it->first);
             it = session_to_expiration_time.erase(it);
@@ -551,6 +1252,49 @@ void KeeperDispatcher::filterLocalSessions(std::unordered_map<int64_t, int64_t>
     }
 }
 
+void KeeperDispatcher::pingSession(int64_t session_id)
+{
+    using namespace std::chrono;
+    int64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    std::lock_guard lock(pinged_sessions_mutex);
+    pinged_sessions[session_id] = now;
+}
+
+void KeeperDispatcher::flushPingedSessions()
+{
+    std::unordered_map<int64_t, int64_t> to_flush;
+    {
+        std::lock_guard lock(pinged_sessions_mutex);
+        to_flush.swap(pinged_sessions);
+    }
+    if (!to_flush.empty())
+        server->getKeeperStateMachine()->getStore().touchSessions(to_flush);
+}
+
+
+bool KeeperDispatcher::scheduleFourLetterWordCommand(std::function<void()> job)
+{
+    if (!four_letter_word_thread)
+        return false;
+
+    return four_letter_word_thread->trySchedule(
+        [job = std::move(job)]
+        {
+            setThreadName("4LWCommand");
+#if defined(OS_LINUX)
+            /// Threads come from the global pool, so the priority is restored for the next job of the thread
+            id_t tid = static_cast<id_t>(getThreadId());
+            errno = 0;
+            int priority = getpriority(PRIO_PROCESS, tid);
+            bool lowered = errno == 0 && setpriority(PRIO_PROCESS, tid, FOUR_LETTER_WORD_NICE) == 0;
+            SCOPE_EXIT({
+                if (lowered)
+                    setpriority(PRIO_PROCESS, tid, priority);
+            });
+#endif
+            job();
+        });
+}
 
 void KeeperDispatcher::updateConfiguration(const Poco::Util::AbstractConfiguration & config)
 {
@@ -568,13 +1312,29 @@ void KeeperDispatcher::updateConfiguration(const Poco::Util::AbstractConfigurati
         if (!push_result)
             throw Exception(ErrorCodes::SYSTEM_ERROR, "Cannot push configuration update to queue");
     }
+
+    /// Batch limits take effect at once, thread counts and queue shards are fixed at startup
+    auto new_settings = RaftSettings::getDefault();
+    new_settings->loadFromConfig("keeper.raft_settings", config);
+    request_accumulator.setBatchLimits(
+        new_settings->max_batch_size,
+        new_settings->max_batch_bytes,
+        new_settings->batch_latency_target_ms,
+        new_settings->max_inflight_batches);
+    request_forwarder.setBatchLimits(new_settings->max_forward_batch_size, new_settings->forward_batch_linger_us);
 }
 
 
-void KeeperDispatcher::updateKeeperStatLatency(uint64_t process_time_ms)
+void KeeperDispatcher::updateKeeperStatLatency(uint64_t process_time_ms, Coordination::OpNum op_num, UInt64 process_time_us)
 {
-    std::lock_guard lock(keeper_stats_mutex);
     keeper_stats.updateLatency(process_time_ms);
+
+    auto role = RequestLatencyStats::FOLLOWER;
+    if (server->isLeader())
+        role = RequestLatencyStats::LEADER;
+    else if (server->isObserver())
+        role = RequestLatencyStats::OBSERVER;
+    request_latency_stats.record(role, op_num, process_time_us);
 }
 
 static uint64_t getDirSize(const fs::path & dir)
@@ -619,10 +1379,25 @@ Keeper4LWInfo KeeperDispatcher::getKeeper4LWInfo()
     {
         std::lock_guard lock(push_request_mutex);
         result.outstanding_requests_count = requests_queue->size();
+        for (size_t lane = 0; lane < PriorityRequestsQueue::LANES; ++lane)
+            result.queued_requests_by_lane[lane] = requests_queue->size(static_cast<PriorityRequestsQueue::Lane>(lane));
+        for (size_t group = 0; group < requests_queue->groupCount(); ++group)
+            result.client_groups.push_back(
+                {client_groups.name(group),
+                 client_groups.weight(group),
+                 requests_queue->groupSize(group),
+                 requests_queue->groupPops(group)});
     }
+    result.commit_queue_size = request_processor->commitQueueSize();
+    result.throttled_requests_count = throttled_requests.load(std::memory_order_relaxed);
+    result.expired_requests_count = request_processor->expiredRequests();
+    result.abandoned_requests_count = request_processor->abandonedRequests();
+    result.rate_limited_requests_count = rate_limiter.rejectedCount();
+    result.alive_connections_count = 0;
+    for (auto & shard : session_callbacks)
     {
-        std::lock_guard lock(session_to_response_callback_mutex);
-        result.alive_connections_count = session_to_response_callback.size();
+        std::lock_guard lock(shard.mutex);
+        result.alive_connections_count += shard.callbacks.size();
     }
     if (result.is_leader)
     {
@@ -631,6 +1406,11 @@ Keeper4LWInfo KeeperDispatcher::getKeeper4LWInfo()
     }
     result.total_nodes_count = server->getKeeperStateMachine()->getNodesCount();
     result.last_zxid = server->getKeeperStateMachine()->getLastProcessedZxid();
+    result.request_runners = request_processor->getRunnerStats();
+    result.request_batches = request_accumulator.getBatchStats();
+    result.log_cache = server->getLogCacheStats();
+    result.batch_entry_raw_bytes = server->getBatchEntryRawBytes();
+    result.batch_entry_bytes = server->getBatchEntryBytes();
     return result;
 }
 
@@ -5,27 +5,43 @@
 #    include <Core/config_core.h>
 #endif
 
+#include <condition_variable>
 #include <functional>
 #include <Service/ConnectionStats.h>
+#include <Service/HotKeyStats.h>
 #include <Service/Keeper4LWInfo.h>
+#include <Service/LatencyHistogram.h>
 #include <Service/KeeperServer.h>
 #include <Service/NuRaftStateMachine.h>
 #include <Service/RequestAccumulator.h>
 #include <Service/RequestForwarder.h>
 #include <Service/RequestProcessor.h>
-#include <Service/RequestsQueue.h>
+#include <Service/PriorityRequestsQueue.h>
+#include <Service/ReadIndexTracker.h>
+#include <Service/RequestCapture.h>
+#include <Service/RequestTrace.h>
 #include <Service/Settings.h>
 #include <Poco/FIFOBuffer.h>
+#include <Poco/Net/IPAddress.h>
 #include <Poco/Util/AbstractConfiguration.h>
 #include <Common/ConcurrentBoundedQueue.h>
 #include <Common/Exception.h>
+#include <Common/ProfilingMutex.h>
 #include <Common/ThreadPool.h>
 #include <common/logger_useful.h>
 
+#if defined(OS_LINUX)
+#    include <Common/MemoryStatisticsOS.h>
+#endif
+
 namespace RK
 {
-using ZooKeeperResponseCallback = std::function<void(const Coordination::ZooKeeperResponsePtr & response)>;
-using ForwardResponseCallback = std::function<void(const ForwardResponse & response)>;
+/// Called with responses of a session in order, responses produced together are passed at once.
+using ZooKeeperResponseCallback = std::function<void(const Coordination::ZooKeeperResponses & responses)>;
+/// Responses of a connection from a follower, written by one send
+using ForwardResponseCallback = std::function<void(const ForwardResponse * responses, size_t count)>;
+/// Called with the session id of a handshake, 0 if the session could not be created or updated, expired if it is gone.
+using SessionRequestCallback = std::function<void(int64_t session_id, bool expired)>;
 
 class KeeperDispatcher : public std::enable_shared_from_this<KeeperDispatcher>
 {
@@ -33,13 +49,30 @@ class KeeperDispatcher : public std::enable_shared_from_this<KeeperDispatcher>
 private:
 
     std::mutex push_request_mutex;
-    ptr<RequestsQueue> requests_queue;
-    ThreadSafeQueue<KeeperStore::ResponseForSession> responses_queue;
+    ptr<PriorityRequestsQueue> requests_queue;
+    /// Requests rejected by admission control
+    std::atomic<UInt64> throttled_requests{0};
+    KeeperStore::KeeperResponsesQueue responses_queue;
     std::atomic<bool> shutdown_called{false};
     using SessionToResponseCallback = std::unordered_map<int64_t, ZooKeeperResponseCallback>;
 
-    std::mutex session_to_response_callback_mutex;
-    SessionToResponseCallback session_to_response_callback;
+    /// Response callbacks of local sessions, sharded by session id so that response threads do not contend
+    struct SessionCallbacks
+    {
+        ProfilingMutex<std::mutex, LockProfiler::SessionCallbacks> mutex;
+        SessionToResponseCallback callbacks;
+    };
+    static constexpr size_t SESSION_CALLBACK_SHARDS = 32;
+    SessionCallbacks session_callbacks[SESSION_CALLBACK_SHARDS];
+
+    SessionCallbacks & sessionCallbacksFor(int64_t session_id)
+    {
+        return session_callbacks[static_cast<uint64_t>(session_id) % SESSION_CALLBACK_SHARDS];
+    }
+
+    /// session id -> time of the last heartbeat not applied to the store yet
+    std::mutex pinged_sessions_mutex;
+    std::unordered_map<int64_t, int64_t> pinged_sessions;
 
     std::mutex forward_to_response_callback_mutex;
 
@@ -64,17 +97,62 @@ private:
 
     ThreadPoolPtr request_thread;
     ThreadPoolPtr responses_thread;
+    /// Runs four letter word commands at a low priority, so that a large output does not stall a reactor
+    ThreadPoolPtr four_letter_word_thread;
 
     ThreadFromGlobalPool session_cleaner_thread;
 
+    /// Transfer leadership away when this server is overloaded as leader, see leaderBalanceThread
+    ThreadFromGlobalPool leader_balance_thread;
+    std::mutex leader_balance_mutex;
+    std::condition_variable leader_balance_cv;
+
     /// Apply or wait for configuration changes
     ThreadFromGlobalPool update_configuration_thread;
 
+    /// Shrink store structures every store_shrink_interval_ms, see KeeperStore::shrinkContainers
+    ThreadFromGlobalPool store_shrink_thread;
+    std::mutex store_shrink_mutex;
+    std::condition_variable store_shrink_cv;
+
+    /// Check StallWatchdog four times a stall_threshold_ms
+    ThreadFromGlobalPool stall_watchdog_thread;
+    std::mutex stall_watchdog_mutex;
+    std::condition_variable stall_watchdog_cv;
+
+    /// Session request of a handshake, the connection is parked until the callback
+    struct SessionRequest
+    {
+        /// Session to update the timeout of at a reconnect, 0 for a new session
+        int64_t session_id = 0;
+        int64_t session_timeout_ms = 0;
+        SessionRequestCallback callback;
+    };
+    ConcurrentBoundedQueue<SessionRequest> session_requests_queue{20000};
+    /// Serves session requests in batches, see sessionRequestThread
+    ThreadFromGlobalPool session_request_thread;
+
     std::shared_ptr<KeeperServer> server;
 
-    mutable std::mutex keeper_stats_mutex;
     ConnectionStats keeper_stats;
 
+    /// Recorded without locks
+    RequestLatencyStats request_latency_stats;
+    RequestTracer request_tracer;
+    RequestCapture request_capture;
+    HotKeyStats hot_key_stats;
+    RequestRateLimiter rate_limiter;
+    ClientGroups client_groups;
+    /// <network, mask> of Settings::relaxed_read_order_networks
+    std::vector<std::pair<Poco::Net::IPAddress, Poco::Net::IPAddress>> relaxed_read_order_networks;
+
+    /// Whether resident memory is over raft_settings.memory_soft_limit
+    std::atomic<bool> memory_pressure{false};
+    std::atomic<UInt64> rejected_sessions{0};
+#if defined(OS_LINUX)
+    MemoryStatisticsOS memory_statistics;
+#endif
+
     SettingsPtr configuration_and_settings;
 
     Poco::Logger * log;
@@ -88,12 +166,58 @@ private:
     RequestAccumulator request_accumulator;
     RequestForwarder request_forwarder;
 
+    /// Rounds local reads wait for when reads are linearizable or syncs are lightweight, nullptr otherwise
+    std::unique_ptr<ReadIndexTracker> read_index_tracker;
+    bool linearizable_reads = false;
+    /// Observers serve reads from their local state without waiting for a read index
+    bool observer_local_reads = false;
+
 
     void requestThread();
     void requestThreadFakeZk(size_t thread_index);
-    void responseThread();
+    /// Deliver responses of the sessions in shard of responses_queue
+    void responseThread(size_t shard);
     void sessionCleanerTask();
+    /// Put the requests closing dead_sessions, in batches of max_expire_sessions_batch_size or a Close of each if it is 0
+    void expireSessions(const std::vector<int64_t> & dead_sessions);
+    /** Serves the session requests queued by handshakes so that no reactor waits for Raft. The Raft entries of all
+     * the requests queued are appended at once and waited for after, a reconnect storm takes a few round trips
+     * instead of one for every session.
+     */
+    void sessionRequestThread();
+    /** Checks the load of the leader every leader_balance_interval_ms: CPU of the process, average log fsync
+     * latency, client connections and committed requests waiting to be applied. If some is above its limit for
+     * leader_balance_checks checks in a row, leadership is transferred to the most up to date voting follower.
+     */
+    void leaderBalanceThread();
+    void storeShrinkThread();
+    /// Log the stalls found by StallWatchdog with the stacks of all threads
+    void stallWatchdogThread();
+    /// Limits the leader is over, empty if none. Updates the samples cpu_us and fsync_stats of the last check.
+    String getLeaderOverload(UInt64 elapsed_us, UInt64 & cpu_us, LogFsyncStats & fsync_stats);
+    /// Resident memory of the process, the tracked memory where it is not known
+    UInt64 getResidentMemory() const;
+    /// Enter or leave memory pressure, called periodically by the session cleaner
+    void checkMemorySoftLimit();
     void setResponse(int64_t session_id, const Coordination::ZooKeeperResponsePtr & response);
+    /// Group responses by session and hand every session its responses at once.
+    void setResponses(const KeeperStore::ResponsesForSessions & responses);
+
+    /// Admission control, whether the lane of the request's priority in the shard of session is too deep to take it.
+    bool shouldThrottle(const Coordination::ZooKeeperRequest & request, int64_t session_id) const;
+
+    /// Max responses coalesced by response thread at a time
+    static constexpr size_t MAX_RESPONSE_BATCH = 65536;
+    /// Max session requests appended to Raft at a time
+    static constexpr size_t MAX_SESSION_REQUEST_BATCH = 1024;
+
+    /// Session of internal requests, session ids are allocated from 1
+    static constexpr int64_t INTERNAL_SESSION_ID = 0;
+
+    /// A few so that a quick command is not stuck behind one dumping millions of watches
+    static constexpr size_t FOUR_LETTER_WORD_THREADS = 2;
+    static constexpr size_t FOUR_LETTER_WORD_QUEUE_SIZE = 64;
+    static constexpr int FOUR_LETTER_WORD_NICE = 10;
 
 public:
     KeeperDispatcher();
@@ -104,11 +228,32 @@ public:
 
     ~KeeperDispatcher() = default;
 
-    bool putRequest(const Coordination::ZooKeeperRequestPtr & request, int64_t session_id);
+    /// log_entry holds the request bytes received from the client if not nullptr, see RequestForSession::log_entry.
+    /// A rate limited request is answered with ZTHROTTLEDOP in the session order without being executed.
+    /// A request over the queue depth limits is rejected by TIMEOUT_EXCEEDED like when the queue is full.
+    /// A read with min_zxid is served once min_zxid is applied, see RequestForSession::min_zxid.
+    bool putRequest(
+        const Coordination::ZooKeeperRequestPtr & request,
+        int64_t session_id,
+        nuraft::ptr<nuraft::buffer> log_entry = nullptr,
+        bool rate_limited = false,
+        int64_t min_zxid = 0,
+        bool relaxed_order = false,
+        size_t client_group = ClientGroups::DEFAULT);
 
     bool putForwardingRequest(size_t server_id, size_t client_id, const Coordination::ZooKeeperRequestPtr & request, int64_t session_id);
+    /// Requests of a DataBatch frame, appended to the accumulator at once if leader. Results of requests not queued
+    /// are appended to failed.
+    void putForwardingRequests(
+        int32_t server_id, int32_t client_id, KeeperStore::RequestsForSessions & requests, std::vector<ForwardResponse> & failed);
+
+    /// Request of INTERNAL_SESSION_ID by default, which has no response, waits for room in the queue
+    void putInternalRequest(const Coordination::ZooKeeperRequestPtr & request, int64_t session_id = INTERNAL_SESSION_ID);
 
     int64_t getSessionID(int64_t session_timeout_ms) { return server->getSessionID(session_timeout_ms); }
+    /// Create a session, or update the timeout of session_id at a reconnect if not 0, without waiting for it.
+    /// callback is called on the session request thread, false if the queue is full or shut down.
+    bool putSessionRequest(int64_t session_id, int64_t session_timeout_ms, SessionRequestCallback callback);
     bool updateSessionTimeout(int64_t session_id, int64_t session_timeout_ms)
     {
         return server->updateSessionTimeout(session_id, session_timeout_ms);
@@ -119,19 +264,42 @@ public:
     void unRegisterForward(int32_t server_id, int32_t client_id);
 
     void registerSession(int64_t session_id, ZooKeeperResponseCallback callback, bool is_reconnected = false);
+
+    /// Replicate a new session whose id is granted from the local session id block, requests of the
+    /// session are ordered after it. Do nothing if sessions are created through Raft synchronously.
+    void putRegisterSessionRequest(int64_t session_id, int64_t session_timeout_ms);
     /// Call if we don't need any responses for this session no more (session was expired)
     void finishSession(int64_t session_id);
 
+    /// Queue the barrier of a connection handed off to another process after the responses queued to session so far,
+    /// see ConnectionHandoff
+    void pushHandoffBarrier(int64_t session_id);
+    /// Wait until the requests committed so far are applied, false if they are not in timeout_ms
+    bool waitCommittedApplied(UInt64 timeout_ms) { return request_processor->waitCommitQueueEmpty(timeout_ms); }
+
     bool isLocalSession(int64_t session_id);
+    /// Sessions connected to this server
+    std::vector<int64_t> getLocalSessions();
 
     void filterLocalSessions(std::unordered_map<int64_t, int64_t> & session_to_expiration_time);
 
+    /// Record a heartbeat answered by the connection of session, it is applied to the store by flushPingedSessions.
+    void pingSession(int64_t session_id);
+    /// Apply heartbeats recorded since the last flush to the session table of the store.
+    void flushPingedSessions();
+
     /// from follower
     void handleRemoteSession(int64_t session_id, int64_t expiration_time)
     {
         server->handleRemoteSession(session_id, expiration_time);
     }
 
+    /// from follower, in bulk
+    void handleRemoteSessions(const std::vector<std::pair<int64_t, int64_t>> & session_to_expiration_time)
+    {
+        server->handleRemoteSessions(session_to_expiration_time);
+    }
+
     /// Thread apply or wait configuration changes from leader
     void updateConfigurationThread();
     /// Registered in ConfigReloader callback. Add new configuration changes to
@@ -139,9 +307,19 @@ public:
     void updateConfiguration(const Poco::Util::AbstractConfiguration & config);
 
     /// Invoked when a request completes.
-    void updateKeeperStatLatency(uint64_t process_time_ms);
+    void updateKeeperStatLatency(uint64_t process_time_ms, Coordination::OpNum op_num, UInt64 process_time_us);
+
+    void sendAppendEntryResponse(int32_t server_id, int32_t client_id, const ForwardResponse & response)
+    {
+        sendAppendEntryResponses(server_id, client_id, &response, 1);
+    }
+    void sendAppendEntryResponses(int32_t server_id, int32_t client_id, const ForwardResponse * responses, size_t count);
 
-    void sendAppendEntryResponse(int32_t server_id, int32_t client_id, const ForwardResponse & response);
+    /// Commit index to answer the read index request of a follower, nullopt if not leader
+    std::optional<UInt64> getReadIndex() const { return server->getReadIndex(); }
+
+    /// nullptr if neither reads are linearizable nor syncs are lightweight
+    ReadIndexTracker * getReadIndexTracker() const { return read_index_tracker.get(); }
 
     /// Are we leader
     bool isLeader() const
@@ -154,6 +332,8 @@ public:
         return server->isLeaderAlive();
     }
 
+    bool isWitness() const { return server->isWitness(); }
+
     bool isObserver() const
     {
         return server->isObserver();
@@ -164,40 +344,83 @@ public:
     uint64_t getSnapDirSize() const;
 
     /// Request statistics such as qps, latency etc.
-    ConnectionStats getKeeperConnectionStats() const
+    ConnectionStats getKeeperConnectionStats() const { return keeper_stats; }
+
+    const RequestLatencyStats & getRequestLatencyStats() const { return request_latency_stats; }
+
+    RequestTracer & getRequestTracer() { return request_tracer; }
+
+    RequestCapture & getRequestCapture() { return request_capture; }
+
+    /// Run job of a four letter word command on four_letter_word_thread, false if too many are waiting
+    bool scheduleFourLetterWordCommand(std::function<void()> job);
+
+    HotKeyStats & getHotKeyStats() { return hot_key_stats; }
+
+    RequestRateLimiter & getRateLimiter() { return rate_limiter; }
+    const ClientGroups & getClientGroups() const { return client_groups; }
+
+    /// Whether reads of the sessions of a client at address may pass their pending writes, see RequestForSession::relaxed_order
+    bool isRelaxedReadOrderClient(const Poco::Net::IPAddress & address) const;
+
+    /// Start capturing client requests into keeper.request_capture_dir, return the path of the capture
+    String startRequestCapture()
     {
-        std::lock_guard lock(keeper_stats_mutex);
-        return keeper_stats;
+        return request_capture.start(
+            configuration_and_settings->request_capture_dir, configuration_and_settings->request_capture_max_bytes);
     }
 
     Keeper4LWInfo getKeeper4LWInfo();
 
-    const NuRaftStateMachine & getStateMachine() const
+    KeeperMemoryInfo getKeeperMemoryInfo() const;
+
+    /// Whether a client may create a new session, they are rejected under memory pressure
+    bool admitNewSession()
     {
-        return *server->getKeeperStateMachine();
+        if (likely(!memory_pressure.load(std::memory_order_relaxed)))
+            return true;
+        rejected_sessions.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
 
-    const SettingsPtr & getKeeperConfigurationAndSettings() const
+    const NuRaftStateMachine & getStateMachine() const
     {
-        return configuration_and_settings;
+        return *server->getKeeperStateMachine();
     }
 
-    void incrementPacketsSent()
+    /// For exports, which read the store directly, see exportSubtree
+    KeeperStore & getStore() { return server->getKeeperStateMachine()->getStore(); }
+
+    /// Files of the last snapshot, served to servers joining the cluster
+    std::vector<String> getLastSnapshotFiles() const { return server->getKeeperStateMachine()->getLastSnapshotFiles(); }
+
+    /// Committed log and session requests of downstreams, see RelayReplicator
+    RelayLogPack readRelayLog(int32_t downstream_id, UInt64 from, UInt64 wait_ms)
     {
-        std::lock_guard lock(keeper_stats_mutex);
-        keeper_stats.incrementPacketsSent();
+        return server->readRelayLog(downstream_id, from, wait_ms);
     }
+    ptr<buffer> appendDownstreamEntry(const ptr<buffer> & entry) { return server->appendDownstreamEntry(entry); }
+    UInt64 getCommittedIndex() const { return server->getCommittedIndex(); }
+    std::vector<RelayDownstreams::Downstream> getRelayDownstreams() const { return server->getRelayDownstreams(); }
+    std::optional<RelayReplicator::Stats> getRelayStats() const { return server->getRelayStats(); }
 
-    void incrementPacketsReceived()
+    const SettingsPtr & getKeeperConfigurationAndSettings() const
     {
-        std::lock_guard lock(keeper_stats_mutex);
-        keeper_stats.incrementPacketsReceived();
+        return configuration_and_settings;
     }
 
+    void incrementPacketsSent() { keeper_stats.incrementPacketsSent(); }
+
+    void incrementPacketsReceived() { keeper_stats.incrementPacketsReceived(); }
+
     void resetConnectionStats()
     {
-        std::lock_guard lock(keeper_stats_mutex);
         keeper_stats.reset();
+        request_latency_stats.reset();
+        request_tracer.reset();
+        LockProfiler::reset();
+        hot_key_stats.reset();
+        rejected_sessions.store(0, std::memory_order_relaxed);
     }
 
     uint64_t createSnapshot()
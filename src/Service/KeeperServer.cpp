@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <string>
 #include <IO/ReadHelpers.h>
@@ -7,11 +8,17 @@
 #include <Service/NuRaftStateMachine.h>
 #include <Service/NuRaftStateManager.h>
 #include <Service/ReadBufferFromNuraftBuffer.h>
+#include <Service/RelayReplicator.h>
+#include <Service/SnapshotBootstrap.h>
 #include <Service/WriteBufferFromNuraftBuffer.h>
+#include <Service/formatHex.h>
 #include <boost/algorithm/string.hpp>
 #include <libnuraft/async.hxx>
+#include <Poco/File.h>
 #include <Poco/NumberFormatter.h>
+#include <Common/Stopwatch.h>
 #include <Common/ZooKeeper/ZooKeeperIO.h>
+#include <ext/scope_guard.h>
 
 namespace RK
 {
@@ -19,6 +26,7 @@ namespace ErrorCodes
 {
     extern const int RAFT_ERROR;
     extern const int INVALID_CONFIG_PARAMETER;
+    extern const int BAD_ARGUMENTS;
 }
 
 using Poco::NumberFormatter;
@@ -51,7 +59,47 @@ KeeperServer::KeeperServer(
     , responses_queue(responses_queue_)
     , log(&(Poco::Logger::get("KeeperServer")))
 {
-    state_manager = cs_new<NuRaftStateManager>(server_id, config, settings_);
+    /// A replicated server copies the snapshot of its upstream, see RelayReplicator
+    const String upstream = NuRaftStateManager::parseUpstream(config_, "keeper.cluster", server_id);
+    const std::vector<String> bootstrap_peers = upstream.empty() ? settings->snapshot_bootstrap_peers : std::vector<String>{upstream};
+
+    /// The log segments are indexed by another thread while the state machine loads the snapshot, unless the log store
+    /// tells whether to fetch the snapshot from the bootstrap peers first. See RaftSettings::parallel_startup.
+    const bool parallel_startup = settings->raft_settings->parallel_startup && bootstrap_peers.empty();
+    state_manager = cs_new<NuRaftStateManager>(server_id, config, settings_, !parallel_startup);
+
+    std::promise<ptr<log_store>> log_store_promise;
+    std::shared_future<ptr<log_store>> log_store_future = log_store_promise.get_future().share();
+    ThreadFromGlobalPool log_store_thread;
+    SCOPE_EXIT({
+        if (log_store_thread.joinable())
+            log_store_thread.join();
+    });
+
+    if (parallel_startup)
+    {
+        log_store_thread = ThreadFromGlobalPool(
+            [&]
+            {
+                try
+                {
+                    Stopwatch watch;
+                    state_manager->initLogStore();
+                    LOG_INFO(log, "Log store initialized in {} ms", watch.elapsedMilliseconds());
+                    log_store_promise.set_value(state_manager->load_log_store());
+                }
+                catch (...)
+                {
+                    log_store_promise.set_exception(std::current_exception());
+                }
+            });
+    }
+    else
+    {
+        if (!bootstrap_peers.empty() && state_manager->load_log_store()->next_slot() <= 1 && !hasSnapshotFiles())
+            fetchSnapshotFromPeers(settings->snapshot_dir, bootstrap_peers, log);
+        log_store_promise.set_value(state_manager->load_log_store());
+    }
 
     state_machine = nuraft::cs_new<NuRaftStateMachine>(
         responses_queue_,
@@ -63,10 +111,46 @@ KeeperServer::KeeperServer(
         settings->raft_settings->max_stored_snapshots,
         new_session_id_callback_mutex,
         new_session_id_callback,
-        state_manager->load_log_store(),
+        log_store_future,
         checkAndGetSuperdigest(settings->super_digest),
         KeeperSnapshotStore::MAX_OBJECT_NODE_SIZE,
-        request_processor_);
+        request_processor_,
+        state_manager->isWitness());
+    /// The state machine of a witness does not wait for the log store
+    log_store_future.get();
+
+    if (settings->raft_settings->snapshot_stagger)
+        state_machine->setSnapshotDelay([this] { return getSnapshotDelay(); });
+}
+
+bool KeeperServer::hasSnapshotFiles() const
+{
+    Poco::File snapshot_dir(settings->snapshot_dir);
+    if (!snapshot_dir.exists())
+        return false;
+    std::vector<String> files;
+    snapshot_dir.list(files);
+    return std::any_of(files.begin(), files.end(), [](const String & file) { return file.starts_with("snapshot_"); });
+}
+
+UInt64 KeeperServer::getSnapshotDelay() const
+{
+    UInt64 distance = settings->raft_settings->snapshot_distance;
+    int32 leader = raft_instance ? raft_instance->get_leader() : -1;
+    if (leader == server_id)
+        return distance;
+
+    /// Followers and learners in the order of their ids, the same on every member as the cluster config is
+    std::vector<int32> members;
+    for (const auto & server : state_manager->get_cluster_config()->get_servers())
+        if (server->get_id() != leader)
+            members.push_back(server->get_id());
+    std::sort(members.begin(), members.end());
+
+    auto it = std::find(members.begin(), members.end(), server_id);
+    if (it == members.end())
+        return 0;
+    return static_cast<UInt64>(it - members.begin()) * distance / members.size();
 }
 
 
@@ -80,9 +164,12 @@ void KeeperServer::startup()
     params.reserved_log_items_ = raft_settings->reserved_log_items;
     params.snapshot_distance_ = raft_settings->snapshot_distance;
     params.client_req_timeout_ = raft_settings->operation_timeout_ms;
-    params.return_method_ = nuraft::raft_params::blocking;
+    params.return_method_ = raft_settings->async_append_entries ? nuraft::raft_params::async_handler : nuraft::raft_params::blocking;
     params.parallel_log_appending_ = raft_settings->log_fsync_mode == FsyncMode::FSYNC_PARALLEL;
     params.auto_forwarding_ = true;
+    /// Leader lease of linearizable reads, the leader steps down before followers can elect a new one
+    if (raft_settings->linearizable_reads || raft_settings->lightweight_sync)
+        params.leadership_expiry_ = static_cast<int32>(raft_settings->election_timeout_lower_bound_ms * 3 / 4);
     // TODO set max_batch_size to NuRaft
 
     nuraft::asio_service::options asio_opts{};
@@ -93,37 +180,135 @@ void KeeperServer::startup()
 
     UInt16 port = config.getInt("keeper.internal_port", 8103);
 
+    if (raft_settings->raft_control_port_offset && port + raft_settings->raft_control_port_offset > 65535)
+        throw Exception(ErrorCodes::INVALID_CONFIG_PARAMETER, "Control port of internal port {} is out of range", port);
+
     raft_instance = launcher.init(
         state_machine,
         state_manager,
         nuraft::cs_new<LoggerWrapper>("NuRaft", raft_settings->raft_logs_level),
         port,
         asio_opts,
+        static_cast<UInt16>(raft_settings->raft_control_port_offset),
+        static_cast<UInt32>(std::max<UInt64>(raft_settings->raft_control_thread_size, 1)),
         params,
         init_options);
 
     if (!raft_instance)
         throw Exception(ErrorCodes::RAFT_ERROR, "Cannot allocate RAFT instance");
 
+    auto & file_log_store = dynamic_cast<NuRaftFileLogStore &>(*state_manager->load_log_store());
     /// used raft_instance notify_log_append_completion
     if (raft_settings->log_fsync_mode == FsyncMode::FSYNC_PARALLEL)
-        dynamic_cast<NuRaftFileLogStore &>(*state_manager->load_log_store()).setRaftServer(raft_instance);
+        file_log_store.setRaftServer(raft_instance);
+    file_log_store.setRetentionFloor([this] { return relay_downstreams.retentionFloor(settings->raft_settings->relay_log_retention_ms); });
+
+    if (!state_manager->getUpstream().empty())
+    {
+        relay_replicator = std::make_unique<RelayReplicator>(
+            state_manager->getUpstream(), server_id, state_machine, state_manager, settings->raft_settings);
+        relay_replicator->start();
+    }
 }
 
 ptr<ForwardingConnection> KeeperServer::getLeaderClient(RunnerId runner_id)
 {
-    return state_manager->getClient(raft_instance->get_leader(), runner_id);
+    return state_manager->getClient(getLeader(), runner_id);
+}
+
+std::vector<ptr<ForwardingConnection>> KeeperServer::getLeaderClients()
+{
+    return state_manager->getClients(getLeader());
+}
+
+std::vector<ptr<ForwardingConnection>> KeeperServer::getPeerClients()
+{
+    return state_manager->getAllClients();
 }
 
 
 int32 KeeperServer::getLeader()
 {
+    if (relay_replicator)
+        return relay_replicator->getLeader();
     return raft_instance->get_leader();
 }
 
+ptr<nuraft::cmd_result<ptr<buffer>>> KeeperServer::appendEntry(const ptr<buffer> & entry)
+{
+    if (relay_replicator)
+        return relay_replicator->appendEntry(entry);
+    return raft_instance->append_entries({entry});
+}
+
+ptr<buffer> KeeperServer::appendDownstreamEntry(const ptr<buffer> & entry)
+{
+    /// Session requests only, see NuRaftStateMachine::commit, writes are forwarded to the leader
+    size_t size = entry->size();
+    if (size != sizeof(int64_t) && size != sizeof(int32_t) + sizeof(int64_t) && size != 2 * sizeof(int64_t))
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "Entry of {} bytes is not a session request", size);
+
+    auto result = appendEntry(entry);
+    if (!result->has_result())
+        result->get();
+    if (!result->get_accepted() || result->get_result_code() != nuraft::cmd_result_code::OK)
+        throw Exception(ErrorCodes::RAFT_ERROR, "Session request of downstream failed, reason {}", result->get_result_str());
+    return result->get();
+}
+
+RelayLogPack KeeperServer::readRelayLog(int32_t downstream_id, UInt64 from, UInt64 wait_ms)
+{
+    if (from == 0)
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "Log index starts from 1");
+    relay_downstreams.fetched(downstream_id, from - 1);
+
+    /// Polled, commits do not notify downstreams
+    Stopwatch watch;
+    while (getCommittedIndex() < from && watch.elapsedMilliseconds() < wait_ms)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    RelayLogPack result;
+    result.commit_index = getCommittedIndex();
+    result.source_commit_index
+        = relay_replicator ? relay_replicator->getSourceCommitIndex() : raft_instance->get_leader_committed_log_idx();
+    result.leader = getLeader();
+
+    auto log_store = state_manager->load_log_store();
+    if (from < log_store->start_index())
+    {
+        result.compacted = true;
+        return result;
+    }
+    if (from <= result.commit_index)
+    {
+        UInt64 count = std::min(result.commit_index - from + 1, RelayReplicator::MAX_PACK_ENTRIES);
+        result.pack = log_store->pack(from, static_cast<int32>(count));
+        result.entries = count;
+    }
+    return result;
+}
+
+UInt64 KeeperServer::getCommittedIndex() const
+{
+    if (relay_replicator)
+        return relay_replicator->getAppliedIndex();
+    return raft_instance->get_committed_log_idx();
+}
+
+std::optional<RelayReplicator::Stats> KeeperServer::getRelayStats() const
+{
+    if (!relay_replicator)
+        return {};
+    return relay_replicator->getStats();
+}
+
 void KeeperServer::shutdown()
 {
     LOG_INFO(log, "Shutting down keeper server.");
+    if (relay_replicator)
+        relay_replicator->shutdown();
+    if (settings->raft_settings->shutdown_snapshot_timeout_ms)
+        createShutdownSnapshot();
     state_machine->shutdown();
     if (state_manager->load_log_store() && !state_manager->load_log_store()->flush())
         LOG_WARNING(log, "Log store flush error while server shutdown.");
@@ -138,19 +323,30 @@ void KeeperServer::shutdown()
 
 namespace
 {
-    nuraft::ptr<nuraft::buffer> getZooKeeperLogEntry(int64_t session_id, int64_t time, const Coordination::ZooKeeperRequestPtr & request)
+    nuraft::ptr<nuraft::buffer> getZooKeeperLogEntry(const KeeperStore::RequestForSession & request_for_session)
     {
-        RK::WriteBufferFromNuraftBuffer buf;
-        RK::writeIntBinary(session_id, buf);
-        request->write(buf);
-        Coordination::write(time, buf);
+        /// Received right into the log entry, no need to serialize the request again
+        if (request_for_session.log_entry)
+        {
+            NuRaftStateMachine::finishLogEntry(
+                *request_for_session.log_entry, request_for_session.session_id, request_for_session.create_time);
+            return request_for_session.log_entry;
+        }
+
+        /// Written right into an entry of the exact size
+        RK::WriteBufferFromNuraftBuffer buf(
+            sizeof(request_for_session.session_id) + request_for_session.request->bytesSize() + sizeof(request_for_session.create_time));
+        RK::writeIntBinary(request_for_session.session_id, buf);
+        request_for_session.request->write(buf);
+        Coordination::write(request_for_session.create_time, buf);
         return buf.getBuffer();
     }
 }
 
 void KeeperServer::putRequest(const KeeperStore::RequestForSession & request_for_session)
 {
-    auto [session_id, request, time, server, client] = request_for_session;
+    const auto & session_id = request_for_session.session_id;
+    const auto & request = request_for_session.request;
     if (isLeaderAlive() && request->isReadRequest())
     {
         LOG_TRACE(
@@ -160,7 +356,8 @@ void KeeperServer::putRequest(const KeeperStore::RequestForSession & request_for
     else
     {
         std::vector<ptr<buffer>> entries;
-        entries.push_back(getZooKeeperLogEntry(session_id, time, request));
+        entries.push_back(getZooKeeperLogEntry(request_for_session));
+        state_machine->registerAppendedRequest(request_for_session);
 
         LOG_TRACE(
             log,
@@ -176,35 +373,64 @@ void KeeperServer::putRequest(const KeeperStore::RequestForSession & request_for
             result = raft_instance->append_entries(entries);
         }
 
-        if (!result->has_result())
-            result->get();
-
-        if (result->get_accepted() && result->get_result_code() == nuraft::cmd_result_code::OK)
+        if (settings->raft_settings->async_append_entries)
         {
-            /// response pushed into queue by state machine
+            /// The handler is owned by result, so result is not captured
+            auto * raw_result = result.get();
+            result->when_ready([this, request_for_session, raw_result](ptr<buffer> &, ptr<std::exception> &)
+            {
+                try
+                {
+                    handleWriteResult(request_for_session, *raw_result);
+                }
+                catch (...)
+                {
+                    tryLogCurrentException(log);
+                }
+            });
             return;
         }
 
-        auto response = request->makeResponse();
+        if (!result->has_result())
+            result->get();
 
-        response->xid = request->xid;
-        response->zxid = 0;
+        handleWriteResult(request_for_session, *result);
+    }
+}
 
-        response->error = result->get_result_code() == nuraft::cmd_result_code::TIMEOUT ? Coordination::Error::ZOPERATIONTIMEOUT
-                                                                                        : Coordination::Error::ZCONNECTIONLOSS;
+void KeeperServer::handleWriteResult(
+    const KeeperStore::RequestForSession & request_for_session, nuraft::cmd_result<ptr<buffer>> & result)
+{
+    const auto & session_id = request_for_session.session_id;
+    const auto & request = request_for_session.request;
 
-        responses_queue.push(RK::KeeperStore::ResponseForSession{session_id, response});
-        if (!result->get_accepted())
-            throw Exception(ErrorCodes::RAFT_ERROR, "Request session {} xid {} error, result is not accepted.", session_id, request->xid);
-        else
-            throw Exception(
-                ErrorCodes::RAFT_ERROR,
-                "Request session {} xid {} error, nuraft code {} and message: '{}'",
-                session_id,
-                request->xid,
-                result->get_result_code(),
-                result->get_result_str());
+    if (result.get_accepted() && result.get_result_code() == nuraft::cmd_result_code::OK)
+    {
+        /// response pushed into queue by state machine
+        return;
     }
+
+    state_machine->forgetAppendedRequest(request_for_session);
+
+    auto response = request->makeResponse();
+
+    response->xid = request->xid;
+    response->zxid = 0;
+
+    response->error = result.get_result_code() == nuraft::cmd_result_code::TIMEOUT ? Coordination::Error::ZOPERATIONTIMEOUT
+                                                                                   : Coordination::Error::ZCONNECTIONLOSS;
+
+    responses_queue.push(RK::KeeperStore::ResponseForSession{session_id, response});
+    if (!result.get_accepted())
+        throw Exception(ErrorCodes::RAFT_ERROR, "Request session {} xid {} error, result is not accepted.", session_id, request->xid);
+    else
+        throw Exception(
+            ErrorCodes::RAFT_ERROR,
+            "Request session {} xid {} error, nuraft code {} and message: '{}'",
+            session_id,
+            request->xid,
+            result.get_result_code(),
+            result.get_result_str());
 }
 
 ptr<nuraft::cmd_result<ptr<buffer>>> KeeperServer::putRequestBatch(const std::vector<KeeperStore::RequestForSession> & request_batch)
@@ -219,42 +445,107 @@ ptr<nuraft::cmd_result<ptr<buffer>>> KeeperServer::putRequestBatch(const std::ve
             request_session.session_id,
             request_session.request->xid,
             request_session.request->getOpNum());
-        entries.push_back(getZooKeeperLogEntry(request_session.session_id, request_session.create_time, request_session.request));
+        entries.push_back(getZooKeeperLogEntry(request_session));
+        state_machine->registerAppendedRequest(request_session);
+    }
+    /// One entry for the batch, the result is for the last entry appended either way
+    if (settings->raft_settings->batch_requests_in_entry && entries.size() > 1)
+    {
+        entries = {NuRaftStateMachine::serializeBatch(entries)};
+        size_t raw_bytes = entries[0]->size();
+        /// Shipped to followers and kept in the log compressed
+        UInt64 min_bytes = settings->raft_settings->compress_batch_entries_min_bytes;
+        if (min_bytes && raw_bytes >= min_bytes)
+        {
+            if (auto compressed = NuRaftStateMachine::compressBatch(*entries[0]))
+                entries[0] = compressed;
+        }
+        batch_entry_raw_bytes.fetch_add(raw_bytes, std::memory_order_relaxed);
+        batch_entry_bytes.fetch_add(entries[0]->size(), std::memory_order_relaxed);
     }
+
     /// append_entries write request
     ptr<nuraft::cmd_result<ptr<buffer>>> result = raft_instance->append_entries(entries);
     return result;
 }
 
 int64_t KeeperServer::getSessionID(int64_t session_timeout_ms)
+{
+    int64_t block_size = settings->raft_settings->session_id_block_size;
+    if (block_size <= 0)
+        return createSession(session_timeout_ms);
+
+    std::lock_guard lock(session_id_block_mutex);
+    if (next_session_id == session_id_block_end)
+    {
+        next_session_id = reserveSessionIDs(block_size);
+        session_id_block_end = next_session_id + block_size;
+        LOG_INFO(log, "Reserved session ids [{}, {})", toHexString(next_session_id), toHexString(session_id_block_end));
+    }
+    return next_session_id++;
+}
+
+int64_t KeeperServer::reserveSessionIDs(int64_t count)
+{
+    auto entry = buffer::alloc(sizeof(int32_t) + sizeof(int64_t));
+    nuraft::buffer_serializer bs(entry);
+    bs.put_i32(server_id);
+    bs.put_i64(count);
+
+    std::lock_guard lock(append_entries_mutex);
+
+    auto result = appendEntry(entry);
+
+    if (!result->has_result())
+        result->get();
+
+    if (!result->get_accepted())
+        throw Exception(ErrorCodes::RAFT_ERROR, "Cannot send reserve session ids request to RAFT, reason {}", result->get_result_str());
+
+    if (result->get_result_code() != nuraft::cmd_result_code::OK)
+        throw Exception(ErrorCodes::RAFT_ERROR, "Reserve session ids request failed to RAFT");
+
+    auto resp = result->get();
+    if (resp == nullptr)
+        throw Exception(ErrorCodes::RAFT_ERROR, "Received nullptr as first reserved session id");
+
+    nuraft::buffer_serializer bs_resp(resp);
+    return bs_resp.get_i64();
+}
+
+int64_t KeeperServer::createSession(int64_t session_timeout_ms)
+{
+    return waitCreateSession(appendCreateSession(session_timeout_ms), session_timeout_ms);
+}
+
+ptr<nuraft::cmd_result<ptr<buffer>>> KeeperServer::appendCreateSession(int64_t session_timeout_ms)
 {
     auto entry = buffer::alloc(sizeof(int64_t));
     /// Just special session request
     nuraft::buffer_serializer bs(entry);
     bs.put_i64(session_timeout_ms);
 
-    int64_t sid;
-    {
-        std::lock_guard lock(append_entries_mutex);
-
-        auto result = raft_instance->append_entries({entry});
+    std::lock_guard lock(append_entries_mutex);
+    return appendEntry(entry);
+}
 
-        if (!result->has_result())
-            result->get();
+int64_t KeeperServer::waitCreateSession(ptr<nuraft::cmd_result<ptr<buffer>>> result, int64_t session_timeout_ms)
+{
+    if (!result->has_result())
+        result->get();
 
-        if (!result->get_accepted())
-            throw Exception(ErrorCodes::RAFT_ERROR, "Cannot send session_id request to RAFT, reason {}", result->get_result_str());
+    if (!result->get_accepted())
+        throw Exception(ErrorCodes::RAFT_ERROR, "Cannot send session_id request to RAFT, reason {}", result->get_result_str());
 
-        if (result->get_result_code() != nuraft::cmd_result_code::OK)
-            throw Exception(ErrorCodes::RAFT_ERROR, "session_id request failed to RAFT");
+    if (result->get_result_code() != nuraft::cmd_result_code::OK)
+        throw Exception(ErrorCodes::RAFT_ERROR, "session_id request failed to RAFT");
 
-        auto resp = result->get();
-        if (resp == nullptr)
-            throw Exception(ErrorCodes::RAFT_ERROR, "Received nullptr as session_id");
+    auto resp = result->get();
+    if (resp == nullptr)
+        throw Exception(ErrorCodes::RAFT_ERROR, "Received nullptr as session_id");
 
-        nuraft::buffer_serializer bs_resp(resp);
-        sid = bs_resp.get_i64();
-    }
+    nuraft::buffer_serializer bs_resp(resp);
+    int64_t sid = bs_resp.get_i64();
 
     {
         std::unique_lock session_id_lock(new_session_id_callback_mutex);
@@ -279,6 +570,11 @@ int64_t KeeperServer::getSessionID(int64_t session_timeout_ms)
 }
 
 bool KeeperServer::updateSessionTimeout(int64_t session_id, int64_t session_timeout_ms)
+{
+    return waitSessionTimeoutUpdate(appendSessionTimeoutUpdate(session_id, session_timeout_ms), session_id, session_timeout_ms);
+}
+
+ptr<nuraft::cmd_result<ptr<buffer>>> KeeperServer::appendSessionTimeoutUpdate(int64_t session_id, int64_t session_timeout_ms)
 {
     LOG_DEBUG(log, "Updating session timeout for {}", NumberFormatter::formatHex(session_id, true));
 
@@ -288,8 +584,11 @@ bool KeeperServer::updateSessionTimeout(int64_t session_id, int64_t session_time
     bs.put_i64(session_id);
     bs.put_i64(session_timeout_ms);
 
-    auto result = raft_instance->append_entries({entry});
+    return appendEntry(entry);
+}
 
+bool KeeperServer::waitSessionTimeoutUpdate(ptr<nuraft::cmd_result<ptr<buffer>>> result, int64_t session_id, int64_t session_timeout_ms)
+{
     if (!result->has_result())
         result->get();
 
@@ -338,12 +637,17 @@ void KeeperServer::handleRemoteSession(int64_t session_id, int64_t expiration_ti
     state_machine->getStore().handleRemoteSession(session_id, expiration_time);
 }
 
+void KeeperServer::handleRemoteSessions(const std::vector<std::pair<int64_t, int64_t>> & session_to_expiration_time)
+{
+    state_machine->getStore().handleRemoteSessions(session_to_expiration_time);
+}
+
 int64_t KeeperServer::getSessionTimeout(int64_t session_id)
 {
     LOG_DEBUG(log, "get session timeout for {}", session_id);
-    if (state_machine->getStore().session_and_timeout.contains(session_id))
+    if (auto timeout = state_machine->getStore().session_table.getTimeout(session_id))
     {
-        return state_machine->getStore().session_and_timeout.find(session_id)->second;
+        return *timeout;
     }
     else
     {
@@ -358,6 +662,23 @@ bool KeeperServer::isLeader() const
 }
 
 
+std::optional<UInt64> KeeperServer::getReadIndex() const
+{
+    if (!isLeader())
+        return {};
+
+    /// A new leader does not know the latest commit index until it has committed an entry of its term
+    UInt64 commit_index = raft_instance->get_committed_log_idx();
+    if (state_manager->load_log_store()->term_at(commit_index) != raft_instance->get_term())
+        return {};
+    return commit_index;
+}
+
+bool KeeperServer::isWitness() const
+{
+    return state_manager->isWitness();
+}
+
 bool KeeperServer::isObserver() const
 {
     auto cluster_config = state_manager->get_cluster_config();
@@ -371,6 +692,8 @@ bool KeeperServer::isFollower() const
 
 bool KeeperServer::isLeaderAlive() const
 {
+    if (relay_replicator)
+        return relay_replicator->isUpstreamAlive() && relay_replicator->getLeader() != -1;
     /// nuraft leader_ and role_ not sync
     return raft_instance->is_leader_alive() && raft_instance->get_leader() != -1;
 }
@@ -404,6 +727,12 @@ nuraft::cb_func::ReturnCode KeeperServer::callbackFunc(nuraft::cb_func::Type typ
         initialized_flag = true;
         initialized_cv.notify_all();
     }
+    /// Entries appended as leader and not committed yet may be overwritten by the new leader
+    if (type == nuraft::cb_func::Type::BecomeFollower || type == nuraft::cb_func::Type::BecomeLeader)
+        state_machine->clearAppendedRequests();
+    /// Sessions are not expired before their servers had the chance to sync them to us
+    if (type == nuraft::cb_func::Type::BecomeLeader)
+        state_machine->getStore().touchAllSessions();
     return nuraft::cb_func::ReturnCode::Ok;
 }
 
@@ -420,6 +749,11 @@ std::vector<int64_t> KeeperServer::getDeadSessions()
     return state_machine->getDeadSessions();
 }
 
+std::vector<String> KeeperServer::getExpiredNodes(size_t max_count)
+{
+    return state_machine->getExpiredNodes(max_count);
+}
+
 ConfigUpdateActions KeeperServer::getConfigurationDiff(const Poco::Util::AbstractConfiguration & config_)
 {
     return state_manager->getConfigurationDiff(config_);
@@ -580,9 +914,42 @@ bool KeeperServer::waitConfigurationUpdate(const ConfigUpdateAction & task)
     return true;
 }
 
+void KeeperServer::createShutdownSnapshot()
+{
+    /// The snapshots of a replicated server are created by its replicator, which is stopped already
+    if (!raft_instance || isWitness() || relay_replicator)
+        return;
+
+    try
+    {
+        UInt64 last_snapshot_idx = raft_instance->get_last_snapshot_idx();
+        if (raft_instance->get_committed_log_idx() <= last_snapshot_idx)
+            return;
+
+        Stopwatch watch;
+        UInt64 log_idx = createSnapshot();
+        if (!log_idx)
+            return;
+
+        /// The snapshot task runs on the snapshot thread, nothing else is committed meanwhile as clients are gone
+        UInt64 timeout_ms = settings->raft_settings->shutdown_snapshot_timeout_ms;
+        while (raft_instance->get_last_snapshot_idx() < log_idx && watch.elapsedMilliseconds() < timeout_ms)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        if (raft_instance->get_last_snapshot_idx() >= log_idx)
+            LOG_INFO(log, "Created shutdown snapshot at log index {} in {}ms", log_idx, watch.elapsedMilliseconds());
+        else
+            LOG_WARNING(log, "Shutdown snapshot at log index {} not done in {}ms, shutting down anyway", log_idx, timeout_ms);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to create shutdown snapshot");
+    }
+}
+
 uint64_t KeeperServer::createSnapshot()
 {
-    uint64_t log_idx = raft_instance->create_snapshot();
+    uint64_t log_idx = relay_replicator ? relay_replicator->requestSnapshot() : raft_instance->create_snapshot();
     if (log_idx != 0)
         LOG_INFO(log, "Snapshot creation scheduled with last committed log index {}.", log_idx);
     else
@@ -598,6 +965,8 @@ KeeperLogInfo KeeperServer::getKeeperLogInfo()
     {
         log_info.first_log_idx = log_store->start_index();
         log_info.first_log_term = log_store->term_at(log_info.first_log_idx);
+        if (const auto * file_log_store = dynamic_cast<const NuRaftFileLogStore *>(log_store.get()))
+            log_info.fsync_stats = file_log_store->getFsyncStats();
     }
 
     if (raft_instance)
@@ -609,13 +978,67 @@ KeeperLogInfo KeeperServer::getKeeperLogInfo()
         log_info.target_committed_log_idx = raft_instance->get_target_committed_log_idx();
         log_info.last_snapshot_idx = raft_instance->get_last_snapshot_idx();
     }
+    if (relay_replicator)
+    {
+        log_info.last_committed_log_idx = relay_replicator->getAppliedIndex();
+        log_info.leader_committed_log_idx = relay_replicator->getSourceCommitIndex();
+        log_info.target_committed_log_idx = log_info.leader_committed_log_idx;
+    }
 
     return log_info;
 }
 
+LogCacheStats KeeperServer::getLogCacheStats()
+{
+    auto log_store = state_manager->load_log_store();
+    if (const auto * file_log_store = dynamic_cast<const NuRaftFileLogStore *>(log_store.get()))
+        return file_log_store->getCacheStats();
+    return {};
+}
+
+void KeeperServer::setLogCacheMaxBytes(UInt64 max_bytes)
+{
+    auto log_store = state_manager->load_log_store();
+    if (auto * file_log_store = dynamic_cast<NuRaftFileLogStore *>(log_store.get()))
+        file_log_store->setCacheMaxBytes(max_bytes);
+}
+
 bool KeeperServer::requestLeader()
 {
     return isLeader() || raft_instance->request_leadership();
 }
 
+std::optional<int32_t> KeeperServer::getLeadershipSuccessor() const
+{
+    if (!isLeader())
+        return {};
+
+    const auto params = raft_instance->get_current_params();
+    const uint64_t last_log_idx = raft_instance->get_last_log_idx();
+    /// Followers which did not respond for a few heartbeats may be down
+    const uint64_t max_silence_us = static_cast<uint64_t>(params.heart_beat_interval_) * 3 * 1000;
+
+    std::optional<int32_t> successor;
+    uint64_t successor_log_idx = 0;
+    for (const auto & peer : raft_instance->get_peer_info_all())
+    {
+        auto srv_config = raft_instance->get_srv_config(peer.id_);
+        if (!srv_config || srv_config->is_learner() || srv_config->get_priority() == 0)
+            continue;
+        if (peer.last_succ_resp_us_ > max_silence_us || last_log_idx > peer.last_log_idx_ + params.stale_log_gap_)
+            continue;
+        if (!successor || peer.last_log_idx_ > successor_log_idx)
+        {
+            successor = peer.id_;
+            successor_log_idx = peer.last_log_idx_;
+        }
+    }
+    return successor;
+}
+
+void KeeperServer::transferLeadership(int32_t successor)
+{
+    raft_instance->yield_leadership(false, successor);
+}
+
 }
@@ -4,8 +4,10 @@
 #include <Service/Keeper4LWInfo.h>
 #include <Service/KeeperStore.h>
 #include <Service/NuRaftFileLogStore.h>
+#include <Service/NuRaftLauncher.h>
 #include <Service/NuRaftStateMachine.h>
 #include <Service/NuRaftStateManager.h>
+#include <Service/RelayReplicator.h>
 #include <Service/Settings.h>
 #include <Service/Types.h>
 #include <libnuraft/nuraft.hxx>
@@ -19,6 +21,20 @@ struct ServerInfo
     bool is_leader;
 };
 
+/// Committed log served to a downstream at GET /log, see RelayReplicator
+struct RelayLogPack
+{
+    /// The log before the index fetched from is compacted
+    bool compacted = false;
+    /// nullptr if no entry was committed from the index within the wait
+    ptr<buffer> pack;
+    UInt64 entries = 0;
+    UInt64 commit_index = 0;
+    /// Commit index of the leader
+    UInt64 source_commit_index = 0;
+    int32 leader = -1;
+};
+
 class KeeperServer
 {
 private:
@@ -30,7 +46,7 @@ private:
 
     nuraft::ptr<NuRaftStateManager> state_manager;
 
-    nuraft::raft_launcher launcher;
+    NuRaftLauncher launcher;
 
     nuraft::ptr<nuraft::raft_server> raft_instance;
 
@@ -49,8 +65,36 @@ private:
     std::mutex new_session_id_callback_mutex;
     std::unordered_map<int64_t, ptr<std::condition_variable>> new_session_id_callback;
 
+    /// Block of session ids reserved for this server, [next_session_id, session_id_block_end) are not granted yet.
+    std::mutex session_id_block_mutex;
+    int64_t next_session_id{0};
+    int64_t session_id_block_end{0};
+
+    /// Servers replicating from this one, and the replicator of this one if it has an upstream, see RelayReplicator
+    RelayDownstreams relay_downstreams;
+    std::unique_ptr<RelayReplicator> relay_replicator;
+
+    /// Bytes of batch log entries appended by this server before and after compression
+    std::atomic<UInt64> batch_entry_raw_bytes{0};
+    std::atomic<UInt64> batch_entry_bytes{0};
+
+    /// Snapshot directory has snapshot files, whether loaded or not
+    bool hasSnapshotFiles() const;
+
+    /// Delay of the snapshots of this server, see RaftSettings::snapshot_stagger
+    UInt64 getSnapshotDelay() const;
+
+    /// Reserve count session ids through Raft, return the first one.
+    int64_t reserveSessionIDs(int64_t count);
+
+    /// Create a session through Raft and wait until it is applied.
+    int64_t createSession(int64_t session_timeout_ms);
+
     nuraft::cb_func::ReturnCode callbackFunc(nuraft::cb_func::Type type, nuraft::cb_func::Param * param);
 
+    /// Reply an error to the session if the write request is not committed, throw RAFT_ERROR then.
+    void handleWriteResult(const KeeperStore::RequestForSession & request_for_session, nuraft::cmd_result<ptr<buffer>> & result);
+
 public:
     KeeperServer(
         const SettingsPtr & settings_,
@@ -61,21 +105,56 @@ public:
     void startup();
 
     ptr<ForwardingConnection> getLeaderClient(RunnerId runner_id);
+    /// Forwarding clients of all runners to the current leader
+    std::vector<ptr<ForwardingConnection>> getLeaderClients();
+    /// Forwarding clients of all the other servers
+    std::vector<ptr<ForwardingConnection>> getPeerClients();
 
     int32 getLeader();
 
+    /// Append an entry to Raft, by the upstream if this server is replicated from a relay
+    ptr<nuraft::cmd_result<ptr<buffer>>> appendEntry(const ptr<buffer> & entry);
+    /// Append a session request of a downstream and wait for its response, throw RAFT_ERROR if it fails
+    ptr<buffer> appendDownstreamEntry(const ptr<buffer> & entry);
+    /// Committed log from index from for downstream_id, waiting at most wait_ms for the first entry
+    RelayLogPack readRelayLog(int32_t downstream_id, UInt64 from, UInt64 wait_ms);
+    /// Last log index applied, the committed one of NuRaft or the one the replicator applied
+    UInt64 getCommittedIndex() const;
+    std::vector<RelayDownstreams::Downstream> getRelayDownstreams() const { return relay_downstreams.get(); }
+    /// nullopt unless this server is replicated from a relay
+    std::optional<RelayReplicator::Stats> getRelayStats() const;
+
     void putRequest(const KeeperStore::RequestForSession & request);
 
     ptr<nuraft::cmd_result<ptr<buffer>>> putRequestBatch(const std::vector<KeeperStore::RequestForSession> & request_batch);
 
+    /// Get id for a new session. If session_id_block_size is set, the id is granted from a local block
+    /// and the session must be registered by a RegisterSession request.
     int64_t getSessionID(int64_t session_timeout_ms);
     /// update session timeout
     /// @return whether success
     bool updateSessionTimeout(int64_t session_id, int64_t session_timeout_ms);
 
+    /** The two halves of createSession and updateSessionTimeout, so that the session requests of many
+     * handshakes are appended at once and waited for after. wait* throw RAFT_ERROR as the synchronous ones.
+     */
+    ptr<nuraft::cmd_result<ptr<buffer>>> appendCreateSession(int64_t session_timeout_ms);
+    int64_t waitCreateSession(ptr<nuraft::cmd_result<ptr<buffer>>> result, int64_t session_timeout_ms);
+    ptr<nuraft::cmd_result<ptr<buffer>>> appendSessionTimeoutUpdate(int64_t session_id, int64_t session_timeout_ms);
+    bool waitSessionTimeoutUpdate(ptr<nuraft::cmd_result<ptr<buffer>>> result, int64_t session_id, int64_t session_timeout_ms);
+
+    /// Whether new session ids are granted from a local block, see RaftSettings::session_id_block_size
+    bool grantsSessionIDsLocally() const { return settings->raft_settings->session_id_block_size > 0; }
+
     std::vector<int64_t> getDeadSessions();
 
+    /// TTL and container nodes which may be expired
+    std::vector<String> getExpiredNodes(size_t max_count);
+
     void handleRemoteSession(int64_t session_id, int64_t expiration_time);
+    void handleRemoteSessions(const std::vector<std::pair<int64_t, int64_t>> & session_to_expiration_time);
+
+    UInt64 getTerm() { return raft_instance->get_term(); }
 
     int64_t getSessionTimeout(int64_t session_id);
 
@@ -83,6 +162,9 @@ public:
 
     bool isLeaderAlive() const;
 
+    /// Commit index linearizable reads wait for, nullopt if not leader
+    std::optional<UInt64> getReadIndex() const;
+
     void waitInit();
 
     /// Return true if KeeperServer initialized
@@ -92,6 +174,8 @@ public:
     }
 
     void shutdown();
+    /// Snapshot the applied state at shutdown if it is ahead of the last snapshot, see RaftSettings::shutdown_snapshot_timeout_ms
+    void createShutdownSnapshot();
 
     nuraft::ptr<NuRaftStateMachine> getKeeperStateMachine() const
     {
@@ -101,6 +185,8 @@ public:
     bool isFollower() const;
 
     bool isObserver() const;
+    /// Keeps the log only, see NuRaftStateMachine::witness
+    bool isWitness() const;
 
     /// @return follower count if node is not leader return 0
     uint64_t getFollowerCount() const;
@@ -126,7 +212,18 @@ public:
     /// Raft log information
     KeeperLogInfo getKeeperLogInfo();
 
+    LogCacheStats getLogCacheStats();
+
+    UInt64 getBatchEntryRawBytes() const { return batch_entry_raw_bytes.load(std::memory_order_relaxed); }
+    UInt64 getBatchEntryBytes() const { return batch_entry_bytes.load(std::memory_order_relaxed); }
+    void setLogCacheMaxBytes(UInt64 max_bytes);
+
     bool requestLeader();
+
+    /// Voting follower which is the most up to date and responded lately, nullopt if there is none or not leader
+    std::optional<int32_t> getLeadershipSuccessor() const;
+    /// Yield leadership to successor, it is elected after it caught up the log
+    void transferLeadership(int32_t successor);
 };
 
 }
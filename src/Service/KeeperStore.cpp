@@ -1,9 +1,14 @@
-#include <functional>
-#include <iomanip>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <variant>
 #include <Service/KeeperStore.h>
+#include <Service/PathUtils.h>
 #include <boost/algorithm/string.hpp>
 #include <Poco/Base64Encoder.h>
 #include <Poco/SHA1Engine.h>
+#include <Common/HashTable/Hash.h>
+#include <Common/SipHash.h>
 #include <Common/StringUtils/StringUtils.h>
 #include <Common/ZooKeeper/IKeeper.h>
 
@@ -15,40 +20,60 @@ namespace ErrorCodes
     extern const int BAD_ARGUMENTS;
 }
 
-static inline void set_response(
-    ThreadSafeQueue<KeeperStore::ResponseForSession> & responses_queue,
-    const KeeperStore::ResponsesForSessions & responses,
-    bool ignore_response)
+static constexpr size_t NODE_MUTEX_STRIPES = 4096;
+
+NodeMutex & KeeperNode::getMutex() const
 {
-    if (!ignore_response)
+    static NodeMutex mutexes[NODE_MUTEX_STRIPES];
+    return mutexes[intHash64(reinterpret_cast<uintptr_t>(this)) % NODE_MUTEX_STRIPES];
+}
+
+Coordination::Stat KeeperNode::readStat() const
+{
+    static constexpr size_t OPTIMISTIC_READS = 4;
+
+    auto view = [](Coordination::Stat stat_view)
     {
-        for (const auto & response : responses)
-            responses_queue.push(response);
+        stat_view.cversion = stat_view.cversion * 2 - stat_view.numChildren;
+        return stat_view;
+    };
+
+    auto & mutex = getMutex();
+    for (size_t i = 0; i < OPTIMISTIC_READS; ++i)
+    {
+        UInt64 sequence = mutex.getSequence();
+        if (sequence & 1)
+            continue;
+        Coordination::Stat copy = stat;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (mutex.getSequence(std::memory_order_relaxed) == sequence)
+            return view(copy);
     }
+
+    std::shared_lock lock(mutex);
+    return view(stat);
 }
 
-static inline void set_response(
-    ThreadSafeQueue<KeeperStore::ResponseForSession> & responses_queue,
-    const KeeperStore::ResponseForSession & response,
-    bool ignore_response)
+uint64_t KeeperNode::sizeInBytes() const
 {
-    KeeperStore::ResponsesForSessions responses;
-    responses.push_back(response);
-    set_response(responses_queue, responses, ignore_response);
+    /// A large value is counted by every node sharing it
+    return sizeof(KeeperNode) + getStringHeapBytes(data.stored()) + (data.hasSharedBuffer() ? sizeof(String) : 0) + children.sizeInBytes();
 }
 
-static String parentPath(const String & path)
+template <typename Responses>
+static inline void set_response(KeeperStore::KeeperResponsesQueue & responses_queue, const Responses & responses, bool ignore_response)
 {
-    auto rslash_pos = path.rfind('/');
-    if (rslash_pos > 0)
-        return path.substr(0, rslash_pos);
-    return "/";
+    if (!ignore_response)
+        responses_queue.push(responses);
 }
 
-static std::string getBaseName(const String & path)
+static inline void set_response(
+    KeeperStore::KeeperResponsesQueue & responses_queue,
+    const KeeperStore::ResponseForSession & response,
+    bool ignore_response)
 {
-    size_t basename_start = path.rfind('/');
-    return std::string{&path[basename_start + 1], path.length() - basename_start - 1};
+    if (!ignore_response)
+        responses_queue.push(response);
 }
 
 static String base64Encode(const String & decoded)
@@ -98,31 +123,36 @@ static String toString(const Coordination::ACLs & acls)
     return ret.str();
 }
 
-static bool checkACL(int32_t permission, const Coordination::ACLs & node_acls, const std::vector<Coordination::AuthID> & session_auths)
+/// Permissions granted by node_acls to a session with session_auths, a permission is checked by any bit of it.
+static int32_t sessionPermissions(const Coordination::ACLs & node_acls, const std::vector<Coordination::AuthID> & session_auths)
 {
     if (node_acls.empty())
-        return true;
+        return Coordination::ACL::All;
 
     for (const auto & session_auth : session_auths)
         if (session_auth.scheme == "super")
-            return true;
+            return Coordination::ACL::All;
 
+    int32_t permissions = 0;
     for (const auto & node_acl : node_acls)
     {
-        if (node_acl.permissions & permission)
+        if (node_acl.scheme == "world" && node_acl.id == "anyone")
         {
-            if (node_acl.scheme == "world" && node_acl.id == "anyone")
-                return true;
+            permissions |= node_acl.permissions;
+            continue;
+        }
 
-            for (const auto & session_auth : session_auths)
+        for (const auto & session_auth : session_auths)
+        {
+            if (node_acl.scheme == session_auth.scheme && node_acl.id == session_auth.id)
             {
-                if (node_acl.scheme == session_auth.scheme && node_acl.id == session_auth.id)
-                    return true;
+                permissions |= node_acl.permissions;
+                break;
             }
         }
     }
 
-    return false;
+    return permissions;
 }
 
 static bool fixupACL(
@@ -171,259 +201,568 @@ static bool fixupACL(
     return valid_found;
 }
 
-static KeeperStore::ResponsesForSessions processWatchesImpl(
-    const String & path, KeeperStore::Watches & watches, KeeperStore::Watches & list_watches, Coordination::Event event_type)
+/// Responses of hot requests are allocated from SlabPool, freed by connection threads and reused by the next request.
+template <typename Response>
+static std::shared_ptr<Response> makePooledResponse()
+{
+    return std::allocate_shared<Response>(SlabAllocator<Response>());
+}
+
+/// Path of request with its hash, which is computed at the first call only, path must be the path of the request.
+static HashedPath requestPath(const Coordination::ZooKeeperRequest & zk_request, const String & path)
+{
+    if (!zk_request.path_hash)
+        zk_request.path_hash = HashedPath::hashOf(path);
+    return HashedPath(path, zk_request.path_hash);
+}
+
+/// Fire watches triggered by event on path, on_responses is called under the lock of every watched path.
+/// notify_parent false does not fire the child watches of the parent, e.g. if it is removed too.
+/// CHILD fires the list watches of path only.
+static void processWatchesImpl(
+    const HashedPath & path,
+    WatchManager & watch_manager,
+    Coordination::Event event_type,
+    const KeeperStore::WatchCallback & on_responses,
+    bool notify_parent = true)
 {
     static auto * log = &(Poco::Logger::get("KeeperStore"));
-    KeeperStore::ResponsesForSessions result;
-    auto it = watches.find(path);
-    if (it != watches.end())
+    RequestArenaScope arena_scope;
+
+    auto fire = [&](const HashedPath & watch_path, WatchManager::WatchType type, Coordination::Event event, bool include_persistent = true)
     {
-        std::shared_ptr<Coordination::ZooKeeperWatchResponse> watch_response = std::make_shared<Coordination::ZooKeeperWatchResponse>();
-        watch_response->path = path;
-        watch_response->xid = Coordination::WATCH_XID;
-        watch_response->zxid = -1;
-        watch_response->type = event_type;
-        watch_response->state = Coordination::State::CONNECTED;
-        for (auto watcher_session : it->second)
-        {
-            result.push_back(KeeperStore::ResponseForSession{watcher_session, watch_response});
-            LOG_TRACE(log, "Watch triggered path {}, watcher session {}", path, watcher_session);
-        }
-        watches.erase(it);
+        watch_manager.fireWatches(watch_path, type, [&](const WatchManager::SessionIDs & sessions)
+        {
+            auto watch_response = makePooledResponse<Coordination::ZooKeeperWatchResponse>();
+            watch_response->path = String(watch_path.path);
+            watch_response->xid = Coordination::WATCH_XID;
+            watch_response->zxid = -1;
+            watch_response->type = event;
+            watch_response->state = Coordination::State::CONNECTED;
+            /// Serialize once for all the watching sessions
+            watch_response->prepareFrame();
+
+            KeeperStore::WatchResponses result;
+            result.reserve(sessions.size());
+            for (auto watcher_session : sessions)
+            {
+                result.push_back(KeeperStore::ResponseForSession{watcher_session, watch_response});
+                LOG_TRACE(log, "Watch triggered path {}, watcher session {}", watch_path.path, watcher_session);
+            }
+            on_responses(result);
+        }, include_persistent);
+    };
+
+    /// Children of path changed, e.g. some of them are removed by RemoveRecursive
+    if (event_type == Coordination::Event::CHILD)
+    {
+        fire(path, WatchManager::LIST, Coordination::Event::CHILD);
+        return;
     }
 
-    auto parent_path = parentPath(path);
+    fire(path, WatchManager::DATA, event_type);
 
-    Strings paths_to_check_for_list_watches;
+    /// Hashed once for both of the events of parent
+    String parent = parentPath(path.path);
+    HashedPath parent_path(parent);
     if (event_type == Coordination::Event::CREATED)
     {
-        paths_to_check_for_list_watches.push_back(parent_path); /// Trigger list watches for parent
+        if (notify_parent)
+            fire(parent_path, WatchManager::LIST, Coordination::Event::CHILD); /// Trigger list watches for parent
     }
     else if (event_type == Coordination::Event::DELETED)
     {
-        paths_to_check_for_list_watches.push_back(path); /// Trigger both list watches for this path
-        paths_to_check_for_list_watches.push_back(parent_path); /// And for parent path
+        /// Persistent watches of path are already fired by the data event
+        fire(path, WatchManager::LIST, Coordination::Event::DELETED, false); /// Trigger both list watches for this path
+        if (notify_parent)
+            fire(parent_path, WatchManager::LIST, Coordination::Event::CHILD); /// And for parent path
     }
     /// CHANGED event never trigger list wathes
+}
 
-    for (const auto & path_to_check : paths_to_check_for_list_watches)
+namespace
+{
+    /// Type of the watch a read request registers
+    WatchManager::WatchType watchTypeOf(const Coordination::ZooKeeperRequest & zk_request)
     {
-        it = list_watches.find(path_to_check);
-        if (it != list_watches.end())
-        {
-            std::shared_ptr<Coordination::ZooKeeperWatchResponse> watch_list_response = std::make_shared<Coordination::ZooKeeperWatchResponse>();
-            watch_list_response->path = path_to_check;
-            watch_list_response->xid = Coordination::WATCH_XID;
-            watch_list_response->zxid = -1;
-            if (path_to_check == parent_path)
-                watch_list_response->type = Coordination::Event::CHILD;
-            else
-                watch_list_response->type = Coordination::Event::DELETED;
-
-            watch_list_response->state = Coordination::State::CONNECTED;
-            for (auto watcher_session : it->second)
-                result.push_back(KeeperStore::ResponseForSession{watcher_session, watch_list_response});
-
-            list_watches.erase(it);
-        }
+        auto op_num = zk_request.getOpNum();
+        return op_num == Coordination::OpNum::List || op_num == Coordination::OpNum::SimpleList ? WatchManager::LIST : WatchManager::DATA;
     }
-    return result;
 }
 
 /** only write request should increase zxid
  */
-static bool shouldIncreaseZxid(const Coordination::ZooKeeperRequestPtr & zk_request)
+bool KeeperStore::shouldIncreaseZxid(const Coordination::ZooKeeperRequestPtr & zk_request)
 {
     return !(dynamic_cast<Coordination::ZooKeeperGetRequest *>(zk_request.get())
         || dynamic_cast<Coordination::ZooKeeperSetWatchesRequest *>(zk_request.get())
         || dynamic_cast<Coordination::ZooKeeperExistsRequest *>(zk_request.get())
         || dynamic_cast<Coordination::ZooKeeperAuthRequest *>(zk_request.get())
         || dynamic_cast<Coordination::ZooKeeperHeartbeatRequest *>(zk_request.get())
+        || dynamic_cast<Coordination::ZooKeeperRegisterSessionRequest *>(zk_request.get())
+        || dynamic_cast<Coordination::ZooKeeperMultiReadRequest *>(zk_request.get())
+        || dynamic_cast<Coordination::ZooKeeperAddWatchRequest *>(zk_request.get())
+        || dynamic_cast<Coordination::ZooKeeperRemoveWatchesRequest *>(zk_request.get())
         || dynamic_cast<Coordination::ZooKeeperListRequest *>(zk_request.get())
         || dynamic_cast<Coordination::ZooKeeperSimpleListRequest *>(zk_request.get()));
 }
 
-KeeperStore::KeeperStore(int64_t tick_time_ms, const String & super_digest_) : session_expiry_queue(tick_time_ms), super_digest(super_digest_)
+KeeperStore::KeeperStore(
+    int64_t tick_time_ms,
+    const String & super_digest_,
+    ContainerType container_type,
+    UInt64 subtree_stats_depth_,
+    SessionExpiryType session_expiry_type,
+    bool prepare_response_frames_,
+    UInt64 response_cache_max_paths_,
+    UInt64 response_cache_max_body_bytes_,
+    UInt32 container_blocks,
+    UInt64 idempotency_cache_size)
+    : container(container_type, container_blocks)
+    , session_table(tick_time_ms, session_expiry_type)
+    , node_expiry(tick_time_ms)
+    , subtree_stats_depth(subtree_stats_depth_)
+    , super_digest(super_digest_)
+    , prepare_response_frames(prepare_response_frames_)
+    , response_cache_max_paths(response_cache_max_paths_)
+    , response_cache_max_body_bytes(response_cache_max_body_bytes_)
+    , idempotency_cache(idempotency_cache_size)
 {
     log = &(Poco::Logger::get("KeeperStore"));
-    container.emplace("/", std::make_shared<KeeperNode>());
+    auto root = KeeperNode::create();
+    digest = nodeDigest("/", *root);
+    container.emplace("/", std::move(root));
+    node_bytes += NODE_ENTRY_BYTES;
+    path_bytes += 1;
 }
 
-using Undo = std::function<void()>;
+/** Undo records of write requests in multi, applied in reverse order when a later sub request fails.
+ *
+ * They are plain records instead of closures, paths refer to the sub request which outlives the undo.
+ */
+struct CreateUndo
+{
+    String path_created;
+    int64_t pzxid;
+    uint64_t acl_id;
+    int64_t session_id;
+    bool is_ephemeral;
+};
+
+struct RemoveUndo
+{
+    std::string_view path;
+    std::shared_ptr<KeeperNode> prev_node;
+    int64_t pzxid;
+};
 
-struct StoreRequest
+struct SetUndo
 {
-    Coordination::ZooKeeperRequestPtr zk_request;
+    std::string_view path;
+    std::shared_ptr<KeeperNode> prev_node;
+    size_t data_size;
+};
 
-    explicit StoreRequest(const Coordination::ZooKeeperRequestPtr & zk_request_) : zk_request(zk_request_) { }
-    virtual std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t zxid,
-        int64_t session_id,
-        int64_t time) const = 0;
-    virtual bool checkAuth(KeeperStore & /*storage*/, int64_t /*session_id*/) const { return true; }
+using Undo = std::variant<std::monostate, CreateUndo, RemoveUndo, SetUndo>;
 
-    virtual KeeperStore::ResponsesForSessions
-    processWatches(KeeperStore::Watches & /*watches*/, KeeperStore::Watches & /*list_watches*/) const
+static void applyUndo(KeeperStore & store, const Undo & undo)
+{
+    if (const auto * create = std::get_if<CreateUndo>(&undo))
     {
-        return {};
+        const auto & path_created = create->path_created;
+        if (auto node = store.container.get(path_created))
+            store.onNodeRemoved(path_created, *node);
+        store.container.erase(path_created);
+        store.acl_map.removeUsage(create->acl_id);
+
+        if (create->is_ephemeral)
+            store.ephemerals.remove(create->session_id, path_created);
+
+        String child_path = getBaseName(path_created);
+        auto undo_parent = store.getNodeForUpdate(parentPath(path_created));
+        {
+            std::lock_guard parent_lock(undo_parent->getMutex());
+            --undo_parent->stat.cversion;
+            --undo_parent->stat.numChildren;
+            undo_parent->stat.pzxid = create->pzxid;
+            undo_parent->children.erase(child_path);
+            store.onChildRemoved(child_path);
+        }
     }
+    else if (const auto * remove = std::get_if<RemoveUndo>(&undo))
+    {
+        String path(remove->path);
+        const auto & prev_node = remove->prev_node;
+        if (prev_node->is_ephemeral)
+            store.ephemerals.add(prev_node->stat.ephemeralOwner, path);
+        store.acl_map.addUsage(prev_node->acl_id);
 
-    virtual ~StoreRequest() = default;
-};
+        store.onNodeAdded(path, *prev_node);
+        store.scheduleNodeExpiry(path, *prev_node);
+        store.container.emplace(path, prev_node);
 
-struct SvsKeeperStorageHeartbeatRequest final : public StoreRequest
-{
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & /* store */,
-        int64_t /* zxid */,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+        String child_basename = getBaseName(path);
+        auto undo_parent = store.getNodeForUpdate(parentPath(path));
+        {
+            std::lock_guard parent_lock(undo_parent->getMutex());
+            ++(undo_parent->stat.numChildren);
+            undo_parent->stat.pzxid = remove->pzxid;
+            undo_parent->children.insert(child_basename);
+            store.onChildAdded(child_basename);
+        }
+    }
+    else if (const auto * set = std::get_if<SetUndo>(&undo))
     {
-        return {zk_request->makeResponse(), {}};
+        String path(set->path);
+        size_t saved_bytes = 0;
+        if (auto node = store.container.get(path))
+        {
+            store.onNodeChanged(KeeperStore::nodeDigest(path, *node), KeeperStore::nodeDigest(path, *set->prev_node));
+            saved_bytes = node->data.savedBytes();
+        }
+        store.onDataChanged(path, set->data_size, set->prev_node->data.size(), saved_bytes, set->prev_node->data.savedBytes());
+        store.updateQuotaLimits(path, &set->prev_node->data);
+        store.preserveVersion(path);
+        store.container.emplace(path, set->prev_node);
     }
+}
+
+/** Stateless handler of an op num, see STORE_REQUEST_HANDLERS.
+ *
+ * process applies the request. If undo is not nullptr, the request is part of a multi and must record
+ * how to revert what it changed. process_watches fires the watches of a succeeded request with its
+ * response. check_auth and process_watches may be nullptr if the op needs no permission or fires no watch.
+ */
+struct StoreRequestHandler
+{
+    using Process = Coordination::ZooKeeperResponsePtr (*)(
+        KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t session_id, int64_t time, Undo * undo);
+    using CheckAuth = bool (*)(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id);
+    using ProcessWatches = void (*)(
+        const Coordination::ZooKeeperRequest & zk_request,
+        const Coordination::ZooKeeperResponse & zk_response,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses);
+
+    Coordination::OpNum op_num;
+    Process process;
+    CheckAuth check_auth;
+    ProcessWatches process_watches;
 };
 
-struct SvsKeeperStorageSetWatchesRequest final : public StoreRequest
+/// Whether session has the permission on a node with acl_id.
+static bool checkNodeACL(KeeperStore & store, uint64_t acl_id, int32_t permission, int64_t session_id)
+{
+    /// Default acl is 'world,'anyone : cdrwa, do not convert it
+    if (acl_id == 0)
+        return true;
+
+    int32_t permissions;
+    if (store.acl_permissions.get(session_id, acl_id, permissions))
+        return permissions & permission;
+
+    const auto node_acls = store.acl_map.convertNumber(acl_id);
+
+    /// Put under the lock, so that a concurrent change of the auth erases the mask computed before it
+    std::shared_lock r_lock(store.auth_mutex);
+    static const Coordination::AuthIDs no_auth_ids;
+    auto it = store.session_and_auth.find(session_id);
+    permissions = sessionPermissions(node_acls, it != store.session_and_auth.end() ? it->second : no_auth_ids);
+    store.acl_permissions.put(session_id, acl_id, permissions);
+    return permissions & permission;
+}
+
+/// Check permission on the node of path, true if the node does not exist.
+static bool checkPathACL(KeeperStore & store, const HashedPath & path, int32_t permission, int64_t session_id)
 {
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & /* storage */,
-        int64_t /* zxid */,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+    uint64_t acl_id;
+    if (!store.container.read(path, [&acl_id](const KeeperNode & node) { acl_id = node.acl_id; }))
+        return true;
+    return checkNodeACL(store, acl_id, permission, session_id);
+}
+
+/// Check permission on the parent of path, true if the parent does not exist.
+static bool checkParentACL(KeeperStore & store, std::string_view path, int32_t permission, int64_t session_id)
+{
+    return checkPathACL(store, parentPath(path), permission, session_id);
+}
+
+struct SvsKeeperStorageHeartbeatRequest
+{
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & /* store */, const Coordination::ZooKeeperRequest &, int64_t, int64_t, int64_t, Undo *)
     {
-        return {zk_request->makeResponse(), {}};
+        return makePooledResponse<Coordination::ZooKeeperHeartbeatResponse>();
     }
+};
 
-    KeeperStore::ResponsesForSessions
-    processWatches(KeeperStore::Watches & /*watches*/, KeeperStore::Watches & /*list_watches*/) const override
+struct SvsKeeperStorageSetWatchesRequest
+{
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & /* store */, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        return {};
+        return zk_request.makeResponse();
     }
 };
 
-struct SvsKeeperStorageSyncRequest final : public StoreRequest
+struct SvsKeeperStorageSyncRequest
 {
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & /* storage */,
-        int64_t /* zxid */,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & /* store */, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        auto response = zk_request->makeResponse();
-        dynamic_cast<Coordination::ZooKeeperSyncResponse *>(response.get())->path
-            = dynamic_cast<Coordination::ZooKeeperSyncRequest *>(zk_request.get())->path;
-        return {response, {}};
+        auto response = zk_request.makeResponse();
+        dynamic_cast<Coordination::ZooKeeperSyncResponse &>(*response).path
+            = dynamic_cast<const Coordination::ZooKeeperSyncRequest &>(zk_request).path;
+        return response;
     }
 };
 
-struct SvsKeeperStorageSetSeqNumRequest final : public StoreRequest
+struct SvsKeeperStorageAddWatchRequest
 {
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t /* zxid */,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
+    }
+
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t session_id, int64_t, Undo *)
     {
-        auto response = zk_request->makeResponse();
-        Coordination::ZooKeeperSetSeqNumRequest & request = dynamic_cast<Coordination::ZooKeeperSetSeqNumRequest &>(*zk_request);
-        auto znode = store.container.get(request.path);
+        auto response = zk_request.makeResponse();
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperAddWatchRequest &>(zk_request);
+
+        WatchManager::WatchType type;
+        switch (request.mode)
         {
-            std::lock_guard lock(znode->mutex);
-            znode->stat.cversion = request.seq_num;
+            case Coordination::ZooKeeperAddWatchRequest::PERSISTENT:
+                type = WatchManager::PERSISTENT;
+                break;
+            case Coordination::ZooKeeperAddWatchRequest::PERSISTENT_RECURSIVE:
+                type = WatchManager::PERSISTENT_RECURSIVE;
+                break;
+            default:
+                response->error = Coordination::Error::ZBADARGUMENTS;
+                return response;
         }
 
-        return {response, {}};
+        if (!store.checkSessionWatches(session_id, request.path, type))
+        {
+            response->error = Coordination::Error::ZQUOTAEXCEEDED;
+            return response;
+        }
+        /// Same as ZooKeeper, path needs not exist
+        store.watch_manager.addWatch(request.path, session_id, type);
+        return response;
     }
 };
 
-
-struct SvsKeeperStorageCreateRequest final : public StoreRequest
+struct SvsKeeperStorageRemoveWatchesRequest
 {
-    using StoreRequest::StoreRequest;
-
-    KeeperStore::ResponsesForSessions
-    processWatches(KeeperStore::Watches & watches, KeeperStore::Watches & list_watches) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t session_id, int64_t, Undo *)
     {
-        return processWatchesImpl(zk_request->getPath(), watches, list_watches, Coordination::Event::CREATED);
+        using Request = Coordination::ZooKeeperRemoveWatchesRequest;
+
+        auto response = zk_request.makeResponse();
+        const auto & request = dynamic_cast<const Request &>(zk_request);
+
+        auto & watch_manager = store.watch_manager;
+        bool removed = false;
+        switch (request.type)
+        {
+            case Request::CHILDREN:
+                removed = watch_manager.removeWatch(request.path, session_id, WatchManager::LIST);
+                break;
+            case Request::DATA:
+                removed = watch_manager.removeWatch(request.path, session_id, WatchManager::DATA);
+                break;
+            case Request::ANY:
+                /// Not short circuit, all of them are removed
+                for (auto type : {WatchManager::DATA, WatchManager::LIST, WatchManager::PERSISTENT, WatchManager::PERSISTENT_RECURSIVE})
+                    removed |= watch_manager.removeWatch(request.path, session_id, type);
+                break;
+            case Request::PERSISTENT:
+                removed = watch_manager.removeWatch(request.path, session_id, WatchManager::PERSISTENT);
+                break;
+            case Request::PERSISTENT_RECURSIVE:
+                removed = watch_manager.removeWatch(request.path, session_id, WatchManager::PERSISTENT_RECURSIVE);
+                break;
+            default:
+                response->error = Coordination::Error::ZBADARGUMENTS;
+                return response;
+        }
+
+        if (!removed)
+            response->error = Coordination::Error::ZNOWATCHER;
+        return response;
     }
+};
 
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+struct SvsKeeperStorageSubtreeStatRequest
+{
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        auto & container = store.container;
-        auto parent_path = parentPath(zk_request->getPath());
+        auto response_ptr = zk_request.makeResponse();
+        auto & response = dynamic_cast<Coordination::ZooKeeperSubtreeStatResponse &>(*response_ptr);
+        KeeperStore::SubtreeStats stats;
+        if (store.getSubtreeStats(zk_request.getPath(), stats))
+        {
+            response.node_count = stats.node_count;
+            response.data_bytes = stats.data_bytes;
+            response.error = Coordination::Error::ZOK;
+        }
+        else
+        {
+            response.error = Coordination::Error::ZNONODE;
+        }
+        return response_ptr;
+    }
+};
 
-        auto parent = container.get(parent_path);
-        if (parent == nullptr)
-            return true;
+struct SvsKeeperStorageGetEphemeralsRequest
+{
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t session_id, int64_t, Undo *)
+    {
+        auto response_ptr = zk_request.makeResponse();
+        auto & response = dynamic_cast<Coordination::ZooKeeperGetEphemeralsResponse &>(*response_ptr);
+        response.ephemerals = store.ephemerals.getPaths(session_id, zk_request.getPath());
+        response.error = Coordination::Error::ZOK;
+        return response_ptr;
+    }
+};
 
-        const auto & node_acls = store.acl_map.convertNumber(parent->acl_id);
-        if (node_acls.empty())
-            return true;
+struct SvsKeeperStorageGetAllChildrenNumberRequest
+{
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
+    }
 
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
+    {
+        auto response_ptr = zk_request.makeResponse();
+        auto & response = dynamic_cast<Coordination::ZooKeeperGetAllChildrenNumberResponse &>(*response_ptr);
+        KeeperStore::SubtreeStats stats;
+        if (store.getSubtreeStats(zk_request.getPath(), stats))
         {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Create, node_acls, session_auths);
+            response.total_number = static_cast<int32_t>(stats.node_count);
+            response.error = Coordination::Error::ZOK;
         }
         else
         {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Create, node_acls, empty_auth_ids);
+            response.error = Coordination::Error::ZNONODE;
+        }
+        return response_ptr;
+    }
+};
+
+struct SvsKeeperStorageSetSeqNumRequest
+{
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
+    {
+        auto response = zk_request.makeResponse();
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperSetSeqNumRequest &>(zk_request);
+        auto znode = store.getNodeForUpdate(request.path);
+        {
+            std::lock_guard lock(znode->getMutex());
+            znode->stat.cversion = request.seq_num;
         }
+
+        return response;
+    }
+};
+
+
+struct SvsKeeperStorageCreateRequest
+{
+    static void processWatches(
+        const Coordination::ZooKeeperRequest & zk_request,
+        const Coordination::ZooKeeperResponse &,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses)
+    {
+        processWatchesImpl(requestPath(zk_request, zk_request.getPath()), watch_manager, Coordination::Event::CREATED, on_responses);
+    }
+
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        /// LOL, GetACL require more permissions, then SetACL...
+        return checkParentACL(store, zk_request.getPath(), Coordination::ACL::Create, session_id);
     }
 
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t zxid,
-        int64_t session_id,
-        int64_t time) const override
+    static Coordination::ZooKeeperResponsePtr process(
+        KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t session_id, int64_t time, Undo * undo)
     {
-        Poco::Logger * log = &(Poco::Logger::get("SvsKeeperStorageCreateRequest"));
+        static Poco::Logger * log = &(Poco::Logger::get("SvsKeeperStorageCreateRequest"));
 
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
-        Undo undo;
-        Coordination::ZooKeeperCreateResponse & response = dynamic_cast<Coordination::ZooKeeperCreateResponse &>(*response_ptr);
-        Coordination::ZooKeeperCreateRequest & request = dynamic_cast<Coordination::ZooKeeperCreateRequest &>(*zk_request);
+        const Coordination::ZooKeeperCreateRequest & request = dynamic_cast<const Coordination::ZooKeeperCreateRequest &>(zk_request);
+        /// CreateContainer and CreateTTL respond the stat too
+        std::shared_ptr<Coordination::ZooKeeperCreateResponse> response_ptr = request.getOpNum() == Coordination::OpNum::Create
+            ? makePooledResponse<Coordination::ZooKeeperCreateResponse>()
+            : std::static_pointer_cast<Coordination::ZooKeeperCreateResponse>(request.makeResponse());
+        auto & response = *response_ptr;
+
+        if (request.getOpNum() == Coordination::OpNum::CreateTTL && (request.ttl <= 0 || request.ttl > EphemeralType::MAX_TTL))
+        {
+            response.error = Coordination::Error::ZBADARGUMENTS;
+            return response_ptr;
+        }
 
-        auto parent = store.container.get(parentPath(request.path));
+        /// Looked up twice, for checking and for updating
+        String parent_path = parentPath(request.path);
+        HashedPath hashed_parent_path(parent_path);
+        auto parent = store.container.get(hashed_parent_path);
         if (parent == nullptr)
         {
-            LOG_TRACE(log, "Create no parent {}, path {}", parentPath(request.path), request.path);
+            LOG_TRACE(log, "Create no parent {}, path {}", parent_path, request.path);
             response.error = Coordination::Error::ZNONODE;
-            return {response_ptr, undo};
+            return response_ptr;
         }
         else if (parent->is_ephemeral)
         {
             response.error = Coordination::Error::ZNOCHILDRENFOREPHEMERALS;
-            return {response_ptr, undo};
+            return response_ptr;
         }
 
-        std::string path_created = request.path;
+        String path_created;
         if (request.is_sequential)
         {
-            auto seq_num = parent->stat.cversion;
-
-            std::stringstream seq_num_str; // STYLE_CHECK_ALLOW_STD_STRING_STREAM
-            seq_num_str.exceptions(std::ios::failbit);
-            seq_num_str << std::setw(10) << std::setfill('0') << seq_num;
-
-            path_created += seq_num_str.str();
+            path_created.reserve(request.path.size() + SEQUENTIAL_SUFFIX_WIDTH);
+            path_created = request.path;
+            appendSequentialSuffix(path_created, parent->stat.cversion);
+        }
+        else
+        {
+            path_created = request.path;
         }
-        if (store.container.count(path_created) == 1)
+        /// The hash of request path is reused unless a sequential suffix is appended
+        HashedPath hashed_path_created
+            = request.is_sequential ? HashedPath(path_created) : HashedPath(path_created, requestPath(request, request.path).hash);
+        if (store.container.count(hashed_path_created) == 1)
         {
             response.error = Coordination::Error::ZNODEEXISTS;
-            return {response_ptr, undo};
+            return response_ptr;
         }
         String child_path = getBaseName(path_created);
         if (child_path.empty())
         {
             response.error = Coordination::Error::ZBADARGUMENTS;
-            return {response_ptr, undo};
+            return response_ptr;
+        }
+        if (!store.checkQuotas(path_created, 1, request.data.size()))
+        {
+            response.error = Coordination::Error::ZQUOTAEXCEEDED;
+            return response_ptr;
+        }
+        if (request.is_ephemeral && !store.checkSessionEphemerals(session_id))
+        {
+            response.error = Coordination::Error::ZQUOTAEXCEEDED;
+            return response_ptr;
         }
-        std::shared_ptr<KeeperNode> created_node = std::make_shared<KeeperNode>();
+        std::shared_ptr<KeeperNode> created_node = KeeperNode::create();
 
         Coordination::ACLs node_acls;
         uint64_t acl_id{};
@@ -436,15 +775,14 @@ struct SvsKeeperStorageCreateRequest final : public StoreRequest
             if (!fixupACL(request.acls, session_auth_ids, node_acls))
             {
                 response.error = Coordination::Error::ZINVALIDACL;
-                return {response_ptr, {}};
+                return response_ptr;
             }
 
-            acl_id = store.acl_map.convertACLs(node_acls);
-            store.acl_map.addUsage(acl_id);
+            acl_id = store.acl_map.convertACLsAndAddUsage(node_acls);
         }
 
         created_node->acl_id = acl_id;
-        LOG_TRACE(log, "path {}, acl_id {}, node_acls {}", zk_request->getPath(), created_node->acl_id, toString(node_acls));
+        LOG_TRACE(log, "path {}, acl_id {}, node_acls {}", zk_request.getPath(), created_node->acl_id, toString(node_acls));
         created_node->stat.czxid = zxid;
         created_node->stat.mzxid = zxid;
         created_node->stat.pzxid = zxid;
@@ -456,16 +794,22 @@ struct SvsKeeperStorageCreateRequest final : public StoreRequest
         created_node->is_ephemeral = request.is_ephemeral;
         if (request.is_ephemeral)
             created_node->stat.ephemeralOwner = session_id;
+        else if (request.is_container)
+            created_node->stat.ephemeralOwner = EphemeralType::CONTAINER;
+        else if (request.getOpNum() == Coordination::OpNum::CreateTTL)
+            created_node->stat.ephemeralOwner = EphemeralType::ownerOfTTL(request.ttl);
         created_node->is_sequental = request.is_sequential;
 
         int64_t pzxid;
 
+        parent = store.getNodeForUpdate(hashed_parent_path);
         {
-            std::lock_guard parent_lock(parent->mutex);
+            std::lock_guard parent_lock(parent->getMutex());
 
             response.path_created = path_created;
 
             parent->children.insert(child_path);
+            store.onChildAdded(child_path);
 
             ++parent->stat.cversion;
             ++parent->stat.numChildren;
@@ -474,147 +818,111 @@ struct SvsKeeperStorageCreateRequest final : public StoreRequest
             parent->stat.pzxid = zxid;
         }
 
-        store.container.emplace(path_created, std::move(created_node));
+        if (auto * with_stat = dynamic_cast<Coordination::ZooKeeperCreateWithStatResponse *>(&response))
+            with_stat->stat = created_node->statForResponse();
+
+        store.preserveVersion(hashed_path_created);
+        store.onNodeAdded(path_created, *created_node);
+        store.scheduleNodeExpiry(path_created, *created_node);
+        store.container.emplace(hashed_path_created, std::move(created_node));
 
         if (request.is_ephemeral)
-        {
-            std::lock_guard w_lock(store.ephemerals_mutex);
-            store.ephemerals[session_id].emplace(path_created);
-        }
+            store.ephemerals.add(session_id, path_created);
 
-        undo = [&store,
-                session_id,
-                path_created,
-                pzxid,
-                is_ephemeral = request.is_ephemeral,
-                parent_path = parentPath(request.path),
-                child_path, acl_id] {
-            {
-                store.container.erase(path_created);
-                store.acl_map.removeUsage(acl_id);
-            }
-            if (is_ephemeral)
-            {
-                std::lock_guard w_lock(store.ephemerals_mutex);
-                store.ephemerals[session_id].erase(path_created);
-            }
-            auto undo_parent = store.container.at(parent_path);
-            {
-                std::lock_guard parent_lock(undo_parent->mutex);
-                --undo_parent->stat.cversion;
-                --undo_parent->stat.numChildren;
-                undo_parent->stat.pzxid = pzxid;
-                undo_parent->children.erase(child_path);
-            }
-        };
+        if (undo)
+            *undo = CreateUndo{std::move(path_created), pzxid, acl_id, session_id, request.is_ephemeral};
 
         response.error = Coordination::Error::ZOK;
-        return {response_ptr, undo};
+        return response_ptr;
     }
-
 };
 
-struct SvsKeeperStorageGetRequest final : public StoreRequest
+struct SvsKeeperStorageGetRequest
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        Poco::Logger * log = &(Poco::Logger::get("SvsKeeperStorageGetRequest"));
-        auto & container = store.container;
-        auto node = container.get(zk_request->getPath());
-        if (node == nullptr)
-            return true;
-
-        const auto & node_acls = store.acl_map.convertNumber(node->acl_id);
-        LOG_TRACE(log, "path {}, acl_id {}, node_acls {}", zk_request->getPath(), node->acl_id, toString(node_acls));
-        if (node_acls.empty())
-            return true;
-
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
-        {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Read, node_acls, session_auths);
-        }
-        else
-        {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Read, node_acls, empty_auth_ids);
-        }
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
     }
 
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t /* zxid */,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
-        Coordination::ZooKeeperGetResponse & response = dynamic_cast<Coordination::ZooKeeperGetResponse &>(*response_ptr);
-        Coordination::ZooKeeperGetRequest & request = dynamic_cast<Coordination::ZooKeeperGetRequest &>(*zk_request);
+        auto response_ptr = makePooledResponse<Coordination::ZooKeeperGetResponse>();
+        auto & response = *response_ptr;
+        const Coordination::ZooKeeperGetRequest & request = dynamic_cast<const Coordination::ZooKeeperGetRequest &>(zk_request);
+
+        KeeperStore::ResponseBodies::SharedElement cached;
+        if (store.response_cache_max_paths)
+            cached = store.cached_get_bodies.get(request.path);
+
+        bool exists = store.container.read(requestPath(request, request.path), [&response, &cached](const KeeperNode & node)
+        {
+            std::shared_lock r_lock(node.getMutex());
+            node.data.markAccessed();
+            response.stat = node.statForResponse();
+            if (cached && cached->stat == response.stat)
+                response.body = std::shared_ptr<const String>(cached, &cached->body);
+            else if (auto shared_data = node.data.shared())
+                response.shared_data = std::move(shared_data);
+            else
+                node.data.copyTo(response.data);
+        });
+        response.error = exists ? Coordination::Error::ZOK : Coordination::Error::ZNONODE;
 
-        auto node = store.container.get(request.path);
-        if (node == nullptr)
-        {
-            response.error = Coordination::Error::ZNONODE;
-        }
-        else
-        {
-            {
-                std::shared_lock r_lock(node->mutex);
-                response.stat = node->statForResponse();
-                response.data = node->data;
-            }
-            response.error = Coordination::Error::ZOK;
-        }
+        if (exists && !response.body && !response.shared_data && store.response_cache_max_paths
+            && response.data.size() <= store.response_cache_max_body_bytes)
+            store.cacheResponseBody(store.cached_get_bodies, request.path, response.stat, response);
 
-        return {response_ptr, {}};
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageRemoveRequest final : public StoreRequest
+/// Remove the node of path which has no children, return the pzxid of its parent before.
+static int64_t removeNode(KeeperStore & store, const String & path, const KeeperNode & node, int64_t zxid)
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    int64_t pzxid;
+    auto child_basename = getBaseName(path);
+    auto parent_path = parentPath(path);
+
+    auto parent = store.getNodeForUpdate(parent_path);
     {
-        auto & container = store.container;
-        auto parent = container.get(parentPath(zk_request->getPath()));
-        if (parent == nullptr)
-            return true;
+        std::lock_guard parent_lock(parent->getMutex());
+        --parent->stat.numChildren;
+        pzxid = parent->stat.pzxid;
+        parent->stat.pzxid = zxid;
+        parent->children.erase(child_basename);
+        store.onChildRemoved(child_basename);
+        store.scheduleNodeExpiry(parent_path, *parent);
+    }
 
-        const auto & node_acls = store.acl_map.convertNumber(parent->acl_id);
-        if (node_acls.empty())
-            return true;
+    store.acl_map.removeUsage(node.acl_id);
+    store.onNodeRemoved(path, node);
+    if (node.stat.ephemeralOwner != 0 && !node.is_ephemeral)
+        store.unscheduleNodeExpiry(path);
+    store.preserveVersion(path);
+    store.container.erase(path);
+    store.eraseCachedResponseBodies(path);
+
+    if (node.is_ephemeral)
+        store.ephemerals.remove(node.stat.ephemeralOwner, path);
+    return pzxid;
+}
 
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
-        {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Delete, node_acls, session_auths);
-        }
-        else
-        {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Delete, node_acls, empty_auth_ids);
-        }
+struct SvsKeeperStorageRemoveRequest
+{
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        return checkParentACL(store, zk_request.getPath(), Coordination::ACL::Delete, session_id);
     }
 
-
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t zxid,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t, int64_t, Undo * undo)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
         Coordination::ZooKeeperRemoveResponse & response = dynamic_cast<Coordination::ZooKeeperRemoveResponse &>(*response_ptr);
-        Coordination::ZooKeeperRemoveRequest & request = dynamic_cast<Coordination::ZooKeeperRemoveRequest &>(*zk_request);
-        Undo undo;
+        const Coordination::ZooKeeperRemoveRequest & request = dynamic_cast<const Coordination::ZooKeeperRemoveRequest &>(zk_request);
 
-        Poco::Logger * log = &(Poco::Logger::get("SvsKeeperStorageRemoveRequest"));
-        KeeperStore::Container::SharedElement node = store.container.get(request.path);
+        KeeperStore::Container::SharedElement node = store.container.get(requestPath(request, request.path));
         if (node == nullptr)
         {
             response.error = Coordination::Error::ZNONODE;
@@ -625,281 +933,421 @@ struct SvsKeeperStorageRemoveRequest final : public StoreRequest
         }
         else if (!node->children.empty())
         {
-            LOG_TRACE(log, "Parent children begin {}", *node->children.begin());
             response.error = Coordination::Error::ZNOTEMPTY;
         }
         else
         {
             response.error = Coordination::Error::ZOK;
+            int64_t pzxid = removeNode(store, request.path, *node, zxid);
 
-            int64_t pzxid;
-            auto prev_node = node->clone();
-            auto child_basename = getBaseName(request.path);
+            /// The removed node is not changed any more, undo puts it back as it is
+            if (undo)
+                *undo = RemoveUndo{request.path, std::move(node), pzxid};
+        }
 
-            auto parent = store.container.at(parentPath(request.path));
-            {
-                std::lock_guard parent_lock(parent->mutex);
-                --parent->stat.numChildren;
-                pzxid = parent->stat.pzxid;
-                parent->stat.pzxid = zxid;
-                parent->children.erase(child_basename);
-            }
+        return response_ptr;
+    }
+
+    static void processWatches(
+        const Coordination::ZooKeeperRequest & zk_request,
+        const Coordination::ZooKeeperResponse &,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses)
+    {
+        processWatchesImpl(requestPath(zk_request, zk_request.getPath()), watch_manager, Coordination::Event::DELETED, on_responses);
+    }
+};
+
+struct SvsKeeperStorageRemoveRecursiveRequest
+{
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        return checkParentACL(store, zk_request.getPath(), Coordination::ACL::Delete, session_id);
+    }
+
+    static std::vector<String> children(const KeeperNode & node)
+    {
+        std::vector<String> names;
+        std::shared_lock r_lock(node.getMutex());
+        names.reserve(node.children.size());
+        node.children.forEach([&names](const String & child) { names.push_back(child); });
+        return names;
+    }
+
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t session_id, int64_t, Undo *)
+    {
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
+        auto & response = dynamic_cast<Coordination::ZooKeeperRemoveRecursiveResponse &>(*response_ptr);
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperRemoveRecursiveRequest &>(zk_request);
 
-            store.acl_map.removeUsage(prev_node->acl_id);
-            store.container.erase(request.path);
+        if (request.path == "/" || request.limit < 0)
+        {
+            response.error = Coordination::Error::ZBADARGUMENTS;
+            return response_ptr;
+        }
+
+        auto root = store.container.get(request.path);
+        if (!root)
+        {
+            response.error = Coordination::Error::ZNONODE;
+            return response_ptr;
+        }
 
-            int64_t ephemeral_owner{};
+        /// Walk the subtree depth first, a node is collected after its children. Removing a node needs the
+        /// delete permission on its parent, so every parent of the subtree is checked before removing anything.
+        struct Level
+        {
+            String path;
+            std::vector<String> children;
+            size_t next = 0;
+        };
+        std::vector<Level> levels;
+        levels.push_back({request.path, children(*root)});
+        if (!levels.back().children.empty() && !checkNodeACL(store, root->acl_id, Coordination::ACL::Delete, session_id))
+        {
+            response.error = Coordination::Error::ZNOAUTH;
+            return response_ptr;
+        }
 
-            if (prev_node->is_ephemeral)
+        auto & removed_paths = response.removed_paths;
+        size_t limit = request.limit;
+        while (!levels.empty() && (!limit || removed_paths.size() < limit))
+        {
+            auto & level = levels.back();
+            if (level.next == level.children.size())
             {
-                ephemeral_owner = prev_node->stat.ephemeralOwner;
-                std::lock_guard w_lock(store.ephemerals_mutex);
-                store.ephemerals[ephemeral_owner].erase(request.path);
+                removed_paths.push_back(std::move(level.path));
+                levels.pop_back();
+                continue;
             }
 
-            undo = [prev_node, &store, ephemeral_owner, path = request.path, pzxid, child_basename] {
-                if (prev_node->is_ephemeral)
-                {
-                    std::lock_guard w_lock(store.ephemerals_mutex);
-                    store.ephemerals[ephemeral_owner].emplace(path);
-                }
-                store.acl_map.addUsage(prev_node->acl_id);
-
-                store.container.emplace(path, prev_node);
-                auto undo_parent = store.container.at(parentPath(path));
-                {
-                    std::lock_guard parent_lock(undo_parent->mutex);
-                    ++(undo_parent->stat.numChildren);
-                    undo_parent->stat.pzxid = pzxid;
-                    undo_parent->children.insert(child_basename);
-                }
-            };
+            String child_path = level.path + "/" + level.children[level.next++];
+            auto child = store.container.get(child_path);
+            if (!child)
+                continue;
+            auto grandchildren = children(*child);
+            if (grandchildren.empty())
+            {
+                removed_paths.push_back(std::move(child_path));
+                continue;
+            }
+            if (!checkNodeACL(store, child->acl_id, Coordination::ACL::Delete, session_id))
+            {
+                removed_paths.clear();
+                response.error = Coordination::Error::ZNOAUTH;
+                return response_ptr;
+            }
+            levels.push_back({std::move(child_path), std::move(grandchildren)});
         }
 
-        return {response_ptr, undo};
+        for (const auto & path : removed_paths)
+            if (auto node = store.container.get(path))
+                removeNode(store, path, *node, zxid);
+
+        response.removed = removed_paths.size();
+        response.has_more = !levels.empty();
+        response.error = Coordination::Error::ZOK;
+        return response_ptr;
     }
 
-    KeeperStore::ResponsesForSessions
-    processWatches(KeeperStore::Watches & watches, KeeperStore::Watches & list_watches) const override
+    /// One delete event for every removed node, a child event only for the parents left
+    static void processWatches(
+        const Coordination::ZooKeeperRequest &,
+        const Coordination::ZooKeeperResponse & zk_response,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses)
     {
-        return processWatchesImpl(zk_request->getPath(), watches, list_watches, Coordination::Event::DELETED);
+        const auto & response = dynamic_cast<const Coordination::ZooKeeperRemoveRecursiveResponse &>(zk_response);
+        std::unordered_set<std::string_view> removed(response.removed_paths.begin(), response.removed_paths.end());
+        std::unordered_set<String> notified_parents;
+        for (const auto & path : response.removed_paths)
+        {
+            auto parent_path = parentPath(path);
+            bool parent_left = !removed.contains(parent_path) && notified_parents.insert(parent_path).second;
+            processWatchesImpl(path, watch_manager, Coordination::Event::DELETED, on_responses, false);
+            if (parent_left)
+                processWatchesImpl(parent_path, watch_manager, Coordination::Event::CHILD, on_responses, false);
+        }
     }
 };
 
-struct SvsKeeperStorageExistsRequest final : public StoreRequest
+struct SvsKeeperStorageExistsRequest
 {
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t /* zxid */,
-        int64_t /* session_id */,
-        int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
-        Coordination::ZooKeeperExistsResponse & response = dynamic_cast<Coordination::ZooKeeperExistsResponse &>(*response_ptr);
-        Coordination::ZooKeeperExistsRequest & request = dynamic_cast<Coordination::ZooKeeperExistsRequest &>(*zk_request);
+        auto response_ptr = makePooledResponse<Coordination::ZooKeeperExistsResponse>();
+        auto & response = *response_ptr;
+        const Coordination::ZooKeeperExistsRequest & request = dynamic_cast<const Coordination::ZooKeeperExistsRequest &>(zk_request);
 
-        auto node = store.container.get(request.path);
-        if (node != nullptr)
-        {
-            {
-                std::shared_lock r_lock(node->mutex);
-                response.stat = node->statForResponse();
-            }
-            response.error = Coordination::Error::ZOK;
-        }
-        else
-        {
-            response.error = Coordination::Error::ZNONODE;
-        }
+        auto read_stat = [&response](const KeeperNode & node) { response.stat = node.readStat(); };
+        bool exists = store.container.read(requestPath(request, request.path), read_stat);
+        response.error = exists ? Coordination::Error::ZOK : Coordination::Error::ZNONODE;
 
-        return {response_ptr, {}};
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageSetRequest final : public StoreRequest
+struct SvsKeeperStorageSetRequest
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        auto & container = store.container;
-        auto node = container.get(zk_request->getPath());
-        if (node == nullptr)
-            return true;
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Write, session_id);
+    }
 
-        const auto & node_acls = store.acl_map.convertNumber(node->acl_id);
-        if (node_acls.empty())
-            return true;
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t, int64_t time, Undo * undo)
+    {
+        auto response_ptr = makePooledResponse<Coordination::ZooKeeperSetResponse>();
+        auto & response = *response_ptr;
+        const Coordination::ZooKeeperSetRequest & request = dynamic_cast<const Coordination::ZooKeeperSetRequest &>(zk_request);
 
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
+        auto path = requestPath(request, request.path);
+        auto node = store.container.get(path);
+        if (node == nullptr)
         {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Write, node_acls, session_auths);
+            response.error = Coordination::Error::ZNONODE;
         }
-        else
+        else if (request.version != -1 && request.version != node->stat.version)
         {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Write, node_acls, empty_auth_ids);
+            response.error = Coordination::Error::ZBADVERSION;
         }
-    }
-
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t zxid,
-        int64_t /* session_id */,
-        int64_t time) const override
-    {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
-        Coordination::ZooKeeperSetResponse & response = dynamic_cast<Coordination::ZooKeeperSetResponse &>(*response_ptr);
-        Coordination::ZooKeeperSetRequest & request = dynamic_cast<Coordination::ZooKeeperSetRequest &>(*zk_request);
-        Undo undo;
-
-        auto node = store.container.get(request.path);
-        if (node == nullptr)
+        else if (!store.checkQuotas(request.path, 0, static_cast<int64_t>(request.data.size()) - static_cast<int64_t>(node->data.size())))
         {
-            response.error = Coordination::Error::ZNONODE;
+            response.error = Coordination::Error::ZQUOTAEXCEEDED;
         }
-        else if (request.version == -1 || request.version == node->stat.version)
+        else
         {
-            auto prev_node = node->clone();
+            /// Only multi needs the previous version to revert
+            if (undo)
+                *undo = SetUndo{request.path, node->clone(), request.data.size()};
+
+            size_t prev_data_size = node->data.size();
+            size_t prev_saved_bytes = node->data.savedBytes();
+            node = store.getNodeForUpdate(path);
             {
-                std::lock_guard node_lock(node->mutex);
+                std::lock_guard node_lock(node->getMutex());
+                UInt64 old_digest = KeeperStore::nodeDigest(request.path, *node);
                 ++node->stat.version;
                 node->stat.mzxid = zxid;
                 node->stat.mtime = time;
                 node->stat.dataLength = request.data.length();
                 node->data = request.data;
+                store.onNodeChanged(old_digest, KeeperStore::nodeDigest(request.path, *node));
             }
+            store.onDataChanged(request.path, prev_data_size, request.data.size(), prev_saved_bytes);
+            store.updateQuotaLimits(request.path, &node->data);
 
-            auto parent = store.container.at(parentPath(request.path));
             response.stat = node->statForResponse();
             response.error = Coordination::Error::ZOK;
-
-            undo = [prev_node, &store, path = request.path] {
-                store.container.emplace(path, prev_node);
-            };
-        }
-        else
-        {
-            response.error = Coordination::Error::ZBADVERSION;
         }
 
-        return {response_ptr, undo};
+        return response_ptr;
     }
 
-    KeeperStore::ResponsesForSessions
-    processWatches(KeeperStore::Watches & watches, KeeperStore::Watches & list_watches) const override
+    static void processWatches(
+        const Coordination::ZooKeeperRequest & zk_request,
+        const Coordination::ZooKeeperResponse &,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses)
     {
-        return processWatchesImpl(zk_request->getPath(), watches, list_watches, Coordination::Event::CHANGED);
+        processWatchesImpl(requestPath(zk_request, zk_request.getPath()), watch_manager, Coordination::Event::CHANGED, on_responses);
     }
 };
 
-struct SvsKeeperStorageListRequest final : public StoreRequest
+struct SvsKeeperStorageListRequest
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        auto & container = store.container;
-        auto node = container.get(zk_request->getPath());
-        if (node == nullptr)
-            return true;
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
+    }
 
-        const auto & node_acls = store.acl_map.convertNumber(node->acl_id);
-        if (node_acls.empty())
-            return true;
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
+    {
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
+        Coordination::ZooKeeperListResponse & response = dynamic_cast<Coordination::ZooKeeperListResponse &>(*response_ptr);
+        const Coordination::ZooKeeperListRequest & request = dynamic_cast<const Coordination::ZooKeeperListRequest &>(zk_request);
 
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
-        {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Read, node_acls, session_auths);
-        }
-        else
+        if (request.path.empty())
+            throw RK::Exception("Logical error: path cannot be empty", ErrorCodes::LOGICAL_ERROR);
+
+        KeeperStore::ResponseBodies::SharedElement cached;
+        if (store.response_cache_max_paths)
+            cached = store.cached_list_bodies.get(request.path);
+
+        /// Children are in sorted order
+        size_t names_bytes = 0;
+        bool exists = store.container.read(requestPath(request, request.path), [&response, &cached, &names_bytes](const KeeperNode & node)
         {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Read, node_acls, empty_auth_ids);
-        }
+            std::shared_lock r_lock(node.getMutex());
+            response.stat = node.statForResponse();
+            if (cached && cached->stat == response.stat)
+            {
+                response.body = std::shared_ptr<const String>(cached, &cached->body);
+                return;
+            }
+            response.names.reserve(node.children.size());
+            node.children.forEach([&response, &names_bytes](const String & child)
+            {
+                response.names.push_back(child);
+                names_bytes += child.size();
+            });
+        });
+        response.error = exists ? Coordination::Error::ZOK : Coordination::Error::ZNONODE;
+
+        if (exists && !response.body && store.response_cache_max_paths && names_bytes <= store.response_cache_max_body_bytes)
+            store.cacheResponseBody(store.cached_list_bodies, request.path, response.stat, response);
+
+        return response_ptr;
     }
+};
 
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t /*zxid*/,
-        int64_t /*session_id*/,
-        int64_t /* time */) const override
+struct SvsKeeperStorageListPageRequest
+{
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
-        Coordination::ZooKeeperListResponse & response = dynamic_cast<Coordination::ZooKeeperListResponse &>(*response_ptr);
-        Coordination::ZooKeeperListRequest & request = dynamic_cast<Coordination::ZooKeeperListRequest &>(*zk_request);
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
+    }
 
-        auto node = store.container.get(request.path);
-        if (node == nullptr)
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
+    {
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
+        Coordination::ZooKeeperListPageResponse & response = dynamic_cast<Coordination::ZooKeeperListPageResponse &>(*response_ptr);
+        const Coordination::ZooKeeperListPageRequest & request = dynamic_cast<const Coordination::ZooKeeperListPageRequest &>(zk_request);
+
+        if (request.limit <= 0)
         {
-            response.error = Coordination::Error::ZNONODE;
+            response.error = Coordination::Error::ZBADARGUMENTS;
+            return response_ptr;
         }
-        else
+
+        /// Only the page is copied under the node lock
+        bool exists = store.container.read(requestPath(request, request.path), [&response, &request](const KeeperNode & node)
         {
-            auto path_prefix = request.path;
-            if (path_prefix.empty())
-                throw RK::Exception("Logical error: path cannot be empty", ErrorCodes::LOGICAL_ERROR);
+            std::shared_lock r_lock(node.getMutex());
+            response.has_more = node.children.forEachPage(
+                request.start_after, request.prefix, request.limit, [&response](const String & child) { response.names.push_back(child); });
+            response.stat = node.statForResponse();
+        });
+        response.error = exists ? Coordination::Error::ZOK : Coordination::Error::ZNONODE;
 
-            {
-                std::shared_lock r_lock(node->mutex);
-                response.names.insert(response.names.end(), node->children.begin(), node->children.end());
-                response.stat = node->statForResponse();
-            }
-            std::sort(response.names.begin(), response.names.end());
-            response.error = Coordination::Error::ZOK;
-        }
-        return {response_ptr, {}};
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageCheckRequest final : public StoreRequest
+struct SvsKeeperStorageListWithDataRequest
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        auto & container = store.container;
-        auto node = container.get(zk_request->getPath());
-        if (node == nullptr)
-            return true;
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
+    }
 
-        const auto & node_acls = store.acl_map.convertNumber(node->acl_id);
-        if (node_acls.empty())
-            return true;
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t session_id, int64_t, Undo *)
+    {
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
+        auto & response = dynamic_cast<Coordination::ZooKeeperListWithDataResponse &>(*response_ptr);
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperListWithDataRequest &>(zk_request);
 
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
+        if (request.limit <= 0 || request.max_data_bytes < 0)
         {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Read, node_acls, session_auths);
+            response.error = Coordination::Error::ZBADARGUMENTS;
+            return response_ptr;
         }
-        else
+
+        /// Names of the page are taken under the lock of the parent alone, then every child is read under its own lock
+        std::vector<String> names;
+        bool exists = store.container.read(requestPath(request, request.path), [&](const KeeperNode & node)
+        {
+            std::shared_lock r_lock(node.getMutex());
+            response.has_more = node.children.forEachPage(
+                request.start_after, request.prefix, request.limit, [&names](const String & child) { names.push_back(child); });
+            response.stat = node.statForResponse();
+        });
+        if (!exists)
+        {
+            response.error = Coordination::Error::ZNONODE;
+            return response_ptr;
+        }
+
+        String child_path = request.path == "/" ? request.path : request.path + "/";
+        size_t parent_path_size = child_path.size();
+        size_t data_bytes = 0;
+        response.children.reserve(names.size());
+        for (auto & name : names)
         {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Read, node_acls, empty_auth_ids);
+            child_path.resize(parent_path_size);
+            child_path += name;
+
+            Coordination::ZooKeeperListWithDataResponse::Child child;
+            uint64_t acl_id = 0;
+            bool over_cap = false;
+            /// Removed since the page was taken, skipped as if the page were taken after
+            if (!store.container.read(child_path, [&](const KeeperNode & node)
+                {
+                    std::shared_lock r_lock(node.getMutex());
+                    child.stat = node.statForResponse();
+                    acl_id = node.acl_id;
+                    if (!request.with_data)
+                        return;
+                    if (request.max_data_bytes && !response.children.empty()
+                        && data_bytes + node.data.size() > static_cast<size_t>(request.max_data_bytes))
+                    {
+                        over_cap = true;
+                        return;
+                    }
+                    node.data.markAccessed();
+                    node.data.copyTo(child.data);
+                    child.has_data = true;
+                }))
+                continue;
+
+            /// The page ends before the child, the last name listed is the cursor of the next page
+            if (over_cap)
+            {
+                response.has_more = true;
+                break;
+            }
+            if (child.has_data && !checkNodeACL(store, acl_id, Coordination::ACL::Read, session_id))
+            {
+                child.has_data = false;
+                child.data.clear();
+            }
+            data_bytes += child.data.size();
+            child.name = std::move(name);
+            response.children.push_back(std::move(child));
         }
+        response.error = Coordination::Error::ZOK;
+
+        return response_ptr;
+    }
+};
+
+struct SvsKeeperStorageCheckRequest
+{
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Read, session_id);
     }
 
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t /*zxid*/,
-        int64_t /*session_id*/,
-        int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
         Coordination::ZooKeeperCheckResponse & response = dynamic_cast<Coordination::ZooKeeperCheckResponse &>(*response_ptr);
-        Coordination::ZooKeeperCheckRequest & request = dynamic_cast<Coordination::ZooKeeperCheckRequest &>(*zk_request);
+        const Coordination::ZooKeeperCheckRequest & request = dynamic_cast<const Coordination::ZooKeeperCheckRequest &>(zk_request);
 
-        auto node = store.container.get(request.path);
-        if (node == nullptr)
+        int32_t version = -1;
+        bool exists = store.container.read(
+            requestPath(request, request.path), [&version](const KeeperNode & node) { version = node.readStat().version; });
+        if (!exists)
         {
             response.error = Coordination::Error::ZNONODE;
         }
-        else if (request.version != -1 && request.version != node->stat.version) /// don't need lock
+        else if (request.version != -1 && request.version != version)
         {
             response.error = Coordination::Error::ZBADVERSION;
         }
@@ -907,46 +1355,25 @@ struct SvsKeeperStorageCheckRequest final : public StoreRequest
         {
             response.error = Coordination::Error::ZOK;
         }
-        return {response_ptr, {}};
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageSetACLRequest final : public StoreRequest
+struct SvsKeeperStorageSetACLRequest
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        auto & container = store.container;
-        auto node = container.get(zk_request->getPath());
-        if (node == nullptr)
-            return true;
-
-        const auto & node_acls = store.acl_map.convertNumber(node->acl_id);
-        if (node_acls.empty())
-            return true;
-
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
-        {
-            const auto & session_auths = it->second;
-            return checkACL(Coordination::ACL::Admin, node_acls, session_auths);
-        }
-        else
-        {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Admin, node_acls, empty_auth_ids);
-        }
+        return checkPathACL(store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Admin, session_id);
     }
 
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store, int64_t /*zxid*/, int64_t session_id,
-                                                                int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t session_id, int64_t, Undo *)
     {
         auto & container = store.container;
 
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
         Coordination::ZooKeeperSetACLResponse & response = dynamic_cast<Coordination::ZooKeeperSetACLResponse &>(*response_ptr);
-        Coordination::ZooKeeperSetACLRequest & request = dynamic_cast<Coordination::ZooKeeperSetACLRequest &>(*zk_request);
+        const Coordination::ZooKeeperSetACLRequest & request = dynamic_cast<const Coordination::ZooKeeperSetACLRequest &>(zk_request);
         auto node = container.get(request.path);
         if (node == nullptr)
         {
@@ -966,62 +1393,45 @@ struct SvsKeeperStorageSetACLRequest final : public StoreRequest
                 if (!fixupACL(request.acls, session_auth_ids, node_acls))
                 {
                     response.error = Coordination::Error::ZINVALIDACL;
-                    return {response_ptr, {}};
+                    return response_ptr;
                 }
             }
 
-            uint64_t acl_id = store.acl_map.convertACLs(node_acls);
-            store.acl_map.addUsage(acl_id);
+            uint64_t acl_id = store.acl_map.convertACLsAndAddUsage(node_acls);
 
-            std::lock_guard node_lock(node->mutex);
+            node = store.getNodeForUpdate(request.path);
+            if (store.isTrackingDirtyPaths())
+                store.markDirty(request.path);
+            std::lock_guard node_lock(node->getMutex());
+            UInt64 old_digest = KeeperStore::nodeDigest(request.path, *node);
             node->acl_id = acl_id;
             ++node->stat.aversion;
+            store.onNodeChanged(old_digest, KeeperStore::nodeDigest(request.path, *node));
 
             response.stat = node->stat;
             response.error = Coordination::Error::ZOK;
         }
 
         /// It cannot be used insied multitransaction?
-        return { response_ptr, {} };
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageGetACLRequest final : public StoreRequest
+struct SvsKeeperStorageGetACLRequest
 {
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
     {
-        auto & container = store.container;
-        auto node = container.get(zk_request->getPath());
-        if (node == nullptr)
-            return true;
-
-        const auto & node_acls = store.acl_map.convertNumber(node->acl_id);
-        if (node_acls.empty())
-            return true;
-
-        std::shared_lock r_lock(store.auth_mutex);
-        auto it = store.session_and_auth.find(session_id);
-        if (it != store.session_and_auth.end())
-        {
-            const auto & session_auths = it->second;
-            /// LOL, GetACL require more permissions, then SetACL...
-            return checkACL(Coordination::ACL::Admin | Coordination::ACL::Read, node_acls, session_auths);
-        }
-        else
-        {
-            std::vector<Coordination::AuthID> empty_auth_ids;
-            return checkACL(Coordination::ACL::Admin | Coordination::ACL::Read, node_acls, empty_auth_ids);
-        }
+        /// LOL, GetACL require more permissions, then SetACL...
+        return checkPathACL(
+            store, requestPath(zk_request, zk_request.getPath()), Coordination::ACL::Admin | Coordination::ACL::Read, session_id);
     }
 
-    using StoreRequest::StoreRequest;
-
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store, int64_t /*zxid*/, int64_t /*session_id*/,
-                                                                int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t, int64_t, Undo *)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
         Coordination::ZooKeeperGetACLResponse & response = dynamic_cast<Coordination::ZooKeeperGetACLResponse &>(*response_ptr);
-        Coordination::ZooKeeperGetACLRequest & request = dynamic_cast<Coordination::ZooKeeperGetACLRequest &>(*zk_request);
+        const Coordination::ZooKeeperGetACLRequest & request = dynamic_cast<const Coordination::ZooKeeperGetACLRequest &>(zk_request);
         auto & container = store.container;
         auto node = container.get(request.path);
         if (node == nullptr)
@@ -1030,113 +1440,255 @@ struct SvsKeeperStorageGetACLRequest final : public StoreRequest
         }
         else
         {
-            std::shared_lock r_lock(node->mutex);
+            std::shared_lock r_lock(node->getMutex());
             response.stat = node->stat;
             response.acl = store.acl_map.convertNumber(node->acl_id);
         }
 
-        return {response_ptr, {}};
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageAuthRequest final : public StoreRequest
+struct SvsKeeperStorageAuthRequest
 {
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store, int64_t /*zxid*/, int64_t session_id,
-                                                                int64_t /* time */) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t, int64_t session_id, int64_t, Undo *)
     {
-        Coordination::ZooKeeperAuthRequest & auth_request = dynamic_cast<Coordination::ZooKeeperAuthRequest &>(*zk_request);
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
+        const Coordination::ZooKeeperAuthRequest & auth_request = dynamic_cast<const Coordination::ZooKeeperAuthRequest &>(zk_request);
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
         Coordination::ZooKeeperAuthResponse & auth_response =  dynamic_cast<Coordination::ZooKeeperAuthResponse &>(*response_ptr);
         auto & sessions_and_auth = store.session_and_auth;
 
-        if (auth_request.scheme != "digest" || std::count(auth_request.data.begin(), auth_request.data.end(), ':') != 1)
+        Coordination::AuthID auth;
+        if (!store.authOf(auth_request.scheme, auth_request.data, auth))
         {
             auth_response.error = Coordination::Error::ZAUTHFAILED;
         }
+        else if (auth.scheme == "super")
+        {
+            std::lock_guard w_lock(store.auth_mutex);
+            sessions_and_auth[session_id].emplace_back(auth);
+            store.acl_permissions.erase(session_id);
+        }
         else
         {
-            auto digest = generateDigest(auth_request.data);
-            if (digest == store.super_digest)
+            std::lock_guard w_lock(store.auth_mutex);
+            auto & session_ids = sessions_and_auth[session_id];
+            if (std::find(session_ids.begin(), session_ids.end(), auth) == session_ids.end())
             {
-                Coordination::AuthID auth{"super", ""};
-
-                std::lock_guard w_lock(store.auth_mutex);
                 sessions_and_auth[session_id].emplace_back(auth);
+                store.acl_permissions.erase(session_id);
             }
-            else
-            {
-                Coordination::AuthID auth{auth_request.scheme, digest};
-
-                std::lock_guard w_lock(store.auth_mutex);
-                auto & session_ids = sessions_and_auth[session_id];
-                if (std::find(session_ids.begin(), session_ids.end(), auth) == session_ids.end())
-                    sessions_and_auth[session_id].emplace_back(auth);
-            }
-
         }
 
-        return { response_ptr, {} };
+        return response_ptr;
     }
 };
 
-struct SvsKeeperStorageMultiRequest final : public StoreRequest
-{
+/// Handler of a sub request of multi, only plain write requests and check are allowed.
+static const StoreRequestHandler & getMultiSubRequestHandler(const Coordination::ZooKeeperRequest & sub_request);
 
-    bool checkAuth(KeeperStore & store, int64_t session_id) const override
+struct SvsKeeperStorageMultiRequest
+{
+    static const Coordination::ZooKeeperRequest & subRequest(const Coordination::RequestPtr & sub_request)
     {
-        for (const auto & concrete_request : concrete_requests)
-            if (!concrete_request->checkAuth(store, session_id))
-                return false;
-        return true;
+        return dynamic_cast<const Coordination::ZooKeeperRequest &>(*sub_request);
     }
 
-    std::vector<StoreRequestPtr> concrete_requests;
-    explicit SvsKeeperStorageMultiRequest(const Coordination::ZooKeeperRequestPtr & zk_request_) : StoreRequest(zk_request_)
+    /// What the sub requests see of a node, the node in the store unless a sub request before changed it
+    struct OverlayNode
     {
-        Coordination::ZooKeeperMultiRequest & request = dynamic_cast<Coordination::ZooKeeperMultiRequest &>(*zk_request);
-        concrete_requests.reserve(request.requests.size());
+        bool exists = false;
+        bool is_ephemeral = false;
+        int32_t version = 0;
+        int32_t cversion = 0;
+        size_t num_children = 0;
+    };
 
-        for (const auto & sub_request : request.requests)
+    /** Nodes changed by the sub requests validated so far, over the store which is not changed. It is small,
+     * a multi has a few sub requests.
+     */
+    struct Overlay
+    {
+        KeeperStore & store;
+        std::unordered_map<String, OverlayNode, HashedPathHash, HashedPathEqual> nodes;
+
+        OverlayNode & get(const HashedPath & path)
         {
-            auto sub_zk_request = std::dynamic_pointer_cast<Coordination::ZooKeeperRequest>(sub_request);
-            if (sub_zk_request->getOpNum() == Coordination::OpNum::Create)
+            auto it = findPath(nodes, path);
+            if (it != nodes.end())
+                return it->second;
+
+            OverlayNode overlay_node;
+            if (auto node = store.container.get(path))
             {
-                concrete_requests.push_back(std::make_shared<SvsKeeperStorageCreateRequest>(sub_zk_request));
+                overlay_node.exists = true;
+                overlay_node.is_ephemeral = node->is_ephemeral;
+                overlay_node.version = node->stat.version;
+                overlay_node.cversion = node->stat.cversion;
+                overlay_node.num_children = node->children.size();
             }
-            else if (sub_zk_request->getOpNum() == Coordination::OpNum::Remove)
-            {
-                concrete_requests.push_back(std::make_shared<SvsKeeperStorageRemoveRequest>(sub_zk_request));
+            return nodes.emplace(String(path.path), overlay_node).first->second;
+        }
+    };
+
+    /// Error of sub request against overlay, the checks are the ones of its handler in the same order.
+    /// Changes overlay as the sub request changes the store if it succeeds.
+    static Coordination::Error
+    validate(Overlay & overlay, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        switch (zk_request.getOpNum())
+        {
+            case Coordination::OpNum::Create:
+            case Coordination::OpNum::CreateContainer:
+            case Coordination::OpNum::CreateTTL: {
+                const auto & request = dynamic_cast<const Coordination::ZooKeeperCreateRequest &>(zk_request);
+                if (request.getOpNum() == Coordination::OpNum::CreateTTL && (request.ttl <= 0 || request.ttl > EphemeralType::MAX_TTL))
+                    return Coordination::Error::ZBADARGUMENTS;
+
+                String parent_path = parentPath(request.path);
+                auto & parent = overlay.get(parent_path);
+                if (!parent.exists)
+                    return Coordination::Error::ZNONODE;
+                if (parent.is_ephemeral)
+                    return Coordination::Error::ZNOCHILDRENFOREPHEMERALS;
+
+                String path_created = request.path;
+                if (request.is_sequential)
+                    appendSequentialSuffix(path_created, parent.cversion);
+                HashedPath hashed_path_created
+                    = request.is_sequential ? HashedPath(path_created) : HashedPath(path_created, requestPath(request, request.path).hash);
+                auto & created = overlay.get(hashed_path_created);
+                if (created.exists)
+                    return Coordination::Error::ZNODEEXISTS;
+                if (getBaseName(path_created).empty())
+                    return Coordination::Error::ZBADARGUMENTS;
+
+                if (!request.acls.empty())
+                {
+                    Coordination::ACLs node_acls;
+                    std::lock_guard lock(overlay.store.auth_mutex);
+                    static const Coordination::AuthIDs no_auth_ids;
+                    auto it = overlay.store.session_and_auth.find(session_id);
+                    const auto & session_auth_ids = it == overlay.store.session_and_auth.end() ? no_auth_ids : it->second;
+                    if (!fixupACL(request.acls, session_auth_ids, node_acls))
+                        return Coordination::Error::ZINVALIDACL;
+                }
+
+                created = OverlayNode{true, request.is_ephemeral, 0, 0, 0};
+                ++parent.cversion;
+                ++parent.num_children;
+                return Coordination::Error::ZOK;
             }
-            else if (sub_zk_request->getOpNum() == Coordination::OpNum::Set)
-            {
-                concrete_requests.push_back(std::make_shared<SvsKeeperStorageSetRequest>(sub_zk_request));
+            case Coordination::OpNum::Remove: {
+                const auto & request = dynamic_cast<const Coordination::ZooKeeperRemoveRequest &>(zk_request);
+                auto & node = overlay.get(requestPath(request, request.path));
+                if (!node.exists)
+                    return Coordination::Error::ZNONODE;
+                if (request.version != -1 && request.version != node.version)
+                    return Coordination::Error::ZBADVERSION;
+                if (node.num_children)
+                    return Coordination::Error::ZNOTEMPTY;
+
+                node = OverlayNode{};
+                --overlay.get(parentPath(request.path)).num_children;
+                return Coordination::Error::ZOK;
             }
-            else if (sub_zk_request->getOpNum() == Coordination::OpNum::Check)
-            {
-                concrete_requests.push_back(std::make_shared<SvsKeeperStorageCheckRequest>(sub_zk_request));
+            case Coordination::OpNum::Set: {
+                const auto & request = dynamic_cast<const Coordination::ZooKeeperSetRequest &>(zk_request);
+                auto & node = overlay.get(requestPath(request, request.path));
+                if (!node.exists)
+                    return Coordination::Error::ZNONODE;
+                if (request.version != -1 && request.version != node.version)
+                    return Coordination::Error::ZBADVERSION;
+
+                ++node.version;
+                return Coordination::Error::ZOK;
             }
-            else
+            case Coordination::OpNum::Check: {
+                const auto & request = dynamic_cast<const Coordination::ZooKeeperCheckRequest &>(zk_request);
+                auto & node = overlay.get(requestPath(request, request.path));
+                if (!node.exists)
+                    return Coordination::Error::ZNONODE;
+                if (request.version != -1 && request.version != node.version)
+                    return Coordination::Error::ZBADVERSION;
+                return Coordination::Error::ZOK;
+            }
+            default:
                 throw RK::Exception(
-                    ErrorCodes::BAD_ARGUMENTS, "Illegal command as part of multi ZooKeeper request {}", sub_zk_request->getOpNum());
+                    ErrorCodes::BAD_ARGUMENTS, "Illegal command as part of multi ZooKeeper request {}", zk_request.getOpNum());
+        }
+    }
+
+    /// Responses of a multi whose sub request failed with error, the ones before succeeded and the ones after are not applied
+    static void setFailedResponses(Coordination::ZooKeeperMultiResponse & response, size_t failed, Coordination::Error error)
+    {
+        for (size_t j = 0; j < response.responses.size(); ++j)
+        {
+            response.responses[j] = std::make_shared<Coordination::ZooKeeperErrorResponse>();
+            if (j < failed)
+                response.responses[j]->error = Coordination::Error::ZOK;
+            else if (j == failed)
+                response.responses[j]->error = error;
+            else
+                response.responses[j]->error = Coordination::Error::ZRUNTIMEINCONSISTENCY;
+        }
+    }
+
+    static bool checkAuth(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t session_id)
+    {
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperMultiRequest &>(zk_request);
+        for (const auto & sub_request : request.requests)
+        {
+            const auto & handler = getMultiSubRequestHandler(subRequest(sub_request));
+            if (handler.check_auth && !handler.check_auth(store, subRequest(sub_request), session_id))
+                return false;
         }
+        return true;
     }
 
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo> process(KeeperStore & store,
-        int64_t zxid,
-        int64_t session_id,
-        int64_t time) const override
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t session_id, int64_t time, Undo *)
     {
-        Coordination::ZooKeeperResponsePtr response_ptr = zk_request->makeResponse();
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperMultiRequest &>(zk_request);
+        Coordination::ZooKeeperResponsePtr response_ptr = zk_request.makeResponse();
         Coordination::ZooKeeperMultiResponse & response = dynamic_cast<Coordination::ZooKeeperMultiResponse &>(*response_ptr);
-        std::vector<Undo> undo_actions;
+
+        /** Validate all the sub requests before changing anything, a failed multi (a version check of an
+         * optimistic lock mostly) changes nothing and is not rolled back. The apply below fails only if the
+         * validation missed something, it still rolls back then.
+         */
+        {
+            Overlay overlay{store, {}};
+            for (size_t i = 0; i < request.requests.size(); ++i)
+            {
+                auto error = validate(overlay, subRequest(request.requests[i]), session_id);
+                if (error != Coordination::Error::ZOK)
+                {
+                    setFailedResponses(response, i, error);
+                    return response_ptr;
+                }
+            }
+        }
+
+        ArenaVector<Undo> undo_actions;
+        undo_actions.reserve(request.requests.size());
+
+        auto rollback = [&]
+        {
+            for (auto it = undo_actions.rbegin(); it != undo_actions.rend(); ++it)
+                applyUndo(store, *it);
+        };
 
         try
         {
-            size_t i = 0;
-            for (const auto & concrete_request : concrete_requests)
+            for (size_t i = 0; i < request.requests.size(); ++i)
             {
-                auto [cur_response, undo_action] = concrete_request->process(store, zxid, session_id, time);
+                const auto & sub_request = subRequest(request.requests[i]);
+                const auto & handler = getMultiSubRequestHandler(sub_request);
+
+                Undo undo_action;
+                auto cur_response = handler.process(store, sub_request, zxid, session_id, time, &undo_action);
 
                 response.responses[i] = cur_response;
                 if (cur_response->error != Coordination::Error::ZOK)
@@ -1154,163 +1706,315 @@ struct SvsKeeperStorageMultiRequest final : public StoreRequest
                         response.responses[j]->error = Coordination::Error::ZRUNTIMEINCONSISTENCY;
                     }
 
-                    for (auto it = undo_actions.rbegin(); it != undo_actions.rend(); ++it)
-                        if (*it)
-                            (*it)();
-
-                    return {response_ptr, {}};
+                    rollback();
+                    return response_ptr;
                 }
                 else
                     undo_actions.emplace_back(std::move(undo_action));
-
-                ++i;
             }
 
             response.error = Coordination::Error::ZOK;
-            return {response_ptr, {}};
+            return response_ptr;
         }
         catch (...)
         {
-            for (auto it = undo_actions.rbegin(); it != undo_actions.rend(); ++it)
-                if (*it)
-                    (*it)();
+            rollback();
             throw;
         }
     }
 
-    KeeperStore::ResponsesForSessions
-    processWatches(KeeperStore::Watches & watches, KeeperStore::Watches & list_watches) const override
+    static void processWatches(
+        const Coordination::ZooKeeperRequest & zk_request,
+        const Coordination::ZooKeeperResponse & zk_response,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses)
     {
-        KeeperStore::ResponsesForSessions result;
-        for (const auto & generic_request : concrete_requests)
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperMultiRequest &>(zk_request);
+        const auto & response = dynamic_cast<const Coordination::ZooKeeperMultiResponse &>(zk_response);
+        for (size_t i = 0; i < request.requests.size(); ++i)
         {
-            auto responses = generic_request->processWatches(watches, list_watches);
-            result.insert(result.end(), responses.begin(), responses.end());
+            const auto & sub_request = subRequest(request.requests[i]);
+            const auto & handler = getMultiSubRequestHandler(sub_request);
+            if (handler.process_watches)
+                handler.process_watches(
+                    sub_request, dynamic_cast<const Coordination::ZooKeeperResponse &>(*response.responses[i]), watch_manager, on_responses);
         }
-        return result;
     }
 };
 
-struct SvsKeeperStorageCloseRequest final : public StoreRequest
+static const StoreRequestHandler & getStoreRequestHandler(Coordination::OpNum op_num);
+
+struct SvsKeeperStorageMultiReadRequest
 {
-    using StoreRequest::StoreRequest;
-    std::pair<Coordination::ZooKeeperResponsePtr, Undo>
-    process(KeeperStore & /* store */, int64_t, int64_t,
-            int64_t /* time */) const override
+    static bool isReadOp(Coordination::OpNum op_num)
     {
-        throw RK::Exception("Called process on close request", ErrorCodes::LOGICAL_ERROR);
+        return op_num == Coordination::OpNum::Get || op_num == Coordination::OpNum::List || op_num == Coordination::OpNum::SimpleList;
     }
-};
 
-void KeeperStore::finalize()
-{
-    if (finalized)
-        throw RK::Exception("keeper store already finalized", ErrorCodes::LOGICAL_ERROR);
+    /// Permission is checked for every sub request, a denied one fails alone with ZNOAUTH.
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t session_id, int64_t time, Undo *)
+    {
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperMultiReadRequest &>(zk_request);
+        auto response_ptr = std::make_shared<Coordination::ZooKeeperMultiReadResponse>(Coordination::Responses{});
+        auto & response = *response_ptr;
 
-    finalized = true;
+        for (const auto & sub_request : request.requests)
+        {
+            if (!isReadOp(dynamic_cast<const Coordination::ZooKeeperRequest &>(*sub_request).getOpNum()))
+            {
+                response.error = Coordination::Error::ZBADARGUMENTS;
+                return response_ptr;
+            }
+        }
 
-    for (const auto & [session_id, ephemerals_paths] : ephemerals)
-        for (const String & ephemeral_path : ephemerals_paths)
+        response.responses.reserve(request.requests.size());
+        for (const auto & sub_request_ptr : request.requests)
         {
-            auto parent = container.at(parentPath(ephemeral_path));
+            const auto & sub_request = dynamic_cast<const Coordination::ZooKeeperRequest &>(*sub_request_ptr);
+            const auto & handler = getStoreRequestHandler(sub_request.getOpNum());
+
+            Coordination::ZooKeeperResponsePtr sub_response;
+            if (handler.check_auth && !handler.check_auth(store, sub_request, session_id))
             {
-                std::lock_guard parent_lock(parent->mutex);
-                --parent->stat.numChildren;
-                parent->children.erase(getBaseName(ephemeral_path));
+                sub_response = std::make_shared<Coordination::ZooKeeperErrorResponse>();
+                sub_response->error = Coordination::Error::ZNOAUTH;
             }
-            container.erase(ephemeral_path);
+            else
+            {
+                sub_response = handler.process(store, sub_request, zxid, session_id, time, nullptr);
+                if (sub_response->error != Coordination::Error::ZOK)
+                {
+                    auto error = sub_response->error;
+                    sub_response = std::make_shared<Coordination::ZooKeeperErrorResponse>();
+                    sub_response->error = error;
+                }
+            }
+            response.responses.push_back(std::move(sub_response));
         }
 
-    {
-        std::lock_guard lock(ephemerals_mutex);
-        ephemerals.clear();
+        response.error = Coordination::Error::ZOK;
+        return response_ptr;
     }
+};
 
+struct SvsKeeperStorageBatchWriteRequest
+{
+    static bool isBatchOp(Coordination::OpNum op_num)
     {
-        std::lock_guard session_lock(session_mutex);
-        std::lock_guard watch_lock(watch_mutex);
-        watches.clear();
-        list_watches.clear();
-        sessions_and_watchers.clear();
-        session_expiry_queue.clear();
-        session_and_timeout.clear();
+        return op_num == Coordination::OpNum::Create || op_num == Coordination::OpNum::Set || op_num == Coordination::OpNum::Remove;
     }
+
+    /// Permission is checked for every sub request as it is applied, nothing is validated ahead or undone.
+    static Coordination::ZooKeeperResponsePtr
+    process(KeeperStore & store, const Coordination::ZooKeeperRequest & zk_request, int64_t zxid, int64_t session_id, int64_t time, Undo *)
     {
-        std::lock_guard auth_lock(auth_mutex);
-        session_and_auth.clear();
-    }
-}
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperBatchWriteRequest &>(zk_request);
+        auto response_ptr = std::make_shared<Coordination::ZooKeeperBatchWriteResponse>(Coordination::Responses{});
+        auto & response = *response_ptr;
 
-class NuKeeperWrapperFactory final : private boost::noncopyable
-{
-public:
-    using Creator = std::function<StoreRequestPtr(const Coordination::ZooKeeperRequestPtr &)>;
-    using OpNumToRequest = std::unordered_map<Coordination::OpNum, Creator>;
+        for (const auto & sub_request : request.requests)
+        {
+            if (!isBatchOp(dynamic_cast<const Coordination::ZooKeeperRequest &>(*sub_request).getOpNum()))
+            {
+                response.error = Coordination::Error::ZBADARGUMENTS;
+                return response_ptr;
+            }
+        }
 
-    static NuKeeperWrapperFactory & instance()
-    {
-        static NuKeeperWrapperFactory factory;
-        return factory;
-    }
+        response.responses.reserve(request.requests.size());
+        for (const auto & sub_request_ptr : request.requests)
+        {
+            const auto & sub_request = dynamic_cast<const Coordination::ZooKeeperRequest &>(*sub_request_ptr);
+            const auto & handler = getStoreRequestHandler(sub_request.getOpNum());
 
-    StoreRequestPtr get(const Coordination::ZooKeeperRequestPtr & zk_request) const
-    {
-        auto it = op_num_to_request.find(zk_request->getOpNum());
-        if (it == op_num_to_request.end())
-            throw RK::Exception("Unknown operation type " + toString(zk_request->getOpNum()), ErrorCodes::LOGICAL_ERROR);
+            Coordination::ZooKeeperResponsePtr sub_response;
+            if (!handler.check_auth(store, sub_request, session_id))
+            {
+                sub_response = std::make_shared<Coordination::ZooKeeperErrorResponse>();
+                sub_response->error = Coordination::Error::ZNOAUTH;
+            }
+            else
+            {
+                sub_response = handler.process(store, sub_request, zxid, session_id, time, nullptr);
+                if (sub_response->error != Coordination::Error::ZOK)
+                {
+                    auto error = sub_response->error;
+                    sub_response = std::make_shared<Coordination::ZooKeeperErrorResponse>();
+                    sub_response->error = error;
+                }
+            }
+            response.responses.push_back(std::move(sub_response));
+        }
 
-        return it->second(zk_request);
+        response.error = Coordination::Error::ZOK;
+        return response_ptr;
     }
 
-    void registerRequest(Coordination::OpNum op_num, Creator creator)
+    /// Of the sub requests applied
+    static void processWatches(
+        const Coordination::ZooKeeperRequest & zk_request,
+        const Coordination::ZooKeeperResponse & zk_response,
+        WatchManager & watch_manager,
+        const KeeperStore::WatchCallback & on_responses)
     {
-        if (!op_num_to_request.try_emplace(op_num, creator).second)
-            throw RK::Exception(ErrorCodes::LOGICAL_ERROR, "Request with op num {} already registered", op_num);
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperBatchWriteRequest &>(zk_request);
+        const auto & response = dynamic_cast<const Coordination::ZooKeeperBatchWriteResponse &>(zk_response);
+        for (size_t i = 0; i < request.requests.size(); ++i)
+        {
+            const auto & sub_response = dynamic_cast<const Coordination::ZooKeeperResponse &>(*response.responses[i]);
+            if (sub_response.error != Coordination::Error::ZOK)
+                continue;
+            const auto & sub_request = dynamic_cast<const Coordination::ZooKeeperRequest &>(*request.requests[i]);
+            getStoreRequestHandler(sub_request.getOpNum()).process_watches(sub_request, sub_response, watch_manager, on_responses);
+        }
     }
+};
 
-private:
-    OpNumToRequest op_num_to_request;
-    NuKeeperWrapperFactory();
+/// Close, ExpireSessions and RegisterSession change sessions and are applied by processRequest itself, so is RemoveExpiredNodes.
+static constexpr StoreRequestHandler STORE_REQUEST_HANDLERS[] = {
+    {Coordination::OpNum::Heartbeat, &SvsKeeperStorageHeartbeatRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::SetWatches, &SvsKeeperStorageSetWatchesRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::AddWatch, &SvsKeeperStorageAddWatchRequest::process, &SvsKeeperStorageAddWatchRequest::checkAuth, nullptr},
+    {Coordination::OpNum::RemoveWatches, &SvsKeeperStorageRemoveWatchesRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::Sync, &SvsKeeperStorageSyncRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::Auth, &SvsKeeperStorageAuthRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::Create,
+     &SvsKeeperStorageCreateRequest::process,
+     &SvsKeeperStorageCreateRequest::checkAuth,
+     &SvsKeeperStorageCreateRequest::processWatches},
+    {Coordination::OpNum::CreateContainer,
+     &SvsKeeperStorageCreateRequest::process,
+     &SvsKeeperStorageCreateRequest::checkAuth,
+     &SvsKeeperStorageCreateRequest::processWatches},
+    {Coordination::OpNum::CreateTTL,
+     &SvsKeeperStorageCreateRequest::process,
+     &SvsKeeperStorageCreateRequest::checkAuth,
+     &SvsKeeperStorageCreateRequest::processWatches},
+    {Coordination::OpNum::Remove,
+     &SvsKeeperStorageRemoveRequest::process,
+     &SvsKeeperStorageRemoveRequest::checkAuth,
+     &SvsKeeperStorageRemoveRequest::processWatches},
+    {Coordination::OpNum::RemoveRecursive,
+     &SvsKeeperStorageRemoveRecursiveRequest::process,
+     &SvsKeeperStorageRemoveRecursiveRequest::checkAuth,
+     &SvsKeeperStorageRemoveRecursiveRequest::processWatches},
+    {Coordination::OpNum::Exists, &SvsKeeperStorageExistsRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::Get, &SvsKeeperStorageGetRequest::process, &SvsKeeperStorageGetRequest::checkAuth, nullptr},
+    {Coordination::OpNum::Set,
+     &SvsKeeperStorageSetRequest::process,
+     &SvsKeeperStorageSetRequest::checkAuth,
+     &SvsKeeperStorageSetRequest::processWatches},
+    {Coordination::OpNum::List, &SvsKeeperStorageListRequest::process, &SvsKeeperStorageListRequest::checkAuth, nullptr},
+    {Coordination::OpNum::SimpleList, &SvsKeeperStorageListRequest::process, &SvsKeeperStorageListRequest::checkAuth, nullptr},
+    {Coordination::OpNum::ListPage, &SvsKeeperStorageListPageRequest::process, &SvsKeeperStorageListPageRequest::checkAuth, nullptr},
+    {Coordination::OpNum::ListWithData,
+     &SvsKeeperStorageListWithDataRequest::process,
+     &SvsKeeperStorageListWithDataRequest::checkAuth,
+     nullptr},
+    {Coordination::OpNum::Check, &SvsKeeperStorageCheckRequest::process, &SvsKeeperStorageCheckRequest::checkAuth, nullptr},
+    {Coordination::OpNum::Multi,
+     &SvsKeeperStorageMultiRequest::process,
+     &SvsKeeperStorageMultiRequest::checkAuth,
+     &SvsKeeperStorageMultiRequest::processWatches},
+    {Coordination::OpNum::MultiRead, &SvsKeeperStorageMultiReadRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::BatchWrite,
+     &SvsKeeperStorageBatchWriteRequest::process,
+     nullptr,
+     &SvsKeeperStorageBatchWriteRequest::processWatches},
+    {Coordination::OpNum::SetSeqNum, &SvsKeeperStorageSetSeqNumRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::SubtreeStat, &SvsKeeperStorageSubtreeStatRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::GetEphemerals, &SvsKeeperStorageGetEphemeralsRequest::process, nullptr, nullptr},
+    {Coordination::OpNum::GetAllChildrenNumber,
+     &SvsKeeperStorageGetAllChildrenNumberRequest::process,
+     &SvsKeeperStorageGetAllChildrenNumberRequest::checkAuth,
+     nullptr},
+    {Coordination::OpNum::SetACL, &SvsKeeperStorageSetACLRequest::process, &SvsKeeperStorageSetACLRequest::checkAuth, nullptr},
+    {Coordination::OpNum::GetACL, &SvsKeeperStorageGetACLRequest::process, &SvsKeeperStorageGetACLRequest::checkAuth, nullptr},
 };
 
-template <Coordination::OpNum num, typename RequestT>
-void registerNuKeeperRequestWrapper(NuKeeperWrapperFactory & factory)
+/// Index of STORE_REQUEST_HANDLERS by the lowest byte of op num, fails to compile if two op nums share it.
+static constexpr auto STORE_REQUEST_HANDLER_INDEX = []
 {
-    factory.registerRequest(
-        num, [](const Coordination::ZooKeeperRequestPtr & zk_request) { return std::make_shared<RequestT>(zk_request); });
+    std::array<int8_t, 256> index{};
+    index.fill(-1);
+    for (size_t i = 0; i < std::size(STORE_REQUEST_HANDLERS); ++i)
+    {
+        auto slot = static_cast<uint8_t>(STORE_REQUEST_HANDLERS[i].op_num);
+        if (index[slot] != -1)
+            throw std::logic_error("Op nums of store request handlers share the lowest byte");
+        index[slot] = static_cast<int8_t>(i);
+    }
+    return index;
+}();
+
+static const StoreRequestHandler & getStoreRequestHandler(Coordination::OpNum op_num)
+{
+    auto index = STORE_REQUEST_HANDLER_INDEX[static_cast<uint8_t>(op_num)];
+    if (index < 0 || STORE_REQUEST_HANDLERS[index].op_num != op_num)
+        throw RK::Exception("Unknown operation type " + toString(op_num), ErrorCodes::LOGICAL_ERROR);
+    return STORE_REQUEST_HANDLERS[index];
 }
 
+static const StoreRequestHandler & getMultiSubRequestHandler(const Coordination::ZooKeeperRequest & sub_request)
+{
+    auto op_num = sub_request.getOpNum();
+    if (op_num != Coordination::OpNum::Create && op_num != Coordination::OpNum::CreateContainer && op_num != Coordination::OpNum::CreateTTL
+        && op_num != Coordination::OpNum::Remove && op_num != Coordination::OpNum::Set && op_num != Coordination::OpNum::Check)
+        throw RK::Exception(ErrorCodes::BAD_ARGUMENTS, "Illegal command as part of multi ZooKeeper request {}", op_num);
+    return getStoreRequestHandler(op_num);
+}
 
-NuKeeperWrapperFactory::NuKeeperWrapperFactory()
+
+void KeeperStore::finalize()
 {
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Heartbeat, SvsKeeperStorageHeartbeatRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::SetWatches, SvsKeeperStorageSetWatchesRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Sync, SvsKeeperStorageSyncRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Auth, SvsKeeperStorageAuthRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Close, SvsKeeperStorageCloseRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Create, SvsKeeperStorageCreateRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Remove, SvsKeeperStorageRemoveRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Exists, SvsKeeperStorageExistsRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Get, SvsKeeperStorageGetRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Set, SvsKeeperStorageSetRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::List, SvsKeeperStorageListRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::SimpleList, SvsKeeperStorageListRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Check, SvsKeeperStorageCheckRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::Multi, SvsKeeperStorageMultiRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::SetSeqNum, SvsKeeperStorageSetSeqNumRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::SetACL, SvsKeeperStorageSetACLRequest>(*this);
-    registerNuKeeperRequestWrapper<Coordination::OpNum::GetACL, SvsKeeperStorageGetACLRequest>(*this);
+    if (finalized)
+        throw RK::Exception("keeper store already finalized", ErrorCodes::LOGICAL_ERROR);
+
+    finalized = true;
+
+    for (const auto & [session_id, ephemerals_paths] : ephemerals.getSessions())
+        for (const String & ephemeral_path : ephemerals_paths)
+        {
+            auto parent = getNodeForUpdate(parentPath(ephemeral_path));
+            {
+                std::lock_guard parent_lock(parent->getMutex());
+                --parent->stat.numChildren;
+                parent->children.erase(getBaseName(ephemeral_path));
+                onChildRemoved(getBaseName(ephemeral_path));
+            }
+            if (auto node = container.get(ephemeral_path))
+                onNodeRemoved(ephemeral_path, *node);
+            preserveVersion(ephemeral_path);
+            container.erase(ephemeral_path);
+        }
+
+    ephemerals.clear();
+
+    {
+        std::lock_guard session_lock(session_mutex);
+        watch_manager.clear();
+        session_table.clear();
+    }
+    {
+        std::lock_guard auth_lock(auth_mutex);
+        session_and_auth.clear();
+        acl_permissions.clear();
+    }
 }
 
 
+
 void KeeperStore::processRequest(
-    ThreadSafeQueue<ResponseForSession> & responses_queue,
+    KeeperResponsesQueue & responses_queue,
     const Coordination::ZooKeeperRequestPtr & zk_request,
     int64_t session_id,
     int64_t time,
     std::optional<int64_t> new_last_zxid,
     bool check_acl [[maybe_unused]],
-    bool ignore_response)
+    bool ignore_response,
+    std::optional<int64_t> assigned_zxid,
+    bool connected)
 {
     LOG_TRACE(
         log,
@@ -1319,6 +2023,14 @@ void KeeperStore::processRequest(
         zk_request->xid,
         Coordination::toString(zk_request->getOpNum()));
 
+    /// What the request allocates in the arena is released once its responses are queued
+    RequestArenaScope arena_scope;
+
+    /// Write requests are serialized with pinSnapshot, so a pinned snapshot never sees part of a request.
+    std::shared_lock pin_lock(snapshot_pin_mutex, std::defer_lock);
+    if (!zk_request->isReadRequest())
+        pin_lock.lock();
+
     if (new_last_zxid)
     {
         if (zxid >= *new_last_zxid)
@@ -1326,66 +2038,76 @@ void KeeperStore::processRequest(
         zxid = *new_last_zxid;
     }
 
+    /// zxid of the request when it is reserved by parallel apply
+    auto current_zxid = [&]() -> int64_t { return assigned_zxid ? *assigned_zxid : zxid.load(); };
+    auto next_zxid = [&]() -> int64_t { return assigned_zxid ? *assigned_zxid : getZXID(); };
+
     if (zk_request->getOpNum() == Coordination::OpNum::Close)
     {
-        {
-            std::lock_guard lock(ephemerals_mutex);
-            auto it = ephemerals.find(session_id);
-            if (it != ephemerals.end())
-            {
-                for (const auto & ephemeral_path : it->second)
-                {
-                    LOG_TRACE(log, "Disconnect session {}, deleting its ephemeral node {}", toHexString(session_id), ephemeral_path);
-                    auto parent = container.at(parentPath(ephemeral_path));
-                    if (!parent)
-                    {
-                        LOG_ERROR(log, "Logical error, disconnect session {}, ephemeral znode parent not exist {}", toHexString(session_id), ephemeral_path);
-                    }
-                    else
-                    {
-                        std::lock_guard parent_lock(parent->mutex);
-                        --parent->stat.numChildren;
-                        parent->children.erase(getBaseName(ephemeral_path));
-                    }
-                    container.erase(ephemeral_path);
-
-                    std::lock_guard watch_lock(watch_mutex);
-                    auto responses = processWatchesImpl(ephemeral_path, watches, list_watches, Coordination::Event::DELETED);
-                    set_response(responses_queue, responses, ignore_response);
-                }
-                ephemerals.erase(it);
-            }
-            else
-            {
-                LOG_DEBUG(log, "Session {} already closed, must applying a fuzzy log.", toHexString(session_id));
-            }
-            clearDeadWatches(session_id);
-        }
+        ResponsesForSessions responses;
+        closeSession(session_id, responses);
 
         /// Finish connection
         auto response = std::make_shared<Coordination::ZooKeeperCloseResponse>();
         response->xid = zk_request->xid;
-        response->zxid = new_last_zxid ? zxid.load() : getZXID();
-        {
-            std::lock_guard lock(session_mutex);
-            session_expiry_queue.remove(session_id);
-            session_and_timeout.erase(session_id);
-            LOG_INFO(log, "Process close session {}, total sessions {}", toHexString(session_id), session_and_timeout.size());
-        }
+        response->zxid = new_last_zxid ? zxid.load() : next_zxid();
+        responses.push_back(ResponseForSession{session_id, response});
+
+        set_response(responses_queue, responses, ignore_response);
+        return;
+    }
+    else if (zk_request->getOpNum() == Coordination::OpNum::ExpireSessions)
+    {
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperExpireSessionsRequest &>(*zk_request);
+
+        /// The whole batch is one log entry and takes one zxid
+        int64_t close_zxid = new_last_zxid ? zxid.load() : next_zxid();
 
+        /// Watch events of all the expired sessions are pushed at once, so they are coalesced per watcher.
+        ResponsesForSessions responses;
+        for (auto expired_session : request.session_ids)
         {
-            std::lock_guard lock(auth_mutex);
-            session_and_auth.erase(session_id);
+            closeSession(expired_session, responses);
+
+            auto response = std::make_shared<Coordination::ZooKeeperCloseResponse>();
+            response->xid = Coordination::CLOSE_XID;
+            response->zxid = close_zxid;
+            responses.push_back(ResponseForSession{expired_session, response});
         }
+        LOG_INFO(log, "Expired {} sessions, total sessions {}", request.session_ids.size(), session_table.size());
 
-        set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
+        set_response(responses_queue, responses, ignore_response);
         return;
     }
+    else if (zk_request->getOpNum() == Coordination::OpNum::RemoveExpiredNodes)
+    {
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperRemoveExpiredNodesRequest &>(*zk_request);
 
-    /// ZooKeeper update sessions expiry for each request, not only for heartbeats
+        /// The whole batch is one log entry and takes one zxid
+        int64_t remove_zxid = new_last_zxid ? zxid.load() : next_zxid();
+
+        ResponsesForSessions responses;
+        removeExpiredNodes(request.paths, remove_zxid, time, responses);
+        set_response(responses_queue, responses, ignore_response);
+        return;
+    }
+    else if (zk_request->getOpNum() == Coordination::OpNum::RegisterSession)
     {
+        const auto & request = dynamic_cast<const Coordination::ZooKeeperRegisterSessionRequest &>(*zk_request);
+
+        /// Session id is reserved already, registering does not increase zxid and has no response.
         std::lock_guard lock(session_mutex);
-        if (!session_and_timeout.contains(session_id) && !new_last_zxid)
+        if (!session_table.add(session_id, request.session_timeout_ms))
+            LOG_DEBUG(log, "Session {} already exist, must applying a fuzzy log.", toHexString(session_id));
+        else
+            LOG_DEBUG(log, "Register session {} with timeout {}", toHexString(session_id), request.session_timeout_ms);
+        return;
+    }
+
+    /// ZooKeeper update sessions expiry for each request, not only for heartbeats
+    if (!session_table.touch(session_id))
+    {
+        if (!new_last_zxid)
         {
             LOG_WARNING(
                 log,
@@ -1395,101 +2117,125 @@ void KeeperStore::processRequest(
                 zk_request->getPath());
             return;
         }
-        session_expiry_queue.addNewSessionOrUpdate(session_id, session_and_timeout[session_id]);
+        /// Replaying log of an unknown session, it expires at once for it has no timeout
+        std::lock_guard lock(session_mutex);
+        session_table.add(session_id, 0);
     }
 
     if (zk_request->getOpNum() == Coordination::OpNum::Heartbeat)
     {
-        StoreRequestPtr store_request = NuKeeperWrapperFactory::instance().get(zk_request);
-        auto [response, _] = store_request->process(*this, zxid, session_id, time);
+        auto response = getStoreRequestHandler(zk_request->getOpNum()).process(*this, *zk_request, current_zxid(), session_id, time, nullptr);
         response->xid = zk_request->xid;
         /// Heartbeat not increase zxid
-        response->zxid = zxid;
+        response->zxid = current_zxid();
+        if (prepare_response_frames)
+            response->prepareFrame();
         set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
     }
     else if (zk_request->getOpNum() == Coordination::OpNum::SetWatches)
     {
-        StoreRequestPtr store_request = NuKeeperWrapperFactory::instance().get(zk_request);
-        auto [response, _] = store_request->process(*this, zxid, session_id, time);
+        auto response = getStoreRequestHandler(zk_request->getOpNum()).process(*this, *zk_request, current_zxid(), session_id, time, nullptr);
         response->xid = zk_request->xid;
         /// SetWatches not increase zxid
-        response->zxid = zxid;
+        response->zxid = current_zxid();
 
         auto * request = dynamic_cast<Coordination::ZooKeeperSetWatchesRequest *>(zk_request.get());
 
-        std::lock_guard lock(watch_mutex);
-        for (String & path : request->data_watches)
-        {
-            LOG_TRACE(log, "Register data_watches for session {}, path {}, xid", toHexString(session_id), path, request->xid);
-            /// register watches
-            watches[path].emplace_back(session_id);
-            sessions_and_watchers[session_id].emplace(path);
+        /** Nodes are looked up without any lock, SetWatches is applied after the requests before it and before the
+          * ones after it, see RequestProcessor. As in ZooKeeper, a watch whose event happened since relative_zxid is
+          * answered by the event to this session only and not registered, the others are registered in bulk.
+          */
+        ResponsesForSessions events;
+        std::vector<HashedPath> data_paths;
+        std::vector<HashedPath> list_paths;
+        data_paths.reserve(request->data_watches.size() + request->exist_watches.size());
+        list_paths.reserve(request->list_watches.size());
+
+        auto add_event = [&](const HashedPath & path, Coordination::Event type)
+        {
+            auto watch_response = makePooledResponse<Coordination::ZooKeeperWatchResponse>();
+            watch_response->path = String(path.path);
+            watch_response->xid = Coordination::WATCH_XID;
+            watch_response->zxid = -1;
+            watch_response->type = type;
+            watch_response->state = Coordination::State::CONNECTED;
+            events.push_back(ResponseForSession{session_id, watch_response});
+        };
 
-            /// trigger watches
-            auto node = container.get(path);
+        for (const String & path : request->data_watches)
+        {
+            HashedPath hashed_path(path);
+            auto node = container.get(hashed_path);
             if (!node)
-            {
-                LOG_TRACE(log, "Trigger data_watches when processing SetWatch operation for session {}, path {}", toHexString(session_id), path);
-                auto watch_responses = processWatchesImpl(path, watches, list_watches, Coordination::Event::DELETED);
-                set_response(responses_queue, watch_responses, ignore_response);
-            }
+                add_event(hashed_path, Coordination::Event::DELETED);
             else if (node->stat.mzxid > request->relative_zxid)
-            {
-                LOG_TRACE(log, "Trigger data_watches when processing SetWatch operation for session {}, path {}", toHexString(session_id), path);
-                auto watch_responses = processWatchesImpl(path, watches, list_watches, Coordination::Event::CHANGED);
-                set_response(responses_queue, watch_responses, ignore_response);
-            }
+                add_event(hashed_path, Coordination::Event::CHANGED);
+            else
+                data_paths.push_back(hashed_path);
         }
 
-        for (String & path : request->exist_watches)
+        for (const String & path : request->exist_watches)
         {
-            LOG_TRACE(log, "Register exist_watches for session {}, path {}, xid", toHexString(session_id), path, request->xid);
-            /// register watches
-            watches[path].emplace_back(session_id);
-            sessions_and_watchers[session_id].emplace(path);
-
-            /// trigger watches
-            auto node = container.get(path);
-            if (node)
-            {
-                LOG_TRACE(log, "Trigger exist_watches when processing SetWatch operation for session {}, path {}", toHexString(session_id), path);
-                auto watch_responses = processWatchesImpl(path, watches, list_watches, Coordination::Event::CREATED);
-                set_response(responses_queue, watch_responses, ignore_response);
-            }
+            HashedPath hashed_path(path);
+            if (container.get(hashed_path))
+                add_event(hashed_path, Coordination::Event::CREATED);
+            else
+                data_paths.push_back(hashed_path);
         }
 
-        for (String & path : request->list_watches)
+        for (const String & path : request->list_watches)
         {
-            LOG_TRACE(log, "Register list_watches for session {}, path {}, xid", toHexString(session_id), path, request->xid);
-            /// register watches
-            list_watches[path].emplace_back(session_id);
-            sessions_and_watchers[session_id].emplace(path);
-
-            /// trigger watches
-            auto node = container.get(path);
-            if (node == nullptr)
-            {
-                LOG_TRACE(log, "Trigger list_watches when processing SetWatch operation for session {}, path {}", toHexString(session_id), path);
-                auto watch_responses = processWatchesImpl(path, watches, list_watches, Coordination::Event::DELETED);
-                set_response(responses_queue, watch_responses, ignore_response);
-            }
+            HashedPath hashed_path(path);
+            auto node = container.get(hashed_path);
+            if (!node)
+                add_event(hashed_path, Coordination::Event::DELETED);
             else if (node->stat.pzxid > request->relative_zxid)
-            {
-                LOG_TRACE(log, "Trigger list_watches when processing SetWatch operation for session {}, path {}", toHexString(session_id), path);
-                auto watch_responses = processWatchesImpl(path, watches, list_watches, Coordination::Event::CHILD);
-                set_response(responses_queue, watch_responses, ignore_response);
-            }
+                add_event(hashed_path, Coordination::Event::CHILD);
+            else
+                list_paths.push_back(hashed_path);
         }
 
+        watch_manager.addWatches(data_paths, session_id, WatchManager::DATA);
+        watch_manager.addWatches(list_paths, session_id, WatchManager::LIST);
+        LOG_DEBUG(
+            log,
+            "Set {} watches for session {}, {} of them triggered since zxid {}",
+            data_paths.size() + list_paths.size() + events.size(),
+            toHexString(session_id),
+            events.size(),
+            request->relative_zxid);
+        if (!events.empty())
+            set_response(responses_queue, events, ignore_response);
+
         /// no response for SetWatches request
         set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
     }
     else
     {
-        StoreRequestPtr store_request = NuKeeperWrapperFactory::instance().get(zk_request);
+        const auto & handler = getStoreRequestHandler(zk_request->getOpNum());
         Coordination::ZooKeeperResponsePtr response;
 
-        if (check_acl && !store_request->checkAuth(*this, session_id))
+        /// A retry of a committed write is answered as the first commit was, without changing the tree
+        bool idempotent = idempotency_cache.enabled() && IdempotencyCache::isCached(*zk_request);
+        UInt64 request_digest = idempotent ? IdempotencyCache::digestOf(*zk_request) : 0;
+        if (idempotent)
+        {
+            if (auto cached = idempotency_cache.find(session_id, *zk_request, request_digest))
+            {
+                /// The retry is a log entry of its own and takes a zxid anyway
+                if (!new_last_zxid)
+                    next_zxid();
+                cached->request_created_time_ms = time;
+                if (prepare_response_frames && !ignore_response && connected)
+                    cached->prepareFrame();
+                LOG_DEBUG(
+                    log, "Answer retried write of session {}, xid {} from the idempotency cache", toHexString(session_id), cached->xid);
+                set_response(responses_queue, ResponseForSession{session_id, cached}, ignore_response);
+                return;
+            }
+        }
+
+        if (check_acl && handler.check_auth && !handler.check_auth(*this, *zk_request, session_id))
         {
             response = zk_request->makeResponse();
             /// Original ZooKeeper always throws no auth, even when user provided some credentials
@@ -1497,13 +2243,27 @@ void KeeperStore::processRequest(
         }
         else
         {
-            response = store_request->process(*this, zxid, session_id, time).first;
+            response = handler.process(*this, *zk_request, current_zxid(), session_id, time, nullptr);
+        }
+
+        /// A read registering a new watch beyond the cap of the session fails as a whole
+        if (zk_request->isReadRequest() && zk_request->has_watch
+            && (response->error == Coordination::Error::ZOK
+                || (response->error == Coordination::Error::ZNONODE && zk_request->getOpNum() == Coordination::OpNum::Exists))
+            && !checkSessionWatches(session_id, zk_request->getPath(), watchTypeOf(*zk_request)))
+        {
+            response = zk_request->makeResponse();
+            response->error = Coordination::Error::ZQUOTAEXCEEDED;
         }
 
         response->request_created_time_ms = time;
 
         response->xid = zk_request->xid;
-        response->zxid = new_last_zxid ? zxid.load() : (shouldIncreaseZxid(zk_request) ? getZXID() : zxid.load());
+        response->zxid = new_last_zxid ? zxid.load() : (shouldIncreaseZxid(zk_request) ? next_zxid() : current_zxid());
+        if (idempotent)
+            idempotency_cache.add(session_id, *zk_request, request_digest, *response);
+        if (prepare_response_frames && !ignore_response && connected)
+            response->prepareFrame();
 
         //2^19 = 524,288
         if (container.size() << 45 == 0)
@@ -1532,19 +2292,16 @@ void KeeperStore::processRequest(
         {
             if (zk_request->has_watch)
             {
-                std::lock_guard lock(watch_mutex);
-
-                /// handle watch register, below 1 and 2 must be atomic
+                /// handle watch register, below 1 and 2 must be atomic, they are under the lock of the path
                 if (response->error == Coordination::Error::ZOK
                     || (response->error == Coordination::Error::ZNONODE && zk_request->getOpNum() == Coordination::OpNum::Exists))
                 {
                     /// 1. register watch
-                    auto & watches_type
-                    = zk_request->getOpNum() == Coordination::OpNum::List || zk_request->getOpNum() == Coordination::OpNum::SimpleList
-                        ? list_watches
-                        : watches;
-                    watches_type[zk_request->getPath()].emplace_back(session_id);
-                    sessions_and_watchers[session_id].emplace(zk_request->getPath());
+                    watch_manager.addWatch(zk_request->getPath(), session_id, watchTypeOf(*zk_request), [&]
+                    {
+                        /// 2. push response to queue
+                        set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
+                    });
 
                     LOG_TRACE(
                         log,
@@ -1556,8 +2313,10 @@ void KeeperStore::processRequest(
                         response->error,
                         Coordination::errorMessage(response->error));
                 }
-                /// 2. push response to queue
-                set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
+                else
+                {
+                    set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
+                }
             }
             else
             {
@@ -1567,167 +2326,866 @@ void KeeperStore::processRequest(
         }
         else
         {
+            /// handle watch trigger, watch responses are pushed under the lock of the watched path
+            if (response->error == Coordination::Error::ZOK && handler.process_watches)
             {
-                std::lock_guard lock(watch_mutex);
-
-                /// handle watch trigger, below 1 and 2 must be atomic
-                if (watches.contains(zk_request->getPath()) || list_watches.contains(parentPath(zk_request->getPath())))
+                handler.process_watches(*zk_request, *response, watch_manager, [&](const WatchResponses & watch_responses)
                 {
-                    if (response->error == Coordination::Error::ZOK)
+                    set_response(responses_queue, watch_responses, ignore_response);
+
+                    for (const auto & session_id_response : watch_responses)
                     {
-                        /// 1. trigger watch
-                        auto watch_responses = store_request->processWatches(watches, list_watches);
-
-                        /// 2. push watch response to queue
-                        set_response(responses_queue, watch_responses, ignore_response);
-
-                        for (auto & session_id_response : watch_responses)
-                        {
-                            auto * watch_response
-                                = dynamic_cast<Coordination::ZooKeeperWatchResponse *>(session_id_response.response.get());
-                            LOG_TRACE(
-                                log,
-                                "Processed watch, session {}, path {}, type {}, xid {} zxid {}",
-                                toHexString(session_id_response.session_id),
-                                watch_response->path,
-                                watch_response->type,
-                                watch_response->xid,
-                                watch_response->zxid);
-                        }
+                        auto * watch_response = dynamic_cast<Coordination::ZooKeeperWatchResponse *>(session_id_response.response.get());
+                        LOG_TRACE(
+                            log,
+                            "Processed watch, session {}, path {}, type {}, xid {} zxid {}",
+                            toHexString(session_id_response.session_id),
+                            watch_response->path,
+                            watch_response->type,
+                            watch_response->xid,
+                            watch_response->zxid);
                     }
-                }
+                });
             }
 
             /// push response to queue
-            set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response);
-
+            set_response(responses_queue, ResponseForSession{session_id, response}, ignore_response || !connected);
         }
     }
 }
 
 bool KeeperStore::updateSessionTimeout(int64_t session_id, int64_t /*session_timeout_ms*/)
 {
-    std::lock_guard lock(session_mutex);
-    if (!session_and_timeout.contains(session_id))
+    if (!session_table.touch(session_id))
     {
         LOG_WARNING(log, "Updating session timeout for {}, but it is already expired.", toHexString(session_id));
         return false;
     }
-    session_expiry_queue.addNewSessionOrUpdate(session_id, session_and_timeout[session_id]);
     LOG_INFO(log, "Updated session timeout for {}", toHexString(session_id));
     return true;
 }
 
+std::pair<int64_t, int64_t> KeeperStore::pinSnapshot()
+{
+    std::lock_guard pin_lock(snapshot_pin_mutex);
+    {
+        std::lock_guard lock(snapshot_versions_mutex);
+        snapshot_versions.clear();
+        pinned_digest = digest.load();
+        snapshot_pinned = true;
+    }
+    {
+        /// Kept if the last pinned paths were not taken, so that the next delta snapshot still has them
+        std::lock_guard lock(dirty_paths_mutex);
+        pinned_dirty_paths.merge(dirty_paths);
+        dirty_paths.clear();
+    }
+    idempotency_cache.pin(zxid.load());
+    return {zxid.load(), getSessionIDCounter()};
+}
+
+void KeeperStore::unpinSnapshot()
+{
+    std::unordered_map<String, std::shared_ptr<KeeperNode>> versions;
+    {
+        std::lock_guard lock(snapshot_versions_mutex);
+        snapshot_pinned = false;
+        versions.swap(snapshot_versions);
+    }
+    idempotency_cache.unpin();
+    LOG_INFO(log, "Unpin snapshot, reclaim {} superseded node versions", versions.size());
+}
+
+void KeeperStore::markDirty(const String & path)
+{
+    std::lock_guard lock(dirty_paths_mutex);
+    dirty_paths.insert(path);
+}
+
+void KeeperStore::markRemoved(const String & path)
+{
+    std::lock_guard lock(dirty_paths_mutex);
+    dirty_paths.insert(path);
+    dirty_paths.insert(parentPath(path));
+}
+
+std::unordered_set<String> KeeperStore::takeSnapshotDirtyPaths()
+{
+    std::lock_guard lock(dirty_paths_mutex);
+    std::unordered_set<String> paths;
+    paths.swap(pinned_dirty_paths);
+    if (!snapshot_pinned)
+    {
+        paths.merge(dirty_paths);
+        dirty_paths.clear();
+    }
+    return paths;
+}
+
+int64_t KeeperStore::pinExportView()
+{
+    std::lock_guard pin_lock(snapshot_pin_mutex);
+    std::lock_guard lock(snapshot_versions_mutex);
+    if (export_pins++ == 0)
+    {
+        export_versions.clear();
+        export_zxid = zxid.load();
+    }
+    return export_zxid;
+}
+
+void KeeperStore::unpinExportView()
+{
+    std::unordered_map<String, std::shared_ptr<KeeperNode>> versions;
+    {
+        std::lock_guard lock(snapshot_versions_mutex);
+        if (--export_pins == 0)
+            versions.swap(export_versions);
+    }
+    if (!versions.empty())
+        LOG_INFO(log, "Unpin export view, reclaim {} superseded node versions", versions.size());
+}
+
+std::shared_ptr<const KeeperNode> KeeperStore::getExportNode(const String & path)
+{
+    /// Get live node before checking versions, as getSnapshotNode
+    auto node = container.get(path);
+    std::lock_guard lock(snapshot_versions_mutex);
+    assert(export_pins);
+    auto it = export_versions.find(path);
+    return it != export_versions.end() ? it->second : node;
+}
+
+int32_t KeeperStore::permissionsOf(uint64_t acl_id, const Coordination::AuthIDs & auths) const
+{
+    return acl_id == 0 ? Coordination::ACL::All : sessionPermissions(acl_map.convertNumber(acl_id), auths);
+}
+
+bool KeeperStore::authOf(const String & scheme, const String & data, Coordination::AuthID & auth) const
+{
+    if (scheme != "digest" || std::count(data.begin(), data.end(), ':') != 1)
+        return false;
+
+    auto digest = generateDigest(data);
+    if (digest == super_digest)
+        auth = Coordination::AuthID{"super", ""};
+    else
+        auth = Coordination::AuthID{scheme, digest};
+    return true;
+}
+
+std::shared_ptr<KeeperNode> KeeperStore::getNodeForUpdate(const HashedPath & path)
+{
+    auto node = container.get(path);
+    if (!node || !versionsPinned())
+        return node;
+
+    std::lock_guard lock(snapshot_versions_mutex);
+    /// Copied if a view has the live node as its version, i.e. it was not copied since the view was pinned
+    bool preserved = false;
+    if (snapshot_pinned)
+        preserved |= snapshot_versions.try_emplace(String(path.path), node).second;
+    if (export_pins)
+        preserved |= export_versions.try_emplace(String(path.path), node).second;
+    if (!preserved)
+        return node;
+
+    auto copy = node->clone();
+    container.emplace(path, copy);
+    return copy;
+}
+
+void KeeperStore::preserveVersion(const HashedPath & path)
+{
+    if (!versionsPinned())
+        return;
+
+    std::lock_guard lock(snapshot_versions_mutex);
+    if (snapshot_pinned && !snapshot_versions.contains(String(path.path)))
+        snapshot_versions.emplace(String(path.path), container.get(path));
+    if (export_pins && !export_versions.contains(String(path.path)))
+        export_versions.emplace(String(path.path), container.get(path));
+}
+
+std::shared_ptr<const KeeperNode> KeeperStore::getSnapshotNode(const String & path)
+{
+    /// Get live node before checking versions, node changes record the version before changing the container.
+    auto node = container.get(path);
+    {
+        std::lock_guard lock(snapshot_versions_mutex);
+        if (snapshot_pinned)
+        {
+            auto it = snapshot_versions.find(path);
+            /// Not changed since pinned, the live node is the pinned version.
+            return it != snapshot_versions.end() ? it->second : node;
+        }
+    }
+
+    if (!node)
+        return nullptr;
+    std::shared_lock lock(node->getMutex());
+    return node->clone();
+}
+
 void KeeperStore::buildPathChildren(bool from_zk_snapshot)
 {
     LOG_INFO(log, "build path children in keeper storage {}", container.size());
-    /// build children
-    for (UInt32 block_idx = 0; block_idx < container.getBlockNum(); block_idx++)
+
+    /// Thread -> parent shard -> paths
+    std::vector<std::vector<std::vector<String>>> collected(
+        BUILD_CHILDREN_THREADS, std::vector<std::vector<String>>(BUILD_CHILDREN_THREADS));
+    auto collect = [](std::vector<std::vector<String>> & shard_paths)
+    {
+        return [&shard_paths](const String & path, const Container::SharedElement &)
+        { shard_paths[parentShardOf(path, shard_paths.size())].push_back(path); };
+    };
+
+    ThreadPool pool(BUILD_CHILDREN_THREADS);
+    if (container.isRadixTree())
     {
-        for (const auto& it : container.getMap(block_idx).getMap())
+        container.forEach(collect(collected[0]));
+    }
+    else
+    {
+        for (size_t thread = 0; thread < BUILD_CHILDREN_THREADS; ++thread)
         {
-            if (it.first == "/")
-               continue;
+            pool.scheduleOrThrowOnError([this, thread, &collected, &collect]
+            {
+                for (UInt32 block = thread; block < container.getBlockNum(); block += BUILD_CHILDREN_THREADS)
+                    container.getMap(block).forEach(collect(collected[thread]));
+            });
+        }
+        pool.wait();
+    }
+
+    /// Children of a parent are changed by the thread of its shard only
+    for (size_t shard = 0; shard < BUILD_CHILDREN_THREADS; ++shard)
+    {
+        pool.scheduleOrThrowOnError([this, shard, from_zk_snapshot, &collected]
+        {
+            for (auto & shard_paths : collected)
+            {
+                linkToParents(shard_paths[shard], from_zk_snapshot);
+                std::vector<String>().swap(shard_paths[shard]);
+            }
+        });
+    }
+    pool.wait();
+
+    recalculateMemoryStats();
+}
+
+size_t KeeperStore::parentShardOf(const String & path, size_t shards)
+{
+    return std::hash<std::string_view>{}(parentPathView(path)) % shards;
+}
+
+void KeeperStore::linkToParents(const std::vector<String> & paths, bool count_children)
+{
+    for (const auto & path : paths)
+    {
+        if (path == "/")
+            continue;
+
+        auto parent = container.get(parentPath(path));
+        if (parent == nullptr)
+            throw RK::Exception("Logical error: Build : can not find parent node " + path, ErrorCodes::LOGICAL_ERROR);
+        parent->children.insert(getBaseName(path));
+        if (count_children)
+            parent->stat.numChildren++;
+    }
+}
+
+void KeeperStore::recalculateMemoryStats()
+{
+    int64_t new_node_bytes = 0;
+    int64_t new_data_bytes = 0;
+    int64_t new_path_bytes = 0;
+    int64_t new_children_bytes = 0;
+    int64_t new_compression_saved_bytes = 0;
+    UInt64 new_digest = 0;
+    {
+        std::lock_guard lock(subtree_stats_mutex);
+        subtree_stats.clear();
+    }
+    {
+        std::lock_guard lock(node_expiry_mutex);
+        node_expiry.clear();
+    }
+    {
+        std::lock_guard lock(quotas_mutex);
+        quotas.clear();
+        has_quotas = false;
+    }
+    std::vector<std::pair<String, Container::SharedElement>> quota_limits;
+    container.forEach([&](const String & path, const Container::SharedElement & node)
+    {
+        if (path.starts_with(QUOTA_ROOT))
+            quota_limits.emplace_back(path, node);
+        new_node_bytes += NODE_ENTRY_BYTES;
+        new_path_bytes += path.size();
+        new_data_bytes += node->data.size();
+        new_compression_saved_bytes += node->data.savedBytes();
+        new_digest += nodeDigest(path, *node);
+        node->children.forEach([&new_children_bytes](const String & child) { new_children_bytes += childBytes(child); });
+        updateSubtreeStats(path, 1, node->data.size());
+        if (node->stat.ephemeralOwner != 0 && !node->is_ephemeral)
+            scheduleNodeExpiry(path, *node);
+    });
+    node_bytes = new_node_bytes;
+    data_bytes = new_data_bytes;
+    path_bytes = new_path_bytes;
+    children_bytes = new_children_bytes;
+    compression_saved_bytes = new_compression_saved_bytes;
+    digest = new_digest;
+
+    /// The usage of quotas is counted from the whole tree
+    for (const auto & [path, node] : quota_limits)
+        updateQuotaLimits(path, &node->data);
+}
 
-            auto parent_path = parentPath(it.first);
-            auto child_path = getBaseName(it.first);
-            auto parent = container.get(parent_path);
-            if (parent == nullptr)
+KeeperStore::ColdDataStats KeeperStore::compressColdData(UInt8 idle_passes)
+{
+    idle_passes = std::clamp<UInt8>(idle_passes, 1, NodeData::MAX_IDLE_PASSES);
+
+    struct Candidate
+    {
+        String path;
+        std::shared_ptr<KeeperNode> node;
+        bool compress;
+        int64_t mzxid = 0;
+        String value;
+    };
+    std::vector<Candidate> candidates;
+
+    /// Paths are copied for candidates only, a node is idle for idle_passes passes once and read since the last pass once
+    container.forEach([&](const String & path, const Container::SharedElement & node)
+    {
+        UInt8 state = node->data.markIdle();
+        UInt8 idle = NodeData::idlePassesOf(state);
+        if (!NodeData::isCompressed(state) && idle == idle_passes && node->data.size() >= NodeData::MIN_COMPRESS_BYTES)
+            candidates.push_back({path, node, true});
+        else if (NodeData::isCompressed(state) && idle == 1)
+            candidates.push_back({path, node, false});
+    });
+
+    for (auto & candidate : candidates)
+    {
+        String value;
+        {
+            std::shared_lock lock(candidate.node->getMutex());
+            candidate.mzxid = candidate.node->stat.mzxid;
+            if (candidate.compress == candidate.node->data.compressed())
+                continue;
+            candidate.node->data.copyTo(value);
+        }
+        if (!candidate.compress)
+            candidate.value = std::move(value);
+        else if (!NodeData::compress(value, candidate.value))
+            candidate.value.clear();
+    }
+
+    ColdDataStats stats;
+    for (size_t begin = 0; begin < candidates.size(); begin += COLD_DATA_BATCH_SIZE)
+    {
+        std::lock_guard pin_lock(snapshot_pin_mutex);
+        if (versionsPinned())
+            break;
+
+        size_t end = std::min(begin + COLD_DATA_BATCH_SIZE, candidates.size());
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto & candidate = candidates[i];
+            if (candidate.value.empty() || container.get(candidate.path) != candidate.node)
+                continue;
+
+            auto & node = *candidate.node;
+            std::lock_guard lock(node.getMutex());
+            /// Changed since the value was copied, or read if it is to be compressed
+            if (node.stat.mzxid != candidate.mzxid || candidate.compress == node.data.compressed()
+                || (candidate.compress && node.data.idlePasses() < idle_passes))
+                continue;
+
+            size_t saved_bytes = node.data.savedBytes();
+            if (candidate.compress)
             {
-                throw RK::Exception("Logical error: Build : can not find parent node " + it.first, ErrorCodes::LOGICAL_ERROR);
+                node.data.setCompressed(std::move(candidate.value));
+                compression_saved_bytes += node.data.savedBytes();
+                ++stats.compressed;
             }
             else
             {
-                parent->children.insert(child_path);
-                if (from_zk_snapshot)
-                    parent->stat.numChildren++;
+                node.data.setDecompressed(std::move(candidate.value));
+                compression_saved_bytes -= saved_bytes;
+                ++stats.decompressed;
             }
         }
     }
+    return stats;
+}
 
+UInt64 KeeperStore::nodeDigest(const String & path, const KeeperNode & node)
+{
+    SipHash hash;
+    hash.update(path.size());
+    hash.update(path);
+    String buf;
+    hash.update(node.data.size());
+    hash.update(node.data.get(buf));
+    const auto & stat = node.stat;
+    hash.update(stat.czxid);
+    hash.update(stat.mzxid);
+    hash.update(stat.ctime);
+    hash.update(stat.mtime);
+    hash.update(stat.version);
+    hash.update(stat.aversion);
+    hash.update(stat.ephemeralOwner);
+    return hash.get64();
 }
 
-void KeeperStore::clearDeadWatches(int64_t session_id)
+void KeeperStore::updateSubtreeStats(const String & path, int64_t count_delta, int64_t bytes_delta)
 {
-    LOG_DEBUG(log, "Clear dead watches, session {}", toHexString(session_id));
-    //    std::lock_guard session_lock(session_mutex);
-    std::lock_guard watch_lock(watch_mutex);
-    auto watches_it = sessions_and_watchers.find(session_id);
-    if (watches_it != sessions_and_watchers.end())
+    if (subtree_stats_depth == 0 || path == "/")
+        return;
+
+    auto apply = [&](const String & ancestor)
     {
-        for (const auto & watch_path : watches_it->second)
+        auto & stats = subtree_stats[ancestor];
+        stats.node_count += count_delta;
+        stats.data_bytes += bytes_delta;
+        if (stats.node_count == 0)
+            subtree_stats.erase(ancestor);
+    };
+
+    std::lock_guard lock(subtree_stats_mutex);
+    apply("/");
+
+    /// Ancestors "/a", "/a/b" ... of depth 1 to subtree_stats_depth, path itself excluded.
+    size_t pos = 0;
+    for (UInt64 depth = 1; depth <= subtree_stats_depth; ++depth)
+    {
+        pos = path.find('/', pos + 1);
+        if (pos == String::npos)
+            break;
+        apply(path.substr(0, pos));
+    }
+}
+
+bool KeeperStore::getSubtreeStats(const String & path, SubtreeStats & stats)
+{
+    if (!container.get(path))
+        return false;
+
+    stats = {};
+    auto depth = path == "/" ? 0 : std::count(path.begin(), path.end(), '/');
+    if (subtree_stats_depth != 0 && static_cast<UInt64>(depth) <= subtree_stats_depth)
+    {
+        std::lock_guard lock(subtree_stats_mutex);
+        auto it = subtree_stats.find(path);
+        if (it != subtree_stats.end())
+            stats = it->second;
+        return true;
+    }
+
+    /// Not indexed, walk the subtree
+    std::vector<String> paths{path};
+    while (!paths.empty())
+    {
+        String current = std::move(paths.back());
+        paths.pop_back();
+        auto node = container.get(current);
+        if (!node)
+            continue;
+
+        std::shared_lock r_lock(node->getMutex());
+        if (current != path)
+        {
+            ++stats.node_count;
+            stats.data_bytes += node->data.size();
+        }
+        node->children.forEach([&](const String & child) { paths.push_back(childPath(current, child)); });
+    }
+    return true;
+}
+
+std::map<String, KeeperStore::SubtreeStats> KeeperStore::getIndexedSubtreeStats() const
+{
+    std::lock_guard lock(subtree_stats_mutex);
+    return {subtree_stats.begin(), subtree_stats.end()};
+}
+
+/// Call f for "/", every ancestor of path and path itself
+template <typename F>
+static void forEachPathPrefix(const String & path, F && f)
+{
+    f(String("/"));
+    if (path == "/")
+        return;
+    size_t pos = 0;
+    while (pos != String::npos)
+    {
+        pos = path.find('/', pos + 1);
+        f(path.substr(0, pos));
+    }
+}
+
+void KeeperStore::updateQuotas(const String & path, int64_t count_delta, int64_t bytes_delta)
+{
+    if (!has_quotas.load(std::memory_order_relaxed))
+        return;
+
+    std::lock_guard lock(quotas_mutex);
+    forEachPathPrefix(path, [&](const String & prefix)
+    {
+        auto it = quotas.find(prefix);
+        if (it == quotas.end())
+            return;
+        it->second.node_count += count_delta;
+        it->second.data_bytes += bytes_delta;
+    });
+}
+
+bool KeeperStore::checkQuotas(const String & path, int64_t count_delta, int64_t bytes_delta) const
+{
+    if (!has_quotas.load(std::memory_order_relaxed) || (count_delta <= 0 && bytes_delta <= 0))
+        return true;
+
+    bool within = true;
+    std::lock_guard lock(quotas_mutex);
+    forEachPathPrefix(path, [&](const String & prefix)
+    {
+        auto it = quotas.find(prefix);
+        if (it == quotas.end())
+            return;
+        const auto & quota = it->second;
+        if ((count_delta > 0 && quota.count_limit >= 0 && quota.node_count + count_delta > quota.count_limit)
+            || (bytes_delta > 0 && quota.bytes_limit >= 0 && quota.data_bytes + bytes_delta > quota.bytes_limit))
+            within = false;
+    });
+    return within;
+}
+
+void KeeperStore::updateQuotaLimits(const String & path, const NodeData * data)
+{
+    const size_t root_size = QUOTA_ROOT.size();
+    const size_t limits_size = QUOTA_LIMITS_NODE.size();
+    if (!path.starts_with(QUOTA_ROOT) || !path.ends_with(QUOTA_LIMITS_NODE) || path.size() < root_size + limits_size + 1
+        || path[path.size() - limits_size - 1] != '/')
+        return;
+
+    String quota_path = path.substr(root_size, path.size() - root_size - limits_size - 1);
+    if (quota_path.empty())
+        quota_path = "/";
+    else if (quota_path[0] != '/')
+        return;
+
+    if (!data)
+    {
+        std::lock_guard lock(quotas_mutex);
+        quotas.erase(quota_path);
+        has_quotas = !quotas.empty();
+        return;
+    }
+
+    /// "count=-1,bytes=-1,countHardLimit=N,bytesHardLimit=M", fields not parsed are no limit
+    Quota limits;
+    String buf;
+    std::vector<String> fields;
+    boost::split(fields, data->get(buf), boost::is_any_of(","));
+    for (const auto & field : fields)
+    {
+        auto equal = field.find('=');
+        if (equal == String::npos)
+            continue;
+        String key = field.substr(0, equal);
+        int64_t value = -1;
+        try
+        {
+            value = std::stoll(field.substr(equal + 1));
+        }
+        catch (const std::logic_error &)
+        {
+            continue;
+        }
+        if (key == "countHardLimit")
+            limits.count_limit = value;
+        else if (key == "bytesHardLimit")
+            limits.bytes_limit = value;
+    }
+
+    {
+        std::lock_guard lock(quotas_mutex);
+        auto it = quotas.find(quota_path);
+        if (it != quotas.end())
         {
-            auto watch = watches.find(watch_path);
-            if (watch != watches.end())
+            it->second.count_limit = limits.count_limit;
+            it->second.bytes_limit = limits.bytes_limit;
+            return;
+        }
+    }
+
+    /// A new quota, path and its descendants are counted
+    SubtreeStats stats;
+    if (auto node = container.get(quota_path); node && getSubtreeStats(quota_path, stats))
+    {
+        std::shared_lock r_lock(node->getMutex());
+        limits.node_count = stats.node_count + 1;
+        limits.data_bytes = stats.data_bytes + node->data.size();
+    }
+    std::lock_guard lock(quotas_mutex);
+    quotas.emplace(quota_path, limits);
+    has_quotas = true;
+}
+
+std::map<String, KeeperStore::Quota> KeeperStore::getQuotas() const
+{
+    std::lock_guard lock(quotas_mutex);
+    return {quotas.begin(), quotas.end()};
+}
+
+size_t KeeperStore::shrinkContainers()
+{
+    size_t shrunk = 0;
+    for (UInt32 i = 0; i < container.getBlockNum(); ++i)
+        shrunk += container.getMap(i).shrink();
+    for (auto * bodies : {&cached_get_bodies, &cached_list_bodies})
+        for (UInt32 i = 0; i < bodies->getBlockNum(); ++i)
+            shrunk += bodies->getMap(i).shrink();
+    return shrunk + watch_manager.shrink();
+}
+
+KeeperStore::MemoryStats KeeperStore::getMemoryStats() const
+{
+    MemoryStats stats{};
+    stats.node_bytes = node_bytes.load(std::memory_order_relaxed);
+    stats.compression_saved_bytes = compression_saved_bytes.load(std::memory_order_relaxed);
+    stats.data_bytes = data_bytes.load(std::memory_order_relaxed) - stats.compression_saved_bytes;
+    stats.path_bytes = path_bytes.load(std::memory_order_relaxed);
+    stats.children_bytes = children_bytes.load(std::memory_order_relaxed);
+
+    stats.watch_bytes = watch_manager.sizeInBytes();
+    stats.acl_bytes = acl_map.sizeInBytes();
+    return stats;
+}
+
+void KeeperStore::closeSession(int64_t session_id, ResponsesForSessions & watch_responses)
+{
+    {
+        auto append_responses = [&](const WatchResponses & responses)
+        { watch_responses.insert(watch_responses.end(), responses.begin(), responses.end()); };
+
+        /// Taken out at once, no lock is held while the nodes are removed
+        auto ephemeral_paths = ephemerals.take(session_id);
+        if (ephemeral_paths.empty())
+            LOG_DEBUG(log, "Session {} already closed, must applying a fuzzy log.", toHexString(session_id));
+
+        /// Child watches of a parent fire once for all its ephemeral nodes
+        std::unordered_set<String> parent_paths;
+        for (const auto & ephemeral_path : ephemeral_paths)
+        {
+            LOG_TRACE(log, "Disconnect session {}, deleting its ephemeral node {}", toHexString(session_id), ephemeral_path);
+            auto parent_path = parentPath(ephemeral_path);
+            auto parent = getNodeForUpdate(parent_path);
+            if (!parent)
             {
-                auto & watches_for_path = watch->second;
-                for (auto w_it = watches_for_path.begin(); w_it != watches_for_path.end();)
-                {
-                    if (*w_it == session_id)
-                        w_it = watches_for_path.erase(w_it);
-                    else
-                        ++w_it;
-                }
-                if (watches_for_path.empty())
-                    watches.erase(watch);
+                LOG_ERROR(
+                    log,
+                    "Logical error, disconnect session {}, ephemeral znode parent not exist {}",
+                    toHexString(session_id),
+                    ephemeral_path);
             }
+            else
+            {
+                std::lock_guard parent_lock(parent->getMutex());
+                --parent->stat.numChildren;
+                parent->children.erase(getBaseName(ephemeral_path));
+                onChildRemoved(getBaseName(ephemeral_path));
+                scheduleNodeExpiry(parent_path, *parent);
+            }
+            if (auto node = container.get(ephemeral_path))
+                onNodeRemoved(ephemeral_path, *node);
+            preserveVersion(ephemeral_path);
+            container.erase(ephemeral_path);
+            eraseCachedResponseBodies(ephemeral_path);
+
+            processWatchesImpl(ephemeral_path, watch_manager, Coordination::Event::DELETED, append_responses, false);
+            parent_paths.insert(std::move(parent_path));
+        }
+        for (const auto & parent_path : parent_paths)
+            processWatchesImpl(parent_path, watch_manager, Coordination::Event::CHILD, append_responses);
+
+        clearDeadWatches(session_id);
+    }
+
+    {
+        std::lock_guard lock(session_mutex);
+        session_table.remove(session_id);
+        LOG_INFO(log, "Process close session {}, total sessions {}", toHexString(session_id), session_table.size());
+    }
+
+    {
+        std::lock_guard lock(auth_mutex);
+        session_and_auth.erase(session_id);
+        acl_permissions.erase(session_id);
+    }
+
+    idempotency_cache.erase(session_id);
+}
+
+void KeeperStore::scheduleNodeExpiry(const String & path, const KeeperNode & node)
+{
+    auto owner = node.stat.ephemeralOwner;
+    bool is_ttl = EphemeralType::isTTL(owner);
+    if (!is_ttl && !EphemeralType::isContainer(owner))
+        return;
+
+    std::lock_guard lock(node_expiry_mutex);
+    if (!node.children.empty())
+        node_expiry.remove(path);
+    else if (is_ttl)
+        node_expiry.update(path, node.stat.mtime + EphemeralType::ttlOf(owner));
+    else if (node.stat.cversion > 0)
+        node_expiry.update(path, 0);
+    else
+        node_expiry.remove(path);
+}
+
+void KeeperStore::unscheduleNodeExpiry(const String & path)
+{
+    std::lock_guard lock(node_expiry_mutex);
+    node_expiry.remove(path);
+}
+
+std::vector<String> KeeperStore::getExpiredNodes(size_t max_count)
+{
+    /// Collected again if the removal is not applied meanwhile, e.g. the leader changed
+    static constexpr int64_t RETRY_AFTER_MS = 1000;
+
+    std::lock_guard lock(node_expiry_mutex);
+    return node_expiry.getExpired(ISessionExpiryQueue::getNowMilliseconds(), max_count, RETRY_AFTER_MS);
+}
+
+void KeeperStore::removeExpiredNodes(
+    const std::vector<String> & paths, int64_t remove_zxid, int64_t time, ResponsesForSessions & watch_responses)
+{
+    size_t removed = 0;
+    for (const auto & path : paths)
+    {
+        auto node = container.get(path);
+        if (!node)
+        {
+            unscheduleNodeExpiry(path);
+            continue;
+        }
+
+        /// The leader found it by an index which may be stale, check it again
+        auto owner = node->stat.ephemeralOwner;
+        bool expired;
+        {
+            std::shared_lock r_lock(node->getMutex());
+            if (!node->children.empty())
+                expired = false;
+            else if (EphemeralType::isContainer(owner))
+                expired = node->stat.cversion > 0;
+            else if (EphemeralType::isTTL(owner))
+                expired = time >= node->stat.mtime + EphemeralType::ttlOf(owner);
+            else
+                expired = false;
+
+            if (!expired)
+                scheduleNodeExpiry(path, *node);
+        }
+        if (!expired)
+        {
+            /// The path is a node of another kind now
+            if (owner == 0 || node->is_ephemeral)
+                unscheduleNodeExpiry(path);
+            continue;
+        }
+
+        LOG_TRACE(log, "Remove expired {} node {}", EphemeralType::isContainer(owner) ? "container" : "TTL", path);
+        removeNode(*this, path, *node, remove_zxid);
+        processWatchesImpl(
+            path,
+            watch_manager,
+            Coordination::Event::DELETED,
+            [&](const WatchResponses & responses)
+            { watch_responses.insert(watch_responses.end(), responses.begin(), responses.end()); });
+        ++removed;
+    }
+    LOG_DEBUG(log, "Removed {} of {} expired nodes", removed, paths.size());
+}
 
-            auto list_watch = list_watches.find(watch_path);
-            if (list_watch != list_watches.end())
+void KeeperStore::cacheResponseBody(
+    ResponseBodies & bodies, const String & path, const Coordination::Stat & stat, Coordination::ZooKeeperResponse & response)
+{
+    if (cached_get_bodies.size() + cached_list_bodies.size() >= response_cache_max_paths && !clearing_response_cache.exchange(true))
+    {
+        /// Hot paths are cached again by their next reads
+        for (auto * cache : {&cached_get_bodies, &cached_list_bodies})
+        {
+            for (UInt32 i = 0; i < cache->getBlockNum(); ++i)
             {
-                auto & list_watches_for_path = list_watch->second;
-                for (auto w_it = list_watches_for_path.begin(); w_it != list_watches_for_path.end();)
-                {
-                    if (*w_it == session_id)
-                        w_it = list_watches_for_path.erase(w_it);
-                    else
-                        ++w_it;
-                }
-                if (list_watches_for_path.empty())
-                    list_watches.erase(list_watch);
+                std::vector<String> paths;
+                cache->getMap(i).forEach([&paths](const String & cached_path, const auto &) { paths.push_back(cached_path); });
+                for (const auto & cached_path : paths)
+                    cache->getMap(i).erase(cached_path);
             }
         }
-        sessions_and_watchers.erase(watches_it);
+        clearing_response_cache.store(false);
     }
+
+    auto cached = std::make_shared<CachedResponseBody>();
+    cached->stat = stat;
+    WriteBufferFromOwnString buf;
+    response.writeImpl(buf);
+    cached->body = std::move(buf.str());
+    bodies.emplace(path, cached);
+    response.body = std::shared_ptr<const String>(cached, &cached->body);
+}
+
+void KeeperStore::eraseCachedResponseBodies(const String & path)
+{
+    if (!response_cache_max_paths)
+        return;
+    cached_get_bodies.erase(path);
+    cached_list_bodies.erase(path);
+}
+
+void KeeperStore::clearDeadWatches(int64_t session_id)
+{
+    LOG_DEBUG(log, "Clear dead watches, session {}", toHexString(session_id));
+    watch_manager.removeSession(session_id);
 }
 
-void KeeperStore::dumpWatches(WriteBufferFromOwnString & buf) const
+void KeeperStore::dumpWatches(WriteBuffer & buf) const
 {
-//    std::lock_guard session_lock(session_mutex);
-    std::lock_guard lock(watch_mutex);
-    for (const auto & [session_id, watches_paths] : sessions_and_watchers)
+    watch_manager.forEachSession([&buf](int64_t session_id, const std::vector<String> & watches_paths)
     {
         buf << toHexString(session_id) << "\n";
         for (const String & path : watches_paths)
             buf << "\t" << path << "\n";
-    }
+    });
 }
 
-void KeeperStore::dumpWatchesByPath(WriteBufferFromOwnString & buf) const
+void KeeperStore::dumpWatchesByPath(WriteBuffer & buf) const
 {
-    auto write_int_vec = [&buf](const std::vector<int64_t> & session_ids)
+    auto write_path = [&buf](const String & watch_path, const std::vector<int64_t> & session_ids)
     {
+        buf << watch_path << "\n";
         for (int64_t session_id : session_ids)
         {
             buf << "\t" << toHexString(session_id) << "\n";
         }
     };
 
-    std::lock_guard lock(watch_mutex);
-    for (const auto & [watch_path, sessions] : watches)
-    {
-        buf << watch_path << "\n";
-        write_int_vec(sessions);
-    }
-
-    for (const auto & [watch_path, sessions] : list_watches)
-    {
-        buf << watch_path << "\n";
-        write_int_vec(sessions);
-    }
+    watch_manager.forEachPath(WatchManager::DATA, write_path);
+    watch_manager.forEachPath(WatchManager::LIST, write_path);
+    watch_manager.forEachPath(WatchManager::PERSISTENT, write_path);
+    watch_manager.forEachPath(WatchManager::PERSISTENT_RECURSIVE, write_path);
 }
 
-void KeeperStore::dumpSessionsAndEphemerals(WriteBufferFromOwnString & buf) const
+void KeeperStore::dumpSessionsAndEphemerals(WriteBuffer & buf) const
 {
     auto write_str_set = [&buf](const std::unordered_set<String> & ephemeral_paths)
     {
@@ -1738,7 +3196,7 @@ void KeeperStore::dumpSessionsAndEphemerals(WriteBufferFromOwnString & buf) cons
     };
 
     {
-        std::lock_guard lock(session_mutex);
+        auto session_and_timeout = session_table.getSessionAndTimeout();
         buf << "Sessions dump (" << session_and_timeout.size() << "):\n";
         for (const auto & [session_id, _] : session_and_timeout)
         {
@@ -1746,55 +3204,110 @@ void KeeperStore::dumpSessionsAndEphemerals(WriteBufferFromOwnString & buf) cons
         }
     }
 
-    std::lock_guard lock(ephemerals_mutex);
-    buf << "Sessions with Ephemerals (" << getSessionWithEphemeralNodesCount() << "):\n";
-    for (const auto & [session_id, ephemeral_paths] : ephemerals)
+    buf << "Sessions with Ephemerals (" << ephemerals.size() << "):\n";
+    ephemerals.forEach([&](int64_t session_id, const EphemeralIndex::Paths & ephemeral_paths)
     {
         buf << toHexString(session_id) << "\n";
         write_str_set(ephemeral_paths);
-    }
+    });
 }
 
 uint64_t KeeperStore::getTotalWatchesCount() const
 {
-    std::lock_guard lock(watch_mutex);
-    uint64_t ret = 0;
-    for (const auto & [path, subscribed_sessions] : watches)
-        ret += subscribed_sessions.size();
+    return watch_manager.watchCount();
+}
 
-    for (const auto & [path, subscribed_sessions] : list_watches)
-        ret += subscribed_sessions.size();
+uint64_t KeeperStore::getSessionsWithWatchesCount() const
+{
+    return watch_manager.sessionCount();
+}
 
-    return ret;
+uint64_t KeeperStore::getTotalEphemeralNodesCount() const
+{
+    return ephemerals.nodeCount();
 }
 
-uint64_t KeeperStore::getSessionsWithWatchesCount() const
+bool KeeperStore::checkSessionEphemerals(int64_t session_id) const
 {
-    std::lock_guard lock(watch_mutex);
-    std::unordered_set<int64_t> counter;
-    for (const auto & [path, subscribed_sessions] : watches)
-        counter.insert(subscribed_sessions.begin(), subscribed_sessions.end());
+    if (!session_limits.max_ephemerals || ephemerals.count(session_id) < session_limits.max_ephemerals)
+        return true;
+    LOG_WARNING(
+        log, "Session {} has {} ephemeral nodes, reject creating more of them", toHexString(session_id), session_limits.max_ephemerals);
+    return false;
+}
 
-    for (const auto & [path, subscribed_sessions] : list_watches)
-        counter.insert(subscribed_sessions.begin(), subscribed_sessions.end());
+bool KeeperStore::checkSessionWatches(int64_t session_id, const String & path, WatchManager::WatchType type) const
+{
+    if (!session_limits.max_watches || watch_manager.sessionWatchCount(session_id) < session_limits.max_watches
+        || watch_manager.hasWatch(path, session_id, type))
+        return true;
+    LOG_WARNING(log, "Session {} has {} watches, reject registering more of them", toHexString(session_id), session_limits.max_watches);
+    return false;
+}
 
-    return counter.size();
+namespace
+{
+    std::vector<KeeperStore::SessionUsage> topByCount(std::vector<KeeperStore::SessionUsage> usage, size_t limit)
+    {
+        auto by_count = [](const auto & lhs, const auto & rhs) { return lhs.count > rhs.count; };
+        if (usage.size() > limit)
+        {
+            std::nth_element(usage.begin(), usage.begin() + limit, usage.end(), by_count);
+            usage.resize(limit);
+        }
+        std::sort(usage.begin(), usage.end(), by_count);
+        return usage;
+    }
 }
 
-uint64_t KeeperStore::getTotalEphemeralNodesCount() const
+std::vector<KeeperStore::SessionUsage> KeeperStore::getTopWatchSessions(size_t limit) const
 {
-    std::lock_guard lock(ephemerals_mutex);
-    uint64_t ret = 0;
-    for (const auto & [session_id, nodes] : ephemerals)
-        ret += nodes.size();
+    return topByCount(watch_manager.getSessionsUsage(), limit);
+}
 
-    return ret;
+std::vector<KeeperStore::SessionUsage> KeeperStore::getTopEphemeralSessions(size_t limit) const
+{
+    std::vector<SessionUsage> usage;
+    ephemerals.forEach([&](int64_t session_id, const EphemeralIndex::Paths & paths)
+    {
+        size_t bytes = 0;
+        for (const auto & path : paths)
+            bytes += path.size();
+        usage.push_back(SessionUsage{session_id, paths.size(), bytes});
+    });
+    return topByCount(std::move(usage), limit);
 }
 
 bool KeeperStore::containsSession(int64_t session_id) const
 {
-    std::lock_guard lock(session_mutex);
-    return session_and_timeout.contains(session_id);
+    return session_table.contains(session_id);
+}
+
+KeeperStore::SessionWatches KeeperStore::getSessionWatches(int64_t session_id)
+{
+    SessionWatches result;
+    for (auto & [path, type] : watch_manager.getSessionWatches(session_id))
+    {
+        switch (type)
+        {
+            case WatchManager::DATA:
+                if (container.get(HashedPath(path)))
+                    result.data_watches.push_back(std::move(path));
+                else
+                    result.exist_watches.push_back(std::move(path));
+                break;
+            case WatchManager::LIST:
+                result.list_watches.push_back(std::move(path));
+                break;
+            case WatchManager::PERSISTENT:
+                result.persistent_watches.push_back(std::move(path));
+                break;
+            case WatchManager::PERSISTENT_RECURSIVE:
+                result.persistent_recursive_watches.push_back(std::move(path));
+                break;
+        }
+    }
+    return result;
 }
 
 }
@@ -1,41 +1,70 @@
 #pragma once
 
 #include <functional>
+#include <map>
+#include <shared_mutex>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <IO/Operators.h>
 #include <IO/WriteBufferFromString.h>
 #include <Service/ACLMap.h>
-#include <Service/SessionExpiryQueue.h>
+#include <Service/ACLPermissionCache.h>
+#include <Service/ChildrenSet.h>
+#include <Service/ConcurrentPathTrie.h>
+#include <Service/EphemeralIndex.h>
+#include <Service/EphemeralType.h>
+#include <Service/EpochReclaimer.h>
+#include <Service/HashedPath.h>
+#include <Service/IdempotencyCache.h>
+#include <Service/NodeData.h>
+#include <Service/NodeExpiryWheel.h>
+#include <Service/NodeMutex.h>
+#include <Service/RequestArena.h>
+#include <Service/RequestTrace.h>
+#include <Service/SessionTable.h>
+#include <Service/Settings.h>
+#include <Service/SlabAllocator.h>
 #include <Service/ThreadSafeQueue.h>
+#include <Service/WatchManager.h>
 #include <Service/formatHex.h>
 #include <Poco/Logger.h>
 #include <Common/ConcurrentBoundedQueue.h>
+#include <Common/ProfilingMutex.h>
 #include <Common/ThreadPool.h>
 #include <Common/ZooKeeper/IKeeper.h>
 #include <Common/ZooKeeper/ZooKeeperCommon.h>
 #include <common/logger_useful.h>
 
+namespace nuraft
+{
+class buffer;
+}
+
 namespace RK
 {
-struct StoreRequest;
-using StoreRequestPtr = std::shared_ptr<StoreRequest>;
 using ResponseCallback = std::function<void(const Coordination::ZooKeeperResponsePtr &)>;
-using ChildrenSet = std::unordered_set<std::string>;
 
 struct KeeperNode
 {
-    String data;
+    NodeData data;
     uint64_t acl_id = 0; /// 0 -- no ACL by default
     bool is_ephemeral = false;
     bool is_sequental = false;
     Coordination::Stat stat{};
     ChildrenSet children{};
-    std::shared_mutex mutex;
+
+    /// Nodes do not own a mutex, they share a fixed pool of mutexes striped by node address.
+    /// No code path holds two node locks at the same time, so sharing can not dead lock.
+    NodeMutex & getMutex() const;
+
+    /// Nodes are allocated from SlabPool, node and shared_ptr control block share one slab object.
+    static std::shared_ptr<KeeperNode> create() { return std::allocate_shared<KeeperNode>(SlabAllocator<KeeperNode>()); }
+
     std::shared_ptr<KeeperNode> clone() const
     {
-        auto node = std::make_shared<KeeperNode>();
+        auto node = create();
         node->data = data;
         node->acl_id = acl_id;
         node->is_ephemeral = is_ephemeral;
@@ -58,6 +87,12 @@ struct KeeperNode
         return stat_view;
     }
 
+    /** Same as statForResponse, read without locking the node as a seqlock on the sequence of its mutex, for Exists
+     * and Check. numChildren is taken from stat, which counts the children too, because children may be reallocated
+     * by a writer meanwhile. Takes the shared lock if writers of the stripe keep it busy.
+     */
+    Coordination::Stat readStat() const;
+
     bool operator==(const KeeperNode & rhs) const
     {
         return data == rhs.data && acl_id == rhs.acl_id
@@ -65,98 +100,377 @@ struct KeeperNode
     }
     bool operator!=(const KeeperNode & rhs) const { return !(rhs == *this); }
 
-    /// Object memory size
+    /// Object memory size, include heap memory of data and children
     uint64_t sizeInBytes() const;
 };
 
-template <typename Element, unsigned NumBlocks>
+/** Hash map sharded into a power of two blocks, chosen at construction.
+ *
+ * Reads are lock free: a block is a chained hash table whose buckets and links are atomic pointers,
+ * readers walk it inside an EpochGuard. Writers of a block are serialized by its mutex and never
+ * change a published entry, they link a new entry and retire the replaced one to EpochReclaimer.
+ * Rehash builds a new table and retires the old one as a whole, it doubles the buckets when they are full and
+ * shrink gives them back when erases left the block sparse.
+ *
+ * Keys are hashed by HashedPath, an entry keeps its hash, so lookups compare hashes before keys and rehash
+ * does not hash the keys again. The block is picked by the high bits of the hash and the bucket by the low bits.
+ * Every block has cache lines of its own, and the table pointer read by readers does not share a line with
+ * what writers of the block change.
+ */
+template <typename Element>
 class ConcurrentMap
 {
 public:
     using SharedElement = std::shared_ptr<Element>;
-    using ElementMap = std::unordered_map<std::string, SharedElement>;
     using Action = std::function<void(const String &, const SharedElement &)>;
 
-    class InnerMap
+    static constexpr UInt32 DEFAULT_BLOCK_NUM = 16;
+
+    class alignas(64) InnerMap
     {
-    public:
-        SharedElement get(std::string const & key)
+    private:
+        struct Entry
         {
-            std::shared_lock rlock(mut_);
-            auto i = map_.find(key);
-            return (i != map_.end()) ? i->second : nullptr;
+            Entry(std::string_view key_, size_t hash_, const SharedElement & value_, Entry * next_)
+                : key(key_), hash(hash_), value(value_), next(next_)
+            {
+            }
+
+            const String key;
+            const size_t hash;
+            const SharedElement value;
+            /// Not owned, an unlinked entry is freed alone and its successors are untouched
+            std::atomic<Entry *> next;
+        };
+
+        struct Table
+        {
+            explicit Table(size_t bucket_count_) : bucket_count(bucket_count_), buckets(new std::atomic<Entry *>[bucket_count_])
+            {
+                for (size_t i = 0; i < bucket_count; ++i)
+                    buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
+
+            ~Table()
+            {
+                for (size_t i = 0; i < bucket_count; ++i)
+                {
+                    Entry * entry = buckets[i].load(std::memory_order_relaxed);
+                    while (entry)
+                    {
+                        Entry * next = entry->next.load(std::memory_order_relaxed);
+                        delete entry;
+                        entry = next;
+                    }
+                }
+            }
+
+            std::atomic<Entry *> & bucket(size_t hash) { return buckets[hash & (bucket_count - 1)]; }
+
+            const size_t bucket_count;
+            std::unique_ptr<std::atomic<Entry *>[]> buckets;
+        };
+
+        static constexpr size_t INITIAL_BUCKET_COUNT = 64;
+        /// shrink rehashes a block with fewer elements than 1 / SHRINK_LOAD_FACTOR of its buckets
+        static constexpr size_t SHRINK_LOAD_FACTOR = 8;
+
+        static size_t bucketHash(std::string_view key) { return HashedPath::hashOf(key); }
+
+        static bool matches(const Entry & entry, std::string_view key, size_t hash) { return entry.hash == hash && entry.key == key; }
+
+        const Entry * find(std::string_view key, size_t hash) const
+        {
+            const Entry * entry = table.load(std::memory_order_acquire)->bucket(hash).load(std::memory_order_acquire);
+            while (entry && !matches(*entry, key, hash))
+                entry = entry->next.load(std::memory_order_acquire);
+            return entry;
         }
-        bool emplace(std::string const & key, SharedElement && value)
+
+        /// Insert or assign, writers hold write_mutex.
+        bool emplaceImpl(std::string_view key, size_t hash, const SharedElement & value)
         {
-            std::unique_lock wlock(mut_);
-            auto [_, created] = map_.insert_or_assign(key, std::forward<SharedElement>(value));
-            return created;
+            std::lock_guard lock(write_mutex);
+            Table * current = table.load(std::memory_order_relaxed);
+            auto & head = current->bucket(hash);
+
+            for (std::atomic<Entry *> * link = &head; Entry * entry = link->load(std::memory_order_relaxed); link = &entry->next)
+            {
+                if (matches(*entry, key, hash))
+                {
+                    link->store(new Entry(key, hash, value, entry->next.load(std::memory_order_relaxed)), std::memory_order_release);
+                    EpochReclaimer::instance().retire(entry);
+                    return false;
+                }
+            }
+
+            head.store(new Entry(key, hash, value, head.load(std::memory_order_relaxed)), std::memory_order_release);
+            if (element_count.fetch_add(1, std::memory_order_relaxed) + 1 > current->bucket_count)
+                rehash(current, current->bucket_count * 2);
+            return true;
         }
-        bool emplace(std::string const & key, const SharedElement & value)
+
+        /// Rehash into bucket_count buckets, readers keep walking the old table until they leave the guard.
+        void rehash(Table * current, size_t bucket_count)
         {
-            std::unique_lock wlock(mut_);
-            auto [_, created] = map_.insert_or_assign(key, value);
-            return created;
+            auto * new_table = new Table(bucket_count);
+            for (size_t i = 0; i < current->bucket_count; ++i)
+            {
+                for (Entry * entry = current->buckets[i].load(std::memory_order_relaxed); entry;
+                     entry = entry->next.load(std::memory_order_relaxed))
+                {
+                    auto & head = new_table->bucket(entry->hash);
+                    head.store(
+                        new Entry(entry->key, entry->hash, entry->value, head.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+                }
+            }
+            table.store(new_table, std::memory_order_release);
+            EpochReclaimer::instance().retire(current);
         }
-        bool erase(std::string const & key)
+
+    public:
+        InnerMap() : table(new Table(INITIAL_BUCKET_COUNT)) { }
+        ~InnerMap() { delete table.load(std::memory_order_relaxed); }
+
+        InnerMap(const InnerMap &) = delete;
+        InnerMap & operator=(const InnerMap &) = delete;
+
+        SharedElement get(std::string_view key) { return get(key, bucketHash(key)); }
+        SharedElement get(std::string_view key, size_t hash)
         {
-            std::unique_lock write_lock(mut_);
-            return map_.erase(key);
+            EpochGuard guard;
+            const Entry * entry = find(key, hash);
+            return entry ? entry->value : nullptr;
         }
 
+        /// Call f with the element without copying the shared_ptr, return false if key not exists.
+        template <typename F>
+        bool read(std::string_view key, size_t hash, F && f)
+        {
+            EpochGuard guard;
+            const Entry * entry = find(key, hash);
+            if (!entry || !entry->value)
+                return false;
+            f(static_cast<const Element &>(*entry->value));
+            return true;
+        }
 
-        size_t size() const { return map_.size(); }
+        bool emplace(std::string_view key, SharedElement && value) { return emplaceImpl(key, bucketHash(key), value); }
+        bool emplace(std::string_view key, const SharedElement & value) { return emplaceImpl(key, bucketHash(key), value); }
+        bool emplace(std::string_view key, size_t hash, const SharedElement & value) { return emplaceImpl(key, hash, value); }
 
-        void forEach(const Action & fn)
+        bool erase(std::string_view key) { return erase(key, bucketHash(key)); }
+        bool erase(std::string_view key, size_t hash)
         {
-            std::shared_lock read_lock(mut_);
-            for (auto [key, value] : map_)
-                fn(key, value);
+            std::lock_guard lock(write_mutex);
+            auto & head = table.load(std::memory_order_relaxed)->bucket(hash);
+            for (std::atomic<Entry *> * link = &head; Entry * entry = link->load(std::memory_order_relaxed); link = &entry->next)
+            {
+                if (matches(*entry, key, hash))
+                {
+                    /// Readers standing on entry can still walk to its successors until it is reclaimed
+                    link->store(entry->next.load(std::memory_order_relaxed), std::memory_order_release);
+                    EpochReclaimer::instance().retire(entry);
+                    element_count.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
         }
 
-        std::shared_mutex & getMutex() { return mut_; }
+        size_t size() const { return element_count.load(std::memory_order_relaxed); }
+        size_t bucketCount() const { return table.load(std::memory_order_acquire)->bucket_count; }
 
-        /// This method will destroy InnerMap thread safety property.
-        /// deprecated use forEach instead.
-        ElementMap & getMap() { return map_; }
+        /** Rehash into as few buckets as the elements need if the block is sparse after mass erases, return whether
+         * it shrank. Writers of the block wait for it, the buckets walked are mostly empty then, readers do not.
+         */
+        bool shrink()
+        {
+            std::lock_guard lock(write_mutex);
+            Table * current = table.load(std::memory_order_relaxed);
+            size_t count = element_count.load(std::memory_order_relaxed);
+            if (current->bucket_count <= INITIAL_BUCKET_COUNT || count * SHRINK_LOAD_FACTOR >= current->bucket_count)
+                return false;
+
+            size_t bucket_count = INITIAL_BUCKET_COUNT;
+            while (bucket_count < count * 2)
+                bucket_count <<= 1;
+            rehash(current, bucket_count);
+            return true;
+        }
+
+        /// Writers of the block wait until it finishes.
+        void forEach(const Action & fn)
+        {
+            std::lock_guard lock(write_mutex);
+            Table * current = table.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < current->bucket_count; ++i)
+            {
+                for (Entry * entry = current->buckets[i].load(std::memory_order_relaxed); entry;
+                     entry = entry->next.load(std::memory_order_relaxed))
+                    fn(entry->key, entry->value);
+            }
+        }
 
     private:
-        std::shared_mutex mut_;
-        ElementMap map_;
+        alignas(64) std::atomic<Table *> table;
+        alignas(64) ProfilingMutex<std::mutex, LockProfiler::StoreBlock> write_mutex;
+        std::atomic<size_t> element_count{0};
     };
 
 private:
-    std::array<InnerMap, NumBlocks> maps_;
-    std::hash<std::string> hash_;
+    static UInt32 blockBits(UInt32 block_num_)
+    {
+        UInt32 bits = 0;
+        while ((1U << bits) < block_num_)
+            ++bits;
+        return bits;
+    }
+
+    const UInt32 block_num;
+    const UInt32 block_bits;
+    std::unique_ptr<InnerMap[]> maps_;
+
+    InnerMap & mapFor(size_t hash) { return maps_[block_bits ? hash >> (64 - block_bits) : 0]; }
 
 public:
-    SharedElement get(const std::string & key) { return mapFor(key).get(key); }
-    SharedElement at(const std::string & key) { return mapFor(key).get(key); }
+    /// block_num_ is rounded up to a power of two
+    explicit ConcurrentMap(UInt32 block_num_ = DEFAULT_BLOCK_NUM)
+        : block_num(1U << blockBits(block_num_)), block_bits(blockBits(block_num_)), maps_(new InnerMap[block_num])
+    {
+    }
+
+    SharedElement get(const HashedPath & key) { return mapFor(key.hash).get(key.path, key.hash); }
+    SharedElement at(const HashedPath & key) { return get(key); }
+
+    /// Call f with the element under an EpochGuard, return false if key not exists.
+    template <typename F>
+    bool read(const HashedPath & key, F && f)
+    {
+        return mapFor(key.hash).read(key.path, key.hash, std::forward<F>(f));
+    }
 
-    bool emplace(const std::string & key, SharedElement && value) { return mapFor(key).emplace(key, std::forward<SharedElement>(value)); }
-    bool emplace(const std::string & key, const SharedElement & value) { return mapFor(key).emplace(key, value); }
-    size_t count(const std::string & key) { return get(key) != nullptr ? 1 : 0; }
-    bool erase(std::string const & key) { return mapFor(key).erase(key); }
+    bool emplace(const HashedPath & key, const SharedElement & value) { return mapFor(key.hash).emplace(key.path, key.hash, value); }
+    size_t count(const HashedPath & key) { return get(key) != nullptr ? 1 : 0; }
+    bool erase(const HashedPath & key) { return mapFor(key.hash).erase(key.path, key.hash); }
 
-    InnerMap & mapFor(std::string const & key) { return maps_[hash_(key) % NumBlocks]; }
-    UInt32 getBlockNum() const { return NumBlocks; }
+    InnerMap & mapFor(const HashedPath & key) { return mapFor(key.hash); }
+    UInt32 getBlockNum() const { return block_num; }
     InnerMap & getMap(const UInt32 & index) { return maps_[index]; }
 
     size_t size() const
     {
         size_t s(0);
-        for (auto it = maps_.begin(); it != maps_.end(); it++)
+        for (UInt32 i = 0; i < block_num; ++i)
+            s += maps_[i].size();
+        return s;
+    }
+};
+
+
+/** Node container of KeeperStore, the underlying structure is chosen by config.
+ *
+ * HASH_MAP is ConcurrentMap, RADIX_TREE is ConcurrentPathTrie which does not store
+ * the full path for every node and does not hash the path on lookup.
+ */
+template <typename Element>
+class KeeperContainer
+{
+public:
+    using HashMap = ConcurrentMap<Element>;
+    using RadixTree = ConcurrentPathTrie<Element>;
+    using InnerMap = typename HashMap::InnerMap;
+    using SharedElement = std::shared_ptr<Element>;
+    using Action = std::function<void(const String &, const SharedElement &)>;
+
+    explicit KeeperContainer(ContainerType type_ = ContainerType::HASH_MAP, UInt32 block_num = HashMap::DEFAULT_BLOCK_NUM)
+        : type(type_), hash_map(isRadixTree() ? 1 : block_num)
+    {
+    }
+
+    /// A path is hashed for HASH_MAP only, requests hash it once and pass the HashedPath
+    SharedElement get(const String & key) { return isRadixTree() ? radix_tree.get(key) : hash_map.get(key); }
+    SharedElement get(const HashedPath & key) { return isRadixTree() ? radix_tree.get(key.path) : hash_map.get(key); }
+    SharedElement at(const String & key) { return get(key); }
+
+    /// Call f with the element, return false if key not exists. The hot read path,
+    /// HASH_MAP does it without any lock or reference counting.
+    template <typename F>
+    bool read(const String & key, F && f)
+    {
+        return isRadixTree() ? readRadixTree(key, std::forward<F>(f)) : hash_map.read(key, std::forward<F>(f));
+    }
+    template <typename F>
+    bool read(const HashedPath & key, F && f)
+    {
+        return isRadixTree() ? readRadixTree(key.path, std::forward<F>(f)) : hash_map.read(key, std::forward<F>(f));
+    }
+
+    bool emplace(const String & key, SharedElement && value)
+    {
+        return isRadixTree() ? radix_tree.emplace(key, std::move(value)) : hash_map.emplace(key, std::move(value));
+    }
+    bool emplace(const String & key, const SharedElement & value)
+    {
+        return isRadixTree() ? radix_tree.emplace(key, value) : hash_map.emplace(key, value);
+    }
+    bool emplace(const HashedPath & key, const SharedElement & value)
+    {
+        return isRadixTree() ? radix_tree.emplace(key.path, value) : hash_map.emplace(key, value);
+    }
+
+    size_t count(const String & key) { return get(key) != nullptr ? 1 : 0; }
+    size_t count(const HashedPath & key) { return get(key) != nullptr ? 1 : 0; }
+    bool erase(const String & key) { return isRadixTree() ? radix_tree.erase(key) : hash_map.erase(key); }
+    bool erase(const HashedPath & key) { return isRadixTree() ? radix_tree.erase(key.path) : hash_map.erase(key); }
+
+    size_t size() const { return isRadixTree() ? radix_tree.size() : hash_map.size(); }
+
+    void forEach(const Action & fn)
+    {
+        if (isRadixTree())
         {
-            s += it->size();
+            radix_tree.forEach(fn);
+            return;
         }
-        return s;
+        for (UInt32 i = 0; i < hash_map.getBlockNum(); i++)
+            hash_map.getMap(i).forEach(fn);
+    }
+
+    ContainerType getType() const { return type; }
+    bool isRadixTree() const { return type == ContainerType::RADIX_TREE; }
+
+    /// Hash map blocks, there is no block for RADIX_TREE.
+    UInt32 getBlockNum() const { return isRadixTree() ? 0 : hash_map.getBlockNum(); }
+    InnerMap & getMap(const UInt32 & index) { return hash_map.getMap(index); }
+
+private:
+    template <typename F>
+    bool readRadixTree(std::string_view key, F && f)
+    {
+        auto element = radix_tree.get(key);
+        if (!element)
+            return false;
+        f(static_cast<const Element &>(*element));
+        return true;
     }
+
+    ContainerType type;
+    HashMap hash_map;
+    RadixTree radix_tree;
 };
 
+/// Serialized body of a Get or List response of a node, valid while the node has the same stat.
+struct CachedResponseBody
+{
+    Coordination::Stat stat;
+    String body;
+};
 
 class KeeperStore
 {
 public:
+    /// Default blocks of the node container, see RaftSettings::container_blocks
     static constexpr int MAP_BLOCK_NUM = 16;
 
     int64_t session_id_counter{1};
@@ -168,7 +482,9 @@ public:
     };
 
     using ResponsesForSessions = std::vector<ResponseForSession>;
-    using KeeperResponsesQueue = ThreadSafeQueue<KeeperStore::ResponseForSession>;
+    /// Watch responses fired by a request, in the request arena
+    using WatchResponses = ArenaVector<ResponseForSession>;
+    using KeeperResponsesQueue = ShardedThreadSafeQueue<KeeperStore::ResponseForSession>;
 
     struct RequestForSession
     {
@@ -176,68 +492,212 @@ public:
         Coordination::ZooKeeperRequestPtr request;
         /// millisecond
         int64_t create_time{};
+        /// millisecond, the client has given up on the request after it, 0 if never, see Settings::request_deadline_ms
+        int64_t deadline{0};
 
         /// for forward request
         int32_t server_id{-1};
         int32_t client_id{-1};
 
+        /// Rejected by admission control, answered with ZTHROTTLEDOP in the session order without being executed
+        bool throttled{false};
+
+        /// Retry of a committed write, answered by this response of the first commit in the session order, see IdempotencyCache
+        Coordination::ZooKeeperResponsePtr replayed_response;
+
+        /// Log entry holding the request bytes as received from the client, its head and tail are
+        /// written when it is appended, see NuRaftStateMachine::finishLogEntry
+        std::shared_ptr<nuraft::buffer> log_entry;
+
+        /// Read index round a linearizable read waits for, 0 if the read is served at once, see ReadIndexTracker
+        UInt64 read_round{0};
+
+        /// Zxid a read waits to be applied locally, the last zxid seen by its client, 0 if the read is not fenced
+        int64_t min_zxid{0};
+
+        /// The read may be served before the pending writes of its session on other paths, see Settings::relaxed_read_order_networks
+        bool relaxed_order{false};
+
+        /// Client group of the connection, whose share of the request threads it takes, see ClientGroups
+        size_t client_group{0};
+
+        /// Stages the request passed on this server, see RequestTracer
+        RequestTrace trace;
+
         bool isForwardRequest() const
         {
             return server_id > -1 && client_id > -1;
         }
+
+        bool expired(int64_t now_ms) const { return deadline && now_ms >= deadline; }
     };
 
     using SessionAndAuth = std::unordered_map<int64_t, Coordination::AuthIDs>;
 
     using RequestsForSessions = std::vector<RequestForSession>;
 
-    using Container = ConcurrentMap<KeeperNode, MAP_BLOCK_NUM>;
+    using Container = KeeperContainer<KeeperNode>;
 
-    using Ephemerals = std::unordered_map<int64_t, std::unordered_set<std::string>>;
+    using Ephemerals = EphemeralIndex::Sessions;
     using EphemeralsPtr = std::shared_ptr<Ephemerals>;
-    using SessionAndWatcher = std::unordered_map<int64_t, std::unordered_set<std::string>>;
-    using SessionAndWatcherPtr = std::shared_ptr<SessionAndWatcher>;
     using SessionAndTimeout = std::unordered_map<int64_t, int64_t>;
     using SessionIDs = std::vector<int64_t>;
 
-    using Watches = std::map<String /* path, relative of root_path */, SessionIDs>;
+    /// Called with watch responses under the lock of the watched path
+    using WatchCallback = std::function<void(const WatchResponses &)>;
 
-    mutable std::shared_mutex auth_mutex;
+    mutable ProfilingMutex<std::shared_mutex, LockProfiler::StoreAuth> auth_mutex;
     SessionAndAuth session_and_auth;
 
     Container container;
 
-    Ephemerals ephemerals;
-    mutable std::mutex ephemerals_mutex;
+    EphemeralIndex ephemerals;
 
-    SessionExpiryQueue session_expiry_queue;
-    SessionAndTimeout session_and_timeout;
+    /// Sessions and their expiration, touched by every request without a global lock
+    SessionTable session_table;
+
+    /// Expiration of TTL and container nodes, maintained by every replica and used by the leader, see scheduleNodeExpiry
+    NodeExpiryWheel node_expiry;
+    mutable std::mutex node_expiry_mutex;
     /// pending close sessions
 //    std::unordered_set<int64_t> closing_sessions;
-    mutable std::mutex session_mutex;
-
-    /// Session id -> patch
-    SessionAndWatcher sessions_and_watchers;
-    /// Path -> session id. Watches for 'get' and 'exist' requests
-    Watches watches;
-    /// Path -> session id. Watches for 'list' request (watches on children).
-    Watches list_watches;
+    /// Serialize creating and closing sessions, guard session_id_counter
+    mutable ProfilingMutex<std::mutex, LockProfiler::StoreSession> session_mutex;
 
-    mutable std::mutex watch_mutex;
+    /// Data and list watches, and session -> watched paths
+    WatchManager watch_manager;
 
     /// ACLMap for more compact ACLs storage inside nodes.
     ACLMap acl_map;
+    /// Permissions of sessions on ACL ids, erased under auth_mutex when the auth of a session changes
+    ACLPermissionCache acl_permissions;
 
     std::atomic<int64_t> zxid{0};
     bool finalized{false};
 
+    /// Exact byte counters of the data tree, see onNodeAdded
+    std::atomic<int64_t> node_bytes{0};
+    std::atomic<int64_t> data_bytes{0};
+    std::atomic<int64_t> path_bytes{0};
+    std::atomic<int64_t> children_bytes{0};
+    /// Bytes saved by compressing values of cold nodes, data_bytes counts values as they are before compression
+    std::atomic<int64_t> compression_saved_bytes{0};
+
+    /// See getDigest, wraps around
+    std::atomic<UInt64> digest{0};
+
+    /// Path -> stats of its subtree, for paths not deeper than subtree_stats_depth.
+    const UInt64 subtree_stats_depth;
+    mutable std::mutex subtree_stats_mutex;
+    std::unordered_map<String, SubtreeStats> subtree_stats;
+
+    /// Add deltas to all ancestors of path which are indexed.
+    void updateSubtreeStats(const String & path, int64_t count_delta, int64_t bytes_delta);
+
+    /** Quotas of paths, set as in ZooKeeper by the data of the node QUOTA_ROOT + path + "/" + QUOTA_LIMITS_NODE, for
+     * example "count=-1,bytes=-1,countHardLimit=1000000,bytesHardLimit=1073741824". A create or set which would take
+     * the nodes or the data bytes of path and its descendants over a hard limit fails with ZQUOTAEXCEEDED, the soft
+     * limits count and bytes are not enforced, as in ZooKeeper. -1 or a missing limit means no limit.
+     */
+    struct Quota
+    {
+        int64_t count_limit = -1;
+        int64_t bytes_limit = -1;
+        /// Of path and its descendants, maintained by updateQuotas
+        int64_t node_count = 0;
+        int64_t data_bytes = 0;
+    };
+    static constexpr std::string_view QUOTA_ROOT = "/zookeeper/quota";
+    static constexpr std::string_view QUOTA_LIMITS_NODE = "zookeeper_limits";
+
+    mutable std::mutex quotas_mutex;
+    std::unordered_map<String, Quota> quotas;
+    /// Changes of the tree take quotas_mutex only if there are quotas
+    std::atomic<bool> has_quotas{false};
+
+    /// Add deltas to the quotas of path and its ancestors.
+    void updateQuotas(const String & path, int64_t count_delta, int64_t bytes_delta);
+    /// Set the limits of the quota of a limits node, nullptr data if the limits node is removed. The usage of a new quota is
+    /// counted from the tree, which must be up to date but for the limits node itself.
+    void updateQuotaLimits(const String & path, const NodeData * data);
+
+    /// Write requests hold it shared, pinSnapshot holds it exclusively.
+    std::shared_mutex snapshot_pin_mutex;
+    std::atomic<bool> snapshot_pinned{false};
+    UInt64 pinned_digest = 0;
+    mutable std::mutex snapshot_versions_mutex;
+    /// Path -> node version at the pinned point, nullptr if the path did not exist.
+    std::unordered_map<String, std::shared_ptr<KeeperNode>> snapshot_versions;
+    /// Exports sharing the export view, see pinExportView. Changed under both mutexes.
+    std::atomic<size_t> export_pins{0};
+    int64_t export_zxid = 0;
+    std::unordered_map<String, std::shared_ptr<KeeperNode>> export_versions;
+
+    bool versionsPinned() const
+    {
+        return snapshot_pinned.load(std::memory_order_relaxed) || export_pins.load(std::memory_order_relaxed);
+    }
+
+    /// See trackDirtyPaths
+    std::atomic<bool> track_dirty_paths{false};
+    mutable std::mutex dirty_paths_mutex;
+    std::unordered_set<String> dirty_paths;
+    /// Dirty paths up to the pinned point, not taken by a snapshot yet
+    std::unordered_set<String> pinned_dirty_paths;
+
     const String super_digest;
 
+    /// Serialize responses before pushing them to the responses queue, see ZooKeeperResponse::prepareFrame
+    const bool prepare_response_frames;
+
+    using ResponseBodies = ConcurrentMap<CachedResponseBody>;
+
+    /** Serialized Get and List bodies of paths, shared by the responses of them while the stat of the node is the
+     * same, so that a hot path is not copied and serialized for every read. Any change of the node changes its
+     * mzxid, pzxid, version, cversion or aversion, so a cached body is checked by the stat under the node lock.
+     * The cache is emptied when it has response_cache_max_paths paths, 0 disables it.
+     */
+    const UInt64 response_cache_max_paths;
+    const UInt64 response_cache_max_body_bytes;
+    ResponseBodies cached_get_bodies;
+    ResponseBodies cached_list_bodies;
+    std::atomic<bool> clearing_response_cache{false};
+
+    /// Responses of the last writes of sessions, answering retried writes, see RaftSettings::idempotency_cache_size
+    IdempotencyCache idempotency_cache;
+
+    /// Serialize the body of the response of the node at path with stat into bodies, and share it with the response
+    void cacheResponseBody(
+        ResponseBodies & bodies, const String & path, const Coordination::Stat & stat, Coordination::ZooKeeperResponse & response);
+    void eraseCachedResponseBodies(const String & path);
+
     void clearDeadWatches(int64_t session_id);
 
+    /// Remove ephemerals, watches and auth of a closed session, watch events fired are appended to watch_responses.
+    void closeSession(int64_t session_id, ResponsesForSessions & watch_responses);
+
+    /// Remove the nodes at paths which are expired at time, watch events fired are appended to watch_responses.
+    void removeExpiredNodes(const std::vector<String> & paths, int64_t remove_zxid, int64_t time, ResponsesForSessions & watch_responses);
+
     int64_t getZXID() { return zxid++; }
 
-    explicit KeeperStore(int64_t tick_time_ms, const String & super_digest_ = "");
+    /// Reserve count zxids at once and return the first one, used by parallel apply.
+    int64_t reserveZXIDs(int64_t count) { return zxid.fetch_add(count); }
+
+    /// Only write requests increase zxid.
+    static bool shouldIncreaseZxid(const Coordination::ZooKeeperRequestPtr & zk_request);
+
+    explicit KeeperStore(
+        int64_t tick_time_ms,
+        const String & super_digest_ = "",
+        ContainerType container_type = ContainerType::HASH_MAP,
+        UInt64 subtree_stats_depth_ = 0,
+        SessionExpiryType session_expiry_type = SessionExpiryType::SORTED_MAP,
+        bool prepare_response_frames_ = false,
+        UInt64 response_cache_max_paths_ = 0,
+        UInt64 response_cache_max_body_bytes_ = 0,
+        UInt32 container_blocks = MAP_BLOCK_NUM,
+        UInt64 idempotency_cache_size = 0);
 
     int64_t getSessionID(int64_t session_timeout_ms)
     {
@@ -246,12 +706,22 @@ public:
 
         std::lock_guard lock(session_mutex);
         auto result = session_id_counter++;
-        auto it = session_and_timeout.emplace(result, session_timeout_ms);
-        if (!it.second)
+        if (!session_table.add(result, session_timeout_ms))
         {
             LOG_DEBUG(log, "Session {} already exist, must applying a fuzzy log.", toHexString(result));
         }
-        session_expiry_queue.addNewSessionOrUpdate(result, session_timeout_ms);
+        return result;
+    }
+
+    /// Reserve count session ids for a server to grant locally, return the first one.
+    int64_t reserveSessionIDs(int64_t count)
+    {
+        /// Reserving session ids is a log entry and should increase zxid
+        getZXID();
+
+        std::lock_guard lock(session_mutex);
+        auto result = session_id_counter;
+        session_id_counter += count;
         return result;
     }
 
@@ -263,92 +733,314 @@ public:
 
     bool updateSessionTimeout(int64_t session_id, int64_t session_timeout_ms);
 
+    /// assigned_zxid is the zxid reserved for the request by parallel apply, the global zxid is not increased then.
+    /// connected is false if the session has no connection on this server, the response of a write is then neither
+    /// serialized nor queued, the watch events it fires still are.
     void processRequest(
-        ThreadSafeQueue<ResponseForSession> & responses_queue,
+        KeeperResponsesQueue & responses_queue,
         const Coordination::ZooKeeperRequestPtr & request,
         int64_t session_id,
         int64_t time,
         std::optional<int64_t> new_last_zxid = {},
         bool check_acl = true,
-        bool ignore_response = false);
+        bool ignore_response = false,
+        std::optional<int64_t> assigned_zxid = {},
+        bool connected = true);
+
+    /** MVCC snapshot support.
+     *
+     * pinSnapshot freezes the data tree at the current zxid. While pinned, the first change of a path
+     * copies the node and replaces it in the container, the pinned version is kept in snapshot_versions
+     * and never changed again. So snapshot can iterate a point-in-time view without locking or cloning
+     * nodes while the apply thread keeps writing. unpinSnapshot reclaims the superseded versions.
+     *
+     * Returns next zxid and next session id at the pinned point.
+     */
+    std::pair<int64_t, int64_t> pinSnapshot();
+    void unpinSnapshot();
+
+    /// Node to be changed by a write request, can be changed in place.
+    std::shared_ptr<KeeperNode> getNodeForUpdate(const HashedPath & path);
+
+    /// Keep the pinned version of path, must be called before path is created, erased or replaced.
+    void preserveVersion(const HashedPath & path);
 
-    /// build path children after load data from snapshot
+    /// Node at the pinned point, nullptr if not exist. If not pinned, return a copy of the live node.
+    std::shared_ptr<const KeeperNode> getSnapshotNode(const String & path);
+
+    /** A second pinned view of the same kind for exports, see exportSubtree, which may take long and must not hold
+     * back snapshots. Exports running at once share the view pinned by the first of them. A change then keeps the
+     * versions of both views. Returns the zxid of the view.
+     */
+    int64_t pinExportView();
+    void unpinExportView();
+    /// Node in the export view, nullptr if not exist, must be pinned
+    std::shared_ptr<const KeeperNode> getExportNode(const String & path);
+
+    /// Permissions of auths on a node of acl_id, for connections with no session in the store, see StartupReadServer
+    int32_t permissionsOf(uint64_t acl_id, const Coordination::AuthIDs & auths) const;
+    /// Auth id an AddAuth of scheme and data gives, false if it fails
+    bool authOf(const String & scheme, const String & data, Coordination::AuthID & auth) const;
+
+    /** Collect paths changed in a way zxids of nodes can not tell, for delta snapshots: removed nodes,
+     * their parents, whose stat is not always given a new zxid, and nodes with ACL set.
+     * pinSnapshot moves paths collected up to the pinned point aside, takeSnapshotDirtyPaths hands them
+     * to the snapshot, or all the paths if not pinned.
+     */
+    void trackDirtyPaths() { track_dirty_paths = true; }
+    bool isTrackingDirtyPaths() const { return track_dirty_paths; }
+    void markDirty(const String & path);
+    /// Mark path and its parent
+    void markRemoved(const String & path);
+    std::unordered_set<String> takeSnapshotDirtyPaths();
+
+    /** Caps of a session, 0 means not limited. Creating an ephemeral node or registering a watch beyond them fails with
+     * ZQUOTAEXCEEDED, so that closing a session and clearing its watches take a bounded time.
+     */
+    struct SessionLimits
+    {
+        UInt64 max_ephemerals = 0;
+        UInt64 max_watches = 0;
+    };
+    void setSessionLimits(const SessionLimits & limits) { session_limits = limits; }
+    /// Whether session may create one more ephemeral node or register the watch of type on path, log why if not.
+    /// A watch the session has already is not counted again.
+    bool checkSessionEphemerals(int64_t session_id) const;
+    bool checkSessionWatches(int64_t session_id, const String & path, WatchManager::WatchType type) const;
+
+    using SessionUsage = WatchManager::SessionUsage;
+    /// The top limit sessions by count of watches and of ephemeral nodes
+    std::vector<SessionUsage> getTopWatchSessions(size_t limit) const;
+    std::vector<SessionUsage> getTopEphemeralSessions(size_t limit) const;
+
+    /// Threads of buildPathChildren
+    static constexpr size_t BUILD_CHILDREN_THREADS = 8;
+
+    /** Build path children after load data from snapshot. Paths are collected from the blocks of the container
+     * in parallel, partitioned by parentShardOf, and every shard of parents is linked by its own thread.
+     * from_zk_snapshot counts numChildren of parents too, which ZooKeeper snapshots do not have.
+     */
     void buildPathChildren(bool from_zk_snapshot = false);
 
+    /// Shard of the parent of path, children of one parent are always in one shard
+    static size_t parentShardOf(const String & path, size_t shards);
+    /// Link loaded nodes at paths to their parents. All paths of a parent must be linked at once,
+    /// so that different shards of parentShardOf can be linked concurrently.
+    void linkToParents(const std::vector<String> & paths, bool count_children = false);
+
     void finalize();
 
     /// Add session id. Used when restoring KeeperStorage from snapshot.
     void addSessionID(int64_t session_id, int64_t session_timeout_ms)
     {
         std::lock_guard lock(session_mutex);
-        session_and_timeout.emplace(session_id, session_timeout_ms);
-        session_expiry_queue.addNewSessionOrUpdate(session_id, session_timeout_ms);
+        session_table.add(session_id, session_timeout_ms);
     }
 
-    std::vector<int64_t> getDeadSessions()
+    std::vector<int64_t> getDeadSessions() { return session_table.getExpiredSessions(); }
+    /// Dead sessions of session_ids, see RaftSettings::session_lease_ms
+    std::vector<int64_t> getDeadSessionsOf(const std::vector<int64_t> & session_ids) const
     {
-        std::lock_guard lock(session_mutex);
-        auto ret = session_expiry_queue.getExpiredSessions();
-        return ret;
+        return session_table.getExpiredSessionsOf(session_ids);
     }
 
-    std::unordered_map<int64_t, int64_t> sessionToExpirationTime()
+    /// TTL and container nodes which may be expired, for the leader to remove by RemoveExpiredNodes
+    std::vector<String> getExpiredNodes(size_t max_count);
+
+    /** Index the node at path by its expiration, called under the node lock by every change which may expire it.
+     * A TTL node without children expires ttl after its mtime, a container node expires once it had children
+     * and has none left. Other nodes are removed from the index.
+     */
+    void scheduleNodeExpiry(const String & path, const KeeperNode & node);
+    void unscheduleNodeExpiry(const String & path);
+
+    std::unordered_map<int64_t, int64_t> sessionToExpirationTime() const { return session_table.sessionToExpirationTime(); }
+
+    void handleRemoteSession(int64_t session_id, int64_t expiration_time) { session_table.setExpirationTime(session_id, expiration_time); }
+    void handleRemoteSessions(const std::vector<std::pair<int64_t, int64_t>> & session_to_expiration_time)
     {
-        std::lock_guard lock(session_mutex);
-        const auto & ret = session_expiry_queue.sessionToExpirationTime();
-        return ret;
+        session_table.setExpirationTimes(session_to_expiration_time);
     }
 
-    void handleRemoteSession(int64_t session_id, int64_t expiration_time)
+    /// Refresh sessions pinged at the given time, heartbeats answered by connections never reach the store.
+    void touchSessions(const std::unordered_map<int64_t, int64_t> & session_to_ping_time)
     {
-        std::lock_guard lock(session_mutex);
-        session_expiry_queue.setSessionExpirationTime(session_id, expiration_time);
+        for (const auto & [session_id, ping_time] : session_to_ping_time)
+            session_table.touch(session_id, ping_time);
     }
 
+    /// A new leader does not know when sessions of other servers were seen last, they get their timeout from now
+    /// until the servers sync them.
+    void touchAllSessions() { session_table.touchAll(session_table.nowMilliseconds()); }
+
     bool containsSession(int64_t session_id) const;
 
+    /// Watches of a session as its client would set them again, data watches on paths which do not exist are exist
+    /// watches. For the connections handed off to another process, see ConnectionHandoff.
+    struct SessionWatches
+    {
+        std::vector<String> data_watches;
+        std::vector<String> exist_watches;
+        std::vector<String> list_watches;
+        std::vector<String> persistent_watches;
+        std::vector<String> persistent_recursive_watches;
+    };
+    SessionWatches getSessionWatches(int64_t session_id);
+
     /// Introspection functions mostly used in 4-letter commands
     uint64_t getNodesCount() const
     {
         return container.size();
     }
     
-    uint64_t getApproximateDataSize() const
-    {
-        UInt64 node_count = container.size();
-        UInt64 size_bytes = container.getBlockNum() * sizeof(Container::InnerMap) /* Inner map size */
-            + node_count * 8 / 0.75 /*hash map array size*/
-            + node_count * sizeof(KeeperNode) /*node size*/
-            + node_count * 100; /*path and child of node size*/
-        return size_bytes;
-    }
+    struct MemoryStats
+    {
+        uint64_t node_bytes;
+        uint64_t data_bytes;
+        uint64_t path_bytes;
+        uint64_t children_bytes;
+        uint64_t watch_bytes;
+        uint64_t acl_bytes;
+        /// Bytes saved by compressing values of cold nodes, data_bytes counts values as they are kept
+        uint64_t compression_saved_bytes;
+
+        uint64_t total() const { return node_bytes + data_bytes + path_bytes + children_bytes + watch_bytes + acl_bytes; }
+    };
 
-    uint64_t getTotalWatchesCount() const;
+    MemoryStats getMemoryStats() const;
+
+    /// Memory used by the data tree, computed from exact byte counters.
+    uint64_t getApproximateDataSize() const { return getMemoryStats().total(); }
+
+    /** Give back the buckets of the node container, the response caches and the watch tables left sparse by mass
+     * deletions, one block or shard at a time so that no lock is held for long. Children sets need nothing, they
+     * free their memory as children are removed. Return the number of blocks and tables shrunk.
+     */
+    size_t shrinkContainers();
 
-    uint64_t getWatchedPathsCount() const
+    /** Order independent digest of the data tree as the digest of ZooKeeper 3.6, the sum of the digests of all the nodes.
+     * Replicas which applied the same log entries have the same digest, so comparing them at the same zxid checks
+     * that they agree in O(1). cversion, pzxid and numChildren of a node change with its children, which are covered
+     * by their own digests, and ACL ids are local, so they are not in the digest of a node.
+     */
+    UInt64 getDigest() const { return digest.load(std::memory_order_relaxed); }
+    /// Digest at the pinned point, the current one if not pinned
+    UInt64 getSnapshotDigest() const { return snapshot_pinned ? pinned_digest : getDigest(); }
+    static UInt64 nodeDigest(const String & path, const KeeperNode & node);
+    /// The node changed in place or was replaced, old_digest and new_digest are its digests before and after
+    void onNodeChanged(UInt64 old_digest, UInt64 new_digest) { digest += new_digest - old_digest; }
+
+    /// Maintain byte counters, subtree stats and digest, called by every change of the data tree.
+    void onNodeAdded(const String & path, const KeeperNode & node)
+    {
+        digest += nodeDigest(path, node);
+        node_bytes += NODE_ENTRY_BYTES;
+        path_bytes += path.size();
+        data_bytes += node.data.size();
+        compression_saved_bytes += node.data.savedBytes();
+        updateSubtreeStats(path, 1, node.data.size());
+        updateQuotaLimits(path, &node.data);
+        updateQuotas(path, 1, node.data.size());
+    }
+    void onNodeRemoved(const String & path, const KeeperNode & node)
+    {
+        if (track_dirty_paths.load(std::memory_order_relaxed))
+            markRemoved(path);
+        digest -= nodeDigest(path, node);
+        node_bytes -= NODE_ENTRY_BYTES;
+        path_bytes -= path.size();
+        data_bytes -= node.data.size();
+        compression_saved_bytes -= node.data.savedBytes();
+        updateSubtreeStats(path, -1, -static_cast<int64_t>(node.data.size()));
+        updateQuotas(path, -1, -static_cast<int64_t>(node.data.size()));
+        updateQuotaLimits(path, nullptr);
+    }
+    /// old_saved_bytes and new_saved_bytes are savedBytes of the value before and after
+    void onDataChanged(const String & path, size_t old_size, size_t new_size, size_t old_saved_bytes = 0, size_t new_saved_bytes = 0)
     {
-        std::lock_guard lock(watch_mutex);
-        return watches.size() + list_watches.size();
+        int64_t delta = static_cast<int64_t>(new_size) - static_cast<int64_t>(old_size);
+        data_bytes += delta;
+        compression_saved_bytes += static_cast<int64_t>(new_saved_bytes) - static_cast<int64_t>(old_saved_bytes);
+        updateSubtreeStats(path, 0, delta);
+        updateQuotas(path, 0, delta);
     }
+    void onChildAdded(const String & name) { children_bytes += childBytes(name); }
+    void onChildRemoved(const String & name) { children_bytes -= childBytes(name); }
+
+    /// Memory of a node besides its value, children and ACL, which have counters of their own: the node with the control
+    /// block of its shared_ptr and the entry of the container keeping it.
+    static constexpr size_t NODE_ENTRY_BYTES
+        = sizeof(KeeperNode) + 2 * sizeof(void *) + sizeof(String) + sizeof(std::shared_ptr<KeeperNode>) + 2 * sizeof(void *);
+    /// A child in the children set of its parent, a node of the sorted set with the heap of the name
+    static size_t childBytes(const String & name) { return sizeof(String) + 4 * sizeof(void *) + getStringHeapBytes(name); }
+
+    /// Recalculate byte counters, subtree stats, digest and expiration of nodes from the whole tree, used after loading snapshot.
+    void recalculateMemoryStats();
+
+    /// Nodes whose values are swapped under one exclusive snapshot_pin_mutex
+    static constexpr size_t COLD_DATA_BATCH_SIZE = 1000;
+
+    struct ColdDataStats
+    {
+        size_t compressed = 0;
+        size_t decompressed = 0;
+    };
+
+    /** One pass of compressing values of cold nodes, called periodically by a background thread of every server,
+     * compression is local and never in the log or snapshots.
+     *
+     * Every pass adds one idle pass to all the nodes, a Get clears them. Values of nodes idle for idle_passes
+     * passes are compressed, Get decompresses them into the response, and the next pass decompresses values
+     * of nodes read since then. Values are compressed outside of any lock and swapped in batches under
+     * snapshot_pin_mutex exclusively, so that no write request sees a value being swapped. A pass stops
+     * when a snapshot or an export is pinned, because they read the live nodes without locking them.
+     */
+    ColdDataStats compressColdData(UInt8 idle_passes);
+
+    struct SubtreeStats
+    {
+        /// Descendants, not include the node itself
+        int64_t node_count = 0;
+        int64_t data_bytes = 0;
+    };
+
+    /** Stats of path, answered from the index when path is not deeper than subtree_stats_depth,
+     * otherwise by walking the subtree. Return false if path does not exist.
+     */
+    bool getSubtreeStats(const String & path, SubtreeStats & stats);
+
+    /// All indexed paths, sorted by path.
+    std::map<String, SubtreeStats> getIndexedSubtreeStats() const;
+
+    UInt64 getSubtreeStatsDepth() const { return subtree_stats_depth; }
+
+    /// Whether adding count_delta nodes and bytes_delta data bytes at path keeps within the quotas of path and its ancestors
+    bool checkQuotas(const String & path, int64_t count_delta, int64_t bytes_delta) const;
+
+    /// All quotas, sorted by path.
+    std::map<String, Quota> getQuotas() const;
+
+    uint64_t getTotalWatchesCount() const;
+
+    uint64_t getWatchedPathsCount() const { return watch_manager.watchedPathCount(); }
 
     uint64_t getSessionsWithWatchesCount() const;
 
     uint64_t getSessionWithEphemeralNodesCount() const
     {
-        std::lock_guard lock(watch_mutex);
         return ephemerals.size();
     }
     uint64_t getTotalEphemeralNodesCount() const;
 
-    void dumpWatches(WriteBufferFromOwnString & buf) const;
-    void dumpWatchesByPath(WriteBufferFromOwnString & buf) const;
-    void dumpSessionsAndEphemerals(WriteBufferFromOwnString & buf) const;
+    void dumpWatches(WriteBuffer & buf) const;
+    void dumpWatchesByPath(WriteBuffer & buf) const;
+    void dumpSessionsAndEphemerals(WriteBuffer & buf) const;
 
 private:
+    SessionLimits session_limits;
     Poco::Logger * log;
 };
 
 using SessionIDs = KeeperStore::SessionIDs;
-using Watches = KeeperStore::Watches;
 
 }
@@ -0,0 +1,231 @@
+#if !defined(ARCADIA_BUILD)
+#    include <Common/config.h>
+#endif
+
+#include <mutex>
+#include <Poco/Net/IPAddress.h>
+#include <Service/KernelTLS.h>
+#include <Common/Exception.h>
+#include <ext/scope_guard.h>
+
+#if USE_SSL
+#    include <openssl/err.h>
+#    include <openssl/ssl.h>
+#    include <openssl/x509v3.h>
+#endif
+
+/// SSL_OP_ENABLE_KTLS is there since OpenSSL 3.0 built with ktls, BoringSSL has no kernel TLS
+#if USE_SSL && defined(OS_LINUX) && defined(SSL_OP_ENABLE_KTLS)
+#    define USE_KERNEL_TLS 1
+#else
+#    define USE_KERNEL_TLS 0
+#endif
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int OPENSSL_ERROR;
+    extern const int SUPPORT_IS_DISABLED;
+    extern const int INVALID_CONFIG_PARAMETER;
+}
+
+#if USE_KERNEL_TLS
+namespace
+{
+    String lastError()
+    {
+        String message;
+        while (unsigned long code = ERR_get_error())
+        {
+            char buf[256];
+            ERR_error_string_n(code, buf, sizeof(buf));
+            if (!message.empty())
+                message += "; ";
+            message += buf;
+        }
+        return message.empty() ? "unknown error" : message;
+    }
+
+    SSL_CTX * createContext(const Settings & settings, bool server)
+    {
+        SSL_CTX * ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+        if (!ctx)
+            throw Exception(ErrorCodes::OPENSSL_ERROR, "Cannot create TLS context: {}", lastError());
+
+        try
+        {
+            SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+            SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+            /// A ticket is a handshake message after the handshake, which kernel TLS does not take on the other side
+            SSL_CTX_set_num_tickets(ctx, 0);
+
+            if (SSL_CTX_use_certificate_chain_file(ctx, settings.tls_certificate_file.c_str()) != 1
+                || SSL_CTX_use_PrivateKey_file(ctx, settings.tls_private_key_file.c_str(), SSL_FILETYPE_PEM) != 1
+                || SSL_CTX_check_private_key(ctx) != 1)
+                throw Exception(
+                    ErrorCodes::OPENSSL_ERROR,
+                    "Cannot load TLS certificate {} and private key {}: {}",
+                    settings.tls_certificate_file,
+                    settings.tls_private_key_file,
+                    lastError());
+
+            if (!settings.tls_ca_file.empty()
+                && SSL_CTX_load_verify_locations(ctx, settings.tls_ca_file.c_str(), nullptr) != 1)
+                throw Exception(ErrorCodes::OPENSSL_ERROR, "Cannot load TLS CA file {}: {}", settings.tls_ca_file, lastError());
+
+            /// Servers are always verified, so without a CA file no handshake to a server succeeds. Clients only if required.
+            if (!server)
+                SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+            else if (settings.tls_verify_client)
+                SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+        }
+        catch (...)
+        {
+            SSL_CTX_free(ctx);
+            throw;
+        }
+        return ctx;
+    }
+
+    bool kernelTLSEnabled(SSL * ssl) { return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)); }
+
+    /// Host of endpoint host:port, [ipv6]:port is taken too
+    String endpointHost(const String & endpoint)
+    {
+        String host = endpoint.substr(0, endpoint.rfind(':'));
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+        return host;
+    }
+
+    /// The certificate of the server must be issued for host, an IP address or a DNS name
+    bool setExpectedHost(SSL * ssl, const String & host)
+    {
+        Poco::Net::IPAddress address;
+        if (Poco::Net::IPAddress::tryParse(host, address))
+            return X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str()) == 1;
+        return SSL_set1_host(ssl, host.c_str()) == 1 && SSL_set_tlsext_host_name(ssl, host.c_str()) == 1;
+    }
+}
+#endif
+
+KernelTLS::KernelTLS(const Settings & settings)
+    : handshake_timeout(static_cast<Poco::Timespan::TimeDiff>(settings.tls_handshake_timeout_ms * 1000))
+    , handshake_thread_count(settings.tls_handshake_thread_count)
+    , log(&Poco::Logger::get("KernelTLS"))
+{
+    if (settings.tls_certificate_file.empty() || settings.tls_private_key_file.empty())
+        throw Exception(ErrorCodes::INVALID_CONFIG_PARAMETER, "keeper.tls needs certificate_file and private_key_file");
+    if (settings.tls_verify_client && settings.tls_ca_file.empty())
+        throw Exception(ErrorCodes::INVALID_CONFIG_PARAMETER, "keeper.tls.verify_client needs ca_file");
+    if (settings.tls_forwarding_port && settings.tls_ca_file.empty())
+        throw Exception(ErrorCodes::INVALID_CONFIG_PARAMETER, "keeper.tls.forwarding_port needs ca_file to verify the other servers");
+
+#if USE_KERNEL_TLS
+    server_ctx = createContext(settings, true);
+    try
+    {
+        client_ctx = createContext(settings, false);
+    }
+    catch (...)
+    {
+        SSL_CTX_free(static_cast<SSL_CTX *>(server_ctx));
+        throw;
+    }
+    LOG_INFO(log, "TLS by kernel TLS, certificate {}", settings.tls_certificate_file);
+#else
+    throw Exception(ErrorCodes::SUPPORT_IS_DISABLED, "TLS needs Linux and OpenSSL with kernel TLS, this build has no kernel TLS");
+#endif
+}
+
+KernelTLS::~KernelTLS()
+{
+#if USE_KERNEL_TLS
+    SSL_CTX_free(static_cast<SSL_CTX *>(server_ctx));
+    SSL_CTX_free(static_cast<SSL_CTX *>(client_ctx));
+#endif
+}
+
+std::shared_ptr<KernelTLS> KernelTLS::get(const Settings & settings)
+{
+    if (!settings.tls_client_port && !settings.tls_forwarding_port)
+        return nullptr;
+
+    static std::mutex mutex;
+    static std::shared_ptr<KernelTLS> instance;
+    std::lock_guard lock(mutex);
+    if (!instance)
+        instance.reset(new KernelTLS(settings));
+    return instance;
+}
+
+bool KernelTLS::accept([[maybe_unused]] Poco::Net::StreamSocket & socket) const
+{
+#if USE_KERNEL_TLS
+    String peer;
+    try
+    {
+        peer = socket.peerAddress().toString();
+        socket.setBlocking(true);
+        socket.setReceiveTimeout(handshake_timeout);
+        socket.setSendTimeout(handshake_timeout);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Cannot prepare the TLS handshake of " + peer);
+        return false;
+    }
+
+    ERR_clear_error();
+    SSL * ssl = SSL_new(static_cast<SSL_CTX *>(server_ctx));
+    if (!ssl)
+    {
+        LOG_ERROR(log, "Cannot create TLS connection: {}", lastError());
+        return false;
+    }
+    /// The descriptor stays open, it is owned by the socket
+    SCOPE_EXIT({ SSL_free(ssl); });
+
+    if (SSL_set_fd(ssl, socket.impl()->sockfd()) != 1 || SSL_accept(ssl) != 1)
+    {
+        LOG_WARNING(log, "TLS handshake of {} failed: {}", peer, lastError());
+        return false;
+    }
+    if (!kernelTLSEnabled(ssl))
+    {
+        LOG_ERROR(log, "Kernel TLS is not enabled for {} with cipher {}, is the tls module loaded?", peer, SSL_get_cipher_name(ssl));
+        return false;
+    }
+    LOG_TRACE(log, "TLS handshake of {} done, {} {}", peer, SSL_get_version(ssl), SSL_get_cipher_name(ssl));
+    return true;
+#else
+    return false;
+#endif
+}
+
+void KernelTLS::connect([[maybe_unused]] Poco::Net::StreamSocket & socket, const String & endpoint) const
+{
+#if USE_KERNEL_TLS
+    ERR_clear_error();
+    SSL * ssl = SSL_new(static_cast<SSL_CTX *>(client_ctx));
+    if (!ssl)
+        throw Exception(ErrorCodes::OPENSSL_ERROR, "Cannot create TLS connection: {}", lastError());
+    SCOPE_EXIT({ SSL_free(ssl); });
+
+    String host = endpointHost(endpoint);
+    if (!setExpectedHost(ssl, host))
+        throw Exception(ErrorCodes::OPENSSL_ERROR, "Cannot set the expected TLS host {} of {}: {}", host, endpoint, lastError());
+
+    if (SSL_set_fd(ssl, socket.impl()->sockfd()) != 1 || SSL_connect(ssl) != 1)
+        throw Exception(ErrorCodes::OPENSSL_ERROR, "TLS handshake with {} failed: {}", endpoint, lastError());
+    if (!kernelTLSEnabled(ssl))
+        throw Exception(
+            ErrorCodes::OPENSSL_ERROR, "Kernel TLS is not enabled for {} with cipher {}", endpoint, SSL_get_cipher_name(ssl));
+#else
+    throw Exception(ErrorCodes::SUPPORT_IS_DISABLED, "TLS connection to {} needs kernel TLS", endpoint);
+#endif
+}
+
+}
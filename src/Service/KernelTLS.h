@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <Poco/Net/StreamSocket.h>
+#include <Poco/Timespan.h>
+#include <Service/Settings.h>
+#include <common/logger_useful.h>
+
+namespace RK
+{
+
+/** TLS of the client port and the forwarding port by kernel TLS.
+ *
+ * The handshake is done by OpenSSL on the blocking socket, which then hands the keys of both directions to the kernel.
+ * From there on the socket carries plaintext for the process, so the connection handlers read and write it by readv
+ * and writev as a plain socket and the kernel encrypts the records, gathered writes keep a single copy. A connection
+ * whose keys the kernel does not take, for an old kernel, a missing tls module or a cipher it has no offload for, is
+ * refused instead of falling back to TLS in user space. Session tickets are not issued, and key updates, which the
+ * kernel does not handle, break the connection.
+ */
+class KernelTLS
+{
+public:
+    ~KernelTLS();
+
+    /// Shared by the acceptors and forwarding connections, nullptr if neither port uses TLS.
+    /// Throw if TLS is configured but unusable, such as without kernel TLS in OpenSSL.
+    static std::shared_ptr<KernelTLS> get(const Settings & settings);
+
+    /// Handshake of an accepted connection. Return false if it failed, the socket should be closed then.
+    bool accept(Poco::Net::StreamSocket & socket) const;
+
+    /// Handshake of a connection to endpoint host:port, whose certificate must be issued for host. Throw if it failed.
+    void connect(Poco::Net::StreamSocket & socket, const String & endpoint) const;
+
+    size_t handshakeThreadCount() const { return handshake_thread_count; }
+
+private:
+    explicit KernelTLS(const Settings & settings);
+
+    /// SSL_CTX, left opaque here so that users of the header do not need OpenSSL
+    void * server_ctx = nullptr;
+    void * client_ctx = nullptr;
+    Poco::Timespan handshake_timeout;
+    size_t handshake_thread_count;
+
+    Poco::Logger * log;
+};
+
+using KernelTLSPtr = std::shared_ptr<KernelTLS>;
+
+}
@@ -0,0 +1,140 @@
+#include <Service/LatencyHistogram.h>
+#include <algorithm>
+
+namespace RK
+{
+
+size_t LatencyHistogram::bucketOf(UInt64 value_us)
+{
+    if (value_us < SUB_BUCKETS)
+        return value_us;
+
+    size_t power = 63 - __builtin_clzll(value_us);
+    if (power >= MAX_POWER)
+        return BUCKETS - 1;
+    size_t sub_bucket = (value_us >> (power - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (power - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+UInt64 LatencyHistogram::bucketUpperBound(size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    size_t power = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    UInt64 sub_bucket = bucket % SUB_BUCKETS;
+    UInt64 width = 1ULL << (power - SUB_BUCKET_BITS);
+    return (1ULL << power) + (sub_bucket + 1) * width - 1;
+}
+
+LatencyHistogram::Counts LatencyHistogram::getCounts() const
+{
+    Counts result;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        /// Counters only grow, so they are never below what reset remembered
+        UInt64 base = reset_counts[i].load(std::memory_order_relaxed);
+        UInt64 count = counts[i].load(std::memory_order_relaxed);
+        result[i] = count > base ? count - base : 0;
+    }
+    return result;
+}
+
+LatencyPercentiles LatencyHistogram::getPercentiles() const
+{
+    return getPercentiles(getCounts());
+}
+
+LatencyPercentiles LatencyHistogram::getPercentiles(const Counts & counts)
+{
+    LatencyPercentiles result;
+    for (UInt64 count : counts)
+        result.count += count;
+    if (!result.count)
+        return result;
+
+    /// Value at quantile, the upper bound of the bucket holding it
+    auto at = [&](double quantile)
+    {
+        auto rank = std::max<UInt64>(1, static_cast<UInt64>(quantile * result.count + 0.5));
+        UInt64 seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return bucketUpperBound(i);
+        }
+        return bucketUpperBound(BUCKETS - 1);
+    };
+
+    result.p50 = at(0.5);
+    result.p90 = at(0.9);
+    result.p99 = at(0.99);
+    result.p999 = at(0.999);
+    result.max = at(1.0);
+    return result;
+}
+
+void LatencyHistogram::reset()
+{
+    for (size_t i = 0; i < BUCKETS; ++i)
+        reset_counts[i].store(counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+String RequestLatencyStats::roleName(Role role)
+{
+    switch (role)
+    {
+        case LEADER:
+            return "leader";
+        case FOLLOWER:
+            return "follower";
+        case OBSERVER:
+            return "observer";
+    }
+    return "unknown";
+}
+
+String RequestLatencyStats::operationName(size_t slot)
+{
+    return slot < std::size(OPERATIONS) ? Coordination::toString(OPERATIONS[slot]) : "other";
+}
+
+size_t RequestLatencyStats::slotOf(Coordination::OpNum op_num)
+{
+    const auto * it = std::find(std::begin(OPERATIONS), std::end(OPERATIONS), op_num);
+    return it - std::begin(OPERATIONS);
+}
+
+LatencyHistogram::Counts RequestLatencyStats::getOperationCounts(size_t slot) const
+{
+    LatencyHistogram::Counts result{};
+    for (const auto & role_histograms : histograms)
+    {
+        auto counts = role_histograms[slot].getCounts();
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i)
+            result[i] += counts[i];
+    }
+    return result;
+}
+
+LatencyHistogram::Counts RequestLatencyStats::getTotalCounts() const
+{
+    LatencyHistogram::Counts result{};
+    for (size_t slot = 0; slot < OPERATION_SLOTS; ++slot)
+    {
+        auto counts = getOperationCounts(slot);
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i)
+            result[i] += counts[i];
+    }
+    return result;
+}
+
+void RequestLatencyStats::reset()
+{
+    for (auto & role_histograms : histograms)
+        for (auto & histogram : role_histograms)
+            histogram.reset();
+}
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <iterator>
+#include <common/types.h>
+#include <Common/ZooKeeper/ZooKeeperConstants.h>
+
+namespace RK
+{
+
+struct LatencyPercentiles
+{
+    UInt64 count{0};
+    UInt64 p50{0};
+    UInt64 p90{0};
+    UInt64 p99{0};
+    UInt64 p999{0};
+    UInt64 max{0};
+};
+
+/** Lock free histogram of latencies in microseconds.
+ *
+ * Every power of 2 is split into SUB_BUCKETS linear buckets, so a percentile is off by at most 1 / SUB_BUCKETS
+ * of its value. Values from 2^MAX_POWER us (about 18 minutes) are counted in the last bucket.
+ *
+ * reset does not touch the counters, it remembers them and they are subtracted when reading, so recording
+ * never waits.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr size_t SUB_BUCKET_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr size_t MAX_POWER = 30;
+    static constexpr size_t BUCKETS = (MAX_POWER - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    using Counts = std::array<UInt64, BUCKETS>;
+
+    static size_t bucketOf(UInt64 value_us);
+    /// Largest value counted in bucket
+    static UInt64 bucketUpperBound(size_t bucket);
+
+    void record(UInt64 value_us) { counts[bucketOf(value_us)].fetch_add(1, std::memory_order_relaxed); }
+
+    /// Counts since the last reset
+    Counts getCounts() const;
+    LatencyPercentiles getPercentiles() const;
+    static LatencyPercentiles getPercentiles(const Counts & counts);
+
+    void reset();
+
+private:
+    std::array<std::atomic<UInt64>, BUCKETS> counts{};
+    std::array<std::atomic<UInt64>, BUCKETS> reset_counts{};
+};
+
+/** Latencies of client requests by the role of the server and the operation.
+ *
+ * Operations not in OPERATIONS are counted as "other".
+ */
+class RequestLatencyStats
+{
+public:
+    enum Role : uint8_t
+    {
+        LEADER = 0,
+        FOLLOWER = 1,
+        OBSERVER = 2,
+    };
+
+    static constexpr size_t ROLES = 3;
+    static constexpr Coordination::OpNum OPERATIONS[] = {
+        Coordination::OpNum::Create,
+        Coordination::OpNum::Remove,
+        Coordination::OpNum::Exists,
+        Coordination::OpNum::Get,
+        Coordination::OpNum::Set,
+        Coordination::OpNum::GetACL,
+        Coordination::OpNum::SetACL,
+        Coordination::OpNum::SimpleList,
+        Coordination::OpNum::Sync,
+        Coordination::OpNum::List,
+        Coordination::OpNum::Check,
+        Coordination::OpNum::Multi,
+        Coordination::OpNum::MultiRead,
+        Coordination::OpNum::BatchWrite,
+        Coordination::OpNum::Auth,
+        Coordination::OpNum::SubtreeStat,
+        Coordination::OpNum::ListPage,
+        Coordination::OpNum::ListWithData,
+        Coordination::OpNum::RemoveRecursive,
+        Coordination::OpNum::CreateContainer,
+        Coordination::OpNum::CreateTTL,
+    };
+    static constexpr size_t OPERATION_SLOTS = std::size(OPERATIONS) + 1;
+
+    static String roleName(Role role);
+    /// Name of the operation of slot, "other" for the last one
+    static String operationName(size_t slot);
+
+    void record(Role role, Coordination::OpNum op_num, UInt64 latency_us) { histograms[role][slotOf(op_num)].record(latency_us); }
+
+    const LatencyHistogram & get(Role role, size_t slot) const { return histograms[role][slot]; }
+    /// Counts of all roles and operations
+    LatencyHistogram::Counts getTotalCounts() const;
+    /// Counts of an operation of all roles
+    LatencyHistogram::Counts getOperationCounts(size_t slot) const;
+
+    void reset();
+
+private:
+    static size_t slotOf(Coordination::OpNum op_num);
+
+    LatencyHistogram histograms[ROLES][OPERATION_SLOTS];
+};
+
+}
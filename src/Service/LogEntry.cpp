@@ -1,3 +1,5 @@
+#include <cstring>
+#include <zlib.h>
 #include <Service/LogEntry.h>
 #include <Service/proto/Log.pb.h>
 #include <libnuraft/nuraft.hxx>
@@ -23,13 +25,29 @@ ptr<log_entry> LogEntry::setTermAndIndex(ptr<log_entry> & entry, ulong term, ulo
     return new_entry;
 }
 
-char * LogEntry::serializeEntry(ptr<log_entry> & entry, ptr<buffer> & entry_buf, size_t & buf_size)
+char * LogEntry::serializeEntry(ptr<log_entry> & entry, ptr<buffer> & entry_buf, size_t & buf_size, bool compress)
 {
     //entry_buf = entry->serialize();
     //buf_size = entry_buf->size();
     //return reinterpret_cast<char *>(entry_buf->get_raw(buf_size));
     ptr<buffer> data_buf = entry->get_buf_ptr();
     data_buf->pos(0);
+
+    String compressed;
+    if (compress && data_buf->size() >= MIN_COMPRESS_SIZE
+        && LogEntry::compress(reinterpret_cast<const char *>(data_buf->data_begin()), data_buf->size(), compressed))
+    {
+        auto data_size = static_cast<UInt32>(data_buf->size());
+        entry_buf = buffer::alloc(COMPRESSED_HEADER_SIZE + compressed.size());
+        char * pos = reinterpret_cast<char *>(entry_buf->data_begin());
+        pos[0] = static_cast<char>(COMPRESSED_MARKER);
+        pos[1] = static_cast<char>(static_cast<byte>(entry->get_val_type()));
+        memcpy(pos + 2, &data_size, sizeof(UInt32));
+        memcpy(pos + COMPRESSED_HEADER_SIZE, compressed.data(), compressed.size());
+        buf_size = entry_buf->size();
+        return pos;
+    }
+
     entry_buf = buffer::alloc(sizeof(char) + data_buf->size());
     entry_buf->put((static_cast<byte>(entry->get_val_type())));
     entry_buf->put(*data_buf);
@@ -38,6 +56,34 @@ char * LogEntry::serializeEntry(ptr<log_entry> & entry, ptr<buffer> & entry_buf,
     return reinterpret_cast<char *>(entry_buf->data_begin());
 }
 
+void LogEntry::serializeEntry(ptr<log_entry> & entry, SerializedLogEntry & serialized, bool compress)
+{
+    ptr<buffer> data_buf = entry->get_buf_ptr();
+    data_buf->pos(0);
+    const char * data = reinterpret_cast<const char *>(data_buf->data_begin());
+
+    String compressed;
+    if (compress && data_buf->size() >= MIN_COMPRESS_SIZE && LogEntry::compress(data, data_buf->size(), compressed))
+    {
+        /// The layout of serializeEntry after the marker
+        auto data_size = static_cast<UInt32>(data_buf->size());
+        serialized.holder = buffer::alloc(COMPRESSED_HEADER_SIZE - 1 + compressed.size());
+        char * pos = reinterpret_cast<char *>(serialized.holder->data_begin());
+        pos[0] = static_cast<char>(static_cast<byte>(entry->get_val_type()));
+        memcpy(pos + 1, &data_size, sizeof(UInt32));
+        memcpy(pos + COMPRESSED_HEADER_SIZE - 1, compressed.data(), compressed.size());
+        serialized.type = COMPRESSED_MARKER;
+        serialized.data = pos;
+        serialized.size = serialized.holder->size();
+        return;
+    }
+
+    serialized.type = static_cast<UInt8>(entry->get_val_type());
+    serialized.data = data;
+    serialized.size = data_buf->size();
+    serialized.holder = nullptr;
+}
+
 ptr<log_entry> LogEntry::parseEntry(const char * entry_str, const UInt64 & term, size_t buf_size)
 {
     // auto entry_buf = buffer::alloc(buf_size);
@@ -45,12 +91,42 @@ ptr<log_entry> LogEntry::parseEntry(const char * entry_str, const UInt64 & term,
     // entry_buf->pos(0);
     // auto entry = log_entry::deserialize(*(entry_buf.get()));
     // return entry;
-    auto entry_buf = buffer::alloc(buf_size);
-    entry_buf->put_raw(reinterpret_cast<const byte *>(entry_str), buf_size);
-    entry_buf->pos(0);
-    nuraft::log_val_type tp = static_cast<nuraft::log_val_type>(entry_buf->get_byte());
-    ptr<buffer> data = buffer::copy(*entry_buf);
-    return cs_new<log_entry>(term, data, tp);
+    if (buf_size >= COMPRESSED_HEADER_SIZE && static_cast<byte>(entry_str[0]) == COMPRESSED_MARKER)
+    {
+        UInt32 data_size;
+        memcpy(&data_size, entry_str + 2, sizeof(UInt32));
+        ptr<buffer> data = buffer::alloc(data_size);
+        const char * compressed = entry_str + COMPRESSED_HEADER_SIZE;
+        if (!decompress(compressed, buf_size - COMPRESSED_HEADER_SIZE, reinterpret_cast<char *>(data->data_begin()), data_size))
+            return nullptr;
+        return cs_new<log_entry>(term, data, static_cast<nuraft::log_val_type>(entry_str[1]));
+    }
+
+    if (buf_size < 1)
+        return nullptr;
+    /// The data is copied once, right into the buffer of the entry
+    ptr<buffer> data = buffer::alloc(buf_size - 1);
+    memcpy(data->data_begin(), entry_str + 1, buf_size - 1);
+    return cs_new<log_entry>(term, data, static_cast<nuraft::log_val_type>(entry_str[0]));
+}
+
+bool LogEntry::compress(const char * data, size_t size, String & out, int level)
+{
+    uLongf compressed_size = compressBound(size);
+    out.resize(compressed_size);
+    /// Level 1 by default, the log is written on the commit path
+    int ret = compress2(reinterpret_cast<Bytef *>(out.data()), &compressed_size, reinterpret_cast<const Bytef *>(data), size, level);
+    if (ret != Z_OK || compressed_size >= size)
+        return false;
+    out.resize(compressed_size);
+    return true;
+}
+
+bool LogEntry::decompress(const char * data, size_t size, char * out, size_t out_size)
+{
+    uLongf decompressed_size = out_size;
+    int ret = uncompress(reinterpret_cast<Bytef *>(out), &decompressed_size, reinterpret_cast<const Bytef *>(data), size);
+    return ret == Z_OK && decompressed_size == out_size;
 }
 
 ptr<buffer> LogEntry::serializePB(ptr<LogEntryPB> msg_pb)
@@ -41,15 +41,41 @@ struct LogEntryHeader
     static constexpr size_t HEADER_SIZE = 24;
 };
 
+/// A log entry as it is written to a segment, the type byte followed by the data. The data is the buffer of the
+/// entry unless it is compressed, then it is owned by holder.
+struct SerializedLogEntry
+{
+    UInt8 type;
+    const char * data;
+    size_t size;
+    ptr<buffer> holder;
+};
+
 class LogEntry
 {
 public:
+    /// Type byte of a serialized entry whose data is compressed, it is not a log_val_type. It is followed by
+    /// the type, the UInt32 size of the data before compression and the data compressed by zlib.
+    static constexpr UInt8 COMPRESSED_MARKER = 0xFF;
+    static constexpr size_t COMPRESSED_HEADER_SIZE = 2 + sizeof(UInt32);
+    /// Data shorter than it is never compressed
+    static constexpr size_t MIN_COMPRESS_SIZE = 128;
+
     //return entry count
     static ptr<log_entry> setTermAndIndex(ptr<log_entry> & entry, ulong term, ulong index);
 
-    static char * serializeEntry(ptr<log_entry> & entry, ptr<buffer> & entry_buf, size_t & buf_size);
+    /// compress: compress the data if it gets smaller, data_crc of the header is then the checksum of the compressed data
+    static char * serializeEntry(ptr<log_entry> & entry, ptr<buffer> & entry_buf, size_t & buf_size, bool compress = false);
+    /// Same bytes as serializeEntry, without copying the data of an entry not compressed
+    static void serializeEntry(ptr<log_entry> & entry, SerializedLogEntry & serialized, bool compress = false);
+    /// Returns nullptr if compressed data is corrupted
     static ptr<log_entry> parseEntry(const char * entry_str, const UInt64 & term, size_t buf_size);
 
+    /// Compress data into out by zlib level, returns false if it does not get smaller
+    static bool compress(const char * data, size_t size, String & out, int level = 1);
+    /// Decompress data of decompressed size out_size into out, returns false if data is corrupted
+    static bool decompress(const char * data, size_t size, char * out, size_t out_size);
+
     //serialize protobuf to nuraft buffer
     static ptr<buffer> serializePB(ptr<LogEntryPB> msg_pb);
     static ptr<buffer> serializePB(LogEntryPB & msg_pb);
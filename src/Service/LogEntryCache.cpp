@@ -0,0 +1,123 @@
+#include <Service/LogEntryCache.h>
+#include <cassert>
+#include <Common/SpinWait.h>
+
+namespace RK
+{
+
+void LogEntryCache::Slot::lock()
+{
+    while (locked.exchange(true, std::memory_order_acquire))
+    {
+        while (locked.load(std::memory_order_relaxed))
+            cpuRelax();
+    }
+}
+
+LogEntryCache::LogEntryCache(UInt64 max_bytes_, size_t ring_size) : max_bytes(max_bytes_), mask(ring_size - 1)
+{
+    assert(ring_size && (ring_size & (ring_size - 1)) == 0);
+    slots = std::make_unique<Slot[]>(ring_size);
+}
+
+UInt64 LogEntryCache::bytesOf(const ptr<log_entry> & entry)
+{
+    return sizeof(log_entry) + entry->get_buf().size();
+}
+
+ptr<log_entry> LogEntryCache::get(UInt64 index)
+{
+    ptr<log_entry> entry;
+    if (index >= first_index.load(std::memory_order_acquire) && index <= last_index.load(std::memory_order_acquire))
+    {
+        Slot & slot = slots[index & mask];
+        slot.lock();
+        if (slot.index == index)
+            entry = slot.entry;
+        slot.unlock();
+    }
+
+    if (entry)
+        hits.fetch_add(1, std::memory_order_relaxed);
+    else
+        misses.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+}
+
+void LogEntryCache::put(UInt64 index, const ptr<log_entry> & entry)
+{
+    if (!entry)
+        return;
+
+    /// The slot is taken by the index one lap before
+    if (index > mask)
+        first_index.store(std::max(first_index.load(std::memory_order_relaxed), index - mask), std::memory_order_release);
+    if (index < first_index.load(std::memory_order_relaxed))
+        first_index.store(index, std::memory_order_release);
+
+    UInt64 bytes = bytesOf(entry);
+    Slot & slot = slots[index & mask];
+    slot.lock();
+    UInt64 replaced_bytes = slot.entry ? slot.bytes : 0;
+    bool replaced = slot.entry != nullptr;
+    slot.index = index;
+    slot.bytes = bytes;
+    slot.entry = entry;
+    slot.unlock();
+
+    if (replaced)
+    {
+        total_bytes.fetch_sub(replaced_bytes, std::memory_order_relaxed);
+        total_entries.fetch_sub(1, std::memory_order_relaxed);
+    }
+    total_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    total_entries.fetch_add(1, std::memory_order_relaxed);
+    last_index.store(std::max(last_index.load(std::memory_order_relaxed), index), std::memory_order_release);
+
+    UInt64 first = first_index.load(std::memory_order_relaxed);
+    UInt64 limit = max_bytes.load(std::memory_order_relaxed);
+    while (total_bytes.load(std::memory_order_relaxed) > limit && first < index && first < pinned_index)
+    {
+        first_index.store(first + 1, std::memory_order_release);
+        evict(first);
+        ++first;
+    }
+}
+
+void LogEntryCache::evict(UInt64 index)
+{
+    Slot & slot = slots[index & mask];
+    ptr<log_entry> evicted;
+    slot.lock();
+    if (slot.index == index && slot.entry)
+    {
+        evicted = std::move(slot.entry);
+        slot.entry = nullptr;
+        total_bytes.fetch_sub(slot.bytes, std::memory_order_relaxed);
+        total_entries.fetch_sub(1, std::memory_order_relaxed);
+    }
+    slot.unlock();
+}
+
+void LogEntryCache::clear()
+{
+    UInt64 first = first_index.load(std::memory_order_relaxed);
+    UInt64 last = last_index.load(std::memory_order_relaxed);
+    /// Readers miss from now on
+    first_index.store(last + 1, std::memory_order_release);
+    for (UInt64 index = first; index <= last; ++index)
+        evict(index);
+}
+
+LogCacheStats LogEntryCache::getStats() const
+{
+    LogCacheStats stats;
+    stats.hits = hits.load(std::memory_order_relaxed);
+    stats.misses = misses.load(std::memory_order_relaxed);
+    stats.entries = total_entries.load(std::memory_order_relaxed);
+    stats.bytes = total_bytes.load(std::memory_order_relaxed);
+    stats.max_bytes = max_bytes.load(std::memory_order_relaxed);
+    return stats;
+}
+
+}
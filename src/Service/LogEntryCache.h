@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <libnuraft/nuraft.hxx>
+#include <common/types.h>
+
+namespace RK
+{
+using nuraft::log_entry;
+using nuraft::ptr;
+
+/// Lookups of the log entry cache and of the read ahead buffer behind it
+struct LogCacheStats
+{
+    UInt64 hits{0};
+    UInt64 misses{0};
+    /// Misses served by entries read ahead of a sequential reader
+    UInt64 read_ahead_hits{0};
+    UInt64 entries{0};
+    UInt64 bytes{0};
+    UInt64 max_bytes{0};
+};
+
+/** In-memory cache of the tail of the Raft log, bounded by bytes.
+ *
+ * Entries are kept in a ring of slots by index. A reader locks only the slot it reads with a spin lock,
+ * so the commit thread and replication to followers do not contend on the hot tail. Once entries take
+ * more than max_bytes, the oldest ones are evicted, the newest entry is always kept. Pinned entries, which are
+ * not written to segments yet, are kept over max_bytes too.
+ *
+ * put, clear, pin and unpin must not be called concurrently, get and setMaxBytes are thread safe.
+ */
+class LogEntryCache
+{
+public:
+    static constexpr size_t DEFAULT_RING_SIZE = 65536;
+    static constexpr UInt64 DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+    explicit LogEntryCache(UInt64 max_bytes_, size_t ring_size = DEFAULT_RING_SIZE);
+
+    /// nullptr if the entry is not cached
+    ptr<log_entry> get(UInt64 index);
+    void put(UInt64 index, const ptr<log_entry> & entry);
+    void clear();
+
+    /// Entries over a lower limit are evicted by the next put
+    void setMaxBytes(UInt64 max_bytes_) { max_bytes.store(max_bytes_, std::memory_order_relaxed); }
+
+    /// Entries from index on are not evicted by bytes until unpin, they are evicted by the next put after it
+    void pin(UInt64 index) { pinned_index = index; }
+    void unpin() { pinned_index = NOT_PINNED; }
+
+    LogCacheStats getStats() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<bool> locked{false};
+        UInt64 index{0};
+        UInt64 bytes{0};
+        ptr<log_entry> entry;
+
+        void lock();
+        void unlock() { locked.store(false, std::memory_order_release); }
+    };
+
+    static UInt64 bytesOf(const ptr<log_entry> & entry);
+
+    /// Remove index from its slot if it is still there
+    void evict(UInt64 index);
+
+    std::atomic<UInt64> max_bytes;
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+
+    /// Cached entries are in [first_index, last_index], some of them may be missing
+    std::atomic<UInt64> first_index{1};
+    std::atomic<UInt64> last_index{0};
+    std::atomic<UInt64> total_bytes{0};
+    std::atomic<UInt64> total_entries{0};
+
+    static constexpr UInt64 NOT_PINNED = std::numeric_limits<UInt64>::max();
+    UInt64 pinned_index = NOT_PINNED;
+
+    std::atomic<UInt64> hits{0};
+    std::atomic<UInt64> misses{0};
+};
+
+}
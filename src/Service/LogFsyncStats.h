@@ -0,0 +1,32 @@
+#pragma once
+
+#include <algorithm>
+#include <common/types.h>
+
+namespace RK
+{
+
+/// Fsyncs of fsync_parallel and fsync_batch modes, histograms are in power of 2 buckets, bucket i counts values in [2^(i-1), 2^i)
+struct LogFsyncStats
+{
+    static constexpr size_t BUCKETS = 20;
+
+    static size_t bucketOf(UInt64 value) { return std::min<size_t>(value ? 64 - __builtin_clzll(value) : 0, BUCKETS - 1); }
+    static UInt64 bucketLowerBound(size_t bucket) { return bucket ? 1ULL << (bucket - 1) : 0; }
+
+    UInt64 fsync_count{0};
+    UInt64 total_latency_us{0};
+    UInt64 max_latency_us{0};
+    /// Entries made durable by one fsync
+    UInt64 total_batch_size{0};
+    UInt64 latency_us[BUCKETS]{};
+    UInt64 batch_size[BUCKETS]{};
+
+    /// fsync_batch: how long the oldest entry of the last fsync waited to be durable, and the most of it
+    UInt64 last_durability_lag_us{0};
+    UInt64 max_durability_lag_us{0};
+    /// fsync_batch: entries not durable which make an fsync now, adapted to log_fsync_max_lag_ms
+    UInt64 batch_fsync_entries{0};
+};
+
+}
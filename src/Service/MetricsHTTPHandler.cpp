@@ -0,0 +1,440 @@
+#include <Service/MetricsHTTPHandler.h>
+
+#include <algorithm>
+#include <IO/Operators.h>
+#include <IO/ReadHelpers.h>
+#include <IO/ReadBufferFromIStream.h>
+#include <IO/WriteBufferFromOStream.h>
+#include <IO/WriteBufferFromString.h>
+#include <IO/WriteHelpers.h>
+#include <Service/FourLetterCommand.h>
+#include <Service/KeeperDispatcher.h>
+#include <Service/RelayReplicator.h>
+#include <Service/SubtreeExport.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Path.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/URI.h>
+#include <Poco/Timestamp.h>
+#include <Common/CurrentMetrics.h>
+#include <Common/Exception.h>
+#include <Common/ProfileEvents.h>
+#include <Common/StringUtils/StringUtils.h>
+#include <common/find_symbols.h>
+#include <common/logger_useful.h>
+
+namespace RK
+{
+
+namespace
+{
+    using Buffer = WriteBufferFromOwnString;
+
+    void writeFamily(Buffer & out, const String & name, const char * type, const char * unit = nullptr)
+    {
+        out << "# TYPE " << name << ' ' << type << '\n';
+        if (unit)
+            out << "# UNIT " << name << ' ' << unit << '\n';
+    }
+
+    void writeSample(Buffer & out, const String & name, const String & labels, UInt64 value)
+    {
+        out << name;
+        if (!labels.empty())
+            out << '{' << labels << '}';
+        out << ' ' << value << '\n';
+    }
+
+    String escapeLabel(const String & value)
+    {
+        String escaped;
+        escaped.reserve(value.size());
+        for (char c : value)
+        {
+            if (c == '\\' || c == '"')
+                escaped += '\\';
+            if (c == '\n')
+            {
+                escaped += "\\n";
+                continue;
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    String label(const String & name, const String & value)
+    {
+        return name + "=\"" + escapeLabel(value) + "\"";
+    }
+
+    String joinLabels(const String & lhs, const String & rhs)
+    {
+        return lhs.empty() ? rhs : lhs + "," + rhs;
+    }
+
+    /// Buckets are merged to powers of 2, which is enough for dashboards and keeps the series few
+    void writeLatencyHistogram(Buffer & out, const String & name, const String & labels, const LatencyHistogram::Counts & counts)
+    {
+        UInt64 cumulative = 0;
+        for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket)
+        {
+            cumulative += counts[bucket];
+            if ((bucket + 1) % LatencyHistogram::SUB_BUCKETS == 0 && bucket + 1 < LatencyHistogram::BUCKETS)
+            {
+                String le = label("le", toString(LatencyHistogram::bucketUpperBound(bucket)));
+                writeSample(out, name + "_bucket", joinLabels(labels, le), cumulative);
+            }
+        }
+        writeSample(out, name + "_bucket", joinLabels(labels, label("le", "+Inf")), cumulative);
+        writeSample(out, name + "_count", labels, cumulative);
+    }
+
+    /// Bucket i of LogFsyncStats counts values in [2^(i-1), 2^i), the last one also the larger values
+    void writeFsyncHistogram(Buffer & out, const String & name, const UInt64 (&buckets)[LogFsyncStats::BUCKETS], UInt64 count, UInt64 sum)
+    {
+        UInt64 cumulative = 0;
+        for (size_t bucket = 0; bucket + 1 < LogFsyncStats::BUCKETS; ++bucket)
+        {
+            cumulative += buckets[bucket];
+            writeSample(out, name + "_bucket", label("le", toString(LogFsyncStats::bucketLowerBound(bucket + 1) - 1)), cumulative);
+        }
+        writeSample(out, name + "_bucket", label("le", "+Inf"), count);
+        writeSample(out, name + "_count", "", count);
+        writeSample(out, name + "_sum", "", sum);
+    }
+
+    bool isNumber(const String & value)
+    {
+        return !value.empty() && std::all_of(value.begin(), value.end(), [](char c) { return isNumericASCII(c); });
+    }
+
+    /// Lines of mntr are zk_<key>\t<value>, numbers are exported as gauges and the others as info
+    void writeMonitorFields(Buffer & out, const String & fields)
+    {
+        const char * pos = fields.data();
+        const char * end = fields.data() + fields.size();
+        while (pos < end)
+        {
+            const char * line_end = find_first_symbols<'\n'>(pos, end);
+            const char * tab = find_first_symbols<'\t'>(pos, line_end);
+            if (tab != line_end && line_end - pos > 3 && std::string_view(pos, 3) == "zk_")
+            {
+                String name = "raftkeeper_" + String(pos + 3, tab);
+                String value(tab + 1, line_end);
+                if (isNumber(value))
+                {
+                    writeFamily(out, name, "gauge");
+                    out << name << ' ' << value << '\n';
+                }
+                else
+                {
+                    writeFamily(out, name, "info");
+                    writeSample(out, name + "_info", label("value", value), 1);
+                }
+            }
+            pos = line_end + 1;
+        }
+    }
+}
+
+String renderMetrics(KeeperDispatcher & keeper_dispatcher)
+{
+    Buffer out;
+
+    /// Without a leader mntr reports only that the server is not serving
+    String monitor_fields = MonitorCommand(keeper_dispatcher).run();
+    bool serving = monitor_fields.starts_with("zk_");
+    writeFamily(out, "raftkeeper_serving", "gauge");
+    writeSample(out, "raftkeeper_serving", "", serving);
+    if (serving)
+        writeMonitorFields(out, monitor_fields);
+
+    const auto & latency_stats = keeper_dispatcher.getRequestLatencyStats();
+    writeFamily(out, "raftkeeper_request_latency_microseconds", "histogram", "microseconds");
+    for (size_t role = 0; role < RequestLatencyStats::ROLES; ++role)
+    {
+        for (size_t slot = 0; slot < RequestLatencyStats::OPERATION_SLOTS; ++slot)
+        {
+            auto counts = latency_stats.get(static_cast<RequestLatencyStats::Role>(role), slot).getCounts();
+            if (std::all_of(counts.begin(), counts.end(), [](UInt64 count) { return count == 0; }))
+                continue;
+            String labels = joinLabels(
+                label("role", RequestLatencyStats::roleName(static_cast<RequestLatencyStats::Role>(role))),
+                label("operation", RequestLatencyStats::operationName(slot)));
+            writeLatencyHistogram(out, "raftkeeper_request_latency_microseconds", labels, counts);
+        }
+    }
+
+    const auto & tracer = keeper_dispatcher.getRequestTracer();
+    writeFamily(out, "raftkeeper_request_stage_microseconds", "histogram", "microseconds");
+    for (size_t span = 0; span < RequestTracer::SPANS; ++span)
+        writeLatencyHistogram(
+            out,
+            "raftkeeper_request_stage_microseconds",
+            label("stage", RequestTracer::spanName(static_cast<RequestTracer::Span>(span))),
+            tracer.get(static_cast<RequestTracer::Span>(span)).getCounts());
+
+    writeFamily(out, "raftkeeper_snapshot_duration_microseconds", "histogram", "microseconds");
+    const auto & snapshot_latency = keeper_dispatcher.getStateMachine().getSnapshotLatency();
+    writeLatencyHistogram(out, "raftkeeper_snapshot_duration_microseconds", "", snapshot_latency.getCounts());
+
+    auto fsync = keeper_dispatcher.getKeeperLogInfo().fsync_stats;
+    writeFamily(out, "raftkeeper_log_fsync_latency_microseconds", "histogram", "microseconds");
+    writeFsyncHistogram(out, "raftkeeper_log_fsync_latency_microseconds", fsync.latency_us, fsync.fsync_count, fsync.total_latency_us);
+    writeFamily(out, "raftkeeper_log_fsync_entries", "histogram");
+    writeFsyncHistogram(out, "raftkeeper_log_fsync_entries", fsync.batch_size, fsync.fsync_count, fsync.total_batch_size);
+    writeFamily(out, "raftkeeper_log_durability_lag_microseconds", "gauge", "microseconds");
+    writeSample(out, "raftkeeper_log_durability_lag_microseconds", "", fsync.last_durability_lag_us);
+
+    /// Top 10 keys only, so that the series stay few
+    const auto & hot_key_stats = keeper_dispatcher.getHotKeyStats();
+    for (bool by_bytes : {false, true})
+    {
+        String name = by_bytes ? "raftkeeper_hot_key_bytes" : "raftkeeper_hot_key_requests";
+        writeFamily(out, name, "gauge", by_bytes ? "bytes" : nullptr);
+        for (size_t dimension = 0; dimension < HotKeyStats::DIMENSIONS; ++dimension)
+        {
+            for (const auto & hot_key : hot_key_stats.top(static_cast<HotKeyStats::Dimension>(dimension), by_bytes, 10))
+            {
+                String dimension_label = label("dimension", HotKeyStats::dimensionName(static_cast<HotKeyStats::Dimension>(dimension)));
+                String labels = joinLabels(dimension_label, label("key", hot_key.key));
+                writeSample(out, name, labels, hot_key.value);
+            }
+        }
+    }
+
+    for (ProfileEvents::Event event = 0, events_end = ProfileEvents::end(); event < events_end; ++event)
+    {
+        String name = String("raftkeeper_profile_events_") + ProfileEvents::getName(event);
+        writeFamily(out, name, "counter");
+        writeSample(out, name + "_total", "", ProfileEvents::global_counters[event].load(std::memory_order_relaxed));
+    }
+
+    for (CurrentMetrics::Metric metric = 0, metrics_end = CurrentMetrics::end(); metric < metrics_end; ++metric)
+    {
+        String name = String("raftkeeper_metric_") + CurrentMetrics::getName(metric);
+        writeFamily(out, name, "gauge");
+        out << name << ' ' << CurrentMetrics::values[metric].load(std::memory_order_relaxed) << '\n';
+    }
+
+    out << "# EOF\n";
+    return out.str();
+}
+
+void MetricsHTTPRequestHandler::handleSnapshotRequest(const String & uri, Poco::Net::HTTPServerResponse & response)
+{
+    /// The leader is the busiest server, the joining server asks another peer
+    if (keeper_dispatcher.isLeader())
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+        response.send() << "Leader does not serve snapshots\n";
+        return;
+    }
+
+    auto files = keeper_dispatcher.getLastSnapshotFiles();
+    if (uri == "/snapshot")
+    {
+        String names;
+        for (const auto & file : files)
+            names += Poco::Path(file).getFileName() + '\n';
+        response.setContentType("text/plain; charset=utf-8");
+        response.setContentLength(names.size());
+        response.send() << names;
+        return;
+    }
+
+    /// Only the files of the last snapshot, a name is never a path
+    String name = uri.substr(sizeof("/snapshot/") - 1);
+    auto it = std::find_if(files.begin(), files.end(), [&](const String & file) { return Poco::Path(file).getFileName() == name; });
+    if (it == files.end())
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+        response.send() << "Not a file of the last snapshot\n";
+        return;
+    }
+    /// Removed snapshot files fail the send, the joining server fetches again
+    response.sendFile(*it, "application/octet-stream");
+}
+
+void MetricsHTTPRequestHandler::handleExportRequest(const String & uri, Poco::Net::HTTPServerResponse & response)
+{
+    String root = "/";
+    for (const auto & [name, value] : Poco::URI(uri).getQueryParameters())
+        if (name == "path")
+            root = value;
+
+    auto & store = keeper_dispatcher.getStore();
+    if (!store.container.get(root))
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+        response.send() << "No node " << root << '\n';
+        return;
+    }
+
+    /// Chunks are sent as the buffer fills, a slow reader blocks the export by the socket
+    response.setContentType("application/octet-stream");
+    response.setChunkedTransferEncoding(true);
+    WriteBufferFromOStream out(response.send());
+
+    auto * log = &Poco::Logger::get("MetricsHTTPHandler");
+    Poco::Timestamp start;
+    size_t exported = exportSubtree(store, root, out);
+    out.next();
+    LOG_INFO(log, "Exported {} nodes of {} in {} ms", exported, root, start.elapsed() / 1000);
+}
+
+void MetricsHTTPRequestHandler::handleImportRequest(Poco::Net::HTTPServerRequest & request, Poco::Net::HTTPServerResponse & response)
+{
+    /// Internal requests are appended by the leader only
+    if (!keeper_dispatcher.isLeader())
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+        response.send() << "Import is served by the leader\n";
+        return;
+    }
+
+    String root;
+    for (const auto & [name, value] : Poco::URI(request.getURI()).getQueryParameters())
+        if (name == "path")
+            root = value;
+
+    /// The queue paces the import, a batch is read from the body once the one before is queued
+    ReadBufferFromIStream in(request.stream());
+    size_t batches = 0;
+    Poco::Timestamp start;
+    size_t imported = importSubtree(in, root, [&](const Coordination::ZooKeeperRequestPtr & batch)
+    {
+        keeper_dispatcher.putInternalRequest(batch);
+        ++batches;
+    });
+    auto * log = &Poco::Logger::get("MetricsHTTPHandler");
+    LOG_INFO(log, "Imported {} nodes by {} batches in {} ms", imported, batches, start.elapsed() / 1000);
+
+    String result = fmt::format("{} nodes in {} batches\n", imported, batches);
+    response.setContentType("text/plain; charset=utf-8");
+    response.setContentLength(result.size());
+    response.send() << result;
+}
+
+void MetricsHTTPRequestHandler::handleLogRequest(const String & uri, Poco::Net::HTTPServerResponse & response)
+{
+    UInt64 from = 0;
+    Int32 server = -1;
+    UInt64 wait_ms = 0;
+    for (const auto & [name, value] : Poco::URI(uri).getQueryParameters())
+    {
+        if (name == "from")
+            from = parse<UInt64>(value);
+        else if (name == "server")
+            server = parse<Int32>(value);
+        else if (name == "wait_ms")
+            wait_ms = std::min(parse<UInt64>(value), RelayReplicator::FETCH_WAIT_MS);
+    }
+
+    auto log_pack = keeper_dispatcher.readRelayLog(server, from, wait_ms);
+    if (log_pack.compacted)
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_GONE);
+        response.send() << "Log before " << from << " is compacted\n";
+        return;
+    }
+
+    response.set(RelayReplicator::COMMIT_INDEX_HEADER, toString(log_pack.commit_index));
+    response.set(RelayReplicator::SOURCE_COMMIT_INDEX_HEADER, toString(log_pack.source_commit_index));
+    response.set(RelayReplicator::LEADER_HEADER, toString(log_pack.leader));
+    if (!log_pack.pack)
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_NO_CONTENT);
+        response.setContentLength(0);
+        response.send();
+        return;
+    }
+    response.setContentType("application/octet-stream");
+    response.setContentLength(log_pack.pack->size());
+    response.send().write(reinterpret_cast<const char *>(log_pack.pack->data_begin()), log_pack.pack->size());
+}
+
+void MetricsHTTPRequestHandler::handleAppendRequest(Poco::Net::HTTPServerRequest & request, Poco::Net::HTTPServerResponse & response)
+{
+    String body;
+    Poco::StreamCopier::copyToString(request.stream(), body);
+    auto entry = buffer::alloc(body.size());
+    entry->put_raw(reinterpret_cast<const nuraft::byte *>(body.data()), body.size());
+    entry->pos(0);
+
+    ptr<buffer> result;
+    try
+    {
+        result = keeper_dispatcher.appendDownstreamEntry(entry);
+    }
+    catch (...)
+    {
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE);
+        response.send() << getCurrentExceptionMessage(false) << '\n';
+        return;
+    }
+
+    response.setContentType("application/octet-stream");
+    response.setContentLength(result ? result->size() : 0);
+    auto & out = response.send();
+    if (result)
+        out.write(reinterpret_cast<const char *>(result->data_begin()), result->size());
+}
+
+void MetricsHTTPRequestHandler::handleRequest(Poco::Net::HTTPServerRequest & request, Poco::Net::HTTPServerResponse & response)
+{
+    try
+    {
+        const String & uri = request.getURI();
+        if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_GET && (uri == "/snapshot" || uri.starts_with("/snapshot/")))
+        {
+            handleSnapshotRequest(uri, response);
+            return;
+        }
+        if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_GET && (uri == "/export" || uri.starts_with("/export?")))
+        {
+            handleExportRequest(uri, response);
+            return;
+        }
+        if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_POST && (uri == "/import" || uri.starts_with("/import?")))
+        {
+            handleImportRequest(request, response);
+            return;
+        }
+        if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_GET && uri.starts_with("/log?"))
+        {
+            handleLogRequest(uri, response);
+            return;
+        }
+        if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_POST && uri == "/append")
+        {
+            handleAppendRequest(request, response);
+            return;
+        }
+
+        if (request.getMethod() != Poco::Net::HTTPRequest::HTTP_GET || uri != "/metrics")
+        {
+            response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_NOT_FOUND);
+            response.send() << "Not found, metrics are at /metrics\n";
+            return;
+        }
+
+        String metrics = renderMetrics(keeper_dispatcher);
+        response.setContentType("application/openmetrics-text; version=1.0.0; charset=utf-8");
+        response.setContentLength(metrics.size());
+        response.send() << metrics;
+    }
+    catch (...)
+    {
+        tryLogCurrentException(&Poco::Logger::get("MetricsHTTPHandler"), "Failed to serve " + request.getURI());
+        if (!response.sent())
+        {
+            response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            response.send() << getCurrentExceptionMessage(false) << '\n';
+        }
+    }
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+class KeeperDispatcher;
+
+/** Metrics of the server in OpenMetrics text format for Prometheus: all the fields of mntr, latency histograms of
+ * requests and of their pipeline stages, log fsyncs and snapshots, the hottest paths, sessions and clients, and the
+ * global ProfileEvents and CurrentMetrics.
+ *
+ * The values are read from counters kept anyway, rendering takes about as long as mntr.
+ */
+String renderMetrics(KeeperDispatcher & keeper_dispatcher);
+
+/** Serves renderMetrics at GET /metrics.
+ *
+ * A follower also serves the files of its last snapshot to servers joining the cluster: their names one per line at
+ * GET /snapshot and each of them at GET /snapshot/<name>. See fetchSnapshotFromPeers.
+ *
+ * GET /export?path=<path> streams the subtree of path, / by default, by chunked transfer, see exportSubtree. The
+ * export runs on the thread of the HTTP server, best on a follower.
+ *
+ * POST /import?path=<path> on the leader creates the nodes of an export in the body under path, at their own paths by
+ * default, see importSubtree. The batches are queued when it answers and applied in order after.
+ *
+ * A relay serves its committed log to the servers replicating from it: GET /log?from=<index>&server=<id>&wait_ms=<ms>
+ * answers a pack of entries from index, waiting for the first one, and POST /append appends the session request in
+ * the body and answers its response. See RelayReplicator.
+ */
+class MetricsHTTPRequestHandler : public Poco::Net::HTTPRequestHandler
+{
+public:
+    explicit MetricsHTTPRequestHandler(KeeperDispatcher & keeper_dispatcher_) : keeper_dispatcher(keeper_dispatcher_) { }
+
+    void handleRequest(Poco::Net::HTTPServerRequest & request, Poco::Net::HTTPServerResponse & response) override;
+
+private:
+    void handleSnapshotRequest(const String & uri, Poco::Net::HTTPServerResponse & response);
+    void handleExportRequest(const String & uri, Poco::Net::HTTPServerResponse & response);
+    void handleImportRequest(Poco::Net::HTTPServerRequest & request, Poco::Net::HTTPServerResponse & response);
+    void handleLogRequest(const String & uri, Poco::Net::HTTPServerResponse & response);
+    void handleAppendRequest(Poco::Net::HTTPServerRequest & request, Poco::Net::HTTPServerResponse & response);
+
+    KeeperDispatcher & keeper_dispatcher;
+};
+
+class MetricsHTTPRequestHandlerFactory : public Poco::Net::HTTPRequestHandlerFactory
+{
+public:
+    explicit MetricsHTTPRequestHandlerFactory(KeeperDispatcher & keeper_dispatcher_) : keeper_dispatcher(keeper_dispatcher_) { }
+
+    Poco::Net::HTTPRequestHandler * createRequestHandler(const Poco::Net::HTTPServerRequest &) override
+    {
+        return new MetricsHTTPRequestHandler(keeper_dispatcher);
+    }
+
+private:
+    KeeperDispatcher & keeper_dispatcher;
+};
+
+}
@@ -0,0 +1,529 @@
+#include <Service/MultiplexConnectionHandler.h>
+
+#include <IO/ReadBufferFromMemory.h>
+#include <Service/KeeperDispatcher.h>
+#include <Service/formatHex.h>
+#include <Poco/Net/NetException.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <Common/ZooKeeper/ZooKeeperIO.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int UNEXPECTED_PACKET_FROM_CLIENT;
+    extern const int TIMEOUT_EXCEEDED;
+}
+
+using Poco::NObserver;
+
+MultiplexConnectionHandler::MultiplexConnectionHandler(Context & global_context_, StreamSocket & socket, SocketReactor & reactor)
+    : log(&Logger::get("MultiplexConnectionHandler"))
+    , socket_(socket)
+    , reactor_(reactor)
+    , global_context(global_context_)
+    , keeper_dispatcher(global_context.getDispatcher())
+    , session_timeout(
+          0,
+          global_context.getConfigRef().getUInt(
+              "keeper.raft_settings.session_timeout_ms", Coordination::DEFAULT_SESSION_TIMEOUT_MS)
+              * 1000)
+    , shared(std::make_shared<Shared>())
+    , responses(std::make_unique<ThreadSafeResponseQueue>())
+    , max_send_iov_count(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_send_iov_count)
+    , max_send_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_send_bytes)
+    , max_queued_response_bytes(keeper_dispatcher->getKeeperConfigurationAndSettings()->max_connection_queued_response_bytes)
+    , ip_rate_bucket(keeper_dispatcher->getRateLimiter().ipBucket(socket_.peerAddress().host().toString()))
+    , relaxed_read_order(keeper_dispatcher->isRelaxedReadOrderClient(socket_.peerAddress().host()))
+    , address_client_group(keeper_dispatcher->getClientGroups().ofAddress(socket_.peerAddress().host()))
+{
+    LOG_DEBUG(log, "New multiplexed connection from {}", socket_.peerAddress().toString());
+    shared->conn = this;
+
+    reactor_.addEventHandler(
+        socket_, NObserver<MultiplexConnectionHandler, ReadableNotification>(*this, &MultiplexConnectionHandler::onSocketReadable));
+    reactor_.addEventHandler(
+        socket_, NObserver<MultiplexConnectionHandler, ErrorNotification>(*this, &MultiplexConnectionHandler::onSocketError));
+    reactor_.addEventHandler(
+        socket_, NObserver<MultiplexConnectionHandler, ShutdownNotification>(*this, &MultiplexConnectionHandler::onReactorShutdown));
+}
+
+MultiplexConnectionHandler::~MultiplexConnectionHandler()
+{
+    try
+    {
+        /// Session requests and responses may be done any time, they find the connection gone
+        {
+            std::lock_guard lock(shared->mutex);
+            shared->conn = nullptr;
+        }
+
+        for (const auto & [_, channel] : channels)
+        {
+            if (!channel.handshake_done)
+                continue;
+            LOG_INFO(log, "Disconnecting session {}", toHexString(channel.session_id));
+            keeper_dispatcher->getHotKeyStats().unregisterClient(channel.session_id);
+        }
+
+        reactor_.removeEventHandler(
+            socket_, NObserver<MultiplexConnectionHandler, ReadableNotification>(*this, &MultiplexConnectionHandler::onSocketReadable));
+        reactor_.removeEventHandler(
+            socket_, NObserver<MultiplexConnectionHandler, WritableNotification>(*this, &MultiplexConnectionHandler::onSocketWritable));
+        reactor_.removeEventHandler(
+            socket_, NObserver<MultiplexConnectionHandler, ErrorNotification>(*this, &MultiplexConnectionHandler::onSocketError));
+        reactor_.removeEventHandler(
+            socket_, NObserver<MultiplexConnectionHandler, ShutdownNotification>(*this, &MultiplexConnectionHandler::onReactorShutdown));
+    }
+    catch (...)
+    {
+    }
+}
+
+void MultiplexConnectionHandler::onSocketReadable(const AutoPtr<ReadableNotification> & /*pNf*/)
+{
+    try
+    {
+        if (!socket_.available())
+        {
+            /// An edge triggered reactor may report data which was already drained when handling the last event
+            if (reactor_.isEdgeTriggered()
+                && !socket_.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_ERROR))
+                return;
+            LOG_INFO(log, "Client {} closed multiplexed connection, errno {}", socket_.peerAddress().toString(), errno);
+            destroyMe();
+            return;
+        }
+
+        while (!reading_paused && socket_.available())
+        {
+            if (!receiveFrames())
+            {
+                destroyMe();
+                return;
+            }
+        }
+    }
+    catch (Poco::Net::NetException &)
+    {
+        tryLogCurrentException(log, "Network error when receiving requests, will close multiplexed connection");
+        destroyMe();
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Fatal error when handling requests, will close multiplexed connection");
+        destroyMe();
+    }
+}
+
+bool MultiplexConnectionHandler::receiveFrames()
+{
+    /// Reactor threads serve one connection at a time, so one buffer for each of them
+    thread_local std::unique_ptr<char[]> receive_buffer;
+    if (!receive_buffer)
+        receive_buffer = std::make_unique<char[]>(RECEIVE_BUFFER_SIZE);
+
+    int received = socket_.receiveBytes(receive_buffer.get(), RECEIVE_BUFFER_SIZE);
+    if (received <= 0)
+        return true;
+    pending.append(receive_buffer.get(), received);
+
+    size_t pos = 0;
+    while (pending.size() - pos >= FRAME_HEAD_SIZE + sizeof(int32_t))
+    {
+        ReadBufferFromMemory head(pending.data() + pos, FRAME_HEAD_SIZE + sizeof(int32_t));
+        int32_t frame_length;
+        int64_t channel_id;
+        int32_t packet_length;
+        Coordination::read(frame_length, head);
+        Coordination::read(channel_id, head);
+        Coordination::read(packet_length, head);
+
+        if (packet_length < 0 || packet_length > MAX_PACKET_SIZE
+            || frame_length != static_cast<int32_t>(sizeof(int64_t) + sizeof(int32_t)) + packet_length)
+        {
+            LOG_WARNING(log, "Bad frame of length {} and packet length {} on channel {}", frame_length, packet_length, channel_id);
+            return false;
+        }
+
+        if (pending.size() - pos < sizeof(int32_t) + frame_length)
+            break;
+
+        pos += FRAME_HEAD_SIZE + sizeof(int32_t);
+        keeper_dispatcher->incrementPacketsReceived();
+        handleFrame(channel_id, pending.data() + pos, packet_length);
+        pos += packet_length;
+    }
+
+    pending.erase(0, pos);
+    return true;
+}
+
+void MultiplexConnectionHandler::handleFrame(int64_t channel_id, const char * data, int32_t length)
+{
+    auto it = channels.find(channel_id);
+    if (it == channels.end())
+    {
+        receiveHandshake(channel_id, data, length);
+        return;
+    }
+
+    if (!it->second.handshake_done)
+        throw Exception(
+            ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Request on channel {} before its handshake is answered", channel_id);
+    receiveRequest(channel_id, it->second, data, length);
+}
+
+void MultiplexConnectionHandler::receiveHandshake(int64_t channel_id, const char * data, int32_t length)
+{
+    if (length != Coordination::CLIENT_HANDSHAKE_LENGTH && length != Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_READONLY)
+        throw Exception(
+            ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT, "Unexpected handshake length {} on channel {}", length, channel_id);
+
+    ReadBufferFromMemory in(data, length);
+    ConnectRequest connect_req;
+    Coordination::read(connect_req.protocol_version, in);
+    if (connect_req.protocol_version != Coordination::ZOOKEEPER_PROTOCOL_VERSION)
+        throw Exception(
+            ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT,
+            "Unexpected protocol version {} on channel {}",
+            connect_req.protocol_version,
+            channel_id);
+    Coordination::read(connect_req.last_zxid_seen, in);
+    Coordination::read(connect_req.timeout_ms, in);
+    Coordination::read(connect_req.previous_session_id, in);
+    Coordination::read(connect_req.passwd, in);
+
+    auto & channel = channels[channel_id];
+    channel.session_timeout = session_timeout;
+    if (connect_req.timeout_ms != 0)
+        channel.session_timeout = std::min(Poco::Timespan(connect_req.timeout_ms * 1000), session_timeout);
+    channel.session_rate_bucket = keeper_dispatcher->getRateLimiter().sessionBucket();
+
+    /// Refused as by ConnectionHandler::receiveHandshake and handleHandshake, only the channel is closed
+    bool can_connect = keeper_dispatcher->hasLeader() && !keeper_dispatcher->isWitness();
+    int64_t last_zxid = keeper_dispatcher->getStateMachine().getLastProcessedZxid();
+    if (connect_req.last_zxid_seen > last_zxid)
+    {
+        if (keeper_dispatcher->getKeeperConfigurationAndSettings()->raft_settings->zxid_fence_wait_ms)
+            channel.read_fence_zxid = connect_req.last_zxid_seen;
+        else
+            can_connect = false;
+    }
+
+    bool expired = false;
+    if (can_connect && connect_req.previous_session_id)
+    {
+        expired = !keeper_dispatcher->getStateMachine().containsSession(connect_req.previous_session_id);
+        can_connect = !expired;
+    }
+    else if (can_connect)
+        can_connect = keeper_dispatcher->admitNewSession();
+
+    if (can_connect)
+    {
+        int64_t previous_session_id = connect_req.previous_session_id;
+        auto callback = [shared_ = shared, channel_id, previous_session_id](int64_t session_id, bool expired_)
+        {
+            std::lock_guard lock(shared_->mutex);
+            if (!shared_->conn)
+                return;
+            shared_->session_request_results.push_back({channel_id, previous_session_id, session_id, expired_});
+            /// Finished on the reactor thread
+            shared_->conn->queueFrames({});
+        };
+        if (keeper_dispatcher->putSessionRequest(connect_req.previous_session_id, channel.session_timeout.totalMilliseconds(), callback))
+            return;
+        LOG_WARNING(log, "Too many handshakes waiting for their sessions");
+    }
+
+    LOG_WARNING(log, "Refuse handshake on channel {}, previous session {}", channel_id, toHexString(connect_req.previous_session_id));
+    channel.session_id = connect_req.previous_session_id;
+    sendHandshake(channel_id, channel, false, expired);
+    channels.erase(channel_id);
+}
+
+void MultiplexConnectionHandler::receiveRequest(int64_t channel_id, Channel & channel, const char * data, int32_t length)
+{
+    int64_t session_id = channel.session_id;
+    ReadBufferFromMemory body(data, length);
+    int32_t xid;
+    Coordination::read(xid, body);
+    Coordination::OpNum opnum;
+    Coordination::read(opnum, body);
+
+    if (opnum != Coordination::OpNum::Heartbeat)
+        LOG_DEBUG(
+            log,
+            "Receive request: channel {}, session {}, xid {}, length {}, opnum {}",
+            channel_id,
+            toHexString(session_id),
+            xid,
+            length,
+            Coordination::toString(opnum));
+
+    /// Internal requests are only made by servers
+    if (opnum == Coordination::OpNum::ExpireSessions || opnum == Coordination::OpNum::RegisterSession
+        || opnum == Coordination::OpNum::RemoveExpiredNodes)
+        throw Exception(
+            ErrorCodes::UNEXPECTED_PACKET_FROM_CLIENT,
+            "Session {} sent internal request {}",
+            toHexString(session_id),
+            Coordination::toString(opnum));
+
+    /// Auth requests are not captured for their credentials
+    auto & request_capture = keeper_dispatcher->getRequestCapture();
+    if (unlikely(request_capture.isActive()) && opnum != Coordination::OpNum::Heartbeat && opnum != Coordination::OpNum::Auth)
+        request_capture.record(session_id, data, length);
+
+    Coordination::ZooKeeperRequestPtr request = Coordination::ZooKeeperRequestFactory::instance().get(opnum);
+    request->xid = xid;
+    request->readImpl(body);
+    if (opnum == Coordination::OpNum::Sync && keeper_dispatcher->getKeeperConfigurationAndSettings()->raft_settings->lightweight_sync)
+        static_cast<Coordination::ZooKeeperSyncRequest &>(*request).barrier = true;
+    if (opnum == Coordination::OpNum::Heartbeat)
+        keeper_dispatcher->pingSession(session_id);
+
+    /// Frames are received in the buffer of the reactor, a write is copied into a log entry
+    nuraft::ptr<nuraft::buffer> log_entry;
+    if (!request->isReadRequest() && body.eof())
+    {
+        log_entry = nuraft::buffer::alloc(NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE + length + NuRaftStateMachine::LOG_ENTRY_TAIL_SIZE);
+        memcpy(log_entry->data_begin() + NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE, data, length);
+    }
+
+    /// Control requests, e.g. heartbeats and close, are never limited
+    bool rate_limited = PriorityRequestsQueue::laneOf(*request) != PriorityRequestsQueue::CONTROL && !acquireRateLimits(channel, *request);
+
+    if (channel.read_fence_zxid && keeper_dispatcher->getStateMachine().getLastProcessedZxid() >= channel.read_fence_zxid)
+        channel.read_fence_zxid = 0;
+    int64_t min_zxid = request->isReadRequest() ? channel.read_fence_zxid : 0;
+    channel.client_group = keeper_dispatcher->getClientGroups().ofRequest(
+        ClientGroups::merge(channel.client_group, address_client_group), *request, channel.client_group_path_checked);
+
+    if (!keeper_dispatcher->putRequest(
+            request, session_id, log_entry, rate_limited, min_zxid, relaxed_read_order, channel.client_group))
+        throw Exception(ErrorCodes::TIMEOUT_EXCEEDED, "Session {} already disconnected", toHexString(session_id));
+}
+
+bool MultiplexConnectionHandler::acquireRateLimits(Channel & channel, const Coordination::ZooKeeperRequest & request)
+{
+    auto & rate_limiter = keeper_dispatcher->getRateLimiter();
+    if (!channel.session_rate_bucket && !ip_rate_bucket && !rate_limiter.hasPathLimits())
+        return true;
+
+    UInt64 now_ns = clock_gettime_ns();
+    bool acquired = (!channel.session_rate_bucket || channel.session_rate_bucket->tryAcquire(now_ns))
+        && (!ip_rate_bucket || ip_rate_bucket->tryAcquire(now_ns))
+        && (!rate_limiter.hasPathLimits() || rate_limiter.tryAcquirePath(request.getPath(), now_ns));
+    if (!acquired)
+        rate_limiter.onRejected();
+    return acquired;
+}
+
+void MultiplexConnectionHandler::finishChannels()
+{
+    std::vector<SessionRequestResult> results;
+    std::vector<int64_t> closed;
+    {
+        std::lock_guard lock(shared->mutex);
+        results.swap(shared->session_request_results);
+        closed.swap(shared->closed_channels);
+    }
+
+    for (const auto & result : results)
+    {
+        auto it = channels.find(result.channel);
+        if (it == channels.end())
+            continue;
+        auto & channel = it->second;
+
+        if (!result.session_id)
+        {
+            LOG_WARNING(log, "Cannot get session for handshake on channel {}", result.channel);
+            channel.session_id = result.previous_session_id;
+            sendHandshake(result.channel, channel, false, result.expired);
+            channels.erase(it);
+            continue;
+        }
+
+        channel.session_id = result.session_id;
+        bool is_reconnected = result.previous_session_id != 0;
+        LOG_INFO(
+            log, "{} session {} on channel {}", is_reconnected ? "Reconnected" : "New", toHexString(channel.session_id), result.channel);
+
+        /// Registered before the handshake is answered, so that no response of the session is missed
+        auto callback = [shared_ = shared, channel_id = result.channel](const Coordination::ZooKeeperResponses & batch)
+        { sendResponses(shared_, channel_id, batch); };
+        keeper_dispatcher->registerSession(channel.session_id, callback, is_reconnected);
+        keeper_dispatcher->getHotKeyStats().registerClient(channel.session_id, socket_.peerAddress().host().toString());
+        if (!is_reconnected)
+            keeper_dispatcher->putRegisterSessionRequest(channel.session_id, channel.session_timeout.totalMilliseconds());
+
+        sendHandshake(result.channel, channel, true, false);
+        channel.handshake_done = true;
+    }
+
+    /// The close response is queued already, the session is closed by the request
+    for (auto channel_id : closed)
+    {
+        auto it = channels.find(channel_id);
+        if (it == channels.end())
+            continue;
+        keeper_dispatcher->finishSession(it->second.session_id);
+        keeper_dispatcher->getHotKeyStats().unregisterClient(it->second.session_id);
+        channels.erase(it);
+    }
+}
+
+void MultiplexConnectionHandler::sendHandshake(int64_t channel_id, const Channel & channel, bool connect_success, bool session_expired)
+{
+    WriteBufferFromFiFoBuffer out;
+    Coordination::write(Coordination::SERVER_HANDSHAKE_LENGTH, out);
+    Coordination::write(connect_success ? Coordination::ZOOKEEPER_PROTOCOL_VERSION : 42, out);
+    /// Session timout -1 represent session expired in Zookeeper
+    int32_t negotiated_session_timeout = session_expired ? -1 : channel.session_timeout.totalMilliseconds();
+    Coordination::write(negotiated_session_timeout, out);
+    Coordination::write(channel.session_id, out);
+    std::array<char, Coordination::PASSWORD_LENGTH> passwd{};
+    Coordination::write(passwd, out);
+    auto packet = out.getBuffer();
+
+    queueFrames({makeFrameHead(channel_id, packet->used()), packet});
+}
+
+void MultiplexConnectionHandler::sendResponses(
+    const std::shared_ptr<Shared> & shared, int64_t channel_id, const Coordination::ZooKeeperResponses & batch)
+{
+    std::lock_guard lock(shared->mutex);
+    auto * conn = shared->conn;
+    if (!conn)
+        return;
+
+    std::vector<std::shared_ptr<FIFOBuffer>> buffers;
+    buffers.reserve(batch.size() * 2);
+    for (const auto & response : batch)
+    {
+        std::shared_ptr<FIFOBuffer> packet;
+        if (!response->frame.empty())
+            packet = makeFrameBuffer(response);
+        else
+        {
+            WriteBufferFromFiFoBuffer buf;
+            response->write(buf);
+            packet = buf.getBuffer();
+        }
+        buffers.push_back(conn->makeFrameHead(channel_id, packet->used()));
+        buffers.push_back(std::move(packet));
+
+        if (response->xid != Coordination::WATCH_XID && response->getOpNum() == Coordination::OpNum::Close)
+            shared->closed_channels.push_back(channel_id);
+    }
+    conn->queueFrames(buffers);
+}
+
+void MultiplexConnectionHandler::queueFrames(const std::vector<std::shared_ptr<FIFOBuffer>> & buffers)
+{
+    size_t bytes = 0;
+    for (const auto & buffer : buffers)
+        bytes += buffer->used();
+    /// Frame head and packet are queued together, responses of other channels do not come between them
+    responses->push(buffers);
+    queued_response_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    updateReadInterest();
+
+    reactor_.addEventHandler(
+        socket_, NObserver<MultiplexConnectionHandler, WritableNotification>(*this, &MultiplexConnectionHandler::onSocketWritable));
+    reactor_.wakeUp();
+}
+
+std::shared_ptr<FIFOBuffer> MultiplexConnectionHandler::makeFrameHead(int64_t channel_id, size_t packet_size) const
+{
+    WriteBufferFromFiFoBuffer out(FRAME_HEAD_SIZE);
+    Coordination::write(static_cast<int32_t>(sizeof(int64_t) + packet_size), out);
+    Coordination::write(channel_id, out);
+    return out.getBuffer();
+}
+
+void MultiplexConnectionHandler::onSocketWritable(const AutoPtr<WritableNotification> &)
+{
+    try
+    {
+        finishChannels();
+
+        /// An edge triggered reactor does not report the socket again while it stays writable, so send until it would block
+        bool edge_triggered = reactor_.isEdgeTriggered();
+        GatheredSendResult result;
+        while (responses->size() != 0)
+        {
+            result = sendResponsesGathered(socket_, *responses, head_response_sent, max_send_iov_count, max_send_bytes);
+            /// A frame is its head and its packet
+            for (size_t i = 0; i < result.responses / 2; ++i)
+                keeper_dispatcher->incrementPacketsSent();
+            queued_response_bytes.fetch_sub(result.bytes, std::memory_order_relaxed);
+            updateReadInterest();
+            if (!edge_triggered || result.would_block)
+                break;
+        }
+
+        /// Responses and session request results are pushed under the lock before the writable handler is added,
+        /// so the handler is not removed after one of them is pushed
+        std::lock_guard lock(shared->mutex);
+        if (responses->size() == 0 && shared->session_request_results.empty() && shared->closed_channels.empty())
+            reactor_.removeEventHandler(
+                socket_, NObserver<MultiplexConnectionHandler, WritableNotification>(*this, &MultiplexConnectionHandler::onSocketWritable));
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Fatal error when sending data to client, will close multiplexed connection");
+        destroyMe();
+    }
+}
+
+void MultiplexConnectionHandler::updateReadInterest()
+{
+    if (!max_queued_response_bytes)
+        return;
+
+    std::lock_guard lock(read_interest_mutex);
+    size_t bytes = queued_response_bytes.load(std::memory_order_relaxed);
+    if (!reading_paused && bytes >= max_queued_response_bytes)
+    {
+        LOG_DEBUG(log, "Pause reading multiplexed connection, {} response bytes queued", bytes);
+        reading_paused = true;
+        reactor_.removeEventHandler(
+            socket_, NObserver<MultiplexConnectionHandler, ReadableNotification>(*this, &MultiplexConnectionHandler::onSocketReadable));
+    }
+    /// Resume at half of the limit, so that reading is not switched for every response
+    else if (reading_paused && bytes <= max_queued_response_bytes / 2)
+    {
+        LOG_DEBUG(log, "Resume reading multiplexed connection");
+        reading_paused = false;
+        reactor_.addEventHandler(
+            socket_, NObserver<MultiplexConnectionHandler, ReadableNotification>(*this, &MultiplexConnectionHandler::onSocketReadable));
+        reactor_.wakeUp();
+    }
+}
+
+void MultiplexConnectionHandler::onReactorShutdown(const AutoPtr<ShutdownNotification> & /*pNf*/)
+{
+    LOG_INFO(log, "reactor shutdown!");
+    destroyMe();
+}
+
+void MultiplexConnectionHandler::onSocketError(const AutoPtr<ErrorNotification> & /*pNf*/)
+{
+    LOG_WARNING(log, "Socket of multiplexed connection from {} error, errno {}", socket_.peerAddress().toString(), errno);
+    destroyMe();
+}
+
+void MultiplexConnectionHandler::destroyMe()
+{
+    for (const auto & [_, channel] : channels)
+        if (channel.handshake_done)
+            keeper_dispatcher->finishSession(channel.session_id);
+    delete this;
+}
+
+}
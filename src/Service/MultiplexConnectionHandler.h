@@ -0,0 +1,153 @@
+#pragma once
+
+#include <Poco/FIFOBuffer.h>
+#include <Poco/NObserver.h>
+#include <Poco/Net/StreamSocket.h>
+#include <Service/SocketNotification.h>
+#include <Service/SocketReactor.h>
+
+#include <unordered_map>
+#include <Service/ClientGroups.h>
+#include <Service/ConnCommon.h>
+#include <Service/RequestRateLimiter.h>
+#include <Service/SvsSocketAcceptor.h>
+#include <Service/SvsSocketReactor.h>
+
+
+namespace RK
+{
+using Poco::Net::StreamSocket;
+
+using Poco::AutoPtr;
+using Poco::FIFOBuffer;
+using Poco::Logger;
+
+class KeeperDispatcher;
+
+/** Connection carrying many sessions of one client, served at keeper.multiplex_port, so that a client with several
+ * sessions takes one socket, one handler and one reactor registration instead of one for each session.
+ *
+ * Every frame in both directions is
+ *     int32 length of the rest | int64 channel | ZooKeeper packet, with its own int32 length
+ * The channel is chosen by the client for each of its sessions. The first packet of a new channel is a handshake,
+ * it is answered on the channel by a handshake response carrying the session id, and the client sends nothing else
+ * on the channel before it. Requests, responses and watch events of a session then go on its channel as on a
+ * connection of its own: they keep the order of the session, and the session expires by its own timeout once its
+ * heartbeats stop. A close request closes only its channel, closing the connection disconnects all its sessions.
+ *
+ * Heartbeats go through the dispatcher in session order, unlike ConnectionHandler which answers them right away.
+ * A failed handshake is answered as by ConnectionHandler and closes only its channel.
+ */
+class MultiplexConnectionHandler
+{
+public:
+    MultiplexConnectionHandler(Context & global_context_, StreamSocket & socket, SocketReactor & reactor);
+    ~MultiplexConnectionHandler();
+
+    void onSocketReadable(const AutoPtr<ReadableNotification> & pNf);
+    void onSocketWritable(const AutoPtr<WritableNotification> & pNf);
+    void onReactorShutdown(const AutoPtr<ShutdownNotification> & pNf);
+    void onSocketError(const AutoPtr<ErrorNotification> & pNf);
+
+    /// Bytes of the frame head, int32 length and int64 channel
+    static constexpr size_t FRAME_HEAD_SIZE = sizeof(int32_t) + sizeof(int64_t);
+
+private:
+    /// A session of the connection, only used by the reactor thread
+    struct Channel
+    {
+        /// 0 until the handshake is answered
+        int64_t session_id = 0;
+        bool handshake_done = false;
+        Poco::Timespan session_timeout;
+        /// See ConnectionHandler::read_fence_zxid
+        int64_t read_fence_zxid = 0;
+        TokenBucketPtr session_rate_bucket;
+        /// See ConnectionHandler::client_group
+        size_t client_group = ClientGroups::DEFAULT;
+        bool client_group_path_checked = false;
+    };
+
+    /// Result of a session request, taken by the reactor thread
+    struct SessionRequestResult
+    {
+        int64_t channel;
+        int64_t previous_session_id;
+        int64_t session_id;
+        bool expired;
+    };
+
+    /// Shared with the callbacks of session requests and responses, which may come after the connection is gone
+    struct Shared
+    {
+        std::mutex mutex;
+        /// nullptr once the connection is destroyed
+        MultiplexConnectionHandler * conn = nullptr;
+        std::vector<SessionRequestResult> session_request_results;
+        /// Channels whose close request is answered
+        std::vector<int64_t> closed_channels;
+    };
+
+    /// Handle the complete frames received, the incomplete one at the end is kept. Return false if the connection should be closed
+    bool receiveFrames();
+    void handleFrame(int64_t channel_id, const char * data, int32_t length);
+
+    void receiveHandshake(int64_t channel_id, const char * data, int32_t length);
+    void receiveRequest(int64_t channel_id, Channel & channel, const char * data, int32_t length);
+    bool acquireRateLimits(Channel & channel, const Coordination::ZooKeeperRequest & request);
+
+    /// Take the results of session requests and the closed channels, on the reactor thread
+    void finishChannels();
+    void sendHandshake(int64_t channel_id, const Channel & channel, bool connect_success, bool session_expired);
+
+    /// Called by the dispatcher threads
+    static void sendResponses(const std::shared_ptr<Shared> & shared, int64_t channel_id, const Coordination::ZooKeeperResponses & batch);
+    /// Queue buffers of frames and trigger the writable event, called by any thread while conn is alive
+    void queueFrames(const std::vector<std::shared_ptr<FIFOBuffer>> & buffers);
+
+    std::shared_ptr<FIFOBuffer> makeFrameHead(int64_t channel_id, size_t packet_size) const;
+
+    /// See ConnectionHandler::updateReadInterest, only the queued response bytes are limited
+    void updateReadInterest();
+
+    void destroyMe();
+
+    static constexpr size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
+    /// A packet of a frame is at most this, as ZooKeeper requests
+    static constexpr int32_t MAX_PACKET_SIZE = 0x40000000;
+
+    Logger * log;
+
+    StreamSocket socket_;
+    SocketReactor & reactor_;
+
+    Context & global_context;
+    std::shared_ptr<KeeperDispatcher> keeper_dispatcher;
+
+    Poco::Timespan session_timeout;
+
+    std::unordered_map<int64_t, Channel> channels;
+    /// Bytes received after the last complete frame
+    String pending;
+
+    std::shared_ptr<Shared> shared;
+
+    ThreadSafeResponseQueuePtr responses;
+    /// Bytes of the head of responses sent
+    size_t head_response_sent = 0;
+    size_t max_send_iov_count;
+    size_t max_send_bytes;
+
+    /// Bytes in responses not sent yet, reading is paused over max_queued_response_bytes
+    std::atomic<size_t> queued_response_bytes{0};
+    std::mutex read_interest_mutex;
+    bool reading_paused = false;
+    size_t max_queued_response_bytes;
+
+    TokenBucketPtr ip_rate_bucket;
+    const bool relaxed_read_order;
+    /// Client group of the address, channels may then move by their requests
+    const size_t address_client_group;
+};
+
+}
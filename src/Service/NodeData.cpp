@@ -0,0 +1,78 @@
+#include <Service/NodeData.h>
+
+#include <Common/Exception.h>
+#include <Service/LogEntry.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int CORRUPTED_DATA;
+}
+
+static void decompressValue(const String & compressed_value, size_t size, String & out)
+{
+    out.resize(size);
+    if (!LogEntry::decompress(compressed_value.data(), compressed_value.size(), out.data(), size))
+        throw Exception(ErrorCodes::CORRUPTED_DATA, "Compressed node value of {} bytes is corrupted", size);
+}
+
+const String & NodeData::get(String & buf) const
+{
+    if (!compressed())
+        return stored();
+    decompressValue(*large_value, value_size, buf);
+    return buf;
+}
+
+void NodeData::copyTo(String & out) const
+{
+    if (compressed())
+        decompressValue(*large_value, value_size, out);
+    else
+        out = stored();
+}
+
+bool NodeData::compress(const String & value, String & out)
+{
+    return value.size() >= MIN_COMPRESS_BYTES && LogEntry::compress(value.data(), value.size(), out);
+}
+
+void NodeData::setCompressed(String compressed_value)
+{
+    large_value = std::make_shared<const String>(std::move(compressed_value));
+    String().swap(inline_value);
+    state.fetch_or(COMPRESSED, std::memory_order_relaxed);
+}
+
+void NodeData::setDecompressed(String value)
+{
+    UInt8 idle_passes = idlePassesOf(state.load(std::memory_order_relaxed));
+    *this = std::move(value);
+    state.store(idle_passes, std::memory_order_relaxed);
+}
+
+UInt8 NodeData::markIdle() const
+{
+    UInt8 current = state.load(std::memory_order_relaxed);
+    while (idlePassesOf(current) < MAX_IDLE_PASSES && !state.compare_exchange_weak(current, current + 1, std::memory_order_relaxed))
+    {
+    }
+    return idlePassesOf(current) < MAX_IDLE_PASSES ? current + 1 : current;
+}
+
+bool NodeData::operator==(const NodeData & rhs) const
+{
+    String buf;
+    String rhs_buf;
+    return size() == rhs.size() && get(buf) == rhs.get(rhs_buf);
+}
+
+bool NodeData::operator==(std::string_view rhs) const
+{
+    String buf;
+    return get(buf) == rhs;
+}
+
+}
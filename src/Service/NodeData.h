@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Value of a node. Values larger than LARGE_VALUE_BYTES are kept out of line in an immutable shared buffer, so that
+ * the node, the responses of Get and the versions kept for snapshots share one copy of a value of megabytes, and
+ * copying it under the node lock costs a reference count instead of a memcpy. Small values are kept inline.
+ *
+ * A value is never changed in place, Set assigns a new one. Values of cold nodes may be compressed by
+ * KeeperStore::compressColdData, which only changes how the value is kept, size() stays the same.
+ */
+class NodeData
+{
+public:
+    static constexpr size_t LARGE_VALUE_BYTES = 16 * 1024;
+    /// Values shorter than it are never compressed
+    static constexpr size_t MIN_COMPRESS_BYTES = 128;
+
+    NodeData() = default;
+    NodeData(const NodeData & rhs) { *this = rhs; }
+
+    NodeData & operator=(const NodeData & rhs)
+    {
+        inline_value = rhs.inline_value;
+        large_value = rhs.large_value;
+        value_size = rhs.value_size;
+        state.store(rhs.state.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+
+    NodeData & operator=(String value)
+    {
+        value_size = static_cast<UInt32>(value.size());
+        if (value.size() > LARGE_VALUE_BYTES)
+        {
+            large_value = std::make_shared<const String>(std::move(value));
+            String().swap(inline_value);
+        }
+        else
+        {
+            inline_value = std::move(value);
+            large_value.reset();
+        }
+        state.store(0, std::memory_order_relaxed);
+        return *this;
+    }
+
+    /// The value, decompressed into buf if it is compressed
+    const String & get(String & buf) const;
+    /// Copy the value into out
+    void copyTo(String & out) const;
+
+    /// Buffer shared by the value, nullptr if it is inline or compressed
+    std::shared_ptr<const String> shared() const { return compressed() ? nullptr : large_value; }
+
+    size_t size() const { return value_size; }
+    size_t length() const { return size(); }
+    bool empty() const { return size() == 0; }
+
+    bool compressed() const { return state.load(std::memory_order_relaxed) & COMPRESSED; }
+    /// Bytes the value is smaller by when it is compressed
+    size_t savedBytes() const { return compressed() ? value_size - large_value->size() : 0; }
+    /// The value as it is kept, compressed or not
+    const String & stored() const { return large_value ? *large_value : inline_value; }
+    bool hasSharedBuffer() const { return large_value != nullptr; }
+
+    /// Compress value into out, false if it is too short or does not get smaller
+    static bool compress(const String & value, String & out);
+    /// Keep the value compressed, it must be the compressed value
+    void setCompressed(String compressed_value);
+    /// Keep the value decompressed, it must be the decompressed value
+    void setDecompressed(String value);
+
+    /** Access bit of the cold data pass. A read clears the idle passes of the node, every pass of
+     * KeeperStore::compressColdData adds one and returns the state, up to MAX_IDLE_PASSES.
+     */
+    void markAccessed() const
+    {
+        if (state.load(std::memory_order_relaxed) & IDLE_PASSES_MASK)
+            state.fetch_and(COMPRESSED, std::memory_order_relaxed);
+    }
+    UInt8 markIdle() const;
+    UInt8 idlePasses() const { return idlePassesOf(state.load(std::memory_order_relaxed)); }
+    static UInt8 idlePassesOf(UInt8 state_) { return state_ & IDLE_PASSES_MASK; }
+    static bool isCompressed(UInt8 state_) { return state_ & COMPRESSED; }
+
+    static constexpr UInt8 MAX_IDLE_PASSES = 0x7F;
+
+    bool operator==(const NodeData & rhs) const;
+    bool operator==(std::string_view rhs) const;
+
+private:
+    static constexpr UInt8 COMPRESSED = 0x80;
+    static constexpr UInt8 IDLE_PASSES_MASK = 0x7F;
+
+    String inline_value;
+    /// Large value, or the compressed value if compressed
+    std::shared_ptr<const String> large_value;
+    UInt32 value_size = 0;
+    /// COMPRESSED | idle passes, the compressed bit is only changed by assignments and the cold data pass
+    mutable std::atomic<UInt8> state{0};
+};
+
+}
@@ -0,0 +1,93 @@
+#include <Service/NodeExpiryWheel.h>
+
+#include <algorithm>
+#include <Service/SessionExpiryQueue.h>
+
+namespace RK
+{
+
+NodeExpiryWheel::NodeExpiryWheel(int64_t tick_ms_)
+    : tick_ms(std::max<int64_t>(tick_ms_, 1)), slots(WHEEL_SIZE), walked_tick(tickOf(getNowMilliseconds()) - 1)
+{
+}
+
+void NodeExpiryWheel::unlink(const String & path, int64_t expiration_time)
+{
+    if (tickOf(expiration_time) <= walked_tick)
+        expired.erase(path);
+    else
+        slotOf(tickOf(expiration_time)).erase(path);
+}
+
+void NodeExpiryWheel::update(const String & path, int64_t expiration_time)
+{
+    auto [it, inserted] = path_to_expiration_time.try_emplace(path, expiration_time);
+    if (!inserted)
+    {
+        if (it->second == expiration_time)
+            return;
+        unlink(path, it->second);
+        it->second = expiration_time;
+    }
+
+    int64_t tick = tickOf(expiration_time);
+    if (tick <= walked_tick)
+        expired.insert(path);
+    else
+        slotOf(tick).insert(path);
+}
+
+bool NodeExpiryWheel::remove(const String & path)
+{
+    auto it = path_to_expiration_time.find(path);
+    if (it == path_to_expiration_time.end())
+        return false;
+
+    unlink(path, it->second);
+    path_to_expiration_time.erase(it);
+    return true;
+}
+
+std::vector<String> NodeExpiryWheel::getExpired(int64_t now, size_t max_count, int64_t retry_after)
+{
+    int64_t now_tick = tickOf(now);
+
+    /// Walk slots in (walked_tick, now_tick), slots of a whole turn at most. Paths of later turns stay in their slot.
+    int64_t begin_tick = std::max(walked_tick + 1, now_tick - static_cast<int64_t>(WHEEL_SIZE));
+    for (int64_t tick = begin_tick; tick < now_tick; ++tick)
+    {
+        auto & slot = slotOf(tick);
+        for (auto it = slot.begin(); it != slot.end();)
+        {
+            if (tickOf(path_to_expiration_time[*it]) < now_tick)
+            {
+                expired.insert(*it);
+                it = slot.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    walked_tick = std::max(walked_tick, now_tick - 1);
+
+    std::vector<String> result;
+    for (auto it = expired.begin(); it != expired.end() && result.size() < max_count; ++it)
+        result.push_back(*it);
+
+    for (const auto & path : result)
+        update(path, now + retry_after);
+    return result;
+}
+
+void NodeExpiryWheel::clear()
+{
+    path_to_expiration_time.clear();
+    for (auto & slot : slots)
+        slot.clear();
+    expired.clear();
+    walked_tick = tickOf(getNowMilliseconds()) - 1;
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Hashed timer wheel of expiration times of TTL and container nodes, as SessionExpiryWheel of sessions.
+ *
+ * It is an index for the leader to find candidates only, the node is checked again when its removal is
+ * applied, so that an entry may be stale, e.g. of a container which got a child meanwhile. Paths collected
+ * are scheduled again retry_after later, they are collected once more if their removal is never applied.
+ */
+class NodeExpiryWheel
+{
+public:
+    static constexpr size_t WHEEL_SIZE = 4096;
+
+    explicit NodeExpiryWheel(int64_t tick_ms_);
+
+    void update(const String & path, int64_t expiration_time);
+
+    bool remove(const String & path);
+
+    /// At most max_count paths expired at now
+    std::vector<String> getExpired(int64_t now, size_t max_count, int64_t retry_after);
+
+    void clear();
+
+    size_t size() const { return path_to_expiration_time.size(); }
+
+private:
+    int64_t tickOf(int64_t time) const { return time / tick_ms; }
+    std::unordered_set<String> & slotOf(int64_t tick) { return slots[static_cast<uint64_t>(tick) % WHEEL_SIZE]; }
+
+    /// Remove path from its slot or from expired set
+    void unlink(const String & path, int64_t expiration_time);
+
+    const int64_t tick_ms;
+
+    std::unordered_map<String, int64_t> path_to_expiration_time;
+    std::vector<std::unordered_set<String>> slots;
+    /// Paths expired but not collected yet
+    std::unordered_set<String> expired;
+
+    /// Slots before and at walked_tick are walked, paths expiring in them are in expired
+    int64_t walked_tick;
+};
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <shared_mutex>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Shared mutex of a stripe of nodes with a sequence number which is odd while the mutex is held exclusively.
+ *
+ * Nodes are changed only under the exclusive lock of their stripe, so a few trivially copyable fields of a node,
+ * e.g. its stat, can be read without locking as a seqlock: read the sequence, copy the fields, and retry if the
+ * sequence changed or was odd. See KeeperNode::readStat.
+ */
+class NodeMutex
+{
+public:
+    void lock()
+    {
+        mutex.lock();
+        beginWrite();
+    }
+
+    bool try_lock()
+    {
+        if (!mutex.try_lock())
+            return false;
+        beginWrite();
+        return true;
+    }
+
+    void unlock()
+    {
+        sequence.fetch_add(1, std::memory_order_release);
+        mutex.unlock();
+    }
+
+    void lock_shared() { mutex.lock_shared(); }
+    bool try_lock_shared() { return mutex.try_lock_shared(); }
+    void unlock_shared() { mutex.unlock_shared(); }
+
+    /// Read before copying fields with acquire, and after them behind an acquire fence with relaxed
+    UInt64 getSequence(std::memory_order order = std::memory_order_acquire) const { return sequence.load(order); }
+
+private:
+    void beginWrite()
+    {
+        sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    std::shared_mutex mutex;
+    std::atomic<UInt64> sequence{0};
+};
+
+}
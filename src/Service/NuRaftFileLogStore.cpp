@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <Service/LogEntry.h>
 #include <Service/NuRaftFileLogStore.h>
+#include <Service/PipelineStageThreads.h>
+#include <Common/Stopwatch.h>
 #include <Common/setThreadName.h>
 
 namespace RK
@@ -15,68 +17,34 @@ ptr<log_entry> makeClone(const ptr<log_entry> & entry)
     return clone;
 }
 
-ptr<log_entry> LogEntryQueue::getEntry(const UInt64 & index)
-{
-    //LOG_DEBUG(log,"get entry {}, index {}, batch {}", index, index & (MAX_VECTOR_SIZE - 1), index >> BIT_SIZE);
-    std::shared_lock read_lock(queue_mutex);
-    if (index > max_index || max_index - index >= MAX_VECTOR_SIZE)
-        return nullptr;
-
-    if (index >> BIT_SIZE == batch_index || index >> BIT_SIZE == batch_index - 1)
-    {
-        return entry_vec[index & (MAX_VECTOR_SIZE - 1)];
-    }
-    else
-    {
-        return nullptr;
-    }
-}
-
-void LogEntryQueue::putEntry(UInt64 & index, ptr<log_entry> & entry)
-{
-    std::lock_guard write_lock(queue_mutex);
-    entry_vec[index & (MAX_VECTOR_SIZE - 1)] = entry;
-    batch_index = std::max(batch_index, index >> BIT_SIZE);
-    max_index = std::max(max_index, index);
-    //LOG_DEBUG(log,"put entry {}, index {}, batch {}", index, index & (MAX_VECTOR_SIZE - 1), batch_index);
-}
-
-void LogEntryQueue::putEntryOrClear(UInt64 & index, ptr<log_entry> & entry)
-{
-    std::lock_guard write_lock(queue_mutex);
-    if (index >> BIT_SIZE == batch_index || index >> BIT_SIZE == batch_index - 1)
-    {
-        entry_vec[index & (MAX_VECTOR_SIZE - 1)] = entry;
-        max_index = index;
-    }
-    else
-    {
-        LOG_DEBUG(log, "clear log queue.");
-        batch_index = 0;
-        max_index = 0;
-        for (size_t i = 0; i < MAX_VECTOR_SIZE; ++i)
-            entry_vec[i] = nullptr;
-    }
-}
-
-void LogEntryQueue::clear()
-{
-    LOG_DEBUG(log, "clear log queue.");
-    std::lock_guard write_lock(queue_mutex);
-    batch_index = 0;
-    max_index = 0;
-    for (size_t i = 0; i < MAX_VECTOR_SIZE; ++i)
-        entry_vec[i] = nullptr;
-}
-
 NuRaftFileLogStore::NuRaftFileLogStore(
     const std::string & log_dir,
     bool force_new,
     FsyncMode log_fsync_mode_,
     UInt64 log_fsync_interval_,
     UInt32 max_log_size_,
-    UInt32 max_segment_count_)
-    : log_fsync_mode(log_fsync_mode_), log_fsync_interval(log_fsync_interval_)
+    UInt32 max_segment_count_,
+    bool preallocate_segments_,
+    bool drop_page_cache_,
+    bool batch_appends_,
+    UInt64 log_cache_max_bytes_,
+    bool compress_log_,
+    UInt64 log_remove_bytes_per_second_,
+    bool raw_packs_,
+    const std::string & log_cold_dir_,
+    UInt64 log_fsync_batch_bytes_,
+    UInt64 log_fsync_max_lag_ms_,
+    bool log_persistent_memory_,
+    bool log_crc32c_checksum_)
+    : log_cache(log_cache_max_bytes_)
+    , batch_appends(batch_appends_)
+    , compress_log(compress_log_)
+    , raw_packs(raw_packs_)
+    , log_fsync_mode(log_fsync_mode_)
+    , log_fsync_interval(std::max<UInt64>(log_fsync_interval_, 1))
+    , log_fsync_batch_bytes(log_fsync_batch_bytes_)
+    , log_fsync_max_lag_ms(log_fsync_max_lag_ms_)
+    , batch_fsync_entries(log_fsync_interval)
 {
     log = &(Poco::Logger::get("FileLogStore"));
 
@@ -86,6 +54,7 @@ NuRaftFileLogStore::NuRaftFileLogStore(
         std::mutex thread_mutex;
 
         bool thread_started = false;
+        parallel_fsync_event = std::make_shared<Poco::Event>();
         fsync_thread = ThreadFromGlobalPool([&thread_started, this] { fsyncThread(thread_started); });
 
         std::unique_lock lock(thread_mutex);
@@ -94,10 +63,22 @@ NuRaftFileLogStore::NuRaftFileLogStore(
             /// ignore
         }
     }
+    else if (log_fsync_mode == FsyncMode::FSYNC_BATCH && log_fsync_max_lag_ms)
+        fsync_thread = ThreadFromGlobalPool([this] { batchFsyncThread(); });
 
     segment_store = LogSegmentStore::getInstance(log_dir, force_new);
 
-    if (segment_store->init(max_log_size_, max_segment_count_) >= 0)
+    if (segment_store->init(
+            max_log_size_,
+            max_segment_count_,
+            preallocate_segments_,
+            drop_page_cache_,
+            compress_log_,
+            log_remove_bytes_per_second_,
+            log_cold_dir_,
+            log_persistent_memory_,
+            log_crc32c_checksum_)
+        >= 0)
     {
         LOG_INFO(log, "Init file log store, last log index {}, log dir {}", segment_store->lastLogIndex(), log_dir);
     }
@@ -126,6 +107,7 @@ void NuRaftFileLogStore::shutdown()
         return;
 
     shutdown_called = true;
+    writePendingEntries();
 
     if (log_fsync_mode == FsyncMode::FSYNC_PARALLEL)
     {
@@ -133,6 +115,14 @@ void NuRaftFileLogStore::shutdown()
         if (fsync_thread.joinable())
             fsync_thread.join();
     }
+    else if (fsync_thread.joinable())
+    {
+        {
+            std::lock_guard lock(fsync_batch_mutex);
+            fsync_batch_cv.notify_all();
+        }
+        fsync_thread.join();
+    }
 }
 
 NuRaftFileLogStore::~NuRaftFileLogStore()
@@ -143,26 +133,105 @@ NuRaftFileLogStore::~NuRaftFileLogStore()
 void NuRaftFileLogStore::fsyncThread(bool & thread_started)
 {
     setThreadName("LogFsync");
-
-    parallel_fsync_event = std::make_shared<Poco::Event>();
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Fsync);
 
     while (!shutdown_called)
     {
         thread_started = true;
         parallel_fsync_event->wait();
 
+        writePendingEntries();
+
+        Stopwatch watch;
         UInt64 last_flush_index = segment_store->flush();
+        UInt64 latency_us = watch.elapsedMicroseconds();
+
         if (last_flush_index)
         {
+            /// Overwritten entries (write_at) may end before the last durable index
+            UInt64 batch_size = last_flush_index > disk_last_durable_index ? last_flush_index - disk_last_durable_index : 0;
             disk_last_durable_index = last_flush_index;
+            /// All appends waiting for the fsync are completed at once
             if (raft_instance) /// For test
                 raft_instance->notify_log_append_completion(true);
+
+            std::lock_guard lock(fsync_stats_mutex);
+            ++fsync_stats.fsync_count;
+            fsync_stats.total_latency_us += latency_us;
+            fsync_stats.max_latency_us = std::max(fsync_stats.max_latency_us, latency_us);
+            fsync_stats.total_batch_size += batch_size;
+            ++fsync_stats.latency_us[LogFsyncStats::bucketOf(latency_us)];
+            ++fsync_stats.batch_size[LogFsyncStats::bucketOf(batch_size)];
         }
     }
 
     LOG_INFO(log, "shutdown background raft log fsync thread.");
 }
 
+void NuRaftFileLogStore::fsyncBatch()
+{
+    UInt64 batch_size = to_flush_count;
+    Stopwatch watch;
+    flush();
+    UInt64 latency_us = watch.elapsedMicroseconds();
+    UInt64 lag_us = clock_gettime_ns() / 1000 - unflushed_since_us;
+
+    to_flush_count = 0;
+    unflushed_bytes.store(0, std::memory_order_relaxed);
+    unflushed_since_us = 0;
+
+    if (log_fsync_max_lag_ms)
+    {
+        avg_fsync_latency_us = avg_fsync_latency_us ? (avg_fsync_latency_us * 7 + latency_us) / 8 : latency_us;
+        /// Fewer entries make an fsync sooner under load, more of them make fewer fsyncs while the lag is well under the bound
+        UInt64 max_lag_us = log_fsync_max_lag_ms * 1000;
+        if (lag_us > max_lag_us)
+            batch_fsync_entries = std::max<UInt64>(batch_fsync_entries / 2, 1);
+        else if (lag_us < max_lag_us / 2 && batch_size >= batch_fsync_entries)
+            batch_fsync_entries = std::min(batch_fsync_entries + batch_fsync_entries / 4 + 1, log_fsync_interval);
+    }
+
+    std::lock_guard lock(fsync_stats_mutex);
+    ++fsync_stats.fsync_count;
+    fsync_stats.total_latency_us += latency_us;
+    fsync_stats.max_latency_us = std::max(fsync_stats.max_latency_us, latency_us);
+    fsync_stats.total_batch_size += batch_size;
+    ++fsync_stats.latency_us[LogFsyncStats::bucketOf(latency_us)];
+    ++fsync_stats.batch_size[LogFsyncStats::bucketOf(batch_size)];
+    fsync_stats.last_durability_lag_us = lag_us;
+    fsync_stats.max_durability_lag_us = std::max(fsync_stats.max_durability_lag_us, lag_us);
+    fsync_stats.batch_fsync_entries = batch_fsync_entries;
+}
+
+UInt64 NuRaftFileLogStore::batchFsyncDeadlineUs() const
+{
+    UInt64 max_lag_us = log_fsync_max_lag_ms * 1000;
+    return max_lag_us > avg_fsync_latency_us ? max_lag_us - avg_fsync_latency_us : 0;
+}
+
+void NuRaftFileLogStore::batchFsyncThread()
+{
+    setThreadName("LogFsyncBatch");
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Fsync);
+
+    std::unique_lock lock(fsync_batch_mutex);
+    while (!shutdown_called)
+    {
+        if (!to_flush_count)
+        {
+            fsync_batch_cv.wait(lock, [this] { return to_flush_count || shutdown_called; });
+            continue;
+        }
+
+        UInt64 deadline_us = unflushed_since_us + batchFsyncDeadlineUs();
+        UInt64 now_us = clock_gettime_ns() / 1000;
+        if (now_us < deadline_us)
+            fsync_batch_cv.wait_for(lock, std::chrono::microseconds(deadline_us - now_us));
+        else
+            fsyncBatch();
+    }
+}
+
 ptr<log_entry> NuRaftFileLogStore::make_clone(const ptr<log_entry> & entry)
 {
     ptr<log_entry> clone = cs_new<log_entry>(entry->get_term(), buffer::clone(entry->get_buf()), entry->get_val_type());
@@ -171,7 +240,8 @@ ptr<log_entry> NuRaftFileLogStore::make_clone(const ptr<log_entry> & entry)
 
 ulong NuRaftFileLogStore::next_slot() const
 {
-    return segment_store->lastLogIndex() + 1;
+    std::lock_guard lock(pending_mutex);
+    return segment_store->lastLogIndex() + pending_entries.size() + 1;
 }
 
 ulong NuRaftFileLogStore::start_index() const
@@ -188,11 +258,55 @@ ptr<log_entry> NuRaftFileLogStore::last_entry() const
         return nullptr;
 }
 
+void NuRaftFileLogStore::appendPendingEntries()
+{
+    if (pending_entries.empty())
+        return;
+
+    UInt64 expected_index = segment_store->lastLogIndex() + pending_entries.size();
+    if (segment_store->appendEntries(pending_entries) != expected_index)
+        LOG_ERROR(
+            log,
+            "Failed to append {} entries to index {}, last log index {}",
+            pending_entries.size(),
+            expected_index,
+            segment_store->lastLogIndex());
+    pending_entries.clear();
+    log_cache.unpin();
+}
+
+void NuRaftFileLogStore::writePendingEntries()
+{
+    std::lock_guard lock(pending_mutex);
+    appendPendingEntries();
+}
+
 ulong NuRaftFileLogStore::append(ptr<log_entry> & entry)
 {
+    /// By a worker of NuRaft on a follower, the leader appends from the accumulator which is accounted already
+    PipelineStageThreads::attach(PipelineStage::NuRaft);
     ptr<log_entry> clone = makeClone(entry);
-    UInt64 log_index = segment_store->appendEntry(entry);
-    log_queue.putEntry(log_index, clone);
+    UInt64 log_index;
+    {
+        std::lock_guard lock(pending_mutex);
+        if (batch_appends)
+        {
+            pending_entries.push_back(entry);
+            log_index = segment_store->lastLogIndex() + pending_entries.size();
+            /// Read from log_cache only until they are written
+            if (pending_entries.size() == 1)
+                log_cache.pin(log_index);
+            /// Entries other than app logs, such as configs, are not held back
+            if (pending_entries.size() >= MAX_PENDING_ENTRIES || entry->get_val_type() != log_val_type::app_log)
+                appendPendingEntries();
+        }
+        else
+            log_index = segment_store->appendEntry(entry);
+        log_cache.put(log_index, clone);
+    }
+
+    if (log_fsync_mode == FsyncMode::FSYNC_BATCH && log_fsync_batch_bytes)
+        unflushed_bytes.fetch_add(entry->get_buf().size(), std::memory_order_relaxed);
 
     last_log_entry = clone;
 
@@ -204,9 +318,14 @@ ulong NuRaftFileLogStore::append(ptr<log_entry> & entry)
 
 void NuRaftFileLogStore::write_at(ulong index, ptr<log_entry> & entry)
 {
-    if (segment_store->writeAt(index, entry) == index)
     {
-        log_queue.clear();
+        std::lock_guard lock(pending_mutex);
+        appendPendingEntries();
+        if (segment_store->writeAt(index, entry) == index)
+        {
+            log_cache.clear();
+        }
+        clearReadAhead();
     }
 
     //last_log_entry = std::dynamic_pointer_cast<log_entry>(ch_entry);
@@ -221,18 +340,28 @@ void NuRaftFileLogStore::write_at(ulong index, ptr<log_entry> & entry)
 void NuRaftFileLogStore::end_of_append_batch(ulong start, ulong cnt)
 {
     LOG_TRACE(log, "fsync log store, start log idx {}, log count {}", start, cnt);
+    writePendingEntries();
 
     if (log_fsync_mode == FsyncMode::FSYNC_PARALLEL)
     {
         parallel_fsync_event->set();
     }
-    else if (log_fsync_mode == FsyncMode::FSYNC_BATCH)
+    else if (log_fsync_mode == FsyncMode::FSYNC_BATCH && cnt)
     {
-        if (to_flush_count % log_fsync_interval == 0)
+        std::lock_guard lock(fsync_batch_mutex);
+        UInt64 now_us = clock_gettime_ns() / 1000;
+        if (!to_flush_count)
         {
-            to_flush_count = 0;
-            flush();
+            unflushed_since_us = now_us;
+            /// The batch fsync thread waits for the deadline of the oldest entry
+            fsync_batch_cv.notify_one();
         }
+        to_flush_count += cnt;
+
+        if (to_flush_count >= batch_fsync_entries
+            || (log_fsync_batch_bytes && unflushed_bytes.load(std::memory_order_relaxed) >= log_fsync_batch_bytes)
+            || (log_fsync_max_lag_ms && now_us >= unflushed_since_us + batchFsyncDeadlineUs()))
+            fsyncBatch();
     }
     else if (log_fsync_mode == FsyncMode::FSYNC)
     {
@@ -243,6 +372,8 @@ void NuRaftFileLogStore::end_of_append_batch(ulong start, ulong cnt)
 ptr<std::vector<ptr<log_entry>>> NuRaftFileLogStore::log_entries(ulong start, ulong end)
 {
     ptr<std::vector<ptr<log_entry>>> ret = cs_new<std::vector<ptr<log_entry>>>();
+    if (end > start + 1)
+        segment_store->adviseRead(start, end - 1);
     //segment_store->getEntries(start, end, ret);
     for (auto i = start; i < end; i++)
     {
@@ -257,6 +388,8 @@ ptr<std::vector<ptr<log_entry>>> NuRaftFileLogStore::log_entries_ext(ulong start
 {
     ptr<std::vector<ptr<log_entry>>> ret = cs_new<std::vector<ptr<log_entry>>>();
     //segment_store->getEntriesExt(start, end, batch_size_hint_in_bytes, ret);
+    if (end > start + 1)
+        segment_store->adviseRead(start, end - 1);
     int64 get_size = 0;
     int64 entry_size = 0;
     for (auto i = start; i < end; i++)
@@ -277,7 +410,11 @@ ptr<std::vector<ptr<log_entry>>> NuRaftFileLogStore::log_entries_ext(ulong start
 ptr<std::vector<VersionLogEntry>> NuRaftFileLogStore::log_entries_version_ext(ulong start, ulong end, int64 batch_size_hint_in_bytes)
 {
     ptr<std::vector<VersionLogEntry>> ret = cs_new<std::vector<VersionLogEntry>>();
+    /// Versions are kept by segments
+    writePendingEntries();
     //segment_store->getEntriesExt(start, end, batch_size_hint_in_bytes, ret);
+    if (end > start + 1)
+        segment_store->adviseRead(start, end - 1);
     int64 get_size = 0;
     int64 entry_size = 0;
     for (auto i = start; i < end; i++)
@@ -296,26 +433,58 @@ ptr<std::vector<VersionLogEntry>> NuRaftFileLogStore::log_entries_version_ext(ul
 }
 
 
-ptr<log_entry> NuRaftFileLogStore::entry_at(ulong index)
+ptr<log_entry> NuRaftFileLogStore::readEntry(UInt64 index)
 {
-    ptr<nuraft::log_entry> src = nullptr;
+    bool sequential;
     {
-        //std::lock_guard write_lock(index_mutex);
-        src = log_queue.getEntry(index);
-        if (src == nullptr)
-        {
-            src = segment_store->getEntry(index);
-            LOG_TRACE(log, "get entry {} from disk", index);
-            //2^16, 65536
-            if (index << 48 == 0)
-            {
-                //LOG_DEBUG(log, "get entry {} from disk", index);
-            }
-        }
-        else
+        std::lock_guard lock(read_ahead_mutex);
+        if (index >= read_ahead_start && index < read_ahead_start + read_ahead_entries.size())
         {
-            LOG_TRACE(log, "get entry {} from queue", index);
+            last_read_index = index;
+            read_ahead_hits.fetch_add(1, std::memory_order_relaxed);
+            return read_ahead_entries[index - read_ahead_start];
         }
+        sequential = index == last_read_index + 1;
+        last_read_index = index;
+    }
+
+    if (!sequential)
+        return segment_store->getEntry(index);
+
+    /// Read ahead outside the lock, a reader of another range does not wait for it
+    ptr<std::vector<ptr<log_entry>>> entries = cs_new<std::vector<ptr<log_entry>>>();
+    UInt64 end_index = std::min<UInt64>(index + READ_AHEAD_ENTRIES - 1, segment_store->lastLogIndex());
+    segment_store->getEntriesExt(index, end_index, READ_AHEAD_BYTES, entries);
+    if (entries->empty())
+        return segment_store->getEntry(index);
+
+    LOG_TRACE(log, "read ahead {} entries from {}", entries->size(), index);
+    ptr<log_entry> entry = entries->front();
+    std::lock_guard lock(read_ahead_mutex);
+    read_ahead_start = index;
+    read_ahead_entries = std::move(*entries);
+    return entry;
+}
+
+void NuRaftFileLogStore::clearReadAhead()
+{
+    std::lock_guard lock(read_ahead_mutex);
+    read_ahead_start = 0;
+    read_ahead_entries.clear();
+    last_read_index = 0;
+}
+
+ptr<log_entry> NuRaftFileLogStore::entry_at(ulong index)
+{
+    ptr<nuraft::log_entry> src = log_cache.get(index);
+    if (src == nullptr)
+    {
+        src = readEntry(index);
+        LOG_TRACE(log, "get entry {} from disk", index);
+    }
+    else
+    {
+        LOG_TRACE(log, "get entry {} from cache", index);
     }
     if (src)
         return make_clone(src);
@@ -332,7 +501,61 @@ ulong NuRaftFileLogStore::term_at(ulong index)
         return 0;
 }
 
+ptr<buffer> NuRaftFileLogStore::packRaw(ulong index, int32 cnt)
+{
+    if (cnt <= 0)
+        return nullptr;
+
+    /// Entries held back are read from segments
+    writePendingEntries();
+    std::vector<RawLogEntries> chunks;
+    if (!segment_store->readRawEntries(index, index + cnt - 1, chunks))
+        return nullptr;
+
+    size_t size_total = sizeof(int32) * 3;
+    for (const auto & chunk : chunks)
+        size_total += sizeof(byte) + sizeof(ulong) * 2 + chunk.data.size();
+
+    ptr<buffer> buf_out = buffer::alloc(size_total);
+    buf_out->pos(0);
+    buf_out->put(RAW_PACK);
+    buf_out->put(cnt);
+    buf_out->put(static_cast<int32>(chunks.size()));
+    for (const auto & chunk : chunks)
+    {
+        buf_out->put(static_cast<byte>(chunk.checksum));
+        buf_out->put(static_cast<ulong>(chunk.count));
+        buf_out->put(static_cast<ulong>(chunk.data.size()));
+        buf_out->put_raw(reinterpret_cast<const byte *>(chunk.data.data()), chunk.data.size());
+    }
+    buf_out->pos(0);
+    LOG_DEBUG(log, "raw pack log start {}, count {}, {} bytes", index, cnt, size_total);
+    return buf_out;
+}
+
 ptr<buffer> NuRaftFileLogStore::pack(ulong index, int32 cnt)
+{
+    ptr<buffer> buf_out = raw_packs ? packRaw(index, cnt) : nullptr;
+    if (!buf_out)
+        buf_out = packEntries(index, cnt);
+
+    String compressed;
+    if (compress_log && LogEntry::compress(reinterpret_cast<const char *>(buf_out->data_begin()), buf_out->size(), compressed))
+    {
+        ptr<buffer> compressed_out = buffer::alloc(sizeof(int32) * 2 + compressed.size());
+        compressed_out->pos(0);
+        compressed_out->put(COMPRESSED_PACK);
+        compressed_out->put(static_cast<int32>(buf_out->size()));
+        compressed_out->put_raw(reinterpret_cast<const nuraft::byte *>(compressed.data()), compressed.size());
+        compressed_out->pos(0);
+        LOG_DEBUG(log, "compressed pack from {} to {} bytes", buf_out->size(), compressed_out->size());
+        return compressed_out;
+    }
+
+    return buf_out;
+}
+
+ptr<buffer> NuRaftFileLogStore::packEntries(ulong index, int32 cnt)
 {
     ptr<std::vector<ptr<log_entry>>> entries = log_entries(index, index + cnt);
 
@@ -358,34 +581,102 @@ ptr<buffer> NuRaftFileLogStore::pack(ulong index, int32 cnt)
     }
 
     LOG_DEBUG(log, "pack log start {}, count {}", index, cnt);
-
     return buf_out;
 }
 
+void NuRaftFileLogStore::applyRawPack(ulong index, buffer & pack)
+{
+    int32 cnt = pack.get_int();
+    int32 chunk_count = pack.get_int();
+    std::vector<RawLogEntries> chunks;
+    UInt64 entries = 0;
+    for (int32 i = 0; i < chunk_count; ++i)
+    {
+        if (pack.size() - pack.pos() < sizeof(byte) + sizeof(ulong) * 2)
+        {
+            LOG_ERROR(log, "Raw log pack at {} of {} bytes is truncated", index, pack.size());
+            return;
+        }
+        byte checksum = pack.get_byte();
+        ulong count = pack.get_ulong();
+        ulong size = pack.get_ulong();
+        if (checksum > static_cast<byte>(ChecksumType::CRC32C) || size > pack.size() - pack.pos())
+        {
+            LOG_ERROR(log, "Raw log pack at {} of {} bytes is corrupted", index, pack.size());
+            return;
+        }
+        const char * data = reinterpret_cast<const char *>(pack.data_begin()) + pack.pos();
+        chunks.push_back(RawLogEntries{static_cast<ChecksumType>(checksum), count, std::string(data, size)});
+        pack.pos(pack.pos() + size);
+        entries += count;
+    }
+    if (entries != static_cast<UInt64>(cnt))
+        LOG_WARNING(log, "Raw log pack at {} has {} entries, expect {}", index, entries, cnt);
+
+    {
+        std::lock_guard lock(pending_mutex);
+        appendPendingEntries();
+        /// Headers and checksums are validated before the entries are written
+        if (segment_store->writeRawAt(index, chunks) == static_cast<UInt64>(-1))
+            LOG_ERROR(log, "Failed to apply raw log pack at {}, segment_store last_log_index {}", index, segment_store->lastLogIndex());
+        log_cache.clear();
+        clearReadAhead();
+    }
+    if (log_fsync_mode == FsyncMode::FSYNC_PARALLEL)
+        parallel_fsync_event->set();
+    LOG_DEBUG(log, "apply raw pack {}, {} entries", index, entries);
+}
+
 void NuRaftFileLogStore::apply_pack(ulong index, buffer & pack)
 {
     pack.pos(0);
     int32 num_logs = pack.get_int();
 
+    if (num_logs == COMPRESSED_PACK)
+    {
+        int32 pack_size = pack.get_int();
+        ptr<buffer> decompressed = pack_size > 0 ? buffer::alloc(pack_size) : nullptr;
+        const char * compressed = reinterpret_cast<const char *>(pack.data_begin()) + pack.pos();
+        if (!decompressed
+            || !LogEntry::decompress(compressed, pack.size() - pack.pos(), reinterpret_cast<char *>(decompressed->data_begin()), pack_size))
+        {
+            LOG_ERROR(log, "Failed to decompress log pack at {} of {} bytes", index, pack.size());
+            return;
+        }
+        apply_pack(index, *decompressed);
+        return;
+    }
+
+    if (num_logs == RAW_PACK)
+    {
+        applyRawPack(index, pack);
+        return;
+    }
+
+    std::vector<ptr<log_entry>> entries;
+    entries.reserve(num_logs);
     for (int32 ii = 0; ii < num_logs; ++ii)
     {
-        ulong cur_idx = index + ii;
         int32 buf_size = pack.get_int();
 
         ptr<buffer> buf_local = buffer::alloc(buf_size);
         pack.get(buf_local);
 
-        if (cur_idx - segment_store->lastLogIndex() != 1)
-            LOG_WARNING(log, "cur_idx {}, segment_store last_log_index {}, difference is not 1", cur_idx, segment_store->lastLogIndex());
+        entries.push_back(log_entry::deserialize(*buf_local));
+    }
+
+    {
+        std::lock_guard lock(pending_mutex);
+        appendPendingEntries();
+        if (index - segment_store->lastLogIndex() != 1)
+            LOG_WARNING(log, "cur_idx {}, segment_store last_log_index {}, difference is not 1", index, segment_store->lastLogIndex());
         else
-            LOG_DEBUG(log, "cur_idx {}, segment_store last_log_index {}", cur_idx, segment_store->lastLogIndex());
+            LOG_DEBUG(log, "cur_idx {}, segment_store last_log_index {}", index, segment_store->lastLogIndex());
 
-        ptr<log_entry> le = log_entry::deserialize(*buf_local);
-        //if (cur_idx - segment_store->lastLogIndex() == 1)
-        //  segment_store->appendEntry(le);
-        {
-            segment_store->writeAt(cur_idx, le);
-        }
+        /// The whole pack is written by one pwritev
+        segment_store->writeAt(index, entries);
+        log_cache.clear();
+        clearReadAhead();
     }
     if (log_fsync_mode == FsyncMode::FSYNC_PARALLEL)
         parallel_fsync_event->set();
@@ -395,9 +686,23 @@ void NuRaftFileLogStore::apply_pack(ulong index, buffer & pack)
 //last_log_index : last removed log index
 bool NuRaftFileLogStore::compact(ulong last_log_index)
 {
+    /// Not when the log is compacted past its end for an installed snapshot, nor for downstreams behind the log already
+    if (retention_floor && last_log_index + 1 < next_slot())
+    {
+        UInt64 floor = retention_floor();
+        if (floor > start_index() && floor <= last_log_index)
+        {
+            LOG_DEBUG(log, "Keep log from {} for downstreams, not compacted to {}", floor, last_log_index);
+            last_log_index = floor - 1;
+        }
+    }
+
     //std::lock_guard<std::recursive_mutex> lock(log_lock);
+    std::lock_guard lock(pending_mutex);
+    appendPendingEntries();
     segment_store->removeSegment(last_log_index + 1);
-    log_queue.clear();
+    log_cache.clear();
+    clearReadAhead();
     //start_idx = last_log_index + 1;
     LOG_DEBUG(log, "compact last_log_index {}", last_log_index);
     return true;
@@ -412,12 +717,27 @@ void FileLogStore::close()
 
 bool NuRaftFileLogStore::flush()
 {
+    writePendingEntries();
     return segment_store->flush() > 0;
 }
 
+LogFsyncStats NuRaftFileLogStore::getFsyncStats() const
+{
+    std::lock_guard lock(fsync_stats_mutex);
+    return fsync_stats;
+}
+
+LogCacheStats NuRaftFileLogStore::getCacheStats() const
+{
+    LogCacheStats stats = log_cache.getStats();
+    stats.read_ahead_hits = read_ahead_hits.load(std::memory_order_relaxed);
+    return stats;
+}
+
 ulong NuRaftFileLogStore::last_durable_index()
 {
-    uint64_t last_log = next_slot() - 1;
+    /// Entries held back are not written yet
+    uint64_t last_log = segment_store->lastLogIndex();
     if (log_fsync_mode != FsyncMode::FSYNC_PARALLEL) {
         return last_log;
     }
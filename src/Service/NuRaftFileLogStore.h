@@ -1,8 +1,12 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <map>
 #include <mutex>
+#include <Service/LogEntryCache.h>
+#include <Service/LogFsyncStats.h>
 #include <Service/NuRaftLogSegment.h>
 #include <libnuraft/nuraft.hxx>
 #include <common/logger_useful.h>
@@ -15,25 +19,6 @@ using nuraft::int32;
 using nuraft::int64;
 using nuraft::ulong;
 
-class LogEntryQueue
-{
-public:
-    LogEntryQueue() : batch_index(0), max_index(0), log(&(Poco::Logger::get("LogEntryQueue"))) { }
-    ptr<log_entry> getEntry(const UInt64 & index);
-    void putEntry(UInt64 & index, ptr<log_entry> & entry);
-    void putEntryOrClear(UInt64 & index, ptr<log_entry> & entry);
-    void clear();
-
-private:
-    static constexpr UInt8 BIT_SIZE = 16;
-    static constexpr UInt32 MAX_VECTOR_SIZE = 65536; //2^16
-    UInt64 batch_index;
-    UInt64 max_index;
-    ptr<log_entry> entry_vec[MAX_VECTOR_SIZE];
-    std::shared_mutex queue_mutex;
-    Poco::Logger * log;
-};
-
 class NuRaftFileLogStore : public nuraft::log_store
 {
     __nocopy__(NuRaftFileLogStore)
@@ -45,7 +30,19 @@ public :
         FsyncMode log_fsync_mode_ = FsyncMode::FSYNC_PARALLEL,
         UInt64 log_fsync_interval_ = 1000,
         UInt32 max_log_size_ = LogSegmentStore::MAX_LOG_SIZE,
-        UInt32 max_segment_count_ = LogSegmentStore::MAX_SEGMENT_COUNT);
+        UInt32 max_segment_count_ = LogSegmentStore::MAX_SEGMENT_COUNT,
+        bool preallocate_segments_ = false,
+        bool drop_page_cache_ = false,
+        bool batch_appends_ = false,
+        UInt64 log_cache_max_bytes_ = LogEntryCache::DEFAULT_MAX_BYTES,
+        bool compress_log_ = false,
+        UInt64 log_remove_bytes_per_second_ = LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND,
+        bool raw_packs_ = false,
+        const std::string & log_cold_dir_ = "",
+        UInt64 log_fsync_batch_bytes_ = 0,
+        UInt64 log_fsync_max_lag_ms_ = 0,
+        bool log_persistent_memory_ = false,
+        bool log_crc32c_checksum_ = false);
 
     ~NuRaftFileLogStore() override;
 
@@ -88,27 +85,103 @@ public :
         raft_instance = raft_instance_;
     }
 
+    /// First log index compaction keeps, 0 for none, see RelayDownstreams. Set before the log is compacted.
+    void setRetentionFloor(std::function<UInt64()> retention_floor_) { retention_floor = std::move(retention_floor_); }
+
     const ptr<LogSegmentStore> segmentStore() const { return segment_store; }
 
+    LogFsyncStats getFsyncStats() const;
+    LogCacheStats getCacheStats() const;
+    /// Lowered under memory pressure, see LogEntryCache::setMaxBytes
+    void setCacheMaxBytes(UInt64 max_bytes) { log_cache.setMaxBytes(max_bytes); }
+
 private:
+    /// Appended entries held back at most, a batch of them is written by one pwritev
+    static constexpr size_t MAX_PENDING_ENTRIES = 512;
+    /// Entry count of a pack whose entries are compressed as a whole, it is followed by the size before compression
+    static constexpr int32 COMPRESSED_PACK = -1;
+    /// Entry count of a pack of entries as they are on disk, it is followed by the count and the chunks of RawLogEntries
+    static constexpr int32 RAW_PACK = -2;
+
+    /// Entries read ahead at most when entries missing in log_cache are read in order
+    static constexpr UInt64 READ_AHEAD_ENTRIES = 1024;
+    static constexpr int64 READ_AHEAD_BYTES = 4 * 1024 * 1024;
+
     static ptr<log_entry> make_clone(const ptr<log_entry> & entry);
     void fsyncThread(bool & thread_started);
 
+    /// fsync_batch: fsync the entries not durable, fsync_batch_mutex must be held
+    void fsyncBatch();
+    /// Time the oldest entry not durable waits for at most before it is fsynced, fsync_batch_mutex must be held
+    UInt64 batchFsyncDeadlineUs() const;
+    /// fsync_batch: fsync the entries waiting longer than the deadline when no more entries are appended
+    void batchFsyncThread();
+
+    /// Write entries held back by append to segments, pending_mutex must be held
+    void appendPendingEntries();
+    void writePendingEntries();
+
+    /// Pack of entries read from segments as they are, nullptr if some of them can not be read so
+    ptr<buffer> packRaw(ulong index, int32 cnt);
+    /// Pack of serialized log entries
+    ptr<buffer> packEntries(ulong index, int32 cnt);
+    void applyRawPack(ulong index, buffer & pack);
+
+    /// Read an entry missing in log_cache, a sequential reader reads entries ahead
+    ptr<log_entry> readEntry(UInt64 index);
+    void clearReadAhead();
+
     Poco::Logger * log;
     ptr<LogSegmentStore> segment_store;
-    LogEntryQueue log_queue;
+    LogEntryCache log_cache;
+
+    /// Entries from read_ahead_start read ahead for a lagging follower, they are older than log_cache
+    std::mutex read_ahead_mutex;
+    UInt64 read_ahead_start{0};
+    std::vector<ptr<log_entry>> read_ahead_entries;
+    UInt64 last_read_index{0};
+    std::atomic<UInt64> read_ahead_hits{0};
 
     ptr<log_entry> last_log_entry;
+
+    /// Appended entries are held back and written together in end_of_append_batch, they are read from log_cache meanwhile
+    const bool batch_appends;
+    /// Compress entries in segments and packs shipped to followers
+    const bool compress_log;
+    /// Ship packs as raw segment bytes which followers append without deserializing entries
+    const bool raw_packs;
+    mutable std::mutex pending_mutex;
+    std::vector<ptr<log_entry>> pending_entries;
+
     FsyncMode log_fsync_mode;
     UInt64 log_fsync_interval;
-
+    /// fsync_batch: bytes not durable which make an fsync, 0 means no limit
+    const UInt64 log_fsync_batch_bytes;
+    /// fsync_batch: bound of the time an entry is not durable, the entry threshold is adapted to it, 0 to disable
+    const UInt64 log_fsync_max_lag_ms;
+
+    std::mutex fsync_batch_mutex;
+    std::condition_variable fsync_batch_cv;
+    /// Entries not durable, since unflushed_since_us
     UInt64 to_flush_count{0};
+    std::atomic<UInt64> unflushed_bytes{0};
+    UInt64 unflushed_since_us{0};
+    /// Entries which make an fsync, at most log_fsync_interval
+    UInt64 batch_fsync_entries;
+    /// Exponentially weighted average, the deadline leaves time for the fsync itself
+    UInt64 avg_fsync_latency_us{0};
+
     ThreadFromGlobalPool fsync_thread;
     std::atomic<bool> shutdown_called{false};
 
-    ulong disk_last_durable_index;
+    std::atomic<ulong> disk_last_durable_index;
+    /// Auto reset, appends while fsyncing are made durable together by the next fsync
     std::shared_ptr<Poco::Event> parallel_fsync_event;
+
+    mutable std::mutex fsync_stats_mutex;
+    LogFsyncStats fsync_stats;
     nuraft::ptr<nuraft::raft_server> raft_instance;
+    std::function<UInt64()> retention_floor;
 };
 
 }
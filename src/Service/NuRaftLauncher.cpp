@@ -0,0 +1,165 @@
+#include <Service/NuRaftLauncher.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <thread>
+#include <Common/setThreadName.h>
+#include <common/getThreadId.h>
+
+namespace RK
+{
+
+namespace
+{
+    /// Nice value of the control threads, they are not raised if the process may not do it
+    constexpr int CONTROL_THREAD_NICE = -10;
+
+    bool isControlRequest(nuraft::req_msg & request)
+    {
+        switch (request.get_type())
+        {
+            case nuraft::msg_type::request_vote_request:
+            case nuraft::msg_type::pre_vote_request:
+                return true;
+            case nuraft::msg_type::append_entries_request:
+                return request.log_entries().empty();
+            default:
+                return false;
+        }
+    }
+
+    /// Client of a peer sending control requests on the control connection and the rest on the data connection
+    class SplitRpcClient : public nuraft::rpc_client
+    {
+    public:
+        SplitRpcClient(nuraft::ptr<nuraft::rpc_client> data_client_, nuraft::ptr<nuraft::rpc_client> control_client_)
+            : data_client(std::move(data_client_)), control_client(std::move(control_client_))
+        {
+        }
+
+        void send(nuraft::ptr<nuraft::req_msg> & request, nuraft::rpc_handler & when_done, uint64_t send_timeout_ms) override
+        {
+            if (isControlRequest(*request))
+                control_client->send(request, when_done, send_timeout_ms);
+            else
+                data_client->send(request, when_done, send_timeout_ms);
+        }
+
+        uint64_t get_id() const override { return data_client->get_id(); }
+
+        /// The client is created again if either connection is abandoned
+        bool is_abandoned() const override { return data_client->is_abandoned() || control_client->is_abandoned(); }
+
+    private:
+        nuraft::ptr<nuraft::rpc_client> data_client;
+        nuraft::ptr<nuraft::rpc_client> control_client;
+    };
+
+    class SplitRpcClientFactory : public nuraft::rpc_client_factory
+    {
+    public:
+        SplitRpcClientFactory(
+            nuraft::ptr<nuraft::asio_service> data_service_,
+            nuraft::ptr<nuraft::asio_service> control_service_,
+            UInt16 control_port_offset_)
+            : data_service(std::move(data_service_))
+            , control_service(std::move(control_service_))
+            , control_port_offset(control_port_offset_)
+        {
+        }
+
+        /// The endpoint is host:port
+        nuraft::ptr<nuraft::rpc_client> create_client(const std::string & endpoint) override
+        {
+            auto data_client = data_service->create_client(endpoint);
+            size_t colon = endpoint.rfind(':');
+            if (!data_client || colon == std::string::npos)
+                return data_client;
+
+            int port = std::stoi(endpoint.substr(colon + 1)) + control_port_offset;
+            auto control_client = control_service->create_client(endpoint.substr(0, colon + 1) + std::to_string(port));
+            if (!control_client)
+                return data_client;
+            return nuraft::cs_new<SplitRpcClient>(data_client, control_client);
+        }
+
+    private:
+        nuraft::ptr<nuraft::asio_service> data_service;
+        nuraft::ptr<nuraft::asio_service> control_service;
+        UInt16 control_port_offset;
+    };
+
+    void stopAsioService(nuraft::ptr<nuraft::asio_service> & service, nuraft::ptr<nuraft::rpc_listener> & listener, size_t time_limit_sec)
+    {
+        if (listener)
+        {
+            listener->stop();
+            listener->shutdown();
+        }
+        if (!service)
+            return;
+        service->stop();
+        for (size_t waited_ms = 0; service->get_active_workers() && waited_ms < time_limit_sec * 1000; waited_ms += 10)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+nuraft::ptr<nuraft::raft_server> NuRaftLauncher::init(
+    nuraft::ptr<nuraft::state_machine> state_machine,
+    nuraft::ptr<nuraft::state_mgr> state_manager,
+    nuraft::ptr<nuraft::logger> logger,
+    UInt16 port,
+    const nuraft::asio_service::options & asio_options,
+    UInt16 control_port_offset,
+    UInt32 control_thread_size,
+    const nuraft::raft_params & params,
+    const nuraft::raft_server::init_options & init_options)
+{
+    asio_service = nuraft::cs_new<nuraft::asio_service>(asio_options, logger);
+    listener = asio_service->create_rpc_listener(port, logger);
+    if (!listener)
+        return nullptr;
+
+    nuraft::ptr<nuraft::rpc_client_factory> client_factory = asio_service;
+    if (control_port_offset)
+    {
+        nuraft::asio_service::options control_options = asio_options;
+        control_options.thread_pool_size_ = control_thread_size;
+        control_options.worker_start_ = [](uint32_t)
+        {
+            setThreadName("RaftControl");
+#if defined(OS_LINUX)
+            setpriority(PRIO_PROCESS, static_cast<id_t>(getThreadId()), CONTROL_THREAD_NICE);
+#endif
+        };
+        control_asio_service = nuraft::cs_new<nuraft::asio_service>(control_options, logger);
+        control_listener = control_asio_service->create_rpc_listener(port + control_port_offset, logger);
+        if (!control_listener)
+            return nullptr;
+        client_factory = nuraft::cs_new<SplitRpcClientFactory>(asio_service, control_asio_service, control_port_offset);
+    }
+
+    nuraft::ptr<nuraft::delayed_task_scheduler> scheduler = asio_service;
+    auto * context = new nuraft::context(state_manager, state_machine, listener, logger, client_factory, scheduler, params);
+    raft_instance = nuraft::cs_new<nuraft::raft_server>(context, init_options);
+
+    nuraft::ptr<nuraft::msg_handler> handler = raft_instance;
+    listener->listen(handler);
+    if (control_listener)
+        control_listener->listen(handler);
+    return raft_instance;
+}
+
+bool NuRaftLauncher::shutdown(size_t time_limit_sec)
+{
+    if (!raft_instance)
+        return false;
+
+    raft_instance->shutdown();
+    raft_instance.reset();
+
+    stopAsioService(control_asio_service, control_listener, time_limit_sec);
+    stopAsioService(asio_service, listener, time_limit_sec);
+    return !asio_service->get_active_workers() && (!control_asio_service || !control_asio_service->get_active_workers());
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <libnuraft/nuraft.hxx> // Y_IGNORE
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Launches the raft server as nuraft::raft_launcher does, optionally with a control channel.
+ *
+ * Without the channel all raft messages share one connection to each peer and the threads of one asio service. With it
+ * votes and heartbeats, append entries requests without entries, go on a connection of their own to the port of the
+ * peer at control_port_offset past its internal port, served by a small asio service of their own, so that they never
+ * wait behind log entries or snapshot objects being sent or handled. A peer runs one request at a time, so messages
+ * to it taking different connections never overtake each other. All members must use the same offset.
+ */
+class NuRaftLauncher
+{
+public:
+    /// control_port_offset 0 means no control channel
+    nuraft::ptr<nuraft::raft_server> init(
+        nuraft::ptr<nuraft::state_machine> state_machine,
+        nuraft::ptr<nuraft::state_mgr> state_manager,
+        nuraft::ptr<nuraft::logger> logger,
+        UInt16 port,
+        const nuraft::asio_service::options & asio_options,
+        UInt16 control_port_offset,
+        UInt32 control_thread_size,
+        const nuraft::raft_params & params,
+        const nuraft::raft_server::init_options & init_options);
+
+    /// Return false if the asio threads are not all done in time_limit_sec
+    bool shutdown(size_t time_limit_sec);
+
+private:
+    nuraft::ptr<nuraft::asio_service> asio_service;
+    nuraft::ptr<nuraft::rpc_listener> listener;
+    nuraft::ptr<nuraft::asio_service> control_asio_service;
+    nuraft::ptr<nuraft::rpc_listener> control_listener;
+    nuraft::ptr<nuraft::raft_server> raft_instance;
+};
+
+}
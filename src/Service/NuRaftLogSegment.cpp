@@ -1,5 +1,10 @@
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,11 +13,37 @@
 #include <Service/KeeperCommon.h>
 #include <Service/LogEntry.h>
 #include <Service/NuRaftLogSegment.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <Poco/File.h>
+#include <IO/ReadBufferFromMemory.h>
+#include <IO/ReadHelpers.h>
+#include <IO/VarInt.h>
+#include <IO/WriteBufferFromFile.h>
+#include <IO/WriteBufferFromString.h>
+#include <IO/WriteHelpers.h>
+#include <Common/CpuId.h>
+#include <Common/Exception.h>
 #include <Common/ThreadPool.h>
+#include <Common/Throttler.h>
+#include <Common/setThreadName.h>
+#include <ext/scope_guard.h>
+
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#endif
+
+#if defined(OS_LINUX)
+/// Not defined by older headers
+#    ifndef MAP_SHARED_VALIDATE
+#        define MAP_SHARED_VALIDATE 0x03
+#    endif
+#    ifndef MAP_SYNC
+#        define MAP_SYNC 0x80000
+#    endif
+#endif
 
 #ifdef __clang__
 #    pragma clang diagnostic push
@@ -29,6 +60,125 @@ extern const int CANNOT_READ_FROM_FILE_DESCRIPTOR;
 extern const int CANNOT_WRITE_TO_FILE_DESCRIPTOR;
 }
 
+namespace
+{
+    /// Sync data of the file, and metadata only if needed to read it (e.g. file size)
+    int dataSync(int fd)
+    {
+#if defined(OS_DARWIN)
+        return ::fsync(fd);
+#else
+        return ::fdatasync(fd);
+#endif
+    }
+
+    /// Zeros written ahead of appends of a preallocated segment at a time
+    constexpr UInt64 ZERO_FILL_AHEAD = 4 * 1024 * 1024;
+
+    constexpr UInt64 PAGE_SIZE_FOR_CACHE = 4096;
+
+    /// Header, type byte and data of an appended entry
+    constexpr size_t VECS_PER_ENTRY = 3;
+
+    /// Range reads of a closed segment are read ahead up to this
+    constexpr UInt64 MAX_READ_AHEAD = 64 * 1024 * 1024;
+
+    /// Write all of vecs at offset, the last one is advanced on a short write. Returns false with errno set on error.
+    bool writeFully(int fd, struct iovec * vecs, size_t count, UInt64 offset)
+    {
+        while (count)
+        {
+            ssize_t ret = ::pwritev(fd, vecs, static_cast<int>(std::min<size_t>(count, IOV_MAX)), offset);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+            {
+                if (ret == 0)
+                    errno = EIO;
+                return false;
+            }
+
+            offset += ret;
+            auto written = static_cast<size_t>(ret);
+            while (count && written >= vecs->iov_len)
+            {
+                written -= vecs->iov_len;
+                ++vecs;
+                --count;
+            }
+            if (count)
+            {
+                vecs->iov_base = static_cast<char *>(vecs->iov_base) + written;
+                vecs->iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+#if defined(__x86_64__)
+    constexpr uintptr_t CACHE_LINE_SIZE = 64;
+
+    __attribute__((target("clwb"))) void writeBackLinesCLWB(uintptr_t from, uintptr_t to)
+    {
+        for (; from < to; from += CACHE_LINE_SIZE)
+            _mm_clwb(reinterpret_cast<void *>(from));
+    }
+
+    __attribute__((target("clflushopt"))) void writeBackLinesCLFLUSHOPT(uintptr_t from, uintptr_t to)
+    {
+        for (; from < to; from += CACHE_LINE_SIZE)
+            _mm_clflushopt(reinterpret_cast<void *>(from));
+    }
+
+    void writeBackLinesCLFLUSH(uintptr_t from, uintptr_t to)
+    {
+        for (; from < to; from += CACHE_LINE_SIZE)
+            _mm_clflush(reinterpret_cast<const void *>(from));
+    }
+#endif
+
+    /** Copy vecs to data, then write back their cache lines and fence, so that they are persistent once it returns
+      * on a MAP_SYNC mapping. clwb keeps the lines cached, clflushopt and clflush evict them.
+      */
+    void storePersistent(char * data, const struct iovec * vecs, size_t count)
+    {
+        char * end = data;
+        for (size_t i = 0; i < count; ++i)
+        {
+            memcpy(end, vecs[i].iov_base, vecs[i].iov_len);
+            end += vecs[i].iov_len;
+        }
+#if defined(__x86_64__)
+        uintptr_t from = reinterpret_cast<uintptr_t>(data) & ~(CACHE_LINE_SIZE - 1);
+        uintptr_t to = reinterpret_cast<uintptr_t>(end);
+        if (Cpu::CpuFlagsCache::have_CLWB)
+            writeBackLinesCLWB(from, to);
+        else if (Cpu::CpuFlagsCache::have_CLFLUSHOPT)
+            writeBackLinesCLFLUSHOPT(from, to);
+        else
+            writeBackLinesCLFLUSH(from, to);
+        _mm_sfence();
+#endif
+    }
+
+    /// "RaftIdx" + version
+    constexpr UInt64 INDEX_MAGIC = 0x0078644974666152;
+    constexpr UInt8 INDEX_VERSION = 1;
+
+    /// Drop clean pages of [from, to) of the file, dirty pages are not dropped by the kernel
+    void dropPageCacheOf(int fd, UInt64 from, UInt64 to)
+    {
+#if defined(OS_LINUX)
+        if (fd >= 0 && from < to)
+            ::posix_fadvise(fd, from, to - from, POSIX_FADV_DONTNEED);
+#else
+        (void)fd;
+        (void)from;
+        (void)to;
+#endif
+    }
+}
+
 using namespace nuraft;
 
 int ftruncateUninterrupted(int fd, off_t length)
@@ -41,6 +191,27 @@ int ftruncateUninterrupted(int fd, off_t length)
     return rc;
 }
 
+SegmentEntryIndex::~SegmentEntryIndex()
+{
+    for (auto & chunk : chunks)
+        delete[] chunk.load(std::memory_order_relaxed);
+}
+
+void SegmentEntryIndex::set(size_t i, UInt64 offset, UInt64 term)
+{
+    size_t k = chunkOf(i);
+    if (k >= MAX_CHUNKS)
+        throw Exception(ErrorCodes::LOGICAL_ERROR, "Entry {} is out of segment entry index", i);
+    Slot * chunk = chunks[k].load(std::memory_order_relaxed);
+    if (!chunk)
+    {
+        chunk = new Slot[FIRST_CHUNK_SIZE << k];
+        chunks[k].store(chunk, std::memory_order_release);
+    }
+    chunk[i - chunkBegin(k)].offset.store(offset, std::memory_order_relaxed);
+    chunk[i - chunkBegin(k)].term.store(term, std::memory_order_relaxed);
+}
+
 bool compareSegment(ptr<NuRaftLogSegment> & seg1, ptr<NuRaftLogSegment> & seg2)
 {
     return seg1->firstIndex() < seg2->firstIndex();
@@ -94,6 +265,11 @@ std::string NuRaftLogSegment::getPath()
     return log_dir + "/" + getFileName();
 }
 
+std::string NuRaftLogSegment::getIndexPath()
+{
+    return getFinishPath() + INDEX_FILE_SUFFIX;
+}
+
 int NuRaftLogSegment::openFile()
 {
     if (seg_fd > 0)
@@ -119,6 +295,8 @@ int NuRaftLogSegment::openFile()
 
 int NuRaftLogSegment::closeFile()
 {
+    unmapPersistentMemory();
+    unmapFile();
     if (seg_fd >= 0)
     {
         ::close(seg_fd);
@@ -127,8 +305,48 @@ int NuRaftLogSegment::closeFile()
     return 0;
 }
 
+int NuRaftLogSegment::prepareRead()
+{
+    {
+        std::shared_lock read_lock(log_mutex);
+        if (seg_fd >= 0 && (is_open || mapped_data || map_failed))
+            return 0;
+    }
+    std::lock_guard write_lock(log_mutex);
+    if (openFile() != 0)
+        return -1;
+    if (!is_open)
+        mapFile();
+    return 0;
+}
+
+void NuRaftLogSegment::mapFile()
+{
+    if (mapped_data || map_failed || file_size == 0)
+        return;
+
+    void * data = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, seg_fd, 0);
+    if (data == MAP_FAILED)
+    {
+        LOG_WARNING(log, "Failed to map segment {} of {} bytes, read it by pread, error:{}", getFileName(), file_size, strerror(errno));
+        map_failed = true;
+        return;
+    }
+    mapped_data = static_cast<char *>(data);
+    mapped_size = file_size;
+}
+
+void NuRaftLogSegment::unmapFile()
+{
+    if (mapped_data && ::munmap(mapped_data, mapped_size) != 0)
+        LOG_WARNING(log, "Failed to unmap segment {}, error:{}", file_name, strerror(errno));
+    mapped_data = nullptr;
+    mapped_size = 0;
+    map_failed = false;
+}
+
 //create new open segment
-int NuRaftLogSegment::create()
+int NuRaftLogSegment::create(const std::string & recycled_path)
 {
     if (!is_open)
     {
@@ -145,7 +363,22 @@ int NuRaftLogSegment::create()
         return -1;
     }
     errno = 0;
-    seg_fd = ::open(full_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!recycled_path.empty())
+    {
+        /// Blocks of the recycled file are reused, entries left in it are rejected by index when loading
+        try
+        {
+            Poco::File(recycled_path).renameTo(full_path);
+            seg_fd = ::open(full_path.c_str(), O_RDWR, 0644);
+            LOG_INFO(log, "Reuse recycled segment file {} for {}", recycled_path, full_path);
+        }
+        catch (...)
+        {
+            LOG_WARNING(log, "Failed to reuse recycled segment file {}, {}", recycled_path, getCurrentExceptionMessage(false));
+        }
+    }
+    if (seg_fd < 0)
+        seg_fd = ::open(full_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (seg_fd < 0)
     {
         LOG_WARNING(log, "Created new segment {} failed, fd {}, error:{}", full_path, seg_fd, strerror(errno));
@@ -178,6 +411,86 @@ void NuRaftLogSegment::writeFileHeader()
         throw Exception(ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR, "Cannot write version to file descriptor");
 
     file_size.fetch_add(sizeof(uint64_t) + sizeof(uint8_t), std::memory_order_release);
+    preallocate();
+}
+
+void NuRaftLogSegment::preallocate()
+{
+    zeroed_until = file_size;
+    if (!preallocate_size || seg_fd < 0 || file_size >= preallocate_size)
+        return;
+
+    errno = 0;
+#if defined(OS_LINUX)
+    int ret = ::fallocate(seg_fd, 0, 0, preallocate_size);
+#else
+    int ret = ftruncateUninterrupted(seg_fd, preallocate_size);
+#endif
+    if (ret != 0)
+    {
+        LOG_WARNING(log, "Failed to preallocate segment {} to {} bytes, error:{}", getFileName(), preallocate_size, strerror(errno));
+        preallocate_size = 0;
+        return;
+    }
+    if (persistent_memory)
+        mapPersistentMemory();
+}
+
+void NuRaftLogSegment::mapPersistentMemory()
+{
+    unmapPersistentMemory();
+#if defined(OS_LINUX) && defined(__x86_64__)
+    errno = 0;
+    void * data = ::mmap(nullptr, preallocate_size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, seg_fd, 0);
+    if (data == MAP_FAILED)
+    {
+        LOG_WARNING(log, "Failed to map segment {} with MAP_SYNC, it is synced by fsync, error:{}", getFileName(), strerror(errno));
+        return;
+    }
+    /// The header, the allocation and appends written before are persisted once, the blocks are not changed by appends after
+    if (dataSync(seg_fd) == -1)
+    {
+        LOG_WARNING(log, "log fsync error when mapping segment {}, error:{}", getFileName(), strerror(errno));
+        ::munmap(data, preallocate_size);
+        return;
+    }
+    pmem_data = static_cast<char *>(data);
+    pmem_size = preallocate_size;
+    pmem_unsynced.store(false, std::memory_order_relaxed);
+    LOG_INFO(log, "Map segment {} of {} bytes to persistent memory", getFileName(), pmem_size);
+#else
+    LOG_WARNING(log, "Persistent memory log is supported on Linux x86_64 only, segment {} is synced by fsync", getFileName());
+#endif
+}
+
+void NuRaftLogSegment::unmapPersistentMemory()
+{
+    if (pmem_data && ::munmap(pmem_data, pmem_size) != 0)
+        LOG_WARNING(log, "Failed to unmap segment {} from persistent memory, error:{}", file_name, strerror(errno));
+    pmem_data = nullptr;
+    pmem_size = 0;
+}
+
+void NuRaftLogSegment::zeroFillAhead(UInt64 end)
+{
+    static const char zeros[64 * 1024] = {};
+
+    UInt64 from = std::max<UInt64>(zeroed_until, file_size);
+    UInt64 to = std::min(end + ZERO_FILL_AHEAD, preallocate_size);
+    while (from < to)
+    {
+        ssize_t ret = ::pwrite(seg_fd, zeros, std::min<UInt64>(sizeof(zeros), to - from), from);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            LOG_WARNING(log, "Failed to zero fill segment {} at {}, error:{}", getFileName(), from, strerror(errno));
+            preallocate_size = 0;
+            return;
+        }
+        from += ret;
+    }
+    zeroed_until = std::max(zeroed_until, to);
 }
 
 //load open/close segment
@@ -203,7 +516,14 @@ int NuRaftLogSegment::load()
     file_size = st_buf.st_size;
 
     size_t entry_off = loadVersion();
+    if (!is_open && loadIndex(entry_off))
+    {
+        LOG_INFO(log, "Load closed segment {} from its index, {} entries", file_name, last_index + 1 - first_index);
+        return 0;
+    }
+
     UInt64 actual_last_index = first_index - 1;
+    std::vector<char> data;
     for (; entry_off < file_size;)
     {
         LogEntryHeader header;
@@ -213,6 +533,11 @@ int NuRaftLogSegment::load()
             ret = rc;
             break;
         }
+        /// A preallocated or recycled open segment ends at zeros or at an entry left by an older segment
+        if (is_open && version >= LogVersion::V1
+            && ((header.term == 0 && header.data_length == 0) || header.index != actual_last_index + 1))
+            break;
+
         // rc == 0
         const UInt64 skip_len = sizeof(LogEntryHeader) + header.data_length;
         if (entry_off + skip_len > file_size)
@@ -222,7 +547,23 @@ int NuRaftLogSegment::load()
             ret = -1;
             break;
         }
-        offset_term.push_back(std::make_pair(entry_off, header.term));
+
+        /// Entries after the last sync of the open segment may be written partly, even in the middle of the file.
+        /// A closed segment is verified once when it has no index, then it is loaded from the index.
+        data.resize(header.data_length);
+        ssize_t read_size = pread(seg_fd, data.data(), header.data_length, entry_off + sizeof(LogEntryHeader));
+        if (read_size != static_cast<ssize_t>(header.data_length) || !verifyChecksum(checksumOf(version), data.data(), header.data_length, header.data_crc))
+        {
+            if (is_open)
+            {
+                LOG_WARNING(log, "Found corrupted entry at offset {} of open segment {}, the log ends before it", entry_off, file_name);
+                break;
+            }
+            LOG_ERROR(log, "Found corrupted entry at offset {} of closed segment {}", entry_off, file_name);
+            ret = -1;
+            break;
+        }
+        entry_index.set(actual_last_index + 1 - first_index, entry_off, header.term);
         ++actual_last_index;
         entry_off += skip_len;
         if (actual_last_index << 44 == 0)
@@ -289,14 +630,163 @@ int NuRaftLogSegment::load()
     }
 
     file_size = entry_off;
+    entry_index.setEnd(actual_last_index + 1 - first_index, entry_off);
 
     if (is_open)
     {
         ::lseek(seg_fd, entry_off, SEEK_SET);
+        preallocate();
+    }
+    else if (ret == 0)
+    {
+        /// The index is missing or stale, the next startup loads it
+        writeIndex();
     }
     return ret;
 }
 
+void NuRaftLogSegment::writeIndex()
+{
+    UInt64 last = last_index.load(std::memory_order_relaxed);
+    if (last < first_index)
+        return;
+    size_t count = last + 1 - first_index;
+
+    std::string index_path = getIndexPath();
+    std::string tmp_path = index_path + ".tmp";
+    try
+    {
+        WriteBufferFromOwnString index;
+        writeIntBinary(INDEX_MAGIC, index);
+        writeIntBinary(INDEX_VERSION, index);
+        writeIntBinary(first_index, index);
+        writeIntBinary(last, index);
+        writeIntBinary(file_size.load(std::memory_order_relaxed), index);
+        writeIntBinary(entry_index.offset(0), index);
+
+        size_t runs = 0;
+        for (size_t i = 0; i < count; ++i)
+            runs += i == 0 || entry_index.term(i) != entry_index.term(i - 1);
+        writeVarUInt(runs, index);
+        for (size_t i = 0, run_begin = 0; i < count; ++i)
+        {
+            if (i + 1 == count || entry_index.term(i + 1) != entry_index.term(i))
+            {
+                writeVarUInt(i + 1 - run_begin, index);
+                writeVarUInt(entry_index.term(i), index);
+                run_begin = i + 1;
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            writeVarUInt(entry_index.offset(i + 1) - entry_index.offset(i), index);
+
+        const std::string & content = index.str();
+        UInt32 checksum = getCRC32(content.data(), content.size());
+
+        WriteBufferFromFile out(tmp_path);
+        out.write(content.data(), content.size());
+        writeIntBinary(checksum, out);
+        out.next();
+        out.close();
+        Poco::File(tmp_path).renameTo(index_path);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to write index of segment " + file_name);
+        Poco::File tmp_file(tmp_path);
+        if (tmp_file.exists())
+            tmp_file.remove();
+    }
+}
+
+bool NuRaftLogSegment::loadIndex(UInt64 entries_offset)
+{
+    std::string index_path = getIndexPath();
+    std::ifstream in(index_path, std::ios::binary);
+    if (!in)
+        return false;
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    UInt32 checksum;
+    if (content.size() < sizeof(checksum))
+        return false;
+    memcpy(&checksum, content.data() + content.size() - sizeof(checksum), sizeof(checksum));
+    if (!verifyCRC32(content.data(), content.size() - sizeof(checksum), checksum))
+    {
+        LOG_WARNING(log, "Index {} is corrupted, load segment by reading entries", index_path);
+        return false;
+    }
+
+    try
+    {
+        ReadBufferFromMemory index(content.data(), content.size() - sizeof(checksum));
+        UInt64 magic;
+        UInt8 index_version;
+        UInt64 index_first;
+        UInt64 index_last;
+        UInt64 index_file_size;
+        UInt64 offset;
+        readIntBinary(magic, index);
+        readIntBinary(index_version, index);
+        readIntBinary(index_first, index);
+        readIntBinary(index_last, index);
+        readIntBinary(index_file_size, index);
+        readIntBinary(offset, index);
+        if (magic != INDEX_MAGIC || index_version != INDEX_VERSION || index_first != first_index || index_last != last_index
+            || index_file_size != file_size || offset != entries_offset)
+        {
+            LOG_WARNING(log, "Index {} does not match the segment, load segment by reading entries", index_path);
+            return false;
+        }
+
+        std::vector<std::pair<UInt64, UInt64>> loaded(index_last - index_first + 1);
+        UInt64 runs;
+        readVarUInt(runs, index);
+        size_t pos = 0;
+        for (UInt64 run = 0; run < runs; ++run)
+        {
+            UInt64 count;
+            UInt64 term;
+            readVarUInt(count, index);
+            readVarUInt(term, index);
+            if (count > loaded.size() - pos)
+                return false;
+            for (UInt64 i = 0; i < count; ++i)
+                loaded[pos++].second = term;
+        }
+        if (pos != loaded.size())
+            return false;
+
+        for (auto & entry : loaded)
+        {
+            UInt64 length;
+            readVarUInt(length, index);
+            entry.first = offset;
+            offset += length;
+        }
+        if (offset != file_size || !index.eof())
+            return false;
+
+        for (size_t i = 0; i < loaded.size(); ++i)
+            entry_index.set(i, loaded[i].first, loaded[i].second);
+        entry_index.setEnd(loaded.size(), offset);
+        return true;
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to load index " + index_path);
+        return false;
+    }
+}
+
+void NuRaftLogSegment::removeIndex()
+{
+    Poco::File index_file(getIndexPath());
+    if (index_file.exists())
+        index_file.remove();
+}
+
 off_t NuRaftLogSegment::loadVersion()
 {
     if (seg_fd < 0)
@@ -337,11 +827,21 @@ off_t NuRaftLogSegment::loadVersion()
 //is_full=false, close ofstream
 int NuRaftLogSegment::close(bool is_full)
 {
+    std::lock_guard flush_lock(flush_mutex);
+    std::lock_guard append_lock(append_mutex);
     std::lock_guard write_lock(log_mutex);
     if (!is_open)
     {
         return 0;
     }
+    /// Pages of the mapping past the file size are gone after cutting it
+    unmapPersistentMemory();
+    /// A full segment is loaded up to its file size, so the preallocated tail is cut
+    if (is_full && preallocate_size && seg_fd >= 0 && ftruncateUninterrupted(seg_fd, file_size) != 0)
+        LOG_ERROR(log, "Failed to truncate preallocated segment to {}, error:{}", file_size, strerror(errno));
+    /// Only the open segment is synced by flush, so entries not synced yet are synced before closing.
+    if (seg_fd >= 0 && dataSync(seg_fd) == -1)
+        LOG_ERROR(log, "log fsync error when closing segment, error:{}", strerror(errno));
     closeFile();
     if (is_full)
     {
@@ -359,6 +859,7 @@ int NuRaftLogSegment::close(bool is_full)
         is_open = false;
         Poco::File(old_path).renameTo(new_path);
         file_name = getFinishFileName();
+        writeIndex();
         return 0;
     }
     return 0;
@@ -366,98 +867,337 @@ int NuRaftLogSegment::close(bool is_full)
 
 UInt64 NuRaftLogSegment::flush() const
 {
-    if (seg_fd >= 0)
+    /// Appends go on while syncing, the file is not closed meanwhile as closing takes flush_mutex too.
+    std::lock_guard flush_lock(flush_mutex);
+
+    int fd;
+    UInt64 index;
+    UInt64 synced_size;
     {
-        std::lock_guard write_lock(log_mutex);
+        std::shared_lock read_lock(log_mutex);
+        /// The segment was synced when it was closed
+        if (seg_fd < 0)
+            return is_open ? 0 : last_index.load(std::memory_order_acquire);
+        fd = seg_fd;
+        /// Entries appended after this are synced by the next flush
+        index = last_index.load(std::memory_order_acquire);
+        synced_size = file_size.load(std::memory_order_acquire);
+        /// Entries stored into the mapping are persistent before they are published, and there is no page cache of it
+        if (pmem_data && !pmem_unsynced.exchange(false, std::memory_order_acq_rel))
+            return index;
+    }
 
-        int ret;
-#if defined(OS_DARWIN)
-        ret = ::fsync(seg_fd);
-#else
-        ret = ::fdatasync(seg_fd);
-#endif
-        if (ret == -1)
-            LOG_ERROR(log, "log fsync error");
-        else if (ret == 0)
-            return last_index; /// return last_index
+    if (dataSync(fd) == -1)
+    {
+        LOG_ERROR(log, "log fsync error, error:{}", strerror(errno));
+        return 0;
     }
-    return 0;
+
+    if (drop_page_cache)
+    {
+        /// The last page is kept as the next appends write it again
+        UInt64 drop_until = synced_size / PAGE_SIZE_FOR_CACHE * PAGE_SIZE_FOR_CACHE;
+        UInt64 dropped_until = cache_dropped_until.load(std::memory_order_relaxed);
+        if (dropped_until < drop_until)
+        {
+            dropPageCacheOf(fd, dropped_until, drop_until);
+            cache_dropped_until.compare_exchange_strong(dropped_until, drop_until, std::memory_order_relaxed);
+        }
+    }
+    return index; /// return last_index
 }
 
-int NuRaftLogSegment::remove()
+void NuRaftLogSegment::dropPageCache(UInt64 from_index, UInt64 to_index) const
 {
+    if (!drop_page_cache)
+        return;
+
+    std::shared_lock read_lock(log_mutex);
+    if (from_index < first_index || to_index < from_index || to_index > last_index.load(std::memory_order_acquire))
+        return;
+
+    UInt64 from = entry_index.offset(from_index - first_index) / PAGE_SIZE_FOR_CACHE * PAGE_SIZE_FOR_CACHE;
+    UInt64 to = entry_index.offset(to_index + 1 - first_index);
+    /// Mapped pages are not dropped from the page cache while they are mapped in
+    if (mapped_data && from < to && to <= mapped_size)
+        ::madvise(mapped_data + from, to - from, MADV_DONTNEED);
+    dropPageCacheOf(seg_fd, from, to);
+}
+
+void NuRaftLogSegment::adviseRead(UInt64 from_index, UInt64 to_index)
+{
+    if (is_open || prepareRead() != 0)
+        return;
+
+    std::shared_lock read_lock(log_mutex);
+    if (!mapped_data || from_index < first_index || to_index < from_index || to_index > last_index.load(std::memory_order_acquire))
+        return;
+
+    UInt64 from = entry_index.offset(from_index - first_index) / PAGE_SIZE_FOR_CACHE * PAGE_SIZE_FOR_CACHE;
+    UInt64 to = entry_index.offset(to_index + 1 - first_index);
+    to = std::min(to, from + MAX_READ_AHEAD);
+    if (from < to && to <= mapped_size)
+        ::madvise(mapped_data + from, to - from, MADV_WILLNEED);
+}
+
+int NuRaftLogSegment::remove(const std::string & recycle_path)
+{
+    std::lock_guard flush_lock(flush_mutex);
+    std::lock_guard append_lock(append_mutex);
     std::lock_guard write_lock(log_mutex);
     closeFile();
+    if (!is_open)
+        removeIndex();
     std::string full_path = getPath();
     Poco::File file_obj(full_path);
     if (file_obj.exists())
     {
-        LOG_INFO(log, "Remove log segment {}", full_path);
-        file_obj.remove();
+        if (!recycle_path.empty())
+        {
+            LOG_INFO(log, "Recycle log segment {} to {}", full_path, recycle_path);
+            file_obj.renameTo(recycle_path);
+        }
+        else
+        {
+            LOG_INFO(log, "Remove log segment {}", full_path);
+            file_obj.remove();
+        }
     }
     return 0;
 }
 
+bool NuRaftLogSegment::moveTo(const std::string & dir, const std::string & copied_path)
+{
+    std::lock_guard flush_lock(flush_mutex);
+    std::lock_guard append_lock(append_mutex);
+    std::lock_guard write_lock(log_mutex);
+    if (is_open)
+        return false;
+
+    std::string old_path = getPath();
+    std::string old_index_path = getIndexPath();
+    std::string new_path = dir + "/" + getFileName();
+    LOG_INFO(log, "Move closed segment {} to {}", old_path, new_path);
+
+    /// The copy is in place before the old file is removed, a crash in between leaves the segment in both directories
+    Poco::File(copied_path).renameTo(new_path);
+    closeFile();
+    log_dir = dir;
+    Poco::File(old_path).remove();
+    Poco::File old_index(old_index_path);
+    if (old_index.exists())
+        old_index.remove();
+    writeIndex();
+    return true;
+}
+
 //LogEntryHeader(term,index,length,crc) + log_entry(Type+ Data)
 UInt64 NuRaftLogSegment::appendEntry(ptr<log_entry> entry, std::atomic<UInt64> & last_log_index)
 {
-    LogEntryHeader header;
-    ptr<buffer> entry_buf;
-    char * entry_str;
-    size_t buf_size = 0;
-    struct iovec vec[2];
+    if (appendEntries({entry}, 0, std::numeric_limits<UInt64>::max(), last_log_index) != 1)
+        return -1;
+    return last_index.load(std::memory_order_acquire);
+}
+
+ssize_t NuRaftLogSegment::appendEntries(
+    const std::vector<ptr<log_entry>> & entries, size_t begin, UInt64 max_size, std::atomic<UInt64> & last_log_index)
+{
+    if (!is_open || seg_fd < 0)
     {
-        //std::shared_lock read_lock(log_mutex);
-        if (!entry || !is_open)
-        {
+        LOG_ERROR(log, "Segment {} is not open.", getFileName());
+        return -1;
+    }
+    if (begin >= entries.size())
+        return 0;
+
+    size_t count = entries.size() - begin;
+    std::vector<LogEntryHeader> headers(count);
+    /// Header, type byte and data of every entry, the data is written from the buffer of the entry
+    std::vector<SerializedLogEntry> serialized(count);
+    std::vector<struct iovec> vecs(count * VECS_PER_ENTRY);
+    for (size_t i = 0; i < count; ++i)
+    {
+        ptr<log_entry> entry = entries[begin + i];
+        if (!entry)
             return -1;
+        LogEntry::serializeEntry(entry, serialized[i], compress_entries);
+        headers[i].term = entry->get_term();
+        headers[i].data_length = 1 + serialized[i].size;
+        headers[i].data_crc = extendChecksum(
+            checksumOf(version),
+            getChecksum(checksumOf(version), reinterpret_cast<const char *>(&serialized[i].type), 1),
+            serialized[i].data,
+            serialized[i].size);
+        vecs[i * VECS_PER_ENTRY].iov_base = &headers[i];
+        vecs[i * VECS_PER_ENTRY].iov_len = LogEntryHeader::HEADER_SIZE;
+        vecs[i * VECS_PER_ENTRY + 1].iov_base = &serialized[i].type;
+        vecs[i * VECS_PER_ENTRY + 1].iov_len = 1;
+        vecs[i * VECS_PER_ENTRY + 2].iov_base = const_cast<char *>(serialized[i].data);
+        vecs[i * VECS_PER_ENTRY + 2].iov_len = serialized[i].size;
+    }
+
+    /// Readers are not blocked while writing, they see the entries once last_index is advanced
+    std::lock_guard append_lock(append_mutex);
+    size_t appended = 0;
+    UInt64 end = file_size.load(std::memory_order_relaxed);
+    while (appended < count && end <= max_size)
+        end += LogEntryHeader::HEADER_SIZE + headers[appended++].data_length;
+    if (!appended)
+        return 0;
+
+    /// Blocks written by pwrite without fsync must not be stored into by the mapping, their metadata is not persistent
+    if (preallocate_size && !pmem_data && end > zeroed_until)
+        zeroFillAhead(end);
+
+    UInt64 first_appended = last_index.load(std::memory_order_acquire) + 1;
+    for (size_t i = 0; i < appended; ++i)
+        headers[i].index = first_appended + i;
+
+    errno = 0;
+    if (pmem_data && end <= pmem_size)
+    {
+        storePersistent(pmem_data + file_size.load(std::memory_order_relaxed), vecs.data(), appended * VECS_PER_ENTRY);
+    }
+    else if (!writeFully(seg_fd, vecs.data(), appended * VECS_PER_ENTRY, file_size.load(std::memory_order_relaxed)))
+    {
+        LOG_WARNING(log, "Write {} entries of {} bytes to {} failed, error:{}", appended, end - file_size, getFileName(), strerror(errno));
+        return -1;
+    }
+    else if (pmem_data)
+    {
+        pmem_unsynced.store(true, std::memory_order_release);
+    }
+
+    UInt64 offset = file_size.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < appended; ++i)
+    {
+        entry_index.set(first_appended + i - first_index, offset, headers[i].term);
+        offset += LogEntryHeader::HEADER_SIZE + headers[i].data_length;
+    }
+    entry_index.setEnd(first_appended + appended - first_index, offset);
+    file_size.store(end, std::memory_order_release);
+    last_index.fetch_add(appended, std::memory_order_release);
+    last_log_index.store(last_index, std::memory_order_release);
+
+    LOG_TRACE(
+        log,
+        "Append {} entries, index {} to {}, file {}, file size {}.",
+        appended,
+        first_appended,
+        first_appended + appended - 1,
+        getFileName(),
+        end);
+    return appended;
+}
+
+int NuRaftLogSegment::readRawEntries(UInt64 from_index, UInt64 to_index, RawLogEntries & raw)
+{
+    if (version < LogVersion::V1 || (!is_open && prepareRead() != 0))
+        return -1;
+
+    std::shared_lock read_lock(log_mutex);
+    if (from_index < first_index || to_index < from_index || to_index > last_index.load(std::memory_order_acquire)
+        || checksumOf(version) != raw.checksum)
+        return -1;
+
+    UInt64 from = entry_index.offset(from_index - first_index);
+    UInt64 to = entry_index.offset(to_index + 1 - first_index);
+    size_t old_size = raw.data.size();
+    raw.data.resize(old_size + (to - from));
+    if (mapped_data && to <= mapped_size)
+    {
+        memcpy(raw.data.data() + old_size, mapped_data + from, to - from);
+    }
+    else
+    {
+        for (UInt64 offset = from; offset < to;)
+        {
+            ssize_t ret = ::pread(seg_fd, raw.data.data() + old_size + (offset - from), to - offset, offset);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+            {
+                LOG_ERROR(log, "Read entries {} to {} of {} failed, error:{}", from_index, to_index, getFileName(), strerror(errno));
+                raw.data.resize(old_size);
+                return -1;
+            }
+            offset += ret;
         }
-        entry_str = LogEntry::serializeEntry(entry, entry_buf, buf_size);
-        if (entry_str == nullptr || buf_size == 0)
+    }
+    raw.count += to_index - from_index + 1;
+    return 0;
+}
+
+ssize_t NuRaftLogSegment::appendRawEntries(RawLogEntries & raw, size_t & pos, UInt64 max_size, std::atomic<UInt64> & last_log_index)
+{
+    if (!is_open || seg_fd < 0)
+    {
+        LOG_ERROR(log, "Segment {} is not open.", getFileName());
+        return -1;
+    }
+
+    std::lock_guard append_lock(append_mutex);
+    UInt64 expected_index = last_index.load(std::memory_order_acquire) + 1;
+    UInt64 offset = file_size.load(std::memory_order_relaxed);
+    size_t end = pos;
+    std::vector<std::pair<UInt64, UInt64>> appended_offset_term;
+    while (end < raw.data.size() && offset <= max_size)
+    {
+        LogEntryHeader header;
+        if (raw.data.size() - end < LogEntryHeader::HEADER_SIZE)
+            return -1;
+        memcpy(&header, raw.data.data() + end, LogEntryHeader::HEADER_SIZE);
+        const char * data = raw.data.data() + end + LogEntryHeader::HEADER_SIZE;
+        if (header.index != expected_index || raw.data.size() - end - LogEntryHeader::HEADER_SIZE < header.data_length
+            || !verifyChecksum(raw.checksum, data, header.data_length, header.data_crc))
         {
-            LOG_ERROR(log, "Cant get entry string buffer, size is {}.", buf_size);
+            LOG_ERROR(log, "Raw entry at {} of {} bytes is corrupted, expect index {}", end, raw.data.size(), expected_index);
             return -1;
         }
-        if (seg_fd < 0)
+        if (checksumOf(version) != raw.checksum)
         {
-            LOG_ERROR(log, "seg fs is null.");
-            return -1;
+            header.data_crc = getChecksum(checksumOf(version), data, header.data_length);
+            memcpy(raw.data.data() + end, &header, LogEntryHeader::HEADER_SIZE);
         }
-        header.term = entry->get_term();
-        header.data_length = buf_size;
-        header.data_crc = RK::getCRC32(entry_str, header.data_length);
-        vec[0].iov_base = &header;
-        vec[0].iov_len = LogEntryHeader::HEADER_SIZE;
-        vec[1].iov_base = reinterpret_cast<void *>(entry_str);
-        vec[1].iov_len = header.data_length;
+
+        appended_offset_term.emplace_back(offset, header.term);
+        offset += LogEntryHeader::HEADER_SIZE + header.data_length;
+        end += LogEntryHeader::HEADER_SIZE + header.data_length;
+        ++expected_index;
     }
+    if (appended_offset_term.empty())
+        return 0;
+
+    if (preallocate_size && !pmem_data && offset > zeroed_until)
+        zeroFillAhead(offset);
+
+    struct iovec vec;
+    vec.iov_base = raw.data.data() + pos;
+    vec.iov_len = end - pos;
     errno = 0;
+    if (pmem_data && offset <= pmem_size)
     {
-        std::lock_guard write_lock(log_mutex);
-        header.index = last_index.load(std::memory_order_acquire) + 1;
-        //ssize_t ret = pwritev(seg_fd, vec, 2, file_size);
-        ssize_t ret = writev(seg_fd, vec, 2);
-        //flush();
-        if (ret < 0 || ret != static_cast<ssize_t>(vec[0].iov_len + vec[1].iov_len))
-        {
-            LOG_WARNING(log, "Write {}, real size {}, error:{}", ret, vec[0].iov_len + vec[1].iov_len, strerror(errno));
-            return -1;
-        }
-        offset_term.push_back(std::make_pair(file_size.load(std::memory_order_relaxed), entry->get_term()));
-        file_size.fetch_add(LogEntryHeader::HEADER_SIZE + header.data_length, std::memory_order_release);
-        last_index.fetch_add(1, std::memory_order_release);
-        last_log_index.store(last_index, std::memory_order_release);
+        storePersistent(pmem_data + file_size.load(std::memory_order_relaxed), &vec, 1);
     }
-    LOG_TRACE(
-        log,
-        "Append term {}, index {}, length {}, crc {}, file {}, entry type {}.",
-        header.term,
-        header.index,
-        header.data_length,
-        header.data_crc,
-        file_size,
-        entry->get_val_type());
-    return header.index;
+    else if (!writeFully(seg_fd, &vec, 1, file_size.load(std::memory_order_relaxed)))
+    {
+        LOG_WARNING(log, "Write {} raw entries of {} bytes to {} failed, error:{}", appended_offset_term.size(), end - pos, getFileName(), strerror(errno));
+        return -1;
+    }
+    else if (pmem_data)
+    {
+        pmem_unsynced.store(true, std::memory_order_release);
+    }
+
+    UInt64 first_appended = expected_index - appended_offset_term.size();
+    for (size_t i = 0; i < appended_offset_term.size(); ++i)
+        entry_index.set(first_appended + i - first_index, appended_offset_term[i].first, appended_offset_term[i].second);
+    entry_index.setEnd(expected_index - first_index, offset);
+    file_size.store(offset, std::memory_order_release);
+    last_index.fetch_add(appended_offset_term.size(), std::memory_order_release);
+    last_log_index.store(last_index, std::memory_order_release);
+    pos = end;
+    return appended_offset_term.size();
 }
 
 int NuRaftLogSegment::writeAt(UInt64 index, const ptr<log_entry> entry)
@@ -468,27 +1208,18 @@ int NuRaftLogSegment::writeAt(UInt64 index, const ptr<log_entry> entry)
 
 int NuRaftLogSegment::getMeta(UInt64 index, LogMeta * meta) const
 {
-    if (last_index == first_index - 1 || index > last_index.load(std::memory_order_relaxed) || index < first_index)
+    UInt64 last = last_index.load(std::memory_order_acquire);
+    if (last == first_index - 1 || index > last || index < first_index)
     {
-        LOG_WARNING(log, "current_index={}, last_index={}, first_index={}", index, last_index.load(std::memory_order_relaxed), first_index);
+        LOG_WARNING(log, "current_index={}, last_index={}, first_index={}", index, last, first_index);
         return -1;
     }
 
     UInt64 meta_index = index - first_index;
-    UInt64 entry_offset = offset_term[meta_index].first;
-    UInt64 next_offset;
-    if (index < last_index.load(std::memory_order_relaxed))
-    {
-        next_offset = offset_term[meta_index + 1].first;
-    }
-    else
-    {
-        next_offset = file_size;
-    }
-
+    UInt64 entry_offset = entry_index.offset(meta_index);
     meta->offset = entry_offset;
-    meta->term = offset_term[meta_index].second;
-    meta->length = next_offset - entry_offset;
+    meta->term = entry_index.term(meta_index);
+    meta->length = entry_index.offset(meta_index + 1) - entry_offset;
     //LOG_INFO(log, "Get meta offset {}, term {}, length {}.", meta->offset, meta->term, meta->length);
     return 0;
 }
@@ -514,37 +1245,85 @@ int NuRaftLogSegment::loadHeader(int fd, off_t offset, LogEntryHeader * header)
             strerror(errno));
         return -1;
     }
-    buffer_serializer bs(buf);
-    bs.pos(0);
-    header->term = bs.get_u64();
-    header->index = bs.get_u64();
-    header->data_length = bs.get_u32();
-    header->data_crc = bs.get_u32();
-    //LOG_INFO(log, "Offset {}, header data length {}, data crc {}", offset, header->data_length, header->data_crc);
+    buffer_serializer bs(buf);
+    bs.pos(0);
+    header->term = bs.get_u64();
+    header->index = bs.get_u64();
+    header->data_length = bs.get_u32();
+    header->data_crc = bs.get_u32();
+    //LOG_INFO(log, "Offset {}, header data length {}, data crc {}", offset, header->data_length, header->data_crc);
+    return 0;
+}
+
+//Header
+//Entry
+int NuRaftLogSegment::loadEntry(int fd, off_t offset, LogEntryHeader * header, ptr<log_entry> & entry) const
+{
+    if (loadHeader(fd, offset, header) != 0)
+    {
+        return -1;
+    }
+    //LOG_INFO(log, "Load entry header, length {}, crc {}.", header->data_length, header->data_crc);
+    char * entry_str = new char[header->data_length];
+    errno = 0;
+    ssize_t ret = pread(fd, entry_str, header->data_length, offset + LogEntryHeader::HEADER_SIZE);
+    if (ret < 0 || ret != header->data_length)
+    {
+        LOG_ERROR(log, "Cant read app data from log segment, ret:{}, error:{}.", ret, strerror(errno));
+        delete[] entry_str;
+        return -1;
+    }
+
+    //LOG_INFO(log, "Load entry body, length {}, crc {}.", header->data_length, header->data_crc);
+    if (!verifyChecksum(checksumOf(version), entry_str, header->data_length, header->data_crc))
+    {
+        LOG_ERROR(
+            log,
+            "Found corrupted data at offset {}, term {}, index {}, length {}, crc {}, file {}",
+            offset,
+            header->term,
+            header->index,
+            header->data_length,
+            header->data_crc,
+            file_name);
+        delete[] entry_str;
+        return -1;
+    }
+    //LOG_INFO(log, "Verify crc32, length {}, crc {}.", header->data_length, header->data_crc);
+    entry = LogEntry::parseEntry(entry_str, header->term, header->data_length);
+    //LOG_INFO(log, "Alloc buffer, offset {}, length {}, crc {}, term {}.", offset, header->data_length, header->data_crc, entry->get_term());
+
+    delete[] entry_str;
+    if (!entry)
+    {
+        LOG_ERROR(log, "Failed to decompress entry at offset {}, index {}, file {}", offset, header->index, file_name);
+        return -1;
+    }
     return 0;
 }
 
-//Header
-//Entry
-int NuRaftLogSegment::loadEntry(int fd, off_t offset, LogEntryHeader * header, ptr<log_entry> & entry) const
+int NuRaftLogSegment::loadMappedEntry(off_t offset, LogEntryHeader * header, ptr<log_entry> & entry) const
 {
-    if (loadHeader(fd, offset, header) != 0)
+    if (offset < 0 || static_cast<size_t>(offset) + LogEntryHeader::HEADER_SIZE > mapped_size)
     {
+        LOG_ERROR(log, "Log entry header at offset {} is out of mapped segment {} of {} bytes", offset, file_name, mapped_size);
         return -1;
     }
-    //LOG_INFO(log, "Load entry header, length {}, crc {}.", header->data_length, header->data_crc);
-    char * entry_str = new char[header->data_length];
-    errno = 0;
-    ssize_t ret = pread(fd, entry_str, header->data_length, offset + LogEntryHeader::HEADER_SIZE);
-    if (ret < 0 || ret != header->data_length)
+
+    const char * pos = mapped_data + offset;
+    memcpy(&header->term, pos, sizeof(header->term));
+    memcpy(&header->index, pos + 8, sizeof(header->index));
+    memcpy(&header->data_length, pos + 16, sizeof(header->data_length));
+    memcpy(&header->data_crc, pos + 20, sizeof(header->data_crc));
+
+    const char * entry_str = pos + LogEntryHeader::HEADER_SIZE;
+    if (static_cast<size_t>(offset) + LogEntryHeader::HEADER_SIZE + header->data_length > mapped_size)
     {
-        LOG_ERROR(log, "Cant read app data from log segment, ret:{}, error:{}.", ret, strerror(errno));
-        delete[] entry_str;
+        LOG_ERROR(log, "Log entry at offset {} of length {} is out of mapped segment {}", offset, header->data_length, file_name);
         return -1;
     }
 
-    //LOG_INFO(log, "Load entry body, length {}, crc {}.", header->data_length, header->data_crc);
-    if (!verifyCRC32(entry_str, header->data_length, header->data_crc))
+    if (!verifyChecksum(checksumOf(version), entry_str, header->data_length, header->data_crc))
     {
         LOG_ERROR(
             log,
@@ -555,14 +1334,14 @@ int NuRaftLogSegment::loadEntry(int fd, off_t offset, LogEntryHeader * header, p
             header->data_length,
             header->data_crc,
             file_name);
-        delete[] entry_str;
         return -1;
     }
-    //LOG_INFO(log, "Verify crc32, length {}, crc {}.", header->data_length, header->data_crc);
     entry = LogEntry::parseEntry(entry_str, header->term, header->data_length);
-    //LOG_INFO(log, "Alloc buffer, offset {}, length {}, crc {}, term {}.", offset, header->data_length, header->data_crc, entry->get_term());
-
-    delete[] entry_str;
+    if (!entry)
+    {
+        LOG_ERROR(log, "Failed to decompress entry at offset {}, index {}, file {}", offset, header->index, file_name);
+        return -1;
+    }
     return 0;
 }
 
@@ -570,15 +1349,12 @@ int NuRaftLogSegment::loadEntry(int fd, off_t offset, LogEntryHeader * header, p
 //Data
 //-Header
 //--Entry
-//---Protobuf Message
+//---Type and ZooKeeper request
 ptr<log_entry> NuRaftLogSegment::getEntry(UInt64 index)
 {
+    if (prepareRead() != 0)
     {
-        std::lock_guard write_lock(log_mutex);
-        if (openFile() != 0)
-        {
-            return nullptr;
-        }
+        return nullptr;
     }
     std::shared_lock read_lock(log_mutex);
     LogMeta meta;
@@ -592,7 +1368,8 @@ ptr<log_entry> NuRaftLogSegment::getEntry(UInt64 index)
     {
         LogEntryHeader header;
         size_t offset = meta.offset;
-        if (loadEntry(seg_fd, offset, &header, entry) != 0)
+        int ret = mapped_data ? loadMappedEntry(offset, &header, entry) : loadEntry(seg_fd, offset, &header, entry);
+        if (ret != 0)
         {
             LOG_WARNING(log, "Get entry failed, path {}, index {}, offset {}.", getPath(), index, offset);
             ok = false;
@@ -620,6 +1397,7 @@ UInt64 NuRaftLogSegment::getTerm(UInt64 index) const
 
 int NuRaftLogSegment::truncate(const UInt64 last_index_kept)
 {
+    std::lock_guard append_lock(append_mutex);
     UInt64 truncate_size = 0;
     UInt64 first_truncate_in_offset = 0;
     {
@@ -630,7 +1408,10 @@ int NuRaftLogSegment::truncate(const UInt64 last_index_kept)
             return 0;
         }
         first_truncate_in_offset = last_index_kept + 1 - first_index;
-        truncate_size = offset_term[first_truncate_in_offset].first;
+        truncate_size = entry_index.offset(first_truncate_in_offset);
+        /// The file is going to be written again, and cut, it is mapped again by preallocate
+        unmapFile();
+        unmapPersistentMemory();
         LOG_INFO(
             log,
             "Truncating {}, offset {}, first_index {}, last_index from {} to {}, truncate_size to {} ",
@@ -656,6 +1437,8 @@ int NuRaftLogSegment::truncate(const UInt64 last_index_kept)
             old_path,
             new_path);
 
+        /// Removed first, a stale index of the closed segment must not be left if it is closed again at the same last index
+        removeIndex();
         Poco::File(old_path).renameTo(new_path);
         file_name = getOpenFileName();
         is_open = true;
@@ -682,19 +1465,25 @@ int NuRaftLogSegment::truncate(const UInt64 last_index_kept)
     }
     else
     {
+        /// Slots past last_index_kept are written again by appends, the end of entry last_index_kept is truncate_size already
         std::lock_guard write_lock(log_mutex);
-        offset_term.resize(first_truncate_in_offset);
         last_index.store(last_index_kept, std::memory_order_release);
         file_size = truncate_size;
+        unmapFile();
+        cache_dropped_until = std::min<UInt64>(cache_dropped_until, truncate_size / PAGE_SIZE_FOR_CACHE * PAGE_SIZE_FOR_CACHE);
+        preallocate();
     }
 
     return ret;
 }
 
-ptr<LogSegmentStore> LogSegmentStore::segment_store = nullptr;
+std::mutex LogSegmentStore::instances_mutex;
+std::unordered_map<std::string, ptr<LogSegmentStore>> LogSegmentStore::instances;
 
 ptr<LogSegmentStore> LogSegmentStore::getInstance(const std::string & log_dir_, bool force_new)
 {
+    std::lock_guard lock(instances_mutex);
+    auto & segment_store = instances[log_dir_];
     if (segment_store == nullptr || force_new)
     {
         segment_store = cs_new<LogSegmentStore>(log_dir_);
@@ -702,24 +1491,73 @@ ptr<LogSegmentStore> LogSegmentStore::getInstance(const std::string & log_dir_,
     return segment_store;
 }
 
-int LogSegmentStore::init(UInt32 max_log_size_, UInt32 max_segment_count_)
+int LogSegmentStore::init(
+    UInt32 max_log_size_,
+    UInt32 max_segment_count_,
+    bool preallocate_segments_,
+    bool drop_page_cache_,
+    bool compress_entries_,
+    UInt64 remove_bytes_per_second_,
+    const std::string & cold_log_dir_,
+    bool persistent_memory_,
+    bool crc32c_checksum_)
 {
-    LOG_INFO(log, "Begin init log segment store, max log size {} bytes, max segment count {}.", max_log_size_, max_segment_count_);
+    LOG_INFO(
+        log,
+        "Begin init log segment store, max log size {} bytes, max segment count {}, preallocate {}, drop page cache {}, compress {}, "
+        "remove {} bytes per second, cold log dir '{}', persistent memory {}, crc32c checksum {}.",
+        max_log_size_,
+        max_segment_count_,
+        preallocate_segments_,
+        drop_page_cache_,
+        compress_entries_,
+        remove_bytes_per_second_,
+        cold_log_dir_,
+        persistent_memory_,
+        crc32c_checksum_);
     max_log_size = max_log_size_;
-    max_segment_count = max_segment_count_;    
+    max_segment_count = max_segment_count_;
+    preallocate_segments = preallocate_segments_;
+    drop_page_cache = drop_page_cache_;
+    compress_entries = compress_entries_;
+    remove_bytes_per_second = remove_bytes_per_second_;
+    cold_log_dir = cold_log_dir_ == log_dir ? "" : cold_log_dir_;
+    persistent_memory = persistent_memory_;
+    log_version = crc32c_checksum_ ? LogVersion::V2 : CURRENT_LOG_VERSION;
 
     if (Directory::createDir(log_dir) != 0)
     {
         LOG_ERROR(log, "Fail to create directory {}", log_dir);
         return -1;
     }
+    if (!cold_log_dir.empty() && Directory::createDir(cold_log_dir) != 0)
+    {
+        LOG_ERROR(log, "Fail to create directory {}", cold_log_dir);
+        return -1;
+    }
     
     //Initialize class variables
     int ret = 0;
     first_log_index.store(1);
     last_log_index.store(0);
-    open_segment = nullptr;
-    
+    {
+        std::lock_guard write_lock(seg_mutex);
+        segments.clear();
+        open_segment = nullptr;
+        publishSegments();
+    }
+    {
+        std::lock_guard lock(recycle_mutex);
+        recycled_files.clear();
+    }
+    {
+        /// Removed files and closed segments left are listed again
+        stopBackgroundThread();
+        std::lock_guard lock(background_mutex);
+        background_tasks.clear();
+    }
+    startBackgroundThread();
+
     do
     {
         ret = listSegments();
@@ -740,54 +1578,82 @@ int LogSegmentStore::init(UInt32 max_log_size_, UInt32 max_segment_count_)
             LOG_WARNING(log, "Open segment failed, error code {}", ret);
             break;
         }
+        /// Closed segments left in log_dir by the last run
+        if (!cold_log_dir.empty())
+        {
+            for (const auto & segment : segments)
+                if (segment->getLogDir() == log_dir)
+                    scheduleMigration(segment);
+        }
     } while (0);
+
+    {
+        std::lock_guard write_lock(seg_mutex);
+        publishSegments();
+    }
     return ret;
 }
 
+void LogSegmentStore::publishSegments()
+{
+    auto published = std::make_unique<SegmentDirectory>();
+    published->segments = segments;
+    std::sort(published->segments.begin(), published->segments.end(), compareSegment);
+    published->open_segment = open_segment;
+    directory.set(std::move(published));
+}
+
 int LogSegmentStore::close()
 {
+    stopBackgroundThread();
     if (open_segment)
     {
         std::lock_guard write_lock(seg_mutex);
         open_segment->close(false);
         open_segment = nullptr;
+        publishSegments();
     }
     return 0;
 }
 
 UInt64 LogSegmentStore::flush()
 {
-    if (open_segment)
+    ptr<NuRaftLogSegment> segment;
     {
-        std::lock_guard write_lock(seg_mutex);
-        return open_segment->flush();
+        /// Not held while syncing, so that appends and rotation are not blocked by it
+        std::shared_lock read_lock(seg_mutex);
+        segment = open_segment;
     }
-    return 0;
+    return segment ? segment->flush() : 0;
 }
 
 int LogSegmentStore::openSegment()
 {
     {
         std::shared_lock read_lock(seg_mutex);
-        if (open_segment && open_segment->getFileSize() <= max_log_size && open_segment->getVersion() >= CURRENT_LOG_VERSION)
+        if (open_segment && open_segment->getFileSize() <= max_log_size && open_segment->getVersion() >= log_version)
         {
             return 0;
         }
     }
     std::lock_guard write_lock(seg_mutex);
+    SCOPE_EXIT({ publishSegments(); });
     //UInt64 last_idx(0);
     if (open_segment)
     {
         //last_idx = open_segment->lastIndex();
         open_segment->close(true);
         segments.push_back(open_segment);
+        if (!cold_log_dir.empty())
+            scheduleMigration(open_segment);
         open_segment = nullptr;
     }
     UInt64 next_idx = last_log_index.load(std::memory_order_acquire) + 1;
     //LOG_INFO(log, "Last log index, LogSegment {}, LogSegmentStore {}", last_idx, last_log_index.load(std::memory_order_acquire));
-    ptr<NuRaftLogSegment> seg = cs_new<NuRaftLogSegment>(log_dir, next_idx);
+    ptr<NuRaftLogSegment> seg = cs_new<NuRaftLogSegment>(log_dir, next_idx, "", "", log_version);
+    setupSegment(*seg);
     open_segment = seg;
-    if (open_segment->create() != 0)
+    if (open_segment->create(takeRecycledFile()) != 0)
     {
         LOG_ERROR(log, "Create open segment directory {} index {} failed.", log_dir, next_idx);
         open_segment = nullptr;
@@ -806,6 +1672,249 @@ int LogSegmentStore::openSegment()
     return 0;
 }
 
+void LogSegmentStore::setupSegment(NuRaftLogSegment & segment) const
+{
+    /// The mapping of a persistent memory segment is of its preallocated size
+    segment.setPreallocateSize(preallocate_segments || persistent_memory ? max_log_size : 0);
+    segment.setDropPageCache(drop_page_cache);
+    segment.setCompressEntries(compress_entries);
+    segment.setPersistentMemory(persistent_memory);
+}
+
+void LogSegmentStore::dropReadPageCache(UInt64 start_index, UInt64 end_index)
+{
+    if (!drop_page_cache)
+        return;
+
+    /// The open segment is read by followers which are up to date, its pages are dropped once synced
+    auto current = directory.get();
+    if (!current)
+        return;
+    for (const auto & segment : current->segments)
+    {
+        if (segment->lastIndex() < start_index || segment->firstIndex() > end_index)
+            continue;
+        segment->dropPageCache(std::max(start_index, segment->firstIndex()), std::min(end_index, segment->lastIndex()));
+    }
+}
+
+void LogSegmentStore::adviseRead(UInt64 start_index, UInt64 end_index)
+{
+    auto current = directory.get();
+    if (!current)
+        return;
+    for (const auto & segment : current->segments)
+    {
+        if (segment->lastIndex() < start_index || segment->firstIndex() > end_index)
+            continue;
+        segment->adviseRead(std::max(start_index, segment->firstIndex()), std::min(end_index, segment->lastIndex()));
+    }
+}
+
+void LogSegmentStore::removeOrRecycle(ptr<NuRaftLogSegment> & segment)
+{
+    std::string recycle_path;
+    std::string segment_dir = segment->getLogDir();
+    /// Files in cold_log_dir are not reused, new segments are created in log_dir
+    if (preallocate_segments && segment_dir == log_dir)
+    {
+        std::lock_guard lock(recycle_mutex);
+        if (recycled_files.size() < MAX_RECYCLED_SEGMENTS)
+        {
+            recycle_path = log_dir + "/" + LOG_RECYCLED_FILE_PREFIX + std::to_string(recycled_file_seq++);
+            recycled_files.push_back(recycle_path);
+        }
+    }
+    if (!recycle_path.empty())
+    {
+        segment->remove(recycle_path);
+        return;
+    }
+
+    /// Renaming is cheap, and the file is not listed as a segment any more if the node crashes before unlinking it
+    std::string removed_path = segment_dir + "/" + LOG_REMOVED_FILE_PREFIX + segment->getFileName();
+    segment->remove(removed_path);
+    scheduleRemoval(removed_path);
+}
+
+void LogSegmentStore::startBackgroundThread()
+{
+    if (background_thread.joinable())
+        return;
+    background_shutdown = false;
+    background_thread = ThreadFromGlobalPool([this] { backgroundThread(); });
+}
+
+void LogSegmentStore::stopBackgroundThread()
+{
+    if (!background_thread.joinable())
+        return;
+    {
+        std::lock_guard lock(background_mutex);
+        background_shutdown = true;
+    }
+    background_cv.notify_all();
+    background_thread.join();
+}
+
+void LogSegmentStore::scheduleBackgroundTask(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(background_mutex);
+        background_tasks.push_back(std::move(task));
+    }
+    background_cv.notify_one();
+}
+
+void LogSegmentStore::scheduleRemoval(const std::string & path)
+{
+    scheduleBackgroundTask([this, path] { removeFileThrottled(path); });
+}
+
+void LogSegmentStore::backgroundThread()
+{
+    setThreadName("LogBackground");
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(background_mutex);
+            background_cv.wait(lock, [this] { return background_shutdown || !background_tasks.empty(); });
+            if (background_shutdown)
+                return;
+            task = std::move(background_tasks.front());
+            background_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void LogSegmentStore::removeFileThrottled(const std::string & path)
+{
+    try
+    {
+        int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd >= 0)
+        {
+            struct stat st_buf;
+            if (remove_bytes_per_second && fstat(fd, &st_buf) == 0)
+            {
+                Throttler throttler(remove_bytes_per_second);
+                auto size = static_cast<UInt64>(st_buf.st_size);
+                while (size > REMOVE_CHUNK_SIZE && !background_shutdown)
+                {
+                    size -= REMOVE_CHUNK_SIZE;
+                    if (ftruncateUninterrupted(fd, size) != 0)
+                        break;
+                    throttler.add(REMOVE_CHUNK_SIZE);
+                }
+            }
+            ::close(fd);
+        }
+
+        /// Left truncated on shutdown, the next init unlinks it
+        if (background_shutdown)
+            return;
+        Poco::File file(path);
+        if (file.exists())
+            file.remove();
+        LOG_INFO(log, "Removed log file {}", path);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to remove log file " + path);
+    }
+}
+
+void LogSegmentStore::scheduleMigration(const ptr<NuRaftLogSegment> & segment)
+{
+    scheduleBackgroundTask([this, segment] { migrateSegment(segment); });
+}
+
+void LogSegmentStore::migrateSegment(const ptr<NuRaftLogSegment> & segment)
+{
+    std::string file_name = segment->getFileName();
+    std::string from_path = segment->getLogDir() + "/" + file_name;
+    std::string copied_path = cold_log_dir + "/" + LOG_MIGRATING_FILE_PREFIX + file_name;
+    int from_fd = -1;
+    int to_fd = -1;
+    try
+    {
+        /// A closed segment is not written, it is copied without locks. If it is truncated meanwhile, it is open when switched.
+        from_fd = ::open(from_path.c_str(), O_RDONLY);
+        if (from_fd < 0)
+        {
+            LOG_WARNING(log, "Segment {} is not migrated, it is removed or opened again", from_path);
+            return;
+        }
+        to_fd = ::open(copied_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (to_fd < 0)
+            throw Exception(ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR, "Cannot open {}, error:{}", copied_path, strerror(errno));
+
+        std::string copy_buf(REMOVE_CHUNK_SIZE / 16, '\0');
+        UInt64 offset = 0;
+        while (!background_shutdown)
+        {
+            ssize_t ret = ::pread(from_fd, copy_buf.data(), copy_buf.size(), offset);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                throw Exception(ErrorCodes::CANNOT_READ_FROM_FILE_DESCRIPTOR, "Cannot read {}, error:{}", from_path, strerror(errno));
+            if (ret == 0)
+                break;
+            struct iovec vec{copy_buf.data(), static_cast<size_t>(ret)};
+            if (!writeFully(to_fd, &vec, 1, offset))
+                throw Exception(ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR, "Cannot write {}, error:{}", copied_path, strerror(errno));
+            offset += ret;
+        }
+        if (!background_shutdown && dataSync(to_fd) != 0)
+            throw Exception(ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR, "Cannot sync {}, error:{}", copied_path, strerror(errno));
+        ::close(from_fd);
+        from_fd = -1;
+        ::close(to_fd);
+        to_fd = -1;
+
+        bool moved = false;
+        if (!background_shutdown)
+        {
+            /// No reader is in the segment while it is switched
+            std::lock_guard write_lock(seg_mutex);
+            bool listed = std::find(segments.begin(), segments.end(), segment) != segments.end();
+            if (listed && segment->getFileName() == file_name && segment->getFileSize() == offset)
+                moved = segment->moveTo(cold_log_dir, copied_path);
+        }
+        if (!moved)
+        {
+            LOG_INFO(log, "Segment {} is not migrated, it is changed or removed", from_path);
+            Poco::File(copied_path).remove();
+        }
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to migrate log segment " + from_path);
+        if (from_fd >= 0)
+            ::close(from_fd);
+        if (to_fd >= 0)
+            ::close(to_fd);
+        Poco::File copied(copied_path);
+        if (copied.exists())
+            copied.remove();
+    }
+}
+
+std::string LogSegmentStore::takeRecycledFile()
+{
+    std::lock_guard lock(recycle_mutex);
+    while (!recycled_files.empty())
+    {
+        std::string path = recycled_files.back();
+        recycled_files.pop_back();
+        if (Poco::File(path).exists())
+            return path;
+    }
+    return {};
+}
+
 int LogSegmentStore::getSegment(UInt64 index, ptr<NuRaftLogSegment> & seg)
 {
     seg = nullptr;
@@ -821,21 +1930,20 @@ int LogSegmentStore::getSegment(UInt64 index, ptr<NuRaftLogSegment> & seg)
         LOG_WARNING(log, "Attempted to access entry {} outside of log, index range [{}, {}].", index, first_index, last_index);
         return -1;
     }
-    if (open_segment && index >= open_segment->firstIndex())
+    auto current = directory.get();
+    if (!current)
+        return -1;
+    if (current->open_segment && index >= current->open_segment->firstIndex())
     {
-        seg = open_segment;
+        seg = current->open_segment;
     }
     else
     {
-        for (auto it = segments.begin(); it != segments.end(); it++)
-        {
-            ptr<NuRaftLogSegment> seg_it = (*it);
-            if (index >= seg_it->firstIndex() && index <= seg_it->lastIndex())
-            {
-                //LOG_INFO(log, "Get segment index range [{}, {}].", seg_it->firstIndex(), seg_it->lastIndex());
-                seg = seg_it;
-            }
-        }
+        const auto & closed = current->segments;
+        auto it = std::upper_bound(
+            closed.begin(), closed.end(), index, [](UInt64 i, const ptr<NuRaftLogSegment> & segment) { return i < segment->firstIndex(); });
+        if (it != closed.begin() && index <= (*std::prev(it))->lastIndex())
+            seg = *std::prev(it);
     }
     if (seg != nullptr)
     {
@@ -845,7 +1953,6 @@ int LogSegmentStore::getSegment(UInt64 index, ptr<NuRaftLogSegment> & seg)
     {
         return -1;
     }
-    //std::lock_guard lock(seg_mutex);
 }
 
 LogVersion LogSegmentStore::getVersion(UInt64 index)
@@ -867,6 +1974,26 @@ UInt64 LogSegmentStore::appendEntry(ptr<log_entry> entry)
     return open_segment->appendEntry(entry, last_log_index);
 }
 
+UInt64 LogSegmentStore::appendEntries(const std::vector<ptr<log_entry>> & entries)
+{
+    size_t appended = 0;
+    while (appended < entries.size())
+    {
+        /// Rotates the open segment once it is full
+        if (openSegment() != 0)
+        {
+            LOG_INFO(log, "Open segment failed.");
+            return -1;
+        }
+        std::shared_lock read_lock(seg_mutex);
+        ssize_t ret = open_segment->appendEntries(entries, appended, max_log_size, last_log_index);
+        if (ret < 0)
+            return -1;
+        appended += ret;
+    }
+    return lastLogIndex();
+}
+
 UInt64 LogSegmentStore::writeAt(UInt64 index, const ptr<log_entry> entry)
 {
     //ptr<NuRaftLogSegment> seg;
@@ -880,6 +2007,64 @@ UInt64 LogSegmentStore::writeAt(UInt64 index, const ptr<log_entry> entry)
     return -1;
 }
 
+UInt64 LogSegmentStore::writeAt(UInt64 index, const std::vector<ptr<log_entry>> & entries)
+{
+    truncateLog(index - 1);
+    if (index == lastLogIndex() + 1)
+        return appendEntries(entries);
+
+    LOG_WARNING(log, "writeAt log index {} failed, firstLogIndex {}, lastLogIndex {}.", index, firstLogIndex(), lastLogIndex());
+    return -1;
+}
+
+bool LogSegmentStore::readRawEntries(UInt64 start_index, UInt64 end_index, std::vector<RawLogEntries> & chunks)
+{
+    std::shared_lock read_lock(seg_mutex);
+    for (UInt64 index = start_index; index <= end_index;)
+    {
+        ptr<NuRaftLogSegment> seg;
+        if (getSegment(index, seg) != 0)
+            return false;
+
+        UInt64 to_index = std::min(end_index, seg->lastIndex());
+        ChecksumType checksum = checksumOf(seg->getVersion());
+        if (chunks.empty() || chunks.back().checksum != checksum)
+            chunks.push_back(RawLogEntries{checksum, 0, {}});
+        if (seg->readRawEntries(index, to_index, chunks.back()) != 0)
+            return false;
+        index = to_index + 1;
+    }
+    return true;
+}
+
+UInt64 LogSegmentStore::writeRawAt(UInt64 index, std::vector<RawLogEntries> & chunks)
+{
+    truncateLog(index - 1);
+    if (index != lastLogIndex() + 1)
+    {
+        LOG_WARNING(log, "writeRawAt log index {} failed, firstLogIndex {}, lastLogIndex {}.", index, firstLogIndex(), lastLogIndex());
+        return -1;
+    }
+
+    for (auto & chunk : chunks)
+    {
+        size_t pos = 0;
+        while (pos < chunk.data.size())
+        {
+            /// Rotates the open segment once it is full
+            if (openSegment() != 0)
+            {
+                LOG_INFO(log, "Open segment failed.");
+                return -1;
+            }
+            std::shared_lock read_lock(seg_mutex);
+            if (open_segment->appendRawEntries(chunk, pos, max_log_size, last_log_index) < 0)
+                return -1;
+        }
+    }
+    return lastLogIndex();
+}
+
 /*
 int LogSegmentStore::appendEntries(const std::vector<log_entry *> & entries)
 {
@@ -942,7 +2127,6 @@ int LogSegmentStore::appendEntries(const std::vector<log_entry *> & entries)
 ptr<log_entry> LogSegmentStore::getEntry(UInt64 index)
 {
     ptr<NuRaftLogSegment> seg;
-    std::shared_lock read_lock(seg_mutex);
     if (getSegment(index, seg) != 0)
     {
         LOG_WARNING(log, "Cant find log segmtnt by index {}.", index);
@@ -958,11 +2142,13 @@ void LogSegmentStore::getEntries(UInt64 start_index, UInt64 end_index, ptr<std::
         LOG_ERROR(log, "Entry vector is nullptr.");
         return;
     }
+    adviseRead(start_index, end_index);
     for (UInt64 index = start_index; index <= end_index; index++)
     {
         auto entry_pt = getEntry(index);
         entries->push_back(entry_pt);
     }
+    dropReadPageCache(start_index, end_index);
 }
 
 
@@ -976,9 +2162,12 @@ void LogSegmentStore::getEntriesExt(
     }
     int64 get_size = 0;
     int64 entry_size = 0;
+    adviseRead(start_index, end_index);
     for (UInt64 index = start_index; index <= end_index; index++)
     {
         auto entry_pt = getEntry(index);
+        if (!entry_pt)
+            break;
         entry_size = entry_pt->get_buf().size() + sizeof(ulong) + sizeof(char);
         if (get_size + entry_size > batch_size_hint_in_bytes)
         {
@@ -987,6 +2176,8 @@ void LogSegmentStore::getEntriesExt(
         entries->push_back(entry_pt);
         get_size += entry_size;
     }
+    if (!entries->empty())
+        dropReadPageCache(start_index, start_index + entries->size() - 1);
 }
 
 UInt64 LogSegmentStore::getTerm(UInt64 index)
@@ -1058,13 +2249,14 @@ int LogSegmentStore::removeSegment(UInt64 first_index_kept)
 
         for (size_t i = 0; i < remove_vec.size(); ++i)
         {
-            remove_vec[i]->remove();
+            removeOrRecycle(remove_vec[i]);
             LOG_INFO(log, "Remove segment, directory {}, file {}", log_dir, remove_vec[i]->getFileName());
             remove_vec[i] = nullptr;
         }
         // reset last_log_index
         if (last_log_index == 0 || (last_log_index - 1) < first_log_index)
             last_log_index.store(first_log_index - 1, std::memory_order_release);
+        publishSegments();
     }
     return 0;
 }
@@ -1089,11 +2281,12 @@ int LogSegmentStore::removeSegment()
             first_log_index.store(segment->lastIndex() + 1, std::memory_order_release);
             segments.erase(segments.begin());
         }
+        publishSegments();
     }
 
     for (size_t i = 0; i < remove_vec.size(); ++i)
     {
-        remove_vec[i]->remove();
+        removeOrRecycle(remove_vec[i]);
         LOG_INFO(log, "Remove segment, directory {}, file {}", log_dir, remove_vec[i]->getFileName());
         remove_vec[i] = nullptr;
     }
@@ -1149,12 +2342,13 @@ int LogSegmentStore::truncateLog(UInt64 last_index_kept)
                 last_segment = open_segment;
             }
         }
+        publishSegments();
     }
 
     //remove files
     for (size_t i = 0; i < remove_vec.size(); ++i)
     {
-        remove_vec[i]->remove();
+        removeOrRecycle(remove_vec[i]);
         LOG_INFO(log, "Remove segment, directory {}, file {}", log_dir, remove_vec[i]->getFileName());
         remove_vec[i] = nullptr;
     }
@@ -1180,6 +2374,7 @@ int LogSegmentStore::truncateLog(UInt64 last_index_kept)
 
             if (!segments.empty())
                 segments.erase(segments.end() - 1);
+            publishSegments();
         }
         if (ret == 0)
             last_log_index.store(last_index_kept, std::memory_order_release);
@@ -1215,6 +2410,7 @@ int LogSegmentStore::reset(UInt64 next_log_index)
     }
     first_log_index.store(next_log_index, std::memory_order_release);
     last_log_index.store(next_log_index - 1, std::memory_order_release);
+    publishSegments();
     write_lock.unlock();
     for (size_t i = 0; i < popped.size(); ++i)
     {
@@ -1224,12 +2420,12 @@ int LogSegmentStore::reset(UInt64 next_log_index)
     return 0;
 }
 
-int LogSegmentStore::listSegments()
+int LogSegmentStore::listSegmentsIn(const std::string & dir)
 {
-    Poco::File file_dir(log_dir);
+    Poco::File file_dir(dir);
     if (!file_dir.exists())
     {
-        LOG_WARNING(log, "Log directory {} is not exists.", log_dir);
+        LOG_WARNING(log, "Log directory {} is not exists.", dir);
         return 0;
     }
     std::vector<std::string> files;
@@ -1240,7 +2436,45 @@ int LogSegmentStore::listSegments()
         {
             continue;
         }
-        LOG_INFO(log, "List log dir {}, file name {}", log_dir, file_name);
+        LOG_INFO(log, "List log dir {}, file name {}", dir, file_name);
+
+        if (file_name.find(NuRaftLogSegment::INDEX_FILE_SUFFIX) != std::string::npos)
+        {
+            /// Indexes are loaded with their segments, the ones left by removed segments or failed writes are removed
+            std::string segment_name = file_name.substr(0, file_name.find(NuRaftLogSegment::INDEX_FILE_SUFFIX));
+            if (!file_name.ends_with(NuRaftLogSegment::INDEX_FILE_SUFFIX) || std::find(files.begin(), files.end(), segment_name) == files.end())
+                Poco::File(dir + "/" + file_name).remove();
+            continue;
+        }
+
+        if (file_name.starts_with(LOG_REMOVED_FILE_PREFIX))
+        {
+            scheduleRemoval(dir + "/" + file_name);
+            continue;
+        }
+
+        if (file_name.starts_with(LOG_MIGRATING_FILE_PREFIX))
+        {
+            /// Copy of a segment not switched to cold_log_dir, the segment is still in log_dir
+            Poco::File(dir + "/" + file_name).remove();
+            continue;
+        }
+
+        if (file_name.starts_with(LOG_RECYCLED_FILE_PREFIX))
+        {
+            std::string path = dir + "/" + file_name;
+            const char * seq_end = file_name.data() + file_name.size();
+            UInt64 seq = 0;
+            auto [parsed_end, error] = std::from_chars(file_name.data() + std::char_traits<char>::length(LOG_RECYCLED_FILE_PREFIX), seq_end, seq);
+            if (dir == log_dir && preallocate_segments && recycled_files.size() < MAX_RECYCLED_SEGMENTS && error == std::errc() && parsed_end == seq_end)
+            {
+                recycled_files.push_back(path);
+                recycled_file_seq = std::max(recycled_file_seq, seq + 1);
+            }
+            else
+                Poco::File(path).remove();
+            continue;
+        }
 
         int match = 0;
         UInt64 first_index = 0;
@@ -1249,29 +2483,53 @@ int LogSegmentStore::listSegments()
         match = sscanf(file_name.c_str(), NuRaftLogSegment::LOG_FINISH_FILE_NAME, &first_index, &last_index, create_time);
         if (match == 3)
         {
-            LOG_INFO(log, "Restore closed segment, directory {}, first index {}, last index {}", log_dir, first_index, last_index);
-            ptr<NuRaftLogSegment> segment = cs_new<NuRaftLogSegment>(log_dir, first_index, last_index, file_name);
+            LOG_INFO(log, "Restore closed segment, directory {}, first index {}, last index {}", dir, first_index, last_index);
+            ptr<NuRaftLogSegment> segment = cs_new<NuRaftLogSegment>(dir, first_index, last_index, file_name);
+            /// A closed segment is opened again if it is truncated
+            setupSegment(*segment);
+            auto listed = std::find_if(
+                segments.begin(), segments.end(), [&](const auto & seg) { return seg->getFileName() == file_name && seg->getLogDir() != dir; });
+            if (listed != segments.end())
+            {
+                /// The node crashed while moving it to cold_log_dir, the copy in cold_log_dir is complete
+                LOG_INFO(log, "Segment {} is migrated, remove it from {}", file_name, (*listed)->getLogDir());
+                (*listed)->remove();
+                *listed = segment;
+                continue;
+            }
             segments.push_back(segment);
             continue;
         }
         match = sscanf(file_name.c_str(), NuRaftLogSegment::LOG_OPEN_FILE_NAME, &first_index, create_time);
         if (match == 2)
         {
-            LOG_INFO(log, "Restore open segment, directory {}, first index {}, file name {}", log_dir, first_index, file_name);
+            LOG_INFO(log, "Restore open segment, directory {}, first index {}, file name {}", dir, first_index, file_name);
             if (!open_segment)
             {
-                open_segment = cs_new<NuRaftLogSegment>(log_dir, first_index, file_name, std::string(create_time));
-                LOG_INFO(log, "Create open segment, directory {}, first index {}, file name {}", log_dir, first_index, file_name);
+                open_segment = cs_new<NuRaftLogSegment>(dir, first_index, file_name, std::string(create_time));
+                setupSegment(*open_segment);
+                LOG_INFO(log, "Create open segment, directory {}, first index {}, file name {}", dir, first_index, file_name);
                 continue;
             }
             else
             {
-                LOG_WARNING(log, "Open segment conflict, directory {}, first index {}, file name {}", log_dir, first_index, file_name);
+                LOG_WARNING(log, "Open segment conflict, directory {}, first index {}, file name {}", dir, first_index, file_name);
                 return -1;
             }
         }
     }
 
+    return 0;
+}
+
+int LogSegmentStore::listSegments()
+{
+    int ret = listSegmentsIn(log_dir);
+    if (ret == 0 && !cold_log_dir.empty())
+        ret = listSegmentsIn(cold_log_dir);
+    if (ret != 0)
+        return ret;
+
     std::sort(segments.begin(), segments.end(), compareSegment);
 
     // 0 close/open segment
@@ -1347,35 +2605,42 @@ int LogSegmentStore::listSegments()
 
 int LogSegmentStore::loadSegments()
 {
-    // closed segments
-    ThreadPool load_thread_pool(LOAD_THREAD_NUM);
-    for (UInt32 thread_idx = 0; thread_idx < LOAD_THREAD_NUM; thread_idx++)
-    {
-        load_thread_pool.trySchedule([this, thread_idx] {
-            Poco::Logger * thread_log = &(Poco::Logger::get("LoadLogThread"));
-            int ret = 0;
-            for (size_t seg_idx = 0; seg_idx < this->getSegments().size(); seg_idx++)
-            {
-                if (seg_idx % LOAD_THREAD_NUM == thread_idx)
+    /// Closed segments are independent, they are loaded and verified in parallel. Every thread takes the next
+    /// segment not loaded yet, so that a few large segments without index do not keep one thread busy with the rest.
+    const size_t segment_count = segments.size();
+    std::vector<int> results(segment_count, 0);
+    std::atomic<size_t> next_segment{0};
+    {
+        ThreadPool load_thread_pool(std::min<size_t>(LOAD_THREAD_NUM, std::max<size_t>(segment_count, 1)));
+        for (size_t thread_idx = 0; thread_idx < std::min<size_t>(LOAD_THREAD_NUM, segment_count); thread_idx++)
+        {
+            load_thread_pool.scheduleOrThrowOnError([this, &results, &next_segment, segment_count] {
+                Poco::Logger * thread_log = &(Poco::Logger::get("LoadLogThread"));
+                for (size_t seg_idx = next_segment++; seg_idx < segment_count; seg_idx = next_segment++)
                 {
-                    ptr<NuRaftLogSegment> segment = this->getSegments()[seg_idx];
+                    ptr<NuRaftLogSegment> segment = segments[seg_idx];
                     LOG_INFO(thread_log, "Load closed segment, first_index {}, last_index {}", segment->firstIndex(), segment->lastIndex());
-                    ret = segment->load();
-                    if (ret != 0)
-                    {
-                        LOG_WARNING(log, "Load closed segment {} failed {}", segment->firstIndex(), ret);
-                        continue;
-                    }
-                    if (segment->lastIndex() > this->lastLogIndex())
-                    {
-                        LOG_INFO(log, "Close segment last index {}", segment->lastIndex());
-                        this->setLastLogIndex(segment->lastIndex());
-                    }
+                    results[seg_idx] = segment->load();
                 }
-            }
-        });
+            });
+        }
+        load_thread_pool.wait();
+    }
+
+    /// The list is sorted and checked to be continuous by listSegments
+    for (size_t seg_idx = 0; seg_idx < segment_count; seg_idx++)
+    {
+        if (results[seg_idx] != 0)
+        {
+            LOG_ERROR(log, "Load closed segment {} failed {}", segments[seg_idx]->getFileName(), results[seg_idx]);
+            return results[seg_idx];
+        }
+    }
+    if (segment_count)
+    {
+        LOG_INFO(log, "Loaded {} closed segments, last index {}", segment_count, segments.back()->lastIndex());
+        setLastLogIndex(segments.back()->lastIndex());
     }
-    load_thread_pool.wait();
 
     // open segment
     if (open_segment)
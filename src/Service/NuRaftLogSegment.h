@@ -1,15 +1,25 @@
 #pragma once
 
+#include <array>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 #include <vector>
+#include <Service/Crc32.h>
 #include <Service/KeeperCommon.h>
 #include <Service/LogEntry.h>
 #include <Service/proto/Log.pb.h>
 #include <libnuraft/basic_types.hxx>
 #include <libnuraft/nuraft.hxx>
 #include <common/logger_useful.h>
+#include <Common/MultiVersion.h>
+#include <Common/ThreadPool.h>
 
 
 namespace RK
@@ -20,22 +30,85 @@ enum class LogVersion : uint8_t
 {
     V0 = 0,
     V1 = 1, /// with ctime mtime
+    V2 = 2, /// checksum of entries is CRC32C
 };
 
+inline ChecksumType checksumOf(LogVersion version)
+{
+    return version >= LogVersion::V2 ? ChecksumType::CRC32C : ChecksumType::CRC32;
+}
+
 struct VersionLogEntry
 {
     LogVersion version;
     ptr<log_entry> entry;
 };
 
+/// V2 is written only if enabled by settings, so that servers without it can read segments
 static constexpr auto CURRENT_LOG_VERSION = LogVersion::V1;
 
+/// Entries as they are on disk, each a LogEntryHeader and its data, of segments with one checksum type
+struct RawLogEntries
+{
+    ChecksumType checksum;
+    UInt64 count = 0;
+    std::string data;
+};
+
+/** Offsets and terms of the entries of a segment, written by the appending thread and read without locks.
+  * Chunks double in size and are only freed with the index, so a slot never moves while it is read. Entry i is
+  * published by the release store of last_index after its slot is written, and readers load last_index with acquire
+  * before its slot. Slot i + 1 holds the end of entry i once it is published, so the end of the last entry is not
+  * read from file_size, which a concurrent append moves before it publishes.
+  */
+class SegmentEntryIndex
+{
+public:
+    SegmentEntryIndex() = default;
+    ~SegmentEntryIndex();
+    SegmentEntryIndex(const SegmentEntryIndex &) = delete;
+    SegmentEntryIndex & operator=(const SegmentEntryIndex &) = delete;
+
+    /// Only by the writer, the chunk of i is allocated if needed
+    void set(size_t i, UInt64 offset, UInt64 term);
+    /// End of the entries before i, the offset of entry i once it is appended
+    void setEnd(size_t i, UInt64 offset) { set(i, offset, 0); }
+
+    UInt64 offset(size_t i) const { return slot(i).offset.load(std::memory_order_relaxed); }
+    UInt64 term(size_t i) const { return slot(i).term.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<UInt64> offset{0};
+        std::atomic<UInt64> term{0};
+    };
+
+    static constexpr size_t FIRST_CHUNK_SIZE = 1024;
+    static constexpr size_t MAX_CHUNKS = 48;
+
+    /// Chunk k holds slots [FIRST_CHUNK_SIZE * (2^k - 1), FIRST_CHUNK_SIZE * (2^(k+1) - 1))
+    static size_t chunkOf(size_t i) { return 63 - __builtin_clzll(i / FIRST_CHUNK_SIZE + 1); }
+    static size_t chunkBegin(size_t k) { return FIRST_CHUNK_SIZE * ((1ULL << k) - 1); }
+
+    const Slot & slot(size_t i) const
+    {
+        size_t k = chunkOf(i);
+        return chunks[k].load(std::memory_order_acquire)[i - chunkBegin(k)];
+    }
+
+    std::array<std::atomic<Slot *>, MAX_CHUNKS> chunks{};
+};
 
 class NuRaftLogSegment
 {
 public:
     NuRaftLogSegment(
-        const std::string & log_dir_, UInt64 first_index_, const std::string & file_name_ = "", const std::string & create_time_ = "")
+        const std::string & log_dir_,
+        UInt64 first_index_,
+        const std::string & file_name_ = "",
+        const std::string & create_time_ = "",
+        LogVersion version_ = CURRENT_LOG_VERSION)
         : log_dir(log_dir_)
         , first_index(first_index_)
         , last_index(first_index_ - 1)
@@ -45,7 +118,7 @@ public:
         , file_size(0)
         , is_open(true)
         , log(&(Poco::Logger::get("LogSegment")))
-        , version(CURRENT_LOG_VERSION)
+        , version(version_)
     {
     }
 
@@ -61,16 +134,40 @@ public:
     {
     }
 
-    ~NuRaftLogSegment() { }
+    ~NuRaftLogSegment()
+    {
+        unmapPersistentMemory();
+        unmapFile();
+    }
 
-    // create open segment
-    int create();
+    // create open segment, reusing the recycled file if not empty
+    int create(const std::string & recycled_path = "");
     // load segment
     int load();
     // close open segment
     int close(bool is_full);
-    // remove the segment
-    int remove();
+    // remove the segment, the file is renamed to recycle_path if not empty
+    int remove(const std::string & recycle_path = "");
+
+    /// Allocate the open segment file to size ahead of appends, 0 means growing it by appends.
+    void setPreallocateSize(UInt64 size) { preallocate_size = size; }
+
+    /// Drop pages of synced appends and of range reads from the page cache
+    void setDropPageCache(bool drop) { drop_page_cache = drop; }
+
+    /// Compress data of appended entries, entries are read whether compressed or not
+    void setCompressEntries(bool compress) { compress_entries = compress; }
+
+    /** Persist appends to the preallocated open segment by storing them into a MAP_SYNC mapping of the file and writing
+      * back their cache lines, rather than by fsync. The mapping only succeeds on a filesystem mounted with dax over
+      * persistent memory, the segment is synced by fsync otherwise. The file is the same as without it.
+      */
+    void setPersistentMemory(bool enable) { persistent_memory = enable; }
+    /// Drop pages of entries [from_index, to_index] from the page cache
+    void dropPageCache(UInt64 from_index, UInt64 to_index) const;
+
+    /// Read entries [from_index, to_index] of a closed segment ahead, they are going to be read in order
+    void adviseRead(UInt64 from_index, UInt64 to_index);
 
     void writeFileHeader();
 
@@ -83,8 +180,23 @@ public:
     // serialize entry, and append to open segment,return new start index
     UInt64 appendEntry(ptr<log_entry> entry, std::atomic<UInt64> & last_log_index);
 
+    /// Serialize entries from begin and append them to the open segment by one pwritev for every IOV_MAX / 2 entries.
+    /// An entry is appended only if the segment is not larger than max_size before it, the same as appending one by one.
+    /// Returns the number of entries appended, -1 on error.
+    ssize_t appendEntries(const std::vector<ptr<log_entry>> & entries, size_t begin, UInt64 max_size, std::atomic<UInt64> & last_log_index);
+
     int writeAt(UInt64 index, const ptr<log_entry> entry);
 
+    /// Read entries [from_index, to_index] as they are on disk and append them to raw.data.
+    /// Returns -1 if the entry format of the segment is older than V1, as then it is not the format of new segments.
+    int readRawEntries(UInt64 from_index, UInt64 to_index, RawLogEntries & raw);
+
+    /** Append entries of raw from pos by one pwrite after validating their headers and checksums, headers are
+      * checksummed again if the segment uses another checksum. pos is advanced over the appended entries.
+      * Appends while the segment is not larger than max_size before an entry. Returns the appended count, -1 on error.
+      */
+    ssize_t appendRawEntries(RawLogEntries & raw, size_t & pos, UInt64 max_size, std::atomic<UInt64> & last_log_index);
+
     // get entry by index
     ptr<log_entry> getEntry(UInt64 index);
 
@@ -96,6 +208,18 @@ public:
 
     bool isOpen() const { return is_open; }
 
+    /// Directory of the segment file, changed by moveTo
+    std::string getLogDir() const
+    {
+        std::shared_lock read_lock(log_mutex);
+        return log_dir;
+    }
+
+    /** Move a closed segment to dir, where its file was copied to copied_path and synced. Readers reopen the file from dir.
+      * The index is written again in dir. Returns false if the segment was opened again meanwhile.
+      */
+    bool moveTo(const std::string & dir, const std::string & copied_path);
+
     UInt64 getFileSize() const { return file_size.load(std::memory_order_consume); }
 
     UInt64 firstIndex() const { return first_index; }
@@ -114,6 +238,8 @@ public:
     static constexpr char LOG_FINISH_FILE_NAME[] = "log_%lu_%lu_%s";
     static constexpr char LOG_OPEN_FILE_NAME[] = "log_%lu_open_%s";
 #endif
+    /// Index of a closed segment is kept next to it in <segment file name>.idx
+    static constexpr char INDEX_FILE_SUFFIX[] = ".idx";
 
 private:
     struct LogMeta
@@ -128,17 +254,44 @@ private:
     std::string getFinishFileName();
     std::string getFinishPath();
     std::string getPath();
+    std::string getIndexPath();
 
     int openFile();
     int closeFile();
 
-    //Get log index
+    /// Open the file and map it if the segment is closed, log_mutex must not be held
+    int prepareRead();
+    /// Map a closed segment, log_mutex must be held exclusively
+    void mapFile();
+    void unmapFile();
+
+    /// Offset and term of a published entry, without locks
     int getMeta(UInt64 index, LogMeta * meta) const;
     int loadHeader(int fd, off_t offset, LogEntryHeader * head) const;
     int loadEntry(int fd, off_t offset, LogEntryHeader * head, ptr<log_entry> & entry) const;
+    /// Load an entry from the mapping, the data is copied once into the entry
+    int loadMappedEntry(off_t offset, LogEntryHeader * head, ptr<log_entry> & entry) const;
 
     int truncateMetaAndGetLast(UInt64 last);
 
+    /** Write the index of a closed segment, so that it is loaded without reading all entry headers.
+     * It is offsets of entries as lengths of entries, and terms as runs of entries of one term.
+     * The index is written to a temporary file and renamed, an index failed to write is only logged.
+     */
+    void writeIndex();
+    /// Load entry_index from the index of a closed segment, false if there is no index or it does not match the segment
+    bool loadIndex(UInt64 entries_offset);
+    void removeIndex();
+
+    /// Allocate the file to preallocate_size, the file past file_size is zeros after it
+    void preallocate();
+    /// Write zeros ahead of appends up to end, so that appends do not convert unwritten extents
+    void zeroFillAhead(UInt64 end);
+
+    /// Map the preallocated open segment with MAP_SYNC, the file is synced once before appends go into the mapping
+    void mapPersistentMemory();
+    void unmapPersistentMemory();
+
 private:
     std::string log_dir;
     const UInt64 first_index;
@@ -149,10 +302,35 @@ private:
     std::atomic<UInt64> file_size;
     bool is_open;
     Poco::Logger * log;
+    /// Held shared by readers of the file and exclusively when the file or its mapping changes, never by appends
     mutable std::shared_mutex log_mutex;
-    //file offset
-    std::vector<std::pair<UInt64 /*offset*/, UInt64 /*term*/>> offset_term;
+    /// Held by flush while syncing and by closing the file, never by appends
+    mutable std::mutex flush_mutex;
+    /// Serializes appends and truncation, taken before log_mutex. Readers never take it.
+    std::mutex append_mutex;
+    SegmentEntryIndex entry_index;
     LogVersion version;
+
+    UInt64 preallocate_size = 0;
+    /// Zeros are written to the file up to here, only meaningful when preallocated
+    UInt64 zeroed_until = 0;
+
+    bool drop_page_cache = false;
+    bool compress_entries = false;
+    /// Synced appends before it are dropped from the page cache, lowered by truncate
+    mutable std::atomic<UInt64> cache_dropped_until{0};
+
+    /// A closed segment is immutable, it is mapped and read without syscalls. Falls back to pread if mapping failed.
+    char * mapped_data = nullptr;
+    size_t mapped_size = 0;
+    bool map_failed = false;
+
+    bool persistent_memory = false;
+    /// The open segment mapped with MAP_SYNC up to pmem_size, appends ending in it are persisted without fsync
+    char * pmem_data = nullptr;
+    size_t pmem_size = 0;
+    /// An append was written by pwrite while the segment is mapped, past pmem_size, so the next flush syncs the file
+    mutable std::atomic<bool> pmem_unsynced{false};
 };
 
 // LogSegmentStore use segmented append-only file, all data in disk, all index in memory.
@@ -173,11 +351,28 @@ public:
         LOG_INFO(log, "Create LogSegmentStore {}.", log_dir_);
     }
 
-    virtual ~LogSegmentStore() { }
+    virtual ~LogSegmentStore() { stopBackgroundThread(); }
+    /// Store of log_dir, servers of a process with different log dirs, such as in benchmarks, have their own stores
     static ptr<LogSegmentStore> getInstance(const std::string & log_dir, bool force_new = false);
 
     // init log store, check consistency and integrity
-    int init(UInt32 max_log_size = MAX_LOG_SIZE, UInt32 max_segment_count = MAX_SEGMENT_COUNT);
+    // preallocate_segments: allocate open segments to max_log_size ahead and recycle removed segment files
+    // drop_page_cache: drop synced appends and range reads from the page cache
+    // compress_entries: compress data of appended entries by zlib
+    // remove_bytes_per_second: speed of freeing removed segment files in the background, 0 is unlimited
+    // cold_log_dir: closed segments are moved to it in the background, the open segment is kept in log_dir
+    // persistent_memory: persist appends to the open segment in a dax mapped log_dir without fsync, see NuRaftLogSegment
+    // crc32c_checksum: create segments of V2, whose entries are checksummed by CRC32C
+    int init(
+        UInt32 max_log_size = MAX_LOG_SIZE,
+        UInt32 max_segment_count = MAX_SEGMENT_COUNT,
+        bool preallocate_segments = false,
+        bool drop_page_cache = false,
+        bool compress_entries = false,
+        UInt64 remove_bytes_per_second = DEFAULT_REMOVE_BYTES_PER_SECOND,
+        const std::string & cold_log_dir = "",
+        bool persistent_memory = false,
+        bool crc32c_checksum = false);
     int close();
     UInt64 flush();
 
@@ -191,8 +386,21 @@ public:
     // append entry to log
     UInt64 appendEntry(ptr<log_entry> entry);
 
+    /// Append a batch of entries, segments are rotated inside the batch. Returns the last log index, -1 on error.
+    UInt64 appendEntries(const std::vector<ptr<log_entry>> & entries);
+
     UInt64 writeAt(UInt64 index, const ptr<log_entry> entry);
 
+    /// Truncate the log after index - 1 and append entries from index on
+    UInt64 writeAt(UInt64 index, const std::vector<ptr<log_entry>> & entries);
+
+    /// Read entries [start_index, end_index] as they are on disk, a chunk for every run of segments of one checksum type.
+    /// Returns false if an entry is not in the log, or is in a segment of a format older than V1.
+    bool readRawEntries(UInt64 start_index, UInt64 end_index, std::vector<RawLogEntries> & chunks);
+
+    /// Truncate the log after index - 1 and append raw entries from index on. Returns the last log index, -1 on error.
+    UInt64 writeRawAt(UInt64 index, std::vector<RawLogEntries> & chunks);
+
     // get logentry by index
     ptr<log_entry> getEntry(UInt64 index);
 
@@ -228,6 +436,16 @@ public:
     static constexpr UInt32 MAX_LOG_SIZE = 1000 * 1024 * 1024; //1G, 0.3K/Log, 3M logs
     static constexpr UInt32 MAX_SEGMENT_COUNT = 50; //50G
     static constexpr int LOAD_THREAD_NUM = 8;
+    /// Removed segment files kept for new segments when preallocating
+    static constexpr size_t MAX_RECYCLED_SEGMENTS = 2;
+    static constexpr char LOG_RECYCLED_FILE_PREFIX[] = "log_recycled_";
+    /// Removed segment files are renamed to it and unlinked in the background
+    static constexpr char LOG_REMOVED_FILE_PREFIX[] = "log_removed_";
+    static constexpr UInt64 DEFAULT_REMOVE_BYTES_PER_SECOND = 256 * 1024 * 1024;
+    /// A removed file is truncated by this at a time before unlinking, so that freeing its extents is throttled
+    static constexpr UInt64 REMOVE_CHUNK_SIZE = 64 * 1024 * 1024;
+    /// A closed segment is copied to it in cold_log_dir before it is renamed to the segment file
+    static constexpr char LOG_MIGRATING_FILE_PREFIX[] = "log_migrating_";
 
 private:
     int openSegment();
@@ -239,6 +457,45 @@ private:
     //get LogSegment by log index
     int getSegment(UInt64 log_index, ptr<NuRaftLogSegment> & ptr);
 
+    /// Publish segments and open_segment to readers, after changing them under seg_mutex held exclusively
+    void publishSegments();
+
+    /// Remove segment, keeping its file for a new segment if preallocating and there are few kept.
+    /// Otherwise the file is renamed to a removed file, which is unlinked by the removal thread.
+    void removeOrRecycle(ptr<NuRaftLogSegment> & segment);
+
+    /** Removed files are unlinked and closed segments are moved to cold_log_dir by a background thread, rather than
+      * under seg_mutex, as both take long for large files. The thread is stopped by close, files left are handled after the next init.
+      */
+    void startBackgroundThread();
+    void stopBackgroundThread();
+    void scheduleBackgroundTask(std::function<void()> task);
+    void scheduleRemoval(const std::string & path);
+    void backgroundThread();
+    void removeFileThrottled(const std::string & path);
+    /// Copy a closed segment to cold_log_dir and switch it there, it is left in log_dir on any error
+    void scheduleMigration(const ptr<NuRaftLogSegment> & segment);
+    void migrateSegment(const ptr<NuRaftLogSegment> & segment);
+
+    /// Directory of closed segments, log_dir if it is not set
+    const std::string & closedSegmentDir() const { return cold_log_dir.empty() ? log_dir : cold_log_dir; }
+    /// List segment files of dir into segments and open_segment
+    int listSegmentsIn(const std::string & dir);
+    /// A recycled file for a new segment, empty if there is none
+    std::string takeRecycledFile();
+
+    /// Drop pages of closed segments read for entries [start_index, end_index]
+    void dropReadPageCache(UInt64 start_index, UInt64 end_index);
+
+public:
+    /// Entries [start_index, end_index] are going to be read in order, closed segments read them ahead
+    void adviseRead(UInt64 start_index, UInt64 end_index);
+
+private:
+
+    /// Options of segments applied to a segment when it is created or listed
+    void setupSegment(NuRaftLogSegment & segment) const;
+
     //for truncate
     /*
     void popSegments(UInt64 first_index_kept, std::vector<ptr<LogSegment>> & poped);
@@ -246,7 +503,8 @@ private:
     */
 
 private:
-    static ptr<LogSegmentStore> segment_store;
+    static std::mutex instances_mutex;
+    static std::unordered_map<std::string, ptr<LogSegmentStore>> instances;
     std::string log_dir;
     std::atomic<UInt64> first_log_index;
     std::atomic<UInt64> last_log_index;
@@ -256,6 +514,34 @@ private:
     SegmentVector segments;
     mutable std::shared_mutex seg_mutex;
     ptr<NuRaftLogSegment> open_segment;
+
+    /// Segments as readers see them, sorted by first index. Readers find a segment here rather than under seg_mutex,
+    /// so that a reader in a segment does not hold up rotation, which every append waits for.
+    struct SegmentDirectory
+    {
+        SegmentVector segments;
+        ptr<NuRaftLogSegment> open_segment;
+    };
+    MultiVersion<SegmentDirectory> directory;
+    bool preallocate_segments = false;
+    bool drop_page_cache = false;
+    bool compress_entries = false;
+    bool persistent_memory = false;
+    /// Of created segments
+    LogVersion log_version = CURRENT_LOG_VERSION;
+    std::mutex recycle_mutex;
+    std::vector<std::string> recycled_files;
+    UInt64 recycled_file_seq = 0;
+
+    UInt64 remove_bytes_per_second = DEFAULT_REMOVE_BYTES_PER_SECOND;
+    /// Closed segments are moved here from log_dir if it is not empty
+    std::string cold_log_dir;
+
+    std::mutex background_mutex;
+    std::condition_variable background_cv;
+    std::deque<std::function<void()>> background_tasks;
+    std::atomic<bool> background_shutdown{false};
+    ThreadFromGlobalPool background_thread;
     //bool enable_sync;
 };
 
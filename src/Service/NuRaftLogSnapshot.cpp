@@ -1,5 +1,10 @@
 #include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <limits>
+#include <mutex>
 #include <unordered_set>
 #include <fcntl.h>
 #include <stdio.h>
@@ -8,14 +13,21 @@
 #include <IO/WriteHelpers.h>
 #include <Service/KeeperCommon.h>
 #include <Service/NuRaftLogSnapshot.h>
+#include <Service/PathUtils.h>
 #include <Service/ReadBufferFromNuraftBuffer.h>
 #include <Service/WriteBufferFromNuraftBuffer.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 #include <Poco/File.h>
 #include <Poco/NumberFormatter.h>
 #include <Common/Exception.h>
 #include <Common/Stopwatch.h>
+#include <Common/ThreadPool.h>
+#include <Common/setThreadName.h>
 #include <Common/ZooKeeper/ZooKeeperIO.h>
+#include <ext/scope_guard.h>
 
 #ifdef __clang__
 #    pragma clang diagnostic push
@@ -34,6 +46,7 @@ namespace ErrorCodes
     extern const int LOGICAL_ERROR;
     extern const int CANNOT_READ_FROM_FILE_DESCRIPTOR;
     extern const int CANNOT_WRITE_TO_FILE_DESCRIPTOR;
+    extern const int CANNOT_OPEN_FILE;
     extern const int CANNOT_FSYNC;
     extern const int CANNOT_CLOSE_FILE;
     extern const int CHECKSUM_DOESNT_MATCH;
@@ -92,10 +105,278 @@ std::shared_ptr<WriteBufferFromFile> openFileAndWriteHeader(const String & path,
     return out;
 }
 
+/** Write buffer of data objects. Writes are throttled and the written range is handed to writeback step by step, so
+  * that dirty pages of a large snapshot are not flushed at once in front of the fsyncs of the Raft log.
+  *
+  * With io_depth, a full buffer is queued to a thread writing the object and encoding goes on in a free one, up to
+  * io_depth buffers are queued. With direct_io the object is written with O_DIRECT from the aligned buffers, writes
+  * are buffered from the first one of a size not aligned, the last one mostly. finalize waits for the queued writes.
+  */
+class SnapshotWriteBuffer : public WriteBufferFromFile
+{
+public:
+    SnapshotWriteBuffer(const String & path, const std::shared_ptr<Throttler> & throttler_, const SnapshotIOSettings & settings)
+        : SnapshotWriteBuffer(path, openObject(path, settings.direct_io), throttler_, settings)
+    {
+    }
+
+    ~SnapshotWriteBuffer() override
+    {
+        try
+        {
+            finalize();
+        }
+        catch (...)
+        {
+            tryLogCurrentException(__PRETTY_FUNCTION__);
+        }
+
+        if (writer.joinable())
+        {
+            {
+                std::lock_guard lock(mutex);
+                stopped = true;
+            }
+            cv.notify_all();
+            writer.join();
+        }
+    }
+
+    void finalize() override
+    {
+        next();
+        if (!io_depth)
+            return;
+
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this] { return queued.empty() && !writing; });
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+protected:
+    void nextImpl() override
+    {
+        size_t bytes = offset();
+        if (!io_depth)
+        {
+            writeBlock(working_buffer.begin(), bytes);
+            return;
+        }
+
+        Memory<> block;
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [this] { return error || !free_blocks.empty() || allocated_blocks < io_depth; });
+            if (error)
+                std::rethrow_exception(error);
+            if (!free_blocks.empty())
+            {
+                block = std::move(free_blocks.back());
+                free_blocks.pop_back();
+            }
+            else
+                ++allocated_blocks;
+        }
+        if (!block.data())
+            block = Memory<>(KeeperSnapshotStore::WRITE_BUFFER_SIZE, KeeperSnapshotStore::WRITE_BUFFER_ALIGNMENT);
+
+        {
+            std::lock_guard lock(mutex);
+            queued.push_back(QueuedBlock{std::move(memory), bytes});
+        }
+        cv.notify_all();
+        memory = std::move(block);
+        set(memory.data(), KeeperSnapshotStore::WRITE_BUFFER_SIZE);
+    }
+
+private:
+    struct OpenedObject
+    {
+        int fd;
+        bool direct_io;
+    };
+
+    static OpenedObject openObject(const String & path, bool direct_io)
+    {
+        int flags = O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC;
+#if defined(OS_LINUX)
+        if (direct_io)
+        {
+            int fd = ::open(path.c_str(), flags | O_DIRECT, 0666);
+            if (fd >= 0)
+                return {fd, true};
+            if (errno != EINVAL)
+                throwFromErrnoWithPath("Cannot open file " + path, path, ErrorCodes::CANNOT_OPEN_FILE);
+            LOG_WARNING(&Poco::Logger::get("KeeperSnapshotStore"), "Filesystem of {} does not support O_DIRECT, write it buffered", path);
+        }
+#endif
+        int fd = ::open(path.c_str(), flags, 0666);
+        if (fd < 0)
+            throwFromErrnoWithPath("Cannot open file " + path, path, ErrorCodes::CANNOT_OPEN_FILE);
+        return {fd, false};
+    }
+
+    SnapshotWriteBuffer(
+        const String & path, OpenedObject object, const std::shared_ptr<Throttler> & throttler_, const SnapshotIOSettings & settings)
+        : WriteBufferFromFile(
+            object.fd, path, KeeperSnapshotStore::WRITE_BUFFER_SIZE, nullptr, KeeperSnapshotStore::WRITE_BUFFER_ALIGNMENT)
+        , throttler(throttler_)
+        /// Pages written directly are not dirty
+        , flush_bytes(object.direct_io ? 0 : settings.flush_bytes)
+        , direct_io(object.direct_io)
+        , io_depth(settings.io_depth)
+    {
+        if (io_depth)
+            writer = ThreadFromGlobalPool([this] { writeQueued(); });
+    }
+
+    void writeBlock(const char * data, size_t size)
+    {
+#if defined(OS_LINUX)
+        if (direct_io && size % KeeperSnapshotStore::WRITE_BUFFER_ALIGNMENT != 0)
+        {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_DIRECT);
+            direct_io = false;
+        }
+#endif
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t res = ::pwrite(fd, data + done, size - done, written + done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                throwFromErrnoWithPath("Cannot write to file " + file_name, file_name, ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR);
+            done += res;
+        }
+        written += size;
+
+#if defined(OS_LINUX)
+        if (flush_bytes && written - flushed >= flush_bytes)
+        {
+            ::sync_file_range(fd, flushed, written - flushed, SYNC_FILE_RANGE_WRITE);
+            flushed = written;
+        }
+#endif
+
+        if (throttler)
+            throttler->add(size);
+    }
+
+    void writeQueued()
+    {
+        setThreadName("SnapshotWrite");
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            cv.wait(lock, [this] { return stopped || !queued.empty(); });
+            if (queued.empty())
+                return;
+
+            auto block = std::move(queued.front());
+            queued.pop_front();
+            bool failed = error != nullptr;
+            writing = true;
+            lock.unlock();
+
+            std::exception_ptr write_error;
+            if (!failed)
+            {
+                try
+                {
+                    writeBlock(block.memory.data(), block.size);
+                }
+                catch (...)
+                {
+                    write_error = std::current_exception();
+                }
+            }
+
+            lock.lock();
+            if (write_error)
+                error = write_error;
+            writing = false;
+            free_blocks.push_back(std::move(block.memory));
+            cv.notify_all();
+        }
+    }
+
+    std::shared_ptr<Throttler> throttler;
+    UInt64 flush_bytes;
+    bool direct_io;
+    const UInt64 io_depth;
+    /// Bytes written, the offset of the next block
+    UInt64 written = 0;
+    UInt64 flushed = 0;
+
+    struct QueuedBlock
+    {
+        Memory<> memory;
+        size_t size;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<QueuedBlock> queued;
+    std::vector<Memory<>> free_blocks;
+    /// Blocks besides the working buffer
+    UInt64 allocated_blocks = 0;
+    bool writing = false;
+    bool stopped = false;
+    /// Of the first failed write, later blocks are dropped
+    std::exception_ptr error;
+    ThreadFromGlobalPool writer;
+};
+
+std::shared_ptr<WriteBufferFromFile> openDataObjectAndWriteHeader(
+    const String & path, const SnapshotVersion version, const std::shared_ptr<Throttler> & throttler, const SnapshotIOSettings & settings)
+{
+    std::shared_ptr<WriteBufferFromFile> out = std::make_shared<SnapshotWriteBuffer>(path, throttler, settings);
+    out->write(MAGIC_SNAPSHOT_HEAD.data(), MAGIC_SNAPSHOT_HEAD.size());
+    writeIntBinary(static_cast<uint8_t>(version), *out);
+    return out;
+}
+
+/// Lowest best effort IO priority of the current thread in the scope, if the IO scheduler supports priorities
+class LowIOPriorityScope
+{
+public:
+    explicit LowIOPriorityScope(bool enabled)
+    {
+#if defined(OS_LINUX)
+        if (!enabled)
+            return;
+        previous = static_cast<int>(::syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0));
+        if (previous >= 0 && ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, LOWEST_BEST_EFFORT) != 0)
+            previous = -1;
+#else
+        (void)enabled;
+#endif
+    }
+
+    ~LowIOPriorityScope()
+    {
+#if defined(OS_LINUX)
+        if (previous >= 0)
+            ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous);
+#endif
+    }
+
+private:
+    static constexpr int IOPRIO_WHO_PROCESS = 1;
+    /// Class best effort (2) with data 7, the lowest
+    static constexpr int LOWEST_BEST_EFFORT = (2 << 13) | 7;
+
+    [[maybe_unused]] int previous = -1;
+};
+
 void writeTailAndClose(std::shared_ptr<WriteBufferFromFile> & out, UInt32 checksum)
 {
     out->write(MAGIC_SNAPSHOT_TAIL.data(), MAGIC_SNAPSHOT_TAIL.size());
     writeIntBinary(checksum, *out);
+    /// Data objects may still be written behind, see SnapshotWriteBuffer
+    out->finalize();
     out->close();
 }
 
@@ -112,28 +393,58 @@ int openFileForRead(std::string & obj_path)
     return snap_fd;
 }
 
-std::pair<size_t, UInt32> saveBatch(std::shared_ptr<WriteBufferFromFile> & out, ptr<SnapshotBatchPB> & batch)
+/// Save batch data of version, it is compressed by compression_level since V3
+std::pair<size_t, UInt32>
+saveBatchData(std::shared_ptr<WriteBufferFromFile> & out, const std::string & data, SnapshotVersion version, int compression_level = 0)
 {
-    if (!batch)
-        batch = cs_new<SnapshotBatchPB>();
-
     std::string str_buf;
-    batch->SerializeToString(&str_buf);
+    const std::string * body = &data;
+    if (version >= SnapshotVersion::V3 && version != SnapshotVersion::None)
+    {
+        std::string compressed;
+        if (compression_level > 0 && LogEntry::compress(data.data(), data.size(), compressed, compression_level))
+        {
+            auto raw_size = static_cast<UInt32>(data.size());
+            str_buf.reserve(1 + sizeof(UInt32) + compressed.size());
+            str_buf.push_back(static_cast<char>(SnapshotCodec::Zlib));
+            str_buf.append(reinterpret_cast<const char *>(&raw_size), sizeof(UInt32));
+            str_buf.append(compressed);
+        }
+        else
+        {
+            str_buf.reserve(1 + data.size());
+            str_buf.push_back(static_cast<char>(SnapshotCodec::None));
+            str_buf.append(data);
+        }
+        body = &str_buf;
+    }
 
     SnapshotBatchHeader header;
-    header.data_length = str_buf.size();
-    header.data_crc = RK::getCRC32(str_buf.c_str(), str_buf.size());
+    header.data_length = body->size();
+    header.data_crc = getChecksum(checksumOf(version), body->c_str(), body->size());
 
     writeIntBinary(header.data_length, *out);
     writeIntBinary(header.data_crc, *out);
 
-    out->write(str_buf.c_str(), header.data_length);
-    out->next();
+    out->write(body->c_str(), header.data_length);
 
     return {SnapshotBatchHeader::HEADER_SIZE + header.data_length, header.data_crc};
 }
 
-UInt32 updateCheckSum(UInt32 checksum, UInt32 data_crc)
+std::pair<size_t, UInt32>
+saveBatch(std::shared_ptr<WriteBufferFromFile> & out, ptr<SnapshotBatchPB> & batch, SnapshotVersion version, int compression_level = 0)
+{
+    if (!batch)
+        batch = cs_new<SnapshotBatchPB>();
+
+    std::string data;
+    if (version >= SnapshotVersion::V4 && version != SnapshotVersion::None)
+        data.push_back(static_cast<char>(SnapshotBatchLayout::Protobuf));
+    batch->AppendToString(&data);
+    return saveBatchData(out, data, version, compression_level);
+}
+
+UInt32 updateCheckSum(UInt32 checksum, UInt32 data_crc, SnapshotVersion version)
 {
     union
     {
@@ -142,16 +453,20 @@ UInt32 updateCheckSum(UInt32 checksum, UInt32 data_crc)
     };
     crc[0] = checksum;
     crc[1] = data_crc;
-    return RK::getCRC32(reinterpret_cast<const char *>(&data), 8);
+    return getChecksum(checksumOf(version), reinterpret_cast<const char *>(&data), 8);
 }
 
-std::pair<size_t, UInt32>
-saveBatchAndUpdateCheckSum(std::shared_ptr<WriteBufferFromFile> & out, ptr<SnapshotBatchPB> & batch, UInt32 checksum)
+std::pair<size_t, UInt32> saveBatchAndUpdateCheckSum(
+    std::shared_ptr<WriteBufferFromFile> & out,
+    ptr<SnapshotBatchPB> & batch,
+    UInt32 checksum,
+    SnapshotVersion version,
+    int compression_level = 0)
 {
-    auto [save_size, data_crc] = saveBatch(out, batch);
+    auto [save_size, data_crc] = saveBatch(out, batch, version, compression_level);
     /// rebuild batch
     batch = cs_new<SnapshotBatchPB>();
-    return {save_size, updateCheckSum(checksum, data_crc)};
+    return {save_size, updateCheckSum(checksum, data_crc, version)};
 }
 
 //static String toString(const Coordination::ACLs & acls)
@@ -197,7 +512,7 @@ void serializeAcls(ACLMap & acls, String path, UInt32 save_batch_size, SnapshotV
             if (index != 0)
             {
                 /// write data in batch to file
-                auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
+                auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
                 checksum = new_checksum;
             }
             batch = cs_new<SnapshotBatchPB>();
@@ -218,30 +533,29 @@ void serializeAcls(ACLMap & acls, String path, UInt32 save_batch_size, SnapshotV
     }
 
     /// flush the last acl batch
-    auto [_, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
+    auto [_, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
     checksum = new_checksum;
 
     writeTailAndClose(out, checksum);
 }
 
-[[maybe_unused]] size_t serializeEphemerals(KeeperStore::Ephemerals & ephemerals, std::mutex & mutex, String path, UInt32 save_batch_size)
+[[maybe_unused]] size_t serializeEphemerals(const KeeperStore::Ephemerals & ephemerals, String path, UInt32 save_batch_size)
 {
     Poco::Logger * log = &(Poco::Logger::get("KeeperSnapshotStore"));
     LOG_INFO(log, "Begin create snapshot ephemeral object, node size {}, path {}", ephemerals.size(), path);
 
     ptr<SnapshotBatchPB> batch;
 
-    std::lock_guard lock(mutex);
-
     if (ephemerals.empty())
     {
         LOG_INFO(log, "Create snapshot ephemeral nodes size is 0");
         return 0;
     }
 
+    /// Written without a file header, so it is parsed as V0
     auto out = cs_new<WriteBufferFromFile>(path);
     uint64_t index = 0;
-    for (auto & ephemeral_it : ephemerals)
+    for (const auto & ephemeral_it : ephemerals)
     {
         /// flush and rebuild batch
         if (index % save_batch_size == 0)
@@ -250,7 +564,7 @@ void serializeAcls(ACLMap & acls, String path, UInt32 save_batch_size, SnapshotV
             if (index != 0)
             {
                 /// write data in batch to file
-                saveBatch(out, batch);
+                saveBatch(out, batch, SnapshotVersion::V0);
             }
             batch = cs_new<SnapshotBatchPB>();
             batch->set_batch_type(SnapshotTypePB::SNAPSHOT_TYPE_DATA_EPHEMERAL);
@@ -275,7 +589,7 @@ void serializeAcls(ACLMap & acls, String path, UInt32 save_batch_size, SnapshotV
     }
 
     /// flush the last batch
-    saveBatch(out, batch);
+    saveBatch(out, batch, SnapshotVersion::V0);
     out->close();
     return 1;
 }
@@ -289,18 +603,19 @@ int64_t serializeSessions(KeeperStore & store, UInt32 save_batch_size, const Sna
     auto out = openFileAndWriteHeader(path, version);
 
 
-    LOG_INFO(log, "Begin create snapshot session object, session size {}, path {}", store.session_and_timeout.size(), path);
+    LOG_INFO(log, "Begin create snapshot session object, session size {}, path {}", store.session_table.size(), path);
 
     std::lock_guard lock(store.session_mutex);
     std::lock_guard acl_lock(store.auth_mutex);
 
     int64_t next_session_id = store.session_id_counter;
+    auto session_and_timeout = store.session_table.getSessionAndTimeout();
     ptr<SnapshotBatchPB> batch;
 
     uint64_t index = 0;
     UInt32 checksum = 0;
 
-    for (auto & session_it : store.session_and_timeout)
+    for (auto & session_it : session_and_timeout)
     {
         /// flush and rebuild batch
         if (index % save_batch_size == 0)
@@ -309,7 +624,7 @@ int64_t serializeSessions(KeeperStore & store, UInt32 save_batch_size, const Sna
             if (index != 0)
             {
                 /// write data in batch to file
-                auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
+                auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
                 checksum = new_checksum;
             }
             batch = cs_new<SnapshotBatchPB>();
@@ -335,8 +650,47 @@ int64_t serializeSessions(KeeperStore & store, UInt32 save_batch_size, const Sna
     }
 
     /// flush the last batch
-    auto [_, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
+    auto [_, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
     checksum = new_checksum;
+
+    /// Cached responses of the sessions follow them, in the order of every session
+    auto idempotency_entries = store.idempotency_cache.getSnapshotEntries();
+    for (size_t i = 0; i < idempotency_entries.size(); ++i)
+    {
+        if (i % save_batch_size == 0)
+        {
+            if (i != 0)
+            {
+                auto [save_size, batch_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
+                checksum = batch_checksum;
+            }
+            batch = cs_new<SnapshotBatchPB>();
+            batch->set_batch_type(SnapshotTypePB::SNAPSHOT_TYPE_IDEMPOTENCY);
+        }
+
+        const auto & [session_id, cached] = idempotency_entries[i];
+        SnapshotItemPB * entry = batch->add_data();
+        WriteBufferFromNuraftBuffer buf;
+        Coordination::write(session_id, buf);
+        Coordination::write(cached.xid, buf);
+        Coordination::write(cached.request_digest, buf);
+        Coordination::write(cached.zxid, buf);
+        Coordination::write(cached.error, buf);
+        Coordination::write(cached.body != nullptr, buf);
+        if (cached.body)
+            Coordination::write(*cached.body, buf);
+
+        ptr<buffer> data = buf.getBuffer();
+        data->pos(0);
+        entry->set_data(std::string(reinterpret_cast<char *>(data->data_begin()), data->size()));
+    }
+    if (!idempotency_entries.empty())
+    {
+        auto [save_size, batch_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
+        checksum = batch_checksum;
+    }
+    LOG_INFO(log, "Saved {} cached responses of sessions", idempotency_entries.size());
+
     writeTailAndClose(out, checksum);
 
     return next_session_id;
@@ -365,7 +719,7 @@ void serializeMap(T & snap_map, UInt32 save_batch_size, SnapshotVersion version,
             if (index != 0)
             {
                 /// write data in batch to file
-                auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
+                auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
                 checksum = new_checksum;
             }
 
@@ -392,7 +746,7 @@ void serializeMap(T & snap_map, UInt32 save_batch_size, SnapshotVersion version,
     }
 
     /// flush the last batch
-    auto [_, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
+    auto [_, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum, version);
     checksum = new_checksum;
     writeTailAndClose(out, checksum);
 }
@@ -418,100 +772,252 @@ size_t KeeperSnapshotStore::getObjectIdx(const std::string & file_name)
     return std::stoi(file_name.substr(it1 + 1, file_name.size() - it1));
 }
 
-size_t KeeperSnapshotStore::serializeDataTree(KeeperStore & storage)
+size_t KeeperSnapshotStore::serializeDataTree(KeeperStore & storage, size_t first_object_id)
 {
-    std::shared_ptr<WriteBufferFromFile> out;
-    ptr<SnapshotBatchPB> batch;
+    /// Subtrees not taken by any thread yet. A thread traverses the subtree it takes in deep first order,
+    /// and hands the bottom half of its pending nodes back when another thread is idle, so that one
+    /// large subtree is serialized by all threads.
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    std::deque<String> pending{"/"};
+    const size_t threads = SNAPSHOT_THREAD_NUM;
+    std::atomic<size_t> idle_threads{0};
+    bool failed = false;
+
+    std::atomic<size_t> next_object_id{first_object_id};
+    std::atomic<uint64_t> processed{0};
+
+    /// Nodes saved by a delta snapshot, the whole tree is still traversed in memory
+    auto changed = [this](const String & path, const KeeperNode & node)
+    {
+        int64_t base_zxid = delta_changes.base_zxid;
+        return node.stat.czxid >= base_zxid || node.stat.mzxid >= base_zxid || node.stat.pzxid >= base_zxid
+            || delta_changes.dirty_paths.contains(path);
+    };
 
-    uint64_t processed = 0;
-    uint32_t checksum = 0;
+    auto serialize_subtrees = [&]
+    {
+        LowIOPriorityScope io_priority(io_settings.low_io_priority);
+        DataObjectWriter writer;
+        std::vector<String> stack;
+        uint64_t thread_processed = 0;
+        try
+        {
+            while (true)
+            {
+                {
+                    std::unique_lock lock(pending_mutex);
+                    if (++idle_threads == threads)
+                        pending_cv.notify_all();
+                    pending_cv.wait(lock, [&] { return failed || !pending.empty() || idle_threads == threads; });
+                    /// All threads are idle and nothing is pending, the whole tree is serialized
+                    if (failed || pending.empty())
+                        break;
+                    --idle_threads;
+                    stack.push_back(std::move(pending.front()));
+                    pending.pop_front();
+                }
 
-    serializeNode(out, batch, storage, "/", processed, checksum);
-    auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
-    checksum = new_checksum;
+                while (!stack.empty())
+                {
+                    String path = std::move(stack.back());
+                    stack.pop_back();
 
-    writeTailAndClose(out, checksum);
-    LOG_INFO(log, "Creating snapshot processed data size {}, current zxid {}", processed, storage.zxid);
+                    /// Version at the pinned point, never changed by the apply thread
+                    auto node = storage.getSnapshotNode(path);
+                    /// In case of node is deleted
+                    if (!node)
+                        continue;
 
-    return getObjectIdx(out->getFileName());
-}
+                    if (!delta_base || changed(path, *node))
+                    {
+                        appendNodeToObject(writer, next_object_id, path, node);
+                        thread_processed++;
+                    }
 
-void KeeperSnapshotStore::serializeNode(
-    ptr<WriteBufferFromFile> & out,
-    ptr<SnapshotBatchPB> & batch,
-    KeeperStore & store,
-    const String & path,
-    uint64_t & processed,
-    uint32_t & checksum)
-{
-    auto node = store.container.get(path);
+                    String path_with_slash = path;
+                    if (path != "/")
+                        path_with_slash += '/';
+                    node->children.forEach([&](const String & child) { stack.push_back(path_with_slash + child); });
 
-    /// In case of node is deleted
-    if (!node)
-        return;
+                    if (stack.size() >= SPLIT_PENDING_NODES && idle_threads.load(std::memory_order_relaxed))
+                    {
+                        std::lock_guard lock(pending_mutex);
+                        if (idle_threads && pending.empty())
+                        {
+                            size_t half = stack.size() / 2;
+                            std::move(stack.begin(), stack.begin() + half, std::back_inserter(pending));
+                            stack.erase(stack.begin(), stack.begin() + half);
+                            pending_cv.notify_all();
+                        }
+                    }
+                }
+            }
+            closeObject(writer);
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard lock(pending_mutex);
+                failed = true;
+            }
+            pending_cv.notify_all();
+            throw;
+        }
+        processed += thread_processed;
+    };
 
-    std::shared_ptr<KeeperNode> node_copy;
+    ThreadPool serialize_thread_pool(SNAPSHOT_THREAD_NUM);
+    try
     {
-        std::shared_lock lock(node->mutex);
-        node_copy = node->clone();
+        for (size_t thread_idx = 0; thread_idx < threads; thread_idx++)
+            serialize_thread_pool.scheduleOrThrowOnError(serialize_subtrees);
     }
-
-    if (processed % max_object_node_size == 0)
+    catch (...)
     {
-        /// time to create new snapshot object
-        uint64_t obj_id = processed / max_object_node_size;
-
-        if (obj_id != 0)
+        /// Threads already scheduled wait for all threads to be idle
         {
-            /// flush last batch data
-            auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
-            checksum = new_checksum;
-
-            /// close current object file
-            writeTailAndClose(out, checksum);
-            /// reset checksum
-            checksum = 0;
+            std::lock_guard lock(pending_mutex);
+            failed = true;
         }
-        String new_obj_path;
-        /// for there are 4 objects before data ojects
-        getObjectPath(obj_id + 4, new_obj_path);
+        pending_cv.notify_all();
+        serialize_thread_pool.wait();
+        throw;
+    }
+    serialize_thread_pool.wait();
 
-        LOG_INFO(log, "Create new snapshot object {}, path {}", obj_id + 4, new_obj_path);
-        out = openFileAndWriteHeader(new_obj_path, version);
+    LOG_INFO(log, "Creating snapshot processed data size {}, current zxid {}", processed.load(), storage.zxid);
+
+    /// Always save one data object, even if the tree is empty
+    if (next_object_id == first_object_id)
+    {
+        DataObjectWriter writer;
+        String obj_path;
+        getObjectPath(next_object_id++, obj_path);
+        writer.out = openDataObjectAndWriteHeader(obj_path, version, write_throttler, io_settings);
+        writer.batch = cs_new<SnapshotBatchPB>();
+        writer.flat_batch.assign(1, static_cast<char>(SnapshotBatchLayout::FlatNodes));
+        closeObject(writer);
     }
 
-    /// flush and rebuild batch
-    if (processed % save_batch_size == 0)
+    return next_object_id - 1;
+}
+
+void KeeperSnapshotStore::appendNodeToObject(
+    DataObjectWriter & writer, std::atomic<size_t> & next_object_id, const String & path, std::shared_ptr<const KeeperNode> node)
+{
+    size_t node_bytes = nodeBytes(path, *node);
+    if (writer.out
+        && (writer.object_nodes == max_object_node_size || (max_object_bytes && writer.object_bytes + node_bytes > max_object_bytes)))
+        closeObject(writer);
+
+    if (!writer.out)
     {
-        /// skip flush the first batch
-        if (processed != 0)
-        {
-            /// flush data in batch to file
-            auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(out, batch, checksum);
-            checksum = new_checksum;
-        }
-        else
-        {
-            if (!batch)
-                batch = cs_new<SnapshotBatchPB>();
-        }
+        /// time to create new snapshot object
+        size_t obj_id = next_object_id++;
+        String new_obj_path;
+        getObjectPath(obj_id, new_obj_path);
+
+        LOG_INFO(log, "Create new snapshot object {}, path {}", obj_id, new_obj_path);
+        writer.out = openDataObjectAndWriteHeader(new_obj_path, version, write_throttler, io_settings);
+        writer.batch = cs_new<SnapshotBatchPB>();
+        writer.flat_batch.assign(1, static_cast<char>(SnapshotBatchLayout::FlatNodes));
+        writer.object_nodes = 0;
+        writer.object_bytes = 0;
+        writer.batch_nodes = 0;
+        writer.batch_bytes = 0;
+        writer.checksum = 0;
+    }
+    else if (writer.batch_nodes == save_batch_size || (save_batch_bytes && writer.batch_bytes + node_bytes > save_batch_bytes))
+    {
+        /// flush data in batch to file
+        flushBatch(writer);
     }
 
     LOG_TRACE(log, "Append node path {}", path);
-    appendNodeToBatch(batch, path, node_copy);
-    processed++;
+    if (version >= SnapshotVersion::V4)
+        appendFlatNode(writer.flat_batch, path, *node);
+    else
+        appendNodeToBatch(writer.batch, path, node);
+    writer.object_nodes++;
+    writer.object_bytes += node_bytes;
+    writer.batch_nodes++;
+    writer.batch_bytes += node_bytes;
+}
 
-    String path_with_slash = path;
-    if (path != "/")
-        path_with_slash += '/';
+size_t KeeperSnapshotStore::nodeBytes(const String & path, const KeeperNode & node)
+{
+    /// sizes of path and data, acl_id, flags and stat
+    return path.size() + node.data.size() + 18 + sizeof(Coordination::Stat);
+}
 
-    for (const auto & child : node->children)
-        serializeNode(out, batch, store, path_with_slash + child, processed, checksum);
+void KeeperSnapshotStore::flushBatch(DataObjectWriter & writer)
+{
+    if (version >= SnapshotVersion::V4)
+    {
+        auto [save_size, data_crc] = saveBatchData(writer.out, writer.flat_batch, version, compression_level);
+        writer.checksum = updateCheckSum(writer.checksum, data_crc, version);
+        writer.flat_batch.assign(1, static_cast<char>(SnapshotBatchLayout::FlatNodes));
+    }
+    else
+    {
+        auto [save_size, new_checksum] = saveBatchAndUpdateCheckSum(writer.out, writer.batch, writer.checksum, version, compression_level);
+        writer.checksum = new_checksum;
+    }
+    writer.batch_nodes = 0;
+    writer.batch_bytes = 0;
+}
+
+void KeeperSnapshotStore::closeObject(DataObjectWriter & writer)
+{
+    if (!writer.out)
+        return;
 
+    /// flush last batch data
+    flushBatch(writer);
+
+    writeTailAndClose(writer.out, writer.checksum);
+    writer.out.reset();
+    writer.batch.reset();
+    writer.flat_batch.clear();
+}
+
+namespace
+{
+    template <typename T>
+    void appendFlat(String & batch, const T & value)
+    {
+        batch.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+}
+
+void KeeperSnapshotStore::appendFlatNode(String & batch, const String & path, const KeeperNode & node)
+{
+    appendFlat(batch, static_cast<UInt32>(path.size()));
+    batch.append(path);
+    appendFlat(batch, static_cast<UInt32>(node.data.size()));
+    String buf;
+    batch.append(node.data.get(buf));
+    appendFlat(batch, static_cast<UInt64>(node.acl_id));
+    appendFlat(batch, static_cast<UInt8>(node.is_ephemeral));
+    appendFlat(batch, static_cast<UInt8>(node.is_sequental));
+
+    const auto & stat = node.stat;
+    appendFlat(batch, stat.czxid);
+    appendFlat(batch, stat.mzxid);
+    appendFlat(batch, stat.ctime);
+    appendFlat(batch, stat.mtime);
+    appendFlat(batch, stat.version);
+    appendFlat(batch, stat.cversion);
+    appendFlat(batch, stat.aversion);
+    appendFlat(batch, stat.ephemeralOwner);
+    appendFlat(batch, stat.dataLength);
+    appendFlat(batch, stat.numChildren);
+    appendFlat(batch, stat.pzxid);
 }
 
 void KeeperSnapshotStore::appendNodeToBatch(
-    ptr<SnapshotBatchPB> batch, const String & path, std::shared_ptr<KeeperNode> node)
+    ptr<SnapshotBatchPB> batch, const String & path, std::shared_ptr<const KeeperNode> node)
 {
 #ifdef RAFT_SERVICE_TEST
     std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -519,7 +1025,8 @@ void KeeperSnapshotStore::appendNodeToBatch(
     SnapshotItemPB * entry = batch->add_data();
     WriteBufferFromNuraftBuffer buf;
     Coordination::write(path, buf);
-    Coordination::write(node->data, buf);
+    String data;
+    Coordination::write(node->data.get(data), buf);
     Coordination::write(node->acl_id, buf);
     Coordination::write(node->is_ephemeral, buf);
     Coordination::write(node->is_sequental, buf);
@@ -551,6 +1058,10 @@ size_t KeeperSnapshotStore::createObjects(KeeperStore & store, int64_t next_zxid
     //uint map、Sessions、acls、Normal node objects
     size_t total_obj_count = data_object_count + 3;
 
+    LowIOPriorityScope io_priority(io_settings.low_io_priority);
+    write_throttler = io_settings.write_bytes_per_second ? std::make_shared<Throttler>(io_settings.write_bytes_per_second) : nullptr;
+    delta_base_loaded = true;
+
     LOG_INFO(log, "Creating snapshot with approximately data_object_count {}, total_obj_count {}, next zxid {}, next session id {}",
              data_object_count, total_obj_count, next_zxid, next_session_id);
 
@@ -565,6 +1076,10 @@ size_t KeeperSnapshotStore::createObjects(KeeperStore & store, int64_t next_zxid
     int_map["ZXID"] = next_zxid;
     /// Next session id
     int_map["SESSIONID"] = next_session_id;
+    if (delta_base)
+        int_map["DELTA_BASE"] = *delta_base;
+    /// Digest of the data tree, checked when loaded
+    int_map["DIGEST"] = static_cast<int64_t>(store.getSnapshotDigest());
 
     String map_path;
     getObjectPath(1, map_path);
@@ -586,8 +1101,15 @@ size_t KeeperSnapshotStore::createObjects(KeeperStore & store, int64_t next_zxid
     getObjectPath(3, acl_path);
     serializeAcls(store.acl_map, acl_path, save_batch_size, version);
 
-    /// 4. Save data tree
-    size_t last_id = serializeDataTree(store);
+    /// 4. Save data tree, after the removed paths of a delta snapshot
+    size_t first_data_object = 4;
+    if (delta_base)
+    {
+        String deleted_path;
+        getObjectPath(first_data_object++, deleted_path);
+        serializeDeletedPaths(store, deleted_path);
+    }
+    size_t last_id = serializeDataTree(store, first_data_object);
 
     total_obj_count = last_id;
     LOG_INFO(log, "Creating snapshot real data_object_count {}, total_obj_count {}", total_obj_count - 3, total_obj_count);
@@ -603,6 +1125,95 @@ size_t KeeperSnapshotStore::createObjects(KeeperStore & store, int64_t next_zxid
     return total_obj_count;
 }
 
+void KeeperSnapshotStore::serializeDeletedPaths(KeeperStore & store, const String & obj_path)
+{
+    auto out = openDataObjectAndWriteHeader(obj_path, version, write_throttler, io_settings);
+    UInt32 checksum = 0;
+    String batch(1, static_cast<char>(SnapshotBatchLayout::DeletedPaths));
+    auto flush_batch = [&]
+    {
+        auto [save_size, data_crc] = saveBatchData(out, batch, version, compression_level);
+        checksum = updateCheckSum(checksum, data_crc, version);
+        batch.assign(1, static_cast<char>(SnapshotBatchLayout::DeletedPaths));
+    };
+
+    size_t deleted = 0;
+    for (const auto & path : delta_changes.dirty_paths)
+    {
+        /// Dirty paths still existing are saved as changed nodes
+        if (store.getSnapshotNode(path))
+            continue;
+        if (save_batch_bytes && batch.size() > 1 && batch.size() + sizeof(UInt32) + path.size() > save_batch_bytes)
+            flush_batch();
+        appendFlat(batch, static_cast<UInt32>(path.size()));
+        batch.append(path);
+        ++deleted;
+    }
+    flush_batch();
+    writeTailAndClose(out, checksum);
+    LOG_INFO(log, "Creating delta snapshot of base {}, removed paths {}", *delta_base, deleted);
+}
+
+void KeeperSnapshotStore::setDeltaBase(UInt64 base_log_index, SnapshotDeltaChanges changes)
+{
+    delta_base = base_log_index;
+    delta_base_loaded = true;
+    delta_changes = std::move(changes);
+    version = SnapshotVersion::V4;
+}
+
+std::optional<UInt64> KeeperSnapshotStore::getDeltaBase()
+{
+    if (!delta_base_loaded)
+    {
+        auto it = objects_path.find(1);
+        if (it != objects_path.end())
+        {
+            /// Only the int map is loaded into the store
+            KeeperStore int_map_store(RaftSettings::getDefault()->dead_session_check_period_ms);
+            LoadedPaths loaded_paths(1);
+            parseOneObject(it->second, int_map_store, loaded_paths);
+        }
+        delta_base_loaded = true;
+    }
+    return delta_base;
+}
+
+void KeeperSnapshotStore::removeObjects(const KeeperSnapshotStore * replaced_by)
+{
+    for (const auto & [obj_id, obj_path] : objects_path)
+    {
+        if (replaced_by)
+        {
+            auto it = replaced_by->objects_path.find(obj_id);
+            if (it != replaced_by->objects_path.end() && it->second == obj_path)
+                continue;
+        }
+        Poco::File file(obj_path);
+        if (file.exists())
+            file.remove();
+    }
+}
+
+void KeeperSnapshotStore::removeDeletedNodes(KeeperStore & store)
+{
+    for (const auto & path : deleted_paths)
+    {
+        auto node = store.container.get(path);
+        if (!node)
+            continue;
+
+        if (auto parent = store.container.get(parentPath(path)))
+            parent->children.erase(getBaseName(path));
+        if (node->is_ephemeral)
+            store.ephemerals.remove(node->stat.ephemeralOwner, path);
+        replaced_acls.push_back(node->acl_id);
+        store.container.erase(path);
+    }
+    LOG_INFO(log, "Load delta snapshot, removed {} nodes", deleted_paths.size());
+    std::vector<String>().swap(deleted_paths);
+}
+
 void KeeperSnapshotStore::init(std::string create_time = "")
 {
     if (create_time.empty())
@@ -616,69 +1227,176 @@ void KeeperSnapshotStore::init(std::string create_time = "")
     curr_time_t = BackendTimer::parseTime(curr_time);
 }
 
-bool KeeperSnapshotStore::loadHeader(ptr<std::fstream> fs, SnapshotBatchHeader & head)
+void KeeperSnapshotStore::parseFlatNodes(
+    const char * data, size_t size, KeeperStore & store, LoadedPaths & loaded_paths, const String & obj_path)
 {
-    head.reset();
-    errno = 0;
-    if (readUInt32(fs, head.data_length) != 0)
+    size_t pos = 0;
+    auto read = [&](void * to, size_t n)
+    {
+        if (pos + n > size)
+            throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} flat batch is truncated at {}", obj_path, pos);
+        memcpy(to, data + pos, n);
+        pos += n;
+    };
+    auto read_string = [&](String & to)
+    {
+        UInt32 string_size;
+        read(&string_size, sizeof(UInt32));
+        if (pos + string_size > size)
+            throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} flat batch is truncated at {}", obj_path, pos);
+        to.assign(data + pos, string_size);
+        pos += string_size;
+    };
+
+    size_t nodes = 0;
+    while (pos < size)
     {
-        if (!fs->eof())
+        ptr<KeeperNode> node = KeeperNode::create();
+        String key;
+        read_string(key);
+        String data;
+        read_string(data);
+        node->data = std::move(data);
+
+        UInt64 acl_id;
+        read(&acl_id, sizeof(UInt64));
+        node->acl_id = acl_id;
+        UInt8 flag;
+        read(&flag, sizeof(UInt8));
+        node->is_ephemeral = flag;
+        read(&flag, sizeof(UInt8));
+        node->is_sequental = flag;
+
+        auto & stat = node->stat;
+        read(&stat.czxid, sizeof(stat.czxid));
+        read(&stat.mzxid, sizeof(stat.mzxid));
+        read(&stat.ctime, sizeof(stat.ctime));
+        read(&stat.mtime, sizeof(stat.mtime));
+        read(&stat.version, sizeof(stat.version));
+        read(&stat.cversion, sizeof(stat.cversion));
+        read(&stat.aversion, sizeof(stat.aversion));
+        read(&stat.ephemeralOwner, sizeof(stat.ephemeralOwner));
+        read(&stat.dataLength, sizeof(stat.dataLength));
+        read(&stat.numChildren, sizeof(stat.numChildren));
+        read(&stat.pzxid, sizeof(stat.pzxid));
+
+        /// Some strange ACLID during deserialization from ZooKeeper
+        if (node->acl_id == std::numeric_limits<uint64_t>::max())
+            node->acl_id = 0;
+        store.acl_map.addUsage(node->acl_id);
+
+        /// A delta snapshot replaces the node loaded from its base, children are linked to the new node
+        if (delta_base)
         {
-            LOG_ERROR(log, "Cant read header data_length from snapshot file, error:{}.", strerror(errno));
+            if (auto loaded = store.container.get(key))
+            {
+                node->children = std::move(loaded->children);
+                {
+                    std::lock_guard lock(replaced_acls_mutex);
+                    replaced_acls.push_back(loaded->acl_id);
+                }
+                if (loaded->is_ephemeral)
+                    store.ephemerals.remove(loaded->stat.ephemeralOwner, key);
+            }
         }
-        return false;
-    }
 
-    if (readUInt32(fs, head.data_crc) != 0)
-    {
-        if (!fs->eof())
+        /// TTL and container nodes have an ephemeralOwner too
+        auto ephemeral_owner = node->is_ephemeral ? stat.ephemeralOwner : 0;
+        LOG_TRACE(log, "Load snapshot read key {}, node stat {}", key, stat.toString());
+        store.container.emplace(key, std::move(node));
+
+        if (ephemeral_owner != 0)
         {
-            LOG_ERROR(log, "Cant read header data_crc from snapshot file, error:{}.", strerror(errno));
+            LOG_INFO(log, "Load snapshot find ephemeral node {} - {}", ephemeral_owner, key);
+            store.ephemerals.add(ephemeral_owner, key);
         }
-        return false;
+
+        auto & shard_paths = loaded_paths[KeeperStore::parentShardOf(key, loaded_paths.size())];
+        shard_paths.push_back(std::move(key));
+        ++nodes;
     }
-    //LOG_INFO(log, "Offset {}, header data length {}, data crc {}", offset, head->data_length, head->data_crc);
-    return true;
+    LOG_INFO(log, "Load flat batch size {}", nodes);
 }
 
-bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & store)
+bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & store, LoadedPaths & loaded_paths)
 {
-    ptr<std::fstream> snap_fs = cs_new<std::fstream>();
-    snap_fs->open(obj_path, std::ios::in | std::ios::binary);
-    if (snap_fs->fail())
+    int snap_fd = ::open(obj_path.c_str(), O_RDONLY);
+    if (snap_fd < 0)
     {
         LOG_ERROR(log, "Open snapshot object {} for read failed, error:{}", obj_path, strerror(errno));
         return false;
     }
-    snap_fs->seekg(0, snap_fs->end);
-    size_t file_size = snap_fs->tellg();
-    snap_fs->seekg(0, snap_fs->beg);
+    struct stat file_stat;
+    if (::fstat(snap_fd, &file_stat) != 0)
+    {
+        LOG_ERROR(log, "Stat snapshot object {} failed, error:{}", obj_path, strerror(errno));
+        ::close(snap_fd);
+        return false;
+    }
+    size_t file_size = file_stat.st_size;
 
     LOG_INFO(log, "Open snapshot object {} for read,file size {}", obj_path, file_size);
+    if (file_size == 0)
+    {
+        ::close(snap_fd);
+        return true;
+    }
+
+    /// Batches are decoded straight from the mapping, which is read ahead as objects are read sequentially
+    void * mapped = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, snap_fd, 0);
+    ::close(snap_fd);
+    if (mapped == MAP_FAILED)
+    {
+        LOG_ERROR(log, "Map snapshot object {} failed, error:{}", obj_path, strerror(errno));
+        return false;
+    }
+    ::madvise(mapped, file_size, MADV_SEQUENTIAL);
+    SCOPE_EXIT({ ::munmap(mapped, file_size); });
+    const char * file_data = static_cast<const char *>(mapped);
 
     size_t read_size = 0;
+    auto read = [&](void * to, size_t n)
+    {
+        if (read_size + n > file_size)
+            return false;
+        memcpy(to, file_data + read_size, n);
+        read_size += n;
+        return true;
+    };
+
+    /// With io_depth the window of the mapping after the batch being decoded is read from disk in the meantime, it is
+    /// advanced by blocks once half of it is decoded
+    const size_t readahead_bytes = io_settings.io_depth * WRITE_BUFFER_SIZE;
+    size_t readahead_end = 0;
+    auto read_ahead = [&]
+    {
+        if (!readahead_bytes || readahead_end == file_size || read_size + readahead_bytes / 2 < readahead_end)
+            return;
+        size_t end = std::min(file_size, (read_size + readahead_bytes) / WRITE_BUFFER_SIZE * WRITE_BUFFER_SIZE + WRITE_BUFFER_SIZE);
+        ::madvise(static_cast<char *>(mapped) + readahead_end, end - readahead_end, MADV_WILLNEED);
+        readahead_end = end;
+    };
+
     SnapshotBatchHeader header;
     UInt32 checksum = 0;
     SnapshotVersion version_ = SnapshotVersion::None;
-    while (!snap_fs->eof())
+    while (read_size < file_size)
     {
+        read_ahead();
         size_t cur_read_size = read_size;
-        UInt64 magic;
-        readUInt64(snap_fs, magic);
-        read_size += 8;
+        UInt64 magic = 0;
+        read(&magic, sizeof(UInt64));
         if (isFileHeader(magic))
         {
-            char * buf = reinterpret_cast<char *>(&version_);
-            snap_fs->read(buf, sizeof(uint8_t));
-            read_size += 1;
+            if (!read(&version_, sizeof(uint8_t)))
+                throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} load header error", obj_path);
             LOG_INFO(log, "obj_path {}, read file header, version {}", obj_path, uint8_t(version_));
         }
         else if (isFileTail(magic))
         {
             UInt32 file_checksum;
-            char * buf = reinterpret_cast<char *>(&file_checksum);
-            snap_fs->read(buf, sizeof(UInt32));
-            read_size += 4;
+            if (!read(&file_checksum, sizeof(UInt32)))
+                throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} load tail error", obj_path);
             LOG_INFO(log, "obj_path {}, file_checksum {}, checksum {}.", obj_path, file_checksum, checksum);
             if (file_checksum != checksum)
                 throw Exception(ErrorCodes::CHECKSUM_DOESNT_MATCH, "snapshot {} checksum doesn't match", obj_path);
@@ -693,33 +1411,101 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
             }
 
             LOG_INFO(log, "obj_path {}, didn't read the header and tail of the file", obj_path);
-            snap_fs->seekg(cur_read_size);
             read_size = cur_read_size;
         }
-        if (!loadHeader(snap_fs, header))
+
+        header.reset();
+        if (!read(&header.data_length, sizeof(UInt32)) || !read(&header.data_crc, sizeof(UInt32)))
         {
             throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} load header error", obj_path);
         }
 
-        checksum = updateCheckSum(checksum, header.data_crc);
-        char * body_buf = new char[header.data_length];
-        read_size += (SnapshotBatchHeader::HEADER_SIZE + header.data_length);
-
-        if (!snap_fs->read(body_buf, header.data_length))
+        checksum = updateCheckSum(checksum, header.data_crc, version_);
+        if (read_size + header.data_length > file_size)
         {
-            LOG_ERROR(log, "Cant read snapshot object file {} size {}, only {} could be read", obj_path, header.data_length, snap_fs->gcount());
-            delete[] body_buf;
+            LOG_ERROR(
+                log, "Cant read snapshot object file {} size {}, only {} could be read", obj_path, header.data_length, file_size - read_size);
             return false;
         }
+        const char * body_buf = file_data + read_size;
+        read_size += header.data_length;
 
-        if (!verifyCRC32(body_buf, header.data_length, header.data_crc))
+        if (!verifyChecksum(checksumOf(version_), body_buf, header.data_length, header.data_crc))
         {
             LOG_ERROR(log, "Found corrupted data, file {}", obj_path);
-            delete[] body_buf;
             return false;
         }
+
+        /// Batch data after the codec, decompressed if needed
+        const char * batch_data = body_buf;
+        size_t batch_size = header.data_length;
+        std::string raw;
+        if (version_ >= SnapshotVersion::V3)
+        {
+            if (batch_size < 1)
+                throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} batch without codec", obj_path);
+
+            auto codec = static_cast<SnapshotCodec>(body_buf[0]);
+            size_t prefix = 1 + sizeof(UInt32);
+            if (codec == SnapshotCodec::None)
+            {
+                batch_data = body_buf + 1;
+                batch_size = header.data_length - 1;
+            }
+            else if (codec == SnapshotCodec::Zlib && header.data_length >= prefix)
+            {
+                UInt32 raw_size;
+                memcpy(&raw_size, body_buf + 1, sizeof(UInt32));
+                raw.resize(raw_size);
+                if (!LogEntry::decompress(body_buf + prefix, header.data_length - prefix, raw.data(), raw_size))
+                    throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} batch can not be decompressed", obj_path);
+                batch_data = raw.data();
+                batch_size = raw.size();
+            }
+            else
+            {
+                throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} batch with unknown codec {}", obj_path, UInt32(codec));
+            }
+        }
+
+        if (version_ >= SnapshotVersion::V4)
+        {
+            if (batch_size < 1)
+                throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} batch without layout", obj_path);
+
+            auto layout = static_cast<SnapshotBatchLayout>(batch_data[0]);
+            batch_data++;
+            batch_size--;
+            if (layout == SnapshotBatchLayout::FlatNodes)
+            {
+                parseFlatNodes(batch_data, batch_size, store, loaded_paths, obj_path);
+                continue;
+            }
+            else if (layout == SnapshotBatchLayout::DeletedPaths)
+            {
+                /// Only one object has them, so it is not shared by threads
+                for (size_t pos = 0; pos < batch_size;)
+                {
+                    UInt32 path_size;
+                    if (pos + sizeof(UInt32) > batch_size)
+                        throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} deleted paths are truncated", obj_path);
+                    memcpy(&path_size, batch_data + pos, sizeof(UInt32));
+                    pos += sizeof(UInt32);
+                    if (pos + path_size > batch_size)
+                        throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} deleted paths are truncated", obj_path);
+                    deleted_paths.emplace_back(batch_data + pos, path_size);
+                    pos += path_size;
+                }
+                continue;
+            }
+            else if (layout != SnapshotBatchLayout::Protobuf)
+            {
+                throw Exception(ErrorCodes::CORRUPTED_DATA, "snapshot {} batch with unknown layout {}", obj_path, UInt32(layout));
+            }
+        }
+
         SnapshotBatchPB batch_pb;
-        batch_pb.ParseFromString(std::string(body_buf, header.data_length));
+        batch_pb.ParseFromArray(batch_data, batch_size);
         switch (batch_pb.batch_type())
         {
             case SnapshotTypePB::SNAPSHOT_TYPE_DATA: {
@@ -733,12 +1519,14 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
                     buf->put(data);
                     buf->pos(0);
                     ReadBufferFromNuraftBuffer in(buf);
-                    ptr<KeeperNode> node = cs_new<KeeperNode>();
+                    ptr<KeeperNode> node = KeeperNode::create();
                     std::string key;
                     try
                     {
                         Coordination::read(key, in);
-                        Coordination::read(node->data, in);
+                        String data;
+                        Coordination::read(data, in);
+                        node->data = std::move(data);
                         if (version_ >= SnapshotVersion::V1)
                         {
                             Coordination::read(node->acl_id, in);
@@ -762,7 +1550,8 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
                         Coordination::read(node->is_ephemeral, in);
                         Coordination::read(node->is_sequental, in);
                         Coordination::read(node->stat, in);
-                        auto ephemeral_owner = node->stat.ephemeralOwner;
+                        /// TTL and container nodes have an ephemeralOwner too
+                        auto ephemeral_owner = node->is_ephemeral ? node->stat.ephemeralOwner : 0;
                         LOG_TRACE(log, "Load snapshot read key {}, node stat {}", key, node->stat.toString());
                         store.container.emplace(key, std::move(node));
 
@@ -770,10 +1559,11 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
                         {
                             /// TODO LOG_INFO -> LOG_TRACE
                             LOG_INFO(log, "Load snapshot find ephemeral node {} - {}", ephemeral_owner, key);
-                            std::lock_guard l(store.ephemerals_mutex);
-                            auto & ephemeral_nodes = store.ephemerals[ephemeral_owner];
-                            ephemeral_nodes.emplace(key);
+                            store.ephemerals.add(ephemeral_owner, key);
                         }
+
+                        auto & shard_paths = loaded_paths[KeeperStore::parentShardOf(key, loaded_paths.size())];
+                        shard_paths.push_back(std::move(key));
                     }
                     catch (Coordination::Exception & e)
                     {
@@ -817,6 +1607,7 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
                                 {
                                     std::lock_guard lock(store.auth_mutex);
                                     store.session_and_auth[session_id] = ids;
+                                    store.acl_permissions.erase(session_id);
                                 }
                             }
                         }
@@ -857,6 +1648,36 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
                         LOG_TRACE(log, "parseOneObject acl_id {}", acl_id);
                         store.acl_map.addMapping(acl_id, acls);
                     }
+                    /// Ids of the ACLs may have been remapped
+                    store.acl_permissions.clear();
+                }
+                break;
+            case SnapshotTypePB::SNAPSHOT_TYPE_IDEMPOTENCY:
+                for (int data_idx = 0; data_idx < batch_pb.data_size(); data_idx++)
+                {
+                    const SnapshotItemPB & item_pb = batch_pb.data(data_idx);
+                    const std::string & data = item_pb.data();
+                    ptr<buffer> buf = buffer::alloc(data.size() + 1);
+                    buf->put(data);
+                    buf->pos(0);
+                    ReadBufferFromNuraftBuffer in(buf);
+
+                    int64_t session_id;
+                    IdempotencyCache::Entry cached;
+                    bool has_body;
+                    Coordination::read(session_id, in);
+                    Coordination::read(cached.xid, in);
+                    Coordination::read(cached.request_digest, in);
+                    Coordination::read(cached.zxid, in);
+                    Coordination::read(cached.error, in);
+                    Coordination::read(has_body, in);
+                    if (has_body)
+                    {
+                        String body;
+                        Coordination::read(body, in);
+                        cached.body = std::make_shared<const String>(std::move(body));
+                    }
+                    store.idempotency_cache.load(session_id, std::move(cached));
                 }
                 break;
             case SnapshotTypePB::SNAPSHOT_TYPE_UINTMAP: {
@@ -896,62 +1717,112 @@ bool KeeperSnapshotStore::parseOneObject(std::string obj_path, KeeperStore & sto
                 {
                     store.session_id_counter = int_map["SESSIONID"];
                 }
+                if (int_map.find("DIGEST") != int_map.end())
+                {
+                    recorded_digest = static_cast<UInt64>(int_map["DIGEST"]);
+                }
+                /// Read by other threads once loaded
+                if (!delta_base_loaded && int_map.find("DELTA_BASE") != int_map.end())
+                {
+                    delta_base = int_map["DELTA_BASE"];
+                }
             }
             break;
             default:
                 break;
         }
-        delete[] body_buf;
     }
     return true;
 }
 
-void KeeperSnapshotStore::parseObject(KeeperStore & store)
+void KeeperSnapshotStore::parseObject(KeeperStore & store, bool data_only)
 {
+    /// Nodes of a delta snapshot replace the loaded ones by delta_base
+    getDeltaBase();
+
     SnapshotVersion current_version = static_cast<SnapshotVersion>(version);
     if (current_version > version)
         throw Exception(ErrorCodes::UNKNOWN_FORMAT_VERSION, "Unsupported snapshot version {}", version);
 
+    /// Paths loaded by every thread, by shard of their parents
+    std::vector<LoadedPaths> loaded_paths(SNAPSHOT_THREAD_NUM, LoadedPaths(SNAPSHOT_THREAD_NUM));
+
+    /// Objects from the biggest one, every thread takes the next object once it is done with its own,
+    /// so that threads finish at about the same time even if objects are not even.
+    std::vector<std::pair<UInt64, std::map<ulong, std::string>::const_iterator>> objects;
+    objects.reserve(objects_path.size());
+    for (auto it = objects_path.cbegin(); it != objects_path.cend(); ++it)
+    {
+        /// int map, sessions and ACLs are before data objects
+        if (!data_only || it->first >= 4)
+            objects.emplace_back(getObjectSize(it->first), it);
+    }
+    std::stable_sort(objects.begin(), objects.end(), [](const auto & l, const auto & r) { return l.first > r.first; });
+    std::atomic<size_t> next_object{0};
+
     ThreadPool object_thread_pool(SNAPSHOT_THREAD_NUM);
     for (UInt32 thread_idx = 0; thread_idx < SNAPSHOT_THREAD_NUM; thread_idx++)
     {
-        object_thread_pool.trySchedule([this, thread_idx, &store] {
+        object_thread_pool.trySchedule([this, thread_idx, &store, &loaded_paths, &objects, &next_object] {
             Poco::Logger * thread_log = &(Poco::Logger::get("KeeperSnapshotStore.parseObjectThread"));
-            UInt32 obj_idx = 0;
-            for (auto it = this->objects_path.begin(); it != this->objects_path.end(); it++)
+            for (size_t i = next_object++; i < objects.size(); i = next_object++)
             {
-                if (obj_idx % SNAPSHOT_THREAD_NUM == thread_idx)
+                auto [obj_bytes, it] = objects[i];
+                LOG_INFO(
+                    thread_log,
+                    "Parse object, thread_idx {}, obj_index {}, path {}, bytes {}, obj size {}",
+                    thread_idx,
+                    it->first,
+                    it->second,
+                    obj_bytes,
+                    this->objects_path.size());
+                try
                 {
-                    LOG_INFO(
-                        thread_log,
-                        "Parse object, thread_idx {}, obj_index {}, path {}, obj size {}",
-                        thread_idx,
-                        it->first,
-                        it->second,
-                        this->objects_path.size());
-                    try
-                    {
-                        this->parseOneObject(it->second, store);
-                    }
-                    catch(Exception & e)
-                    {
-                        LOG_ERROR(log, "parseOneObject error {}, {}", it->second, getExceptionMessage(e, true));
-                    }
+                    this->parseOneObject(it->second, store, loaded_paths[thread_idx]);
+                }
+                catch(Exception & e)
+                {
+                    LOG_ERROR(log, "parseOneObject error {}, {}", it->second, getExceptionMessage(e, true));
                 }
-                obj_idx++;
             }
         });
     }
     object_thread_pool.wait();
+    removeDeletedNodes(store);
 
-    size_t ephemeral_nodes = 0;
-    for (auto & paths : store.ephemerals)
+    LOG_INFO(log, "Load snapshot done, ephemeral sessions {} nodes {}", store.ephemerals.size(), store.ephemerals.nodeCount());
+
+    /// Build children of every shard of parents in its own thread, children of a parent are changed by one thread only
+    LOG_INFO(log, "build path children in keeper storage {}", store.container.size());
+    for (UInt32 shard = 0; shard < SNAPSHOT_THREAD_NUM; shard++)
     {
-        ephemeral_nodes += paths.second.size();
+        object_thread_pool.scheduleOrThrowOnError([shard, &store, &loaded_paths] {
+            for (auto & thread_paths : loaded_paths)
+            {
+                store.linkToParents(thread_paths[shard]);
+                std::vector<String>().swap(thread_paths[shard]);
+            }
+        });
     }
-    LOG_INFO(log, "Load snapshot done, ephemeral sessions {} nodes {}", store.ephemerals.size(), ephemeral_nodes);
+    object_thread_pool.wait();
 
-    store.buildPathChildren();
+    /// After all the nodes and ACLs are loaded, so that an ACL still used is never removed
+    for (auto acl_id : replaced_acls)
+        store.acl_map.removeUsage(acl_id);
+    std::vector<uint64_t>().swap(replaced_acls);
+
+    /// Bases are followed by the delta snapshot
+    if (!data_only)
+    {
+        store.recalculateMemoryStats();
+
+        /// Snapshots before the digest have none
+        if (recorded_digest && *recorded_digest != store.getDigest())
+            LOG_ERROR(
+                log, "Digest of loaded data tree {} differs from the one recorded in snapshot {}", store.getDigest(), *recorded_digest);
+        else if (recorded_digest)
+            LOG_INFO(log, "Digest of loaded data tree {} is verified", store.getDigest());
+    }
 
     auto node = store.container.get("/");
     if (node != nullptr)
@@ -990,33 +1861,28 @@ void KeeperSnapshotStore::loadObject(ulong obj_id, ptr<buffer> & buffer)
     ::lseek(snap_fd, 0, SEEK_SET);
 
     buffer = buffer::alloc(file_size);
+    /// Read straight into the buffer by as large reads as the kernel takes
     size_t offset = 0;
-    char read_buf[IO_BUFFER_SIZE];
     while (offset < file_size)
     {
-        int buf_size = IO_BUFFER_SIZE;
-        if (offset + IO_BUFFER_SIZE >= file_size)
-        {
-            buf_size = file_size - offset;
-        }
         errno = 0;
-        ssize_t ret = pread(snap_fd, read_buf, buf_size, offset);
-        if (ret < 0)
+        ssize_t ret = ::pread(snap_fd, buffer->data_begin() + offset, file_size - offset, offset);
+        if (ret <= 0)
         {
             LOG_ERROR(
                 log,
                 "Read object failed, path {}, offset {}, length {}, ret {}, erron {}, error:{}",
                 obj_path,
                 offset,
-                buf_size,
+                file_size - offset,
                 ret,
                 errno,
                 strerror(errno));
             break;
         }
-        buffer->put_raw(reinterpret_cast<nuraft::byte *>(read_buf), buf_size);
-        offset += buf_size;
+        offset += ret;
     }
+    buffer->pos(offset);
 
     if (snap_fd > 0)
     {
@@ -1043,36 +1909,28 @@ void KeeperSnapshotStore::saveObject(ulong obj_id, buffer & buffer)
         return;
     }
 
-    buffer.pos(0);
+    /// Written straight from the buffer by as large writes as the kernel takes
     size_t offset = 0;
     while (offset < buffer.size())
     {
-        int buf_size;
-        if (offset + IO_BUFFER_SIZE < buffer.size())
-        {
-            buf_size = IO_BUFFER_SIZE;
-        }
-        else
-        {
-            buf_size = buffer.size() - offset;
-        }
         errno = 0;
-        ssize_t ret = pwrite(snap_fd, buffer.get_raw(buf_size), buf_size, offset);
-        if (ret < 0)
+        ssize_t ret = ::pwrite(snap_fd, buffer.data_begin() + offset, buffer.size() - offset, offset);
+        if (ret <= 0)
         {
             LOG_ERROR(
                 log,
                 "Write object failed, path {}, offset {}, length {}, ret {}, erron {}, error:{}",
                 obj_path,
                 offset,
-                buf_size,
+                buffer.size() - offset,
                 ret,
                 errno,
                 strerror(errno));
             break;
         }
-        offset += buf_size;
+        offset += ret;
     }
+    buffer.pos(offset);
 
     if (snap_fd > 0)
     {
@@ -1083,52 +1941,184 @@ void KeeperSnapshotStore::saveObject(ulong obj_id, buffer & buffer)
     LOG_INFO(log, "Save object path {}, file size {}, obj_id {}.", obj_path, buffer.size(), obj_id);
 }
 
+UInt64 KeeperSnapshotStore::getObjectSize(ulong obj_id)
+{
+    auto it = objects_path.find(obj_id);
+    if (it == objects_path.end())
+        return 0;
+
+    struct stat file_stat;
+    if (::stat(it->second.c_str(), &file_stat) != 0)
+    {
+        LOG_ERROR(log, "Stat snapshot object {} failed, error:{}", it->second, strerror(errno));
+        return 0;
+    }
+    return file_stat.st_size;
+}
+
+bool KeeperSnapshotStore::readObject(ulong obj_id, UInt64 offset, char * to, size_t size)
+{
+    auto it = objects_path.find(obj_id);
+    if (it == objects_path.end())
+    {
+        LOG_WARNING(log, "Not exist object {}", obj_id);
+        return false;
+    }
+
+    std::string obj_path = it->second;
+    int snap_fd = ::open(obj_path.c_str(), O_RDONLY);
+    if (snap_fd < 0)
+    {
+        LOG_ERROR(log, "Open snapshot object {} failed, error:{}", obj_path, strerror(errno));
+        return false;
+    }
+    SCOPE_EXIT({ ::close(snap_fd); });
+
+    size_t read_bytes = 0;
+    while (read_bytes < size)
+    {
+        errno = 0;
+        ssize_t ret = ::pread(snap_fd, to + read_bytes, size - read_bytes, offset + read_bytes);
+        if (ret <= 0)
+        {
+            LOG_ERROR(log, "Read object failed, path {}, offset {}, length {}, ret {}, error:{}", obj_path, offset, size, ret, strerror(errno));
+            return false;
+        }
+        read_bytes += ret;
+    }
+
+#if defined(OS_LINUX)
+    /// The next chunk is read from disk while this one is sent
+    ::posix_fadvise(snap_fd, offset + size, size, POSIX_FADV_WILLNEED);
+#endif
+    return true;
+}
+
+void KeeperSnapshotStore::addObject(ulong obj_id)
+{
+    if (Directory::createDir(snap_dir) != 0)
+        throw Exception(ErrorCodes::CANNOT_CREATE_DIRECTORY, "Fail to create snapshot directory {}", snap_dir);
+
+    std::string obj_path;
+    getObjectPath(obj_id, obj_path);
+    /// An object received again is written from scratch
+    ::unlink(obj_path.c_str());
+    objects_path[obj_id] = obj_path;
+}
+
+void KeeperSnapshotStore::writeObject(ulong obj_id, UInt64 offset, const char * data, size_t size)
+{
+    std::string obj_path;
+    getObjectPath(obj_id, obj_path);
+
+    int snap_fd = openFileForWrite(obj_path);
+    if (snap_fd < 0)
+        throw Exception(ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR, "Cannot open snapshot object {}", obj_path);
+    SCOPE_EXIT({ ::close(snap_fd); });
+
+    size_t written = 0;
+    while (written < size)
+    {
+        errno = 0;
+        ssize_t ret = ::pwrite(snap_fd, data + written, size - written, offset + written);
+        if (ret < 0)
+            throw Exception(
+                ErrorCodes::CANNOT_WRITE_TO_FILE_DESCRIPTOR,
+                "Write object failed, path {}, offset {}, length {}, error:{}",
+                obj_path,
+                offset,
+                size,
+                strerror(errno));
+        written += ret;
+    }
+    LOG_DEBUG(log, "Write object path {}, offset {}, size {}, obj_id {}.", obj_path, offset, size, obj_id);
+}
+
 void KeeperSnapshotStore::addObjectPath(ulong obj_id, std::string & path)
 {
     objects_path[obj_id] = path;
 }
 
+ptr<KeeperSnapshotStore> KeeperSnapshotManager::newSnapshotStore(snapshot & meta)
+{
+    ptr<KeeperSnapshotStore> snap_store = cs_new<KeeperSnapshotStore>(snap_dir, meta, object_node_size);
+    if (flat_format)
+        snap_store->version = SnapshotVersion::V4;
+    else if (compression_level > 0)
+        snap_store->version = SnapshotVersion::V3;
+    else if (crc32c_checksum)
+        snap_store->version = SnapshotVersion::V2;
+    snap_store->compression_level = compression_level;
+    snap_store->io_settings = io_settings;
+    snap_store->max_object_bytes = object_bytes;
+    snap_store->save_batch_bytes = batch_bytes;
+    snap_store->init();
+    return snap_store;
+}
+
 size_t KeeperSnapshotManager::createSnapshot(snapshot & meta, KeeperStore & storage, int64_t next_zxid, int64_t next_session_id)
 {
     size_t store_size = storage.container.size() + storage.ephemerals.size();
     meta.set_size(store_size);
-    ptr<KeeperSnapshotStore> snap_store = cs_new<KeeperSnapshotStore>(snap_dir, meta, object_node_size);
-    snap_store->init();
+    ptr<KeeperSnapshotStore> snap_store = newSnapshotStore(meta);
+
+    /// Always taken, so that they do not pile up
+    auto dirty_paths = storage.takeSnapshotDirtyPaths();
+    bool delta = false;
+    {
+        std::lock_guard lock(snapshots_mutex);
+        delta = max_delta_count && delta_count < max_delta_count && storage.isTrackingDirtyPaths() && last_created
+            && snapshots.contains(last_created->log_index);
+    }
+    if (delta)
+        snap_store->setDeltaBase(last_created->log_index, SnapshotDeltaChanges{last_created->next_zxid, std::move(dirty_paths)});
+
     LOG_INFO(
         log,
-        "Create snapshot last_log_term {}, last_log_idx {}, size {}, SM container size {}, SM ephemeral size {}",
+        "Create {} snapshot last_log_term {}, last_log_idx {}, size {}, SM container size {}, SM ephemeral size {}",
+        delta ? "delta" : "full",
         meta.get_last_log_term(),
         meta.get_last_log_idx(),
         meta.size(),
         storage.container.size(),
         storage.ephemerals.size());
+
+    /// If failed, changes since the last snapshot are lost, so the next one is full
+    last_created.reset();
     size_t obj_size = snap_store->createObjects(storage, next_zxid, next_session_id);
+    std::lock_guard lock(snapshots_mutex);
     snapshots[meta.get_last_log_idx()] = snap_store;
+    last_created = DeltaBase{meta.get_last_log_idx(), next_zxid};
+    delta_count = delta ? delta_count + 1 : 0;
     return obj_size;
 }
 
 bool KeeperSnapshotManager::receiveSnapshot(snapshot & meta)
 {
     ptr<KeeperSnapshotStore> snap_store = cs_new<KeeperSnapshotStore>(snap_dir, meta, object_node_size);
+    snap_store->io_settings = io_settings;
     snap_store->init();
+    std::lock_guard lock(snapshots_mutex);
     snapshots[meta.get_last_log_idx()] = snap_store;
+    /// The store is replaced by the received snapshot
+    last_created.reset();
     return true;
 }
 
 bool KeeperSnapshotManager::existSnapshot(const snapshot & meta)
 {
+    std::lock_guard lock(snapshots_mutex);
     return snapshots.find(meta.get_last_log_idx()) != snapshots.end();
 }
 
 bool KeeperSnapshotManager::existSnapshotObject(const snapshot & meta, ulong obj_id)
 {
-    auto it = snapshots.find(meta.get_last_log_idx());
-    if (it == snapshots.end())
+    ptr<KeeperSnapshotStore> store = getSnapshotStore(meta);
+    if (!store)
     {
         LOG_INFO(log, "Not exists snapshot last_log_idx {}", meta.get_last_log_idx());
         return false;
     }
-    ptr<KeeperSnapshotStore> store = it->second;
     bool exist = store->existObject(obj_id);
     LOG_INFO(log, "Find object {} by last_log_idx {} and object id {}", exist, meta.get_last_log_idx(), obj_id);
     return exist;
@@ -1136,51 +2126,122 @@ bool KeeperSnapshotManager::existSnapshotObject(const snapshot & meta, ulong obj
 
 bool KeeperSnapshotManager::loadSnapshotObject(const snapshot & meta, ulong obj_id, ptr<buffer> & buffer)
 {
-    auto it = snapshots.find(meta.get_last_log_idx());
-    if (it == snapshots.end())
+    ptr<KeeperSnapshotStore> store = getSnapshotStore(meta);
+    if (!store)
     {
         LOG_WARNING(log, "Cant find snapshot, last log index {}", meta.get_last_log_idx());
         return false;
     }
-    ptr<KeeperSnapshotStore> store = it->second;
     store->loadObject(obj_id, buffer);
     return true;
 }
 
 bool KeeperSnapshotManager::saveSnapshotObject(snapshot & meta, ulong obj_id, buffer & buffer)
 {
+    getOrCreateSnapshotStore(meta)->saveObject(obj_id, buffer);
+    return true;
+}
+
+ptr<KeeperSnapshotStore> KeeperSnapshotManager::getSnapshotStore(const snapshot & meta)
+{
+    std::lock_guard lock(snapshots_mutex);
     auto it = snapshots.find(meta.get_last_log_idx());
+    return it == snapshots.end() ? nullptr : it->second;
+}
+
+ptr<KeeperSnapshotStore> KeeperSnapshotManager::getOrCreateSnapshotStore(snapshot & meta)
+{
+    std::lock_guard lock(snapshots_mutex);
+    auto it = snapshots.find(meta.get_last_log_idx());
+    if (it != snapshots.end())
+        return it->second;
+
+    meta.set_size(0);
+    auto store = cs_new<KeeperSnapshotStore>(snap_dir, meta);
+    store->io_settings = io_settings;
+    store->init();
+    snapshots[meta.get_last_log_idx()] = store;
+    /// The store is replaced by the received snapshot
+    last_created.reset();
+    return store;
+}
+
+bool KeeperSnapshotManager::parseSnapshot(const snapshot & meta, KeeperStore & storage)
+{
     ptr<KeeperSnapshotStore> store;
-    if (it == snapshots.end())
-    {
-        meta.set_size(0);
-        store = cs_new<KeeperSnapshotStore>(snap_dir, meta);
-        store->init();
-        snapshots[meta.get_last_log_idx()] = store;
-    }
-    else
+    /// Bases of a delta snapshot back to a full snapshot, loaded from the oldest one
+    std::vector<ptr<KeeperSnapshotStore>> chain;
     {
+        std::lock_guard lock(snapshots_mutex);
+        auto it = snapshots.find(meta.get_last_log_idx());
+        if (it == snapshots.end())
+        {
+            LOG_WARNING(log, "Cant find snapshot, last log index {}", meta.get_last_log_idx());
+            return false;
+        }
         store = it->second;
+
+        chain.push_back(store);
+        while (auto base = chain.back()->getDeltaBase())
+        {
+            auto base_it = snapshots.find(*base);
+            if (base_it == snapshots.end())
+            {
+                LOG_ERROR(
+                    log, "Cant find base snapshot {} of delta snapshot {}", *base, chain.back()->getSnapshot()->get_last_log_idx());
+                return false;
+            }
+            chain.push_back(base_it->second);
+        }
     }
-    store->saveObject(obj_id, buffer);
+    for (auto chain_it = chain.rbegin(); chain_it != chain.rend(); ++chain_it)
+        (*chain_it)->parseObject(storage, *chain_it != store);
+
+    LOG_INFO(
+        log,
+        "Finish parse snapshot of {} snapshots, StateMachine container size {}, ephemeral size {}",
+        chain.size(),
+        storage.container.size(),
+        storage.ephemerals.size());
     return true;
 }
 
-bool KeeperSnapshotManager::parseSnapshot(const snapshot & meta, KeeperStore & storage)
+bool KeeperSnapshotManager::isFullSnapshot(const snapshot & meta)
 {
+    std::lock_guard lock(snapshots_mutex);
     auto it = snapshots.find(meta.get_last_log_idx());
-    if (it == snapshots.end())
+    return it == snapshots.end() || !it->second->getDeltaBase();
+}
+
+bool KeeperSnapshotManager::ensureFullSnapshot(const snapshot & meta)
+{
+    ptr<KeeperSnapshotStore> delta_store = getSnapshotStore(meta);
+    if (!delta_store || !delta_store->getDeltaBase())
+        return true;
+
+    LOG_INFO(log, "Snapshot {} is a delta snapshot, rewrite it as a full snapshot", meta.get_last_log_idx());
+    RaftSettingsPtr raft_settings(RaftSettings::getDefault());
+    KeeperStore storage(raft_settings->dead_session_check_period_ms);
+    if (!parseSnapshot(meta, storage))
+        return false;
+
+    ptr<snapshot> full_meta = snapshot::deserialize(*meta.serialize());
+    full_meta->set_size(storage.container.size() + storage.ephemerals.size());
+    ptr<KeeperSnapshotStore> full_store = newSnapshotStore(*full_meta);
+    full_store->createObjects(storage, storage.zxid, storage.getSessionIDCounter());
+
+    std::lock_guard lock(snapshots_mutex);
+    /// Removed or replaced by a received snapshot meanwhile
+    auto it = snapshots.find(meta.get_last_log_idx());
+    if (it == snapshots.end() || it->second != delta_store)
     {
-        LOG_WARNING(log, "Cant find snapshot, last log index {}", meta.get_last_log_idx());
+        full_store->removeObjects(delta_store.get());
         return false;
     }
-    ptr<KeeperSnapshotStore> store = it->second;
-    store->parseObject(storage);
-    LOG_INFO(
-        log,
-        "Finish parse snapshot, StateMachine container size {}, ephemeral size {}",
-        storage.container.size(),
-        storage.ephemerals.size());
+
+    /// Later delta snapshots of it are loaded on the full snapshot as well
+    delta_store->removeObjects(full_store.get());
+    it->second = full_store;
     return true;
 }
 
@@ -1196,6 +2257,7 @@ size_t KeeperSnapshotManager::loadSnapshotMetas()
     unsigned long log_last_index;
     unsigned long object_id;
 
+    std::lock_guard lock(snapshots_mutex);
     for (const auto& file : file_vec)
     {
         if (file.find("snapshot_") == file.npos)
@@ -1210,6 +2272,7 @@ size_t KeeperSnapshotManager::loadSnapshotMetas()
             ptr<nuraft::cluster_config> config = cs_new<nuraft::cluster_config>(log_last_index, log_last_index - 1);
             nuraft::snapshot meta(log_last_index, 1, config);
             ptr<KeeperSnapshotStore> snap_store = cs_new<KeeperSnapshotStore>(snap_dir, meta, object_node_size);
+            snap_store->io_settings = io_settings;
             snap_store->init(time_str);
             snapshots[meta.get_last_log_idx()] = snap_store;
             LOG_INFO(log, "load filename {}, time {}, index {}, object id {}", file, time_str, log_last_index, object_id);
@@ -1223,6 +2286,7 @@ size_t KeeperSnapshotManager::loadSnapshotMetas()
 
 ptr<snapshot> KeeperSnapshotManager::lastSnapshot()
 {
+    std::lock_guard lock(snapshots_mutex);
     LOG_INFO(log, "Get last snapshot, snapshot size {}", snapshots.size());
     auto entry = snapshots.rbegin();
     if (entry == snapshots.rend())
@@ -1232,6 +2296,7 @@ ptr<snapshot> KeeperSnapshotManager::lastSnapshot()
 
 time_t KeeperSnapshotManager::getLastCreateTime()
 {
+    std::lock_guard lock(snapshots_mutex);
     auto entry = snapshots.rbegin();
     if (entry == snapshots.rend())
         return 0L;
@@ -1240,47 +2305,56 @@ time_t KeeperSnapshotManager::getLastCreateTime()
 
 size_t KeeperSnapshotManager::removeSnapshots()
 {
-    Int64 remove_count = static_cast<Int64>(snapshots.size()) - static_cast<Int64>(keep_max_snapshot_count);
+    std::lock_guard lock(snapshots_mutex);
+    while (snapshots.size() > keep_max_snapshot_count)
+    {
+        /// Delta snapshots need their bases, so the oldest snapshot and the delta snapshots following it
+        /// are removed together, once enough snapshots are left after them.
+        auto chain_end = std::next(snapshots.begin());
+        size_t chain_size = 1;
+        while (chain_end != snapshots.end() && chain_end->second->getDeltaBase())
+        {
+            ++chain_end;
+            ++chain_size;
+        }
+        if (snapshots.size() - chain_size < keep_max_snapshot_count)
+            break;
+
+        while (snapshots.begin() != chain_end)
+        {
+            ulong remove_log_index = snapshots.begin()->first;
+            removeSnapshotFiles(remove_log_index);
+            snapshots.erase(snapshots.begin());
+        }
+    }
+    return snapshots.size();
+}
+
+void KeeperSnapshotManager::removeSnapshotFiles(ulong log_index)
+{
     char time_str[128];
     unsigned long log_last_index;
     unsigned long object_id;
-    while (remove_count > 0)
+    Poco::File dir_obj(snap_dir);
+    if (!dir_obj.exists())
+        return;
+
+    std::vector<std::string> files;
+    dir_obj.list(files);
+    for (const auto & file : files)
     {
-        auto it = snapshots.begin();
-        ulong remove_log_index = it->first;
-        Poco::File dir_obj(snap_dir);
-        if (dir_obj.exists())
+        if (file.find("snapshot_") == file.npos)
         {
-            std::vector<std::string> files;
-            dir_obj.list(files);
-            for (auto file : files)
-            {
-                if (file.find("snapshot_") == file.npos)
-                {
-                    LOG_INFO(log, "Skip no snapshot file {}", file);
-                    continue;
-                }
-                sscanf(file.c_str(), "snapshot_%[^_]_%lu_%lu", time_str, &log_last_index, &object_id);
-                if (remove_log_index == log_last_index)
-                {
-                    LOG_INFO(
-                        log,
-                        "remove_count {}, snapshot size {}, remove log index {}, file {}",
-                        remove_count,
-                        snapshots.size(),
-                        remove_log_index,
-                        file);
-                    Poco::File(snap_dir + "/" + file).remove();
-                    if (snapshots.find(remove_log_index) != snapshots.end())
-                    {
-                        snapshots.erase(it);
-                    }
-                }
-            }
+            LOG_INFO(log, "Skip no snapshot file {}", file);
+            continue;
+        }
+        sscanf(file.c_str(), "snapshot_%[^_]_%lu_%lu", time_str, &log_last_index, &object_id);
+        if (log_index == log_last_index)
+        {
+            LOG_INFO(log, "Snapshot size {}, remove log index {}, file {}", snapshots.size(), log_index, file);
+            Poco::File(snap_dir + "/" + file).remove();
         }
-        remove_count--;
     }
-    return snapshots.size();
 }
 }
 
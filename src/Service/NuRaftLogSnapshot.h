@@ -1,13 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <unordered_set>
+#include <vector>
 #include <IO/WriteBufferFromFile.h>
+#include <Service/Crc32.h>
 #include <Service/KeeperCommon.h>
 #include <Service/KeeperStore.h>
 #include <Service/LogEntry.h>
 #include <Service/proto/Log.pb.h>
 #include <libnuraft/nuraft.hxx>
+#include <Common/Throttler.h>
 #include <Common/ZooKeeper/IKeeper.h>
 
 
@@ -21,11 +29,42 @@ enum SnapshotVersion : uint8_t
 {
     V0 = 0,
     V1 = 1, /// with ACL map, and last_log_term for file name
+    V2 = 2, /// checksum of batches and objects is CRC32C
+    V3 = 3, /// batch data starts with its SnapshotCodec
+    V4 = 4, /// batch data after the codec starts with its SnapshotBatchLayout, data batches are flat nodes
     None = 255,
 };
 
+/// V2, V3 and V4 are written only if enabled by settings, so that servers without them can read snapshots
 static constexpr auto CURRENT_SNAPSHOT_VERSION = SnapshotVersion::V1;
 
+/// Codec of batch data since V3, followed by the UInt32 size of the batch before compression unless None
+enum class SnapshotCodec : uint8_t
+{
+    None = 0,
+    Zlib = 1,
+};
+
+/** Layout of batch data since V4.
+ *
+ * FlatNodes are length prefixed nodes in native byte order, decoded straight from the mapped object:
+ * UInt32 path size, path, UInt32 data size, data, UInt64 acl_id, UInt8 is_ephemeral, UInt8 is_sequental,
+ * then the fields of Coordination::Stat in order.
+ *
+ * DeletedPaths are UInt32 path size and path of nodes removed since the base of a delta snapshot.
+ */
+enum class SnapshotBatchLayout : uint8_t
+{
+    Protobuf = 0,
+    FlatNodes = 1,
+    DeletedPaths = 2,
+};
+
+inline ChecksumType checksumOf(SnapshotVersion version)
+{
+    return version >= SnapshotVersion::V2 && version != SnapshotVersion::None ? ChecksumType::CRC32C : ChecksumType::CRC32;
+}
+
 struct SnapshotBatchHeader
 {
     // The length of the batch data (uncompressed)
@@ -41,8 +80,37 @@ struct SnapshotBatchHeader
     static const size_t HEADER_SIZE = 8;
 };
 
+/// IO of creating snapshots, so that it does not disturb the Raft log on a shared disk
+struct SnapshotIOSettings
+{
+    /// Write speed of data objects, 0 means not limited
+    UInt64 write_bytes_per_second = 0;
+    /// Start writeback of data objects by sync_file_range every this many bytes, 0 means left to the kernel
+    UInt64 flush_bytes = 0;
+    /// Threads creating snapshots have the lowest best effort IO priority
+    bool low_io_priority = false;
+    /// Blocks of WRITE_BUFFER_SIZE of a data object queued to its writing thread, and read ahead of loading it. 0 means
+    /// written synchronously and readahead left to the kernel.
+    UInt64 io_depth = 0;
+    /// Data objects are written with O_DIRECT if the filesystem supports it
+    bool direct_io = false;
+};
+
+/// Changes since the base of a delta snapshot
+struct SnapshotDeltaChanges
+{
+    /// Next zxid of the base snapshot, nodes created or changed since then have a zxid not less than it
+    int64_t base_zxid = 0;
+    /// See KeeperStore::trackDirtyPaths
+    std::unordered_set<String> dirty_paths;
+};
+
 //Snapshot stored in disk, one snapshot object corresponds one file
 //SnapshotHeader + (SnapshotBatchHeader+LogEntryBody)[...]
+//
+//A delta snapshot has only the nodes changed since its base snapshot, the snapshot before it. Its object 4
+//has the paths removed since then and its int map has the last log index of the base as DELTA_BASE. It is
+//loaded on top of its bases back to a full snapshot, sessions and ACLs are always saved in full.
 class KeeperSnapshotStore
 {
 public:
@@ -76,13 +144,31 @@ public:
     size_t createObjects(KeeperStore & store, int64_t next_zxid = 0, int64_t next_session_id = 0);
     // init snapshot store for receive snapshot object
     void init(std::string create_time);
-    void parseObject(KeeperStore & store);
+    /// data_only loads only the data objects, used for bases of a delta snapshot
+    void parseObject(KeeperStore & store, bool data_only = false);
+
+    /// Create a delta snapshot of the base instead of a full one, before createObjects. Delta snapshots are V4.
+    void setDeltaBase(UInt64 base_log_index, SnapshotDeltaChanges changes);
+    /// Last log index of the base if it is a delta snapshot
+    std::optional<UInt64> getDeltaBase();
+    /// Remove object files from disk, except the ones rewritten by replaced_by, which are named the same
+    /// if created in the same second
+    void removeObjects(const KeeperSnapshotStore * replaced_by = nullptr);
 
     void loadObject(ulong obj_id, ptr<buffer> & buffer);
     bool existObject(ulong obj_id);
     void saveObject(ulong obj_id, buffer & buffer);
 
+    /// Byte-level access to objects for chunked transfer, readObject and writeObject are thread safe
+    UInt64 getObjectSize(ulong obj_id);
+    /// Read size bytes of object from offset into to, returns false if failed
+    bool readObject(ulong obj_id, UInt64 offset, char * to, size_t size);
+    /// Register a received object, it is written by writeObject
+    void addObject(ulong obj_id);
+    void writeObject(ulong obj_id, UInt64 offset, const char * data, size_t size);
+
     void addObjectPath(ulong obj_id, std::string & path);
+    const std::map<ulong, std::string> & getObjectPaths() const { return objects_path; }
 
     ptr<snapshot> getSnapshot() { return snap_meta; }
 
@@ -113,34 +199,69 @@ public:
     static const UInt32 MAX_OBJECT_NODE_SIZE = 1000000;
     // 100M Count / 10K = 10K
     static const UInt32 SAVE_BATCH_SIZE = 10000;
+    /// Data objects and batches are also closed by serialized bytes, so that they are even whatever the node sizes
+    static const UInt64 MAX_OBJECT_BYTES = 128 * 1024 * 1024;
+    static const UInt64 SAVE_BATCH_BYTES = 1024 * 1024;
     static const int SNAPSHOT_THREAD_NUM = 8;
-    static const int IO_BUFFER_SIZE = 16384; //16K
+    /// A serializing thread shares its pending nodes with idle threads once it has this many
+    static const size_t SPLIT_PENDING_NODES = 64;
+    static const int WRITE_BUFFER_SIZE = 4194304; //4M
+    static const int WRITE_BUFFER_ALIGNMENT = 4096;
 
     SnapshotVersion version = CURRENT_SNAPSHOT_VERSION;
+    /// zlib level of data batches, 0 means not compressed. Only used since V3.
+    int compression_level = 0;
+    SnapshotIOSettings io_settings;
+    /// Approximate serialized bytes of a data object and of a data batch, 0 means only limited by node count
+    UInt64 max_object_bytes = MAX_OBJECT_BYTES;
+    UInt64 save_batch_bytes = SAVE_BATCH_BYTES;
 
 private:
     void getObjectPath(ulong object_id, std::string & path);
-    bool parseOneObject(std::string obj_path, KeeperStore & store);
-    bool loadHeader(ptr<std::fstream> fs, SnapshotBatchHeader & head);
+    /// Paths of loaded nodes by KeeperStore::parentShardOf
+    using LoadedPaths = std::vector<std::vector<String>>;
+    bool parseOneObject(std::string obj_path, KeeperStore & store, LoadedPaths & loaded_paths);
+    /// Remove the nodes of deleted_paths loaded from an older snapshot of the chain
+    void removeDeletedNodes(KeeperStore & store);
+    void serializeDeletedPaths(KeeperStore & store, const String & obj_path);
+
+    /// Data objects written by one thread of serializeDataTree
+    struct DataObjectWriter
+    {
+        ptr<WriteBufferFromFile> out;
+        ptr<SnapshotBatchPB> batch;
+        /// batch of FlatNodes since V4
+        String flat_batch;
+        /// nodes in the current object
+        uint64_t object_nodes = 0;
+        uint64_t object_bytes = 0;
+        /// nodes in the current batch
+        uint64_t batch_nodes = 0;
+        uint64_t batch_bytes = 0;
+        uint32_t checksum = 0;
+    };
 
-    size_t serializeDataTree(KeeperStore & storage);
     /**
-     * Serialize data tree by deep traversal.
-     * @param out destination
-     * @param batch nodes packaged in batch
-     * @param store data tree
-     * @param path current node path
-     * @param processed nodes processed
+     * Serialize data tree by deep traversal in SNAPSHOT_THREAD_NUM threads.
+     * Every thread writes its own objects, object ids are taken from a shared counter, so they are contiguous.
+     * Only changed nodes are saved for a delta snapshot.
+     * @return id of the last data object
      */
-    void serializeNode(
-        ptr<WriteBufferFromFile> & out,
-        ptr<SnapshotBatchPB> & batch,
-        KeeperStore & store,
-        const String & path,
-        uint64_t & processed,
-        uint32_t & checksum);
+    size_t serializeDataTree(KeeperStore & storage, size_t first_object_id);
+    /// Approximate bytes of node in a data batch
+    static size_t nodeBytes(const String & path, const KeeperNode & node);
+    /// Append node to the current object of writer, open a new object if there is none or it is full
+    void appendNodeToObject(
+        DataObjectWriter & writer, std::atomic<size_t> & next_object_id, const String & path, std::shared_ptr<const KeeperNode> node);
+    /// Flush the last batch and close the current object of writer, if any
+    void closeObject(DataObjectWriter & writer);
+    /// Save the batch of writer and start a new one
+    void flushBatch(DataObjectWriter & writer);
+    static void appendFlatNode(String & batch, const String & path, const KeeperNode & node);
+    /// Load a batch of FlatNodes
+    void parseFlatNodes(const char * data, size_t size, KeeperStore & store, LoadedPaths & loaded_paths, const String & obj_path);
     inline static void appendNodeToBatch(
-        ptr<SnapshotBatchPB> batch, const String & path, std::shared_ptr<KeeperNode> node);
+        ptr<SnapshotBatchPB> batch, const String & path, std::shared_ptr<const KeeperNode> node);
 
 private:
     std::string snap_dir;
@@ -155,6 +276,20 @@ private:
     std::string curr_time;
     time_t curr_time_t;
     std::shared_ptr<ThreadPool> snapshot_thread;
+    /// Shared by threads writing data objects of the snapshot being created
+    std::shared_ptr<Throttler> write_throttler;
+
+    std::optional<UInt64> delta_base;
+    /// delta_base is known, or else it is read from the int map
+    bool delta_base_loaded = false;
+    SnapshotDeltaChanges delta_changes;
+    /// Digest of the data tree in the int map, see KeeperStore::getDigest
+    std::optional<UInt64> recorded_digest;
+    /// Paths removed since the base, loaded from the only object having them
+    std::vector<String> deleted_paths;
+    /// ACLs of loaded nodes replaced by a delta snapshot, their usage is removed after loading
+    std::mutex replaced_acls_mutex;
+    std::vector<uint64_t> replaced_acls;
 };
 
 using KeeperSnapshotStoreMap = std::map<uint64_t, ptr<KeeperSnapshotStore>>;
@@ -163,10 +298,27 @@ using KeeperSnapshotStoreMap = std::map<uint64_t, ptr<KeeperSnapshotStore>>;
 class KeeperSnapshotManager
 {
 public:
-    KeeperSnapshotManager(const std::string & snap_dir_, UInt32 keep_max_snapshot_count_, UInt32 object_node_size_)
+    KeeperSnapshotManager(
+        const std::string & snap_dir_,
+        UInt32 keep_max_snapshot_count_,
+        UInt32 object_node_size_,
+        int compression_level_ = 0,
+        bool flat_format_ = false,
+        const SnapshotIOSettings & io_settings_ = {},
+        UInt64 object_bytes_ = KeeperSnapshotStore::MAX_OBJECT_BYTES,
+        UInt64 batch_bytes_ = KeeperSnapshotStore::SAVE_BATCH_BYTES,
+        UInt32 max_delta_count_ = 0,
+        bool crc32c_checksum_ = false)
         : snap_dir(snap_dir_)
         , keep_max_snapshot_count(keep_max_snapshot_count_)
         , object_node_size(object_node_size_)
+        , compression_level(std::clamp(compression_level_, 0, 9))
+        , flat_format(flat_format_)
+        , io_settings(io_settings_)
+        , object_bytes(object_bytes_)
+        , batch_bytes(batch_bytes_)
+        , max_delta_count(max_delta_count_)
+        , crc32c_checksum(crc32c_checksum_)
         , log(&(Poco::Logger::get("KeeperSnapshotManager")))
     {
     }
@@ -177,7 +329,17 @@ public:
     bool existSnapshotObject(const snapshot & meta, ulong obj_id);
     bool loadSnapshotObject(const snapshot & meta, ulong obj_id, ptr<buffer> & buffer);
     bool saveSnapshotObject(snapshot & meta, ulong obj_id, buffer & buffer);
+    /// nullptr if not exist
+    ptr<KeeperSnapshotStore> getSnapshotStore(const snapshot & meta);
+    /// Store of a snapshot being received
+    ptr<KeeperSnapshotStore> getOrCreateSnapshotStore(snapshot & meta);
+    /// A delta snapshot is loaded on its bases
     bool parseSnapshot(const snapshot & meta, KeeperStore & storage);
+    /// Rewrite a delta snapshot as a full one, so that it can be sent to a follower. It is loaded in a new store,
+    /// which may take long, the map of snapshots is not locked meanwhile.
+    bool ensureFullSnapshot(const snapshot & meta);
+    /// False if meta is a delta snapshot, see ensureFullSnapshot
+    bool isFullSnapshot(const snapshot & meta);
     ptr<snapshot> lastSnapshot();
     time_t getLastCreateTime();
     size_t loadSnapshotMetas();
@@ -193,9 +355,37 @@ private:
     std::atomic<uint64_t> last_committed_idx;
 #endif
     UInt32 object_node_size;
+    /// zlib level of created snapshots, 0 means not compressed
+    int compression_level;
+    /// Create V4 snapshots with flat data batches
+    bool flat_format;
+    SnapshotIOSettings io_settings;
+    /// Approximate bytes of data objects and batches of created snapshots
+    UInt64 object_bytes;
+    UInt64 batch_bytes;
+    /// Delta snapshots between two full snapshots, 0 means all snapshots are full
+    UInt32 max_delta_count;
+    /// Create V2 snapshots, whose batches and objects are checksummed by CRC32C, if no later version is enabled
+    bool crc32c_checksum;
+
+    /// The last snapshot created, the base of the next delta snapshot
+    struct DeltaBase
+    {
+        UInt64 log_index;
+        int64_t next_zxid;
+    };
+    std::optional<DeltaBase> last_created;
+    /// Delta snapshots since the last full snapshot
+    UInt32 delta_count = 0;
+
+    /// A new store for meta with the settings of created snapshots
+    ptr<KeeperSnapshotStore> newSnapshotStore(snapshot & meta);
+    /// Remove snapshot files of log index from the directory
+    void removeSnapshotFiles(ulong log_index);
 
     Poco::Logger * log;
-    //std::mutex snap_mutex;
+    /// Guards snapshots, which is read by the raft threads and the snapshot thread
+    std::mutex snapshots_mutex;
     KeeperSnapshotStoreMap snapshots;
     std::string last_create_time_str;
 };
@@ -1,19 +1,31 @@
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <string>
 #include <math.h>
+#include <IO/ReadBufferFromFile.h>
+#include <IO/VarInt.h>
+#include <IO/WriteBufferFromFile.h>
 #include <Service/NuRaftFileLogStore.h>
 #include <Service/NuRaftStateMachine.h>
+#include <Service/PipelineStageThreads.h>
+#include <Service/StallWatchdog.h>
+#include <Service/StartupReadServer.h>
 #include <Service/ReadBufferFromNuraftBuffer.h>
 #include <Service/RequestProcessor.h>
 #include <Service/WriteBufferFromNuraftBuffer.h>
 #include <Service/proto/Log.pb.h>
 #include <Poco/File.h>
+#include <Common/CurrentMemoryTracker.h>
+#include <Common/Exception.h>
 #include <Common/Stopwatch.h>
+#include <Common/setThreadName.h>
 #include <Common/ZooKeeper/ZooKeeperIO.h>
+#include <ext/scope_guard.h>
 
 
 #ifdef __clang__
@@ -27,14 +39,32 @@ using namespace nuraft;
 
 namespace RK
 {
+namespace ErrorCodes
+{
+    extern const int LOGICAL_ERROR;
+    extern const int CORRUPTED_DATA;
+}
+
+/// Log entries read and decoded together when replaying, 0.3 * 10000 = 3M
+static constexpr ulong REPLAY_BATCH_SIZE = 10000;
+
 struct ReplayLogBatch
 {
     ulong batch_start_index = 0;
     ulong batch_end_index = 0;
     ptr<std::vector<VersionLogEntry>> log_vec;
     ptr<std::vector<ptr<KeeperStore::RequestForSession>>> request_vec;
+    /// Position in log_vec -> requests of a batch entry, its request_vec element is nullptr
+    std::unordered_map<size_t, std::vector<ptr<KeeperStore::RequestForSession>>> batch_requests;
 };
 
+static std::shared_future<ptr<log_store>> readyLogStore(ptr<log_store> log_store_)
+{
+    std::promise<ptr<log_store>> promise;
+    promise.set_value(std::move(log_store_));
+    return promise.get_future().share();
+}
+
 nuraft::ptr<nuraft::buffer> writeResponses(KeeperStore::ResponsesForSessions & responses)
 {
     WriteBufferFromNuraftBuffer buffer;
@@ -60,15 +90,61 @@ NuRaftStateMachine::NuRaftStateMachine(
     ptr<log_store> log_store_,
     std::string super_digest,
     UInt32 object_node_size,
-    std::shared_ptr<RequestProcessor> request_processor_)
+    std::shared_ptr<RequestProcessor> request_processor_,
+    bool witness_)
+    : NuRaftStateMachine(
+        responses_queue_,
+        raft_settings_,
+        snap_dir,
+        snap_begin_second,
+        snap_end_second,
+        internal,
+        keep_max_snapshot_count,
+        new_session_id_callback_mutex_,
+        new_session_id_callback_,
+        readyLogStore(log_store_),
+        super_digest,
+        object_node_size,
+        request_processor_,
+        witness_)
+{
+}
+
+NuRaftStateMachine::NuRaftStateMachine(
+    KeeperResponsesQueue & responses_queue_,
+    const RaftSettingsPtr & raft_settings_,
+    std::string & snap_dir,
+    UInt32 snap_begin_second,
+    UInt32 snap_end_second,
+    UInt32 internal,
+    UInt32 keep_max_snapshot_count,
+    std::mutex & new_session_id_callback_mutex_,
+    std::unordered_map<int64_t, ptr<std::condition_variable>> & new_session_id_callback_,
+    std::shared_future<ptr<log_store>> log_store_future,
+    std::string super_digest,
+    UInt32 object_node_size,
+    std::shared_ptr<RequestProcessor> request_processor_,
+    bool witness_)
     : raft_settings(raft_settings_)
-    , store(raft_settings->dead_session_check_period_ms, super_digest)
+    , store(
+          raft_settings->dead_session_check_period_ms,
+          super_digest,
+          raft_settings->container_type,
+          raft_settings->subtree_stats_depth,
+          raft_settings->session_expiry_type,
+          raft_settings->prepare_response_frames,
+          raft_settings->response_cache_max_paths,
+          raft_settings->response_cache_max_body_bytes,
+          raft_settings->container_blocks,
+          raft_settings->idempotency_cache_size)
     , responses_queue(responses_queue_)
     , request_processor(request_processor_)
     , new_session_id_callback_mutex(new_session_id_callback_mutex_)
     , new_session_id_callback(new_session_id_callback_)
+    , witness(witness_)
 {
     log = &(Poco::Logger::get("KeeperStateMachine"));
+    snapshot_memory_tracker.setDescription("(for snapshots)");
 
     LOG_INFO(log, "begin init state machine, snapshot directory {}", snap_dir);
 
@@ -83,151 +159,243 @@ NuRaftStateMachine::NuRaftStateMachine(
     ulong prev_last_committed_idx = 0;
     task_manager->getLastCommitted(prev_last_committed_idx);
 
-    snap_mgr = cs_new<KeeperSnapshotManager>(snapshot_dir, keep_max_snapshot_count, object_node_size);
+    snap_mgr = cs_new<KeeperSnapshotManager>(
+        snapshot_dir,
+        keep_max_snapshot_count,
+        object_node_size,
+        static_cast<int>(raft_settings->snapshot_compression_level),
+        raft_settings->snapshot_flat_format,
+        SnapshotIOSettings{
+            raft_settings->snapshot_write_bytes_per_second,
+            raft_settings->snapshot_flush_bytes,
+            raft_settings->snapshot_low_io_priority,
+            raft_settings->snapshot_io_depth,
+            raft_settings->snapshot_direct_io},
+        raft_settings->snapshot_object_bytes,
+        raft_settings->snapshot_batch_bytes,
+        static_cast<UInt32>(raft_settings->snapshot_max_deltas),
+        raft_settings->crc32c_checksum);
+    if (raft_settings->snapshot_max_deltas)
+        store.trackDirtyPaths();
+    store.setSessionLimits({raft_settings->max_session_ephemerals, raft_settings->max_session_watches});
+
+    if (witness)
+    {
+        /// Nothing to load or replay, entries from the last commit are committed again by raft
+        loadWitnessSnapshot();
+        last_committed_idx = std::max(prev_last_committed_idx, witness_snapshot ? witness_snapshot->get_last_log_idx() : 0);
+        LOG_INFO(log, "Witness, last committed index {}", last_committed_idx);
+        return;
+    }
+
     //load snapshot meta from disk
     size_t meta_size = snap_mgr->loadSnapshotMetas();
     //get last snapshot
     auto last_snapshot = snap_mgr->lastSnapshot();
-    if (last_snapshot != nullptr)
+    last_committed_idx = last_snapshot ? last_snapshot->get_last_log_idx() : 0;
+
+    LOG_INFO(log, "Load snapshot meta size {}, last log index {} in snapshot", meta_size, last_committed_idx);
+
+    /// The replay only needs the last log index of the snapshot, so the snapshot is applied by another thread while the log
+    /// store finishes initializing and the log after the snapshot is read. The log is applied once the snapshot is.
+    ThreadFromGlobalPool snapshot_thread;
+    std::exception_ptr snapshot_exception;
+    SCOPE_EXIT({
+        if (snapshot_thread.joinable())
+            snapshot_thread.join();
+    });
+    auto wait_snapshot = [&]
     {
-        last_committed_idx = last_snapshot->get_last_log_idx();
-        apply_snapshot(*last_snapshot);
-    }
-    else
+        if (snapshot_thread.joinable())
+            snapshot_thread.join();
+        if (snapshot_exception)
+            std::rethrow_exception(snapshot_exception);
+    };
+
+    if (last_snapshot != nullptr && raft_settings->parallel_startup)
     {
-        last_committed_idx = 0;
+        snapshot_thread = ThreadFromGlobalPool(
+            [&]
+            {
+                try
+                {
+                    apply_snapshot(*last_snapshot);
+                }
+                catch (...)
+                {
+                    snapshot_exception = std::current_exception();
+                }
+            });
     }
+    else if (last_snapshot != nullptr)
+        apply_snapshot(*last_snapshot);
 
-    LOG_INFO(log, "Load snapshot meta size {}, last log index {} in snapshot", meta_size, last_committed_idx);
-
-    //[ batch_start_index, batch_end_index )
-    ulong batch_start_index = 0;
-    ulong batch_end_index = 0;
+    ptr<log_store> log_store_ = log_store_future.get();
     if (log_store_ != nullptr)
     {
-        std::mutex load_mutex;
-        std::condition_variable load_cond;
         ulong last_log_index = log_store_->next_slot() - 1;
         if (prev_last_committed_idx != 0 && prev_last_committed_idx < last_log_index)
         {
             last_log_index = prev_last_committed_idx;
         }
 
-        batch_start_index = last_committed_idx + 1;
-        std::queue<ReplayLogBatch> log_queue;
+        /// Log entries in [first_log_index, last_log_index] are replayed in batches of REPLAY_BATCH_SIZE. Reader threads read
+        /// and decode batches ahead, the batches are applied in order by this thread.
+        const ulong first_log_index = last_committed_idx + 1;
+        const size_t batch_count = last_log_index >= first_log_index ? (last_log_index - first_log_index) / REPLAY_BATCH_SIZE + 1 : 0;
+        const auto reader_count
+            = static_cast<UInt32>(std::clamp<UInt64>(raft_settings->log_replay_threads, 1, std::max<size_t>(1, batch_count)));
+        /// Decoded batches waiting to be applied are bounded
+        const size_t max_loaded_batches = reader_count * 2;
 
         LOG_INFO(
             log,
-            "Begin replay log, first log index {} and last log index {} in log file ( prev index {}, log index {} )",
-            batch_start_index,
+            "Begin replay log, first log index {} and last log index {} in log file ( prev index {}, log index {} ), {} reader threads",
+            first_log_index,
             last_log_index,
             prev_last_committed_idx,
-            log_store_->next_slot() - 1);
+            log_store_->next_slot() - 1,
+            reader_count);
 
-        UInt32 REPLAY_THREAD_NUM = 1;
-        ThreadPool object_thread_pool(REPLAY_THREAD_NUM);
-        for (UInt32 thread_idx = 0; thread_idx < REPLAY_THREAD_NUM; thread_idx++)
+        std::mutex load_mutex;
+        std::condition_variable load_cond;
+        /// Batch number -> batch
+        std::map<size_t, ReplayLogBatch> loaded_batches;
+        size_t applying_batch = 0;
+        std::exception_ptr load_exception;
+        bool replay_stopped = false;
+        std::atomic<size_t> next_batch{0};
+
+        auto load_batch = [this, &log_store_](ReplayLogBatch & batch, Poco::Logger * thread_log)
         {
-            object_thread_pool.trySchedule([this,
-                                            thread_idx,
-                                            last_log_index,
-                                            &load_mutex,
-                                            &log_queue,
-                                            &batch_start_index,
-                                            &batch_end_index,
-                                            &log_store_] {
-                Poco::Logger * thread_log = &(Poco::Logger::get("LoadLogThread"));
-                while (batch_start_index < last_log_index)
+            batch.log_vec = dynamic_cast<NuRaftFileLogStore *>(log_store_.get())
+                                ->log_entries_version_ext(batch.batch_start_index, batch.batch_end_index, 0);
+            batch.request_vec = cs_new<std::vector<ptr<KeeperStore::RequestForSession>>>();
+
+            for (auto entry : *(batch.log_vec))
+            {
+                if (entry.entry->get_val_type() != nuraft::log_val_type::app_log)
+                {
+                    batch.request_vec->push_back(nullptr);
+                    LOG_WARNING(thread_log, "Replay log, not app log {}", entry.entry->get_val_type());
+                    continue;
+                }
+
+                if (isNewSessionRequest(entry.entry->get_buf()))
+                {
+                    batch.request_vec->push_back(nullptr);
+                }
+                else if (isUpdateSessionRequest(entry.entry->get_buf()))
+                {
+                    batch.request_vec->push_back(nullptr);
+                }
+                else if (isReserveSessionIDsRequest(entry.entry->get_buf()))
                 {
-                    while (log_queue.size() >= 10)
+                    batch.request_vec->push_back(nullptr);
+                }
+                else if (isBatchRequest(entry.entry->get_buf()))
+                {
+                    auto & requests = batch.batch_requests[batch.request_vec->size()];
+                    batch.request_vec->push_back(nullptr);
+                    for (auto & request_entry : splitBatch(entry.entry->get_buf()))
                     {
-                        LOG_DEBUG(thread_log, "Sleep 1s wait for replay log");
-                        sleep(1);
-                        //load_cond.wait();
+                        ptr<log_entry> request_log = cs_new<log_entry>(entry.entry->get_term(), request_entry);
+                        requests.push_back(this->createRequestSession(request_log));
                     }
+                }
+                else
+                {
+                    /// replay nodes
+                    ptr<KeeperStore::RequestForSession> ptr_request = this->createRequestSession(entry.entry);
+                    LOG_TRACE(thread_log, "Replay log request, session {}", toHexString(ptr_request->session_id));
 
-                    //0.3 * 10000 = 3M
-                    batch_end_index = batch_start_index + 10000;
-                    if (batch_end_index > last_log_index + 1)
-                        batch_end_index = last_log_index + 1;
-
-                    LOG_INFO(
-                        thread_log,
-                        "Begin load batch log to state machine, thread {}, batch [ {} , {} )",
-                        thread_idx,
-                        batch_start_index,
-                        batch_end_index);
-
-                    ReplayLogBatch batch;
-                    batch.log_vec = dynamic_cast<NuRaftFileLogStore *>(log_store_.get())
-                                        ->log_entries_version_ext(batch_start_index, batch_end_index, 0);
-
-                    batch.batch_start_index = batch_start_index;
-                    batch.batch_end_index = batch_end_index;
-                    batch.request_vec = cs_new<std::vector<ptr<KeeperStore::RequestForSession>>>();
+                    batch.request_vec->push_back(ptr_request);
+                }
+            }
+        };
 
-                    for (auto entry : *(batch.log_vec))
+        ThreadPool object_thread_pool(reader_count);
+        for (UInt32 thread_idx = 0; thread_idx < reader_count; thread_idx++)
+        {
+            object_thread_pool.trySchedule(
+                [&, thread_idx]
+                {
+                    Poco::Logger * thread_log = &(Poco::Logger::get("LoadLogThread"));
+                    try
                     {
-                        if (entry.entry->get_val_type() != nuraft::log_val_type::app_log)
-                        {
-                            batch.request_vec->push_back(nullptr);
-                            LOG_WARNING(thread_log, "Replay log, not app log {}", entry.entry->get_val_type());
-                            continue;
-                        }
-
-                        if (isNewSessionRequest(entry.entry->get_buf()))
+                        for (size_t batch_no = next_batch++; batch_no < batch_count; batch_no = next_batch++)
                         {
-                            batch.request_vec->push_back(nullptr);
-                        }
-                        else if (isUpdateSessionRequest(entry.entry->get_buf()))
-                        {
-                            batch.request_vec->push_back(nullptr);
-                        }
-                        else
-                        {
-                            /// replay nodes
-                            ptr<KeeperStore::RequestForSession> ptr_request = this->createRequestSession(entry.entry);
-                            LOG_TRACE(log, "Replay log request, session {}", toHexString(ptr_request->session_id));
-
-                            batch.request_vec->push_back(ptr_request);
+                            {
+                                std::unique_lock lock(load_mutex);
+                                load_cond.wait(
+                                    lock, [&] { return batch_no < applying_batch + max_loaded_batches || load_exception || replay_stopped; });
+                                if (load_exception || replay_stopped)
+                                    return;
+                            }
+
+                            ReplayLogBatch batch;
+                            batch.batch_start_index = first_log_index + batch_no * REPLAY_BATCH_SIZE;
+                            batch.batch_end_index = std::min(batch.batch_start_index + REPLAY_BATCH_SIZE, last_log_index + 1);
+                            LOG_INFO(
+                                thread_log,
+                                "Begin load batch log to state machine, thread {}, batch [ {} , {} )",
+                                thread_idx,
+                                batch.batch_start_index,
+                                batch.batch_end_index);
+                            load_batch(batch, thread_log);
+
+                            {
+                                std::lock_guard lock(load_mutex);
+                                loaded_batches.emplace(batch_no, std::move(batch));
+                            }
+                            load_cond.notify_all();
                         }
                     }
-
+                    catch (...)
                     {
-                        std::lock_guard queue_lock(load_mutex);
-                        log_queue.push(batch);
+                        tryLogCurrentException(thread_log, "Failed to load log batch");
+                        {
+                            std::lock_guard lock(load_mutex);
+                            if (!load_exception)
+                                load_exception = std::current_exception();
+                        }
+                        load_cond.notify_all();
                     }
-                    LOG_INFO(
-                        thread_log,
-                        "Finish load batch log to state machine, thread {}, batch [ {} , {} )",
-                        thread_idx,
-                        batch_start_index,
-                        batch_end_index);
-                    batch_start_index = batch_end_index;
-                }
-            });
+                });
         }
 
-        while (!log_queue.empty() || batch_start_index < last_log_index)
+        /// Readers must not wait for a batch to be applied if applying fails
+        SCOPE_EXIT({
+            {
+                std::lock_guard lock(load_mutex);
+                replay_stopped = true;
+            }
+            load_cond.notify_all();
+        });
+
+        wait_snapshot();
+        /// Reads are served from the snapshot while the log is replayed
+        StartupReadServer::openView(store);
+
+        for (size_t batch_no = 0; batch_no < batch_count; ++batch_no)
         {
             ReplayLogBatch batch;
             {
-                while (log_queue.empty() && batch_start_index != last_log_index)
+                std::unique_lock lock(load_mutex);
+                load_cond.wait(lock, [&] { return loaded_batches.count(batch_no) || load_exception; });
+                if (load_exception)
                 {
-                    LOG_DEBUG(
-                        log,
-                        "Sleep 100ms, log queue size {}, start index {}, last index {}",
-                        log_queue.size(),
-                        batch_start_index,
-                        last_log_index);
-                    usleep(100000);
-                }
-                if (!log_queue.empty())
-                {
-                    std::lock_guard queue_lock(load_mutex);
-                    batch = log_queue.front();
+                    lock.unlock();
+                    object_thread_pool.wait();
+                    std::rethrow_exception(load_exception);
                 }
+                auto it = loaded_batches.find(batch_no);
+                batch = std::move(it->second);
+                loaded_batches.erase(it);
+                applying_batch = batch_no + 1;
             }
+            load_cond.notify_all();
+
             if (batch.log_vec == nullptr)
             {
                 LOG_DEBUG(log, "log vector is null");
@@ -257,50 +425,65 @@ NuRaftStateMachine::NuRaftStateMachine(
                     store.updateSessionTimeout(session_id, session_timeout_ms);
                     LOG_TRACE(log, "Replay log update session {} with timeout {}", toHexString(session_id), session_timeout_ms);
                 }
+                else if (isReserveSessionIDsRequest(entry.entry->get_buf()))
+                {
+                    /// replay reserving session ids
+                    nuraft::buffer_serializer data_serializer(entry.entry->get_buf());
+                    int32_t reserve_server_id = data_serializer.get_i32();
+                    int64_t count = data_serializer.get_i64();
+
+                    int64_t first_session_id = store.reserveSessionIDs(count);
+                    LOG_TRACE(log, "Replay log reserve {} session ids from {} for server {}", count, toHexString(first_session_id), reserve_server_id);
+                }
                 else
                 {
-                    /// replay nodes
-                    auto & request = (*batch.request_vec)[i];
-                    LOG_TRACE(
-                        log, "Replay log request, session {}, request {}", toHexString(request->session_id), request->request->toString());
-                    store.processRequest(responses_queue, request->request, request->session_id, request->create_time, {}, true, true);
-                    if (request->session_id > store.session_id_counter)
+                    /// replay nodes, a batch entry has many of them
+                    auto batch_it = batch.batch_requests.find(i);
+                    auto replay = [&](const ptr<KeeperStore::RequestForSession> & request)
                     {
-                        LOG_WARNING(
-                            log,
-                            "Storage's session_id_counter {} must bigger than the session id {} of log.",
-                            toHexString(store.session_id_counter),
-                            toHexString(request->session_id));
-                        store.session_id_counter = request->session_id;
+                        if (!request)
+                            return;
+                        LOG_TRACE(
+                            log, "Replay log request, session {}, request {}", toHexString(request->session_id), request->request->toString());
+                        store.processRequest(responses_queue, request->request, request->session_id, request->create_time, {}, true, true);
+                        if (request->session_id > store.session_id_counter)
+                        {
+                            LOG_WARNING(
+                                log,
+                                "Storage's session_id_counter {} must bigger than the session id {} of log.",
+                                toHexString(store.session_id_counter),
+                                toHexString(request->session_id));
+                            store.session_id_counter = request->session_id;
+                        }
+                    };
+                    if (batch_it != batch.batch_requests.end())
+                    {
+                        for (const auto & request : batch_it->second)
+                            replay(request);
                     }
+                    else
+                        replay((*batch.request_vec)[i]);
                 }
             }
-            log_queue.pop();
             last_committed_idx = batch.batch_end_index - 1;
             LOG_INFO(log, "Replay start index {}, commit index {}", batch.batch_start_index, last_committed_idx);
-            batch.log_vec = nullptr;
-            batch.request_vec = nullptr;
-            batch.batch_start_index = 0;
-            batch.batch_end_index = 0;
         }
         object_thread_pool.wait();
 
-        size_t ephemeral_nodes = 0;
-        for (auto & paths : store.ephemerals)
-        {
-            ephemeral_nodes += paths.second.size();
-        }
-        LOG_INFO(log, "Apply log done, ephemeral sessions {} nodes {}", store.ephemerals.size(), ephemeral_nodes);
+        LOG_INFO(log, "Apply log done, ephemeral sessions {} nodes {}", store.ephemerals.size(), store.ephemerals.nodeCount());
 
         /// In order to meet the initial application of snapshot in the cluster. At this time, the log index is less than the last index of the snapshot, and compact is required.
         if (log_store_->next_slot() <= last_committed_idx)
             log_store_->compact(last_committed_idx);
     }
+    wait_snapshot();
 
     LOG_INFO(log, "Replay last committed index {} in log store", last_committed_idx);
 
     LOG_INFO(log, "Starting background creating snapshot thread.");
     snap_thread = ThreadFromGlobalPool([this] { snapThread(); });
+    if (raft_settings->compress_cold_data_after_ms)
+        cold_data_thread = ThreadFromGlobalPool([this] { coldDataThread(); });
 }
 
 ptr<KeeperStore::RequestForSession> NuRaftStateMachine::createRequestSession(ptr<log_entry> & entry)
@@ -355,35 +538,98 @@ ptr<KeeperStore::RequestForSession> NuRaftStateMachine::createRequestSession(ptr
 
 void NuRaftStateMachine::snapThread()
 {
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Snapshot);
     while (!shutdown_called)
     {
-        if (snap_task)
+        std::shared_ptr<SnapTask> task;
+        ptr<snapshot> full_task;
+        {
+            std::unique_lock lock(snap_task_mutex);
+            snap_task_cv.wait_for(
+                lock, std::chrono::milliseconds(1000), [this] { return snap_task || full_snap_task || shutdown_called; });
+            task = snap_task;
+            full_task = full_snap_task;
+        }
+
+        if (task)
         {
             Stopwatch stopwatch;
-            in_snapshot = true;
 
             LOG_WARNING(
                 log,
                 "Create snapshot last_log_term {}, last_log_idx {}",
-                snap_task->s->get_last_log_term(),
-                snap_task->s->get_last_log_idx());
+                task->s->get_last_log_term(),
+                task->s->get_last_log_idx());
 
-            create_snapshot(*snap_task->s, snap_task->next_zxid, snap_task->next_session_id);
+            create_snapshot(*task->s, task->next_zxid, task->next_session_id);
+            store.unpinSnapshot();
             ptr<std::exception> except(nullptr);
             bool ret = true;
 
-            snap_task->when_done(ret, except);
-            snap_task = nullptr;
+            task->when_done(ret, except);
+            {
+                std::lock_guard lock(snap_task_mutex);
+                snap_task = nullptr;
+            }
 
             stopwatch.stop();
             in_snapshot = false;
 
             snap_count.fetch_add(1);
             snap_time_ms.fetch_add(stopwatch.elapsedMilliseconds());
+            snapshot_latency.record(stopwatch.elapsedMicroseconds());
 
             LOG_INFO(log, "Create snapshot time cost {} ms", stopwatch.elapsedMilliseconds());
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+        if (full_task)
+        {
+            /// Not under snapshot_mutex, so that the raft threads are not blocked meanwhile. Snapshots are only
+            /// removed by this thread, a snapshot received meanwhile is kept instead of the rewritten one.
+            try
+            {
+                CurrentMemoryTracker::Scope memory_scope(&snapshot_memory_tracker);
+                snap_mgr->ensureFullSnapshot(*full_task);
+            }
+            catch (...)
+            {
+                tryLogCurrentException(log, "Failed to rewrite delta snapshot " + std::to_string(full_task->get_last_log_idx()));
+            }
+            std::lock_guard lock(snap_task_mutex);
+            if (full_snap_task == full_task)
+                full_snap_task = nullptr;
+        }
+    }
+}
+
+void NuRaftStateMachine::coldDataThread()
+{
+    setThreadName("ColdData");
+    auto period = std::chrono::milliseconds(std::max<UInt64>(raft_settings->compress_cold_data_after_ms / COLD_DATA_PASSES, 1));
+    while (!shutdown_called)
+    {
+        {
+            std::unique_lock lock(cold_data_mutex);
+            if (cold_data_cv.wait_for(lock, period, [this] { return shutdown_called.load(); }))
+                break;
+        }
+
+        try
+        {
+            Stopwatch stopwatch;
+            auto stats = store.compressColdData(COLD_DATA_PASSES);
+            LOG_DEBUG(
+                log,
+                "Compressed {} and decompressed {} cold node values in {} ms, saved {} bytes",
+                stats.compressed,
+                stats.decompressed,
+                stopwatch.elapsedMilliseconds(),
+                store.getMemoryStats().compression_saved_bytes);
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Failed to compress cold node values");
+        }
     }
 }
 
@@ -425,9 +671,81 @@ KeeperStore::RequestForSession NuRaftStateMachine::parseRequest(nuraft::buffer &
     return request_for_session;
 }
 
+void NuRaftStateMachine::finishLogEntry(nuraft::buffer & entry, int64_t session_id, int64_t create_time)
+{
+    assert(entry.size() >= LOG_ENTRY_HEAD_SIZE + LOG_ENTRY_TAIL_SIZE);
+    auto request_length = static_cast<int32_t>(entry.size() - LOG_ENTRY_HEAD_SIZE - LOG_ENTRY_TAIL_SIZE);
+
+    /// Same encoding as serializeRequest, session id is in native order and the others are big endian
+    auto * pos = entry.data_begin();
+    memcpy(pos, &session_id, sizeof(session_id));
+    int32_t length_big_endian = __builtin_bswap32(request_length);
+    memcpy(pos + sizeof(session_id), &length_big_endian, sizeof(length_big_endian));
+    int64_t time_big_endian = __builtin_bswap64(create_time);
+    memcpy(pos + entry.size() - LOG_ENTRY_TAIL_SIZE, &time_big_endian, sizeof(time_big_endian));
+}
+
+void NuRaftStateMachine::registerAppendedRequest(const KeeperStore::RequestForSession & request)
+{
+    std::lock_guard lock(appended_requests_mutex);
+    /// Requests with a fixed xid (auth) may be in flight together, the later ones are parsed at commit
+    auto [it, inserted] = appended_requests.try_emplace(UInt128(request.session_id, request.request->xid), request);
+    if (inserted)
+        it->second.trace.mark(RequestTrace::APPEND);
+}
+
+void NuRaftStateMachine::forgetAppendedRequest(const KeeperStore::RequestForSession & request)
+{
+    std::lock_guard lock(appended_requests_mutex);
+    auto it = appended_requests.find(UInt128(request.session_id, request.request->xid));
+    if (it != appended_requests.end() && it->second.request == request.request)
+        appended_requests.erase(it);
+}
+
+void NuRaftStateMachine::clearAppendedRequests()
+{
+    std::lock_guard lock(appended_requests_mutex);
+    appended_requests.clear();
+}
+
+std::optional<KeeperStore::RequestForSession> NuRaftStateMachine::takeAppendedRequest(nuraft::buffer & data)
+{
+    if (data.size() < LOG_ENTRY_HEAD_SIZE + sizeof(int32_t) + sizeof(int32_t) + LOG_ENTRY_TAIL_SIZE)
+        return {};
+
+    ReadBufferFromNuraftBuffer buffer(data);
+    int64_t session_id;
+    readIntBinary(session_id, buffer);
+    int32_t length;
+    Coordination::read(length, buffer);
+    int32_t xid;
+    Coordination::read(xid, buffer);
+    Coordination::OpNum opnum;
+    Coordination::read(opnum, buffer);
+
+    /// Entries written before create time was added have no tail
+    if (data.size() != LOG_ENTRY_HEAD_SIZE + static_cast<size_t>(length) + LOG_ENTRY_TAIL_SIZE)
+        return {};
+    ReadBufferFromMemory tail(reinterpret_cast<const char *>(data.data_begin()) + data.size() - LOG_ENTRY_TAIL_SIZE, LOG_ENTRY_TAIL_SIZE);
+    int64_t create_time;
+    Coordination::read(create_time, tail);
+
+    std::lock_guard lock(appended_requests_mutex);
+    auto it = appended_requests.find(UInt128(session_id, xid));
+    if (it == appended_requests.end())
+        return {};
+
+    /// A request which failed to append may be left with the same key
+    std::optional<KeeperStore::RequestForSession> request;
+    if (it->second.request->getOpNum() == opnum && it->second.create_time == create_time)
+        request = std::move(it->second);
+    appended_requests.erase(it);
+    return request;
+}
+
 ptr<buffer> NuRaftStateMachine::serializeRequest(KeeperStore::RequestForSession & session_request)
 {
-    WriteBufferFromNuraftBuffer out;
+    WriteBufferFromNuraftBuffer out(sizeof(session_request.session_id) + session_request.request->bytesSize() + LOG_ENTRY_TAIL_SIZE);
     /// TODO unify digital encoding mode, see parseRequest
     writeIntBinary(session_request.session_id, out);
     session_request.request->write(out);
@@ -437,16 +755,68 @@ ptr<buffer> NuRaftStateMachine::serializeRequest(KeeperStore::RequestForSession
 
 ptr<buffer> NuRaftStateMachine::pre_commit(const ulong log_idx, buffer & data)
 {
-    // Nothing to do with pre-commit in this example.
     LOG_TRACE(log, "pre commit, log indx {}, data size {}", log_idx, data.size());
+    if (witness || isNewSessionRequest(data) || isUpdateSessionRequest(data) || isReserveSessionIDsRequest(data))
+        return nullptr;
+
+    try
+    {
+        auto requests = parseRequests(log_idx, data);
+        for (auto & request : requests)
+            request.trace.mark(RequestTrace::PRE_COMMIT);
+        std::lock_guard lock(pre_committed_mutex);
+        pre_committed_requests[log_idx] = std::move(requests);
+    }
+    catch (...)
+    {
+        /// Parsed again at commit, which fails there
+        tryLogCurrentException(log, fmt::format("Failed to parse log entry {} in pre commit", log_idx));
+    }
     return nullptr;
 }
 
 void NuRaftStateMachine::rollback(const ulong log_idx, buffer & data)
 {
-    // Nothing to do with rollback,
-    // as this example doesn't do anything on pre-commit.
-    LOG_TRACE(log, "pre commit, log indx {}, data size {}", log_idx, data.size());
+    LOG_TRACE(log, "rollback, log indx {}, data size {}", log_idx, data.size());
+    std::lock_guard lock(pre_committed_mutex);
+    pre_committed_requests.erase(log_idx);
+}
+
+std::vector<KeeperStore::RequestForSession> NuRaftStateMachine::parseRequests(const ulong log_idx, nuraft::buffer & data)
+{
+    std::vector<KeeperStore::RequestForSession> requests;
+    auto parse = [&](nuraft::buffer & entry)
+    {
+        auto appended_request = takeAppendedRequest(entry);
+        requests.push_back(appended_request ? std::move(*appended_request) : parseRequest(entry));
+    };
+
+    if (isBatchRequest(data))
+    {
+        auto entries = splitBatch(data);
+        if (entries.empty())
+            throw Exception(ErrorCodes::LOGICAL_ERROR, "Batch log entry {} of {} bytes is corrupted", log_idx, data.size());
+        requests.reserve(entries.size());
+        for (auto & entry : entries)
+            parse(*entry);
+    }
+    else
+        parse(data);
+    return requests;
+}
+
+std::optional<std::vector<KeeperStore::RequestForSession>> NuRaftStateMachine::takePreCommittedRequests(const ulong log_idx)
+{
+    std::lock_guard lock(pre_committed_mutex);
+    /// Log entries before are committed or covered by an installed snapshot
+    pre_committed_requests.erase(pre_committed_requests.begin(), pre_committed_requests.lower_bound(log_idx));
+
+    auto it = pre_committed_requests.find(log_idx);
+    if (it == pre_committed_requests.end())
+        return {};
+    std::optional<std::vector<KeeperStore::RequestForSession>> requests = std::move(it->second);
+    pre_committed_requests.erase(it);
+    return requests;
 }
 
 nuraft::ptr<nuraft::buffer> NuRaftStateMachine::commit(const ulong log_idx, nuraft::buffer & data, bool ignore_response)
@@ -457,6 +827,13 @@ nuraft::ptr<nuraft::buffer> NuRaftStateMachine::commit(const ulong log_idx, nura
     LOG_DEBUG(log, "Begin commit log index {}", log_idx);
     //    }
 
+    if (witness)
+    {
+        last_committed_idx = log_idx;
+        task_manager->afterCommitted(last_committed_idx);
+        return nullptr;
+    }
+
     if (isNewSessionRequest(data))
     {
         nuraft::buffer_serializer timeout_data(data);
@@ -521,47 +898,37 @@ nuraft::ptr<nuraft::buffer> NuRaftStateMachine::commit(const ulong log_idx, nura
 
         return response;
     }
-    else
+    else if (isReserveSessionIDsRequest(data))
     {
-        auto request_for_session = parseRequest(data);
-        KeeperStore::ResponsesForSessions responses_for_sessions;
-        LOG_DEBUG(
-            log,
-            "Commit log index {}, session {}, xid {}, request {}",
-            log_idx,
-            toHexString(request_for_session.session_id),
-            request_for_session.request->xid,
-            request_for_session.request->toString());
+        nuraft::buffer_serializer data_serializer(data);
+        int32_t reserve_server_id = data_serializer.get_i32();
+        int64_t count = data_serializer.get_i64();
 
-        if (request_for_session.create_time > 0)
-        {
-            Int64 elapsed = Poco::Timestamp().epochMicroseconds() / 1000 - request_for_session.create_time;
-            if (elapsed > 1000)
-                LOG_WARNING(
-                    log,
-                    "Commit log {} request process time {}ms, session {} xid {} req type {}",
-                    log_idx,
-                    elapsed,
-                    request_for_session.session_id,
-                    request_for_session.request->xid,
-                    Coordination::toString(request_for_session.request->getOpNum()));
-        }
+        auto response = nuraft::buffer::alloc(sizeof(int64_t));
+        nuraft::buffer_serializer bs(response);
+
+        int64_t first_session_id = store.reserveSessionIDs(count);
+        bs.put_i64(first_session_id);
+
+        LOG_DEBUG(log, "Reserve {} session ids from {} for server {}", count, toHexString(first_session_id), reserve_server_id);
+        last_committed_idx = log_idx;
+        task_manager->afterCommitted(last_committed_idx);
 
+        return response;
+    }
+    else
+    {
+        /// Entries not pre committed by this server, such as the ones committed after a restart, are parsed here
+        auto requests = takePreCommittedRequests(log_idx);
+        if (!requests)
+            requests = parseRequests(log_idx, data);
+        if (requests->size() > 1)
+            LOG_DEBUG(log, "Commit log index {}, batch of {} requests", log_idx, requests->size());
+        for (auto & request_for_session : *requests)
+            commitRequest(log_idx, request_for_session, ignore_response);
+        /// The requests of a log entry are handed over together
         if (request_processor)
-        {
-            request_processor->commit(request_for_session);
-        }
-        else
-        {
-            store.processRequest(
-                responses_queue,
-                request_for_session.request,
-                request_for_session.session_id,
-                request_for_session.create_time,
-                {},
-                true,
-                ignore_response);
-        }
+            request_processor->commit(*requests);
 
         last_committed_idx = log_idx;
         task_manager->afterCommitted(last_committed_idx);
@@ -570,8 +937,49 @@ nuraft::ptr<nuraft::buffer> NuRaftStateMachine::commit(const ulong log_idx, nura
     }
 }
 
+void NuRaftStateMachine::commitRequest(ulong log_idx, KeeperStore::RequestForSession & request_for_session, bool ignore_response)
+{
+    request_for_session.trace.mark(RequestTrace::COMMIT);
+    LOG_DEBUG(
+        log,
+        "Commit log index {}, session {}, xid {}, request {}",
+        log_idx,
+        toHexString(request_for_session.session_id),
+        request_for_session.request->xid,
+        request_for_session.request->toString());
+
+    if (request_for_session.create_time > 0)
+    {
+        Int64 elapsed = Poco::Timestamp().epochMicroseconds() / 1000 - request_for_session.create_time;
+        if (elapsed > 1000)
+            LOG_WARNING(
+                log,
+                "Commit log {} request process time {}ms, session {} xid {} req type {}",
+                log_idx,
+                elapsed,
+                request_for_session.session_id,
+                request_for_session.request->xid,
+                Coordination::toString(request_for_session.request->getOpNum()));
+    }
+
+    if (!request_processor)
+    {
+        store.processRequest(
+            responses_queue,
+            request_for_session.request,
+            request_for_session.session_id,
+            request_for_session.create_time,
+            {},
+            true,
+            ignore_response);
+    }
+}
+
 nuraft::ptr<nuraft::buffer> NuRaftStateMachine::commit(const ulong log_idx, buffer & data)
 {
+    /// Called by the commit thread of NuRaft
+    PipelineStageThreads::attach(PipelineStage::NuRaft);
+    StallWatchdog::Busy busy(log_idx);
     return commit(log_idx, data, false);
 }
 
@@ -585,6 +993,11 @@ std::vector<int64_t> NuRaftStateMachine::getDeadSessions()
     return store.getDeadSessions();
 }
 
+std::vector<String> NuRaftStateMachine::getExpiredNodes(size_t max_count)
+{
+    return store.getExpiredNodes(max_count);
+}
+
 int64_t NuRaftStateMachine::getLastProcessedZxid() const
 {
     return store.zxid.load();
@@ -620,17 +1033,17 @@ uint64_t NuRaftStateMachine::getSessionWithEphemeralNodesCount() const
     return store.getSessionWithEphemeralNodesCount();
 }
 
-void NuRaftStateMachine::dumpWatches(WriteBufferFromOwnString & buf) const
+void NuRaftStateMachine::dumpWatches(WriteBuffer & buf) const
 {
     store.dumpWatches(buf);
 }
 
-void NuRaftStateMachine::dumpWatchesByPath(WriteBufferFromOwnString & buf) const
+void NuRaftStateMachine::dumpWatchesByPath(WriteBuffer & buf) const
 {
     store.dumpWatchesByPath(buf);
 }
 
-void NuRaftStateMachine::dumpSessionsAndEphemerals(WriteBufferFromOwnString & buf) const
+void NuRaftStateMachine::dumpSessionsAndEphemerals(WriteBuffer & buf) const
 {
     store.dumpSessionsAndEphemerals(buf);
 }
@@ -640,6 +1053,26 @@ uint64_t NuRaftStateMachine::getApproximateDataSize() const
     return store.getApproximateDataSize();
 }
 
+KeeperStore::MemoryStats NuRaftStateMachine::getMemoryStats() const
+{
+    return store.getMemoryStats();
+}
+
+UInt64 NuRaftStateMachine::getDigest() const
+{
+    return store.getDigest();
+}
+
+std::map<String, KeeperStore::SubtreeStats> NuRaftStateMachine::getIndexedSubtreeStats() const
+{
+    return store.getIndexedSubtreeStats();
+}
+
+UInt64 NuRaftStateMachine::getSubtreeStatsDepth() const
+{
+    return store.getSubtreeStatsDepth();
+}
+
 bool NuRaftStateMachine::containsSession(int64_t session_id) const
 {
     return store.containsSession(session_id);
@@ -652,10 +1085,21 @@ void NuRaftStateMachine::shutdown()
 
     shutdown_called = true;
     LOG_INFO(log, "Shutting down state machine");
+    {
+        std::lock_guard lock(snap_task_mutex);
+        snap_task_cv.notify_all();
+    }
+    {
+        std::lock_guard lock(cold_data_mutex);
+        cold_data_cv.notify_all();
+    }
+    if (cold_data_thread.joinable())
+        cold_data_thread.join();
 
     store.finalize();
     task_manager->shutDown();
-    snap_thread.join();
+    if (snap_thread.joinable())
+        snap_thread.join();
     LOG_INFO(log, "State machine shut down done!");
 }
 
@@ -680,58 +1124,83 @@ bool NuRaftStateMachine::chk_create_snapshot(time_t curr_time)
 {
     std::lock_guard<std::mutex> lock(snapshot_mutex);
     time_t prev_time = snap_mgr->getLastCreateTime();
-    return !in_snapshot && timer.isActionTime(prev_time, curr_time);
+    if (in_snapshot || !timer.isActionTime(prev_time, curr_time))
+        return false;
+
+    /// Asked at every commit since snapshot_distance is reached, declined until the delay of this member is too
+    UInt64 delay = snapshot_delay ? snapshot_delay() : 0;
+    if (!delay)
+        return true;
+    auto last = snap_mgr->lastSnapshot();
+    UInt64 last_idx = last ? last->get_last_log_idx() : 0;
+    return last_committed_idx >= last_idx + raft_settings->snapshot_distance + delay;
 }
 
-void NuRaftStateMachine::create_snapshot(snapshot & s, async_result<bool>::handler_type & when_done)
+std::vector<String> NuRaftStateMachine::getLastSnapshotFiles()
 {
-    if (!raft_settings->async_snapshot)
-    {
-        size_t wait_times = 0;
-        while (request_processor && request_processor->commitQueueSize() != 0)
-        {
-            /// wait commit queue empty
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            if (++wait_times % 1000 == 0)
-            {
-                LOG_WARNING(log, "Wait commit queue to empty 1s");
-            }
-        }
+    std::vector<String> files;
+    if (witness)
+        return files;
 
-        Stopwatch stopwatch;
-        in_snapshot = true;
-
-        LOG_WARNING(log, "Create snapshot last_log_term {}, last_log_idx {}", s.get_last_log_term(), s.get_last_log_idx());
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    /// A snapshot being received is the last one already
+    auto last = snap_mgr->lastSnapshot();
+    if (!last || last->get_last_log_idx() > last_committed_idx || !requestFullSnapshot(*last))
+        return files;
+
+    auto snap_store = snap_mgr->getSnapshotStore(*last);
+    for (const auto & [_, path] : snap_store->getObjectPaths())
+        files.push_back(path);
+    return files;
+}
 
-        create_snapshot(s, store.zxid, store.session_id_counter);
+void NuRaftStateMachine::create_snapshot(snapshot & s, async_result<bool>::handler_type & when_done)
+{
+    if (witness)
+    {
+        saveWitnessSnapshot(s);
         ptr<std::exception> except(nullptr);
         bool ret = true;
         when_done(ret, except);
+        return;
+    }
 
-        stopwatch.stop();
-        in_snapshot = false;
+    in_snapshot = true;
+    /// Session ids are granted by the commit thread, so the counter is the one at last_log_idx here.
+    int64_t next_session_id = store.getSessionIDCounter();
 
-        snap_count.fetch_add(1);
-        snap_time_ms.fetch_add(stopwatch.elapsedMilliseconds());
+    /// Both sync and async snapshots are serialized by snap_thread, so commits do not stall on them.
+    /// Need make a copy of s
+    auto t1 = Poco::Timestamp().epochMicroseconds();
+    ptr<buffer> snp_buf = s.serialize();
+    auto t2 = Poco::Timestamp().epochMicroseconds();
+    auto snap_copy = snapshot::deserialize(*snp_buf);
+    auto t3 = Poco::Timestamp().epochMicroseconds();
 
-        LOG_INFO(log, "Create snapshot time cost {} ms", stopwatch.elapsedMilliseconds());
-    }
-    else
+    auto schedule = [this, snap_copy, next_session_id, when_done]() mutable
     {
-        /// Need make a copy of s
-        auto t1 = Poco::Timestamp().epochMicroseconds();
-        ptr<buffer> snp_buf = s.serialize();
-        auto t2 = Poco::Timestamp().epochMicroseconds();
-        auto snap_copy = snapshot::deserialize(*snp_buf);
-        auto t3 = Poco::Timestamp().epochMicroseconds();
-        snap_task = std::make_shared<SnapTask>(snap_copy, store.zxid, store.session_id_counter, when_done);
-        auto t4 = Poco::Timestamp().epochMicroseconds();
-        LOG_INFO(log, "Async create snapshot time cost {}us, {}us, {}us", (t2 - t1), (t3 - t2), (t4 - t3));
-    }
+        /// Writes go on after pinned, the snapshot thread iterates the pinned view.
+        int64_t next_zxid = store.pinSnapshot().first;
+        {
+            std::lock_guard lock(snap_task_mutex);
+            snap_task = std::make_shared<SnapTask>(snap_copy, next_zxid, next_session_id, when_done);
+        }
+        snap_task_cv.notify_one();
+    };
+
+    /// Logs up to last_log_idx are committed but may be still in commit queue. The store is pinned by the request
+    /// processor once they are applied and before anything committed after them is, commits go on meanwhile.
+    if (request_processor)
+        request_processor->runAfterCommittedApplied(std::move(schedule));
+    else
+        schedule();
+    auto t4 = Poco::Timestamp().epochMicroseconds();
+    LOG_INFO(log, "Schedule snapshot time cost {}us, {}us, {}us", (t2 - t1), (t3 - t2), (t4 - t3));
 }
 
 void NuRaftStateMachine::create_snapshot(snapshot & s, int64_t next_zxid, int64_t next_session_id)
 {
+    CurrentMemoryTracker::Scope memory_scope(&snapshot_memory_tracker);
     std::lock_guard<std::mutex> lock(snapshot_mutex);
     snap_mgr->createSnapshot(s, store, next_zxid, next_session_id);
     snap_mgr->removeSnapshots();
@@ -760,8 +1229,28 @@ int NuRaftStateMachine::read_snapshot_data(snapshot & s, const ulong offset, buf
     return 0;
 }
 
+bool NuRaftStateMachine::requestFullSnapshot(snapshot & s)
+{
+    if (snap_mgr->isFullSnapshot(s))
+        return true;
+
+    {
+        std::lock_guard lock(snap_task_mutex);
+        if (!full_snap_task || full_snap_task->get_last_log_idx() != s.get_last_log_idx())
+            full_snap_task = snapshot::deserialize(*s.serialize());
+    }
+    snap_task_cv.notify_one();
+    return false;
+}
+
 int NuRaftStateMachine::read_logical_snp_obj(snapshot & s, void *& user_snp_ctx, ulong obj_id, ptr<buffer> & data_out, bool & is_last_obj)
 {
+    if (obj_id & SNAPSHOT_CHUNK_FLAG)
+    {
+        user_snp_ctx = nullptr;
+        return readSnapshotChunk(s, obj_id, data_out, is_last_obj);
+    }
+
     std::lock_guard<std::mutex> lock(snapshot_mutex);
     // Snapshot doesn't exist.
     if (!snap_mgr->existSnapshot(s))
@@ -775,6 +1264,14 @@ int NuRaftStateMachine::read_logical_snp_obj(snapshot & s, void *& user_snp_ctx,
 
     if (obj_id == 0)
     {
+        /// The follower may not have the bases of a delta snapshot, chunks of the snapshot are read after this too.
+        /// Rewriting takes long, the snapshot is sent by a later attempt of the leader once it is done.
+        if (!requestFullSnapshot(s))
+        {
+            LOG_INFO(log, "Snapshot {} is a delta snapshot, send it after it is rewritten as a full one", s.get_last_log_idx());
+            return -1;
+        }
+
         // Object ID == 0: first object
         data_out = buffer::alloc(sizeof(UInt32));
         buffer_serializer bs(data_out);
@@ -796,12 +1293,113 @@ int NuRaftStateMachine::read_logical_snp_obj(snapshot & s, void *& user_snp_ctx,
     return 0;
 }
 
+int NuRaftStateMachine::readSnapshotChunk(snapshot & s, ulong obj_id, ptr<buffer> & data_out, bool & is_last_obj)
+{
+    /// Objects of a snapshot are never changed, only the lookup is under the mutex, so that reading does not
+    /// block creating snapshots. A removed object can still be read by a descriptor opened before.
+    ptr<KeeperSnapshotStore> snap_store;
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snap_store = snap_mgr->getSnapshotStore(s);
+    }
+
+    ulong object_id = (obj_id & ~SNAPSHOT_CHUNK_FLAG) >> 32;
+    ulong chunk = obj_id & 0xffffffff;
+    if (!snap_store || !snap_store->existObject(object_id))
+    {
+        data_out = nullptr;
+        is_last_obj = true;
+        LOG_INFO(log, "Cant find snapshot by last_log_idx {}, object id {}, chunk {}", s.get_last_log_idx(), object_id, chunk);
+        return 0;
+    }
+
+    UInt64 chunk_bytes = raft_settings->snapshot_chunk_bytes ? raft_settings->snapshot_chunk_bytes : DEFAULT_SNAPSHOT_CHUNK_BYTES;
+    UInt64 offset = chunk * chunk_bytes;
+    UInt64 object_size = snap_store->getObjectSize(object_id);
+    UInt64 size = offset < object_size ? std::min<UInt64>(chunk_bytes, object_size - offset) : 0;
+
+    data_out = buffer::alloc(SNAPSHOT_CHUNK_HEAD_SIZE + size);
+    char * pos = reinterpret_cast<char *>(data_out->data_begin());
+    if (!snap_store->readObject(object_id, offset, pos + SNAPSHOT_CHUNK_HEAD_SIZE, size))
+    {
+        data_out = nullptr;
+        LOG_ERROR(log, "Failed to read snapshot object {} at {}, last_log_idx {}", object_id, offset, s.get_last_log_idx());
+        return -1;
+    }
+
+    bool last_chunk = offset + size >= object_size;
+    memcpy(pos, &offset, sizeof(UInt64));
+    pos[sizeof(UInt64)] = last_chunk;
+    is_last_obj = last_chunk && !snap_store->existObject(object_id + 1);
+
+    LOG_DEBUG(
+        log,
+        "Read snapshot chunk, last_log_idx {}, object id {}, chunk {}, size {}, is_last {}",
+        s.get_last_log_idx(),
+        object_id,
+        chunk,
+        size,
+        is_last_obj);
+    return 0;
+}
+
+void NuRaftStateMachine::saveSnapshotChunk(snapshot & s, ulong & obj_id, buffer & data)
+{
+    if (data.size() < SNAPSHOT_CHUNK_HEAD_SIZE)
+        throw Exception(ErrorCodes::CORRUPTED_DATA, "Snapshot chunk {} of {} bytes is too short", obj_id, data.size());
+
+    ulong object_id = (obj_id & ~SNAPSHOT_CHUNK_FLAG) >> 32;
+    const char * pos = reinterpret_cast<const char *>(data.data_begin());
+    UInt64 offset;
+    memcpy(&offset, pos, sizeof(UInt64));
+    bool last_chunk = pos[sizeof(UInt64)];
+
+    obj_id = last_chunk ? snapshotChunkId(object_id + 1, 0) : obj_id + 1;
+    if (witness)
+        return;
+
+    ptr<KeeperSnapshotStore> snap_store;
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        snap_store = snap_mgr->getOrCreateSnapshotStore(s);
+        if (offset == 0)
+            snap_store->addObject(object_id);
+    }
+
+    /// Written while the next chunk is received
+    size_t size = data.size() - SNAPSHOT_CHUNK_HEAD_SIZE;
+    ptr<buffer> chunk_data = buffer::alloc(size);
+    memcpy(chunk_data->data_begin(), pos + SNAPSHOT_CHUNK_HEAD_SIZE, size);
+    snapshot_chunk_writer.scheduleOrThrowOnError(
+        [snap_store, object_id, offset, chunk_data] { snap_store->writeObject(object_id, offset, chunk_data->data_begin(), chunk_data->size()); });
+}
+
 void NuRaftStateMachine::save_logical_snp_obj(snapshot & s, ulong & obj_id, buffer & data, bool is_first_obj, bool is_last_obj)
 {
+    CurrentMemoryTracker::Scope memory_scope(&snapshot_memory_tracker);
+    if (obj_id & SNAPSHOT_CHUNK_FLAG)
+    {
+        saveSnapshotChunk(s, obj_id, data);
+        return;
+    }
+
+    if (witness)
+    {
+        /// Data is dropped, apply_snapshot records the meta only
+        obj_id = obj_id == 0 && raft_settings->snapshot_chunk_bytes ? snapshotChunkId(1, 0) : obj_id + 1;
+        return;
+    }
+
     if (obj_id == 0)
     {
         // Object ID == 0: it contains dummy value, create snapshot context.
         snap_mgr->receiveSnapshot(s);
+        if (raft_settings->snapshot_chunk_bytes)
+        {
+            LOG_INFO(log, "Receive snapshot last_log_idx {} by chunks", s.get_last_log_idx());
+            obj_id = snapshotChunkId(1, 0);
+            return;
+        }
     }
     else
     {
@@ -823,6 +1421,22 @@ bool NuRaftStateMachine::apply_snapshot(snapshot & s)
 {
     //TODO: double buffer load or multi thread load
     LOG_INFO(log, "apply snapshot term {}, last log index {}, size {}", s.get_last_log_term(), s.get_last_log_idx(), s.size());
+    if (witness)
+    {
+        saveWitnessSnapshot(s);
+        last_committed_idx = s.get_last_log_idx();
+        return true;
+    }
+    try
+    {
+        /// Received chunks are all written
+        snapshot_chunk_writer.wait();
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to write received snapshot chunks");
+        return false;
+    }
     std::lock_guard<std::mutex> lock(snapshot_mutex);
     return snap_mgr->parseSnapshot(s, store);
 }
@@ -843,9 +1457,45 @@ ptr<snapshot> NuRaftStateMachine::last_snapshot()
     // Just return the latest snapshot.
     std::lock_guard<std::mutex> lock(snapshot_mutex);
     LOG_INFO(log, "last_snapshot invoke");
+    if (witness)
+        return witness_snapshot;
     return snap_mgr->lastSnapshot();
 }
 
+void NuRaftStateMachine::loadWitnessSnapshot()
+{
+    String file = snapshot_dir + "/witness_snapshot";
+    if (!Poco::File(file).exists())
+        return;
+
+    ReadBufferFromFile in(file, 4096);
+    size_t size;
+    readVarUInt(size, in);
+    ptr<buffer> buf = buffer::alloc(size);
+    in.readStrict(reinterpret_cast<char *>(buf->data()), size);
+    witness_snapshot = snapshot::deserialize(*buf);
+    LOG_INFO(log, "Load witness snapshot, last log index {}", witness_snapshot->get_last_log_idx());
+}
+
+void NuRaftStateMachine::saveWitnessSnapshot(snapshot & s)
+{
+    ptr<buffer> data = s.serialize();
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    Poco::File(snapshot_dir).createDirectories();
+    /// Written aside and renamed, a crash leaves the previous one
+    String file = snapshot_dir + "/witness_snapshot";
+    {
+        WriteBufferFromFile out(file + ".tmp", 4096, O_WRONLY | O_TRUNC | O_CREAT);
+        writeVarUInt(data->size(), out);
+        out.write(reinterpret_cast<char *>(data->data()), data->size());
+        out.finalize();
+        out.sync();
+    }
+    Poco::File(file + ".tmp").renameTo(file);
+    witness_snapshot = snapshot::deserialize(*data);
+    LOG_INFO(log, "Save witness snapshot, last log index {}", s.get_last_log_idx());
+}
+
 bool NuRaftStateMachine::exists(const std::string & path)
 {
     return (store.container.count(path) == 1);
@@ -871,6 +1521,103 @@ bool NuRaftStateMachine::isUpdateSessionRequest(nuraft::buffer & data)
     return data.size() == sizeof(int64) + sizeof(int64);
 }
 
+bool NuRaftStateMachine::isReserveSessionIDsRequest(nuraft::buffer & data)
+{
+    return data.size() == sizeof(int32) + sizeof(int64);
+}
+
+bool NuRaftStateMachine::isBatchRequest(nuraft::buffer & data)
+{
+    if (data.size() <= BATCH_ENTRY_HEAD_SIZE)
+        return false;
+    int64_t marker;
+    memcpy(&marker, data.data_begin(), sizeof(marker));
+    return marker == BATCH_ENTRY_MARKER || marker == COMPRESSED_BATCH_ENTRY_MARKER;
+}
+
+ptr<buffer> NuRaftStateMachine::serializeBatch(const std::vector<ptr<buffer>> & entries)
+{
+    size_t size = BATCH_ENTRY_HEAD_SIZE;
+    for (const auto & entry : entries)
+        size += sizeof(UInt32) + entry->size();
+
+    ptr<buffer> batch = buffer::alloc(size);
+    auto * pos = batch->data_begin();
+    memcpy(pos, &BATCH_ENTRY_MARKER, sizeof(BATCH_ENTRY_MARKER));
+    auto count = static_cast<UInt32>(entries.size());
+    memcpy(pos + sizeof(BATCH_ENTRY_MARKER), &count, sizeof(count));
+    pos += BATCH_ENTRY_HEAD_SIZE;
+    for (const auto & entry : entries)
+    {
+        auto entry_size = static_cast<UInt32>(entry->size());
+        memcpy(pos, &entry_size, sizeof(entry_size));
+        memcpy(pos + sizeof(entry_size), entry->data_begin(), entry_size);
+        pos += sizeof(entry_size) + entry_size;
+    }
+    return batch;
+}
+
+ptr<buffer> NuRaftStateMachine::compressBatch(nuraft::buffer & batch)
+{
+    String compressed;
+    if (!LogEntry::compress(reinterpret_cast<const char *>(batch.data_begin()), batch.size(), compressed)
+        || compressed.size() + BATCH_ENTRY_HEAD_SIZE >= batch.size())
+        return nullptr;
+
+    ptr<buffer> result = buffer::alloc(BATCH_ENTRY_HEAD_SIZE + compressed.size());
+    auto * pos = result->data_begin();
+    auto size = static_cast<UInt32>(batch.size());
+    memcpy(pos, &COMPRESSED_BATCH_ENTRY_MARKER, sizeof(COMPRESSED_BATCH_ENTRY_MARKER));
+    memcpy(pos + sizeof(COMPRESSED_BATCH_ENTRY_MARKER), &size, sizeof(size));
+    memcpy(pos + BATCH_ENTRY_HEAD_SIZE, compressed.data(), compressed.size());
+    return result;
+}
+
+std::vector<ptr<buffer>> NuRaftStateMachine::splitBatch(nuraft::buffer & data)
+{
+    int64_t marker;
+    memcpy(&marker, data.data_begin(), sizeof(marker));
+    if (marker == COMPRESSED_BATCH_ENTRY_MARKER)
+    {
+        UInt32 size;
+        memcpy(&size, data.data_begin() + sizeof(marker), sizeof(size));
+        ptr<buffer> batch = buffer::alloc(size);
+        const char * compressed = reinterpret_cast<const char *>(data.data_begin()) + BATCH_ENTRY_HEAD_SIZE;
+        if (!LogEntry::decompress(compressed, data.size() - BATCH_ENTRY_HEAD_SIZE, reinterpret_cast<char *>(batch->data_begin()), size))
+            return {};
+        /// Batches are compressed once
+        memcpy(&marker, batch->data_begin(), sizeof(marker));
+        if (size <= BATCH_ENTRY_HEAD_SIZE || marker != BATCH_ENTRY_MARKER)
+            return {};
+        return splitBatch(*batch);
+    }
+
+    std::vector<ptr<buffer>> entries;
+    const auto * pos = data.data_begin() + sizeof(BATCH_ENTRY_MARKER);
+    const auto * end = data.data_begin() + data.size();
+    UInt32 count;
+    memcpy(&count, pos, sizeof(count));
+    pos += sizeof(count);
+    entries.reserve(count);
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        UInt32 entry_size;
+        if (static_cast<size_t>(end - pos) < sizeof(entry_size))
+            return {};
+        memcpy(&entry_size, pos, sizeof(entry_size));
+        pos += sizeof(entry_size);
+        if (static_cast<size_t>(end - pos) < entry_size)
+            return {};
+        ptr<buffer> entry = buffer::alloc(entry_size);
+        memcpy(entry->data_begin(), pos, entry_size);
+        entries.push_back(entry);
+        pos += entry_size;
+    }
+    if (pos != end)
+        return {};
+    return entries;
+}
+
 }
 
 #ifdef __clang__
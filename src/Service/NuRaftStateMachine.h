@@ -2,16 +2,23 @@
 
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <future>
+#include <limits>
+#include <map>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
 #include <string.h>
 #include <time.h>
 #include <Service/KeeperStore.h>
+#include <Service/LatencyHistogram.h>
 #include <Service/NuRaftLogSnapshot.h>
 #include <Service/RaftTaskManager.h>
 #include <Service/Settings.h>
 #include <Service/ThreadSafeQueue.h>
 #include <libnuraft/nuraft.hxx>
+#include <Common/MemoryTracker.h>
 #include <common/types.h>
 
 
@@ -21,7 +28,7 @@ using nuraft::async_result;
 using nuraft::buffer;
 using nuraft::cs_new;
 
-using KeeperResponsesQueue = ThreadSafeQueue<KeeperStore::ResponseForSession>;
+using KeeperResponsesQueue = KeeperStore::KeeperResponsesQueue;
 
 class RequestProcessor;
 
@@ -41,7 +48,26 @@ public:
         ptr<nuraft::log_store> log_store_ = nullptr,
         std::string super_digest = "",
         UInt32 object_node_size = KeeperSnapshotStore::MAX_OBJECT_NODE_SIZE,
-        std::shared_ptr<RequestProcessor> request_processor_ = nullptr);
+        std::shared_ptr<RequestProcessor> request_processor_ = nullptr,
+        bool witness_ = false);
+
+    /// The log store to replay may still be initializing, it is waited for only once the snapshot is being applied. See
+    /// RaftSettings::parallel_startup.
+    NuRaftStateMachine(
+        KeeperResponsesQueue & responses_queue_,
+        const RaftSettingsPtr & raft_settings_,
+        std::string & snap_dir,
+        UInt32 snap_begin_second,
+        UInt32 snap_end_second,
+        UInt32 internal,
+        UInt32 keep_max_snapshot_count,
+        std::mutex & new_session_id_callback_mutex_,
+        std::unordered_map<int64_t, ptr<std::condition_variable>> & new_session_id_callback_,
+        std::shared_future<ptr<nuraft::log_store>> log_store_future,
+        std::string super_digest,
+        UInt32 object_node_size,
+        std::shared_ptr<RequestProcessor> request_processor_,
+        bool witness_);
 
     ~NuRaftStateMachine() override = default;
 
@@ -57,6 +83,14 @@ public:
     bool chk_create_snapshot() override;
     //for unit test
     bool chk_create_snapshot(time_t curr_time);
+    /// Log entries past snapshot_distance to wait for before a snapshot, so that the members do not snapshot at once.
+    /// See RaftSettings::snapshot_stagger, set before the server starts.
+    void setSnapshotDelay(std::function<UInt64()> snapshot_delay_) { snapshot_delay = std::move(snapshot_delay_); }
+    /// Paths of the objects of the last snapshot if it is applied, rewritten as a full snapshot if it is a delta, so
+    /// that a new server can copy them instead of the leader sending them. See fetchSnapshotFromPeers.
+    std::vector<String> getLastSnapshotFiles();
+    /// Let snap_thread rewrite snapshot s as a full one if it is a delta snapshot, return true if it is full already.
+    bool requestFullSnapshot(snapshot & s);
     void create_snapshot(snapshot & s, async_result<bool>::handler_type & when_done) override;
     //sync create snapshot
     void create_snapshot(snapshot & s, int64_t next_zxid = 0, int64_t next_session_id = 0);
@@ -70,6 +104,18 @@ public:
     void save_logical_snp_obj(snapshot & s, ulong & obj_id, buffer & data, bool is_first_obj, bool is_last_obj) override;
     bool exist_snapshot_object(snapshot & s, ulong obj_id);
 
+    /** If raft_settings snapshot_chunk_bytes is set, a receiver asks for snapshot objects chunk by chunk. The object id of
+      * a chunk is SNAPSHOT_CHUNK_FLAG | snapshot object id << 32 | chunk index. The data of a chunk is the UInt64 offset in
+      * the snapshot object, the UInt8 whether it is the last chunk of the object, then the bytes of the object.
+      */
+    static constexpr ulong SNAPSHOT_CHUNK_FLAG = 1ULL << 63;
+    static constexpr size_t SNAPSHOT_CHUNK_HEAD_SIZE = sizeof(UInt64) + sizeof(UInt8);
+    static constexpr UInt64 DEFAULT_SNAPSHOT_CHUNK_BYTES = 4 * 1024 * 1024;
+    /// Received chunks waiting to be written, receiving goes on while they are written
+    static constexpr size_t SNAPSHOT_CHUNKS_IN_FLIGHT = 8;
+
+    static ulong snapshotChunkId(ulong object_id, ulong chunk) { return SNAPSHOT_CHUNK_FLAG | (object_id << 32) | chunk; }
+
     bool apply_snapshot(snapshot & s) override;
 
     void free_user_snp_ctx(void *& user_snp_ctx) override;
@@ -95,6 +141,7 @@ public:
     void processReadRequest(const KeeperStore::RequestForSession & request_for_session);
 
     std::vector<int64_t> getDeadSessions();
+    std::vector<String> getExpiredNodes(size_t max_count);
 
     /// Introspection functions for 4lw commands
     int64_t getLastProcessedZxid() const;
@@ -104,13 +151,17 @@ public:
     uint64_t getWatchedPathsCount() const;
     uint64_t getSessionsWithWatchesCount() const;
 
-    void dumpWatches(WriteBufferFromOwnString & buf) const;
-    void dumpWatchesByPath(WriteBufferFromOwnString & buf) const;
-    void dumpSessionsAndEphemerals(WriteBufferFromOwnString & buf) const;
+    void dumpWatches(WriteBuffer & buf) const;
+    void dumpWatchesByPath(WriteBuffer & buf) const;
+    void dumpSessionsAndEphemerals(WriteBuffer & buf) const;
 
     uint64_t getSessionWithEphemeralNodesCount() const;
     uint64_t getTotalEphemeralNodesCount() const;
     uint64_t getApproximateDataSize() const;
+    KeeperStore::MemoryStats getMemoryStats() const;
+    UInt64 getDigest() const;
+    std::map<String, KeeperStore::SubtreeStats> getIndexedSubtreeStats() const;
+    UInt64 getSubtreeStatsDepth() const;
     bool containsSession(int64_t session_id) const;
 
     uint64_t getSnapshotCount() const
@@ -118,6 +169,11 @@ public:
         return snap_count;
     }
 
+    const LatencyHistogram & getSnapshotLatency() const { return snapshot_latency; }
+
+    /// Memory of snapshots being created or received, the buffers of loading snapshots are in the data tree
+    const MemoryTracker & getSnapshotMemoryTracker() const { return snapshot_memory_tracker; }
+
     uint64_t getSnapshotTimeMs() const
     {
         return snap_time_ms;
@@ -130,17 +186,67 @@ public:
 
     void shutdown();
 
+    /** A log entry of request is session id, request length, request (xid, opnum and body) and create time.
+      * Request length is included in the head as the request bytes of client are prefixed with it.
+      */
+    static constexpr size_t LOG_ENTRY_HEAD_SIZE = sizeof(int64_t) + sizeof(int32_t);
+    static constexpr size_t LOG_ENTRY_TAIL_SIZE = sizeof(int64_t);
+
+    /** A log entry of many requests is BATCH_ENTRY_MARKER in place of the session id, the UInt32 count of requests,
+      * then every request as the UInt32 size and the log entry of the request. Sizes are in native order.
+      */
+    static constexpr int64_t BATCH_ENTRY_MARKER = std::numeric_limits<int64_t>::min();
+    static constexpr size_t BATCH_ENTRY_HEAD_SIZE = sizeof(int64_t) + sizeof(UInt32);
+    /// A compressed batch entry is COMPRESSED_BATCH_ENTRY_MARKER, the UInt32 size of the batch entry and the batch entry by zlib
+    static constexpr int64_t COMPRESSED_BATCH_ENTRY_MARKER = std::numeric_limits<int64_t>::min() + 1;
+
+    static ptr<buffer> serializeBatch(const std::vector<ptr<buffer>> & entries);
+    /// Compressed batch entry, nullptr if it does not get smaller
+    static ptr<buffer> compressBatch(nuraft::buffer & batch);
+    /// Log entries of the requests of a batch entry, empty if it is corrupted
+    static std::vector<ptr<buffer>> splitBatch(nuraft::buffer & data);
+    static bool isBatchRequest(nuraft::buffer & data);
+
     static KeeperStore::RequestForSession parseRequest(nuraft::buffer & data);
     static ptr<buffer> serializeRequest(KeeperStore::RequestForSession & request);
+    /// Write head and tail of a log entry whose request bytes are in place.
+    static void finishLogEntry(nuraft::buffer & entry, int64_t session_id, int64_t create_time);
+
+    /// Requests appended by this server, pre commit takes them instead of parsing the log entries again.
+    void registerAppendedRequest(const KeeperStore::RequestForSession & request);
+    /// The request will not be committed
+    void forgetAppendedRequest(const KeeperStore::RequestForSession & request);
+    void clearAppendedRequests();
 
 private:
     ptr<KeeperStore::RequestForSession> createRequestSession(ptr<log_entry> & entry);
+
+    /// Parsed request of the log entry if it was appended by this server
+    std::optional<KeeperStore::RequestForSession> takeAppendedRequest(nuraft::buffer & data);
+    /// Requests of a log entry of one or many requests
+    std::vector<KeeperStore::RequestForSession> parseRequests(ulong log_idx, nuraft::buffer & data);
+    /// Requests parsed when the log entry was pre committed, drops the ones of earlier log entries
+    std::optional<std::vector<KeeperStore::RequestForSession>> takePreCommittedRequests(ulong log_idx);
+    /// Apply the request at once if there is no request processor, or else it is handed to it by the caller
+    void commitRequest(ulong log_idx, KeeperStore::RequestForSession & request_for_session, bool ignore_response);
     void snapThread();
+    /// Passes of KeeperStore::compressColdData, only started if compress_cold_data_after_ms is set
+    void coldDataThread();
+
+    int readSnapshotChunk(snapshot & s, ulong obj_id, ptr<buffer> & data_out, bool & is_last_obj);
+    /// Write the chunk unless witness, and set obj_id to the next one to request
+    void saveSnapshotChunk(snapshot & s, ulong & obj_id, buffer & data);
+
+    /// Meta of the latest snapshot of a witness, which keeps no data of snapshots
+    void loadWitnessSnapshot();
+    void saveWitnessSnapshot(snapshot & s);
 
     /// Only contains session_id
     static bool isNewSessionRequest(nuraft::buffer & data);
     /// Contains session_id and timeout
     static bool isUpdateSessionRequest(nuraft::buffer & data);
+    /// Contains server_id and count of session ids to reserve
+    static bool isReserveSessionIDsRequest(nuraft::buffer & data);
 
     Poco::Logger * log;
     RaftSettingsPtr raft_settings;
@@ -151,19 +257,42 @@ private:
 
     std::shared_ptr<RequestProcessor> request_processor;
 
+    /// (session id, xid) -> request appended by this server and not committed yet
+    std::mutex appended_requests_mutex;
+    std::unordered_map<UInt128, KeeperStore::RequestForSession> appended_requests;
+
+    /// Log index -> requests parsed in pre_commit, taken at commit and dropped at rollback. Log entries are parsed
+    /// when they are appended, so that the commit thread does not parse them.
+    std::mutex pre_committed_mutex;
+    std::map<ulong, std::vector<KeeperStore::RequestForSession>> pre_committed_requests;
+
     // Last committed Raft log number.
     std::atomic<uint64_t> last_committed_idx;
+
+    /** A witness persists and acknowledges log entries, but does not apply them to the store and keeps no snapshot
+     * data. Creating or receiving a snapshot only records its meta, so that the log is compacted. It votes but is
+     * never leader and serves no clients.
+     */
+    const bool witness;
+    /// Latest snapshot of a witness, under snapshot_mutex
+    ptr<snapshot> witness_snapshot;
     //Backend async task manager
     ptr<RaftTaskManager> task_manager;
     // Mutex for `snapshots`.
     std::mutex snapshot_mutex;
+    /// Writes received snapshot chunks
+    ThreadPool snapshot_chunk_writer{1, 1, SNAPSHOT_CHUNKS_IN_FLIGHT};
     std::string snapshot_dir;
     BackendTimer timer;
+    std::function<UInt64()> snapshot_delay;
     ptr<KeeperSnapshotManager> snap_mgr;
     KeeperNode default_node;
 
     std::atomic_int64_t snap_count{0};
     std::atomic_int64_t snap_time_ms{0};
+    /// Durations of creating snapshots in microseconds
+    LatencyHistogram snapshot_latency;
+    MemoryTracker snapshot_memory_tracker{VariableContext::Process};
     std::atomic_bool in_snapshot = false;
 
     ThreadFromGlobalPool snap_thread;
@@ -179,10 +308,21 @@ private:
         {
         }
     };
+    /// Snapshot waiting for snap_thread, guarded by snap_task_mutex
     std::shared_ptr<SnapTask> snap_task;
+    /// Delta snapshot to rewrite as a full one by snap_thread, guarded by snap_task_mutex. See requestFullSnapshot.
+    ptr<snapshot> full_snap_task;
+    std::mutex snap_task_mutex;
+    std::condition_variable snap_task_cv;
 
     std::atomic<bool> shutdown_called{false};
 
+    /// A node is compressed after it is not read for COLD_DATA_PASSES passes of cold_data_thread
+    static constexpr UInt8 COLD_DATA_PASSES = 4;
+    std::mutex cold_data_mutex;
+    std::condition_variable cold_data_cv;
+    ThreadFromGlobalPool cold_data_thread;
+
     std::mutex & new_session_id_callback_mutex;
     std::unordered_map<int64_t, ptr<std::condition_variable>> & new_session_id_callback;
 };
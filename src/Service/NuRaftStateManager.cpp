@@ -15,21 +15,50 @@ using namespace nuraft;
 NuRaftStateManager::NuRaftStateManager(
     int id_,
     const Poco::Util::AbstractConfiguration & config_,
-    SettingsPtr settings_)
+    SettingsPtr settings_,
+    bool init_log_store)
     : settings(settings_), my_id(id_), my_host(settings_->host), my_internal_port(settings_->internal_port), log_dir(settings_->log_dir)
 {
     log = &(Poco::Logger::get("NuRaftStateManager"));
-    curr_log_store = cs_new<NuRaftFileLogStore>(
-        log_dir, false, settings->raft_settings->log_fsync_mode, settings->raft_settings->log_fsync_interval);
+    if (init_log_store)
+        initLogStore();
 
     srv_state_file = fs::path(log_dir) / "srv_state";
     cluster_config_file = fs::path(log_dir) / "cluster_config";
+    upstream = parseUpstream(config_, "keeper.cluster", my_id);
     cur_cluster_config = parseClusterConfig(config_, "keeper.cluster", settings->thread_count);
+    /// Decided by the configuration this server starts with
+    auto my_config = cur_cluster_config->get_server(my_id);
+    witness = my_config && my_config->get_aux() == WITNESS_AUX;
+}
+
+void NuRaftStateManager::initLogStore()
+{
+    curr_log_store = cs_new<NuRaftFileLogStore>(
+        log_dir,
+        false,
+        settings->raft_settings->log_fsync_mode,
+        settings->raft_settings->log_fsync_interval,
+        LogSegmentStore::MAX_LOG_SIZE,
+        LogSegmentStore::MAX_SEGMENT_COUNT,
+        settings->raft_settings->log_segment_preallocate,
+        settings->raft_settings->log_drop_page_cache,
+        settings->raft_settings->log_batch_append,
+        settings->raft_settings->log_cache_max_bytes,
+        settings->raft_settings->log_compression,
+        settings->raft_settings->log_remove_bytes_per_second,
+        settings->raft_settings->log_raw_pack,
+        settings->log_cold_dir,
+        settings->raft_settings->log_fsync_batch_bytes,
+        settings->raft_settings->log_fsync_max_lag_ms,
+        settings->raft_settings->log_persistent_memory,
+        settings->raft_settings->crc32c_checksum);
 }
 
 ptr<cluster_config> NuRaftStateManager::load_config()
 {
-    if (!Poco::File(cluster_config_file).exists())
+    /// A replicated server keeps its own config, it does not know the one of the Raft cluster
+    if (!upstream.empty() || !Poco::File(cluster_config_file).exists())
     {
         LOG_INFO(log, "load config with initial cluster config.");
         return cur_cluster_config;
@@ -101,6 +130,16 @@ void NuRaftStateManager::system_exit(const int exit_code)
     LOG_ERROR(log, "Raft system exit with code {}", exit_code);
 }
 
+String NuRaftStateManager::parseUpstream(const Poco::Util::AbstractConfiguration & config, const String & config_name, int id)
+{
+    Poco::Util::AbstractConfiguration::Keys keys;
+    config.keys(config_name, keys);
+    for (const auto & key : keys)
+        if (startsWith(key, "server") && config.getInt(config_name + "." + key + ".id") == id)
+            return config.getString(config_name + "." + key + ".upstream", "");
+    return "";
+}
+
 ptr<cluster_config> NuRaftStateManager::parseClusterConfig(
     const Poco::Util::AbstractConfiguration & config, const std::string & config_name, size_t thread_count) const
 {
@@ -121,9 +160,16 @@ ptr<cluster_config> NuRaftStateManager::parseClusterConfig(
                 String host = config.getString(config_name + "." + key + ".host");
                 String internal_port = config.getString(config_name + "." + key + ".internal_port", "8103");
                 String endpoint = host + ":" + internal_port;
-                bool learner = config.getBool(config_name + "." + key + ".learner", false);
-                int priority = config.getInt(config_name + "." + key + ".priority", 1);
-                ret_cluster_config->get_servers().push_back(cs_new<srv_config>(id, 0, endpoint, "", learner, priority));
+                bool replicated = !config.getString(config_name + "." + key + ".upstream", "").empty();
+                bool learner = replicated || config.getBool(config_name + "." + key + ".learner", false);
+                bool witness = config.getBool(config_name + "." + key + ".witness", false);
+                /// Learners never vote and are never elected, witnesses vote but are never elected
+                int priority = learner || witness ? 0 : config.getInt(config_name + "." + key + ".priority", 1);
+                /// A server replicated from a relay is not a member of the Raft cluster, see RelayReplicator.
+                /// It is a learner of its own config.
+                if (!replicated || id == my_id)
+                    ret_cluster_config->get_servers().push_back(
+                        cs_new<srv_config>(id, 0, endpoint, witness ? WITNESS_AUX : "", learner, priority));
 
                 if (my_id != id)
                 {
@@ -132,12 +178,18 @@ ptr<cluster_config> NuRaftStateManager::parseClusterConfig(
 
                     LOG_INFO(log, "Create ForwardingConnection for {}, {}", id, forwarding_endpoint);
 
+                    /// One more client after the ones of forwarding runners for read index requests
+                    bool read_index = settings->raft_settings->linearizable_reads || settings->raft_settings->lightweight_sync;
+                    size_t client_count = thread_count + (read_index ? 1 : 0);
+
+                    KernelTLSPtr tls = settings->tls_forwarding_port ? KernelTLS::get(*settings) : nullptr;
+
                     /// TODO use separate configuration
-                    for (size_t i = 0; i < thread_count; ++i)
+                    for (size_t i = 0; i < client_count; ++i)
                     {
                         auto & client_list = clients[id];
                         std::shared_ptr<ForwardingConnection> client = std::make_shared<ForwardingConnection>(
-                            my_id, i, forwarding_endpoint, settings->raft_settings->operation_timeout_ms * 1000);
+                            my_id, i, forwarding_endpoint, settings->raft_settings->operation_timeout_ms * 1000, tls);
                         client_list.push_back(client);
                         LOG_INFO(
                             log,
@@ -230,4 +282,22 @@ ptr<ForwardingConnection> NuRaftStateManager::getClient(int32_t server_id, Runne
     return nullptr;
 }
 
+std::vector<ptr<ForwardingConnection>> NuRaftStateManager::getAllClients()
+{
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    std::vector<ptr<ForwardingConnection>> result;
+    for (const auto & [server_id, server_clients] : clients)
+        result.insert(result.end(), server_clients.begin(), server_clients.end());
+    return result;
+}
+
+std::vector<ptr<ForwardingConnection>> NuRaftStateManager::getClients(int32_t server_id)
+{
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    auto it = clients.find(server_id);
+    if (it == clients.end())
+        return {};
+    return it->second;
+}
+
 }
@@ -46,11 +46,17 @@ public:
     NuRaftStateManager(
         int id,
         const Poco::Util::AbstractConfiguration & config_,
-        SettingsPtr settings_);
+        SettingsPtr settings_,
+        bool init_log_store = true);
 
     ~NuRaftStateManager() override = default;
 
+    /// Open the log store and index its segments, if not done by the constructor. The log store is not used before it.
+    void initLogStore();
+
     ptr<cluster_config> parseClusterConfig(const Poco::Util::AbstractConfiguration & config, const String & config_name, size_t thread_count) const;
+    /// Metrics endpoint of the relay server id is replicated from, empty if it is a member of the Raft cluster
+    static String parseUpstream(const Poco::Util::AbstractConfiguration & config, const String & config_name, int id);
 
     ptr<cluster_config> load_config() override;
 
@@ -68,6 +74,13 @@ public:
 
     bool shouldStartAsFollower() const { return start_as_follower_servers.count(my_id); }
 
+    /// Aux of the server config of a witness, see NuRaftStateMachine::witness
+    static constexpr auto WITNESS_AUX = "witness";
+    bool isWitness() const { return witness; }
+
+    /// See parseUpstream, decided by the configuration this server starts with
+    const String & getUpstream() const { return upstream; }
+
     //ptr<srv_config> get_srv_config() const { return curr_srv_config; }
 
     ptr<cluster_config> get_cluster_config() const { return cur_cluster_config; }
@@ -76,6 +89,10 @@ public:
     ConfigUpdateActions getConfigurationDiff(const Poco::Util::AbstractConfiguration & config) const;
 
     ptr<ForwardingConnection> getClient(int32_t server_id, RunnerId runner_id);
+    /// All forwarding clients to server_id, empty if there is none
+    std::vector<ptr<ForwardingConnection>> getClients(int32_t server_id);
+    /// Clients of all the other servers
+    std::vector<ptr<ForwardingConnection>> getAllClients();
 
 protected:
     NuRaftStateManager() = default;
@@ -88,6 +105,8 @@ private:
     int32_t my_internal_port;
 
     std::unordered_set<int> start_as_follower_servers;
+    bool witness = false;
+    String upstream;
 
     String log_dir;
     ptr<log_store> curr_log_store;
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <charconv>
+#include <string_view>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Znode path helpers which do not allocate, results refer to the argument.
+ *
+ * Paths are absolute and normalized, "/" is the root, the parent of "/a" is "/".
+ */
+
+inline std::string_view parentPathView(std::string_view path)
+{
+    auto rslash_pos = path.rfind('/');
+    if (rslash_pos > 0)
+        return path.substr(0, rslash_pos);
+    return "/";
+}
+
+inline std::string_view baseNameView(std::string_view path)
+{
+    return path.substr(path.rfind('/') + 1);
+}
+
+inline String parentPath(std::string_view path)
+{
+    return String(parentPathView(path));
+}
+
+inline String getBaseName(std::string_view path)
+{
+    return String(baseNameView(path));
+}
+
+/// Width of the suffix of sequential znodes
+static constexpr size_t SEQUENTIAL_SUFFIX_WIDTH = 10;
+
+/// Append seq_num padded with '0' to SEQUENTIAL_SUFFIX_WIDTH, same as std::setw(10) << std::setfill('0').
+inline void appendSequentialSuffix(String & path, int32_t seq_num)
+{
+    char digits[16];
+    size_t length = std::to_chars(digits, digits + sizeof(digits), seq_num).ptr - digits;
+
+    if (length < SEQUENTIAL_SUFFIX_WIDTH)
+        path.append(SEQUENTIAL_SUFFIX_WIDTH - length, '0');
+    path.append(digits, length);
+}
+
+/// Path of child in parent, child is a base name.
+inline String childPath(std::string_view parent, std::string_view child)
+{
+    String path;
+    path.reserve(parent.size() + 1 + child.size());
+    path.append(parent);
+    if (parent.empty() || parent.back() != '/')
+        path.push_back('/');
+    path.append(child);
+    return path;
+}
+
+}
@@ -0,0 +1,212 @@
+#include <Service/PipelineStageThreads.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <common/getThreadId.h>
+
+namespace RK
+{
+
+String toString(PipelineStage stage)
+{
+    switch (stage)
+    {
+        case PipelineStage::Reactor:
+            return "reactor";
+        case PipelineStage::Dispatcher:
+            return "dispatcher";
+        case PipelineStage::Accumulator:
+            return "accumulator";
+        case PipelineStage::Forwarder:
+            return "forwarder";
+        case PipelineStage::NuRaft:
+            return "nuraft";
+        case PipelineStage::Processor:
+            return "processor";
+        case PipelineStage::Response:
+            return "response";
+        case PipelineStage::Snapshot:
+            return "snapshot";
+        case PipelineStage::Fsync:
+            return "fsync";
+    }
+    __builtin_unreachable();
+}
+
+PipelineStageThreads & PipelineStageThreads::instance()
+{
+    static PipelineStageThreads stage_threads;
+    return stage_threads;
+}
+
+PipelineStageThreads::Counters & PipelineStageThreads::Counters::operator+=(const Counters & other)
+{
+    cpu_ns += other.cpu_ns;
+    cpu_wait_ns += other.cpu_wait_ns;
+    io_wait_ns += other.io_wait_ns;
+    voluntary_switches += other.voluntary_switches;
+    involuntary_switches += other.involuntary_switches;
+    return *this;
+}
+
+PipelineStageThreads::Counters PipelineStageThreads::Counters::operator-(const Counters & other) const
+{
+    auto diff = [](UInt64 curr, UInt64 prev) { return curr >= prev ? curr - prev : 0; };
+    Counters ret;
+    ret.cpu_ns = diff(cpu_ns, other.cpu_ns);
+    ret.cpu_wait_ns = diff(cpu_wait_ns, other.cpu_wait_ns);
+    ret.io_wait_ns = diff(io_wait_ns, other.io_wait_ns);
+    ret.voluntary_switches = diff(voluntary_switches, other.voluntary_switches);
+    ret.involuntary_switches = diff(involuntary_switches, other.involuntary_switches);
+    return ret;
+}
+
+PipelineStageThreads::Counters PipelineStageThreads::read([[maybe_unused]] pid_t tid)
+{
+    Counters counters;
+#if defined(OS_LINUX)
+    String task = "/proc/self/task/" + std::to_string(tid);
+    static const UInt64 ns_per_tick = 1000000000 / std::max<long>(sysconf(_SC_CLK_TCK), 1);
+
+    /// <on cpu ns> <waiting for cpu ns> <timeslices>
+    std::ifstream schedstat(task + "/schedstat");
+    bool has_schedstat = static_cast<bool>(schedstat >> counters.cpu_ns >> counters.cpu_wait_ns);
+
+    /// Fields after the command, which may contain spaces, start from the state, field 3 of proc(5)
+    std::ifstream stat_file(task + "/stat");
+    String stat((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+    if (auto comm_end = stat.rfind(')'); comm_end != String::npos)
+    {
+        std::istringstream fields(stat.substr(comm_end + 1));
+        std::vector<String> values;
+        for (String value; fields >> value;)
+            values.push_back(std::move(value));
+        auto field = [&values](size_t number) { return number - 3 < values.size() ? std::stoull(values[number - 3]) : 0; };
+        /// utime and stime in ticks, only if the kernel has no schedstat
+        if (!has_schedstat)
+            counters.cpu_ns = (field(14) + field(15)) * ns_per_tick;
+        counters.io_wait_ns = field(42) * ns_per_tick;
+    }
+
+    std::ifstream status(task + "/status");
+    for (String line; std::getline(status, line);)
+    {
+        if (line.starts_with("voluntary_ctxt_switches:"))
+            counters.voluntary_switches = std::stoull(line.substr(line.find(':') + 1));
+        else if (line.starts_with("nonvoluntary_ctxt_switches:"))
+            counters.involuntary_switches = std::stoull(line.substr(line.find(':') + 1));
+    }
+#endif
+    return counters;
+}
+
+bool PipelineStageThreads::enter(PipelineStage stage)
+{
+    pid_t tid = static_cast<pid_t>(getThreadId());
+    {
+        std::lock_guard lock(mutex);
+        if (threads.contains(tid))
+            return false;
+    }
+    /// Read out of the lock, the thread is only registered by itself
+    Counters baseline = reader(tid);
+    std::lock_guard lock(mutex);
+    threads.emplace(tid, Thread{stage, baseline});
+    return true;
+}
+
+void PipelineStageThreads::leave()
+{
+    pid_t tid = static_cast<pid_t>(getThreadId());
+    Counters counters = reader(tid);
+    std::lock_guard lock(mutex);
+    auto it = threads.find(tid);
+    if (it == threads.end())
+        return;
+    retired[static_cast<size_t>(it->second.stage)] += counters - it->second.baseline;
+    threads.erase(it);
+}
+
+PipelineStageThreads::Scope::Scope(PipelineStage stage, PipelineStageThreads & stage_threads_)
+    : stage_threads(stage_threads_), registered(stage_threads.enter(stage))
+{
+}
+
+PipelineStageThreads::Scope::~Scope()
+{
+    if (registered)
+        stage_threads.leave();
+}
+
+void PipelineStageThreads::attach(PipelineStage stage)
+{
+    struct Attached
+    {
+        bool done = false;
+        bool registered = false;
+        ~Attached()
+        {
+            if (registered)
+                instance().leave();
+        }
+    };
+    static thread_local Attached attached;
+    if (attached.done)
+        return;
+    attached.done = true;
+    attached.registered = instance().enter(stage);
+}
+
+std::vector<PipelineStageStats> PipelineStageThreads::collect()
+{
+    std::vector<std::pair<pid_t, Thread>> snapshot;
+    std::array<Counters, PIPELINE_STAGE_COUNT> totals;
+    {
+        std::lock_guard lock(mutex);
+        snapshot.assign(threads.begin(), threads.end());
+        totals = retired;
+    }
+
+    /// procfs is read out of the lock, a thread leaving meanwhile may be counted twice until the next sample
+    std::array<size_t, PIPELINE_STAGE_COUNT> thread_counts{};
+    for (const auto & [tid, thread] : snapshot)
+    {
+        auto stage = static_cast<size_t>(thread.stage);
+        totals[stage] += reader(tid) - thread.baseline;
+        ++thread_counts[stage];
+    }
+
+    std::lock_guard lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto interval = now - last_sample_time;
+    if (interval >= MIN_SAMPLE_INTERVAL)
+    {
+        auto interval_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count());
+        for (size_t i = 0; i < PIPELINE_STAGE_COUNT; ++i)
+        {
+            auto cpu_ns = (totals[i] - last_sample[i]).cpu_ns;
+            utilization[i] = thread_counts[i] ? 100.0 * static_cast<double>(cpu_ns) / interval_ns / thread_counts[i] : 0;
+        }
+        last_sample = totals;
+        last_sample_time = now;
+    }
+
+    std::vector<PipelineStageStats> stats(PIPELINE_STAGE_COUNT);
+    for (size_t i = 0; i < PIPELINE_STAGE_COUNT; ++i)
+    {
+        stats[i].name = toString(static_cast<PipelineStage>(i));
+        stats[i].threads = thread_counts[i];
+        stats[i].cpu_us = totals[i].cpu_ns / 1000;
+        stats[i].cpu_wait_us = totals[i].cpu_wait_ns / 1000;
+        stats[i].io_wait_us = totals[i].io_wait_ns / 1000;
+        stats[i].voluntary_switches = totals[i].voluntary_switches;
+        stats[i].involuntary_switches = totals[i].involuntary_switches;
+        stats[i].utilization = static_cast<UInt64>(std::lround(utilization[i]));
+    }
+    return stats;
+}
+
+}
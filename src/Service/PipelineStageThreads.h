@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+#include <boost/noncopyable.hpp>
+#include <common/types.h>
+
+namespace RK
+{
+
+/// Stages of the request pipeline whose threads are accounted
+enum class PipelineStage : UInt8
+{
+    Reactor,
+    Dispatcher,
+    Accumulator,
+    Forwarder,
+    NuRaft,
+    Processor,
+    Response,
+    Snapshot,
+    Fsync,
+};
+
+static constexpr size_t PIPELINE_STAGE_COUNT = static_cast<size_t>(PipelineStage::Fsync) + 1;
+
+String toString(PipelineStage stage);
+
+/// Resource usage of the threads of a stage, times in microseconds
+struct PipelineStageStats
+{
+    String name;
+    size_t threads = 0;
+    /// On CPU
+    UInt64 cpu_us = 0;
+    /// Runnable but waiting for a CPU
+    UInt64 cpu_wait_us = 0;
+    /// Blocked on block IO, needs delay accounting in the kernel
+    UInt64 io_wait_us = 0;
+    UInt64 voluntary_switches = 0;
+    UInt64 involuntary_switches = 0;
+    /// Percent of the time of the threads on CPU, over the interval since the last sample
+    UInt64 utilization = 0;
+};
+
+/** CPU time, CPU wait, IO wait and context switches of each pipeline stage, to see which stage is the bottleneck
+  * without a profiler.
+  *
+  * A thread of a stage registers itself, then its counters are read from /proc/self/task/<tid> when the stats are
+  * collected, which needs no permissions unlike taskstats of TaskStatsInfoGetter. Counters are taken from the
+  * registration on, so a thread of the global pool is not charged for its earlier jobs, and what a thread used is kept
+  * in its stage after it leaves. Utilization is over the interval since the last sample, samples are at least
+  * MIN_SAMPLE_INTERVAL apart so that mntr and scrapes of the metrics port share them.
+  */
+class PipelineStageThreads : private boost::noncopyable
+{
+public:
+    static constexpr auto MIN_SAMPLE_INTERVAL = std::chrono::seconds(1);
+
+    struct Counters
+    {
+        UInt64 cpu_ns = 0;
+        UInt64 cpu_wait_ns = 0;
+        UInt64 io_wait_ns = 0;
+        UInt64 voluntary_switches = 0;
+        UInt64 involuntary_switches = 0;
+
+        Counters & operator+=(const Counters & other);
+        Counters operator-(const Counters & other) const;
+    };
+    using CountersReader = std::function<Counters(pid_t tid)>;
+
+    static PipelineStageThreads & instance();
+
+    /// Counters of threads are read by reader instead of from procfs, for tests
+    explicit PipelineStageThreads(CountersReader reader_) : reader(std::move(reader_)) { }
+
+    /// Account the current thread to stage while the scope lives, for threads running a loop of their own
+    class Scope : private boost::noncopyable
+    {
+    public:
+        explicit Scope(PipelineStage stage, PipelineStageThreads & stage_threads_ = instance());
+        ~Scope();
+
+    private:
+        PipelineStageThreads & stage_threads;
+        bool registered;
+    };
+
+    /// Account the current thread to stage until it exits, unless it is accounted already.
+    /// For the threads of pools and of NuRaft, which are called on their first request. Cheap after the first call.
+    static void attach(PipelineStage stage);
+
+    std::vector<PipelineStageStats> collect();
+
+private:
+    PipelineStageThreads() = default;
+
+    struct Thread
+    {
+        PipelineStage stage;
+        Counters baseline;
+    };
+
+    static Counters read(pid_t tid);
+    CountersReader reader = &PipelineStageThreads::read;
+
+    bool enter(PipelineStage stage);
+    void leave();
+
+    std::mutex mutex;
+    std::unordered_map<pid_t, Thread> threads;
+    /// Used by the threads which left
+    std::array<Counters, PIPELINE_STAGE_COUNT> retired;
+
+    std::chrono::steady_clock::time_point last_sample_time = std::chrono::steady_clock::now();
+    std::array<Counters, PIPELINE_STAGE_COUNT> last_sample;
+    std::array<double, PIPELINE_STAGE_COUNT> utilization{};
+};
+
+}
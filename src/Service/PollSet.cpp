@@ -11,6 +11,7 @@
 #include <Poco/Thread.h>
 #include <iostream>
 #include <Poco/Logger.h>
+#include <atomic>
 #include <common/logger_useful.h>
 
 
@@ -26,6 +27,12 @@ using Poco::Net::SocketImpl;
 
 namespace RK {
 
+namespace
+{
+	/// Mode of PollSets created from now on
+	std::atomic<bool> edge_triggered_default{false};
+}
+
 #if defined(POCO_HAVE_FD_EPOLL)
 
 
@@ -39,10 +46,12 @@ private:
 public:
 	PollSetImpl(): _epollfd(epoll_create(1)),
 		_events(1024),
-		_eventfd(eventfd(0, EFD_NONBLOCK))
+		_eventfd(eventfd(0, EFD_NONBLOCK)),
+		_edgeTriggered(edge_triggered_default.load())
 	{
         log = &Poco::Logger::get("PollSet");
-		int err = addImpl(_eventfd, PollSet::POLL_READ, log);
+		/// The eventfd counter is read as a whole, level triggered it is
+		int err = addImpl(_eventfd, PollSet::POLL_READ, log, false);
 		if ((err) || (_epollfd < 0))
 		{
 			errno;
@@ -60,7 +69,7 @@ public:
 
 		SocketImpl* sockImpl = socket.impl();
 
-		int err = addImpl(sockImpl->sockfd(), mode, sockImpl);
+		int err = addImpl(sockImpl->sockfd(), mode, sockImpl, _edgeTriggered);
 
 		if (err)
 		{
@@ -104,14 +113,9 @@ public:
 	{
 		poco_socket_t fd = socket.impl()->sockfd();
 		struct epoll_event ev;
-		ev.events = 0;
-		if (mode & PollSet::POLL_READ)
-			ev.events |= EPOLLIN;
-		if (mode & PollSet::POLL_WRITE)
-			ev.events |= EPOLLOUT;
-		if (mode & PollSet::POLL_ERROR)
-			ev.events |= EPOLLERR;
+		ev.events = eventsOf(mode, _edgeTriggered);
 		ev.data.ptr = socket.impl();
+		/// Modifying also rearms an edge triggered socket, it is reported again if it is ready
 		int err = epoll_ctl(_epollfd, EPOLL_CTL_MOD, fd, &ev);
 		if (err)
 		{
@@ -206,17 +210,30 @@ public:
 		return static_cast<int>(_socketMap.size());
 	}
 
+	bool isEdgeTriggered() const
+	{
+		return _edgeTriggered;
+	}
+
 private:
-	int addImpl(int fd, int mode, void* ptr)
+	static uint32_t eventsOf(int mode, bool edgeTriggered)
 	{
-		struct epoll_event ev;
-		ev.events = 0;
+		uint32_t events = 0;
 		if (mode & PollSet::POLL_READ)
-			ev.events |= EPOLLIN;
+			events |= EPOLLIN;
 		if (mode & PollSet::POLL_WRITE)
-			ev.events |= EPOLLOUT;
+			events |= EPOLLOUT;
 		if (mode & PollSet::POLL_ERROR)
-			ev.events |= EPOLLERR;
+			events |= EPOLLERR;
+		if (edgeTriggered)
+			events |= EPOLLET;
+		return events;
+	}
+
+	int addImpl(int fd, int mode, void* ptr, bool edgeTriggered)
+	{
+		struct epoll_event ev;
+		ev.events = eventsOf(mode, edgeTriggered);
 		ev.data.ptr = ptr;
 		return epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev);
 	}
@@ -226,6 +243,7 @@ private:
 	std::map<void*, Socket>         _socketMap;
 	std::vector<struct epoll_event> _events;
 	int                             _eventfd;
+	const bool                      _edgeTriggered;
 };
 
 
@@ -410,6 +428,12 @@ public:
 		return static_cast<int>(_socketMap.size());
 	}
 
+	bool isEdgeTriggered() const
+	{
+		/// poll has no edge triggered mode
+		return false;
+	}
+
 private:
 
 	void setMode(short& target, int mode)
@@ -492,6 +516,18 @@ PollSet::SocketModeMap PollSet::poll(const Poco::Timespan& timeout)
 }
 
 
+void PollSet::setEdgeTriggered(bool edgeTriggered)
+{
+	edge_triggered_default.store(edgeTriggered);
+}
+
+
+bool PollSet::isEdgeTriggered() const
+{
+	return _pImpl->isEdgeTriggered();
+}
+
+
 int PollSet::count() const
 {
 	return _pImpl->count();
@@ -71,6 +71,17 @@ public:
 		/// Wakes up a waiting PollSet.
 		/// On platforms/implementations where this functionality
 		/// is not available, it does nothing.
+
+	static void setEdgeTriggered(bool edgeTriggered);
+		/// Sets whether PollSets created from now on are edge triggered.
+		///
+		/// An edge triggered PollSet reports a socket only when it becomes
+		/// ready again, so handlers must read and write until the socket
+		/// would block. Only supported with epoll, elsewhere PollSets are
+		/// level triggered anyway.
+
+	bool isEdgeTriggered() const;
+		/// Returns true if the PollSet is edge triggered.
 private:
 	PollSetImpl* _pImpl;
 
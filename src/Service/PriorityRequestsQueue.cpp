@@ -0,0 +1,235 @@
+#include <Service/PriorityRequestsQueue.h>
+
+namespace RK
+{
+
+PriorityRequestsQueue::Lane PriorityRequestsQueue::laneOf(const Coordination::ZooKeeperRequest & request)
+{
+    using Coordination::OpNum;
+    switch (request.getOpNum())
+    {
+        case OpNum::RegisterSession:
+        case OpNum::ExpireSessions:
+        case OpNum::RemoveExpiredNodes:
+        case OpNum::Close:
+        case OpNum::Auth:
+        case OpNum::SetACL:
+        case OpNum::Heartbeat:
+            return CONTROL;
+        default:
+            return request.isReadRequest() ? READ : WRITE;
+    }
+}
+
+PriorityRequestsQueue::Group::Group(size_t lane_capacity, UInt64 weight) : stride(STRIDE / std::clamp(weight, 1ul, STRIDE))
+{
+    for (auto & lane : lanes)
+        lane = std::make_unique<Queue>(lane_capacity);
+}
+
+PriorityRequestsQueue::Shard::Shard(size_t lane_capacity, const std::vector<UInt64> & group_weights)
+{
+    groups.reserve(group_weights.size());
+    for (UInt64 weight : group_weights)
+        groups.emplace_back(lane_capacity, weight);
+}
+
+PriorityRequestsQueue::PriorityRequestsQueue(size_t child_queue_size, size_t lane_capacity, const std::vector<UInt64> & group_weights)
+    : group_count(group_weights.size())
+{
+    assert(child_queue_size > 0);
+    assert(lane_capacity > 0);
+    assert(group_count > 0 && group_count <= ClientGroups::MAX_GROUPS);
+
+    shards.reserve(child_queue_size);
+    for (size_t i = 0; i < child_queue_size; i++)
+        shards.push_back(std::make_unique<Shard>(std::max(1ul, lane_capacity / child_queue_size), group_weights));
+}
+
+bool PriorityRequestsQueue::pushImpl(RequestForSession && request, std::optional<UInt64> wait_ms)
+{
+    auto & shard = shardFor(request.session_id);
+
+    /// Requests of a session are pushed by one thread, so the lane can not change before the push below
+    size_t group = std::min(request.client_group, group_count - 1);
+    Lane lane = laneOf(*request.request);
+    {
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.sessions.try_emplace(request.session_id, SessionLane{group, lane, 0}).first;
+        group = it->second.group;
+        lane = it->second.lane;
+        ++it->second.count;
+
+        /// A group becoming busy does not catch up on the time it was idle
+        auto & busy_group = shard.groups[group];
+        if (busy_group.queued++ == 0)
+            busy_group.pass = std::max(busy_group.pass, shard.pass);
+    }
+
+    /// Raised before the push so that it never goes below the number of requests in lanes
+    shard.queued.fetch_add(1, std::memory_order_relaxed);
+
+    auto & queue = *shard.groups[group].lanes[lane];
+    int64_t session_id = request.session_id;
+    bool pushed = wait_ms ? queue.tryPush(std::move(request), *wait_ms) : queue.push(std::move(request));
+    if (!pushed)
+    {
+        shard.queued.fetch_sub(1, std::memory_order_relaxed);
+        std::lock_guard lock(shard.mutex);
+        release(shard, group, session_id);
+        return false;
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (shard.waiters.load(std::memory_order_relaxed))
+    {
+        {
+            std::lock_guard lock(shard.mutex);
+        }
+        shard.condition.notify_one();
+    }
+    return true;
+}
+
+void PriorityRequestsQueue::release(Shard & shard, size_t group, int64_t session_id)
+{
+    --shard.groups[group].queued;
+    auto it = shard.sessions.find(session_id);
+    if (it != shard.sessions.end() && --it->second.count == 0)
+        shard.sessions.erase(it);
+}
+
+bool PriorityRequestsQueue::tryPopGroup(Shard & shard, size_t group_id, RequestForSession & request)
+{
+    auto & group = shard.groups[group_id];
+    size_t first = (group.pops + 1) % WRITE_TURN == 0 ? WRITE : CONTROL;
+    for (size_t i = 0; i < LANES; ++i)
+    {
+        if (group.lanes[(first + i) % LANES]->tryPop(request))
+        {
+            ++group.pops;
+            shard.pass = group.pass;
+            group.pass += group.stride;
+            shard.queued.fetch_sub(1, std::memory_order_relaxed);
+            release(shard, group_id, request.session_id);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PriorityRequestsQueue::tryPopOnce(Shard & shard, RequestForSession & request)
+{
+    if (!shard.queued.load(std::memory_order_relaxed))
+        return false;
+
+    std::lock_guard lock(shard.mutex);
+    /// Groups in the order of their virtual time, a group whose requests are still on their way into the lanes is skipped
+    UInt64 tried = 0;
+    for (size_t i = 0; i < group_count; ++i)
+    {
+        size_t next = group_count;
+        for (size_t group = 0; group < group_count; ++group)
+        {
+            const auto & candidate = shard.groups[group];
+            if (candidate.queued && !(tried >> group & 1) && (next == group_count || candidate.pass < shard.groups[next].pass))
+                next = group;
+        }
+        if (next == group_count)
+            return false;
+        if (tryPopGroup(shard, next, request))
+            return true;
+        tried |= 1ul << next;
+    }
+    return false;
+}
+
+bool PriorityRequestsQueue::tryPop(size_t queue_id, RequestForSession & request, UInt64 wait_ms)
+{
+    assert(queue_id < shards.size());
+    auto & shard = *shards[queue_id];
+
+    if (tryPopOnce(shard, request))
+        return true;
+    if (!wait_ms)
+        return false;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
+    while (true)
+    {
+        {
+            std::unique_lock lock(shard.mutex);
+            shard.waiters.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool ready = shard.condition.wait_until(lock, deadline, [&] { return shard.queued.load(std::memory_order_relaxed) > 0; });
+            shard.waiters.fetch_sub(1, std::memory_order_relaxed);
+            if (!ready)
+                return false;
+        }
+
+        /// The request may still be on its way into the lane, then wait again
+        if (tryPopOnce(shard, request))
+            return true;
+    }
+}
+
+bool PriorityRequestsQueue::tryPopAny(RequestForSession & request, UInt64 wait_ms)
+{
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        if (tryPop(i, request, wait_ms))
+            return true;
+    }
+    return false;
+}
+
+size_t PriorityRequestsQueue::size() const
+{
+    size_t size{};
+    for (const auto & shard : shards)
+        for (const auto & group : shard->groups)
+            for (const auto & lane : group.lanes)
+                size += lane->size();
+    return size;
+}
+
+size_t PriorityRequestsQueue::size(Lane lane) const
+{
+    size_t size{};
+    for (const auto & shard : shards)
+        for (const auto & group : shard->groups)
+            size += group.lanes[lane]->size();
+    return size;
+}
+
+size_t PriorityRequestsQueue::shardSize(int64_t session_id, Lane lane) const
+{
+    size_t size{};
+    for (const auto & group : shardFor(session_id).groups)
+        size += group.lanes[lane]->size();
+    return size;
+}
+
+size_t PriorityRequestsQueue::groupSize(size_t group) const
+{
+    size_t size{};
+    for (const auto & shard : shards)
+    {
+        std::lock_guard lock(shard->mutex);
+        size += shard->groups[group].queued;
+    }
+    return size;
+}
+
+UInt64 PriorityRequestsQueue::groupPops(size_t group) const
+{
+    UInt64 pops{};
+    for (const auto & shard : shards)
+    {
+        std::lock_guard lock(shard->mutex);
+        pops += shard->groups[group].pops;
+    }
+    return pops;
+}
+
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+#include <Service/ClientGroups.h>
+#include <Service/RequestsQueue.h>
+
+namespace RK
+{
+
+/** Requests of the dispatcher in three priority lanes sharded by session id, every shard is popped
+ * by one request thread.
+ *
+ * Control requests (session creation and expiry, close, auth, set ACL and heartbeat) are popped
+ * first, then reads, then writes, so that they do not wait behind bulk traffic. Every
+ * WRITE_TURN-th pop of a shard starts from the write lane, so writes are never starved.
+ *
+ * Every shard has the lanes for each client group, see ClientGroups. A request thread takes the next
+ * request from the group with queued requests of the least virtual time, by stride scheduling: a pop
+ * advances the virtual time of its group by STRIDE / weight, and a group becoming busy again starts
+ * at the virtual time of the shard, so that it does not catch up on the time it was idle. Busy groups
+ * thus share the request threads, and the runners and the accumulator behind them, by their weights.
+ *
+ * Requests of a session keep their order: while a session has requests in a lane, its new requests
+ * go to the same lane of the same group whatever their priority and group.
+ */
+class PriorityRequestsQueue
+{
+public:
+    using RequestForSession = KeeperStore::RequestForSession;
+    using Queue = RequestsQueue::Queue;
+
+    enum Lane : uint8_t
+    {
+        CONTROL = 0,
+        READ = 1,
+        WRITE = 2,
+    };
+
+    static constexpr size_t LANES = 3;
+    static constexpr size_t WRITE_TURN = 8;
+    static constexpr UInt64 STRIDE = 1 << 20;
+
+    static Lane laneOf(const Coordination::ZooKeeperRequest & request);
+
+    /// group_weights are of the client groups, the capacity of a lane is of every group
+    PriorityRequestsQueue(size_t child_queue_size, size_t lane_capacity, const std::vector<UInt64> & group_weights = {1});
+
+    /// Returns false if the queue is finished. The request is moved into the queue only if it is pushed.
+    bool push(const RequestForSession & request) { return pushImpl(RequestForSession(request), std::nullopt); }
+    bool push(RequestForSession && request) { return pushImpl(std::move(request), std::nullopt); }
+    /// Returns false if the request was not pushed during wait_ms
+    bool tryPush(const RequestForSession & request, UInt64 wait_ms = 0) { return pushImpl(RequestForSession(request), wait_ms); }
+    bool tryPush(RequestForSession && request, UInt64 wait_ms = 0) { return pushImpl(std::move(request), wait_ms); }
+
+    bool tryPop(size_t queue_id, RequestForSession & request, UInt64 wait_ms = 0);
+    bool tryPopAny(RequestForSession & request, UInt64 wait_ms = 0);
+
+    size_t size() const;
+    /// Requests in lane of all shards
+    size_t size(Lane lane) const;
+    /// Requests in lane of the shard of session
+    size_t shardSize(int64_t session_id, Lane lane) const;
+    bool empty() const { return size() == 0; }
+
+    size_t groupCount() const { return group_count; }
+    /// Requests of a client group queued in all shards, and popped from them
+    size_t groupSize(size_t group) const;
+    UInt64 groupPops(size_t group) const;
+
+private:
+    /// Group and lane of a session which has requests queued, and the number of them
+    struct SessionLane
+    {
+        size_t group;
+        Lane lane;
+        size_t count;
+    };
+
+    struct Group
+    {
+        Group(size_t lane_capacity, UInt64 weight);
+
+        std::unique_ptr<Queue> lanes[LANES];
+        UInt64 stride;
+
+        /// Under the mutex of the shard
+        size_t queued = 0;
+        UInt64 pass = 0;
+        UInt64 pops = 0;
+    };
+
+    struct Shard
+    {
+        Shard(size_t lane_capacity, const std::vector<UInt64> & group_weights);
+
+        std::vector<Group> groups;
+
+        std::mutex mutex;
+        std::unordered_map<int64_t, SessionLane> sessions;
+        /// Virtual time of the last pop
+        UInt64 pass = 0;
+
+        /// Requests in all lanes, consumers park on condition when it is 0
+        std::atomic<size_t> queued{0};
+        std::atomic<size_t> waiters{0};
+        std::condition_variable condition;
+    };
+
+    bool pushImpl(RequestForSession && request, std::optional<UInt64> wait_ms);
+    bool tryPopOnce(Shard & shard, RequestForSession & request);
+    /// Under the mutex of the shard
+    bool tryPopGroup(Shard & shard, size_t group, RequestForSession & request);
+    void release(Shard & shard, size_t group, int64_t session_id);
+
+    Shard & shardFor(int64_t session_id) { return *shards[static_cast<uint64_t>(session_id) % shards.size()]; }
+    const Shard & shardFor(int64_t session_id) const { return *shards[static_cast<uint64_t>(session_id) % shards.size()]; }
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t group_count;
+};
+
+}
@@ -0,0 +1,81 @@
+#include <Service/ReadIndexTracker.h>
+#include <algorithm>
+#include <chrono>
+
+namespace RK
+{
+
+UInt64 ReadIndexTracker::join()
+{
+    std::lock_guard lock(mutex);
+    if (!next_round_joined && !sent_round)
+        condition.notify_one();
+    next_round_joined = true;
+    return next_round;
+}
+
+std::optional<UInt64> ReadIndexTracker::waitRound(UInt64 wait_ms)
+{
+    std::unique_lock lock(mutex);
+    if (!condition.wait_for(
+            lock, std::chrono::milliseconds(wait_ms), [this] { return shutdown_called || (next_round_joined && !sent_round); })
+        || shutdown_called)
+        return {};
+
+    sent_round = next_round++;
+    next_round_joined = false;
+    return sent_round;
+}
+
+void ReadIndexTracker::confirm(UInt64 round, UInt64 index)
+{
+    std::lock_guard lock(mutex);
+    if (round == sent_round)
+        sent_round = 0;
+
+    if (confirmed.empty() || round > confirmed.back().first)
+    {
+        /// The commit index never goes back, so neither does the index of later rounds
+        if (!confirmed.empty())
+            index = std::max(index, confirmed.back().second);
+        confirmed.emplace_back(round, index);
+        if (confirmed.size() > MAX_CONFIRMED_ROUNDS)
+            confirmed.pop_front();
+    }
+
+    if (next_round_joined)
+        condition.notify_one();
+}
+
+void ReadIndexTracker::fail(UInt64 round)
+{
+    std::lock_guard lock(mutex);
+    if (round != sent_round)
+        return;
+
+    sent_round = 0;
+    /// Reads of round are kept waiting, the next round is sent even if no read joins it
+    next_round_joined = true;
+    condition.notify_one();
+}
+
+std::optional<UInt64> ReadIndexTracker::indexOf(UInt64 round) const
+{
+    std::lock_guard lock(mutex);
+    if (confirmed.empty() || confirmed.back().first < round)
+        return {};
+
+    /// The first round confirmed since round was sent
+    auto it = std::lower_bound(
+        confirmed.begin(), confirmed.end(), round, [](const auto & confirmed_round, UInt64 value) { return confirmed_round.first < value; });
+    return it->second;
+}
+
+void ReadIndexTracker::shutdown()
+{
+    std::lock_guard lock(mutex);
+    shutdown_called = true;
+    condition.notify_all();
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Rounds of read index requests which make reads linearizable.
+ *
+ * A read joins the next round when it arrives and only one round is in flight at a time, so all the
+ * reads arriving during a round trip to the leader share the next round. A round is confirmed with
+ * the commit index of the leader when it handled the round, which is not less than the commit index
+ * when any read of the round arrived, and a read is served once the local state is applied up to it.
+ */
+class ReadIndexTracker
+{
+public:
+    /// Round of a read arriving now, never 0
+    UInt64 join();
+
+    /// Wait until some read joined the next round and no round is in flight, then send it.
+    /// Return nullopt on timeout or shutdown.
+    std::optional<UInt64> waitRound(UInt64 wait_ms);
+
+    /// Round was confirmed with the commit index of the leader
+    void confirm(UInt64 round, UInt64 index);
+    /// Round failed, its reads are confirmed by the next round
+    void fail(UInt64 round);
+
+    /// Index reads in round wait for, nullopt if round is not confirmed yet
+    std::optional<UInt64> indexOf(UInt64 round) const;
+
+    void shutdown();
+
+private:
+    /// Confirmed rounds kept, an older round waits for the oldest one kept
+    static constexpr size_t MAX_CONFIRMED_ROUNDS = 64;
+
+    mutable std::mutex mutex;
+    std::condition_variable condition;
+
+    /// Round new reads join
+    UInt64 next_round = 1;
+    bool next_round_joined = false;
+    /// Round in flight, 0 if none
+    UInt64 sent_round = 0;
+
+    /// <round, index> ascending in both
+    std::deque<std::pair<UInt64, UInt64>> confirmed;
+
+    bool shutdown_called = false;
+};
+
+}
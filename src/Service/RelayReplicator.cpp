@@ -0,0 +1,293 @@
+#include <Service/RelayReplicator.h>
+
+#include <IO/ReadHelpers.h>
+#include <Service/NuRaftFileLogStore.h>
+#include <Service/NuRaftStateMachine.h>
+#include <Service/NuRaftStateManager.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/StreamCopier.h>
+#include <Common/Exception.h>
+#include <Common/Stopwatch.h>
+#include <Common/setThreadName.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int NETWORK_ERROR;
+}
+
+namespace
+{
+    UInt64 nowMilliseconds()
+    {
+        return clock_gettime_ns(CLOCK_MONOTONIC_COARSE) / 1000000;
+    }
+
+    nuraft::ptr<nuraft::buffer> toBuffer(const String & data)
+    {
+        auto buf = nuraft::buffer::alloc(data.size());
+        buf->put_raw(reinterpret_cast<const nuraft::byte *>(data.data()), data.size());
+        buf->pos(0);
+        return buf;
+    }
+}
+
+UInt64 RelayDownstreams::nowMilliseconds() const
+{
+    return clock ? clock() : RK::nowMilliseconds();
+}
+
+void RelayDownstreams::fetched(int32_t server_id, UInt64 applied_index)
+{
+    std::lock_guard lock(mutex);
+    downstreams[server_id] = Downstream{server_id, applied_index, nowMilliseconds()};
+}
+
+std::vector<RelayDownstreams::Downstream> RelayDownstreams::get() const
+{
+    std::lock_guard lock(mutex);
+    std::vector<Downstream> result;
+    result.reserve(downstreams.size());
+    for (const auto & [_, downstream] : downstreams)
+        result.push_back(downstream);
+    return result;
+}
+
+UInt64 RelayDownstreams::retentionFloor(UInt64 retention_ms) const
+{
+    UInt64 now = nowMilliseconds();
+    UInt64 floor = 0;
+    std::lock_guard lock(mutex);
+    for (const auto & [_, downstream] : downstreams)
+        if (downstream.last_fetch_ms + retention_ms >= now && (!floor || downstream.applied_index + 1 < floor))
+            floor = downstream.applied_index + 1;
+    return floor;
+}
+
+RelayReplicator::RelayReplicator(
+    const String & upstream_,
+    int32_t server_id_,
+    nuraft::ptr<NuRaftStateMachine> state_machine_,
+    nuraft::ptr<NuRaftStateManager> state_manager_,
+    RaftSettingsPtr raft_settings_)
+    : upstream(upstream_)
+    , server_id(server_id_)
+    , state_machine(std::move(state_machine_))
+    , state_manager(std::move(state_manager_))
+    , raft_settings(std::move(raft_settings_))
+    , log(&Poco::Logger::get("RelayReplicator"))
+{
+    applied_index = state_machine->last_commit_index();
+    if (auto snapshot = state_machine->last_snapshot())
+        last_snapshot_index = snapshot->get_last_log_idx();
+}
+
+RelayReplicator::~RelayReplicator()
+{
+    shutdown();
+}
+
+void RelayReplicator::start()
+{
+    LOG_INFO(log, "Replicate from upstream {} after log index {}", upstream, applied_index.load());
+    thread = ThreadFromGlobalPool([this] { run(); });
+}
+
+void RelayReplicator::shutdown()
+{
+    {
+        std::lock_guard lock(shutdown_mutex);
+        if (shutdown_called)
+            return;
+        shutdown_called = true;
+    }
+    shutdown_cv.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+bool RelayReplicator::isUpstreamAlive() const
+{
+    UInt64 last = last_answer_ms.load(std::memory_order_relaxed);
+    return last && last + ALIVE_MS >= nowMilliseconds();
+}
+
+UInt64 RelayReplicator::requestSnapshot()
+{
+    snapshot_requested = true;
+    return applied_index.load();
+}
+
+RelayReplicator::Stats RelayReplicator::getStats() const
+{
+    Stats stats;
+    stats.upstream = upstream;
+    stats.applied_index = applied_index.load(std::memory_order_relaxed);
+    stats.upstream_commit_index = upstream_commit_index.load(std::memory_order_relaxed);
+    stats.source_commit_index = source_commit_index.load(std::memory_order_relaxed);
+    stats.upstream_alive = isUpstreamAlive();
+    stats.stalled = stalled.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void RelayReplicator::run()
+{
+    setThreadName("RelayRepl");
+
+    std::unique_ptr<Poco::Net::HTTPClientSession> session;
+    while (true)
+    {
+        bool retry = false;
+        try
+        {
+            if (!session)
+            {
+                session = std::make_unique<Poco::Net::HTTPClientSession>(Poco::Net::SocketAddress(upstream));
+                session->setTimeout(Poco::Timespan((FETCH_WAIT_MS + raft_settings->operation_timeout_ms) * 1000));
+                session->setKeepAlive(true);
+            }
+            retry = !fetch(*session);
+            maybeSnapshot();
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Failed to replicate from upstream " + upstream);
+            session.reset();
+            retry = true;
+        }
+
+        std::unique_lock lock(shutdown_mutex);
+        if (retry)
+            shutdown_cv.wait_for(lock, std::chrono::milliseconds(RETRY_MS), [this] { return shutdown_called; });
+        if (shutdown_called)
+            break;
+    }
+}
+
+bool RelayReplicator::fetch(Poco::Net::HTTPClientSession & session)
+{
+    UInt64 from = applied_index.load() + 1;
+    Poco::Net::HTTPRequest request(
+        Poco::Net::HTTPRequest::HTTP_GET,
+        fmt::format("/log?from={}&server={}&wait_ms={}", from, server_id, FETCH_WAIT_MS),
+        Poco::Net::HTTPMessage::HTTP_1_1);
+    session.sendRequest(request);
+
+    Poco::Net::HTTPResponse response;
+    auto & in = session.receiveResponse(response);
+    String body;
+    Poco::StreamCopier::copyToString(in, body);
+
+    auto status = response.getStatus();
+    if (status == Poco::Net::HTTPResponse::HTTP_GONE)
+    {
+        last_answer_ms = nowMilliseconds();
+        if (!stalled.exchange(true))
+            LOG_ERROR(log, "Upstream {} compacted its log before index {}, restart this server with empty data", upstream, from);
+        return false;
+    }
+    if (status != Poco::Net::HTTPResponse::HTTP_OK && status != Poco::Net::HTTPResponse::HTTP_NO_CONTENT)
+        throw Exception(ErrorCodes::NETWORK_ERROR, "Upstream {} answered {} {}: {}", upstream, status, response.getReason(), body);
+
+    leader = parse<Int32>(response.get(LEADER_HEADER));
+    upstream_commit_index = parse<UInt64>(response.get(COMMIT_INDEX_HEADER));
+    source_commit_index = parse<UInt64>(response.get(SOURCE_COMMIT_INDEX_HEADER));
+    last_answer_ms = nowMilliseconds();
+    stalled = false;
+
+    if (status == Poco::Net::HTTPResponse::HTTP_OK && !body.empty())
+        apply(from, *toBuffer(body));
+    return true;
+}
+
+void RelayReplicator::apply(UInt64 from, nuraft::buffer & pack)
+{
+    auto log_store = state_manager->load_log_store();
+    /// Entries after the applied index are not committed, e.g. the tail of the log before a restart, and are replaced
+    log_store->apply_pack(from, pack);
+
+    UInt64 end = log_store->next_slot();
+    for (UInt64 index = from; index < end; ++index)
+    {
+        auto entry = log_store->entry_at(index);
+        /// Config changes are of the Raft cluster, this server is not a member of it
+        if (entry->get_val_type() == nuraft::log_val_type::app_log)
+            state_machine->commit(index, entry->get_buf());
+        applied_index = index;
+    }
+}
+
+void RelayReplicator::maybeSnapshot()
+{
+    UInt64 index = state_machine->last_commit_index();
+    bool requested = snapshot_requested.load();
+    if (index <= last_snapshot_index || (!requested && index < last_snapshot_index + raft_settings->snapshot_distance))
+        return;
+    /// Outside of the snapshot window or creating one, requested snapshots are retried after the next fetch
+    if (state_machine->getSnapshoting() || !state_machine->chk_create_snapshot())
+        return;
+
+    snapshot_requested = false;
+    auto log_store = state_manager->load_log_store();
+    nuraft::snapshot snapshot(index, log_store->term_at(index), state_manager->get_cluster_config());
+    nuraft::async_result<bool>::handler_type when_done = [this, index](bool & done, nuraft::ptr<std::exception> &)
+    {
+        if (!done)
+            return;
+        last_snapshot_index = index;
+        compactLog(index);
+    };
+    LOG_INFO(log, "Create snapshot at log index {}", index);
+    state_machine->create_snapshot(snapshot, when_done);
+}
+
+void RelayReplicator::compactLog(UInt64 snapshot_index)
+{
+    UInt64 reserved = raft_settings->reserved_log_items;
+    if (snapshot_index <= reserved)
+        return;
+    auto log_store = state_manager->load_log_store();
+    if (snapshot_index - reserved >= log_store->start_index())
+        log_store->compact(snapshot_index - reserved);
+}
+
+nuraft::ptr<nuraft::cmd_result<nuraft::ptr<nuraft::buffer>>> RelayReplicator::appendEntry(const nuraft::ptr<nuraft::buffer> & entry)
+{
+    auto result = nuraft::cs_new<nuraft::cmd_result<nuraft::ptr<nuraft::buffer>>>();
+    nuraft::ptr<nuraft::buffer> response_data;
+    nuraft::ptr<std::exception> error;
+    try
+    {
+        Poco::Net::HTTPClientSession session(Poco::Net::SocketAddress(upstream));
+        session.setTimeout(Poco::Timespan(raft_settings->operation_timeout_ms * 1000));
+
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/append", Poco::Net::HTTPMessage::HTTP_1_1);
+        request.setContentType("application/octet-stream");
+        request.setContentLength(entry->size());
+        session.sendRequest(request).write(reinterpret_cast<const char *>(entry->data_begin()), entry->size());
+
+        Poco::Net::HTTPResponse response;
+        String body;
+        Poco::StreamCopier::copyToString(session.receiveResponse(response), body);
+        if (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK)
+        {
+            response_data = toBuffer(body);
+            result->accept();
+            result->set_result(response_data, error);
+            return result;
+        }
+        LOG_WARNING(log, "Upstream {} did not append session entry: {}", upstream, body);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to append session entry by upstream " + upstream);
+    }
+    result->set_result(response_data, error, nuraft::cmd_result_code::FAILED);
+    return result;
+}
+
+}
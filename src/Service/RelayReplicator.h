@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <Service/Settings.h>
+#include <libnuraft/nuraft.hxx>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Common/ThreadPool.h>
+#include <common/logger_useful.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+class NuRaftStateMachine;
+class NuRaftStateManager;
+
+/** The servers replicating from this one as their relay, by the fetches of its committed log, see RelayReplicator.
+  */
+class RelayDownstreams
+{
+public:
+    struct Downstream
+    {
+        int32_t server_id;
+        /// Log index the downstream applied, the one before the index it fetched from
+        UInt64 applied_index;
+        /// Monotonic time of its last fetch
+        UInt64 last_fetch_ms;
+    };
+
+    /// Monotonic milliseconds, tests pass their own clock
+    using Clock = std::function<UInt64()>;
+
+    explicit RelayDownstreams(Clock clock_ = {}) : clock(std::move(clock_)) { }
+
+    void fetched(int32_t server_id, UInt64 applied_index);
+
+    std::vector<Downstream> get() const;
+
+    /// First log index not applied by the downstreams which fetched within retention_ms, 0 if there is none
+    UInt64 retentionFloor(UInt64 retention_ms) const;
+
+private:
+    UInt64 nowMilliseconds() const;
+
+    Clock clock;
+    mutable std::mutex mutex;
+    std::map<int32_t, Downstream> downstreams;
+};
+
+/** Replicate this server from its upstream relay instead of the leader, so that the leader sends the log once to a
+  * relay in every region rather than to every observer there. A server is replicated so if its <upstream> in the
+  * cluster config is the metrics endpoint, host:port, of its relay. It is then left out of the Raft cluster config
+  * of the other servers, the leader does not know it, and it is a learner of its own config which receives nothing.
+  *
+  * The replicator long polls GET /log of the relay for the committed log after the applied index, applies the packs
+  * of entries to the log store and commits them to the state machine, as NuRaft does with the entries of a leader.
+  * It snapshots and compacts the log by snapshot_distance and reserved_log_items as NuRaft does too. Any server can
+  * be a relay, a replicated one as well, so relays cascade. A relay keeps the log its downstreams have not applied,
+  * see RaftSettings::relay_log_retention_ms. A server without data copies the last snapshot of its relay before it
+  * starts, see fetchSnapshotFromPeers. One behind the log of its relay stalls until restarted with empty data, as
+  * a snapshot cannot be installed into a running state machine.
+  *
+  * Writes are forwarded to the leader the relay reports as on any follower, their responses are sent when the
+  * entries arrive from the relay. Session entries are appended through the relay, see appendEntry.
+  */
+class RelayReplicator
+{
+public:
+    /// Headers of the responses of GET /log
+    static constexpr auto COMMIT_INDEX_HEADER = "X-Commit-Index";
+    static constexpr auto SOURCE_COMMIT_INDEX_HEADER = "X-Source-Commit-Index";
+    static constexpr auto LEADER_HEADER = "X-Leader";
+    /// Entries of a pack at most
+    static constexpr UInt64 MAX_PACK_ENTRIES = 1024;
+    /// A fetch waits at most this long for new entries
+    static constexpr UInt64 FETCH_WAIT_MS = 1000;
+
+    RelayReplicator(
+        const String & upstream_,
+        int32_t server_id_,
+        nuraft::ptr<NuRaftStateMachine> state_machine_,
+        nuraft::ptr<NuRaftStateManager> state_manager_,
+        RaftSettingsPtr raft_settings_);
+
+    ~RelayReplicator();
+
+    void start();
+    void shutdown();
+
+    /// Leader the upstream reports, -1 if unknown
+    int32_t getLeader() const { return leader.load(std::memory_order_relaxed); }
+    /// The upstream answered a fetch lately
+    bool isUpstreamAlive() const;
+
+    UInt64 getAppliedIndex() const { return applied_index.load(std::memory_order_relaxed); }
+    /// Commit index of the leader as of the last fetch
+    UInt64 getSourceCommitIndex() const { return source_commit_index.load(std::memory_order_relaxed); }
+
+    /// Append a session entry by the upstream, see NuRaftStateMachine::commit. The result is set when it answers.
+    nuraft::ptr<nuraft::cmd_result<nuraft::ptr<nuraft::buffer>>> appendEntry(const nuraft::ptr<nuraft::buffer> & entry);
+
+    /// Snapshot the applied state after the next fetch, return the index it is applied to now
+    UInt64 requestSnapshot();
+
+    struct Stats
+    {
+        String upstream;
+        UInt64 applied_index;
+        UInt64 upstream_commit_index;
+        UInt64 source_commit_index;
+        bool upstream_alive;
+        /// The upstream no longer has the log after the applied index
+        bool stalled;
+    };
+    Stats getStats() const;
+
+private:
+    /// Retry interval after a failed fetch
+    static constexpr UInt64 RETRY_MS = 1000;
+    /// The upstream is alive if it answered within this
+    static constexpr UInt64 ALIVE_MS = 3 * FETCH_WAIT_MS;
+
+    void run();
+    /// Fetch and apply the entries after the applied index, false if the upstream has not the log from it
+    bool fetch(Poco::Net::HTTPClientSession & session);
+    void apply(UInt64 from, nuraft::buffer & pack);
+    /// Snapshot as NuRaft does after snapshot_distance entries or when requested
+    void maybeSnapshot();
+    void compactLog(UInt64 snapshot_index);
+
+    const String upstream;
+    const int32_t server_id;
+    nuraft::ptr<NuRaftStateMachine> state_machine;
+    nuraft::ptr<NuRaftStateManager> state_manager;
+    RaftSettingsPtr raft_settings;
+    Poco::Logger * log;
+
+    std::atomic<UInt64> applied_index{0};
+    std::atomic<UInt64> last_snapshot_index{0};
+    std::atomic<bool> snapshot_requested{false};
+
+    std::atomic<int32_t> leader{-1};
+    std::atomic<UInt64> upstream_commit_index{0};
+    std::atomic<UInt64> source_commit_index{0};
+    /// Monotonic time of the last answer of the upstream
+    std::atomic<UInt64> last_answer_ms{0};
+    std::atomic<bool> stalled{false};
+
+    std::mutex shutdown_mutex;
+    std::condition_variable shutdown_cv;
+    bool shutdown_called{false};
+    ThreadFromGlobalPool thread;
+};
+
+}
@@ -1,60 +1,190 @@
 #include <Service/KeeperDispatcher.h>
+#include <Service/PipelineStageThreads.h>
 #include <Service/RequestAccumulator.h>
+#include <Common/SpinWait.h>
+#include <Common/setThreadAffinity.h>
 #include <Common/setThreadName.h>
+#include <algorithm>
 
 namespace RK
 {
 
 void RequestAccumulator::push(RequestForSession request_for_session)
 {
-    requests_queue->push(request_for_session);
+    requests_queue->push(std::move(request_for_session));
 }
 
+bool RequestAccumulator::tryPush(RequestForSession && request_for_session, UInt64 wait_ms)
+{
+    return requests_queue->tryPush(std::move(request_for_session), wait_ms);
+}
+
+
+namespace
+{
+
+/// Cheap estimation of the log entry size of request, the exact size is only known after serializing.
+UInt64 estimateRequestBytes(const Coordination::ZooKeeperRequest & request)
+{
+    static constexpr UInt64 ENTRY_OVERHEAD = 64;
+
+    if (const auto * create = dynamic_cast<const Coordination::ZooKeeperCreateRequest *>(&request))
+        return ENTRY_OVERHEAD + create->path.size() + create->data.size();
+    if (const auto * set = dynamic_cast<const Coordination::ZooKeeperSetRequest *>(&request))
+        return ENTRY_OVERHEAD + set->path.size() + set->data.size();
+    if (const auto * multi = dynamic_cast<const Coordination::ZooKeeperMultiRequest *>(&request))
+    {
+        UInt64 bytes = ENTRY_OVERHEAD;
+        for (const auto & sub_request : multi->requests)
+            bytes += estimateRequestBytes(dynamic_cast<const Coordination::ZooKeeperRequest &>(*sub_request));
+        return bytes;
+    }
+    return ENTRY_OVERHEAD + request.getPath().size();
+}
+
+UInt64 nowMicroseconds()
+{
+    return clock_gettime_ns() / 1000;
+}
+
+}
 
 void RequestAccumulator::run(RunnerId runner_id)
 {
     setThreadName(("ReqAccumu-" + toString(runner_id)).c_str());
-
-    NuRaftResult result = nullptr;
+    setThreadAffinity(keeper_dispatcher->getKeeperConfigurationAndSettings()->accumulator_cpus);
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Accumulator);
 
     KeeperStore::RequestsForSessions to_append_batch;
+    UInt64 batch_bytes = 0;
+    Stopwatch batch_watch;
     UInt64 max_wait = operation_timeout_ms;
+    auto & policy = *batch_policies[runner_id];
+    UInt64 limits_version = batch_limits_version.load();
 
-    while (!shutdown_called)
+    auto add_to_batch = [&](KeeperStore::RequestForSession && request_for_session)
     {
-        KeeperStore::RequestForSession request_for_session;
+        if (to_append_batch.empty())
+            batch_watch.restart();
+        batch_bytes += estimateRequestBytes(*request_for_session.request);
+        to_append_batch.emplace_back(std::move(request_for_session));
+    };
 
-        bool pop_succ = false;
+    while (!shutdown_called)
+    {
         if (to_append_batch.empty())
         {
-            pop_succ = requests_queue->tryPop(runner_id, request_for_session, std::min(static_cast<uint64_t>(1000), max_wait));
-        }
-        else
-        {
-            if (!requests_queue->tryPop(runner_id, request_for_session))
+            if (limits_version != batch_limits_version.load(std::memory_order_relaxed))
             {
-                result = server->putRequestBatch(to_append_batch);
-                waitResultAndHandleError(result, to_append_batch);
-                result.reset();
-                to_append_batch.clear();
-                continue;
+                std::lock_guard lock(batch_limits_mutex);
+                limits_version = batch_limits_version.load();
+                policy.setLimits(batch_limits.max_batch_size, batch_limits.max_batch_bytes, batch_limits.latency_target_us);
             }
-            pop_succ = true;
+
+            KeeperStore::RequestForSession request_for_session;
+            if (!spinUntil([&] { return requests_queue->tryPop(runner_id, request_for_session); }, spin_wait_us)
+                && !requests_queue->tryPop(runner_id, request_for_session, std::min(static_cast<uint64_t>(1000), max_wait)))
+                continue;
+            add_to_batch(std::move(request_for_session));
+            policy.onArrival(1, nowMicroseconds());
         }
 
-        if (pop_succ)
-        {
-            to_append_batch.emplace_back(request_for_session);
+        /// Take what is queued at once
+        size_t old_size = to_append_batch.size();
+        size_t room = policy.batchSize() - std::min(policy.batchSize(), old_size);
+        size_t popped = requests_queue->tryPopMany(runner_id, to_append_batch, room);
+        for (size_t i = old_size; i < to_append_batch.size(); ++i)
+            batch_bytes += estimateRequestBytes(*to_append_batch[i].request);
+        policy.onArrival(popped, nowMicroseconds());
 
-            if (to_append_batch.size() >= max_batch_size)
+        AdaptiveBatchPolicy::FlushReason reason;
+        if (policy.isFull(to_append_batch.size(), batch_bytes))
+        {
+            reason = AdaptiveBatchPolicy::SIZE;
+        }
+        else if (popped == 0)
+        {
+            /// The queue is drained, wait a little for the next request only if it is likely to come soon
+            UInt64 linger = policy.lingerMicroseconds();
+            UInt64 elapsed = batch_watch.elapsedMicroseconds();
+            if (linger > elapsed)
             {
-                result = server->putRequestBatch(to_append_batch);
-                waitResultAndHandleError(result, to_append_batch);
-                result.reset();
-                to_append_batch.clear();
+                KeeperStore::RequestForSession request_for_session;
+                if (requests_queue->tryPopMicro(runner_id, request_for_session, linger - elapsed))
+                {
+                    add_to_batch(std::move(request_for_session));
+                    policy.onArrival(1, nowMicroseconds());
+                    continue;
+                }
             }
+            reason = linger ? AdaptiveBatchPolicy::TIME : AdaptiveBatchPolicy::IDLE;
+        }
+        else
+        {
+            continue;
+        }
+
+        policy.onFlush(to_append_batch.size(), reason);
+        submitBatch(runner_id, to_append_batch);
+        to_append_batch.clear();
+        batch_bytes = 0;
+    }
+}
+
+void RequestAccumulator::submitBatch(RunnerId runner_id, KeeperStore::RequestsForSessions & batch)
+{
+    auto & inflight = *inflights[runner_id];
+    auto & policy = *batch_policies[runner_id];
+
+    auto entry = std::make_shared<InflightBatch>();
+    entry->batch.swap(batch);
+    {
+        std::unique_lock lock(inflight.mutex);
+        inflight.cv.wait(lock, [&] { return inflight.batches.size() < max_inflight_batches || shutdown_called; });
+
+        for (auto latency : inflight.commit_latencies)
+            policy.onCommitted(latency);
+        inflight.commit_latencies.clear();
+
+        inflight.batches.push_back(entry);
+    }
+
+    entry->watch.restart();
+    entry->result = server->putRequestBatch(entry->batch);
+    /// Called at once if the result is ready, such as in blocking return method. The handler is kept by the result of
+    /// entry, so it holds entry weakly, entry is alive in the inflight batches until it is done.
+    entry->result->when_ready([this, runner_id, weak_entry = std::weak_ptr<InflightBatch>(entry)](auto &, auto &)
+    {
+        if (auto done_entry = weak_entry.lock())
+            onBatchDone(runner_id, done_entry);
+    });
+}
+
+void RequestAccumulator::onBatchDone(RunnerId runner_id, const std::shared_ptr<InflightBatch> & entry)
+{
+    auto & inflight = *inflights[runner_id];
+    {
+        std::lock_guard lock(inflight.mutex);
+        entry->done = true;
+
+        /// Results are handled in submission order, a batch done early waits for the ones before it
+        while (!inflight.batches.empty() && inflight.batches.front()->done)
+        {
+            auto head = std::move(inflight.batches.front());
+            inflight.batches.pop_front();
+            waitResultAndHandleError(head->result, head->batch);
+            inflight.commit_latencies.push_back(head->watch.elapsedMicroseconds());
         }
     }
+    inflight.cv.notify_all();
+}
+
+std::vector<AdaptiveBatchPolicy::Stats> RequestAccumulator::getBatchStats() const
+{
+    std::vector<AdaptiveBatchPolicy::Stats> stats;
+    for (const auto & policy : batch_policies)
+        stats.push_back(policy->getStats());
+    return stats;
 }
 
 bool RequestAccumulator::waitResultAndHandleError(NuRaftResult prev_result, const KeeperStore::RequestsForSessions & prev_batch)
@@ -65,19 +195,30 @@ bool RequestAccumulator::waitResultAndHandleError(NuRaftResult prev_result, cons
         prev_result->get();
 
     bool result_accepted = prev_result->get_accepted();
+    bool succeeded = result_accepted && prev_result->get_result_code() == nuraft::cmd_result_code::OK;
+
+    /// Results of the requests of a forwarding connection are sent by one write, a batch has few connections
+    std::vector<std::pair<std::pair<int32_t, int32_t>, std::vector<ForwardResponse>>> forward_responses;
 
     for (const auto & request_session : prev_batch)
     {
+        if (!succeeded)
+            server->getKeeperStateMachine()->forgetAppendedRequest(request_session);
+
         if (request_session.isForwardRequest())
         {
-            ForwardResponse response{
-                Result,
-                result_accepted,
-                prev_result->get_result_code(),
-                request_session.session_id,
-                request_session.request->xid,
-                request_session.request->getOpNum()};
-            keeper_dispatcher->sendAppendEntryResponse(request_session.server_id, request_session.client_id, response);
+            std::pair<int32_t, int32_t> connection{request_session.server_id, request_session.client_id};
+            auto it = std::find_if(
+                forward_responses.begin(), forward_responses.end(), [&](const auto & responses) { return responses.first == connection; });
+            if (it == forward_responses.end())
+                it = forward_responses.insert(forward_responses.end(), {connection, {}});
+            it->second.push_back(
+                {Result,
+                 result_accepted,
+                 prev_result->get_result_code(),
+                 request_session.session_id,
+                 request_session.request->xid,
+                 request_session.request->getOpNum()});
         }
         else if (!result_accepted || prev_result->get_result_code() != nuraft::cmd_result_code::OK)
         {
@@ -90,7 +231,10 @@ bool RequestAccumulator::waitResultAndHandleError(NuRaftResult prev_result, cons
         }
     }
 
-    return result_accepted && prev_result->get_result_code() == nuraft::cmd_result_code::OK;
+    for (const auto & [connection, responses] : forward_responses)
+        keeper_dispatcher->sendAppendEntryResponses(connection.first, connection.second, responses.data(), responses.size());
+
+    return succeeded;
 }
 
 void RequestAccumulator::shutdown()
@@ -101,6 +245,11 @@ void RequestAccumulator::shutdown()
     LOG_INFO(log, "Shutting down request processor!");
 
     shutdown_called = true;
+    for (auto & inflight : inflights)
+    {
+        std::lock_guard lock(inflight->mutex);
+        inflight->cv.notify_all();
+    }
 
     KeeperStore::RequestForSession request_for_session;
     while (requests_queue->tryPopAny(request_for_session))
@@ -119,13 +268,23 @@ void RequestAccumulator::initialize(
     std::shared_ptr<KeeperDispatcher> keeper_dispatcher_,
     std::shared_ptr<KeeperServer> server_,
     UInt64 operation_timeout_ms_,
-    UInt64 max_batch_size_)
+    UInt64 max_batch_size_,
+    UInt64 max_batch_bytes_,
+    UInt64 batch_latency_target_ms_,
+    UInt64 max_inflight_batches_)
 {
     keeper_dispatcher = keeper_dispatcher_;
     operation_timeout_ms = operation_timeout_ms_;
-    max_batch_size = max_batch_size_;
+    spin_wait_us = keeper_dispatcher->getKeeperConfigurationAndSettings()->spin_wait_us;
+    max_inflight_batches = std::max<UInt64>(1, max_inflight_batches_);
+    batch_limits = {max_batch_size_, max_batch_bytes_, batch_latency_target_ms_ * 1000};
     server = server_;
     requests_queue = std::make_shared<RequestsQueue>(runner_count, 20000);
+    for (size_t i = 0; i < runner_count; i++)
+    {
+        batch_policies.push_back(std::make_unique<AdaptiveBatchPolicy>(max_batch_size_, max_batch_bytes_, batch_latency_target_ms_ * 1000));
+        inflights.push_back(std::make_unique<InflightBatches>());
+    }
     request_thread = std::make_shared<ThreadPool>(runner_count);
     for (size_t i = 0; i < runner_count; i++)
     {
@@ -133,4 +292,37 @@ void RequestAccumulator::initialize(
     }
 }
 
+void RequestAccumulator::setBatchLimits(
+    UInt64 max_batch_size_, UInt64 max_batch_bytes_, UInt64 batch_latency_target_ms_, UInt64 max_inflight_batches_)
+{
+    {
+        std::lock_guard lock(batch_limits_mutex);
+        BatchLimits limits{max_batch_size_, max_batch_bytes_, batch_latency_target_ms_ * 1000};
+        if (limits.max_batch_size != batch_limits.max_batch_size || limits.max_batch_bytes != batch_limits.max_batch_bytes
+            || limits.latency_target_us != batch_limits.latency_target_us)
+        {
+            LOG_INFO(
+                log,
+                "Batch limits change to max_batch_size {}, max_batch_bytes {}, batch_latency_target_ms {}",
+                max_batch_size_,
+                max_batch_bytes_,
+                batch_latency_target_ms_);
+            batch_limits = limits;
+            ++batch_limits_version;
+        }
+    }
+
+    UInt64 max_inflight = std::max<UInt64>(1, max_inflight_batches_);
+    if (max_inflight_batches.exchange(max_inflight) != max_inflight)
+    {
+        LOG_INFO(log, "Max inflight batches change to {}", max_inflight);
+        /// Runners waiting for room may have it now
+        for (auto & inflight : inflights)
+        {
+            std::lock_guard lock(inflight->mutex);
+            inflight->cv.notify_all();
+        }
+    }
+}
+
 }
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <Service/AdaptiveBatchPolicy.h>
 #include <Service/KeeperServer.h>
 #include <Service/RequestProcessor.h>
 #include <Service/RequestsQueue.h>
 #include <Service/Types.h>
+#include <Common/Stopwatch.h>
+#include <condition_variable>
+#include <deque>
 
 namespace RK
 {
@@ -11,7 +15,9 @@ namespace RK
 /** Accumulate requests into a batch to promote performance.
  * Request in a batch must be all write request.
  *
- * The batch is transferred to Raft and goes through log replication flow.
+ * The batch is transferred to Raft and goes through log replication flow. Batch size is decided by
+ * AdaptiveBatchPolicy of the runner. Every runner keeps up to max_inflight_batches batches in flight,
+ * their results are handled in submission order when they are ready.
  */
 class RequestAccumulator
 {
@@ -25,6 +31,8 @@ public:
     }
 
     void push(RequestForSession request_for_session);
+    /// Wait at most wait_ms for room, request_for_session is moved only if pushed
+    bool tryPush(RequestForSession && request_for_session, UInt64 wait_ms);
 
     bool waitResultAndHandleError(NuRaftResult prev_result, const KeeperStore::RequestsForSessions & prev_batch);
 
@@ -37,9 +45,41 @@ public:
         std::shared_ptr<KeeperDispatcher> keeper_dispatcher_,
         std::shared_ptr<KeeperServer> server_,
         UInt64 operation_timeout_ms_,
-        UInt64 max_batch_size_);
+        UInt64 max_batch_size_,
+        UInt64 max_batch_bytes_,
+        UInt64 batch_latency_target_ms_,
+        UInt64 max_inflight_batches_);
+
+    /// Batch policy stats of every runner
+    std::vector<AdaptiveBatchPolicy::Stats> getBatchStats() const;
+
+    /// Change the batch limits at runtime, runners apply them before their next batch
+    void setBatchLimits(UInt64 max_batch_size_, UInt64 max_batch_bytes_, UInt64 batch_latency_target_ms_, UInt64 max_inflight_batches_);
 
 private:
+    struct InflightBatch
+    {
+        KeeperStore::RequestsForSessions batch;
+        NuRaftResult result;
+        Stopwatch watch;
+        bool done = false;
+    };
+
+    struct InflightBatches
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        /// In submission order
+        std::deque<std::shared_ptr<InflightBatch>> batches;
+        /// Commit latencies of handled batches not fed to the batch policy yet
+        std::vector<UInt64> commit_latencies;
+    };
+
+    /// Append batch to Raft, wait while the runner has max_inflight_batches in flight. batch is moved out.
+    void submitBatch(RunnerId runner_id, KeeperStore::RequestsForSessions & batch);
+    /// Result of entry is ready, handle it and the ready ones after it.
+    void onBatchDone(RunnerId runner_id, const std::shared_ptr<InflightBatch> & entry);
+
     Poco::Logger * log;
 
     ptr<RequestsQueue> requests_queue;
@@ -52,7 +92,23 @@ private:
     std::shared_ptr<RequestProcessor> request_processor;
 
     UInt64 operation_timeout_ms;
-    UInt64 max_batch_size;
+    /// Spin before waiting for requests
+    UInt64 spin_wait_us = 0;
+    std::vector<std::unique_ptr<AdaptiveBatchPolicy>> batch_policies;
+
+    struct BatchLimits
+    {
+        UInt64 max_batch_size;
+        UInt64 max_batch_bytes;
+        UInt64 latency_target_us;
+    };
+    std::mutex batch_limits_mutex;
+    BatchLimits batch_limits{};
+    /// Bumped by setBatchLimits
+    std::atomic<UInt64> batch_limits_version{0};
+
+    std::atomic<UInt64> max_inflight_batches{1};
+    std::vector<std::unique_ptr<InflightBatches>> inflights;
 };
 
 }
@@ -0,0 +1,22 @@
+#include <Service/RequestArena.h>
+
+namespace RK
+{
+
+thread_local RequestArena::ThreadState RequestArena::thread_state;
+
+void RequestArena::enter()
+{
+    if (thread_state.depth++ == 0 && !thread_state.arena)
+        thread_state.arena = std::make_unique<Arena>(INITIAL_SIZE);
+}
+
+void RequestArena::release()
+{
+    if (thread_state.arena->size() > MAX_RETAINED_SIZE)
+        thread_state.arena.reset();
+    else
+        thread_state.arena->clear();
+}
+
+}
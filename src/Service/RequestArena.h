@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <vector>
+#include <Common/Arena.h>
+
+namespace RK
+{
+
+/** Bump arena of the thread for what a request allocates and frees before its response is queued, e.g. the undo
+  * records of a multi, the watch responses fired by a write and their split by the shards of the responses queue.
+  * It is released wholesale when the outermost RequestArenaScope of the thread exits, so once the arena grew to the
+  * working size of the requests the thread applies, those allocations do not reach the general purpose allocator.
+  *
+  * Only containers destroyed within the scope may allocate from it, nothing allocated from it may be kept by a
+  * response or anything else outliving the request.
+  */
+class RequestArena
+{
+public:
+    static Arena & get()
+    {
+        assert(thread_state.depth > 0);
+        return *thread_state.arena;
+    }
+
+private:
+    friend class RequestArenaScope;
+
+    /// Chunk of a new arena
+    static constexpr size_t INITIAL_SIZE = 64 * 1024;
+    /// An arena grown beyond this, e.g. by a huge multi, is dropped on release instead of being kept by the thread
+    static constexpr size_t MAX_RETAINED_SIZE = 4 * 1024 * 1024;
+
+    struct ThreadState
+    {
+        std::unique_ptr<Arena> arena;
+        size_t depth = 0;
+    };
+    static thread_local ThreadState thread_state;
+
+    static void enter();
+    static void release();
+};
+
+/// Allocations of the request arena may be done within it, nested scopes release nothing
+class RequestArenaScope
+{
+public:
+    RequestArenaScope() { RequestArena::enter(); }
+    ~RequestArenaScope()
+    {
+        if (--RequestArena::thread_state.depth == 0)
+            RequestArena::release();
+    }
+
+    RequestArenaScope(const RequestArenaScope &) = delete;
+    RequestArenaScope & operator=(const RequestArenaScope &) = delete;
+};
+
+/// Allocator of standard containers allocating from the request arena, deallocation does nothing
+template <typename T>
+struct RequestArenaAllocator
+{
+    using value_type = T;
+
+    RequestArenaAllocator() = default;
+    template <typename U>
+    RequestArenaAllocator(const RequestArenaAllocator<U> &) { } /// NOLINT
+
+    T * allocate(size_t n) { return reinterpret_cast<T *>(RequestArena::get().alignedAlloc(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) { }
+
+    template <typename U>
+    bool operator==(const RequestArenaAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const RequestArenaAllocator<U> &) const { return false; }
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, RequestArenaAllocator<T>>;
+
+}
@@ -0,0 +1,182 @@
+#include <Service/RequestCapture.h>
+
+#include <IO/VarInt.h>
+#include <IO/WriteHelpers.h>
+#include <Poco/File.h>
+#include <Common/Exception.h>
+#include <Common/Stopwatch.h>
+#include <Common/setThreadName.h>
+#include <common/logger_useful.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int BAD_ARGUMENTS;
+    extern const int CANNOT_READ_ALL_DATA;
+}
+
+RequestCapture::~RequestCapture()
+{
+    try
+    {
+        stop();
+    }
+    catch (...)
+    {
+        tryLogCurrentException(&Poco::Logger::get("RequestCapture"), "Failed to stop request capture");
+    }
+}
+
+String RequestCapture::start(const String & dir, UInt64 max_bytes_)
+{
+    std::lock_guard lock(mutex);
+    if (active || write_thread.joinable())
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "Requests are already being captured into {}", path);
+    if (dir.empty())
+        throw Exception(ErrorCodes::BAD_ARGUMENTS, "Request capture is disabled, keeper.request_capture_dir is not set");
+
+    Poco::File(dir).createDirectories();
+    path = dir + "/requests_" + toString(time(nullptr)) + ".rkcap";
+    out = std::make_unique<WriteBufferFromFile>(path, DBMS_DEFAULT_BUFFER_SIZE, O_WRONLY | O_CREAT | O_EXCL);
+    out->write(MAGIC, MAGIC_SIZE);
+
+    buffer.clear();
+    last_us = 0;
+    bytes = MAGIC_SIZE;
+    max_bytes = max_bytes_;
+    stopping = false;
+    write_thread = ThreadFromGlobalPool([this] { writeThread(); });
+    active.store(true, std::memory_order_relaxed);
+
+    LOG_INFO(&Poco::Logger::get("RequestCapture"), "Capturing requests into {}, at most {} bytes", path, max_bytes);
+    return path;
+}
+
+String RequestCapture::stop()
+{
+    {
+        std::lock_guard lock(mutex);
+        if (!write_thread.joinable())
+            return {};
+        active.store(false, std::memory_order_relaxed);
+        stopping = true;
+    }
+    cv.notify_all();
+    write_thread.join();
+
+    std::lock_guard lock(mutex);
+    LOG_INFO(&Poco::Logger::get("RequestCapture"), "Captured {} bytes of requests into {}", bytes, path);
+    return path;
+}
+
+std::pair<String, UInt64> RequestCapture::getStatus() const
+{
+    std::lock_guard lock(mutex);
+    return {path, bytes};
+}
+
+void RequestCapture::record(int64_t session_id, const char * frame, size_t length)
+{
+    char header[sizeof(session_id) + 2 * 10];
+    memcpy(header, &session_id, sizeof(session_id));
+
+    bool flush = false;
+    {
+        std::lock_guard lock(mutex);
+        if (!active.load(std::memory_order_relaxed))
+            return;
+
+        /// Read under the mutex, so that the requests in the file are in time order
+        UInt64 now_us = clock_gettime_ns() / 1000;
+        char * pos = writeVarUInt(last_us ? now_us - last_us : 0, header + sizeof(session_id));
+        pos = writeVarUInt(length, pos);
+        last_us = now_us;
+
+        size_t record_bytes = pos - header + length;
+        if (bytes + record_bytes > max_bytes)
+        {
+            /// Full, the write thread finishes the file
+            active.store(false, std::memory_order_relaxed);
+            stopping = true;
+            flush = true;
+        }
+        else
+        {
+            buffer.append(header, pos);
+            buffer.append(frame, length);
+            bytes += record_bytes;
+            flush = buffer.size() >= DBMS_DEFAULT_BUFFER_SIZE;
+        }
+    }
+    if (flush)
+        cv.notify_all();
+}
+
+void RequestCapture::writeThread()
+{
+    setThreadName("ReqCapture");
+    auto * log = &Poco::Logger::get("RequestCapture");
+
+    String batch;
+    while (true)
+    {
+        bool last;
+        {
+            std::unique_lock lock(mutex);
+            cv.wait_for(lock, std::chrono::milliseconds(100), [this] { return stopping || buffer.size() >= DBMS_DEFAULT_BUFFER_SIZE; });
+            batch.swap(buffer);
+            last = stopping;
+        }
+
+        try
+        {
+            out->write(batch.data(), batch.size());
+            if (last)
+            {
+                out->next();
+                out->sync();
+                out.reset();
+            }
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Failed to write captured requests, capture is stopped");
+            active.store(false, std::memory_order_relaxed);
+            out.reset();
+            last = true;
+        }
+        batch.clear();
+
+        if (last)
+            break;
+    }
+}
+
+RequestCaptureReader::RequestCaptureReader(const String & path) : in(path)
+{
+    char magic[RequestCapture::MAGIC_SIZE];
+    if (in.read(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, RequestCapture::MAGIC, sizeof(magic)) != 0)
+        throw Exception(ErrorCodes::CANNOT_READ_ALL_DATA, "{} is not a request capture", path);
+}
+
+bool RequestCaptureReader::next(CapturedRequest & request)
+{
+    if (in.eof())
+        return false;
+
+    in.readStrict(reinterpret_cast<char *>(&request.session_id), sizeof(request.session_id));
+    UInt64 delta_us;
+    readVarUInt(delta_us, in);
+    UInt64 length;
+    readVarUInt(length, in);
+    request.frame.resize(length);
+    in.readStrict(request.frame.data(), length);
+
+    offset_us += delta_us;
+    request.offset_us = offset_us;
+    return true;
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <IO/ReadBufferFromFile.h>
+#include <IO/WriteBufferFromFile.h>
+#include <Common/ThreadPool.h>
+
+namespace RK
+{
+
+/** Records the request frames clients send to this server with their session and receive time, to replay them
+ * later with the benchmark tool as the traffic of production.
+ *
+ * File layout: the magic "RKCAPT01", then per request the session id as Int64, the microseconds since the previous
+ * request as VarUInt, the frame length as VarUInt and the frame, which is xid, opnum and the body of the request in
+ * the ZooKeeper protocol. Handshakes, heartbeats and auth requests, which carry credentials, are not recorded.
+ *
+ * Recording appends to a memory buffer under a mutex, a background thread writes it, so a receiving thread never
+ * waits for the disk. Inactive, the cost is a relaxed load in isActive.
+ */
+class RequestCapture
+{
+public:
+    static constexpr char MAGIC[] = "RKCAPT01";
+    static constexpr size_t MAGIC_SIZE = sizeof(MAGIC) - 1;
+
+    ~RequestCapture();
+
+    /// Start recording into a new file in dir, return its path. Throws if already recording.
+    String start(const String & dir, UInt64 max_bytes_);
+    /// Return the path of the stopped recording, or empty if there was none
+    String stop();
+
+    bool isActive() const { return active.load(std::memory_order_relaxed); }
+    /// Path of the current recording and its size so far
+    std::pair<String, UInt64> getStatus() const;
+
+    void record(int64_t session_id, const char * frame, size_t length);
+
+private:
+    void writeThread();
+
+    std::atomic<bool> active{false};
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    String path;
+    std::unique_ptr<WriteBufferFromFile> out;
+    /// Filled by record and swapped out by the write thread
+    String buffer;
+    UInt64 last_us{0};
+    UInt64 bytes{0};
+    UInt64 max_bytes{0};
+    bool stopping{false};
+
+    ThreadFromGlobalPool write_thread;
+};
+
+struct CapturedRequest
+{
+    int64_t session_id;
+    /// Since the first request of the recording
+    UInt64 offset_us;
+    String frame;
+};
+
+/// Reads the requests of a recording of RequestCapture
+class RequestCaptureReader
+{
+public:
+    explicit RequestCaptureReader(const String & path);
+
+    /// Return false at the end of the recording
+    bool next(CapturedRequest & request);
+
+private:
+    ReadBufferFromFile in;
+    UInt64 offset_us{0};
+};
+
+}
@@ -1,6 +1,9 @@
 
 #include <Service/KeeperDispatcher.h>
 #include <Service/RequestForwarder.h>
+#include <Common/SpinWait.h>
+#include <Service/PipelineStageThreads.h>
+#include <Common/setThreadAffinity.h>
 #include <Common/setThreadName.h>
 
 namespace RK
@@ -8,27 +11,39 @@ namespace RK
 
 void RequestForwarder::push(RequestForSession request_for_session)
 {
-    requests_queue->push(request_for_session);
+    requests_queue->push(std::move(request_for_session));
 }
 
 void RequestForwarder::run(RunnerId runner_id)
 {
     setThreadName(("ReqFwdSend-" + toString(runner_id)).c_str());
+    setThreadAffinity(keeper_dispatcher->getKeeperConfigurationAndSettings()->forwarder_cpus);
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Forwarder);
 
     LOG_DEBUG(log, "Starting forwarding request sending thread.");
     while (!shutdown_called)
     {
         UInt64 max_wait = session_sync_period_ms;
+        auto session_sync_due = [&]
+        {
+            return session_sync_time_watch.elapsedMilliseconds() >= session_sync_period_ms
+                || (!server->isLeader() && server->isLeaderAlive() && server->getLeader() != session_synced_leader);
+        };
         if (session_sync_idx == runner_id)
         {
             auto elapsed_milliseconds = session_sync_time_watch.elapsedMilliseconds();
-            max_wait = elapsed_milliseconds >= session_sync_period_ms ? 0 : session_sync_period_ms - elapsed_milliseconds;
+            max_wait = session_sync_due() ? 0 : session_sync_period_ms - elapsed_milliseconds;
         }
 
         KeeperStore::RequestForSession request_for_session;
 
-        if (requests_queue->tryPop(runner_id, request_for_session, max_wait))
+        if (spinUntil([&] { return requests_queue->tryPop(runner_id, request_for_session); }, std::min(spin_wait_us, max_wait * 1000))
+            || requests_queue->tryPop(runner_id, request_for_session, max_wait))
         {
+            KeeperStore::RequestsForSessions batch;
+            batch.push_back(std::move(request_for_session));
+            collectBatch(runner_id, batch);
+
             try
             {
                 if (!server->isLeader() && server->isLeaderAlive())
@@ -36,7 +51,13 @@ void RequestForwarder::run(RunnerId runner_id)
                     auto client = server->getLeaderClient(runner_id);
                     if (client)
                     {
-                        client->send(request_for_session);
+                        client->send(batch, forward_batch_frames);
+                        auto & tracer = keeper_dispatcher->getRequestTracer();
+                        for (auto & request : batch)
+                        {
+                            request.trace.mark(RequestTrace::FORWARD);
+                            tracer.record(request.trace, request.session_id, request.request->xid, request.request->getOpNum(), -1);
+                        }
                     }
                     else
                     {
@@ -49,31 +70,54 @@ void RequestForwarder::run(RunnerId runner_id)
             catch (...)
             {
                 tryLogCurrentException(log, "error forward request to leader for runner " + std::to_string(runner_id));
-                request_processor->onError(
-                    false,
-                    nuraft::cmd_result_code::FAILED,
-                    request_for_session.session_id,
-                    request_for_session.request->xid,
-                    request_for_session.request->getOpNum());
+                for (const auto & failed : batch)
+                    request_processor->onError(
+                        false, nuraft::cmd_result_code::FAILED, failed.session_id, failed.request->xid, failed.request->getOpNum());
             }
         }
 
-        if (session_sync_idx == runner_id && session_sync_time_watch.elapsedMilliseconds() >= session_sync_period_ms)
+        if (session_sync_idx == runner_id && session_sync_due())
         {
             if (!server->isLeader() && server->isLeaderAlive())
             {
                 /// send sessions
                 try
                 {
+                    /// At once for a new leader, then every session_sync_period_ms
+                    session_synced_leader = server->getLeader();
                     auto client = server->getLeaderClient(runner_id);
                     if (client)
                     {
                         /// TODO if keeper nodes time has large gap something will be wrong.
+                        keeper_dispatcher->flushPingedSessions();
                         auto session_to_expiration_time = server->getKeeperStateMachine()->getStore().sessionToExpirationTime();
+                        auto all_sessions = session_lease_ms ? session_to_expiration_time : std::unordered_map<int64_t, int64_t>{};
                         keeper_dispatcher->filterLocalSessions(session_to_expiration_time);
-                        LOG_DEBUG(log, "Has {} local sessions to send", session_to_expiration_time.size());
-                        if (!session_to_expiration_time.empty())
-                            client->sendSession(session_to_expiration_time);
+                        if (delta_session_sync && session_lease_ms)
+                        {
+                            auto delta = session_sync_tracker.nextLeases(
+                                session_to_expiration_time, all_sessions, server->getTerm(), session_lease_ms);
+                            LOG_DEBUG(
+                                log,
+                                "Has {} leases of {} local sessions to send",
+                                delta.sessions.size(),
+                                session_to_expiration_time.size());
+                            if (!delta.sessions.empty())
+                                client->sendSessionDelta(delta);
+                        }
+                        else if (delta_session_sync)
+                        {
+                            auto delta = session_sync_tracker.next(session_to_expiration_time, server->getTerm());
+                            LOG_DEBUG(log, "Has {} of {} local sessions changed to send", delta.sessions.size(), session_to_expiration_time.size());
+                            if (!delta.sessions.empty())
+                                client->sendSessionDelta(delta);
+                        }
+                        else
+                        {
+                            LOG_DEBUG(log, "Has {} local sessions to send", session_to_expiration_time.size());
+                            if (!session_to_expiration_time.empty())
+                                client->sendSession(session_to_expiration_time);
+                        }
                     }
                     else
                     {
@@ -95,9 +139,37 @@ void RequestForwarder::run(RunnerId runner_id)
     }
 }
 
+void RequestForwarder::collectBatch(RunnerId runner_id, KeeperStore::RequestsForSessions & batch)
+{
+    /// Limits may be changed by config reload, take them once for the batch
+    UInt64 max_size = max_forward_batch_size.load(std::memory_order_relaxed);
+    UInt64 linger_us = forward_batch_linger_us.load(std::memory_order_relaxed);
+
+    if (batch.size() < max_size)
+        requests_queue->tryPopMany(runner_id, batch, max_size - batch.size());
+
+    if (!linger_us)
+        return;
+
+    Stopwatch watch;
+    while (batch.size() < max_size && !shutdown_called)
+    {
+        UInt64 elapsed_us = watch.elapsedMicroseconds();
+        if (elapsed_us >= linger_us)
+            break;
+
+        KeeperStore::RequestForSession request_for_session;
+        if (!requests_queue->tryPopMicro(runner_id, request_for_session, linger_us - elapsed_us))
+            break;
+        batch.push_back(std::move(request_for_session));
+        requests_queue->tryPopMany(runner_id, batch, max_size - batch.size());
+    }
+}
+
 void RequestForwarder::runReceive(RunnerId runner_id)
 {
     setThreadName(("ReqFwdRecv-" + toString(runner_id)).c_str());
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Forwarder);
 
     LOG_DEBUG(log, "Starting forwarding response receiving thread.");
     while (!shutdown_called)
@@ -116,6 +188,9 @@ void RequestForwarder::runReceive(RunnerId runner_id)
 
                     client->receive(response);
 
+                    if (response.accepted && response.protocol == SessionDelta)
+                        session_sync_tracker.acknowledge(static_cast<UInt64>(response.xid));
+
                     if (!response.accepted)
                     {
                         /// common request
@@ -143,6 +218,10 @@ void RequestForwarder::runReceive(RunnerId runner_id)
                                 response.xid,
                                 response.error_code);
                         }
+                        else if (response.protocol == SessionDelta)
+                        {
+                            LOG_WARNING(log, "Leader failed to apply session delta of round {}, will send it again", response.xid);
+                        }
                         else if (response.protocol == Handshake)
                         {
                             LOG_ERROR(
@@ -160,7 +239,9 @@ void RequestForwarder::runReceive(RunnerId runner_id)
                         LOG_DEBUG(log, "Not found client for runner {}, maybe no session attached to me", runner_id);
                     else if (!client->isConnected())
                         LOG_DEBUG(log, "Client not connected for runner {}, maybe no session attached to me", runner_id);
-                    std::this_thread::sleep_for(std::chrono::milliseconds(session_sync_period_ms));
+                    /// Come back soon if the client is connected in background, or responses wait for the sleep
+                    std::this_thread::sleep_for(std::chrono::milliseconds(
+                        forward_connect_interval_ms ? std::min(session_sync_period_ms, forward_connect_interval_ms) : session_sync_period_ms));
                 }
             }
             else
@@ -176,6 +257,106 @@ void RequestForwarder::runReceive(RunnerId runner_id)
     }
 }
 
+void RequestForwarder::runConnect()
+{
+    setThreadName("ReqFwdConnect");
+
+    LOG_DEBUG(log, "Starting forwarding connect thread.");
+    int32 last_leader = -1;
+    while (!shutdown_called)
+    {
+        try
+        {
+            if (!server->isLeader() && server->isLeaderAlive())
+            {
+                int32 leader = server->getLeader();
+                if (leader != last_leader)
+                    LOG_INFO(log, "Connecting forwarding clients to leader {}", leader);
+                last_leader = leader;
+
+                for (const auto & client : server->getLeaderClients())
+                {
+                    if (!client->tryConnect())
+                        LOG_WARNING(log, "Failed to connect forwarding client to leader {}, will retry", leader);
+                }
+            }
+            else
+                last_leader = -1;
+
+            /// Connected while they are followers, nothing is sent by them until one is leader
+            if (forward_connect_all_peers)
+            {
+                for (const auto & client : server->getPeerClients())
+                {
+                    if (!client->tryConnect())
+                        LOG_DEBUG(log, "Failed to connect forwarding client to peer, will retry");
+                }
+            }
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Error when connecting forwarding clients");
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(forward_connect_interval_ms));
+    }
+}
+
+void RequestForwarder::runReadIndex()
+{
+    setThreadName("ReqFwdReadIdx");
+
+    LOG_DEBUG(log, "Starting read index thread.");
+    auto * read_index_tracker = keeper_dispatcher->getReadIndexTracker();
+    while (!shutdown_called)
+    {
+        auto round = read_index_tracker->waitRound(session_sync_period_ms);
+        if (!round)
+            continue;
+
+        try
+        {
+            std::optional<UInt64> read_index;
+            if (server->isLeader())
+                read_index = server->getReadIndex();
+            else if (server->isLeaderAlive())
+                read_index = requestReadIndex(*round);
+
+            if (!read_index)
+                throw Exception("No read index from leader for round " + std::to_string(*round), ErrorCodes::RAFT_ERROR);
+
+            LOG_TRACE(log, "Read index round {} confirmed with index {}", *round, *read_index);
+            read_index_tracker->confirm(*round, *read_index);
+            request_processor->onReadIndexConfirmed();
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Error when getting read index");
+            read_index_tracker->fail(*round);
+            /// Reads are answered with connection loss if there is no leader, retry later.
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::max<UInt64>(session_sync_period_ms / 10, 10)));
+        }
+    }
+}
+
+std::optional<UInt64> RequestForwarder::requestReadIndex(UInt64 round)
+{
+    auto client = server->getLeaderClient(thread_count);
+    if (!client)
+        throw Exception("Not found read index client for leader " + std::to_string(server->getLeader()), ErrorCodes::RAFT_FORWARDING_ERROR);
+
+    client->sendReadIndex(static_cast<int64_t>(round));
+
+    ForwardResponse response;
+    while (client->poll(session_sync_period_ms * 1000) && client->receive(response))
+    {
+        /// Skip the handshake response and responses of rounds failed before
+        if (response.protocol == ReadIndex && response.xid == static_cast<int64_t>(round))
+            return response.accepted ? std::optional<UInt64>(static_cast<UInt64>(response.read_index)) : std::nullopt;
+    }
+    return {};
+}
+
 void RequestForwarder::shutdown()
 {
     LOG_INFO(log, "Shutting down request forwarder!");
@@ -187,6 +368,16 @@ void RequestForwarder::shutdown()
     request_thread->wait();
     response_thread->wait();
 
+    if (connect_thread.joinable())
+        connect_thread.join();
+
+    if (auto * read_index_tracker = keeper_dispatcher->getReadIndexTracker())
+    {
+        read_index_tracker->shutdown();
+        if (read_index_thread.joinable())
+            read_index_thread.join();
+    }
+
     KeeperStore::RequestForSession request_for_session;
     while (requests_queue->tryPopAny(request_for_session))
     {
@@ -224,6 +415,15 @@ void RequestForwarder::initialize(
     session_sync_period_ms = session_sync_period_ms_;
     server = server_;
     keeper_dispatcher = keeper_dispatcher_;
+    spin_wait_us = keeper_dispatcher->getKeeperConfigurationAndSettings()->spin_wait_us;
+    const auto & raft_settings = keeper_dispatcher->getKeeperConfigurationAndSettings()->raft_settings;
+    max_forward_batch_size = raft_settings->max_forward_batch_size;
+    forward_batch_linger_us = raft_settings->forward_batch_linger_us;
+    forward_connect_interval_ms = raft_settings->forward_connect_interval_ms;
+    forward_connect_all_peers = raft_settings->forward_connect_all_peers;
+    forward_batch_frames = raft_settings->forward_batch_frames;
+    delta_session_sync = raft_settings->delta_session_sync;
+    session_lease_ms = raft_settings->session_lease_ms;
     requests_queue = std::make_shared<RequestsQueue>(thread_count, 20000);
     request_thread = std::make_shared<ThreadPool>(thread_count);
 
@@ -237,6 +437,25 @@ void RequestForwarder::initialize(
     {
         response_thread->trySchedule([this, runner_id] { runReceive(runner_id); });
     }
+
+    /// Connect to a new leader before requests are forwarded, rather than on the first of them
+    if (forward_connect_interval_ms)
+        connect_thread = ThreadFromGlobalPool([this] { runConnect(); });
+
+    if (keeper_dispatcher->getReadIndexTracker())
+        read_index_thread = ThreadFromGlobalPool([this] { runReadIndex(); });
+}
+
+void RequestForwarder::setBatchLimits(UInt64 max_forward_batch_size_, UInt64 forward_batch_linger_us_)
+{
+    bool changed = max_forward_batch_size.exchange(max_forward_batch_size_) != max_forward_batch_size_;
+    changed |= forward_batch_linger_us.exchange(forward_batch_linger_us_) != forward_batch_linger_us_;
+    if (changed)
+        LOG_INFO(
+            log,
+            "Forward batch limits change to max_forward_batch_size {}, forward_batch_linger_us {}",
+            max_forward_batch_size_,
+            forward_batch_linger_us_);
 }
 
 }
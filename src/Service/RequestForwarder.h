@@ -1,8 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <Service/KeeperServer.h>
 #include <Service/RequestProcessor.h>
 #include <Service/RequestsQueue.h>
+#include <Service/SessionSync.h>
 #include <Common/Stopwatch.h>
 #include <Service/Types.h>
 
@@ -30,14 +32,28 @@ public:
 
     void runReceive(RunnerId runner_id);
 
+    /// Keep the forwarding clients of all runners connected to the current leader
+    void runConnect();
+
+    /// Get the commit index of the leader for rounds of ReadIndexTracker, one round at a time
+    void runReadIndex();
+
     void initialize(
         size_t thread_count_,
         std::shared_ptr<KeeperServer> server_,
         std::shared_ptr<KeeperDispatcher> keeper_dispatcher_,
         UInt64 session_sync_period_ms_);
 
+    /// Change the forward batch limits at runtime
+    void setBatchLimits(UInt64 max_forward_batch_size_, UInt64 forward_batch_linger_us_);
 
 private:
+    /// Pop more requests of runner_id into batch, lingering forward_batch_linger_us for them
+    void collectBatch(RunnerId runner_id, KeeperStore::RequestsForSessions & batch);
+
+    /// Send round to the leader by the read index client and wait for its commit index
+    std::optional<UInt64> requestReadIndex(UInt64 round);
+
     size_t thread_count;
 
     ptr<RequestsQueue> requests_queue;
@@ -52,13 +68,37 @@ private:
 
     ThreadPoolPtr response_thread;
 
+    ThreadFromGlobalPool read_index_thread;
+
+    ThreadFromGlobalPool connect_thread;
+
     bool shutdown_called{false};
 
     std::shared_ptr<KeeperServer> server;
 
     UInt64 session_sync_period_ms = 500;
+    /// Spin before waiting for requests
+    UInt64 spin_wait_us = 0;
+
+    /// Requests forwarded to the leader by one write
+    std::atomic<UInt64> max_forward_batch_size{100};
+    std::atomic<UInt64> forward_batch_linger_us{0};
+    /// Period of reconnecting forwarding clients to the leader in background, 0 means connecting on send
+    UInt64 forward_connect_interval_ms = 100;
+    /// Keep forwarding clients to followers connected too, so that a new leader is forwarded to at once
+    bool forward_connect_all_peers = false;
+    /// Forward batches as one DataBatch frame
+    bool forward_batch_frames = false;
+
+    /// Send only sessions changed since the last acknowledged sync round
+    bool delta_session_sync = false;
+    /// Send leases of sessions instead of their expiration times, see RaftSettings::session_lease_ms
+    UInt64 session_lease_ms = 0;
+    SessionSyncTracker session_sync_tracker;
 
     std::atomic<UInt8> session_sync_idx{0};
+    /// Leader sessions were synced to last, a new leader gets them at once rather than after session_sync_period_ms
+    std::atomic<int32> session_synced_leader{-1};
 
     Stopwatch session_sync_time_watch;
 };
@@ -1,16 +1,58 @@
+#include <algorithm>
+#include <unordered_set>
 
 #include <Service/KeeperDispatcher.h>
+#include <Service/PathUtils.h>
+#include <Service/PipelineStageThreads.h>
+#include <Service/StallWatchdog.h>
 #include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <Common/SpinWait.h>
+#include <Common/setThreadAffinity.h>
 #include <Common/setThreadName.h>
+#include <ext/scope_guard.h>
 
 namespace RK
 {
 
+namespace
+{
+    /// Bytes of the data a request writes or reads, read data is looked up as the response is made later
+    UInt64 requestBytes(const Coordination::ZooKeeperRequest & request, KeeperStore & store)
+    {
+        UInt64 bytes = request.getPath().size();
+        switch (request.getOpNum())
+        {
+            case Coordination::OpNum::Create:
+                bytes += dynamic_cast<const Coordination::ZooKeeperCreateRequest &>(request).data.size();
+                break;
+            case Coordination::OpNum::Set:
+                bytes += dynamic_cast<const Coordination::ZooKeeperSetRequest &>(request).data.size();
+                break;
+            case Coordination::OpNum::Get:
+                store.container.read(request.getPath(), [&bytes](const KeeperNode & node)
+                {
+                    std::shared_lock lock(node.getMutex());
+                    bytes += node.data.size();
+                });
+                break;
+            case Coordination::OpNum::Multi:
+            case Coordination::OpNum::MultiRead:
+            case Coordination::OpNum::BatchWrite:
+                for (const auto & operation : dynamic_cast<const Coordination::ZooKeeperMultiRequest &>(request).requests)
+                    bytes += requestBytes(dynamic_cast<const Coordination::ZooKeeperRequest &>(*operation), store);
+                break;
+            default:
+                break;
+        }
+        return bytes;
+    }
+}
+
 void RequestProcessor::push(RequestForSession request_for_session)
 {
     if (!shutdown_called)
     {
-        requests_queue->push(request_for_session);
+        requests_queue->push(std::move(request_for_session));
         {
             std::unique_lock lk(mutex);
             cv.notify_all();
@@ -21,23 +63,41 @@ void RequestProcessor::push(RequestForSession request_for_session)
 void RequestProcessor::run()
 {
     setThreadName("ReqProcessor");
+    setThreadAffinity(keeper_dispatcher->getKeeperConfigurationAndSettings()->processor_cpus);
+    PipelineStageThreads::Scope stage_scope(PipelineStage::Processor);
 
     while (!shutdown_called)
     {
         try
         {
-            auto need_wait = [&]() -> bool { return errors.empty() && requests_queue->empty() && committed_queue.empty(); };
+            auto need_wait = [&]() -> bool
+            {
+                return errors.empty() && requests_queue->empty() && committed_queue.empty() && !read_index_moved
+                    && !(after_applied_action && popped_count == after_applied_count);
+            };
+
+            /// Errors and read index moves are rare, they wake up the wait below
+            spinUntil([&] { return !requests_queue->empty() || !committed_queue.empty(); }, spin_wait_us);
 
             {
                 using namespace std::chrono_literals;
                 std::unique_lock lk(mutex);
-                if (!cv.wait_for(lk, operation_timeout_ms * 1ms, [&] { return !need_wait() || shutdown_called; }))
+                main_thread_waiting.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                /// Fenced reads are answered when they wait too long even if nothing is committed
+                UInt64 wait_ms = operation_timeout_ms;
+                if (has_fenced_reads)
+                    wait_ms = std::clamp(zxid_fence_wait_ms, static_cast<UInt64>(1), operation_timeout_ms);
+                bool woken = cv.wait_for(lk, wait_ms * 1ms, [&] { return !need_wait() || shutdown_called; });
+                main_thread_waiting.store(false, std::memory_order_relaxed);
+                if (!woken)
                     LOG_DEBUG(
                         log,
                         "wait time out errors size {}, requests_queue size {}, committed_queue size {}",
                         errors.size(),
                         requests_queue->size(),
                         committed_queue.size());
+                read_index_moved = false;
             }
 
             if (shutdown_called)
@@ -46,20 +106,73 @@ void RequestProcessor::run()
             /// 1. process error requests
             processErrorRequest();
 
+            /// Requests committed up to commit_index are all in the count below
+            UInt64 commit_index = read_index_tracker ? server->getKeeperStateMachine()->last_commit_index() : 0;
             size_t committed_request_size = committed_queue.size();
+            /// Requests committed after the pending action wait for it
+            size_t apply_count = runAfterAppliedAction(committed_request_size);
+            if (read_index_tracker)
+            {
+                RequestForSession committed_head;
+                committed_head_session = committed_queue.peek(committed_head) ? committed_head.session_id : -1;
+                has_waiting_reads = false;
+            }
+
+            has_fenced_reads = false;
 
             /// 2. process read request, multi thread
-            for (RunnerId runner_id = 0; runner_id < runner_count; runner_id++)
+            if (stolen_sessions.empty())
             {
-                request_thread->trySchedule([this, runner_id] {
-                    moveRequestToPendingQueue(runner_id);
-                    processReadRequests(runner_id);
-                });
+                for (RunnerId runner_id = 0; runner_id < runner_count; runner_id++)
+                {
+                    request_thread->trySchedule([this, runner_id] {
+                        moveRequestToPendingQueue(runner_id);
+                        processReadRequests(runner_id);
+                    });
+                }
+                request_thread->wait();
+            }
+            else
+            {
+                /// Requests of stolen sessions have to reach their runner before reading
+                for (RunnerId runner_id = 0; runner_id < runner_count; runner_id++)
+                    request_thread->trySchedule([this, runner_id] { moveRequestToPendingQueue(runner_id); });
+                request_thread->wait();
+
+                moveForwardedRequests();
+
+                for (RunnerId runner_id = 0; runner_id < runner_count; runner_id++)
+                    request_thread->trySchedule([this, runner_id] { processReadRequests(runner_id); });
+                request_thread->wait();
             }
-            request_thread->wait();
 
             /// 3. process committed request, single thread
-            processCommittedRequest(committed_request_size);
+            bool all_applied = processCommittedRequest(apply_count) && apply_count == committed_request_size;
+            runAfterAppliedAction(0);
+            /// Applying may have reached the fences
+            if (has_fenced_reads && committed_request_size)
+            {
+                std::lock_guard lk(mutex);
+                read_index_moved = true;
+            }
+            if (commitQueueSize() == 0)
+            {
+                std::lock_guard lk(applied_mutex);
+                applied_cv.notify_all();
+            }
+            if (read_index_tracker && all_applied && commit_index > applied_index)
+            {
+                applied_index = commit_index;
+                /// Check the waiting reads again at once
+                if (has_waiting_reads)
+                {
+                    std::lock_guard lk(mutex);
+                    read_index_moved = true;
+                }
+            }
+
+            /// 4. rebalance sessions between runners
+            balanceRunners();
         }
         catch (...)
         {
@@ -75,27 +188,146 @@ void RequestProcessor::moveRequestToPendingQueue(RunnerId runner_id)
     size_t request_size = requests_queue->size(runner_id);
 
     LOG_TRACE(log, "Move request to pending queue, runner id {} request size {}", runner_id, request_size);
-    for (size_t i = 0; i < request_size; ++i)
+    RequestForSessions requests;
+    requests.reserve(request_size);
+    requests_queue->tryPopMany(runner_id, requests, request_size);
+
+    for (auto & request : requests)
     {
-        RequestForSession request;
-        if (requests_queue->tryPop(runner_id, request))
+        auto op_num = request.request->getOpNum();
+        if (op_num != Coordination::OpNum::Auth)
         {
-            auto op_num = request.request->getOpNum();
-            if (op_num != Coordination::OpNum::Auth)
-            {
-                LOG_TRACE(log, "Put session {} xid {} to pending queue", toHexString(request.session_id), request.request->xid);
-                thread_requests[request.session_id].push_back(request);
-            }
+            LOG_TRACE(log, "Put session {} xid {} to pending queue", toHexString(request.session_id), request.request->xid);
+            if (getRunnerId(request.session_id) == runner_id)
+                thread_requests[request.session_id].push_back(PendingRequest{std::move(request), {}});
+            else
+                forwarded_requests[runner_id].push_back(std::move(request));
+        }
+    }
+}
+
+void RequestProcessor::moveForwardedRequests()
+{
+    for (auto & requests : forwarded_requests)
+    {
+        for (auto & request : requests)
+            pending_requests.find(getRunnerId(request.session_id))->second[request.session_id].push_back(PendingRequest{std::move(request), {}});
+        requests.clear();
+    }
+}
+
+void RequestProcessor::balanceRunners()
+{
+    /// Stolen sessions which are drained go home, their new requests are popped by the home runner anyway
+    for (auto it = stolen_sessions.begin(); it != stolen_sessions.end();)
+    {
+        if (!pending_requests.find(it->second)->second.contains(it->first))
+            it = stolen_sessions.erase(it);
+        else
+            ++it;
+    }
+
+    RunnerId busiest = 0;
+    size_t busiest_load = 0;
+    std::vector<RunnerId> idle_runners;
+    for (RunnerId runner_id = 0; runner_id < runner_count; runner_id++)
+    {
+        size_t load = 0;
+        for (const auto & [_, requests] : pending_requests.find(runner_id)->second)
+            load += requests.size();
+        pending_counts[runner_id].store(load, std::memory_order_relaxed);
+
+        if (load > busiest_load)
+        {
+            busiest = runner_id;
+            busiest_load = load;
         }
+        if (load == 0 && requests_queue->size(runner_id) == 0)
+            idle_runners.push_back(runner_id);
+    }
+
+    auto & busiest_sessions = pending_requests.find(busiest)->second;
+    if (idle_runners.empty() || busiest_sessions.size() < 2)
+        return;
+
+    SessionLoads session_loads;
+    session_loads.reserve(busiest_sessions.size());
+    for (const auto & [session_id, requests] : busiest_sessions)
+        session_loads.emplace_back(session_id, requests.size());
+
+    for (auto [session_id, thief] : planSteals(session_loads, idle_runners))
+    {
+        auto node = busiest_sessions.extract(session_id);
+        pending_requests.find(thief)->second.insert(std::move(node));
+
+        if (thief == static_cast<RunnerId>(session_id % runner_count))
+            stolen_sessions.erase(session_id);
+        else
+            stolen_sessions[session_id] = thief;
+        steal_counts[thief].fetch_add(1, std::memory_order_relaxed);
+
+        LOG_TRACE(log, "Runner {} steals session {} from runner {}", thief, toHexString(session_id), busiest);
+    }
+}
+
+std::vector<std::pair<int64_t, RunnerId>>
+RequestProcessor::planSteals(const SessionLoads & busiest_sessions, const std::vector<RunnerId> & idle_runners)
+{
+    std::vector<std::pair<int64_t, RunnerId>> steals;
+    if (idle_runners.empty())
+        return steals;
+
+    size_t busiest_load = 0;
+    for (const auto & [_, load] : busiest_sessions)
+        busiest_load += load;
+
+    /// Move sessions one by one to the idle runners until the busiest runner keeps about its share and one session
+    size_t share = busiest_load / (idle_runners.size() + 1);
+    size_t moved_load = 0;
+    for (size_t i = 0; i + 1 < busiest_sessions.size() && busiest_load - moved_load > share; ++i)
+    {
+        steals.emplace_back(busiest_sessions[i].first, idle_runners[steals.size() % idle_runners.size()]);
+        moved_load += busiest_sessions[i].second;
     }
+    return steals;
 }
 
+std::vector<RequestRunnerStats> RequestProcessor::getRunnerStats() const
+{
+    std::vector<RequestRunnerStats> stats;
+    if (!requests_queue || !steal_counts)
+        return stats;
+
+    stats.reserve(runner_count);
+    for (RunnerId runner_id = 0; runner_id < runner_count; runner_id++)
+        stats.push_back(RequestRunnerStats{
+            requests_queue->size(runner_id),
+            pending_counts[runner_id].load(std::memory_order_relaxed),
+            steal_counts[runner_id].load(std::memory_order_relaxed)});
+    return stats;
+}
 
-void RequestProcessor::processCommittedRequest(size_t count)
+
+bool RequestProcessor::processCommittedRequest(size_t count)
 {
     LOG_DEBUG(log, "Process committed request size {}", count);
     RequestForSession committed_request;
-    for (size_t i = 0; i < count; ++i)
+    RequestForSessions batch;
+
+    /// Apply what is popped from committed_queue whatever happens
+    SCOPE_EXIT({
+        try
+        {
+            applyCommittedRequests(batch);
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Got exception while apply committed requests");
+        }
+    });
+
+    size_t i = 0;
+    for (; i < count; ++i)
     {
         if (committed_queue.peek(committed_request))
         {
@@ -129,8 +361,14 @@ void RequestProcessor::processCommittedRequest(size_t count)
                         toHexString(committed_request.session_id));
                     pending_requests_for_thread.erase(committed_request.session_id);
                 }
-                applyRequest(committed_request);
-                committed_queue.pop();
+                if (op_num == Coordination::OpNum::ExpireSessions)
+                {
+                    /// Sessions are finished when expiring, requests left of them will never be committed
+                    const auto & expire_request = dynamic_cast<const Coordination::ZooKeeperExpireSessionsRequest &>(*committed_request.request);
+                    for (auto expired_session : expire_request.session_ids)
+                        pending_requests.find(getRunnerId(expired_session))->second.erase(expired_session);
+                }
+                popCommittedRequest(committed_request, batch);
             }
             /// Local requests
             else
@@ -143,13 +381,14 @@ void RequestProcessor::processCommittedRequest(size_t count)
                     LOG_DEBUG(
                         log,
                         "Current session pending request opNum {}, session {}, xid {}",
-                        Coordination::toString(pending_requests_for_session.begin()->request->getOpNum()),
-                        toHexString(pending_requests_for_session.begin()->session_id),
-                        pending_requests_for_session.begin()->request->xid);
+                        Coordination::toString(pending_requests_for_session.front().request.request->getOpNum()),
+                        toHexString(pending_requests_for_session.front().request.session_id),
+                        pending_requests_for_session.front().request.request->xid);
 
-                    while (pending_requests_for_session.begin()->request->xid != committed_request.request->xid)
+                    while (pending_requests_for_session.front().request.request->xid != committed_request.request->xid)
                     {
-                        auto current_begin_request_session = pending_requests_for_session.begin();
+                        const auto & pending_head = pending_requests_for_session.front();
+                        const auto * current_begin_request_session = &pending_head.request;
                         if (current_begin_request_session->request->isReadRequest())
                         {
                             LOG_DEBUG(
@@ -172,7 +411,8 @@ void RequestProcessor::processCommittedRequest(size_t count)
                         else
                         {
                             std::unique_lock lk(mutex);
-                            if (errors.contains(UInt128(
+                            if (pending_head.error || pending_head.request.throttled || pending_head.request.replayed_response
+                                || errors.contains(UInt128(
                                     current_begin_request_session->session_id, current_begin_request_session->request->xid)))
                             {
                                 LOG_WARNING(
@@ -214,14 +454,14 @@ void RequestProcessor::processCommittedRequest(size_t count)
                 if (has_read_request || found_error)
                     break;
 
-                applyRequest(committed_request);
-                committed_queue.pop();
+                popCommittedRequest(committed_request, batch);
 
-                for (auto it = pending_requests_for_session.begin(); it != pending_requests_for_session.end();)
+                /// Pop the head up to the committed request
+                while (!pending_requests_for_session.empty())
                 {
-                    auto xid = it->request->xid;
-                    auto opnum = it->request->getOpNum();
-                    it = pending_requests_for_session.erase(it);
+                    auto xid = pending_requests_for_session.front().request.request->xid;
+                    auto opnum = pending_requests_for_session.front().request.request->getOpNum();
+                    pending_requests_for_session.pop_front();
                     if (xid == committed_request.request->xid
                         || (opnum == Coordination::OpNum::Close
                             && committed_request.request->getOpNum() == Coordination::OpNum::Close))
@@ -235,6 +475,183 @@ void RequestProcessor::processCommittedRequest(size_t count)
             }
         }
     }
+    return i == count;
+}
+
+void RequestProcessor::popCommittedRequest(const RequestForSession & request, RequestForSessions & batch)
+{
+    ++popped_count;
+    if (!apply_thread)
+    {
+        applyRequest(request);
+        committed_queue.pop();
+        return;
+    }
+
+    /// Count it before pop, so that commitQueueSize never misses it
+    ++applying_count;
+    committed_queue.pop();
+    batch.push_back(request);
+}
+
+namespace
+{
+
+/// Keys of all the state a request may touch, requests with a common key must be applied in commit order.
+/// Return false if the request must be applied alone.
+bool getConflictKeys(const RequestForSession & request, std::vector<String> & keys)
+{
+    using namespace Coordination;
+
+    const auto & zk_request = request.request;
+    auto op_num = zk_request->getOpNum();
+    /// RemoveRecursive touches every path of a subtree
+    if (op_num == OpNum::Close || op_num == OpNum::ExpireSessions || op_num == OpNum::SetWatches || op_num == OpNum::RemoveRecursive)
+        return false;
+
+    /// Session keys can not be a path for they do not start with '/'
+    keys.push_back("#" + std::to_string(request.session_id));
+
+    auto add_path = [&keys](const String & path)
+    {
+        keys.push_back(path);
+        keys.push_back(parentPath(path));
+    };
+
+    if (op_num == OpNum::Multi || op_num == OpNum::BatchWrite)
+    {
+        const auto & multi_request = dynamic_cast<const ZooKeeperMultiRequest &>(*zk_request);
+        for (const auto & sub_request : multi_request.requests)
+            add_path(sub_request->getPath());
+    }
+    else if (!zk_request->getPath().empty())
+    {
+        add_path(zk_request->getPath());
+    }
+    else if (op_num != OpNum::Heartbeat && op_num != OpNum::Auth && op_num != OpNum::RegisterSession)
+    {
+        return false;
+    }
+    return true;
+}
+
+}
+
+void RequestProcessor::applyCommittedRequests(RequestForSessions & batch)
+{
+    if (batch.empty())
+        return;
+
+    SCOPE_EXIT({
+        applying_count -= batch.size();
+        batch.clear();
+    });
+
+    auto & store = server->getKeeperStateMachine()->getStore();
+
+    /// Apply requests in [begin, end) which are independent from barriers.
+    auto apply_segment = [&](size_t begin, size_t end)
+    {
+        size_t size = end - begin;
+        if (size == 1)
+        {
+            applyRequest(batch[begin]);
+            return;
+        }
+
+        /// Reserve zxids in commit order, requests of expired sessions are skipped and do not take a zxid.
+        /// Sessions are only closed by Close and ExpireSessions which are barriers, so it does not change in the segment.
+        /// Sessions registered in the segment are applied before their requests for they share the session key.
+        std::vector<int64_t> zxids(size);
+        std::unordered_set<int64_t> registered_sessions;
+        int64_t increase_count = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            const auto & request = batch[begin + i];
+            zxids[i] = increase_count;
+            if (request.request->getOpNum() == Coordination::OpNum::RegisterSession)
+                registered_sessions.insert(request.session_id);
+            else if ((store.containsSession(request.session_id) || registered_sessions.contains(request.session_id))
+                     && KeeperStore::shouldIncreaseZxid(request.request))
+                ++increase_count;
+        }
+        int64_t first_zxid = store.reserveZXIDs(increase_count);
+
+        /// Level requests into waves, a request is in the wave after all the conflicting requests before it.
+        std::unordered_map<String, size_t> last_wave;
+        std::vector<std::vector<size_t>> waves;
+        std::vector<String> keys;
+        for (size_t i = 0; i < size; ++i)
+        {
+            keys.clear();
+            getConflictKeys(batch[begin + i], keys);
+
+            size_t wave = 0;
+            for (const auto & key : keys)
+            {
+                auto it = last_wave.find(key);
+                if (it != last_wave.end())
+                    wave = std::max(wave, it->second + 1);
+            }
+            for (const auto & key : keys)
+                last_wave[key] = wave;
+
+            if (wave == waves.size())
+                waves.emplace_back();
+            waves[wave].push_back(i);
+        }
+
+        LOG_DEBUG(log, "Apply {} committed requests in {} waves", size, waves.size());
+
+        /// Collect responses of every request and send them in commit order
+        std::vector<KeeperResponsesQueue> responses(size);
+        for (const auto & wave : waves)
+        {
+            for (size_t i : wave)
+            {
+                apply_thread->scheduleOrThrowOnError(
+                    [this, &batch, &responses, &zxids, first_zxid, begin, i]
+                    {
+                        /// Workers of the pool are pinned by their first request
+                        static thread_local bool pinned = false;
+                        if (!pinned)
+                        {
+                            setThreadAffinity(keeper_dispatcher->getKeeperConfigurationAndSettings()->processor_cpus);
+                            PipelineStageThreads::attach(PipelineStage::Processor);
+                            pinned = true;
+                        }
+                        applyRequest(batch[begin + i], responses[i], first_zxid + zxids[i]);
+                    });
+            }
+            apply_thread->wait();
+        }
+
+        /// Hand the responses of the segment over at once, so that they are coalesced per session
+        KeeperStore::ResponsesForSessions segment_responses;
+        KeeperStore::ResponseForSession response;
+        for (auto & request_responses : responses)
+        {
+            while (request_responses.tryPop(response))
+                segment_responses.push_back(response);
+        }
+        responses_queue.push(segment_responses);
+    };
+
+    size_t segment_begin = 0;
+    std::vector<String> keys;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        keys.clear();
+        if (getConflictKeys(batch[i], keys))
+            continue;
+
+        if (segment_begin < i)
+            apply_segment(segment_begin, i);
+        applyRequest(batch[i]);
+        segment_begin = i + 1;
+    }
+    if (segment_begin < batch.size())
+        apply_segment(segment_begin, batch.size());
 }
 
 void RequestProcessor::processErrorRequest()
@@ -271,82 +688,53 @@ void RequestProcessor::processErrorRequest()
             else
             {
                 using namespace Coordination;
-                std::optional<RequestForSession> request;
                 if (static_cast<int32_t>(xid) == Coordination::AUTH_XID)
                 {
                     ZooKeeperRequestPtr auth_request = std::make_shared<ZooKeeperAuthRequest>();
                     using namespace std::chrono;
                     int64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
                     RequestForSession request1{static_cast<int64_t>(session_id), auth_request, now, -1, -1};
-                    request.emplace(request1);
+                    sendErrorResponse(request1, error_request);
+                    it = errors.erase(it);
+                    continue;
                 }
-                else
-                {
-                    auto session_requests = pending_requests_for_thread.find(session_id);
 
-                    if (session_requests != pending_requests_for_thread.end())
+                PendingRequest * matched = nullptr;
+                auto session_requests = pending_requests_for_thread.find(session_id);
+                if (session_requests != pending_requests_for_thread.end())
+                {
+                    for (auto & pending : session_requests->second)
                     {
-                        auto & requests = session_requests->second;
-                        for (auto request_it = requests.begin(); request_it != requests.end();)
+                        const auto & pending_request = pending.request.request;
+                        LOG_TRACE(
+                            log,
+                            "Try match session {} pending request xid {}, target error xid {}",
+                            toHexString(session_id),
+                            pending_request->xid,
+                            xid);
+                        if (static_cast<uint64_t>(pending_request->xid) < xid)
                         {
-                            LOG_TRACE(
-                                log,
-                                "Try match session {} pending request xid {}, target error xid {}",
-                                toHexString(session_id),
-                                request_it->request->xid,
-                                xid);
-                            if (static_cast<uint64_t>(request_it->request->xid) < xid)
-                            {
-                                break;
-                            }
-                            else if (
-                                static_cast<uint64_t>(request_it->request->xid) == xid
-                                || (request_it->request->getOpNum() == Coordination::OpNum::Close
-                                    && error_request.opnum == Coordination::OpNum::Close))
-                            {
-                                request = *request_it;
-                                request_it = requests.erase(request_it);
-                                break;
-                            }
-                            else
-                            {
-                                ++request_it;
-                            }
+                            break;
+                        }
+                        else if (
+                            static_cast<uint64_t>(pending_request->xid) == xid
+                            || (pending_request->getOpNum() == Coordination::OpNum::Close
+                                && error_request.opnum == Coordination::OpNum::Close))
+                        {
+                            matched = &pending;
+                            break;
                         }
-                    }
-                    else
-                    {
-                        LOG_WARNING(log, "Session {}, no pending requests", toHexString(session_id));
                     }
                 }
-
-                if (request)
+                else
                 {
-                    ZooKeeperResponsePtr response = request->request->makeResponse();
-                    response->xid = request->request->xid;
-                    response->zxid = 0;
-                    response->request_created_time_ms = request->create_time;
-
-                    auto accepted = error_request.accepted;
-                    auto error_code = error_request.error_code;
-
-                    response->error = error_code == nuraft::cmd_result_code::TIMEOUT ? Coordination::Error::ZOPERATIONTIMEOUT
-                                                                                     : Coordination::Error::ZCONNECTIONLOSS;
-
-                    responses_queue.push(RK::KeeperStore::ResponseForSession{static_cast<int64_t>(session_id), response});
-
-                    LOG_ERROR(
-                        log,
-                        "Make error response for session {}, xid {}, opNum {}",
-                        session_id,
-                        response->xid,
-                        error_request.opnum);
-
-                    if (!accepted)
-                        LOG_ERROR(log, "Request batch is not accepted");
-                    else
-                        LOG_ERROR(log, "Request batch error, nuraft code {}", error_code);
+                    LOG_WARNING(log, "Session {}, no pending requests", toHexString(session_id));
+                }
 
+                if (matched)
+                {
+                    /// Answered when it reaches the head of its session, so responses keep the session order
+                    matched->error = error_request;
                     it = errors.erase(it);
                     LOG_ERROR(log, "Matched error request session {}, xid {} from pending requests queue", toHexString(session_id), xid);
                 }
@@ -365,6 +753,31 @@ void RequestProcessor::processErrorRequest()
     }
 }
 
+void RequestProcessor::sendErrorResponse(const RequestForSession & request, Coordination::Error error) const
+{
+    auto response = request.request->makeResponse();
+    response->xid = request.request->xid;
+    response->zxid = 0;
+    response->request_created_time_ms = request.create_time;
+    response->error = error;
+
+    responses_queue.push(RK::KeeperStore::ResponseForSession{request.session_id, response});
+}
+
+void RequestProcessor::sendErrorResponse(const RequestForSession & request, const ErrorRequest & error_request) const
+{
+    sendErrorResponse(
+        request,
+        error_request.error_code == nuraft::cmd_result_code::TIMEOUT ? Coordination::Error::ZOPERATIONTIMEOUT
+                                                                     : Coordination::Error::ZCONNECTIONLOSS);
+
+    LOG_ERROR(log, "Make error response for session {}, xid {}, opNum {}", request.session_id, request.request->xid, error_request.opnum);
+    if (!error_request.accepted)
+        LOG_ERROR(log, "Request batch is not accepted");
+    else
+        LOG_ERROR(log, "Request batch error, nuraft code {}", error_request.error_code);
+}
+
 void RequestProcessor::processReadRequests(RunnerId runner_id)
 {
     auto & thread_requests = pending_requests.find(runner_id)->second;
@@ -373,18 +786,34 @@ void RequestProcessor::processReadRequests(RunnerId runner_id)
     for (auto it = thread_requests.begin(); it != thread_requests.end();)
     {
         auto & session_requests = it->second;
-        for (auto session_request = session_requests.begin(); session_request != session_requests.end();)
+        while (!session_requests.empty())
         {
+            auto & head = session_requests.front();
+            /// failed write request
+            if (head.error)
+                sendErrorResponse(head.request, *head.error);
+            /// rejected by admission control of dispatcher
+            else if (head.request.throttled)
+                sendErrorResponse(head.request, Coordination::Error::ZTHROTTLEDOP);
+            /// retry answered from the idempotency cache by dispatcher
+            else if (head.request.replayed_response)
+            {
+                head.request.replayed_response->request_created_time_ms = head.request.create_time;
+                responses_queue.push(RK::KeeperStore::ResponseForSession{head.request.session_id, head.request.replayed_response});
+            }
             /// read request
-            if (session_request->request->isReadRequest())
+            else if (head.request.request->isReadRequest())
             {
-                applyRequest(*session_request);
-                session_request = session_requests.erase(session_request);
+                if (!serveRead(head))
+                    break;
             }
             else
             {
+                if (head.request.relaxed_order)
+                    serveRelaxedReads(session_requests);
                 break;
             }
+            session_requests.pop_front();
         }
 
         if (session_requests.empty())
@@ -394,8 +823,141 @@ void RequestProcessor::processReadRequests(RunnerId runner_id)
     }
 }
 
+bool RequestProcessor::serveRead(PendingRequest & pending)
+{
+    if (shedRead(pending.request))
+        return true;
+
+    if (!zxidFenceReached(pending.request))
+    {
+        if (!zxidFenceExpired(pending.request))
+        {
+            has_fenced_reads = true;
+            return false;
+        }
+        LOG_DEBUG(
+            log,
+            "Session {} read xid {} not fenced in time, zxid {} not applied",
+            toHexString(pending.request.session_id),
+            pending.request.request->xid,
+            pending.request.min_zxid);
+        sendErrorResponse(pending.request, Coordination::Error::ZOPERATIONTIMEOUT);
+    }
+    else if (!readIndexReached(pending))
+    {
+        has_waiting_reads = true;
+        return false;
+    }
+    else
+        applyRequest(pending.request);
+    return true;
+}
+
+bool RequestProcessor::shedRead(const RequestForSession & request)
+{
+    /// Answered by the connection anyway
+    if (request.request->getOpNum() == Coordination::OpNum::Heartbeat)
+        return false;
+
+    if (!keeper_dispatcher->isLocalSession(request.session_id))
+    {
+        abandoned_requests.fetch_add(1, std::memory_order_relaxed);
+        LOG_TRACE(log, "Drop read xid {} of session {}, its connection is gone", request.request->xid, toHexString(request.session_id));
+        return true;
+    }
+
+    using namespace std::chrono;
+    if (request.expired(duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()))
+    {
+        expired_requests.fetch_add(1, std::memory_order_relaxed);
+        LOG_DEBUG(
+            log,
+            "Session {} read xid {} is not served within {}ms, its client has given up",
+            toHexString(request.session_id),
+            request.request->xid,
+            request.deadline - request.create_time);
+        sendErrorResponse(request, Coordination::Error::ZOPERATIONTIMEOUT);
+        return true;
+    }
+    return false;
+}
+
+void RequestProcessor::serveRelaxedReads(PendingRequests & session_requests)
+{
+    /// Paths of the requests before, a read of a path, its ancestors or its descendants keeps its order with them
+    std::vector<String> ordered_paths;
+    auto related = [&](const String & path)
+    {
+        return std::any_of(ordered_paths.begin(), ordered_paths.end(), [&](const String & ordered)
+        {
+            return path.starts_with(ordered) || ordered.starts_with(path);
+        });
+    };
+
+    for (auto it = session_requests.begin(); it != session_requests.end();)
+    {
+        const auto & request = *it->request.request;
+        String path = request.getPath();
+        /// Writes of no single path, such as multi and close, keep the order of everything after them
+        if (path.empty() || request.getOpNum() == Coordination::OpNum::Multi || request.getOpNum() == Coordination::OpNum::BatchWrite)
+            return;
+
+        if (!request.isReadRequest() || it->error || it->request.throttled || it->request.replayed_response || related(path))
+        {
+            ordered_paths.push_back(std::move(path));
+            ++it;
+        }
+        else if (!serveRead(*it))
+            return;
+        else
+            it = session_requests.erase(it);
+    }
+}
+
+bool RequestProcessor::readIndexReached(PendingRequest & pending) const
+{
+    /// Answered with connection loss at once if there is no leader
+    if (!pending.request.read_round || !server->isLeaderAlive())
+        return true;
+
+    /// The next write of the session is the head of committed_queue, so everything committed before the read
+    /// arrived is applied, and the read has to be served before the write.
+    if (pending.request.session_id == committed_head_session)
+        return true;
+
+    if (!pending.read_index)
+        pending.read_index = read_index_tracker->indexOf(pending.request.read_round);
+    return pending.read_index && *pending.read_index <= applied_index;
+}
+
+bool RequestProcessor::zxidFenceReached(const RequestForSession & request) const
+{
+    return !request.min_zxid || server->getKeeperStateMachine()->getLastProcessedZxid() >= request.min_zxid;
+}
+
+bool RequestProcessor::zxidFenceExpired(const RequestForSession & request) const
+{
+    using namespace std::chrono;
+    auto now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    return now_ms - request.create_time >= static_cast<int64_t>(zxid_fence_wait_ms);
+}
+
 void RequestProcessor::applyRequest(const RequestForSession & request) const
 {
+    applyRequest(request, responses_queue, {});
+}
+
+void RequestProcessor::applyRequest(
+    const RequestForSession & request, KeeperResponsesQueue & responses, std::optional<int64_t> assigned_zxid) const
+{
+    RequestTrace trace = request.trace;
+    trace.mark(RequestTrace::APPLY_BEGIN);
+    StallWatchdog::Busy busy(request.session_id, request.request->xid, static_cast<Int32>(request.request->getOpNum()));
+
+    auto & hot_key_stats = keeper_dispatcher->getHotKeyStats();
+    if (hot_key_stats.sample())
+        hot_key_stats.record(
+            *request.request, request.session_id, requestBytes(*request.request, server->getKeeperStateMachine()->getStore()));
     try
     {
         LOG_TRACE(
@@ -414,15 +976,17 @@ void RequestProcessor::applyRequest(const RequestForSession & request) const
             response->zxid = 0;
             response->error = Coordination::Error::ZCONNECTIONLOSS;
 
-            responses_queue.push(RK::KeeperStore::ResponseForSession{request.session_id, response});
+            responses.push(RK::KeeperStore::ResponseForSession{request.session_id, response});
         }
         /// Raft already committed the request, we must apply it/
         else
         {
             if (!server->isLeaderAlive())
                 LOG_WARNING(log, "Apply write request but leader not alive.");
+            /// Nobody reads the response of a write of a session connected elsewhere or whose connection is gone
+            bool connected = request.request->isReadRequest() || keeper_dispatcher->isLocalSession(request.session_id);
             server->getKeeperStateMachine()->getStore().processRequest(
-                responses_queue, request.request, request.session_id, request.create_time, {}, true, false);
+                responses, request.request, request.session_id, request.create_time, {}, true, false, assigned_zxid, connected);
         }
     }
     catch (...)
@@ -432,6 +996,9 @@ void RequestProcessor::applyRequest(const RequestForSession & request) const
             fmt::format(
                 "Got exception while process session {} read request {}.", toHexString(request.session_id), request.request->toString()));
     }
+    trace.mark(RequestTrace::APPLY_END);
+    keeper_dispatcher->getRequestTracer().record(
+        trace, request.session_id, request.request->xid, request.request->getOpNum(), request.isForwardRequest() ? request.server_id : -1);
 }
 
 void RequestProcessor::shutdown()
@@ -446,6 +1013,10 @@ void RequestProcessor::shutdown()
         std::unique_lock lk(mutex);
         cv.notify_all();
     }
+    {
+        std::lock_guard lk(applied_mutex);
+        applied_cv.notify_all();
+    }
 
     if (main_thread.joinable())
         main_thread.join();
@@ -466,13 +1037,87 @@ void RequestProcessor::commit(RequestForSession request)
 {
     if (!shutdown_called)
     {
-        committed_queue.push(request);
+        committed_queue.push(std::move(request));
+        ++committed_count;
+        notifyCommitted();
+        LOG_DEBUG(log, "Commit notify committed queue size {}", committed_queue.size());
+    }
+}
+
+void RequestProcessor::commit(RequestForSessions & requests)
+{
+    if (shutdown_called)
+        return;
+
+    for (auto & request : requests)
+    {
+        /// Wake up the main thread before waiting for room in the queue
+        if (!committed_queue.tryPush(std::move(request)))
         {
-            std::unique_lock lk(mutex);
-            cv.notify_all();
+            notifyCommitted();
+            committed_queue.push(std::move(request));
         }
-        LOG_DEBUG(log, "Commit notify committed queue size {}", committed_queue.size());
+        ++committed_count;
+    }
+    notifyCommitted();
+    LOG_DEBUG(log, "Commit {} requests, notify committed queue size {}", requests.size(), committed_queue.size());
+}
+
+void RequestProcessor::notifyCommitted()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!main_thread_waiting.load(std::memory_order_relaxed))
+        return;
+    {
+        std::unique_lock lk(mutex);
     }
+    cv.notify_all();
+}
+
+bool RequestProcessor::waitCommitQueueEmpty(UInt64 timeout_ms)
+{
+    std::unique_lock lk(applied_mutex);
+    return applied_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this] { return commitQueueSize() == 0 || shutdown_called; });
+}
+
+void RequestProcessor::runAfterCommittedApplied(std::function<void()> action)
+{
+    {
+        std::lock_guard lk(mutex);
+        after_applied_action = std::move(action);
+        after_applied_count = committed_count;
+    }
+    cv.notify_all();
+}
+
+size_t RequestProcessor::runAfterAppliedAction(size_t count)
+{
+    std::function<void()> action;
+    {
+        std::lock_guard lk(mutex);
+        if (!after_applied_action)
+            return count;
+        if (popped_count < after_applied_count)
+            return std::min<size_t>(count, after_applied_count - popped_count);
+        action.swap(after_applied_action);
+    }
+
+    try
+    {
+        action();
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Got exception while running action after committed requests applied");
+    }
+    return count;
+}
+
+void RequestProcessor::onReadIndexConfirmed()
+{
+    std::unique_lock lk(mutex);
+    read_index_moved = true;
+    cv.notify_all();
 }
 
 void RequestProcessor::onError(
@@ -492,6 +1137,7 @@ void RequestProcessor::onError(
 
 void RequestProcessor::initialize(
     size_t thread_count_,
+    size_t apply_thread_count_,
     std::shared_ptr<KeeperServer> server_,
     std::shared_ptr<KeeperDispatcher> keeper_dispatcher_,
     UInt64 operation_timeout_ms_)
@@ -500,12 +1146,21 @@ void RequestProcessor::initialize(
     runner_count = thread_count_;
     server = server_;
     keeper_dispatcher = keeper_dispatcher_;
+    spin_wait_us = keeper_dispatcher->getKeeperConfigurationAndSettings()->spin_wait_us;
+    zxid_fence_wait_ms = keeper_dispatcher->getKeeperConfigurationAndSettings()->raft_settings->zxid_fence_wait_ms;
+    read_index_tracker = keeper_dispatcher->getReadIndexTracker();
     requests_queue = std::make_shared<RequestsQueue>(runner_count, 20000);
     request_thread = std::make_shared<ThreadPool>(thread_count_);
+    apply_thread_count = apply_thread_count_;
+    if (apply_thread_count > 1)
+        apply_thread = std::make_shared<ThreadPool>(apply_thread_count);
     for (size_t i = 0; i < runner_count; i++)
     {
         pending_requests[i];
     }
+    forwarded_requests.resize(runner_count);
+    pending_counts = std::make_unique<std::atomic<size_t>[]>(runner_count);
+    steal_counts = std::make_unique<std::atomic<size_t>[]>(runner_count);
     main_thread = ThreadFromGlobalPool([this] { run(); });
 }
 
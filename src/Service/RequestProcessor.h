@@ -1,6 +1,8 @@
 #pragma once
 
+#include <Service/Keeper4LWInfo.h>
 #include <Service/KeeperServer.h>
+#include <Service/ReadIndexTracker.h>
 #include <Service/RequestsQueue.h>
 #include <Common/ZooKeeper/ZooKeeperConstants.h>
 #include <Service/Types.h>
@@ -32,6 +34,8 @@ class KeeperDispatcher;
 class RequestProcessor
 {
 public:
+    using RequestForSessions = std::vector<KeeperStore::RequestForSession>;
+
     explicit RequestProcessor(KeeperResponsesQueue & responses_queue_)
         : responses_queue(responses_queue_), log(&Poco::Logger::get("RequestProcessor"))
     {
@@ -44,7 +48,8 @@ public:
     
     void processReadRequests(RunnerId runner_id);
     void processErrorRequest();
-    void processCommittedRequest(size_t count);
+    /// Return true if all the count requests are applied
+    bool processCommittedRequest(size_t count);
 
     /// Apply request to state machine
     void applyRequest(const RequestForSession & request) const;
@@ -52,26 +57,90 @@ public:
     void shutdown();
 
     void commit(RequestForSession request);
+    /// Commit the requests of log entries in order and wake up the main thread once, requests are moved from
+    void commit(RequestForSessions & requests);
 
     void onError(bool accepted, nuraft::cmd_result_code error_code, int64_t session_id, Coordination::XID xid, Coordination::OpNum opnum);
 
+    /// A round of ReadIndexTracker is confirmed, check the reads waiting for it
+    void onReadIndexConfirmed();
+
     void initialize(
         size_t thread_count_,
+        size_t apply_thread_count_,
         std::shared_ptr<KeeperServer> server_,
         std::shared_ptr<KeeperDispatcher> keeper_dispatcher_,
         UInt64 operation_timeout_ms_);
 
-    size_t commitQueueSize() { return committed_queue.size(); }
+    /// Committed requests not applied yet, include the ones being applied in parallel.
+    size_t commitQueueSize() { return committed_queue.size() + applying_count; }
 
-private:
+    /// Wait until all the committed requests are applied, return false if they are not applied in timeout_ms.
+    /// Returns true at once after shutdown.
+    bool waitCommitQueueEmpty(UInt64 timeout_ms);
+
+    /// Run action on the main thread once the requests committed so far are applied and before any request committed
+    /// after them is, so that it sees the store at the last committed log index. Called by the commit thread, which
+    /// does not wait for it. There is one action at a time.
+    void runAfterCommittedApplied(std::function<void()> action);
+
+    std::vector<RequestRunnerStats> getRunnerStats() const;
 
+    /// Reads shed before being served, see Settings::request_deadline_ms
+    UInt64 expiredRequests() const { return expired_requests.load(std::memory_order_relaxed); }
+    UInt64 abandonedRequests() const { return abandoned_requests.load(std::memory_order_relaxed); }
+
+    /// <session_id, pending requests> of a runner
+    using SessionLoads = std::vector<std::pair<int64_t, size_t>>;
+    /// <session_id, thief> of the sessions balanceRunners moves from the busiest runner with busiest_sessions to
+    /// idle_runners, in the order of busiest_sessions and the thieves taken in turn.
+    static std::vector<std::pair<int64_t, RunnerId>>
+    planSteals(const SessionLoads & busiest_sessions, const std::vector<RunnerId> & idle_runners);
+
+private:
+    /// Apply request and put responses into responses, assigned_zxid is the zxid reserved by parallel apply.
+    void applyRequest(
+        const RequestForSession & request, KeeperResponsesQueue & responses, std::optional<int64_t> assigned_zxid) const;
+
+    /// Pop the head of committed_queue, apply it at once if apply serially, or else add it to batch.
+    void popCommittedRequest(const RequestForSession & request, RequestForSessions & batch);
+
+    /** Apply committed requests in parallel, results are the same as serial apply.
+     *
+     * Requests conflict if they are from the same session or touch the same path or its parent,
+     * they are leveled into waves so that requests in a wave are independent from each other and
+     * a request is always applied after all the conflicting requests before it. Close, SetWatches
+     * and unknown requests without path are applied alone. Zxids are reserved in commit order and
+     * responses are sent in commit order too.
+     */
+    void applyCommittedRequests(RequestForSessions & batch);
+
+    /// Runner reading requests of session, it is session_id % runner_count unless the session is stolen.
     size_t getRunnerId(int64_t session_id) const
     {
+        if (!stolen_sessions.empty())
+        {
+            auto it = stolen_sessions.find(session_id);
+            if (it != stolen_sessions.end())
+                return it->second;
+        }
         return session_id % runner_count;
     }
 
+    /// Answer request with the error of Raft.
+    void sendErrorResponse(const RequestForSession & request, const ErrorRequest & error_request) const;
+    void sendErrorResponse(const RequestForSession & request, Coordination::Error error) const;
+
+    /// Hand requests popped by their home runner to the runner which stole the session.
+    void moveForwardedRequests();
+
+    /** Let idle runners steal whole sessions from the busiest one, and give stolen sessions without
+     * pending requests back to their home runner. Called by the main thread when no runner is
+     * working, so no session is moved while it has a read in flight and the order of requests of
+     * a session is kept.
+     */
+    void balanceRunners();
 
-    using RequestForSessions = std::vector<KeeperStore::RequestForSession>;
 
     ThreadFromGlobalPool main_thread;
 
@@ -84,29 +153,109 @@ private:
     /// Local requests
     ptr<RequestsQueue> requests_queue;
 
+    struct PendingRequest
+    {
+        RequestForSession request;
+        /// Set when Raft failed the request, it is answered with the error when it reaches the head of its session
+        std::optional<ErrorRequest> error;
+        /// Index of the read round once it is confirmed
+        std::optional<UInt64> read_index;
+    };
+
+    /// Requests of a session in arriving order, popped from the head
+    using PendingRequests = std::deque<PendingRequest>;
+
+    /// Answer the read unless it waits for its read index or zxid fence, false if it waits
+    bool serveRead(PendingRequest & pending);
+    /** Shed the read before any work as nobody is waiting for its response: drop it if its connection is gone, or
+      * answer it with ZOPERATIONTIMEOUT if its deadline passed. Return false if it is to be served.
+      */
+    bool shedRead(const RequestForSession & request);
+    /// Serve the reads of a relaxed order session behind its pending write at the head which have no pending request
+    /// before them on a related path, see RequestForSession::relaxed_order
+    void serveRelaxedReads(PendingRequests & session_requests);
+    /// Whether the linearizable read can be served now
+    bool readIndexReached(PendingRequest & pending) const;
+    /// Whether the min_zxid of the read is applied, and whether it waited longer than zxid_fence_wait_ms
+    bool zxidFenceReached(const RequestForSession & request) const;
+    bool zxidFenceExpired(const RequestForSession & request) const;
+
     /// <runner_id, <session_id, requests>>
     /// Requests from `requests_queue` grouped by session
-    std::unordered_map<size_t, std::unordered_map<int64_t, RequestForSessions>> pending_requests;
+    std::unordered_map<size_t, std::unordered_map<int64_t, PendingRequests>> pending_requests;
+
+    /// <session_id, runner_id> of sessions stolen from their home runner, only changed by the main thread
+    std::unordered_map<int64_t, RunnerId> stolen_sessions;
+    /// Requests of stolen sessions popped by their home runner, indexed by the home runner
+    std::vector<RequestForSessions> forwarded_requests;
+
+    /// Pending requests and stolen sessions of every runner, for metrics
+    std::unique_ptr<std::atomic<size_t>[]> pending_counts;
+    std::unique_ptr<std::atomic<size_t>[]> steal_counts;
 
     /// Raft committed write requests which can be local or from other nodes.
-    ConcurrentBoundedQueue<KeeperStore::RequestForSession> committed_queue{1000};
+    /// Single consumer, the main thread peeks the head before popping it.
+    MPMCBoundedQueue<KeeperStore::RequestForSession> committed_queue{1024};
 
     size_t runner_count;
 
     ThreadPoolPtr request_thread;
 
+    /// Threads applying committed requests, apply_thread is null if apply serially
+    size_t apply_thread_count = 1;
+    ThreadPoolPtr apply_thread;
+    /// Requests popped from committed_queue but not applied yet
+    std::atomic<size_t> applying_count{0};
+    /// Requests ever pushed to committed_queue by the commit thread and popped from it by the main thread
+    std::atomic<UInt64> committed_count{0};
+    UInt64 popped_count = 0;
+
+    /// Action of runAfterCommittedApplied and the popped_count it waits for, guarded by mutex
+    std::function<void()> after_applied_action;
+    UInt64 after_applied_count = 0;
+
+    /// Run after_applied_action if it is due, return the requests which may be popped before it
+    size_t runAfterAppliedAction(size_t count);
+
+    /// Notified by the main thread once the committed requests are all applied
+    std::mutex applied_mutex;
+    std::condition_variable applied_cv;
+
     std::shared_ptr<KeeperDispatcher> keeper_dispatcher;
 
     mutable std::mutex mutex;
     std::condition_variable cv;
+    /// The main thread is waiting on cv, committing only notifies it then
+    std::atomic<bool> main_thread_waiting{false};
+
+    void notifyCommitted();
 
     /// key : session_id xid
-    /// Error requests when append entry or forward to leader
+    /// Error requests when append entry or forward to leader, moved into pending_requests by the main thread
     std::unordered_map<UInt128, ErrorRequest> errors;
 
+    /// nullptr if neither reads are linearizable nor syncs are lightweight
+    ReadIndexTracker * read_index_tracker = nullptr;
+    /// Committed requests are applied up to the log index, only changed by the main thread
+    std::atomic<UInt64> applied_index{0};
+    /// Session of the head of committed_queue when reading, set by the main thread before runners start
+    int64_t committed_head_session = -1;
+    /// Some read could not be served for its read index
+    std::atomic<bool> has_waiting_reads{false};
+    /// Some read waits for its min_zxid to be applied, the reads are checked again after applying
+    std::atomic<bool> has_fenced_reads{false};
+    /// Read index moved since reads were checked, guarded by mutex
+    bool read_index_moved{false};
+
+    std::atomic<UInt64> expired_requests{0};
+    std::atomic<UInt64> abandoned_requests{0};
+
     Poco::Logger * log;
 
     UInt64 operation_timeout_ms = 10000;
+    /// Spin before waiting for requests
+    UInt64 spin_wait_us = 0;
+    UInt64 zxid_fence_wait_ms = 0;
 };
 
 }
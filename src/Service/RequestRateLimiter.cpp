@@ -0,0 +1,72 @@
+#include <Service/RequestRateLimiter.h>
+#include <algorithm>
+
+namespace RK
+{
+
+TokenBucket::TokenBucket(UInt64 rate, UInt64 burst)
+    : interval_ns(1000000000 / std::max(rate, static_cast<UInt64>(1))), capacity_ns(interval_ns * std::max(burst, static_cast<UInt64>(1)))
+{
+}
+
+bool TokenBucket::tryAcquire(UInt64 now_ns)
+{
+    UInt64 full_at = full_at_ns.load(std::memory_order_relaxed);
+    while (true)
+    {
+        UInt64 next_full_at = std::max(full_at, now_ns) + interval_ns;
+        if (next_full_at - now_ns > capacity_ns)
+            return false;
+        if (full_at_ns.compare_exchange_weak(full_at, next_full_at, std::memory_order_relaxed))
+            return true;
+    }
+}
+
+void RequestRateLimiter::configure(
+    UInt64 session_rate_, UInt64 session_burst_, UInt64 ip_rate_, UInt64 ip_burst_, const std::vector<PathRateLimit> & path_limits)
+{
+    session_rate = session_rate_;
+    session_burst = session_burst_ ? session_burst_ : session_rate_;
+    ip_rate = ip_rate_;
+    ip_burst = ip_burst_ ? ip_burst_ : ip_rate_;
+
+    path_buckets.clear();
+    for (const auto & limit : path_limits)
+        if (limit.rate)
+            path_buckets.emplace_back(limit.prefix, std::make_unique<TokenBucket>(limit.rate, limit.burst ? limit.burst : limit.rate));
+    std::stable_sort(
+        path_buckets.begin(), path_buckets.end(), [](const auto & lhs, const auto & rhs) { return lhs.first.size() > rhs.first.size(); });
+}
+
+TokenBucketPtr RequestRateLimiter::sessionBucket() const
+{
+    return session_rate ? std::make_shared<TokenBucket>(session_rate, session_burst) : nullptr;
+}
+
+TokenBucketPtr RequestRateLimiter::ipBucket(const String & host)
+{
+    if (!ip_rate)
+        return nullptr;
+
+    std::lock_guard lock(ip_buckets_mutex);
+    auto & weak_bucket = ip_buckets[host];
+    if (auto bucket = weak_bucket.lock())
+        return bucket;
+
+    auto bucket = std::make_shared<TokenBucket>(ip_rate, ip_burst);
+    weak_bucket = bucket;
+    /// Forget the hosts without connections now and then, connections are far rarer than requests
+    if (ip_buckets.size() % 1024 == 0)
+        std::erase_if(ip_buckets, [](const auto & host_bucket) { return host_bucket.second.expired(); });
+    return bucket;
+}
+
+bool RequestRateLimiter::tryAcquirePath(const String & path, UInt64 now_ns)
+{
+    for (auto & [prefix, bucket] : path_buckets)
+        if (path.starts_with(prefix))
+            return bucket->tryAcquire(now_ns);
+    return true;
+}
+
+}
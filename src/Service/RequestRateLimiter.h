@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Token bucket of rate tokens a second holding at most burst tokens.
+ *
+ * Kept as the time the bucket is full again (GCRA), so that taking a token refills the bucket by a CAS of one
+ * atomic without a lock or a refill thread.
+ */
+class TokenBucket
+{
+public:
+    TokenBucket(UInt64 rate, UInt64 burst);
+
+    /// Take a token at now_ns, false if the bucket is empty
+    bool tryAcquire(UInt64 now_ns);
+
+private:
+    /// Nanoseconds a token takes to refill
+    const UInt64 interval_ns;
+    /// Nanoseconds all the burst tokens take to refill
+    const UInt64 capacity_ns;
+    /// The bucket is full at this time, it has (capacity_ns - (full_at_ns - now)) / interval_ns tokens before
+    std::atomic<UInt64> full_at_ns{0};
+};
+
+using TokenBucketPtr = std::shared_ptr<TokenBucket>;
+
+/// Rate of requests of a path prefix, of all the clients
+struct PathRateLimit
+{
+    String prefix;
+    UInt64 rate;
+    UInt64 burst;
+};
+
+/** Rate limits of client requests, a runaway client sending requests as fast as it is answered takes a whole
+ * pipeline thread otherwise.
+ *
+ * A connection takes a token from the bucket of its session, the bucket shared by the connections of its client
+ * address and the bucket of the longest configured prefix of the path for every request but control requests.
+ * Requests over a limit are rejected by the dispatcher with ZTHROTTLEDOP, which clients retry.
+ */
+class RequestRateLimiter
+{
+public:
+    /// Rate 0 means no limit, burst 0 means rate
+    void configure(UInt64 session_rate_, UInt64 session_burst_, UInt64 ip_rate_, UInt64 ip_burst_, const std::vector<PathRateLimit> & path_limits);
+
+    /// Bucket of a new session, nullptr if sessions are not limited
+    TokenBucketPtr sessionBucket() const;
+    /// Bucket shared by the connections from host, nullptr if client addresses are not limited
+    TokenBucketPtr ipBucket(const String & host);
+
+    bool hasPathLimits() const { return !path_buckets.empty(); }
+    /// Take a token of the longest prefix of path, true if path has no limit
+    bool tryAcquirePath(const String & path, UInt64 now_ns);
+
+    /// Requests rejected by any of the limits
+    void onRejected() { rejected.fetch_add(1, std::memory_order_relaxed); }
+    UInt64 rejectedCount() const { return rejected.load(std::memory_order_relaxed); }
+
+private:
+    UInt64 session_rate = 0;
+    UInt64 session_burst = 0;
+    UInt64 ip_rate = 0;
+    UInt64 ip_burst = 0;
+
+    std::mutex ip_buckets_mutex;
+    /// Buckets are owned by the connections, a host is forgotten after its last connection closed
+    std::unordered_map<String, std::weak_ptr<TokenBucket>> ip_buckets;
+
+    /// Longest prefixes first
+    std::vector<std::pair<String, std::unique_ptr<TokenBucket>>> path_buckets;
+
+    std::atomic<UInt64> rejected{0};
+};
+
+}
@@ -0,0 +1,99 @@
+#include <Service/RequestTrace.h>
+
+namespace RK
+{
+
+namespace
+{
+    struct SpanStages
+    {
+        RequestTrace::Stage from;
+        RequestTrace::Stage to;
+    };
+
+    constexpr SpanStages SPAN_STAGES[] = {
+        {RequestTrace::RECEIVE, RequestTrace::DISPATCH},
+        {RequestTrace::DISPATCH, RequestTrace::FORWARD},
+        {RequestTrace::DISPATCH, RequestTrace::APPEND},
+        {RequestTrace::APPEND, RequestTrace::PRE_COMMIT},
+        {RequestTrace::PRE_COMMIT, RequestTrace::COMMIT},
+        {RequestTrace::COMMIT, RequestTrace::APPLY_BEGIN},
+        {RequestTrace::APPLY_BEGIN, RequestTrace::APPLY_END},
+    };
+}
+
+const char * RequestTracer::spanName(Span span)
+{
+    switch (span)
+    {
+        case QUEUE:
+            return "queue";
+        case FORWARDING:
+            return "forward";
+        case BATCH:
+            return "batch";
+        case LOG_WRITE:
+            return "log_write";
+        case REPLICATE:
+            return "replicate";
+        case COMMIT_QUEUE:
+            return "commit_queue";
+        case APPLY:
+            return "apply";
+        case TOTAL:
+            return "total";
+    }
+    return "unknown";
+}
+
+void RequestTracer::record(const RequestTrace & trace, int64_t session_id, int32_t xid, Coordination::OpNum opnum, int32_t forwarded_from)
+{
+    for (size_t span = 0; span < std::size(SPAN_STAGES); ++span)
+    {
+        UInt64 from = trace.stage_us[SPAN_STAGES[span].from];
+        UInt64 to = trace.stage_us[SPAN_STAGES[span].to];
+        if (from && to >= from)
+            spans[span].record(to - from);
+    }
+
+    UInt64 first = 0;
+    UInt64 last = 0;
+    for (UInt64 stage_us : trace.stage_us)
+    {
+        if (!stage_us)
+            continue;
+        if (!first || stage_us < first)
+            first = stage_us;
+        last = std::max(last, stage_us);
+    }
+    if (!first)
+        return;
+
+    UInt64 total_us = last - first;
+    spans[TOTAL].record(total_us);
+
+    UInt64 threshold = slow_us.load(std::memory_order_relaxed);
+    if (!threshold || total_us < threshold)
+        return;
+
+    std::lock_guard lock(slow_traces_mutex);
+    if (slow_traces.size() >= SLOW_TRACES)
+        slow_traces.pop_front();
+    slow_traces.push_back(SlowTrace{session_id, xid, opnum, forwarded_from, trace});
+}
+
+std::vector<RequestTracer::SlowTrace> RequestTracer::getSlowTraces() const
+{
+    std::lock_guard lock(slow_traces_mutex);
+    return {slow_traces.begin(), slow_traces.end()};
+}
+
+void RequestTracer::reset()
+{
+    for (auto & span : spans)
+        span.reset();
+    std::lock_guard lock(slow_traces_mutex);
+    slow_traces.clear();
+}
+
+}
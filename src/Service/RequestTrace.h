@@ -0,0 +1,98 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <Service/LatencyHistogram.h>
+#include <Common/Stopwatch.h>
+
+namespace RK
+{
+
+/** Monotonic time in microseconds when a request passed the stages of the pipeline, 0 for the stages it did not pass.
+ *
+ * A write request on the leader passes all of them but FORWARD, one on a follower ends at FORWARD and is traced
+ * again on the leader from RECEIVE. Reads skip the Raft stages. Requests parsed from the log, such as the ones
+ * of other servers, are traced from PRE_COMMIT or COMMIT.
+ */
+struct RequestTrace
+{
+    enum Stage : uint8_t
+    {
+        /// Put into the dispatcher queue
+        RECEIVE = 0,
+        /// Popped by a request thread of the dispatcher
+        DISPATCH = 1,
+        /// Sent to the leader
+        FORWARD = 2,
+        /// Handed to Raft, after batching by the accumulator
+        APPEND = 3,
+        /// Written to the local log
+        PRE_COMMIT = 4,
+        /// Committed by the quorum
+        COMMIT = 5,
+        APPLY_BEGIN = 6,
+        APPLY_END = 7,
+    };
+
+    static constexpr size_t STAGES = 8;
+
+    UInt64 stage_us[STAGES]{};
+
+    void mark(Stage stage) { stage_us[stage] = clock_gettime_ns() / 1000; }
+};
+
+/** Durations between the stages of RequestTrace aggregated in histograms, and the traces of requests slower than
+ * a threshold end to end, the last SLOW_TRACES of them are kept.
+ */
+class RequestTracer
+{
+public:
+    /// Durations between two stages, recorded when a request passed both
+    enum Span : uint8_t
+    {
+        QUEUE = 0,
+        FORWARDING = 1,
+        BATCH = 2,
+        LOG_WRITE = 3,
+        REPLICATE = 4,
+        COMMIT_QUEUE = 5,
+        APPLY = 6,
+        TOTAL = 7,
+    };
+
+    static constexpr size_t SPANS = 8;
+    static constexpr size_t SLOW_TRACES = 128;
+
+    struct SlowTrace
+    {
+        int64_t session_id;
+        int32_t xid;
+        Coordination::OpNum opnum;
+        /// -1 if the request is from a local session
+        int32_t forwarded_from;
+        RequestTrace trace;
+    };
+
+    static const char * spanName(Span span);
+
+    /// 0 does not keep slow traces
+    void setSlowThreshold(UInt64 slow_us_) { slow_us.store(slow_us_, std::memory_order_relaxed); }
+
+    void record(const RequestTrace & trace, int64_t session_id, int32_t xid, Coordination::OpNum opnum, int32_t forwarded_from);
+
+    const LatencyHistogram & get(Span span) const { return spans[span]; }
+    /// Oldest first
+    std::vector<SlowTrace> getSlowTraces() const;
+
+    void reset();
+
+private:
+    std::array<LatencyHistogram, SPANS> spans;
+    std::atomic<UInt64> slow_us{0};
+
+    mutable std::mutex slow_traces_mutex;
+    std::deque<SlowTrace> slow_traces;
+};
+
+}
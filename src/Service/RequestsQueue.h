@@ -1,15 +1,15 @@
 #pragma once
 
-#include <Common/ConcurrentBoundedQueue.h>
+#include <Common/MPMCBoundedQueue.h>
 #include <Service/NuRaftStateMachine.h>
-#include <boost/lockfree/queue.hpp>
 
 namespace RK
 {
 
+/// Requests sharded by session id, every shard is a lock-free ring so that a hop in the pipeline does not take a mutex.
 struct RequestsQueue
 {
-    using Queue = ConcurrentBoundedQueue<KeeperStore::RequestForSession>;
+    using Queue = MPMCBoundedQueue<KeeperStore::RequestForSession>;
 
     std::vector<ptr<Queue>> queues;
 
@@ -25,17 +25,18 @@ struct RequestsQueue
         }
     }
 
-    bool push(const KeeperStore::RequestForSession & request)
-    {
-        return queues[request.session_id % queues.size()]->push(std::forward<const KeeperStore::RequestForSession>(request));
-    }
+    bool push(const KeeperStore::RequestForSession & request) { return queueFor(request).push(request); }
+    /// The request is moved into the queue only if it is pushed
+    bool push(KeeperStore::RequestForSession && request) { return queueFor(request).push(std::move(request)); }
 
-    bool tryPush(const KeeperStore::RequestForSession & request, UInt64 wait_ms = 0)
+    bool tryPush(const KeeperStore::RequestForSession & request, UInt64 wait_ms = 0) { return queueFor(request).tryPush(request, wait_ms); }
+    bool tryPush(KeeperStore::RequestForSession && request, UInt64 wait_ms = 0)
     {
-        return queues[request.session_id % queues.size()]->tryPush(
-            std::forward<const KeeperStore::RequestForSession>(request), wait_ms);
+        return queueFor(request).tryPush(std::move(request), wait_ms);
     }
 
+    Queue & queueFor(const KeeperStore::RequestForSession & request) { return *queues[request.session_id % queues.size()]; }
+
     bool pop(size_t queue_id, KeeperStore::RequestForSession & request)
     {
         assert(queue_id != 0 && queue_id <= queues.size());
@@ -55,11 +56,18 @@ struct RequestsQueue
     }
 
 
+    /// Pop at most max_count requests of queue_id into requests without waiting, returns the number popped.
+    size_t tryPopMany(size_t queue_id, std::vector<KeeperStore::RequestForSession> & requests, size_t max_count)
+    {
+        assert(queue_id < queues.size());
+        return queues[queue_id]->tryPopMany(requests, max_count);
+    }
+
     bool tryPopAny(KeeperStore::RequestForSession & request, UInt64 wait_ms = 0)
     {
         for (const auto & queue : queues)
         {
-            if (queue->tryPop(request, wait_ms * 1000))
+            if (queue->tryPop(request, wait_ms))
                 return true;
         }
         return false;
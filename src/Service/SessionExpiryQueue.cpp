@@ -25,15 +25,6 @@ bool SessionExpiryQueue::remove(int64_t session_id)
     return false;
 }
 
-void SessionExpiryQueue::addNewSessionOrUpdate(int64_t session_id, int64_t timeout_ms)
-{
-    int64_t now = getNowMilliseconds();
-    /// round up to next interval
-    int64_t new_expiry_time = roundToNextInterval(now + timeout_ms);
-
-    setSessionExpirationTime(session_id, new_expiry_time);
-}
-
 void SessionExpiryQueue::setSessionExpirationTime(int64_t session_id, int64_t expiration_time)
 {
     int64_t new_expiry_time = expiration_time;
@@ -78,9 +69,9 @@ void SessionExpiryQueue::setSessionExpirationTime(int64_t session_id, int64_t ex
     }
 }
 
-std::vector<int64_t> SessionExpiryQueue::getExpiredSessions() const
+std::vector<int64_t> SessionExpiryQueue::getExpiredSessions()
 {
-    int64_t now = getNowMilliseconds();
+    int64_t now = nowMilliseconds();
     std::vector<int64_t> result;
 
     /// Check all buckets
@@ -95,11 +86,6 @@ std::vector<int64_t> SessionExpiryQueue::getExpiredSessions() const
     return result;
 }
 
-const std::unordered_map<int64_t, int64_t> & SessionExpiryQueue::sessionToExpirationTime()
-{
-    return session_to_expiration_time;
-}
-
 void SessionExpiryQueue::clear()
 {
     session_to_expiration_time.clear();
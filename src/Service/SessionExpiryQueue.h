@@ -4,29 +4,28 @@
 #include <unordered_set>
 #include <map>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace RK
 {
 
-/// Simple class for checking expired sessions. Main idea -- to round sessions
-/// timeouts and place all sessions into buckets rounded by their expired time.
-/// So we will have not too many different buckets and can check expired
-/// sessions quite fast.
-/// So buckets looks like this:
-/// [1630580418000] -> {1, 5, 6}
-/// [1630580418500] -> {2, 3}
-/// ...
-/// When new session appear it's added to the existing bucket or create new bucket.
-class SessionExpiryQueue
+/// Buckets of sessions by expiration time, expiration times are rounded up to expiration_interval.
+class ISessionExpiryQueue
 {
-private:
-    /// Session -> timeout ms
-    std::unordered_map<int64_t, int64_t> session_to_expiration_time;
-
-    /// Expire time -> session expire near this time
-    std::map<int64_t, std::unordered_set<int64_t>> expiry_to_sessions;
+public:
+    /// expiration_interval -- how often we will check new sessions and how small
+    /// buckets we will have. In ZooKeeper normal session timeout is around 30 seconds
+    /// and expiration_interval is about 500ms.
+    /// Milliseconds since epoch, tests pass their own clock
+    using Clock = std::function<int64_t()>;
 
-    int64_t expiration_interval;
+    explicit ISessionExpiryQueue(int64_t expiration_interval_, Clock clock_ = {})
+        : expiration_interval(expiration_interval_), clock(std::move(clock_))
+    {
+    }
+    virtual ~ISessionExpiryQueue() = default;
 
     static int64_t getNowMilliseconds()
     {
@@ -34,36 +33,66 @@ private:
         return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
     }
 
-    /// Round time to the next expiration interval. The result used as a key for
-    /// expiry_to_sessions map.
+    /// Now by the clock of the queue
+    int64_t nowMilliseconds() const { return clock ? clock() : getNowMilliseconds(); }
+
+    /// Round time to the next expiration interval.
     int64_t roundToNextInterval(int64_t time) const
     {
         return (time / expiration_interval + 1) * expiration_interval;
     }
 
-public:
-    /// expiration_interval -- how often we will check new sessions and how small
-    /// buckets we will have. In ZooKeeper normal session timeout is around 30 seconds
-    /// and expiration_interval is about 500ms.
-    explicit SessionExpiryQueue(int64_t expiration_interval_)
-        : expiration_interval(expiration_interval_)
+    /// Session was actually removed
+    virtual bool remove(int64_t session_id) = 0;
+
+    /// Update session expiry time (must be called on hearbeats)
+    void addNewSessionOrUpdate(int64_t session_id, int64_t timeout_ms)
     {
+        setSessionExpirationTime(session_id, roundToNextInterval(nowMilliseconds() + timeout_ms));
     }
 
-    /// Session was actually removed
-    bool remove(int64_t session_id);
+    virtual void setSessionExpirationTime(int64_t session_id, int64_t expiration_time) = 0;
 
-    /// Update session expiry time (must be called on hearbeats)
-    void addNewSessionOrUpdate(int64_t session_id, int64_t timeout_ms);
+    /// Get all expired sessions, a session is returned until it is removed or gets a later expiration time.
+    virtual std::vector<int64_t> getExpiredSessions() = 0;
+
+    virtual void clear() = 0;
+
+protected:
+    int64_t expiration_interval;
+    Clock clock;
+};
+
+using SessionExpiryQueuePtr = std::unique_ptr<ISessionExpiryQueue>;
+
+/// Simple class for checking expired sessions. Main idea -- to round sessions
+/// timeouts and place all sessions into buckets rounded by their expired time.
+/// So we will have not too many different buckets and can check expired
+/// sessions quite fast.
+/// So buckets looks like this:
+/// [1630580418000] -> {1, 5, 6}
+/// [1630580418500] -> {2, 3}
+/// ...
+/// When new session appear it's added to the existing bucket or create new bucket.
+class SessionExpiryQueue final : public ISessionExpiryQueue
+{
+private:
+    /// Session -> timeout ms
+    std::unordered_map<int64_t, int64_t> session_to_expiration_time;
+
+    /// Expire time -> session expire near this time
+    std::map<int64_t, std::unordered_set<int64_t>> expiry_to_sessions;
+
+public:
+    using ISessionExpiryQueue::ISessionExpiryQueue;
 
-    /// Get all expired sessions
-    std::vector<int64_t> getExpiredSessions() const;
+    bool remove(int64_t session_id) override;
 
-    const std::unordered_map<int64_t, int64_t> & sessionToExpirationTime();
+    void setSessionExpirationTime(int64_t session_id, int64_t expiration_time) override;
 
-    void setSessionExpirationTime(int64_t session_id, int64_t expiration_time);
+    std::vector<int64_t> getExpiredSessions() override;
 
-    void clear();
+    void clear() override;
 };
 
 }
@@ -0,0 +1,96 @@
+#include <Service/SessionExpiryWheel.h>
+#include <algorithm>
+
+namespace RK
+{
+
+SessionExpiryWheel::SessionExpiryWheel(int64_t expiration_interval_, Clock clock_)
+    : ISessionExpiryQueue(expiration_interval_, std::move(clock_)), slots(WHEEL_SIZE), walked_tick(tickOf(nowMilliseconds()) - 1)
+{
+}
+
+void SessionExpiryWheel::unlink(int64_t session_id, int64_t expiration_time)
+{
+    if (tickOf(expiration_time) <= walked_tick)
+        expired.erase(session_id);
+    else
+        slotOf(tickOf(expiration_time)).erase(session_id);
+}
+
+bool SessionExpiryWheel::remove(int64_t session_id)
+{
+    auto it = session_to_expiration_time.find(session_id);
+    if (it == session_to_expiration_time.end())
+        return false;
+
+    unlink(session_id, it->second);
+    session_to_expiration_time.erase(it);
+    return true;
+}
+
+void SessionExpiryWheel::setSessionExpirationTime(int64_t session_id, int64_t expiration_time)
+{
+    auto [it, inserted] = session_to_expiration_time.try_emplace(session_id, expiration_time);
+    if (!inserted)
+    {
+        if (it->second == expiration_time)
+            return;
+        unlink(session_id, it->second);
+        it->second = expiration_time;
+    }
+
+    int64_t tick = tickOf(expiration_time);
+    if (tick <= walked_tick)
+        expired.insert(session_id);
+    else
+        slotOf(tick).insert(session_id);
+}
+
+std::vector<int64_t> SessionExpiryWheel::getExpiredSessions()
+{
+    int64_t now = nowMilliseconds();
+    int64_t now_tick = tickOf(now);
+
+    /// Walk slots in (walked_tick, now_tick], slots of a whole turn at most
+    int64_t begin_tick = std::max(walked_tick + 1, now_tick - static_cast<int64_t>(WHEEL_SIZE) + 1);
+    for (int64_t tick = begin_tick; tick <= now_tick; ++tick)
+    {
+        auto & slot = slotOf(tick);
+        for (auto it = slot.begin(); it != slot.end();)
+        {
+            /// Sessions of later turns stay in the slot
+            if (tickOf(session_to_expiration_time[*it]) < now_tick)
+            {
+                expired.insert(*it);
+                it = slot.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    /// Slot of now_tick is not finished, sessions in it may expire later in the tick
+    walked_tick = now_tick - 1;
+
+    std::vector<int64_t> result(expired.begin(), expired.end());
+    auto & current_slot = slotOf(now_tick);
+    for (auto session_id : current_slot)
+    {
+        int64_t expiration_time = session_to_expiration_time[session_id];
+        if (tickOf(expiration_time) == now_tick && expiration_time <= now)
+            result.push_back(session_id);
+    }
+    return result;
+}
+
+void SessionExpiryWheel::clear()
+{
+    session_to_expiration_time.clear();
+    for (auto & slot : slots)
+        slot.clear();
+    expired.clear();
+    walked_tick = tickOf(nowMilliseconds()) - 1;
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Service/SessionExpiryQueue.h>
+
+namespace RK
+{
+
+/** Hashed timer wheel of session expiration times.
+ *
+ * There is a slot for every expiration_interval (the tick), the slot of an expiration time is its
+ * tick modulo WHEEL_SIZE. Moving a session to another slot is O(1). Collecting walks only the slots
+ * passed since the last collection, sessions found expired are moved to an expired set which is
+ * returned until they are removed, so collection is O(expired) amortized.
+ *
+ * WHEEL_SIZE ticks cover far more than usual session timeouts. A session expiring later than a whole
+ * turn stays in its slot and is checked against its expiration time every time the slot is walked.
+ */
+class SessionExpiryWheel final : public ISessionExpiryQueue
+{
+public:
+    static constexpr size_t WHEEL_SIZE = 4096;
+
+    explicit SessionExpiryWheel(int64_t expiration_interval_, Clock clock_ = {});
+
+    bool remove(int64_t session_id) override;
+
+    void setSessionExpirationTime(int64_t session_id, int64_t expiration_time) override;
+
+    std::vector<int64_t> getExpiredSessions() override;
+
+    void clear() override;
+
+private:
+    int64_t tickOf(int64_t time) const { return time / expiration_interval; }
+    std::unordered_set<int64_t> & slotOf(int64_t tick) { return slots[static_cast<uint64_t>(tick) % WHEEL_SIZE]; }
+
+    /// Remove session from its slot or from expired set.
+    void unlink(int64_t session_id, int64_t expiration_time);
+
+    /// Session -> expiration time
+    std::unordered_map<int64_t, int64_t> session_to_expiration_time;
+
+    std::vector<std::unordered_set<int64_t>> slots;
+    /// Sessions expired but not removed yet
+    std::unordered_set<int64_t> expired;
+
+    /// Slots before and at walked_tick are walked, sessions expiring in them are in expired.
+    int64_t walked_tick;
+};
+
+}
@@ -0,0 +1,167 @@
+#include <Service/SessionSync.h>
+#include <algorithm>
+#include <IO/VarInt.h>
+#include <Common/Exception.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int CORRUPTED_DATA;
+}
+
+void writeSessionDelta(const SessionDelta & delta, WriteBuffer & out)
+{
+    writeVarUInt(delta.round, out);
+    writeVarUInt(delta.sessions.size(), out);
+    if (delta.sessions.empty())
+        return;
+
+    int64_t base = delta.sessions.front().second;
+    for (const auto & session : delta.sessions)
+        base = std::min(base, session.second);
+    writeVarInt(base, out);
+
+    int64_t prev_session_id = 0;
+    for (const auto & [session_id, expiration_time] : delta.sessions)
+    {
+        writeVarInt(session_id - prev_session_id, out);
+        writeVarUInt(static_cast<UInt64>(expiration_time - base), out);
+        prev_session_id = session_id;
+    }
+}
+
+void readSessionDelta(SessionDelta & delta, ReadBuffer & in)
+{
+    readVarUInt(delta.round, in);
+    UInt64 size;
+    readVarUInt(size, in);
+
+    delta.sessions.clear();
+    if (!size)
+        return;
+
+    /// A session takes 2 bytes at least
+    if (size > in.available() / 2)
+        throw Exception(ErrorCodes::CORRUPTED_DATA, "Session delta of {} sessions in {} bytes", size, in.available());
+
+    Int64 base;
+    readVarInt(base, in);
+
+    delta.sessions.reserve(size);
+    int64_t session_id = 0;
+    for (UInt64 i = 0; i < size; ++i)
+    {
+        Int64 session_id_delta;
+        readVarInt(session_id_delta, in);
+        UInt64 expiration_delta;
+        readVarUInt(expiration_delta, in);
+
+        session_id += session_id_delta;
+        delta.sessions.emplace_back(session_id, base + static_cast<int64_t>(expiration_delta));
+    }
+}
+
+SessionDelta SessionSyncTracker::next(const std::unordered_map<int64_t, int64_t> & local_sessions, UInt64 term)
+{
+    std::lock_guard lock(mutex);
+    if (term != last_term)
+    {
+        acknowledged.clear();
+        /// Rounds sent to the old leader are never acknowledged
+        pending.clear();
+        last_term = term;
+    }
+
+    /// Closed sessions are forgotten, the leader closes them by requests
+    std::erase_if(acknowledged, [&](const auto & session) { return !local_sessions.contains(session.first); });
+
+    SessionDelta delta;
+    delta.round = ++last_round;
+    for (const auto & [session_id, expiration_time] : local_sessions)
+    {
+        auto it = acknowledged.find(session_id);
+        if (it == acknowledged.end() || it->second != expiration_time)
+            delta.sessions.emplace_back(session_id, expiration_time);
+    }
+    std::sort(delta.sessions.begin(), delta.sessions.end());
+    addPending(delta);
+    return delta;
+}
+
+SessionDelta SessionSyncTracker::nextLeases(
+    const std::unordered_map<int64_t, int64_t> & local_sessions,
+    const std::unordered_map<int64_t, int64_t> & all_sessions,
+    UInt64 term,
+    UInt64 lease_ms)
+{
+    std::lock_guard lock(mutex);
+    if (term != last_term)
+    {
+        acknowledged.clear();
+        /// Rounds sent to the old leader are never acknowledged
+        pending.clear();
+        last_term = term;
+    }
+
+    SessionDelta delta;
+    delta.round = ++last_round;
+    for (auto it = acknowledged.begin(); it != acknowledged.end();)
+    {
+        if (local_sessions.contains(it->first))
+        {
+            ++it;
+            continue;
+        }
+
+        /// The lease is given back, the session is forgotten once the leader has its real expiration time
+        auto session = all_sessions.find(it->first);
+        if (session == all_sessions.end() || session->second == it->second)
+        {
+            it = acknowledged.erase(it);
+            continue;
+        }
+        delta.sessions.emplace_back(session->first, session->second);
+        ++it;
+    }
+
+    auto lease = static_cast<int64_t>(lease_ms);
+    for (const auto & [session_id, expiration_time] : local_sessions)
+    {
+        auto it = acknowledged.find(session_id);
+        if (it == acknowledged.end() || it->second < expiration_time + lease / 2)
+            delta.sessions.emplace_back(session_id, expiration_time + lease);
+    }
+    std::sort(delta.sessions.begin(), delta.sessions.end());
+    addPending(delta);
+    return delta;
+}
+
+void SessionSyncTracker::addPending(const SessionDelta & delta)
+{
+    pending.push_back(delta);
+    if (pending.size() > MAX_PENDING_ROUNDS)
+        pending.pop_front();
+}
+
+void SessionSyncTracker::acknowledge(UInt64 round)
+{
+    std::lock_guard lock(mutex);
+    auto it = std::find_if(pending.begin(), pending.end(), [round](const auto & delta) { return delta.round == round; });
+    /// Superseded by a later round, or forgotten
+    if (it == pending.end())
+        return;
+
+    for (const auto & [session_id, expiration_time] : it->sessions)
+        acknowledged[session_id] = expiration_time;
+    pending.erase(pending.begin(), it + 1);
+}
+
+size_t SessionSyncTracker::acknowledgedSize() const
+{
+    std::lock_guard lock(mutex);
+    return acknowledged.size();
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <IO/ReadBuffer.h>
+#include <IO/WriteBuffer.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/// Sessions of a follower whose expiration time changed, sent to the leader in one sync round
+struct SessionDelta
+{
+    UInt64 round = 0;
+    /// session id -> expiration time, sorted by session id
+    std::vector<std::pair<int64_t, int64_t>> sessions;
+};
+
+/** Sessions are written sorted, every id as varint delta of the previous one and every expiration
+ * time as varint delta of the smallest one, so that a session takes 3 or 4 bytes rather than 16.
+ */
+void writeSessionDelta(const SessionDelta & delta, WriteBuffer & out);
+/// in holds the whole delta, as received in one package
+void readSessionDelta(SessionDelta & delta, ReadBuffer & in);
+
+/** Expiration times of local sessions acknowledged by the leader, so that a sync round sends only
+ * the sessions which changed.
+ *
+ * A round not acknowledged is sent again by the next one as its sessions are still different from
+ * the acknowledged ones. Everything is sent again when the term changes, as the new leader knows
+ * nothing of what was sent to the old one.
+ *
+ * Rounds are kept until they are acknowledged, so an acknowledgement arriving after the next round is
+ * sent still counts. An acknowledged round supersedes the rounds before it, whose late acknowledgements
+ * are ignored, as the sessions of them still not acknowledged are in it too.
+ */
+class SessionSyncTracker
+{
+public:
+    /// Sessions of local_sessions (session id -> expiration time) not acknowledged in term yet
+    SessionDelta next(const std::unordered_map<int64_t, int64_t> & local_sessions, UInt64 term);
+
+    /** With leases, see RaftSettings::session_lease_ms: a local session is sent with its expiration time plus lease_ms
+     * when the acknowledged lease of it is shorter than half of lease_ms. A session no longer local, whose client
+     * disconnected, is sent once with its expiration time of all_sessions, so that the leader expires it in time.
+     */
+    SessionDelta nextLeases(
+        const std::unordered_map<int64_t, int64_t> & local_sessions,
+        const std::unordered_map<int64_t, int64_t> & all_sessions,
+        UInt64 term,
+        UInt64 lease_ms);
+
+    /// The leader applied round
+    void acknowledge(UInt64 round);
+
+    /// Rounds kept for acknowledgements, the oldest is forgotten beyond it
+    static constexpr size_t MAX_PENDING_ROUNDS = 16;
+
+    size_t acknowledgedSize() const;
+
+private:
+    /// Under mutex
+    void addPending(const SessionDelta & delta);
+
+    mutable std::mutex mutex;
+    std::unordered_map<int64_t, int64_t> acknowledged;
+    /// Rounds sent and not acknowledged yet, oldest first
+    std::deque<SessionDelta> pending;
+    UInt64 last_round = 0;
+    UInt64 last_term = 0;
+};
+
+}
@@ -0,0 +1,214 @@
+#include <Service/SessionTable.h>
+#include <Service/SessionExpiryWheel.h>
+
+namespace RK
+{
+
+SessionTable::SessionTable(int64_t expiration_interval, SessionExpiryType expiry_type, ISessionExpiryQueue::Clock clock)
+{
+    if (expiry_type == SessionExpiryType::TIMER_WHEEL)
+        expiry_queue = std::make_unique<SessionExpiryWheel>(expiration_interval, std::move(clock));
+    else
+        expiry_queue = std::make_unique<SessionExpiryQueue>(expiration_interval, std::move(clock));
+}
+
+bool SessionTable::add(int64_t session_id, int64_t timeout_ms)
+{
+    int64_t expiration_time = expiry_queue->roundToNextInterval(nowMilliseconds() + timeout_ms);
+    bool inserted;
+    {
+        auto & shard = shardFor(session_id);
+        std::unique_lock lock(shard.mutex);
+        auto [it, emplaced] = shard.sessions.try_emplace(session_id, timeout_ms);
+        it->second.expiration_time.store(expiration_time, std::memory_order_relaxed);
+        inserted = emplaced;
+    }
+    if (inserted)
+        session_count.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard lock(expiry_mutex);
+    expiry_queue->setSessionExpirationTime(session_id, expiration_time);
+    return inserted;
+}
+
+bool SessionTable::remove(int64_t session_id)
+{
+    {
+        auto & shard = shardFor(session_id);
+        std::unique_lock lock(shard.mutex);
+        if (!shard.sessions.erase(session_id))
+            return false;
+    }
+    session_count.fetch_sub(1, std::memory_order_relaxed);
+
+    std::lock_guard lock(expiry_mutex);
+    expiry_queue->remove(session_id);
+    return true;
+}
+
+bool SessionTable::touch(int64_t session_id, int64_t now_ms)
+{
+    auto & shard = shardFor(session_id);
+    std::shared_lock lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it == shard.sessions.end())
+        return false;
+
+    auto & session = it->second;
+    int64_t expiration_time = expiry_queue->roundToNextInterval(now_ms + session.timeout_ms);
+    /// Requests in the same interval do not write the shared cache line
+    if (session.expiration_time.load(std::memory_order_relaxed) < expiration_time)
+        session.expiration_time.store(expiration_time, std::memory_order_relaxed);
+    return true;
+}
+
+void SessionTable::touchAll(int64_t now_ms)
+{
+    for (auto & shard : shards)
+    {
+        std::shared_lock lock(shard.mutex);
+        for (auto & [session_id, session] : shard.sessions)
+        {
+            int64_t expiration_time = expiry_queue->roundToNextInterval(now_ms + session.timeout_ms);
+            if (session.expiration_time.load(std::memory_order_relaxed) < expiration_time)
+                session.expiration_time.store(expiration_time, std::memory_order_relaxed);
+        }
+    }
+}
+
+void SessionTable::setExpirationTime(int64_t session_id, int64_t expiration_time)
+{
+    auto & shard = shardFor(session_id);
+    std::shared_lock lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it != shard.sessions.end())
+        it->second.expiration_time.store(expiration_time, std::memory_order_relaxed);
+}
+
+void SessionTable::setExpirationTimes(const std::vector<std::pair<int64_t, int64_t>> & session_to_expiration_time)
+{
+    std::vector<const std::pair<int64_t, int64_t> *> of_shard[SHARDS];
+    for (const auto & session : session_to_expiration_time)
+        of_shard[static_cast<uint64_t>(session.first) % SHARDS].push_back(&session);
+
+    for (size_t i = 0; i < SHARDS; ++i)
+    {
+        if (of_shard[i].empty())
+            continue;
+
+        auto & shard = shards[i];
+        std::shared_lock lock(shard.mutex);
+        for (const auto * session : of_shard[i])
+        {
+            auto it = shard.sessions.find(session->first);
+            if (it != shard.sessions.end())
+                it->second.expiration_time.store(session->second, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool SessionTable::contains(int64_t session_id) const
+{
+    const auto & shard = shardFor(session_id);
+    std::shared_lock lock(shard.mutex);
+    return shard.sessions.contains(session_id);
+}
+
+std::optional<int64_t> SessionTable::getTimeout(int64_t session_id) const
+{
+    const auto & shard = shardFor(session_id);
+    std::shared_lock lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it == shard.sessions.end())
+        return {};
+    return it->second.timeout_ms;
+}
+
+std::optional<int64_t> SessionTable::getExpirationTime(int64_t session_id) const
+{
+    const auto & shard = shardFor(session_id);
+    std::shared_lock lock(shard.mutex);
+    auto it = shard.sessions.find(session_id);
+    if (it == shard.sessions.end())
+        return {};
+    return it->second.expiration_time.load(std::memory_order_relaxed);
+}
+
+std::vector<int64_t> SessionTable::getExpiredSessionsOf(const std::vector<int64_t> & session_ids) const
+{
+    int64_t now = nowMilliseconds();
+    std::vector<int64_t> result;
+    for (auto session_id : session_ids)
+    {
+        auto expiration_time = getExpirationTime(session_id);
+        if (expiration_time && *expiration_time <= now)
+            result.push_back(session_id);
+    }
+    return result;
+}
+
+size_t SessionTable::size() const
+{
+    return session_count.load(std::memory_order_relaxed);
+}
+
+SessionTable::SessionAndTimeout SessionTable::getSessionAndTimeout() const
+{
+    SessionAndTimeout result;
+    result.reserve(size());
+    for (const auto & shard : shards)
+    {
+        std::shared_lock lock(shard.mutex);
+        for (const auto & [session_id, session] : shard.sessions)
+            result.emplace(session_id, session.timeout_ms);
+    }
+    return result;
+}
+
+std::unordered_map<int64_t, int64_t> SessionTable::sessionToExpirationTime() const
+{
+    std::unordered_map<int64_t, int64_t> result;
+    result.reserve(size());
+    for (const auto & shard : shards)
+    {
+        std::shared_lock lock(shard.mutex);
+        for (const auto & [session_id, session] : shard.sessions)
+            result.emplace(session_id, session.expiration_time.load(std::memory_order_relaxed));
+    }
+    return result;
+}
+
+std::vector<int64_t> SessionTable::getExpiredSessions()
+{
+    std::lock_guard lock(expiry_mutex);
+
+    int64_t now = nowMilliseconds();
+    std::vector<int64_t> result;
+    for (auto session_id : expiry_queue->getExpiredSessions())
+    {
+        auto expiration_time = getExpirationTime(session_id);
+        if (!expiration_time)
+            expiry_queue->remove(session_id);
+        else if (*expiration_time > now)
+            /// Touched after it was bucketed
+            expiry_queue->setSessionExpirationTime(session_id, *expiration_time);
+        else
+            result.push_back(session_id);
+    }
+    return result;
+}
+
+void SessionTable::clear()
+{
+    for (auto & shard : shards)
+    {
+        std::unique_lock lock(shard.mutex);
+        session_count.fetch_sub(shard.sessions.size(), std::memory_order_relaxed);
+        shard.sessions.clear();
+    }
+
+    std::lock_guard lock(expiry_mutex);
+    expiry_queue->clear();
+}
+
+}
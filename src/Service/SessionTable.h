@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include <Service/SessionExpiryQueue.h>
+#include <Service/Settings.h>
+#include <Common/ProfilingMutex.h>
+
+namespace RK
+{
+
+/** Sessions and their timeouts, sharded by session id.
+ *
+ * Every request touches its session. Touch takes only the shared lock of a shard and stores the
+ * new expiration time into an atomic, so requests of different sessions do not contend and no
+ * session is moved between expiry buckets on the request path.
+ *
+ * Expiry buckets are brought up to date lazily by getExpiredSessions: a session found in an
+ * expired bucket is checked against its real expiration time and moved to the right bucket if
+ * it was touched since it was bucketed.
+ */
+class SessionTable
+{
+public:
+    using SessionAndTimeout = std::unordered_map<int64_t, int64_t>;
+
+    static constexpr size_t SHARDS = 32;
+
+    SessionTable(int64_t expiration_interval, SessionExpiryType expiry_type, ISessionExpiryQueue::Clock clock = {});
+
+    /// Add session if not exists and refresh its expiration time, return false if it exists.
+    bool add(int64_t session_id, int64_t timeout_ms);
+    bool remove(int64_t session_id);
+
+    /// Refresh expiration time of session, return false if it does not exist.
+    bool touch(int64_t session_id) { return touch(session_id, nowMilliseconds()); }
+    /// Refresh expiration time of session as if it was touched at now_ms.
+    bool touch(int64_t session_id, int64_t now_ms);
+    /// Refresh expiration time of every session as if it was touched at now_ms.
+    void touchAll(int64_t now_ms);
+
+    /// Set expiration time of a session, used for sessions connected to other servers.
+    void setExpirationTime(int64_t session_id, int64_t expiration_time);
+    /// Same for many sessions, taking the lock of every shard once.
+    void setExpirationTimes(const std::vector<std::pair<int64_t, int64_t>> & session_to_expiration_time);
+
+    bool contains(int64_t session_id) const;
+    std::optional<int64_t> getTimeout(int64_t session_id) const;
+    size_t size() const;
+
+    /// Copy of session -> timeout ms
+    SessionAndTimeout getSessionAndTimeout() const;
+    /// Copy of session -> expiration time
+    std::unordered_map<int64_t, int64_t> sessionToExpirationTime() const;
+
+    std::vector<int64_t> getExpiredSessions();
+    /// Sessions of session_ids expired by now, without the buckets, for a few sessions of many
+    std::vector<int64_t> getExpiredSessionsOf(const std::vector<int64_t> & session_ids) const;
+
+    void clear();
+
+    /// Now by the clock of the table
+    int64_t nowMilliseconds() const { return expiry_queue->nowMilliseconds(); }
+
+private:
+    struct Session
+    {
+        explicit Session(int64_t timeout_ms_) : timeout_ms(timeout_ms_) { }
+
+        const int64_t timeout_ms;
+        std::atomic<int64_t> expiration_time{0};
+    };
+
+    struct Shard
+    {
+        mutable ProfilingMutex<std::shared_mutex, LockProfiler::SessionTableShard> mutex;
+        std::unordered_map<int64_t, Session> sessions;
+    };
+
+    Shard & shardFor(int64_t session_id) { return shards[static_cast<uint64_t>(session_id) % SHARDS]; }
+    const Shard & shardFor(int64_t session_id) const { return shards[static_cast<uint64_t>(session_id) % SHARDS]; }
+
+    /// Real expiration time of session, nullopt if it does not exist.
+    std::optional<int64_t> getExpirationTime(int64_t session_id) const;
+
+    Shard shards[SHARDS];
+    std::atomic<size_t> session_count{0};
+
+    /// Buckets of expiration time, may lag behind the real expiration times
+    std::mutex expiry_mutex;
+    SessionExpiryQueuePtr expiry_queue;
+};
+
+}
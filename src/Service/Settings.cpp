@@ -1,6 +1,10 @@
+#include <climits>
 #include <filesystem>
 #include <IO/WriteHelpers.h>
+#include <Service/LogEntryCache.h>
+#include <Service/NuRaftLogSegment.h>
 #include <Service/Settings.h>
+#include <Poco/Environment.h>
 
 
 namespace RK
@@ -10,6 +14,42 @@ namespace ErrorCodes
 extern const int UNKNOWN_SETTING;
 }
 
+namespace
+{
+/// Parse CPU list like "2,3,8-11"
+std::vector<int> parseCpuList(const String & in)
+{
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < in.size())
+    {
+        size_t end = in.find(',', pos);
+        if (end == String::npos)
+            end = in.size();
+        String item = in.substr(pos, end - pos);
+        pos = end + 1;
+        if (item.empty())
+            continue;
+
+        try
+        {
+            size_t dash = item.find('-');
+            int first = std::stoi(item.substr(0, dash));
+            int last = dash == String::npos ? first : std::stoi(item.substr(dash + 1));
+            if (first < 0 || last < first)
+                throw std::invalid_argument(item);
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        catch (const std::logic_error &)
+        {
+            throw Exception("Invalid CPU list " + in, ErrorCodes::UNKNOWN_SETTING);
+        }
+    }
+    return cpus;
+}
+}
+
 namespace FsyncModeNS {
 FsyncMode parseFsyncMode(const String & in)
 {
@@ -37,6 +77,52 @@ String toString(FsyncMode mode)
 
 }
 
+namespace ContainerTypeNS {
+ContainerType parseContainerType(const String & in)
+{
+    if (in == "hash_map")
+        return ContainerType::HASH_MAP;
+    else if (in == "radix_tree")
+        return ContainerType::RADIX_TREE;
+    else
+        throw Exception("Unknown config 'container_type'.", ErrorCodes::UNKNOWN_SETTING);
+}
+
+String toString(ContainerType type)
+{
+    if (type == ContainerType::HASH_MAP)
+        return "hash_map";
+    else if (type == ContainerType::RADIX_TREE)
+        return "radix_tree";
+    else
+        throw Exception("Unknown config 'container_type'.", ErrorCodes::UNKNOWN_SETTING);
+}
+
+}
+
+namespace SessionExpiryTypeNS {
+SessionExpiryType parseSessionExpiryType(const String & in)
+{
+    if (in == "sorted_map")
+        return SessionExpiryType::SORTED_MAP;
+    else if (in == "timer_wheel")
+        return SessionExpiryType::TIMER_WHEEL;
+    else
+        throw Exception("Unknown config 'session_expiry_type'.", ErrorCodes::UNKNOWN_SETTING);
+}
+
+String toString(SessionExpiryType type)
+{
+    if (type == SessionExpiryType::SORTED_MAP)
+        return "sorted_map";
+    else if (type == SessionExpiryType::TIMER_WHEEL)
+        return "timer_wheel";
+    else
+        throw Exception("Unknown config 'session_expiry_type'.", ErrorCodes::UNKNOWN_SETTING);
+}
+
+}
+
 void RaftSettings::loadFromConfig(const String & config_elem, const Poco::Util::AbstractConfiguration & config)
 {
     if (!config.has(config_elem))
@@ -55,6 +141,8 @@ void RaftSettings::loadFromConfig(const String & config_elem, const Poco::Util::
         session_timeout_ms = config.getUInt(get_key("session_timeout_ms"), Coordination::DEFAULT_SESSION_TIMEOUT_MS);
         operation_timeout_ms = config.getUInt(get_key("operation_timeout_ms"), Coordination::DEFAULT_OPERATION_TIMEOUT_MS);
         dead_session_check_period_ms = config.getUInt(get_key("dead_session_check_period_ms"), 100);
+        max_expire_sessions_batch_size = config.getUInt(get_key("max_expire_sessions_batch_size"), 0);
+        session_id_block_size = config.getUInt(get_key("session_id_block_size"), 0);
         heart_beat_interval_ms = config.getUInt(get_key("heart_beat_interval_ms"), 500);
         election_timeout_lower_bound_ms = config.getUInt(get_key("election_timeout_lower_bound_ms"), 10000);
         election_timeout_upper_bound_ms = config.getUInt(get_key("election_timeout_upper_bound_ms"), 20000);
@@ -72,10 +160,90 @@ void RaftSettings::loadFromConfig(const String & config_elem, const Poco::Util::
         fresh_log_gap = config.getUInt(get_key("fresh_log_gap"), 200);
         configuration_change_tries_count = config.getUInt(get_key("configuration_change_tries_count"), 30);
         max_batch_size = config.getUInt(get_key("max_batch_size"), 1000);
+        max_batch_bytes = config.getUInt64(get_key("max_batch_bytes"), 0);
+        batch_latency_target_ms = config.getUInt(get_key("batch_latency_target_ms"), 0);
+        max_inflight_batches = config.getUInt(get_key("max_inflight_batches"), 1);
+        max_queued_read_requests = config.getUInt(get_key("max_queued_read_requests"), 0);
+        max_queued_write_requests = config.getUInt(get_key("max_queued_write_requests"), 0);
         log_fsync_mode = FsyncModeNS::parseFsyncMode(config.getString(get_key("log_fsync_mode"), "fsync_parallel"));
         log_fsync_interval = config.getUInt(get_key("log_fsync_interval"), 1000);
         session_consistent = config.getBool(get_key("session_consistent"), true);
         async_snapshot = config.getBool(get_key("async_snapshot"), false);
+        async_append_entries = config.getBool(get_key("async_append_entries"), false);
+        container_type = ContainerTypeNS::parseContainerType(config.getString(get_key("container_type"), "hash_map"));
+        subtree_stats_depth = config.getUInt(get_key("subtree_stats_depth"), 0);
+        session_expiry_type
+            = SessionExpiryTypeNS::parseSessionExpiryType(config.getString(get_key("session_expiry_type"), "sorted_map"));
+        prepare_response_frames = config.getBool(get_key("prepare_response_frames"), false);
+        linearizable_reads = config.getBool(get_key("linearizable_reads"), false);
+        max_forward_batch_size = std::max<UInt64>(config.getUInt(get_key("max_forward_batch_size"), 100), 1);
+        forward_batch_linger_us = config.getUInt(get_key("forward_batch_linger_us"), 0);
+        forward_connect_interval_ms = config.getUInt(get_key("forward_connect_interval_ms"), 100);
+        delta_session_sync = config.getBool(get_key("delta_session_sync"), false);
+        log_segment_preallocate = config.getBool(get_key("log_segment_preallocate"), false);
+        log_drop_page_cache = config.getBool(get_key("log_drop_page_cache"), false);
+        log_batch_append = config.getBool(get_key("log_batch_append"), false);
+        log_cache_max_bytes = config.getUInt64(get_key("log_cache_max_bytes"), LogEntryCache::DEFAULT_MAX_BYTES);
+        log_compression = config.getBool(get_key("log_compression"), false);
+        crc32c_checksum = config.getBool(get_key("crc32c_checksum"), false);
+        log_remove_bytes_per_second
+            = config.getUInt64(get_key("log_remove_bytes_per_second"), LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND);
+        log_raw_pack = config.getBool(get_key("log_raw_pack"), false);
+        log_persistent_memory = config.getBool(get_key("log_persistent_memory"), false);
+        batch_requests_in_entry = config.getBool(get_key("batch_requests_in_entry"), false);
+        snapshot_compression_level = config.getUInt(get_key("snapshot_compression_level"), 0);
+        snapshot_flat_format = config.getBool(get_key("snapshot_flat_format"), false);
+        snapshot_chunk_bytes = config.getUInt64(get_key("snapshot_chunk_bytes"), 0);
+        snapshot_write_bytes_per_second = config.getUInt64(get_key("snapshot_write_bytes_per_second"), 0);
+        snapshot_flush_bytes = config.getUInt64(get_key("snapshot_flush_bytes"), 0);
+        snapshot_low_io_priority = config.getBool(get_key("snapshot_low_io_priority"), false);
+        snapshot_io_depth = config.getUInt64(get_key("snapshot_io_depth"), 0);
+        snapshot_direct_io = config.getBool(get_key("snapshot_direct_io"), false);
+        snapshot_object_bytes = config.getUInt64(get_key("snapshot_object_bytes"), 128 * 1024 * 1024);
+        snapshot_batch_bytes = config.getUInt64(get_key("snapshot_batch_bytes"), 1024 * 1024);
+        snapshot_max_deltas = config.getUInt64(get_key("snapshot_max_deltas"), 0);
+        log_replay_threads = config.getUInt64(get_key("log_replay_threads"), 4);
+        request_trace_slow_us = config.getUInt64(get_key("request_trace_slow_us"), 100000);
+        lock_profiling = config.getBool(get_key("lock_profiling"), false);
+        hot_key_sample_rate = config.getUInt64(get_key("hot_key_sample_rate"), 64);
+        hot_key_path_depth = config.getUInt64(get_key("hot_key_path_depth"), 4);
+        memory_soft_limit = config.getUInt64(get_key("memory_soft_limit"), 0);
+        memory_soft_limit_log_cache_bytes = config.getUInt64(get_key("memory_soft_limit_log_cache_bytes"), 16 * 1024 * 1024);
+        response_cache_max_paths = config.getUInt64(get_key("response_cache_max_paths"), 0);
+        response_cache_max_body_bytes = config.getUInt64(get_key("response_cache_max_body_bytes"), 64 * 1024);
+        idempotency_cache_size = config.getUInt64(get_key("idempotency_cache_size"), 0);
+        max_session_ephemerals = config.getUInt64(get_key("max_session_ephemerals"), 0);
+        max_session_watches = config.getUInt64(get_key("max_session_watches"), 0);
+        max_expire_nodes_batch_size = config.getUInt64(get_key("max_expire_nodes_batch_size"), 0);
+        compress_cold_data_after_ms = config.getUInt64(get_key("compress_cold_data_after_ms"), 0);
+        observer_local_reads = config.getBool(get_key("observer_local_reads"), false);
+        leader_balance_interval_ms = config.getUInt64(get_key("leader_balance_interval_ms"), 0);
+        leader_balance_checks = std::max<UInt64>(config.getUInt64(get_key("leader_balance_checks"), 6), 1);
+        leader_balance_max_cpu_percent = config.getUInt64(get_key("leader_balance_max_cpu_percent"), 80);
+        leader_balance_max_fsync_latency_us = config.getUInt64(get_key("leader_balance_max_fsync_latency_us"), 0);
+        leader_balance_max_connections = config.getUInt64(get_key("leader_balance_max_connections"), 0);
+        leader_balance_max_apply_lag = config.getUInt64(get_key("leader_balance_max_apply_lag"), 0);
+        compress_batch_entries_min_bytes = config.getUInt64(get_key("compress_batch_entries_min_bytes"), 0);
+        forward_connect_all_peers = config.getBool(get_key("forward_connect_all_peers"), false);
+        forward_batch_frames = config.getBool(get_key("forward_batch_frames"), false);
+        zxid_fence_wait_ms = config.getUInt64(get_key("zxid_fence_wait_ms"), 0);
+        lightweight_sync = config.getBool(get_key("lightweight_sync"), false);
+        log_fsync_batch_bytes = config.getUInt64(get_key("log_fsync_batch_bytes"), 0);
+        log_fsync_max_lag_ms = config.getUInt64(get_key("log_fsync_max_lag_ms"), 0);
+        session_lease_ms = config.getUInt64(get_key("session_lease_ms"), 0);
+        shutdown_snapshot_timeout_ms = config.getUInt64(get_key("shutdown_snapshot_timeout_ms"), 0);
+        relay_log_retention_ms = config.getUInt64(get_key("relay_log_retention_ms"), 600000);
+        snapshot_stagger = config.getBool(get_key("snapshot_stagger"), false);
+        container_blocks = config.getUInt64(get_key("container_blocks"), 16);
+        store_shrink_interval_ms = config.getUInt64(get_key("store_shrink_interval_ms"), 60000);
+        parallel_startup = config.getBool(get_key("parallel_startup"), true);
+        raft_control_port_offset = config.getUInt64(get_key("raft_control_port_offset"), 0);
+        raft_control_thread_size = config.getUInt64(get_key("raft_control_thread_size"), 2);
+        request_deadline_ms = config.getUInt64(get_key("request_deadline_ms"), 0);
+        if (raft_control_port_offset > 65535)
+            throw Exception("Config 'raft_control_port_offset' should not be greater than 65535.", ErrorCodes::UNKNOWN_SETTING);
+        if (container_blocks == 0 || container_blocks > 65536 || (container_blocks & (container_blocks - 1)))
+            throw Exception("Config 'container_blocks' should be a power of two not greater than 65536.", ErrorCodes::UNKNOWN_SETTING);
     }
     catch (Exception & e)
     {
@@ -91,6 +259,8 @@ RaftSettingsPtr RaftSettings::getDefault()
     settings->session_timeout_ms = Coordination::DEFAULT_SESSION_TIMEOUT_MS;
     settings->operation_timeout_ms = Coordination::DEFAULT_OPERATION_TIMEOUT_MS;
     settings->dead_session_check_period_ms =100;
+    settings->max_expire_sessions_batch_size = 0;
+    settings->session_id_block_size = 0;
     settings->heart_beat_interval_ms = 500;
     settings->election_timeout_lower_bound_ms = 10000;
     settings->election_timeout_upper_bound_ms = 20000;
@@ -106,19 +276,106 @@ RaftSettingsPtr RaftSettings::getDefault()
     settings->fresh_log_gap = 200;
     settings->configuration_change_tries_count = 30;
     settings->max_batch_size = 1000;
+    settings->max_batch_bytes = 0;
+    settings->batch_latency_target_ms = 0;
+    settings->max_inflight_batches = 1;
+    settings->max_queued_read_requests = 0;
+    settings->max_queued_write_requests = 0;
     settings->log_fsync_interval = 1000;
     settings->log_fsync_mode = FsyncMode::FSYNC_PARALLEL;
     settings->session_consistent = true;
     settings->async_snapshot = false;
+    settings->async_append_entries = false;
+    settings->container_type = ContainerType::HASH_MAP;
+    settings->subtree_stats_depth = 0;
+    settings->session_expiry_type = SessionExpiryType::SORTED_MAP;
+    settings->prepare_response_frames = false;
+    settings->linearizable_reads = false;
+    settings->max_forward_batch_size = 100;
+    settings->forward_batch_linger_us = 0;
+    settings->forward_connect_interval_ms = 100;
+    settings->delta_session_sync = false;
+    settings->log_segment_preallocate = false;
+    settings->log_drop_page_cache = false;
+    settings->log_batch_append = false;
+    settings->log_cache_max_bytes = LogEntryCache::DEFAULT_MAX_BYTES;
+    settings->log_compression = false;
+    settings->crc32c_checksum = false;
+    settings->log_remove_bytes_per_second = LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND;
+    settings->log_raw_pack = false;
+    settings->log_persistent_memory = false;
+    settings->batch_requests_in_entry = false;
+    settings->snapshot_compression_level = 0;
+    settings->snapshot_flat_format = false;
+    settings->snapshot_chunk_bytes = 0;
+    settings->snapshot_write_bytes_per_second = 0;
+    settings->snapshot_flush_bytes = 0;
+    settings->snapshot_low_io_priority = false;
+    settings->snapshot_io_depth = 0;
+    settings->snapshot_direct_io = false;
+    settings->snapshot_object_bytes = 128 * 1024 * 1024;
+    settings->snapshot_batch_bytes = 1024 * 1024;
+    settings->snapshot_max_deltas = 0;
+    settings->log_replay_threads = 4;
+    settings->request_trace_slow_us = 100000;
+    settings->lock_profiling = false;
+    settings->hot_key_sample_rate = 64;
+    settings->hot_key_path_depth = 4;
+    settings->memory_soft_limit = 0;
+    settings->memory_soft_limit_log_cache_bytes = 16 * 1024 * 1024;
+    settings->response_cache_max_paths = 0;
+    settings->response_cache_max_body_bytes = 64 * 1024;
+    settings->idempotency_cache_size = 0;
+    settings->max_session_ephemerals = 0;
+    settings->max_session_watches = 0;
+    settings->max_expire_nodes_batch_size = 0;
+    settings->compress_cold_data_after_ms = 0;
+    settings->observer_local_reads = false;
+    settings->leader_balance_interval_ms = 0;
+    settings->leader_balance_checks = 6;
+    settings->leader_balance_max_cpu_percent = 80;
+    settings->leader_balance_max_fsync_latency_us = 0;
+    settings->leader_balance_max_connections = 0;
+    settings->leader_balance_max_apply_lag = 0;
+    settings->compress_batch_entries_min_bytes = 0;
+    settings->forward_connect_all_peers = false;
+    settings->forward_batch_frames = false;
+    settings->zxid_fence_wait_ms = 0;
+    settings->lightweight_sync = false;
+    settings->log_fsync_batch_bytes = 0;
+    settings->log_fsync_max_lag_ms = 0;
+    settings->session_lease_ms = 0;
+    settings->shutdown_snapshot_timeout_ms = 0;
+    settings->relay_log_retention_ms = 600000;
+    settings->snapshot_stagger = false;
+    settings->container_blocks = 16;
+    settings->store_shrink_interval_ms = 60000;
+    settings->parallel_startup = true;
+    settings->raft_control_port_offset = 0;
+    settings->raft_control_thread_size = 2;
+    settings->request_deadline_ms = 0;
 
     return settings;
 }
 
-const String Settings::DEFAULT_FOUR_LETTER_WORD_CMD = "conf,cons,crst,envi,ruok,srst,srvr,stat,wchs,dirs,mntr,isro,lgif,rqld";
+const String Settings::DEFAULT_FOUR_LETTER_WORD_CMD
+    = "conf,cons,crst,envi,ruok,srst,srvr,stat,wchs,dirs,mntr,isro,lgif,rqld,stsz,lats,trcs,lcks,hotk,mems,tops";
 
 Settings::Settings()
 : my_id(NOT_EXIST)
 , port(NOT_EXIST)
+, request_capture_max_bytes(0)
+, profile_frequency(0)
+, profile_duration_ms(0)
+, stall_threshold_ms(0)
+, stall_capture_ms(0)
+, startup_read_only(false)
+, startup_read_max_connections(0)
+, tls_client_port(false)
+, tls_forwarding_port(false)
+, tls_verify_client(false)
+, tls_handshake_timeout_ms(0)
+, tls_handshake_thread_count(1)
 , standalone_keeper(false)
 , raft_settings(RaftSettings::getDefault())
 {
@@ -158,6 +415,134 @@ void Settings::dump(WriteBufferFromOwnString & buf) const
     writeText("thread_count=", buf);
     write_int(thread_count);
 
+    writeText("apply_thread_count=", buf);
+    write_int(apply_thread_count);
+
+    writeText("response_thread_count=", buf);
+    write_int(response_thread_count);
+
+    writeText("io_thread_count=", buf);
+    write_int(io_thread_count);
+
+    writeText("forwarding_io_thread_count=", buf);
+    write_int(forwarding_io_thread_count);
+
+    writeText("reuse_port=", buf);
+    write_int(reuse_port);
+
+    writeText("edge_triggered_io=", buf);
+    write_int(edge_triggered_io);
+
+    writeText("max_send_iov_count=", buf);
+    write_int(max_send_iov_count);
+
+    writeText("max_send_bytes=", buf);
+    write_int(max_send_bytes);
+
+    writeText("max_connection_outstanding_requests=", buf);
+    write_int(max_connection_outstanding_requests);
+
+    writeText("max_connection_queued_response_bytes=", buf);
+    write_int(max_connection_queued_response_bytes);
+
+    writeText("idle_connection_trim_ms=", buf);
+    write_int(idle_connection_trim_ms);
+    writeText("idle_socket_buffer_bytes=", buf);
+    write_int(idle_socket_buffer_bytes);
+
+    writeText("client_compression_min_bytes=", buf);
+    write_int(client_compression_min_bytes);
+
+    writeText("handoff_socket=", buf);
+    writeText(handoff_socket, buf);
+    buf.write('\n');
+    writeText("handoff_timeout_ms=", buf);
+    write_int(handoff_timeout_ms);
+
+    writeText("spin_wait_us=", buf);
+    write_int(spin_wait_us);
+
+    auto write_cpus = [&buf](const String & name, const std::vector<int> & cpus)
+    {
+        writeText(name + "=", buf);
+        for (size_t i = 0; i < cpus.size(); ++i)
+        {
+            if (i)
+                buf.write(',');
+            writeIntText(cpus[i], buf);
+        }
+        buf.write('\n');
+    };
+    write_cpus("pipeline_cpus", pipeline_cpus);
+    write_cpus("request_cpus", request_cpus);
+    write_cpus("accumulator_cpus", accumulator_cpus);
+    write_cpus("forwarder_cpus", forwarder_cpus);
+    write_cpus("processor_cpus", processor_cpus);
+    write_cpus("response_cpus", response_cpus);
+
+    writeText("huge_pages=", buf);
+    write_int(huge_pages);
+
+    writeText("session_request_rate=", buf);
+    write_int(session_request_rate);
+    writeText("session_request_burst=", buf);
+    write_int(session_request_burst);
+    writeText("ip_request_rate=", buf);
+    write_int(ip_request_rate);
+    writeText("ip_request_burst=", buf);
+    write_int(ip_request_burst);
+
+    writeText("path_request_rate_limits=", buf);
+    for (size_t i = 0; i < path_request_rate_limits.size(); ++i)
+    {
+        const auto & limit = path_request_rate_limits[i];
+        if (i)
+            buf.write(',');
+        writeText(limit.prefix + ":" + std::to_string(limit.rate) + ":" + std::to_string(limit.burst), buf);
+    }
+    buf.write('\n');
+
+    writeText("relaxed_read_order_networks=", buf);
+    for (size_t i = 0; i < relaxed_read_order_networks.size(); ++i)
+    {
+        if (i)
+            buf.write(',');
+        writeText(relaxed_read_order_networks[i], buf);
+    }
+    buf.write('\n');
+
+    writeText("default_client_group_weight=", buf);
+    write_int(default_client_group_weight);
+
+    writeText("client_groups=", buf);
+    for (size_t i = 0; i < client_groups.size(); ++i)
+    {
+        if (i)
+            buf.write(',');
+        writeText(client_groups[i].name + ":" + std::to_string(client_groups[i].weight), buf);
+    }
+    buf.write('\n');
+
+    writeText("snapshot_bootstrap_peers=", buf);
+    for (size_t i = 0; i < snapshot_bootstrap_peers.size(); ++i)
+    {
+        if (i)
+            buf.write(',');
+        writeText(snapshot_bootstrap_peers[i], buf);
+    }
+    buf.write('\n');
+
+    writeText("tls_client_port=", buf);
+    write_int(tls_client_port);
+    writeText("tls_forwarding_port=", buf);
+    write_int(tls_forwarding_port);
+    writeText("tls_verify_client=", buf);
+    write_int(tls_verify_client);
+    writeText("tls_handshake_timeout_ms=", buf);
+    write_int(tls_handshake_timeout_ms);
+    writeText("tls_handshake_thread_count=", buf);
+    write_int(tls_handshake_thread_count);
+
     writeText("snapshot_create_interval=", buf);
     write_int(snapshot_create_interval);
 
@@ -175,10 +560,32 @@ void Settings::dump(WriteBufferFromOwnString & buf) const
     writeText(log_dir, buf);
     buf.write('\n');
 
+    writeText("log_cold_dir=", buf);
+    writeText(log_cold_dir, buf);
+    buf.write('\n');
+
     writeText("snapshot_dir=", buf);
     writeText(snapshot_dir, buf);
     buf.write('\n');
 
+    writeText("request_capture_dir=", buf);
+    writeText(request_capture_dir, buf);
+    buf.write('\n');
+    writeText("request_capture_max_bytes=", buf);
+    write_int(request_capture_max_bytes);
+    writeText("profile_frequency=", buf);
+    write_int(profile_frequency);
+    writeText("profile_duration_ms=", buf);
+    write_int(profile_duration_ms);
+    writeText("stall_threshold_ms=", buf);
+    write_int(stall_threshold_ms);
+    writeText("stall_capture_ms=", buf);
+    write_int(stall_capture_ms);
+    writeText("startup_read_only=", buf);
+    write_int(startup_read_only);
+    writeText("startup_read_max_connections=", buf);
+    write_int(startup_read_max_connections);
+
     /// raft_settings
 
     writeText("session_timeout_ms=", buf);
@@ -187,6 +594,10 @@ void Settings::dump(WriteBufferFromOwnString & buf) const
     write_int(raft_settings->operation_timeout_ms);
     writeText("dead_session_check_period_ms=", buf);
     write_int(raft_settings->dead_session_check_period_ms);
+    writeText("max_expire_sessions_batch_size=", buf);
+    write_int(raft_settings->max_expire_sessions_batch_size);
+    writeText("session_id_block_size=", buf);
+    write_int(raft_settings->session_id_block_size);
 
     writeText("heart_beat_interval_ms=", buf);
     write_int(raft_settings->heart_beat_interval_ms);
@@ -224,6 +635,157 @@ void Settings::dump(WriteBufferFromOwnString & buf) const
     writeText("fresh_log_gap=", buf);
     write_int(raft_settings->fresh_log_gap);
 
+    writeText("container_type=", buf);
+    writeText(ContainerTypeNS::toString(raft_settings->container_type), buf);
+    buf.write('\n');
+    writeText("subtree_stats_depth=", buf);
+    write_int(raft_settings->subtree_stats_depth);
+    writeText("session_expiry_type=", buf);
+    writeText(SessionExpiryTypeNS::toString(raft_settings->session_expiry_type), buf);
+    buf.write('\n');
+    writeText("prepare_response_frames=", buf);
+    write_int(raft_settings->prepare_response_frames);
+    writeText("max_batch_bytes=", buf);
+    write_int(raft_settings->max_batch_bytes);
+    writeText("batch_latency_target_ms=", buf);
+    write_int(raft_settings->batch_latency_target_ms);
+    writeText("max_inflight_batches=", buf);
+    write_int(raft_settings->max_inflight_batches);
+    writeText("async_append_entries=", buf);
+    write_int(raft_settings->async_append_entries);
+    writeText("max_queued_read_requests=", buf);
+    write_int(raft_settings->max_queued_read_requests);
+    writeText("max_queued_write_requests=", buf);
+    write_int(raft_settings->max_queued_write_requests);
+    writeText("linearizable_reads=", buf);
+    write_int(raft_settings->linearizable_reads);
+    writeText("max_forward_batch_size=", buf);
+    write_int(raft_settings->max_forward_batch_size);
+    writeText("forward_batch_linger_us=", buf);
+    write_int(raft_settings->forward_batch_linger_us);
+    writeText("forward_connect_interval_ms=", buf);
+    write_int(raft_settings->forward_connect_interval_ms);
+    writeText("delta_session_sync=", buf);
+    write_int(raft_settings->delta_session_sync);
+    writeText("log_segment_preallocate=", buf);
+    write_int(raft_settings->log_segment_preallocate);
+    writeText("log_drop_page_cache=", buf);
+    write_int(raft_settings->log_drop_page_cache);
+    writeText("log_batch_append=", buf);
+    write_int(raft_settings->log_batch_append);
+    writeText("log_cache_max_bytes=", buf);
+    write_int(raft_settings->log_cache_max_bytes);
+    writeText("log_compression=", buf);
+    write_int(raft_settings->log_compression);
+    writeText("crc32c_checksum=", buf);
+    write_int(raft_settings->crc32c_checksum);
+    writeText("log_remove_bytes_per_second=", buf);
+    write_int(raft_settings->log_remove_bytes_per_second);
+    writeText("log_raw_pack=", buf);
+    write_int(raft_settings->log_raw_pack);
+    writeText("log_persistent_memory=", buf);
+    write_int(raft_settings->log_persistent_memory);
+    writeText("batch_requests_in_entry=", buf);
+    write_int(raft_settings->batch_requests_in_entry);
+    writeText("snapshot_compression_level=", buf);
+    write_int(raft_settings->snapshot_compression_level);
+    writeText("snapshot_flat_format=", buf);
+    write_int(raft_settings->snapshot_flat_format);
+    writeText("snapshot_chunk_bytes=", buf);
+    write_int(raft_settings->snapshot_chunk_bytes);
+    writeText("snapshot_write_bytes_per_second=", buf);
+    write_int(raft_settings->snapshot_write_bytes_per_second);
+    writeText("snapshot_flush_bytes=", buf);
+    write_int(raft_settings->snapshot_flush_bytes);
+    writeText("snapshot_low_io_priority=", buf);
+    write_int(raft_settings->snapshot_low_io_priority);
+    writeText("snapshot_io_depth=", buf);
+    write_int(raft_settings->snapshot_io_depth);
+    writeText("snapshot_direct_io=", buf);
+    write_int(raft_settings->snapshot_direct_io);
+    writeText("snapshot_object_bytes=", buf);
+    write_int(raft_settings->snapshot_object_bytes);
+    writeText("snapshot_batch_bytes=", buf);
+    write_int(raft_settings->snapshot_batch_bytes);
+    writeText("snapshot_max_deltas=", buf);
+    write_int(raft_settings->snapshot_max_deltas);
+    writeText("log_replay_threads=", buf);
+    write_int(raft_settings->log_replay_threads);
+    writeText("request_trace_slow_us=", buf);
+    write_int(raft_settings->request_trace_slow_us);
+    writeText("lock_profiling=", buf);
+    write_int(raft_settings->lock_profiling);
+    writeText("hot_key_sample_rate=", buf);
+    write_int(raft_settings->hot_key_sample_rate);
+    writeText("hot_key_path_depth=", buf);
+    write_int(raft_settings->hot_key_path_depth);
+    writeText("memory_soft_limit=", buf);
+    write_int(raft_settings->memory_soft_limit);
+    writeText("memory_soft_limit_log_cache_bytes=", buf);
+    write_int(raft_settings->memory_soft_limit_log_cache_bytes);
+    writeText("response_cache_max_paths=", buf);
+    write_int(raft_settings->response_cache_max_paths);
+    writeText("response_cache_max_body_bytes=", buf);
+    write_int(raft_settings->response_cache_max_body_bytes);
+    writeText("idempotency_cache_size=", buf);
+    write_int(raft_settings->idempotency_cache_size);
+    writeText("max_session_ephemerals=", buf);
+    write_int(raft_settings->max_session_ephemerals);
+    writeText("max_session_watches=", buf);
+    write_int(raft_settings->max_session_watches);
+    writeText("max_expire_nodes_batch_size=", buf);
+    write_int(raft_settings->max_expire_nodes_batch_size);
+    writeText("compress_cold_data_after_ms=", buf);
+    write_int(raft_settings->compress_cold_data_after_ms);
+    writeText("observer_local_reads=", buf);
+    write_int(raft_settings->observer_local_reads);
+    writeText("leader_balance_interval_ms=", buf);
+    write_int(raft_settings->leader_balance_interval_ms);
+    writeText("leader_balance_checks=", buf);
+    write_int(raft_settings->leader_balance_checks);
+    writeText("leader_balance_max_cpu_percent=", buf);
+    write_int(raft_settings->leader_balance_max_cpu_percent);
+    writeText("leader_balance_max_fsync_latency_us=", buf);
+    write_int(raft_settings->leader_balance_max_fsync_latency_us);
+    writeText("leader_balance_max_connections=", buf);
+    write_int(raft_settings->leader_balance_max_connections);
+    writeText("leader_balance_max_apply_lag=", buf);
+    write_int(raft_settings->leader_balance_max_apply_lag);
+    writeText("compress_batch_entries_min_bytes=", buf);
+    write_int(raft_settings->compress_batch_entries_min_bytes);
+    writeText("forward_connect_all_peers=", buf);
+    write_int(raft_settings->forward_connect_all_peers);
+    writeText("forward_batch_frames=", buf);
+    write_int(raft_settings->forward_batch_frames);
+    writeText("zxid_fence_wait_ms=", buf);
+    write_int(raft_settings->zxid_fence_wait_ms);
+    writeText("lightweight_sync=", buf);
+    write_int(raft_settings->lightweight_sync);
+    writeText("log_fsync_batch_bytes=", buf);
+    write_int(raft_settings->log_fsync_batch_bytes);
+    writeText("log_fsync_max_lag_ms=", buf);
+    write_int(raft_settings->log_fsync_max_lag_ms);
+    writeText("session_lease_ms=", buf);
+    write_int(raft_settings->session_lease_ms);
+    writeText("shutdown_snapshot_timeout_ms=", buf);
+    write_int(raft_settings->shutdown_snapshot_timeout_ms);
+    writeText("relay_log_retention_ms=", buf);
+    write_int(raft_settings->relay_log_retention_ms);
+    writeText("snapshot_stagger=", buf);
+    write_int(raft_settings->snapshot_stagger);
+    writeText("container_blocks=", buf);
+    write_int(raft_settings->container_blocks);
+    writeText("store_shrink_interval_ms=", buf);
+    write_int(raft_settings->store_shrink_interval_ms);
+    writeText("parallel_startup=", buf);
+    write_int(raft_settings->parallel_startup);
+    writeText("raft_control_port_offset=", buf);
+    write_int(raft_settings->raft_control_port_offset);
+    writeText("raft_control_thread_size=", buf);
+    write_int(raft_settings->raft_control_thread_size);
+    writeText("request_deadline_ms=", buf);
+    write_int(raft_settings->request_deadline_ms);
+
 }
 
 SettingsPtr Settings::loadFromConfig(const Poco::Util::AbstractConfiguration & config, bool standalone_keeper_)
@@ -239,6 +801,94 @@ SettingsPtr Settings::loadFromConfig(const Poco::Util::AbstractConfiguration & c
 
     ret->internal_port = config.getInt("keeper.internal_port", 8103);
     ret->thread_count = config.getInt("keeper.thread_count", 16);
+    ret->apply_thread_count = std::max(config.getInt("keeper.apply_thread_count", 1), 1);
+    ret->response_thread_count = std::max(config.getInt("keeper.response_thread_count", 1), 1);
+    int processor_count = static_cast<int>(Poco::Environment::processorCount());
+    ret->io_thread_count = std::max(config.getInt("keeper.io_thread_count", processor_count), 1);
+    ret->forwarding_io_thread_count = std::max(config.getInt("keeper.forwarding_io_thread_count", processor_count), 1);
+    ret->reuse_port = config.getBool("keeper.reuse_port", false);
+    ret->edge_triggered_io = config.getBool("keeper.edge_triggered_io", false);
+    ret->max_send_iov_count = std::clamp(config.getInt("keeper.max_send_iov_count", 64), 1, IOV_MAX);
+    ret->max_send_bytes = std::max(config.getInt("keeper.max_send_bytes", 256 * 1024), 1);
+    ret->max_connection_outstanding_requests = std::max(config.getInt("keeper.max_connection_outstanding_requests", 10000), 0);
+    ret->max_connection_queued_response_bytes = std::max(config.getInt("keeper.max_connection_queued_response_bytes", 64 * 1024 * 1024), 0);
+    ret->idle_connection_trim_ms = std::max(config.getInt("keeper.idle_connection_trim_ms", 60000), 0);
+    ret->idle_socket_buffer_bytes = std::max(config.getInt("keeper.idle_socket_buffer_bytes", 4096), 0);
+    ret->client_compression_min_bytes = std::max(config.getInt("keeper.client_compression_min_bytes", 16384), 0);
+    ret->handoff_socket = config.getString("keeper.handoff_socket", "");
+    ret->handoff_timeout_ms = config.getUInt64("keeper.handoff_timeout_ms", 10000);
+    ret->spin_wait_us = std::max(config.getInt("keeper.spin_wait_us", 0), 0);
+    String pipeline_cpus = config.getString("keeper.pipeline_cpus", "");
+    ret->pipeline_cpus = parseCpuList(pipeline_cpus);
+    ret->request_cpus = parseCpuList(config.getString("keeper.request_cpus", pipeline_cpus));
+    ret->accumulator_cpus = parseCpuList(config.getString("keeper.accumulator_cpus", pipeline_cpus));
+    ret->forwarder_cpus = parseCpuList(config.getString("keeper.forwarder_cpus", pipeline_cpus));
+    ret->processor_cpus = parseCpuList(config.getString("keeper.processor_cpus", pipeline_cpus));
+    ret->response_cpus = parseCpuList(config.getString("keeper.response_cpus", pipeline_cpus));
+    ret->huge_pages = config.getBool("keeper.huge_pages", false);
+    ret->session_request_rate = config.getUInt64("keeper.session_request_rate", 0);
+    ret->session_request_burst = config.getUInt64("keeper.session_request_burst", 0);
+    ret->ip_request_rate = config.getUInt64("keeper.ip_request_rate", 0);
+    ret->ip_request_burst = config.getUInt64("keeper.ip_request_burst", 0);
+
+    Poco::Util::AbstractConfiguration::Keys path_limit_keys;
+    config.keys("keeper.path_request_rate_limits", path_limit_keys);
+    for (const auto & key : path_limit_keys)
+    {
+        if (!key.starts_with("limit"))
+            continue;
+        String limit_key = "keeper.path_request_rate_limits." + key;
+        ret->path_request_rate_limits.push_back(
+            {config.getString(limit_key + ".prefix"), config.getUInt64(limit_key + ".rate", 0), config.getUInt64(limit_key + ".burst", 0)});
+    }
+
+    Poco::Util::AbstractConfiguration::Keys network_keys;
+    config.keys("keeper.relaxed_read_order_networks", network_keys);
+    for (const auto & key : network_keys)
+    {
+        if (key.starts_with("network"))
+            ret->relaxed_read_order_networks.push_back(config.getString("keeper.relaxed_read_order_networks." + key));
+    }
+
+    ret->default_client_group_weight = config.getUInt64("keeper.client_groups.default_weight", 1);
+    Poco::Util::AbstractConfiguration::Keys group_keys;
+    config.keys("keeper.client_groups", group_keys);
+    for (const auto & key : group_keys)
+    {
+        if (!key.starts_with("group"))
+            continue;
+        String group_key = "keeper.client_groups." + key;
+        ClientGroupSettings group{config.getString(group_key + ".name", key), config.getUInt64(group_key + ".weight", 1), {}, {}, {}};
+        Poco::Util::AbstractConfiguration::Keys match_keys;
+        config.keys(group_key, match_keys);
+        for (const auto & match_key : match_keys)
+        {
+            if (match_key.starts_with("network"))
+                group.networks.push_back(config.getString(group_key + "." + match_key));
+            else if (match_key.starts_with("auth"))
+                group.auths.push_back(config.getString(group_key + "." + match_key));
+            else if (match_key.starts_with("path_prefix"))
+                group.path_prefixes.push_back(config.getString(group_key + "." + match_key));
+        }
+        ret->client_groups.push_back(std::move(group));
+    }
+
+    Poco::Util::AbstractConfiguration::Keys peer_keys;
+    config.keys("keeper.snapshot_bootstrap_peers", peer_keys);
+    for (const auto & key : peer_keys)
+    {
+        if (key.starts_with("peer"))
+            ret->snapshot_bootstrap_peers.push_back(config.getString("keeper.snapshot_bootstrap_peers." + key));
+    }
+
+    ret->tls_client_port = config.getBool("keeper.tls.client_port", false);
+    ret->tls_forwarding_port = config.getBool("keeper.tls.forwarding_port", false);
+    ret->tls_certificate_file = config.getString("keeper.tls.certificate_file", "");
+    ret->tls_private_key_file = config.getString("keeper.tls.private_key_file", "");
+    ret->tls_ca_file = config.getString("keeper.tls.ca_file", "");
+    ret->tls_verify_client = config.getBool("keeper.tls.verify_client", false);
+    ret->tls_handshake_timeout_ms = config.getUInt64("keeper.tls.handshake_timeout_ms", 3000);
+    ret->tls_handshake_thread_count = std::max(config.getInt("keeper.tls.handshake_thread_count", 4), 1);
 
     ret->snapshot_create_interval = config.getInt("keeper.snapshot_create_interval", 3600);
     ret->snapshot_create_interval = std::max(ret->snapshot_create_interval, 1);
@@ -251,7 +901,16 @@ SettingsPtr Settings::loadFromConfig(const Poco::Util::AbstractConfiguration & c
     ret->four_letter_word_white_list = config.getString("keeper.four_letter_word_white_list", DEFAULT_FOUR_LETTER_WORD_CMD);
 
     ret->log_dir = getLogsPathFromConfig(config, standalone_keeper_);
+    ret->log_cold_dir = config.getString("keeper.log_cold_dir", "");
     ret->snapshot_dir = getSnapshotsPathFromConfig(config, standalone_keeper_);
+    ret->request_capture_dir = config.getString("keeper.request_capture_dir", "");
+    ret->request_capture_max_bytes = config.getUInt64("keeper.request_capture_max_bytes", 1024 * 1024 * 1024);
+    ret->profile_frequency = config.getUInt64("keeper.profile_frequency", 99);
+    ret->profile_duration_ms = config.getUInt64("keeper.profile_duration_ms", 30000);
+    ret->stall_threshold_ms = config.getUInt64("keeper.stall_threshold_ms", 5000);
+    ret->stall_capture_ms = config.getUInt64("keeper.stall_capture_ms", 200);
+    ret->startup_read_only = config.getBool("keeper.startup_read_only", false);
+    ret->startup_read_max_connections = std::max<UInt64>(config.getUInt64("keeper.startup_read_max_connections", 1024), 1);
 
     ret->raft_settings->loadFromConfig("keeper.raft_settings", config);
 
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <vector>
 #include <Core/Defines.h>
 #include <IO/WriteBufferFromString.h>
 #include <Poco/Message.h>
 #include <Poco/Util/AbstractConfiguration.h>
+#include <Service/ClientGroups.h>
 #include <Common/ZooKeeper/ZooKeeperConstants.h>
 #include <Service/LoggerWrapper.h>
+#include <Service/RequestRateLimiter.h>
 
 namespace RK
 {
@@ -27,6 +30,34 @@ FsyncMode parseFsyncMode(const String & in);
 String toString(FsyncMode mode);
 }
 
+/// Structure which indexes znodes by path in KeeperStore.
+enum class ContainerType
+{
+    /// Hash map shards keyed by full path.
+    HASH_MAP,
+    /// Path-compressed radix tree, common path prefixes are stored once.
+    RADIX_TREE
+};
+
+namespace ContainerTypeNS {
+ContainerType parseContainerType(const String & in);
+String toString(ContainerType type);
+}
+
+/// Structure which buckets sessions by expiration time.
+enum class SessionExpiryType
+{
+    /// Sorted map of expiration time -> sessions.
+    SORTED_MAP,
+    /// Hashed timer wheel with a slot per dead_session_check_period_ms.
+    TIMER_WHEEL
+};
+
+namespace SessionExpiryTypeNS {
+SessionExpiryType parseSessionExpiryType(const String & in);
+String toString(SessionExpiryType type);
+}
+
 struct RaftSettings;
 using RaftSettingsPtr = std::shared_ptr<RaftSettings>;
 
@@ -45,10 +76,99 @@ struct Settings
     int internal_port;
 
     String log_dir;
+    /// Closed log segments are moved here from log_dir in the background, e.g. from a fast device to a bulk one. Not moved if empty.
+    String log_cold_dir;
     String snapshot_dir;
+    /// Directory of the captures of client requests started by capb, capturing is disabled if empty
+    String request_capture_dir;
+    /// A capture stops once its file reaches this size
+    UInt64 request_capture_max_bytes;
+    /// Profiles started by cpup and walp sample every thread this many times a second, for at most profile_duration_ms
+    UInt64 profile_frequency;
+    UInt64 profile_duration_ms;
+    /// A thread busy with one request or log entry this long is reported as stalled, see StallWatchdog, 0 disables it.
+    /// The stacks of all threads are then sampled by real time for stall_capture_ms, 0 means no stacks.
+    UInt64 stall_threshold_ms;
+    UInt64 stall_capture_ms;
+    /// Serve read only sessions and ruok, isro, srvr and mntr from the snapshot while the log is replayed on startup,
+    /// see StartupReadServer, with at most startup_read_max_connections connections.
+    bool startup_read_only;
+    UInt64 startup_read_max_connections;
 
     int snapshot_create_interval;
     int thread_count;
+    /// Threads applying committed write requests, 1 means serial apply
+    int apply_thread_count;
+    /// Threads delivering responses to connections, responses are sharded among them by session
+    int response_thread_count;
+    /// Reactors serving client connections
+    int io_thread_count;
+    /// Reactors serving forwarding connections from other servers
+    int forwarding_io_thread_count;
+    /// Every client reactor listens on a socket of its own by SO_REUSEPORT and is pinned to a CPU
+    bool reuse_port;
+    /// Sockets are polled edge triggered, every notification drains its socket
+    bool edge_triggered_io;
+    /// Most responses and bytes sent to a connection by one writev
+    int max_send_iov_count;
+    int max_send_bytes;
+    /// Reading a connection pauses while it has this many requests not answered or response bytes not sent, 0 means no limit
+    int max_connection_outstanding_requests;
+    int max_connection_queued_response_bytes;
+    /// A connection with nothing in flight for idle_connection_trim_ms releases its buffers and its kernel socket buffers
+    /// are shrunk to idle_socket_buffer_bytes until its next event. 0 means connections or socket buffers are not trimmed.
+    int idle_connection_trim_ms;
+    int idle_socket_buffer_bytes;
+    /// Clients negotiating compression at the handshake get responses of at least this many bytes compressed,
+    /// 0 means compression is refused
+    int client_compression_min_bytes;
+    /// UNIX socket a new server binary started on this host connects to for the listening and client sockets of this
+    /// one, see ConnectionHandoff. Empty disables handoff. The connections are drained for at most handoff_timeout_ms.
+    String handoff_socket;
+    UInt64 handoff_timeout_ms;
+    /// Pipeline threads spin this long for the next request before parking, 0 means no spinning
+    int spin_wait_us;
+    /// CPUs pipeline threads are pinned to, empty means not pinned
+    std::vector<int> pipeline_cpus;
+    /// CPUs threads of a pipeline stage are pinned to, pipeline_cpus if not configured. The processor threads
+    /// apply committed requests, so nodes are allocated on the NUMA node of processor_cpus.
+    std::vector<int> request_cpus;
+    std::vector<int> accumulator_cpus;
+    std::vector<int> forwarder_cpus;
+    std::vector<int> processor_cpus;
+    std::vector<int> response_cpus;
+    /// Back the data tree, values and the log entry cache by transparent huge pages if the system has them
+    bool huge_pages;
+    /// Requests a second a session and the connections from a client address may send, requests over them are
+    /// rejected with ZTHROTTLEDOP. 0 means no limit, burst is the requests allowed at once, 0 means the rate.
+    UInt64 session_request_rate;
+    UInt64 session_request_burst;
+    UInt64 ip_request_rate;
+    UInt64 ip_request_burst;
+    /// Requests a second of all the clients to paths under prefixes, the longest matching prefix applies
+    std::vector<PathRateLimit> path_request_rate_limits;
+    /// Client networks, such as 10.0.0.0/8, whose reads do not wait for the pending writes of their session on other paths
+    std::vector<String> relaxed_read_order_networks;
+    /// Groups of clients sharing the request threads by their weights, see ClientGroups. Clients of no group are in
+    /// the default group of default_client_group_weight.
+    std::vector<ClientGroupSettings> client_groups;
+    UInt64 default_client_group_weight;
+    /// Metrics endpoints, host:port, of the other servers. A server without data copies the last snapshot of one of
+    /// them before it starts, so that the leader only sends it the log tail. Empty means the leader sends a snapshot.
+    std::vector<String> snapshot_bootstrap_peers;
+    /// Serve the client port and the forwarding port by TLS, forwarding connections to other servers then use
+    /// TLS too. The records are handled by kernel TLS once the handshake is done, see KernelTLS.
+    bool tls_client_port;
+    bool tls_forwarding_port;
+    String tls_certificate_file;
+    String tls_private_key_file;
+    /// CAs verifying the certificates of peers, required by tls_forwarding_port. The client certificate is only required
+    /// if tls_verify_client.
+    String tls_ca_file;
+    bool tls_verify_client;
+    /// Handshakes of accepted connections run on these threads, a handshake not done in the timeout fails
+    UInt64 tls_handshake_timeout_ms;
+    int tls_handshake_thread_count;
 
     /// TODO remove
     int snapshot_start_time;
@@ -80,6 +200,12 @@ struct RaftSettings
     UInt64 operation_timeout_ms;
     /// How often leader will check sessions to consider them dead and remove
     UInt64 dead_session_check_period_ms;
+    /// Max sessions closed by one expire sessions log entry, 0 means a Close log entry for each session
+    UInt64 max_expire_sessions_batch_size;
+    /// Session ids reserved by a server at a time, new sessions are granted locally from the block
+    /// and registered asynchronously. 0 means creating every session synchronously through Raft, which
+    /// servers of older versions can apply, so it is set only after every server is upgraded.
+    UInt64 session_id_block_size;
     /// Heartbeat interval between quorum nodes
     UInt64 heart_beat_interval_ms;
     /// Lower bound of election timer (avoid too often leader elections)
@@ -108,14 +234,178 @@ struct RaftSettings
     UInt64 configuration_change_tries_count;
     /// Max batch size for append_entries
     UInt64 max_batch_size;
+    /// Max estimated bytes of a batch for append_entries, 0 means no limit
+    UInt64 max_batch_bytes;
+    /// p99 commit latency target of write batches, batch size adapts to it, 0 means fixed max_batch_size
+    UInt64 batch_latency_target_ms;
+    /// Max append_entries batches in flight of an accumulator runner
+    UInt64 max_inflight_batches;
+    /// Read requests are rejected when so many reads are queued in the dispatcher shard of the session, 0 means no limit
+    UInt64 max_queued_read_requests;
+    /// Write requests are rejected when so many writes are queued in the dispatcher shard of the session, 0 means no limit
+    UInt64 max_queued_write_requests;
     /// Raft log fsync mode
     FsyncMode log_fsync_mode;
-    /// How many logs do once fsync when async_fsync is false
+    /// fsync_batch: most log entries not durable before an fsync
     UInt64 log_fsync_interval;
     /// Request-response will follow the session xid order
     bool session_consistent;
-    /// Whether async snapshot
+    /// Whether async snapshot. Snapshots are serialized by the snapshot thread from a pinned view in both modes,
+    /// so commits go on while creating snapshot.
     bool async_snapshot;
+    /// Whether append_entries returns before the entries are committed, results are handled by callbacks then
+    bool async_append_entries;
+    /// Node container of the data tree
+    ContainerType container_type;
+    /// Keep descendant count and data bytes for every path not deeper than it, 0 means disabled
+    UInt64 subtree_stats_depth;
+    /// Expiry buckets of sessions
+    SessionExpiryType session_expiry_type;
+    /// Serialize responses on the apply thread, connection threads only copy the bytes
+    bool prepare_response_frames;
+    /// Reads wait until the local state is applied up to the commit index of the leader after they arrived
+    bool linearizable_reads;
+    /// Most requests a follower forwards to the leader by one write
+    UInt64 max_forward_batch_size;
+    /// How long a follower waits for more requests to forward together, 0 means not waiting
+    UInt64 forward_batch_linger_us;
+    /// Period of connecting forwarding clients to the leader in background, 0 means connecting when forwarding
+    UInt64 forward_connect_interval_ms;
+    /// Followers sync only sessions changed since the last round acknowledged by the leader. Old leaders close the
+    /// connection on the package, so it is enabled after every server is upgraded.
+    bool delta_session_sync;
+    /// Allocate Raft log segments to their full size ahead of appends and reuse files of removed segments
+    bool log_segment_preallocate;
+    /// Drop Raft log pages from the page cache once they are synced or read for a lagging follower
+    bool log_drop_page_cache;
+    /// Write appended Raft log entries of an append batch together by one pwritev
+    bool log_batch_append;
+    /// Bytes of Raft log entries cached in memory for replication and commit
+    UInt64 log_cache_max_bytes;
+    /// Compress Raft log entries in segments and log packs shipped to followers by zlib
+    bool log_compression;
+    /// Checksum new Raft log segments and snapshots by CRC32C, which servers without it can not read
+    bool crc32c_checksum;
+    /// Bytes per second of removed Raft log segment files freed in the background, 0 is unlimited
+    UInt64 log_remove_bytes_per_second;
+    /// Ship log packs to followers as the bytes of segments, which followers append without deserializing entries
+    bool log_raw_pack;
+    /// Persist appends to the open Raft log segment through a MAP_SYNC mapping on a dax filesystem instead of fsync
+    bool log_persistent_memory;
+    /// Append a batch of write requests as one Raft log entry, which is unpacked when committed
+    bool batch_requests_in_entry;
+    /// zlib level of data batches in created snapshots, which are also shipped to followers compressed, 0 means not compressed
+    UInt64 snapshot_compression_level;
+    /// Save nodes in created snapshots as flat records, which are loaded from the mapped object without protobuf
+    bool snapshot_flat_format;
+    /// Receive snapshots from the leader in chunks of this many bytes, written while the next chunk is received. 0 means whole objects.
+    UInt64 snapshot_chunk_bytes;
+    /// Write speed of snapshot data objects, 0 means not limited
+    UInt64 snapshot_write_bytes_per_second;
+    /// Start writeback of snapshot data objects every this many bytes written, 0 means left to the kernel
+    UInt64 snapshot_flush_bytes;
+    /// Threads creating snapshots have the lowest best effort IO priority
+    bool snapshot_low_io_priority;
+    /// Blocks of snapshot data objects written behind encoding and read ahead of decoding, 0 means synchronous writes and
+    /// readahead left to the kernel
+    UInt64 snapshot_io_depth;
+    /// Write snapshot data objects with O_DIRECT, bypassing the page cache
+    bool snapshot_direct_io;
+    /// Approximate bytes of a snapshot data object, 0 means objects are only limited by node count
+    UInt64 snapshot_object_bytes;
+    /// Approximate bytes of a snapshot data batch, 0 means batches are only limited by node count
+    UInt64 snapshot_batch_bytes;
+    /// Delta snapshots between two full snapshots, they only have the nodes changed since the snapshot before. 0 means all
+    /// snapshots are full.
+    UInt64 snapshot_max_deltas;
+    /// Threads reading and decoding the log ahead of applying it when replaying it on startup, the log is always applied
+    /// in order by one thread.
+    UInt64 log_replay_threads;
+    /// Requests slower than it end to end on a server have the time of every pipeline stage kept for the trcs
+    /// command, in microseconds. 0 keeps none.
+    UInt64 request_trace_slow_us;
+    /// Hot mutexes of the store and the pipeline record their wait and hold times for the lcks command
+    bool lock_profiling;
+    /// One request in it is sampled into the top paths, sessions and clients of the hotk command, 0 samples none
+    UInt64 hot_key_sample_rate;
+    /// Paths are counted by their first components, e.g. 4 counts /clickhouse/tables/01/t1/replicas/r1/queue as /clickhouse/tables/01/t1
+    UInt64 hot_key_path_depth;
+    /// Resident memory in bytes over which new sessions are rejected and the log cache shrinks to
+    /// memory_soft_limit_log_cache_bytes, until it drops below 90% of it. 0 is no limit.
+    UInt64 memory_soft_limit;
+    UInt64 memory_soft_limit_log_cache_bytes;
+    /// Paths whose serialized Get and List responses are cached, 0 disables the cache. Bodies larger than
+    /// response_cache_max_body_bytes are not cached.
+    UInt64 response_cache_max_paths;
+    UInt64 response_cache_max_body_bytes;
+    /// Responses of the last writes of every session kept to answer retries of them, 0 disables it. Must be the same
+    /// on all the servers, the cache is part of the replicated state.
+    UInt64 idempotency_cache_size;
+    /// Ephemeral nodes of a session at most, 0 means not limited. Must be the same on all the servers.
+    UInt64 max_session_ephemerals;
+    /// Watches of a session at most, 0 means not limited
+    UInt64 max_session_watches;
+    /// Max expired TTL and container nodes removed by one RemoveExpiredNodes log entry, 0 means they are not removed.
+    /// Servers of older versions can not apply the entry.
+    UInt64 max_expire_nodes_batch_size;
+    /// Compress values of nodes not read for about this long in memory, 0 to disable
+    UInt64 compress_cold_data_after_ms;
+    /// Observers serve reads from local state even if reads are linearizable, they are sequentially consistent there
+    bool observer_local_reads;
+    /// Check the load of the leader this often and transfer leadership if it is overloaded, 0 to disable
+    UInt64 leader_balance_interval_ms;
+    /// Checks in a row of an overloaded leader before leadership is transferred
+    UInt64 leader_balance_checks;
+    /// Load limits of the leader, 0 to ignore one. CPU is percent of all cores of the process.
+    UInt64 leader_balance_max_cpu_percent;
+    UInt64 leader_balance_max_fsync_latency_us;
+    UInt64 leader_balance_max_connections;
+    UInt64 leader_balance_max_apply_lag;
+    /// Batch log entries of at least this many bytes are appended compressed, 0 to disable
+    UInt64 compress_batch_entries_min_bytes;
+    /// Keep forwarding connections to every server, not only the leader, so that failover does not wait for connecting
+    bool forward_connect_all_peers;
+    /// Forward a batch of requests as one DataBatch frame, which leaders of older versions do not accept
+    bool forward_batch_frames;
+    /// A client which has seen a zxid this server has not applied yet is accepted, and its reads wait at most this
+    /// long for the zxid to be applied, so that it reads its writes on every server. 0 refuses such clients.
+    UInt64 zxid_fence_wait_ms;
+    /// Sync waits for the commit index of the leader by a read index round instead of appending a log entry
+    bool lightweight_sync;
+    /// fsync_batch: log bytes not durable which make an fsync, 0 means no limit
+    UInt64 log_fsync_batch_bytes;
+    /// fsync_batch: bound of the time a log entry is not durable, the entries of an fsync are adapted to it, 0 to disable
+    UInt64 log_fsync_max_lag_ms;
+    /** Servers expire the sessions connected to them, the leader learns a lease of every remote session, ahead of its
+     * expiration by this, renewed every half of it. The leader expires a remote session when its lease runs out, e.g.
+     * its server died. 0 means the leader expires all the sessions. Needs delta_session_sync.
+     */
+    UInt64 session_lease_ms;
+    /// Create a snapshot of the applied state at a clean shutdown, waiting up to this, so that a restart replays no
+    /// log tail. 0 to disable.
+    UInt64 shutdown_snapshot_timeout_ms;
+    /// A relay keeps the log its downstreams have not applied when they fetched from it within this, see RelayReplicator
+    UInt64 relay_log_retention_ms;
+    /** Stagger snapshots of the members so that a quorum always has its full disk bandwidth: followers in order of
+     * their ids snapshot spread over snapshot_distance after it is reached, the leader a whole snapshot_distance late.
+     */
+    bool snapshot_stagger;
+    /// Blocks of the hash map node container, a power of two. More blocks let more writers and rehashes run in parallel,
+    /// snapshots do not depend on it.
+    UInt64 container_blocks;
+    /// Give back the buckets of store structures left sparse by mass deletions every this, 0 to disable
+    UInt64 store_shrink_interval_ms;
+    /// On startup the log segments are indexed while the snapshot loads, and the log after the snapshot is read while it
+    /// is applied. If false they are done one after another.
+    bool parallel_startup;
+    /// Votes and heartbeats go on a connection of their own to the internal port of each member plus it, served by
+    /// raft_control_thread_size threads of their own, so that they do not wait behind replication. It must be the same
+    /// for all members, 0 sends them with the rest of the raft messages.
+    UInt64 raft_control_port_offset;
+    UInt64 raft_control_thread_size;
+    /// A client has given up on a request this long after it arrived, a read still waiting then is answered with
+    /// ZOPERATIONTIMEOUT without being served. Reads of connections gone are dropped anyway. 0 to disable.
+    UInt64 request_deadline_ms;
 
     void loadFromConfig(const String & config_elem, const Poco::Util::AbstractConfiguration & config);
 
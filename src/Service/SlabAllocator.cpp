@@ -0,0 +1,139 @@
+#include <Service/SlabAllocator.h>
+
+namespace RK
+{
+
+namespace
+{
+    /// Trivially destructible, so still readable by frees after the cache of the thread is destroyed
+    thread_local bool thread_cache_destroyed = false;
+}
+
+struct SlabPool::ThreadCache
+{
+    struct Objects
+    {
+        size_t count = 0;
+        char * objects[THREAD_CACHE_SIZE];
+    };
+    Objects classes[NUM_CLASSES];
+
+    ~ThreadCache()
+    {
+        thread_cache_destroyed = true;
+        for (size_t i = 0; i < NUM_CLASSES; ++i)
+            if (classes[i].count)
+                SlabPool::instance().drain(i, classes[i].objects, classes[i].count);
+    }
+};
+
+SlabPool & SlabPool::instance()
+{
+    static auto * pool = new SlabPool();
+    return *pool;
+}
+
+SlabPool::SlabPool()
+{
+    classes.reserve(NUM_CLASSES);
+    for (size_t i = 0; i < NUM_CLASSES; ++i)
+        classes.emplace_back(std::make_unique<SizeClass>((i + 1) * CLASS_GRANULARITY));
+}
+
+SlabPool::ThreadCache * SlabPool::threadCache()
+{
+    if (thread_cache_destroyed)
+        return nullptr;
+    static thread_local ThreadCache cache;
+    return &cache;
+}
+
+size_t SlabPool::fill(size_t index, char ** objects, size_t count)
+{
+    auto & size_class = *classes[index];
+    std::lock_guard lock(size_class.mutex);
+    size_t filled = 0;
+    try
+    {
+        for (; filled < count; ++filled)
+            objects[filled] = size_class.pool.alloc();
+    }
+    catch (...)
+    {
+        if (!filled)
+            throw;
+    }
+    size_class.used += filled;
+    if (size_class.used > size_class.allocated)
+        size_class.allocated = size_class.used;
+    return filled;
+}
+
+void SlabPool::drain(size_t index, char * const * objects, size_t count)
+{
+    auto & size_class = *classes[index];
+    std::lock_guard lock(size_class.mutex);
+    for (size_t i = 0; i < count; ++i)
+        size_class.pool.free(objects[i]);
+    size_class.used -= count;
+}
+
+char * SlabPool::alloc(size_t size)
+{
+    if (size > MAX_OBJECT_SIZE)
+        return static_cast<char *>(::operator new(size));
+
+    size_t index = classIndex(size);
+    if (auto * cache = threadCache())
+    {
+        auto & cached = cache->classes[index];
+        if (!cached.count)
+            cached.count = fill(index, cached.objects, THREAD_CACHE_BATCH);
+        return cached.objects[--cached.count];
+    }
+
+    char * ptr;
+    fill(index, &ptr, 1);
+    return ptr;
+}
+
+void SlabPool::free(char * ptr, size_t size)
+{
+    if (size > MAX_OBJECT_SIZE)
+    {
+        ::operator delete(ptr);
+        return;
+    }
+
+    size_t index = classIndex(size);
+    if (auto * cache = threadCache())
+    {
+        auto & cached = cache->classes[index];
+        /// Objects freed by a thread which does not allocate them, such as responses, go back by a batch
+        if (cached.count == THREAD_CACHE_SIZE)
+        {
+            drain(index, cached.objects + THREAD_CACHE_BATCH, THREAD_CACHE_SIZE - THREAD_CACHE_BATCH);
+            cached.count = THREAD_CACHE_BATCH;
+        }
+        cached.objects[cached.count++] = ptr;
+        return;
+    }
+
+    drain(index, &ptr, 1);
+}
+
+std::vector<SlabPool::ClassStats> SlabPool::getStats() const
+{
+    std::vector<ClassStats> stats;
+    for (const auto & size_class : classes)
+    {
+        std::lock_guard lock(size_class->mutex);
+        if (size_class->allocated == 0)
+            continue;
+        stats.push_back(
+            {size_class->object_size, size_class->used, size_class->allocated - size_class->used, size_class->pool.size()});
+    }
+    return stats;
+}
+
+}
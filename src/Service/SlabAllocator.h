@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <Common/SmallObjectPool.h>
+
+namespace RK
+{
+
+/** Size-class slab pool for small long-lived objects such as znodes.
+ *
+ * Requests are rounded up to a multiple of CLASS_GRANULARITY, and every size class is a
+ * SmallObjectPool, so a freed node is reused by the next node of the same class instead of
+ * going back to the general purpose allocator. This keeps RSS flat under create / remove
+ * churn. Requests larger than MAX_OBJECT_SIZE go to operator new.
+ *
+ * Every thread caches up to THREAD_CACHE_SIZE free objects of each class, so that the apply workers allocating and
+ * freeing nodes at once do not serialize on the mutex of a class. The mutex is only taken to refill an empty cache or
+ * drain a full one by THREAD_CACHE_BATCH objects, and objects cached by a thread go back to the class when it exits.
+ *
+ * Memory of a size class is never returned to the system.
+ */
+class SlabPool
+{
+public:
+    static constexpr size_t CLASS_GRANULARITY = 32;
+    static constexpr size_t MAX_OBJECT_SIZE = 1024;
+    static constexpr size_t NUM_CLASSES = MAX_OBJECT_SIZE / CLASS_GRANULARITY;
+    static constexpr size_t THREAD_CACHE_SIZE = 32;
+    static constexpr size_t THREAD_CACHE_BATCH = THREAD_CACHE_SIZE / 2;
+
+    struct ClassStats
+    {
+        size_t object_size;
+        /// objects in use, including the free objects cached by threads
+        size_t used;
+        /// objects in the free list of the class
+        size_t free;
+        /// memory held by the size class
+        size_t bytes;
+    };
+
+    /// Process wide pool, never destroyed for objects may be freed during static destruction.
+    static SlabPool & instance();
+
+    char * alloc(size_t size);
+    void free(char * ptr, size_t size);
+
+    /// Stats of size classes which have ever been used.
+    std::vector<ClassStats> getStats() const;
+
+private:
+    SlabPool();
+
+    static size_t classIndex(size_t size) { return (size + CLASS_GRANULARITY - 1) / CLASS_GRANULARITY - 1; }
+
+    struct SizeClass
+    {
+        explicit SizeClass(size_t object_size_) : object_size(object_size_), pool(object_size_) { }
+
+        const size_t object_size;
+        mutable std::mutex mutex;
+        SmallObjectPool pool;
+        size_t used = 0;
+        size_t allocated = 0;
+    };
+
+    /// Free objects of every class cached by a thread
+    struct ThreadCache;
+    /// nullptr once the cache of the thread is destroyed at its exit
+    static ThreadCache * threadCache();
+
+    /// Take count objects of class index out of it into objects, return the number taken, fewer only if out of memory
+    size_t fill(size_t index, char ** objects, size_t count);
+    /// Return count objects to class index
+    void drain(size_t index, char * const * objects, size_t count);
+
+    std::vector<std::unique_ptr<SizeClass>> classes;
+};
+
+/// std allocator backed by SlabPool, used with std::allocate_shared.
+template <typename T>
+struct SlabAllocator
+{
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U> &) noexcept { }
+
+    T * allocate(size_t n) { return reinterpret_cast<T *>(SlabPool::instance().alloc(n * sizeof(T))); }
+    void deallocate(T * ptr, size_t n) { SlabPool::instance().free(reinterpret_cast<char *>(ptr), n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U> &) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const SlabAllocator<U> &) const noexcept { return false; }
+};
+
+}
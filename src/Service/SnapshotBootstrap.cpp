@@ -0,0 +1,136 @@
+#include <Service/SnapshotBootstrap.h>
+
+#include <IO/ReadBufferFromIStream.h>
+#include <IO/WriteBufferFromFile.h>
+#include <IO/copyData.h>
+#include <Poco/File.h>
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/SocketAddress.h>
+#include <Poco/StreamCopier.h>
+#include <Common/Exception.h>
+#include <common/logger_useful.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int NETWORK_ERROR;
+}
+
+namespace
+{
+    /// Timeout of connecting and of every read, a snapshot file takes far longer as a whole
+    constexpr auto FETCH_TIMEOUT_SECONDS = 30;
+
+    void removeIfExists(const String & path)
+    {
+        Poco::File file(path);
+        if (file.exists())
+            file.remove(true);
+    }
+
+    std::istream & get(Poco::Net::HTTPClientSession & session, Poco::Net::HTTPResponse & response, const String & uri)
+    {
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri, Poco::Net::HTTPMessage::HTTP_1_1);
+        session.sendRequest(request);
+        return session.receiveResponse(response);
+    }
+
+    /// Names of the snapshot files of the peer, empty if it serves none
+    std::vector<String> fetchFileNames(Poco::Net::HTTPClientSession & session)
+    {
+        Poco::Net::HTTPResponse response;
+        auto & in = get(session, response, "/snapshot");
+        String body;
+        Poco::StreamCopier::copyToString(in, body);
+        if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_OK)
+            return {};
+
+        std::vector<String> names;
+        size_t begin = 0;
+        for (size_t end = body.find('\n'); end != String::npos; begin = end + 1, end = body.find('\n', begin))
+        {
+            String name = body.substr(begin, end - begin);
+            /// Written into snapshot_dir, a name is never a path
+            if (!name.starts_with("snapshot_") || name.find('/') != String::npos)
+                return {};
+            names.push_back(std::move(name));
+        }
+        return names;
+    }
+
+    void fetchFile(Poco::Net::HTTPClientSession & session, const String & name, const String & path)
+    {
+        Poco::Net::HTTPResponse response;
+        auto & in = get(session, response, "/snapshot/" + name);
+        if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_OK)
+            throw Exception(ErrorCodes::NETWORK_ERROR, "Snapshot file {} is not served: {}", name, response.getReason());
+
+        ReadBufferFromIStream read_buf(in);
+        WriteBufferFromFile write_buf(path);
+        copyData(read_buf, write_buf);
+        write_buf.next();
+        write_buf.sync();
+
+        if (response.hasContentLength() && static_cast<UInt64>(response.getContentLength64()) != write_buf.count())
+            throw Exception(
+                ErrorCodes::NETWORK_ERROR,
+                "Snapshot file {} is truncated, {} of {} bytes",
+                name,
+                write_buf.count(),
+                response.getContentLength64());
+    }
+}
+
+bool fetchSnapshotFromPeers(const String & snapshot_dir, const std::vector<String> & peers, Poco::Logger * log)
+{
+    /// Not listed by loadSnapshotMetas, its name has no "snapshot_"
+    String fetch_dir = snapshot_dir + "/fetching";
+
+    for (const auto & peer : peers)
+    {
+        try
+        {
+            removeIfExists(fetch_dir);
+            Poco::File(fetch_dir).createDirectories();
+
+            Poco::Net::HTTPClientSession session(Poco::Net::SocketAddress(peer));
+            session.setTimeout(Poco::Timespan(FETCH_TIMEOUT_SECONDS, 0));
+
+            auto names = fetchFileNames(session);
+            if (names.empty())
+            {
+                LOG_INFO(log, "Peer {} serves no snapshot", peer);
+                continue;
+            }
+
+            for (const auto & name : names)
+                fetchFile(session, name, fetch_dir + "/" + name);
+            for (const auto & name : names)
+                Poco::File(fetch_dir + "/" + name).renameTo(snapshot_dir + "/" + name);
+            removeIfExists(fetch_dir);
+
+            LOG_INFO(log, "Fetched snapshot of {} files from peer {}", names.size(), peer);
+            return true;
+        }
+        catch (...)
+        {
+            tryLogCurrentException(log, "Failed to fetch snapshot from peer " + peer);
+        }
+    }
+
+    try
+    {
+        removeIfExists(fetch_dir);
+    }
+    catch (...)
+    {
+        tryLogCurrentException(log, "Failed to remove " + fetch_dir);
+    }
+    return false;
+}
+
+}
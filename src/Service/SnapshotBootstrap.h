@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <common/types.h>
+
+namespace Poco
+{
+class Logger;
+}
+
+namespace RK
+{
+
+/** Copy the last snapshot of a follower into snapshot_dir before a server without data joins the cluster, so that
+ * the leader only sends the log tail after it instead of reading and sending a whole snapshot when it is busiest.
+ *
+ * Peers are the metrics endpoints, host:port, of the other servers, see MetricsHTTPRequestHandler. The first
+ * one serving a snapshot is used, the leader declines. Files are moved into snapshot_dir once all of them are
+ * fetched, so a failed fetch leaves nothing behind. Returns false if no peer served a snapshot, then the leader
+ * installs one as before.
+ */
+bool fetchSnapshotFromPeers(const String & snapshot_dir, const std::vector<String> & peers, Poco::Logger * log);
+
+}
@@ -9,6 +9,10 @@
 #include "Poco/ErrorHandler.h"
 #include "Poco/Thread.h"
 #include "Poco/Exception.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <unordered_set>
 
 
 using Poco::Exception;
@@ -20,6 +24,14 @@ using Poco::Net::SocketImpl;
 namespace RK {
 
 
+namespace
+{
+	/// Reactors alive, for stats
+	std::mutex reactors_mutex;
+	std::unordered_set<SocketReactor*> reactors;
+}
+
+
 SocketReactor::SocketReactor():
 	_stop(false),
 	_timeout(DEFAULT_TIMEOUT),
@@ -31,6 +43,8 @@ SocketReactor::SocketReactor():
 	_pShutdownNotification(new ShutdownNotification(this)),
 	_pThread(nullptr)
 {
+	std::lock_guard lock(reactors_mutex);
+	reactors.insert(this);
 }
 
 
@@ -45,11 +59,15 @@ SocketReactor::SocketReactor(const Poco::Timespan& timeout):
 	_pShutdownNotification(new ShutdownNotification(this)),
 	_pThread(nullptr)
 {
+	std::lock_guard lock(reactors_mutex);
+	reactors.insert(this);
 }
 
 
 SocketReactor::~SocketReactor()
 {
+	std::lock_guard lock(reactors_mutex);
+	reactors.erase(this);
 }
 
 
@@ -71,6 +89,7 @@ void SocketReactor::run()
 				PollSet::SocketModeMap sm = _pollSet.poll(_timeout);
 				if (sm.size() > 0)
 				{
+					auto loop_start = std::chrono::steady_clock::now();
 					onBusy();
 					PollSet::SocketModeMap::iterator it = sm.begin();
 					PollSet::SocketModeMap::iterator end = sm.end();
@@ -84,9 +103,12 @@ void SocketReactor::run()
 						if (it->second & PollSet::POLL_WRITE) dispatch(it->first, _pWritableNotification);
 						if (it->second & PollSet::POLL_ERROR) dispatch(it->first, _pErrorNotification);
 					}
+					recordLoop(sm.size(), std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now() - loop_start).count());
 				}
 				if (!readable) onTimeout();
 			}
+			runPeriodicTask();
 		}
 		catch (Exception& exc)
 		{
@@ -224,6 +246,84 @@ bool SocketReactor::has(const Socket& socket) const
 }
 
 
+bool SocketReactor::isEdgeTriggered() const
+{
+	return _pollSet.isEdgeTriggered();
+}
+
+
+void SocketReactor::recordLoop(uint64_t events, uint64_t loop_time_us)
+{
+	_loopCount.fetch_add(1, std::memory_order_relaxed);
+	_eventCount.fetch_add(events, std::memory_order_relaxed);
+	_loopTimeUs.fetch_add(loop_time_us, std::memory_order_relaxed);
+	/// Only the reactor thread writes it
+	if (loop_time_us > _maxLoopTimeUs.load(std::memory_order_relaxed))
+		_maxLoopTimeUs.store(loop_time_us, std::memory_order_relaxed);
+}
+
+
+void SocketReactor::setName(const std::string& name)
+{
+	_name = name;
+}
+
+
+SocketReactor::Stats SocketReactor::getStats() const
+{
+	Stats stats;
+	stats.name = _name;
+	stats.loop_count = _loopCount.load(std::memory_order_relaxed);
+	stats.event_count = _eventCount.load(std::memory_order_relaxed);
+	stats.loop_time_us = _loopTimeUs.load(std::memory_order_relaxed);
+	stats.max_loop_time_us = _maxLoopTimeUs.load(std::memory_order_relaxed);
+	{
+		ScopedLock lock(_mutex);
+		stats.socket_count = _handlers.size();
+	}
+	return stats;
+}
+
+
+std::vector<SocketReactor::Stats> SocketReactor::getAllStats()
+{
+	std::vector<Stats> all_stats;
+	std::lock_guard lock(reactors_mutex);
+	all_stats.reserve(reactors.size());
+	for (const auto * reactor : reactors)
+		all_stats.push_back(reactor->getStats());
+	return all_stats;
+}
+
+
+void SocketReactor::setPeriodicTask(const Poco::Timespan& interval, PeriodicTask task)
+{
+	ScopedLock lock(_mutex);
+	_periodicTask = std::move(task);
+	_periodicIntervalUs.store(_periodicTask ? std::max<int64_t>(interval.totalMicroseconds(), 1) : 0, std::memory_order_relaxed);
+}
+
+
+void SocketReactor::runPeriodicTask()
+{
+	int64_t interval_us = _periodicIntervalUs.load(std::memory_order_relaxed);
+	if (!interval_us)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	if (now - _lastPeriodicRun < std::chrono::microseconds(interval_us))
+		return;
+	PeriodicTask task;
+	{
+		ScopedLock lock(_mutex);
+		task = _periodicTask;
+	}
+	if (!task)
+		return;
+	_lastPeriodicRun = now;
+	task(*this);
+}
+
+
 void SocketReactor::onTimeout()
 {
 	dispatch(_pTimeoutNotification);
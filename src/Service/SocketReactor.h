@@ -18,6 +18,10 @@
 #include "Poco/Thread.h"
 #include <map>
 #include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
 
 
 using Poco::Net::Socket;
@@ -152,6 +156,38 @@ public:
 	bool has(const Socket& socket) const;
 		/// Returns true if socket is registered with this rector.
 
+	bool isEdgeTriggered() const;
+		/// Returns true if the sockets are polled edge triggered, see PollSet::setEdgeTriggered.
+		/// Then handlers must drain a socket on every notification.
+
+	struct Stats
+		/// Event loop statistics of a reactor.
+	{
+		std::string name;
+		/// Loops which dispatched some events
+		uint64_t loop_count;
+		uint64_t event_count;
+		/// Time spent on dispatching events, excluding waiting in poll
+		uint64_t loop_time_us;
+		uint64_t max_loop_time_us;
+		uint64_t socket_count;
+	};
+
+	void setName(const std::string& name);
+		/// Sets the name the reactor is reported with in stats.
+
+	Stats getStats() const;
+		/// Returns the event loop statistics.
+
+	static std::vector<Stats> getAllStats();
+		/// Returns the event loop statistics of all reactors alive.
+
+	using PeriodicTask = std::function<void(SocketReactor&)>;
+
+	void setPeriodicTask(const Poco::Timespan& interval, PeriodicTask task);
+		/// Sets a task the reactor thread runs about every interval, replacing the previous one.
+		/// It runs between polls, so up to the timeout late if no event occurs.
+
 protected:
 	virtual void onTimeout();
 		/// Called if the timeout expires and no other events are available.
@@ -196,6 +232,8 @@ private:
 	typedef MutexType::ScopedLock             ScopedLock;
 
 	bool hasSocketHandlers();
+	void recordLoop(uint64_t events, uint64_t loop_time_us);
+	void runPeriodicTask();
 	void dispatch(NotifierPtr& pNotifier, SocketNotification* pNotification);
 	NotifierPtr getNotifier(const Socket& socket, bool makeNew = false);
 
@@ -214,9 +252,20 @@ private:
 	NotificationPtr   _pTimeoutNotification;
 	NotificationPtr   _pIdleNotification;
 	NotificationPtr   _pShutdownNotification;
-	MutexType         _mutex;
+	mutable MutexType _mutex;
 	Poco::Thread*     _pThread;
 
+	std::string           _name;
+	std::atomic<uint64_t> _loopCount{0};
+	std::atomic<uint64_t> _eventCount{0};
+	std::atomic<uint64_t> _loopTimeUs{0};
+	std::atomic<uint64_t> _maxLoopTimeUs{0};
+
+	/// The task is guarded by _mutex, 0 interval means no task, the last run is of the reactor thread
+	PeriodicTask          _periodicTask;
+	std::atomic<int64_t>  _periodicIntervalUs{0};
+	std::chrono::steady_clock::time_point _lastPeriodicRun;
+
 	friend class SocketNotifier;
 };
 
@@ -0,0 +1,164 @@
+#include <Service/StallWatchdog.h>
+
+#include <algorithm>
+#include <Common/Stopwatch.h>
+#include <common/getThreadId.h>
+
+namespace RK
+{
+
+struct StallWatchdog::Slot
+{
+    /// 0 if the slot is free
+    std::atomic<UInt64> thread_id{0};
+    /// 0 if the thread is not busy
+    std::atomic<UInt64> busy_since_ms{0};
+    std::atomic<int64_t> session_id{0};
+    std::atomic<int64_t> xid{0};
+    std::atomic<Int32> opnum{0};
+    std::atomic<UInt64> log_index{0};
+    /// busy_since_ms of the last stall reported, a stall is reported once
+    std::atomic<UInt64> reported_since_ms{0};
+};
+
+StallWatchdog & StallWatchdog::instance()
+{
+    static StallWatchdog watchdog;
+    return watchdog;
+}
+
+StallWatchdog::StallWatchdog() : slots(std::make_unique<Slot[]>(MAX_THREADS))
+{
+}
+
+StallWatchdog::~StallWatchdog() = default;
+
+UInt64 StallWatchdog::nowMilliseconds() const
+{
+    return clock ? clock() : clock_gettime_ns(CLOCK_MONOTONIC_COARSE) / 1000000;
+}
+
+StallWatchdog::Busy::Busy(int64_t session_id, int64_t xid, Int32 opnum)
+{
+    enter(session_id, xid, opnum, 0);
+}
+
+StallWatchdog::Busy::Busy(UInt64 log_index)
+{
+    enter(0, 0, 0, log_index);
+}
+
+void StallWatchdog::Busy::enter(int64_t session_id, int64_t xid, Int32 opnum, UInt64 log_index)
+{
+    auto & watchdog = StallWatchdog::instance();
+    if (!watchdog.getThreshold())
+        return;
+
+    /// The slot is taken on the first request of the thread and freed when it exits
+    struct ThreadSlot
+    {
+        Slot * slot = nullptr;
+        bool taken = false;
+        ~ThreadSlot()
+        {
+            if (!slot)
+                return;
+            slot->busy_since_ms.store(0, std::memory_order_relaxed);
+            slot->thread_id.store(0, std::memory_order_release);
+        }
+    };
+    static thread_local ThreadSlot thread_slot;
+    if (!thread_slot.taken)
+    {
+        thread_slot.taken = true;
+        UInt64 thread_id = getThreadId();
+        for (size_t i = 0; i < MAX_THREADS && !thread_slot.slot; ++i)
+        {
+            UInt64 free = 0;
+            if (watchdog.slots[i].thread_id.compare_exchange_strong(free, thread_id, std::memory_order_acq_rel))
+                thread_slot.slot = &watchdog.slots[i];
+        }
+    }
+    slot = thread_slot.slot;
+    if (!slot)
+        return;
+
+    outermost = slot->busy_since_ms.load(std::memory_order_relaxed) == 0;
+    if (!outermost)
+    {
+        saved_session_id = slot->session_id.load(std::memory_order_relaxed);
+        saved_xid = slot->xid.load(std::memory_order_relaxed);
+        saved_opnum = slot->opnum.load(std::memory_order_relaxed);
+        saved_log_index = slot->log_index.load(std::memory_order_relaxed);
+    }
+    slot->session_id.store(session_id, std::memory_order_relaxed);
+    slot->xid.store(xid, std::memory_order_relaxed);
+    slot->opnum.store(opnum, std::memory_order_relaxed);
+    slot->log_index.store(log_index, std::memory_order_relaxed);
+    if (outermost)
+        slot->busy_since_ms.store(std::max<UInt64>(watchdog.nowMilliseconds(), 1), std::memory_order_release);
+}
+
+StallWatchdog::Busy::~Busy()
+{
+    if (!slot)
+        return;
+    if (outermost)
+    {
+        slot->busy_since_ms.store(0, std::memory_order_release);
+        return;
+    }
+    slot->session_id.store(saved_session_id, std::memory_order_relaxed);
+    slot->xid.store(saved_xid, std::memory_order_relaxed);
+    slot->opnum.store(saved_opnum, std::memory_order_relaxed);
+    slot->log_index.store(saved_log_index, std::memory_order_relaxed);
+}
+
+std::vector<StallWatchdog::Stall> StallWatchdog::check()
+{
+    std::vector<Stall> stalls;
+    UInt64 threshold = getThreshold();
+    if (!threshold)
+        return stalls;
+
+    UInt64 now = nowMilliseconds();
+    for (size_t i = 0; i < MAX_THREADS; ++i)
+    {
+        auto & slot = slots[i];
+        UInt64 thread_id = slot.thread_id.load(std::memory_order_acquire);
+        UInt64 since = slot.busy_since_ms.load(std::memory_order_acquire);
+        if (!thread_id || !since || now < since + threshold || slot.reported_since_ms.load(std::memory_order_relaxed) == since)
+            continue;
+
+        slot.reported_since_ms.store(since, std::memory_order_relaxed);
+        stall_count.fetch_add(1, std::memory_order_relaxed);
+        /// The thread may move on meanwhile, then its next request is reported, which is harmless
+        stalls.push_back(
+            {thread_id,
+             now - since,
+             slot.session_id.load(std::memory_order_relaxed),
+             slot.xid.load(std::memory_order_relaxed),
+             slot.opnum.load(std::memory_order_relaxed),
+             slot.log_index.load(std::memory_order_relaxed)});
+    }
+    return stalls;
+}
+
+size_t StallWatchdog::stalledThreads() const
+{
+    UInt64 threshold = getThreshold();
+    if (!threshold)
+        return 0;
+
+    size_t stalled = 0;
+    UInt64 now = nowMilliseconds();
+    for (size_t i = 0; i < MAX_THREADS; ++i)
+    {
+        UInt64 since = slots[i].busy_since_ms.load(std::memory_order_acquire);
+        if (slots[i].thread_id.load(std::memory_order_acquire) && since && now >= since + threshold)
+            ++stalled;
+    }
+    return stalled;
+}
+
+}
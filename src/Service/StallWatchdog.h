@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Finds threads stuck on one request, such as the apply thread on a huge Multi, a lock convoy or a slow compaction,
+  * before clients time out.
+  *
+  * A thread marks itself busy with a Busy scope around every request it applies and every log entry NuRaft commits.
+  * That is a few relaxed stores into a slot of the thread, taken on its first request. check is called periodically
+  * by the watchdog thread of KeeperDispatcher, which logs the stalls with their request and captures the stacks of
+  * all threads by SamplingProfiler.
+  */
+class StallWatchdog : private boost::noncopyable
+{
+    struct Slot;
+
+public:
+    /// Threads tracked at most, others are not watched
+    static constexpr size_t MAX_THREADS = 256;
+
+    static StallWatchdog & instance();
+
+    /// What a thread busy for too long is doing
+    struct Stall
+    {
+        UInt64 thread_id;
+        UInt64 busy_ms;
+        int64_t session_id;
+        int64_t xid;
+        Int32 opnum;
+        /// Of a log entry committed by NuRaft, 0 for a request
+        UInt64 log_index;
+    };
+
+    /// Mark the current thread busy while the scope lives. A nested scope replaces what is reported, and the time
+    /// is counted from the outermost one.
+    class Busy : private boost::noncopyable
+    {
+    public:
+        Busy(int64_t session_id, int64_t xid, Int32 opnum);
+        explicit Busy(UInt64 log_index);
+        ~Busy();
+
+    private:
+        Slot * slot = nullptr;
+        bool outermost = false;
+        int64_t saved_session_id = 0;
+        int64_t saved_xid = 0;
+        Int32 saved_opnum = 0;
+        UInt64 saved_log_index = 0;
+
+        void enter(int64_t session_id, int64_t xid, Int32 opnum, UInt64 log_index);
+    };
+
+    /// Monotonic milliseconds, tests pass their own clock
+    using Clock = std::function<UInt64()>;
+    /// Set while no thread is busy, before the threshold, an empty clock is the monotonic clock
+    void setClock(Clock clock_) { clock = std::move(clock_); }
+
+    /// Threads are watched once the threshold is set, 0 disables the watchdog
+    void setThreshold(UInt64 threshold_ms_) { threshold_ms.store(threshold_ms_, std::memory_order_relaxed); }
+    UInt64 getThreshold() const { return threshold_ms.load(std::memory_order_relaxed); }
+
+    /// Threads busy with the same request over the threshold. Every stall is returned and counted once.
+    std::vector<Stall> check();
+
+    /// Stalls found since start
+    UInt64 stallCount() const { return stall_count.load(std::memory_order_relaxed); }
+    /// Threads over the threshold right now
+    size_t stalledThreads() const;
+
+private:
+    StallWatchdog();
+    ~StallWatchdog();
+
+    UInt64 nowMilliseconds() const;
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<UInt64> threshold_ms{0};
+    std::atomic<UInt64> stall_count{0};
+    Clock clock;
+};
+
+}
@@ -0,0 +1,392 @@
+#include <Service/StartupReadServer.h>
+
+#include <algorithm>
+#include <IO/ReadBufferFromMemory.h>
+#include <IO/WriteBufferFromString.h>
+#include <Service/FourLetterCommand.h>
+#include <Service/KeeperStore.h>
+#include <Poco/Net/TCPServerConnection.h>
+#include <Poco/Net/TCPServerConnectionFactory.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <Common/ZooKeeper/ZooKeeperIO.h>
+#include <Common/config_version.h>
+
+namespace RK
+{
+
+namespace
+{
+    /// The view is opened by the state machine, which knows nothing of the server
+    struct View
+    {
+        std::mutex mutex;
+        bool running = false;
+        KeeperStore * store = nullptr;
+        int64_t zxid = 0;
+    };
+
+    View & view()
+    {
+        static View startup_view;
+        return startup_view;
+    }
+
+    /// Larger requests are refused, reads are small
+    constexpr int32_t MAX_REQUEST_LENGTH = 1 << 20;
+}
+
+class StartupReadServer::Connection : public Poco::Net::TCPServerConnection
+{
+public:
+    Connection(const Poco::Net::StreamSocket & socket_, StartupReadServer & server_)
+        : Poco::Net::TCPServerConnection(socket_), server(server_)
+    {
+        std::lock_guard lock(server.mutex);
+        ++server.connection_count;
+    }
+
+    ~Connection() override
+    {
+        std::lock_guard lock(server.mutex);
+        --server.connection_count;
+        server.cv.notify_all();
+    }
+
+    void run() override
+    {
+        try
+        {
+            socket().setSendTimeout(Poco::Timespan(static_cast<Poco::Timespan::TimeDiff>(server.session_timeout_ms) * 1000));
+            int32_t length = 0;
+            if (!receiveLength(length))
+                return;
+
+            if (length != Coordination::CLIENT_HANDSHAKE_LENGTH && length != Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_READONLY)
+            {
+                send(runCommand(IFourLetterCommand::toName(length)));
+                return;
+            }
+
+            KeeperStore * store;
+            int64_t zxid;
+            {
+                std::lock_guard lock(view().mutex);
+                store = view().store;
+                zxid = view().zxid;
+            }
+            if (!handshake(length, store, zxid))
+                return;
+
+            String body;
+            while (receiveLength(length))
+            {
+                if (length <= 0 || length > MAX_REQUEST_LENGTH)
+                {
+                    LOG_WARNING(server.log, "Request of {} bytes from {}, close", length, peer);
+                    return;
+                }
+                body.resize(length);
+                if (!receive(body.data(), body.size()))
+                    return;
+
+                ReadBufferFromMemory in(body.data(), body.size());
+                Coordination::XID xid;
+                Coordination::OpNum opnum;
+                Coordination::read(xid, in);
+                Coordination::read(opnum, in);
+                auto request = Coordination::ZooKeeperRequestFactory::instance().get(opnum);
+                request->xid = xid;
+                request->readImpl(in);
+
+                bool close = false;
+                auto response = process(*request, *store, close);
+                response->xid = xid;
+                response->zxid = zxid;
+                WriteBufferFromOwnString out;
+                response->write(out);
+                send(out.str());
+                if (close)
+                    return;
+            }
+        }
+        catch (...)
+        {
+            tryLogCurrentException(server.log, "Startup read connection of " + peer + " failed");
+        }
+    }
+
+private:
+    StartupReadServer & server;
+    String peer = socket().peerAddress().toString();
+    Coordination::AuthIDs auths;
+
+    /// Wait for data in short polls to notice the server stopping, false if the connection is closed, idle for
+    /// the session timeout or the server stops
+    bool receive(char * data, size_t size)
+    {
+        size_t received = 0;
+        UInt64 idle_ms = 0;
+        while (received < size)
+        {
+            if (server.stopped)
+                return false;
+            if (!socket().poll(Poco::Timespan(0, 100000), Poco::Net::Socket::SELECT_READ))
+            {
+                idle_ms += 100;
+                if (idle_ms >= server.session_timeout_ms)
+                    return false;
+                continue;
+            }
+            int bytes = socket().receiveBytes(data + received, static_cast<int>(size - received));
+            if (bytes <= 0)
+                return false;
+            received += bytes;
+            idle_ms = 0;
+        }
+        return true;
+    }
+
+    bool receiveLength(int32_t & length)
+    {
+        char data[sizeof(int32_t)];
+        if (!receive(data, sizeof(data)))
+            return false;
+        ReadBufferFromMemory in(data, sizeof(data));
+        Coordination::read(length, in);
+        return true;
+    }
+
+    void send(const String & data) { socket().sendBytes(data.data(), static_cast<int>(data.size())); }
+
+    bool handshake(int32_t length, KeeperStore * store, int64_t zxid)
+    {
+        String body(length, '\0');
+        if (!receive(body.data(), body.size()))
+            return false;
+
+        ReadBufferFromMemory in(body.data(), body.size());
+        int32_t protocol_version;
+        int64_t last_zxid_seen;
+        int32_t timeout_ms;
+        int64_t previous_session_id;
+        std::array<char, Coordination::PASSWORD_LENGTH> passwd{};
+        bool readonly = false;
+        Coordination::read(protocol_version, in);
+        Coordination::read(last_zxid_seen, in);
+        Coordination::read(timeout_ms, in);
+        Coordination::read(previous_session_id, in);
+        Coordination::read(passwd, in);
+        if (length == Coordination::CLIENT_HANDSHAKE_LENGTH_WITH_READONLY)
+            Coordination::read(readonly, in);
+
+        /// Closed without an answer, the client tries again or another server
+        if (!store || !readonly || last_zxid_seen > zxid)
+        {
+            LOG_DEBUG(
+                server.log,
+                "Refuse session of {} while starting, {}",
+                peer,
+                !store ? "the snapshot is not loaded" : !readonly ? "it is not read only" : "it has seen a later zxid");
+            return false;
+        }
+
+        int64_t session_id = server.next_session_id++;
+        auto session_timeout_ms = static_cast<int32_t>(server.session_timeout_ms);
+        if (timeout_ms > 0)
+            session_timeout_ms = std::min(session_timeout_ms, timeout_ms);
+        LOG_INFO(server.log, "Read only session {} of {} at zxid {} while starting", session_id, peer, zxid);
+
+        WriteBufferFromOwnString out;
+        Coordination::write(Coordination::SERVER_HANDSHAKE_LENGTH + 1, out);
+        Coordination::write(Coordination::ZOOKEEPER_PROTOCOL_VERSION, out);
+        Coordination::write(session_timeout_ms, out);
+        Coordination::write(session_id, out);
+        Coordination::write(std::array<char, Coordination::PASSWORD_LENGTH>{}, out);
+        Coordination::write(true, out);
+        send(out.str());
+        return true;
+    }
+
+    Coordination::ZooKeeperResponsePtr process(const Coordination::ZooKeeperRequest & request, KeeperStore & store, bool & close)
+    {
+        using namespace Coordination;
+        auto response = request.makeResponse();
+        auto readable = [&](const std::shared_ptr<const KeeperNode> & node)
+        {
+            if (!node)
+                response->error = Error::ZNONODE;
+            else if (!(store.permissionsOf(node->acl_id, auths) & ACL::Read))
+                response->error = Error::ZNOAUTH;
+            return response->error == Error::ZOK;
+        };
+
+        switch (request.getOpNum())
+        {
+            case OpNum::Heartbeat:
+            case OpNum::SetWatches:
+                break;
+            case OpNum::Close:
+                close = true;
+                break;
+            case OpNum::Sync:
+                dynamic_cast<ZooKeeperSyncResponse &>(*response).path = dynamic_cast<const ZooKeeperSyncRequest &>(request).path;
+                break;
+            case OpNum::Auth: {
+                const auto & auth_request = dynamic_cast<const ZooKeeperAuthRequest &>(request);
+                AuthID auth;
+                if (!store.authOf(auth_request.scheme, auth_request.data, auth))
+                    response->error = Error::ZAUTHFAILED;
+                else if (std::find(auths.begin(), auths.end(), auth) == auths.end())
+                    auths.push_back(auth);
+                break;
+            }
+            case OpNum::Exists: {
+                auto node = store.getExportNode(request.getPath());
+                if (node)
+                    dynamic_cast<ZooKeeperExistsResponse &>(*response).stat = node->statForResponse();
+                else
+                    response->error = Error::ZNONODE;
+                break;
+            }
+            case OpNum::Get: {
+                auto node = store.getExportNode(request.getPath());
+                if (!readable(node))
+                    break;
+                auto & get_response = dynamic_cast<ZooKeeperGetResponse &>(*response);
+                node->data.copyTo(get_response.data);
+                get_response.stat = node->statForResponse();
+                break;
+            }
+            case OpNum::List:
+            case OpNum::SimpleList: {
+                auto node = store.getExportNode(request.getPath());
+                if (!readable(node))
+                    break;
+                auto & list_response = dynamic_cast<ZooKeeperListResponse &>(*response);
+                list_response.names.reserve(node->children.size());
+                node->children.forEach([&list_response](const String & child) { list_response.names.push_back(child); });
+                list_response.stat = node->statForResponse();
+                break;
+            }
+            default:
+                response->error = request.isReadRequest() ? Error::ZUNIMPLEMENTED : Error::ZNOTREADONLY;
+        }
+        return response;
+    }
+
+    String runCommand(const String & name)
+    {
+        if (name == "ruok")
+            return "imok";
+        if (name == "isro")
+            return "ro";
+
+        KeeperStore * store;
+        int64_t view_zxid;
+        {
+            std::lock_guard lock(view().mutex);
+            store = view().store;
+            view_zxid = view().zxid;
+        }
+        /// The live store, whose zxid moves on as the log is replayed
+        uint64_t node_count = store ? store->getNodesCount() : 0;
+        int64_t last_zxid = store ? store->zxid.load() : 0;
+        size_t connections;
+        {
+            std::lock_guard lock(server.mutex);
+            connections = server.connection_count;
+        }
+
+        if (name == "srvr")
+            return fmt::format(
+                "RaftKeeper version: {}\nZxid: 0x{:x}\nMode: read-only\nNode count: {}\nStarting, read only sessions see zxid 0x{:x}\n",
+                VERSION_FULL,
+                last_zxid,
+                node_count,
+                view_zxid);
+        if (name == "mntr")
+            return fmt::format(
+                "zk_version\t{}\nzk_server_state\tread-only\nzk_znode_count\t{}\nzk_last_zxid\t{}\nzk_startup_view_zxid\t{}\n"
+                "zk_num_alive_connections\t{}\n",
+                VERSION_FULL,
+                node_count,
+                last_zxid,
+                view_zxid,
+                connections);
+        return "RaftKeeper is starting, only ruok, isro, srvr and mntr are served\n";
+    }
+};
+
+class StartupReadServer::ConnectionFactory : public Poco::Net::TCPServerConnectionFactory
+{
+public:
+    explicit ConnectionFactory(StartupReadServer & server_) : server(server_) { }
+
+    Poco::Net::TCPServerConnection * createConnection(const Poco::Net::StreamSocket & socket) override
+    {
+        return new Connection(socket, server);
+    }
+
+private:
+    StartupReadServer & server;
+};
+
+StartupReadServer::StartupReadServer(const Poco::Net::ServerSocket & socket, size_t max_connections, UInt64 session_timeout_ms_)
+    : session_timeout_ms(std::max<UInt64>(session_timeout_ms_, 1000))
+    , thread_pool(1, static_cast<int>(std::max<size_t>(max_connections, 1)))
+    , log(&Poco::Logger::get("StartupReadServer"))
+{
+    {
+        std::lock_guard lock(view().mutex);
+        view().running = true;
+    }
+    auto * params = new Poco::Net::TCPServerParams;
+    params->setMaxThreads(static_cast<int>(std::max<size_t>(max_connections, 1)));
+    params->setMaxQueued(static_cast<int>(std::max<size_t>(max_connections, 1)));
+    server = std::make_unique<Poco::Net::TCPServer>(new ConnectionFactory(*this), thread_pool, socket, params);
+    server->start();
+}
+
+StartupReadServer::~StartupReadServer()
+{
+    stopped = true;
+    server->stop();
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [this] { return connection_count == 0; });
+    }
+    thread_pool.joinAll();
+    /// The listening socket is closed with the last reference
+    server.reset();
+
+    std::lock_guard lock(view().mutex);
+    if (view().store)
+    {
+        view().store->unpinExportView();
+        LOG_INFO(log, "Closed the startup read view at zxid {}", view().zxid);
+    }
+    view().store = nullptr;
+    view().running = false;
+}
+
+bool StartupReadServer::isRunning()
+{
+    std::lock_guard lock(view().mutex);
+    return view().running;
+}
+
+void StartupReadServer::openView(KeeperStore & store)
+{
+    std::lock_guard lock(view().mutex);
+    if (!view().running || view().store)
+        return;
+    view().zxid = store.pinExportView();
+    view().store = &store;
+    LOG_INFO(
+        &Poco::Logger::get("StartupReadServer"),
+        "Serve read only sessions at zxid {} with {} nodes while the log is replayed",
+        view().zxid,
+        store.getNodesCount());
+}
+
+}
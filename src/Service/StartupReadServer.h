@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/TCPServer.h>
+#include <Poco/ThreadPool.h>
+#include <boost/noncopyable.hpp>
+#include <common/logger_useful.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+class KeeperStore;
+
+/** Serves the client port while the server starts, so that monitoring and clients tolerating stale reads get the
+  * server back minutes before the log is replayed and the server caught up.
+  *
+  * Once the snapshot is applied, NuRaftStateMachine opens the view, an export view of the store pinned at the zxid of
+  * the snapshot (see KeeperStore::pinExportView), which the replay does not change. A client asking for a read only
+  * session, canBeReadOnly of ZooKeeper clients, gets a session of this server alone. It reads the view with the
+  * permissions of its AddAuths, responses carry the zxid of the view and writes fail with ZNOTREADONLY. Watches are
+  * not set, the view does not change. Other clients are disconnected until the view is open, or if they ask for no
+  * read only session, and so retry until the server serves. ruok, isro, srvr and mntr are answered.
+  *
+  * Connections are blocking, one thread each. All of them are closed when the server serves, then the clients connect
+  * to the client port again, ZooKeeper clients in read only mode look for a read write server by themselves anyway.
+  */
+class StartupReadServer : private boost::noncopyable
+{
+public:
+    StartupReadServer(const Poco::Net::ServerSocket & socket, size_t max_connections, UInt64 session_timeout_ms_);
+    /// Close the connections, then the view
+    ~StartupReadServer();
+
+    /// Whether a server is running, the view is only opened if so
+    static bool isRunning();
+    /// By NuRaftStateMachine once the snapshot is applied, before the log is replayed
+    static void openView(KeeperStore & store);
+
+private:
+    class Connection;
+    class ConnectionFactory;
+
+    UInt64 session_timeout_ms;
+    std::atomic<bool> stopped{false};
+    std::atomic<int64_t> next_session_id{1};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t connection_count = 0;
+
+    Poco::ThreadPool thread_pool;
+    std::unique_ptr<Poco::Net::TCPServer> server;
+    Poco::Logger * log;
+};
+
+}
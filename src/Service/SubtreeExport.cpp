@@ -0,0 +1,122 @@
+#include <cstring>
+#include <Service/SubtreeExport.h>
+#include <Service/KeeperStore.h>
+#include <Common/ZooKeeper/ZooKeeperIO.h>
+#include <ext/scope_guard.h>
+
+namespace RK
+{
+
+namespace ErrorCodes
+{
+    extern const int CORRUPTED_DATA;
+}
+
+size_t exportSubtree(KeeperStore & store, const String & root, WriteBuffer & out)
+{
+    int64_t zxid = store.pinExportView();
+    SCOPE_EXIT({ store.unpinExportView(); });
+
+    out.write(EXPORT_MAGIC, strlen(EXPORT_MAGIC));
+    Coordination::write(EXPORT_VERSION, out);
+    Coordination::write(zxid, out);
+
+    size_t exported = 0;
+    std::vector<String> stack{root};
+    String data;
+    while (!stack.empty())
+    {
+        String path = std::move(stack.back());
+        stack.pop_back();
+
+        /// Removed since its parent was read, a child of another version
+        auto node = store.getExportNode(path);
+        if (!node)
+            continue;
+
+        node->data.copyTo(data);
+        Coordination::write(path, out);
+        Coordination::write(node->statForResponse(), out);
+        Coordination::write(data, out);
+        Coordination::write(store.acl_map.convertNumber(node->acl_id), out);
+        ++exported;
+
+        String path_with_slash = path == "/" ? path : path + '/';
+        node->children.forEach([&](const String & child) { stack.push_back(path_with_slash + child); });
+    }
+    Coordination::write(String{}, out);
+    return exported;
+}
+
+int64_t readExportHead(ReadBuffer & in)
+{
+    char magic[sizeof(EXPORT_MAGIC) - 1];
+    int32_t version = 0;
+    int64_t zxid = 0;
+    if (in.read(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, EXPORT_MAGIC, sizeof(magic)) != 0)
+        throw Exception(ErrorCodes::CORRUPTED_DATA, "Not an export stream");
+    Coordination::read(version, in);
+    if (version != EXPORT_VERSION)
+        throw Exception(ErrorCodes::CORRUPTED_DATA, "Unknown export version {}", version);
+    Coordination::read(zxid, in);
+    return zxid;
+}
+
+bool readExportedNode(ReadBuffer & in, ExportedNode & node)
+{
+    Coordination::read(node.path, in);
+    if (node.path.empty())
+        return false;
+    Coordination::read(node.stat, in);
+    Coordination::read(node.data, in);
+    Coordination::read(node.acls, in);
+    return true;
+}
+
+size_t importSubtree(
+    ReadBuffer & in, const String & root, const std::function<void(const Coordination::ZooKeeperRequestPtr &)> & put)
+{
+    readExportHead(in);
+
+    size_t imported = 0;
+    size_t batch_bytes = 0;
+    auto batch = std::make_shared<Coordination::ZooKeeperBatchWriteRequest>();
+    auto flush = [&]
+    {
+        if (batch->requests.empty())
+            return;
+        put(batch);
+        batch = std::make_shared<Coordination::ZooKeeperBatchWriteRequest>();
+        batch_bytes = 0;
+    };
+
+    /// Parents come before their children, so every create finds its parent in an earlier sub request
+    String export_root;
+    ExportedNode node;
+    while (readExportedNode(in, node))
+    {
+        if (export_root.empty())
+            export_root = node.path;
+        if (node.stat.ephemeralOwner)
+            continue;
+
+        auto request = std::make_shared<Coordination::ZooKeeperCreateRequest>();
+        /// Empty for the export root, /b for its descendant /a/b of export root /a
+        String relative = node.path == export_root ? "" : node.path.substr(export_root == "/" ? 0 : export_root.size());
+        request->path = root.empty() ? node.path : (root == "/" ? "" : root) + relative;
+        if (request->path.empty())
+            request->path = "/";
+        request->data = std::move(node.data);
+        request->acls = std::move(node.acls);
+
+        batch_bytes += request->path.size() + request->data.size();
+        batch->requests.push_back(std::move(request));
+        ++imported;
+        if (batch->requests.size() >= IMPORT_BATCH_SIZE || batch_bytes >= IMPORT_BATCH_BYTES)
+            flush();
+    }
+    flush();
+    return imported;
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <functional>
+#include <IO/ReadBuffer.h>
+#include <IO/WriteBuffer.h>
+#include <Common/ZooKeeper/IKeeper.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+
+namespace RK
+{
+
+class KeeperStore;
+
+/// A node of an exported subtree
+struct ExportedNode
+{
+    String path;
+    Coordination::Stat stat;
+    String data;
+    Coordination::ACLs acls;
+};
+
+/** A subtree as a stream for backups and migrations, instead of a Get and a List per node through the pipeline.
+ *
+ *     "RKEXPORT" version:int32 zxid:int64
+ *     path stat data acls      every node in ZooKeeper encoding, parents before their children
+ *     ""                       end of the stream, a stream cut short has none
+ *
+ * The nodes are read from the export view of the store, see KeeperStore::pinExportView, so the stream is the
+ * subtree at the zxid in the head however long it takes, and neither locks nodes nor goes through the request
+ * threads. Nodes are written as they are read, out, such as a socket, paces the export. ACLs are not checked.
+ */
+static constexpr char EXPORT_MAGIC[] = "RKEXPORT";
+static constexpr int32_t EXPORT_VERSION = 1;
+
+/// Returns the number of nodes exported, 0 if root does not exist
+size_t exportSubtree(KeeperStore & store, const String & root, WriteBuffer & out);
+
+/// Returns the zxid of the stream, throw if it is not an export
+int64_t readExportHead(ReadBuffer & in);
+/// Returns false at the end of the stream
+bool readExportedNode(ReadBuffer & in, ExportedNode & node);
+
+/// Nodes and bytes of data of a BatchWrite of importSubtree at most
+static constexpr size_t IMPORT_BATCH_SIZE = 1000;
+static constexpr size_t IMPORT_BATCH_BYTES = 1 << 20;
+
+/** Create the nodes of an export by BatchWrite requests given to put in order, with their data and ACLs. The root of
+ * the export is created at root if not empty, at its own path otherwise. Nodes existing already are left as they
+ * are and ephemeral nodes are skipped, stats are those of new nodes. Returns the number of nodes put.
+ */
+size_t importSubtree(
+    ReadBuffer & in, const String & root, const std::function<void(const Coordination::ZooKeeperRequestPtr &)> & put);
+
+}
@@ -10,10 +10,13 @@
 #include <Poco/Environment.h>
 #include <Poco/NObserver.h>
 #include <Poco/SharedPtr.h>
+#include <mutex>
 #include <vector>
 
 #include <Core/Context.h>
+#include <Service/KernelTLS.h>
 #include <Service/SvsSocketReactor.h>
+#include <Common/ThreadPool.h>
 
 
 using Poco::Net::Socket;
@@ -75,6 +78,29 @@ namespace RK {
             reactor_->wakeUp();
         }
 
+        SvsSocketAcceptor(
+            const String& name,
+            Context & keeper_context_,
+            ServerSocket & socket,
+            const Poco::Timespan & timeout,
+            int cpu)
+            : name_(name)
+            , socket_(socket)
+            , reactor_(nullptr)
+            , threads_(1)
+            , next_(0)
+            , keeper_context(keeper_context_)
+            , timeout_(timeout)
+        /// Creates a SvsSocketAcceptor with a single reactor which accepts the connections of socket
+        /// and serves them too, for SO_REUSEPORT where every reactor has a listening socket of its own.
+        /// The reactor thread is pinned to cpu if it is not negative.
+        {
+            reactors_.push_back(new ParallelReactor(timeout_, name_, cpu));
+            reactor_ = reactors_.front().get();
+            reactor_->addEventHandler(socket_, Observer(*this, &SvsSocketAcceptor::onAccept));
+            reactor_->wakeUp();
+        }
+
         virtual ~SvsSocketAcceptor()
         /// Destroys the ParallelSocketAcceptor.
         {
@@ -90,6 +116,15 @@ namespace RK {
             }
         }
 
+        void setTLS(KernelTLSPtr tls)
+        /// Accepted connections are handed to the reactors after a TLS handshake, which runs
+        /// on a pool of threads so that slow clients do not hold up accepting.
+        {
+            tls_ = std::move(tls);
+            size_t threads = tls_->handshakeThreadCount();
+            tls_pool_ = std::make_unique<ThreadPool>(threads, threads, MAX_QUEUED_TLS_HANDSHAKES);
+        }
+
         void setReactor(SocketReactor& reactor)
         /// Sets the reactor for this acceptor.
         {
@@ -127,6 +162,21 @@ namespace RK {
                 reactor_->removeEventHandler(socket_, Observer(*this, &SvsSocketAcceptor::onAccept));
             }
         }
+
+        void resumeAccepting()
+        /// Registers the acceptor again with its reactor after unregisterAcceptor.
+        {
+            if (reactor_)
+                registerAcceptor(*reactor_);
+        }
+
+        template <typename... Args>
+        ServiceHandler* adoptConnection(StreamSocket& socket, const Args&... args)
+        /// Serves a connected socket inherited from another process, see ConnectionHandoff.
+        /// args are passed to the ServiceHandler after the ones of accepted connections.
+        {
+            return makeServiceHandler(socket, args...);
+        }
 	
         void onAccept(ReadableNotification* pNotification)
         /// Accepts connection and creates event handler.
@@ -134,8 +184,15 @@ namespace RK {
         /// and need register event? no
         {
             pNotification->release();
-            StreamSocket sock = socket_.acceptConnection();
-            createServiceHandler(sock);
+            /// Edge triggered, connections queued together are reported once, so accept all of them
+            do
+            {
+                StreamSocket sock = socket_.acceptConnection();
+                if (tls_)
+                    handshake(sock);
+                else
+                    createServiceHandler(sock);
+            } while (reactor_->isEdgeTriggered() && socket_.poll(Poco::Timespan(0), Socket::SELECT_READ));
         }
 
     protected:
@@ -149,8 +206,15 @@ namespace RK {
         /// fashion.
         ///
         /// Subclasses can override this method.
+        {
+            return makeServiceHandler(socket);
+        }
+
+        template <typename... Args>
+        ServiceHandler* makeServiceHandler(StreamSocket& socket, const Args&... args)
         {
             socket.setBlocking(false);
+            std::lock_guard lock(next_mutex_);
             SocketReactor* pReactor = reactor(socket);
             if (!pReactor)
             {
@@ -158,11 +222,31 @@ namespace RK {
                 if (next_ == reactors_.size()) next_ = 0;
                 pReactor = reactors_[next];
             }
-            auto* ret = new ServiceHandler(keeper_context, socket, *pReactor);
+            auto* ret = new ServiceHandler(keeper_context, socket, *pReactor, args...);
             pReactor->wakeUp();
             return ret;
         }
 
+        void handshake(const StreamSocket& socket)
+        /// Schedule the TLS handshake of socket, the connection is closed if it fails
+        /// or too many handshakes are queued.
+        {
+            bool scheduled = tls_pool_->trySchedule([this, socket]() mutable
+            {
+                try
+                {
+                    if (tls_->accept(socket))
+                        createServiceHandler(socket);
+                }
+                catch (...)
+                {
+                    tryLogCurrentException(&Poco::Logger::get(name_), "Cannot create the handler of a TLS connection");
+                }
+            });
+            if (!scheduled)
+                LOG_WARNING(&Poco::Logger::get(name_), "Too many TLS handshakes running, connection closed");
+        }
+
         SocketReactor* reactor(const Socket& socket)
         /// Returns reactor where this socket is already registered
         /// for polling, if found; otherwise returns null pointer.
@@ -219,6 +303,9 @@ namespace RK {
         }
 
     private:
+        /// Connections accepted while this many handshakes are running or queued are closed
+        static constexpr size_t MAX_QUEUED_TLS_HANDSHAKES = 4096;
+
         SvsSocketAcceptor() = delete;
         SvsSocketAcceptor(const SvsSocketAcceptor &) = delete;
         SvsSocketAcceptor & operator = (const SvsSocketAcceptor &) = delete;
@@ -233,6 +320,12 @@ namespace RK {
 
         Context & keeper_context;
         Poco::Timespan timeout_;
+
+        /// Handlers are created by the handshake threads too
+        std::mutex next_mutex_;
+        KernelTLSPtr tls_;
+        /// Last, so that running handshakes are done before the rest is destroyed
+        std::unique_ptr<ThreadPool> tls_pool_;
     };
 
 
@@ -2,6 +2,7 @@
 
 #include <Service/SocketReactor.h>
 #include <Service/SocketNotification.h>
+#include <Service/PipelineStageThreads.h>
 #include <Poco/Net/StreamSocket.h>
 #include <Poco/Net/ServerSocket.h>
 #include <Poco/NObserver.h>
@@ -9,6 +10,11 @@
 #include <Poco/SharedPtr.h>
 #include <Common/setThreadName.h>
 
+#if defined(OS_LINUX)
+#    include <pthread.h>
+#    include <sched.h>
+#endif
+
 
 
 namespace RK {
@@ -21,14 +27,17 @@ namespace RK {
 
         SvsSocketReactor(const std::string& name = "")
         {
+            this->setName(name);
             _thread.start(*this);
             if (!name.empty())
                 _thread.setName(name);
         }
 
-        SvsSocketReactor(const Poco::Timespan& timeout, const std::string& name = ""):
-            SR(timeout)
+        /// The reactor thread is pinned to cpu if it is not negative.
+        SvsSocketReactor(const Poco::Timespan& timeout, const std::string& name = "", int cpu = -1):
+            SR(timeout), _cpu(cpu)
         {
+            this->setName(name);
             _thread.start(*this);
             if (!name.empty())
                 _thread.setName(name);
@@ -46,6 +55,22 @@ namespace RK {
             }
         }
 	
+        void run() override
+        {
+#if defined(OS_LINUX)
+            if (_cpu >= 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(_cpu, &cpus);
+                /// Not pinned is no worse than before, so ignore errors
+                pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            }
+#endif
+            PipelineStageThreads::Scope stage_scope(PipelineStage::Reactor);
+            SR::run();
+        }
+
     protected:
         void onIdle() override
         {
@@ -54,6 +79,7 @@ namespace RK {
         }
 	
     private:
+        int _cpu = -1;
         Poco::Thread _thread;
     };
 
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <vector>
+#include <Service/RequestArena.h>
 
 namespace RK
 {
@@ -26,6 +30,17 @@ public:
         cv.notify_one();
     }
 
+    /// Push all the elements under one lock, so that a consumer of tryPopAll gets them together.
+    template <typename Elements>
+    void push(const Elements & responses)
+    {
+        if (responses.empty())
+            return;
+        std::lock_guard lock(queue_mutex);
+        queue.insert(queue.end(), responses.begin(), responses.end());
+        cv.notify_one();
+    }
+
     void pop()
     {
         std::unique_lock lock(queue_mutex);
@@ -44,6 +59,21 @@ public:
         return true;
     }
 
+    /// Pop at most max_size elements, wait for timeout_ms if the queue is empty.
+    bool tryPopAll(std::vector<T> & responses, size_t max_size, int64_t timeout_ms = 0)
+    {
+        responses.clear();
+        std::unique_lock lock(queue_mutex);
+        if (!cv.wait_for(lock,
+                         std::chrono::milliseconds(timeout_ms), [this] { return !queue.empty(); }))
+            return false;
+
+        size_t size = std::min(max_size, queue.size());
+        responses.assign(std::make_move_iterator(queue.begin()), std::make_move_iterator(queue.begin() + size));
+        queue.erase(queue.begin(), queue.begin() + size);
+        return true;
+    }
+
     bool peek(T & response)
     {
         std::unique_lock lock(queue_mutex);
@@ -83,6 +113,99 @@ public:
     {
         return size() == 0;
     }
+
+    /// Free the blocks of the queue if it is empty, false if it is not
+    bool shrinkIfEmpty()
+    {
+        std::lock_guard lock(queue_mutex);
+        if (!queue.empty())
+            return false;
+        queue.shrink_to_fit();
+        return true;
+    }
+};
+
+/** ThreadSafeQueue sharded by the session_id of elements, every shard is meant to be consumed by
+  * its own thread. Elements of a session stay in order, elements of different sessions in different
+  * shards are not ordered.
+  */
+template <typename T>
+class ShardedThreadSafeQueue
+{
+private:
+    std::vector<std::unique_ptr<ThreadSafeQueue<T>>> shards;
+
+    ThreadSafeQueue<T> & shardFor(const T & e) { return *shards[static_cast<uint64_t>(e.session_id) % shards.size()]; }
+
+public:
+    explicit ShardedThreadSafeQueue(size_t shard_count = 1) { setShardCount(shard_count); }
+
+    /// Must be called before the queue is used
+    void setShardCount(size_t shard_count)
+    {
+        shards.clear();
+        for (size_t i = 0; i < std::max<size_t>(shard_count, 1); ++i)
+            shards.push_back(std::make_unique<ThreadSafeQueue<T>>());
+    }
+
+    size_t shardCount() const { return shards.size(); }
+
+    void push(const T & e) { shardFor(e).push(e); }
+
+    /// Elements of a shard are pushed under one lock
+    template <typename Elements>
+    void push(const Elements & elements)
+    {
+        if (shards.size() == 1)
+        {
+            shards[0]->push(elements);
+            return;
+        }
+
+        RequestArenaScope arena_scope;
+        ArenaVector<ArenaVector<T>> sharded(shards.size());
+        for (const auto & e : elements)
+            sharded[static_cast<uint64_t>(e.session_id) % shards.size()].push_back(e);
+        for (size_t i = 0; i < shards.size(); ++i)
+            shards[i]->push(sharded[i]);
+    }
+
+    bool tryPop(T & e, int64_t timeout_ms = 0) { return shards[0]->tryPop(e, timeout_ms) || tryPopFromOthers(e); }
+
+    bool tryPopAll(size_t shard, std::vector<T> & elements, size_t max_size, int64_t timeout_ms = 0)
+    {
+        return shards[shard]->tryPopAll(elements, max_size, timeout_ms);
+    }
+
+    /// Only waits on the first shard
+    bool tryPopAll(std::vector<T> & elements, size_t max_size, int64_t timeout_ms = 0)
+    {
+        if (shards[0]->tryPopAll(elements, max_size, timeout_ms))
+            return true;
+        for (size_t i = 1; i < shards.size(); ++i)
+            if (shards[i]->tryPopAll(elements, max_size))
+                return true;
+        return false;
+    }
+
+    size_t size() const
+    {
+        size_t size = 0;
+        for (const auto & shard : shards)
+            size += shard->size();
+        return size;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    bool tryPopFromOthers(T & e)
+    {
+        for (size_t i = 1; i < shards.size(); ++i)
+            if (shards[i]->tryPop(e))
+                return true;
+        return false;
+    }
 };
 
 }
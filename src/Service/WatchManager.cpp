@@ -0,0 +1,524 @@
+#include <Service/WatchManager.h>
+#include <algorithm>
+#include <Service/ChildrenSet.h>
+#include <Service/PathUtils.h>
+
+namespace RK
+{
+
+bool SessionSet::insert(int64_t session_id)
+{
+    if (hash_set)
+        return hash_set->insert(session_id).second;
+
+    if (std::find(vector.begin(), vector.end(), session_id) != vector.end())
+        return false;
+
+    if (vector.size() >= MAX_VECTOR_SIZE)
+    {
+        hash_set = std::make_unique<std::unordered_set<int64_t>>(vector.begin(), vector.end());
+        std::vector<int64_t>().swap(vector);
+        return hash_set->insert(session_id).second;
+    }
+
+    vector.push_back(session_id);
+    return true;
+}
+
+bool SessionSet::erase(int64_t session_id)
+{
+    if (hash_set)
+    {
+        if (!hash_set->erase(session_id))
+            return false;
+        if (hash_set->size() <= MAX_VECTOR_SIZE / 2)
+        {
+            vector.assign(hash_set->begin(), hash_set->end());
+            hash_set.reset();
+        }
+        return true;
+    }
+
+    auto it = std::find(vector.begin(), vector.end(), session_id);
+    if (it == vector.end())
+        return false;
+    /// Order does not matter
+    *it = vector.back();
+    vector.pop_back();
+    return true;
+}
+
+bool SessionSet::contains(int64_t session_id) const
+{
+    if (hash_set)
+        return hash_set->contains(session_id);
+    return std::find(vector.begin(), vector.end(), session_id) != vector.end();
+}
+
+size_t WatchManager::pathEntryBytes(const String & path)
+{
+    return NODE_OVERHEAD + sizeof(String) + getStringHeapBytes(path) + sizeof(SessionSet);
+}
+
+WatchManager::Watches::iterator WatchManager::emplacePath(Watches & watches, const HashedPath & path)
+{
+    auto it = findPath(watches, path);
+    if (it == watches.end())
+    {
+        markWatched(path.hash);
+        it = watches.try_emplace(String(path.path)).first;
+        watch_bytes.fetch_add(pathEntryBytes(it->first), std::memory_order_relaxed);
+    }
+    return it;
+}
+
+void WatchManager::erasePath(Watches & watches, Watches::iterator it, size_t hash)
+{
+    watch_bytes.fetch_sub(pathEntryBytes(it->first), std::memory_order_relaxed);
+    watches.erase(it);
+    unmarkWatched(hash);
+}
+
+bool WatchManager::insertWatch(Watches & watches, const HashedPath & path, int64_t session_id, WatchType type)
+{
+    auto it = emplacePath(watches, path);
+    if (!it->second.insert(session_id))
+        return false;
+
+    auto & session_shard = sessionShard(session_id);
+    std::lock_guard session_lock(session_shard.mutex);
+    auto [session_it, inserted] = session_shard.sessions.try_emplace(session_id);
+    session_it->second.insert(makeRef(it->first, type));
+    watch_count.fetch_add(1, std::memory_order_relaxed);
+    watch_bytes.fetch_add(WATCH_BYTES + (inserted ? SESSION_ENTRY_BYTES : 0), std::memory_order_relaxed);
+    return true;
+}
+
+bool WatchManager::eraseWatch(Watches & watches, const HashedPath & path, int64_t session_id, WatchType type)
+{
+    auto it = findPath(watches, path);
+    if (it == watches.end() || !it->second.erase(session_id))
+        return false;
+
+    unlinkSession(session_id, makeRef(it->first, type));
+    watch_count.fetch_sub(1, std::memory_order_relaxed);
+    watch_bytes.fetch_sub(WATCH_BYTES, std::memory_order_relaxed);
+    if (it->second.empty())
+        erasePath(watches, it, path.hash);
+    return true;
+}
+
+void WatchManager::addWatch(const HashedPath & path, int64_t session_id, WatchType type, const std::function<void()> & on_added)
+{
+    auto & shard = pathShard(path);
+    std::lock_guard lock(shard.mutex);
+
+    if (type == PERSISTENT_RECURSIVE)
+    {
+        std::lock_guard recursive_lock(recursive.mutex);
+        if (insertWatch(recursive.watches, path, session_id, type))
+            recursive.count.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        insertWatch(shard.watches[type], path, session_id, type);
+    }
+
+    if (on_added)
+        on_added();
+}
+
+void WatchManager::addWatches(const std::vector<HashedPath> & paths, int64_t session_id, WatchType type)
+{
+    /// Recursive watches are in one table of their own, rare enough to add one by one
+    if (type == PERSISTENT_RECURSIVE)
+    {
+        for (const auto & path : paths)
+            addWatch(path, session_id, type);
+        return;
+    }
+
+    std::vector<std::vector<const HashedPath *>> paths_of_shards(PATH_SHARDS);
+    for (const auto & path : paths)
+        paths_of_shards[path.hash % PATH_SHARDS].push_back(&path);
+
+    auto & session_shard = sessionShard(session_id);
+    std::vector<WatchRef> refs;
+    for (size_t i = 0; i < PATH_SHARDS; ++i)
+    {
+        if (paths_of_shards[i].empty())
+            continue;
+
+        auto & shard = path_shards[i];
+        std::lock_guard lock(shard.mutex);
+        refs.clear();
+        for (const auto * path : paths_of_shards[i])
+        {
+            auto it = emplacePath(shard.watches[type], *path);
+            if (it->second.insert(session_id))
+                refs.push_back(makeRef(it->first, type));
+        }
+        if (refs.empty())
+            continue;
+
+        /// Under the lock of the path shard as in insertWatch, so that the refs are never of removed paths
+        std::lock_guard session_lock(session_shard.mutex);
+        auto [session_it, inserted] = session_shard.sessions.try_emplace(session_id);
+        session_it->second.insert(refs.begin(), refs.end());
+        watch_count.fetch_add(refs.size(), std::memory_order_relaxed);
+        watch_bytes.fetch_add(refs.size() * WATCH_BYTES + (inserted ? SESSION_ENTRY_BYTES : 0), std::memory_order_relaxed);
+    }
+}
+
+bool WatchManager::removeWatch(const HashedPath & path, int64_t session_id, WatchType type)
+{
+    auto & shard = pathShard(path);
+    std::lock_guard lock(shard.mutex);
+
+    if (type == PERSISTENT_RECURSIVE)
+    {
+        std::lock_guard recursive_lock(recursive.mutex);
+        if (!eraseWatch(recursive.watches, path, session_id, type))
+            return false;
+        recursive.count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    return eraseWatch(shard.watches[type], path, session_id, type);
+}
+
+void WatchManager::unlinkSession(int64_t session_id, WatchRef ref)
+{
+    auto & session_shard = sessionShard(session_id);
+    std::lock_guard session_lock(session_shard.mutex);
+    auto it = session_shard.sessions.find(session_id);
+    if (it == session_shard.sessions.end())
+        return;
+    it->second.erase(ref);
+    if (it->second.empty())
+    {
+        session_shard.sessions.erase(it);
+        watch_bytes.fetch_sub(SESSION_ENTRY_BYTES, std::memory_order_relaxed);
+    }
+}
+
+bool WatchManager::hasWatch(const HashedPath & path, int64_t session_id, WatchType type) const
+{
+    const auto & shard = pathShard(path);
+    std::lock_guard lock(shard.mutex);
+
+    if (type == PERSISTENT_RECURSIVE)
+    {
+        std::shared_lock recursive_lock(recursive.mutex);
+        auto it = findPath(recursive.watches, path);
+        return it != recursive.watches.end() && it->second.contains(session_id);
+    }
+    auto it = findPath(shard.watches[type], path);
+    return it != shard.watches[type].end() && it->second.contains(session_id);
+}
+
+void WatchManager::fireWatches(
+    const HashedPath & path, WatchType type, const std::function<void(const SessionIDs &)> & on_fired, bool include_persistent)
+{
+    /// Most writes are of paths nobody watches, they skip the lock
+    bool check_recursive = include_persistent && type == DATA && recursive.count.load(std::memory_order_relaxed) > 0;
+    if (!check_recursive && !mayBeWatched(path.hash))
+        return;
+
+    auto & shard = pathShard(path);
+    std::lock_guard lock(shard.mutex);
+
+    SessionIDs sessions;
+    auto collect = [&sessions](int64_t session_id) { sessions.push_back(session_id); };
+    size_t sources = 0;
+
+    /// The extracted node keeps the interned path alive until the reverse index forgets it
+    auto & watches = shard.watches[type];
+    auto fired = findPath(watches, path);
+    auto node = fired == watches.end() ? Watches::node_type{} : watches.extract(fired);
+    if (!node.empty())
+    {
+        sessions.reserve(node.mapped().size());
+        node.mapped().forEach(collect);
+
+        auto ref = makeRef(node.key(), type);
+        for (auto session_id : sessions)
+            unlinkSession(session_id, ref);
+        watch_count.fetch_sub(sessions.size(), std::memory_order_relaxed);
+        watch_bytes.fetch_sub(sessions.size() * WATCH_BYTES + pathEntryBytes(node.key()), std::memory_order_relaxed);
+        unmarkWatched(path.hash);
+        ++sources;
+    }
+
+    if (include_persistent)
+    {
+        const auto & persistent = shard.watches[PERSISTENT];
+        if (auto it = findPath(persistent, path); it != persistent.end())
+        {
+            it->second.forEach(collect);
+            ++sources;
+        }
+
+        if (check_recursive)
+        {
+            std::shared_lock recursive_lock(recursive.mutex);
+            for (std::string_view ancestor = path.path;; ancestor = parentPathView(ancestor))
+            {
+                if (auto it = findPath(recursive.watches, ancestor); it != recursive.watches.end())
+                {
+                    it->second.forEach(collect);
+                    ++sources;
+                }
+                if (ancestor == "/")
+                    break;
+            }
+        }
+    }
+
+    if (sessions.empty())
+        return;
+
+    /// A session watching path in several ways gets one event
+    if (sources > 1)
+    {
+        std::sort(sessions.begin(), sessions.end());
+        sessions.erase(std::unique(sessions.begin(), sessions.end()), sessions.end());
+    }
+
+    on_fired(sessions);
+}
+
+void WatchManager::removeSession(int64_t session_id)
+{
+    /// Copy the paths, the path shards can not be locked under the session shard
+    std::vector<std::pair<String, WatchType>> paths;
+    {
+        auto & session_shard = sessionShard(session_id);
+        std::lock_guard session_lock(session_shard.mutex);
+        auto it = session_shard.sessions.find(session_id);
+        if (it == session_shard.sessions.end())
+            return;
+        paths.reserve(it->second.size());
+        for (auto ref : it->second)
+            paths.emplace_back(refPath(ref), refType(ref));
+    }
+
+    for (const auto & [path, type] : paths)
+        removeWatch(path, session_id, type);
+}
+
+void WatchManager::clear()
+{
+    auto clear_watches = [this](Watches & watches, WatchType type)
+    {
+        for (auto & [path, sessions] : watches)
+        {
+            auto ref = makeRef(path, type);
+            sessions.forEach([&](int64_t session_id) { unlinkSession(session_id, ref); });
+            watch_count.fetch_sub(sessions.size(), std::memory_order_relaxed);
+            watch_bytes.fetch_sub(sessions.size() * WATCH_BYTES + pathEntryBytes(path), std::memory_order_relaxed);
+            unmarkWatched(HashedPath::hashOf(path));
+        }
+        watches.clear();
+    };
+
+    for (auto & shard : path_shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (auto type : {DATA, LIST, PERSISTENT})
+            clear_watches(shard.watches[type], type);
+    }
+
+    std::lock_guard recursive_lock(recursive.mutex);
+    clear_watches(recursive.watches, PERSISTENT_RECURSIVE);
+    recursive.count = 0;
+}
+
+size_t WatchManager::watchedPathCount() const
+{
+    size_t count = 0;
+    for (const auto & shard : path_shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (const auto & watches : shard.watches)
+            count += watches.size();
+    }
+
+    std::shared_lock recursive_lock(recursive.mutex);
+    return count + recursive.watches.size();
+}
+
+size_t WatchManager::sessionCount() const
+{
+    size_t count = 0;
+    for (const auto & session_shard : session_shards)
+    {
+        std::lock_guard session_lock(session_shard.mutex);
+        count += session_shard.sessions.size();
+    }
+    return count;
+}
+
+size_t WatchManager::sessionWatchCount(int64_t session_id) const
+{
+    const auto & session_shard = session_shards[static_cast<uint64_t>(session_id) % SESSION_SHARDS];
+    std::lock_guard session_lock(session_shard.mutex);
+    auto it = session_shard.sessions.find(session_id);
+    return it == session_shard.sessions.end() ? 0 : it->second.size();
+}
+
+std::vector<WatchManager::SessionUsage> WatchManager::getSessionsUsage() const
+{
+    std::vector<SessionUsage> result;
+    for (const auto & session_shard : session_shards)
+    {
+        std::lock_guard session_lock(session_shard.mutex);
+        for (const auto & [session_id, refs] : session_shard.sessions)
+        {
+            size_t bytes = 0;
+            for (auto ref : refs)
+                bytes += refPath(ref).size();
+            result.push_back(SessionUsage{session_id, refs.size(), bytes});
+        }
+    }
+    return result;
+}
+
+void WatchManager::forEachSession(const std::function<void(int64_t, const std::vector<String> &)> & f) const
+{
+    std::vector<std::pair<int64_t, std::vector<String>>> shard_sessions;
+    for (const auto & session_shard : session_shards)
+    {
+        shard_sessions.clear();
+        {
+            std::lock_guard session_lock(session_shard.mutex);
+            shard_sessions.reserve(session_shard.sessions.size());
+            for (const auto & [session_id, refs] : session_shard.sessions)
+            {
+                auto & paths = shard_sessions.emplace_back(session_id, std::vector<String>{}).second;
+                paths.reserve(refs.size());
+                for (auto ref : refs)
+                    paths.push_back(refPath(ref));
+            }
+        }
+        for (const auto & [session_id, paths] : shard_sessions)
+            f(session_id, paths);
+    }
+}
+
+std::vector<std::pair<String, WatchManager::WatchType>> WatchManager::getSessionWatches(int64_t session_id) const
+{
+    const auto & session_shard = session_shards[static_cast<uint64_t>(session_id) % SESSION_SHARDS];
+    std::vector<std::pair<String, WatchType>> result;
+    std::lock_guard session_lock(session_shard.mutex);
+    auto it = session_shard.sessions.find(session_id);
+    if (it == session_shard.sessions.end())
+        return result;
+    result.reserve(it->second.size());
+    for (auto ref : it->second)
+        result.emplace_back(refPath(ref), refType(ref));
+    return result;
+}
+
+void WatchManager::forEachPath(WatchType type, const std::function<void(const String &, const SessionIDs &)> & f) const
+{
+    std::vector<std::pair<String, SessionIDs>> shard_paths;
+    auto copy = [&shard_paths](const Watches & watches)
+    {
+        shard_paths.reserve(watches.size());
+        for (const auto & [path, session_set] : watches)
+        {
+            auto & sessions = shard_paths.emplace_back(path, SessionIDs{}).second;
+            session_set.forEach([&sessions](int64_t session_id) { sessions.push_back(session_id); });
+        }
+    };
+    auto call = [&]
+    {
+        for (const auto & [path, sessions] : shard_paths)
+            f(path, sessions);
+        shard_paths.clear();
+    };
+
+    if (type == PERSISTENT_RECURSIVE)
+    {
+        {
+            std::shared_lock recursive_lock(recursive.mutex);
+            copy(recursive.watches);
+        }
+        call();
+        return;
+    }
+
+    for (const auto & shard : path_shards)
+    {
+        {
+            std::lock_guard lock(shard.mutex);
+            copy(shard.watches[type]);
+        }
+        call();
+    }
+}
+
+namespace
+{
+/// Tables with fewer elements than 1 / SHRINK_LOAD_FACTOR of their buckets are rehashed
+constexpr size_t SHRINK_LOAD_FACTOR = 8;
+constexpr size_t SHRINK_MIN_BUCKETS = 64;
+
+template <typename Table>
+bool shrinkTable(Table & table)
+{
+    if (table.bucket_count() <= SHRINK_MIN_BUCKETS || table.size() * SHRINK_LOAD_FACTOR >= table.bucket_count())
+        return false;
+    /// Nodes are not moved, the interned paths referred to by WatchRef stay valid
+    table.rehash(0);
+    return true;
+}
+}
+
+size_t WatchManager::shrink()
+{
+    size_t shrunk = 0;
+    for (auto & shard : path_shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (auto & watches : shard.watches)
+            shrunk += shrinkTable(watches);
+    }
+
+    {
+        std::unique_lock recursive_lock(recursive.mutex);
+        shrunk += shrinkTable(recursive.watches);
+    }
+
+    for (auto & session_shard : session_shards)
+    {
+        std::lock_guard session_lock(session_shard.mutex);
+        shrunk += shrinkTable(session_shard.sessions);
+    }
+    return shrunk;
+}
+
+size_t WatchManager::sizeInBytes() const
+{
+    size_t bytes = watch_bytes.load(std::memory_order_relaxed);
+    for (const auto & shard : path_shards)
+    {
+        std::lock_guard lock(shard.mutex);
+        for (const auto & watches : shard.watches)
+            bytes += watches.bucket_count() * sizeof(void *);
+    }
+
+    {
+        std::shared_lock recursive_lock(recursive.mutex);
+        bytes += recursive.watches.bucket_count() * sizeof(void *);
+    }
+
+    for (const auto & session_shard : session_shards)
+    {
+        std::lock_guard session_lock(session_shard.mutex);
+        bytes += session_shard.sessions.bucket_count() * sizeof(void *);
+    }
+    return bytes;
+}
+
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Service/HashedPath.h>
+#include <Common/ProfilingMutex.h>
+#include <common/types.h>
+
+namespace RK
+{
+
+/** Deduplicated set of session ids.
+ *
+ * Most paths are watched by few sessions, they are kept in a small vector, which is converted
+ * to a hash set when it grows beyond MAX_VECTOR_SIZE so that hot paths stay O(1).
+ */
+class SessionSet
+{
+public:
+    static constexpr size_t MAX_VECTOR_SIZE = 16;
+
+    bool insert(int64_t session_id);
+    bool erase(int64_t session_id);
+    bool contains(int64_t session_id) const;
+
+    size_t size() const { return hash_set ? hash_set->size() : vector.size(); }
+    bool empty() const { return size() == 0; }
+
+    template <typename F>
+    void forEach(F && f) const
+    {
+        if (hash_set)
+        {
+            for (auto session_id : *hash_set)
+                f(session_id);
+        }
+        else
+        {
+            for (auto session_id : vector)
+                f(session_id);
+        }
+    }
+
+private:
+    std::vector<int64_t> vector;
+    std::unique_ptr<std::unordered_set<int64_t>> hash_set;
+};
+
+/** Watches of KeeperStore, path -> sessions for data and list watches and the reverse index session -> paths.
+ *
+ * Paths are sharded by hash and sessions by id, every shard has its own mutex, so register, fire
+ * and session cleanup touch only the involved shards and are O(1) per watch. A watched path is
+ * stored once as the key of the path table, the reverse index only keeps a pointer to that key.
+ *
+ * Persistent recursive watches are kept in their own table, an event on a path looks up the path and
+ * its ancestors in it, which is O(depth) and skipped at all when there is no such watch.
+ *
+ * Lock order is path shard, then recursive table, then session shard. No code path holds two path
+ * shards at the same time.
+ *
+ * Watched paths are also counted in a lock free table of slots by path hash, so that firing on a path nobody
+ * watches, which most writes are, takes no lock at all. A slot counts the watched paths hashed into it, a
+ * collision only costs the lookup of a path which is not there.
+ */
+class WatchManager
+{
+public:
+    enum WatchType : uint8_t
+    {
+        /// Watches for 'get' and 'exists' requests
+        DATA = 0,
+        /// Watches for 'list' request (watches on children)
+        LIST = 1,
+        /// Watches of 'addWatch' which are not removed when fired. PERSISTENT is fired by data and child
+        /// events of the path, PERSISTENT_RECURSIVE by data events of the path and all its descendants.
+        PERSISTENT = 2,
+        PERSISTENT_RECURSIVE = 3,
+    };
+
+    using SessionIDs = std::vector<int64_t>;
+
+    static constexpr size_t PATH_SHARDS = 64;
+    static constexpr size_t SESSION_SHARDS = 16;
+
+    /// Register a watch. on_added is called under the lock of path, so it is ordered with watches fired on the path.
+    void addWatch(const HashedPath & path, int64_t session_id, WatchType type, const std::function<void()> & on_added = {});
+
+    /** Register watches of session on many paths, e.g. of SetWatches after a reconnect. Every path shard and the
+     * session shard are locked once for all the paths in the shard instead of once for every path.
+     */
+    void addWatches(const std::vector<HashedPath> & paths, int64_t session_id, WatchType type);
+
+    /// Unregister a watch, return false if it does not exist.
+    bool removeWatch(const HashedPath & path, int64_t session_id, WatchType type);
+    bool hasWatch(const HashedPath & path, int64_t session_id, WatchType type) const;
+
+    /** Unregister all the DATA or LIST watches on path, on_fired is called with the watching sessions under
+     * the lock of path if there are any. If include_persistent, persistent watches triggered by the same
+     * event are fired too without being unregistered: PERSISTENT on path, and for DATA also
+     * PERSISTENT_RECURSIVE on path and its ancestors. A session is in sessions once.
+     */
+    void fireWatches(
+        const HashedPath & path, WatchType type, const std::function<void(const SessionIDs &)> & on_fired, bool include_persistent = true);
+
+    /// Unregister all the watches of session.
+    void removeSession(int64_t session_id);
+
+    void clear();
+
+    /// Watched (path, type) pairs
+    size_t watchedPathCount() const;
+    /// Registered watches
+    size_t watchCount() const { return watch_count.load(std::memory_order_relaxed); }
+    size_t sessionCount() const;
+    /// Registered watches of session
+    size_t sessionWatchCount(int64_t session_id) const;
+
+    /// Watches of a session and the bytes of their paths
+    struct SessionUsage
+    {
+        int64_t session_id;
+        size_t count;
+        size_t bytes;
+    };
+    /// Of every session with watches
+    std::vector<SessionUsage> getSessionsUsage() const;
+
+    /// Call f(session_id, paths) for every session with watches. A shard is copied under its lock and f
+    /// is called without any lock held, so f may be slow, e.g. write to a client.
+    void forEachSession(const std::function<void(int64_t, const std::vector<String> &)> & f) const;
+    /// Watched paths of session with their types
+    std::vector<std::pair<String, WatchType>> getSessionWatches(int64_t session_id) const;
+    /// Call f(path, sessions) for every watched path of type, like forEachSession.
+    void forEachPath(WatchType type, const std::function<void(const String &, const SessionIDs &)> & f) const;
+
+    /// Memory of the watches, kept by a running counter, only the buckets of the tables are summed up here
+    size_t sizeInBytes() const;
+
+    /// Rehash the tables of every shard left sparse by removed watches into fewer buckets, a shard at a time.
+    /// Return the number of tables shrunk.
+    size_t shrink();
+
+private:
+    /// Pointer to the interned path tagged with watch type in the lowest two bits
+    using WatchRef = uintptr_t;
+    static constexpr uintptr_t TYPE_MASK = 3;
+    static_assert(alignof(String) > TYPE_MASK);
+
+    static WatchRef makeRef(const String & path, WatchType type) { return reinterpret_cast<uintptr_t>(&path) | type; }
+    static const String & refPath(WatchRef ref) { return *reinterpret_cast<const String *>(ref & ~TYPE_MASK); }
+    static WatchType refType(WatchRef ref) { return static_cast<WatchType>(ref & TYPE_MASK); }
+
+    using Watches = std::unordered_map<String, SessionSet, HashedPathHash, HashedPathEqual>;
+
+    struct PathShard
+    {
+        mutable ProfilingMutex<std::mutex, LockProfiler::WatchPathShard> mutex;
+        /// DATA, LIST and PERSISTENT
+        Watches watches[3];
+    };
+
+    struct RecursiveWatches
+    {
+        mutable ProfilingMutex<std::shared_mutex, LockProfiler::WatchRecursive> mutex;
+        Watches watches;
+        /// Number of registered watches, events skip the table if it is 0
+        std::atomic<size_t> count{0};
+    };
+
+    struct SessionShard
+    {
+        mutable ProfilingMutex<std::mutex, LockProfiler::WatchSessionShard> mutex;
+        std::unordered_map<int64_t, std::unordered_set<WatchRef>> sessions;
+    };
+
+    PathShard & pathShard(const HashedPath & path) { return path_shards[path.hash % PATH_SHARDS]; }
+    const PathShard & pathShard(const HashedPath & path) const { return path_shards[path.hash % PATH_SHARDS]; }
+
+    static constexpr size_t WATCHED_SLOTS = 1 << 16;
+    /// Bits above the ones of the path shard
+    static size_t watchedSlot(size_t hash) { return (hash >> 32) & (WATCHED_SLOTS - 1); }
+
+    /** A path is marked before it is added to a table and unmarked after it is removed, so a fire which sees no mark
+     * is ordered before the watch is added, as if it took the lock of the path shard first. The increment and the
+     * fence before the check are sequentially consistent for that.
+     */
+    void markWatched(size_t hash) { watched_slots[watchedSlot(hash)].fetch_add(1, std::memory_order_seq_cst); }
+    void unmarkWatched(size_t hash) { watched_slots[watchedSlot(hash)].fetch_sub(1, std::memory_order_relaxed); }
+    bool mayBeWatched(size_t hash) const
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return watched_slots[watchedSlot(hash)].load(std::memory_order_relaxed) != 0;
+    }
+    SessionShard & sessionShard(int64_t session_id) { return session_shards[static_cast<uint64_t>(session_id) % SESSION_SHARDS]; }
+
+    /// Remove ref from the reverse index of session, path shard of ref is locked.
+    void unlinkSession(int64_t session_id, WatchRef ref);
+
+    /// hash table node overhead: next pointer and cached hash
+    static constexpr size_t NODE_OVERHEAD = 2 * sizeof(void *);
+    /// A session in the set of a path and the ref in the reverse index
+    static constexpr size_t WATCH_BYTES = sizeof(int64_t) + NODE_OVERHEAD + sizeof(WatchRef);
+    static constexpr size_t SESSION_ENTRY_BYTES = NODE_OVERHEAD + sizeof(int64_t) + sizeof(std::unordered_set<WatchRef>);
+    static size_t pathEntryBytes(const String & path);
+
+    /// Insert path into watches whose lock is held if it is not there
+    Watches::iterator emplacePath(Watches & watches, const HashedPath & path);
+    /// Erase an entry of watches whose lock is held
+    void erasePath(Watches & watches, Watches::iterator it, size_t hash);
+
+    /// Add or remove a watch in watches whose lock is held, return false if nothing changed.
+    bool insertWatch(Watches & watches, const HashedPath & path, int64_t session_id, WatchType type);
+    bool eraseWatch(Watches & watches, const HashedPath & path, int64_t session_id, WatchType type);
+
+    PathShard path_shards[PATH_SHARDS];
+    RecursiveWatches recursive;
+    SessionShard session_shards[SESSION_SHARDS];
+    std::atomic<size_t> watch_count{0};
+    /// See sizeInBytes
+    std::atomic<size_t> watch_bytes{0};
+    /// Watched paths of the tables by watchedSlot
+    std::unique_ptr<std::atomic<uint32_t>[]> watched_slots{new std::atomic<uint32_t>[WATCHED_SLOTS]()};
+};
+
+}
@@ -49,6 +49,16 @@ void WriteBufferFromFiFoBuffer::finalize()
 
     is_finished = true;
     size_t real_size = pos - reinterpret_cast<Position>(buffer->begin());
+
+    /// Exactly sized, no need to copy
+    if (real_size == buffer->size())
+    {
+        if (real_size > 0)
+            buffer->advance(real_size);
+        set(nullptr, 0);
+        return;
+    }
+
     auto new_buffer = std::make_shared<FIFOBuffer>(real_size);
     memcpy(new_buffer->begin(), buffer->begin(), real_size);
     if (real_size > 0)
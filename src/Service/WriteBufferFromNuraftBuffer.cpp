@@ -28,9 +28,9 @@ void WriteBufferFromNuraftBuffer::nextImpl()
     working_buffer = internal_buffer;
 }
 
-WriteBufferFromNuraftBuffer::WriteBufferFromNuraftBuffer() : WriteBuffer(nullptr, 0)
+WriteBufferFromNuraftBuffer::WriteBufferFromNuraftBuffer(size_t size) : WriteBuffer(nullptr, 0)
 {
-    buffer = nuraft::buffer::alloc(initial_size);
+    buffer = nuraft::buffer::alloc(std::max(size, static_cast<size_t>(1)));
     set(reinterpret_cast<Position>(buffer->data_begin()), buffer->size());
 }
 
@@ -41,6 +41,12 @@ void WriteBufferFromNuraftBuffer::finalize()
 
     is_finished = true;
     size_t real_size = pos - reinterpret_cast<Position>(buffer->data_begin());
+    if (real_size == buffer->size())
+    {
+        set(nullptr, 0);
+        return;
+    }
+
     nuraft::ptr<nuraft::buffer> new_buffer = nuraft::buffer::alloc(real_size);
     memcpy(new_buffer->data_begin(), buffer->data_begin(), real_size);
     buffer = new_buffer;
@@ -18,7 +18,8 @@ private:
     void nextImpl() override;
 
 public:
-    WriteBufferFromNuraftBuffer();
+    /// Starts small and grows, pass the size if it is known so that the buffer is allocated once and not copied.
+    explicit WriteBufferFromNuraftBuffer(size_t size = initial_size);
 
     void finalize() override final;
     nuraft::ptr<nuraft::buffer> getBuffer();
@@ -1,9 +1,16 @@
 #include <Service/ZooKeeperDataReader.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
 #include <cstdlib>
+#include <mutex>
+#include <sys/mman.h>
 #include <IO/ReadHelpers.h>
+#include <Common/ThreadPool.h>
 #include <Common/ZooKeeper/ZooKeeperIO.h>
-#include <IO/ReadBufferFromFile.h>
+#include <IO/MMapReadBufferFromFile.h>
+#include <IO/ReadBufferFromMemory.h>
 #include <string>
 
 
@@ -16,6 +23,31 @@ namespace ErrorCodes
     extern const int CORRUPTED_DATA;
 }
 
+namespace
+{
+
+/// Snapshots and logs are read once from the beginning to the end
+class SequentialFileReader : public MMapReadBufferFromFile
+{
+public:
+    explicit SequentialFileReader(const std::string & file_name_) : MMapReadBufferFromFile(file_name_, 0)
+    {
+        if (buffer().size())
+            ::madvise(buffer().begin(), buffer().size(), MADV_SEQUENTIAL);
+    }
+};
+
+/// Transaction of a ZooKeeper log to apply
+struct ZooKeeperTxn
+{
+    int64_t session_id;
+    int64_t zxid;
+    int64_t time;
+    Coordination::ZooKeeperRequestPtr request;
+};
+
+}
+
 int64_t getZxidFromName(const std::string & filename)
 {
     std::filesystem::path path(filename);
@@ -94,8 +126,10 @@ int64_t deserializeStorageData(KeeperStore & store, ReadBuffer & in, Poco::Logge
     size_t count = 0;
     while (path != "/")
     {
-        std::shared_ptr<KeeperNode> node = std::make_shared<KeeperNode>();
-        Coordination::read(node->data, in);
+        std::shared_ptr<KeeperNode> node = KeeperNode::create();
+        String data;
+        Coordination::read(data, in);
+        node->data = std::move(data);
         size_t acl_id;
         Coordination::read(acl_id, in);
 //        Coordination::read(node.acl_id, in);
@@ -120,10 +154,10 @@ int64_t deserializeStorageData(KeeperStore & store, ReadBuffer & in, Poco::Logge
             node->stat.dataLength = node->data.length();
             store.container.emplace(path, node);
 
-            if (node->stat.ephemeralOwner != 0)
+            if (EphemeralType::isSession(node->stat.ephemeralOwner))
             {
                 node->is_ephemeral = true;
-                store.ephemerals[node->stat.ephemeralOwner].insert(path);
+                store.ephemerals.add(node->stat.ephemeralOwner, path);
             }
         }
         Coordination::read(path, in);
@@ -143,7 +177,7 @@ void deserializeKeeperStoreFromSnapshot(KeeperStore & store, const std::string &
     LOG_INFO(log, "Deserializing snapshot {}", snapshot_path);
     int64_t zxid = getZxidFromName(snapshot_path);
 
-    ReadBufferFromFile reader(snapshot_path);
+    SequentialFileReader reader(snapshot_path);
 
     deserializeSnapshotMagic(reader);
 
@@ -295,6 +329,31 @@ Coordination::ZooKeeperRequestPtr deserializeCreateTxn(ReadBuffer & in)
     return result;
 }
 
+Coordination::ZooKeeperRequestPtr deserializeCreateContainerTxn(ReadBuffer & in)
+{
+    std::shared_ptr<Coordination::ZooKeeperCreateRequest> result = std::make_shared<Coordination::ZooKeeperCreateContainerRequest>();
+    Coordination::read(result->path, in);
+    Coordination::read(result->data, in);
+    Coordination::read(result->acls, in);
+    Coordination::read(result->parent_cversion, in);
+
+    result->restored_from_zookeeper_log = true;
+    return result;
+}
+
+Coordination::ZooKeeperRequestPtr deserializeCreateTTLTxn(ReadBuffer & in)
+{
+    std::shared_ptr<Coordination::ZooKeeperCreateRequest> result = std::make_shared<Coordination::ZooKeeperCreateTTLRequest>();
+    Coordination::read(result->path, in);
+    Coordination::read(result->data, in);
+    Coordination::read(result->acls, in);
+    Coordination::read(result->parent_cversion, in);
+    Coordination::read(result->ttl, in);
+
+    result->restored_from_zookeeper_log = true;
+    return result;
+}
+
 Coordination::ZooKeeperRequestPtr deserializeDeleteTxn(ReadBuffer & in)
 {
     std::shared_ptr<Coordination::ZooKeeperRemoveRequest> result = std::make_shared<Coordination::ZooKeeperRemoveRequest>();
@@ -410,6 +469,12 @@ Coordination::ZooKeeperRequestPtr deserializeTxnImpl(ReadBuffer & in, bool subtx
         case 14:
             result = deserializeMultiTxn(in, log);
             break;
+        case 19:
+            result = deserializeCreateContainerTxn(in);
+            break;
+        case 21:
+            result = deserializeCreateTTLTxn(in);
+            break;
         case -10:
             result = deserializeCreateSession(in);
             break;
@@ -472,7 +537,7 @@ bool hasErrorsInMultiRequest(Coordination::ZooKeeperRequestPtr request)
 
 }
 
-bool deserializeTxn(KeeperStore & store, ReadBuffer & in, Poco::Logger * log)
+bool deserializeTxn(ReadBuffer & in, std::vector<ZooKeeperTxn> & txns, Poco::Logger * log)
 {
     int64_t checksum;
     Coordination::read(checksum, in);
@@ -483,16 +548,14 @@ bool deserializeTxn(KeeperStore & store, ReadBuffer & in, Poco::Logger * log)
     int32_t txn_len;
     Coordination::read(txn_len, in);
     int64_t count_before = in.count();
-    int64_t session_id;
-    Coordination::read(session_id, in);
+    ZooKeeperTxn txn;
+    Coordination::read(txn.session_id, in);
     int32_t xid;
     Coordination::read(xid, in);
-    int64_t zxid;
-    Coordination::read(zxid, in);
-    int64_t time;
-    Coordination::read(time, in);
+    Coordination::read(txn.zxid, in);
+    Coordination::read(txn.time, in);
 
-    Coordination::ZooKeeperRequestPtr request = deserializeTxnImpl(in, false, txn_len, log);
+    txn.request = deserializeTxnImpl(in, false, txn_len, log);
 
     /// Skip all other bytes
     int64_t bytes_read = in.count() - count_before;
@@ -502,46 +565,50 @@ bool deserializeTxn(KeeperStore & store, ReadBuffer & in, Poco::Logger * log)
 //    LOG_INFO(log, "txn_len is {}, count_before {}, bytes_read {}", txn_len, count_before, bytes_read);
 
     /// We don't need to apply error requests
-    if (isErrorRequest(request))
+    if (isErrorRequest(txn.request))
         return true;
 
-    request->xid = xid;
+    /// Skip failed multirequests
+    if (txn.request->getOpNum() == Coordination::OpNum::Multi && hasErrorsInMultiRequest(txn.request))
+        return true;
 
-    if (zxid > store.zxid)
-    {
-        /// Separate processing of session id requests
-        if (request->getOpNum() == Coordination::OpNum::SessionID)
-        {
-            const Coordination::ZooKeeperSessionIDRequest & session_id_request = dynamic_cast<const Coordination::ZooKeeperSessionIDRequest &>(*request);
-            store.getSessionID(session_id_request.session_timeout_ms);
-        }
-        else
-        {
-            /// Skip failed multirequests
-            if (request->getOpNum() == Coordination::OpNum::Multi && hasErrorsInMultiRequest(request))
-                return true;
+    txn.request->xid = xid;
+    txns.push_back(std::move(txn));
+    return true;
+}
 
-            KeeperStore::KeeperResponsesQueue responses_queue;
-            store.processRequest(responses_queue, request, session_id, time, zxid, /* check_acl = */ false, /*ignore_response*/true);
-        }
-    }
+void applyTxn(KeeperStore & store, const ZooKeeperTxn & txn)
+{
+    if (txn.zxid <= store.zxid)
+        return;
 
-    return true;
+    /// Separate processing of session id requests
+    if (txn.request->getOpNum() == Coordination::OpNum::SessionID)
+    {
+        const Coordination::ZooKeeperSessionIDRequest & session_id_request = dynamic_cast<const Coordination::ZooKeeperSessionIDRequest &>(*txn.request);
+        store.getSessionID(session_id_request.session_timeout_ms);
+    }
+    else
+    {
+        KeeperStore::KeeperResponsesQueue responses_queue;
+        store.processRequest(responses_queue, txn.request, txn.session_id, txn.time, txn.zxid, /* check_acl = */ false, /*ignore_response*/true);
+    }
 }
 
-void deserializeLogAndApplyToStore(KeeperStore & store, const std::string & log_path, Poco::Logger * log)
+std::vector<ZooKeeperTxn> deserializeLog(const std::string & log_path, Poco::Logger * log)
 {
-    ReadBufferFromFile reader(log_path);
+    SequentialFileReader reader(log_path);
 
     LOG_INFO(log, "Deserializing log {}", log_path);
     deserializeLogMagic(reader);
     LOG_INFO(log, "Header looks OK");
 
+    std::vector<ZooKeeperTxn> txns;
     size_t counter = 0;
-    while (!reader.eof() && deserializeTxn(store, reader, log))
+    while (!reader.eof() && deserializeTxn(reader, txns, log))
     {
         counter++;
-        if (counter % 1000 == 0)
+        if (counter % 100000 == 0)
             LOG_INFO(log, "Deserialized txns log: {}", counter);
 
         int8_t forty_two;
@@ -551,9 +618,17 @@ void deserializeLogAndApplyToStore(KeeperStore & store, const std::string & log_
     }
 
     LOG_INFO(log, "Finished {} deserialization, totally read {} records", log_path, counter);
+    return txns;
+}
+
+void deserializeLogAndApplyToStore(KeeperStore & store, const std::string & log_path, Poco::Logger * log)
+{
+    for (const auto & txn : deserializeLog(log_path, log))
+        applyTxn(store, txn);
 }
 
-void deserializeLogsAndApplyToStore(KeeperStore & store, const std::string & path, Poco::Logger * log)
+/// Log files by the zxid in their name
+std::map<int64_t, std::string> listLogs(const std::string & path)
 {
     namespace fs = std::filesystem;
     std::map<int64_t, std::string> existing_logs;
@@ -565,6 +640,12 @@ void deserializeLogsAndApplyToStore(KeeperStore & store, const std::string & pat
         int64_t zxid = getZxidFromName(log_path);
         existing_logs[zxid] = p.path();
     }
+    return existing_logs;
+}
+
+void deserializeLogsAndApplyToStore(KeeperStore & store, const std::string & path, Poco::Logger * log, size_t thread_count)
+{
+    std::map<int64_t, std::string> existing_logs = listLogs(path);
 
     LOG_INFO(log, "Totally have {} logs", existing_logs.size());
 
@@ -582,12 +663,205 @@ void deserializeLogsAndApplyToStore(KeeperStore & store, const std::string & pat
             break;
         }
     }
+    std::reverse(stored_files.begin(), stored_files.end());
+    if (stored_files.empty())
+        return;
+
+    /// Logs are decoded by thread_count threads ahead of applying them in order, at most thread_count decoded logs wait
+    thread_count = std::clamp<size_t>(thread_count, 1, stored_files.size());
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::map<size_t, std::vector<ZooKeeperTxn>> decoded;
+    size_t applying = 0;
+    std::exception_ptr exception;
+    bool stopped = false;
+    std::atomic<size_t> next_file{0};
+
+    ThreadPool decode_pool(thread_count);
+    for (size_t thread_idx = 0; thread_idx < thread_count; ++thread_idx)
+    {
+        decode_pool.trySchedule([&]
+        {
+            try
+            {
+                for (size_t file_idx = next_file++; file_idx < stored_files.size(); file_idx = next_file++)
+                {
+                    {
+                        std::unique_lock lock(mutex);
+                        cond.wait(lock, [&] { return file_idx < applying + thread_count || exception || stopped; });
+                        if (exception || stopped)
+                            return;
+                    }
+                    auto txns = deserializeLog(stored_files[file_idx], log);
+                    {
+                        std::lock_guard lock(mutex);
+                        decoded.emplace(file_idx, std::move(txns));
+                    }
+                    cond.notify_all();
+                }
+            }
+            catch (...)
+            {
+                {
+                    std::lock_guard lock(mutex);
+                    if (!exception)
+                        exception = std::current_exception();
+                }
+                cond.notify_all();
+            }
+        });
+    }
+
+    auto stop = [&]
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopped = true;
+        }
+        cond.notify_all();
+        decode_pool.wait();
+    };
 
-    for (auto it = stored_files.rbegin(); it != stored_files.rend(); ++it)
+    try
     {
-        deserializeLogAndApplyToStore(store, *it, log);
+        for (size_t file_idx = 0; file_idx < stored_files.size(); ++file_idx)
+        {
+            std::vector<ZooKeeperTxn> txns;
+            {
+                std::unique_lock lock(mutex);
+                cond.wait(lock, [&] { return decoded.count(file_idx) || exception; });
+                if (exception)
+                    std::rethrow_exception(exception);
+                txns = std::move(decoded[file_idx]);
+                decoded.erase(file_idx);
+                applying = file_idx + 1;
+            }
+            cond.notify_all();
+
+            for (const auto & txn : txns)
+                applyTxn(store, txn);
+            LOG_INFO(log, "Applied {} records of {}", txns.size(), stored_files[file_idx]);
+        }
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+    stop();
+}
+
+uint32_t adler32(const char * data, size_t size)
+{
+    static constexpr uint32_t MOD_ADLER = 65521;
+    uint32_t a = 1;
+    uint32_t b = 0;
+    while (size)
+    {
+        /// The sums do not overflow in 5552 bytes
+        size_t block = std::min<size_t>(size, 5552);
+        size -= block;
+        for (; block; --block)
+        {
+            a += static_cast<unsigned char>(*data++);
+            b += a;
+        }
+        a %= MOD_ADLER;
+        b %= MOD_ADLER;
+    }
+    return (b << 16) | a;
+}
+
+ZooKeeperLogFollower::ZooKeeperLogFollower(KeeperStore & store_, const std::string & path_, Poco::Logger * log_)
+    : store(store_), path(path_), log(log_)
+{
+}
+
+size_t ZooKeeperLogFollower::poll()
+{
+    auto logs = listLogs(path);
+    if (logs.empty())
+        return 0;
+
+    if (current_log.empty())
+    {
+        /// The last log starting at or before the zxid of store, or else the first one
+        auto it = logs.upper_bound(store.zxid);
+        if (it != logs.begin())
+            --it;
+        current_log_zxid = it->first;
+        current_log = it->second;
+        offset = 0;
+    }
+
+    size_t applied = 0;
+    while (true)
+    {
+        applied += applyCurrentLog();
+
+        /// ZooKeeper only writes the newest log, so an older one is finished
+        auto next = logs.upper_bound(current_log_zxid);
+        if (next == logs.end())
+            break;
+        LOG_INFO(log, "Finished following log {}, switch to {}", current_log, next->second);
+        current_log_zxid = next->first;
+        current_log = next->second;
+        offset = 0;
+    }
+    return applied;
+}
+
+size_t ZooKeeperLogFollower::applyCurrentLog()
+{
+    /// Logs are preallocated with zeros and grow, they are mapped again every time
+    MMapReadBufferFromFile reader(current_log, 0);
+    size_t file_size = reader.buffer().size();
+    if (offset == 0)
+    {
+        static constexpr size_t LOG_HEADER_SIZE = 16;
+        if (file_size < LOG_HEADER_SIZE)
+            return 0;
+        deserializeLogMagic(reader);
+        offset = reader.count();
+    }
+    reader.seek(offset, SEEK_SET);
+
+    static constexpr size_t TXN_HEAD_SIZE = sizeof(int64_t) + sizeof(int32_t);
+    size_t applied = 0;
+    std::vector<ZooKeeperTxn> txns;
+    while (offset + TXN_HEAD_SIZE <= file_size)
+    {
+        const char * record = reader.buffer().begin() + offset;
+        int64_t checksum;
+        int32_t txn_len;
+        {
+            ReadBufferFromMemory head(record, TXN_HEAD_SIZE);
+            Coordination::read(checksum, head);
+            Coordination::read(txn_len, head);
+        }
+
+        /// A transaction being written is read by the next poll
+        size_t record_size = TXN_HEAD_SIZE + static_cast<size_t>(txn_len) + 1;
+        if (checksum == 0 || txn_len <= 0 || offset + record_size > file_size)
+            break;
+        if (adler32(record + TXN_HEAD_SIZE, txn_len) != static_cast<uint32_t>(checksum) || record[record_size - 1] != 0x42)
+            break;
+
+        txns.clear();
+        deserializeTxn(reader, txns, log);
+        int8_t forty_two;
+        Coordination::read(forty_two, reader);
+        for (const auto & txn : txns)
+        {
+            applyTxn(store, txn);
+            ++applied;
+        }
+        offset += record_size;
     }
 
+    if (applied)
+        LOG_INFO(log, "Applied {} records of {}, zxid {}", applied, current_log, store.zxid);
+    return applied;
 }
 
 }
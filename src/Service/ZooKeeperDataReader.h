@@ -10,6 +10,34 @@ void deserializeKeeperStoreFromSnapshot(KeeperStore & store, const std::string &
 void deserializeKeeperStoreFromSnapshotsDir(KeeperStore & store, const std::string & path, Poco::Logger * log);
 
 void deserializeLogAndApplyToStore(KeeperStore & store, const std::string & log_path, Poco::Logger * log);
-void deserializeLogsAndApplyToStore(KeeperStore & store, const std::string & path, Poco::Logger * log);
+/// Logs are decoded by thread_count threads and applied in order
+void deserializeLogsAndApplyToStore(KeeperStore & store, const std::string & path, Poco::Logger * log, size_t thread_count = 1);
+
+/** Follows the transaction logs of a running ZooKeeper server and applies the new transactions to store.
+  *
+  * It starts from the log holding the zxid of store, transactions up to it are skipped. A log is finished once
+  * a newer one exists. A transaction is applied only after it is completely written, that is its checksum
+  * matches and its end byte is written.
+  */
+class ZooKeeperLogFollower
+{
+public:
+    ZooKeeperLogFollower(KeeperStore & store_, const std::string & path_, Poco::Logger * log_);
+
+    /// Apply the transactions written since the last call, returns how many are applied
+    size_t poll();
+
+private:
+    size_t applyCurrentLog();
+
+    KeeperStore & store;
+    std::string path;
+    Poco::Logger * log;
+
+    int64_t current_log_zxid = 0;
+    std::string current_log;
+    /// Of the next transaction in current_log, 0 before the header is read
+    size_t offset = 0;
+};
 
 }
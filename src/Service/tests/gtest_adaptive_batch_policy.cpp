@@ -0,0 +1,37 @@
+#include <Service/AdaptiveBatchPolicy.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(AdaptiveBatchPolicy, adaptToCommitLatency)
+{
+    /// Fixed size without a target
+    AdaptiveBatchPolicy fixed(1000, 0, 0);
+    ASSERT_EQ(fixed.batchSize(), 1000);
+    ASSERT_EQ(fixed.lingerMicroseconds(), 0);
+
+    AdaptiveBatchPolicy policy(1000, 4096, 10000);
+    ASSERT_EQ(policy.batchSize(), AdaptiveBatchPolicy::MIN_BATCH_SIZE);
+    ASSERT_TRUE(policy.isFull(1, 4096));
+
+    /// Full batches committed fast grow the batch
+    for (int i = 0; i < 64; ++i)
+    {
+        policy.onFlush(policy.batchSize(), AdaptiveBatchPolicy::SIZE);
+        policy.onCommitted(1000);
+    }
+    size_t grown = policy.batchSize();
+    ASSERT_GT(grown, AdaptiveBatchPolicy::MIN_BATCH_SIZE);
+
+    /// Slow commits shrink it
+    for (int i = 0; i < 256; ++i)
+        policy.onCommitted(50000);
+    ASSERT_LT(policy.batchSize(), grown);
+    ASSERT_EQ(policy.getStats().p99_commit_latency_us, 50000);
+    ASSERT_EQ(policy.getStats().flushes[AdaptiveBatchPolicy::SIZE], 64);
+
+    /// No headroom under the target, never linger
+    for (UInt64 now = 1; now < 100; ++now)
+        policy.onArrival(1, now * 10);
+    ASSERT_EQ(policy.lingerMicroseconds(), 0);
+}
@@ -0,0 +1,39 @@
+#include <Service/ClientGroups.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(ClientGroups, matchAddressAuthAndPath)
+{
+    using namespace Coordination;
+    ClientGroups groups;
+    groups.configure(
+        {{"discovery", 4, {"10.1.0.0/16"}, {"digest:discovery"}, {"/discovery"}},
+         {"clickhouse", 1, {"10.0.0.0/8"}, {}, {"/clickhouse"}}},
+        1);
+    ASSERT_EQ(groups.size(), 3);
+    ASSERT_EQ(groups.weights(), (std::vector<UInt64>{1, 4, 1}));
+
+    ASSERT_EQ(groups.ofAddress(Poco::Net::IPAddress("10.1.2.3")), 1);
+    ASSERT_EQ(groups.ofAddress(Poco::Net::IPAddress("10.2.2.3")), 2);
+    ASSERT_EQ(groups.ofAddress(Poco::Net::IPAddress("192.168.0.1")), ClientGroups::DEFAULT);
+    ASSERT_EQ(groups.ofAuth("digest", "discovery:secret"), 1);
+    ASSERT_EQ(groups.ofAuth("digest", "other:secret"), ClientGroups::DEFAULT);
+    ASSERT_EQ(groups.ofPath("/clickhouse/tables"), 2);
+    ASSERT_EQ(groups.ofPath("/clickhouse2"), ClientGroups::DEFAULT);
+
+    /// Only the first request with a path counts
+    bool path_checked = false;
+    auto create = std::make_shared<ZooKeeperCreateRequest>();
+    create->path = "/clickhouse/a";
+    size_t group = groups.ofRequest(ClientGroups::DEFAULT, *create, path_checked);
+    ASSERT_EQ(group, 2);
+    create->path = "/discovery/a";
+    ASSERT_EQ(groups.ofRequest(group, *create, path_checked), 2);
+
+    auto auth = std::make_shared<ZooKeeperAuthRequest>();
+    auth->scheme = "digest";
+    auth->data = "discovery:secret";
+    ASSERT_EQ(groups.ofRequest(group, *auth, path_checked), 1);
+}
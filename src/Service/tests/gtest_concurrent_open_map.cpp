@@ -0,0 +1,51 @@
+#include <Service/ConcurrentOpenMap.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+
+using namespace RK;
+
+TEST(ConcurrentOpenMap, incrementalGrowAndErase)
+{
+    ConcurrentOpenMap<String> map(4);
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> errors{0};
+    for (int i = 0; i < 100; i++)
+        ASSERT_TRUE(map.emplace("/stable/" + std::to_string(i), std::make_shared<String>(std::to_string(i))));
+
+    std::thread reader([&]
+    {
+        while (!stop)
+        {
+            for (int i = 0; i < 100; i++)
+            {
+                String value;
+                if (!map.read("/stable/" + std::to_string(i), [&value](const String & v) { value = v; }) || value != std::to_string(i))
+                    ++errors;
+            }
+        }
+    });
+
+    /// Grow through several tables while erasing, every other key is erased meanwhile
+    for (int i = 0; i < 100000; i++)
+    {
+        ASSERT_TRUE(map.emplace("/churn/" + std::to_string(i), std::make_shared<String>(std::to_string(i))));
+        if (i % 2)
+            ASSERT_TRUE(map.erase("/churn/" + std::to_string(i - 1)));
+    }
+    ASSERT_FALSE(map.emplace("/churn/1", std::make_shared<String>("assigned")));
+    stop = true;
+    reader.join();
+
+    ASSERT_EQ(errors, 0);
+    ASSERT_EQ(map.size(), 100 + 50000);
+    ASSERT_EQ(*map.get("/churn/1"), "assigned");
+    ASSERT_EQ(*map.get("/churn/99999"), "99999");
+    ASSERT_EQ(map.get("/churn/0"), nullptr);
+    ASSERT_FALSE(map.erase("/churn/0"));
+
+    size_t visited = 0;
+    for (UInt32 i = 0; i < map.getBlockNum(); i++)
+        map.getMap(i).forEach([&visited](const String &, const std::shared_ptr<String> &) { ++visited; });
+    ASSERT_EQ(visited, map.size());
+}
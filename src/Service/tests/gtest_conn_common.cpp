@@ -0,0 +1,35 @@
+#include <Service/ConnCommon.h>
+#include <IO/ReadBufferFromMemory.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(ConnCommon, compressFrame)
+{
+    auto response = std::make_shared<Coordination::ZooKeeperListResponse>();
+    response->xid = 7;
+    response->zxid = 42;
+    for (size_t i = 0; i < 1000; ++i)
+        response->names.push_back("query-" + std::to_string(i));
+    response->prepareFrame();
+    auto frame = makeFrameBuffer(response);
+
+    /// Short frames are sent as they are
+    ASSERT_EQ(compressFrame(*frame, frame->used() + 1), nullptr);
+
+    auto compressed = compressFrame(*frame, 1024);
+    ASSERT_NE(compressed, nullptr);
+    ASSERT_LT(compressed->used(), frame->used());
+
+    int32_t length;
+    ReadBufferFromMemory in(compressed->begin(), sizeof(int32_t));
+    Coordination::read(length, in);
+    ASSERT_EQ(static_cast<size_t>(length), compressed->used() - sizeof(int32_t));
+
+    String decompressed;
+    decompressFrame(compressed->begin() + sizeof(int32_t), length, decompressed);
+    ASSERT_EQ(decompressed, response->frame.substr(sizeof(int32_t)));
+
+    /// Truncated frames are rejected
+    ASSERT_ANY_THROW(decompressFrame(compressed->begin() + sizeof(int32_t), length - 1, decompressed));
+}
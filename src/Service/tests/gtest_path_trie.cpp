@@ -0,0 +1,196 @@
+#include <Service/ConcurrentPathTrie.h>
+#include <Service/KeeperStore.h>
+#include <gtest/gtest.h>
+#include <thread>
+
+using namespace RK;
+
+TEST(ConcurrentPathTrie, emplaceGetErase)
+{
+    ConcurrentPathTrie<String> trie;
+    ASSERT_TRUE(trie.emplace("/", std::make_shared<String>("root")));
+    ASSERT_TRUE(trie.emplace("/clickhouse/tables/1", std::make_shared<String>("1")));
+    ASSERT_TRUE(trie.emplace("/clickhouse/tables/2", std::make_shared<String>("2")));
+    ASSERT_TRUE(trie.emplace("/clickhouse", std::make_shared<String>("ch")));
+    ASSERT_TRUE(trie.emplace("/clickhouse/task_queue", std::make_shared<String>("queue")));
+
+    /// assign existing key
+    ASSERT_FALSE(trie.emplace("/clickhouse/tables/1", std::make_shared<String>("11")));
+    ASSERT_EQ(trie.size(), 5);
+
+    ASSERT_EQ(*trie.get("/"), "root");
+    ASSERT_EQ(*trie.get("/clickhouse"), "ch");
+    ASSERT_EQ(*trie.get("/clickhouse/tables/1"), "11");
+    ASSERT_EQ(*trie.get("/clickhouse/task_queue"), "queue");
+    ASSERT_EQ(trie.get("/clickhouse/tables"), nullptr);
+    ASSERT_EQ(trie.get("/clickhouse/tables/3"), nullptr);
+    ASSERT_EQ(trie.get("/click"), nullptr);
+
+    ASSERT_FALSE(trie.erase("/clickhouse/tables"));
+    ASSERT_TRUE(trie.erase("/clickhouse/tables/1"));
+    ASSERT_FALSE(trie.erase("/clickhouse/tables/1"));
+    ASSERT_EQ(trie.get("/clickhouse/tables/1"), nullptr);
+    ASSERT_EQ(*trie.get("/clickhouse/tables/2"), "2");
+
+    ASSERT_TRUE(trie.erase("/clickhouse"));
+    ASSERT_EQ(*trie.get("/clickhouse/task_queue"), "queue");
+    ASSERT_EQ(trie.size(), 3);
+}
+
+TEST(ConcurrentPathTrie, forEach)
+{
+    ConcurrentPathTrie<String> trie;
+    for (int i = 0; i < 1000; i++)
+        trie.emplace("/node/" + std::to_string(i), std::make_shared<String>(std::to_string(i)));
+
+    size_t count = 0;
+    trie.forEach([&count](const String & key, const std::shared_ptr<String> & value)
+    {
+        ASSERT_EQ(key, "/node/" + *value);
+        count++;
+    });
+    ASSERT_EQ(count, 1000);
+
+    for (int i = 0; i < 1000; i += 2)
+        ASSERT_TRUE(trie.erase("/node/" + std::to_string(i)));
+    ASSERT_EQ(trie.size(), 500);
+    for (int i = 1; i < 1000; i += 2)
+        ASSERT_EQ(*trie.get("/node/" + std::to_string(i)), std::to_string(i));
+}
+
+TEST(KeeperContainer, radixTreeBuildPathChildren)
+{
+    KeeperStore store(100, "", ContainerType::RADIX_TREE);
+    store.container.emplace("/a", std::make_shared<KeeperNode>());
+    store.container.emplace("/a/b", std::make_shared<KeeperNode>());
+    store.container.emplace("/a/c", std::make_shared<KeeperNode>());
+    store.buildPathChildren();
+
+    ASSERT_EQ(store.container.size(), 4);
+    ASSERT_EQ(store.container.get("/")->children.size(), 1);
+    ASSERT_EQ(store.container.get("/a")->children.size(), 2);
+}
+
+TEST(ChildrenSet, growAndShrink)
+{
+    ChildrenSet children;
+    ASSERT_TRUE(children.empty());
+    for (int i = 0; i < 100; i++)
+        ASSERT_TRUE(children.insert(std::to_string(i)));
+    ASSERT_FALSE(children.insert("1"));
+    ASSERT_EQ(children.size(), 100);
+
+    ChildrenSet copy = children;
+    ASSERT_EQ(copy, children);
+
+    for (int i = 0; i < 95; i++)
+        ASSERT_TRUE(children.erase(std::to_string(i)));
+    ASSERT_FALSE(children.erase("1"));
+    ASSERT_EQ(children.size(), 5);
+    ASSERT_TRUE(children.contains("99"));
+    ASSERT_NE(copy, children);
+}
+
+TEST(ChildrenSet, forEachPage)
+{
+    /// Small set is a vector and large set is a tree
+    for (size_t count : {10, 1000})
+    {
+        ChildrenSet children;
+        for (size_t i = 0; i < count; i++)
+            children.insert((i % 2 ? "log-" : "block-") + std::to_string(i));
+
+        std::vector<String> all;
+        children.forEach([&all](const String & child) { all.push_back(child); });
+        ASSERT_TRUE(std::is_sorted(all.begin(), all.end()));
+
+        /// Walk through by pages of 3
+        std::vector<String> paged;
+        String cursor;
+        bool has_more = true;
+        while (has_more)
+        {
+            size_t before = paged.size();
+            has_more = children.forEachPage(cursor, "", 3, [&paged](const String & child) { paged.push_back(child); });
+            ASSERT_LE(paged.size() - before, 3);
+            cursor = paged.back();
+        }
+        ASSERT_EQ(paged, all);
+
+        /// Only children with prefix, cursor before the prefix
+        std::vector<String> logs;
+        ASSERT_FALSE(children.forEachPage("a", "log-", count, [&logs](const String & child) { logs.push_back(child); }));
+        ASSERT_EQ(logs.size(), count / 2);
+        for (const auto & log : logs)
+            ASSERT_EQ(log.substr(0, 4), "log-");
+
+        logs.clear();
+        ASSERT_TRUE(children.forEachPage("", "log-", 1, [&logs](const String & child) { logs.push_back(child); }));
+        ASSERT_EQ(logs.size(), 1);
+        ASSERT_EQ(logs[0], all[count / 2]);
+    }
+}
+
+TEST(ConcurrentMap, lockFreeReadWhileWriting)
+{
+    ConcurrentMap<String> map(4);
+    for (int i = 0; i < 100; i++)
+        ASSERT_TRUE(map.emplace("/stable/" + std::to_string(i), std::make_shared<String>(std::to_string(i))));
+
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> errors{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++)
+    {
+        readers.emplace_back([&]
+        {
+            while (!stop)
+            {
+                for (int i = 0; i < 100; i++)
+                {
+                    String value;
+                    if (!map.read("/stable/" + std::to_string(i), [&value](const String & v) { value = v; }) || value != std::to_string(i))
+                        ++errors;
+                }
+            }
+        });
+    }
+
+    /// Rehash, assign and erase while reading
+    for (int round = 0; round < 10; round++)
+    {
+        for (int i = 0; i < 5000; i++)
+            map.emplace("/churn/" + std::to_string(i), std::make_shared<String>(std::to_string(round)));
+        for (int i = 0; i < 5000; i++)
+            ASSERT_TRUE(map.erase("/churn/" + std::to_string(i)));
+    }
+    stop = true;
+    for (auto & reader : readers)
+        reader.join();
+
+    ASSERT_EQ(errors, 0);
+    ASSERT_EQ(map.size(), 100);
+    /// Retired objects wait two epochs
+    EpochReclaimer::instance().reclaim();
+    EpochReclaimer::instance().reclaim();
+    ASSERT_EQ(EpochReclaimer::instance().pendingCount(), 0);
+}
+
+TEST(ConcurrentMap, shrinkAfterMassErase)
+{
+    ConcurrentMap<String> map(1);
+    auto & block = map.getMap(0);
+    for (int i = 0; i < 10000; i++)
+        map.emplace("/mass/" + std::to_string(i), std::make_shared<String>(std::to_string(i)));
+    ASSERT_FALSE(block.shrink());
+    size_t full_buckets = block.bucketCount();
+
+    for (int i = 10; i < 10000; i++)
+        ASSERT_TRUE(map.erase("/mass/" + std::to_string(i)));
+    ASSERT_TRUE(block.shrink());
+    ASSERT_LT(block.bucketCount(), full_buckets);
+    ASSERT_FALSE(block.shrink());
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(*map.get("/mass/" + std::to_string(i)), std::to_string(i));
+    ASSERT_EQ(map.size(), 10);
+}
@@ -0,0 +1,28 @@
+#include <Service/PathUtils.h>
+#include <gtest/gtest.h>
+#include <limits>
+
+using namespace RK;
+
+TEST(PathUtils, parentBaseNameAndSequentialSuffix)
+{
+    ASSERT_EQ(parentPathView("/a"), "/");
+    ASSERT_EQ(parentPathView("/a/b/c"), "/a/b");
+    ASSERT_EQ(baseNameView("/a/b/c"), "c");
+    ASSERT_EQ(baseNameView("/a/"), "");
+    ASSERT_EQ(childPath("/", "a"), "/a");
+    ASSERT_EQ(childPath("/a", "b"), "/a/b");
+
+    String path = "/lock-";
+    appendSequentialSuffix(path, 42);
+    ASSERT_EQ(path, "/lock-0000000042");
+
+    path = "/lock-";
+    appendSequentialSuffix(path, std::numeric_limits<int32_t>::max());
+    ASSERT_EQ(path, "/lock-2147483647");
+
+    /// Same as std::setw(10) << std::setfill('0') on cversion overflow
+    path = "/lock-";
+    appendSequentialSuffix(path, -1);
+    ASSERT_EQ(path, "/lock-00000000-1");
+}
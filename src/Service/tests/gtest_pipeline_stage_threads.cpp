@@ -0,0 +1,55 @@
+#include <Service/PipelineStageThreads.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+
+using namespace RK;
+
+TEST(PipelineStageThreads, accountThreadsOfStage)
+{
+    /// Every thread is on CPU for cpu_ns, set by the test
+    std::atomic<UInt64> cpu_ns{1000000};
+    PipelineStageThreads stage_threads([&](pid_t)
+    {
+        PipelineStageThreads::Counters counters;
+        counters.cpu_ns = cpu_ns;
+        counters.voluntary_switches = cpu_ns / 1000000;
+        return counters;
+    });
+    auto snapshot = [&] { return stage_threads.collect()[static_cast<size_t>(PipelineStage::Snapshot)]; };
+    ASSERT_EQ(snapshot().threads, 0);
+
+    std::atomic<bool> entered{false};
+    std::atomic<bool> done{false};
+    std::thread thread(
+        [&]
+        {
+            PipelineStageThreads::Scope stage_scope(PipelineStage::Snapshot, stage_threads);
+            entered = true;
+            while (!done)
+                std::this_thread::yield();
+        });
+    while (!entered)
+        std::this_thread::yield();
+
+    /// Counted from the registration on
+    auto running = snapshot();
+    ASSERT_EQ(running.threads, 1);
+    ASSERT_EQ(running.cpu_us, 0);
+
+    cpu_ns = 5000000;
+    running = snapshot();
+    ASSERT_EQ(running.cpu_us, 4000);
+    ASSERT_EQ(running.voluntary_switches, 4);
+    ASSERT_EQ(stage_threads.collect()[static_cast<size_t>(PipelineStage::Fsync)].cpu_us, 0);
+
+    done = true;
+    thread.join();
+
+    /// What the thread used is kept after it left, and nothing after it
+    cpu_ns = 9000000;
+    auto after = snapshot();
+    ASSERT_EQ(after.threads, 0);
+    ASSERT_EQ(after.cpu_us, 4000);
+    ASSERT_EQ(after.voluntary_switches, 4);
+}
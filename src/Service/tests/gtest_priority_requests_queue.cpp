@@ -0,0 +1,77 @@
+#include <Service/PriorityRequestsQueue.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(PriorityRequestsQueue, priorityLanesKeepSessionOrder)
+{
+    using namespace Coordination;
+    PriorityRequestsQueue queue(1, 64);
+    auto make = [](int64_t session_id, ZooKeeperRequestPtr request, XID xid)
+    {
+        request->xid = xid;
+        return KeeperStore::RequestForSession{session_id, request};
+    };
+
+    ASSERT_TRUE(queue.push(make(1, std::make_shared<ZooKeeperCreateRequest>(), 1)));
+    ASSERT_TRUE(queue.push(make(2, std::make_shared<ZooKeeperGetRequest>(), 1)));
+    ASSERT_TRUE(queue.push(make(3, std::make_shared<ZooKeeperCloseRequest>(), 1)));
+    /// Waits behind the write of its session
+    ASSERT_TRUE(queue.push(make(1, std::make_shared<ZooKeeperGetRequest>(), 2)));
+    ASSERT_EQ(queue.size(PriorityRequestsQueue::CONTROL), 1);
+    ASSERT_EQ(queue.size(PriorityRequestsQueue::READ), 1);
+    ASSERT_EQ(queue.size(PriorityRequestsQueue::WRITE), 2);
+
+    std::vector<std::pair<int64_t, XID>> expected{{3, 1}, {2, 1}, {1, 1}, {1, 2}};
+    for (const auto & [session_id, xid] : expected)
+    {
+        KeeperStore::RequestForSession request;
+        ASSERT_TRUE(queue.tryPop(0, request));
+        ASSERT_EQ(request.session_id, session_id);
+        ASSERT_EQ(request.request->xid, xid);
+    }
+    ASSERT_TRUE(queue.empty());
+
+    /// Session 1 has nothing queued now
+    ASSERT_TRUE(queue.push(make(1, std::make_shared<ZooKeeperGetRequest>(), 3)));
+    ASSERT_EQ(queue.size(PriorityRequestsQueue::READ), 1);
+
+    KeeperStore::RequestForSession request;
+    ASSERT_TRUE(queue.tryPop(0, request, 10));
+    ASSERT_FALSE(queue.tryPop(0, request, 10));
+}
+
+TEST(PriorityRequestsQueue, weightedClientGroups)
+{
+    using namespace Coordination;
+    PriorityRequestsQueue queue(1, 256, {1, 3});
+    for (int64_t i = 0; i < 100; ++i)
+    {
+        for (size_t group = 0; group < 2; ++group)
+        {
+            KeeperStore::RequestForSession request{static_cast<int64_t>(group * 1000 + i), std::make_shared<ZooKeeperGetRequest>()};
+            request.client_group = group;
+            ASSERT_TRUE(queue.push(std::move(request)));
+        }
+    }
+    ASSERT_EQ(queue.groupSize(0), 100);
+    ASSERT_EQ(queue.groupSize(1), 100);
+
+    size_t popped[2]{};
+    for (size_t i = 0; i < 100; ++i)
+    {
+        KeeperStore::RequestForSession request;
+        ASSERT_TRUE(queue.tryPop(0, request));
+        ++popped[request.session_id / 1000];
+    }
+    ASSERT_NEAR(popped[0], 25, 1);
+    ASSERT_NEAR(popped[1], 75, 1);
+    ASSERT_EQ(queue.groupPops(1), popped[1]);
+
+    /// Once group 1 is drained group 0 takes all
+    KeeperStore::RequestForSession request;
+    while (queue.tryPop(0, request))
+        ;
+    ASSERT_TRUE(queue.empty());
+    ASSERT_EQ(queue.groupSize(0), 0);
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <fstream>
+#include <thread>
 #include <Service/KeeperCommon.h>
 #include <Service/NuRaftFileLogStore.h>
 #include <Service/NuRaftLogSegment.h>
@@ -154,6 +157,20 @@ TEST(RaftLog, writeAndReadUInt32)
     ASSERT_EQ(x2, y2);
 }
 
+TEST(RaftLog, crc32c)
+{
+    ASSERT_EQ(getCRC32C("123456789", 9), 0xe3069283);
+    ASSERT_EQ(getCRC32C(std::string(32, 0).data(), 32), 0x8a9136aa);
+
+    /// Long enough for the interleaved lanes
+    std::string data(13000, 0);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i % 251);
+    ASSERT_EQ(getCRC32C(data.data(), data.size()), 0x8f63c526);
+    ASSERT_TRUE(verifyChecksum(ChecksumType::CRC32C, data.data(), data.size(), 0x8f63c526));
+    ASSERT_TRUE(verifyChecksum(ChecksumType::CRC32, data.data(), data.size(), getCRC32(data.data(), data.size())));
+}
+
 TEST(RaftLog, serializeStr)
 {
     std::string str("a string buffer");
@@ -254,6 +271,147 @@ TEST(RaftLog, serializeEntry)
     ASSERT_STREQ(entry_pb_1->data(0).data().c_str(), data.c_str());
 }
 
+TEST(RaftLog, serializeEntryWithoutCopy)
+{
+    for (bool compress : {false, true})
+    {
+        ptr<log_entry> entry = cs_new<log_entry>(1, LogEntry::serializePB(createEntryPB(1, 1, OP_TYPE_CREATE, "/key", std::string(1000, 'a'))));
+        ptr<buffer> entry_buf;
+        size_t buf_size;
+        const char * entry_str = LogEntry::serializeEntry(entry, entry_buf, buf_size, compress);
+
+        SerializedLogEntry serialized;
+        LogEntry::serializeEntry(entry, serialized, compress);
+        ASSERT_EQ(serialized.size + 1, buf_size);
+        ASSERT_EQ(serialized.type, static_cast<UInt8>(entry_str[0]));
+        ASSERT_EQ(std::memcmp(serialized.data, entry_str + 1, serialized.size), 0);
+        ASSERT_EQ(serialized.data == reinterpret_cast<const char *>(entry->get_buf().data_begin()), !compress);
+
+        /// Checksummed in pieces as it is appended
+        auto type = reinterpret_cast<const char *>(&serialized.type);
+        for (auto checksum : {ChecksumType::CRC32, ChecksumType::CRC32C})
+            ASSERT_EQ(
+                extendChecksum(checksum, getChecksum(checksum, type, 1), serialized.data, serialized.size),
+                getChecksum(checksum, entry_str, buf_size));
+
+        ptr<log_entry> parsed = LogEntry::parseEntry(entry_str, 1, buf_size);
+        ASSERT_EQ(parsed->get_buf().size(), entry->get_buf().size());
+        ASSERT_EQ(std::memcmp(parsed->get_buf().data_begin(), entry->get_buf().data_begin(), entry->get_buf().size()), 0);
+    }
+}
+
+TEST(RaftLog, compressEntryAndPack)
+{
+    std::string log_dir(LOG_DIR + "/compress");
+    cleanDirectory(log_dir);
+    ptr<NuRaftFileLogStore> file_store = cs_new<NuRaftFileLogStore>(
+        log_dir,
+        true,
+        FsyncMode::FSYNC_PARALLEL,
+        1000,
+        LogSegmentStore::MAX_LOG_SIZE,
+        LogSegmentStore::MAX_SEGMENT_COUNT,
+        false,
+        false,
+        false,
+        LogEntryCache::DEFAULT_MAX_BYTES,
+        true);
+
+    UInt64 term = 1;
+    std::string key("/ck/table/table1");
+    std::string data(1000, 'a');
+    for (int i = 0; i < 8; i++)
+    {
+        auto entry_pb = createEntryPB(term, 0, OP_TYPE_CREATE, key, data);
+        ptr<log_entry> entry_log = cs_new<log_entry>(term, LogEntry::serializePB(entry_pb));
+        ASSERT_EQ(file_store->append(entry_log), i + 1);
+    }
+
+    ptr<log_entry> first = file_store->entry_at(1);
+    ptr<buffer> entry_buf;
+    size_t buf_size;
+    LogEntry::serializeEntry(first, entry_buf, buf_size, true);
+    ASSERT_LT(buf_size, data.size());
+
+    /// Entries are compressed on disk and read back as they were
+    ptr<log_entry> log = file_store->segmentStore()->getEntry(5);
+    ASSERT_EQ(log->get_val_type(), app_log);
+    ASSERT_EQ(data, LogEntry::parsePB(log->get_buf())->data(0).data());
+
+    ptr<buffer> pack = file_store->pack(1, 8);
+    ASSERT_LT(pack->size(), 8 * data.size());
+
+    std::string follower_dir(LOG_DIR + "/compress_follower");
+    cleanDirectory(follower_dir);
+    ptr<NuRaftFileLogStore> follower_store = cs_new<NuRaftFileLogStore>(follower_dir, true);
+    follower_store->apply_pack(1, *pack);
+    ASSERT_EQ(follower_store->next_slot(), 9);
+    ASSERT_EQ(data, LogEntry::parsePB(follower_store->entry_at(8)->get_buf())->data(0).data());
+
+    file_store->shutdown();
+    follower_store->shutdown();
+    cleanDirectory(log_dir);
+    cleanDirectory(follower_dir);
+}
+
+TEST(RaftLog, rawPack)
+{
+    std::string log_dir(LOG_DIR + "/raw_pack");
+    cleanDirectory(log_dir);
+    ptr<NuRaftFileLogStore> file_store = cs_new<NuRaftFileLogStore>(
+        log_dir,
+        true,
+        FsyncMode::FSYNC_PARALLEL,
+        1000,
+        2000,
+        LogSegmentStore::MAX_SEGMENT_COUNT,
+        false,
+        false,
+        false,
+        LogEntryCache::DEFAULT_MAX_BYTES,
+        false,
+        LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND,
+        true);
+
+    std::string key("/ck/table/table1");
+    for (int i = 0; i < 20; i++)
+    {
+        auto entry_pb = createEntryPB(i / 10 + 1, 0, OP_TYPE_CREATE, key, std::to_string(i) + std::string(200, 'a'));
+        ptr<log_entry> entry_log = cs_new<log_entry>(i / 10 + 1, LogEntry::serializePB(entry_pb));
+        ASSERT_EQ(file_store->append(entry_log), i + 1);
+    }
+    ASSERT_GT(file_store->segmentStore()->getSegments().size(), 1);
+
+    /// Entries of several segments are shipped as they are on disk
+    ptr<buffer> pack = file_store->pack(3, 16);
+    pack->pos(0);
+    ASSERT_EQ(pack->get_int(), -2);
+
+    std::string follower_dir(LOG_DIR + "/raw_pack_follower");
+    cleanDirectory(follower_dir);
+    ptr<NuRaftFileLogStore> follower_store = cs_new<NuRaftFileLogStore>(follower_dir, true);
+    follower_store->apply_pack(1, *file_store->pack(1, 2));
+    follower_store->apply_pack(3, *pack);
+    ASSERT_EQ(follower_store->next_slot(), 19);
+    for (UInt64 i = 1; i <= 18; i++)
+    {
+        ptr<log_entry> entry = follower_store->entry_at(i);
+        ASSERT_EQ(entry->get_term(), (i - 1) / 10 + 1);
+        ASSERT_EQ(std::to_string(i - 1) + std::string(200, 'a'), LogEntry::parsePB(entry->get_buf())->data(0).data());
+    }
+
+    /// A corrupted pack is not applied
+    ptr<buffer> corrupted = file_store->pack(19, 2);
+    corrupted->data_begin()[corrupted->size() - 1] ^= 0xFF;
+    follower_store->apply_pack(19, *corrupted);
+    ASSERT_EQ(follower_store->next_slot(), 19);
+
+    file_store->shutdown();
+    follower_store->shutdown();
+    cleanDirectory(log_dir);
+    cleanDirectory(follower_dir);
+}
+
 TEST(RaftLog, appendEntry)
 {
     std::string log_dir(LOG_DIR + "/1");
@@ -337,6 +495,49 @@ TEST(RaftLog, splitSegment)
     cleanDirectory(log_dir);
 }
 
+TEST(RaftLog, loadSegmentIndex)
+{
+    std::string log_dir(LOG_DIR + "/segment_index");
+    cleanDirectory(log_dir);
+    auto log_store = LogSegmentStore::getInstance(log_dir, true);
+    ASSERT_EQ(log_store->init(200, 10), 0);
+    for (int i = 0; i < 12; i++)
+    {
+        std::string key("/ck/table/table1");
+        std::string data("CREATE TABLE table1;");
+        ASSERT_EQ(appendEntry(log_store, i / 5 + 1, OP_TYPE_CREATE, key, data), i + 1);
+    }
+    ASSERT_EQ(log_store->getSegments().size(), 3);
+    std::vector<std::string> index_paths;
+    for (auto & segment : log_store->getSegments())
+    {
+        index_paths.push_back(log_dir + "/" + segment->getFileName() + NuRaftLogSegment::INDEX_FILE_SUFFIX);
+        ASSERT_TRUE(Poco::File(index_paths.back()).exists());
+    }
+    ASSERT_EQ(log_store->close(), 0);
+
+    /// A corrupted index is ignored and written again
+    {
+        std::fstream index(index_paths[1], std::ios::in | std::ios::out | std::ios::binary);
+        index.seekp(10);
+        index.put('\xAB');
+    }
+
+    ASSERT_EQ(log_store->init(200, 10), 0);
+    ASSERT_EQ(log_store->lastLogIndex(), 12);
+    for (UInt64 i = 1; i <= 12; i++)
+    {
+        ASSERT_NE(log_store->getEntry(i), nullptr);
+        ASSERT_EQ(log_store->getTerm(i), (i - 1) / 5 + 1);
+    }
+
+    /// The segment reopened by truncating has no index
+    ASSERT_EQ(log_store->truncateLog(7), 0);
+    ASSERT_FALSE(Poco::File(index_paths[2]).exists());
+    ASSERT_EQ(log_store->close(), 0);
+    cleanDirectory(log_dir);
+}
+
 TEST(RaftLog, removeSegment)
 {
     std::string log_dir(LOG_DIR + "/5");
@@ -367,6 +568,149 @@ TEST(RaftLog, removeSegment)
     //cleanDirectory(log_dir);
 }
 
+TEST(RaftLog, removeSegmentInBackground)
+{
+    std::string log_dir(LOG_DIR + "/remove_background");
+    cleanDirectory(log_dir);
+    Poco::File(log_dir).createDirectories();
+    /// Left by a crash before it was unlinked
+    Poco::File(log_dir + "/" + LogSegmentStore::LOG_REMOVED_FILE_PREFIX + "log_1_2_20240101").createFile();
+
+    auto log_store = LogSegmentStore::getInstance(log_dir, true);
+    ASSERT_EQ(log_store->init(100, 3), 0);
+    for (int i = 0; i < 10; i++)
+    {
+        std::string key("/ck/table/table1");
+        std::string data("CREATE TABLE table1;");
+        ASSERT_EQ(appendEntry(log_store, 1, OP_TYPE_CREATE, key, data), i + 1);
+    }
+    ASSERT_EQ(log_store->removeSegment(5), 0);
+    ASSERT_EQ(log_store->firstLogIndex(), 5);
+
+    auto removed_files = [&]
+    {
+        std::vector<std::string> files;
+        Poco::File(log_dir).list(files);
+        return std::count_if(
+            files.begin(), files.end(), [](const auto & file) { return file.starts_with(LogSegmentStore::LOG_REMOVED_FILE_PREFIX); });
+    };
+    for (int i = 0; i < 100 && removed_files(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_EQ(removed_files(), 0);
+    ASSERT_EQ(log_store->close(), 0);
+    cleanDirectory(log_dir);
+}
+
+TEST(RaftLog, migrateClosedSegments)
+{
+    std::string log_dir(LOG_DIR + "/migrate_hot");
+    std::string cold_dir(LOG_DIR + "/migrate_cold");
+    cleanDirectory(log_dir);
+    cleanDirectory(cold_dir);
+
+    auto log_store = LogSegmentStore::getInstance(log_dir, true);
+    ASSERT_EQ(log_store->init(100, 3, false, false, false, LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND, cold_dir), 0);
+    for (int i = 0; i < 10; i++)
+    {
+        std::string key("/ck/table/table1");
+        std::string data("CREATE TABLE table1;");
+        ASSERT_EQ(appendEntry(log_store, 1, OP_TYPE_CREATE, key, data), i + 1);
+    }
+
+    auto closed_segments = [](const std::string & dir)
+    {
+        std::vector<std::string> files;
+        Poco::File(dir).list(files);
+        return std::count_if(files.begin(), files.end(), [](const auto & file)
+        {
+            return file.starts_with("log_") && file.find("_open_") == std::string::npos && !file.ends_with(NuRaftLogSegment::INDEX_FILE_SUFFIX);
+        });
+    };
+    for (int i = 0; i < 100 && closed_segments(log_dir); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_EQ(closed_segments(log_dir), 0);
+    ASSERT_GT(closed_segments(cold_dir), 0);
+
+    for (UInt64 index = 1; index <= 10; index++)
+        ASSERT_NE(log_store->getEntry(index), nullptr);
+    ASSERT_EQ(log_store->close(), 0);
+
+    /// Segments are listed from both directories
+    ASSERT_EQ(log_store->init(100, 3, false, false, false, LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND, cold_dir), 0);
+    ASSERT_EQ(log_store->firstLogIndex(), 1);
+    ASSERT_EQ(log_store->lastLogIndex(), 10);
+    ASSERT_EQ(log_store->removeSegment(5), 0);
+    ASSERT_EQ(log_store->firstLogIndex(), 5);
+    ASSERT_EQ(log_store->close(), 0);
+    cleanDirectory(log_dir);
+    cleanDirectory(cold_dir);
+}
+
+TEST(RaftLog, preallocateAndRecycleSegment)
+{
+    std::string log_dir(LOG_DIR + "/preallocate");
+    cleanDirectory(log_dir);
+    auto log_store = LogSegmentStore::getInstance(log_dir, true);
+    ASSERT_EQ(log_store->init(100, 3, true), 0);
+    for (int i = 0; i < 10; i++)
+    {
+        std::string key("/ck/table/table1");
+        std::string data("CREATE TABLE table1;");
+        ASSERT_EQ(appendEntry(log_store, 1, OP_TYPE_CREATE, key, data), i + 1);
+    }
+
+    /// The file of the removed segment is kept and taken by the next segment
+    ASSERT_EQ(log_store->removeSegment(3), 0);
+    ASSERT_TRUE(Poco::File(log_dir + "/" + LogSegmentStore::LOG_RECYCLED_FILE_PREFIX + "0").exists());
+    for (int i = 10; i < 12; i++)
+    {
+        std::string key("/ck/table/table1");
+        std::string data("CREATE TABLE table1;");
+        ASSERT_EQ(appendEntry(log_store, 1, OP_TYPE_CREATE, key, data), i + 1);
+    }
+    ASSERT_FALSE(Poco::File(log_dir + "/" + LogSegmentStore::LOG_RECYCLED_FILE_PREFIX + "0").exists());
+    ASSERT_EQ(log_store->close(), 0);
+
+    /// The log of the open segment ends before its zeros
+    ASSERT_EQ(log_store->init(100, 3, true), 0);
+    ASSERT_EQ(log_store->firstLogIndex(), 3);
+    ASSERT_EQ(log_store->lastLogIndex(), 12);
+    for (UInt64 i = 3; i <= 12; i++)
+        ASSERT_NE(log_store->getEntry(i), nullptr);
+    std::string key("/ck/table/table1");
+    std::string data("CREATE TABLE table1;");
+    ASSERT_EQ(appendEntry(log_store, 1, OP_TYPE_CREATE, key, data), 13);
+    ASSERT_EQ(log_store->close(), 0);
+    cleanDirectory(log_dir);
+}
+
+TEST(RaftLog, persistentMemorySegment)
+{
+    std::string log_dir(LOG_DIR + "/pmem");
+    cleanDirectory(log_dir);
+    auto log_store = LogSegmentStore::getInstance(log_dir, true);
+    /// Synced by fsync if log_dir is not on a dax filesystem, the log is the same either way
+    ASSERT_EQ(log_store->init(200, 10, false, false, false, LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND, "", true), 0);
+    std::string key("/ck/table/table1");
+    std::string data("CREATE TABLE table1;");
+    for (int i = 0; i < 8; i++)
+        ASSERT_EQ(appendEntry(log_store, 1, OP_TYPE_CREATE, key, data), i + 1);
+    ASSERT_EQ(log_store->flush(), 8);
+
+    ASSERT_EQ(log_store->truncateLog(6), 0);
+    ASSERT_EQ(appendEntry(log_store, 2, OP_TYPE_CREATE, key, data), 7);
+    ASSERT_EQ(log_store->flush(), 7);
+    ASSERT_EQ(log_store->close(), 0);
+
+    ASSERT_EQ(log_store->init(200, 10, false, false, false, LogSegmentStore::DEFAULT_REMOVE_BYTES_PER_SECOND, "", true), 0);
+    ASSERT_EQ(log_store->lastLogIndex(), 7);
+    for (UInt64 i = 1; i <= 7; i++)
+        ASSERT_NE(log_store->getEntry(i), nullptr);
+    ASSERT_EQ(log_store->getEntry(7)->get_term(), 2);
+    ASSERT_EQ(log_store->close(), 0);
+    cleanDirectory(log_dir);
+}
+
 TEST(RaftLog, truncateLog)
 {
     std::string log_dir(LOG_DIR + "/6");
@@ -569,6 +913,117 @@ TEST(RaftLog, compact)
     //cleanDirectory(log_dir);
 }
 
+TEST(RaftLog, batchAppend)
+{
+    std::string log_dir(LOG_DIR + "/batch");
+    cleanDirectory(log_dir);
+    ptr<NuRaftFileLogStore> file_store = cs_new<NuRaftFileLogStore>(
+        log_dir, true, FsyncMode::FSYNC_PARALLEL, 1000, static_cast<UInt32>(100), static_cast<UInt32>(3), false, false, true);
+
+    UInt64 term = 1;
+    std::string key("/ck/table/table1");
+    std::string data("CREATE TABLE table1;");
+    for (int i = 0; i < 16; i++)
+    {
+        auto entry_pb = createEntryPB(term, 0, OP_TYPE_CREATE, key, data);
+        ptr<log_entry> entry_log = cs_new<log_entry>(term, LogEntry::serializePB(entry_pb));
+        ASSERT_EQ(file_store->append(entry_log), i + 1);
+    }
+
+    /// Held back entries are read from memory
+    ASSERT_EQ(file_store->next_slot(), 17);
+    ASSERT_EQ(file_store->segmentStore()->lastLogIndex(), 0);
+    ASSERT_EQ(file_store->entry_at(8)->get_term(), term);
+
+    /// Segments are rotated inside the batch the same as appending one by one
+    file_store->end_of_append_batch(1, 16);
+    ASSERT_EQ(file_store->segmentStore()->lastLogIndex(), 16);
+    ASSERT_EQ(file_store->segmentStore()->getSegments().size(), 7);
+
+    for (UInt64 i = 1; i <= 16; i++)
+    {
+        ptr<log_entry> log = file_store->segmentStore()->getEntry(i);
+        ASSERT_EQ(log->get_term(), term);
+        ptr<LogEntryPB> pb = LogEntry::parsePB(log->get_buf());
+        ASSERT_EQ(key, pb->data(0).key());
+        ASSERT_EQ(data, pb->data(0).data());
+    }
+    file_store->shutdown();
+    cleanDirectory(log_dir);
+}
+
+TEST(RaftLog, logEntryCache)
+{
+    /// Room for 4 entries of 100 bytes
+    LogEntryCache cache((sizeof(log_entry) + 100) * 4, 8);
+    for (UInt64 i = 1; i <= 6; i++)
+        cache.put(i, cs_new<log_entry>(1, buffer::alloc(100)));
+
+    /// Oldest entries are evicted by bytes
+    ASSERT_EQ(cache.get(1), nullptr);
+    ASSERT_EQ(cache.get(2), nullptr);
+    for (UInt64 i = 3; i <= 6; i++)
+        ASSERT_NE(cache.get(i), nullptr);
+    ASSERT_EQ(cache.getStats().entries, 4);
+    ASSERT_EQ(cache.getStats().hits, 4);
+    ASSERT_EQ(cache.getStats().misses, 2);
+
+    /// An entry larger than the limit is still kept as the newest
+    cache.put(7, cs_new<log_entry>(1, buffer::alloc(1000)));
+    ASSERT_NE(cache.get(7), nullptr);
+    ASSERT_EQ(cache.get(6), nullptr);
+    ASSERT_EQ(cache.getStats().entries, 1);
+
+    /// A slot of the last lap is taken over
+    cache.clear();
+    ASSERT_EQ(cache.get(7), nullptr);
+    cache.put(8, cs_new<log_entry>(1, buffer::alloc(10)));
+    cache.put(16, cs_new<log_entry>(1, buffer::alloc(10)));
+    ASSERT_EQ(cache.get(8), nullptr);
+    ASSERT_NE(cache.get(16), nullptr);
+    ASSERT_EQ(cache.getStats().entries, 1);
+}
+
+TEST(RaftLog, logEntryCachePin)
+{
+    /// Room for 2 entries of 100 bytes
+    LogEntryCache cache((sizeof(log_entry) + 100) * 2, 8);
+    cache.put(1, cs_new<log_entry>(1, buffer::alloc(100)));
+
+    /// Pinned entries are kept over the limit
+    cache.pin(2);
+    for (UInt64 i = 2; i <= 5; i++)
+        cache.put(i, cs_new<log_entry>(1, buffer::alloc(100)));
+    ASSERT_EQ(cache.get(1), nullptr);
+    for (UInt64 i = 2; i <= 5; i++)
+        ASSERT_NE(cache.get(i), nullptr);
+
+    /// And evicted by the next put after they are unpinned
+    cache.unpin();
+    cache.put(6, cs_new<log_entry>(1, buffer::alloc(100)));
+    ASSERT_EQ(cache.getStats().entries, 2);
+    ASSERT_EQ(cache.get(4), nullptr);
+    ASSERT_NE(cache.get(5), nullptr);
+}
+
+TEST(RaftLog, logEntryCacheShrink)
+{
+    LogEntryCache cache((sizeof(log_entry) + 100) * 4, 8);
+    for (UInt64 i = 1; i <= 4; i++)
+        cache.put(i, cs_new<log_entry>(1, buffer::alloc(100)));
+    ASSERT_EQ(cache.getStats().entries, 4);
+
+    /// A lower limit, e.g. under memory pressure, is applied by the next put
+    cache.setMaxBytes((sizeof(log_entry) + 100) * 2);
+    ASSERT_EQ(cache.getStats().entries, 4);
+    cache.put(5, cs_new<log_entry>(1, buffer::alloc(100)));
+    ASSERT_EQ(cache.getStats().entries, 2);
+    ASSERT_EQ(cache.get(3), nullptr);
+    ASSERT_NE(cache.get(4), nullptr);
+    ASSERT_NE(cache.get(5), nullptr);
+    ASSERT_EQ(cache.getStats().max_bytes, (sizeof(log_entry) + 100) * 2);
+}
+
 TEST(RaftLog, getEntry)
 {
     std::string log_dir(LOG_DIR + "/7");
@@ -628,6 +1083,46 @@ TEST(RaftLog, getEntries)
     cleanDirectory(log_dir);
 }
 
+TEST(RaftLog, readWhileAppending)
+{
+    std::string log_dir(LOG_DIR + "/read_while_appending");
+    cleanDirectory(log_dir);
+    auto log_store = LogSegmentStore::getInstance(log_dir, true);
+    ASSERT_EQ(log_store->init(2000, 100), 0); /// a segment is rotated every 30 entries or so
+    std::string key("/ck/table/table1");
+    std::string data("CREATE TABLE table1;");
+
+    const UInt64 count = 2000;
+    std::atomic<bool> done{false};
+    std::atomic<UInt64> wrong{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t)
+    {
+        readers.emplace_back([&] {
+            while (!done)
+            {
+                UInt64 last = log_store->lastLogIndex();
+                for (UInt64 index = last > 50 ? last - 50 : 1; index <= last; ++index)
+                {
+                    ptr<log_entry> entry = log_store->getEntry(index);
+                    if (!entry || entry->get_term() != index / 100 + 1 || log_store->getTerm(index) != index / 100 + 1)
+                        ++wrong;
+                }
+            }
+        });
+    }
+    for (UInt64 index = 1; index <= count; ++index)
+        ASSERT_EQ(appendEntry(log_store, index / 100 + 1, OP_TYPE_CREATE, key, data), index);
+    done = true;
+    for (auto & reader : readers)
+        reader.join();
+
+    ASSERT_EQ(wrong, 0);
+    ASSERT_GT(log_store->getSegments().size(), 10);
+    log_store->close();
+    cleanDirectory(log_dir);
+}
+
 //#define ASSERT_EQ_LOG(log, v1, v2) \ -
 //    { \ -
 //        if (v1 != v2) \ -
@@ -3,6 +3,7 @@
 #include <Service/NuRaftLogSegment.h>
 #include <Service/NuRaftStateMachine.h>
 #include <Service/tests/raft_test_common.h>
+#include <IO/WriteBufferFromString.h>
 #include <gtest/gtest.h>
 #include <libnuraft/nuraft.hxx>
 #include <Poco/File.h>
@@ -192,6 +193,102 @@ TEST(RaftStateMachine, serializeAndParse)
     cleanDirectory(snap_dir);
 }
 
+TEST(RaftStateMachine, serializeRequestOfExactSize)
+{
+    ACLs default_acls;
+    ACL acl;
+    acl.permissions = ACL::All;
+    acl.scheme = "world";
+    acl.id = "anyone";
+    default_acls.emplace_back(std::move(acl));
+
+    auto create = cs_new<ZooKeeperCreateRequest>();
+    create->path = "/multi";
+    create->data = std::string(1000, 'a');
+    create->acls = default_acls;
+    auto set = cs_new<ZooKeeperSetRequest>();
+    set->path = "/multi";
+    set->data = "b";
+    auto multi = cs_new<ZooKeeperMultiRequest>();
+    multi->requests = {create, set};
+
+    for (const ZooKeeperRequestPtr & request : std::vector<ZooKeeperRequestPtr>{create, set, multi})
+    {
+        KeeperStore::RequestForSession session_request;
+        session_request.session_id = 1;
+        session_request.request = request;
+        ptr<buffer> buf = NuRaftStateMachine::serializeRequest(session_request);
+        ASSERT_EQ(buf->size(), sizeof(int64_t) + request->bytesSize() + sizeof(int64_t));
+
+        KeeperStore::RequestForSession parsed = NuRaftStateMachine::parseRequest(*buf);
+        ASSERT_EQ(parsed.request->getOpNum(), request->getOpNum());
+        ASSERT_EQ(parsed.request->bytesSize(), request->bytesSize());
+    }
+}
+
+TEST(RaftStateMachine, finishLogEntryOfEveryRequest)
+{
+    ACLs default_acls;
+    ACL acl;
+    acl.permissions = ACL::All;
+    acl.scheme = "world";
+    acl.id = "anyone";
+    default_acls.emplace_back(std::move(acl));
+
+    auto create = cs_new<ZooKeeperCreateRequest>();
+    create->path = "/node";
+    create->data = "data";
+    create->is_sequential = true;
+    create->acls = default_acls;
+    auto set = cs_new<ZooKeeperSetRequest>();
+    set->path = "/node";
+    set->data = std::string(1000, 'a');
+    set->version = 3;
+    auto remove = cs_new<ZooKeeperRemoveRequest>();
+    remove->path = "/node";
+    remove->version = 4;
+    auto multi = cs_new<ZooKeeperMultiRequest>();
+    multi->requests = {create, set, remove};
+    auto expire_sessions = cs_new<ZooKeeperExpireSessionsRequest>();
+    expire_sessions->session_ids = {1, 2, 3};
+    auto register_session = cs_new<ZooKeeperRegisterSessionRequest>();
+    register_session->session_timeout_ms = 30000;
+
+    std::vector<ZooKeeperRequestPtr> requests{create, set, remove, multi, expire_sessions, register_session};
+    /// And every other request with its default fields
+    for (auto opnum :
+         {OpNum::Close, OpNum::Exists, OpNum::Get, OpNum::GetACL, OpNum::SetACL, OpNum::SimpleList, OpNum::Sync,
+          OpNum::Heartbeat, OpNum::List, OpNum::Check, OpNum::RemoveWatches, OpNum::CreateContainer, OpNum::CreateTTL,
+          OpNum::MultiRead, OpNum::Auth, OpNum::SetWatches, OpNum::GetEphemerals, OpNum::GetAllChildrenNumber,
+          OpNum::AddWatch, OpNum::SetSeqNum, OpNum::SubtreeStat, OpNum::ListPage, OpNum::RemoveRecursive,
+          OpNum::RemoveExpiredNodes, OpNum::BatchWrite, OpNum::ListWithData, OpNum::SessionID})
+        requests.push_back(ZooKeeperRequestFactory::instance().get(opnum));
+
+    Coordination::XID xid = 0;
+    for (const auto & request : requests)
+    {
+        request->xid = ++xid;
+        KeeperStore::RequestForSession session_request;
+        session_request.session_id = 0x123456789abcdef;
+        session_request.request = request;
+        session_request.create_time = 1700000000000 + xid;
+
+        /// Received right into the log entry like in ConnectionHandler, which gets the request without its length
+        WriteBufferFromOwnString out;
+        request->write(out);
+        String received = out.str().substr(sizeof(int32_t));
+        auto entry = buffer::alloc(NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE + received.size() + NuRaftStateMachine::LOG_ENTRY_TAIL_SIZE);
+        memcpy(entry->data_begin() + NuRaftStateMachine::LOG_ENTRY_HEAD_SIZE, received.data(), received.size());
+        NuRaftStateMachine::finishLogEntry(*entry, session_request.session_id, session_request.create_time);
+
+        ptr<buffer> serialized = NuRaftStateMachine::serializeRequest(session_request);
+        ASSERT_EQ(
+            String(reinterpret_cast<const char *>(entry->data_begin()), entry->size()),
+            String(reinterpret_cast<const char *>(serialized->data_begin()), serialized->size()))
+            << Coordination::toString(request->getOpNum());
+    }
+}
+
 TEST(RaftStateMachine, appendEntry)
 {
     std::string snap_dir(SNAP_DIR + "/1");
@@ -214,6 +311,145 @@ TEST(RaftStateMachine, appendEntry)
     cleanDirectory(snap_dir);
 }
 
+TEST(RaftStateMachine, commitBatchEntry)
+{
+    std::string snap_dir(SNAP_DIR + "/batch");
+    cleanDirectory(snap_dir);
+
+    KeeperResponsesQueue queue;
+    RaftSettingsPtr setting_ptr = RaftSettings::getDefault();
+
+    std::mutex new_session_id_callback_mutex;
+    std::unordered_map<int64_t, ptr<std::condition_variable>> new_session_id_callback;
+
+    NuRaftStateMachine machine(queue, setting_ptr, snap_dir, 0, 3600, 10, 3, new_session_id_callback_mutex, new_session_id_callback);
+    int64_t session_id = createSession(machine);
+
+    std::vector<ptr<buffer>> entries;
+    for (int i = 0; i < 3; i++)
+    {
+        KeeperStore::RequestForSession session_request;
+        session_request.session_id = session_id;
+        auto request = cs_new<ZooKeeperCreateRequest>();
+        request->path = "/batch" + std::to_string(i);
+        request->data = std::to_string(i);
+        request->acls = {{ACL::All, "world", "anyone"}};
+        request->xid = i + 1;
+        session_request.request = request;
+        session_request.create_time = 1;
+        entries.push_back(NuRaftStateMachine::serializeRequest(session_request));
+    }
+
+    ptr<buffer> batch = NuRaftStateMachine::serializeBatch(entries);
+    ASSERT_EQ(NuRaftStateMachine::splitBatch(*batch).size(), entries.size());
+    machine.commit(machine.last_commit_index() + 1, *batch, true);
+    for (int i = 0; i < 3; i++)
+        ASSERT_EQ(machine.getNode("/batch" + std::to_string(i)).data, std::to_string(i));
+
+    /// A truncated batch is not split
+    ptr<buffer> truncated = buffer::alloc(batch->size() - 1);
+    memcpy(truncated->data_begin(), batch->data_begin(), truncated->size());
+    ASSERT_TRUE(NuRaftStateMachine::splitBatch(*truncated).empty());
+
+    machine.shutdown();
+    cleanDirectory(snap_dir);
+}
+
+TEST(RaftStateMachine, commitCompressedBatchEntry)
+{
+    std::string snap_dir(SNAP_DIR + "/compressed_batch");
+    cleanDirectory(snap_dir);
+
+    KeeperResponsesQueue queue;
+    RaftSettingsPtr setting_ptr = RaftSettings::getDefault();
+
+    std::mutex new_session_id_callback_mutex;
+    std::unordered_map<int64_t, ptr<std::condition_variable>> new_session_id_callback;
+
+    NuRaftStateMachine machine(queue, setting_ptr, snap_dir, 0, 3600, 10, 3, new_session_id_callback_mutex, new_session_id_callback);
+    int64_t session_id = createSession(machine);
+
+    std::vector<ptr<buffer>> entries;
+    for (int i = 0; i < 10; i++)
+    {
+        KeeperStore::RequestForSession session_request;
+        session_request.session_id = session_id;
+        auto request = cs_new<ZooKeeperCreateRequest>();
+        request->path = "/replica_1_log_queue_entry_" + std::to_string(i);
+        request->data = String(100, 'x');
+        request->acls = {{ACL::All, "world", "anyone"}};
+        request->xid = i + 1;
+        session_request.request = request;
+        session_request.create_time = 1;
+        entries.push_back(NuRaftStateMachine::serializeRequest(session_request));
+    }
+
+    ptr<buffer> batch = NuRaftStateMachine::serializeBatch(entries);
+    ptr<buffer> compressed = NuRaftStateMachine::compressBatch(*batch);
+    ASSERT_TRUE(compressed);
+    ASSERT_LT(compressed->size(), batch->size());
+    ASSERT_TRUE(NuRaftStateMachine::isBatchRequest(*compressed));
+    ASSERT_EQ(NuRaftStateMachine::splitBatch(*compressed).size(), entries.size());
+
+    machine.commit(machine.last_commit_index() + 1, *compressed, true);
+    for (int i = 0; i < 10; i++)
+        ASSERT_EQ(machine.getNode("/replica_1_log_queue_entry_" + std::to_string(i)).data, String(100, 'x'));
+
+    /// A truncated compressed batch is not split
+    ptr<buffer> truncated = buffer::alloc(compressed->size() - 1);
+    memcpy(truncated->data_begin(), compressed->data_begin(), truncated->size());
+    ASSERT_TRUE(NuRaftStateMachine::splitBatch(*truncated).empty());
+
+    machine.shutdown();
+    cleanDirectory(snap_dir);
+}
+
+TEST(RaftStateMachine, preCommitEntry)
+{
+    std::string snap_dir(SNAP_DIR + "/pre_commit");
+    cleanDirectory(snap_dir);
+
+    KeeperResponsesQueue queue;
+    RaftSettingsPtr setting_ptr = RaftSettings::getDefault();
+
+    std::mutex new_session_id_callback_mutex;
+    std::unordered_map<int64_t, ptr<std::condition_variable>> new_session_id_callback;
+
+    NuRaftStateMachine machine(queue, setting_ptr, snap_dir, 0, 3600, 10, 3, new_session_id_callback_mutex, new_session_id_callback);
+    int64_t session_id = createSession(machine);
+
+    auto create_entry = [&](const std::string & path)
+    {
+        KeeperStore::RequestForSession session_request;
+        session_request.session_id = session_id;
+        auto request = cs_new<ZooKeeperCreateRequest>();
+        request->path = path;
+        request->acls = {{ACL::All, "world", "anyone"}};
+        request->xid = 1;
+        session_request.request = request;
+        session_request.create_time = 1;
+        return NuRaftStateMachine::serializeRequest(session_request);
+    };
+
+    /// Commit takes the requests parsed in pre commit
+    UInt64 index = machine.last_commit_index() + 1;
+    machine.pre_commit(index, *create_entry("/pre_committed"));
+    machine.commit(index, *create_entry("/not_pre_committed"), true);
+    ASSERT_NE(machine.getStore().container.get("/pre_committed"), nullptr);
+    ASSERT_EQ(machine.getStore().container.get("/not_pre_committed"), nullptr);
+
+    /// A rolled back entry is parsed at commit
+    index = machine.last_commit_index() + 1;
+    machine.pre_commit(index, *create_entry("/rolled_back"));
+    machine.rollback(index, *create_entry("/rolled_back"));
+    machine.commit(index, *create_entry("/committed"), true);
+    ASSERT_EQ(machine.getStore().container.get("/rolled_back"), nullptr);
+    ASSERT_NE(machine.getStore().container.get("/committed"), nullptr);
+
+    machine.shutdown();
+    cleanDirectory(snap_dir);
+}
+
 TEST(RaftStateMachine, modifyEntry)
 {
     std::string snap_dir(SNAP_DIR + "/2");
@@ -342,6 +578,60 @@ TEST(RaftStateMachine, syncSnapshot)
     cleanDirectory(snap_dir_2);
 }
 
+TEST(RaftStateMachine, syncSnapshotByChunks)
+{
+    std::string snap_dir_1(SNAP_DIR + "/4");
+    std::string snap_dir_2(SNAP_DIR + "/5");
+    cleanDirectory(snap_dir_1);
+    cleanDirectory(snap_dir_2);
+
+    KeeperResponsesQueue queue;
+    RaftSettingsPtr setting_ptr = RaftSettings::getDefault();
+    setting_ptr->snapshot_chunk_bytes = 1000;
+
+    std::mutex new_session_id_callback_mutex;
+    std::unordered_map<int64_t, ptr<std::condition_variable>> new_session_id_callback;
+
+    NuRaftStateMachine machine_source(queue, setting_ptr, snap_dir_1, 0, 3600, 10, 3, new_session_id_callback_mutex, new_session_id_callback);
+    NuRaftStateMachine machine_target(queue, setting_ptr, snap_dir_2, 0, 3600, 10, 3, new_session_id_callback_mutex, new_session_id_callback);
+
+    ptr<cluster_config> config = cs_new<cluster_config>(1, 0);
+    UInt64 term = 1;
+    UInt32 last_index = 1024;
+    for (auto i = 0; i < last_index; i++)
+    {
+        std::string key = "/" + std::to_string(i + 1);
+        std::string data = "table_" + key;
+        createZNode(machine_source, key, data);
+    }
+    snapshot meta(last_index, term, config);
+    machine_source.create_snapshot(meta);
+
+    ptr<buffer> data_out;
+    void * user_snp_ctx;
+    bool is_last_obj = false;
+    ulong obj_id = 0;
+    size_t chunks = 0;
+    while (!is_last_obj)
+    {
+        ASSERT_EQ(machine_source.read_logical_snp_obj(meta, user_snp_ctx, obj_id, data_out, is_last_obj), 0);
+        ASSERT_TRUE(data_out != nullptr);
+        bool is_first = (obj_id == 0);
+        machine_target.save_logical_snp_obj(meta, obj_id, *(data_out.get()), is_first, is_last_obj);
+        ++chunks;
+    }
+    /// The data object is larger than a chunk
+    ASSERT_GT(chunks, 5);
+
+    ASSERT_TRUE(machine_target.apply_snapshot(meta));
+    ASSERT_EQ(machine_target.getStore().container.size(), last_index + 1);
+
+    machine_source.shutdown();
+    machine_target.shutdown();
+    cleanDirectory(snap_dir_1);
+    cleanDirectory(snap_dir_2);
+}
+
 TEST(RaftStateMachine, initStateMachine)
 {
     auto *log = &(Poco::Logger::get("Test_RaftStateMachine"));
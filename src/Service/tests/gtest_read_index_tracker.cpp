@@ -0,0 +1,35 @@
+#include <Service/ReadIndexTracker.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(ReadIndexTracker, roundsAreSharedAndRetried)
+{
+    ReadIndexTracker tracker;
+    ASSERT_FALSE(tracker.waitRound(1));
+
+    auto first = tracker.join();
+    auto round = tracker.waitRound(100);
+    ASSERT_EQ(round, first);
+
+    /// reads arriving while a round is in flight share the next round
+    auto second = tracker.join();
+    ASSERT_EQ(tracker.join(), second);
+    ASSERT_FALSE(tracker.waitRound(1));
+
+    /// reads of a failed round are confirmed by the next one
+    tracker.fail(*round);
+    ASSERT_FALSE(tracker.indexOf(first));
+    round = tracker.waitRound(100);
+    ASSERT_EQ(round, second);
+    tracker.confirm(*round, 10);
+    ASSERT_EQ(tracker.indexOf(first), 10u);
+    ASSERT_EQ(tracker.indexOf(second), 10u);
+
+    /// the index never goes back
+    tracker.join();
+    round = tracker.waitRound(100);
+    ASSERT_FALSE(tracker.indexOf(*round));
+    tracker.confirm(*round, 5);
+    ASSERT_EQ(tracker.indexOf(*round), 10u);
+}
@@ -0,0 +1,27 @@
+#include <Service/RelayReplicator.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(RelayDownstreams, retentionFloor)
+{
+    UInt64 now = 1000;
+    RelayDownstreams downstreams([&now] { return now; });
+    ASSERT_EQ(downstreams.retentionFloor(1000), 0);
+
+    downstreams.fetched(4, 100);
+    downstreams.fetched(5, 40);
+    ASSERT_EQ(downstreams.retentionFloor(1000), 41);
+    ASSERT_EQ(downstreams.get().size(), 2);
+
+    /// The last fetch counts
+    downstreams.fetched(5, 200);
+    ASSERT_EQ(downstreams.retentionFloor(1000), 101);
+
+    /// Downstreams which did not fetch lately keep nothing
+    now += 20;
+    ASSERT_EQ(downstreams.retentionFloor(20), 101);
+    now += 1;
+    downstreams.fetched(4, 300);
+    ASSERT_EQ(downstreams.retentionFloor(20), 301);
+}
@@ -0,0 +1,27 @@
+#include <Service/RequestArena.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(RequestArena, releasedByOutermostScope)
+{
+    const int * first;
+    {
+        RequestArenaScope scope;
+        ArenaVector<int> values(100, 1);
+        {
+            /// Nested scope releases nothing
+            RequestArenaScope nested;
+            ArenaVector<int> more(100, 2);
+        }
+        ArenaVector<int> after(100, 3);
+        ASSERT_EQ(values[99], 1);
+        ASSERT_NE(after.data(), values.data());
+        first = values.data();
+    }
+
+    /// The arena is reused from its beginning
+    RequestArenaScope scope;
+    ArenaVector<int> values(100, 4);
+    ASSERT_EQ(values.data(), first);
+}
@@ -0,0 +1,26 @@
+#include <Service/RequestProcessor.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(RequestProcessor, planStealsOfUnevenRunners)
+{
+    using Steals = std::vector<std::pair<int64_t, RunnerId>>;
+
+    /// Runner 0 has 20 pending requests, one hot session among a few light ones, 3 runners are idle
+    RequestProcessor::SessionLoads busiest_sessions{{0, 12}, {4, 3}, {8, 3}, {12, 1}, {16, 1}};
+    std::vector<RunnerId> idle_runners{1, 2, 3};
+
+    /// Share is 20 / 4 = 5, sessions are moved to the idle runners in turn until runner 0 keeps 5
+    ASSERT_EQ(RequestProcessor::planSteals(busiest_sessions, idle_runners), Steals({{0, 1}, {4, 2}}));
+
+    /// A single idle runner takes sessions until the busiest keeps half
+    ASSERT_EQ(RequestProcessor::planSteals(busiest_sessions, {5}), Steals({{0, 5}}));
+    RequestProcessor::SessionLoads even_sessions{{1, 2}, {2, 2}, {3, 2}, {4, 2}};
+    ASSERT_EQ(RequestProcessor::planSteals(even_sessions, {5}), Steals({{1, 5}, {2, 5}}));
+
+    /// The busiest runner always keeps a session, and nothing is moved without idle runners
+    ASSERT_TRUE(RequestProcessor::planSteals({{0, 100}}, idle_runners).empty());
+    ASSERT_EQ(RequestProcessor::planSteals({{0, 100}, {1, 100}}, idle_runners), Steals({{0, 1}}));
+    ASSERT_TRUE(RequestProcessor::planSteals(busiest_sessions, {}).empty());
+}
@@ -0,0 +1,36 @@
+#include <Service/SessionExpiryWheel.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(SessionExpiryWheel, expireAndReschedule)
+{
+    int64_t now = 1000000;
+    SessionExpiryWheel wheel(10, [&now] { return now; });
+
+    wheel.setSessionExpirationTime(1, now - 100);
+    wheel.setSessionExpirationTime(2, now + 30);
+    /// more than a turn later
+    wheel.setSessionExpirationTime(3, now + 10 * static_cast<int64_t>(SessionExpiryWheel::WHEEL_SIZE) + 30);
+    ASSERT_EQ(wheel.getExpiredSessions(), std::vector<int64_t>{1});
+
+    now += 20;
+    ASSERT_EQ(wheel.getExpiredSessions(), std::vector<int64_t>{1});
+    now += 10;
+    auto expired = wheel.getExpiredSessions();
+    std::sort(expired.begin(), expired.end());
+    ASSERT_EQ(expired, (std::vector<int64_t>{1, 2}));
+
+    /// expired sessions are returned until removed or rescheduled
+    ASSERT_TRUE(wheel.remove(1));
+    ASSERT_FALSE(wheel.remove(1));
+    wheel.addNewSessionOrUpdate(2, 1000);
+    ASSERT_TRUE(wheel.getExpiredSessions().empty());
+
+    wheel.setSessionExpirationTime(3, now);
+    ASSERT_EQ(wheel.getExpiredSessions(), std::vector<int64_t>{3});
+
+    wheel.clear();
+    ASSERT_TRUE(wheel.getExpiredSessions().empty());
+}
@@ -0,0 +1,82 @@
+#include <Service/SessionSync.h>
+#include <IO/ReadBufferFromMemory.h>
+#include <IO/WriteBufferFromString.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+TEST(SessionSync, deltaEncodingAndAcknowledge)
+{
+    SessionDelta delta;
+    delta.round = 7;
+    delta.sessions = {{(1L << 56) + 1, 1700000000000}, {(1L << 56) + 3, 1700000000500}, {(2L << 56) + 1, 1700000001000}};
+
+    WriteBufferFromOwnString out;
+    writeSessionDelta(delta, out);
+    ASSERT_LT(out.str().size(), delta.sessions.size() * 16);
+
+    SessionDelta read;
+    ReadBufferFromMemory in(out.str().data(), out.str().size());
+    readSessionDelta(read, in);
+    ASSERT_EQ(read.round, 7u);
+    ASSERT_EQ(read.sessions, delta.sessions);
+
+    SessionSyncTracker tracker;
+    std::unordered_map<int64_t, int64_t> local{{1, 100}, {2, 200}};
+    auto first = tracker.next(local, 1);
+    ASSERT_EQ(first.sessions.size(), 2);
+
+    /// Not acknowledged, sent again, and acknowledged after it
+    auto second = tracker.next(local, 1);
+    ASSERT_EQ(second.sessions.size(), 2);
+    tracker.acknowledge(first.round);
+    ASSERT_EQ(tracker.acknowledgedSize(), 2);
+    tracker.acknowledge(second.round);
+    ASSERT_EQ(tracker.acknowledgedSize(), 2);
+    ASSERT_TRUE(tracker.next(local, 1).sessions.empty());
+
+    /// A late acknowledgement of a superseded round is ignored
+    local[1] = 150;
+    auto late = tracker.next(local, 1);
+    local[1] = 160;
+    auto latest = tracker.next(local, 1);
+    tracker.acknowledge(latest.round);
+    tracker.acknowledge(late.round);
+    ASSERT_TRUE(tracker.next(local, 1).sessions.empty());
+
+    local[2] = 300;
+    local.erase(1);
+    auto third = tracker.next(local, 1);
+    ASSERT_EQ(third.sessions, (std::vector<std::pair<int64_t, int64_t>>{{2, 300}}));
+    tracker.acknowledge(third.round);
+    ASSERT_TRUE(tracker.next(local, 1).sessions.empty());
+
+    /// New term, everything is sent again
+    ASSERT_EQ(tracker.next(local, 2).sessions.size(), 1);
+}
+
+TEST(SessionSync, leases)
+{
+    SessionSyncTracker tracker;
+    std::unordered_map<int64_t, int64_t> local{{1, 100}, {2, 200}};
+    auto all = local;
+    auto first = tracker.nextLeases(local, all, 1, 1000);
+    ASSERT_EQ(first.sessions, (std::vector<std::pair<int64_t, int64_t>>{{1, 1100}, {2, 1200}}));
+    tracker.acknowledge(first.round);
+
+    /// Renewed when less than half of the lease is left
+    local[1] = 500;
+    local[2] = 800;
+    all = local;
+    auto second = tracker.nextLeases(local, all, 1, 1000);
+    ASSERT_EQ(second.sessions, (std::vector<std::pair<int64_t, int64_t>>{{2, 1800}}));
+    tracker.acknowledge(second.round);
+
+    /// Disconnected, the leader gets its real expiration time once
+    local.erase(1);
+    auto third = tracker.nextLeases(local, all, 1, 1000);
+    ASSERT_EQ(third.sessions, (std::vector<std::pair<int64_t, int64_t>>{{1, 500}}));
+    tracker.acknowledge(third.round);
+    ASSERT_TRUE(tracker.nextLeases(local, all, 1, 1000).sessions.empty());
+    ASSERT_EQ(tracker.acknowledgedSize(), 1);
+}
@@ -0,0 +1,42 @@
+#include <Service/SessionTable.h>
+#include <gtest/gtest.h>
+
+using namespace RK;
+
+static void testSessionTable(SessionExpiryType expiry_type)
+{
+    int64_t now = 1000000;
+    SessionTable session_table(10, expiry_type, [&now] { return now; });
+    ASSERT_TRUE(session_table.add(1, 0));
+    ASSERT_FALSE(session_table.add(1, 0));
+    ASSERT_TRUE(session_table.add(2, 60000));
+    ASSERT_EQ(session_table.size(), 2);
+    ASSERT_EQ(*session_table.getTimeout(1), 0);
+
+    now += 30;
+    auto expired = session_table.getExpiredSessions();
+    ASSERT_EQ(expired, std::vector<int64_t>{1});
+
+    /// Touched sessions are moved to the right bucket when their old bucket expires
+    ASSERT_TRUE(session_table.add(3, 200));
+    for (int i = 0; i < 10; ++i)
+    {
+        now += 10;
+        ASSERT_TRUE(session_table.touch(3));
+        ASSERT_EQ(session_table.getExpiredSessions(), std::vector<int64_t>{1});
+    }
+
+    ASSERT_TRUE(session_table.remove(1));
+    ASSERT_FALSE(session_table.touch(1));
+    now += 200;
+    ASSERT_TRUE(session_table.getExpiredSessions().empty());
+    now += 20;
+    ASSERT_EQ(session_table.getExpiredSessions(), std::vector<int64_t>{3});
+    ASSERT_EQ(session_table.sessionToExpirationTime().size(), 2);
+}
+
+TEST(SessionTable, touchAndLazyExpiry)
+{
+    testSessionTable(SessionExpiryType::SORTED_MAP);
+    testSessionTable(SessionExpiryType::TIMER_WHEEL);
+}
@@ -0,0 +1,48 @@
+#include <Service/SlabAllocator.h>
+#include <gtest/gtest.h>
+#include <thread>
+
+using namespace RK;
+
+namespace
+{
+    /// Objects in use of the class of size, not counting the objects cached by exited threads
+    size_t usedOfClass(size_t size)
+    {
+        for (const auto & stats : SlabPool::instance().getStats())
+            if (stats.object_size >= size && stats.object_size < size + SlabPool::CLASS_GRANULARITY)
+                return stats.used;
+        return 0;
+    }
+}
+
+TEST(SlabPool, threadCachesDrainedOnExit)
+{
+    /// No other test allocates objects of this class
+    constexpr size_t size = SlabPool::MAX_OBJECT_SIZE - 8;
+    size_t used_before = usedOfClass(size);
+
+    std::vector<char *> objects;
+    std::thread allocator(
+        [&]
+        {
+            for (size_t i = 0; i < 10 * SlabPool::THREAD_CACHE_SIZE + 3; ++i)
+                objects.push_back(SlabPool::instance().alloc(size));
+            /// Reused from the cache of the thread
+            char * ptr = objects.back();
+            SlabPool::instance().free(ptr, size);
+            ASSERT_EQ(SlabPool::instance().alloc(size), ptr);
+        });
+    allocator.join();
+    ASSERT_EQ(usedOfClass(size), used_before + objects.size());
+
+    /// Freed by another thread, which returns them by batches and the rest when it exits
+    std::thread releaser(
+        [&]
+        {
+            for (char * ptr : objects)
+                SlabPool::instance().free(ptr, size);
+        });
+    releaser.join();
+    ASSERT_EQ(usedOfClass(size), used_before);
+}
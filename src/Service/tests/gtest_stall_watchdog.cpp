@@ -0,0 +1,56 @@
+#include <Service/StallWatchdog.h>
+#include <Common/ZooKeeper/ZooKeeperConstants.h>
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+
+using namespace RK;
+
+TEST(StallWatchdog, reportStallOnce)
+{
+    auto & watchdog = StallWatchdog::instance();
+    std::atomic<UInt64> now{1000};
+    watchdog.setClock([&now] { return now.load(); });
+    watchdog.setThreshold(50);
+    UInt64 stalls_before = watchdog.stallCount();
+
+    std::atomic<bool> busy{false};
+    std::atomic<bool> done{false};
+    std::thread thread(
+        [&]
+        {
+            StallWatchdog::Busy request_busy(7, 42, static_cast<Int32>(Coordination::OpNum::Multi));
+            now += 20;
+            {
+                /// A nested scope is reported instead, timed from the outer one
+                StallWatchdog::Busy commit_busy(UInt64(100));
+                busy = true;
+                while (!done)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    while (!busy)
+        std::this_thread::yield();
+
+    now += 29;
+    ASSERT_TRUE(watchdog.check().empty());
+    ASSERT_EQ(watchdog.stalledThreads(), 0);
+
+    now += 1;
+    auto stalls = watchdog.check();
+    ASSERT_EQ(stalls.size(), 1);
+    ASSERT_EQ(stalls[0].log_index, 100);
+    ASSERT_EQ(stalls[0].busy_ms, 50);
+    ASSERT_EQ(watchdog.stalledThreads(), 1);
+
+    /// Reported once
+    now += 100;
+    ASSERT_TRUE(watchdog.check().empty());
+    ASSERT_EQ(watchdog.stallCount(), stalls_before + 1);
+
+    done = true;
+    thread.join();
+    ASSERT_EQ(watchdog.stalledThreads(), 0);
+    watchdog.setThreshold(0);
+    watchdog.setClock({});
+}
@@ -0,0 +1,225 @@
+#include <Service/WatchManager.h>
+#include <IO/WriteBufferFromString.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+
+using namespace RK;
+
+TEST(WatchManager, registerFireAndRemoveSession)
+{
+    WatchManager watch_manager;
+    for (int64_t session_id = 1; session_id <= 40; session_id++)
+    {
+        watch_manager.addWatch("/hot", session_id, WatchManager::DATA);
+        /// duplicated watch is ignored
+        watch_manager.addWatch("/hot", session_id, WatchManager::DATA);
+        watch_manager.addWatch("/node/" + std::to_string(session_id), session_id, WatchManager::LIST);
+    }
+    ASSERT_EQ(watch_manager.watchCount(), 80);
+    ASSERT_EQ(watch_manager.watchedPathCount(), 41);
+    ASSERT_EQ(watch_manager.sessionCount(), 40);
+
+    WatchManager::SessionIDs fired;
+    watch_manager.fireWatches("/hot", WatchManager::LIST, [&](const WatchManager::SessionIDs & sessions) { fired = sessions; });
+    ASSERT_TRUE(fired.empty());
+    watch_manager.fireWatches("/hot", WatchManager::DATA, [&](const WatchManager::SessionIDs & sessions) { fired = sessions; });
+    std::sort(fired.begin(), fired.end());
+    ASSERT_EQ(fired.size(), 40);
+    ASSERT_EQ(fired.front(), 1);
+    ASSERT_EQ(fired.back(), 40);
+    ASSERT_EQ(watch_manager.watchCount(), 40);
+
+    for (int64_t session_id = 1; session_id <= 20; session_id++)
+        watch_manager.removeSession(session_id);
+    ASSERT_EQ(watch_manager.watchCount(), 20);
+    ASSERT_EQ(watch_manager.watchedPathCount(), 20);
+    ASSERT_EQ(watch_manager.sessionCount(), 20);
+
+    size_t paths = 0;
+    watch_manager.forEachSession([&](int64_t session_id, const std::vector<String> & watched)
+    {
+        ASSERT_EQ(watched.size(), 1);
+        ASSERT_EQ(watched[0], "/node/" + std::to_string(session_id));
+        paths++;
+    });
+    ASSERT_EQ(paths, 20);
+
+    watch_manager.clear();
+    ASSERT_EQ(watch_manager.watchCount(), 0);
+    ASSERT_EQ(watch_manager.sessionCount(), 0);
+}
+
+TEST(WatchManager, skipUnwatchedPaths)
+{
+    WatchManager watch_manager;
+    size_t fired = 0;
+    auto on_fired = [&fired](const WatchManager::SessionIDs & sessions) { fired += sessions.size(); };
+
+    watch_manager.fireWatches("/unwatched", WatchManager::DATA, on_fired);
+    ASSERT_EQ(fired, 0);
+
+    /// Marks follow adds, removes, fires and clear of many paths
+    for (int round = 0; round < 3; ++round)
+    {
+        for (int i = 0; i < 1000; ++i)
+        {
+            watch_manager.addWatch("/watched/" + std::to_string(i), 1, WatchManager::DATA);
+            watch_manager.addWatch("/watched/" + std::to_string(i), 2, WatchManager::LIST);
+        }
+        ASSERT_TRUE(watch_manager.removeWatch("/watched/0", 1, WatchManager::DATA));
+        for (int i = 0; i < 1000; ++i)
+            watch_manager.fireWatches("/watched/" + std::to_string(i), WatchManager::DATA, on_fired);
+        ASSERT_EQ(fired, 999);
+        fired = 0;
+
+        watch_manager.clear();
+        watch_manager.fireWatches("/watched/1", WatchManager::LIST, on_fired);
+        ASSERT_EQ(fired, 0);
+    }
+}
+
+TEST(WatchManager, persistentWatches)
+{
+    WatchManager watch_manager;
+    watch_manager.addWatch("/a", 1, WatchManager::PERSISTENT);
+    watch_manager.addWatch("/a", 1, WatchManager::DATA);
+    watch_manager.addWatch("/a", 2, WatchManager::PERSISTENT_RECURSIVE);
+    ASSERT_EQ(watch_manager.watchCount(), 3);
+
+    WatchManager::SessionIDs fired;
+    auto on_fired = [&](const WatchManager::SessionIDs & sessions) { fired = sessions; };
+
+    /// session 1 gets one event for its one-shot and persistent watch
+    watch_manager.fireWatches("/a", WatchManager::DATA, on_fired);
+    std::sort(fired.begin(), fired.end());
+    ASSERT_EQ(fired, WatchManager::SessionIDs({1, 2}));
+    ASSERT_EQ(watch_manager.watchCount(), 2);
+
+    /// persistent watches survive firing, children events do not fire recursive watches
+    fired.clear();
+    watch_manager.fireWatches("/a", WatchManager::LIST, on_fired);
+    ASSERT_EQ(fired, WatchManager::SessionIDs({1}));
+
+    fired.clear();
+    watch_manager.fireWatches("/a/b/c", WatchManager::DATA, on_fired);
+    ASSERT_EQ(fired, WatchManager::SessionIDs({2}));
+
+    fired.clear();
+    watch_manager.fireWatches("/ab", WatchManager::DATA, on_fired);
+    ASSERT_TRUE(fired.empty());
+
+    fired.clear();
+    watch_manager.fireWatches("/a", WatchManager::DATA, on_fired, false);
+    ASSERT_TRUE(fired.empty());
+
+    ASSERT_TRUE(watch_manager.removeWatch("/a", 2, WatchManager::PERSISTENT_RECURSIVE));
+    ASSERT_FALSE(watch_manager.removeWatch("/a", 2, WatchManager::PERSISTENT_RECURSIVE));
+    watch_manager.fireWatches("/a/b", WatchManager::DATA, on_fired);
+    ASSERT_TRUE(fired.empty());
+
+    watch_manager.removeSession(1);
+    ASSERT_EQ(watch_manager.watchCount(), 0);
+    ASSERT_EQ(watch_manager.watchedPathCount(), 0);
+}
+
+TEST(WatchManager, addWatchesInBulk)
+{
+    WatchManager watch_manager;
+    std::vector<String> paths;
+    for (size_t i = 0; i < 1000; ++i)
+        paths.push_back("/watched/" + std::to_string(i));
+    std::vector<HashedPath> hashed_paths(paths.begin(), paths.end());
+
+    watch_manager.addWatch("/watched/0", 1, WatchManager::DATA);
+    watch_manager.addWatches(hashed_paths, 1, WatchManager::DATA);
+    watch_manager.addWatches(hashed_paths, 2, WatchManager::LIST);
+    ASSERT_EQ(watch_manager.watchCount(), 2000);
+    ASSERT_EQ(watch_manager.watchedPathCount(), 2000);
+
+    WatchManager::SessionIDs fired;
+    watch_manager.fireWatches("/watched/7", WatchManager::DATA, [&](const WatchManager::SessionIDs & sessions) { fired = sessions; });
+    ASSERT_EQ(fired, WatchManager::SessionIDs({1}));
+
+    watch_manager.removeSession(1);
+    watch_manager.removeSession(2);
+    ASSERT_EQ(watch_manager.watchCount(), 0);
+    ASSERT_EQ(watch_manager.watchedPathCount(), 0);
+}
+
+TEST(WatchManager, preparedWatchFrame)
+{
+    Coordination::ZooKeeperWatchResponse watch_response;
+    watch_response.path = "/hot/lock";
+    watch_response.xid = Coordination::WATCH_XID;
+    watch_response.zxid = -1;
+    watch_response.type = Coordination::Event::DELETED;
+    watch_response.state = Coordination::State::CONNECTED;
+
+    WriteBufferFromOwnString serialized;
+    watch_response.write(serialized);
+
+    watch_response.prepareFrame();
+    ASSERT_FALSE(watch_response.frame.empty());
+
+    WriteBufferFromOwnString copied;
+    watch_response.write(copied);
+    ASSERT_EQ(copied.str(), serialized.str());
+}
+
+TEST(WatchManager, preparedResponseFrame)
+{
+    Coordination::ZooKeeperGetResponse get_response;
+    get_response.xid = 7;
+    get_response.zxid = 100;
+    get_response.data = "value";
+    get_response.stat.version = 3;
+
+    WriteBufferFromOwnString serialized;
+    get_response.write(serialized);
+
+    get_response.prepareFrame();
+    ASSERT_EQ(get_response.frame, serialized.str());
+
+    WriteBufferFromOwnString copied;
+    get_response.write(copied);
+    ASSERT_EQ(copied.str(), serialized.str());
+
+    /// Bad watch responses are not sent
+    Coordination::ZooKeeperWatchResponse watch_response;
+    watch_response.error = Coordination::Error::ZNONODE;
+    watch_response.prepareFrame();
+    ASSERT_TRUE(watch_response.frame.empty());
+}
+
+TEST(WatchManager, sessionWatches)
+{
+    WatchManager watch_manager;
+    watch_manager.addWatch("/a", 1, WatchManager::DATA);
+    watch_manager.addWatch("/a", 1, WatchManager::LIST);
+    watch_manager.addWatch("/b", 1, WatchManager::PERSISTENT_RECURSIVE);
+    watch_manager.addWatch("/c", 2, WatchManager::DATA);
+
+    auto watches = watch_manager.getSessionWatches(1);
+    std::sort(watches.begin(), watches.end());
+    using Watches = std::vector<std::pair<String, WatchManager::WatchType>>;
+    ASSERT_EQ(watches, Watches({{"/a", WatchManager::DATA}, {"/a", WatchManager::LIST}, {"/b", WatchManager::PERSISTENT_RECURSIVE}}));
+
+    watch_manager.fireWatches("/a", WatchManager::DATA, [](const WatchManager::SessionIDs &) {});
+    ASSERT_EQ(watch_manager.getSessionWatches(1).size(), 2);
+    ASSERT_TRUE(watch_manager.getSessionWatches(3).empty());
+}
+
+TEST(WatchManager, shrinkAfterMassRemove)
+{
+    WatchManager watch_manager;
+    for (int i = 0; i < 10000; i++)
+        watch_manager.addWatch("/mass/" + std::to_string(i), 1, WatchManager::DATA);
+    watch_manager.addWatch("/mass/0", 2, WatchManager::DATA);
+    watch_manager.removeSession(1);
+    ASSERT_GT(watch_manager.shrink(), 0);
+
+    WatchManager::SessionIDs fired;
+    watch_manager.fireWatches("/mass/0", WatchManager::DATA, [&](const WatchManager::SessionIDs & sessions) { fired = sessions; });
+    ASSERT_EQ(fired, WatchManager::SessionIDs({2}));
+}
@@ -0,0 +1,426 @@
+/** Benchmark of the whole commit path of a cluster in one process: accumulator, NuRaft replication, log fsync,
+ * state machine and responses.
+ *
+ * Every run boots N servers on loopback, each with its own KeeperDispatcher and data directory, and drives
+ * the leader with closed loop sessions writing their own node. It is reported per cluster size, fsync mode,
+ * max batch size and thread count, such as cluster/set/nodes:3/fsync:fsync_parallel/batch:1000/threads:16,
+ * with throughput and latency percentiles.
+ *
+ *     raft_cluster_benchmark --nodes=3,5 --fsync-modes=fsync_parallel,fsync --data-dir=/dev/shm/bench --json=result.json
+ *
+ * Data directories on tmpfs leave the disk out of the commit path. The JSON output has the layout of google
+ * benchmark, as the one of raft_micro_benchmark.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <Service/KeeperDispatcher.h>
+#include <boost/program_options.hpp>
+#include <Poco/File.h>
+#include <Poco/Logger.h>
+#include <Poco/Util/XMLConfiguration.h>
+#include <Common/Stopwatch.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <common/getFQDNOrHostName.h>
+
+using namespace RK;
+using namespace Coordination;
+
+namespace
+{
+
+struct ClusterOptions
+{
+    String data_dir;
+    UInt16 base_port;
+    UInt64 sessions;
+    UInt64 inflight;
+    UInt64 requests;
+    UInt64 value_size;
+};
+
+struct RunParameters
+{
+    UInt64 nodes;
+    String fsync_mode;
+    UInt64 batch_size;
+    UInt64 thread_count;
+
+    String name() const
+    {
+        return "cluster/set/nodes:" + std::to_string(nodes) + "/fsync:" + fsync_mode + "/batch:" + std::to_string(batch_size)
+            + "/threads:" + std::to_string(thread_count);
+    }
+};
+
+struct RunResult
+{
+    String name;
+    UInt64 requests;
+    UInt64 errors;
+    UInt64 elapsed_ns;
+    UInt64 p50_us;
+    UInt64 p99_us;
+    UInt64 p999_us;
+    UInt64 max_us;
+};
+
+void cleanDirectory(const String & dir)
+{
+    Poco::File file(dir);
+    if (file.exists())
+        file.remove(true);
+}
+
+/// Servers of a run on ports from base_port, three ports a server
+class Cluster
+{
+public:
+    Cluster(const RunParameters & parameters_, const String & dir_, UInt16 base_port_)
+        : parameters(parameters_), dir(dir_), base_port(base_port_)
+    {
+    }
+
+    ~Cluster() { shutdown(); }
+
+    /// Servers wait for a quorum when they are initialized, so they are started together
+    void start()
+    {
+        for (UInt64 id = 1; id <= parameters.nodes; ++id)
+        {
+            dispatchers.push_back(std::make_shared<KeeperDispatcher>());
+            configs.push_back(makeConfig(id));
+        }
+
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(parameters.nodes);
+        for (size_t i = 0; i < parameters.nodes; ++i)
+        {
+            threads.emplace_back([this, &errors, i]
+            {
+                try
+                {
+                    dispatchers[i]->initialize(*configs[i]);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto & thread : threads)
+            thread.join();
+        for (const auto & error : errors)
+            if (error)
+                std::rethrow_exception(error);
+    }
+
+    KeeperDispatcher & waitLeader() const
+    {
+        for (size_t i = 0; i < 600; ++i)
+        {
+            for (const auto & dispatcher : dispatchers)
+                if (dispatcher->isLeader())
+                    return *dispatcher;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        throw std::runtime_error("No leader elected in 60 seconds");
+    }
+
+    void shutdown()
+    {
+        for (auto & dispatcher : dispatchers)
+            dispatcher->shutdown();
+        dispatchers.clear();
+    }
+
+private:
+    UInt16 port(UInt64 id, UInt16 offset) const { return base_port + (id - 1) * 3 + offset; }
+
+    Poco::AutoPtr<Poco::Util::XMLConfiguration> makeConfig(UInt64 id) const
+    {
+        String node_dir = dir + "/node" + std::to_string(id);
+        std::ostringstream xml;
+        xml << "<raftkeeper><keeper>"
+            << "<my_id>" << id << "</my_id><host>127.0.0.1</host>"
+            << "<port>" << port(id, 0) << "</port><forwarding_port>" << port(id, 1) << "</forwarding_port>"
+            << "<internal_port>" << port(id, 2) << "</internal_port>"
+            << "<thread_count>" << parameters.thread_count << "</thread_count>"
+            << "<log_dir>" << node_dir << "/log</log_dir><snapshot_dir>" << node_dir << "/snapshot</snapshot_dir>"
+            << "<raft_settings><log_fsync_mode>" << parameters.fsync_mode << "</log_fsync_mode>"
+            << "<max_batch_size>" << parameters.batch_size << "</max_batch_size></raft_settings><cluster>";
+        for (UInt64 server = 1; server <= parameters.nodes; ++server)
+            xml << "<server><id>" << server << "</id><host>127.0.0.1</host><internal_port>" << port(server, 2)
+                << "</internal_port><forwarding_port>" << port(server, 1) << "</forwarding_port></server>";
+        xml << "</cluster></keeper></raftkeeper>";
+
+        std::istringstream in(xml.str());
+        return new Poco::Util::XMLConfiguration(in);
+    }
+
+    const RunParameters & parameters;
+    const String dir;
+    const UInt16 base_port;
+    std::vector<Poco::AutoPtr<Poco::Util::XMLConfiguration>> configs;
+    std::vector<std::shared_ptr<KeeperDispatcher>> dispatchers;
+};
+
+/** Session sending its requests to the dispatcher in a closed loop, at most inflight at a time. The first
+ * request creates the node of the session, the others set it.
+ */
+class SessionDriver
+{
+public:
+    SessionDriver(KeeperDispatcher & dispatcher_, UInt64 index, UInt64 requests_, const String & value_, std::atomic<UInt64> & done_)
+        : dispatcher(dispatcher_), path("/bench_" + std::to_string(index)), requests(requests_), value(value_), done(done_)
+    {
+        send_ns.resize(requests + 1);
+        latencies_us.reserve(requests);
+    }
+
+    void start(UInt64 inflight)
+    {
+        session_id = dispatcher.getSessionID(30000);
+        dispatcher.registerSession(session_id, [this](const ZooKeeperResponses & responses) { onResponses(responses); });
+        dispatcher.putRegisterSessionRequest(session_id, 30000);
+        /// The first responses may arrive meanwhile
+        std::lock_guard lock(mutex);
+        for (UInt64 i = 0; i < inflight && next_xid <= static_cast<XID>(requests); ++i)
+            send();
+    }
+
+    void finish() { dispatcher.finishSession(session_id); }
+
+    /// After finish
+    const std::vector<UInt64> & getLatencies() const { return latencies_us; }
+    UInt64 getErrors() const { return errors; }
+
+private:
+    /// mutex must be held
+    void send()
+    {
+        XID xid = next_xid++;
+        ZooKeeperRequestPtr request;
+        if (xid == 1)
+        {
+            auto create = std::make_shared<ZooKeeperCreateRequest>();
+            create->path = path;
+            create->data = value;
+            ACL acl;
+            acl.permissions = ACL::All;
+            acl.scheme = "world";
+            acl.id = "anyone";
+            create->acls = {acl};
+            request = create;
+        }
+        else
+        {
+            auto set = std::make_shared<ZooKeeperSetRequest>();
+            set->path = path;
+            set->data = value;
+            request = set;
+        }
+        request->xid = xid;
+        send_ns[xid] = clock_gettime_ns();
+        dispatcher.putRequest(request, session_id);
+    }
+
+    void onResponses(const ZooKeeperResponses & responses)
+    {
+        UInt64 now_ns = clock_gettime_ns();
+        std::lock_guard lock(mutex);
+        for (const auto & response : responses)
+        {
+            /// Session registration and the like
+            if (response->xid <= 0 || response->xid > static_cast<XID>(requests))
+                continue;
+            latencies_us.push_back((now_ns - send_ns[response->xid]) / 1000);
+            if (response->error != Error::ZOK)
+                ++errors;
+            if (next_xid <= static_cast<XID>(requests))
+                send();
+            done.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    KeeperDispatcher & dispatcher;
+    const String path;
+    const UInt64 requests;
+    const String & value;
+    std::atomic<UInt64> & done;
+
+    int64_t session_id = 0;
+    std::mutex mutex;
+    XID next_xid = 1;
+    std::vector<UInt64> send_ns;
+    std::vector<UInt64> latencies_us;
+    UInt64 errors = 0;
+};
+
+RunResult run(const RunParameters & parameters, const ClusterOptions & options, UInt16 base_port)
+{
+    String dir = options.data_dir + "/" + parameters.name().substr(strlen("cluster/set/"));
+    std::replace(dir.begin(), dir.end(), ':', '_');
+    cleanDirectory(dir);
+
+    Cluster cluster(parameters, dir, base_port);
+    cluster.start();
+    auto & leader = cluster.waitLeader();
+
+    String value(options.value_size, 'v');
+    UInt64 requests_per_session = std::max<UInt64>(options.requests / options.sessions, 1);
+    UInt64 total = requests_per_session * options.sessions;
+    std::atomic<UInt64> done{0};
+
+    std::vector<std::unique_ptr<SessionDriver>> sessions;
+    for (UInt64 i = 0; i < options.sessions; ++i)
+        sessions.push_back(std::make_unique<SessionDriver>(leader, i, requests_per_session, value, done));
+
+    Stopwatch watch;
+    for (auto & session : sessions)
+        session->start(options.inflight);
+    /// Requests never answered, such as dropped by a leader change, end the run after a while
+    UInt64 last_done = 0;
+    Stopwatch idle;
+    while (done.load(std::memory_order_acquire) < total && idle.elapsedSeconds() < 30)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (UInt64 current = done.load(std::memory_order_acquire); current != last_done)
+        {
+            last_done = current;
+            idle.restart();
+        }
+    }
+    UInt64 elapsed_ns = watch.elapsedNanoseconds();
+
+    for (auto & session : sessions)
+        session->finish();
+    cluster.shutdown();
+
+    std::vector<UInt64> latencies;
+    UInt64 errors = 0;
+    for (const auto & session : sessions)
+    {
+        latencies.insert(latencies.end(), session->getLatencies().begin(), session->getLatencies().end());
+        errors += session->getErrors();
+    }
+    errors += total - done.load();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies.empty() ? 0 : latencies[static_cast<size_t>(p * (latencies.size() - 1))]; };
+
+    cleanDirectory(dir);
+    return {parameters.name(), done.load(), errors, elapsed_ns, percentile(0.5), percentile(0.99), percentile(0.999),
+            latencies.empty() ? 0 : latencies.back()};
+}
+
+void writeJSON(std::ostream & out, const ClusterOptions & options, const std::vector<RunResult> & results)
+{
+    out << "{\n  \"context\": {\n    \"host_name\": \"" << getFQDNOrHostName() << "\",\n    \"num_cpus\": "
+        << std::thread::hardware_concurrency() << ",\n    \"sessions\": " << options.sessions << ",\n    \"inflight\": "
+        << options.inflight << ",\n    \"value_size\": " << options.value_size << "\n  },\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const auto & result = results[i];
+        double ns_per_op = result.requests ? static_cast<double>(result.elapsed_ns) / result.requests : 0;
+        out << (i ? "," : "") << "\n    {\"name\": \"" << result.name << "\", \"run_type\": \"iteration\", \"iterations\": "
+            << result.requests << ", \"real_time\": " << ns_per_op << ", \"cpu_time\": " << ns_per_op
+            << ", \"time_unit\": \"ns\", \"items_per_second\": " << (result.elapsed_ns ? result.requests * 1e9 / result.elapsed_ns : 0)
+            << ", \"errors\": " << result.errors << ", \"p50_us\": " << result.p50_us << ", \"p99_us\": " << result.p99_us
+            << ", \"p999_us\": " << result.p999_us << ", \"max_us\": " << result.max_us << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+template <typename T>
+std::vector<T> parseList(const String & list)
+{
+    std::vector<T> values;
+    std::istringstream in(list);
+    String value;
+    while (std::getline(in, value, ','))
+    {
+        if constexpr (std::is_same_v<T, String>)
+            values.push_back(value);
+        else
+            values.push_back(std::stoull(value));
+    }
+    return values;
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    namespace po = boost::program_options;
+    po::options_description desc("Commit throughput and latency of an in-process RaftKeeper cluster");
+    desc.add_options()
+        ("help,h", "show help")
+        ("nodes", po::value<String>()->default_value("3"), "comma separated cluster sizes")
+        ("fsync-modes", po::value<String>()->default_value("fsync_parallel,fsync,fsync_batch"), "comma separated log_fsync_mode values")
+        ("batch-sizes", po::value<String>()->default_value("1000"), "comma separated raft_settings.max_batch_size values")
+        ("threads", po::value<String>()->default_value("16"), "comma separated keeper.thread_count values")
+        ("sessions", po::value<UInt64>()->default_value(64), "client sessions on the leader")
+        ("inflight", po::value<UInt64>()->default_value(1), "requests of a session not answered yet at most")
+        ("requests", po::value<UInt64>()->default_value(100000), "requests of a run, of all the sessions")
+        ("value-size", po::value<UInt64>()->default_value(100), "bytes of the data set")
+        ("data-dir", po::value<String>()->default_value("./test_cluster_benchmark"), "data directories, on tmpfs or a real disk")
+        ("base-port", po::value<UInt16>()->default_value(19100), "first loopback port, every run takes 3 ports a server from it")
+        ("json", po::value<String>(), "also write results in JSON to the file");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    Poco::Logger::root().setLevel("error");
+
+    ClusterOptions options;
+    options.data_dir = vm["data-dir"].as<String>();
+    options.base_port = vm["base-port"].as<UInt16>();
+    options.sessions = std::max<UInt64>(vm["sessions"].as<UInt64>(), 1);
+    options.inflight = std::max<UInt64>(vm["inflight"].as<UInt64>(), 1);
+    options.requests = vm["requests"].as<UInt64>();
+    options.value_size = vm["value-size"].as<UInt64>();
+
+    std::vector<RunResult> results;
+    UInt16 base_port = options.base_port;
+    for (UInt64 nodes : parseList<UInt64>(vm["nodes"].as<String>()))
+    {
+        for (const auto & fsync_mode : parseList<String>(vm["fsync-modes"].as<String>()))
+        {
+            for (UInt64 batch_size : parseList<UInt64>(vm["batch-sizes"].as<String>()))
+            {
+                for (UInt64 thread_count : parseList<UInt64>(vm["threads"].as<String>()))
+                {
+                    RunParameters parameters{nodes, fsync_mode, batch_size, thread_count};
+                    /// Ports of a stopped cluster may linger in TIME_WAIT
+                    auto result = run(parameters, options, base_port);
+                    base_port += nodes * 3;
+
+                    double ops = result.elapsed_ns ? result.requests * 1e9 / result.elapsed_ns : 0;
+                    std::cout << result.name << "\t" << result.requests << " ops\t" << ops << " ops/s\tp50 " << result.p50_us
+                              << " us\tp99 " << result.p99_us << " us\tp999 " << result.p999_us << " us\tmax " << result.max_us
+                              << " us\terrors " << result.errors << std::endl;
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    if (vm.count("json"))
+    {
+        std::ofstream out(vm["json"].as<String>());
+        writeJSON(out, options, results);
+    }
+    cleanDirectory(options.data_dir);
+    return 0;
+}
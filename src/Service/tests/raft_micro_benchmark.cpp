@@ -0,0 +1,534 @@
+/** Microbenchmarks of the hot paths of KeeperStore, the watch manager, the log store and snapshots.
+ *
+ * Every benchmark runs a fixed number of operations with a fixed random seed, so that runs are comparable,
+ * and is reported with its parameters in the name, such as store/processRequest/op:Create/nodes:100000.
+ *
+ *     raft_micro_benchmark --filter=store/ --json=result.json
+ *
+ * The JSON output has the layout of google benchmark, so that its compare tools can diff two runs.
+ */
+
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <Service/ConcurrentOpenMap.h>
+#include <Service/KeeperStore.h>
+#include <Service/NuRaftFileLogStore.h>
+#include <Service/NuRaftLogSnapshot.h>
+#include <Service/Settings.h>
+#include <Service/WatchManager.h>
+#include <boost/program_options.hpp>
+#include <libnuraft/nuraft.hxx>
+#include <Poco/File.h>
+#include <Poco/Logger.h>
+#include <Common/Stopwatch.h>
+#include <Common/ZooKeeper/ZooKeeperCommon.h>
+#include <common/getFQDNOrHostName.h>
+
+using namespace RK;
+using namespace Coordination;
+
+namespace
+{
+
+constexpr UInt64 SEED = 42;
+const String WORK_DIR = "./test_micro_benchmark";
+
+struct BenchmarkResult
+{
+    String name;
+    UInt64 iterations;
+    UInt64 elapsed_ns;
+};
+
+struct BenchmarkOptions
+{
+    String filter;
+    UInt64 iterations;
+    UInt64 store_nodes;
+    std::vector<UInt64> snapshot_nodes;
+    std::vector<UInt64> map_keys;
+    std::vector<UInt64> map_blocks;
+    std::vector<UInt64> thread_counts;
+    bool log_fsync;
+};
+
+class BenchmarkRunner
+{
+public:
+    explicit BenchmarkRunner(const BenchmarkOptions & options_) : options(options_) { }
+
+    bool enabled(const String & name) const { return options.filter.empty() || name.find(options.filter) != String::npos; }
+
+    /// f runs the benchmark and returns the number of operations and the time they took
+    void run(const String & name, const std::function<BenchmarkResult()> & f)
+    {
+        if (!enabled(name))
+            return;
+
+        auto result = f();
+        result.name = name;
+        double ns_per_op = result.iterations ? static_cast<double>(result.elapsed_ns) / result.iterations : 0;
+        std::cout << name << "\t" << result.iterations << " ops\t" << ns_per_op << " ns/op\t"
+                  << (result.elapsed_ns ? result.iterations * 1e9 / result.elapsed_ns : 0) << " ops/s" << std::endl;
+        results.push_back(result);
+    }
+
+    void writeJSON(std::ostream & out) const
+    {
+        out << "{\n  \"context\": {\n    \"host_name\": \"" << getFQDNOrHostName() << "\",\n    \"num_cpus\": "
+            << std::thread::hardware_concurrency() << ",\n    \"iterations\": " << options.iterations << ",\n    \"seed\": " << SEED
+            << "\n  },\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const auto & result = results[i];
+            double ns_per_op = result.iterations ? static_cast<double>(result.elapsed_ns) / result.iterations : 0;
+            out << (i ? "," : "") << "\n    {\"name\": \"" << result.name << "\", \"run_type\": \"iteration\", \"iterations\": "
+                << result.iterations << ", \"real_time\": " << ns_per_op << ", \"cpu_time\": " << ns_per_op
+                << ", \"time_unit\": \"ns\", \"items_per_second\": "
+                << (result.elapsed_ns ? result.iterations * 1e9 / result.elapsed_ns : 0) << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    const BenchmarkOptions & options;
+    std::vector<BenchmarkResult> results;
+};
+
+void cleanDirectory(const String & dir)
+{
+    Poco::File file(dir);
+    if (file.exists())
+        file.remove(true);
+}
+
+ACLs worldACLs()
+{
+    ACL acl;
+    acl.permissions = ACL::All;
+    acl.scheme = "world";
+    acl.id = "anyone";
+    return {acl};
+}
+
+void process(KeeperStore & store, const ZooKeeperRequestPtr & request)
+{
+    static KeeperStore::KeeperResponsesQueue responses;
+    store.processRequest(responses, request, 1, 0, {}, /* check_acl */ false, /* ignore_response */ true);
+}
+
+void create(KeeperStore & store, const String & path, const String & data)
+{
+    auto request = std::make_shared<ZooKeeperCreateRequest>();
+    request->path = path;
+    request->data = data;
+    request->acls = worldACLs();
+    process(store, request);
+}
+
+/// Store with nodes /bench/<i> of 100 bytes
+std::unique_ptr<KeeperStore> makeStore(UInt64 nodes)
+{
+    auto store = std::make_unique<KeeperStore>(RaftSettings::getDefault()->dead_session_check_period_ms);
+    store->getSessionID(30000);
+    create(*store, "/bench", "");
+    String data(100, 'v');
+    for (UInt64 i = 0; i < nodes; ++i)
+        create(*store, "/bench/" + std::to_string(i), data);
+    return store;
+}
+
+template <typename F>
+BenchmarkResult timed(UInt64 iterations, F && f)
+{
+    Stopwatch watch;
+    for (UInt64 i = 0; i < iterations; ++i)
+        f(i);
+    return {"", iterations, watch.elapsedNanoseconds()};
+}
+
+void benchmarkStore(BenchmarkRunner & runner, const BenchmarkOptions & options)
+{
+    const UInt64 nodes = options.store_nodes;
+    const UInt64 iterations = options.iterations;
+    const String suffix = "/nodes:" + std::to_string(nodes);
+    String data(100, 'v');
+
+    /// Requests are built before timing, only processRequest is measured
+    auto run = [&](const String & op, const std::function<ZooKeeperRequestPtr(UInt64, std::mt19937_64 &)> & make_request)
+    {
+        runner.run("store/processRequest/op:" + op + suffix, [&]
+        {
+            auto store = makeStore(nodes);
+            std::mt19937_64 rng(SEED);
+            std::vector<ZooKeeperRequestPtr> requests;
+            requests.reserve(iterations);
+            for (UInt64 i = 0; i < iterations; ++i)
+                requests.push_back(make_request(i, rng));
+            return timed(iterations, [&](UInt64 i) { process(*store, requests[i]); });
+        });
+    };
+
+    auto existing_path = [&](std::mt19937_64 & rng) { return "/bench/" + std::to_string(rng() % std::max<UInt64>(nodes, 1)); };
+
+    run("Create", [&](UInt64 i, std::mt19937_64 &)
+    {
+        auto request = std::make_shared<ZooKeeperCreateRequest>();
+        request->path = "/bench/new_" + std::to_string(i);
+        request->data = data;
+        request->acls = worldACLs();
+        return request;
+    });
+    run("CreateSequential", [&](UInt64, std::mt19937_64 &)
+    {
+        auto request = std::make_shared<ZooKeeperCreateRequest>();
+        request->path = "/bench/seq-";
+        request->data = data;
+        request->is_sequential = true;
+        request->acls = worldACLs();
+        return request;
+    });
+    run("Set", [&](UInt64, std::mt19937_64 & rng)
+    {
+        auto request = std::make_shared<ZooKeeperSetRequest>();
+        request->path = existing_path(rng);
+        request->data = data;
+        request->version = -1;
+        return request;
+    });
+    run("Get", [&](UInt64, std::mt19937_64 & rng)
+    {
+        auto request = std::make_shared<ZooKeeperGetRequest>();
+        request->path = existing_path(rng);
+        return request;
+    });
+    run("Exists", [&](UInt64, std::mt19937_64 & rng)
+    {
+        auto request = std::make_shared<ZooKeeperExistsRequest>();
+        request->path = existing_path(rng);
+        return request;
+    });
+    run("List", [&](UInt64, std::mt19937_64 & rng)
+    {
+        auto request = std::make_shared<ZooKeeperListRequest>();
+        request->path = existing_path(rng);
+        return request;
+    });
+    /// Every node is removed once, the ones beyond the store are missing
+    run("Remove", [&](UInt64 i, std::mt19937_64 &)
+    {
+        auto request = std::make_shared<ZooKeeperRemoveRequest>();
+        request->path = "/bench/" + std::to_string(i);
+        request->version = -1;
+        return request;
+    });
+    run("Multi", [&](UInt64 i, std::mt19937_64 & rng)
+    {
+        auto create_request = std::make_shared<CreateRequest>();
+        create_request->path = "/bench/multi_" + std::to_string(i);
+        create_request->data = data;
+        auto set_request = std::make_shared<SetRequest>();
+        set_request->path = existing_path(rng);
+        set_request->data = data;
+        set_request->version = -1;
+        return std::make_shared<ZooKeeperMultiRequest>(Requests{create_request, set_request}, worldACLs());
+    });
+}
+
+/// Filling a map of keys paths and looking up random ones, the slowest emplace shows the pause of rehash
+template <typename Map>
+void benchmarkMapSize(BenchmarkRunner & runner, const BenchmarkOptions & options, const String & container)
+{
+    for (UInt64 keys : options.map_keys)
+    {
+        String suffix = "/container:" + container + "/keys:" + std::to_string(keys);
+        if (!runner.enabled("map/emplace" + suffix) && !runner.enabled("map/get" + suffix))
+            continue;
+
+        auto map = std::make_unique<Map>();
+        auto node = std::make_shared<KeeperNode>();
+        UInt64 slowest_ns = 0;
+        runner.run("map/emplace" + suffix, [&]
+        {
+            Stopwatch watch;
+            for (UInt64 i = 0; i < keys; ++i)
+            {
+                UInt64 start_ns = watch.elapsedNanoseconds();
+                map->emplace("/bench/" + std::to_string(i), node);
+                slowest_ns = std::max(slowest_ns, watch.elapsedNanoseconds() - start_ns);
+            }
+            return BenchmarkResult{"", keys, watch.elapsedNanoseconds()};
+        });
+        runner.run("map/emplace_slowest" + suffix, [&] { return BenchmarkResult{"", 1, slowest_ns}; });
+
+        if (map->size() != keys)
+            for (UInt64 i = 0; i < keys; ++i)
+                map->emplace("/bench/" + std::to_string(i), node);
+
+        runner.run("map/get" + suffix, [&]
+        {
+            std::mt19937_64 rng(SEED);
+            return timed(options.iterations, [&](UInt64) { map->get("/bench/" + std::to_string(rng() % keys)); });
+        });
+    }
+}
+
+void benchmarkMap(BenchmarkRunner & runner, const BenchmarkOptions & options)
+{
+    using Map = ConcurrentMap<KeeperNode>;
+    constexpr UInt64 keys = 100000;
+
+    /// 90% reads and 10% writes over the same keys from every thread, scaling by threads and by blocks
+    for (UInt64 blocks : options.map_blocks)
+    {
+        for (UInt64 threads : options.thread_counts)
+        {
+            runner.run("map/contention/blocks:" + std::to_string(blocks) + "/threads:" + std::to_string(threads), [&]
+            {
+                Map map(static_cast<UInt32>(blocks));
+                std::vector<String> paths;
+                paths.reserve(keys);
+                for (UInt64 i = 0; i < keys; ++i)
+                {
+                    paths.push_back("/bench/" + std::to_string(i));
+                    map.emplace(paths.back(), std::make_shared<KeeperNode>());
+                }
+
+                UInt64 per_thread = options.iterations;
+                std::vector<std::thread> workers;
+                Stopwatch watch;
+                for (UInt64 t = 0; t < threads; ++t)
+                {
+                    workers.emplace_back([&, t]
+                    {
+                        std::mt19937_64 rng(SEED + t);
+                        auto node = std::make_shared<KeeperNode>();
+                        for (UInt64 i = 0; i < per_thread; ++i)
+                        {
+                            const auto & path = paths[rng() % keys];
+                            if (rng() % 10 == 0)
+                                map.emplace(path, node);
+                            else
+                                map.get(path);
+                        }
+                    });
+                }
+                for (auto & worker : workers)
+                    worker.join();
+                return BenchmarkResult{"", per_thread * threads, watch.elapsedNanoseconds()};
+            });
+        }
+    }
+
+    benchmarkMapSize<ConcurrentMap<KeeperNode>>(runner, options, "chained");
+    benchmarkMapSize<ConcurrentOpenMap<KeeperNode>>(runner, options, "open");
+}
+
+void benchmarkWatches(BenchmarkRunner & runner, const BenchmarkOptions & options)
+{
+    /// Fan out: every fire wakes sessions watching the path
+    for (UInt64 sessions : {1UL, 100UL, 10000UL})
+    {
+        runner.run("watch/fire/sessions:" + std::to_string(sessions), [&]
+        {
+            WatchManager watches;
+            UInt64 iterations = std::max<UInt64>(1, options.iterations / sessions);
+            UInt64 fired = 0;
+            Stopwatch watch;
+            for (UInt64 i = 0; i < iterations; ++i)
+            {
+                for (UInt64 session = 0; session < sessions; ++session)
+                    watches.addWatch("/bench/watched", session, WatchManager::DATA);
+                watches.fireWatches("/bench/watched", WatchManager::DATA, [&](const WatchManager::SessionIDs & ids) { fired += ids.size(); });
+            }
+            return BenchmarkResult{"", fired, watch.elapsedNanoseconds()};
+        });
+    }
+
+    /// Closing sessions with 100 watches each
+    runner.run("watch/removeSession/watches:100", [&]
+    {
+        WatchManager watches;
+        UInt64 sessions = std::max<UInt64>(1, options.iterations / 100);
+        for (UInt64 session = 0; session < sessions; ++session)
+            for (UInt64 i = 0; i < 100; ++i)
+                watches.addWatch("/bench/" + std::to_string((session * 100 + i) % 10000), session, WatchManager::DATA);
+        return timed(sessions, [&](UInt64 session) { watches.removeSession(session); });
+    });
+}
+
+void benchmarkLogStore(BenchmarkRunner & runner, const BenchmarkOptions & options)
+{
+    const std::pair<FsyncMode, String> modes[] = {
+        {FsyncMode::FSYNC_PARALLEL, "fsync_parallel"},
+        {FsyncMode::FSYNC, "fsync"},
+        {FsyncMode::FSYNC_BATCH, "fsync_batch"},
+    };
+
+    for (const auto & [mode, mode_name] : modes)
+    {
+        /// Entries of 1KB, as a request with a path and some data
+        auto make_entries = [&]
+        {
+            std::vector<nuraft::ptr<nuraft::log_entry>> entries;
+            entries.reserve(options.iterations);
+            for (UInt64 i = 0; i < options.iterations; ++i)
+            {
+                auto buf = nuraft::buffer::alloc(1024);
+                memset(buf->data_begin(), static_cast<int>('a' + i % 26), buf->size());
+                entries.push_back(nuraft::cs_new<nuraft::log_entry>(1, buf));
+            }
+            return entries;
+        };
+
+        String log_dir = WORK_DIR + "/log_" + mode_name;
+        runner.run("log/append/mode:" + mode_name, [&]
+        {
+            cleanDirectory(log_dir);
+            auto entries = make_entries();
+            auto log_store = nuraft::cs_new<NuRaftFileLogStore>(log_dir, true, options.log_fsync ? mode : FsyncMode::FSYNC_BATCH);
+            auto result = timed(entries.size(), [&](UInt64 i)
+            {
+                log_store->append(entries[i]);
+                /// As NuRaft does after every batch of appends
+                if (i % 100 == 99)
+                    log_store->end_of_append_batch(i - 98, 100);
+            });
+            log_store->flush();
+            return result;
+        });
+
+        /// Random reads from segments, without the entry cache
+        runner.run("log/read/mode:" + mode_name, [&]
+        {
+            cleanDirectory(log_dir);
+            auto entries = make_entries();
+            auto log_store = nuraft::cs_new<NuRaftFileLogStore>(
+                log_dir,
+                true,
+                mode,
+                1000,
+                LogSegmentStore::MAX_LOG_SIZE,
+                LogSegmentStore::MAX_SEGMENT_COUNT,
+                false,
+                false,
+                false,
+                /* log_cache_max_bytes */ 0);
+            for (auto & entry : entries)
+                log_store->append(entry);
+            log_store->flush();
+
+            std::mt19937_64 rng(SEED);
+            return timed(entries.size(), [&](UInt64) { log_store->entry_at(rng() % entries.size() + 1); });
+        });
+        cleanDirectory(log_dir);
+    }
+}
+
+void benchmarkSnapshot(BenchmarkRunner & runner, const BenchmarkOptions & options)
+{
+    for (UInt64 nodes : options.snapshot_nodes)
+    {
+        String suffix = "/nodes:" + std::to_string(nodes);
+        /// Building the store takes long, parse needs the snapshot created
+        if (!runner.enabled("snapshot/create" + suffix) && !runner.enabled("snapshot/parse" + suffix))
+            continue;
+
+        String snap_dir = WORK_DIR + "/snapshot";
+        cleanDirectory(snap_dir);
+
+        auto store = makeStore(nodes);
+        auto config = nuraft::cs_new<nuraft::cluster_config>(1, 0);
+        nuraft::snapshot meta(nodes, 1, config);
+        KeeperSnapshotManager snap_mgr(snap_dir, 1, 1000000);
+
+        /// One operation is one node
+        runner.run("snapshot/create" + suffix, [&]
+        {
+            Stopwatch watch;
+            snap_mgr.createSnapshot(meta, *store);
+            return BenchmarkResult{"", nodes, watch.elapsedNanoseconds()};
+        });
+
+        runner.run("snapshot/parse" + suffix, [&]
+        {
+            KeeperStore new_store(RaftSettings::getDefault()->dead_session_check_period_ms);
+            Stopwatch watch;
+            snap_mgr.parseSnapshot(meta, new_store);
+            return BenchmarkResult{"", nodes, watch.elapsedNanoseconds()};
+        });
+        cleanDirectory(snap_dir);
+    }
+}
+
+std::vector<UInt64> parseList(const String & list)
+{
+    std::vector<UInt64> values;
+    std::istringstream in(list);
+    String value;
+    while (std::getline(in, value, ','))
+        values.push_back(std::stoull(value));
+    return values;
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    namespace po = boost::program_options;
+    po::options_description desc("Microbenchmarks of RaftKeeper hot paths");
+    desc.add_options()
+        ("help,h", "show help")
+        ("filter", po::value<String>()->default_value(""), "run only the benchmarks whose name contains it")
+        ("iterations", po::value<UInt64>()->default_value(100000), "operations of a benchmark, of a thread for contention")
+        ("store-nodes", po::value<UInt64>()->default_value(100000), "nodes in the store for processRequest")
+        ("snapshot-nodes", po::value<String>()->default_value("1000000,10000000"), "comma separated node counts of snapshots")
+        ("map-keys", po::value<String>()->default_value("10000000,50000000"), "comma separated key counts of maps")
+        ("map-blocks", po::value<String>()->default_value("16,64,256"), "comma separated block counts of maps for contention")
+        ("threads", po::value<String>()->default_value("1,2,4,8,16"), "comma separated thread counts for contention")
+        ("no-fsync", "append without fsync in every mode, to measure the log store itself")
+        ("json", po::value<String>(), "also write results in JSON to the file");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    Poco::Logger::root().setLevel("warning");
+
+    BenchmarkOptions options;
+    options.filter = vm["filter"].as<String>();
+    options.iterations = vm["iterations"].as<UInt64>();
+    options.store_nodes = vm["store-nodes"].as<UInt64>();
+    options.snapshot_nodes = parseList(vm["snapshot-nodes"].as<String>());
+    options.map_keys = parseList(vm["map-keys"].as<String>());
+    options.map_blocks = parseList(vm["map-blocks"].as<String>());
+    options.thread_counts = parseList(vm["threads"].as<String>());
+    options.log_fsync = !vm.count("no-fsync");
+
+    cleanDirectory(WORK_DIR);
+    Poco::File(WORK_DIR).createDirectories();
+
+    BenchmarkRunner runner(options);
+    benchmarkStore(runner, options);
+    benchmarkMap(runner, options);
+    benchmarkWatches(runner, options);
+    benchmarkLogStore(runner, options);
+    benchmarkSnapshot(runner, options);
+
+    if (vm.count("json"))
+    {
+        std::ofstream out(vm["json"].as<String>());
+        runner.writeJSON(out);
+    }
+    cleanDirectory(WORK_DIR);
+    return 0;
+}